@@ -17,12 +17,16 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#ifdef CONFIG_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
 
 struct AioHandler
 {
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
     int deleted;
     int pollfds_idx;
     void *opaque;
@@ -42,6 +46,166 @@ static AioHandler *find_aio_handler(AioContext *ctx, int fd)
     return NULL;
 }
 
+#ifdef CONFIG_EPOLL_CREATE1
+/*
+ * Rebuilding and polling an array of every handler costs the same on each
+ * iteration however few of them are ready.  Past AIO_EPOLL_THRESHOLD
+ * handlers they move to an epoll set instead, where registrations only
+ * change with aio_set_fd_handler(), and each wakeup only returns the ready
+ * ones.  For fewer handlers a single poll() beats poll() plus epoll_wait().
+ *
+ * If epoll refuses a descriptor the context goes back to polling every
+ * handler, for good.
+ */
+#define AIO_EPOLL_THRESHOLD     64
+#define AIO_EPOLL_MAX_EVENTS    128
+
+static uint32_t aio_epoll_events(int events)
+{
+    return ((events & G_IO_IN) ? EPOLLIN : 0) |
+           ((events & G_IO_OUT) ? EPOLLOUT : 0);
+}
+
+static int aio_epoll_revents(uint32_t events)
+{
+    return ((events & EPOLLIN) ? G_IO_IN : 0) |
+           ((events & EPOLLOUT) ? G_IO_OUT : 0) |
+           ((events & EPOLLERR) ? G_IO_ERR : 0) |
+           ((events & EPOLLHUP) ? G_IO_HUP : 0);
+}
+
+static bool aio_epoll_enabled(AioContext *ctx)
+{
+    return ctx->epollfd >= 0;
+}
+
+static bool aio_epoll_ctl(AioContext *ctx, AioHandler *node, int op)
+{
+    struct epoll_event ev = {
+        .events = aio_epoll_events(node->pfd.events),
+        .data.ptr = node,
+    };
+
+    return epoll_ctl(ctx->epollfd, op, node->pfd.fd, &ev) == 0;
+}
+
+static void aio_epoll_disable(AioContext *ctx)
+{
+    AioHandler *node;
+
+    g_source_remove_poll(&ctx->source, &ctx->epoll_pfd);
+    close(ctx->epollfd);
+    ctx->epollfd = -1;
+    ctx->epoll_disabled = true;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted) {
+            g_source_add_poll(&ctx->source, &node->pfd);
+        }
+    }
+}
+
+static void aio_epoll_try_enable(AioContext *ctx)
+{
+    AioHandler *node;
+
+    ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ctx->epollfd < 0) {
+        ctx->epoll_disabled = true;
+        return;
+    }
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && !aio_epoll_ctl(ctx, node, EPOLL_CTL_ADD)) {
+            close(ctx->epollfd);
+            ctx->epollfd = -1;
+            ctx->epoll_disabled = true;
+            return;
+        }
+    }
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted) {
+            g_source_remove_poll(&ctx->source, &node->pfd);
+        }
+    }
+    ctx->epoll_pfd.fd = ctx->epollfd;
+    ctx->epoll_pfd.events = G_IO_IN;
+    ctx->epoll_pfd.revents = 0;
+    g_source_add_poll(&ctx->source, &ctx->epoll_pfd);
+}
+
+/* Copy what epoll has to report into the handlers' revents.  Deleted
+ * handlers are unregistered before they are marked, so every node seen
+ * here is still alive.
+ */
+static int aio_epoll_harvest(AioContext *ctx)
+{
+    struct epoll_event events[AIO_EPOLL_MAX_EVENTS];
+    int i, ret;
+
+    /* Level triggered, whatever does not fit is reported next time */
+    ret = epoll_wait(ctx->epollfd, events, AIO_EPOLL_MAX_EVENTS, 0);
+    for (i = 0; i < ret; i++) {
+        AioHandler *node = events[i].data.ptr;
+
+        node->pfd.revents = aio_epoll_revents(events[i].events);
+    }
+    return ret;
+}
+
+static int aio_epoll_poll(AioContext *ctx, int64_t timeout)
+{
+    /* Not ctx->epoll_pfd, which belongs to the GSource's own poll */
+    GPollFD pfd = {
+        .fd = ctx->epollfd,
+        .events = G_IO_IN,
+    };
+    int ret;
+
+    /* epoll_wait() only has millisecond timeouts, so sleep in ppoll() */
+    if (timeout != 0) {
+        ret = qemu_poll_ns(&pfd, 1, timeout);
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+    return aio_epoll_harvest(ctx);
+}
+#endif
+
+/* Start polling a new handler, or pick up a change to its events */
+static void aio_handler_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    if (aio_epoll_enabled(ctx)) {
+        if (!aio_epoll_ctl(ctx, node, is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD)) {
+            aio_epoll_disable(ctx);
+        }
+        return;
+    }
+#endif
+    if (is_new) {
+        g_source_add_poll(&ctx->source, &node->pfd);
+    }
+#ifdef CONFIG_EPOLL_CREATE1
+    if (!ctx->epoll_disabled && ctx->n_handlers >= AIO_EPOLL_THRESHOLD) {
+        aio_epoll_try_enable(ctx);
+    }
+#endif
+}
+
+static void aio_handler_remove(AioContext *ctx, AioHandler *node)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    if (aio_epoll_enabled(ctx)) {
+        aio_epoll_ctl(ctx, node, EPOLL_CTL_DEL);
+        return;
+    }
+#endif
+    g_source_remove_poll(&ctx->source, &node->pfd);
+}
+
 void aio_set_fd_handler(AioContext *ctx,
                         int fd,
                         IOHandler *io_read,
@@ -55,7 +219,12 @@ void aio_set_fd_handler(AioContext *ctx,
     /* Are we deleting the fd handler? */
     if (!io_read && !io_write) {
         if (node) {
-            g_source_remove_poll(&ctx->source, &node->pfd);
+            aio_handler_remove(ctx, node);
+            ctx->n_handlers--;
+            if (node->io_poll) {
+                node->io_poll = NULL;
+                ctx->n_poll_handlers--;
+            }
 
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
@@ -71,13 +240,15 @@ void aio_set_fd_handler(AioContext *ctx,
             }
         }
     } else {
+        bool is_new = false;
+
         if (node == NULL) {
             /* Alloc and insert if it's not already there */
             node = g_malloc0(sizeof(AioHandler));
             node->pfd.fd = fd;
             QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
-
-            g_source_add_poll(&ctx->source, &node->pfd);
+            ctx->n_handlers++;
+            is_new = true;
         }
         /* Update handler with latest information */
         node->io_read = io_read;
@@ -87,6 +258,8 @@ void aio_set_fd_handler(AioContext *ctx,
 
         node->pfd.events = (io_read ? G_IO_IN | G_IO_HUP | G_IO_ERR : 0);
         node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
+
+        aio_handler_update(ctx, node, is_new);
     }
 
     aio_notify(ctx);
@@ -100,6 +273,77 @@ void aio_set_event_notifier(AioContext *ctx,
                        (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll)
+{
+    AioHandler *node = find_aio_handler(ctx, fd);
+
+    assert(node || !io_poll);
+    if (!node) {
+        return;
+    }
+    ctx->n_poll_handlers += !!io_poll - !!node->io_poll;
+    node->io_poll = io_poll;
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    aio_set_fd_poll(ctx, event_notifier_get_fd(notifier), io_poll);
+}
+
+/* Initial window, doubled each time a wait ends soon after it */
+#define AIO_POLL_GROW_START_NS  4000
+
+static bool run_poll_handlers_once(AioContext *ctx)
+{
+    AioHandler *node;
+    bool progress = false;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll && node->io_poll(node->opaque)) {
+            progress = true;
+        }
+    }
+    return progress;
+}
+
+/* Spin on the poll handlers until one of them makes progress or @max_ns
+ * have passed.
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns)
+{
+    int64_t end = get_clock() + max_ns;
+    bool progress;
+
+    ctx->walking_handlers++;
+    do {
+        progress = run_poll_handlers_once(ctx);
+    } while (!progress && get_clock() < end);
+    ctx->walking_handlers--;
+
+    return progress;
+}
+
+/* Polling pays off when waits tend to end shortly after they start.  Grow
+ * the window while they end before poll_max_ns, and give up on polling
+ * altogether when one lasts longer, until waits get short again.
+ */
+static void aio_poll_adjust(AioContext *ctx, int64_t block_ns)
+{
+    int64_t max_ns = atomic_read(&ctx->poll_max_ns);
+    int64_t poll_ns = atomic_read(&ctx->poll_ns);
+
+    if (poll_ns && block_ns <= poll_ns) {
+        /* Caught by the window, leave it be */
+    } else if (block_ns > max_ns) {
+        poll_ns = 0;
+    } else if (poll_ns < max_ns) {
+        poll_ns = poll_ns ? poll_ns * 2 : AIO_POLL_GROW_START_NS;
+    }
+    atomic_set(&ctx->poll_ns, MIN(poll_ns, max_ns));
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     return false;
@@ -109,6 +353,14 @@ bool aio_pending(AioContext *ctx)
 {
     AioHandler *node;
 
+#ifdef CONFIG_EPOLL_CREATE1
+    /* The GSource only polled the epoll fd, find out what is behind it */
+    if (aio_epoll_enabled(ctx) && (ctx->epoll_pfd.revents & G_IO_IN)) {
+        ctx->epoll_pfd.revents = 0;
+        aio_epoll_harvest(ctx);
+    }
+#endif
+
     QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         int revents;
 
@@ -190,6 +442,9 @@ bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
     bool was_dispatching;
+    int64_t timeout;
+    int64_t start = 0;
+    bool polling;
     int ret;
     bool progress;
 
@@ -207,6 +462,32 @@ bool aio_poll(AioContext *ctx, bool blocking)
      * have to clear it now.
      */
     aio_set_dispatching(ctx, !blocking);
+    timeout = blocking ? aio_compute_timeout(ctx) : 0;
+
+    /* Spin a little before going to sleep, if that has helped lately */
+    polling = timeout != 0 && ctx->n_poll_handlers &&
+              atomic_read(&ctx->poll_max_ns);
+    if (polling) {
+        int64_t poll_ns = atomic_read(&ctx->poll_ns);
+
+        start = get_clock();
+        if (poll_ns) {
+            if (timeout > 0) {
+                poll_ns = MIN(poll_ns, timeout);
+            }
+            if (run_poll_handlers(ctx, poll_ns)) {
+                progress = true;
+                timeout = 0;
+            }
+        }
+    }
+
+#ifdef CONFIG_EPOLL_CREATE1
+    if (aio_epoll_enabled(ctx)) {
+        aio_epoll_poll(ctx, timeout);
+        goto dispatch;
+    }
+#endif
 
     ctx->walking_handlers++;
 
@@ -229,8 +510,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     /* wait until next event */
     ret = qemu_poll_ns((GPollFD *)ctx->pollfds->data,
-                         ctx->pollfds->len,
-                         blocking ? aio_compute_timeout(ctx) : 0);
+                         ctx->pollfds->len, timeout);
 
     /* if we have any readable fds, dispatch event */
     if (ret > 0) {
@@ -243,6 +523,13 @@ bool aio_poll(AioContext *ctx, bool blocking)
         }
     }
 
+#ifdef CONFIG_EPOLL_CREATE1
+dispatch:
+#endif
+    if (polling) {
+        aio_poll_adjust(ctx, get_clock() - start);
+    }
+
     /* Run dispatch even if there were no readable fds to run timers */
     aio_set_dispatching(ctx, true);
     if (aio_dispatch(ctx)) {
@@ -101,6 +101,20 @@ static mon_cmd_t android_event_cmds[] = {
         .help = "simulate keystrokes from a given text",
         .mhandler.cmd = android_console_event_text,
     },
+    {
+        .name = "stats",
+        .args_type = "",
+        .params = "",
+        .help = "show the event queue statistics",
+        .mhandler.cmd = android_console_event_stats,
+    },
+    {
+        .name = "script",
+        .args_type = "arg:S?",
+        .params = "",
+        .help = "send a series of timed events",
+        .mhandler.cmd = android_console_event_script,
+    },
     { NULL, NULL, },
 };
 
@@ -169,6 +183,34 @@ static mon_cmd_t android_avd_cmds[] = {
         .help = "query virtual device name",
         .mhandler.cmd = android_console_avd_name,
     },
+    {
+        .name = "wipe",
+        .args_type = "arg:s?",
+        .params = "",
+        .help = "reset a partition and reboot",
+        .mhandler.cmd = android_console_avd_wipe,
+    },
+    {
+        .name = "reset",
+        .args_type = "arg:s?",
+        .params = "",
+        .help = "reboot, or load a snapshot, in place",
+        .mhandler.cmd = android_console_avd_reset,
+    },
+    {
+        .name = "diskstats",
+        .args_type = "arg:s?",
+        .params = "",
+        .help = "show disk latency and queue depth",
+        .mhandler.cmd = android_console_avd_diskstats,
+    },
+    {
+        .name = "boottime",
+        .args_type = "",
+        .params = "",
+        .help = "show the startup timeline",
+        .mhandler.cmd = android_console_avd_boottime,
+    },
     {
         .name = "snapshot",
         .args_type = "item:s",
@@ -198,6 +240,49 @@ static mon_cmd_t android_finger_cmds[] = {
     { NULL, NULL, },
 };
 
+static mon_cmd_t android_pipe_cmds[] = {
+    {
+        .name = "stats",
+        .args_type = "",
+        .params = "",
+        .help = "display usage statistics of the pipe services",
+        .mhandler.cmd = android_console_pipe_stats,
+    },
+    {
+        .name = "adb-notify",
+        .args_type = "",
+        .params = "",
+        .help = "register with the host adb server now",
+        .mhandler.cmd = android_console_pipe_adb_notify,
+    },
+    { NULL, NULL, },
+};
+
+static mon_cmd_t android_vcpu_cmds[] = {
+    {
+        .name = "exits",
+        .args_type = "",
+        .params = "",
+        .help = "display exit statistics of the virtual cpus",
+        .mhandler.cmd = android_console_vcpu_exits,
+    },
+    {
+        .name = "reset",
+        .args_type = "",
+        .params = "",
+        .help = "clear the exit statistics",
+        .mhandler.cmd = android_console_vcpu_reset,
+    },
+    {
+        .name = "profile",
+        .args_type = "action:s,file:s?,rate:i?",
+        .params = "start|stop [file] [rate]",
+        .help = "sample what the virtual cpus are doing",
+        .mhandler.cmd = android_console_vcpu_profile,
+    },
+    { NULL, NULL, },
+};
+
 static mon_cmd_t android_geo_cmds[] = {
     {
         .name = "nmea",
@@ -224,6 +309,13 @@ static mon_cmd_t android_geo_cmds[] = {
             "\n",
         .mhandler.cmd = android_console_geo_fix,
     },
+    {
+        .name = "route",
+        .args_type = "action:s,file:s?,speed:T?,interval:i?",
+        .params = "start|stop|status [file] [speed] [interval]",
+        .help = "play a GPX track back as GPS fixes",
+        .mhandler.cmd = android_console_geo_route,
+    },
     { NULL, NULL, },
 };
 
@@ -462,6 +554,26 @@ static mon_cmd_t android_cmds[] = {
         .help = "rotate the screen by 90 degrees",
         .mhandler.cmd = android_console_rotate_screen,
     },
+    {   .name = "pipe",
+        .args_type = "item:s?",
+        .params = "",
+        .help = "android pipe related commands",
+        .mhandler.cmd = android_console_pipe,
+        .sub_cmds.static_table = android_pipe_cmds,
+    },
+    {   .name = "vcpu",
+        .args_type = "item:s?",
+        .params = "",
+        .help = "virtual cpu related commands",
+        .mhandler.cmd = android_console_vcpu,
+        .sub_cmds.static_table = android_vcpu_cmds,
+    },
+    {   .name = "batch",
+        .args_type = "arg:S?",
+        .params = "",
+        .help = "run several ';'-separated commands, answering once",
+        .mhandler.cmd = android_console_batch,
+    },
 
     { NULL, NULL, },
 };
@@ -27,9 +27,17 @@
 #include "hw/misc/goldfish_battery.h"
 #include "hw/input/goldfish_events.h"
 #include "hw/input/goldfish_sensors.h"
+#include "hw/misc/android_pipe.h"
+#include "sysemu/vcpu-exits.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/boot-timeline.h"
+#include "block/block.h"
+#include "qapi/qmp/qerror.h"
+#include "qemu/timer.h"
 #include "hmp.h"
 
+#include <math.h>
+
 
 #ifdef CONFIG_ANDROID
 
@@ -70,6 +78,32 @@ void qemu2_android_console_setup(const QAndroidBatteryAgent* battery_agent,
 int android_base_port;
 #endif
 
+#ifdef USE_ANDROID_EMU
+#include "android-qemu2-glue/telephony/modem_init.h"
+
+typedef struct {
+    void (*func)(Monitor* mon, const QDict* qdict);
+    Monitor* mon;
+    const QDict* qdict;
+} ModemConsoleCall;
+
+static void modem_console_run(void* opaque) {
+    ModemConsoleCall* call = opaque;
+    call->func(call->mon, call->qdict);
+}
+
+/* Commands that use android_modem run wherever the modem does, see
+ * qemu_android_modem_call(). The monitor waits for them meanwhile, so
+ * they can still print to it.
+ */
+static void modem_console_call(void (*func)(Monitor* mon, const QDict* qdict),
+                               Monitor* mon,
+                               const QDict* qdict) {
+    ModemConsoleCall call = {func, mon, qdict};
+    qemu_android_modem_call(modem_console_run, &call);
+}
+#endif
+
 typedef struct {
     int is_udp;
     int host_port;
@@ -587,6 +621,8 @@ enum {
     CMD_EVENT_CODES,
     CMD_EVENT_SEND,
     CMD_EVENT_TEXT,
+    CMD_EVENT_STATS,
+    CMD_EVENT_SCRIPT,
 };
 
 static const char* event_help[] = {
@@ -597,7 +633,9 @@ static const char* event_help[] = {
         "   event send             send a series of events to the kernel\n"
         "   event types            list all <type> aliases\n"
         "   event codes            list all <code> aliases for a given <type>\n"
-        "   event text             simulate keystrokes from a given text\n",
+        "   event text             simulate keystrokes from a given text\n"
+        "   event stats            show the event queue statistics\n"
+        "   event script           send a series of timed events\n",
         /* CMD_EVENT_TYPES */
         "'event types' list all <type> string aliases supported by the "
         "'event' subcommands",
@@ -613,6 +651,15 @@ static const char* event_help[] = {
         "a given text\nmessage. <message> must be an utf-8 string. Unicode "
         "points will be reverse-mapped\naccording to the current device "
         "keyboard. unsupported characters will be discarded\nsilently",
+        /* CMD_EVENT_STATS */
+        "'event stats' shows how many events are queued for the kernel, and "
+        "how many were\ncoalesced with a queued event or dropped because "
+        "the queue was full",
+        /* CMD_EVENT_SCRIPT */
+        "'event script <time>:<type>:<code>:<value> ...' schedules a series "
+        "of events to be\nsent to the Android kernel, each one <time> "
+        "microseconds of guest time after\nthe command. <type>, <code> and "
+        "<value> are the same as with 'event send'",
 };
 
 void android_console_event_types(Monitor* mon, const QDict* qdict) {
@@ -680,18 +727,12 @@ void android_console_event_codes(Monitor* mon, const QDict* qdict) {
     monitor_printf(mon, "OK\n");
 }
 
-void android_console_event_send(Monitor* mon, const QDict* qdict) {
-    const char* arg = qdict_get_try_str(qdict, "arg");
-    char** substr;
-    int type, code, value = -1;
-
-    if (!arg) {
-        monitor_printf(mon,
-                       "KO: Usage: event send <type>:<code>:<value> ...\n");
-        return;
-    }
-
-    substr = g_strsplit(arg, ":", 3);
+/* Parse the <type>, <code> and <value> strings of an event taken from
+ * |arg|, and return false after reporting the error if one is invalid. */
+static bool parse_event(Monitor* mon, const char* arg, char** substr,
+                        int* ptype, int* pcode, int* pvalue) {
+    int type, code;
+    const char* digits;
 
     /* The event type can be a symbol or number.  Check that we have a valid
      * type string and get the value depending on its format.
@@ -706,13 +747,15 @@ void android_console_event_send(Monitor* mon, const QDict* qdict) {
                        "KO: invalid event type in '%s', try 'event "
                        "list types' for valid values\n",
                        arg);
-        goto out;
+        return false;
     }
 
     /* The event code can be a symbol or number.  Check that we have a valid
      * code string and get the value depending on its format.
      */
-    if (g_ascii_isdigit(*substr[1])) {
+    if (!substr[1]) {
+        code = -1;
+    } else if (g_ascii_isdigit(*substr[1])) {
         code = g_ascii_strtoull(substr[1], NULL, 0);
     } else {
         code = gf_get_event_code_value(type, substr[1]);
@@ -722,20 +765,46 @@ void android_console_event_send(Monitor* mon, const QDict* qdict) {
                        "KO: invalid event code in '%s', try 'event list "
                        "codes <type>' for valid values\n",
                        arg);
-        goto out;
+        return false;
     }
 
-    /* The event value can only be a numeric value.  Check that the value
-     * string is value and convert it.
+    /* The event value can only be a numeric value, negative ones being
+     * needed for things like the end of a multi-touch contact.  Check that
+     * the value string is valid and convert it.
      */
-    if (!substr[2] || !g_ascii_isdigit(*substr[2])) {
+    digits = substr[2];
+    if (digits && *digits == '-') {
+        digits++;
+    }
+    if (!digits || !g_ascii_isdigit(*digits)) {
         monitor_printf(mon,
                        "KO: invalid event value in '%s', must be an "
                        "integer\n",
                        arg);
+        return false;
+    }
+
+    *ptype = type;
+    *pcode = code;
+    *pvalue = g_ascii_strtoll(substr[2], NULL, 0);
+    return true;
+}
+
+void android_console_event_send(Monitor* mon, const QDict* qdict) {
+    const char* arg = qdict_get_try_str(qdict, "arg");
+    char** substr;
+    int type, code, value;
+
+    if (!arg) {
+        monitor_printf(mon,
+                       "KO: Usage: event send <type>:<code>:<value> ...\n");
+        return;
+    }
+
+    substr = g_strsplit(arg, ":", 3);
+    if (!parse_event(mon, arg, substr, &type, &code, &value)) {
         goto out;
     }
-    value = g_ascii_strtoull(substr[2], NULL, 0);
 
     gf_event_send(type, code, value);
 
@@ -745,6 +814,63 @@ out:
     g_strfreev(substr);
 }
 
+void android_console_event_script(Monitor* mon, const QDict* qdict) {
+    const char* arg = qdict_get_try_str(qdict, "arg");
+    char** items;
+    GoldfishScriptedEvent* script;
+    int count, nn;
+
+    if (!arg) {
+        monitor_printf(mon,
+                       "KO: Usage: event script <time>:<type>:<code>:<value> "
+                       "...\n");
+        return;
+    }
+
+    /* The whole script is parsed before anything gets scheduled, so that
+     * an error doesn't leave half of it playing. */
+    items = g_strsplit_set(arg, " \t", -1);
+    script = g_new(GoldfishScriptedEvent, g_strv_length(items));
+    count = 0;
+    for (nn = 0; items[nn]; nn++) {
+        char** substr;
+        char* end;
+        bool ok;
+
+        if (!*items[nn]) {
+            continue;
+        }
+        substr = g_strsplit(items[nn], ":", 4);
+        script[count].time_us = g_ascii_strtoll(substr[0], &end, 0);
+        ok = g_ascii_isdigit(*substr[0]) && *end == '\0' && substr[1];
+        if (!ok) {
+            monitor_printf(mon,
+                           "KO: invalid event time in '%s', must be a "
+                           "positive integer\n",
+                           items[nn]);
+        } else {
+            ok = parse_event(mon, items[nn], substr + 1, &script[count].type,
+                             &script[count].code, &script[count].value);
+        }
+        g_strfreev(substr);
+        if (!ok) {
+            goto out;
+        }
+        count++;
+    }
+
+    if (gf_event_script(script, count) < 0) {
+        monitor_printf(mon, "KO: too many scheduled events\n");
+        goto out;
+    }
+
+    monitor_printf(mon, "OK\n");
+
+out:
+    g_free(script);
+    g_strfreev(items);
+}
+
 void android_console_event_text(Monitor* mon, const QDict* qdict) {
     const char* arg = qdict_get_try_str(qdict, "arg");
 
@@ -757,6 +883,21 @@ void android_console_event_text(Monitor* mon, const QDict* qdict) {
     monitor_printf(mon, "KO: 'event text' is currently unsupported\n");
 }
 
+void android_console_event_stats(Monitor* mon, const QDict* qdict) {
+    GoldfishEventStats stats;
+
+    if (gf_get_event_stats(&stats) < 0) {
+        monitor_printf(mon, "KO: no event device\n");
+        return;
+    }
+
+    monitor_printf(mon, "queued: %u\n", stats.queued);
+    monitor_printf(mon, "capacity: %u\n", stats.capacity);
+    monitor_printf(mon, "coalesced: %llu\n", stats.coalesced);
+    monitor_printf(mon, "dropped: %llu\n", stats.dropped);
+    monitor_printf(mon, "OK\n");
+}
+
 void android_console_event(Monitor* mon, const QDict* qdict) {
     /* This only gets called for bad subcommands and help requests */
     const char* helptext = qdict_get_try_str(qdict, "helptext");
@@ -773,6 +914,10 @@ void android_console_event(Monitor* mon, const QDict* qdict) {
             cmd = CMD_EVENT_SEND;
         } else if (strstr(helptext, "text")) {
             cmd = CMD_EVENT_TEXT;
+        } else if (strstr(helptext, "stats")) {
+            cmd = CMD_EVENT_STATS;
+        } else if (strstr(helptext, "script")) {
+            cmd = CMD_EVENT_SCRIPT;
         }
     }
 
@@ -789,6 +934,10 @@ enum {
     CMD_AVD_START,
     CMD_AVD_STATUS,
     CMD_AVD_NAME,
+    CMD_AVD_WIPE,
+    CMD_AVD_RESET,
+    CMD_AVD_DISKSTATS,
+    CMD_AVD_BOOTTIME,
     CMD_AVD_SNAPSHOT,
     CMD_AVD_SNAPSHOT_LIST,
     CMD_AVD_SNAPSHOT_SAVE,
@@ -806,6 +955,10 @@ static const char* avd_help[] = {
         "   avd start            start/restart the virtual device\n"
         "   avd status           query virtual device status\n"
         "   avd name             query virtual device name\n"
+        "   avd wipe             reset a partition and reboot\n"
+        "   avd reset            reboot, or load a snapshot, in place\n"
+        "   avd diskstats        show disk latency and queue depth\n"
+        "   avd boottime         show the startup timeline\n"
         "   avd snapshot         state snapshot commands\n",
         /* CMD_AVD_STOP */
         "'avd stop' stops the virtual device immediately, use 'avd start' to "
@@ -819,6 +972,22 @@ static const char* avd_help[] = {
         "not",
         /* CMD_AVD_NAME */
         "'avd name' will return the name of this virtual device",
+        /* CMD_AVD_WIPE */
+        "'avd wipe <partition>' will throw away everything written to the "
+        "given partition (userdata, cache or sdcard) and reboot the virtual "
+        "device",
+        /* CMD_AVD_RESET */
+        "'avd reset' will reboot the virtual device without restarting the "
+        "emulator, with the emulated services back in their startup state. "
+        "'avd reset <snapshot>' will load the given snapshot instead",
+        /* CMD_AVD_DISKSTATS */
+        "'avd diskstats [<partition>]' will show, for all disks or the given "
+        "one, how many requests are in flight and how long reads, writes and "
+        "flushes have taken",
+        /* CMD_AVD_BOOTTIME */
+        "'avd boottime' will show when each startup phase completed, from "
+        "the launch of the emulator to the boot milestones reported by the "
+        "system image, and how long each took",
         /* CMD_AVD_SNAPSHOT */
         "allows you to save and restore the virtual device state in snapshots\n"
         "\n"
@@ -911,6 +1080,202 @@ void android_console_avd_name(Monitor* mon, const QDict* qdict) {
     monitor_printf(mon, "OK\n");
 }
 
+void android_console_avd_wipe(Monitor* mon, const QDict* qdict) {
+    const char* name = qdict_get_try_str(qdict, "arg");
+    bool running = runstate_is_running();
+    Error* err = NULL;
+
+    if (!name) {
+        monitor_printf(mon, "KO: missing partition name\n");
+        return;
+    }
+    if (!strcmp(name, "data")) {
+        name = "userdata";
+    }
+
+    if (running) {
+        vm_stop(RUN_STATE_PAUSED);
+    }
+    qmp_block_reset(name, &err);
+    if (!err) {
+        qemu_system_reset_request();
+    }
+    if (running) {
+        vm_start();
+    }
+
+    if (err) {
+        monitor_printf(mon, "KO: %s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+    monitor_printf(mon, "OK\n");
+}
+
+void qmp_android_fast_reset(bool has_snapshot,
+                            const char* snapshot,
+                            bool has_wipe,
+                            strList* wipe,
+                            Error** errp) {
+    bool running = runstate_is_running();
+    Error* local_err = NULL;
+    strList* dev;
+    int ret;
+
+    if (has_snapshot && has_wipe) {
+        error_setg(errp, "'wipe' can't be used with 'snapshot', which "
+                   "restores all the disks");
+        return;
+    }
+    for (dev = has_wipe ? wipe : NULL; dev; dev = dev->next) {
+        if (!bdrv_find(dev->value)) {
+            error_set(errp, QERR_DEVICE_NOT_FOUND, dev->value);
+            return;
+        }
+    }
+
+    vm_stop(RUN_STATE_RESTORE_VM);
+
+    if (has_snapshot) {
+        ret = load_vmstate(snapshot);
+        if (ret < 0) {
+            /* Like loadvm, don't run whatever state the guest is in */
+            error_setg(errp, "Could not load snapshot '%s'", snapshot);
+            return;
+        }
+    } else {
+        for (dev = has_wipe ? wipe : NULL; dev; dev = dev->next) {
+            qmp_block_reset(dev->value, local_err ? NULL : &local_err);
+        }
+        /* RAM is left alone, the guest reboots over it. The emulated
+         * services, which keep their state in their savevm handlers, go
+         * back to how they were before the first boot. */
+        ret = qemu_loadvm_initial_state();
+        if (ret < 0 && ret != -ENOENT) {
+            error_report("warning: could not restore the initial device "
+                         "state: %s", strerror(-ret));
+        }
+        qemu_system_reset(VMRESET_REPORT);
+        boot_timeline_forget_guest();
+    }
+    boot_timeline_mark("fast-reset");
+
+    if (running) {
+        vm_start();
+    }
+    /* A disk that failed to reset still needs the reboot */
+    error_propagate(errp, local_err);
+}
+
+void android_console_avd_reset(Monitor* mon, const QDict* qdict) {
+    const char* snapshot = qdict_get_try_str(qdict, "arg");
+    Error* err = NULL;
+
+    qmp_android_fast_reset(snapshot != NULL, snapshot, false, NULL, &err);
+    if (err) {
+        monitor_printf(mon, "KO: %s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+    monitor_printf(mon, "OK\n");
+}
+
+static void print_latency(Monitor* mon, uint64_t ns) {
+    if (ns >= 1000000000) {
+        monitor_printf(mon, "%gs", ns / 1e9);
+    } else if (ns >= 1000000) {
+        monitor_printf(mon, "%gms", ns / 1e6);
+    } else if (ns >= 1000) {
+        monitor_printf(mon, "%gus", ns / 1e3);
+    } else {
+        monitor_printf(mon, "%" PRIu64 "ns", ns);
+    }
+}
+
+static void print_latency_histogram(Monitor* mon,
+                                    const char* name,
+                                    int64_t ops,
+                                    BlockLatencyHistogramInfo* hist) {
+    uint64List* boundary = hist->boundaries;
+    uint64List* bin;
+    uint64_t last = 0;
+
+    monitor_printf(mon, "  %s: %" PRId64 " ops\n", name, ops);
+    for (bin = hist->bins; bin; bin = bin->next) {
+        if (boundary) {
+            monitor_printf(mon, "    < ");
+            print_latency(mon, boundary->value);
+            last = boundary->value;
+            boundary = boundary->next;
+        } else {
+            monitor_printf(mon, "    >= ");
+            print_latency(mon, last);
+        }
+        monitor_printf(mon, ": %" PRIu64 "\n", bin->value);
+    }
+}
+
+void android_console_avd_diskstats(Monitor* mon, const QDict* qdict) {
+    const char* name = qdict_get_try_str(qdict, "arg");
+    BlockStatsList* list = qmp_query_blockstats(NULL);
+    BlockStatsList* entry;
+    bool found = false;
+
+    if (name && !strcmp(name, "data")) {
+        name = "userdata";
+    }
+
+    for (entry = list; entry; entry = entry->next) {
+        BlockStats* stats = entry->value;
+        BlockDeviceStats* s = stats->stats;
+
+        if (!stats->has_device || (name && strcmp(name, stats->device))) {
+            continue;
+        }
+        found = true;
+
+        monitor_printf(mon,
+                       "%s: queue depth %" PRId64 " (max %" PRId64 ")\n",
+                       stats->device, s->queue_depth, s->max_queue_depth);
+        if (s->has_rd_latency_histogram) {
+            print_latency_histogram(mon, "read", s->rd_operations,
+                                    s->rd_latency_histogram);
+        }
+        if (s->has_wr_latency_histogram) {
+            print_latency_histogram(mon, "write", s->wr_operations,
+                                    s->wr_latency_histogram);
+        }
+        if (s->has_flush_latency_histogram) {
+            print_latency_histogram(mon, "flush", s->flush_operations,
+                                    s->flush_latency_histogram);
+        }
+    }
+    qapi_free_BlockStatsList(list);
+
+    if (name && !found) {
+        monitor_printf(mon, "KO: unknown partition '%s'\n", name);
+        return;
+    }
+    monitor_printf(mon, "OK\n");
+}
+
+void android_console_avd_boottime(Monitor* mon, const QDict* qdict) {
+    BootTimelineMarkInfoList* list = qmp_query_boot_timeline(NULL);
+    BootTimelineMarkInfoList* entry;
+    int64_t last_ns = 0;
+
+    for (entry = list; entry; entry = entry->next) {
+        BootTimelineMarkInfo* mark = entry->value;
+
+        monitor_printf(mon, "%8" PRId64 " ms  %-28s (+%" PRId64 " ms)\n",
+                       mark->time_ns / 1000000, mark->name,
+                       (mark->time_ns - last_ns) / 1000000);
+        last_ns = mark->time_ns;
+    }
+    qapi_free_BootTimelineMarkInfoList(list);
+    monitor_printf(mon, "OK\n");
+}
+
 void android_console_avd_snapshot(Monitor* mon, const QDict* qdict) {
     /* This only gets called for bad subcommands and help requests */
     const char* helptext = qdict_get_try_str(qdict, "helptext");
@@ -969,6 +1334,14 @@ void android_console_avd(Monitor* mon, const QDict* qdict) {
             cmd = CMD_AVD_STATUS;
         } else if (strstr(helptext, "name")) {
             cmd = CMD_AVD_NAME;
+        } else if (strstr(helptext, "wipe")) {
+            cmd = CMD_AVD_WIPE;
+        } else if (strstr(helptext, "reset")) {
+            cmd = CMD_AVD_RESET;
+        } else if (strstr(helptext, "diskstats")) {
+            cmd = CMD_AVD_DISKSTATS;
+        } else if (strstr(helptext, "boottime")) {
+            cmd = CMD_AVD_BOOTTIME;
         }
     }
 
@@ -1099,7 +1472,7 @@ void android_console_sms(Monitor* mon, const QDict* qdict) {
 }
 
 #ifdef USE_ANDROID_EMU
-void android_console_sms_send(Monitor* mon, const QDict* qdict) {
+static void modem_console_sms_send(Monitor* mon, const QDict* qdict) {
     char* args = (char*)qdict_get_try_str(qdict, "arg");
     char* p;
     int textlen;
@@ -1165,7 +1538,11 @@ void android_console_sms_send(Monitor* mon, const QDict* qdict) {
     monitor_printf(mon, "OK\n");
 }
 
-void android_console_sms_pdu(Monitor* mon, const QDict* qdict) {
+void android_console_sms_send(Monitor* mon, const QDict* qdict) {
+    modem_console_call(modem_console_sms_send, mon, qdict);
+}
+
+static void modem_console_sms_pdu(Monitor* mon, const QDict* qdict) {
     SmsPDU pdu;
     char* args = (char*)qdict_get_try_str(qdict, "arg");
 
@@ -1191,6 +1568,10 @@ void android_console_sms_pdu(Monitor* mon, const QDict* qdict) {
     smspdu_free(pdu);
     monitor_printf(mon, "OK\n");
 }
+
+void android_console_sms_pdu(Monitor* mon, const QDict* qdict) {
+    modem_console_call(modem_console_sms_pdu, mon, qdict);
+}
 #else
 void android_console_sms_send(Monitor* mon, const QDict* qdict) {
     monitor_printf(mon, "KO: emulator not built with USE_ANDROID_EMU\n");
@@ -1252,7 +1633,7 @@ static const struct {
           {"ruim", "Read subscription from RUIM", A_SUBSCRIPTION_RUIM},
 };
 
-void android_console_cdma_ssource(Monitor* mon, const QDict* qdict) {
+static void modem_console_cdma_ssource(Monitor* mon, const QDict* qdict) {
     char* args = (char*)qdict_get_try_str(qdict, "arg");
     int nn;
     if (!args) {
@@ -1279,7 +1660,11 @@ void android_console_cdma_ssource(Monitor* mon, const QDict* qdict) {
     monitor_printf(mon, "KO: Don't know source %s\n", args);
 }
 
-void android_console_cdma_prl_version(Monitor* mon, const QDict* qdict) {
+void android_console_cdma_ssource(Monitor* mon, const QDict* qdict) {
+    modem_console_call(modem_console_cdma_ssource, mon, qdict);
+}
+
+static void modem_console_cdma_prl_version(Monitor* mon, const QDict* qdict) {
     char* args = (char*)qdict_get_try_str(qdict, "arg");
     int version = 0;
     char* endptr;
@@ -1297,6 +1682,10 @@ void android_console_cdma_prl_version(Monitor* mon, const QDict* qdict) {
     }
     monitor_printf(mon, "OK\n");
 }
+
+void android_console_cdma_prl_version(Monitor* mon, const QDict* qdict) {
+    modem_console_call(modem_console_cdma_prl_version, mon, qdict);
+}
 #else
 void android_console_cdma_ssource(Monitor* mon, const QDict* qdict) {
     monitor_printf(mon, "KO: emulator not built with USE_ANDROID_EMU\n");
@@ -1462,7 +1851,7 @@ static const char* call_state_to_string(ACallState state) {
     }
 }
 
-void android_console_gsm_list(Monitor* mon, const QDict* qdict) {
+static void modem_console_gsm_list(Monitor* mon, const QDict* qdict) {
     /* check that we have a phone number made of digits */
     int count = amodem_get_call_count(android_modem);
     int nn;
@@ -1487,6 +1876,10 @@ void android_console_gsm_list(Monitor* mon, const QDict* qdict) {
     monitor_printf(mon, "OK\n");
 }
 
+void android_console_gsm_list(Monitor* mon, const QDict* qdict) {
+    modem_console_call(modem_console_gsm_list, mon, qdict);
+}
+
 static int gsm_check_number(char* args) {
     int nn;
 
@@ -1502,7 +1895,7 @@ static int gsm_check_number(char* args) {
     return 0;
 }
 
-void android_console_gsm_call(Monitor* mon, const QDict* qdict) {
+static void modem_console_gsm_call(Monitor* mon, const QDict* qdict) {
     char* args = (char*)qdict_get_try_str(qdict, "arg");
     /* check that we have a phone number made of digits */
     if (!args) {
@@ -1526,7 +1919,11 @@ void android_console_gsm_call(Monitor* mon, const QDict* qdict) {
     monitor_printf(mon, "OK\n");
 }
 
-void android_console_gsm_busy(Monitor* mon, const QDict* qdict) {
+void android_console_gsm_call(Monitor* mon, const QDict* qdict) {
+    modem_console_call(modem_console_gsm_call, mon, qdict);
+}
+
+static void modem_console_gsm_busy(Monitor* mon, const QDict* qdict) {
     ACall call;
 
     char* args = (char*)qdict_get_try_str(qdict, "arg");
@@ -1551,7 +1948,11 @@ void android_console_gsm_busy(Monitor* mon, const QDict* qdict) {
     monitor_printf(mon, "OK\n");
 }
 
-void android_console_gsm_hold(Monitor* mon, const QDict* qdict) {
+void android_console_gsm_busy(Monitor* mon, const QDict* qdict) {
+    modem_console_call(modem_console_gsm_busy, mon, qdict);
+}
+
+static void modem_console_gsm_hold(Monitor* mon, const QDict* qdict) {
     ACall call;
 
     char* args = (char*)qdict_get_try_str(qdict, "arg");
@@ -1574,7 +1975,11 @@ void android_console_gsm_hold(Monitor* mon, const QDict* qdict) {
     monitor_printf(mon, "OK\n");
 }
 
-void android_console_gsm_accept(Monitor* mon, const QDict* qdict) {
+void android_console_gsm_hold(Monitor* mon, const QDict* qdict) {
+    modem_console_call(modem_console_gsm_hold, mon, qdict);
+}
+
+static void modem_console_gsm_accept(Monitor* mon, const QDict* qdict) {
     ACall call;
 
     char* args = (char*)qdict_get_try_str(qdict, "arg");
@@ -1597,7 +2002,11 @@ void android_console_gsm_accept(Monitor* mon, const QDict* qdict) {
     monitor_printf(mon, "OK\n");
 }
 
-void android_console_gsm_cancel(Monitor* mon, const QDict* qdict) {
+void android_console_gsm_accept(Monitor* mon, const QDict* qdict) {
+    modem_console_call(modem_console_gsm_accept, mon, qdict);
+}
+
+static void modem_console_gsm_cancel(Monitor* mon, const QDict* qdict) {
     char* args = (char*)qdict_get_try_str(qdict, "arg");
     if (!args) {
         monitor_printf(
@@ -1621,6 +2030,10 @@ void android_console_gsm_cancel(Monitor* mon, const QDict* qdict) {
     monitor_printf(mon, "OK\n");
 }
 
+void android_console_gsm_cancel(Monitor* mon, const QDict* qdict) {
+    modem_console_call(modem_console_gsm_cancel, mon, qdict);
+}
+
 void android_console_gsm_data(Monitor* mon, const QDict* qdict) {
     int nn;
     monitor_printf(mon,
@@ -1659,7 +2072,7 @@ void android_console_gsm_voice(Monitor* mon, const QDict* qdict) {
     monitor_printf(mon, "OK\n");
 }
 
-void android_console_gsm_status(Monitor* mon, const QDict* qdict) {
+static void modem_console_gsm_status(Monitor* mon, const QDict* qdict) {
     char* args = (char*)qdict_get_try_str(qdict, "arg");
     if (args) {
         monitor_printf(mon, "KO: no argument required\n");
@@ -1680,7 +2093,11 @@ void android_console_gsm_status(Monitor* mon, const QDict* qdict) {
     monitor_printf(mon, "OK\n");
 }
 
-void android_console_gsm_signal(Monitor* mon, const QDict* qdict) {
+void android_console_gsm_status(Monitor* mon, const QDict* qdict) {
+    modem_console_call(modem_console_gsm_status, mon, qdict);
+}
+
+static void modem_console_gsm_signal(Monitor* mon, const QDict* qdict) {
     char* args = (char*)qdict_get_try_str(qdict, "arg");
     enum { SIGNAL_RSSI = 0, SIGNAL_BER, NUM_SIGNAL_PARAMS };
     char* p = args;
@@ -1740,6 +2157,10 @@ void android_console_gsm_signal(Monitor* mon, const QDict* qdict) {
     monitor_printf(mon, "OK\n");
 }
 
+void android_console_gsm_signal(Monitor* mon, const QDict* qdict) {
+    modem_console_call(modem_console_gsm_signal, mon, qdict);
+}
+
 #else
 void android_console_gsm_list(Monitor* mon, const QDict* qdict) {
     monitor_printf(mon, "KO: emulator not built with USE_ANDROID_EMU\n");
@@ -1786,7 +2207,7 @@ void android_console_gsm_signal(Monitor* mon, const QDict* qdict) {
 }
 #endif
 
-enum { CMD_GEO = 0, CMD_GEO_NMEA = 1, CMD_GEO_FIX = 2 };
+enum { CMD_GEO = 0, CMD_GEO_NMEA = 1, CMD_GEO_FIX = 2, CMD_GEO_ROUTE = 3 };
 
 static const char* geo_help[] = {
         /* CMD_GEO */
@@ -1796,7 +2217,8 @@ static const char* geo_help[] = {
         "\n"
         "available sub-commands:\n"
         "   geo nmea               send a GPS NMEA sentence\n"
-        "   geo fix                send a simple GPS fix\n",
+        "   geo fix                send a simple GPS fix\n"
+        "   geo route              play a GPX track back\n",
         /* CMD_GEO_NMEA */
         "send a GPS NMEA sentence\n"
         "'geo nema <sentence>' sends an NMEA 0183 sentence to the emulated "
@@ -1812,7 +2234,20 @@ static const char* geo_help[] = {
         "   <longitude>   longitude, in decimal degrees\n"
         "   <latitude>    latitude, in decimal degrees\n"
         "   <altitude>    optional altitude in meters\n"
-        "   <satellites>  number of satellites being tracked (1-12)"};
+        "   <satellites>  number of satellites being tracked (1-12)",
+        /* CMD_GEO_ROUTE */
+        "play a GPX track back\n"
+        "'geo route start <file> [<speed> [<interval>]]' sends the points of "
+        "the tracks,\n"
+        "routes or waypoints of GPX <file> as GPS fixes, one every "
+        "<interval> ms of\n"
+        "guest time (1000 by default), interpolated along the track. The "
+        "points are\n"
+        "played at the pace of their timestamps times <speed> (1 by "
+        "default), or one per\n"
+        "interval if they have none. 'geo route stop' stops the playback, "
+        "'geo route\n"
+        "status' shows its progress."};
 
 void android_console_geo(Monitor* mon, const QDict* qdict) {
     /* This only gets called for bad subcommands and help requests */
@@ -1826,6 +2261,8 @@ void android_console_geo(Monitor* mon, const QDict* qdict) {
             cmd = CMD_GEO_NMEA;
         } else if (strstr(helptext, "fix")) {
             cmd = CMD_GEO_FIX;
+        } else if (strstr(helptext, "route")) {
+            cmd = CMD_GEO_ROUTE;
         }
     }
 
@@ -1868,6 +2305,400 @@ void android_console_rotate_screen(Monitor *mon, const QDict *qdict)
     }
 }
 
+enum { CMD_PIPE = 0, CMD_PIPE_STATS = 1, CMD_PIPE_ADB_NOTIFY = 2 };
+
+static const char* pipe_help[] = {
+        /* CMD_PIPE */
+        "android pipe related commands\n"
+        "\n"
+        "available sub-commands:\n"
+        "   pipe stats             display usage statistics of the pipe "
+        "services\n"
+        "   pipe adb-notify        register with the host adb server now\n",
+        /* CMD_PIPE_STATS */
+        "'pipe stats' displays, for each pipe service, the number of opened "
+        "pipes,\n"
+        "guest commands, bytes transferred and PIPE_ERROR_AGAIN results, "
+        "followed\n"
+        "by a histogram of the time spent in the service's send/receive "
+        "callbacks.\n"
+        "The adb proxy line reports the open adb server connections, the bytes\n"
+        "forwarded in each direction, the number of socket calls and the "
+        "average\n"
+        "rate of a connection. The adb registration line reports the attempts "
+        "to\n"
+        "register with the host adb server and the time it took from startup "
+        "until\n"
+        "adbd first started proxying.",
+        /* CMD_PIPE_ADB_NOTIFY */
+        "'pipe adb-notify' registers the emulator with the host adb server "
+        "right\n"
+        "away, instead of waiting for the next automatic retry. Use it after "
+        "restarting\n"
+        "the adb server to make the emulator reappear immediately."};
+
+void android_console_pipe(Monitor* mon, const QDict* qdict) {
+    /* This only gets called for bad subcommands and help requests */
+    const char* helptext = qdict_get_try_str(qdict, "helptext");
+
+    /* Default to the first entry which is the parent help message */
+    int cmd = CMD_PIPE;
+
+    if (helptext) {
+        if (strstr(helptext, "stats")) {
+            cmd = CMD_PIPE_STATS;
+        } else if (strstr(helptext, "adb-notify")) {
+            cmd = CMD_PIPE_ADB_NOTIFY;
+        }
+    }
+
+    /* If this is not a help request then we are here with a bad sub-command */
+    monitor_printf(mon,
+                   "%s\n%s\n",
+                   pipe_help[cmd],
+                   helptext ? "OK" : "KO: missing sub-command");
+}
+
+void android_console_pipe_stats(Monitor* mon, const QDict* qdict) {
+    AndroidPipeServiceInfoList* list;
+    AndroidPipeServiceInfoList* entry;
+    AndroidPipeLookupStats lookup;
+    AndroidAdbStats adb;
+    Error* err = NULL;
+    intList* bucket;
+    int n;
+
+    list = qmp_query_android_pipes(&err);
+    if (err) {
+        monitor_printf(mon, "KO: %s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+
+    for (entry = list; entry; entry = entry->next) {
+        AndroidPipeServiceInfo* info = entry->value;
+        monitor_printf(mon,
+                       "%s: opens=%" PRId64 " commands=%" PRId64
+                       " sent=%" PRId64 " received=%" PRId64
+                       " again=%" PRId64 "\n",
+                       info->name, info->opens, info->commands,
+                       info->bytes_sent, info->bytes_received, info->again);
+        monitor_printf(mon, "  open: avg=%" PRId64 "us max=%" PRId64 "us\n",
+                       info->opens ? info->open_time_ns / info->opens / 1000
+                                   : 0,
+                       info->open_time_max_ns / 1000);
+        monitor_printf(mon, "  latency:");
+        for (bucket = info->latency_histogram, n = 0; bucket;
+             bucket = bucket->next, n++) {
+            if (bucket->next) {
+                monitor_printf(mon, " <%dus=%" PRId64, 1 << (2 * n),
+                               bucket->value);
+            } else {
+                monitor_printf(mon, " more=%" PRId64, bucket->value);
+            }
+        }
+        monitor_printf(mon, "\n");
+    }
+    qapi_free_AndroidPipeServiceInfoList(list);
+
+    android_pipe_get_lookup_stats(&lookup);
+    monitor_printf(mon,
+                   "channel lookups=%" PRIu64 " misses=%" PRIu64
+                   " pipes=%u (max %u) map cache hits=%" PRIu64
+                   " misses=%" PRIu64 "\n",
+                   lookup.lookups, lookup.misses, lookup.num_pipes,
+                   lookup.max_pipes, lookup.map_cache_hits,
+                   lookup.map_cache_misses);
+
+    android_adb_get_stats(&adb);
+    monitor_printf(mon,
+                   "adb proxy: connections=%u to host=%" PRIu64 " (%" PRIu64
+                   " writes) from host=%" PRIu64 " (%" PRIu64
+                   " reads) rate=%" PRIu64 "KB/s\n",
+                   adb.connections, adb.bytes_to_host, adb.writes,
+                   adb.bytes_from_host,
+                   adb.reads,
+                   adb.connected_ns >= 1000000
+                       ? (adb.bytes_to_host + adb.bytes_from_host) /
+                             (adb.connected_ns / 1000000)
+                       : 0);
+    monitor_printf(mon, "adb registration: attempts=%" PRIu64
+                   " failures=%" PRIu64,
+                   adb.notify_attempts, adb.notify_failures);
+    if (adb.ready_ns) {
+        monitor_printf(mon, " ready=%" PRId64 "ms\n", adb.ready_ns / 1000000);
+    } else {
+        monitor_printf(mon, " ready=never\n");
+    }
+    monitor_printf(mon, "OK\n");
+}
+
+void android_console_pipe_adb_notify(Monitor* mon, const QDict* qdict) {
+    android_adb_server_notify_now();
+    monitor_printf(mon, "OK\n");
+}
+
+enum {
+    CMD_VCPU = 0,
+    CMD_VCPU_EXITS = 1,
+    CMD_VCPU_RESET = 2,
+    CMD_VCPU_PROFILE = 3,
+};
+
+static const char* vcpu_help[] = {
+        /* CMD_VCPU */
+        "virtual cpu related commands\n"
+        "\n"
+        "available sub-commands:\n"
+        "   vcpu exits             display exit statistics of the virtual "
+        "cpus\n"
+        "   vcpu reset             clear the exit statistics\n"
+        "   vcpu profile           sample what the virtual cpus are doing\n",
+        /* CMD_VCPU_EXITS */
+        "'vcpu exits' displays, for each virtual cpu run by HAX or KVM, the "
+        "number of\n"
+        "exits to the emulator by reason, the average time spent handling "
+        "them and a\n"
+        "histogram of that time, followed by the ports and MMIO addresses "
+        "that caused\n"
+        "the most exits, and the halt polling window, the number of halts "
+        "that polled\n"
+        "and that ended while polling, and the time spent polling.",
+        /* CMD_VCPU_RESET */
+        "'vcpu reset' clears the exit statistics of all the virtual cpus.",
+        /* CMD_VCPU_PROFILE */
+        "'vcpu profile start <file> [<rate>]' starts sampling, <rate> times "
+        "per second\n"
+        "(99 by default), whether each virtual cpu is stopped, halted, in "
+        "the emulator\n"
+        "or running guest code, and at which guest PC. 'vcpu profile stop' "
+        "writes the\n"
+        "samples to <file> as folded stacks for flame graph tools."};
+
+void android_console_vcpu(Monitor* mon, const QDict* qdict) {
+    /* This only gets called for bad subcommands and help requests */
+    const char* helptext = qdict_get_try_str(qdict, "helptext");
+
+    /* Default to the first entry which is the parent help message */
+    int cmd = CMD_VCPU;
+
+    if (helptext) {
+        if (strstr(helptext, "exits")) {
+            cmd = CMD_VCPU_EXITS;
+        } else if (strstr(helptext, "reset")) {
+            cmd = CMD_VCPU_RESET;
+        } else if (strstr(helptext, "profile")) {
+            cmd = CMD_VCPU_PROFILE;
+        }
+    }
+
+    /* If this is not a help request then we are here with a bad sub-command */
+    monitor_printf(mon,
+                   "%s\n%s\n",
+                   vcpu_help[cmd],
+                   helptext ? "OK" : "KO: missing sub-command");
+}
+
+void android_console_vcpu_exits(Monitor* mon, const QDict* qdict) {
+    VcpuExitInfoList* list;
+    VcpuExitInfoList* entry;
+    Error* err = NULL;
+
+    list = qmp_query_vcpu_exits(false, false, &err);
+    if (err) {
+        monitor_printf(mon, "KO: %s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+
+    for (entry = list; entry; entry = entry->next) {
+        VcpuExitInfo* info = entry->value;
+        VcpuExitReasonInfoList* reason;
+        VcpuExitAddressInfoList* addr;
+
+        monitor_printf(mon, "vcpu %" PRId64 ":\n", info->CPU);
+        for (reason = info->reasons; reason; reason = reason->next) {
+            VcpuExitReasonInfo* r = reason->value;
+            intList* bucket;
+            int n;
+
+            monitor_printf(mon, "  %s: count=%" PRId64 " avg=%" PRId64 "us",
+                           VcpuExitReason_lookup[r->reason], r->count,
+                           r->count ? r->time_ns / r->count / 1000 : 0);
+            for (bucket = r->latency_histogram, n = 0; bucket;
+                 bucket = bucket->next, n++) {
+                if (bucket->next) {
+                    monitor_printf(mon, " <%dus=%" PRId64, 1 << (2 * n),
+                                   bucket->value);
+                } else {
+                    monitor_printf(mon, " more=%" PRId64, bucket->value);
+                }
+            }
+            monitor_printf(mon, "\n");
+        }
+        for (addr = info->top_addresses; addr; addr = addr->next) {
+            VcpuExitAddressInfo* a = addr->value;
+
+            monitor_printf(mon, "  %s 0x%" PRIx64 ": count=%" PRId64 "\n",
+                           a->io ? "port" : "mmio", a->address, a->count);
+        }
+        monitor_printf(mon,
+                       "  halt poll: window=%" PRId64 "us polls=%" PRId64
+                       " successes=%" PRId64 " time=%" PRId64 "us\n",
+                       info->halt_poll->window_ns / 1000,
+                       info->halt_poll->polls, info->halt_poll->successes,
+                       info->halt_poll->time_ns / 1000);
+    }
+    qapi_free_VcpuExitInfoList(list);
+    monitor_printf(mon, "OK\n");
+}
+
+void android_console_vcpu_reset(Monitor* mon, const QDict* qdict) {
+    vcpu_exit_reset();
+    monitor_printf(mon, "OK\n");
+}
+
+void android_console_vcpu_profile(Monitor* mon, const QDict* qdict) {
+    const char* action = qdict_get_str(qdict, "action");
+    const char* file = qdict_get_try_str(qdict, "file");
+    Error* err = NULL;
+
+    if (!strcmp(action, "start")) {
+        if (!file) {
+            monitor_printf(mon, "KO: missing file name\n");
+            return;
+        }
+        qmp_vcpu_profile_start(file, qdict_haskey(qdict, "rate"),
+                               qdict_get_try_int(qdict, "rate", 0), &err);
+    } else if (!strcmp(action, "stop")) {
+        VcpuProfileInfo* info = qmp_vcpu_profile_stop(&err);
+
+        if (info) {
+            monitor_printf(mon,
+                           "%" PRId64 " samples, %" PRId64
+                           " stacks in %s\n",
+                           info->samples, info->stacks, info->file);
+            qapi_free_VcpuProfileInfo(info);
+        }
+    } else {
+        monitor_printf(mon, "KO: action must be 'start' or 'stop'\n");
+        return;
+    }
+
+    if (err) {
+        monitor_printf(mon, "KO: %s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+    monitor_printf(mon, "OK\n");
+}
+
+/* Returns whether the output of a console command reports success, that
+ * is whether none of its lines starts with "KO".
+ */
+static bool console_output_ok(const char* output) {
+    const char* line;
+
+    for (line = output; *line; line++) {
+        if (!strncmp(line, "KO", 2)) {
+            return false;
+        }
+        line = strchr(line, '\n');
+        if (!line) {
+            break;
+        }
+    }
+    return true;
+}
+
+/* Relays the output of command |index| of a batch to |mon|, without its
+ * "OK" line and with the index added to its errors, so that the whole
+ * batch gets a single answer.
+ */
+static void batch_relay_output(Monitor* mon, int index, const char* output) {
+    gchar** lines = g_strsplit(output, "\n", -1);
+    int i;
+
+    for (i = 0; lines[i]; i++) {
+        const char* line = lines[i];
+
+        if (!*line || !strcmp(line, "OK")) {
+            continue;
+        }
+        if (!strncmp(line, "KO", 2)) {
+            line += 2;
+            while (*line == ':' || *line == ' ') {
+                line++;
+            }
+            monitor_printf(mon, "KO: %d: %s\n", index, line);
+        } else {
+            monitor_printf(mon, "%s\n", line);
+        }
+    }
+    g_strfreev(lines);
+}
+
+/* 'batch <command>; <command>; ...' runs the commands in order, and
+ * answers once for all of them: their output without the "OK" lines, then
+ * "OK" if they all succeeded, or "KO: <n> of <count> commands failed".
+ * Harnesses sending many sensor or input updates pay a single round trip.
+ */
+void android_console_batch(Monitor* mon, const QDict* qdict) {
+    const char* arg = qdict_get_try_str(qdict, "arg");
+    gchar** commands;
+    int count = 0, failed = 0;
+    int i;
+
+    if (!arg) {
+        monitor_printf(mon, "KO: missing commands, see 'help batch'\n");
+        return;
+    }
+
+    commands = g_strsplit(arg, ";", -1);
+    for (i = 0; commands[i]; i++) {
+        char* output;
+
+        g_strstrip(commands[i]);
+        if (!*commands[i]) {
+            continue;
+        }
+        count++;
+        output = monitor_android_console_run(commands[i]);
+        if (!console_output_ok(output)) {
+            failed++;
+        }
+        batch_relay_output(mon, count, output);
+        g_free(output);
+    }
+    g_strfreev(commands);
+
+    if (failed) {
+        monitor_printf(mon, "KO: %d of %d commands failed\n", failed, count);
+    } else if (!count) {
+        monitor_printf(mon, "KO: missing commands, see 'help batch'\n");
+    } else {
+        monitor_printf(mon, "OK\n");
+    }
+}
+
+AndroidConsoleResultList* qmp_android_console_batch(strList* commands,
+                                                    Error** errp) {
+    AndroidConsoleResultList *head = NULL, **tail = &head;
+
+    for (; commands; commands = commands->next) {
+        AndroidConsoleResultList* entry = g_new0(AndroidConsoleResultList, 1);
+        AndroidConsoleResult* result = g_new0(AndroidConsoleResult, 1);
+
+        result->command = g_strdup(commands->value);
+        result->output = monitor_android_console_run(commands->value);
+        result->ok = console_output_ok(result->output);
+        entry->value = result;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
 #ifdef USE_ANDROID_EMU
 void android_console_geo_nmea(Monitor* mon, const QDict* qdict) {
     const char* arg = qdict_get_try_str(qdict, "arg");
@@ -1950,6 +2781,306 @@ void android_console_geo_fix(Monitor* mon, const QDict* qdict) {
             params[GEO_LAT], params[GEO_LONG], altitude, n_satellites, &tVal);
     monitor_printf(mon, "OK\n");
 }
+
+#define GEO_ROUTE_DEFAULT_INTERVAL_MS 1000
+#define GEO_ROUTE_MIN_INTERVAL_MS 10
+#define GEO_ROUTE_MAX_SPEED 1000
+#define GEO_ROUTE_SATELLITES 8
+
+typedef struct {
+    double latitude;
+    double longitude;
+    double elevation;
+    double time; /* seconds from the first point */
+} GeoRoutePoint;
+
+/* Playback of a track, on the virtual clock so that it pauses with the
+ * guest and keeps its pace whatever the host load. Runs in the main loop.
+ */
+typedef struct {
+    char* file;
+    GArray* points;
+    QEMUTimer* timer;
+    int64_t start_ms;
+    int64_t next_ms;
+    int64_t interval_ms;
+    double speed;
+    bool loop;
+    bool finished;
+    guint position; /* last point passed */
+    double elapsed; /* route time of the last fix, in seconds */
+    int64_t fixes;
+} GeoRoute;
+
+static GeoRoute* geo_route;
+
+/* Seconds since the epoch of an ISO 8601 UTC time, or NAN. Offsets other
+ * than Z are ignored, only differences between the points matter. */
+static double gpx_parse_time(const char* s) {
+    int year, month, day, hour, min;
+    int64_t era, yoe, doy, doe, days;
+    double sec;
+
+    if (sscanf(s, "%d-%d-%dT%d:%d:%lf", &year, &month, &day, &hour, &min,
+               &sec) != 6) {
+        return NAN;
+    }
+    year -= month <= 2;
+    era = (year >= 0 ? year : year - 399) / 400;
+    yoe = year - era * 400;
+    doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    days = era * 146097 + doe - 719468;
+    return days * 86400.0 + hour * 3600 + min * 60 + sec;
+}
+
+/* Looks for attribute |name| in the tag spanning [tag, end). */
+static bool gpx_attribute(const char* tag, const char* end, const char* name,
+                          double* value) {
+    size_t len = strlen(name);
+    const char* p;
+
+    for (p = tag + 1; p + len + 2 < end; p++) {
+        if (qemu_isspace(p[-1]) && !strncmp(p, name, len) && p[len] == '=' &&
+            (p[len + 1] == '"' || p[len + 1] == '\'')) {
+            *value = g_ascii_strtod(p + len + 2, NULL);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Looks for the text of element |name| in [start, end). */
+static const char* gpx_child(const char* start, const char* end,
+                             const char* name) {
+    char* open = g_strdup_printf("<%s>", name);
+    const char* p = g_strstr_len(start, end - start, open);
+
+    if (p) {
+        p += strlen(open);
+    }
+    g_free(open);
+    return p;
+}
+
+/* Appends the <trkpt>, <rtept> and <wpt> points of |text| to |points|.
+ * This only knows enough of GPX to read what track tools write.
+ */
+static void gpx_parse(const char* text, GArray* points) {
+    static const char* const kinds[] = {"trkpt", "rtept", "wpt"};
+    const char* p = text;
+    int kind;
+
+    for (kind = 0; kind < ARRAY_SIZE(kinds); kind++) {
+        char* open = g_strdup_printf("<%s", kinds[kind]);
+        char* close = g_strdup_printf("</%s>", kinds[kind]);
+        size_t open_len = strlen(open);
+
+        for (p = strstr(text, open); p; p = strstr(p + 1, open)) {
+            const char* tag_end = strchr(p, '>');
+            const char* elem_end = tag_end;
+            const char* child;
+            GeoRoutePoint point = {.time = NAN};
+
+            if (!tag_end) {
+                break;
+            }
+            if (!qemu_isspace(p[open_len]) ||
+                !gpx_attribute(p, tag_end, "lat", &point.latitude) ||
+                !gpx_attribute(p, tag_end, "lon", &point.longitude)) {
+                continue;
+            }
+            if (tag_end[-1] != '/') {
+                elem_end = strstr(tag_end, close);
+                if (!elem_end) {
+                    elem_end = tag_end + strlen(tag_end);
+                }
+            }
+            child = gpx_child(tag_end, elem_end, "ele");
+            if (child) {
+                point.elevation = g_ascii_strtod(child, NULL);
+            }
+            child = gpx_child(tag_end, elem_end, "time");
+            if (child) {
+                point.time = gpx_parse_time(child);
+            }
+            g_array_append_val(points, point);
+        }
+        g_free(open);
+        g_free(close);
+        /* A file with tracks may also have waypoints, don't mix them. */
+        if (points->len) {
+            break;
+        }
+    }
+}
+
+/* Turns the timestamps into seconds from the first point, or spaces the
+ * points one interval apart if they aren't all there and in order. */
+static void geo_route_set_times(GArray* points, int64_t interval_ms) {
+    GeoRoutePoint* pt = (GeoRoutePoint*)points->data;
+    bool timed = true;
+    guint i;
+
+    for (i = 0; i < points->len; i++) {
+        if (isnan(pt[i].time) || (i && pt[i].time < pt[i - 1].time)) {
+            timed = false;
+            break;
+        }
+    }
+    for (i = points->len; i-- > 0;) {
+        pt[i].time = timed ? pt[i].time - pt[0].time
+                           : i * (interval_ms / 1000.0);
+    }
+}
+
+static void geo_route_send(GeoRoute* route, double t) {
+    const GeoRoutePoint* pt = (const GeoRoutePoint*)route->points->data;
+    const GeoRoutePoint* a;
+    const GeoRoutePoint* b;
+    double frac = 0;
+    struct timeval tval;
+
+    while (route->position + 1 < route->points->len &&
+           pt[route->position + 1].time <= t) {
+        route->position++;
+    }
+    a = &pt[route->position];
+    b = route->position + 1 < route->points->len ? a + 1 : a;
+    if (b->time > a->time) {
+        frac = (t - a->time) / (b->time - a->time);
+    }
+
+    gettimeofday(&tval, NULL);
+    _g_global.location_agent.gpsCmd(
+            a->latitude + (b->latitude - a->latitude) * frac,
+            a->longitude + (b->longitude - a->longitude) * frac,
+            a->elevation + (b->elevation - a->elevation) * frac,
+            GEO_ROUTE_SATELLITES, &tval);
+    route->elapsed = t;
+    route->fixes++;
+}
+
+static void geo_route_tick(void* opaque) {
+    GeoRoute* route = opaque;
+    const GeoRoutePoint* pt = (const GeoRoutePoint*)route->points->data;
+    double duration = pt[route->points->len - 1].time;
+    double t = (route->next_ms - route->start_ms) * route->speed / 1000.0;
+
+    if (t >= duration && route->loop && duration > 0) {
+        t = fmod(t, duration);
+        route->position = 0;
+    } else if (t >= duration) {
+        geo_route_send(route, duration);
+        route->finished = true;
+        return;
+    }
+    geo_route_send(route, t);
+
+    /* Fixes stay on the interval grid, even if the main loop was late */
+    route->next_ms += route->interval_ms;
+    timer_mod(route->timer, route->next_ms);
+}
+
+static void geo_route_free(GeoRoute* route) {
+    timer_del(route->timer);
+    timer_free(route->timer);
+    g_array_free(route->points, true);
+    g_free(route->file);
+    g_free(route);
+}
+
+void qmp_geo_route_start(const char* file,
+                         bool has_speed,
+                         double speed,
+                         bool has_interval,
+                         int64_t interval,
+                         bool has_loop,
+                         bool loop,
+                         Error** errp) {
+    GeoRoute* route;
+    GError* gerr = NULL;
+    gchar* text;
+
+    if (!_g_global.location_agent.gpsIsSupported()) {
+        error_setg(errp, "No GPS emulation in this virtual device");
+        return;
+    }
+    if (!has_speed) {
+        speed = 1;
+    }
+    if (!(speed > 0 && speed <= GEO_ROUTE_MAX_SPEED)) {
+        error_setg(errp, "Parameter 'speed' expects a number above 0 and "
+                   "up to %d", GEO_ROUTE_MAX_SPEED);
+        return;
+    }
+    if (!has_interval) {
+        interval = GEO_ROUTE_DEFAULT_INTERVAL_MS;
+    }
+    if (interval < GEO_ROUTE_MIN_INTERVAL_MS) {
+        error_setg(errp, "Parameter 'interval' expects at least %d ms",
+                   GEO_ROUTE_MIN_INTERVAL_MS);
+        return;
+    }
+    if (!g_file_get_contents(file, &text, NULL, &gerr)) {
+        error_setg(errp, "Could not read '%s': %s", file, gerr->message);
+        g_error_free(gerr);
+        return;
+    }
+
+    route = g_new0(GeoRoute, 1);
+    route->points = g_array_new(false, false, sizeof(GeoRoutePoint));
+    gpx_parse(text, route->points);
+    g_free(text);
+    if (!route->points->len) {
+        error_setg(errp, "'%s' has no GPX track, route or waypoint", file);
+        g_array_free(route->points, true);
+        g_free(route);
+        return;
+    }
+    geo_route_set_times(route->points, interval);
+
+    if (geo_route) {
+        geo_route_free(geo_route);
+    }
+    route->file = g_strdup(file);
+    route->interval_ms = interval;
+    route->speed = speed;
+    route->loop = has_loop && loop;
+    route->start_ms = route->next_ms = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
+    route->timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, geo_route_tick, route);
+    geo_route = route;
+    geo_route_tick(route);
+}
+
+void qmp_geo_route_stop(Error** errp) {
+    if (!geo_route) {
+        error_setg(errp, "No route is playing");
+        return;
+    }
+    geo_route_free(geo_route);
+    geo_route = NULL;
+}
+
+GeoRouteInfo* qmp_query_geo_route(Error** errp) {
+    GeoRouteInfo* info = g_new0(GeoRouteInfo, 1);
+    GeoRoute* route = geo_route;
+    const GeoRoutePoint* pt;
+
+    if (!route) {
+        return info;
+    }
+    pt = (const GeoRoutePoint*)route->points->data;
+    info->active = !route->finished;
+    info->has_file = true;
+    info->file = g_strdup(route->file);
+    info->points = route->points->len;
+    info->position = route->position;
+    info->fixes = route->fixes;
+    info->elapsed_ms = route->elapsed * 1000;
+    info->duration_ms = pt[route->points->len - 1].time * 1000;
+    return info;
+}
 #else /* not USE_ANDROID_EMU */
 void android_console_geo_nmea(Monitor* mon, const QDict* qdict) {
     monitor_printf(mon, "KO: emulator not built with USE_ANDROID_EMU\n");
@@ -1957,8 +3088,75 @@ void android_console_geo_nmea(Monitor* mon, const QDict* qdict) {
 void android_console_geo_fix(Monitor* mon, const QDict* qdict) {
     monitor_printf(mon, "KO: emulator not built with USE_ANDROID_EMU\n");
 }
+
+void qmp_geo_route_start(const char* file,
+                         bool has_speed,
+                         double speed,
+                         bool has_interval,
+                         int64_t interval,
+                         bool has_loop,
+                         bool loop,
+                         Error** errp) {
+    error_setg(errp, "Emulator not built with USE_ANDROID_EMU");
+}
+
+void qmp_geo_route_stop(Error** errp) {
+    error_setg(errp, "Emulator not built with USE_ANDROID_EMU");
+}
+
+GeoRouteInfo* qmp_query_geo_route(Error** errp) {
+    return g_new0(GeoRouteInfo, 1);
+}
 #endif
 
+void android_console_geo_route(Monitor* mon, const QDict* qdict) {
+    const char* action = qdict_get_str(qdict, "action");
+    const char* file = qdict_get_try_str(qdict, "file");
+    Error* err = NULL;
+
+    if (!strcmp(action, "start")) {
+        if (!file) {
+            monitor_printf(mon, "KO: missing file name\n");
+            return;
+        }
+        qmp_geo_route_start(file, qdict_haskey(qdict, "speed"),
+                            qdict_haskey(qdict, "speed")
+                                    ? qdict_get_double(qdict, "speed")
+                                    : 1,
+                            qdict_haskey(qdict, "interval"),
+                            qdict_get_try_int(qdict, "interval", 0),
+                            false, false, &err);
+    } else if (!strcmp(action, "stop")) {
+        qmp_geo_route_stop(&err);
+    } else if (!strcmp(action, "status")) {
+        GeoRouteInfo* info = qmp_query_geo_route(&err);
+
+        if (info && info->has_file) {
+            monitor_printf(mon,
+                           "%s: %s, point %" PRId64 " of %" PRId64
+                           ", %" PRId64 " of %" PRId64 " ms, %" PRId64
+                           " fixes sent\n",
+                           info->file, info->active ? "playing" : "finished",
+                           info->position + 1, info->points, info->elapsed_ms,
+                           info->duration_ms, info->fixes);
+        } else if (info) {
+            monitor_printf(mon, "no route\n");
+        }
+        qapi_free_GeoRouteInfo(info);
+    } else {
+        monitor_printf(mon, "KO: action must be 'start', 'stop' or "
+                       "'status'\n");
+        return;
+    }
+
+    if (err) {
+        monitor_printf(mon, "KO: %s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+    monitor_printf(mon, "OK\n");
+}
+
 #ifndef CONFIG_ANDROID
 const char* android_console_auth_banner_get() {
     return "";
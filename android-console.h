@@ -51,6 +51,8 @@ void android_console_event_types(Monitor *mon, const QDict *qdict);
 void android_console_event_codes(Monitor *mon, const QDict *qdict);
 void android_console_event_send(Monitor *mon, const QDict *qdict);
 void android_console_event_text(Monitor *mon, const QDict *qdict);
+void android_console_event_stats(Monitor *mon, const QDict *qdict);
+void android_console_event_script(Monitor *mon, const QDict *qdict);
 void android_console_event(Monitor *mon, const QDict *qdict);
 
 void android_console_auth(Monitor* mon, const QDict* qdict);
@@ -59,6 +61,10 @@ void android_console_avd_stop(Monitor *mon, const QDict *qdict);
 void android_console_avd_start(Monitor *mon, const QDict *qdict);
 void android_console_avd_status(Monitor *mon, const QDict *qdict);
 void android_console_avd_name(Monitor *mon, const QDict *qdict);
+void android_console_avd_wipe(Monitor *mon, const QDict *qdict);
+void android_console_avd_reset(Monitor *mon, const QDict *qdict);
+void android_console_avd_diskstats(Monitor *mon, const QDict *qdict);
+void android_console_avd_boottime(Monitor *mon, const QDict *qdict);
 void android_console_avd_snapshot(Monitor *mon, const QDict *qdict);
 void android_console_avd_snapshot_list(Monitor *mon, const QDict *qdict);
 void android_console_avd_snapshot_save(Monitor *mon, const QDict *qdict);
@@ -73,6 +79,7 @@ void android_console_finger(Monitor *mon, const QDict *qdict);
 
 void android_console_geo_nmea(Monitor *mon, const QDict *qdict);
 void android_console_geo_fix(Monitor *mon, const QDict *qdict);
+void android_console_geo_route(Monitor *mon, const QDict *qdict);
 void android_console_geo(Monitor *mon, const QDict *qdict);
 
 void android_console_sms_send(Monitor *mon, const QDict *qdict);
@@ -96,6 +103,14 @@ void android_console_gsm_signal(Monitor *mon, const QDict *qdict);
 void android_console_gsm(Monitor *mon, const QDict *qdict);
 
 void android_console_rotate_screen(Monitor *mon, const QDict *qdict);
+void android_console_pipe_stats(Monitor *mon, const QDict *qdict);
+void android_console_pipe_adb_notify(Monitor *mon, const QDict *qdict);
+void android_console_pipe(Monitor *mon, const QDict *qdict);
+void android_console_vcpu_exits(Monitor *mon, const QDict *qdict);
+void android_console_vcpu_reset(Monitor *mon, const QDict *qdict);
+void android_console_vcpu_profile(Monitor *mon, const QDict *qdict);
+void android_console_vcpu(Monitor *mon, const QDict *qdict);
+void android_console_batch(Monitor *mon, const QDict *qdict);
 
 void android_monitor_print_error(Monitor *mon, const char *fmt, ...);
 
@@ -20,10 +20,21 @@
 
 extern "C" {
 #include "qemu-common.h"
+#include "block/aio.h"
+#include "migration/qemu-file.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
 #include "qemu/timer.h"
+#include "qom/object_interfaces.h"
 #include "sysemu/char.h"
+#include "sysemu/iothread.h"
 }  // extern "C"
 
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
 namespace android {
 namespace qemu {
 
@@ -51,19 +62,35 @@ typedef ::android::base::Looper::FdWatch BaseFdWatch;
 // FdWatch instances, see the comment in the declaration of FdWatch
 // below to understand why.
 //
+// Where epoll is available, watches are kept in a private epoll set that
+// is itself the only descriptor registered with the main loop, so with
+// many watches a mask change is a single epoll_ctl() instead of a
+// qemu_set_fd_handler() call on the main loop's handler list.
+//
 class QemuLooper : public BaseLooper {
 public:
     QemuLooper() :
             Looper(),
             mQemuBh(NULL),
             mPendingFdWatches(),
-            mTimers() {
+            mTimers(),
+            mEpollFd(-1) {
+        memset(mTimerWheels, 0, sizeof(mTimerWheels));
     }
 
     virtual ~QemuLooper() {
         if (mQemuBh) {
             qemu_bh_delete(mQemuBh);
         }
+        for (int n = 0; n < QEMU_CLOCK_MAX; n++) {
+            delete mTimerWheels[n];
+        }
+#ifdef CONFIG_EPOLL
+        if (mEpollFd >= 0) {
+            qemu_set_fd_handler(mEpollFd, NULL, NULL, NULL);
+            ::close(mEpollFd);
+        }
+#endif
     }
 
     static QEMUClockType toQemuClockType(ClockType clock) {
@@ -94,11 +121,18 @@ public:
                         BaseFdWatch(looper, fd, callback, opaque),
                         mWantedEvents(0U),
                         mPendingEvents(0U),
+                        mInEpoll(false),
                         mLink() {
         }
 
         virtual ~FdWatch() {
             clearPending();
+#ifdef CONFIG_EPOLL
+            if (mInEpoll) {
+                asQemuLooper(mLooper)->epollUpdate(this, 0U);
+                return;
+            }
+#endif
             qemu_set_fd_handler(mFd, NULL, NULL, NULL);
         }
 
@@ -127,10 +161,52 @@ public:
             mCallback(mOpaque, mFd, events);
         }
 
+        // Called with the events reported by epoll_wait().
+        void setPendingFromEpoll(uint32_t revents) {
+#ifdef CONFIG_EPOLL
+            unsigned events = 0U;
+            if (revents & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                events |= kEventRead;
+            }
+            if (revents & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+                events |= kEventWrite;
+            }
+            events &= mWantedEvents;
+            if (events) {
+                setPending(events);
+            }
+#endif
+        }
+
+        unsigned wantedEvents() const {
+            return mWantedEvents;
+        }
+
+        int fd() const {
+            return mFd;
+        }
+
         TAIL_QUEUE_LIST_TRAITS(Traits, FdWatch, mLink);
 
     private:
         void updateEvents(unsigned events) {
+            if (events == mWantedEvents) {
+                return;
+            }
+#ifdef CONFIG_EPOLL
+            if (mInEpoll || !mWantedEvents) {
+                // Descriptors epoll refuses (e.g. regular files) fall back
+                // to the main loop handler list.
+                mInEpoll = asQemuLooper(mLooper)->epollUpdate(this, events);
+                if (mInEpoll) {
+                    mWantedEvents = events;
+                    if (!events) {
+                        mInEpoll = false;
+                    }
+                    return;
+                }
+            }
+#endif
             IOHandler* cbRead = (events & kEventRead) ? handleRead : NULL;
             IOHandler* cbWrite = (events & kEventWrite) ? handleWrite : NULL;
             qemu_set_fd_handler(mFd, cbRead, cbWrite, this);
@@ -165,6 +241,7 @@ public:
 
         unsigned mWantedEvents;
         unsigned mPendingEvents;
+        bool mInEpoll;
         ::android::base::TailQueueLink<FdWatch> mLink;
     };
 
@@ -178,68 +255,339 @@ public:
     //
     // T I M E R S
     //
+    // Looper timers don't map to individual QEMUTimers. Each clock has a
+    // hierarchical timer wheel with millisecond slots, so arming and
+    // disarming a timer is O(1) whatever the number of timers, and only
+    // one QEMUTimer per clock, armed at the wheel's next event, sits on the
+    // QEMU timer lists that qemu_clock_deadline_ns_all() looks at.
+    //
+    class TimerWheel;
+
     class Timer : public BaseTimer {
     public:
         Timer(QemuLooper* looper,
               BaseTimer::Callback callback,
               void* opaque, ClockType clock) :
                     BaseTimer(looper, callback, opaque, clock),
-                    mTimer(NULL) {
-            mTimer = ::timer_new(QemuLooper::toQemuClockType(mClockType),
-                                 SCALE_MS,
-                                 qemuTimerCallbackAdapter,
-                                 this);
+                    mWheel(looper->timerWheel(clock)),
+                    mDeadline(0),
+                    mNext(NULL),
+                    mPrev(NULL) {
         }
 
         ~Timer() {
-            ::timer_free(mTimer);
+            mWheel->remove(this);
         }
 
         virtual void startRelative(Duration timeout_ms) {
             if (timeout_ms == kDurationInfinite) {
-                timer_del(mTimer);
+                mWheel->remove(this);
             } else {
-                timeout_ms += qemu_clock_get_ms(
-                        QemuLooper::toQemuClockType(mClockType));
-                timer_mod(mTimer, timeout_ms);
+                mWheel->add(this, timeout_ms + mWheel->now());
             }
         }
 
         virtual void startAbsolute(Duration deadline_ms) {
             if (deadline_ms == kDurationInfinite) {
-                timer_del(mTimer);
+                mWheel->remove(this);
             } else {
-                timer_mod(mTimer, deadline_ms);
+                mWheel->add(this, deadline_ms);
             }
         }
 
         virtual void stop() {
-            ::timer_del(mTimer);
+            mWheel->remove(this);
         }
 
         virtual bool isActive() const {
-            return timer_pending(mTimer);
+            return mWheel->isActive(this);
         }
 
+        // Same format as timer_put()/timer_get() on a SCALE_MS QEMUTimer.
         void save(android::base::Stream* stream) const {
-            timer_put(
-                reinterpret_cast<android::qemu::QemuFileStream*>(stream)->file(),
-                mTimer);
+            QEMUFile* file =
+                reinterpret_cast<android::qemu::QemuFileStream*>(stream)->file();
+            Duration deadline;
+            qemu_put_be64(file, mWheel->deadline(this, &deadline)
+                                ? deadline * SCALE_MS : (uint64_t) -1);
         }
 
         void load(android::base::Stream* stream) {
-            timer_get(
-                reinterpret_cast<android::qemu::QemuFileStream*>(stream)->file(),
-                mTimer);
+            QEMUFile* file =
+                reinterpret_cast<android::qemu::QemuFileStream*>(stream)->file();
+            uint64_t expire_time = qemu_get_be64(file);
+            if (expire_time != (uint64_t) -1) {
+                mWheel->add(this, expire_time / SCALE_MS);
+            } else {
+                mWheel->remove(this);
+            }
         }
 
     private:
-        static void qemuTimerCallbackAdapter(void* opaque) {
-            Timer* timer = static_cast<Timer*>(opaque);
-            timer->mCallback(timer->mOpaque, timer);
+        friend class TimerWheel;
+
+        void fire() {
+            mCallback(mOpaque, this);
         }
 
-        QEMUTimer* mTimer;
+        TimerWheel* mWheel;
+        Duration mDeadline;
+        // Links in a wheel slot, |mPrev| is NULL when inactive.
+        Timer* mNext;
+        Timer** mPrev;
+    };
+
+    // Timers are hashed by deadline into 256 one millisecond slots, then
+    // three levels of 64 slots each covering 64 times the previous span;
+    // whenever the lowest level wraps around, the next slot of the level
+    // above is spread back into the ones below (see the classic Linux
+    // timer wheel). Deadlines further out than the wheel covers are kept
+    // in the last level and re-hashed each time they are cascaded.
+    //
+    // Timers may be armed from any thread, callbacks run on the main loop.
+    class TimerWheel {
+    public:
+        explicit TimerWheel(QEMUClockType clock) :
+                mClock(clock),
+                mQemuTimer(::timer_new_ms(clock, handleExpiry, this)),
+                mCurrent(qemu_clock_get_ms(clock)),
+                mCount(0),
+                mFiring(false) {
+            qemu_mutex_init(&mLock);
+            memset(mSlots, 0, sizeof(mSlots));
+        }
+
+        ~TimerWheel() {
+            DCHECK(!mCount);
+            ::timer_del(mQemuTimer);
+            ::timer_free(mQemuTimer);
+            qemu_mutex_destroy(&mLock);
+        }
+
+        Duration now() const {
+            return qemu_clock_get_ms(mClock);
+        }
+
+        void add(Timer* timer, Duration deadline) {
+            qemu_mutex_lock(&mLock);
+            if (timer->mPrev) {
+                unlink(timer);
+            }
+            if (!mCount) {
+                // Nothing to cascade, skip over the idle time at once.
+                mCurrent = now();
+            }
+            timer->mDeadline = deadline;
+            insert(timer);
+            // Arming past the current deadline is left to handleExpiry().
+            int64_t expire = MAX(deadline, mCurrent);
+            if (!timer_pending(mQemuTimer) ||
+                expire < (int64_t) timer_expire_time_ns(mQemuTimer) / SCALE_MS) {
+                timer_mod(mQemuTimer, expire);
+            }
+            qemu_mutex_unlock(&mLock);
+        }
+
+        void remove(Timer* timer) {
+            qemu_mutex_lock(&mLock);
+            if (timer->mPrev) {
+                unlink(timer);
+            }
+            // A now useless QEMUTimer wake up is cheaper than finding the
+            // next deadline here.
+            qemu_mutex_unlock(&mLock);
+        }
+
+        bool isActive(const Timer* timer) const {
+            return timer->mPrev != NULL;
+        }
+
+        bool deadline(const Timer* timer, Duration* deadline) {
+            qemu_mutex_lock(&mLock);
+            bool active = timer->mPrev != NULL;
+            *deadline = timer->mDeadline;
+            qemu_mutex_unlock(&mLock);
+            return active;
+        }
+
+    private:
+        static const int kRootBits = 8;
+        static const int kLevelBits = 6;
+        static const int kRootSize = 1 << kRootBits;
+        static const int kLevelSize = 1 << kLevelBits;
+        static const int kLevels = 3;
+        static const int kNumSlots = kRootSize + kLevels * kLevelSize;
+
+        static int levelShift(int level) {
+            return kRootBits + level * kLevelBits;
+        }
+
+        // Pick the slot for |timer| relative to |mCurrent|. Timers armed
+        // from a callback are due no earlier than the next slot, otherwise
+        // they would land in the slot being fired.
+        Timer** slotFor(const Timer* timer) {
+            int64_t expires = MAX(timer->mDeadline, mCurrent + mFiring);
+            int64_t delta = expires - mCurrent;
+
+            if (delta < kRootSize) {
+                return &mSlots[expires & (kRootSize - 1)];
+            }
+            for (int level = 0; level < kLevels; level++) {
+                if (level == kLevels - 1 ||
+                    delta < (INT64_C(1) << levelShift(level + 1))) {
+                    if (level == kLevels - 1 &&
+                        delta >= (INT64_C(1) << levelShift(kLevels))) {
+                        // Too far out, park it in the last level.
+                        expires = mCurrent +
+                                  (INT64_C(1) << levelShift(kLevels)) - 1;
+                    }
+                    int index = (expires >> levelShift(level)) &
+                                (kLevelSize - 1);
+                    return &mSlots[kRootSize + level * kLevelSize + index];
+                }
+            }
+            return NULL;  // not reached
+        }
+
+        void insert(Timer* timer) {
+            Timer** head = slotFor(timer);
+            timer->mNext = *head;
+            if (*head) {
+                (*head)->mPrev = &timer->mNext;
+            }
+            timer->mPrev = head;
+            *head = timer;
+            mCount++;
+        }
+
+        void unlink(Timer* timer) {
+            *timer->mPrev = timer->mNext;
+            if (timer->mNext) {
+                timer->mNext->mPrev = timer->mPrev;
+            }
+            timer->mNext = NULL;
+            timer->mPrev = NULL;
+            mCount--;
+        }
+
+        // Move all timers of a slot to |list|, keeping them counted.
+        static void detach(Timer** slot, Timer** list) {
+            *list = *slot;
+            *slot = NULL;
+            if (*list) {
+                (*list)->mPrev = list;
+            }
+        }
+
+        void rehash(Timer** list) {
+            while (*list) {
+                Timer* timer = *list;
+                unlink(timer);
+                insert(timer);
+            }
+        }
+
+        void cascade(int level) {
+            int index = (mCurrent >> levelShift(level)) & (kLevelSize - 1);
+            Timer* list;
+            detach(&mSlots[kRootSize + level * kLevelSize + index], &list);
+            rehash(&list);
+        }
+
+        // Re-hash every timer relative to |mCurrent|, used after jumps in
+        // time where walking slot by slot would take too long.
+        void rehashAll() {
+            Timer* all = NULL;
+            for (int n = 0; n < kNumSlots; n++) {
+                while (mSlots[n]) {
+                    Timer* timer = mSlots[n];
+                    unlink(timer);
+                    timer->mNext = all;
+                    if (all) {
+                        all->mPrev = &timer->mNext;
+                    }
+                    timer->mPrev = &all;
+                    all = timer;
+                    mCount++;
+                }
+            }
+            rehash(&all);
+        }
+
+        // Fire everything due up to |now|. Called with the lock held,
+        // which is dropped around each callback.
+        void run(Duration now) {
+            if (now - mCurrent >= kRootSize) {
+                mCurrent = now;
+                rehashAll();
+            }
+            while (mCount && mCurrent <= now) {
+                int index = mCurrent & (kRootSize - 1);
+                if (!index) {
+                    for (int level = 0; level < kLevels; level++) {
+                        cascade(level);
+                        if ((mCurrent >> levelShift(level)) &
+                            (kLevelSize - 1)) {
+                            break;
+                        }
+                    }
+                }
+
+                Timer* work;
+                detach(&mSlots[index], &work);
+                mFiring = true;
+                while (work) {
+                    Timer* timer = work;
+                    unlink(timer);
+                    qemu_mutex_unlock(&mLock);
+                    timer->fire();
+                    qemu_mutex_lock(&mLock);
+                }
+                mFiring = false;
+                mCurrent++;
+            }
+            if (!mCount) {
+                mCurrent = now;
+            }
+        }
+
+        // Next time the wheel needs attention: the first busy slot of the
+        // root level, or the next cascade if it is empty. When |mCurrent|
+        // is itself a cascade point, the root level isn't filled yet.
+        void rearm() {
+            if (!mCount) {
+                ::timer_del(mQemuTimer);
+                return;
+            }
+            int index = mCurrent & (kRootSize - 1);
+            int64_t next = mCurrent + (kRootSize - index);
+            if (!index) {
+                next = mCurrent;
+            }
+            for (int n = index; n < kRootSize && next > mCurrent; n++) {
+                if (mSlots[n]) {
+                    next = mCurrent + (n - index);
+                    break;
+                }
+            }
+            timer_mod(mQemuTimer, next);
+        }
+
+        static void handleExpiry(void* opaque) {
+            TimerWheel* wheel = static_cast<TimerWheel*>(opaque);
+            qemu_mutex_lock(&wheel->mLock);
+            wheel->run(wheel->now());
+            wheel->rearm();
+            qemu_mutex_unlock(&wheel->mLock);
+        }
+
+        QEMUClockType mClock;
+        QEMUTimer* mQemuTimer;
+        QemuMutex mLock;
+        int64_t mCurrent;   // next millisecond to process
+        unsigned mCount;    // timers in the wheel
+        bool mFiring;       // callbacks of slot |mCurrent| are running
+        Timer* mSlots[kNumSlots];
     };
 
     virtual BaseTimer* createTimer(BaseTimer::Callback callback,
@@ -247,6 +595,14 @@ public:
         return new QemuLooper::Timer(this, callback, opaque, clock);
     }
 
+    TimerWheel* timerWheel(ClockType clock) {
+        int type = toQemuClockType(clock);
+        if (!mTimerWheels[type]) {
+            mTimerWheels[type] = new TimerWheel(toQemuClockType(clock));
+        }
+        return mTimerWheels[type];
+    }
+
     //
     //  L O O P E R
     //
@@ -310,6 +666,60 @@ private:
         mPendingFdWatches.remove(watch);
     }
 
+    // Add, modify or remove |watch| in the epoll set so that it reports
+    // |events|. Returns false if epoll cannot be used for this watch, in
+    // which case nothing changed.
+    bool epollUpdate(FdWatch* watch, unsigned events) {
+#ifdef CONFIG_EPOLL
+        if (mEpollFd < 0) {
+            if (!events) {
+                return false;
+            }
+            mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+            if (mEpollFd < 0) {
+                return false;
+            }
+            qemu_set_fd_handler(mEpollFd, handleEpoll, NULL, this);
+        }
+
+        struct epoll_event ev = {};
+        ev.events = ((events & BaseFdWatch::kEventRead) ? EPOLLIN : 0) |
+                    ((events & BaseFdWatch::kEventWrite) ? EPOLLOUT : 0);
+        ev.data.ptr = watch;
+
+        int op;
+        if (!events) {
+            op = EPOLL_CTL_DEL;
+        } else if (!watch->wantedEvents()) {
+            op = EPOLL_CTL_ADD;
+        } else {
+            op = EPOLL_CTL_MOD;
+        }
+        return epoll_ctl(mEpollFd, op, watch->fd(), &ev) == 0;
+#else
+        return false;
+#endif
+    }
+
+#ifdef CONFIG_EPOLL
+    // Called by QEMU when the epoll set has ready descriptors. All ready
+    // watches are marked pending here and fired together from the
+    // bottom-half, so none of them can go away while we walk |events|.
+    static void handleEpoll(void* opaque) {
+        QemuLooper* looper = reinterpret_cast<QemuLooper*>(opaque);
+        struct epoll_event events[64];
+        int count;
+
+        do {
+            count = epoll_wait(looper->mEpollFd, events, ARRAY_SIZE(events), 0);
+            for (int n = 0; n < count; n++) {
+                static_cast<FdWatch*>(events[n].data.ptr)
+                        ->setPendingFromEpoll(events[n].events);
+            }
+        } while (count == (int) ARRAY_SIZE(events));
+    }
+#endif
+
     // Called by QEMU as soon as the main loop has finished processed
     // I/O events. Used to look at pending watches and fire them.
     static void handleBottomHalf(void* opaque) {
@@ -327,6 +737,312 @@ private:
     QEMUBH* mQemuBh;
     FdWatchList mPendingFdWatches;
     TimerSet mTimers;
+    int mEpollFd;
+    TimerWheel* mTimerWheels[QEMU_CLOCK_MAX];
+};
+
+// An implementation of android::base::Looper running on its own QEMU
+// IOThread, i.e. a dedicated thread polling a private AioContext, rather
+// than on the main loop. The rules are:
+//
+//  1/ Every instance owns a separate thread, created by the constructor
+//     and joined by the destructor. All FdWatch and Timer callbacks run
+//     on that thread, without the QEMU global mutex held.
+//
+//  2/ Watches and timers may be created, armed and destroyed from any
+//     thread; the AioContext lock serializes this with the poll loop.
+//     They must all be destroyed before the looper, and the looper must
+//     not be destroyed from one of its own callbacks.
+//
+//  3/ As with QemuLooper, runWithDeadlineMs() cannot be called.
+//
+// The pending FdWatch list and bottom-half work as in QemuLooper above,
+// except that the bottom-half belongs to the IOThread's AioContext.
+//
+class IoThreadLooper : public BaseLooper {
+public:
+    explicit IoThreadLooper(IOThread* thread) :
+            Looper(),
+            mThread(thread),
+            mContext(iothread_get_aio_context(thread)),
+            mBh(aio_bh_new(mContext, handleBottomHalf, this)),
+            mPendingFdWatches() {
+    }
+
+    virtual ~IoThreadLooper() {
+        qemu_bh_delete(mBh);
+        // Finalizing the IOThread stops and joins its thread.
+        object_unparent(OBJECT(mThread));
+    }
+
+    // Create a looper with a new IOThread named |name|, visible in
+    // 'query-iothreads'. Returns NULL on failure.
+    static IoThreadLooper* create(const char* name) {
+        Error* err = NULL;
+        Object* obj = object_new(TYPE_IOTHREAD);
+
+        user_creatable_complete(obj, &err);
+        if (!err) {
+            object_property_add_child(
+                    container_get(object_get_root(), "/objects"),
+                    name, obj, &err);
+        }
+        object_unref(obj);
+        if (err) {
+            error_report("Cannot create I/O thread '%s' for looper: %s",
+                         name, error_get_pretty(err));
+            error_free(err);
+            return NULL;
+        }
+        return new IoThreadLooper(IOTHREAD(obj));
+    }
+
+    //
+    // F D   W A T C H E S
+    //
+
+    class FdWatch : public BaseFdWatch {
+    public:
+        FdWatch(IoThreadLooper* looper,
+                int fd,
+                BaseFdWatch::Callback callback,
+                void* opaque) :
+                        BaseFdWatch(looper, fd, callback, opaque),
+                        mWantedEvents(0U),
+                        mPendingEvents(0U),
+                        mLink() {
+        }
+
+        virtual ~FdWatch() {
+            AioContext* ctx = context();
+            aio_context_acquire(ctx);
+            clearPending();
+            aio_set_fd_handler(ctx, mFd, NULL, NULL, NULL);
+            aio_context_release(ctx);
+        }
+
+        virtual void addEvents(unsigned events) {
+            events &= kEventMask;
+            updateEvents(mWantedEvents | events);
+        }
+
+        virtual void removeEvents(unsigned events) {
+            events &= kEventMask;
+            updateEvents(mWantedEvents & ~events);
+        }
+
+        virtual unsigned poll() const {
+            return mPendingEvents;
+        }
+
+        bool isPending() const {
+            return mPendingEvents != 0U;
+        }
+
+        void fire() {
+            DCHECK(mPendingEvents);
+            unsigned events = mPendingEvents;
+            mPendingEvents = 0U;
+            mCallback(mOpaque, mFd, events);
+        }
+
+        TAIL_QUEUE_LIST_TRAITS(Traits, FdWatch, mLink);
+
+    private:
+        AioContext* context() const {
+            return asIoThreadLooper(mLooper)->mContext;
+        }
+
+        void updateEvents(unsigned events) {
+            IOHandler* cbRead = (events & kEventRead) ? handleRead : NULL;
+            IOHandler* cbWrite = (events & kEventWrite) ? handleWrite : NULL;
+            AioContext* ctx = context();
+            aio_context_acquire(ctx);
+            aio_set_fd_handler(ctx, mFd, cbRead, cbWrite,
+                               (cbRead || cbWrite) ? this : NULL);
+            mWantedEvents = events;
+            aio_context_release(ctx);
+        }
+
+        void setPending(unsigned event) {
+            if (!mPendingEvents) {
+                asIoThreadLooper(mLooper)->addPendingFdWatch(this);
+            }
+            mPendingEvents |= event;
+        }
+
+        void clearPending() {
+            if (mPendingEvents) {
+                asIoThreadLooper(mLooper)->delPendingFdWatch(this);
+                mPendingEvents = 0;
+            }
+        }
+
+        // Called by aio_poll() on the I/O thread, with the context held.
+        static void handleRead(void* opaque) {
+            FdWatch* watch = static_cast<FdWatch*>(opaque);
+            watch->setPending(kEventRead);
+        }
+
+        static void handleWrite(void* opaque) {
+            FdWatch* watch = static_cast<FdWatch*>(opaque);
+            watch->setPending(kEventWrite);
+        }
+
+        unsigned mWantedEvents;
+        unsigned mPendingEvents;
+        ::android::base::TailQueueLink<FdWatch> mLink;
+    };
+
+    virtual BaseFdWatch* createFdWatch(int fd,
+                                       BaseFdWatch::Callback callback,
+                                       void* opaque) {
+        ::android::base::socketSetNonBlocking(fd);
+        return new FdWatch(this, fd, callback, opaque);
+    }
+
+    //
+    // T I M E R S
+    //
+    // QEMU timers are thread-safe and a timer list attached to an
+    // AioContext kicks its poll loop when re-armed, so these only differ
+    // from QemuLooper::Timer by the timer list they are created on.
+    //
+    class Timer : public BaseTimer {
+    public:
+        Timer(IoThreadLooper* looper,
+              BaseTimer::Callback callback,
+              void* opaque, ClockType clock) :
+                    BaseTimer(looper, callback, opaque, clock),
+                    mTimer(NULL) {
+            mTimer = ::aio_timer_new(looper->mContext,
+                                     QemuLooper::toQemuClockType(mClockType),
+                                     SCALE_MS,
+                                     timerCallbackAdapter,
+                                     this);
+        }
+
+        ~Timer() {
+            ::timer_del(mTimer);
+            ::timer_free(mTimer);
+        }
+
+        virtual void startRelative(Duration timeout_ms) {
+            if (timeout_ms == kDurationInfinite) {
+                timer_del(mTimer);
+            } else {
+                timeout_ms += qemu_clock_get_ms(
+                        QemuLooper::toQemuClockType(mClockType));
+                timer_mod(mTimer, timeout_ms);
+            }
+        }
+
+        virtual void startAbsolute(Duration deadline_ms) {
+            if (deadline_ms == kDurationInfinite) {
+                timer_del(mTimer);
+            } else {
+                timer_mod(mTimer, deadline_ms);
+            }
+        }
+
+        virtual void stop() {
+            ::timer_del(mTimer);
+        }
+
+        virtual bool isActive() const {
+            return timer_pending(mTimer);
+        }
+
+        void save(android::base::Stream* stream) const {
+            timer_put(
+                reinterpret_cast<android::qemu::QemuFileStream*>(stream)->file(),
+                mTimer);
+        }
+
+        void load(android::base::Stream* stream) {
+            timer_get(
+                reinterpret_cast<android::qemu::QemuFileStream*>(stream)->file(),
+                mTimer);
+        }
+
+    private:
+        static void timerCallbackAdapter(void* opaque) {
+            Timer* timer = static_cast<Timer*>(opaque);
+            timer->mCallback(timer->mOpaque, timer);
+        }
+
+        QEMUTimer* mTimer;
+    };
+
+    virtual BaseTimer* createTimer(BaseTimer::Callback callback,
+                                   void* opaque, ClockType clock) {
+        return new IoThreadLooper::Timer(this, callback, opaque, clock);
+    }
+
+    //
+    //  L O O P E R
+    //
+
+    virtual Duration nowMs(ClockType clockType) {
+        return qemu_clock_get_ms(QemuLooper::toQemuClockType(clockType));
+    }
+
+    virtual DurationNs nowNs(ClockType clockType) {
+        return qemu_clock_get_ns(QemuLooper::toQemuClockType(clockType));
+    }
+
+    virtual int runWithDeadlineMs(Duration deadline_ms) {
+        CHECK(false) << "User cannot call looper_run on an I/O thread looper";
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // Same meaning as for the main loop looper: quit the emulator.
+    virtual void forceQuit() {
+        qemu_system_shutdown_request();
+    }
+
+private:
+    typedef ::android::base::TailQueueList<IoThreadLooper::FdWatch> FdWatchList;
+
+    static inline IoThreadLooper* asIoThreadLooper(BaseLooper* looper) {
+        return reinterpret_cast<IoThreadLooper*>(looper);
+    }
+
+    // Both are called with the AioContext held.
+    void addPendingFdWatch(FdWatch* watch) {
+        DCHECK(watch);
+        DCHECK(!watch->isPending());
+
+        if (mPendingFdWatches.empty()) {
+            qemu_bh_schedule(mBh);
+        }
+        mPendingFdWatches.insertTail(watch);
+    }
+
+    void delPendingFdWatch(FdWatch* watch) {
+        DCHECK(watch);
+        DCHECK(watch->isPending());
+        mPendingFdWatches.remove(watch);
+    }
+
+    // Runs on the I/O thread once aio_poll() has dispatched fd events.
+    static void handleBottomHalf(void* opaque) {
+        IoThreadLooper* looper = reinterpret_cast<IoThreadLooper*>(opaque);
+        for (;;) {
+            FdWatch* watch = looper->mPendingFdWatches.front();
+            if (!watch) {
+                break;
+            }
+            looper->delPendingFdWatch(watch);
+            watch->fire();
+        }
+    }
+
+    IOThread* mThread;
+    AioContext* mContext;
+    QEMUBH* mBh;
+    FdWatchList mPendingFdWatches;
 };
 
 }  // namespace
@@ -335,6 +1051,10 @@ BaseLooper* createLooper() {
     return new QemuLooper();
 }
 
+BaseLooper* createIoThreadLooper(const char* name) {
+    return IoThreadLooper::create(name);
+}
+
 }  // namespace qemu
 }  // namespace android
 
@@ -23,5 +23,16 @@ namespace qemu {
 // are different instances!
 android::base::Looper* createLooper();
 
+// Create a new android::base::Looper instance that runs on its own QEMU
+// IOThread named |name| instead of the main event loop, so that the
+// component using it doesn't compete with device emulation. Returns NULL
+// if the thread cannot be created.
+//
+// Callbacks run on that thread WITHOUT the QEMU global mutex: they must
+// take qemu_mutex_lock_iothread() around any access to device, chardev or
+// main loop state, or hand the work over with a main loop bottom-half.
+// See IoThreadLooper in Looper.cpp for the lifetime rules.
+android::base::Looper* createIoThreadLooper(const char* name);
+
 }  // namespace qemu
 }  // namespace android
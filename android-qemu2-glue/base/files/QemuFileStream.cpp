@@ -13,6 +13,8 @@
 
 #include "android/base/Log.h"
 
+#include <algorithm>
+
 extern "C" {
 #include "qemu-common.h"
 #include "migration/qemu-file.h"
@@ -25,25 +27,57 @@ QemuFileStream::QemuFileStream(QEMUFile* file) : mFile(file) {}
 
 QemuFileStream::~QemuFileStream() {}
 
+// QEMUFile takes int lengths; larger transfers go in chunks.
+static const size_t kMaxChunk = 1 << 30;
+
 ssize_t QemuFileStream::read(void* buffer, size_t len) {
     DCHECK(static_cast<ssize_t>(len) >= 0);
-    DCHECK(static_cast<ssize_t>(len) == static_cast<int>(len));
-    return static_cast<ssize_t>(
-            qemu_get_buffer(mFile,
-                            static_cast<uint8_t*>(buffer),
-                            static_cast<int>(len)));
+    uint8_t* p = static_cast<uint8_t*>(buffer);
+    size_t done = 0;
+    while (done < len) {
+        int chunk = static_cast<int>(std::min(len - done, kMaxChunk));
+        int res = qemu_get_buffer(mFile, p + done, chunk);
+        done += res;
+        if (res < chunk) {
+            break;
+        }
+    }
+    return static_cast<ssize_t>(done);
 }
 
 ssize_t QemuFileStream::write(const void* buffer, size_t len) {
     DCHECK(static_cast<ssize_t>(len) >= 0);
-    DCHECK(static_cast<ssize_t>(len) == static_cast<int>(len));
-    qemu_put_buffer(mFile,
-                    static_cast<const uint8_t*>(buffer),
-                    static_cast<int>(len));
+    const uint8_t* p = static_cast<const uint8_t*>(buffer);
+    for (size_t done = 0; done < len; done += kMaxChunk) {
+        qemu_put_buffer(mFile, p + done,
+                        static_cast<int>(std::min(len - done, kMaxChunk)));
+    }
     // There is no way to know if all could be written, so always
     // return success here.
     return static_cast<ssize_t>(len);
 }
 
+const uint8_t* QemuFileStream::peek(size_t len) {
+    if (len > static_cast<size_t>(qemu_file_buffer_size(mFile))) {
+        return nullptr;
+    }
+    return qemu_peek_buffer_in_place(mFile, static_cast<int>(len));
+}
+
+void QemuFileStream::skip(size_t len) {
+    qemu_file_skip(mFile, static_cast<int>(len));
+}
+
+uint8_t* QemuFileStream::reserve(size_t len) {
+    if (len > static_cast<size_t>(qemu_file_buffer_size(mFile))) {
+        return nullptr;
+    }
+    return qemu_put_reserve(mFile, static_cast<int>(len));
+}
+
+void QemuFileStream::commit(size_t len) {
+    qemu_put_commit(mFile, static_cast<int>(len));
+}
+
 }  // namespace qemu
 }  // namespace android
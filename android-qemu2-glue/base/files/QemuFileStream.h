@@ -29,6 +29,17 @@ public:
     virtual ssize_t read(void* buffer, size_t len);
     virtual ssize_t write(const void* buffer, size_t len);
 
+    // Zero-copy access to the QEMUFile buffer, for callers that serialize
+    // many small values or want to parse data where it lies. peek() returns
+    // the next |len| bytes without consuming them, skip() consumes them.
+    // reserve() returns room for |len| bytes to fill in place, commit()
+    // adds them to the stream. Both return nullptr if |len| doesn't fit
+    // in the buffer, in which case use read() / write().
+    const uint8_t* peek(size_t len);
+    void skip(size_t len);
+    uint8_t* reserve(size_t len);
+    void commit(size_t len);
+
     QEMUFile* file() const { return mFile; }
 
 private:
@@ -26,12 +26,14 @@ LOCAL_SRC_FILES := \
     qemu-user-event-agent-impl.c \
     qemu-vm-operations-impl.c \
     qemu-window-agent-impl.c \
+    zygote.c \
     utils/stream.cpp \
     base/async/Looper.cpp \
     base/files/QemuFileStream.cpp \
     emulation/charpipe.c \
     emulation/CharSerialLine.cpp \
     emulation/serial_line.cpp \
+    emulation/ThreadedSerialLine.cpp \
     telephony/modem_init.c \
 
 LOCAL_SRC_FILES := $(LOCAL_SRC_FILES:%=android-qemu2-glue/%)
@@ -26,11 +26,13 @@ QEMU2_COMMON_SOURCES := \
     block/cloop.c \
     block/commit.c \
     block/dmg.c \
+    block/host-throttle.c \
     block/mirror.c \
     block/nbd-client.c \
     block/nbd.c \
     block/null.c \
     block/parallels.c \
+    block/prefetch.c \
     block/qapi.c \
     block/qcow.c \
     block/qcow2-cache.c \
@@ -55,6 +57,7 @@ QEMU2_COMMON_SOURCES := \
     blockdev-nbd.c \
     blockdev.c \
     blockjob.c \
+    boot-timeline.c \
     bt-host.c \
     bt-vhci.c \
     device-hotplug.c \
@@ -86,6 +89,7 @@ QEMU2_COMMON_SOURCES := \
     hw/core/fw-path-provider.c \
     hw/core/hotplug.c \
     hw/core/irq.c \
+    hw/core/irqfd-line.c \
     hw/core/loader.c \
     hw/core/machine.c \
     hw/core/nmi.c \
@@ -97,6 +101,7 @@ QEMU2_COMMON_SOURCES := \
     hw/core/sysbus.c \
     hw/display/framebuffer.c \
     hw/display/goldfish_fb.c \
+    hw/display/goldfish_fb_simd.c \
     hw/i2c/core.c \
     hw/i2c/smbus.c \
     hw/i2c/smbus_eeprom.c \
@@ -217,6 +222,7 @@ QEMU2_COMMON_SOURCES := \
     slirp/arp_table.c \
     slirp/bootp.c \
     slirp/cksum.c \
+    slirp/dnscache.c \
     slirp/dnssearch.c \
     slirp/if.c \
     slirp/ip_icmp.c \
@@ -234,6 +240,7 @@ QEMU2_COMMON_SOURCES := \
     slirp/tftp.c \
     slirp/udp.c \
     tcg-runtime.c \
+    thread-affinity.c \
     thread-pool.c \
     tpm.c \
     ui/android-gpu-frame-bridge.c \
@@ -241,6 +248,7 @@ QEMU2_COMMON_SOURCES := \
     ui/console.c \
     ui/cursor.c \
     ui/d3des.c \
+    ui/frame-capture.c \
     ui/input-keymap.c \
     ui/input-legacy.c \
     ui/input.c \
@@ -263,10 +271,25 @@ QEMU2_COMMON_SOURCES_linux-x86_64 := \
     audio/paaudio.c \
     backends/hostmem-file.c \
     backends/rng-random.c \
+    block/linux-aio.c \
+    block/mmap.c \
     block/raw-posix.c \
     coroutine-ucontext.c \
-    fsdev/qemu-fsdev-dummy.c \
     fsdev/qemu-fsdev-opts.c \
+    fsdev/qemu-fsdev.c \
+    fsdev/virtio-9p-marshal.c \
+    hw/9pfs/codir.c \
+    hw/9pfs/cofile.c \
+    hw/9pfs/cofs.c \
+    hw/9pfs/coxattr.c \
+    hw/9pfs/virtio-9p-coth.c \
+    hw/9pfs/virtio-9p-local.c \
+    hw/9pfs/virtio-9p-posix-acl.c \
+    hw/9pfs/virtio-9p-proxy.c \
+    hw/9pfs/virtio-9p-synth.c \
+    hw/9pfs/virtio-9p-xattr-user.c \
+    hw/9pfs/virtio-9p-xattr.c \
+    hw/9pfs/virtio-9p.c \
     hw/tpm/tpm_passthrough.c \
     hw/usb/dev-mtp.c \
     migration-exec.c \
@@ -294,10 +317,25 @@ QEMU2_COMMON_SOURCES_linux-x86 := \
     audio/paaudio.c \
     backends/hostmem-file.c \
     backends/rng-random.c \
+    block/linux-aio.c \
+    block/mmap.c \
     block/raw-posix.c \
     coroutine-ucontext.c \
-    fsdev/qemu-fsdev-dummy.c \
     fsdev/qemu-fsdev-opts.c \
+    fsdev/qemu-fsdev.c \
+    fsdev/virtio-9p-marshal.c \
+    hw/9pfs/codir.c \
+    hw/9pfs/cofile.c \
+    hw/9pfs/cofs.c \
+    hw/9pfs/coxattr.c \
+    hw/9pfs/virtio-9p-coth.c \
+    hw/9pfs/virtio-9p-local.c \
+    hw/9pfs/virtio-9p-posix-acl.c \
+    hw/9pfs/virtio-9p-proxy.c \
+    hw/9pfs/virtio-9p-synth.c \
+    hw/9pfs/virtio-9p-xattr-user.c \
+    hw/9pfs/virtio-9p-xattr.c \
+    hw/9pfs/virtio-9p.c \
     hw/tpm/tpm_passthrough.c \
     hw/usb/dev-mtp.c \
     migration-exec.c \
@@ -323,6 +361,7 @@ QEMU2_COMMON_SOURCES_darwin-x86_64 := \
     aio-posix.c \
     audio/coreaudio.c \
     backends/rng-random.c \
+    block/mmap.c \
     block/raw-posix.c \
     coroutine-sigaltstack.c \
     hw/usb/dev-mtp.c \
@@ -380,6 +419,8 @@ QEMU2_TARGET_SOURCES := \
     tcg/optimize.c \
     tcg/tcg.c \
     translate-all.c \
+    vcpu-exits.c \
+    vcpu-profile.c \
     vl.c \
     xen-common-stub.c \
     xen-hvm-stub.c \
@@ -387,6 +428,7 @@ QEMU2_TARGET_SOURCES := \
 QEMU2_TARGET_aarch64_SOURCES := \
     disas/arm.c \
     hax-stub.c \
+    hvf-stub.c \
     hw/arm/allwinner-a10.c \
     hw/arm/armv7m.c \
     hw/arm/boot.c \
@@ -552,6 +594,7 @@ QEMU2_TARGET_aarch64_SOURCES := \
     target-arm/psci.c \
     target-arm/translate-a64.c \
     target-arm/translate.c \
+    whpx-stub.c \
 
 QEMU2_TARGET_x86_64_SOURCES := \
     hw/acpi/acpi_interface.c \
@@ -722,6 +765,7 @@ QEMU2_TARGET_i386_SOURCES := \
 QEMU2_TARGET_mipsel_SOURCES := \
     disas/mips.c \
     hax-stub.c \
+    hvf-stub.c \
     hw/acpi/acpi_interface.c \
     hw/acpi/core.c \
     hw/acpi/cpu_hotplug.c \
@@ -785,10 +829,12 @@ QEMU2_TARGET_mipsel_SOURCES := \
     target-mips/msa_helper.c \
     target-mips/op_helper.c \
     target-mips/translate.c \
+    whpx-stub.c \
 
 QEMU2_TARGET_mips64el_SOURCES := \
     disas/mips.c \
     hax-stub.c \
+    hvf-stub.c \
     hw/acpi/acpi_interface.c \
     hw/acpi/core.c \
     hw/acpi/cpu_hotplug.c \
@@ -856,8 +902,10 @@ QEMU2_TARGET_mips64el_SOURCES := \
     target-mips/msa_helper.c \
     target-mips/op_helper.c \
     target-mips/translate.c \
+    whpx-stub.c \
 
 QEMU2_TARGET_aarch64_SOURCES_linux-x86_64 := \
+    hw/9pfs/virtio-9p-device.c \
     hw/misc/vfio.c \
     hw/scsi/vhost-scsi.c \
     hw/virtio/vhost-backend.c \
@@ -867,6 +915,7 @@ QEMU2_TARGET_aarch64_SOURCES_linux-x86_64 := \
 QEMU2_TARGET_aarch64_SOURCES_windows-x86_64 := \
 
 QEMU2_TARGET_aarch64_SOURCES_linux-x86 := \
+    hw/9pfs/virtio-9p-device.c \
     hw/misc/vfio.c \
     hw/scsi/vhost-scsi.c \
     hw/virtio/vhost-backend.c \
@@ -879,6 +928,8 @@ QEMU2_TARGET_aarch64_SOURCES_darwin-x86_64 := \
 
 QEMU2_TARGET_x86_64_SOURCES_linux-x86_64 := \
     hax-stub.c \
+    hvf-stub.c \
+    hw/9pfs/virtio-9p-device.c \
     hw/i386/kvm/apic.c \
     hw/i386/kvm/clock.c \
     hw/i386/kvm/i8254.c \
@@ -893,16 +944,21 @@ QEMU2_TARGET_x86_64_SOURCES_linux-x86_64 := \
     hw/virtio/vhost.c \
     kvm-all.c \
     target-i386/kvm.c \
+    whpx-stub.c \
 
 QEMU2_TARGET_x86_64_SOURCES_windows-x86_64 := \
+    hvf-stub.c \
     kvm-stub.c \
     target-i386/hax-all.c \
     target-i386/hax-slot.c \
     target-i386/hax-windows.c \
     target-i386/kvm-stub.c \
+    target-i386/whpx-all.c \
 
 QEMU2_TARGET_x86_64_SOURCES_linux-x86 := \
     hax-stub.c \
+    hvf-stub.c \
+    hw/9pfs/virtio-9p-device.c \
     hw/i386/kvm/apic.c \
     hw/i386/kvm/clock.c \
     hw/i386/kvm/i8254.c \
@@ -917,23 +973,31 @@ QEMU2_TARGET_x86_64_SOURCES_linux-x86 := \
     hw/virtio/vhost.c \
     kvm-all.c \
     target-i386/kvm.c \
+    whpx-stub.c \
 
 QEMU2_TARGET_x86_64_SOURCES_windows-x86 := \
+    hvf-stub.c \
     kvm-stub.c \
     target-i386/hax-all.c \
     target-i386/hax-slot.c \
     target-i386/hax-windows.c \
     target-i386/kvm-stub.c \
+    target-i386/whpx-all.c \
 
 QEMU2_TARGET_x86_64_SOURCES_darwin-x86_64 := \
     kvm-stub.c \
     target-i386/hax-all.c \
     target-i386/hax-darwin.c \
     target-i386/hax-slot.c \
+    target-i386/hvf-all.c \
+    target-i386/hvf-decode.c \
     target-i386/kvm-stub.c \
+    whpx-stub.c \
 
 QEMU2_TARGET_i386_SOURCES_linux-x86_64 := \
     hax-stub.c \
+    hvf-stub.c \
+    hw/9pfs/virtio-9p-device.c \
     hw/i386/kvm/apic.c \
     hw/i386/kvm/clock.c \
     hw/i386/kvm/i8254.c \
@@ -948,16 +1012,21 @@ QEMU2_TARGET_i386_SOURCES_linux-x86_64 := \
     hw/virtio/vhost.c \
     kvm-all.c \
     target-i386/kvm.c \
+    whpx-stub.c \
 
 QEMU2_TARGET_i386_SOURCES_windows-x86_64 := \
+    hvf-stub.c \
     kvm-stub.c \
     target-i386/hax-all.c \
     target-i386/hax-slot.c \
     target-i386/hax-windows.c \
     target-i386/kvm-stub.c \
+    target-i386/whpx-all.c \
 
 QEMU2_TARGET_i386_SOURCES_linux-x86 := \
     hax-stub.c \
+    hvf-stub.c \
+    hw/9pfs/virtio-9p-device.c \
     hw/i386/kvm/apic.c \
     hw/i386/kvm/clock.c \
     hw/i386/kvm/i8254.c \
@@ -972,22 +1041,29 @@ QEMU2_TARGET_i386_SOURCES_linux-x86 := \
     hw/virtio/vhost.c \
     kvm-all.c \
     target-i386/kvm.c \
+    whpx-stub.c \
 
 QEMU2_TARGET_i386_SOURCES_windows-x86 := \
+    hvf-stub.c \
     kvm-stub.c \
     target-i386/hax-all.c \
     target-i386/hax-slot.c \
     target-i386/hax-windows.c \
     target-i386/kvm-stub.c \
+    target-i386/whpx-all.c \
 
 QEMU2_TARGET_i386_SOURCES_darwin-x86_64 := \
     kvm-stub.c \
     target-i386/hax-all.c \
     target-i386/hax-darwin.c \
     target-i386/hax-slot.c \
+    target-i386/hvf-all.c \
+    target-i386/hvf-decode.c \
     target-i386/kvm-stub.c \
+    whpx-stub.c \
 
 QEMU2_TARGET_mipsel_SOURCES_linux-x86_64 := \
+    hw/9pfs/virtio-9p-device.c \
     hw/misc/vfio.c \
     hw/scsi/vhost-scsi.c \
     hw/virtio/vhost-backend.c \
@@ -997,6 +1073,7 @@ QEMU2_TARGET_mipsel_SOURCES_linux-x86_64 := \
 QEMU2_TARGET_mipsel_SOURCES_windows-x86_64 := \
 
 QEMU2_TARGET_mipsel_SOURCES_linux-x86 := \
+    hw/9pfs/virtio-9p-device.c \
     hw/misc/vfio.c \
     hw/scsi/vhost-scsi.c \
     hw/virtio/vhost-backend.c \
@@ -1008,6 +1085,7 @@ QEMU2_TARGET_mipsel_SOURCES_windows-x86 := \
 QEMU2_TARGET_mipsel_SOURCES_darwin-x86_64 := \
 
 QEMU2_TARGET_mips64el_SOURCES_linux-x86_64 := \
+    hw/9pfs/virtio-9p-device.c \
     hw/misc/vfio.c \
     hw/scsi/vhost-scsi.c \
     hw/virtio/vhost-backend.c \
@@ -1017,6 +1095,7 @@ QEMU2_TARGET_mips64el_SOURCES_linux-x86_64 := \
 QEMU2_TARGET_mips64el_SOURCES_windows-x86_64 := \
 
 QEMU2_TARGET_mips64el_SOURCES_linux-x86 := \
+    hw/9pfs/virtio-9p-device.c \
     hw/misc/vfio.c \
     hw/scsi/vhost-scsi.c \
     hw/virtio/vhost-backend.c \
@@ -87,6 +87,8 @@ LOCAL_LDLIBS += \
     -lfdt \
     $(call qemu2-if-windows, -lvfw32) \
     $(call qemu2-if-linux, -lpulse) \
+    $(call qemu2-if-darwin, \
+        $(call qemu2-if-target,x86 x86_64, -weak_framework Hypervisor)) \
     $(ANDROID_EMU_LDLIBS) \
     $(EMULATOR_LIBUI_LDLIBS) \
 
@@ -185,6 +185,10 @@ LOCAL_SRC_FILES += \
     util/getauxval.c \
     util/readline.c \
     util/rfifolock.c \
+    util/rcu.c \
+    util/qht.c \
+    util/metrics.c \
+    util/metrics-server.c \
     $(call qemu2-if-windows, \
         util/shared-library-win32.c \
         ) \
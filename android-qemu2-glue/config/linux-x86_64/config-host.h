@@ -35,6 +35,8 @@
 #define CONFIG_POSIX_FALLOCATE 1
 #define CONFIG_SYNC_FILE_RANGE 1
 #define CONFIG_FIEMAP 1
+#define CONFIG_LINUX_AIO 1
+#define CONFIG_VIRTFS 1
 #define CONFIG_DUP3 1
 #define CONFIG_PPOLL 1
 #define CONFIG_PRCTL_PR_SET_TIMERSLACK 1
@@ -64,6 +66,10 @@
 #define CONFIG_PRAGMA_DIAGNOSTIC_AVAILABLE 1
 #define CONFIG_HAS_ENVIRON 1
 #define CONFIG_CPUID_H 1
+#define CONFIG_AVX2_OPT 1
+#define CONFIG_SSE42_OPT 1
+#define CONFIG_AESNI_OPT 1
+#define CONFIG_SHANI_OPT 1
 #define CONFIG_INT128 1
 #define CONFIG_TPM $(CONFIG_SOFTMMU)
 #define CONFIG_TPM_PASSTHROUGH 1
@@ -7,6 +7,12 @@
 #else
 #define CONFIG_HAX 1
 #endif
+#ifdef _WIN32
+#define CONFIG_WHPX 1
+#endif
+#ifdef __APPLE__
+#define CONFIG_HVF 1
+#endif
 #define CONFIG_SOFTMMU 1
 #define CONFIG_I386_DIS 1
 #define CONFIG_I386_DIS 1
@@ -34,6 +34,10 @@
 #define CONFIG_COROUTINE_POOL 1
 #define CONFIG_PRAGMA_DIAGNOSTIC_AVAILABLE 1
 #define CONFIG_CPUID_H 1
+#define CONFIG_AVX2_OPT 1
+#define CONFIG_SSE42_OPT 1
+#define CONFIG_AESNI_OPT 1
+#define CONFIG_SHANI_OPT 1
 #define CONFIG_INT128 1
 #define CONFIG_TPM $(CONFIG_SOFTMMU)
 #define CONFIG_TRACE_NOP 1
@@ -0,0 +1,184 @@
+// Copyright 2016 The Android Open Source Project
+//
+// This software is licensed under the terms of the GNU General Public
+// License version 2, as published by the Free Software Foundation, and
+// may be copied, distributed, and modified under those terms.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+#include "android-qemu2-glue/emulation/ThreadedSerialLine.h"
+
+extern "C" {
+#include "qemu-common.h"
+#include "qemu/main-loop.h"
+}
+
+#include <algorithm>
+
+namespace android {
+namespace qemu2 {
+
+using android::base::Looper;
+
+// Input queued for the client before the line stops accepting more.
+static const size_t kMaxInput = 64 * 1024;
+
+// How long to wait before offering input again to a client that had no
+// room for it.
+static const Looper::Duration kInputRetryMs = 10;
+
+ThreadedSerialLine::ThreadedSerialLine(android::SerialLine* line,
+                                       Looper* looper) :
+        mLine(line),
+        mInputTimer(looper->createTimer(onInput, this,
+                                        Looper::ClockType::kHost)),
+        mOutputBh(qemu_bh_new(onOutput, this)),
+        mOpaque(nullptr),
+        mCanRead(nullptr),
+        mRead(nullptr),
+        mInput(),
+        mOutput() {
+    qemu_mutex_init(&mLock);
+    mLine->addHandlers(this, lineCanRead, lineRead);
+}
+
+ThreadedSerialLine::~ThreadedSerialLine() {
+    mLine->addHandlers(nullptr, nullptr, nullptr);
+    qemu_bh_delete(mOutputBh);
+    mInputTimer.reset();
+    qemu_mutex_destroy(&mLock);
+}
+
+void ThreadedSerialLine::addHandlers(void* opaque,
+                                     CanReadFunc canReadFunc,
+                                     ReadFunc readFunc) {
+    qemu_mutex_lock(&mLock);
+    mOpaque = opaque;
+    mCanRead = canReadFunc;
+    mRead = readFunc;
+    const bool pending = !mInput.empty();
+    qemu_mutex_unlock(&mLock);
+
+    // Whatever arrived before there was a client to read it.
+    if (readFunc && pending) {
+        mInputTimer->startRelative(0);
+    }
+}
+
+int ThreadedSerialLine::write(const uint8_t* data, int len) {
+    if (len <= 0) {
+        return 0;
+    }
+    qemu_mutex_lock(&mLock);
+    mOutput.insert(mOutput.end(), data, data + len);
+    qemu_mutex_unlock(&mLock);
+
+    qemu_bh_schedule(mOutputBh);
+    return len;
+}
+
+// static
+int ThreadedSerialLine::lineCanRead(void* opaque) {
+    ThreadedSerialLine* sl = static_cast<ThreadedSerialLine*>(opaque);
+
+    qemu_mutex_lock(&sl->mLock);
+    const size_t queued = sl->mInput.size();
+    qemu_mutex_unlock(&sl->mLock);
+
+    return queued < kMaxInput ? (int)(kMaxInput - queued) : 0;
+}
+
+// static
+void ThreadedSerialLine::lineRead(void* opaque, const uint8_t* data,
+                                  int len) {
+    ThreadedSerialLine* sl = static_cast<ThreadedSerialLine*>(opaque);
+
+    qemu_mutex_lock(&sl->mLock);
+    const bool wasEmpty = sl->mInput.empty();
+    sl->mInput.insert(sl->mInput.end(), data, data + len);
+    const bool haveClient = sl->mRead != nullptr;
+    qemu_mutex_unlock(&sl->mLock);
+
+    // Otherwise the client is already due to look at the queue.
+    if (wasEmpty && haveClient) {
+        sl->mInputTimer->startRelative(0);
+    }
+}
+
+// static
+void ThreadedSerialLine::onInput(void* opaque, Looper::Timer* timer) {
+    ThreadedSerialLine* sl = static_cast<ThreadedSerialLine*>(opaque);
+    std::vector<uint8_t> input;
+
+    qemu_mutex_lock(&sl->mLock);
+    input.swap(sl->mInput);
+    void* clientOpaque = sl->mOpaque;
+    CanReadFunc canRead = sl->mCanRead;
+    ReadFunc read = sl->mRead;
+    qemu_mutex_unlock(&sl->mLock);
+
+    const bool wasFull = input.size() >= kMaxInput;
+    size_t pos = 0;
+    if (read) {
+        while (pos < input.size()) {
+            size_t len = input.size() - pos;
+            if (canRead) {
+                const int room = canRead(clientOpaque);
+                if (room <= 0) {
+                    break;
+                }
+                len = std::min(len, (size_t)room);
+            }
+            read(clientOpaque, &input[pos], (int)len);
+            pos += len;
+        }
+    }
+
+    if (pos < input.size()) {
+        // Keep the rest ahead of anything that came in meanwhile.
+        qemu_mutex_lock(&sl->mLock);
+        sl->mInput.insert(sl->mInput.begin(), input.begin() + pos,
+                          input.end());
+        qemu_mutex_unlock(&sl->mLock);
+        if (read) {
+            timer->startRelative(kInputRetryMs);
+        }
+    }
+
+    // The main loop stopped reading from the line, let it try again.
+    if (wasFull && pos > 0) {
+        qemu_notify_event();
+    }
+}
+
+// static
+void ThreadedSerialLine::onOutput(void* opaque) {
+    ThreadedSerialLine* sl = static_cast<ThreadedSerialLine*>(opaque);
+    std::vector<uint8_t> output;
+
+    qemu_mutex_lock(&sl->mLock);
+    output.swap(sl->mOutput);
+    qemu_mutex_unlock(&sl->mLock);
+
+    if (output.empty()) {
+        return;
+    }
+
+    int written = sl->mLine->write(output.data(), (int)output.size());
+    if (written < 0) {
+        written = 0;
+    }
+    if ((size_t)written < output.size()) {
+        // Tried again with the next write().
+        qemu_mutex_lock(&sl->mLock);
+        sl->mOutput.insert(sl->mOutput.begin(), output.begin() + written,
+                           output.end());
+        qemu_mutex_unlock(&sl->mLock);
+    }
+}
+
+}  // namespace qemu2
+}  // namespace android
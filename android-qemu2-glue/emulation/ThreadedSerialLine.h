@@ -0,0 +1,77 @@
+// Copyright 2016 The Android Open Source Project
+//
+// This software is licensed under the terms of the GNU General Public
+// License version 2, as published by the Free Software Foundation, and
+// may be copied, distributed, and modified under those terms.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+#pragma once
+
+#include "android/base/Compiler.h"
+#include "android/base/async/Looper.h"
+#include "android/emulation/SerialLine.h"
+
+extern "C" {
+#include "qemu/thread.h"
+#include "qemu/typedefs.h"
+}
+
+#include <memory>
+#include <vector>
+
+namespace android {
+namespace qemu2 {
+
+// A SerialLine whose client lives on another thread than the line it
+// stands for. |line| is still read and written from the QEMU main loop,
+// while the handlers given to addHandlers() are called on |looper|'s
+// thread, typically an I/O thread looper. Data goes through a queue in
+// each direction, so neither side ever waits for the other.
+//
+// write() may be called from any thread, it only queues the data and
+// returns. The object must be created, and destroyed, on the main loop.
+class ThreadedSerialLine : public android::SerialLine {
+public:
+    // Does not take ownership of |line|.
+    ThreadedSerialLine(android::SerialLine* line,
+                       android::base::Looper* looper);
+
+    ~ThreadedSerialLine();
+
+    virtual void addHandlers(void* opaque, CanReadFunc canReadFunc,
+                             ReadFunc readFunc);
+
+    virtual int write(const uint8_t* data, int len);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ThreadedSerialLine);
+
+    // Called from the main loop for data coming from |mLine|.
+    static int lineCanRead(void* opaque);
+    static void lineRead(void* opaque, const uint8_t* data, int len);
+
+    // Hands queued input to the client, on the looper's thread.
+    static void onInput(void* opaque, android::base::Looper::Timer* timer);
+
+    // Writes queued output to |mLine|, in a main loop bottom-half.
+    static void onOutput(void* opaque);
+
+    android::SerialLine* mLine;
+    std::unique_ptr<android::base::Looper::Timer> mInputTimer;
+    QEMUBH* mOutputBh;
+
+    // Protects everything below.
+    QemuMutex mLock;
+    void* mOpaque;
+    CanReadFunc mCanRead;
+    ReadFunc mRead;
+    std::vector<uint8_t> mInput;
+    std::vector<uint8_t> mOutput;
+};
+
+}  // namespace qemu2
+}  // namespace android
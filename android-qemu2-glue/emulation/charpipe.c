@@ -10,8 +10,9 @@
 ** GNU General Public License for more details.
 */
 #include "android/utils/debug.h"
-#include "android/utils/cbuffer.h"
 #include "sysemu/char.h"
+#include "qemu/atomic.h"
+#include "qemu/main-loop.h"
 
 #define  xxDEBUG
 
@@ -32,46 +33,164 @@
  *
  */
 
-#define  BIP_BUFFER_SIZE  512
+/* Data that could not be delivered right away is queued in a chain of
+ * single-producer, single-consumer rings.  The producer, whoever writes
+ * to the char driver and thus holds its chr_write_lock, only touches the
+ * last ring of the chain and its |head|.  The consumer, charpipe_poll()
+ * in the main loop, only touches the first ring and its |tail|.  Neither
+ * needs a lock, so writers may run in any thread.
+ *
+ * A full ring is never overwritten: the producer links a larger one after
+ * it and carries on there.  Once the consumer has drained a ring that has
+ * a successor, the producer is done with it and the consumer frees it.
+ */
+
+#define  CHAR_RING_MIN_SIZE  4096
+#define  CHAR_RING_MAX_SIZE  65536
+
+typedef struct CharRing {
+    struct CharRing*  next;
+    unsigned          size;     /* a power of 2 */
+    unsigned          head;     /* bytes ever written, by the producer */
+    unsigned          tail;     /* bytes ever read, by the consumer */
+    uint8_t           data[];
+} CharRing;
+
+typedef struct CharRingChain {
+    CharRing*  first;           /* the consumer's ring */
+    CharRing*  last;            /* the producer's ring */
+} CharRingChain;
+
+static CharRing*
+char_ring_new( unsigned  size )
+{
+    CharRing*  r = g_malloc( sizeof(*r) + size );
+
+    r->next = NULL;
+    r->size = size;
+    r->head = 0;
+    r->tail = 0;
+    return r;
+}
 
-typedef struct BipBuffer {
-    struct BipBuffer*  next;
-    CBuffer            cb[1];
-    char               buff[ BIP_BUFFER_SIZE ];
-} BipBuffer;
+static void
+char_ring_chain_init( CharRingChain*  chain )
+{
+    chain->first = chain->last = char_ring_new( CHAR_RING_MIN_SIZE );
+}
 
-static BipBuffer*  _free_bip_buffers;
+static void
+char_ring_chain_free( CharRingChain*  chain )
+{
+    CharRing*  r = chain->first;
 
-static BipBuffer*
-bip_buffer_alloc( void )
+    while (r != NULL) {
+        CharRing*  next = r->next;
+        g_free(r);
+        r = next;
+    }
+    chain->first = chain->last = NULL;
+}
+
+/* producer side: is there anything queued at all? */
+static int
+char_ring_chain_empty( CharRingChain*  chain )
 {
-    BipBuffer*  bip = _free_bip_buffers;
-    if (bip != NULL) {
-        _free_bip_buffers = bip->next;
-    } else {
-        bip = malloc( sizeof(*bip) );
-        if (bip == NULL) {
-            derror( "%s: not enough memory", __FUNCTION__ );
-            exit(1);
+    CharRing*  r = chain->last;
+
+    return r == atomic_read(&chain->first) &&
+           atomic_read(&r->tail) == r->head;
+}
+
+/* producer side: queue |len| bytes, all of them */
+static void
+char_ring_chain_write( CharRingChain*  chain, const uint8_t*  buf, int  len )
+{
+    CharRing*  r = chain->last;
+
+    while (len > 0) {
+        /* the consumer must be done with the bytes before we reuse them */
+        unsigned  tail = atomic_mb_read(&r->tail);
+        unsigned  room = r->size - (r->head - tail);
+        unsigned  offset, n;
+
+        if (room == 0) {
+            CharRing*  next = char_ring_new( MIN(r->size * 2,
+                                                 CHAR_RING_MAX_SIZE) );
+
+            /* everything written to |r| is visible before |next| */
+            smp_wmb();
+            atomic_set(&r->next, next);
+            chain->last = r = next;
+            continue;
         }
+
+        offset = r->head & (r->size - 1);
+        n = MIN((unsigned)len, MIN(room, r->size - offset));
+        memcpy( r->data + offset, buf, n );
+        smp_wmb();
+        atomic_set(&r->head, r->head + n);
+        buf += n;
+        len -= n;
     }
-    bip->next = NULL;
-    cbuffer_reset( bip->cb, bip->buff, sizeof(bip->buff) );
-    return bip;
 }
 
+/* consumer side: point |iov| at the oldest queued bytes, which may take
+ * two segments if they wrap around, and return how many there are */
+static int
+char_ring_chain_peek( CharRingChain*  chain, struct iovec  iov[2],
+                      int*  iovcnt )
+{
+    CharRing*  r = chain->first;
+
+    for (;;) {
+        unsigned  head = atomic_read(&r->head);
+        unsigned  avail, offset, first;
+        CharRing* next;
+
+        smp_rmb();
+        avail = head - r->tail;
+        if (avail > 0) {
+            offset = r->tail & (r->size - 1);
+            first  = MIN(avail, r->size - offset);
+            iov[0].iov_base = r->data + offset;
+            iov[0].iov_len  = first;
+            iov[1].iov_base = r->data;
+            iov[1].iov_len  = avail - first;
+            *iovcnt = (avail > first) ? 2 : 1;
+            return avail;
+        }
+
+        next = atomic_read(&r->next);
+        if (next == NULL) {
+            *iovcnt = 0;
+            return 0;
+        }
+        /* the producer filled |r| before moving on, look again in case
+         * the last bytes came in after we read |head| */
+        smp_rmb();
+        if (atomic_read(&r->head) != r->tail)
+            continue;
+
+        atomic_set(&chain->first, next);
+        g_free(r);
+        r = next;
+    }
+}
+
+/* consumer side: drop |len| bytes returned by char_ring_chain_peek() */
 static void
-bip_buffer_free( BipBuffer*  bip )
+char_ring_chain_step( CharRingChain*  chain, int  len )
 {
-    bip->next         = _free_bip_buffers;
-    _free_bip_buffers = bip;
+    CharRing*  r = chain->first;
+
+    atomic_mb_set(&r->tail, r->tail + len);
 }
 
 /* this models each half of the charpipe */
 typedef struct CharPipeHalf {
     CharDriverState       cs[1];
-    BipBuffer*            bip_first;
-    BipBuffer*            bip_last;
+    CharRingChain         queue[1];
     struct CharPipeHalf*  peer;         /* NULL if closed */
 } CharPipeHalf;
 
@@ -82,12 +201,7 @@ charpipehalf_close( CharDriverState*  cs )
 {
     CharPipeHalf*  ph = cs->opaque;
 
-    while (ph->bip_first) {
-        BipBuffer*  bip = ph->bip_first;
-        ph->bip_first = bip->next;
-        bip_buffer_free(bip);
-    }
-    ph->bip_last    = NULL;
+    char_ring_chain_free( ph->queue );
     ph->peer        = NULL;
 }
 
@@ -97,13 +211,21 @@ charpipehalf_write( CharDriverState*  cs, const uint8_t*  buf, int  len )
 {
     CharPipeHalf*  ph   = cs->opaque;
     CharPipeHalf*  peer = ph->peer;
-    BipBuffer*     bip  = ph->bip_last;
-    int            ret  = 0;
+    int            ret  = len;
+    int            empty;
 
     D("%s: writing %d bytes to %p: '%s'", __FUNCTION__,
       len, ph, quote_bytes( buf, len ));
 
-    if (bip == NULL && peer != NULL && peer->cs->chr_read != NULL) {
+    if (ph->queue->last == NULL)  /* closed */
+        return ret;
+
+    empty = char_ring_chain_empty( ph->queue );
+
+    /* the peer's handlers expect the iothread lock, which also keeps
+     * charpipe_poll() away while we write to it directly */
+    if (empty && peer != NULL && peer->cs->chr_read != NULL &&
+        qemu_mutex_iothread_locked()) {
         /* no buffered data, try to write directly to the peer */
         while (len > 0) {
             int  size;
@@ -121,33 +243,16 @@ charpipehalf_write( CharDriverState*  cs, const uint8_t*  buf, int  len )
             qemu_chr_be_write( peer->cs, (uint8_t*)buf, size );
             buf += size;
             len -= size;
-            ret += size;
         }
     }
 
     if (len == 0)
         return ret;
 
-    /* buffer the remaining data */
-    if (bip == NULL) {
-        bip = bip_buffer_alloc();
-        ph->bip_first = ph->bip_last = bip;
-    }
-
-    while (len > 0) {
-        int  len2 = cbuffer_write( bip->cb, buf, len );
-
-        buf += len2;
-        ret += len2;
-        len -= len2;
-        if (len == 0)
-            break;
-
-        /* ok, we need another buffer */
-        ph->bip_last = bip_buffer_alloc();
-        bip->next = ph->bip_last;
-        bip       = ph->bip_last;
-    }
+    /* buffer the remaining data, and make sure the main loop sees it */
+    char_ring_chain_write( ph->queue, buf, len );
+    if (empty)
+        qemu_notify_event();
     return  ret;
 }
 
@@ -156,29 +261,20 @@ static void
 charpipehalf_poll( CharPipeHalf*  ph )
 {
     CharPipeHalf*   peer = ph->peer;
-    int             size;
 
     if (peer == NULL || peer->cs->chr_read == NULL)
         return;
 
     while (1) {
-        BipBuffer*  bip = ph->bip_first;
-        uint8_t*    base;
-        int         avail;
+        struct iovec  iov[2];
+        int           iovcnt, i;
+        int           size, sent = 0;
 
-        if (bip == NULL)
+        size = char_ring_chain_peek( ph->queue, iov, &iovcnt );
+        if (size == 0)
             break;
 
-        size = cbuffer_read_avail(bip->cb);
-        if (size == 0) {
-            ph->bip_first = bip->next;
-            if (ph->bip_first == NULL)
-                ph->bip_last = NULL;
-            bip_buffer_free(bip);
-            continue;
-        }
-
-        if (ph->cs->chr_can_read) {
+        if (peer->cs->chr_can_read) {
             int  size2 = qemu_chr_be_can_write(peer->cs);
 
             if (size2 == 0)
@@ -188,14 +284,16 @@ charpipehalf_poll( CharPipeHalf*  ph )
                 size = size2;
         }
 
-        avail = cbuffer_read_peek( bip->cb, &base );
-        if (avail > size)
-            avail = size;
-        D("%s: sending %d bytes from %p: '%s'", __FUNCTION__,
-            avail, ph, quote_bytes( base, avail ));
+        for (i = 0; i < iovcnt && sent < size; i++) {
+            int  avail = MIN((int)iov[i].iov_len, size - sent);
 
-        qemu_chr_be_write( peer->cs, base, avail );
-        cbuffer_read_step( bip->cb, avail );
+            D("%s: sending %d bytes from %p: '%s'", __FUNCTION__,
+                avail, ph, quote_bytes( iov[i].iov_base, avail ));
+
+            qemu_chr_be_write( peer->cs, iov[i].iov_base, avail );
+            sent += avail;
+        }
+        char_ring_chain_step( ph->queue, sent );
     }
 }
 
@@ -205,8 +303,7 @@ charpipehalf_init( CharPipeHalf*  ph, CharPipeHalf*  peer )
 {
     CharDriverState*  cs = ph->cs;
 
-    ph->bip_first   = NULL;
-    ph->bip_last    = NULL;
+    char_ring_chain_init( ph->queue );
     ph->peer        = peer;
 
     cs->chr_write            = charpipehalf_write;
@@ -265,8 +362,7 @@ qemu_chr_open_charpipe( CharDriverState*  *pfirst, CharDriverState*  *psecond )
 
 typedef struct CharBuffer {
     CharDriverState  cs[1];
-    BipBuffer*       bip_first;
-    BipBuffer*       bip_last;
+    CharRingChain    queue[1];
     CharDriverState* endpoint;  /* NULL if closed */
     char             closing;
 } CharBuffer;
@@ -277,12 +373,7 @@ charbuffer_close( CharDriverState*  cs )
 {
     CharBuffer*  cbuf = cs->opaque;
 
-    while (cbuf->bip_first) {
-        BipBuffer*  bip = cbuf->bip_first;
-        cbuf->bip_first = bip->next;
-        bip_buffer_free(bip);
-    }
-    cbuf->bip_last = NULL;
+    char_ring_chain_free( cbuf->queue );
     cbuf->endpoint = NULL;
 
     if (cbuf->endpoint != NULL) {
@@ -296,13 +387,18 @@ charbuffer_write( CharDriverState*  cs, const uint8_t*  buf, int  len )
 {
     CharBuffer*       cbuf = cs->opaque;
     CharDriverState*  peer = cbuf->endpoint;
-    BipBuffer*        bip  = cbuf->bip_last;
-    int               ret  = 0;
+    int               ret  = len;
+    int               empty;
 
     D("%s: writing %d bytes to %p: '%s'", __FUNCTION__,
       len, cbuf, quote_bytes( buf, len ));
 
-    if (bip == NULL && peer != NULL) {
+    if (cbuf->queue->last == NULL)  /* closed */
+        return ret;
+
+    empty = char_ring_chain_empty( cbuf->queue );
+
+    if (empty && peer != NULL) {
         /* no buffered data, try to write directly to the peer */
         int  size = qemu_chr_fe_write(peer, buf, len);
 
@@ -312,33 +408,16 @@ charbuffer_write( CharDriverState*  cs, const uint8_t*  buf, int  len )
             size = len;
 
         buf += size;
-        ret += size;
         len -= size;
     }
 
     if (len == 0)
         return ret;
 
-    /* buffer the remaining data */
-    if (bip == NULL) {
-        bip = bip_buffer_alloc();
-        cbuf->bip_first = cbuf->bip_last = bip;
-    }
-
-    while (len > 0) {
-        int  len2 = cbuffer_write( bip->cb, buf, len );
-
-        buf += len2;
-        ret += len2;
-        len -= len2;
-        if (len == 0)
-            break;
-
-        /* ok, we need another buffer */
-        cbuf->bip_last = bip_buffer_alloc();
-        bip->next = cbuf->bip_last;
-        bip       = cbuf->bip_last;
-    }
+    /* buffer the remaining data, and make sure the main loop sees it */
+    char_ring_chain_write( cbuf->queue, buf, len );
+    if (empty)
+        qemu_notify_event();
     return  ret;
 }
 
@@ -352,31 +431,22 @@ charbuffer_poll( CharBuffer*  cbuf )
         return;
 
     while (1) {
-        BipBuffer*  bip = cbuf->bip_first;
-        uint8_t*    base;
-        int         avail;
-        int         size;
+        struct iovec  iov[2];
+        int           iovcnt;
+        int           avail, size;
 
-        if (bip == NULL)
+        avail = char_ring_chain_peek( cbuf->queue, iov, &iovcnt );
+        if (avail == 0)
             break;
 
-        avail = cbuffer_read_peek( bip->cb, &base );
-        if (avail == 0) {
-            cbuf->bip_first = bip->next;
-            if (cbuf->bip_first == NULL)
-                cbuf->bip_last = NULL;
-            bip_buffer_free(bip);
-            continue;
-        }
-
-        size = qemu_chr_fe_write( peer, base, avail );
+        size = qemu_chr_fe_writev( peer, iov, iovcnt );
 
         if (size < 0)  /* just to be safe */
             size = 0;
         else if (size > avail)
             size = avail;
 
-        cbuffer_read_step( bip->cb, size );
+        char_ring_chain_step( cbuf->queue, size );
 
         if (size < avail)
             break;
@@ -402,8 +472,7 @@ charbuffer_init( CharBuffer*  cbuf, CharDriverState*  endpoint )
 {
     CharDriverState*  cs = cbuf->cs;
 
-    cbuf->bip_first   = NULL;
-    cbuf->bip_last    = NULL;
+    char_ring_chain_init( cbuf->queue );
     cbuf->endpoint    = endpoint;
 
     cs->chr_write               = charbuffer_write;
@@ -412,6 +481,7 @@ charbuffer_init( CharBuffer*  cbuf, CharDriverState*  endpoint )
     cs->chr_close               = charbuffer_close;
     cs->chr_update_read_handler = charbuffer_update_handlers;
     cs->opaque                  = cbuf;
+    qemu_mutex_init(&cs->chr_write_lock);
 }
 
 #define MAX_CHAR_BUFFERS  8
@@ -13,8 +13,10 @@
 
 #include "android-qemu2-glue/emulation/charpipe.h"
 #include "android-qemu2-glue/emulation/CharSerialLine.h"
+#include "android-qemu2-glue/emulation/ThreadedSerialLine.h"
 
 using android::qemu2::CharSerialLine;
+using android::qemu2::ThreadedSerialLine;
 
 CSerialLine* android_serialline_from_cs(CharDriverState* cs) {
     return new CharSerialLine(cs);
@@ -50,3 +52,8 @@ int android_serialline_pipe_open(CSerialLine** pfirst, CSerialLine** psecond) {
     *psecond = new CharSerialLine(second_cs);
     return 0;
 }
+
+CSerialLine* android_serialline_threaded_open(CSerialLine* sl, Looper* looper) {
+    return new ThreadedSerialLine(
+            sl, reinterpret_cast<android::base::Looper*>(looper));
+}
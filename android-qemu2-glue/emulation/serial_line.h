@@ -13,6 +13,7 @@
 
 #include "android/emulation/serial_line.h"
 #include "android/utils/compiler.h"
+#include "android/utils/looper.h"
 #include "qemu-common.h"
 
 ANDROID_BEGIN_HEADER
@@ -28,4 +29,9 @@ CharDriverState* android_serialline_get_cs(CSerialLine* sl);
 // destroys the CSerialLine instance.
 CharDriverState* android_serialline_release_cs(CSerialLine* sl);
 
+// Create a new CSerialLine instance whose client runs on |looper|'s thread,
+// while |sl| itself is still serviced by the main loop. Data is queued in
+// both directions, see ThreadedSerialLine. Does not take ownership of |sl|.
+CSerialLine* android_serialline_threaded_open(CSerialLine* sl, Looper* looper);
+
 ANDROID_END_HEADER
@@ -15,9 +15,72 @@
 #include "android/base/async/Looper.h"
 #include "android/utils/looper.h"
 
+extern "C" {
+#include "qemu/thread.h"
+}
+
+#include <memory>
+
 typedef ::Looper CLooper;
+typedef ::android::base::Looper BaseLooper;
 
 void qemu_looper_setForThread() {
     looper_setForThread(
             reinterpret_cast<CLooper*>(::android::qemu::createLooper()));
 }
+
+CLooper* qemu_looper_create_iothread(const char* name) {
+    return reinterpret_cast<CLooper*>(
+            ::android::qemu::createIoThreadLooper(name));
+}
+
+namespace {
+
+struct SyncCall {
+    void (*func)(void*);
+    void* opaque;
+    QemuMutex lock;
+    QemuCond cond;
+    bool done;
+};
+
+void runSyncCall(void* opaque, BaseLooper::Timer* timer) {
+    SyncCall* call = static_cast<SyncCall*>(opaque);
+
+    call->func(call->opaque);
+
+    qemu_mutex_lock(&call->lock);
+    call->done = true;
+    qemu_cond_signal(&call->cond);
+    qemu_mutex_unlock(&call->lock);
+}
+
+}  // namespace
+
+void qemu_looper_run_sync(CLooper* looper, void (*func)(void*),
+                          void* opaque) {
+    BaseLooper* base = reinterpret_cast<BaseLooper*>(looper);
+    SyncCall call;
+
+    call.func = func;
+    call.opaque = opaque;
+    call.done = false;
+    qemu_mutex_init(&call.lock);
+    qemu_cond_init(&call.cond);
+
+    // Looper timers can be armed from any thread; the callback runs on the
+    // looper's own and doesn't touch the timer once it has signalled.
+    std::unique_ptr<BaseLooper::Timer> timer(base->createTimer(
+            runSyncCall, &call, BaseLooper::ClockType::kHost));
+    timer->startRelative(0);
+
+    qemu_mutex_lock(&call.lock);
+    while (!call.done) {
+        qemu_cond_wait(&call.cond, &call.lock);
+    }
+    qemu_mutex_unlock(&call.lock);
+
+    timer.reset();
+    qemu_cond_destroy(&call.cond);
+    qemu_mutex_destroy(&call.lock);
+}
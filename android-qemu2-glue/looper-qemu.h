@@ -23,4 +23,19 @@ ANDROID_BEGIN_HEADER
  */
 void qemu_looper_setForThread(void);
 
+/* Create a new looper running on its own QEMU I/O thread named |name|,
+ * for components that want to be serviced off the main loop. Its
+ * callbacks run without the QEMU global mutex held, see
+ * android::qemu::createIoThreadLooper(). Returns NULL on failure.
+ */
+Looper* qemu_looper_create_iothread(const char* name);
+
+/* Call |func(opaque)| on the thread that runs |looper|, and wait until it
+ * has returned. This gives code on another thread, such as the main loop,
+ * a way to use a component that lives on an I/O thread looper without any
+ * locking in the component. |looper| must not be the caller's own looper.
+ */
+void qemu_looper_run_sync(Looper* looper, void (*func)(void* opaque),
+                          void* opaque);
+
 ANDROID_END_HEADER
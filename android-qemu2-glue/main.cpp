@@ -45,10 +45,12 @@
 
 extern "C" {
 #include "android/skin/charmap.h"
+#include "sysemu/boot-timeline.h"
 }
 
 #include "android/ui-emu-agent.h"
 #include "android-qemu2-glue/qemu-control-impl.h"
+#include "android-qemu2-glue/zygote.h"
 
 #ifdef TARGET_AARCH64
 #define TARGET_ARM64
@@ -59,8 +61,10 @@ extern "C" {
 
 #include <algorithm>
 #include <assert.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdio.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "android/version.h"
@@ -94,6 +98,8 @@ const int kMaxTargetQemuParams = 16;
  * parameters.
  * |storageDeviceType| is the QEMU storage device type.
  * |networkDeviceType| is the QEMU network device type.
+ * |balloonDeviceType| is the QEMU memory balloon device type.
+ * |sharedFolderDeviceType| is the QEMU virtio-9p device type.
  * |imagePartitionTypes| defines the order of how the image partitions are
  * listed in the command line, because the command line order determines which
  * mount point the partition is attached to.  For x86, the first partition
@@ -114,6 +120,8 @@ struct TargetInfo {
     const char* kernelExtraArgs;
     const char* storageDeviceType;
     const char* networkDeviceType;
+    const char* balloonDeviceType;
+    const char* sharedFolderDeviceType;
     const ImageType imagePartitionTypes[kMaxPartitions];
     const char* qemuExtraArgs[kMaxTargetQemuParams];
 };
@@ -128,6 +136,8 @@ const TargetInfo kTarget = {
     " keep_bootcon earlyprintk=ttyAMA0",
     "virtio-blk-device",
     "virtio-net-device",
+    "virtio-balloon-device",
+    "virtio-9p-device",
     {IMAGE_TYPE_SD_CARD, IMAGE_TYPE_USER_DATA, IMAGE_TYPE_CACHE, IMAGE_TYPE_SYSTEM},
     {NULL},
 #elif defined(TARGET_MIPS64)
@@ -138,6 +148,8 @@ const TargetInfo kTarget = {
     NULL,
     "virtio-blk-device",
     "virtio-net-device",
+    "virtio-balloon-device",
+    "virtio-9p-device",
     {IMAGE_TYPE_SD_CARD, IMAGE_TYPE_USER_DATA, IMAGE_TYPE_CACHE, IMAGE_TYPE_SYSTEM},
     {NULL},
 #elif defined(TARGET_MIPS)
@@ -148,6 +160,8 @@ const TargetInfo kTarget = {
     NULL,
     "virtio-blk-device",
     "virtio-net-device",
+    "virtio-balloon-device",
+    "virtio-9p-device",
     {IMAGE_TYPE_SD_CARD, IMAGE_TYPE_USER_DATA, IMAGE_TYPE_CACHE, IMAGE_TYPE_SYSTEM},
     {NULL},
 #elif defined(TARGET_I386)
@@ -158,6 +172,8 @@ const TargetInfo kTarget = {
     " androidboot.hardware=ranchu",
     "virtio-blk-pci",
     "virtio-net-pci",
+    "virtio-balloon-pci",
+    "virtio-9p-pci",
     {IMAGE_TYPE_SYSTEM, IMAGE_TYPE_CACHE, IMAGE_TYPE_USER_DATA, IMAGE_TYPE_SD_CARD},
     {"-vga", "none", NULL},
 #elif defined(TARGET_X86_64)
@@ -168,6 +184,8 @@ const TargetInfo kTarget = {
     " androidboot.hardware=ranchu",
     "virtio-blk-pci",
     "virtio-net-pci",
+    "virtio-balloon-pci",
+    "virtio-9p-pci",
     {IMAGE_TYPE_SYSTEM, IMAGE_TYPE_CACHE, IMAGE_TYPE_USER_DATA, IMAGE_TYPE_SD_CARD},
     {"-vga", "none", NULL},
 #else
@@ -185,6 +203,162 @@ static String getNthParentDir(const char* path, size_t n) {
     return PathUtils::recompose(dir);
 }
 
+/*
+ * Writable partitions started from a pristine image run on a qcow2
+ * overlay of it instead of a full copy. QEMU creates the overlay when
+ * the drive has an 'overlay-base', so creating or wiping a partition only
+ * deletes a small file, and every instance reads the same base.
+ */
+struct PartitionOverlay {
+    String path;        // the overlay, used as the drive if non-empty
+    String base;        // image to create it on top of, if it must be
+    uint64_t minSize;   // size to grow it to, if smaller
+};
+
+static PartitionOverlay sSystemOverlay;
+static PartitionOverlay sDataOverlay;
+
+static bool isOlderThan(const char* path, const char* other) {
+    struct stat st, otherSt;
+    return stat(path, &st) < 0 || stat(other, &otherSt) < 0 ||
+           st.st_mtime < otherSt.st_mtime;
+}
+
+/*
+ * Return the virtual size of the qcow2 image at |path|, from its header,
+ * or 0 if it can't be read.
+ */
+static uint64_t qcow2VirtualSize(const char* path) {
+    uint8_t header[32];
+    uint64_t size = 0;
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        return 0;
+    }
+    if (fread(header, sizeof(header), 1, f) == 1 &&
+        !memcmp(header, "QFI\xfb", 4)) {
+        for (int i = 24; i < 32; i++) {
+            size = (size << 8) | header[i];
+        }
+    }
+    fclose(f);
+    return size;
+}
+
+/*
+ * Make the data partition of |hw| at least as large as configured, without
+ * copying it: a raw image is extended sparsely with its file system, and
+ * has nothing more to do. An overlay is grown by QEMU, which only adds
+ * qcow2 metadata, and the guest is asked to grow its file system when it
+ * boots.
+ */
+static bool growDataPartition(AndroidHwConfig* hw) {
+    const uint64_t wanted = hw->disk_dataPartition_size;
+    uint64_t size = 0;
+
+    if (sDataOverlay.path.empty()) {
+        if (path_get_size(hw->disk_dataPartition_path, &size) == 0 &&
+            size < wanted) {
+            D("Growing: %s\n", hw->disk_dataPartition_path);
+            resizeExt4Partition(hw->disk_dataPartition_path, wanted);
+        }
+        return false;
+    }
+    if (!sDataOverlay.base.empty()) {
+        path_get_size(sDataOverlay.base.c_str(), &size);
+    } else {
+        size = qcow2VirtualSize(sDataOverlay.path.c_str());
+    }
+    if (size == 0 || size >= wanted) {
+        return false;
+    }
+    sDataOverlay.minSize = wanted;
+    return true;
+}
+
+/*
+ * Have a writable drive on |path| bypass the host page cache and use
+ * native AIO instead of the thread pool, if its file system supports
+ * O_DIRECT.
+ */
+static void addAioParams(String* driveParam, const char* path) {
+#ifdef __linux__
+    int fd = open(path, O_RDONLY | O_DIRECT);
+    if (fd >= 0) {
+        close(fd);
+        *driveParam += ",cache=none,aio=native";
+    }
+#endif
+}
+
+/*
+ * With $ANDROID_BOOT_PREFETCH set, what the guest reads from the drive
+ * while booting is recorded next to the data partition, and read ahead of
+ * it on the next cold boot. Data from the base of an overlay is copied into
+ * it, so a base on a network file system is only read once.
+ */
+static void addPrefetchParams(String* driveParam, const char* id,
+                              AndroidHwConfig* hw) {
+    const char* prefetch = getenv("ANDROID_BOOT_PREFETCH");
+    if (prefetch && prefetch[0]) {
+        *driveParam += StringFormat(
+                ",prefetch-map=%s/%s.readmap",
+                getNthParentDir(hw->disk_dataPartition_path, 1U).c_str(),
+                id);
+    }
+}
+
+/*
+ * With $ANDROID_DISK_CHECKPOINTS set, what the guest writes to the drive is
+ * tracked across runs next to the data partition, so that a checkpoint
+ * taken with drive-backup sync=incremental only copies what changed since
+ * the previous one.
+ */
+static void addDirtyMapParams(String* driveParam, const char* id,
+                              AndroidHwConfig* hw) {
+    const char* checkpoints = getenv("ANDROID_DISK_CHECKPOINTS");
+    if (checkpoints && checkpoints[0]) {
+        *driveParam += StringFormat(
+                ",dirty-map=%s/%s.dirtymap",
+                getNthParentDir(hw->disk_dataPartition_path, 1U).c_str(),
+                id);
+    }
+}
+
+/*
+ * $ANDROID_HOST_IO_BPS and $ANDROID_HOST_IO_IOPS are the limits of the host
+ * disk, shared fairly between the emulators of the host that use it.
+ */
+static void addHostThrottleParams(String* driveParam) {
+#ifdef __linux__
+    const char* bps = getenv("ANDROID_HOST_IO_BPS");
+    const char* iops = getenv("ANDROID_HOST_IO_IOPS");
+    if (bps && bps[0]) {
+        *driveParam += StringFormat(",throttling.host-bps-total=%s", bps);
+    }
+    if (iops && iops[0]) {
+        *driveParam += StringFormat(",throttling.host-iops-total=%s", iops);
+    }
+#endif
+}
+
+static void addOverlayParams(String* driveParam,
+                             const PartitionOverlay& overlay) {
+    *driveParam += StringFormat(",format=qcow2,file=%s",
+                                overlay.path.c_str());
+    if (!overlay.base.empty()) {
+        *driveParam += StringFormat(",overlay-base=%s",
+                                    overlay.base.c_str());
+    }
+    // The overlay may not exist yet, but goes next to its base
+    if (overlay.minSize) {
+        *driveParam += StringFormat(",min-size=%" PRIu64, overlay.minSize);
+    }
+    addAioParams(driveParam, path_exists(overlay.path.c_str())
+                                     ? overlay.path.c_str()
+                                     : overlay.base.c_str());
+}
+
 /* generate parameters for each partition by type.
  * Param:
  *  args - array to hold parameters for qemu
@@ -213,16 +387,24 @@ static void makePartitionCmd(const char** args, int* argsPosition, int* driveInd
             // API 15 and under images need a read+write
             // system image.
             if (apiLevel <= 15) {
+                driveParam += StringFormat("index=%d,id=system", idx++);
+                addOverlayParams(&driveParam, sSystemOverlay);
+            } else {
+#ifdef _WIN32
                 driveParam += StringFormat(
-                        "index=%d,id=system,file=%s",
+                        "index=%d,id=system,read-only,file=%s",
                         idx++,
                         hw->disk_systemPartition_initPath);
-            } else {
+#else
+                // Read the image through a shared mapping, so that all
+                // emulators running it share its pages in the page cache.
                 driveParam += StringFormat(
-                        "index=%d,id=system,read-only,file=%s",
+                        "index=%d,id=system,read-only,format=raw,file=mmap:%s",
                         idx++,
                         hw->disk_systemPartition_initPath);
+#endif
             }
+            addPrefetchParams(&driveParam, "system", hw);
 
             deviceParam = StringFormat("%s,drive=system",
                                        kTarget.storageDeviceType);
@@ -231,13 +413,22 @@ static void makePartitionCmd(const char** args, int* argsPosition, int* driveInd
             driveParam += StringFormat("index=%d,id=cache,file=%s",
                                       idx++,
                                       hw->disk_cachePartition_path);
+            addAioParams(&driveParam, hw->disk_cachePartition_path);
             deviceParam = StringFormat("%s,drive=cache",
                                        kTarget.storageDeviceType);
             break;
         case IMAGE_TYPE_USER_DATA:
-            driveParam += StringFormat("index=%d,id=userdata,file=%s",
-                                      idx++,
-                                      hw->disk_dataPartition_path);
+            if (!sDataOverlay.path.empty()) {
+                driveParam += StringFormat("index=%d,id=userdata", idx++);
+                addOverlayParams(&driveParam, sDataOverlay);
+            } else {
+                driveParam += StringFormat("index=%d,id=userdata,file=%s",
+                                          idx++,
+                                          hw->disk_dataPartition_path);
+                addAioParams(&driveParam, hw->disk_dataPartition_path);
+            }
+            addPrefetchParams(&driveParam, "userdata", hw);
+            addDirtyMapParams(&driveParam, "userdata", hw);
             deviceParam = StringFormat("%s,drive=userdata",
                                        kTarget.storageDeviceType);
             break;
@@ -245,6 +436,7 @@ static void makePartitionCmd(const char** args, int* argsPosition, int* driveInd
             if (hw->hw_sdCard_path != NULL && strcmp(hw->hw_sdCard_path, "")) {
                driveParam += StringFormat("index=%d,id=sdcard,file=%s",
                                          idx++, hw->hw_sdCard_path);
+               addAioParams(&driveParam, hw->hw_sdCard_path);
                deviceParam = StringFormat("%s,drive=sdcard",
                                           kTarget.storageDeviceType);
             } else {
@@ -256,6 +448,17 @@ static void makePartitionCmd(const char** args, int* argsPosition, int* driveInd
             dwarning("Unknown Image type %d\n", type);
             return;
     }
+    addHostThrottleParams(&driveParam);
+    // One request queue per vCPU, so that guest I/O submitted from
+    // different CPUs does not serialize on a single virtqueue. PCI needs
+    // an MSI-X vector per queue plus one for config changes.
+    if (hw->hw_cpu_ncore > 1) {
+        int queues = (int)hw->hw_cpu_ncore;
+        deviceParam += StringFormat(",num-queues=%d", queues);
+        if (!strcmp(kTarget.storageDeviceType, "virtio-blk-pci")) {
+            deviceParam += StringFormat(",vectors=%d", queues + 1);
+        }
+    }
     args[n++] = "-drive";
     args[n++] = ASTRDUP(driveParam.c_str());
     args[n++] = "-device";
@@ -369,6 +572,12 @@ static void enter_qemu_main_loop(int argc, char **argv) {
 extern bool android_op_wipe_data;
 
 extern "C" int main(int argc, char **argv) {
+    // With $ANDROID_ZYGOTE_SOCKET set, this only returns in a pool process
+    // once it has been given a job.
+    if (!android_zygote_run(&argc, &argv)) {
+        return 1;
+    }
+    boot_timeline_mark("launch");
     process_early_setup(argc, argv);
 
     if (argc < 1) {
@@ -383,7 +592,7 @@ extern "C" int main(int argc, char **argv) {
     int    serial = 2;
     int    shell_serial = 0;
 
-    const char* args[128];
+    const char* args[192];
     args[0] = argv[0];
     int n = 1;  // next parameter index
 
@@ -391,6 +600,7 @@ extern "C" int main(int argc, char **argv) {
     if (android_parse_options(&argc, &argv, opts) < 0) {
         return 1;
     }
+    boot_timeline_mark("options-parsed");
 
     // just because we know that we're in the new emulator as we got here
     opts->ranchu = 1;
@@ -546,6 +756,7 @@ extern "C" int main(int argc, char **argv) {
         derror("could not read hardware configuration ?");
         exit(1);
     }
+    boot_timeline_mark("hw-config");
 
     /* The Qt UI handles keyboard shortcuts on its own. Don't load any keyset. */
     SkinKeyset* keyset = skin_keyset_new_from_text("");
@@ -712,12 +923,18 @@ extern "C" int main(int argc, char **argv) {
 
     /* If we have a valid snapshot storage path */
 
-    if (opts->snapstorage) {
-        dwarning("QEMU2 does not support snapshots - option will be ignored.");
+    /* The state of the host side GLES renderer can't be saved, and guest
+     * surfaces would be lost on every load. */
+    if (opts->snapstorage && hw->hw_gpu_enabled) {
+        dwarning("snapshots are not supported with GPU emulation - "
+                 "option will be ignored.");
+        opts->snapstorage = NULL;
+    }
 
-        // QEMU2 does not support some of the flags below, and the emulator will
-        // fail to start if they are passed in, so for now, ignore them.
-#ifdef QEMU2_SNAPSHOT_SUPPORT
+    if (opts->snapstorage) {
+        /* QEMU2 keeps the VM state in the qcow2 overlays of the writable
+         * drives (see -savevm-on-exit), the snapshot storage image only
+         * enables the feature. */
         hw->disk_snapStorage_path = ASTRDUP(opts->snapstorage);
 
         /* -no-snapshot is equivalent to using both -no-snapshot-load
@@ -756,9 +973,9 @@ extern "C" int main(int argc, char **argv) {
         }
 
         if (opts->no_snapshot_update_time) {
-            args[n++] = "-snapshot-no-time-update";
+            dwarning("-no-snapshot-update-time is not supported by QEMU2 - "
+                     "option will be ignored.");
         }
-#endif
     }
 
     if (!opts->logcat || opts->logcat[0] == 0) {
@@ -1046,24 +1263,49 @@ extern "C" int main(int argc, char **argv) {
     }
 #endif
 
-    // Create userdata file from init version if needed.
-    if (android_op_wipe_data || !path_exists(hw->disk_dataPartition_path)) {
+    // Create the userdata partition from the init version if needed, as
+    // an overlay of it. A partition from before overlays stays as it is
+    // until wiped.
+    String dataOverlay = StringFormat("%s.qcow2", hw->disk_dataPartition_path);
+    if (android_op_wipe_data || (!path_exists(hw->disk_dataPartition_path) &&
+                                 !path_exists(dataOverlay.c_str()))) {
         if (!path_exists(hw->disk_dataPartition_initPath)) {
             derror("Missing initial data partition file: %s",
                    hw->disk_dataPartition_initPath);
             exit(1);
         }
-        D("Creating: %s\n", hw->disk_dataPartition_path);
-
-        if (path_copy_file(hw->disk_dataPartition_path,
-                           hw->disk_dataPartition_initPath) < 0) {
-            derror("Could not create %s: %s", hw->disk_dataPartition_path,
-                   strerror(errno));
-            exit(1);
+        D("Creating: %s\n", dataOverlay.c_str());
+        path_delete_file(hw->disk_dataPartition_path);
+        path_delete_file(dataOverlay.c_str());
+        // Grown copy of the pristine image made by older versions
+        path_delete_file(
+                StringFormat("%s.base", hw->disk_dataPartition_path).c_str());
+        sDataOverlay.path = dataOverlay;
+        sDataOverlay.base = hw->disk_dataPartition_initPath;
+    } else if (path_exists(dataOverlay.c_str())) {
+        sDataOverlay.path = dataOverlay;
+    }
+    // The system image grows the file system of a larger drive, with
+    // resize2fs, when it sees this property.
+    if (growDataPartition(hw)) {
+        args[n++] = "-boot-property";
+        args[n++] = "qemu.userdata.resize=1";
+    }
+
+    // Old images got a writable system partition; keep its changes in an
+    // overlay next to the data partition, dropped with the data or when
+    // the system image is updated.
+    if (avd && avdInfo_getApiLevel(avd) <= 15) {
+        String systemOverlay = StringFormat(
+                "%s/system-qemu.img.qcow2",
+                getNthParentDir(hw->disk_dataPartition_path, 1U).c_str());
+        sSystemOverlay.path = systemOverlay;
+        if (android_op_wipe_data ||
+            isOlderThan(systemOverlay.c_str(),
+                        hw->disk_systemPartition_initPath)) {
+            path_delete_file(systemOverlay.c_str());
+            sSystemOverlay.base = hw->disk_systemPartition_initPath;
         }
-
-        resizeExt4Partition(android_hw->disk_dataPartition_path,
-                            android_hw->disk_dataPartition_size);
     }
 
     // Create cache partition image if it doesn't exist already.
@@ -1081,11 +1323,26 @@ extern "C" int main(int argc, char **argv) {
         }
     }
 
+    // $ANDROID_TIME_WARP=N counts instructions, 2^N ns of guest time each,
+    // and skips the periods where the guest only waits for a timer. Test
+    // suites full of sleeps and animations finish sooner, and the time the
+    // guest sees doesn't depend on the host load. This needs TCG.
+    const char* timeWarp = getenv("ANDROID_TIME_WARP");
+    const bool useTimeWarp = timeWarp && timeWarp[0];
+
 #if defined(TARGET_X86_64) || defined(TARGET_I386)
     char* accel_status = NULL;
     CpuAccelMode accel_mode = ACCEL_AUTO;
     const bool accel_ok = handleCpuAcceleration(opts, avd, &accel_mode, accel_status);
 
+    if (useTimeWarp) {
+        if (accel_mode == ACCEL_ON) {
+            derror("ANDROID_TIME_WARP can't be used with CPU acceleration");
+            exit(1);
+        }
+        accel_mode = ACCEL_OFF;
+    }
+
     if (accel_mode == ACCEL_OFF) {  // 'accel off' is specified'
         args[n++] = "-cpu";
         args[n++] = kTarget.qemuCpu;
@@ -1100,6 +1357,18 @@ extern "C" int main(int argc, char **argv) {
         if (accel_ok) {
             args[n++] = ASTRDUP(kEnableAccelerator);
         } else {
+#ifdef _WIN32
+            // HAXM can't run next to Hyper-V, but Hyper-V itself may run
+            // the guest through the Windows Hypervisor Platform. QEMU falls
+            // back to TCG when that isn't available either.
+            args[n++] = "-machine";
+            args[n++] = "accel=whpx:tcg";
+#elif defined(__APPLE__)
+            // Without HAXM, Hypervisor.framework can run the guest on
+            // macOS 10.10 and later.
+            args[n++] = "-machine";
+            args[n++] = "accel=hvf:tcg";
+#endif
             args[n++] = "-cpu";
             args[n++] = kTarget.qemuCpu;
         }
@@ -1113,6 +1382,13 @@ extern "C" int main(int argc, char **argv) {
     args[n++] = "type=ranchu";
 #endif  // !TARGET_X86_64 && !TARGET_I386
 
+    String icount;
+    if (useTimeWarp) {
+        icount = StringFormat("shift=%s,sleep=off", timeWarp);
+        args[n++] = "-icount";
+        args[n++] = icount.c_str();
+    }
+
 #if defined(TARGET_X86_64) || defined(TARGET_I386)
     // SMP Support.
     String ncores;
@@ -1149,6 +1425,59 @@ extern "C" int main(int argc, char **argv) {
     String memorySize = StringFormat("%ld", hw->hw_ramSize);
     args[n++] = memorySize.c_str();
 
+#ifdef __linux__
+    // $ANDROID_HOST_NUMA_NODE keeps the emulator on a host NUMA node: guest
+    // RAM comes from its memory, and the vCPU and I/O threads run on its
+    // CPUs unless $ANDROID_VCPU_AFFINITY or $ANDROID_IO_AFFINITY give them
+    // other host CPUs ("0-3,8").
+    String nodeCpus;
+    String numaBackend;
+    const char* numaNode = getenv("ANDROID_HOST_NUMA_NODE");
+    if (numaNode && numaNode[0]) {
+        char* end;
+        long node = strtol(numaNode, &end, 10);
+        String path = StringFormat("/sys/devices/system/node/node%ld/cpulist",
+                                   node);
+        FILE* file = (*end || node < 0) ? NULL : fopen(path.c_str(), "r");
+        char cpus[1024];
+
+        if (!file || !fgets(cpus, sizeof(cpus), file)) {
+            derror("Invalid host NUMA node in ANDROID_HOST_NUMA_NODE: %s",
+                   numaNode);
+            exit(1);
+        }
+        fclose(file);
+        cpus[strcspn(cpus, "\n")] = '\0';
+        nodeCpus = cpus;
+#if !defined(TARGET_MIPS) && !defined(TARGET_MIPS64)
+        // The MIPS board splits RAM in two and can't take a memdev.
+        numaBackend = StringFormat("memory-backend-ram,id=ram-node0,"
+                                   "size=%ldM,host-nodes=%ld,policy=bind",
+                                   hw->hw_ramSize, node);
+        args[n++] = "-object";
+        args[n++] = numaBackend.c_str();
+        args[n++] = "-numa";
+        args[n++] = "node,memdev=ram-node0";
+#endif
+    }
+    const char* vcpuAffinity = getenv("ANDROID_VCPU_AFFINITY");
+    if (!(vcpuAffinity && vcpuAffinity[0]) && !nodeCpus.empty()) {
+        vcpuAffinity = nodeCpus.c_str();
+    }
+    if (vcpuAffinity && vcpuAffinity[0]) {
+        args[n++] = "-vcpu-affinity";
+        args[n++] = vcpuAffinity;
+    }
+    const char* ioAffinity = getenv("ANDROID_IO_AFFINITY");
+    if (!(ioAffinity && ioAffinity[0]) && !nodeCpus.empty()) {
+        ioAffinity = nodeCpus.c_str();
+    }
+    if (ioAffinity && ioAffinity[0]) {
+        args[n++] = "-io-affinity";
+        args[n++] = ioAffinity;
+    }
+#endif  // __linux__
+
     // Command-line
     args[n++] = "-append";
 
@@ -1291,14 +1620,71 @@ extern "C" int main(int argc, char **argv) {
                          kTarget.imagePartitionTypes[s],
                          api_level);
     }
+    boot_timeline_mark("partitions");
 
     // Network
-    args[n++] = "-netdev";
-    args[n++] = "user,id=mynet";
-    args[n++] = "-device";
+    String netBackend("user,id=mynet");
     String netDevice =
             StringFormat("%s,netdev=mynet", kTarget.networkDeviceType);
+#ifdef __linux__
+    // Bridged networking through an existing tap interface. The kernel's
+    // vhost-net does the packet processing when available, and the device
+    // gets a queue pair per vCPU (slirp only ever has one). PCI needs an
+    // MSI-X vector per queue plus one for config changes.
+    const char* tapIfname = getenv("ANDROID_NET_TAP");
+    if (tapIfname && tapIfname[0]) {
+        netBackend = StringFormat("tap,id=mynet,ifname=%s,"
+                                  "script=no,downscript=no", tapIfname);
+        if (access("/dev/vhost-net", R_OK | W_OK) == 0) {
+            netBackend += ",vhost=on";
+        }
+        if (hw->hw_cpu_ncore > 1) {
+            int queues = (int)hw->hw_cpu_ncore;
+            netBackend += StringFormat(",queues=%d", queues);
+            netDevice += ",mq=on";
+            if (!strcmp(kTarget.networkDeviceType, "virtio-net-pci")) {
+                netDevice += StringFormat(",vectors=%d", 2 * queues + 2);
+            }
+        }
+    }
+#endif
+    args[n++] = "-netdev";
+    args[n++] = netBackend.c_str();
+    args[n++] = "-device";
     args[n++] = netDevice.c_str();
+
+    // Let the guest hand its free memory back to the host, and take some
+    // more back when the host itself runs short.
+    args[n++] = "-device";
+    String balloonDevice = StringFormat(
+            "%s,free-page-reporting=on,auto-balloon-interval=5",
+            kTarget.balloonDeviceType);
+    args[n++] = balloonDevice.c_str();
+
+#ifdef __linux__
+    // Host folder shared with the guest over virtio-9p, for test artifacts
+    // too large to push through adb. The guest mounts it with
+    //   mount -t 9p -o trans=virtio,version=9p2000.L,msize=524288 \
+    //         hostshare <dir>
+    // The msize is what the guest asks for; the Linux client caps it at
+    // what a virtqueue descriptor chain can hold, about 500k. Reads and
+    // writes then go straight between the host file and guest memory.
+    // Snapshots can't be saved while the folder is mounted.
+    String shareFsdev, shareDevice;
+    const char* sharedFolder = getenv("ANDROID_SHARED_FOLDER");
+    if (sharedFolder && sharedFolder[0]) {
+        shareFsdev = StringFormat(
+                "local,id=hostshare,path=%s,security_model=none",
+                sharedFolder);
+        shareDevice = StringFormat("%s,fsdev=hostshare,mount_tag=hostshare",
+                                   kTarget.sharedFolderDeviceType);
+        args[n++] = "-fsdev";
+        args[n++] = shareFsdev.c_str();
+        args[n++] = "-device";
+        args[n++] = shareDevice.c_str();
+    }
+#endif
+
     args[n++] = "-show-cursor";
 
     // Graphics
@@ -1427,6 +1813,7 @@ extern "C" int main(int argc, char **argv) {
     pthread_sigmask(SIG_SETMASK, &set, NULL);
 #endif  // !_WIN32
     ui_init(skinConfig, skinPath, opts, &uiEmuAgent);
+    boot_timeline_mark("ui-init");
     skin_winsys_spawn_thread(opts->no_window, enter_qemu_main_loop, n, (char**)args);
     skin_winsys_enter_main_loop(opts->no_window, argc, argv);
     ui_done();
@@ -14,8 +14,18 @@
 #include "android/telephony/modem_driver.h"
 #include "android/shaper.h"
 
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
 extern "C" {
 #include "net/net.h"
+#include "qemu/timer.h"
 }
 
 double   qemu_net_upload_speed   = 0.;
@@ -27,11 +37,315 @@ NetShaper  slirp_shaper_in;
 NetShaper  slirp_shaper_out;
 NetDelay   slirp_delay_in;
 
+// Parse a -netspeed style value, either a network type name or
+// "<kbps>[:<download kbps>]", into bits per second.
+static int
+parse_network_speed(const char* speed, double* upload, double* download)
+{
+    int          n;
+    char*  end;
+    double       sp;
+
+    for (n = 0; android_netspeeds[n].name != NULL; n++) {
+        if (!strcmp(android_netspeeds[n].name, speed)) {
+            *download = android_netspeeds[n].download;
+            *upload   = android_netspeeds[n].upload;
+            return 0;
+        }
+    }
+
+    /* is this a number ? */
+    sp = strtod(speed, &end);
+    if (end == speed) {
+        return -1;
+    }
+
+    *download = *upload = sp*1000.;
+    if (*end == ':') {
+        speed = end+1;
+        sp = strtod(speed, &end);
+        if (end > speed) {
+            *download = sp*1000.;
+        }
+    }
+    return 1;
+}
+
+// Parse a -netdelay style value, either a network type name or
+// "<ms>[:<max ms>]".
+static int
+parse_network_latency(const char* delay, int* min_ms, int* max_ms)
+{
+    int  n;
+    char*  end;
+    double  sp;
+
+    for (n = 0; android_netdelays[n].name != NULL; n++) {
+        if ( !strcmp( android_netdelays[n].name, delay ) ) {
+            *min_ms = android_netdelays[n].min_ms;
+            *max_ms = android_netdelays[n].max_ms;
+            return 0;
+        }
+    }
+
+    /* is this a number ? */
+    sp = strtod(delay, &end);
+    if (end == delay) {
+        return -1;
+    }
+
+    *min_ms = *max_ms = (int)sp;
+    if (*end == ':') {
+        delay = (const char*)end+1;
+        sp = strtod(delay, &end);
+        if (end > delay) {
+            *max_ms = (int)sp;
+        }
+    }
+    return 0;
+}
+
 #if defined(CONFIG_SLIRP)
 static void* s_slirp_state = nullptr;
 static void* s_net_client_state = nullptr;
 static Slirp* s_slirp = nullptr;
 
+namespace {
+
+// A token bucket rate limiter for one direction of the slirp traffic.
+//
+// The rate is read through |rate| (in bits per second, 0 meaning
+// unlimited) on every packet, so that it can point at
+// qemu_net_upload_speed/qemu_net_download_speed, which are updated by
+// android_parse_network_speed() whenever the speed changes. A packet that
+// fits in the available tokens is passed through immediately without
+// being copied. Otherwise it is queued and a single timer, armed for when
+// the head of the queue can go, drains as many packets as the refilled
+// bucket allows.
+class SlirpShaper {
+public:
+    typedef void (*SendFunc)(void* opaque, const uint8_t* data, size_t size);
+
+    SlirpShaper(const double* rate, SendFunc send, void* opaque) :
+            mRate(rate),
+            mSend(send),
+            mOpaque(opaque),
+            mTimer(timer_new_ns(QEMU_CLOCK_REALTIME, onTimer, this)),
+            mTokens(0.),
+            mLastNs(qemu_clock_get_ns(QEMU_CLOCK_REALTIME)),
+            mQueue(),
+            mQueuedBytes(0) {
+    }
+
+    ~SlirpShaper() {
+        timer_del(mTimer);
+        timer_free(mTimer);
+    }
+
+    void send(const uint8_t* data, size_t size) {
+        if (mQueue.empty()) {
+            if (*mRate <= 0.) {
+                mSend(mOpaque, data, size);
+                return;
+            }
+            refill();
+            if (mTokens >= size) {
+                mTokens -= size;
+                mSend(mOpaque, data, size);
+                return;
+            }
+        }
+        if (mQueuedBytes + size > kMaxQueueBytes) {
+            // Like a full router buffer, drop and let TCP back off.
+            return;
+        }
+        mQueue.emplace_back(data, data + size);
+        mQueuedBytes += size;
+        if (*mRate <= 0.) {
+            drain();
+        } else if (!timer_pending(mTimer)) {
+            schedule();
+        }
+    }
+
+private:
+    // Queued bytes beyond which packets are dropped.
+    static const size_t kMaxQueueBytes = 256 * 1024;
+    // The bucket holds at most this much transmit time worth of tokens,
+    // and never less than a few full size frames.
+    static const int kBurstMs = 10;
+    static const size_t kMinBurstBytes = 4 * 1536;
+
+    double bytesPerNs() const {
+        return *mRate / 8e9;
+    }
+
+    void refill() {
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        double burst = *mRate / 8. * kBurstMs / 1000.;
+        if (burst < kMinBurstBytes) {
+            burst = kMinBurstBytes;
+        }
+        mTokens += (now - mLastNs) * bytesPerNs();
+        if (mTokens > burst) {
+            mTokens = burst;
+        }
+        mLastNs = now;
+    }
+
+    // Arm the timer for when the head packet fits in the bucket.
+    void schedule() {
+        double missing = mQueue.front().size() - mTokens;
+        int64_t delay = missing > 0. ? (int64_t)(missing / bytesPerNs()) : 0;
+        timer_mod_ns(mTimer, mLastNs + delay);
+    }
+
+    // Send every queued packet the bucket allows in one go.
+    void drain() {
+        bool unlimited = *mRate <= 0.;
+        if (!unlimited) {
+            refill();
+        }
+        while (!mQueue.empty()) {
+            std::vector<uint8_t>& packet = mQueue.front();
+            if (!unlimited) {
+                if (mTokens < packet.size()) {
+                    schedule();
+                    return;
+                }
+                mTokens -= packet.size();
+            }
+            // Move the packet out first, |mSend| may re-enter send().
+            std::vector<uint8_t> data;
+            data.swap(packet);
+            mQueue.pop_front();
+            mQueuedBytes -= data.size();
+            mSend(mOpaque, data.data(), data.size());
+        }
+    }
+
+    static void onTimer(void* opaque) {
+        static_cast<SlirpShaper*>(opaque)->drain();
+    }
+
+    const double* mRate;
+    SendFunc mSend;
+    void* mOpaque;
+    QEMUTimer* mTimer;
+    double mTokens;
+    int64_t mLastNs;
+    std::deque<std::vector<uint8_t>> mQueue;
+    size_t mQueuedBytes;
+};
+
+// A delay line adding a random latency between |minMs| and |maxMs| to
+// every packet. Release times never go backwards, so jitter does not
+// reorder packets within the flow.
+class SlirpDelay {
+public:
+    typedef SlirpShaper::SendFunc SendFunc;
+
+    SlirpDelay(const int* minMs, const int* maxMs, SendFunc send,
+               void* opaque) :
+            mMinMs(minMs),
+            mMaxMs(maxMs),
+            mSend(send),
+            mOpaque(opaque),
+            mTimer(timer_new_ns(QEMU_CLOCK_REALTIME, onTimer, this)),
+            mLastReleaseNs(0),
+            mQueue() {
+    }
+
+    ~SlirpDelay() {
+        timer_del(mTimer);
+        timer_free(mTimer);
+    }
+
+    void send(const uint8_t* data, size_t size) {
+        int minMs = *mMinMs;
+        int maxMs = *mMaxMs > minMs ? *mMaxMs : minMs;
+        if (maxMs <= 0 && mQueue.empty()) {
+            mSend(mOpaque, data, size);
+            return;
+        }
+        double delayMs = minMs + g_random_double() * (maxMs - minMs);
+        int64_t release = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                          (int64_t)(delayMs * SCALE_MS);
+        if (release < mLastReleaseNs) {
+            release = mLastReleaseNs;
+        }
+        mLastReleaseNs = release;
+        mQueue.emplace_back();
+        mQueue.back().releaseNs = release;
+        mQueue.back().data.assign(data, data + size);
+        if (mQueue.size() == 1) {
+            timer_mod_ns(mTimer, release);
+        }
+    }
+
+private:
+    struct Packet {
+        int64_t releaseNs;
+        std::vector<uint8_t> data;
+    };
+
+    void drain() {
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        while (!mQueue.empty() && mQueue.front().releaseNs <= now) {
+            std::vector<uint8_t> data;
+            data.swap(mQueue.front().data);
+            mQueue.pop_front();
+            mSend(mOpaque, data.data(), data.size());
+        }
+        if (!mQueue.empty()) {
+            timer_mod_ns(mTimer, mQueue.front().releaseNs);
+        }
+    }
+
+    static void onTimer(void* opaque) {
+        static_cast<SlirpDelay*>(opaque)->drain();
+    }
+
+    const int* mMinMs;
+    const int* mMaxMs;
+    SendFunc mSend;
+    void* mOpaque;
+    QEMUTimer* mTimer;
+    int64_t mLastReleaseNs;
+    std::deque<Packet> mQueue;
+};
+
+// Network conditions applied to the traffic exchanged with a range of
+// remote addresses and ports, instead of the global settings. Each
+// profile has its own buckets and delay line, so a slow profile never
+// holds back packets of other flows.
+struct NetProfile {
+    uint32_t addr;      // Remote IPv4 address, host byte order.
+    uint32_t mask;
+    uint16_t portMin;   // Remote TCP/UDP port range.
+    uint16_t portMax;
+    double uploadSpeed;     // bits per second, 0 for unlimited.
+    double downloadSpeed;
+    int minLatency;     // ms, applied to guest -> network packets.
+    int maxLatency;
+    double loss;        // Probability of dropping a packet, per direction.
+
+    std::unique_ptr<SlirpShaper> shaperIn;
+    std::unique_ptr<SlirpShaper> shaperOut;
+    std::unique_ptr<SlirpDelay> delayIn;
+
+    bool matches(uint32_t remoteAddr, uint16_t remotePort) const {
+        return (remoteAddr & mask) == addr &&
+               remotePort >= portMin && remotePort <= portMax;
+    }
+};
+
+SlirpShaper* s_shaper_in = nullptr;
+SlirpShaper* s_shaper_out = nullptr;
+std::vector<std::unique_ptr<NetProfile>> s_profiles;
+
+}  // namespace
+
 static void
 slirp_delay_in_cb(void* data, size_t size, void* opaque)
 {
@@ -39,17 +353,112 @@ slirp_delay_in_cb(void* data, size_t size, void* opaque)
 }
 
 static void
-slirp_shaper_in_cb(void* data, size_t size, void* opaque)
+slirp_shaper_in_cb(void* opaque, const uint8_t* data, size_t size)
 {
-    netdelay_send_aux(slirp_delay_in, data, size, opaque);
+    if (qemu_net_max_latency <= 0) {
+        slirp_input(s_slirp, data, size);
+    } else {
+        netdelay_send_aux(slirp_delay_in, const_cast<uint8_t*>(data), size,
+                          nullptr);
+    }
 }
 
 static void
-slirp_shaper_out_cb(void* data, size_t size, void* opaque)
+slirp_shaper_out_cb(void* opaque, const uint8_t* data, size_t size)
 {
     qemu_send_packet(static_cast<NetClientState*>(s_net_client_state),
-                     static_cast<const uint8_t*>(data),
-                     size);
+                     data, size);
+}
+
+static void
+slirp_profile_shaper_in_cb(void* opaque, const uint8_t* data, size_t size)
+{
+    static_cast<NetProfile*>(opaque)->delayIn->send(data, size);
+}
+
+static void
+slirp_profile_delay_in_cb(void* opaque, const uint8_t* data, size_t size)
+{
+    slirp_input(s_slirp, data, size);
+}
+
+static void
+slirp_profile_start(NetProfile* p)
+{
+    p->shaperIn.reset(new SlirpShaper(&p->uploadSpeed,
+                                      slirp_profile_shaper_in_cb, p));
+    p->shaperOut.reset(new SlirpShaper(&p->downloadSpeed,
+                                       slirp_shaper_out_cb, p));
+    p->delayIn.reset(new SlirpDelay(&p->minLatency, &p->maxLatency,
+                                    slirp_profile_delay_in_cb, p));
+}
+
+// Find the profile for an Ethernet frame. The remote end is the
+// destination for frames sent by the guest and the source otherwise.
+static NetProfile*
+slirp_profile_lookup(const uint8_t* data, size_t size, bool fromGuest)
+{
+    if (s_profiles.empty() || size < 14 + 20 ||
+        data[12] != 0x08 || data[13] != 0x00) {
+        return nullptr;
+    }
+    const uint8_t* ip = data + 14;
+    size_t ihl = (ip[0] & 0x0f) * 4;
+    if (ihl < 20) {
+        return nullptr;
+    }
+    const uint8_t* a = ip + (fromGuest ? 16 : 12);
+    uint32_t remoteAddr = ((uint32_t)a[0] << 24) | (a[1] << 16) |
+                          (a[2] << 8) | a[3];
+    uint16_t remotePort = 0;
+    bool firstFragment = (((ip[6] << 8) | ip[7]) & 0x1fff) == 0;
+    if ((ip[9] == 6 || ip[9] == 17) && firstFragment &&
+        size >= 14 + ihl + 4) {
+        const uint8_t* port = ip + ihl + (fromGuest ? 2 : 0);
+        remotePort = (port[0] << 8) | port[1];
+    }
+    for (auto& p : s_profiles) {
+        if (p->matches(remoteAddr, remotePort)) {
+            return p.get();
+        }
+    }
+    return nullptr;
+}
+
+// Anything still pushed through the exported netshaper objects ends up in
+// the token buckets as well.
+static void
+slirp_netshaper_in_cb(void* data, size_t size, void* opaque)
+{
+    s_shaper_in->send(static_cast<const uint8_t*>(data), size);
+}
+
+static void
+slirp_netshaper_out_cb(void* data, size_t size, void* opaque)
+{
+    s_shaper_out->send(static_cast<const uint8_t*>(data), size);
+}
+
+void
+slirp_shaper_send_in(const uint8_t* data, size_t size)
+{
+    NetProfile* p = slirp_profile_lookup(data, size, true);
+    if (!p) {
+        s_shaper_in->send(data, size);
+    } else if (p->loss <= 0. || g_random_double() >= p->loss) {
+        p->shaperIn->send(data, size);
+    }
+}
+
+void
+slirp_shaper_send_out(const uint8_t* data, size_t size)
+{
+    NetProfile* p = slirp_profile_lookup(data, size, false);
+    if (!p) {
+        s_shaper_out->send(data, size);
+    } else if (p->loss <= 0. || g_random_double() >= p->loss) {
+        p->shaperOut->send(data, size);
+    }
 }
 
 void
@@ -59,50 +468,141 @@ slirp_init_shapers(void* slirp_state, void* net_client_state, Slirp* slirp)
     s_net_client_state = net_client_state;
     s_slirp = slirp;
     slirp_delay_in = netdelay_create(slirp_delay_in_cb);
-    slirp_shaper_in = netshaper_create(1, slirp_shaper_in_cb);
-    slirp_shaper_out = netshaper_create(1, slirp_shaper_out_cb);
+    s_shaper_in = new SlirpShaper(&qemu_net_upload_speed,
+                                  slirp_shaper_in_cb, nullptr);
+    s_shaper_out = new SlirpShaper(&qemu_net_download_speed,
+                                   slirp_shaper_out_cb, nullptr);
+    for (auto& p : s_profiles) {
+        slirp_profile_start(p.get());
+    }
+
+    // The slirp path no longer goes through these, but they are still
+    // exported for code that sets their rate directly.
+    slirp_shaper_in = netshaper_create(1, slirp_netshaper_in_cb);
+    slirp_shaper_out = netshaper_create(1, slirp_netshaper_out_cb);
 
     netdelay_set_latency(slirp_delay_in, qemu_net_min_latency,
                          qemu_net_max_latency);
     netshaper_set_rate(slirp_shaper_out, qemu_net_download_speed);
     netshaper_set_rate(slirp_shaper_in, qemu_net_upload_speed);
 }
-#endif  // CONFIG_SLIRP
 
-int
-android_parse_network_speed(const char*  speed)
+// Parse "<addr>[/<bits>][:<port>[-<port>]]" into |p|.
+static bool
+parse_profile_target(const char* spec, size_t len, NetProfile* p)
 {
-    int          n;
-    char*  end;
-    double       sp;
-
-    if (speed == NULL || speed[0] == 0) {
-        speed = DEFAULT_NETSPEED;
+    std::string target(spec, len);
+    unsigned a, b, c, d;
+    int n = 0;
+    if (sscanf(target.c_str(), "%u.%u.%u.%u%n", &a, &b, &c, &d, &n) != 4 ||
+        a > 255 || b > 255 || c > 255 || d > 255) {
+        return false;
     }
-
-    for (n = 0; android_netspeeds[n].name != NULL; n++) {
-        if (!strcmp(android_netspeeds[n].name, speed)) {
-            qemu_net_download_speed = android_netspeeds[n].download;
-            qemu_net_upload_speed   = android_netspeeds[n].upload;
-            return 0;
+    const char* s = target.c_str() + n;
+    unsigned bits = 32;
+    if (*s == '/') {
+        char* end;
+        bits = strtoul(s + 1, &end, 10);
+        if (end == s + 1 || bits > 32) {
+            return false;
         }
+        s = end;
     }
+    p->mask = bits ? ~0u << (32 - bits) : 0;
+    p->addr = ((a << 24) | (b << 16) | (c << 8) | d) & p->mask;
+    p->portMin = 0;
+    p->portMax = 0xffff;
+    if (*s == ':') {
+        char* end;
+        unsigned long lo = strtoul(s + 1, &end, 10);
+        unsigned long hi = lo;
+        if (end == s + 1 || lo > 0xffff) {
+            return false;
+        }
+        s = end;
+        if (*s == '-') {
+            hi = strtoul(s + 1, &end, 10);
+            if (end == s + 1 || hi < lo || hi > 0xffff) {
+                return false;
+            }
+            s = end;
+        }
+        p->portMin = lo;
+        p->portMax = hi;
+    }
+    return *s == '\0';
+}
 
-    /* is this a number ? */
-    sp = strtod(speed, &end);
-    if (end == speed) {
+int
+android_parse_network_profile(const char* spec)
+{
+    std::unique_ptr<NetProfile> p(new NetProfile());
+    const char* comma = strchr(spec, ',');
+    size_t len = comma ? (size_t)(comma - spec) : strlen(spec);
+    if (!parse_profile_target(spec, len, p.get())) {
         return -1;
     }
 
-    qemu_net_download_speed = qemu_net_upload_speed = sp*1000.;
-    if (*end == ':') {
-        speed = end+1;
-        sp = strtod(speed, &end);
-        if (end > speed) {
-            qemu_net_download_speed = sp*1000.;
+    while (comma) {
+        const char* start = comma + 1;
+        comma = strchr(start, ',');
+        std::string opt = comma ? std::string(start, comma - start)
+                                : std::string(start);
+        size_t eq = opt.find('=');
+        if (eq == std::string::npos) {
+            return -1;
+        }
+        std::string key = opt.substr(0, eq);
+        const char* value = opt.c_str() + eq + 1;
+        if (key == "speed") {
+            if (parse_network_speed(value, &p->uploadSpeed,
+                                    &p->downloadSpeed) < 0) {
+                return -1;
+            }
+        } else if (key == "delay") {
+            if (parse_network_latency(value, &p->minLatency,
+                                      &p->maxLatency) < 0) {
+                return -1;
+            }
+        } else if (key == "loss") {
+            char* end;
+            double loss = strtod(value, &end);
+            if (end == value || *end != '\0' || loss < 0. || loss > 100.) {
+                return -1;
+            }
+            p->loss = loss / 100.;
+        } else {
+            return -1;
         }
     }
 
+    if (s_slirp) {
+        slirp_profile_start(p.get());
+    }
+    s_profiles.push_back(std::move(p));
+    return 0;
+}
+
+void
+android_clear_network_profiles(void)
+{
+    s_profiles.clear();
+}
+#endif  // CONFIG_SLIRP
+
+int
+android_parse_network_speed(const char*  speed)
+{
+    if (speed == NULL || speed[0] == 0) {
+        speed = DEFAULT_NETSPEED;
+    }
+
+    int ret = parse_network_speed(speed, &qemu_net_upload_speed,
+                                  &qemu_net_download_speed);
+    if (ret <= 0) {
+        return ret;
+    }
+
     if (android_modem)
         amodem_set_data_network_type( android_modem,
                                       android_parse_network_type(speed) );
@@ -113,34 +613,9 @@ android_parse_network_speed(const char*  speed)
 int
 android_parse_network_latency(const char*  delay)
 {
-    int  n;
-    char*  end;
-    double  sp;
-
     if (delay == NULL || delay[0] == 0)
         delay = DEFAULT_NETDELAY;
 
-    for (n = 0; android_netdelays[n].name != NULL; n++) {
-        if ( !strcmp( android_netdelays[n].name, delay ) ) {
-            qemu_net_min_latency = android_netdelays[n].min_ms;
-            qemu_net_max_latency = android_netdelays[n].max_ms;
-            return 0;
-        }
-    }
-
-    /* is this a number ? */
-    sp = strtod(delay, &end);
-    if (end == delay) {
-        return -1;
-    }
-
-    qemu_net_min_latency = qemu_net_max_latency = (int)sp;
-    if (*end == ':') {
-        delay = (const char*)end+1;
-        sp = strtod(delay, &end);
-        if (end > delay) {
-            qemu_net_max_latency = (int)sp;
-        }
-    }
-    return 0;
+    return parse_network_latency(delay, &qemu_net_min_latency,
+                                 &qemu_net_max_latency);
 }
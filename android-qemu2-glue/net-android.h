@@ -22,6 +22,23 @@ ANDROID_BEGIN_HEADER
 void slirp_init_shapers(void* slirp_state,
                         void* net_client_state,
                         Slirp *slirp);
+
+/* Pass a packet from the guest to slirp (in) or from slirp to the guest
+ * (out) through the network speed and latency emulation. With no speed
+ * limit and no latency configured the packet goes straight through. */
+void slirp_shaper_send_in(const uint8_t* data, size_t size);
+void slirp_shaper_send_out(const uint8_t* data, size_t size);
+
+/* Add a network profile from a -netprofile value
+ * "<addr>[/<bits>][:<port>[-<port>]][,speed=<speed>][,delay=<delay>]
+ * [,loss=<percent>]", where speed and delay take the same values as
+ * -netspeed and -netdelay. Traffic with a matching remote end uses the
+ * first matching profile instead of the global settings. Returns 0 on
+ * success, -1 on a parse error. */
+int android_parse_network_profile(const char* spec);
+
+/* Drop all network profiles. */
+void android_clear_network_profiles(void);
 #endif  // CONFIG_SLIRP
 
 ANDROID_END_HEADER
@@ -16,6 +16,33 @@
 #include "android/emulation/control/cellular_agent.h"
 #include "android/shaper.h"
 #include "android/telephony/modem_driver.h"
+#include "android-qemu2-glue/telephony/modem_init.h"
+
+/* The modem may have a thread of its own, so android_modem is only used
+ * from callbacks given to qemu_android_modem_call(), which get a pointer
+ * to the new value.
+ */
+static void cellular_modemSetSignalStrength(void* opaque)
+{
+    amodem_set_signal_strength(android_modem, *(int*)opaque, 99);
+}
+
+static void cellular_modemSetVoiceRegistration(void* opaque)
+{
+    amodem_set_voice_registration(android_modem,
+                                  *(ARegistrationState*)opaque);
+}
+
+static void cellular_modemSetDataRegistration(void* opaque)
+{
+    amodem_set_data_registration(android_modem,
+                                 *(ARegistrationState*)opaque);
+}
+
+static void cellular_modemSetDataNetworkType(void* opaque)
+{
+    amodem_set_data_network_type(android_modem, *(ADataNetworkType*)opaque);
+}
 
 static void cellular_setSignalStrength(int zeroTo31)
 {
@@ -25,7 +52,7 @@ static void cellular_setSignalStrength(int zeroTo31)
         if (zeroTo31 <  0) zeroTo31 =  0;
         if (zeroTo31 > 31) zeroTo31 = 31;
 
-        amodem_set_signal_strength(android_modem, zeroTo31, 99);
+        qemu_android_modem_call(cellular_modemSetSignalStrength, &zeroTo31);
     }
 }
 
@@ -43,7 +70,7 @@ static void cellular_setVoiceStatus(enum CellularStatus voiceStatus)
             case Cellular_Stat_Unregistered:  state = A_REGISTRATION_UNREGISTERED;  break;
         }
 
-        amodem_set_voice_registration(android_modem, state);
+        qemu_android_modem_call(cellular_modemSetVoiceRegistration, &state);
     }
 }
 
@@ -61,7 +88,7 @@ static void cellular_setDataStatus(enum CellularStatus dataStatus)
     }
 
     if (android_modem) {
-        amodem_set_data_registration(android_modem, state);
+        qemu_android_modem_call(cellular_modemSetDataRegistration, &state);
     }
 
     qemu_net_disable = (state != A_REGISTRATION_HOME    &&
@@ -95,8 +122,8 @@ static void cellular_setStandard(enum CellularStandard cStandard)
     netshaper_set_rate(slirp_shaper_out, qemu_net_upload_speed);
 
     if (android_modem) {
-        amodem_set_data_network_type(android_modem,
-                                     android_parse_network_type(speedName));
+        ADataNetworkType type = android_parse_network_type(speedName);
+        qemu_android_modem_call(cellular_modemSetDataNetworkType, &type);
     }
 }
 
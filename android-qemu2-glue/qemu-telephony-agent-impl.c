@@ -20,8 +20,8 @@
 
 static int gsm_number_is_bad(const char*);
 
-static TelephonyResponse telephony_telephonyCmd(TelephonyOperation op,
-                                                const char *phoneNumber)
+static TelephonyResponse telephony_doTelephonyCmd(TelephonyOperation op,
+                                                  const char *phoneNumber)
 {
     int resp;
     int holdCommand;
@@ -79,6 +79,28 @@ static TelephonyResponse telephony_telephonyCmd(TelephonyOperation op,
     }
 }
 
+typedef struct {
+    TelephonyOperation op;
+    const char* phoneNumber;
+    TelephonyResponse resp;
+} TelephonyCall;
+
+static void telephony_call(void* opaque)
+{
+    TelephonyCall* call = opaque;
+    call->resp = telephony_doTelephonyCmd(call->op, call->phoneNumber);
+}
+
+static TelephonyResponse telephony_telephonyCmd(TelephonyOperation op,
+                                                const char *phoneNumber)
+{
+    TelephonyCall call = { op, phoneNumber, Tel_Resp_OK };
+
+    /* The modem may have a thread of its own */
+    qemu_android_modem_call(telephony_call, &call);
+    return call.resp;
+}
+
 
 // TODO: This is very similar to 'gsm_check_number' in android-qemu1-glue/console.c
 //       I should probably instead use sms_address_from_str() in telephony/sms.c
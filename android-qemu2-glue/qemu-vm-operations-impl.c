@@ -16,15 +16,16 @@
 
 #include "android/emulation/control/callbacks.h"
 #include "android/emulation/control/vm_operations.h"
-//#include "cpu.h"
-//#include "monitor/monitor.h"
+#include "android/utils/debug.h"
+#include "monitor/monitor.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qstring.h"
+#include "qemu/timer.h"
 #include "sysemu/sysemu.h"
 
 #include <stdlib.h>
 #include <string.h>
 
-// TODO(zyy@): implement the VM snapshots support
-
 static bool qemu_vm_stop() {
     vm_stop(RUN_STATE_DEBUG);
     return true;
@@ -42,47 +43,87 @@ static bool qemu_vm_is_running() {
 static bool qemu_snapshot_list(void* opaque,
                                LineConsumerCallback outConsumer,
                                LineConsumerCallback errConsumer) {
-//    Monitor* out = monitor_fake_new(opaque, outConsumer);
-//    Monitor* err = monitor_fake_new(opaque, errConsumer);
-//    do_info_snapshots(out, err);
-//    int ret = monitor_fake_get_bytes(err);
-//    monitor_fake_free(err);
-//    monitor_fake_free(out);
-//    return !ret;
-    return false;
+    Monitor* out = monitor_fake_new(opaque, outConsumer);
+    Monitor* err = monitor_fake_new(opaque, errConsumer);
+    Monitor* old_mon = cur_mon;
+    QDict* qdict = qdict_new();
+
+    // do_info_snapshots() prints its own errors to |out| along with the
+    // list, anything going through error_report() goes to |err|.
+    cur_mon = err;
+    do_info_snapshots(out, qdict);
+    cur_mon = old_mon;
+
+    QDECREF(qdict);
+    int ret = monitor_fake_get_bytes(err);
+    monitor_fake_free(err);
+    monitor_fake_free(out);
+    return !ret;
 }
 
 static bool qemu_snapshot_save(const char* name,
                                void* opaque,
                                LineConsumerCallback errConsumer) {
-    //Monitor* err = monitor_fake_new(opaque, errConsumer);
-    //do_savevm(err, name);
-    //int ret = monitor_fake_get_bytes(err);
-    //monitor_fake_free(err);
-    //return !ret;
-    return false;
+    Monitor* err = monitor_fake_new(opaque, errConsumer);
+    Monitor* old_mon = cur_mon;
+    int64_t start_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    cur_mon = err;
+    int ret = save_vmstate(name);
+    cur_mon = old_mon;
+
+    if (ret == 0) {
+        dprint("Saved snapshot '%s' in %" PRId64 " ms", name,
+               qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_ms);
+    }
+    monitor_fake_free(err);
+    return ret == 0;
 }
 
 static bool qemu_snapshot_load(const char* name,
                                void* opaque,
                                LineConsumerCallback errConsumer) {
-    //Monitor* err = monitor_fake_new(opaque, errConsumer);
-    //do_loadvm(err, name);
-    //int ret = monitor_fake_get_bytes(err);
-    //monitor_fake_free(err);
-    //return !ret;
-    return false;
+    Monitor* err = monitor_fake_new(opaque, errConsumer);
+    Monitor* old_mon = cur_mon;
+    int saved_vm_running = runstate_is_running();
+    int64_t start_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    // Same as the 'loadvm' monitor command.
+    vm_stop(RUN_STATE_RESTORE_VM);
+    cur_mon = err;
+    int ret = load_vmstate(name);
+    cur_mon = old_mon;
+
+    if (ret == 0) {
+        dprint("Loaded snapshot '%s' in %" PRId64 " ms", name,
+               qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_ms);
+        if (saved_vm_running) {
+            vm_start();
+        }
+    } else if (ret == -ENOENT) {
+        // Nothing was touched, keep running the current state.
+        monitor_printf(err, "Snapshot '%s' does not exist\n", name);
+        if (saved_vm_running) {
+            vm_start();
+        }
+    }
+    monitor_fake_free(err);
+    return ret == 0;
 }
 
 static bool qemu_snapshot_delete(const char* name,
                                  void* opaque,
                                  LineConsumerCallback errConsumer) {
-    //Monitor* err = monitor_fake_new(opaque, errConsumer);
-    //do_delvm(err, name);
-    //int ret = monitor_fake_get_bytes(err);
-    //monitor_fake_free(err);
-    //return !ret;
-    return false;
+    Monitor* err = monitor_fake_new(opaque, errConsumer);
+    QDict* qdict = qdict_new();
+
+    qdict_put(qdict, "name", qstring_from_str(name));
+    do_delvm(err, qdict);
+    QDECREF(qdict);
+
+    int ret = monitor_fake_get_bytes(err);
+    monitor_fake_free(err);
+    return !ret;
 }
 
 static const QAndroidVmOperations sQAndroidVmOperations = {
@@ -12,16 +12,45 @@
 #include "android-qemu2-glue/telephony/modem_init.h"
 
 #include "android/telephony/modem_driver.h"
+#include "android/utils/looper.h"
+#include "android-qemu2-glue/emulation/serial_line.h"
+#include "android-qemu2-glue/looper-qemu.h"
 #include "android-qemu2-glue/utils/stream.h"
 
 #include "hw/hw.h"
 
+#include <stdlib.h>
+
 #define MODEM_DEV_STATE_SAVE_VERSION 1
 
+/* Looper of the modem's I/O thread, NULL when it runs on the main loop */
+static Looper* modem_looper;
+
+typedef struct {
+    QEMUFile* file;
+    AModem modem;
+    int result;
+} ModemStateCall;
+
+static void modem_state_save_call(void* opaque)
+{
+    ModemStateCall* call = opaque;
+    Stream* const s = stream_from_qemufile(call->file);
+    amodem_state_save(call->modem, (SysFile*)s);
+    stream_free(s);
+}
+
 static void modem_state_save(QEMUFile* file, void* opaque)
 {
-    Stream* const s = stream_from_qemufile(file);
-    amodem_state_save((AModem)opaque, (SysFile*)s);
+    ModemStateCall call = { file, (AModem)opaque, 0 };
+    qemu_android_modem_call(modem_state_save_call, &call);
+}
+
+static void modem_state_load_call(void* opaque)
+{
+    ModemStateCall* call = opaque;
+    Stream* const s = stream_from_qemufile(call->file);
+    call->result = amodem_state_load(call->modem, (SysFile*)s);
     stream_free(s);
 }
 
@@ -30,16 +59,49 @@ static int modem_state_load(QEMUFile* file, void* opaque, int version_id)
     if (version_id != MODEM_DEV_STATE_SAVE_VERSION)
         return -1;
 
-    Stream* const s = stream_from_qemufile(file);
-    const int res = amodem_state_load((AModem)opaque, (SysFile*)s);
-    stream_free(s);
+    ModemStateCall call = { file, (AModem)opaque, 0 };
+    qemu_android_modem_call(modem_state_load_call, &call);
+    return call.result;
+}
 
-    return res;
+/* Runs on the modem thread, so that the modem's timers and sockets are
+ * created on its looper.
+ */
+static void modem_thread_init(void* opaque)
+{
+    looper_setForThread(modem_looper);
+    android_modem_init(*(int*)opaque);
+}
+
+static bool modem_thread_wanted(void)
+{
+    const char* env = getenv("ANDROID_MODEM_THREAD");
+    return env && env[0] && strcmp(env, "0") != 0;
 }
 
+void qemu_android_modem_call(void (*func)(void* opaque), void* opaque) {
+    if (modem_looper) {
+        qemu_looper_run_sync(modem_looper, func, opaque);
+    } else {
+        func(opaque);
+    }
+}
 
 void qemu_android_modem_init(int base_port) {
-    android_modem_init(base_port);
+    if (android_modem_serial_line != NULL && modem_thread_wanted()) {
+        modem_looper = qemu_looper_create_iothread("modem");
+    }
+
+    if (modem_looper) {
+        /* AT commands and unsolicited responses are queued between the
+         * qemud channel, still on the main loop, and the modem thread.
+         */
+        android_modem_serial_line = android_serialline_threaded_open(
+                android_modem_serial_line, modem_looper);
+        qemu_looper_run_sync(modem_looper, modem_thread_init, &base_port);
+    } else {
+        android_modem_init(base_port);
+    }
 
     if (android_modem_serial_line != NULL) {
         register_savevm(NULL,
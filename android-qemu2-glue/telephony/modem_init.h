@@ -17,4 +17,12 @@ ANDROID_BEGIN_HEADER
 /* must be called before the VM runs if there is a modem to emulate */
 extern void qemu_android_modem_init(int base_port);
 
+/* Call |func(opaque)| where the modem runs, and wait for it to return.
+ * With ANDROID_MODEM_THREAD set in the environment, the modem is serviced
+ * by its own I/O thread, and anything that uses android_modem from the
+ * main loop (console commands, UI agents, snapshots) must go through here.
+ * Otherwise this simply calls |func|.
+ */
+extern void qemu_android_modem_call(void (*func)(void* opaque), void* opaque);
+
 ANDROID_END_HEADER
@@ -0,0 +1,259 @@
+// Copyright 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "android-qemu2-glue/zygote.h"
+
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/module.h"
+#include "qemu/sockets.h"
+#include "qom/object.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#endif
+
+#define ZYGOTE_DEFAULT_POOL     4
+#define ZYGOTE_MAX_POOL         64
+#define ZYGOTE_MAX_REQUEST      (64 * 1024)
+
+#ifdef _WIN32
+
+bool android_zygote_run(int* argc, char*** argv) {
+    if (getenv("ANDROID_ZYGOTE_SOCKET")) {
+        error_report("warning: ANDROID_ZYGOTE_SOCKET is ignored on Windows");
+    }
+    return true;
+}
+
+#else  // !_WIN32
+
+static volatile sig_atomic_t zygote_quit;
+
+static void zygote_handle_signal(int sig) {
+    zygote_quit = 1;
+}
+
+static void zygote_touch_class(ObjectClass* klass, void* opaque) {
+}
+
+// Everything done here is inherited by the pool, and skipped later on
+// since module_call_init() only runs each type of initializers once.
+static void zygote_prewarm(void) {
+    module_call_init(MODULE_INIT_QOM);
+    module_call_init(MODULE_INIT_MACHINE);
+    // Runs the class_init of every type, which would otherwise be done
+    // on first use, while creating the machine.
+    object_class_foreach(zygote_touch_class, NULL, true, NULL);
+}
+
+// Reads the arguments of a job from |fd|, and returns them after
+// |argv0| in a NULL-terminated array, or NULL on error.
+static char** zygote_read_request(int fd, const char* argv0, int* count) {
+    GString* buf = g_string_new(NULL);
+    char chunk[4096];
+    char** args;
+    size_t pos;
+    int n;
+
+    // An empty argument ends the request.
+    while (!(buf->len == 1 && buf->str[0] == '\0') &&
+           !(buf->len >= 2 && buf->str[buf->len - 1] == '\0' &&
+             buf->str[buf->len - 2] == '\0')) {
+        ssize_t len = read(fd, chunk, sizeof(chunk));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0 || buf->len + len > ZYGOTE_MAX_REQUEST) {
+            g_string_free(buf, true);
+            return NULL;
+        }
+        g_string_append_len(buf, chunk, len);
+    }
+
+    n = 1;
+    for (pos = 0; buf->str[pos] != '\0'; pos += strlen(buf->str + pos) + 1) {
+        n++;
+    }
+    args = g_new(char*, n + 1);
+    args[0] = g_strdup(argv0);
+    n = 1;
+    for (pos = 0; buf->str[pos] != '\0'; pos += strlen(buf->str + pos) + 1) {
+        args[n++] = g_strdup(buf->str + pos);
+    }
+    args[n] = NULL;
+    g_string_free(buf, true);
+
+    *count = n;
+    return args;
+}
+
+// Runs in a pool process: waits for a job and sets itself up to run it.
+static bool zygote_child(int listen_fd, int status_fd,
+                         int* argc, char*** argv) {
+    pid_t pid = getpid();
+    char reply[32];
+    char** args;
+    int count;
+    int conn;
+
+#ifdef __linux__
+    // Don't outlive the zygote while idle.
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+
+    do {
+        conn = qemu_accept(listen_fd, NULL, NULL);
+    } while (conn < 0 && (errno == EINTR || errno == ECONNABORTED));
+    if (conn < 0) {
+        error_report("zygote: accept failed: %s", strerror(errno));
+        exit(1);
+    }
+
+#ifdef __linux__
+    prctl(PR_SET_PDEATHSIG, 0);
+#endif
+    // Tell the zygote to fork a replacement, writes of less than
+    // PIPE_BUF bytes don't interleave.
+    if (write(status_fd, &pid, sizeof(pid)) != sizeof(pid)) {
+        exit(1);
+    }
+    close(status_fd);
+    close(listen_fd);
+
+    args = zygote_read_request(conn, (*argv)[0], &count);
+    if (!args) {
+        error_report("zygote: invalid job request");
+        exit(1);
+    }
+
+    snprintf(reply, sizeof(reply), "pid %d\n", (int)pid);
+    if (write(conn, reply, strlen(reply)) < 0) {
+        exit(1);
+    }
+    dup2(conn, STDOUT_FILENO);
+    dup2(conn, STDERR_FILENO);
+    if (conn > STDERR_FILENO) {
+        close(conn);
+    }
+
+    *argc = count;
+    *argv = args;
+    return true;
+}
+
+static void zygote_forget(pid_t* idle, int* idle_count, pid_t pid) {
+    int i;
+
+    for (i = 0; i < *idle_count; i++) {
+        if (idle[i] == pid) {
+            idle[i] = idle[--*idle_count];
+            return;
+        }
+    }
+}
+
+bool android_zygote_run(int* argc, char*** argv) {
+    const char* path = getenv("ANDROID_ZYGOTE_SOCKET");
+    const char* pool_env = getenv("ANDROID_ZYGOTE_POOL");
+    int pool = ZYGOTE_DEFAULT_POOL;
+    pid_t idle[ZYGOTE_MAX_POOL];
+    int idle_count = 0;
+    struct sigaction sa;
+    Error* err = NULL;
+    int listen_fd;
+    int status[2];
+    int i;
+
+    if (!path || !*path) {
+        return true;
+    }
+    if (pool_env) {
+        pool = atoi(pool_env);
+        if (pool < 1 || pool > ZYGOTE_MAX_POOL) {
+            error_report("ANDROID_ZYGOTE_POOL must be between 1 and %d",
+                         ZYGOTE_MAX_POOL);
+            return false;
+        }
+    }
+
+    listen_fd = unix_listen(path, NULL, 0, &err);
+    if (listen_fd < 0) {
+        error_report("zygote: %s", error_get_pretty(err));
+        error_free(err);
+        return false;
+    }
+    if (pipe(status) < 0) {
+        error_report("zygote: %s", strerror(errno));
+        close(listen_fd);
+        return false;
+    }
+
+    zygote_prewarm();
+
+    // No SA_RESTART, so that poll() returns when asked to quit.
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = zygote_handle_signal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    while (!zygote_quit) {
+        struct pollfd pfd = { .fd = status[0], .events = POLLIN };
+        pid_t pid;
+
+        while (idle_count < pool) {
+            pid = fork();
+            if (pid == 0) {
+                signal(SIGTERM, SIG_DFL);
+                signal(SIGINT, SIG_DFL);
+                close(status[0]);
+                return zygote_child(listen_fd, status[1], argc, argv);
+            }
+            if (pid < 0) {
+                // Tried again after the next poll() timeout.
+                error_report("zygote: fork failed: %s", strerror(errno));
+                break;
+            }
+            idle[idle_count++] = pid;
+        }
+
+        if (poll(&pfd, 1, 1000) > 0 &&
+            read(status[0], &pid, sizeof(pid)) == sizeof(pid)) {
+            zygote_forget(idle, &idle_count, pid);
+        }
+        // Reap the jobs that are done, and pool processes that died.
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            zygote_forget(idle, &idle_count, pid);
+        }
+    }
+
+    // Jobs that are running are left alone.
+    for (i = 0; i < idle_count; i++) {
+        kill(idle[i], SIGTERM);
+    }
+    unlink(path);
+    exit(0);
+}
+
+#endif  // !_WIN32
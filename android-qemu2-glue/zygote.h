@@ -0,0 +1,41 @@
+// Copyright 2016 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include "android/utils/compiler.h"
+
+#include <stdbool.h>
+
+ANDROID_BEGIN_HEADER
+
+// Launcher mode for farms starting many emulators from the same binary.
+//
+// When $ANDROID_ZYGOTE_SOCKET names a Unix socket path, the process does
+// the part of the startup that doesn't depend on the command line: the
+// dynamic linking, the registration of every QOM type and the class
+// initialization of each of them. It then keeps $ANDROID_ZYGOTE_POOL
+// (default 4) forked copies of itself waiting on the socket, and never
+// returns. A client that connects hands one of them its command line, as
+// NUL-terminated arguments not including the program name, followed by
+// an empty one. The process replies "pid <pid>\n", makes the connection
+// its stdout and stderr, and goes on starting up with that command line,
+// while the zygote forks a replacement.
+//
+// This has to be called first in main(), before any thread is created.
+// Returns true to go on starting up with |*argc| and |*argv|, which are
+// replaced in a process that was handed a job, or false on error.
+bool android_zygote_run(int* argc, char*** argv);
+
+ANDROID_END_HEADER
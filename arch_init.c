@@ -24,9 +24,11 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <zlib.h>
 #ifndef _WIN32
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <fcntl.h>
 #endif
 #include "config.h"
 #include "monitor/monitor.h"
@@ -39,6 +41,9 @@
 #include "hw/pci/pci.h"
 #include "hw/audio/audio.h"
 #include "sysemu/kvm.h"
+#include "sysemu/hax.h"
+#include "sysemu/whpx.h"
+#include "sysemu/hvf.h"
 #include "migration/migration.h"
 #include "hw/i386/smbios.h"
 #include "exec/address-spaces.h"
@@ -118,7 +123,7 @@ static uint64_t bitmap_sync_count;
 /***********************************************************/
 /* ram save/restore */
 
-#define RAM_SAVE_FLAG_FULL     0x01 /* Obsolete, not used anymore */
+#define RAM_SAVE_FLAG_DUP      0x01 /* was RAM_SAVE_FLAG_FULL, long unused */
 #define RAM_SAVE_FLAG_COMPRESS 0x02
 #define RAM_SAVE_FLAG_MEM_SIZE 0x04
 #define RAM_SAVE_FLAG_PAGE     0x08
@@ -126,6 +131,11 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
+#define RAM_SAVE_FLAG_FILE     0x100
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x200
+
+/* Where RAM goes for the next savevm or comes from for the next loadvm */
+static char *ram_snapshot_file;
 
 static struct defconfig_file {
     const char *filename;
@@ -162,13 +172,8 @@ static inline bool is_zero_range(uint8_t *p, uint64_t size)
     return buffer_find_nonzero_offset(p, size) == size;
 }
 
-/* struct contains XBZRLE cache and a static page
-   used by the compression */
+/* struct contains XBZRLE cache */
 static struct {
-    /* buffer used for XBZRLE encoding */
-    uint8_t *encoded_buf;
-    /* buffer for storing page content */
-    uint8_t *current_buf;
     /* Cache for XBZRLE, Protected by lock. */
     PageCache *cache;
     QemuMutex lock;
@@ -189,6 +194,8 @@ static void XBZRLE_cache_unlock(void)
         qemu_mutex_unlock(&XBZRLE.lock);
 }
 
+static void ram_compress_drain(void);
+
 /*
  * called from qmp_migrate_set_cache_size in main thread, possibly while
  * a migration is in progress.
@@ -218,6 +225,8 @@ int64_t xbzrle_cache_resize(int64_t new_size)
             goto out;
         }
 
+        /* Encoder threads may still be using the old one */
+        ram_compress_drain();
         cache_fini(XBZRLE.cache);
         XBZRLE.cache = new_cache;
     }
@@ -240,6 +249,7 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_cache_miss;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
+    uint64_t xbzrle_encode_ns;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -304,6 +314,11 @@ uint64_t xbzrle_mig_pages_overflow(void)
     return acct_info.xbzrle_overflows;
 }
 
+uint64_t xbzrle_mig_encode_time(void)
+{
+    return acct_info.xbzrle_encode_ns / SCALE_MS;
+}
+
 static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
                              int cont, int flag)
 {
@@ -326,92 +341,587 @@ static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
 static RAMBlock *last_seen_block;
 /* This is the last block from where we have sent data */
 static RAMBlock *last_sent_block;
-static ram_addr_t last_offset;
-static unsigned long *migration_bitmap;
-static uint64_t migration_dirty_pages;
-static uint32_t last_version;
-static bool ram_bulk_stage;
 
-/* Update the xbzrle cache to reflect a page that's been sent as all 0.
- * The important thing is that a stale (not-yet-0'd) page be replaced
- * by the new data.
- * As a bonus, if the page wasn't in the cache it gets added so that
- * when a small write is made into the 0'd page it gets XBZRLE sent
+#define ENCODING_FLAG_XBZRLE 0x1
+
+/*
+ * With the compress capability, pages are deflated by a pool of worker
+ * threads.  With xbzrle, the same pool encodes pages against the shared
+ * page cache once the bulk stage is over.  The migration thread hands
+ * each page to an idle worker and writes out whatever that worker
+ * compressed before; a page carries its block and offset, so the order
+ * pages reach the stream in does not matter as long as all of them are
+ * written before the next bitmap sync.  The loading side inflates them
+ * in a pool of its own.
  */
-static void xbzrle_cache_zero_page(ram_addr_t current_addr)
+#define RAM_COMPRESS_MAX_THREADS 16
+#define RAM_COMPRESS_LEVEL       Z_BEST_SPEED
+
+/* What a worker made of its page */
+enum {
+    RAM_COMPRESS_RAW,       /* send the copy in page as is */
+    RAM_COMPRESS_ZLIB,      /* deflated into out */
+    RAM_COMPRESS_XBZRLE,    /* XBZRLE encoded into out */
+    RAM_COMPRESS_SKIP,      /* unchanged since it was last sent */
+};
+
+typedef struct RamCompressThread {
+    QemuThread thread;
+    QemuCond cond;
+    bool busy;              /* holds a page not yet written to the stream */
+    bool done;              /* page compressed */
+    bool quit;
+    RAMBlock *block;
+    ram_addr_t offset;
+    PageCache *cache;       /* XBZRLE encode against this, else deflate */
+    bool last_stage;
+    int result;
+    uint8_t *page;
+    uint8_t *out;
+    uLongf out_len;
+} RamCompressThread;
+
+static RamCompressThread *compress_threads;
+static int compress_nthreads;
+static QemuMutex compress_lock;
+static QemuCond compress_done_cond;
+
+static int ram_compress_host_cpus(void)
 {
-    if (ram_bulk_stage || !migrate_use_xbzrle()) {
-        return;
-    }
+#ifdef _WIN32
+    SYSTEM_INFO system_info;
 
-    /* We don't care if this fails to allocate a new cache page
-     * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, ZERO_TARGET_PAGE);
+    GetSystemInfo(&system_info);
+    return system_info.dwNumberOfProcessors;
+#else
+    return sysconf(_SC_NPROCESSORS_ONLN);
+#endif
 }
 
-#define ENCODING_FLAG_XBZRLE 0x1
+/*
+ * Encode the page copied to t->page against what the cache holds for
+ * it, which is what the destination has, and update the cache to match
+ * what it will have.  Pages missing from the cache are sent raw.
+ * Returns whether it was a cache miss.
+ */
+static bool ram_xbzrle_encode(RamCompressThread *t, bool *overflow)
+{
+    ram_addr_t addr = t->block->offset + t->offset;
+    uint8_t *cached;
+    bool miss = false;
+    int len;
+
+    cache_lock(t->cache, addr);
+    if (!cache_is_cached(t->cache, addr)) {
+        miss = true;
+        t->result = RAM_COMPRESS_RAW;
+        if (!t->last_stage) {
+            /* A failure only costs the next send of the page */
+            cache_insert(t->cache, addr, t->page);
+        }
+    } else {
+        cached = get_cached_data(t->cache, addr);
+        len = xbzrle_encode_buffer(cached, t->page, TARGET_PAGE_SIZE,
+                                   t->out, TARGET_PAGE_SIZE);
+        if (len == 0) {
+            t->result = RAM_COMPRESS_SKIP;
+        } else if (len < 0) {
+            *overflow = true;
+            t->result = RAM_COMPRESS_RAW;
+        } else {
+            t->result = RAM_COMPRESS_XBZRLE;
+            t->out_len = len;
+        }
+        if (len != 0 && !t->last_stage) {
+            memcpy(cached, t->page, TARGET_PAGE_SIZE);
+        }
+    }
+    cache_unlock(t->cache, addr);
+    return miss;
+}
 
-static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
-                            ram_addr_t current_addr, RAMBlock *block,
-                            ram_addr_t offset, int cont, bool last_stage)
+static void *ram_compress_thread(void *opaque)
 {
-    int encoded_len = 0, bytes_sent = -1;
-    uint8_t *prev_cached_page;
+    RamCompressThread *t = opaque;
 
-    if (!cache_is_cached(XBZRLE.cache, current_addr)) {
-        acct_info.xbzrle_cache_miss++;
-        if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data) == -1) {
-                return -1;
-            } else {
-                /* update *current_data when the page has been
-                   inserted into cache */
-                *current_data = get_cached_data(XBZRLE.cache, current_addr);
+    qemu_mutex_lock(&compress_lock);
+    while (!t->quit) {
+        bool miss = false, overflow = false;
+        int64_t start = 0;
+
+        if (!t->busy || t->done) {
+            qemu_cond_wait(&t->cond, &compress_lock);
+            continue;
+        }
+        qemu_mutex_unlock(&compress_lock);
+
+        /* The guest may still be writing the page; compress a copy */
+        memcpy(t->page, memory_region_get_ram_ptr(t->block->mr) + t->offset,
+               TARGET_PAGE_SIZE);
+        if (t->cache) {
+            start = get_clock();
+            miss = ram_xbzrle_encode(t, &overflow);
+        } else {
+            t->out_len = compressBound(TARGET_PAGE_SIZE);
+            t->result = RAM_COMPRESS_ZLIB;
+            if (compress2(t->out, &t->out_len, t->page, TARGET_PAGE_SIZE,
+                          RAM_COMPRESS_LEVEL) != Z_OK) {
+                t->result = RAM_COMPRESS_RAW;
             }
         }
-        return -1;
+
+        qemu_mutex_lock(&compress_lock);
+        if (t->cache) {
+            acct_info.xbzrle_encode_ns += get_clock() - start;
+            acct_info.xbzrle_cache_miss += miss;
+            acct_info.xbzrle_overflows += overflow;
+        }
+        t->done = true;
+        qemu_cond_broadcast(&compress_done_cond);
+    }
+    qemu_mutex_unlock(&compress_lock);
+    return NULL;
+}
+
+static void ram_compress_start(void)
+{
+    int i;
+
+    compress_nthreads = MIN(MAX(ram_compress_host_cpus(), 1),
+                            RAM_COMPRESS_MAX_THREADS);
+    compress_threads = g_new0(RamCompressThread, compress_nthreads);
+    qemu_mutex_init(&compress_lock);
+    qemu_cond_init(&compress_done_cond);
+    for (i = 0; i < compress_nthreads; i++) {
+        RamCompressThread *t = &compress_threads[i];
+
+        t->page = g_malloc(TARGET_PAGE_SIZE);
+        t->out = g_malloc(MAX(compressBound(TARGET_PAGE_SIZE),
+                              TARGET_PAGE_SIZE));
+        qemu_cond_init(&t->cond);
+        qemu_thread_create(&t->thread, "ram-compress", ram_compress_thread,
+                           t, QEMU_THREAD_JOINABLE);
     }
+}
+
+static void ram_compress_stop(void)
+{
+    int i;
 
-    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+    if (!compress_threads) {
+        return;
+    }
+    qemu_mutex_lock(&compress_lock);
+    for (i = 0; i < compress_nthreads; i++) {
+        compress_threads[i].quit = true;
+        qemu_cond_signal(&compress_threads[i].cond);
+    }
+    qemu_mutex_unlock(&compress_lock);
+    for (i = 0; i < compress_nthreads; i++) {
+        RamCompressThread *t = &compress_threads[i];
+
+        qemu_thread_join(&t->thread);
+        qemu_cond_destroy(&t->cond);
+        g_free(t->page);
+        g_free(t->out);
+    }
+    qemu_cond_destroy(&compress_done_cond);
+    qemu_mutex_destroy(&compress_lock);
+    g_free(compress_threads);
+    compress_threads = NULL;
+}
 
-    /* save current buffer into memory */
-    memcpy(XBZRLE.current_buf, *current_data, TARGET_PAGE_SIZE);
+/* Write out a worker's finished page.  Called with compress_lock held. */
+static int ram_compress_put(QEMUFile *f, RamCompressThread *t)
+{
+    int bytes_sent;
 
-    /* XBZRLE encoding (if there is no overflow) */
-    encoded_len = xbzrle_encode_buffer(prev_cached_page, XBZRLE.current_buf,
-                                       TARGET_PAGE_SIZE, XBZRLE.encoded_buf,
-                                       TARGET_PAGE_SIZE);
-    if (encoded_len == 0) {
-        DPRINTF("Skipping unmodified page\n");
+    t->busy = false;
+    switch (t->result) {
+    case RAM_COMPRESS_SKIP:
         return 0;
-    } else if (encoded_len == -1) {
-        DPRINTF("Overflow\n");
-        acct_info.xbzrle_overflows++;
-        /* update data in the cache */
-        if (!last_stage) {
-            memcpy(prev_cached_page, *current_data, TARGET_PAGE_SIZE);
-            *current_data = prev_cached_page;
+    case RAM_COMPRESS_ZLIB:
+        bytes_sent = save_block_hdr(f, t->block, t->offset, 0,
+                                    RAM_SAVE_FLAG_COMPRESS_PAGE);
+        qemu_put_be32(f, t->out_len);
+        qemu_put_buffer(f, t->out, t->out_len);
+        bytes_sent += 4 + t->out_len;
+        acct_info.norm_pages++;
+        break;
+    case RAM_COMPRESS_XBZRLE:
+        bytes_sent = save_block_hdr(f, t->block, t->offset, 0,
+                                    RAM_SAVE_FLAG_XBZRLE);
+        qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
+        qemu_put_be16(f, t->out_len);
+        qemu_put_buffer(f, t->out, t->out_len);
+        bytes_sent += t->out_len + 1 + 2;
+        acct_info.xbzrle_pages++;
+        acct_info.xbzrle_bytes += bytes_sent;
+        break;
+    default:
+        bytes_sent = save_block_hdr(f, t->block, t->offset, 0,
+                                    RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, t->page, TARGET_PAGE_SIZE);
+        bytes_sent += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+        break;
+    }
+    last_sent_block = t->block;
+    return bytes_sent;
+}
+
+/*
+ * Queue a page for compression, or for XBZRLE encoding against @cache,
+ * returning the bytes written to the stream for pages compressed earlier,
+ * which may be none.
+ */
+static int ram_compress_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                             PageCache *cache, bool last_stage)
+{
+    RamCompressThread *t = NULL;
+    int i, bytes_sent = 0;
+
+    qemu_mutex_lock(&compress_lock);
+    while (!t) {
+        for (i = 0; i < compress_nthreads; i++) {
+            if (!compress_threads[i].busy) {
+                t = &compress_threads[i];
+                break;
+            }
+            if (compress_threads[i].done) {
+                t = &compress_threads[i];
+                bytes_sent = ram_compress_put(f, t);
+                break;
+            }
+        }
+        if (!t) {
+            qemu_cond_wait(&compress_done_cond, &compress_lock);
         }
-        return -1;
     }
+    t->block = block;
+    t->offset = offset;
+    t->cache = cache;
+    t->last_stage = last_stage;
+    t->busy = true;
+    t->done = false;
+    qemu_cond_signal(&t->cond);
+    qemu_mutex_unlock(&compress_lock);
+
+    return bytes_sent;
+}
+
+/* Wait for the workers to be done with the pages they hold */
+static void ram_compress_drain(void)
+{
+    int i;
 
-    /* we need to update the data in the cache, in order to get the same data */
-    if (!last_stage) {
-        memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
+    if (!compress_threads) {
+        return;
+    }
+    qemu_mutex_lock(&compress_lock);
+    for (i = 0; i < compress_nthreads; i++) {
+        while (compress_threads[i].busy && !compress_threads[i].done) {
+            qemu_cond_wait(&compress_done_cond, &compress_lock);
+        }
     }
+    qemu_mutex_unlock(&compress_lock);
+}
+
+/* Write out all queued pages, returning the bytes written */
+static int ram_compress_flush(QEMUFile *f)
+{
+    int i, bytes_sent = 0;
 
-    /* Send XBZRLE based compressed page */
-    bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_XBZRLE);
-    qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
-    qemu_put_be16(f, encoded_len);
-    qemu_put_buffer(f, XBZRLE.encoded_buf, encoded_len);
-    bytes_sent += encoded_len + 1 + 2;
-    acct_info.xbzrle_pages++;
-    acct_info.xbzrle_bytes += bytes_sent;
+    if (!compress_threads) {
+        return 0;
+    }
+    qemu_mutex_lock(&compress_lock);
+    for (i = 0; i < compress_nthreads; i++) {
+        RamCompressThread *t = &compress_threads[i];
 
+        while (t->busy && !t->done) {
+            qemu_cond_wait(&compress_done_cond, &compress_lock);
+        }
+        if (t->busy) {
+            bytes_sent += ram_compress_put(f, t);
+        }
+    }
+    qemu_mutex_unlock(&compress_lock);
     return bytes_sent;
 }
 
+typedef struct RamDecompressThread {
+    QemuThread thread;
+    QemuCond cond;
+    bool busy;
+    bool quit;
+    void *host;
+    uint8_t *in;
+    uLong in_len;
+} RamDecompressThread;
+
+static RamDecompressThread *decompress_threads;
+static int decompress_nthreads;
+static QemuMutex decompress_lock;
+static QemuCond decompress_done_cond;
+static bool decompress_failed;
+
+static void *ram_decompress_thread(void *opaque)
+{
+    RamDecompressThread *t = opaque;
+
+    qemu_mutex_lock(&decompress_lock);
+    while (!t->quit) {
+        uLongf len = TARGET_PAGE_SIZE;
+
+        if (!t->busy) {
+            qemu_cond_wait(&t->cond, &decompress_lock);
+            continue;
+        }
+        qemu_mutex_unlock(&decompress_lock);
+
+        if (uncompress(t->host, &len, t->in, t->in_len) != Z_OK ||
+            len != TARGET_PAGE_SIZE) {
+            decompress_failed = true;
+        }
+
+        qemu_mutex_lock(&decompress_lock);
+        t->busy = false;
+        qemu_cond_broadcast(&decompress_done_cond);
+    }
+    qemu_mutex_unlock(&decompress_lock);
+    return NULL;
+}
+
+static void ram_decompress_start(void)
+{
+    int i;
+
+    decompress_nthreads = MIN(MAX(ram_compress_host_cpus(), 1),
+                              RAM_COMPRESS_MAX_THREADS);
+    decompress_threads = g_new0(RamDecompressThread, decompress_nthreads);
+    qemu_mutex_init(&decompress_lock);
+    qemu_cond_init(&decompress_done_cond);
+    for (i = 0; i < decompress_nthreads; i++) {
+        RamDecompressThread *t = &decompress_threads[i];
+
+        t->in = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        qemu_cond_init(&t->cond);
+        qemu_thread_create(&t->thread, "ram-decompress",
+                           ram_decompress_thread, t, QEMU_THREAD_JOINABLE);
+    }
+}
+
+/* Hand a compressed page from the stream to an idle worker */
+static int ram_decompress_page(QEMUFile *f, void *host)
+{
+    RamDecompressThread *t = NULL;
+    uint32_t len = qemu_get_be32(f);
+    int i;
+
+    if (len > compressBound(TARGET_PAGE_SIZE)) {
+        error_report("Invalid compressed page length %u", len);
+        return -EINVAL;
+    }
+    if (!decompress_threads) {
+        ram_decompress_start();
+    }
+
+    qemu_mutex_lock(&decompress_lock);
+    while (!t) {
+        for (i = 0; i < decompress_nthreads; i++) {
+            if (!decompress_threads[i].busy) {
+                t = &decompress_threads[i];
+                break;
+            }
+        }
+        if (!t) {
+            qemu_cond_wait(&decompress_done_cond, &decompress_lock);
+        }
+    }
+    qemu_get_buffer(f, t->in, len);
+    t->in_len = len;
+    t->host = host;
+    t->busy = true;
+    qemu_cond_signal(&t->cond);
+    qemu_mutex_unlock(&decompress_lock);
+    return 0;
+}
+
+/*
+ * Wait for all queued pages to be in place.  A page only appears once
+ * between two EOS markers, so this must be done at each of them.
+ */
+static int ram_decompress_wait(void)
+{
+    int i, ret;
+
+    if (!decompress_threads) {
+        return 0;
+    }
+    qemu_mutex_lock(&decompress_lock);
+    for (i = 0; i < decompress_nthreads; i++) {
+        while (decompress_threads[i].busy) {
+            qemu_cond_wait(&decompress_done_cond, &decompress_lock);
+        }
+    }
+    ret = decompress_failed ? -EINVAL : 0;
+    decompress_failed = false;
+    qemu_mutex_unlock(&decompress_lock);
+
+    if (ret) {
+        error_report("Failed to decompress RAM pages");
+    }
+    return ret;
+}
+
+/*
+ * While the guest is stopped, as for a snapshot or the last stage of a
+ * migration, a page with the same contents as one sent before is sent
+ * as a reference to that one.  Sent pages are remembered in a direct
+ * mapped table indexed by a hash of a sample of their words, and a hit
+ * is only used after comparing the whole page.  With the guest stopped,
+ * the page it points to still holds what the destination was sent.
+ */
+#define RAM_DEDUP_BITS  16
+
+typedef struct RamDedupEntry {
+    RAMBlock *block;
+    ram_addr_t offset;
+} RamDedupEntry;
+
+static RamDedupEntry *ram_dedup;
+
+static RamDedupEntry *ram_dedup_slot(const uint8_t *p)
+{
+    const uint64_t *w = (const uint64_t *)p;
+    uint64_t h = 0;
+    int i;
+
+    for (i = 0; i < TARGET_PAGE_SIZE / 8; i += TARGET_PAGE_SIZE / 8 / 32) {
+        h = (h ^ w[i]) * 0x100000001b3ULL;
+    }
+    h ^= h >> 29;
+    return &ram_dedup[h & ((1 << RAM_DEDUP_BITS) - 1)];
+}
+
+/* Returns an earlier page with the contents of @p, if there is one */
+static RamDedupEntry *ram_dedup_find(uint8_t *p)
+{
+    RamDedupEntry *e;
+
+    if (!ram_dedup || runstate_is_running()) {
+        return NULL;
+    }
+    e = ram_dedup_slot(p);
+    if (e->block &&
+        !memcmp(p, memory_region_get_ram_ptr(e->block->mr) + e->offset,
+                TARGET_PAGE_SIZE)) {
+        return e;
+    }
+    return NULL;
+}
+
+static void ram_dedup_insert(uint8_t *p, RAMBlock *block, ram_addr_t offset)
+{
+    RamDedupEntry *e;
+
+    if (!ram_dedup || runstate_is_running()) {
+        return;
+    }
+    e = ram_dedup_slot(p);
+    e->block = block;
+    e->offset = offset;
+}
+
+static int save_dup_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                         int cont, RamDedupEntry *e)
+{
+    int bytes_sent;
+
+    bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_DUP);
+    qemu_put_byte(f, strlen(e->block->idstr));
+    qemu_put_buffer(f, (uint8_t *)e->block->idstr, strlen(e->block->idstr));
+    qemu_put_be64(f, e->offset);
+    return bytes_sent + 1 + strlen(e->block->idstr) + 8;
+}
+
+static int load_dup_page(QEMUFile *f, void *host)
+{
+    RAMBlock *block;
+    ram_addr_t offset;
+    char id[256];
+    uint8_t len;
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+    offset = qemu_get_be64(f);
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            break;
+        }
+    }
+    if (!block || offset > block->length - TARGET_PAGE_SIZE) {
+        error_report("Illegal source page %s:" RAM_ADDR_FMT, id, offset);
+        return -EINVAL;
+    }
+    memcpy(host, memory_region_get_ram_ptr(block->mr) + offset,
+           TARGET_PAGE_SIZE);
+    return 0;
+}
+
+void ram_decompress_cleanup(void)
+{
+    int i;
+
+    if (!decompress_threads) {
+        return;
+    }
+    qemu_mutex_lock(&decompress_lock);
+    for (i = 0; i < decompress_nthreads; i++) {
+        decompress_threads[i].quit = true;
+        qemu_cond_signal(&decompress_threads[i].cond);
+    }
+    qemu_mutex_unlock(&decompress_lock);
+    for (i = 0; i < decompress_nthreads; i++) {
+        RamDecompressThread *t = &decompress_threads[i];
+
+        qemu_thread_join(&t->thread);
+        qemu_cond_destroy(&t->cond);
+        g_free(t->in);
+    }
+    qemu_cond_destroy(&decompress_done_cond);
+    qemu_mutex_destroy(&decompress_lock);
+    g_free(decompress_threads);
+    decompress_threads = NULL;
+}
+static ram_addr_t last_offset;
+static unsigned long *migration_bitmap;
+static uint64_t migration_dirty_pages;
+static uint32_t last_version;
+static bool ram_bulk_stage;
+
+/* Update the xbzrle cache to reflect a page that's been sent as all 0.
+ * The important thing is that a stale (not-yet-0'd) page be replaced
+ * by the new data.
+ * As a bonus, if the page wasn't in the cache it gets added so that
+ * when a small write is made into the 0'd page it gets XBZRLE sent
+ */
+static void xbzrle_cache_zero_page(ram_addr_t current_addr)
+{
+    if (ram_bulk_stage || !migrate_use_xbzrle()) {
+        return;
+    }
+
+    /* We don't care if this fails to allocate a new cache page
+     * as long as it updated an old one */
+    cache_lock(XBZRLE.cache, current_addr);
+    cache_insert(XBZRLE.cache, current_addr, ZERO_TARGET_PAGE);
+    cache_unlock(XBZRLE.cache, current_addr);
+}
+
 static inline
 ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
                                                  ram_addr_t start)
@@ -456,18 +966,27 @@ static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
 
     /* start address is aligned at the start of a word? */
     if (((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) {
-        int k;
-        int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
+        unsigned long k;
+        unsigned long nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
         unsigned long *src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
-
-        for (k = page; k < page + nr; k++) {
-            if (src[k]) {
-                unsigned long new_dirty;
+        unsigned long *summary =
+            ram_list.dirty_summary[DIRTY_MEMORY_MIGRATION];
+
+        /* Only visit the words the summary may have marked dirty, and drop
+         * their summary bits before taking their dirty bits, see
+         * cpu_physical_memory_dirty_summary_clear().  vCPUs and devices
+         * may be dirtying pages meanwhile. */
+        for (k = find_next_bit(summary, page + nr, page); k < page + nr;
+             k = find_next_bit(summary, page + nr, k + 1)) {
+            unsigned long dirty, new_dirty;
+
+            atomic_and(&summary[BIT_WORD(k)], ~BIT_MASK(k));
+            dirty = atomic_xchg(&src[k], 0);
+            if (dirty) {
                 new_dirty = ~migration_bitmap[k];
-                migration_bitmap[k] |= src[k];
-                new_dirty &= src[k];
+                migration_bitmap[k] |= dirty;
+                new_dirty &= dirty;
                 migration_dirty_pages += ctpopl(new_dirty);
-                src[k] = 0;
             }
         }
     } else {
@@ -583,7 +1102,7 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
     MemoryRegion *mr = block->mr;
     uint8_t *p;
     int ret;
-    bool send_async = true;
+    RamDedupEntry *dup;
 
     cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
 
@@ -615,31 +1134,34 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
          * page would be stale
          */
         xbzrle_cache_zero_page(current_addr);
+    } else if ((dup = ram_dedup_find(p)) != NULL) {
+        acct_info.dup_pages++;
+        bytes_sent = save_dup_page(f, block, offset, cont, dup);
     } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
-        bytes_sent = save_xbzrle_page(f, &p, current_addr, block,
-                                      offset, cont, last_stage);
-        if (!last_stage) {
-            /* Can't send this cached data async, since the cache page
-             * might get updated before it gets to the wire
-             */
-            send_async = false;
-        }
+        /* Queued with the cache lock held, so the cache stays around */
+        bytes_sent = ram_compress_page(f, block, offset, XBZRLE.cache,
+                                       last_stage);
+        XBZRLE_cache_unlock();
+        return bytes_sent;
+    } else if (migrate_use_compression()) {
+        XBZRLE_cache_unlock();
+        return ram_compress_page(f, block, offset, NULL, false);
     }
 
-    /* XBZRLE overflow or normal page */
+    /* Normal page */
     if (bytes_sent == -1) {
         bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
-        if (send_async) {
-            qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
-        } else {
-            qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-        }
+        qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
         bytes_sent += TARGET_PAGE_SIZE;
         acct_info.norm_pages++;
+        ram_dedup_insert(p, block, offset);
     }
 
     XBZRLE_cache_unlock();
 
+    if (bytes_sent > 0) {
+        last_sent_block = block;
+    }
     return bytes_sent;
 }
 
@@ -681,7 +1203,6 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage)
 
             /* if page is unmodified, continue to the next */
             if (bytes_sent > 0) {
-                last_sent_block = block;
                 break;
             }
         }
@@ -746,14 +1267,15 @@ static void migration_end(void)
         migration_bitmap = NULL;
     }
 
+    g_free(ram_dedup);
+    ram_dedup = NULL;
+
+    /* Under the cache lock, which xbzrle_cache_resize() drains them with */
     XBZRLE_cache_lock();
+    ram_compress_stop();
     if (XBZRLE.cache) {
         cache_fini(XBZRLE.cache);
-        g_free(XBZRLE.encoded_buf);
-        g_free(XBZRLE.current_buf);
         XBZRLE.cache = NULL;
-        XBZRLE.encoded_buf = NULL;
-        XBZRLE.current_buf = NULL;
     }
     XBZRLE_cache_unlock();
 }
@@ -770,24 +1292,609 @@ static void reset_ram_globals(void)
     last_offset = 0;
     last_version = ram_list.version;
     ram_bulk_stage = true;
+    if (ram_dedup) {
+        memset(ram_dedup, 0, sizeof(*ram_dedup) << RAM_DEDUP_BITS);
+    }
 }
 
-#define MAX_WAIT 50 /* ms, half buffered_file limit */
+/*
+ * While guest RAM matches a RAM file, dirty logging is kept on so the next
+ * save to the same file only has to write the pages changed since.
+ */
+static char *ram_file_tracked;
+static unsigned ram_file_tracked_version;
+static bool ram_file_saved;
+static uint64_t ram_file_saved_pages;
 
-static int ram_save_setup(QEMUFile *f, void *opaque)
+/*
+ * A shared base RAM file is only ever read.  While guest RAM was loaded
+ * from one, saves put just the pages changed since in the stream, on top
+ * of a reference to the base, the way a disk overlay refers to its
+ * backing file.  ram_file_shared_dirty accumulates those pages over
+ * successive saves.
+ */
+static char *ram_snapshot_base;
+static bool ram_file_tracked_shared;
+static bool ram_file_delta;
+static unsigned long *ram_file_shared_dirty;
+
+static uint64_t ram_pages_sent(void)
+{
+    return acct_info.norm_pages + acct_info.dup_pages +
+           acct_info.xbzrle_pages;
+}
+
+static void ram_file_track_start(const char *path)
 {
     RAMBlock *block;
-    int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
 
-    mig_throttle_on = false;
-    dirty_rate_high_cnt = 0;
-    bitmap_sync_count = 0;
-    migration_bitmap_sync_init();
+    /* HAX, WHPX and HVF have no dirty log of their own, so every page
+     * would be dirty */
+    if (hax_enabled() || whpx_enabled() || hvf_enabled()) {
+        return;
+    }
 
-    if (migrate_use_xbzrle()) {
-        XBZRLE_cache_lock();
-        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
-                                  TARGET_PAGE_SIZE,
+    g_free(ram_file_tracked);
+    ram_file_tracked = g_strdup(path);
+    ram_file_tracked_version = ram_list.version;
+    ram_file_tracked_shared = false;
+    memory_global_dirty_log_start();
+    memory_global_sync_dirty_bitmap(get_system_memory());
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        cpu_physical_memory_reset_dirty(block->offset, block->length,
+                                        DIRTY_MEMORY_MIGRATION);
+    }
+}
+
+/* Whether the save being set up can write to the tracked file in place */
+static bool ram_file_incremental(void)
+{
+    return ram_file_tracked && !ram_file_tracked_shared && ram_snapshot_file &&
+           !strcmp(ram_file_tracked, ram_snapshot_file) &&
+           ram_list.version == ram_file_tracked_version;
+}
+
+/*
+ * Whether the save being set up can refer to the shared base RAM file.
+ * Only for a stopped VM: pages dirtied while a live save runs would be
+ * missed by the next one.
+ */
+static bool ram_file_can_delta(void)
+{
+    return ram_file_tracked && ram_file_tracked_shared && ram_snapshot_file &&
+           ram_list.version == ram_file_tracked_version &&
+           !runstate_is_running();
+}
+
+static void ram_file_track_stop(bool keep_log)
+{
+    if (!ram_file_tracked) {
+        return;
+    }
+    if (!keep_log) {
+        memory_global_dirty_log_stop();
+    }
+    g_free(ram_file_tracked);
+    ram_file_tracked = NULL;
+}
+
+/* Pages loaded from the stream differ from the RAM file */
+static void ram_file_page_loaded(void *host)
+{
+    ram_addr_t addr;
+
+    if (ram_file_tracked && qemu_ram_addr_from_host(host, &addr)) {
+        cpu_physical_memory_set_dirty_range(addr, TARGET_PAGE_SIZE);
+    }
+}
+
+void ram_set_snapshot_file(const char *path)
+{
+    g_free(ram_snapshot_file);
+    ram_snapshot_file = g_strdup(path);
+}
+
+void ram_set_snapshot_base(const char *path)
+{
+    g_free(ram_snapshot_base);
+    ram_snapshot_base = g_strdup(path);
+}
+
+/*
+ * A background save leaves writing the RAM file to a fork()ed child,
+ * whose copy-on-write view of guest RAM stays as it was when the VM was
+ * stopped, so the guest can be resumed as soon as the device state is
+ * saved.
+ */
+static bool ram_snapshot_background;
+#ifndef _WIN32
+static char *ram_bg_path;
+static char *ram_bg_tmp;
+static uint64_t ram_bg_id;
+static unsigned long *ram_bg_dirty;
+static pid_t ram_bg_pid;
+static QEMUTimer *ram_bg_timer;
+#endif
+
+void ram_set_snapshot_background(bool background)
+{
+    ram_snapshot_background = background;
+}
+
+#ifndef _WIN32
+/*
+ * The first host page of a RAM file holds a header naming the save that
+ * wrote it, which the stream repeats, so a snapshot never runs off a file
+ * that an interrupted save left behind.  Blocks follow, each starting
+ * host page aligned so it can be mapped.
+ */
+#define RAM_FILE_MAGIC  0x51454d5552414d31ULL     /* "QEMURAM1" */
+#define RAM_FILE_HDR_LEN 16
+
+static uint64_t ram_file_id;
+
+static uint64_t ram_file_block_size(RAMBlock *block)
+{
+    return HOST_PAGE_ALIGN(block->length);
+}
+
+static int ram_file_put_header(int fd, uint64_t id)
+{
+    uint8_t hdr[RAM_FILE_HDR_LEN];
+
+    stq_be_p(hdr, RAM_FILE_MAGIC);
+    stq_be_p(hdr + 8, id);
+    if (pwrite(fd, hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        return errno ? -errno : -EIO;
+    }
+    return 0;
+}
+
+/*
+ * Pages needing a write: the non-zero ones when writing a new file, the
+ * ones set in @dirty, dirtied since the file was last in sync with RAM,
+ * otherwise.
+ */
+static bool ram_file_page_needed(RAMBlock *block, ram_addr_t offset,
+                                 unsigned long *dirty)
+{
+    if (dirty) {
+        return test_bit((block->offset + offset) >> TARGET_PAGE_BITS, dirty);
+    }
+    return !is_zero_range(block->host + offset, TARGET_PAGE_SIZE);
+}
+
+/*
+ * Write the blocks' pages to the RAM file @path as save @id.  A new file
+ * is written as @tmp, leaving zero pages as holes, and renamed over the
+ * old one so a guest still running off a mapping of the old file is
+ * unaffected.  An incremental save only writes the pages in @dirty, in
+ * place: those have all been written since, so a private mapping of the
+ * file already holds its own copy of them.  The header is cleared while
+ * the file is being updated.
+ *
+ * This only makes system calls, so it can run in a fork()ed child.
+ */
+static int ram_write_file(const char *path, const char *tmp, uint64_t id,
+                          unsigned long *dirty)
+{
+    RAMBlock *block;
+    uint64_t base = qemu_host_page_size;
+    int fd, ret;
+
+    if (dirty) {
+        fd = open(path, O_WRONLY);
+    } else {
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd < 0) {
+        return -errno;
+    }
+
+    ret = ram_file_put_header(fd, 0);
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        ram_addr_t offset = 0;
+
+        while (!ret && offset < block->length) {
+            ram_addr_t len = 0;
+
+            /* Write runs of pages with one call */
+            while (offset + len < block->length &&
+                   ram_file_page_needed(block, offset + len, dirty)) {
+                len += TARGET_PAGE_SIZE;
+            }
+            if (len && pwrite(fd, block->host + offset, len,
+                              base + offset) != (ssize_t)len) {
+                ret = errno ? -errno : -EIO;
+            }
+            offset += len + TARGET_PAGE_SIZE;
+        }
+        if (ret) {
+            break;
+        }
+        base += ram_file_block_size(block);
+    }
+    if (!ret && !dirty && ftruncate(fd, base) < 0) {
+        ret = -errno;
+    }
+    if (!ret) {
+        ret = ram_file_put_header(fd, id);
+    }
+    close(fd);
+    if (!ret && !dirty && rename(tmp, path) < 0) {
+        ret = -errno;
+    }
+    if (ret && !dirty) {
+        unlink(tmp);
+    }
+    return ret;
+}
+
+/* Put the block to file offset table in the stream */
+static void ram_put_file_table(QEMUFile *f, uint64_t id)
+{
+    RAMBlock *block;
+    uint64_t base = qemu_host_page_size;
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_FILE);
+    qemu_put_be64(f, id);
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, base);
+        base += ram_file_block_size(block);
+    }
+    qemu_put_byte(f, 0);
+}
+
+static uint64_t ram_file_new_id(bool incremental)
+{
+    /* A file updated in place keeps its id */
+    if (!incremental || !ram_file_id) {
+        ram_file_id = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) ^
+                      ((uint64_t)getpid() << 48);
+    }
+    return ram_file_id;
+}
+
+/*
+ * Save RAM to ram_snapshot_file and put its table in the stream.
+ * Called with the ramlist lock held.
+ */
+static int ram_save_file(QEMUFile *f, bool incremental)
+{
+    char *tmp = g_strdup_printf("%s.tmp", ram_snapshot_file);
+    uint64_t id = ram_file_new_id(incremental);
+    int ret;
+
+    ret = ram_write_file(ram_snapshot_file, tmp, id,
+                         incremental ? migration_bitmap : NULL);
+    g_free(tmp);
+    if (ret) {
+        error_report("Could not write RAM file '%s': %s", ram_snapshot_file,
+                     strerror(-ret));
+        ram_file_id = 0;
+        return ret;
+    }
+
+    ram_put_file_table(f, id);
+    return 0;
+}
+
+/*
+ * The child can only see guest RAM if it is private anonymous memory:
+ * shared mappings of a file would be written under its feet, and HAX,
+ * WHPX and HVF keep the guest's own view of RAM in the hypervisor.
+ */
+static bool ram_background_possible(void)
+{
+    RAMBlock *block;
+
+    if (hax_enabled() || whpx_enabled() || hvf_enabled()) {
+        return false;
+    }
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (block->fd >= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Like ram_save_file(), but only put the table in the stream and leave
+ * writing the file to ram_snapshot_background_start().
+ */
+static int ram_save_file_background(QEMUFile *f, bool incremental)
+{
+    int64_t pages = last_ram_offset() >> TARGET_PAGE_BITS;
+
+    ram_snapshot_background_abort();
+    ram_bg_path = g_strdup(ram_snapshot_file);
+    ram_bg_tmp = g_strdup_printf("%s.tmp", ram_snapshot_file);
+    ram_bg_id = ram_file_new_id(incremental);
+    if (incremental) {
+        ram_bg_dirty = bitmap_new(pages);
+        bitmap_copy(ram_bg_dirty, migration_bitmap, pages);
+    }
+
+    ram_put_file_table(f, ram_bg_id);
+    return 0;
+}
+
+static void ram_bg_reset(void)
+{
+    if (ram_bg_timer) {
+        timer_del(ram_bg_timer);
+        timer_free(ram_bg_timer);
+        ram_bg_timer = NULL;
+    }
+    g_free(ram_bg_path);
+    g_free(ram_bg_tmp);
+    g_free(ram_bg_dirty);
+    ram_bg_path = NULL;
+    ram_bg_tmp = NULL;
+    ram_bg_dirty = NULL;
+    ram_bg_pid = 0;
+}
+
+/* Collect the child's @status once it has exited */
+static void ram_bg_done(int status)
+{
+    int ret = WIFEXITED(status) ? -WEXITSTATUS(status) : -EINTR;
+
+    if (ret) {
+        error_report("Could not write RAM file '%s' in the background: %s",
+                     ram_bg_path, strerror(-ret));
+        /* The next save to it can't be incremental */
+        ram_file_id = 0;
+        ram_file_track_stop(false);
+    }
+    ram_bg_reset();
+}
+
+static void ram_bg_poll(void *opaque)
+{
+    int status;
+    pid_t pid = waitpid(ram_bg_pid, &status, WNOHANG);
+
+    if (pid == 0 || (pid < 0 && errno == EINTR)) {
+        timer_mod(ram_bg_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + 100);
+        return;
+    }
+    ram_bg_done(pid < 0 ? 0 : status);
+}
+
+int ram_snapshot_background_start(void)
+{
+    RAMBlock *block;
+    pid_t pid;
+
+    if (!ram_bg_path) {
+        return 0;
+    }
+
+    /* Guest RAM isn't inherited by children otherwise */
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        qemu_madvise(block->host, block->length, QEMU_MADV_DOFORK);
+    }
+    pid = fork();
+    if (pid == 0) {
+        _exit(-ram_write_file(ram_bg_path, ram_bg_tmp, ram_bg_id,
+                              ram_bg_dirty));
+    }
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        qemu_madvise(block->host, block->length, QEMU_MADV_DONTFORK);
+    }
+    if (pid < 0) {
+        error_report("Could not start writing RAM file '%s': %s",
+                     ram_bg_path, strerror(errno));
+        ram_snapshot_background_abort();
+        return -errno;
+    }
+
+    ram_bg_pid = pid;
+    ram_bg_timer = timer_new_ms(QEMU_CLOCK_REALTIME, ram_bg_poll, NULL);
+    timer_mod(ram_bg_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + 100);
+    return 0;
+}
+
+void ram_snapshot_background_wait(void)
+{
+    int status;
+
+    if (!ram_bg_pid) {
+        return;
+    }
+    while (waitpid(ram_bg_pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            status = 0;
+            break;
+        }
+    }
+    ram_bg_done(status);
+}
+
+void ram_snapshot_background_abort(void)
+{
+    int status;
+
+    /* A file left half written is caught by its header on load */
+    if (ram_bg_pid) {
+        kill(ram_bg_pid, SIGKILL);
+        while (waitpid(ram_bg_pid, &status, 0) < 0 && errno == EINTR) {
+        }
+    }
+    if (ram_bg_path) {
+        ram_file_id = 0;
+        ram_file_track_stop(false);
+    }
+    ram_bg_reset();
+}
+
+/*
+ * Map a block's pages from the RAM file copy-on-write, so they are only
+ * read in when the guest touches them.  HAX pins guest RAM at the address
+ * it was allocated at and cannot follow a new mapping, and file backed
+ * blocks must stay shared with their file, so those are read in whole.
+ */
+static int ram_load_file_block(int fd, RAMBlock *block, uint64_t base)
+{
+    ram_addr_t mapped = 0;
+
+    if (!hax_enabled() && block->fd < 0) {
+        ram_addr_t len = block->length & qemu_host_page_mask;
+
+        if (len && mmap(block->host, len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_FIXED, fd, base) != MAP_FAILED) {
+            mapped = len;
+            /*
+             * The new mapping lost the advice given at allocation.  Pages
+             * left untouched share the page cache with every other VM
+             * mapping the same file; let KSM merge the copies they make.
+             */
+            qemu_madvise(block->host, len, QEMU_MADV_DONTFORK);
+            if (qemu_opt_get_bool(qemu_get_machine_opts(), "mem-merge",
+                                  true)) {
+                qemu_madvise(block->host, len, QEMU_MADV_MERGEABLE);
+            }
+        }
+    }
+    while (mapped < block->length) {
+        ssize_t n = pread(fd, block->host + mapped, block->length - mapped,
+                          base + mapped);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 ? -errno : -EIO;
+        }
+        mapped += n;
+    }
+    return 0;
+}
+
+/* Open the RAM file @path if it was written as save @id, or return -1 */
+static int ram_open_file(const char *path, uint64_t id)
+{
+    uint8_t hdr[RAM_FILE_HDR_LEN];
+    int fd;
+
+    if (!path) {
+        return -1;
+    }
+    fd = qemu_open(path, O_RDONLY | O_BINARY);
+    if (fd >= 0 && (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+                    ldq_be_p(hdr) != RAM_FILE_MAGIC ||
+                    ldq_be_p(hdr + 8) != id)) {
+        qemu_close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+static int ram_load_file(QEMUFile *f)
+{
+    uint64_t id = qemu_get_be64(f);
+    const char *path = ram_snapshot_file;
+    bool shared = false;
+    int fd, ret = 0;
+
+    /* The snapshot's own file if there is one, else the shared base */
+    fd = ram_open_file(path, id);
+    if (fd < 0 && ram_snapshot_base) {
+        path = ram_snapshot_base;
+        shared = true;
+        fd = ram_open_file(path, id);
+    }
+    if (fd < 0) {
+        error_report("No RAM file written by this snapshot at '%s'",
+                     ram_snapshot_file ? ram_snapshot_file : "");
+        ret = -EINVAL;
+    }
+
+    for (;;) {
+        char id[256];
+        uint64_t base;
+        RAMBlock *block;
+        int len = qemu_get_byte(f);
+
+        if (len == 0 || qemu_file_get_error(f)) {
+            break;
+        }
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+        base = qemu_get_be64(f);
+        if (ret) {
+            continue;
+        }
+
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block) {
+            error_report("Unknown ramblock \"%s\" in RAM file", id);
+            ret = -EINVAL;
+        } else {
+            ret = ram_load_file_block(fd, block, base);
+            if (ret) {
+                error_report("Could not load ramblock \"%s\" from '%s': %s",
+                             id, path, strerror(-ret));
+            }
+        }
+    }
+
+    if (fd >= 0) {
+        qemu_close(fd);
+    }
+    if (!ret) {
+        ram_file_id = id;
+        ram_file_track_start(path);
+        if (ram_file_tracked) {
+            ram_file_tracked_shared = shared;
+            g_free(ram_file_shared_dirty);
+            ram_file_shared_dirty = shared ?
+                bitmap_new(last_ram_offset() >> TARGET_PAGE_BITS) : NULL;
+        }
+    }
+    return ret;
+}
+#else
+int ram_snapshot_background_start(void)
+{
+    return 0;
+}
+
+void ram_snapshot_background_wait(void)
+{
+}
+
+void ram_snapshot_background_abort(void)
+{
+}
+#endif
+
+#define MAX_WAIT 50 /* ms, half buffered_file limit */
+
+static int ram_save_setup(QEMUFile *f, void *opaque)
+{
+    RAMBlock *block;
+    int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
+    bool incremental;
+    long i;
+
+    mig_throttle_on = false;
+    dirty_rate_high_cnt = 0;
+    bitmap_sync_count = 0;
+    migration_bitmap_sync_init();
+
+    if (migrate_use_xbzrle()) {
+        XBZRLE_cache_lock();
+        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
+                                  TARGET_PAGE_SIZE,
                                   TARGET_PAGE_SIZE);
         if (!XBZRLE.cache) {
             XBZRLE_cache_unlock();
@@ -796,47 +1903,60 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         }
         XBZRLE_cache_unlock();
 
-        /* We prefer not to abort if there is no memory */
-        XBZRLE.encoded_buf = g_try_malloc0(TARGET_PAGE_SIZE);
-        if (!XBZRLE.encoded_buf) {
-            error_report("Error allocating encoded_buf");
-            return -1;
-        }
-
-        XBZRLE.current_buf = g_try_malloc(TARGET_PAGE_SIZE);
-        if (!XBZRLE.current_buf) {
-            error_report("Error allocating current_buf");
-            g_free(XBZRLE.encoded_buf);
-            XBZRLE.encoded_buf = NULL;
-            return -1;
-        }
-
         acct_clear();
     }
 
+    if (migrate_use_compression() || migrate_use_xbzrle()) {
+        ram_compress_start();
+    }
+    ram_dedup = g_new0(RamDedupEntry, 1 << RAM_DEDUP_BITS);
+
     qemu_mutex_lock_iothread();
     qemu_mutex_lock_ramlist();
     bytes_transferred = 0;
     reset_ram_globals();
 
+    /* Any other save or migration takes over the dirty log */
+    incremental = ram_file_incremental();
+    ram_file_delta = ram_file_can_delta();
+    ram_file_track_stop(incremental || ram_file_delta);
+    ram_file_saved = false;
+    if (!ram_file_delta) {
+        g_free(ram_file_shared_dirty);
+        ram_file_shared_dirty = NULL;
+    }
+
     ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
     migration_bitmap = bitmap_new(ram_bitmap_pages);
-    bitmap_set(migration_bitmap, 0, ram_bitmap_pages);
 
     /*
      * Count the total number of pages used by ram blocks not including any
-     * gaps due to alignment or unplugs.
+     * gaps due to alignment or unplugs.  An incremental save starts from
+     * the pages dirtied since the RAM file was last in sync instead, and
+     * a delta save from those dirtied since the shared base was loaded.
      */
     migration_dirty_pages = 0;
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        uint64_t block_pages;
+    if (!incremental && !ram_file_delta) {
+        bitmap_set(migration_bitmap, 0, ram_bitmap_pages);
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            uint64_t block_pages;
 
-        block_pages = block->length >> TARGET_PAGE_BITS;
-        migration_dirty_pages += block_pages;
+            block_pages = block->length >> TARGET_PAGE_BITS;
+            migration_dirty_pages += block_pages;
+        }
     }
 
     memory_global_dirty_log_start();
     migration_bitmap_sync();
+    if (ram_file_delta) {
+        bitmap_or(ram_file_shared_dirty, ram_file_shared_dirty,
+                  migration_bitmap, ram_bitmap_pages);
+        bitmap_copy(migration_bitmap, ram_file_shared_dirty,
+                    ram_bitmap_pages);
+        for (i = 0; i < BITS_TO_LONGS(ram_bitmap_pages); i++) {
+            migration_dirty_pages += ctpopl(migration_bitmap[i]);
+        }
+    }
     qemu_mutex_unlock_iothread();
 
     qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
@@ -847,6 +1967,21 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         qemu_put_be64(f, block->length);
     }
 
+#ifndef _WIN32
+    if (ram_file_delta) {
+        /* The stream holds what differs from the base */
+        ram_put_file_table(f, ram_file_id);
+    } else if (ram_snapshot_file &&
+        (ram_snapshot_background && ram_background_possible() ?
+         ram_save_file_background(f, incremental) :
+         ram_save_file(f, incremental)) == 0) {
+        bitmap_zero(migration_bitmap, ram_bitmap_pages);
+        migration_dirty_pages = 0;
+        ram_file_saved = true;
+        ram_file_saved_pages = ram_pages_sent();
+    }
+#endif
+
     qemu_mutex_unlock_ramlist();
 
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
@@ -901,6 +2036,9 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
 
+    /* Pages may be sent again after the next sync */
+    total_sent += ram_compress_flush(f);
+
     qemu_mutex_unlock_ramlist();
 
     /*
@@ -946,10 +2084,21 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         }
         bytes_transferred += bytes_sent;
     }
+    bytes_transferred += ram_compress_flush(f);
 
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
     migration_end();
 
+    /* RAM matches the file unless pages had to go in the stream too */
+    if (ram_file_saved && ram_pages_sent() == ram_file_saved_pages) {
+        ram_file_track_start(ram_snapshot_file);
+    } else if (ram_file_delta) {
+        ram_file_track_start(ram_snapshot_base);
+        ram_file_tracked_shared = ram_file_tracked != NULL;
+    }
+    ram_file_saved = false;
+    ram_file_delta = false;
+
     qemu_mutex_unlock_ramlist();
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
@@ -1070,6 +2219,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
         case RAM_SAVE_FLAG_MEM_SIZE:
+            /* RAM is about to be replaced */
+            ram_file_track_stop(false);
+
             /* Synchronize RAM block list */
             total_ram_bytes = addr;
             while (!ret && total_ram_bytes) {
@@ -1114,6 +2266,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
             ch = qemu_get_byte(f);
             ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+            ram_file_page_loaded(host);
             break;
         case RAM_SAVE_FLAG_PAGE:
             host = host_from_stream_offset(f, addr, flags);
@@ -1124,6 +2277,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
 
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            ram_file_page_loaded(host);
             break;
         case RAM_SAVE_FLAG_XBZRLE:
             host = host_from_stream_offset(f, addr, flags);
@@ -1139,7 +2293,35 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 ret = -EINVAL;
                 break;
             }
+            ram_file_page_loaded(host);
+            break;
+        case RAM_SAVE_FLAG_DUP:
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
+                break;
+            }
+
+            ret = load_dup_page(f, host);
+            ram_file_page_loaded(host);
+            break;
+        case RAM_SAVE_FLAG_COMPRESS_PAGE:
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
+                break;
+            }
+
+            ret = ram_decompress_page(f, host);
+            ram_file_page_loaded(host);
+            break;
+#ifndef _WIN32
+        case RAM_SAVE_FLAG_FILE:
+            ret = ram_load_file(f);
             break;
+#endif
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -1157,6 +2339,10 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
+    if (ram_decompress_wait() < 0 && !ret) {
+        ret = -EINVAL;
+    }
+
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
     return ret;
@@ -233,6 +233,9 @@ aio_ctx_finalize(GSource     *source)
     rfifolock_destroy(&ctx->lock);
     qemu_mutex_destroy(&ctx->bh_lock);
     g_array_free(ctx->pollfds, TRUE);
+    if (ctx->epollfd >= 0) {
+        close(ctx->epollfd);
+    }
     timerlistgroup_deinit(&ctx->tlg);
 }
 
@@ -294,6 +297,7 @@ AioContext *aio_context_new(Error **errp)
     int ret;
     AioContext *ctx;
     ctx = (AioContext *) g_source_new(&aio_source_funcs, sizeof(AioContext));
+    ctx->epollfd = -1;
     ret = event_notifier_init(&ctx->notifier, false);
     if (ret < 0) {
         g_source_destroy(&ctx->source);
@@ -312,6 +316,14 @@ AioContext *aio_context_new(Error **errp)
     return ctx;
 }
 
+void aio_context_set_poll_max_ns(AioContext *ctx, int64_t max_ns)
+{
+    atomic_set(&ctx->poll_max_ns, max_ns);
+    /* Start over, and out of any window the owner is spinning in */
+    atomic_set(&ctx->poll_ns, 0);
+    aio_notify(ctx);
+}
+
 void aio_context_ref(AioContext *ctx)
 {
     g_source_ref(&ctx->source);
@@ -28,6 +28,16 @@
 #define AUDIO_CAP "mixeng"
 #include "audio_int.h"
 
+#ifndef FLOAT_MIXENG
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define MIXENG_SIMD
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define MIXENG_SIMD
+#endif
+#endif
+
 /* 8 bit */
 #define ENDIAN_CONVERSION natural
 #define ENDIAN_CONVERT(v) (v)
@@ -155,6 +165,113 @@
 #undef ITYPE
 #undef SHIFT
 
+#ifdef MIXENG_SIMD
+/*
+ * Host-endian signed 16-bit stereo, what goldfish_audio and most backends
+ * use, several samples at a time.  They give the same results as the
+ * templates.
+ */
+static void conv_s16_to_stereo_simd(struct st_sample *dst, const void *src,
+                                    int samples)
+{
+    const int16_t *in = src;
+
+    for (; samples >= 4; samples -= 4, in += 8, dst += 4) {
+#ifdef __SSE2__
+        __m128i v = _mm_loadu_si128((const __m128i *)in);
+        /* Each 16-bit value in the top half of a 32-bit lane is v << 16 */
+        __m128i lo = _mm_unpacklo_epi16(_mm_setzero_si128(), v);
+        __m128i hi = _mm_unpackhi_epi16(_mm_setzero_si128(), v);
+        __m128i lo_sign = _mm_srai_epi32(lo, 31);
+        __m128i hi_sign = _mm_srai_epi32(hi, 31);
+
+        _mm_storeu_si128((__m128i *)&dst[0], _mm_unpacklo_epi32(lo, lo_sign));
+        _mm_storeu_si128((__m128i *)&dst[1], _mm_unpackhi_epi32(lo, lo_sign));
+        _mm_storeu_si128((__m128i *)&dst[2], _mm_unpacklo_epi32(hi, hi_sign));
+        _mm_storeu_si128((__m128i *)&dst[3], _mm_unpackhi_epi32(hi, hi_sign));
+#else
+        int16x8_t v = vld1q_s16(in);
+        int32x4_t lo = vmovl_s16(vget_low_s16(v));
+        int32x4_t hi = vmovl_s16(vget_high_s16(v));
+
+        vst1q_s64(&dst[0].l, vshlq_n_s64(vmovl_s32(vget_low_s32(lo)), 16));
+        vst1q_s64(&dst[1].l, vshlq_n_s64(vmovl_s32(vget_high_s32(lo)), 16));
+        vst1q_s64(&dst[2].l, vshlq_n_s64(vmovl_s32(vget_low_s32(hi)), 16));
+        vst1q_s64(&dst[3].l, vshlq_n_s64(vmovl_s32(vget_high_s32(hi)), 16));
+#endif
+    }
+    conv_natural_int16_t_to_stereo(dst, in, samples);
+}
+
+#ifdef __SSE2__
+/* clip_natural_int16_t() of four 64-bit values, as 32-bit lanes */
+static inline __m128i clip_s16_sse2(__m128i a, __m128i b)
+{
+    /* The low and high halves of the values, each in a vector */
+    __m128i a2 = _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0));
+    __m128i b2 = _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 2, 0));
+    __m128i lo = _mm_unpacklo_epi64(a2, b2);
+    __m128i hi = _mm_unpackhi_epi64(a2, b2);
+    /* Whether the value fits in 32 bits */
+    __m128i fits = _mm_cmpeq_epi32(hi, _mm_srai_epi32(lo, 31));
+    __m128i big = _mm_cmpgt_epi32(lo, _mm_set1_epi32(0x7effffff));
+    __m128i max = _mm_set1_epi32(INT16_MAX);
+    __m128i in_range, out_of_range;
+
+    in_range = _mm_or_si128(_mm_andnot_si128(big, _mm_srai_epi32(lo, 16)),
+                            _mm_and_si128(big, max));
+    /* INT16_MIN if negative, INT16_MAX otherwise */
+    out_of_range = _mm_xor_si128(max, _mm_srai_epi32(hi, 31));
+    return _mm_or_si128(_mm_and_si128(fits, in_range),
+                        _mm_andnot_si128(fits, out_of_range));
+}
+#else
+static inline int32x2_t clip_s16_neon(int64x2_t v)
+{
+    int64x2_t r = vshrq_n_s64(v, 16);
+
+    r = vbslq_s64(vcgeq_s64(v, vdupq_n_s64(0x7f000000)),
+                  vdupq_n_s64(INT16_MAX), r);
+    r = vbslq_s64(vcltq_s64(v, vdupq_n_s64(-2147483648LL)),
+                  vdupq_n_s64(INT16_MIN), r);
+    return vmovn_s64(r);
+}
+#endif
+
+static void clip_s16_from_stereo_simd(void *dst, const struct st_sample *src,
+                                      int samples)
+{
+    int16_t *out = dst;
+
+    for (; samples >= 4; samples -= 4, src += 4, out += 8) {
+#ifdef __SSE2__
+        __m128i s0 = _mm_loadu_si128((const __m128i *)&src[0]);
+        __m128i s1 = _mm_loadu_si128((const __m128i *)&src[1]);
+        __m128i s2 = _mm_loadu_si128((const __m128i *)&src[2]);
+        __m128i s3 = _mm_loadu_si128((const __m128i *)&src[3]);
+
+        _mm_storeu_si128((__m128i *)out,
+                         _mm_packs_epi32(clip_s16_sse2(s0, s1),
+                                         clip_s16_sse2(s2, s3)));
+#else
+        int32x4_t lo = vcombine_s32(clip_s16_neon(vld1q_s64(&src[0].l)),
+                                    clip_s16_neon(vld1q_s64(&src[1].l)));
+        int32x4_t hi = vcombine_s32(clip_s16_neon(vld1q_s64(&src[2].l)),
+                                    clip_s16_neon(vld1q_s64(&src[3].l)));
+
+        vst1q_s16(out, vcombine_s16(vmovn_s32(lo), vmovn_s32(hi)));
+#endif
+    }
+    clip_natural_int16_t_from_stereo(out, src, samples);
+}
+
+#define conv_natural_int16_t_to_stereo_fast conv_s16_to_stereo_simd
+#define clip_natural_int16_t_from_stereo_fast clip_s16_from_stereo_simd
+#else
+#define conv_natural_int16_t_to_stereo_fast conv_natural_int16_t_to_stereo
+#define clip_natural_int16_t_from_stereo_fast clip_natural_int16_t_from_stereo
+#endif
+
 t_sample *mixeng_conv[2][2][2][3] = {
     {
         {
@@ -198,7 +315,7 @@ t_sample *mixeng_conv[2][2][2][3] = {
         {
             {
                 conv_natural_int8_t_to_stereo,
-                conv_natural_int16_t_to_stereo,
+                conv_natural_int16_t_to_stereo_fast,
                 conv_natural_int32_t_to_stereo
             },
             {
@@ -253,7 +370,7 @@ f_sample *mixeng_clip[2][2][2][3] = {
         {
             {
                 clip_natural_int8_t_from_stereo,
-                clip_natural_int16_t_from_stereo,
+                clip_natural_int16_t_from_stereo_fast,
                 clip_natural_int32_t_from_stereo
             },
             {
@@ -328,12 +445,41 @@ void *st_rate_start (int inrate, int outrate)
     return rate;
 }
 
+/* The rates are the same, add or copy @n samples */
+static void mixeng_mix(struct st_sample *dst, const struct st_sample *src,
+                       int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+#if defined(MIXENG_SIMD) && defined(__SSE2__)
+        _mm_storeu_si128((__m128i *)&dst[i],
+                         _mm_add_epi64(_mm_loadu_si128((__m128i *)&dst[i]),
+                                       _mm_loadu_si128((__m128i *)&src[i])));
+#elif defined(MIXENG_SIMD)
+        vst1q_s64(&dst[i].l, vaddq_s64(vld1q_s64(&dst[i].l),
+                                       vld1q_s64(&src[i].l)));
+#else
+        dst[i].l += src[i].l;
+        dst[i].r += src[i].r;
+#endif
+    }
+}
+
+static void mixeng_copy(struct st_sample *dst, const struct st_sample *src,
+                        int n)
+{
+    memcpy(dst, src, n * sizeof(*dst));
+}
+
 #define NAME st_rate_flow_mix
 #define OP(a, b) a += b
+#define COPY mixeng_mix
 #include "rate_template.h"
 
 #define NAME st_rate_flow
 #define OP(a, b) a = b
+#define COPY mixeng_copy
 #include "rate_template.h"
 
 void st_rate_stop (void *opaque)
@@ -352,6 +498,16 @@ void mixeng_volume (struct st_sample *buf, int len, struct mixeng_volume *vol)
         mixeng_clear (buf, len);
         return;
     }
+    /* Nominal volume, what guests mostly use, leaves the samples alone */
+#ifdef FLOAT_MIXENG
+    if (vol->l == 1.0 && vol->r == 1.0) {
+        return;
+    }
+#else
+    if (vol->l == 1ULL << 32 && vol->r == 1ULL << 32) {
+        return;
+    }
+#endif
 
     while (len--) {
 #ifdef FLOAT_MIXENG
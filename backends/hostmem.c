@@ -17,8 +17,23 @@
 #include "qemu/config-file.h"
 #include "qom/object_interfaces.h"
 
-#ifdef CONFIG_NUMA
+#if !defined(CONFIG_NUMA) && defined(CONFIG_LINUX)
+/* Without libnuma, call the kernel directly; the policies are the same */
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#define CONFIG_NUMA 1
+
+static long mbind(void *start, unsigned long len, int mode,
+                  const unsigned long *nmask, unsigned long maxnode,
+                  unsigned flags)
+{
+    return syscall(__NR_mbind, start, len, mode, nmask, maxnode, flags);
+}
+#elif defined(CONFIG_NUMA)
 #include <numaif.h>
+#endif
+
+#ifdef CONFIG_NUMA
 QEMU_BUILD_BUG_ON(HOST_MEM_POLICY_DEFAULT != MPOL_DEFAULT);
 QEMU_BUILD_BUG_ON(HOST_MEM_POLICY_PREFERRED != MPOL_PREFERRED);
 QEMU_BUILD_BUG_ON(HOST_MEM_POLICY_BIND != MPOL_BIND);
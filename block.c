@@ -198,11 +198,19 @@ static void bdrv_io_limits_intercept(BlockDriverState *bs,
 {
     /* does this io must wait */
     bool must_wait = throttle_schedule_timer(&bs->throttle_state, is_write);
+    int64_t throttled_ns = 0;
 
     /* if must wait or any request of this type throttled queue the IO */
     if (must_wait ||
         !qemu_co_queue_empty(&bs->throttled_reqs[is_write])) {
+        int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
         qemu_co_queue_wait(&bs->throttled_reqs[is_write]);
+        throttled_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+        block_acct_throttled(&bs->stats, throttled_ns);
+    }
+    if (bs->host_throttle) {
+        host_throttle_account(bs, throttled_ns);
     }
 
     /* the IO will be executed, do the accounting */
@@ -357,6 +365,8 @@ BlockDriverState *bdrv_new(void)
     qemu_co_queue_init(&bs->throttled_reqs[1]);
     bs->refcnt = 1;
     bs->aio_context = qemu_get_aio_context();
+    bs->flush_interval_ns = BDRV_DEFAULT_FLUSH_INTERVAL_MS * SCALE_MS;
+    block_acct_init(&bs->stats);
 
     return bs;
 }
@@ -758,6 +768,9 @@ int bdrv_parse_cache_flags(const char *mode, int *flags)
     } else if (!strcmp(mode, "unsafe")) {
         *flags |= BDRV_O_CACHE_WB;
         *flags |= BDRV_O_NO_FLUSH;
+    } else if (!strcmp(mode, "ephemeral")) {
+        *flags |= BDRV_O_CACHE_WB;
+        *flags |= BDRV_O_COALESCE_FLUSH;
     } else if (!strcmp(mode, "writethrough")) {
         /* this is the default */
     } else {
@@ -1860,6 +1873,9 @@ void bdrv_close(BlockDriverState *bs)
     }
 
     /*throttling disk I/O limits*/
+    if (bs->host_throttle) {
+        host_throttle_leave(bs);
+    }
     if (bs->io_limits_enabled) {
         bdrv_io_limits_disable(bs);
     }
@@ -2002,6 +2018,7 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->copy_on_read       = bs_src->copy_on_read;
 
     bs_dest->enable_write_cache = bs_src->enable_write_cache;
+    bs_dest->flush_interval_ns  = bs_src->flush_interval_ns;
 
     /* i/o throttled req */
     memcpy(&bs_dest->throttle_state,
@@ -2010,6 +2027,7 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->throttled_reqs[0]  = bs_src->throttled_reqs[0];
     bs_dest->throttled_reqs[1]  = bs_src->throttled_reqs[1];
     bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
+    bs_dest->host_throttle      = bs_src->host_throttle;
 
     /* r/w error */
     bs_dest->on_read_error      = bs_src->on_read_error;
@@ -2021,6 +2039,8 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
 
     /* dirty bitmap */
     bs_dest->dirty_bitmaps      = bs_src->dirty_bitmaps;
+    bs_dest->read_map           = bs_src->read_map;
+    bs_dest->dirty_map          = bs_src->dirty_map;
 
     /* reference count */
     bs_dest->refcnt             = bs_src->refcnt;
@@ -2300,6 +2320,7 @@ static void tracked_request_end(BdrvTrackedRequest *req)
 
     QLIST_REMOVE(req, list);
     qemu_co_queue_restart_all(&req->wait_queue);
+    block_acct_request_end(&req->bs->stats);
 }
 
 /**
@@ -2324,6 +2345,7 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
     qemu_co_queue_init(&req->wait_queue);
 
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    block_acct_request_begin(&bs->stats);
 }
 
 static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
@@ -2813,6 +2835,52 @@ int bdrv_make_zero(BlockDriverState *bs, BdrvRequestFlags flags)
     }
 }
 
+/*
+ * Throw away the contents of a block device. An image with a backing file
+ * goes back to showing the backing file, by dropping its own clusters if
+ * the format supports that. Anything else is zeroed, unmapping the ranges
+ * that hold data so that sparse files get their holes back.
+ *
+ * Returns < 0 on error, 0 on success.
+ */
+int bdrv_reset(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    int open_flags, file_flags = 0;
+    int ret;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (bs->read_only) {
+        return -EACCES;
+    }
+
+    bdrv_drain_all();
+
+    if (bs->backing_hd && drv->bdrv_make_empty) {
+        ret = drv->bdrv_make_empty(bs);
+    } else {
+        /* Unmap even if the drive wasn't opened with discard=unmap */
+        open_flags = bs->open_flags;
+        bs->open_flags |= BDRV_O_UNMAP;
+        if (bs->file) {
+            file_flags = bs->file->open_flags;
+            bs->file->open_flags |= BDRV_O_UNMAP;
+        }
+        ret = bdrv_make_zero(bs, BDRV_REQ_MAY_UNMAP);
+        bs->open_flags = open_flags;
+        if (bs->file) {
+            bs->file->open_flags = file_flags;
+        }
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_flush(bs);
+}
+
 int bdrv_pread(BlockDriverState *bs, int64_t offset, void *buf, int bytes)
 {
     QEMUIOVector qiov;
@@ -2835,6 +2903,18 @@ int bdrv_pread(BlockDriverState *bs, int64_t offset, void *buf, int bytes)
     return bytes;
 }
 
+int bdrv_preadv(BlockDriverState *bs, int64_t offset, QEMUIOVector *qiov)
+{
+    int ret;
+
+    ret = bdrv_prwv_co(bs, offset, qiov, false, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return qiov->size;
+}
+
 int bdrv_pwritev(BlockDriverState *bs, int64_t offset, QEMUIOVector *qiov)
 {
     int ret;
@@ -3080,6 +3160,13 @@ static int coroutine_fn bdrv_co_do_preadv(BlockDriverState *bs,
         flags |= BDRV_REQ_COPY_ON_READ;
     }
 
+    if (bs->read_map && !(flags & BDRV_REQ_PREFETCH)) {
+        int64_t first = offset >> BDRV_SECTOR_BITS;
+
+        hbitmap_set(bs->read_map, first,
+                    DIV_ROUND_UP(offset + bytes, BDRV_SECTOR_SIZE) - first);
+    }
+
     /* throttling disk I/O */
     if (bs->io_limits_enabled) {
         bdrv_io_limits_intercept(bs, bytes, false);
@@ -3154,6 +3241,21 @@ int coroutine_fn bdrv_co_copy_on_readv(BlockDriverState *bs,
                             BDRV_REQ_COPY_ON_READ);
 }
 
+/*
+ * Read on behalf of a prefetch job: copied into the image if it has a
+ * backing file and can be written, and not recorded in the read map.
+ */
+int coroutine_fn bdrv_co_prefetch_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    BdrvRequestFlags flags = BDRV_REQ_PREFETCH;
+
+    if (bs->backing_hd && !bs->read_only) {
+        flags |= BDRV_REQ_COPY_ON_READ;
+    }
+    return bdrv_co_do_readv(bs, sector_num, nb_sectors, qiov, flags);
+}
+
 /* if no limit is specified in the BlockLimits use a default
  * of 32768 512-byte sectors (16 MiB) per request.
  */
@@ -3278,6 +3380,7 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
         ret = drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
     }
     BLKDBG_EVENT(bs, BLKDBG_PWRITEV_DONE);
+    bs->write_gen++;
 
     if (ret == 0 && !bs->enable_write_cache) {
         ret = bdrv_co_flush(bs);
@@ -4151,6 +4254,23 @@ int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return drv->bdrv_get_info(bs, bdi);
 }
 
+/*
+ * Returns a host file descriptor that can be read instead of @bs, for
+ * instance with sendfile(), or a negative errno.  Reading it bypasses I/O
+ * throttling, copy-on-read and the read map, so it is only handed out
+ * without them.
+ */
+int bdrv_get_host_fd(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_get_host_fd || bs->io_limits_enabled || bs->copy_on_read ||
+        bs->read_map)
+        return -ENOTSUP;
+    return drv->bdrv_get_host_fd(bs);
+}
+
 ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs)
 {
     BlockDriver *drv = bs->drv;
@@ -4554,6 +4674,8 @@ int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
 
     // Check for mergable requests
     num_reqs = multiwrite_merge(bs, reqs, num_reqs, mcb);
+    block_acct_merge_done(&bs->stats, BLOCK_ACCT_WRITE,
+                          mcb->num_callbacks - num_reqs);
 
     trace_bdrv_aio_multiwrite(mcb, mcb->num_callbacks, num_reqs);
 
@@ -4894,7 +5016,7 @@ static void coroutine_fn bdrv_flush_co_entry(void *opaque)
     rwco->ret = bdrv_co_flush(rwco->bs);
 }
 
-int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
+static int coroutine_fn bdrv_co_do_flush(BlockDriverState *bs, bool to_disk)
 {
     int ret;
 
@@ -4911,8 +5033,9 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
         }
     }
 
-    /* But don't actually force it to the disk with cache=unsafe */
-    if (bs->open_flags & BDRV_O_NO_FLUSH) {
+    /* But don't actually force it to the disk with cache=unsafe, nor when
+     * the flush is being coalesced */
+    if ((bs->open_flags & BDRV_O_NO_FLUSH) || !to_disk) {
         goto flush_parent;
     }
 
@@ -4954,7 +5077,38 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
      * in the case of cache=unsafe, so there are no useless flushes.
      */
 flush_parent:
-    return bdrv_co_flush(bs->file);
+    return bdrv_co_do_flush(bs->file, to_disk);
+}
+
+int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
+{
+    uint64_t write_gen;
+    int64_t now;
+    int ret;
+
+    if (!bs || !(bs->open_flags & BDRV_O_COALESCE_FLUSH)) {
+        return bdrv_co_do_flush(bs, true);
+    }
+
+    /*
+     * Data is written back to the OS as usual, but the flush only goes on
+     * to the disk if something was written since the last one that did,
+     * and at most once per flush interval.  The rest complete as soon as
+     * the OS has the data.
+     */
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (bs->write_gen == bs->flushed_gen || now < bs->next_flush_ns) {
+        bs->stats.flush_coalesced++;
+        return bdrv_co_do_flush(bs, false);
+    }
+
+    write_gen = bs->write_gen;
+    bs->next_flush_ns = now + bs->flush_interval_ns;
+    ret = bdrv_co_do_flush(bs, true);
+    if (ret == 0) {
+        bs->flushed_gen = MAX(bs->flushed_gen, write_gen);
+    }
+    return ret;
 }
 
 void bdrv_invalidate_cache(BlockDriverState *bs, Error **errp)
@@ -5383,6 +5537,33 @@ int64_t bdrv_get_dirty_count(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
     return hbitmap_count(bitmap->bitmap);
 }
 
+void bdrv_dirty_bitmap_set(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                           int64_t sector_num, int64_t nb_sectors)
+{
+    hbitmap_set(bitmap->bitmap, sector_num, nb_sectors);
+}
+
+/* Return the sectors dirty so far and start again from a clean bitmap */
+HBitmap *bdrv_dirty_bitmap_take(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
+{
+    HBitmap *taken = bitmap->bitmap;
+
+    bitmap->bitmap = hbitmap_alloc(bdrv_nb_sectors(bs),
+                                   hbitmap_granularity(taken));
+    return taken;
+}
+
+/* Give back what bdrv_dirty_bitmap_take() returned, when it wasn't used */
+void bdrv_dirty_bitmap_restore(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                               HBitmap *taken)
+{
+    if (!hbitmap_merge(bitmap->bitmap, taken)) {
+        /* The device was resized meanwhile */
+        hbitmap_set(bitmap->bitmap, 0, bdrv_nb_sectors(bs));
+    }
+    hbitmap_free(taken);
+}
+
 /* Get a reference to bs */
 void bdrv_ref(BlockDriverState *bs)
 {
@@ -25,6 +25,77 @@
 #include "block/accounting.h"
 #include "block/block_int.h"
 
+/* From 50us to 1s, roughly three bins per decade */
+static const uint64_t default_latency_boundaries[] = {
+    50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+    100000000, 250000000, 500000000, 1000000000,
+};
+
+void block_acct_init(BlockAcctStats *stats)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        block_latency_histogram_set(stats, i, default_latency_boundaries,
+                                    ARRAY_SIZE(default_latency_boundaries));
+    }
+}
+
+/*
+ * Replace the bucketing of the @type latency histogram and clear it.
+ * Boundaries are in nanoseconds and must be strictly increasing; none
+ * disables the histogram.
+ */
+int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
+                                const uint64_t *boundaries,
+                                unsigned int nboundaries)
+{
+    BlockLatencyHistogram *hist = &stats->latency[type];
+    unsigned int i;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    if (nboundaries >= BLOCK_LATENCY_MAX_BINS) {
+        return -E2BIG;
+    }
+    for (i = 1; i < nboundaries; i++) {
+        if (boundaries[i] <= boundaries[i - 1]) {
+            return -EINVAL;
+        }
+    }
+
+    memset(hist, 0, sizeof(*hist));
+    if (nboundaries) {
+        memcpy(hist->boundaries, boundaries, nboundaries * sizeof(uint64_t));
+        hist->nbins = nboundaries + 1;
+    }
+    return 0;
+}
+
+static void block_latency_histogram_account(BlockLatencyHistogram *hist,
+                                            int64_t latency_ns)
+{
+    unsigned int lo = 0, hi;
+
+    if (!hist->nbins) {
+        return;
+    }
+
+    /* Find the first boundary above the latency */
+    hi = hist->nbins - 1;
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+
+        if ((uint64_t)latency_ns < hist->boundaries[mid]) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    hist->bins[lo]++;
+}
+
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type)
 {
@@ -37,13 +108,28 @@ void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
 
 void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
 {
+    int64_t latency_ns = get_clock() - cookie->start_time_ns;
+
     assert(cookie->type < BLOCK_MAX_IOTYPE);
 
     stats->nr_bytes[cookie->type] += cookie->bytes;
     stats->nr_ops[cookie->type]++;
-    stats->total_time_ns[cookie->type] += get_clock() - cookie->start_time_ns;
+    stats->total_time_ns[cookie->type] += latency_ns;
+    block_latency_histogram_account(&stats->latency[cookie->type], latency_ns);
 }
 
+void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
+                           int num_requests)
+{
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    stats->merged[type] += num_requests;
+}
+
+void block_acct_throttled(BlockAcctStats *stats, int64_t ns)
+{
+    stats->throttled_ns += ns;
+}
 
 void block_acct_highest_sector(BlockAcctStats *stats, int64_t sector_num,
                                unsigned int nb_sectors)
@@ -52,3 +138,40 @@ void block_acct_highest_sector(BlockAcctStats *stats, int64_t sector_num,
         stats->wr_highest_sector = sector_num + nb_sectors - 1;
     }
 }
+
+/* Bring the queue depth integral up to now */
+static void block_acct_queue_depth_update(BlockAcctStats *stats, int64_t now)
+{
+    if (stats->queue_depth) {
+        stats->queue_depth_ns += (uint64_t)stats->queue_depth *
+                                 (now - stats->queue_depth_time_ns);
+    }
+    stats->queue_depth_time_ns = now;
+}
+
+void block_acct_request_begin(BlockAcctStats *stats)
+{
+    block_acct_queue_depth_update(stats, get_clock());
+    stats->queue_depth++;
+    if (stats->queue_depth > stats->max_queue_depth) {
+        stats->max_queue_depth = stats->queue_depth;
+    }
+}
+
+void block_acct_request_end(BlockAcctStats *stats)
+{
+    assert(stats->queue_depth > 0);
+    block_acct_queue_depth_update(stats, get_clock());
+    stats->queue_depth--;
+}
+
+/*
+ * The sum over time of the number of requests in flight. The difference
+ * between two samples, divided by the time between them, is the average
+ * queue depth in that interval.
+ */
+uint64_t block_acct_queue_depth_ns(BlockAcctStats *stats)
+{
+    block_acct_queue_depth_update(stats, get_clock());
+    return stats->queue_depth_ns;
+}
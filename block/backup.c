@@ -44,6 +44,7 @@ typedef struct BackupBlockJob {
     CoRwlock flush_rwlock;
     uint64_t sectors_read;
     HBitmap *bitmap;
+    HBitmap *dirty; /* for incremental backups, the sectors to copy */
     QLIST_HEAD(, CowRequest) inflight_reqs;
 } BackupBlockJob;
 
@@ -242,6 +243,35 @@ static void backup_complete(BlockJob *job, void *opaque)
     g_free(data);
 }
 
+/* Incremental backups only copy the clusters written since the last one,
+ * count the others as copied already. */
+static void backup_skip_clean_clusters(BackupBlockJob *job, int64_t end)
+{
+    int64_t sectors = job->common.len / BDRV_SECTOR_SIZE;
+    int64_t granule = 1LL << hbitmap_granularity(job->dirty);
+    int64_t next = 0;
+    HBitmapIter hbi;
+    int64_t sector;
+
+    hbitmap_set(job->bitmap, 0, end);
+    job->common.offset = job->common.len;
+
+    hbitmap_iter_init(&hbi, job->dirty, 0);
+    while ((sector = hbitmap_iter_next(&hbi)) >= 0 && sector < sectors) {
+        int64_t cluster = MAX(next, sector / BACKUP_SECTORS_PER_CLUSTER);
+
+        next = DIV_ROUND_UP(MIN(sector + granule, sectors),
+                            BACKUP_SECTORS_PER_CLUSTER);
+        for (; cluster < next; cluster++) {
+            hbitmap_reset(job->bitmap, cluster, 1);
+            job->common.offset -=
+                MIN(BACKUP_SECTORS_PER_CLUSTER,
+                    sectors - cluster * BACKUP_SECTORS_PER_CLUSTER) *
+                BDRV_SECTOR_SIZE;
+        }
+    }
+}
+
 static void coroutine_fn backup_run(void *opaque)
 {
     BackupBlockJob *job = opaque;
@@ -263,6 +293,9 @@ static void coroutine_fn backup_run(void *opaque)
                        BACKUP_SECTORS_PER_CLUSTER);
 
     job->bitmap = hbitmap_alloc(end, 0);
+    if (job->dirty) {
+        backup_skip_clean_clusters(job, end);
+    }
 
     bdrv_set_enable_write_cache(target, true);
     bdrv_set_on_error(target, on_target_error, on_target_error);
@@ -286,6 +319,9 @@ static void coroutine_fn backup_run(void *opaque)
             if (block_job_is_cancelled(&job->common)) {
                 break;
             }
+            if (job->dirty && hbitmap_get(job->bitmap, start)) {
+                continue;
+            }
 
             /* we need to yield so that qemu_aio_flush() returns.
              * (without, VM does not reboot)
@@ -359,6 +395,16 @@ static void coroutine_fn backup_run(void *opaque)
 
     hbitmap_free(job->bitmap);
 
+    /* What wasn't copied is for the next incremental backup */
+    if (job->dirty) {
+        if ((ret < 0 || block_job_is_cancelled(&job->common)) &&
+            bs->dirty_map) {
+            bdrv_dirty_bitmap_restore(bs, bs->dirty_map, job->dirty);
+        } else {
+            hbitmap_free(job->dirty);
+        }
+    }
+
     bdrv_iostatus_disable(target);
 
     data = g_malloc(sizeof(*data));
@@ -386,6 +432,12 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
         return;
     }
 
+    if (sync_mode == MIRROR_SYNC_MODE_INCREMENTAL && !bs->dirty_map) {
+        error_setg(errp, "Device '%s' has no dirty map",
+                   bdrv_get_device_name(bs));
+        return;
+    }
+
     len = bdrv_getlength(bs);
     if (len < 0) {
         error_setg_errno(errp, -len, "unable to get length for '%s'",
@@ -404,6 +456,10 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
     job->target = target;
     job->sync_mode = sync_mode;
     job->common.len = len;
+    if (sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+        /* Writes from now on are for the next backup */
+        job->dirty = bdrv_dirty_bitmap_take(bs, bs->dirty_map);
+    }
     job->common.co = qemu_coroutine_create(backup_run);
     qemu_coroutine_enter(job->common.co, job);
 }
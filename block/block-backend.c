@@ -14,6 +14,7 @@
 #include "block/block_int.h"
 #include "sysemu/blockdev.h"
 #include "qapi-event.h"
+#include "qemu/metrics.h"
 
 /* Number of coroutines to reserve per attached device model */
 #define COROUTINE_POOL_RESERVATION 64
@@ -29,6 +30,8 @@ struct BlockBackend {
     /* TODO change to DeviceState when all users are qdevified */
     const BlockDevOps *dev_ops;
     void *dev_opaque;
+
+    MetricsCollector *metrics;
 };
 
 static void drive_info_del(DriveInfo *dinfo);
@@ -37,6 +40,58 @@ static void drive_info_del(DriveInfo *dinfo);
 static QTAILQ_HEAD(, BlockBackend) blk_backends =
     QTAILQ_HEAD_INITIALIZER(blk_backends);
 
+static const char *const blk_metrics_types[BLOCK_MAX_IOTYPE] = {
+    [BLOCK_ACCT_READ] = "read",
+    [BLOCK_ACCT_WRITE] = "write",
+    [BLOCK_ACCT_FLUSH] = "flush",
+};
+
+/*
+ * The collector is removed before the BlockDriverState is released, and
+ * only reads its counters, so the BQL isn't needed.
+ */
+static void blk_metrics_collect(MetricsWriter *w, void *opaque)
+{
+    BlockBackend *blk = opaque;
+    BlockDriverState *bs = atomic_read(&blk->bs);
+    BlockAcctStats *stats;
+    int type;
+    unsigned int i;
+
+    if (!bs || !blk->name[0]) {
+        return;
+    }
+    stats = &bs->stats;
+
+    metrics_family(w, "qemu_block_requests", METRIC_COUNTER,
+                   "Requests completed by the device");
+    metrics_family(w, "qemu_block_bytes", METRIC_COUNTER,
+                   "Bytes transferred by the device");
+    metrics_family(w, "qemu_block_request_seconds", METRIC_HISTOGRAM,
+                   "Time taken by requests");
+    for (type = 0; type < BLOCK_MAX_IOTYPE; type++) {
+        BlockLatencyHistogram *hist = &stats->latency[type];
+        char *labels = metrics_labels("device", blk->name,
+                                      "type", blk_metrics_types[type], NULL);
+
+        metrics_sample_int(w, "qemu_block_requests", labels,
+                           stats->nr_ops[type]);
+        metrics_sample_int(w, "qemu_block_bytes", labels,
+                           stats->nr_bytes[type]);
+        if (hist->nbins) {
+            double bounds[BLOCK_LATENCY_MAX_BINS - 1];
+
+            for (i = 0; i < hist->nbins - 1; i++) {
+                bounds[i] = hist->boundaries[i] / 1e9;
+            }
+            metrics_histogram(w, "qemu_block_request_seconds", labels,
+                              bounds, hist->bins, hist->nbins - 1,
+                              stats->total_time_ns[type] / 1e9);
+        }
+        g_free(labels);
+    }
+}
+
 /*
  * Create a new BlockBackend with @name, with a reference count of one.
  * @name must not be null or empty.
@@ -68,6 +123,7 @@ BlockBackend *blk_new(const char *name, Error **errp)
     blk->name = g_strdup(name);
     blk->refcnt = 1;
     QTAILQ_INSERT_TAIL(&blk_backends, blk, link);
+    blk->metrics = metrics_collector_add(blk_metrics_collect, blk);
     return blk;
 }
 
@@ -95,6 +151,7 @@ static void blk_delete(BlockBackend *blk)
 {
     assert(!blk->refcnt);
     assert(!blk->dev);
+    metrics_collector_remove(blk->metrics);
     if (blk->bs) {
         assert(blk->bs->blk == blk);
         blk->bs->blk = NULL;
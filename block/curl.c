@@ -24,6 +24,8 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "qapi/qmp/qbool.h"
+#include "qemu/bitmap.h"
+#include "qemu/error-report.h"
 #include <curl/curl.h>
 
 // #define DEBUG_CURL
@@ -59,10 +61,13 @@ static CURLMcode __curl_multi_socket_action(CURLM *multi_handle,
                    CURLPROTO_FTP | CURLPROTO_FTPS | \
                    CURLPROTO_TFTP)
 
-#define CURL_NUM_STATES 8
+#define CURL_NUM_STATES_DEFAULT 16
+#define CURL_NUM_STATES_MAX 64
 #define CURL_NUM_ACB    8
 #define SECTOR_SIZE     512
 #define READ_AHEAD_DEFAULT (256 * 1024)
+#define READ_AHEAD_MAX_DEFAULT (4 * 1024 * 1024)
+#define CURL_CACHE_CHUNK (64 * 1024)
 #define CURL_TIMEOUT_DEFAULT 5
 #define CURL_TIMEOUT_MAX 10000
 
@@ -75,6 +80,9 @@ static CURLMcode __curl_multi_socket_action(CURLM *multi_handle,
 #define CURL_BLOCK_OPT_SSLVERIFY "sslverify"
 #define CURL_BLOCK_OPT_TIMEOUT "timeout"
 #define CURL_BLOCK_OPT_COOKIE    "cookie"
+#define CURL_BLOCK_OPT_READAHEAD_MAX "readahead-max"
+#define CURL_BLOCK_OPT_CONNECTIONS "connections"
+#define CURL_BLOCK_OPT_CACHE_DIR "cache-dir"
 
 struct BDRVCURLState;
 
@@ -109,14 +117,29 @@ typedef struct BDRVCURLState {
     CURLM *multi;
     QEMUTimer timer;
     size_t len;
-    CURLState states[CURL_NUM_STATES];
+    CURLState states[CURL_NUM_STATES_MAX];
+    int num_states;
     char *url;
     size_t readahead_size;
+    size_t readahead_max;
+    /* Grows while the requests that miss follow each other */
+    size_t readahead_cur;
+    size_t last_start;
+    size_t last_end;
     bool sslverify;
     uint64_t timeout;
     char *cookie;
     bool accept_range;
+    /* ETag or Last-Modified of the image, to key the cache with */
+    char *validator;
     AioContext *aio_context;
+
+    /* Local copy of the chunks of the image read so far, if any */
+    int cache_fd;
+    char *cache_map;
+    unsigned long *cache_bitmap;
+    size_t cache_chunks;
+    bool cache_dirty;
 } BDRVCURLState;
 
 static void curl_clean_state(CURLState *s);
@@ -175,12 +198,29 @@ static size_t curl_header_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
     BDRVCURLState *s = opaque;
     size_t realsize = size * nmemb;
     const char *accept_line = "Accept-Ranges: bytes";
+    static const char *const validators[] = { "ETag:", "Last-Modified:" };
+    int i;
 
     if (realsize >= strlen(accept_line)
         && strncmp((char *)ptr, accept_line, strlen(accept_line)) == 0) {
         s->accept_range = true;
     }
 
+    for (i = 0; i < ARRAY_SIZE(validators); i++) {
+        size_t n = strlen(validators[i]);
+
+        /* An ETag wins over a Last-Modified of the same response */
+        if (realsize > n && !strncasecmp(ptr, validators[i], n) &&
+            (i == 0 || !s->validator)) {
+            while (realsize > n && qemu_isspace(((char *)ptr)[realsize - 1])) {
+                realsize--;
+            }
+            g_free(s->validator);
+            s->validator = g_strndup(ptr, realsize);
+            return size * nmemb;
+        }
+    }
+
     return realsize;
 }
 
@@ -227,7 +267,7 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
     int i;
     size_t end = start + len;
 
-    for (i=0; i<CURL_NUM_STATES; i++) {
+    for (i=0; i<s->num_states; i++) {
         CURLState *state = &s->states[i];
         size_t buf_end = (state->buf_start + state->buf_off);
         size_t buf_fend = (state->buf_start + state->buf_len);
@@ -275,6 +315,136 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
     return FIND_RET_NONE;
 }
 
+/*
+ * The cache of an image is a sparse file of the size of the image in
+ * @cache_dir, and a bitmap of the chunks it holds.  Both are named after
+ * the URL, size and validator of the image, so that a new version of it
+ * on the server gets a new cache.  The bitmap is only written on close,
+ * after the data, so that it never claims chunks that aren't there.
+ */
+static void curl_cache_open(BDRVCURLState *s, const char *cache_dir)
+{
+    char *key, *hash, *path;
+    gchar *map = NULL;
+    gsize map_len;
+    struct stat st;
+
+    if (!s->validator) {
+        error_report("warning: not caching '%s', the server gives no ETag "
+                     "or Last-Modified for it", s->url);
+        return;
+    }
+
+    key = g_strdup_printf("%s\n%zu\n%s", s->url, s->len, s->validator);
+    hash = g_compute_checksum_for_string(G_CHECKSUM_SHA256, key, -1);
+    path = g_strdup_printf("%s/%s.img", cache_dir, hash);
+    s->cache_map = g_strdup_printf("%s/%s.map", cache_dir, hash);
+    g_free(hash);
+    g_free(key);
+
+    s->cache_fd = qemu_open(path, O_RDWR | O_CREAT | O_BINARY, 0644);
+    if (s->cache_fd < 0 || fstat(s->cache_fd, &st) < 0) {
+        error_report("warning: could not open the cache '%s' of '%s': %s",
+                     path, s->url, strerror(errno));
+        goto fail;
+    }
+
+    s->cache_chunks = DIV_ROUND_UP(s->len, CURL_CACHE_CHUNK);
+    s->cache_bitmap = bitmap_new(s->cache_chunks);
+    /* The map of a file that was removed or truncated since is stale */
+    if (st.st_size >= (off_t)s->len &&
+        g_file_get_contents(s->cache_map, &map, &map_len, NULL) &&
+        map_len == BITS_TO_LONGS(s->cache_chunks) * sizeof(unsigned long)) {
+        memcpy(s->cache_bitmap, map, map_len);
+    } else if (ftruncate(s->cache_fd, s->len) < 0) {
+        error_report("warning: could not size the cache '%s' of '%s': %s",
+                     path, s->url, strerror(errno));
+        g_free(map);
+        goto fail;
+    }
+    g_free(map);
+    g_free(path);
+    return;
+
+fail:
+    if (s->cache_fd >= 0) {
+        qemu_close(s->cache_fd);
+    }
+    g_free(s->cache_bitmap);
+    s->cache_bitmap = NULL;
+    g_free(s->cache_map);
+    s->cache_map = NULL;
+    g_free(path);
+}
+
+static void curl_cache_close(BDRVCURLState *s)
+{
+    if (!s->cache_bitmap) {
+        return;
+    }
+    if (s->cache_dirty &&
+        !g_file_set_contents(s->cache_map, (gchar *)s->cache_bitmap,
+                             BITS_TO_LONGS(s->cache_chunks) *
+                             sizeof(unsigned long), NULL)) {
+        error_report("warning: could not write the cache map '%s'",
+                     s->cache_map);
+    }
+    qemu_close(s->cache_fd);
+    g_free(s->cache_bitmap);
+    s->cache_bitmap = NULL;
+    g_free(s->cache_map);
+    s->cache_map = NULL;
+}
+
+/* Returns true if the whole range was read from the cache into @qiov */
+static bool curl_cache_read(BDRVCURLState *s, size_t start, size_t len,
+                            QEMUIOVector *qiov)
+{
+    size_t first = start / CURL_CACHE_CHUNK;
+    size_t last = DIV_ROUND_UP(start + len, CURL_CACHE_CHUNK);
+    char *buf;
+    bool ret;
+
+    if (!s->cache_bitmap || start + len > s->len ||
+        find_next_zero_bit(s->cache_bitmap, last, first) < last) {
+        return false;
+    }
+
+    buf = g_try_malloc(len);
+    ret = buf && pread(s->cache_fd, buf, len, start) == len;
+    if (ret) {
+        qemu_iovec_from_buf(qiov, 0, buf, len);
+    }
+    g_free(buf);
+    return ret;
+}
+
+/* Stores the whole chunks of a completed transfer */
+static void curl_cache_write(BDRVCURLState *s, CURLState *state)
+{
+    size_t end = state->buf_start + state->buf_off;
+    size_t i = DIV_ROUND_UP(state->buf_start, CURL_CACHE_CHUNK);
+    size_t last = end == s->len ? s->cache_chunks : end / CURL_CACHE_CHUNK;
+
+    if (!s->cache_bitmap) {
+        return;
+    }
+    for (; i < last; i++) {
+        size_t off = i * CURL_CACHE_CHUNK;
+        size_t len = MIN(CURL_CACHE_CHUNK, s->len - off);
+
+        if (test_bit(i, s->cache_bitmap)) {
+            continue;
+        }
+        if (pwrite(s->cache_fd, state->orig_buf + (off - state->buf_start),
+                   len, off) != len) {
+            return;
+        }
+        set_bit(i, s->cache_bitmap);
+        s->cache_dirty = true;
+    }
+}
+
 static void curl_multi_check_completion(BDRVCURLState *s)
 {
     int msgs_in_queue;
@@ -308,6 +478,8 @@ static void curl_multi_check_completion(BDRVCURLState *s)
                     qemu_aio_unref(acb);
                     state->acb[i] = NULL;
                 }
+            } else {
+                curl_cache_write(s, state);
             }
 
             curl_clean_state(state);
@@ -364,7 +536,7 @@ static CURLState *curl_init_state(BlockDriverState *bs, BDRVCURLState *s)
     int i, j;
 
     do {
-        for (i=0; i<CURL_NUM_STATES; i++) {
+        for (i=0; i<s->num_states; i++) {
             for (j=0; j<CURL_NUM_ACB; j++)
                 if (s->states[i].acb[j])
                     continue;
@@ -441,7 +613,7 @@ static void curl_detach_aio_context(BlockDriverState *bs)
     BDRVCURLState *s = bs->opaque;
     int i;
 
-    for (i = 0; i < CURL_NUM_STATES; i++) {
+    for (i = 0; i < s->num_states; i++) {
         if (s->states[i].in_use) {
             curl_clean_state(&s->states[i]);
         }
@@ -508,6 +680,21 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "Pass the cookie or list of cookies with each request"
         },
+        {
+            .name = CURL_BLOCK_OPT_READAHEAD_MAX,
+            .type = QEMU_OPT_SIZE,
+            .help = "Readahead size reached with sequential reads",
+        },
+        {
+            .name = CURL_BLOCK_OPT_CONNECTIONS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of concurrent range requests",
+        },
+        {
+            .name = CURL_BLOCK_OPT_CACHE_DIR,
+            .type = QEMU_OPT_STRING,
+            .help = "Directory to keep the data read from the server in",
+        },
         { /* end of list */ }
     },
 };
@@ -521,6 +708,8 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
     Error *local_err = NULL;
     const char *file;
     const char *cookie;
+    const char *cache_dir;
+    uint64_t connections;
     double d;
 
     static int inited = 0;
@@ -544,6 +733,25 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
                    s->readahead_size);
         goto out_noclean;
     }
+    s->readahead_max = qemu_opt_get_size(opts, CURL_BLOCK_OPT_READAHEAD_MAX,
+                                         MAX(READ_AHEAD_MAX_DEFAULT,
+                                             s->readahead_size));
+    if ((s->readahead_max & 0x1ff) != 0 ||
+        s->readahead_max < s->readahead_size) {
+        error_setg(errp, "readahead-max must be a multiple of 512 and at "
+                   "least the readahead size");
+        goto out_noclean;
+    }
+    s->readahead_cur = s->readahead_size;
+
+    connections = qemu_opt_get_number(opts, CURL_BLOCK_OPT_CONNECTIONS,
+                                      CURL_NUM_STATES_DEFAULT);
+    if (connections < 1 || connections > CURL_NUM_STATES_MAX) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   CURL_NUM_STATES_MAX);
+        goto out_noclean;
+    }
+    s->num_states = connections;
 
     s->timeout = qemu_opt_get_number(opts, CURL_BLOCK_OPT_TIMEOUT,
                                      CURL_TIMEOUT_DEFAULT);
@@ -602,6 +810,12 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
     curl_easy_cleanup(state->curl);
     state->curl = NULL;
 
+    s->cache_fd = -1;
+    cache_dir = qemu_opt_get(opts, CURL_BLOCK_OPT_CACHE_DIR);
+    if (cache_dir) {
+        curl_cache_open(s, cache_dir);
+    }
+
     curl_attach_aio_context(bs, bdrv_get_aio_context(bs));
 
     qemu_opts_del(opts);
@@ -612,6 +826,7 @@ out:
     curl_easy_cleanup(state->curl);
     state->curl = NULL;
 out_noclean:
+    g_free(s->validator);
     g_free(s->cookie);
     g_free(s->url);
     qemu_opts_del(opts);
@@ -649,6 +864,13 @@ static void curl_readv_bh_cb(void *p)
             break;
     }
 
+    if (curl_cache_read(s, start, acb->nb_sectors * SECTOR_SIZE,
+                        acb->qiov)) {
+        acb->common.cb(acb->common.opaque, 0);
+        qemu_aio_unref(acb);
+        return;
+    }
+
     // No cache found, so let's start a new request
     state = curl_init_state(acb->common.bs, s);
     if (!state) {
@@ -660,10 +882,22 @@ static void curl_readv_bh_cb(void *p)
     acb->start = 0;
     acb->end = (acb->nb_sectors * SECTOR_SIZE);
 
+    /*
+     * A miss that starts within the previous request means the guest
+     * reads on past the readahead, so read twice as far ahead next time.
+     */
+    if (start > s->last_start && start <= s->last_end) {
+        s->readahead_cur = MIN(s->readahead_cur * 2, s->readahead_max);
+    } else {
+        s->readahead_cur = s->readahead_size;
+    }
+
     state->buf_off = 0;
     g_free(state->orig_buf);
     state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
+    state->buf_len = acb->end + s->readahead_cur;
+    s->last_start = start;
+    s->last_end = start + state->buf_len;
     end = MIN(start + state->buf_len, s->len) - 1;
     state->orig_buf = g_try_malloc(state->buf_len);
     if (state->buf_len && state->orig_buf == NULL) {
@@ -708,7 +942,9 @@ static void curl_close(BlockDriverState *bs)
 
     DPRINTF("CURL: Close\n");
     curl_detach_aio_context(bs);
+    curl_cache_close(s);
 
+    g_free(s->validator);
     g_free(s->cookie);
     g_free(s->url);
 }
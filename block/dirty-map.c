@@ -0,0 +1,170 @@
+/*
+ * Dirty maps kept across runs, for incremental backups
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "trace.h"
+#include "block/block_int.h"
+#include "qemu/error-report.h"
+#include "qapi/qmp/qerror.h"
+
+#include <sys/stat.h>
+
+/*
+ * The dirty map of a device lists the ranges written since its last
+ * incremental backup, as a header line, a line with the size of the device
+ * in sectors and one "<sector> <count>" line per range.  Ranges are rounded
+ * to 64k, the cluster size of backup jobs.
+ *
+ * The map is only written when the device is closed, and removed once it
+ * is read, so that a run that doesn't end cleanly leaves no map behind.
+ * Without a map, or with one older than the image, the whole device counts
+ * as written.
+ */
+#define DIRTY_MAP_HEADER        "qemu-dirty-map 1"
+#define DIRTY_MAP_GRANULARITY   65536
+
+typedef struct DirtyMap {
+    BlockDriverState *bs;
+    char *map;
+    Notifier close_notifier;
+} DirtyMap;
+
+static bool dirty_map_load(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                           const char *map)
+{
+    struct stat map_st, image_st;
+    const char *p;
+    char *contents;
+    char *end;
+    bool ok = false;
+
+    if (stat(map, &map_st) < 0) {
+        return false;
+    }
+    if (stat(bs->filename, &image_st) == 0 &&
+        image_st.st_mtime > map_st.st_mtime) {
+        error_report("warning: ignoring dirty map '%s' older than its image",
+                     map);
+        return false;
+    }
+    if (!g_file_get_contents(map, &contents, NULL, NULL)) {
+        return false;
+    }
+    if (!strstart(contents, DIRTY_MAP_HEADER "\n", &p) ||
+        strtoll(p, &end, 10) != bs->total_sectors || *end != '\n') {
+        error_report("warning: ignoring dirty map '%s' of another format "
+                     "or size", map);
+        goto out;
+    }
+
+    p = end + 1;
+    while (*p) {
+        int64_t sector_num = strtoll(p, &end, 10);
+        int64_t nb_sectors = strtoll(end, &end, 10);
+
+        if (*end != '\n' || sector_num < 0 || nb_sectors <= 0 ||
+            sector_num >= bs->total_sectors ||
+            nb_sectors > bs->total_sectors - sector_num) {
+            error_report("warning: ignoring corrupt dirty map '%s'", map);
+            goto out;
+        }
+        bdrv_dirty_bitmap_set(bs, bitmap, sector_num, nb_sectors);
+        p = end + 1;
+    }
+    ok = true;
+out:
+    g_free(contents);
+    return ok;
+}
+
+static void dirty_map_save(DirtyMap *dm)
+{
+    BlockDriverState *bs = dm->bs;
+    GString *out = g_string_new(DIRTY_MAP_HEADER "\n");
+    uint64_t granule = DIRTY_MAP_GRANULARITY >> BDRV_SECTOR_BITS;
+    int64_t start = -1, end = -1;
+    HBitmapIter hbi;
+    int64_t sector;
+    char *tmp;
+
+    g_string_append_printf(out, "%" PRId64 "\n", bs->total_sectors);
+    bdrv_dirty_iter_init(bs, bs->dirty_map, &hbi);
+    while ((sector = hbitmap_iter_next(&hbi)) >= 0) {
+        if (sector != end) {
+            if (start >= 0) {
+                g_string_append_printf(out, "%" PRId64 " %" PRId64 "\n",
+                                       start, end - start);
+            }
+            start = sector;
+        }
+        end = MIN(sector + granule, bs->total_sectors);
+    }
+    if (start >= 0) {
+        g_string_append_printf(out, "%" PRId64 " %" PRId64 "\n",
+                               start, end - start);
+    }
+
+    tmp = g_strdup_printf("%s.tmp", dm->map);
+    if (!g_file_set_contents(tmp, out->str, out->len, NULL) ||
+        rename(tmp, dm->map) < 0) {
+        error_report("warning: could not write dirty map '%s'", dm->map);
+        unlink(tmp);
+    }
+    g_free(tmp);
+    g_string_free(out, true);
+}
+
+static void dirty_map_closed(Notifier *notifier, void *data)
+{
+    DirtyMap *dm = container_of(notifier, DirtyMap, close_notifier);
+    BlockDriverState *bs = dm->bs;
+
+    dirty_map_save(dm);
+    bdrv_release_dirty_bitmap(bs, bs->dirty_map);
+    bs->dirty_map = NULL;
+
+    notifier_remove(&dm->close_notifier);
+    g_free(dm->map);
+    g_free(dm);
+}
+
+void dirty_map_start(BlockDriverState *bs, const char *map, Error **errp)
+{
+    BdrvDirtyBitmap *bitmap;
+    DirtyMap *dm;
+    bool loaded;
+
+    if (!bs->drv) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, bdrv_get_device_name(bs));
+        return;
+    }
+    if (bs->dirty_map) {
+        error_setg(errp, "Device '%s' already has a dirty map",
+                   bdrv_get_device_name(bs));
+        return;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, DIRTY_MAP_GRANULARITY, errp);
+    if (!bitmap) {
+        return;
+    }
+    loaded = dirty_map_load(bs, bitmap, map);
+    if (!loaded) {
+        bdrv_dirty_bitmap_set(bs, bitmap, 0, bs->total_sectors);
+    }
+    unlink(map);
+    trace_dirty_map_start(bs, loaded, bdrv_get_dirty_count(bs, bitmap));
+
+    dm = g_new0(DirtyMap, 1);
+    dm->bs = bs;
+    dm->map = g_strdup(map);
+    dm->close_notifier.notify = dirty_map_closed;
+    bdrv_add_close_notifier(bs, &dm->close_notifier);
+    bs->dirty_map = bitmap;
+}
@@ -0,0 +1,306 @@
+/*
+ * I/O limits shared by the emulators of a host
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "qemu/timer.h"
+
+#ifdef CONFIG_LINUX
+#include <signal.h>
+#include <sys/mman.h>
+#endif
+
+/*
+ * The processes limited on a host device share a file in /dev/shm named
+ * after the device, with one slot per process.  A process counts the
+ * requests of its drives on the device in its slot, and the time they
+ * spent throttled.  Every period, each process looks at which slots had
+ * requests recently, and gives its drives an equal share of the limits
+ * of the device among the processes that are active, so that idle ones
+ * leave their share to the others.
+ */
+#define HOST_THROTTLE_PATH      "/dev/shm/qemu-host-throttle-1-%" PRIx64
+#define HOST_THROTTLE_SLOTS     128
+#define HOST_THROTTLE_PERIOD_MS 250
+/* Active means with requests in the last that many periods */
+#define HOST_THROTTLE_ACTIVE    4
+
+typedef struct HostThrottleSlot {
+    int32_t pid;
+    uint32_t requests;
+    uint64_t throttled_ns;
+} HostThrottleSlot;
+
+typedef struct HostThrottleShared {
+    HostThrottleSlot slots[HOST_THROTTLE_SLOTS];
+} HostThrottleShared;
+
+typedef struct HostThrottle HostThrottle;
+
+struct HostThrottleMember {
+    HostThrottle *ht;
+    BlockDriverState *bs;
+    ThrottleConfig cfg;
+    unsigned int requests;
+    unsigned int last_requests;
+    int idle_periods;
+    unsigned int divisor;
+    QLIST_ENTRY(HostThrottleMember) next;
+};
+
+struct HostThrottle {
+    uint64_t dev;
+    HostThrottleShared *shared;
+    HostThrottleSlot *slot;
+    uint32_t last_requests[HOST_THROTTLE_SLOTS];
+    int idle_periods[HOST_THROTTLE_SLOTS];
+    QLIST_HEAD(, HostThrottleMember) members;
+    QLIST_ENTRY(HostThrottle) next;
+};
+
+static QLIST_HEAD(, HostThrottle) host_throttles =
+    QLIST_HEAD_INITIALIZER(host_throttles);
+static QEMUTimer *host_throttle_timer;
+
+static bool host_throttle_track(uint32_t requests, uint32_t *last,
+                                int *idle_periods)
+{
+    if (requests != *last) {
+        *last = requests;
+        *idle_periods = 0;
+    } else if (*idle_periods < HOST_THROTTLE_ACTIVE) {
+        ++*idle_periods;
+    }
+    return *idle_periods < HOST_THROTTLE_ACTIVE;
+}
+
+static void host_throttle_apply(HostThrottleMember *m, unsigned int divisor)
+{
+    AioContext *ctx = bdrv_get_aio_context(m->bs);
+    ThrottleConfig cfg = m->cfg;
+    int i;
+
+    if (divisor == m->divisor) {
+        return;
+    }
+    m->divisor = divisor;
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        cfg.buckets[i].avg /= divisor;
+        cfg.buckets[i].max /= divisor;
+    }
+    aio_context_acquire(ctx);
+    bdrv_set_io_limits(m->bs, &cfg);
+    aio_context_release(ctx);
+}
+
+static void host_throttle_update(HostThrottle *ht)
+{
+    HostThrottleMember *m;
+    unsigned int others = 0, local = 0;
+    int i;
+
+    for (i = 0; i < HOST_THROTTLE_SLOTS; i++) {
+        HostThrottleSlot *slot = &ht->shared->slots[i];
+
+        if (host_throttle_track(atomic_read(&slot->requests),
+                                &ht->last_requests[i], &ht->idle_periods[i]) &&
+            slot != ht->slot && atomic_read(&slot->pid)) {
+            others++;
+        }
+    }
+    QLIST_FOREACH(m, &ht->members, next) {
+        if (host_throttle_track(atomic_read(&m->requests), &m->last_requests,
+                                &m->idle_periods)) {
+            local++;
+        }
+    }
+
+    /*
+     * A drive that is idle is given the share it would have once it
+     * starts, as is this process if it is idle.
+     */
+    QLIST_FOREACH(m, &ht->members, next) {
+        unsigned int drives = local +
+                              (m->idle_periods < HOST_THROTTLE_ACTIVE ? 0 : 1);
+
+        host_throttle_apply(m, (others + 1) * drives);
+    }
+}
+
+static void host_throttle_tick(void *opaque)
+{
+    HostThrottle *ht;
+
+    QLIST_FOREACH(ht, &host_throttles, next) {
+        host_throttle_update(ht);
+    }
+    if (!QLIST_EMPTY(&host_throttles)) {
+        timer_mod(host_throttle_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                                       HOST_THROTTLE_PERIOD_MS);
+    }
+}
+
+#ifdef CONFIG_LINUX
+static HostThrottle *host_throttle_open(uint64_t dev, Error **errp)
+{
+    HostThrottleShared *shared;
+    HostThrottle *ht;
+    char *path;
+    int32_t pid = getpid();
+    int fd, i;
+
+    path = g_strdup_printf(HOST_THROTTLE_PATH, dev);
+    fd = qemu_open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0 || ftruncate(fd, sizeof(*shared)) < 0) {
+        error_setg_errno(errp, errno, "Could not open '%s'", path);
+        goto fail;
+    }
+    shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fd, 0);
+    if (shared == MAP_FAILED) {
+        error_setg_errno(errp, errno, "Could not map '%s'", path);
+        goto fail;
+    }
+    qemu_close(fd);
+
+    /* Slots of processes that are gone are free */
+    for (i = 0; i < HOST_THROTTLE_SLOTS; i++) {
+        int32_t old = atomic_read(&shared->slots[i].pid);
+
+        if ((!old || (kill(old, 0) < 0 && errno == ESRCH)) &&
+            atomic_cmpxchg(&shared->slots[i].pid, old, pid) == old) {
+            atomic_set(&shared->slots[i].throttled_ns, 0);
+            break;
+        }
+    }
+    if (i == HOST_THROTTLE_SLOTS) {
+        error_setg(errp, "More than %d processes share '%s'",
+                   HOST_THROTTLE_SLOTS, path);
+        munmap(shared, sizeof(*shared));
+        g_free(path);
+        return NULL;
+    }
+    g_free(path);
+
+    ht = g_new0(HostThrottle, 1);
+    ht->dev = dev;
+    ht->shared = shared;
+    ht->slot = &shared->slots[i];
+    for (i = 0; i < HOST_THROTTLE_SLOTS; i++) {
+        ht->last_requests[i] = atomic_read(&shared->slots[i].requests);
+        ht->idle_periods[i] = HOST_THROTTLE_ACTIVE;
+    }
+    QLIST_INIT(&ht->members);
+    return ht;
+
+fail:
+    if (fd >= 0) {
+        qemu_close(fd);
+    }
+    g_free(path);
+    return NULL;
+}
+
+static void host_throttle_close(HostThrottle *ht)
+{
+    atomic_set(&ht->slot->pid, 0);
+    munmap(ht->shared, sizeof(*ht->shared));
+    g_free(ht);
+}
+#else
+static HostThrottle *host_throttle_open(uint64_t dev, Error **errp)
+{
+    error_setg(errp, "Host-wide I/O limits are not supported on this host");
+    return NULL;
+}
+
+static void host_throttle_close(HostThrottle *ht)
+{
+}
+#endif
+
+void host_throttle_join(BlockDriverState *bs, ThrottleConfig *cfg,
+                        Error **errp)
+{
+    BlockDriverState *leaf = bs;
+    HostThrottleMember *m;
+    HostThrottle *ht;
+    struct stat st;
+
+    assert(!bs->io_limits_enabled);
+    while (leaf->file) {
+        leaf = leaf->file;
+    }
+    if (stat(leaf->filename, &st) < 0) {
+        error_setg_errno(errp, errno, "Could not find the host device of '%s'",
+                         leaf->filename);
+        return;
+    }
+
+    QLIST_FOREACH(ht, &host_throttles, next) {
+        if (ht->dev == st.st_dev) {
+            break;
+        }
+    }
+    if (!ht) {
+        ht = host_throttle_open(st.st_dev, errp);
+        if (!ht) {
+            return;
+        }
+        QLIST_INSERT_HEAD(&host_throttles, ht, next);
+    }
+
+    m = g_new0(HostThrottleMember, 1);
+    m->ht = ht;
+    m->bs = bs;
+    m->cfg = *cfg;
+    m->idle_periods = HOST_THROTTLE_ACTIVE;
+    QLIST_INSERT_HEAD(&ht->members, m, next);
+    bs->host_throttle = m;
+
+    bdrv_io_limits_enable(bs);
+    host_throttle_update(ht);
+
+    if (!host_throttle_timer) {
+        host_throttle_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                           host_throttle_tick, NULL);
+    }
+    if (!timer_pending(host_throttle_timer)) {
+        timer_mod(host_throttle_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                                       HOST_THROTTLE_PERIOD_MS);
+    }
+}
+
+void host_throttle_leave(BlockDriverState *bs)
+{
+    HostThrottleMember *m = bs->host_throttle;
+    HostThrottle *ht = m->ht;
+
+    QLIST_REMOVE(m, next);
+    g_free(m);
+    bs->host_throttle = NULL;
+
+    if (QLIST_EMPTY(&ht->members)) {
+        QLIST_REMOVE(ht, next);
+        host_throttle_close(ht);
+    }
+}
+
+void host_throttle_account(BlockDriverState *bs, int64_t throttled_ns)
+{
+    HostThrottleMember *m = bs->host_throttle;
+
+    atomic_inc(&m->requests);
+    atomic_inc(&m->ht->slot->requests);
+    if (throttled_ns) {
+        atomic_add(&m->ht->slot->throttled_ns, throttled_ns);
+    }
+}
@@ -13,7 +13,81 @@
 #include "block/raw-aio.h"
 #include "qemu/event_notifier.h"
 
-#include <libaio.h>
+#include <linux/aio_abi.h>
+#include <sys/syscall.h>
+
+/*
+ * The kernel interface is used directly rather than through libaio, which
+ * isn't available on every build host. These give the libaio semantics of
+ * returning -errno on failure.
+ */
+typedef aio_context_t io_context_t;
+
+static inline int io_syscall_ret(long ret)
+{
+    return ret < 0 ? -errno : ret;
+}
+
+static inline int io_setup(int nr_events, io_context_t *ctx)
+{
+    return io_syscall_ret(syscall(__NR_io_setup, nr_events, ctx));
+}
+
+static inline int io_destroy(io_context_t ctx)
+{
+    return io_syscall_ret(syscall(__NR_io_destroy, ctx));
+}
+
+static inline int io_submit(io_context_t ctx, long nr, struct iocb **iocbs)
+{
+    return io_syscall_ret(syscall(__NR_io_submit, ctx, nr, iocbs));
+}
+
+static inline int io_cancel(io_context_t ctx, struct iocb *iocb,
+                            struct io_event *event)
+{
+    return io_syscall_ret(syscall(__NR_io_cancel, ctx, iocb, event));
+}
+
+static inline int io_getevents(io_context_t ctx, long min_nr, long nr,
+                               struct io_event *events,
+                               struct timespec *timeout)
+{
+    return io_syscall_ret(syscall(__NR_io_getevents, ctx, min_nr, nr, events,
+                                  timeout));
+}
+
+static inline void io_prep_vectored(struct iocb *iocb, int opcode, int fd,
+                                    const struct iovec *iov, int iovcnt,
+                                    long long offset)
+{
+    memset(iocb, 0, sizeof(*iocb));
+    iocb->aio_lio_opcode = opcode;
+    iocb->aio_fildes = fd;
+    iocb->aio_buf = (uintptr_t)iov;
+    iocb->aio_nbytes = iovcnt;
+    iocb->aio_offset = offset;
+}
+
+static inline void io_prep_preadv(struct iocb *iocb, int fd,
+                                  const struct iovec *iov, int iovcnt,
+                                  long long offset)
+{
+    io_prep_vectored(iocb, IOCB_CMD_PREADV, fd, iov, iovcnt, offset);
+}
+
+static inline void io_prep_pwritev(struct iocb *iocb, int fd,
+                                   const struct iovec *iov, int iovcnt,
+                                   long long offset)
+{
+    io_prep_vectored(iocb, IOCB_CMD_PWRITEV, fd, iov, iovcnt, offset);
+}
+
+static inline void io_set_eventfd(struct iocb *iocb, int eventfd)
+{
+    iocb->aio_flags |= IOCB_FLAG_RESFD;
+    iocb->aio_resfd = eventfd;
+}
 
 /*
  * Queue size (per-device).
@@ -126,7 +200,8 @@ static void qemu_laio_completion_bh(void *opaque)
 
     /* Process completion events */
     while (s->event_idx < s->event_max) {
-        struct iocb *iocb = s->events[s->event_idx].obj;
+        struct iocb *iocb =
+                (struct iocb *)(uintptr_t)s->events[s->event_idx].obj;
         struct qemu_laiocb *laiocb =
                 container_of(iocb, struct qemu_laiocb, iocb);
 
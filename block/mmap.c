@@ -0,0 +1,221 @@
+/*
+ * Read-only block driver backed by a shared file mapping
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The whole image is mapped MAP_SHARED and PROT_READ, and reads are a
+ * single copy from the mapping into the request's buffers, done inline in
+ * the calling coroutine. There is no thread pool round trip and no
+ * private buffer, so any number of emulators using the same system image
+ * share one copy of it in the host page cache.
+ *
+ * The catch is that a read of a page that is not resident blocks the
+ * caller on a page fault. We ask the kernel to read the image ahead when
+ * it is opened, which is what makes sense for images read heavily at
+ * boot. The image must not be truncated while it is mapped.
+ */
+
+#include <sys/mman.h>
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "qemu/iov.h"
+
+typedef struct BDRVMmapState {
+    int fd;
+    uint8_t *base;
+    int64_t size;
+} BDRVMmapState;
+
+static QemuOptsList runtime_opts = {
+    .name = "mmap",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "filename",
+            .type = QEMU_OPT_STRING,
+            .help = "File name of the image",
+        },
+        { /* end of list */ }
+    },
+};
+
+static void mmap_parse_filename(const char *filename, QDict *options,
+                                Error **errp)
+{
+    strstart(filename, "mmap:", &filename);
+    qdict_put_obj(options, "filename", QOBJECT(qstring_from_str(filename)));
+}
+
+static int mmap_file_open(BlockDriverState *bs, QDict *options, int flags,
+                          Error **errp)
+{
+    BDRVMmapState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    const char *filename;
+    struct stat st;
+    int ret;
+
+    if (flags & BDRV_O_RDWR) {
+        error_setg(errp, "mmap images can only be opened read-only");
+        return -EINVAL;
+    }
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    filename = qemu_opt_get(opts, "filename");
+    s->fd = qemu_open(filename, O_RDONLY | O_BINARY);
+    if (s->fd < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not open '%s'", filename);
+        goto out;
+    }
+    if (fstat(s->fd, &st) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not stat '%s'", filename);
+        goto fail;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        ret = -EINVAL;
+        error_setg(errp, "'%s' is not a regular file", filename);
+        goto fail;
+    }
+
+    s->size = st.st_size;
+    s->base = NULL;
+    if (s->size > 0) {
+        if (s->size != (size_t)s->size) {
+            ret = -EFBIG;
+            error_setg(errp, "'%s' is too large to map", filename);
+            goto fail;
+        }
+        s->base = mmap(NULL, s->size, PROT_READ, MAP_SHARED, s->fd, 0);
+        if (s->base == MAP_FAILED) {
+            ret = -errno;
+            s->base = NULL;
+            error_setg_errno(errp, errno, "Could not map '%s'", filename);
+            goto fail;
+        }
+        /* Start reading it in now rather than one fault at a time */
+        madvise(s->base, s->size, MADV_WILLNEED);
+    }
+    ret = 0;
+    goto out;
+
+fail:
+    qemu_close(s->fd);
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static int mmap_reopen_prepare(BDRVReopenState *state,
+                               BlockReopenQueue *queue, Error **errp)
+{
+    if (state->flags & BDRV_O_RDWR) {
+        error_setg(errp, "mmap images can only be opened read-only");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static void mmap_close(BlockDriverState *bs)
+{
+    BDRVMmapState *s = bs->opaque;
+
+    if (s->base) {
+        munmap(s->base, s->size);
+    }
+    qemu_close(s->fd);
+}
+
+static int64_t mmap_getlength(BlockDriverState *bs)
+{
+    BDRVMmapState *s = bs->opaque;
+
+    return s->size;
+}
+
+static int64_t mmap_get_allocated_file_size(BlockDriverState *bs)
+{
+    BDRVMmapState *s = bs->opaque;
+    struct stat st;
+
+    if (fstat(s->fd, &st) < 0) {
+        return -errno;
+    }
+    return (int64_t)st.st_blocks * 512;
+}
+
+static coroutine_fn int mmap_co_readv(BlockDriverState *bs,
+                                      int64_t sector_num, int nb_sectors,
+                                      QEMUIOVector *qiov)
+{
+    BDRVMmapState *s = bs->opaque;
+    int64_t offset = sector_num * BDRV_SECTOR_SIZE;
+    size_t bytes = (size_t)nb_sectors * BDRV_SECTOR_SIZE;
+    size_t copied = 0;
+
+    /* Like a short read, whatever lies past the end reads as zeroes */
+    if (offset < s->size) {
+        copied = MIN(bytes, s->size - offset);
+        qemu_iovec_from_buf(qiov, 0, s->base + offset, copied);
+    }
+    if (copied < bytes) {
+        qemu_iovec_memset(qiov, copied, 0, bytes - copied);
+    }
+    return 0;
+}
+
+static coroutine_fn int mmap_co_writev(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors,
+                                       QEMUIOVector *qiov)
+{
+    return -EPERM;
+}
+
+static int64_t coroutine_fn mmap_co_get_block_status(BlockDriverState *bs,
+                                                     int64_t sector_num,
+                                                     int nb_sectors, int *pnum)
+{
+    *pnum = nb_sectors;
+    return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID |
+           (sector_num << BDRV_SECTOR_BITS);
+}
+
+static BlockDriver bdrv_mmap = {
+    .format_name            = "mmap",
+    .protocol_name          = "mmap",
+    .instance_size          = sizeof(BDRVMmapState),
+
+    .bdrv_parse_filename    = mmap_parse_filename,
+    .bdrv_file_open         = mmap_file_open,
+    .bdrv_reopen_prepare    = mmap_reopen_prepare,
+    .bdrv_close             = mmap_close,
+    .bdrv_getlength         = mmap_getlength,
+    .bdrv_get_allocated_file_size
+                            = mmap_get_allocated_file_size,
+
+    .bdrv_co_readv          = mmap_co_readv,
+    .bdrv_co_writev         = mmap_co_writev,
+    .bdrv_co_get_block_status = mmap_co_get_block_status,
+};
+
+static void bdrv_mmap_init(void)
+{
+    bdrv_register(&bdrv_mmap);
+}
+
+block_init(bdrv_mmap_init);
@@ -0,0 +1,329 @@
+/*
+ * Boot-time prefetch of block devices
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "trace.h"
+#include "block/block_int.h"
+#include "block/blockjob.h"
+#include "qemu/error-report.h"
+#include "qapi/qmp/qerror.h"
+#include "qemu/timer.h"
+#include "sysemu/boot-timeline.h"
+
+/*
+ * The read map of a device lists the ranges the guest read while it was
+ * booting, as a header line and one "<sector> <count>" line per range.
+ * Ranges are rounded to 64k.
+ */
+#define PREFETCH_MAP_HEADER     "qemu-read-map 1"
+#define PREFETCH_GRANULARITY    7       /* log2 of the sectors per bit */
+
+/* Reads in flight, and the size of each */
+#define PREFETCH_WORKERS        8
+#define PREFETCH_CHUNK_SECTORS  1024
+
+/* Booted is when the guest says so, or after that long */
+#define PREFETCH_BOOT_MARK      "guest:sys.boot_completed"
+#define PREFETCH_RECORD_MAX_S   300
+
+typedef struct PrefetchExtent {
+    int64_t sector_num;
+    int64_t nb_sectors;
+} PrefetchExtent;
+
+typedef struct PrefetchBlockJob PrefetchBlockJob;
+
+typedef struct PrefetchWorker {
+    PrefetchBlockJob *job;
+    int64_t sector_num;
+    int nb_sectors;
+    void *buf;
+} PrefetchWorker;
+
+struct PrefetchBlockJob {
+    BlockJob common;
+    GArray *extents;
+    PrefetchWorker workers[PREFETCH_WORKERS];
+    int in_flight;
+    bool waiting;
+    int ret;
+};
+
+typedef struct PrefetchRecord {
+    BlockDriverState *bs;
+    char *map;
+    Notifier close_notifier;
+    QLIST_ENTRY(PrefetchRecord) next;
+} PrefetchRecord;
+
+static QLIST_HEAD(, PrefetchRecord) prefetch_records =
+    QLIST_HEAD_INITIALIZER(prefetch_records);
+static QEMUTimer *prefetch_boot_timer;
+static int prefetch_boot_ticks;
+
+static GArray *prefetch_map_load(const char *map, int64_t total_sectors)
+{
+    GArray *extents;
+    const char *p;
+    char *contents;
+
+    if (!g_file_get_contents(map, &contents, NULL, NULL)) {
+        return NULL;
+    }
+    if (!strstart(contents, PREFETCH_MAP_HEADER "\n", &p)) {
+        error_report("warning: ignoring read map '%s' of another format",
+                     map);
+        g_free(contents);
+        return NULL;
+    }
+
+    extents = g_array_new(false, false, sizeof(PrefetchExtent));
+    while (*p) {
+        PrefetchExtent e;
+        char *end;
+
+        e.sector_num = strtoll(p, &end, 10);
+        e.nb_sectors = strtoll(end, &end, 10);
+        if (*end != '\n' || e.sector_num < 0 || e.nb_sectors <= 0) {
+            break;
+        }
+        p = end + 1;
+        /* The image may have shrunk since */
+        if (e.sector_num < total_sectors) {
+            e.nb_sectors = MIN(e.nb_sectors, total_sectors - e.sector_num);
+            g_array_append_val(extents, e);
+        }
+    }
+    g_free(contents);
+    return extents;
+}
+
+static void prefetch_map_save(BlockDriverState *bs, const char *map)
+{
+    GString *out = g_string_new(PREFETCH_MAP_HEADER "\n");
+    uint64_t granule = 1ULL << PREFETCH_GRANULARITY;
+    int64_t start = -1, end = -1;
+    HBitmapIter hbi;
+    int64_t sector;
+    char *tmp;
+
+    hbitmap_iter_init(&hbi, bs->read_map, 0);
+    while ((sector = hbitmap_iter_next(&hbi)) >= 0) {
+        if (sector != end) {
+            if (start >= 0) {
+                g_string_append_printf(out, "%" PRId64 " %" PRId64 "\n",
+                                       start, end - start);
+            }
+            start = sector;
+        }
+        end = MIN(sector + granule, bs->total_sectors);
+    }
+    if (start >= 0) {
+        g_string_append_printf(out, "%" PRId64 " %" PRId64 "\n",
+                               start, end - start);
+    }
+
+    tmp = g_strdup_printf("%s.tmp", map);
+    if (!g_file_set_contents(tmp, out->str, out->len, NULL) ||
+        rename(tmp, map) < 0) {
+        error_report("warning: could not write read map '%s'", map);
+        unlink(tmp);
+    }
+    g_free(tmp);
+    g_string_free(out, true);
+}
+
+static void prefetch_record_stop(PrefetchRecord *rec)
+{
+    prefetch_map_save(rec->bs, rec->map);
+    hbitmap_free(rec->bs->read_map);
+    rec->bs->read_map = NULL;
+
+    notifier_remove(&rec->close_notifier);
+    QLIST_REMOVE(rec, next);
+    g_free(rec->map);
+    g_free(rec);
+}
+
+static void prefetch_record_closed(Notifier *notifier, void *data)
+{
+    prefetch_record_stop(container_of(notifier, PrefetchRecord,
+                                      close_notifier));
+}
+
+static void prefetch_boot_tick(void *opaque)
+{
+    if (++prefetch_boot_ticks < PREFETCH_RECORD_MAX_S &&
+        !boot_timeline_has(PREFETCH_BOOT_MARK)) {
+        timer_mod(prefetch_boot_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + 1000);
+        return;
+    }
+    while (!QLIST_EMPTY(&prefetch_records)) {
+        prefetch_record_stop(QLIST_FIRST(&prefetch_records));
+    }
+}
+
+static void prefetch_record_start(BlockDriverState *bs, const char *map)
+{
+    PrefetchRecord *rec = g_new0(PrefetchRecord, 1);
+
+    rec->bs = bs;
+    rec->map = g_strdup(map);
+    rec->close_notifier.notify = prefetch_record_closed;
+    bdrv_add_close_notifier(bs, &rec->close_notifier);
+    QLIST_INSERT_HEAD(&prefetch_records, rec, next);
+    bs->read_map = hbitmap_alloc(bs->total_sectors, PREFETCH_GRANULARITY);
+
+    if (!prefetch_boot_timer) {
+        prefetch_boot_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                           prefetch_boot_tick, NULL);
+    }
+    if (!timer_pending(prefetch_boot_timer)) {
+        timer_mod(prefetch_boot_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + 1000);
+    }
+}
+
+static void coroutine_fn prefetch_worker(void *opaque)
+{
+    PrefetchWorker *w = opaque;
+    PrefetchBlockJob *s = w->job;
+    struct iovec iov = {
+        .iov_base = w->buf,
+        .iov_len  = w->nb_sectors * BDRV_SECTOR_SIZE,
+    };
+    QEMUIOVector qiov;
+    int ret;
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    ret = bdrv_co_prefetch_readv(s->common.bs, w->sector_num, w->nb_sectors,
+                                 &qiov);
+    if (ret < 0 && !s->ret) {
+        s->ret = ret;
+    }
+    s->common.offset += iov.iov_len;
+
+    if (--s->in_flight == 0 && s->waiting) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+/*
+ * Reads go out in waves of up to PREFETCH_WORKERS, and the job sleeps with
+ * nothing in flight between waves, so that it can be paused or cancelled
+ * and bdrv_drain_all() returns.
+ */
+static void coroutine_fn prefetch_run(void *opaque)
+{
+    PrefetchBlockJob *s = opaque;
+    BlockDriverState *bs = s->common.bs;
+    int64_t sector_num = 0;
+    guint next = 0;
+    int i;
+
+    for (i = 0; i < PREFETCH_WORKERS; i++) {
+        s->workers[i].job = s;
+        s->workers[i].buf = qemu_blockalign(bs, PREFETCH_CHUNK_SECTORS *
+                                                BDRV_SECTOR_SIZE);
+    }
+
+    while (next < s->extents->len && !s->ret) {
+        block_job_sleep_ns(&s->common, QEMU_CLOCK_REALTIME, 0);
+        if (block_job_is_cancelled(&s->common)) {
+            break;
+        }
+
+        for (i = 0; i < PREFETCH_WORKERS && next < s->extents->len; i++) {
+            PrefetchExtent *e = &g_array_index(s->extents, PrefetchExtent,
+                                               next);
+            PrefetchWorker *w = &s->workers[i];
+
+            if (sector_num < e->sector_num) {
+                sector_num = e->sector_num;
+            }
+            w->sector_num = sector_num;
+            w->nb_sectors = MIN(PREFETCH_CHUNK_SECTORS,
+                                e->sector_num + e->nb_sectors - sector_num);
+            sector_num += w->nb_sectors;
+            if (sector_num >= e->sector_num + e->nb_sectors) {
+                next++;
+            }
+
+            s->in_flight++;
+            qemu_coroutine_enter(qemu_coroutine_create(prefetch_worker), w);
+        }
+
+        while (s->in_flight) {
+            s->waiting = true;
+            qemu_coroutine_yield();
+            s->waiting = false;
+        }
+    }
+
+    for (i = 0; i < PREFETCH_WORKERS; i++) {
+        qemu_vfree(s->workers[i].buf);
+    }
+    g_array_free(s->extents, true);
+    block_job_completed(&s->common, s->ret);
+}
+
+static const BlockJobDriver prefetch_job_driver = {
+    .instance_size = sizeof(PrefetchBlockJob),
+    .job_type      = BLOCK_JOB_TYPE_PREFETCH,
+};
+
+static void prefetch_job_done(void *opaque, int ret)
+{
+    BlockDriverState *bs = opaque;
+
+    if (ret < 0) {
+        error_report("warning: prefetch of '%s' stopped: %s",
+                     bdrv_get_device_name(bs), strerror(-ret));
+    }
+}
+
+void prefetch_start(BlockDriverState *bs, const char *map, Error **errp)
+{
+    PrefetchBlockJob *s;
+    GArray *extents;
+    guint i;
+
+    if (!bs->drv) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, bdrv_get_device_name(bs));
+        return;
+    }
+    if (bs->read_map) {
+        error_setg(errp, "Device '%s' already records its reads",
+                   bdrv_get_device_name(bs));
+        return;
+    }
+
+    extents = prefetch_map_load(map, bs->total_sectors);
+    if (extents && extents->len) {
+        s = block_job_create(&prefetch_job_driver, bs, 0, prefetch_job_done,
+                             bs, errp);
+        if (!s) {
+            g_array_free(extents, true);
+            return;
+        }
+        s->extents = extents;
+        for (i = 0; i < extents->len; i++) {
+            s->common.len += g_array_index(extents, PrefetchExtent,
+                                           i).nb_sectors * BDRV_SECTOR_SIZE;
+        }
+        trace_prefetch_start(bs, s, extents->len, s->common.len);
+        s->common.co = qemu_coroutine_create(prefetch_run);
+        qemu_coroutine_enter(s->common.co, s);
+    } else if (extents) {
+        g_array_free(extents, true);
+    }
+
+    prefetch_record_start(bs, map);
+}
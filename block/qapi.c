@@ -300,8 +300,32 @@ static void bdrv_query_info(BlockBackend *blk, BlockInfo **p_info,
     qapi_free_BlockInfo(info);
 }
 
-static BlockStats *bdrv_query_stats(const BlockDriverState *bs)
+static BlockLatencyHistogramInfo *
+bdrv_query_latency_histogram(const BlockLatencyHistogram *hist)
 {
+    BlockLatencyHistogramInfo *info;
+    uint64List **p_next;
+    unsigned int i;
+
+    info = g_new0(BlockLatencyHistogramInfo, 1);
+    p_next = &info->boundaries;
+    for (i = 0; i < hist->nbins - 1; i++) {
+        *p_next = g_new0(uint64List, 1);
+        (*p_next)->value = hist->boundaries[i];
+        p_next = &(*p_next)->next;
+    }
+    p_next = &info->bins;
+    for (i = 0; i < hist->nbins; i++) {
+        *p_next = g_new0(uint64List, 1);
+        (*p_next)->value = hist->bins[i];
+        p_next = &(*p_next)->next;
+    }
+    return info;
+}
+
+static BlockStats *bdrv_query_stats(BlockDriverState *bs)
+{
+    BlockLatencyHistogram *latency = bs->stats.latency;
     BlockStats *s;
 
     s = g_malloc0(sizeof(*s));
@@ -322,6 +346,27 @@ static BlockStats *bdrv_query_stats(const BlockDriverState *bs)
     s->stats->wr_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_WRITE];
     s->stats->rd_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_READ];
     s->stats->flush_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_FLUSH];
+    if (latency[BLOCK_ACCT_READ].nbins) {
+        s->stats->has_rd_latency_histogram = true;
+        s->stats->rd_latency_histogram =
+            bdrv_query_latency_histogram(&latency[BLOCK_ACCT_READ]);
+    }
+    if (latency[BLOCK_ACCT_WRITE].nbins) {
+        s->stats->has_wr_latency_histogram = true;
+        s->stats->wr_latency_histogram =
+            bdrv_query_latency_histogram(&latency[BLOCK_ACCT_WRITE]);
+    }
+    if (latency[BLOCK_ACCT_FLUSH].nbins) {
+        s->stats->has_flush_latency_histogram = true;
+        s->stats->flush_latency_histogram =
+            bdrv_query_latency_histogram(&latency[BLOCK_ACCT_FLUSH]);
+    }
+    s->stats->queue_depth = bs->stats.queue_depth;
+    s->stats->max_queue_depth = bs->stats.max_queue_depth;
+    s->stats->queue_depth_total_ns = block_acct_queue_depth_ns(&bs->stats);
+    s->stats->wr_merged = bs->stats.merged[BLOCK_ACCT_WRITE];
+    s->stats->flush_coalesced = bs->stats.flush_coalesced;
+    s->stats->throttled_total_time_ns = bs->stats.throttled_ns;
 
     if (bs->file) {
         s->has_parent = true;
@@ -901,15 +901,23 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
             goto fail;
         }
     } else {
+        /* qemu-img convert may have several clusters in flight */
+        bool in_co = qemu_in_coroutine();
+
+        if (in_co) {
+            qemu_co_mutex_lock(&s->lock);
+        }
         cluster_offset = get_cluster_offset(bs, sector_num << 9, 2,
                                             out_len, 0, 0);
         if (cluster_offset == 0) {
             ret = -EIO;
-            goto fail;
+        } else {
+            cluster_offset &= s->cluster_offset_mask;
+            ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+        }
+        if (in_co) {
+            qemu_co_mutex_unlock(&s->lock);
         }
-
-        cluster_offset &= s->cluster_offset_mask;
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
         if (ret < 0) {
             goto fail;
         }
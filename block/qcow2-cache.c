@@ -27,21 +27,86 @@
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Tables are found through a hash of their offset and replaced in CLOCK
+ * order: a hand sweeps over the entries, giving those used since it last
+ * passed one more round and taking the first that wasn't.
+ */
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
+    bool    referenced;
     int     ref;
+    int     hash_next;      /* next entry in the same bucket, or -1 */
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
     struct Qcow2Cache*      depends;
     int                     size;
+    int                     table_size;
     bool                    depends_on_flush;
+    void*                   table_array;
+    int*                    buckets;
+    int                     bucket_mask;
+    int                     clock_hand;
+    uint64_t                hits;
+    uint64_t                misses;
+    uint64_t                prefetches;
 };
 
+static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int i)
+{
+    return (uint8_t *)c->table_array + (size_t)i * c->table_size;
+}
+
+static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t offset = (uint8_t *)table - (uint8_t *)c->table_array;
+    int i = offset / c->table_size;
+
+    assert(i >= 0 && i < c->size && offset % c->table_size == 0);
+    return i;
+}
+
+static inline int *qcow2_cache_bucket(Qcow2Cache *c, uint64_t offset)
+{
+    return &c->buckets[(offset / c->table_size) & c->bucket_mask];
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = *qcow2_cache_bucket(c, offset); i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Set the offset of entry @i, 0 meaning it holds no table */
+static void qcow2_cache_set_offset(Qcow2Cache *c, int i, uint64_t offset)
+{
+    int *p;
+
+    if (c->entries[i].offset) {
+        for (p = qcow2_cache_bucket(c, c->entries[i].offset); *p != i;
+             p = &c->entries[*p].hash_next) {
+            assert(*p >= 0);
+        }
+        *p = c->entries[i].hash_next;
+    }
+    c->entries[i].offset = offset;
+    if (offset) {
+        p = qcow2_cache_bucket(c, offset);
+        c->entries[i].hash_next = *p;
+        *p = i;
+    }
+}
+
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 {
     BDRVQcowState *s = bs->opaque;
@@ -50,29 +115,24 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
+    c->table_size = s->cluster_size;
+    c->bucket_mask = pow2floor(num_tables) - 1;
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
-    if (!c->entries) {
-        goto fail;
+    c->buckets = g_try_new(int, c->bucket_mask + 1);
+    c->table_array = qemu_try_blockalign(bs->file,
+                                         (size_t)num_tables * c->table_size);
+    if (!c->entries || !c->buckets || !c->table_array) {
+        qemu_vfree(c->table_array);
+        g_free(c->buckets);
+        g_free(c->entries);
+        g_free(c);
+        return NULL;
     }
 
-    for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_try_blockalign(bs->file, s->cluster_size);
-        if (c->entries[i].table == NULL) {
-            goto fail;
-        }
+    for (i = 0; i <= c->bucket_mask; i++) {
+        c->buckets[i] = -1;
     }
-
     return c;
-
-fail:
-    if (c->entries) {
-        for (i = 0; i < c->size; i++) {
-            qemu_vfree(c->entries[i].table);
-        }
-    }
-    g_free(c->entries);
-    g_free(c);
-    return NULL;
 }
 
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
@@ -81,15 +141,24 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses,
+                           uint64_t *prefetches)
+{
+    *hits = c->hits;
+    *misses = c->misses;
+    *prefetches = c->prefetches;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -151,8 +220,8 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
+                      qcow2_cache_get_table_addr(c, i), s->cluster_size);
     if (ret < 0) {
         return ret;
     }
@@ -228,96 +297,139 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
         c->entries[i].offset = 0;
-        c->entries[i].cache_hits = 0;
+        c->entries[i].referenced = false;
+    }
+    for (i = 0; i <= c->bucket_mask; i++) {
+        c->buckets[i] = -1;
     }
 
     return 0;
 }
 
-static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
+/* Pick an unused entry other than @skip to hold a new table */
+static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c, int skip)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
+    int n;
 
+    /* Two rounds clear every referenced bit */
+    for (n = 0; n < 2 * c->size; n++) {
+        int i = c->clock_hand;
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
+        c->clock_hand = (i + 1) % c->size;
+        if (c->entries[i].ref || i == skip) {
             continue;
         }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
+        if (c->entries[i].referenced) {
+            c->entries[i].referenced = false;
+            continue;
         }
+        return i;
+    }
+    return -1;
+}
+
+/* Write back entry @i and drop it from the cache */
+static int qcow2_cache_evict(BlockDriverState *bs, Qcow2Cache *c, int i)
+{
+    int ret;
 
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
+    ret = qcow2_cache_entry_flush(bs, c, i);
+    if (ret < 0) {
+        return ret;
     }
+    qcow2_cache_set_offset(c, i, 0);
+    return 0;
+}
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
+/*
+ * Read the table at @offset into entry @i and, if @next is the entry
+ * meant for the table that follows it in the image file, that one too
+ * with the same request.
+ */
+static int qcow2_cache_read(BlockDriverState *bs, Qcow2Cache *c, int i,
+                            uint64_t offset, int next)
+{
+    QEMUIOVector qiov;
+    int ret;
+
+    qemu_iovec_init(&qiov, 2);
+    qemu_iovec_add(&qiov, qcow2_cache_get_table_addr(c, i), c->table_size);
+    if (next >= 0) {
+        qemu_iovec_add(&qiov, qcow2_cache_get_table_addr(c, next),
+                       c->table_size);
     }
-    return min_index;
+    ret = bdrv_preadv(bs->file, offset, &qiov);
+    qemu_iovec_destroy(&qiov);
+    return ret;
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
-    uint64_t offset, void **table, bool read_from_disk)
+    uint64_t offset, void **table, bool read_from_disk, uint64_t next_offset)
 {
     BDRVQcowState *s = bs->opaque;
-    int i;
+    int i, next = -1;
     int ret;
 
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
-        }
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        c->hits++;
+        goto found;
     }
+    c->misses++;
 
     /* If not, write a table back and replace it */
-    i = qcow2_cache_find_entry_to_replace(c);
+    i = qcow2_cache_find_entry_to_replace(c, -1);
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
     if (i < 0) {
-        return i;
+        /* This can't happen in current synchronous code, but leave the check
+         * here as a reminder for whoever starts using AIO with the cache */
+        abort();
     }
 
-    ret = qcow2_cache_entry_flush(bs, c, i);
+    ret = qcow2_cache_evict(bs, c, i);
     if (ret < 0) {
         return ret;
     }
 
+    /* A table stored right after this one comes with the same read */
+    if (read_from_disk && next_offset == offset + c->table_size &&
+        qcow2_cache_lookup(c, next_offset) < 0) {
+        next = qcow2_cache_find_entry_to_replace(c, i);
+        if (next >= 0 && qcow2_cache_evict(bs, c, next) < 0) {
+            next = -1;
+        }
+    }
+
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        ret = qcow2_cache_read(bs, c, i, offset, next);
         if (ret < 0) {
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
-    c->entries[i].offset = offset;
+    qcow2_cache_set_offset(c, i, offset);
+    if (next >= 0) {
+        /* Not referenced, so the hand takes it back soon if unused */
+        qcow2_cache_set_offset(c, next, next_offset);
+        c->prefetches++;
+    }
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
+    c->entries[i].referenced = true;
     c->entries[i].ref++;
-    *table = c->entries[i].table;
+    *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
@@ -328,27 +440,25 @@ found:
 int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table)
 {
-    return qcow2_cache_do_get(bs, c, offset, table, true);
+    return qcow2_cache_do_get(bs, c, offset, table, true, 0);
+}
+
+int qcow2_cache_get_prefetch(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset, uint64_t next_offset, void **table)
+{
+    return qcow2_cache_do_get(bs, c, offset, table, true, next_offset);
 }
 
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table)
 {
-    return qcow2_cache_do_get(bs, c, offset, table, false);
+    return qcow2_cache_do_get(bs, c, offset, table, false, 0);
 }
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, *table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
-    }
-    return -ENOENT;
-
-found:
     c->entries[i].ref--;
     *table = NULL;
 
@@ -358,15 +468,8 @@ found:
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
-    }
-    abort();
-
-found:
+    assert(c->entries[i].offset != 0);
     c->entries[i].dirty = true;
 }
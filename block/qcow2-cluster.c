@@ -139,19 +139,27 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
  * l2_load
  *
  * Loads a L2 table into memory. If the table is in the cache, the cache
- * is used; otherwise the L2 table is loaded from the image file.
+ * is used; otherwise the L2 table is loaded from the image file. When the
+ * tables are walked in L1 order, the next one is read along with it.
  *
  * Returns a pointer to the L2 table on success, or NULL if the read from
  * the image file failed.
  */
 
-static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
-    uint64_t **l2_table)
+static int l2_load(BlockDriverState *bs, uint64_t l1_index,
+    uint64_t l2_offset, uint64_t **l2_table)
 {
     BDRVQcowState *s = bs->opaque;
+    uint64_t next_offset = 0;
     int ret;
 
-    ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset, (void**) l2_table);
+    if (l1_index == s->last_l1_index + 1 && l1_index + 1 < s->l1_size) {
+        next_offset = s->l1_table[l1_index + 1] & L1E_OFFSET_MASK;
+    }
+    s->last_l1_index = l1_index;
+
+    ret = qcow2_cache_get_prefetch(bs, s->l2_table_cache, l2_offset,
+                                   next_offset, (void**) l2_table);
 
     return ret;
 }
@@ -497,7 +505,7 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     /* load the l2 table in memory */
 
-    ret = l2_load(bs, l2_offset, &l2_table);
+    ret = l2_load(bs, l1_index, l2_offset, &l2_table);
     if (ret < 0) {
         return ret;
     }
@@ -611,7 +619,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
     if (s->l1_table[l1_index] & QCOW_OFLAG_COPIED) {
         /* load the l2 table in memory */
-        ret = l2_load(bs, l2_offset, &l2_table);
+        ret = l2_load(bs, l1_index, l2_offset, &l2_table);
         if (ret < 0) {
             return ret;
         }
@@ -1048,29 +1056,19 @@ out:
 static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     uint64_t *host_offset, unsigned int *nb_clusters)
 {
-    BDRVQcowState *s = bs->opaque;
+    int64_t cluster_offset;
 
     trace_qcow2_do_alloc_clusters_offset(qemu_coroutine_self(), guest_offset,
                                          *host_offset, *nb_clusters);
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
-    if (*host_offset == 0) {
-        int64_t cluster_offset =
-            qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
-        if (cluster_offset < 0) {
-            return cluster_offset;
-        }
-        *host_offset = cluster_offset;
-        return 0;
-    } else {
-        int ret = qcow2_alloc_clusters_at(bs, *host_offset, *nb_clusters);
-        if (ret < 0) {
-            return ret;
-        }
-        *nb_clusters = ret;
-        return 0;
+    cluster_offset = qcow2_alloc_data_clusters(bs, *host_offset, nb_clusters);
+    if (cluster_offset < 0) {
+        return cluster_offset;
     }
+    *host_offset = cluster_offset;
+    return 0;
 }
 
 /*
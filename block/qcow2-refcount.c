@@ -754,6 +754,63 @@ int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+/*
+ * Allocate up to *@nb_clusters data clusters, at @offset if it is non-zero,
+ * out of the reserved extent. A new extent is reserved when the current
+ * one is used up, with a single refcount update for all its clusters.
+ *
+ * Returns the offset of the first cluster and sets *@nb_clusters to the
+ * number allocated, which is 0 if they can't go at @offset, or -errno.
+ */
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t offset,
+                                  unsigned int *nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t extent_offset;
+    unsigned int n;
+    int ret;
+
+    if (offset && (!s->extent_clusters || offset != s->extent_offset)) {
+        /* Not the next reserved cluster, try to allocate it directly */
+        ret = qcow2_alloc_clusters_at(bs, offset, *nb_clusters);
+        if (ret < 0) {
+            return ret;
+        }
+        *nb_clusters = ret;
+        return offset;
+    }
+
+    if (!s->extent_clusters) {
+        n = MAX(*nb_clusters, QCOW2_ALLOC_EXTENT_SIZE >> s->cluster_bits);
+        extent_offset = qcow2_alloc_clusters(bs, (uint64_t)n << s->cluster_bits);
+        if (extent_offset < 0) {
+            return extent_offset;
+        }
+        s->extent_offset = extent_offset;
+        s->extent_clusters = n;
+    }
+
+    n = MIN(*nb_clusters, s->extent_clusters);
+    extent_offset = s->extent_offset;
+    s->extent_offset += (uint64_t)n << s->cluster_bits;
+    s->extent_clusters -= n;
+    *nb_clusters = n;
+    return extent_offset;
+}
+
+/* Drop the reference to the clusters left in the reserved extent */
+void qcow2_release_extent(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->extent_clusters) {
+        qcow2_free_clusters(bs, s->extent_offset,
+                            (uint64_t)s->extent_clusters << s->cluster_bits,
+                            QCOW2_DISCARD_NEVER);
+        s->extent_clusters = 0;
+    }
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -23,6 +23,7 @@
  */
 #include "qemu-common.h"
 #include "block/block_int.h"
+#include "block/thread-pool.h"
 #include "qemu/module.h"
 #include <zlib.h>
 #include "qemu/aes.h"
@@ -333,7 +334,12 @@ int qcow2_mark_consistent(BlockDriverState *bs)
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
                        BdrvCheckMode fix)
 {
-    int ret = qcow2_check_refcounts(bs, result, fix);
+    int ret;
+
+    /* Reserved clusters would look leaked */
+    qcow2_release_extent(bs);
+
+    ret = qcow2_check_refcounts(bs, result, fix);
     if (ret < 0) {
         return ret;
     }
@@ -482,7 +488,20 @@ static const char *overlap_bool_option_names[QCOW2_OL_MAX_BITNR] = {
     [QCOW2_OL_INACTIVE_L2_BITNR]    = QCOW2_OPT_OVERLAP_INACTIVE_L2,
 };
 
-static void read_cache_sizes(QemuOpts *opts, uint64_t *l2_cache_size,
+/* L2 cache size that covers the whole image, within the default bounds */
+static uint64_t default_l2_cache_size(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t virtual_size = bs->total_sectors * BDRV_SECTOR_SIZE;
+    uint64_t l2_tables = DIV_ROUND_UP(virtual_size,
+                                      (uint64_t)s->cluster_size * s->l2_size);
+
+    return MAX(DEFAULT_L2_CACHE_BYTE_SIZE,
+               MIN(l2_tables * s->cluster_size, MAX_DEFAULT_L2_CACHE_BYTE_SIZE));
+}
+
+static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
+                             uint64_t *l2_cache_size,
                              uint64_t *refcount_cache_size, Error **errp)
 {
     uint64_t combined_cache_size;
@@ -524,7 +543,7 @@ static void read_cache_sizes(QemuOpts *opts, uint64_t *l2_cache_size,
         }
     } else {
         if (!l2_cache_size_set && !refcount_cache_size_set) {
-            *l2_cache_size = DEFAULT_L2_CACHE_BYTE_SIZE;
+            *l2_cache_size = default_l2_cache_size(bs);
             *refcount_cache_size = *l2_cache_size
                                  / DEFAULT_L2_REFCOUNT_SIZE_RATIO;
         } else if (!l2_cache_size_set) {
@@ -799,7 +818,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    read_cache_sizes(opts, &l2_cache_size, &refcount_cache_size, &local_err);
+    read_cache_sizes(bs, opts, &l2_cache_size, &refcount_cache_size, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
@@ -1428,6 +1447,7 @@ static void qcow2_close(BlockDriverState *bs)
     s->l1_table = NULL;
 
     if (!(bs->open_flags & BDRV_O_INCOMING)) {
+        qcow2_release_extent(bs);
         qcow2_cache_flush(bs, s->l2_table_cache);
         qcow2_cache_flush(bs, s->refcount_block_cache);
 
@@ -2137,11 +2157,53 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
+typedef struct Qcow2CompressData {
+    uint8_t *dest;
+    const uint8_t *src;
+    int size;
+} Qcow2CompressData;
+
+/*
+ * Compresses a cluster into @dest, which has room for more than the
+ * cluster.  Returns the compressed length, or -1 if the cluster doesn't
+ * compress.
+ */
+static int qcow2_compress(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+    z_stream strm;
+    int ret, out_len;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -1;
+    }
+
+    strm.avail_in = data->size;
+    strm.next_in = (uint8_t *)data->src;
+    strm.avail_out = data->size;
+    strm.next_out = data->dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    out_len = strm.next_out - data->dest;
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END || out_len >= data->size) {
+        return -1;
+    }
+    return out_len;
+}
+
 static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
+    Qcow2CompressData data;
+    bool in_co = qemu_in_coroutine();
     int ret, out_len;
     uint8_t *out_buf;
     uint64_t cluster_offset;
@@ -2172,47 +2234,42 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    data.dest = out_buf;
+    data.src = buf;
+    data.size = s->cluster_size;
+    if (in_co) {
+        /* Callers with several clusters in flight, such as qemu-img
+         * convert, get them compressed in parallel */
+        ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
+        out_len = thread_pool_submit_co(pool, qcow2_compress, &data);
+    } else {
+        out_len = qcow2_compress(&data);
     }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (out_len < 0) {
         /* could not compress: write normal cluster */
         ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
         if (ret < 0) {
             goto fail;
         }
     } else {
+        /* Other coroutines may be allocating clusters meanwhile */
+        if (in_co) {
+            qemu_co_mutex_lock(&s->lock);
+        }
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
             sector_num << 9, out_len);
-        if (!cluster_offset) {
+        if (cluster_offset) {
+            cluster_offset &= s->cluster_offset_mask;
+            ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset,
+                                                out_len);
+        } else {
             ret = -EIO;
-            goto fail;
         }
-        cluster_offset &= s->cluster_offset_mask;
-
-        ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
+        if (in_co) {
+            qemu_co_mutex_unlock(&s->lock);
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -2385,6 +2442,8 @@ static int qcow2_make_empty(BlockDriverState *bs)
     int sector_step = INT_MAX / BDRV_SECTOR_SIZE;
     int l1_clusters, ret = 0;
 
+    qcow2_release_extent(bs);
+
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / sizeof(uint64_t));
 
     if (s->qcow_version >= 3 && !s->snapshots &&
@@ -2480,6 +2539,20 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
         };
     }
 
+    if (s->l2_table_cache) {
+        uint64_t hits, misses, prefetches;
+
+        qcow2_cache_get_stats(s->l2_table_cache, &hits, &misses, &prefetches);
+        if (hits + misses) {
+            spec_info->qcow2->l2_cache_hits           = hits;
+            spec_info->qcow2->has_l2_cache_hits       = true;
+            spec_info->qcow2->l2_cache_misses         = misses;
+            spec_info->qcow2->has_l2_cache_misses     = true;
+            spec_info->qcow2->l2_cache_prefetches     = prefetches;
+            spec_info->qcow2->has_l2_cache_prefetches = true;
+        }
+    }
+
     return spec_info;
 }
 
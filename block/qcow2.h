@@ -69,6 +69,14 @@
 
 #define DEFAULT_L2_CACHE_BYTE_SIZE 1048576 /* bytes */
 
+/* Unless set explicitly, the L2 cache grows up to this size to cover the
+ * whole image */
+#define MAX_DEFAULT_L2_CACHE_BYTE_SIZE (32 * 1048576) /* bytes */
+
+/* Data clusters are reserved in extents of this size, so that allocating
+ * writes only update the refcounts once per extent */
+#define QCOW2_ALLOC_EXTENT_SIZE (2 * 1048576) /* bytes */
+
 /* The refblock cache needs only a fourth of the L2 cache size to cover as many
  * clusters */
 #define DEFAULT_L2_REFCOUNT_SIZE_RATIO 4
@@ -231,6 +239,7 @@ typedef struct BDRVQcowState {
 
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
+    uint64_t last_l1_index;     /* of the last L2 table loaded */
 
     uint8_t *cluster_cache;
     uint8_t *cluster_data;
@@ -243,6 +252,10 @@ typedef struct BDRVQcowState {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /* Clusters with a refcount already taken, not yet handed out */
+    uint64_t extent_offset;
+    unsigned int extent_clusters;
+
     CoMutex lock;
 
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
@@ -496,6 +509,9 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size);
 int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     int nb_clusters);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t offset,
+                                  unsigned int *nb_clusters);
+void qcow2_release_extent(BlockDriverState *bs);
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
                           enum qcow2_discard_type type);
@@ -561,6 +577,8 @@ int qcow2_read_snapshots(BlockDriverState *bs);
 /* qcow2-cache.c functions */
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses,
+                           uint64_t *prefetches);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
@@ -572,6 +590,8 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c);
 
 int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
+int qcow2_cache_get_prefetch(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset, uint64_t next_offset, void **table);
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
@@ -172,6 +172,18 @@ int bdrv_snapshot_create(BlockDriverState *bs,
     return -ENOTSUP;
 }
 
+/* The whole device changed behind the back of its dirty bitmaps */
+static void bdrv_snapshot_set_dirty(BlockDriverState *bs)
+{
+    int64_t sector_num;
+
+    for (sector_num = 0; sector_num < bs->total_sectors;
+         sector_num += INT_MAX) {
+        bdrv_set_dirty(bs, sector_num,
+                       MIN(bs->total_sectors - sector_num, INT_MAX));
+    }
+}
+
 int bdrv_snapshot_goto(BlockDriverState *bs,
                        const char *snapshot_id)
 {
@@ -182,7 +194,11 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
         return -ENOMEDIUM;
     }
     if (drv->bdrv_snapshot_goto) {
-        return drv->bdrv_snapshot_goto(bs, snapshot_id);
+        ret = drv->bdrv_snapshot_goto(bs, snapshot_id);
+        if (ret >= 0) {
+            bdrv_snapshot_set_dirty(bs);
+        }
+        return ret;
     }
 
     if (bs->file) {
@@ -194,6 +210,9 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
             bs->drv = NULL;
             return open_ret;
         }
+        if (ret >= 0) {
+            bdrv_snapshot_set_dirty(bs);
+        }
         return ret;
     }
 
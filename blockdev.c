@@ -351,7 +351,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     int on_read_error, on_write_error;
     BlockBackend *blk;
     BlockDriverState *bs;
-    ThrottleConfig cfg;
+    ThrottleConfig cfg, host_cfg;
     int snapshot = 0;
     bool copy_on_read;
     int ret;
@@ -360,6 +360,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     const char *id;
     bool has_driver_specific_opts;
     BlockdevDetectZeroesOptions detect_zeroes;
+    uint64_t flush_interval;
     BlockDriver *drv = NULL;
 
     /* Check common options by copying from bs_opts to opts, all other options
@@ -404,6 +405,11 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     if (qemu_opt_get_bool(opts, "cache.no-flush", false)) {
         bdrv_flags |= BDRV_O_NO_FLUSH;
     }
+    if (qemu_opt_get_bool(opts, "cache.coalesce-flush", false)) {
+        bdrv_flags |= BDRV_O_COALESCE_FLUSH;
+    }
+    flush_interval = qemu_opt_get_number(opts, "cache.flush-interval",
+                                         BDRV_DEFAULT_FLUSH_INTERVAL_MS);
 
 #ifdef CONFIG_LINUX_AIO
     if ((buf = qemu_opt_get(opts, "aio")) != NULL) {
@@ -468,6 +474,28 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         goto early_err;
     }
 
+    /* I/O limits shared with the other processes using the host device */
+    memset(&host_cfg, 0, sizeof(host_cfg));
+    host_cfg.buckets[THROTTLE_BPS_TOTAL].avg =
+        qemu_opt_get_number(opts, "throttling.host-bps-total", 0);
+    host_cfg.buckets[THROTTLE_OPS_TOTAL].avg =
+        qemu_opt_get_number(opts, "throttling.host-iops-total", 0);
+    host_cfg.buckets[THROTTLE_BPS_TOTAL].max =
+        qemu_opt_get_number(opts, "throttling.host-bps-total-max", 0);
+    host_cfg.buckets[THROTTLE_OPS_TOTAL].max =
+        qemu_opt_get_number(opts, "throttling.host-iops-total-max", 0);
+    host_cfg.op_size = cfg.op_size;
+
+    if (!check_throttle_config(&host_cfg, &error)) {
+        error_propagate(errp, error);
+        goto early_err;
+    }
+    if (throttle_enabled(&cfg) && throttle_enabled(&host_cfg)) {
+        error_setg(errp, "host-wide and per-drive I/O limits can't be used "
+                   "at the same time");
+        goto early_err;
+    }
+
     on_write_error = BLOCKDEV_ON_ERROR_ENOSPC;
     if ((buf = qemu_opt_get(opts, "werror")) != NULL) {
         on_write_error = parse_block_error_action(buf, 0, &error);
@@ -513,6 +541,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     bs->open_flags = snapshot ? BDRV_O_SNAPSHOT : 0;
     bs->read_only = ro;
     bs->detect_zeroes = detect_zeroes;
+    bs->flush_interval_ns = flush_interval * SCALE_MS;
 
     bdrv_set_on_error(bs, on_read_error, on_write_error);
 
@@ -558,6 +587,14 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         goto err;
     }
 
+    if (throttle_enabled(&host_cfg)) {
+        host_throttle_join(bs, &host_cfg, &error);
+        if (error) {
+            error_propagate(errp, error);
+            goto err;
+        }
+    }
+
     if (bdrv_key_required(bs)) {
         autostart = 0;
     }
@@ -756,6 +793,10 @@ DriveInfo *drive_new(QemuOpts *all_opts, BlockInterfaceType block_default_type)
             qemu_opt_set_bool(all_opts, "cache.no-flush",
                               !!(flags & BDRV_O_NO_FLUSH));
         }
+        if (!qemu_opt_get(all_opts, "cache.coalesce-flush")) {
+            qemu_opt_set_bool(all_opts, "cache.coalesce-flush",
+                              !!(flags & BDRV_O_COALESCE_FLUSH));
+        }
         qemu_opt_unset(all_opts, "cache");
     }
 
@@ -1793,6 +1834,10 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
     if (!check_throttle_config(&cfg, errp)) {
         return;
     }
+    if (bs->host_throttle) {
+        error_setg(errp, "Device '%s' has host-wide I/O limits", device);
+        return;
+    }
 
     aio_context = bdrv_get_aio_context(bs);
     aio_context_acquire(aio_context);
@@ -1927,6 +1972,110 @@ out:
     aio_context_release(aio_context);
 }
 
+void qmp_block_reset(const char *device, Error **errp)
+{
+    BlockDriverState *bs;
+    AioContext *aio_context;
+    int ret;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (runstate_is_running()) {
+        error_setg(errp, "The VM must be stopped to reset '%s'", device);
+        return;
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
+    if (bdrv_op_is_blocked(bs, BLOCK_OP_TYPE_CHANGE, errp)) {
+        goto out;
+    }
+
+    ret = bdrv_reset(bs);
+    switch (ret) {
+    case 0:
+        break;
+    case -ENOMEDIUM:
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        break;
+    case -EACCES:
+        error_set(errp, QERR_DEVICE_IS_READ_ONLY, device);
+        break;
+    default:
+        error_setg_errno(errp, -ret, "Could not reset '%s'", device);
+        break;
+    }
+
+out:
+    aio_context_release(aio_context);
+}
+
+static int block_latency_histogram_set_list(BlockAcctStats *stats,
+                                            enum BlockAcctType type,
+                                            uint64List *list)
+{
+    uint64_t boundaries[BLOCK_LATENCY_MAX_BINS];
+    unsigned int n = 0;
+
+    for (; list; list = list->next) {
+        if (n == ARRAY_SIZE(boundaries)) {
+            return -E2BIG;
+        }
+        boundaries[n++] = list->value;
+    }
+    return block_latency_histogram_set(stats, type, boundaries, n);
+}
+
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     bool has_boundaries_read,
+                                     uint64List *boundaries_read,
+                                     bool has_boundaries_write,
+                                     uint64List *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     uint64List *boundaries_flush,
+                                     Error **errp)
+{
+    BlockDriverState *bs;
+    AioContext *aio_context;
+    uint64List *lists[BLOCK_MAX_IOTYPE];
+    int i, ret = 0;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    lists[BLOCK_ACCT_READ] = has_boundaries_read ? boundaries_read :
+                             has_boundaries ? boundaries : NULL;
+    lists[BLOCK_ACCT_WRITE] = has_boundaries_write ? boundaries_write :
+                              has_boundaries ? boundaries : NULL;
+    lists[BLOCK_ACCT_FLUSH] = has_boundaries_flush ? boundaries_flush :
+                              has_boundaries ? boundaries : NULL;
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+    for (i = 0; i < BLOCK_MAX_IOTYPE && !ret; i++) {
+        ret = block_latency_histogram_set_list(bdrv_get_stats(bs), i,
+                                               lists[i]);
+    }
+    aio_context_release(aio_context);
+
+    if (ret == -E2BIG) {
+        error_setg(errp, "At most %d histogram boundaries are allowed",
+                   BLOCK_LATENCY_MAX_BINS - 1);
+    } else if (ret < 0) {
+        error_setg(errp, "Histogram boundaries must be in increasing order");
+    }
+}
+
 static void block_job_cb(void *opaque, int ret)
 {
     /* Note that this function may be executed from another AioContext besides
@@ -2176,6 +2325,12 @@ void qmp_drive_backup(const char *device, const char *target,
         goto out;
     }
 
+    if (sync == MIRROR_SYNC_MODE_INCREMENTAL &&
+        mode != NEW_IMAGE_MODE_EXISTING) {
+        error_setg(errp, "Incremental backups go into an existing image");
+        goto out;
+    }
+
     flags = bs->open_flags | BDRV_O_RDWR;
 
     /* See if we have a backing HD we can use to create our new image
@@ -2322,6 +2477,12 @@ void qmp_drive_mirror(const char *device, const char *target,
         goto out;
     }
 
+    if (sync == MIRROR_SYNC_MODE_INCREMENTAL) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "sync",
+                  "'top', 'full' or 'none'");
+        goto out;
+    }
+
     flags = bs->open_flags | BDRV_O_RDWR;
     source = bs->backing_hd;
     if (!source && sync == MIRROR_SYNC_MODE_TOP) {
@@ -2725,6 +2886,16 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "cache.no-flush",
             .type = QEMU_OPT_BOOL,
             .help = "ignore any flush requests for the device",
+        },{
+            .name = "cache.coalesce-flush",
+            .type = QEMU_OPT_BOOL,
+            .help = "let flush requests skip the disk, at most one per "
+                    "flush interval reaches it",
+        },{
+            .name = "cache.flush-interval",
+            .type = QEMU_OPT_NUMBER,
+            .help = "milliseconds between flushes reaching the disk, "
+                    "with cache.coalesce-flush",
         },{
             .name = "aio",
             .type = QEMU_OPT_STRING,
@@ -2797,6 +2968,22 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "throttling.iops-size",
             .type = QEMU_OPT_NUMBER,
             .help = "when limiting by iops max size of an I/O in bytes",
+        },{
+            .name = "throttling.host-bps-total",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total bytes per second of the host device",
+        },{
+            .name = "throttling.host-iops-total",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total I/O operations per second of the host device",
+        },{
+            .name = "throttling.host-bps-total-max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total bytes burst of the host device",
+        },{
+            .name = "throttling.host-iops-total-max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "I/O operations burst of the host device",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
@@ -0,0 +1,168 @@
+/*
+ * Startup timeline
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qmp-commands.h"
+#include "sysemu/boot-timeline.h"
+
+/* The guest can report milestones, don't let it grow the timeline forever */
+#define BOOT_TIMELINE_MAX_MARKS 256
+
+typedef struct BootTimelineMark {
+    char name[80];
+    int64_t ns;
+} BootTimelineMark;
+
+static QemuMutex boot_timeline_lock;
+static BootTimelineMark boot_timeline_marks[BOOT_TIMELINE_MAX_MARKS];
+static unsigned boot_timeline_count;    /* protected by boot_timeline_lock */
+static int64_t boot_timeline_start_ns;
+static int64_t boot_timeline_start_realtime_ns;
+
+static void boot_timeline_write(void)
+{
+    const char *path = getenv("ANDROID_BOOT_TIMELINE");
+    GString *json;
+    char *tmp;
+    unsigned i;
+
+    if (!path || !path[0]) {
+        return;
+    }
+
+    json = g_string_new("{\n");
+    g_string_append_printf(json, "  \"start-realtime-ns\": %" PRId64 ",\n",
+                           boot_timeline_start_realtime_ns);
+    g_string_append(json, "  \"marks\": [");
+    for (i = 0; i < boot_timeline_count; i++) {
+        BootTimelineMark *mark = &boot_timeline_marks[i];
+        char *name = g_strescape(mark->name, NULL);
+
+        g_string_append_printf(json,
+                               "%s\n    { \"name\": \"%s\", "
+                               "\"time-ns\": %" PRId64 " }",
+                               i ? "," : "", name,
+                               mark->ns - boot_timeline_start_ns);
+        g_free(name);
+    }
+    g_string_append(json, "\n  ]\n}\n");
+
+    /* Readers polling the file never see it half written */
+    tmp = g_strdup_printf("%s.tmp", path);
+    if (g_file_set_contents(tmp, json->str, json->len, NULL)) {
+        if (rename(tmp, path) < 0) {
+            unlink(tmp);
+        }
+    }
+    g_free(tmp);
+    g_string_free(json, true);
+}
+
+static bool boot_timeline_seen(const char *name)
+{
+    unsigned i;
+
+    for (i = 0; i < boot_timeline_count; i++) {
+        if (!strcmp(boot_timeline_marks[i].name, name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void boot_timeline_add(const char *name, bool once)
+{
+    int64_t ns = get_clock();
+    BootTimelineMark *mark;
+
+    qemu_mutex_lock(&boot_timeline_lock);
+    if (boot_timeline_count == BOOT_TIMELINE_MAX_MARKS ||
+        (once && boot_timeline_seen(name))) {
+        qemu_mutex_unlock(&boot_timeline_lock);
+        return;
+    }
+    if (!boot_timeline_count) {
+        boot_timeline_start_ns = ns;
+        boot_timeline_start_realtime_ns = get_clock_realtime();
+    }
+    mark = &boot_timeline_marks[boot_timeline_count++];
+    pstrcpy(mark->name, sizeof(mark->name), name);
+    mark->ns = ns;
+    boot_timeline_write();
+    qemu_mutex_unlock(&boot_timeline_lock);
+}
+
+void boot_timeline_mark(const char *name)
+{
+    boot_timeline_add(name, false);
+}
+
+void boot_timeline_mark_once(const char *name)
+{
+    boot_timeline_add(name, true);
+}
+
+bool boot_timeline_has(const char *name)
+{
+    bool seen;
+
+    qemu_mutex_lock(&boot_timeline_lock);
+    seen = boot_timeline_seen(name);
+    qemu_mutex_unlock(&boot_timeline_lock);
+    return seen;
+}
+
+static bool boot_timeline_is_guest(const char *name)
+{
+    return !strcmp(name, "guest-start") || strstart(name, "guest:", NULL);
+}
+
+void boot_timeline_forget_guest(void)
+{
+    unsigned i, n = 0;
+
+    qemu_mutex_lock(&boot_timeline_lock);
+    for (i = 0; i < boot_timeline_count; i++) {
+        if (!boot_timeline_is_guest(boot_timeline_marks[i].name)) {
+            boot_timeline_marks[n++] = boot_timeline_marks[i];
+        }
+    }
+    boot_timeline_count = n;
+    boot_timeline_write();
+    qemu_mutex_unlock(&boot_timeline_lock);
+}
+
+BootTimelineMarkInfoList *qmp_query_boot_timeline(Error **errp)
+{
+    BootTimelineMarkInfoList *head = NULL, **tail = &head;
+    unsigned i;
+
+    qemu_mutex_lock(&boot_timeline_lock);
+    for (i = 0; i < boot_timeline_count; i++) {
+        BootTimelineMark *mark = &boot_timeline_marks[i];
+        BootTimelineMarkInfoList *entry = g_new0(BootTimelineMarkInfoList, 1);
+
+        entry->value = g_new0(BootTimelineMarkInfo, 1);
+        entry->value->name = g_strdup(mark->name);
+        entry->value->time_ns = mark->ns - boot_timeline_start_ns;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    qemu_mutex_unlock(&boot_timeline_lock);
+
+    return head;
+}
+
+/* The Android launcher records marks before QEMU's main() runs */
+static void __attribute__((__constructor__)) boot_timeline_init(void)
+{
+    qemu_mutex_init(&boot_timeline_lock);
+}
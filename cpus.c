@@ -32,14 +32,19 @@
 #include "sysemu/dma.h"
 #include "sysemu/kvm.h"
 #include "sysemu/hax.h"
+#include "sysemu/whpx.h"
+#include "sysemu/hvf.h"
+#include "sysemu/vcpu-exits.h"
 #include "qmp-commands.h"
 
 #include "qemu/thread.h"
 #include "sysemu/cpus.h"
 #include "sysemu/qtest.h"
+#include "sysemu/thread-affinity.h"
 #include "qemu/main-loop.h"
 #include "qemu/bitmap.h"
 #include "qemu/seqlock.h"
+#include "qemu/rcu.h"
 #include "qapi-event.h"
 #include "hw/nmi.h"
 
@@ -109,6 +114,8 @@ static bool all_cpu_threads_idle(void)
 static int64_t vm_clock_warp_start = -1;
 /* Conversion factor from emulated instructions to virtual clock ticks.  */
 static int icount_time_shift;
+/* False when idle vcpus jump to the next timer instead of waiting for it */
+static bool icount_sleep = true;
 /* Arbitrarily pick 1MIPS as the minimum allowable speed.  */
 #define MAX_ICOUNT_SHIFT 10
 
@@ -409,7 +416,9 @@ void qemu_clock_warp(QEMUClockType type)
      * the earliest QEMU_CLOCK_VIRTUAL timer.
      */
     icount_warp_rt(NULL);
-    timer_del(icount_warp_timer);
+    if (icount_sleep) {
+        timer_del(icount_warp_timer);
+    }
     if (!all_cpu_threads_idle()) {
         return;
     }
@@ -426,7 +435,18 @@ void qemu_clock_warp(QEMUClockType type)
         return;
     }
 
-    if (deadline > 0) {
+    if (deadline > 0 && !icount_sleep) {
+        /*
+         * Nothing happens until the next QEMU_CLOCK_VIRTUAL timer, so skip
+         * to it instead of waiting.  Timer-heavy workloads take less real
+         * time, and what the guest sees only depends on its instructions,
+         * not on how long the host takes to run them.
+         */
+        seqlock_write_lock(&timers_state.vm_clock_seqlock);
+        timers_state.qemu_icount_bias += deadline;
+        seqlock_write_unlock(&timers_state.vm_clock_seqlock);
+        qemu_clock_notify(QEMU_CLOCK_VIRTUAL);
+    } else if (deadline > 0) {
         /*
          * Ensure QEMU_CLOCK_VIRTUAL proceeds even when the virtual CPU goes to
          * sleep.  Otherwise, the CPU might be waiting for a future timer
@@ -509,12 +529,19 @@ void configure_icount(QemuOpts *opts, Error **errp)
     if (!option) {
         if (qemu_opt_get(opts, "align") != NULL) {
             error_setg(errp, "Please specify shift option when using align");
+        } else if (qemu_opt_get(opts, "sleep") != NULL) {
+            error_setg(errp, "Please specify shift option when using sleep");
         }
         return;
     }
     icount_align_option = qemu_opt_get_bool(opts, "align", false);
-    icount_warp_timer = timer_new_ns(QEMU_CLOCK_REALTIME,
-                                          icount_warp_rt, NULL);
+    icount_sleep = qemu_opt_get_bool(opts, "sleep", true);
+    if (icount_sleep) {
+        icount_warp_timer = timer_new_ns(QEMU_CLOCK_REALTIME,
+                                         icount_warp_rt, NULL);
+    } else if (icount_align_option) {
+        error_setg(errp, "align=on and sleep=off are incompatible");
+    }
     if (strcmp(option, "auto") != 0) {
         errno = 0;
         icount_time_shift = strtol(option, &rem_str, 0);
@@ -525,6 +552,8 @@ void configure_icount(QemuOpts *opts, Error **errp)
         return;
     } else if (icount_align_option) {
         error_setg(errp, "shift=auto and align=on are incompatible");
+    } else if (!icount_sleep) {
+        error_setg(errp, "shift=auto and sleep=off are incompatible");
     }
 
     use_icount = 2;
@@ -577,6 +606,16 @@ void cpu_synchronize_all_states(void)
         if (hax_enabled() && hax_ug_platform()) {
             hax_cpu_synchronize_state(cpu);
         }
+#endif
+#ifdef CONFIG_WHPX
+        if (whpx_enabled()) {
+            whpx_cpu_synchronize_state(cpu);
+        }
+#endif
+#ifdef CONFIG_HVF
+        if (hvf_enabled()) {
+            hvf_cpu_synchronize_state(cpu);
+        }
 #endif
     }
 }
@@ -590,6 +629,16 @@ void cpu_synchronize_all_post_reset(void)
 #ifdef CONFIG_HAX
         if (hax_enabled() && hax_ug_platform())
             hax_cpu_synchronize_post_reset(cpu);
+#endif
+#ifdef CONFIG_WHPX
+        if (whpx_enabled()) {
+            whpx_cpu_synchronize_post_reset(cpu);
+        }
+#endif
+#ifdef CONFIG_HVF
+        if (hvf_enabled()) {
+            hvf_cpu_synchronize_post_reset(cpu);
+        }
 #endif
     }
 }
@@ -603,6 +652,16 @@ void cpu_synchronize_all_post_init(void)
 #ifdef CONFIG_HAX
         if (hax_enabled() && hax_ug_platform())
             hax_cpu_synchronize_post_init(cpu);
+#endif
+#ifdef CONFIG_WHPX
+        if (whpx_enabled()) {
+            whpx_cpu_synchronize_post_init(cpu);
+        }
+#endif
+#ifdef CONFIG_HVF
+        if (hvf_enabled()) {
+            hvf_cpu_synchronize_post_init(cpu);
+        }
 #endif
     }
 }
@@ -798,6 +857,8 @@ static void qemu_tcg_init_cpu_signals(void)
 #endif /* _WIN32 */
 
 static QemuMutex qemu_global_mutex;
+/* Whether this thread holds qemu_global_mutex, see prepare_mmio_access() */
+static __thread bool iothread_locked;
 static QemuCond qemu_io_proceeded_cond;
 static bool iothread_requesting_mutex;
 
@@ -806,6 +867,24 @@ static QemuThread io_thread;
 static QemuThread *tcg_cpu_thread;
 static QemuCond *tcg_halt_cond;
 
+/*
+ * The TCG vcpus share a single thread, which only moves on to the next
+ * vcpu when the current one leaves cpu_exec(). With several vcpus, a
+ * periodic timer bounds how long one of them can spin, e.g. waiting for a
+ * lock held by a vcpu that does not get to run: the timer fires in the
+ * iothread, which kicks the TCG thread out of the guest to take the
+ * iothread lock, and tcg_exec_all() then resumes with the next vcpu.
+ */
+#define TCG_KICK_PERIOD_NS      (10 * 1000 * 1000)
+
+static QEMUTimer *tcg_kick_timer;
+
+static void tcg_kick_timer_cb(void *opaque)
+{
+    timer_mod(tcg_kick_timer,
+              qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + TCG_KICK_PERIOD_NS);
+}
+
 /* cpu creation */
 static QemuCond qemu_cpu_cond;
 /* system init */
@@ -930,22 +1009,100 @@ static void qemu_tcg_wait_io_event(void)
     }
 }
 
-#ifdef CONFIG_HAX
-static void qemu_hax_wait_io_event(CPUState *cpu)
+/*
+ * A halted HAX or KVM vcpu spins for a while before sleeping on its
+ * halt_cond, to save the wake-up latency when the interrupt it waits for
+ * comes soon. As with KVM's halt_poll_ns, the window of each vcpu adapts
+ * to how long its halts last: it grows while a slightly longer window
+ * would have caught the wake-up, and shrinks when halts are much longer
+ * than the largest window, so that idle guests do not burn host CPU.
+ */
+#define HALT_POLL_NS_MAX        200000
+#define HALT_POLL_NS_START      10000
+
+/* Called after a halt of @halt_ns that polling did not catch */
+static void qemu_halt_poll_adjust(CPUState *cpu, int64_t halt_ns)
+{
+    if (halt_ns > HALT_POLL_NS_MAX) {
+        cpu->halt_poll_ns /= 2;
+        if (cpu->halt_poll_ns < HALT_POLL_NS_START) {
+            cpu->halt_poll_ns = 0;
+        }
+    } else if (cpu->halt_poll_ns < HALT_POLL_NS_MAX) {
+        cpu->halt_poll_ns = cpu->halt_poll_ns ?
+                            MIN(cpu->halt_poll_ns * 2, HALT_POLL_NS_MAX) :
+                            HALT_POLL_NS_START;
+    }
+}
+
+static void qemu_halt_wait(CPUState *cpu)
 {
+    int64_t start, poll_ns = 0;
+    bool halted, woken = false;
+
+    halted = cpu->halted && !cpu_is_stopped(cpu) && cpu_thread_is_idle(cpu);
+    start = halted ? get_clock() : 0;
+
+    if (halted && cpu->halt_poll_ns) {
+        int64_t deadline = start + cpu->halt_poll_ns;
+
+        /*
+         * Drop the lock so that the iothread can raise the interrupt.
+         * The checks done without it are only hints, the loop below
+         * decides under the lock.
+         */
+        qemu_mutex_unlock(&qemu_global_mutex);
+        do {
+            smp_rmb();
+            woken = !cpu_thread_is_idle(cpu);
+            poll_ns = get_clock() - start;
+        } while (!woken && start + poll_ns < deadline);
+        qemu_mutex_lock(&qemu_global_mutex);
+    }
+
     while (cpu_thread_is_idle(cpu)) {
         qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
     }
 
+    if (halted) {
+        int64_t halt_ns = get_clock() - start;
+
+        if (cpu->halt_poll_ns) {
+            vcpu_exit_account_halt_poll(cpu, woken, poll_ns);
+        }
+        if (!woken) {
+            qemu_halt_poll_adjust(cpu, halt_ns);
+        }
+    }
+}
+
+#ifdef CONFIG_HAX
+static void qemu_hax_wait_io_event(CPUState *cpu)
+{
+    qemu_halt_wait(cpu);
+    qemu_wait_io_event_common(cpu);
+}
+#endif
+
+#ifdef CONFIG_WHPX
+static void qemu_whpx_wait_io_event(CPUState *cpu)
+{
+    qemu_halt_wait(cpu);
+    qemu_wait_io_event_common(cpu);
+}
+#endif
+
+#ifdef CONFIG_HVF
+static void qemu_hvf_wait_io_event(CPUState *cpu)
+{
+    qemu_halt_wait(cpu);
     qemu_wait_io_event_common(cpu);
 }
 #endif
 
 static void qemu_kvm_wait_io_event(CPUState *cpu)
 {
-    while (cpu_thread_is_idle(cpu)) {
-        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
-    }
+    qemu_halt_wait(cpu);
 
     qemu_kvm_eat_signals(cpu);
     qemu_wait_io_event_common(cpu);
@@ -956,9 +1113,13 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
     CPUState *cpu = arg;
     int r;
 
+    rcu_register_thread();
+
     qemu_mutex_lock(&qemu_global_mutex);
+    iothread_locked = true;
     qemu_thread_get_self(cpu->thread);
     cpu->thread_id = qemu_get_thread_id();
+    thread_affinity_apply_vcpu();
     current_cpu = cpu;
 
     r = kvm_init_vcpu(cpu);
@@ -997,9 +1158,12 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
     sigset_t waitset;
     int r;
 
+    rcu_register_thread();
+
     qemu_mutex_lock_iothread();
     qemu_thread_get_self(cpu->thread);
     cpu->thread_id = qemu_get_thread_id();
+    thread_affinity_apply_vcpu();
 
     sigemptyset(&waitset);
     sigaddset(&waitset, SIG_IPI);
@@ -1035,14 +1199,18 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
 
+    rcu_register_thread();
+
     qemu_tcg_init_cpu_signals();
     qemu_thread_get_self(cpu->thread);
 
     qemu_mutex_lock(&qemu_global_mutex);
+    iothread_locked = true;
     CPU_FOREACH(cpu) {
         cpu->thread_id = qemu_get_thread_id();
         cpu->created = true;
     }
+    thread_affinity_apply_vcpu();
     qemu_cond_signal(&qemu_cpu_cond);
 
     /* wait for initial kick-off after machine start */
@@ -1076,10 +1244,14 @@ static void *qemu_hax_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
     int r;
+
+    rcu_register_thread();
     qemu_thread_get_self(cpu->thread);
     qemu_mutex_lock(&qemu_global_mutex);
+    iothread_locked = true;
 
     cpu->thread_id = qemu_get_thread_id();
+    thread_affinity_apply_vcpu();
     cpu->created = true;
     cpu->halted = 0;
     current_cpu = cpu;
@@ -1100,11 +1272,93 @@ static void *qemu_hax_cpu_thread_fn(void *arg)
 }
 #endif
 
+#ifdef CONFIG_WHPX
+static void *qemu_whpx_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+    int r;
+
+    rcu_register_thread();
+    qemu_thread_get_self(cpu->thread);
+    qemu_mutex_lock(&qemu_global_mutex);
+    iothread_locked = true;
+
+    cpu->thread_id = qemu_get_thread_id();
+    thread_affinity_apply_vcpu();
+    current_cpu = cpu;
+
+    r = whpx_init_vcpu(cpu);
+    if (r < 0) {
+        fprintf(stderr, "whpx_init_vcpu failed: %s\n", strerror(-r));
+        exit(1);
+    }
+
+    cpu->created = true;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(cpu)) {
+            r = whpx_vcpu_exec(cpu);
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(cpu);
+            }
+        }
+        qemu_whpx_wait_io_event(cpu);
+    }
+    return NULL;
+}
+#endif
+
+#ifdef CONFIG_HVF
+static void *qemu_hvf_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+    int r;
+
+    rcu_register_thread();
+    qemu_thread_get_self(cpu->thread);
+    qemu_mutex_lock(&qemu_global_mutex);
+    iothread_locked = true;
+
+    cpu->thread_id = qemu_get_thread_id();
+    thread_affinity_apply_vcpu();
+    current_cpu = cpu;
+
+    /* The vcpu belongs to the thread creating it, which must run it */
+    r = hvf_init_vcpu(cpu);
+    if (r < 0) {
+        fprintf(stderr, "hvf_init_vcpu failed: %s\n", strerror(-r));
+        exit(1);
+    }
+
+    cpu->created = true;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(cpu)) {
+            r = hvf_vcpu_exec(cpu);
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(cpu);
+            }
+        }
+        qemu_hvf_wait_io_event(cpu);
+    }
+    return NULL;
+}
+#endif
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
     int err;
 
+#ifdef CONFIG_HVF
+    if (hvf_enabled()) {
+        /* hv_vcpu_run() doesn't return on a signal: force the exit */
+        hvf_vcpu_kick(cpu);
+        return;
+    }
+#endif
     err = pthread_kill(cpu->thread->thread, SIG_IPI);
     if (err) {
         fprintf(stderr, "qemu:%s: %s", __func__, strerror(err));
@@ -1122,6 +1376,13 @@ static void qemu_cpu_kick_thread(CPUState *cpu)
         cpu->exit_request = 1;
 #endif
 #else /* _WIN32 */
+#ifdef CONFIG_WHPX
+    if (whpx_enabled()) {
+        /* Hyper-V runs the guest: ask it to leave, wherever the thread is */
+        whpx_vcpu_kick(cpu);
+        return;
+    }
+#endif
     if (!qemu_cpu_is_self(cpu)) {
         CONTEXT tcgContext;
 
@@ -1208,13 +1469,20 @@ void qemu_mutex_lock_iothread(void)
         iothread_requesting_mutex = false;
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    iothread_locked = true;
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    iothread_locked = false;
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
+bool qemu_mutex_iothread_locked(void)
+{
+    return iothread_locked;
+}
+
 static int all_vcpus_paused(void)
 {
     CPUState *cpu;
@@ -1305,9 +1573,15 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
             qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
         }
         tcg_cpu_thread = cpu->thread;
+        tcg_stats_init();
     } else {
         cpu->thread = tcg_cpu_thread;
         cpu->halt_cond = tcg_halt_cond;
+        if (!tcg_kick_timer && !hax_enabled()) {
+            tcg_kick_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                          tcg_kick_timer_cb, NULL);
+            tcg_kick_timer_cb(NULL);
+        }
     }
 }
 
@@ -1333,6 +1607,47 @@ static void qemu_hax_start_vcpu(CPUState *cpu)
 }
 #endif
 
+#ifdef CONFIG_WHPX
+static void qemu_whpx_start_vcpu(CPUState *cpu)
+{
+    char thread_name[VCPU_THREAD_NAME_SIZE];
+
+    cpu->thread = g_malloc0(sizeof(QemuThread));
+    cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+    qemu_cond_init(cpu->halt_cond);
+
+    snprintf(thread_name, VCPU_THREAD_NAME_SIZE, "CPU %d/WHPX",
+             cpu->cpu_index);
+    qemu_thread_create(cpu->thread, thread_name, qemu_whpx_cpu_thread_fn,
+                       cpu, QEMU_THREAD_JOINABLE);
+#ifdef _WIN32
+    cpu->hThread = qemu_thread_get_handle(cpu->thread);
+#endif
+    while (!cpu->created) {
+        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+    }
+}
+#endif
+
+#ifdef CONFIG_HVF
+static void qemu_hvf_start_vcpu(CPUState *cpu)
+{
+    char thread_name[VCPU_THREAD_NAME_SIZE];
+
+    cpu->thread = g_malloc0(sizeof(QemuThread));
+    cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+    qemu_cond_init(cpu->halt_cond);
+
+    snprintf(thread_name, VCPU_THREAD_NAME_SIZE, "CPU %d/HVF",
+             cpu->cpu_index);
+    qemu_thread_create(cpu->thread, thread_name, qemu_hvf_cpu_thread_fn,
+                       cpu, QEMU_THREAD_JOINABLE);
+    while (!cpu->created) {
+        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+    }
+}
+#endif
+
 static void qemu_kvm_start_vcpu(CPUState *cpu)
 {
     char thread_name[VCPU_THREAD_NAME_SIZE];
@@ -1375,6 +1690,14 @@ void qemu_init_vcpu(CPUState *cpu)
 #ifdef CONFIG_HAX
     } else if (hax_enabled() && hax_ug_platform()) {
         qemu_hax_start_vcpu(cpu);
+#endif
+#ifdef CONFIG_WHPX
+    } else if (whpx_enabled()) {
+        qemu_whpx_start_vcpu(cpu);
+#endif
+#ifdef CONFIG_HVF
+    } else if (hvf_enabled()) {
+        qemu_hvf_start_vcpu(cpu);
 #endif
     } else if (tcg_enabled()) {
         qemu_tcg_init_vcpu(cpu);
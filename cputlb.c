@@ -28,6 +28,7 @@
 
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
+#include "qemu/timer.h"
 #include "tcg/tcg.h"
 
 //#define DEBUG_TLB
@@ -35,6 +36,61 @@
 
 /* statistics */
 int tlb_flush_count;
+int64_t tlb_miss_count[3];
+int64_t tlb_fill_count[3];
+int64_t tlb_flush_stat_count[TLB_FLUSH_STAT_MAX];
+int64_t tlb_flush_stat_time_ns[TLB_FLUSH_STAT_MAX];
+
+QEMU_BUILD_BUG_ON(NB_MMU_MODES > 32);
+
+#define ALL_MMUIDX_BITS ((1u << NB_MMU_MODES) - 1)
+
+/* Flushes by address drop every entry of the aligned block of this size
+   around the address, so that pages up to that size need not be tracked
+   as large pages.  A target whose pages are smaller than the size its
+   guests map sets it to the latter. */
+#ifndef TARGET_TLB_FLUSH_BITS
+#define TARGET_TLB_FLUSH_BITS TARGET_PAGE_BITS
+#endif
+#define TLB_FLUSH_BLOCK_SIZE ((target_ulong)1 << TARGET_TLB_FLUSH_BITS)
+
+QEMU_BUILD_BUG_ON(TARGET_TLB_FLUSH_BITS < TARGET_PAGE_BITS);
+
+/* Past that many pages, a range flush clears the whole jump cache */
+#define TLB_FLUSH_RANGE_JMP_PAGES \
+    (TB_JMP_CACHE_SIZE / TB_JMP_PAGE_SIZE / 2)
+
+static inline void tlb_flush_stat(int reason, int64_t start)
+{
+    tlb_flush_stat_count[reason]++;
+    tlb_flush_stat_time_ns[reason] += get_clock() - start;
+}
+
+/* Flush the MMU modes in @idxmap, skipping those already clean */
+static void tlb_flush_modes(CPUState *cpu, uint32_t idxmap)
+{
+    CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
+
+    /* must reset current TB so that interrupts cannot modify the
+       links while we are modifying them */
+    cpu->current_tb = NULL;
+
+    /* With the larger TLB, most of a flush is spent clearing modes the
+       guest has not touched since the previous one, so skip those. */
+    idxmap &= ~env->tlb_clean_modes;
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (!(idxmap & (1u << mmu_idx))) {
+            continue;
+        }
+        memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
+        memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
+        env->tlb_flush_addr[mmu_idx] = -1;
+        env->tlb_flush_mask[mmu_idx] = 0;
+    }
+    env->tlb_clean_modes |= idxmap;
+    memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+}
 
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
@@ -51,74 +107,137 @@ int tlb_flush_count;
 void tlb_flush(CPUState *cpu, int flush_global)
 {
     CPUArchState *env = cpu->env_ptr;
+    int64_t start = get_clock();
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
 #endif
-    /* must reset current TB so that interrupts cannot modify the
-       links while we are modifying them */
-    cpu->current_tb = NULL;
-
-    memset(env->tlb_table, -1, sizeof(env->tlb_table));
-    memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
-    memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
-
+    tlb_flush_modes(cpu, ALL_MMUIDX_BITS);
     env->vtlb_index = 0;
-    env->tlb_flush_addr = -1;
-    env->tlb_flush_mask = 0;
     tlb_flush_count++;
+    tlb_flush_stat(TLB_FLUSH_STAT_ALL, start);
+}
+
+void tlb_flush_by_mmuidx(CPUState *cpu, uint32_t idxmap)
+{
+    int64_t start = get_clock();
+
+#if defined(DEBUG_TLB)
+    printf("tlb_flush_by_mmuidx: %" PRIx32 "\n", idxmap);
+#endif
+    tlb_flush_modes(cpu, idxmap & ALL_MMUIDX_BITS);
+    tlb_flush_stat(TLB_FLUSH_STAT_MMUIDX, start);
+}
+
+/* Whether @tlb_addr is valid and its page in [first, last] */
+static inline bool tlb_hit_range(target_ulong tlb_addr, target_ulong first,
+                                 target_ulong last)
+{
+    return !(tlb_addr & TLB_INVALID_MASK) &&
+           (tlb_addr & TARGET_PAGE_MASK) - first <= last - first;
 }
 
-static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
+static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong first,
+                                   target_ulong last)
 {
-    if (addr == (tlb_entry->addr_read &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_write &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_code &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+    if (tlb_hit_range(tlb_entry->addr_read, first, last) ||
+        tlb_hit_range(tlb_entry->addr_write, first, last) ||
+        tlb_hit_range(tlb_entry->addr_code, first, last)) {
         memset(tlb_entry, -1, sizeof(*tlb_entry));
     }
 }
 
-void tlb_flush_page(CPUState *cpu, target_ulong addr)
+/* Flush the pages from the one of @addr to the one of @last */
+static void tlb_flush_range_1(CPUState *cpu, target_ulong addr,
+                              target_ulong last, int reason)
 {
     CPUArchState *env = cpu->env_ptr;
-    int i;
-    int mmu_idx;
+    int64_t start = get_clock();
+    target_ulong npages, n, page;
+    uint32_t idxmap, large = 0;
+    int mmu_idx, k;
 
+    addr &= TARGET_PAGE_MASK;
+    last &= TARGET_PAGE_MASK;
+    /* less one, so that a range of the whole address space fits */
+    npages = (last - addr) >> TARGET_PAGE_BITS;
+
+    /* Our TLB does not support large pages, so modes where one could
+       overlap the range are flushed entirely. */
+    idxmap = ALL_MMUIDX_BITS & ~env->tlb_clean_modes;
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        target_ulong fa = env->tlb_flush_addr[mmu_idx];
+
+        if ((idxmap & (1u << mmu_idx)) && fa != (target_ulong)-1 &&
+            fa <= last && (fa | ~env->tlb_flush_mask[mmu_idx]) >= addr) {
 #if defined(DEBUG_TLB)
-    printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
-#endif
-    /* Check if we need to flush due to large pages.  */
-    if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
-#if defined(DEBUG_TLB)
-        printf("tlb_flush_page: forced full flush ("
-               TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
-               env->tlb_flush_addr, env->tlb_flush_mask);
+            printf("tlb_flush_range: flush of mode %d ("
+                   TARGET_FMT_lx "/" TARGET_FMT_lx ")\n", mmu_idx,
+                   fa, env->tlb_flush_mask[mmu_idx]);
 #endif
-        tlb_flush(cpu, 1);
-        return;
+            large |= 1u << mmu_idx;
+        }
+    }
+    if (large) {
+        tlb_flush_modes(cpu, large);
+        idxmap &= ~large;
+        reason = TLB_FLUSH_STAT_LARGE_PAGE;
     }
+
     /* must reset current TB so that interrupts cannot modify the
        links while we are modifying them */
     cpu->current_tb = NULL;
 
-    addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    /* Each index of the table is looked at once, for big ranges too */
+    n = MIN(npages, CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
-    }
+        if (!(idxmap & (1u << mmu_idx))) {
+            continue;
+        }
+        for (page = 0; page <= n; page++) {
+            unsigned int i = ((addr >> TARGET_PAGE_BITS) + page) &
+                             (CPU_TLB_SIZE - 1);
 
-    /* check whether there are entries that need to be flushed in the vtlb */
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        int k;
+            tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr, last);
+        }
+        /* check whether there are entries that need to be flushed in the
+           vtlb */
         for (k = 0; k < CPU_VTLB_SIZE; k++) {
-            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr, last);
         }
     }
 
-    tb_flush_jmp_cache(cpu, addr);
+    if (!large) {
+        if (npages < TLB_FLUSH_RANGE_JMP_PAGES) {
+            for (page = 0; page <= npages; page++) {
+                tb_flush_jmp_cache(cpu, addr + (page << TARGET_PAGE_BITS));
+            }
+        } else {
+            memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+        }
+    }
+    tlb_flush_stat(reason, start);
+}
+
+void tlb_flush_page(CPUState *cpu, target_ulong addr)
+{
+#if defined(DEBUG_TLB)
+    printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
+#endif
+    addr &= ~(TLB_FLUSH_BLOCK_SIZE - 1);
+    tlb_flush_range_1(cpu, addr, addr + TLB_FLUSH_BLOCK_SIZE - 1,
+                      TLB_FLUSH_STAT_PAGE);
+}
+
+void tlb_flush_range(CPUState *cpu, target_ulong addr, target_ulong len)
+{
+#if defined(DEBUG_TLB)
+    printf("tlb_flush_range: " TARGET_FMT_lx "+" TARGET_FMT_lx "\n",
+           addr, len);
+#endif
+    if (len) {
+        tlb_flush_range_1(cpu, addr, addr + len - 1, TLB_FLUSH_STAT_RANGE);
+    }
 }
 
 /* update the TLBs so that writes to code in the virtual page 'addr'
@@ -220,26 +339,27 @@ void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
 }
 
 /* Our TLB does not support large pages, so remember the area covered by
-   large pages and trigger a full TLB flush if these are invalidated.  */
-static void tlb_add_large_page(CPUArchState *env, target_ulong vaddr,
-                               target_ulong size)
+   large pages in each mode and flush the whole mode if these are
+   invalidated.  */
+static void tlb_add_large_page(CPUArchState *env, int mmu_idx,
+                               target_ulong vaddr, target_ulong size)
 {
     target_ulong mask = ~(size - 1);
 
-    if (env->tlb_flush_addr == (target_ulong)-1) {
-        env->tlb_flush_addr = vaddr & mask;
-        env->tlb_flush_mask = mask;
+    if (env->tlb_flush_addr[mmu_idx] == (target_ulong)-1) {
+        env->tlb_flush_addr[mmu_idx] = vaddr & mask;
+        env->tlb_flush_mask[mmu_idx] = mask;
         return;
     }
     /* Extend the existing region to include the new page.
        This is a compromise between unnecessary flushes and the cost
        of maintaining a full variable size TLB.  */
-    mask &= env->tlb_flush_mask;
-    while (((env->tlb_flush_addr ^ vaddr) & mask) != 0) {
+    mask &= env->tlb_flush_mask[mmu_idx];
+    while (((env->tlb_flush_addr[mmu_idx] ^ vaddr) & mask) != 0) {
         mask <<= 1;
     }
-    env->tlb_flush_addr &= mask;
-    env->tlb_flush_mask = mask;
+    env->tlb_flush_addr[mmu_idx] &= mask;
+    env->tlb_flush_mask[mmu_idx] = mask;
 }
 
 /* Add a new TLB entry. At most one entry for a given virtual address
@@ -260,8 +380,8 @@ void tlb_set_page(CPUState *cpu, target_ulong vaddr,
     unsigned vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
 
     assert(size >= TARGET_PAGE_SIZE);
-    if (size != TARGET_PAGE_SIZE) {
-        tlb_add_large_page(env, vaddr, size);
+    if (size > TLB_FLUSH_BLOCK_SIZE) {
+        tlb_add_large_page(env, mmu_idx, vaddr, size);
     }
 
     sz = size;
@@ -291,6 +411,7 @@ void tlb_set_page(CPUState *cpu, target_ulong vaddr,
 
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     te = &env->tlb_table[mmu_idx][index];
+    env->tlb_clean_modes &= ~(1u << mmu_idx);
 
     /* do not discard the translation in te, evict it into a victim tlb */
     env->tlb_v_table[mmu_idx][vidx] = *te;
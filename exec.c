@@ -53,6 +53,8 @@
 #include "exec/ram_addr.h"
 
 #include "qemu/range.h"
+#include "qemu/rcu.h"
+#include "qemu/main-loop.h"
 
 #ifdef USE_ANDROID_EMU
 #include "android/error-messages.h"
@@ -123,7 +125,13 @@ typedef struct PhysPageMap {
     MemoryRegionSection *sections;
 } PhysPageMap;
 
+/* as->dispatch is read under RCU, or with the BQL held, and replaced only
+ * with the BQL held; the dispatch it replaces is freed after a grace period.
+ */
 struct AddressSpaceDispatch {
+    struct rcu_head rcu;
+    /* Never reused, unlike the address of a freed dispatch */
+    uint64_t id;
     /* This is a multi-level map on the physical address space.
      * The bottom level has pointers to MemoryRegionSections.
      */
@@ -132,6 +140,27 @@ struct AddressSpaceDispatch {
     AddressSpace *as;
 };
 
+/*
+ * Per-thread cache of the last few phys_map lookups. Devices tend to hit
+ * the same few pages over and over, and each lookup is a walk of up to
+ * P_L2_LEVELS nodes. Entries point into an AddressSpaceDispatch and are
+ * keyed on its id, so a lookup in a newer dispatch never matches them;
+ * they are only returned while the dispatch is still the one being read.
+ */
+#define PHYS_CACHE_SIZE 4
+
+typedef struct PhysPageCache {
+    unsigned next;
+    struct {
+        uint64_t id;
+        hwaddr index;
+        MemoryRegionSection *section;
+    } entry[PHYS_CACHE_SIZE];
+} PhysPageCache;
+
+static uint64_t dispatch_next_id = 1;
+static DEFINE_TLS(PhysPageCache, phys_page_cache);
+
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
 typedef struct subpage_t {
     MemoryRegion iomem;
@@ -315,6 +344,28 @@ bool memory_region_is_unassigned(MemoryRegion *mr)
         && mr != &io_mem_watch;
 }
 
+static MemoryRegionSection *phys_page_find_cached(AddressSpaceDispatch *d,
+                                                  hwaddr addr)
+{
+    PhysPageCache *cache = &tls_var(phys_page_cache);
+    hwaddr index = addr >> TARGET_PAGE_BITS;
+    MemoryRegionSection *section;
+    int i;
+
+    for (i = 0; i < PHYS_CACHE_SIZE; i++) {
+        if (cache->entry[i].id == d->id && cache->entry[i].index == index) {
+            return cache->entry[i].section;
+        }
+    }
+
+    section = phys_page_find(d->phys_map, addr, d->map.nodes, d->map.sections);
+    i = cache->next++ % PHYS_CACHE_SIZE;
+    cache->entry[i].id = d->id;
+    cache->entry[i].index = index;
+    cache->entry[i].section = section;
+    return section;
+}
+
 static MemoryRegionSection *address_space_lookup_region(AddressSpaceDispatch *d,
                                                         hwaddr addr,
                                                         bool resolve_subpage)
@@ -322,7 +373,8 @@ static MemoryRegionSection *address_space_lookup_region(AddressSpaceDispatch *d,
     MemoryRegionSection *section;
     subpage_t *subpage;
 
-    section = phys_page_find(d->phys_map, addr, d->map.nodes, d->map.sections);
+    /* A page is covered by one section, or one subpage split further */
+    section = phys_page_find_cached(d, addr);
     if (resolve_subpage && section->mr->subpage) {
         subpage = container_of(section->mr, subpage_t, iomem);
         section = &d->map.sections[subpage->sub_section[SUBPAGE_IDX(addr)]];
@@ -371,7 +423,8 @@ MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
     hwaddr len = *plen;
 
     for (;;) {
-        section = address_space_translate_internal(as->dispatch, addr, &addr, plen, true);
+        section = address_space_translate_internal(atomic_rcu_read(&as->dispatch),
+                                                   addr, &addr, plen, true);
         mr = section->mr;
 
         if (!mr->iommu_ops) {
@@ -405,7 +458,8 @@ address_space_translate_for_iotlb(AddressSpace *as, hwaddr addr, hwaddr *xlat,
                                   hwaddr *plen)
 {
     MemoryRegionSection *section;
-    section = address_space_translate_internal(as->dispatch, addr, xlat, plen, false);
+    section = address_space_translate_internal(atomic_rcu_read(&as->dispatch),
+                                               addr, xlat, plen, false);
 
     assert(!section->mr->iommu_ops);
     return section;
@@ -862,6 +916,30 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t length,
     }
 }
 
+bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
+                                              ram_addr_t length,
+                                              unsigned client)
+{
+    unsigned long end, page;
+    bool dirty;
+
+    if (length == 0) {
+        return false;
+    }
+
+    assert(client < DIRTY_MEMORY_NUM);
+    end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+    page = start >> TARGET_PAGE_BITS;
+    cpu_physical_memory_dirty_summary_clear(client, page, end);
+    dirty = bitmap_test_and_clear_atomic(ram_list.dirty_memory[client],
+                                         page, end - page);
+
+    if (dirty && tcg_enabled()) {
+        tlb_reset_dirty_range_all(start, length);
+    }
+    return dirty;
+}
+
 static void cpu_physical_memory_set_dirty_tracking(bool enable)
 {
     in_migration = enable;
@@ -887,7 +965,10 @@ hwaddr memory_region_section_get_iotlb(CPUState *cpu,
             iotlb |= PHYS_SECTION_ROM;
         }
     } else {
-        iotlb = section - section->address_space->dispatch->map.sections;
+        AddressSpaceDispatch *d;
+
+        d = atomic_rcu_read(&section->address_space->dispatch);
+        iotlb = section - d->map.sections;
         iotlb += xlat;
     }
 
@@ -1301,6 +1382,52 @@ static int memory_try_enable_merging(void *addr, size_t len)
     return qemu_madvise(addr, len, QEMU_MADV_MERGEABLE);
 }
 
+/* Smaller blocks, such as ROMs, are not worth a huge page */
+#define RAM_HUGEPAGES_MIN_BLOCK     (16 << 20)
+
+static void *ram_block_alloc_huge(RAMBlock *block)
+{
+    static bool warned;
+    void *host;
+
+    if (mem_hugepages != MEM_HUGEPAGES_EXPLICIT ||
+        phys_mem_alloc != qemu_anon_ram_alloc ||
+        block->length < RAM_HUGEPAGES_MIN_BLOCK) {
+        return NULL;
+    }
+    host = qemu_anon_ram_alloc_huge(block->length, mem_hugepage_size,
+                                    &block->mr->align);
+    if (!host && !warned) {
+        error_report("warning: not enough huge pages for guest memory '%s', "
+                     "using normal pages", memory_region_name(block->mr));
+        warned = true;
+    }
+    return host;
+}
+
+/* Back @block with a file that the GPU renderer can map, see -mem-shared */
+static void *ram_block_alloc_shared(RAMBlock *block)
+{
+    static bool warned;
+    void *host;
+
+    if (!mem_shared || phys_mem_alloc != qemu_anon_ram_alloc) {
+        return NULL;
+    }
+    host = qemu_shared_ram_alloc(memory_region_name(block->mr),
+                                 block->length, &block->mr->align,
+                                 &block->fd);
+    if (host) {
+        block->flags |= RAM_SHARED;
+    } else if (!warned) {
+        error_report("warning: cannot share guest memory '%s' with the "
+                     "renderer: %s", memory_region_name(block->mr),
+                     strerror(errno));
+        warned = true;
+    }
+    return host;
+}
+
 static ram_addr_t ram_block_add(RAMBlock *new_block, Error **errp)
 {
     RAMBlock *block;
@@ -1316,8 +1443,14 @@ static ram_addr_t ram_block_add(RAMBlock *new_block, Error **errp)
         if (xen_enabled()) {
             xen_ram_alloc(new_block->offset, new_block->length, new_block->mr);
         } else {
-            new_block->host = phys_mem_alloc(new_block->length,
-                                             &new_block->mr->align);
+            new_block->host = ram_block_alloc_shared(new_block);
+            if (!new_block->host) {
+                new_block->host = ram_block_alloc_huge(new_block);
+            }
+            if (!new_block->host) {
+                new_block->host = phys_mem_alloc(new_block->length,
+                                                 &new_block->mr->align);
+            }
 #ifdef CONFIG_HAX
             /*
              * In Hax, the qemu allocate the virtual address, and HAX kernel
@@ -1347,6 +1480,9 @@ static ram_addr_t ram_block_add(RAMBlock *new_block, Error **errp)
                 qemu_mutex_unlock_ramlist();
                 return -1;
             }
+            if (mem_prealloc) {
+                os_mem_prealloc(-1, new_block->host, new_block->length);
+            }
             memory_try_enable_merging(new_block->host, new_block->length);
         }
     }
@@ -1375,12 +1511,18 @@ static ram_addr_t ram_block_add(RAMBlock *new_block, Error **errp)
             ram_list.dirty_memory[i] =
                 bitmap_zero_extend(ram_list.dirty_memory[i],
                                    old_ram_size, new_ram_size);
+            ram_list.dirty_summary[i] =
+                bitmap_zero_extend(ram_list.dirty_summary[i],
+                                   BITS_TO_LONGS(old_ram_size),
+                                   BITS_TO_LONGS(new_ram_size));
        }
     }
     cpu_physical_memory_set_dirty_range(new_block->offset, new_block->length);
 
     qemu_ram_setup_dump(new_block->host, new_block->length);
-    qemu_madvise(new_block->host, new_block->length, QEMU_MADV_HUGEPAGE);
+    if (mem_hugepages == MEM_HUGEPAGES_TRANSPARENT) {
+        qemu_madvise(new_block->host, new_block->length, QEMU_MADV_HUGEPAGE);
+    }
     qemu_madvise(new_block->host, new_block->length, QEMU_MADV_DONTFORK);
 
     if (kvm_enabled()) {
@@ -1918,7 +2060,9 @@ static uint16_t dummy_section(PhysPageMap *map, AddressSpace *as,
 
 MemoryRegion *iotlb_to_region(AddressSpace *as, hwaddr index)
 {
-    return as->dispatch->map.sections[index & ~TARGET_PAGE_MASK].mr;
+    AddressSpaceDispatch *d = atomic_rcu_read(&as->dispatch);
+
+    return d->map.sections[index & ~TARGET_PAGE_MASK].mr;
 }
 
 static void io_mem_init(void)
@@ -1949,9 +2093,16 @@ static void mem_begin(MemoryListener *listener)
 
     d->phys_map  = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .skip = 1 };
     d->as = as;
+    d->id = dispatch_next_id++;
     as->next_dispatch = d;
 }
 
+static void address_space_dispatch_free(AddressSpaceDispatch *d)
+{
+    phys_sections_free(&d->map);
+    g_free(d);
+}
+
 static void mem_commit(MemoryListener *listener)
 {
     AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
@@ -1960,11 +2111,9 @@ static void mem_commit(MemoryListener *listener)
 
     phys_page_compact_all(next, next->map.nodes_nb);
 
-    as->dispatch = next;
-
+    atomic_rcu_set(&as->dispatch, next);
     if (cur) {
-        phys_sections_free(&cur->map);
-        g_free(cur);
+        call_rcu(cur, address_space_dispatch_free, rcu);
     }
 }
 
@@ -2019,8 +2168,10 @@ void address_space_destroy_dispatch(AddressSpace *as)
     AddressSpaceDispatch *d = as->dispatch;
 
     memory_listener_unregister(&as->dispatch_listener);
-    g_free(d);
-    as->dispatch = NULL;
+    atomic_rcu_set(&as->dispatch, NULL);
+    if (d) {
+        call_rcu(d, address_space_dispatch_free, rcu);
+    }
 }
 
 static void memory_map_init(void)
@@ -2103,6 +2254,11 @@ static void invalidate_and_set_dirty(hwaddr addr,
     xen_modified_memory(addr, length);
 }
 
+void cpu_physical_memory_set_written(ram_addr_t start, ram_addr_t length)
+{
+    invalidate_and_set_dirty(start, length);
+}
+
 static int memory_access_size(MemoryRegion *mr, unsigned l, hwaddr addr)
 {
     unsigned access_size_max = mr->ops->valid.max_access_size;
@@ -2132,6 +2288,19 @@ static int memory_access_size(MemoryRegion *mr, unsigned l, hwaddr addr)
     return l;
 }
 
+/* Take the iothread lock for an access to @mr if it needs it and the
+ * caller doesn't already hold it. Returns true if the caller must release
+ * it once the access is done.
+ */
+static bool prepare_mmio_access(MemoryRegion *mr)
+{
+    if (mr->lockless || qemu_mutex_iothread_locked()) {
+        return false;
+    }
+    qemu_mutex_lock_iothread();
+    return true;
+}
+
 bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
                       int len, bool is_write)
 {
@@ -2141,13 +2310,17 @@ bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
     hwaddr addr1;
     MemoryRegion *mr;
     bool error = false;
+    bool release_lock;
 
+    rcu_read_lock();
     while (len > 0) {
         l = len;
         mr = address_space_translate(as, addr, &addr1, &l, is_write);
+        release_lock = false;
 
         if (is_write) {
             if (!memory_access_is_direct(mr, is_write)) {
+                release_lock = prepare_mmio_access(mr);
                 l = memory_access_size(mr, l, addr1);
                 /* XXX: could force current_cpu to NULL to avoid
                    potential bugs */
@@ -2185,6 +2358,7 @@ bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
         } else {
             if (!memory_access_is_direct(mr, is_write)) {
                 /* I/O case */
+                release_lock = prepare_mmio_access(mr);
                 l = memory_access_size(mr, l, addr1);
                 switch (l) {
                 case 8:
@@ -2216,11 +2390,16 @@ bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
                 memcpy(buf, ptr, l);
             }
         }
+
+        if (release_lock) {
+            qemu_mutex_unlock_iothread();
+        }
         len -= l;
         buf += l;
         addr += l;
     }
 
+    rcu_read_unlock();
     return error;
 }
 
@@ -2255,6 +2434,7 @@ static inline void cpu_physical_memory_write_rom_internal(AddressSpace *as,
     hwaddr addr1;
     MemoryRegion *mr;
 
+    rcu_read_lock();
     while (len > 0) {
         l = len;
         mr = address_space_translate(as, addr, &addr1, &l, true);
@@ -2280,6 +2460,7 @@ static inline void cpu_physical_memory_write_rom_internal(AddressSpace *as,
         buf += l;
         addr += l;
     }
+    rcu_read_unlock();
 }
 
 /* used for ROM loading : can write in RAM and ROM */
@@ -2310,6 +2491,8 @@ typedef struct {
     void *buffer;
     hwaddr addr;
     hwaddr len;
+    /* Claimed with atomic_xchg(), maps can come from lockless devices */
+    bool in_use;
 } BounceBuffer;
 
 static BounceBuffer bounce;
@@ -2357,12 +2540,14 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
     MemoryRegion *mr;
     hwaddr l, xlat;
 
+    rcu_read_lock();
     while (len > 0) {
         l = len;
         mr = address_space_translate(as, addr, &xlat, &l, is_write);
         if (!memory_access_is_direct(mr, is_write)) {
             l = memory_access_size(mr, l, addr);
             if (!memory_region_access_valid(mr, xlat, l, is_write)) {
+                rcu_read_unlock();
                 return false;
             }
         }
@@ -2370,9 +2555,25 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
         len -= l;
         addr += l;
     }
+    rcu_read_unlock();
     return true;
 }
 
+bool address_space_access_lockless(AddressSpace *as, hwaddr addr, int len,
+                                   bool is_write)
+{
+    MemoryRegion *mr;
+    hwaddr l = len, xlat;
+    bool lockless;
+
+    rcu_read_lock();
+    mr = address_space_translate(as, addr, &xlat, &l, is_write);
+    lockless = l == len && mr->lockless &&
+               !memory_access_is_direct(mr, is_write);
+    rcu_read_unlock();
+    return lockless;
+}
+
 /* Map a physical memory region into a host virtual address.
  * May map a subset of the requested range, given by and returned in *plen.
  * May return NULL if resources needed to perform the mapping are exhausted.
@@ -2396,9 +2597,11 @@ void *address_space_map(AddressSpace *as,
     }
 
     l = len;
+    rcu_read_lock();
     mr = address_space_translate(as, addr, &xlat, &l, is_write);
     if (!memory_access_is_direct(mr, is_write)) {
-        if (bounce.buffer) {
+        if (atomic_xchg(&bounce.in_use, true)) {
+            rcu_read_unlock();
             return NULL;
         }
         /* Avoid unbounded allocations */
@@ -2413,6 +2616,7 @@ void *address_space_map(AddressSpace *as,
             address_space_read(as, addr, bounce.buffer, l);
         }
 
+        rcu_read_unlock();
         *plen = l;
         return bounce.buffer;
     }
@@ -2436,6 +2640,7 @@ void *address_space_map(AddressSpace *as,
     }
 
     memory_region_ref(mr);
+    rcu_read_unlock();
     *plen = done;
     return qemu_ram_ptr_length(raddr + base, plen);
 }
@@ -2468,6 +2673,7 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
     qemu_vfree(bounce.buffer);
     bounce.buffer = NULL;
     memory_region_unref(bounce.mr);
+    atomic_mb_set(&bounce.in_use, false);
     cpu_notify_map_clients();
 }
 
@@ -2493,9 +2699,12 @@ static inline uint32_t ldl_phys_internal(AddressSpace *as, hwaddr addr,
     MemoryRegion *mr;
     hwaddr l = 4;
     hwaddr addr1;
+    bool release_lock = false;
 
+    rcu_read_lock();
     mr = address_space_translate(as, addr, &addr1, &l, false);
     if (l < 4 || !memory_access_is_direct(mr, false)) {
+        release_lock = prepare_mmio_access(mr);
         /* I/O case */
         io_mem_read(mr, addr1, &val, 4);
 #if defined(TARGET_WORDS_BIGENDIAN)
@@ -2524,6 +2733,10 @@ static inline uint32_t ldl_phys_internal(AddressSpace *as, hwaddr addr,
             break;
         }
     }
+    if (release_lock) {
+        qemu_mutex_unlock_iothread();
+    }
+    rcu_read_unlock();
     return val;
 }
 
@@ -2551,10 +2764,13 @@ static inline uint64_t ldq_phys_internal(AddressSpace *as, hwaddr addr,
     MemoryRegion *mr;
     hwaddr l = 8;
     hwaddr addr1;
+    bool release_lock = false;
 
+    rcu_read_lock();
     mr = address_space_translate(as, addr, &addr1, &l,
                                  false);
     if (l < 8 || !memory_access_is_direct(mr, false)) {
+        release_lock = prepare_mmio_access(mr);
         /* I/O case */
         io_mem_read(mr, addr1, &val, 8);
 #if defined(TARGET_WORDS_BIGENDIAN)
@@ -2583,6 +2799,10 @@ static inline uint64_t ldq_phys_internal(AddressSpace *as, hwaddr addr,
             break;
         }
     }
+    if (release_lock) {
+        qemu_mutex_unlock_iothread();
+    }
+    rcu_read_unlock();
     return val;
 }
 
@@ -2618,10 +2838,13 @@ static inline uint32_t lduw_phys_internal(AddressSpace *as, hwaddr addr,
     MemoryRegion *mr;
     hwaddr l = 2;
     hwaddr addr1;
+    bool release_lock = false;
 
+    rcu_read_lock();
     mr = address_space_translate(as, addr, &addr1, &l,
                                  false);
     if (l < 2 || !memory_access_is_direct(mr, false)) {
+        release_lock = prepare_mmio_access(mr);
         /* I/O case */
         io_mem_read(mr, addr1, &val, 2);
 #if defined(TARGET_WORDS_BIGENDIAN)
@@ -2650,6 +2873,10 @@ static inline uint32_t lduw_phys_internal(AddressSpace *as, hwaddr addr,
             break;
         }
     }
+    if (release_lock) {
+        qemu_mutex_unlock_iothread();
+    }
+    rcu_read_unlock();
     return val;
 }
 
@@ -2677,10 +2904,13 @@ void stl_phys_notdirty(AddressSpace *as, hwaddr addr, uint32_t val)
     MemoryRegion *mr;
     hwaddr l = 4;
     hwaddr addr1;
+    bool release_lock = false;
 
+    rcu_read_lock();
     mr = address_space_translate(as, addr, &addr1, &l,
                                  true);
     if (l < 4 || !memory_access_is_direct(mr, true)) {
+        release_lock = prepare_mmio_access(mr);
         io_mem_write(mr, addr1, val, 4);
     } else {
         addr1 += memory_region_get_ram_addr(mr) & TARGET_PAGE_MASK;
@@ -2696,6 +2926,10 @@ void stl_phys_notdirty(AddressSpace *as, hwaddr addr, uint32_t val)
             }
         }
     }
+    if (release_lock) {
+        qemu_mutex_unlock_iothread();
+    }
+    rcu_read_unlock();
 }
 
 /* warning: addr must be aligned */
@@ -2707,10 +2941,13 @@ static inline void stl_phys_internal(AddressSpace *as,
     MemoryRegion *mr;
     hwaddr l = 4;
     hwaddr addr1;
+    bool release_lock = false;
 
+    rcu_read_lock();
     mr = address_space_translate(as, addr, &addr1, &l,
                                  true);
     if (l < 4 || !memory_access_is_direct(mr, true)) {
+        release_lock = prepare_mmio_access(mr);
 #if defined(TARGET_WORDS_BIGENDIAN)
         if (endian == DEVICE_LITTLE_ENDIAN) {
             val = bswap32(val);
@@ -2738,6 +2975,10 @@ static inline void stl_phys_internal(AddressSpace *as,
         }
         invalidate_and_set_dirty(addr1, 4);
     }
+    if (release_lock) {
+        qemu_mutex_unlock_iothread();
+    }
+    rcu_read_unlock();
 }
 
 void stl_phys(AddressSpace *as, hwaddr addr, uint32_t val)
@@ -2771,9 +3012,12 @@ static inline void stw_phys_internal(AddressSpace *as,
     MemoryRegion *mr;
     hwaddr l = 2;
     hwaddr addr1;
+    bool release_lock = false;
 
+    rcu_read_lock();
     mr = address_space_translate(as, addr, &addr1, &l, true);
     if (l < 2 || !memory_access_is_direct(mr, true)) {
+        release_lock = prepare_mmio_access(mr);
 #if defined(TARGET_WORDS_BIGENDIAN)
         if (endian == DEVICE_LITTLE_ENDIAN) {
             val = bswap16(val);
@@ -2801,6 +3045,10 @@ static inline void stw_phys_internal(AddressSpace *as,
         }
         invalidate_and_set_dirty(addr1, 2);
     }
+    if (release_lock) {
+        qemu_mutex_unlock_iothread();
+    }
+    rcu_read_unlock();
 }
 
 void stw_phys(AddressSpace *as, hwaddr addr, uint32_t val)
@@ -2887,12 +3135,16 @@ bool cpu_physical_memory_is_io(hwaddr phys_addr)
 {
     MemoryRegion*mr;
     hwaddr l = 1;
+    bool res;
 
+    rcu_read_lock();
     mr = address_space_translate(&address_space_memory,
                                  phys_addr, &phys_addr, &l, false);
 
-    return !(memory_region_is_ram(mr) ||
-             memory_region_is_romd(mr));
+    res = !(memory_region_is_ram(mr) ||
+            memory_region_is_romd(mr));
+    rcu_read_unlock();
+    return res;
 }
 
 void qemu_ram_foreach_block(RAMBlockIterFunc func, void *opaque)
@@ -44,6 +44,8 @@ these four paragraphs for those parts of this code that are retained.
 
 /* We only need stdlib for abort() */
 #include <stdlib.h>
+#include <float.h>
+#include <math.h>
 
 /*----------------------------------------------------------------------------
 | Primitive arithmetic functions, including multi-word arithmetic, and
@@ -62,6 +64,74 @@ these four paragraphs for those parts of this code that are retained.
 *----------------------------------------------------------------------------*/
 #include "softfloat-specialize.h"
 
+/*----------------------------------------------------------------------------
+| Host FPU fast path.  When the inputs are zero or normal, the rounding mode
+| is round-to-nearest-even and the inexact flag is already raised, the host
+| computes the same result as we do, and the only flag it could raise is the
+| inexact one.  Results that are infinite or too close to zero may have
+| raised overflow or underflow, so they are computed again the slow way.
+| This needs a host that computes float and double in their own precision,
+| so not the x87.
+*----------------------------------------------------------------------------*/
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#define USE_HOST_FPU
+#endif
+
+#ifdef USE_HOST_FPU
+typedef union {
+    float32 s;
+    float h;
+} HostFloat32;
+
+typedef union {
+    float64 s;
+    double h;
+} HostFloat64;
+
+static inline flag host_fpu_usable(float_status *status)
+{
+    return STATUS(float_rounding_mode) == float_round_nearest_even &&
+           (STATUS(float_exception_flags) & float_flag_inexact);
+}
+
+static inline flag float32_is_zero_or_normal(float32 a)
+{
+    uint32_t exp = (float32_val(a) >> 23) & 0xff;
+
+    return exp ? exp != 0xff : float32_is_zero(a);
+}
+
+static inline flag float64_is_zero_or_normal(float64 a)
+{
+    uint64_t exp = (float64_val(a) >> 52) & 0x7ff;
+
+    return exp ? exp != 0x7ff : float64_is_zero(a);
+}
+
+static inline flag float32_host_usable(float32 a, float32 b STATUS_PARAM)
+{
+    return host_fpu_usable(status) &&
+           float32_is_zero_or_normal(a) && float32_is_zero_or_normal(b);
+}
+
+static inline flag float64_host_usable(float64 a, float64 b STATUS_PARAM)
+{
+    return host_fpu_usable(status) &&
+           float64_is_zero_or_normal(a) && float64_is_zero_or_normal(b);
+}
+
+/* A zero is only right if the exact result is zero, the caller checks that */
+static inline flag host_float_is_normal(float h)
+{
+    return fabsf(h) > FLT_MIN && fabsf(h) <= FLT_MAX;
+}
+
+static inline flag host_double_is_normal(double h)
+{
+    return fabs(h) > DBL_MIN && fabs(h) <= DBL_MAX;
+}
+#endif
+
 /*----------------------------------------------------------------------------
 | Returns the fraction bits of the half-precision floating-point value `a'.
 *----------------------------------------------------------------------------*/
@@ -2025,6 +2095,16 @@ static float32 subFloat32Sigs( float32 a, float32 b, flag zSign STATUS_PARAM)
 float32 float32_add( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
+#ifdef USE_HOST_FPU
+    if (float32_host_usable(a, b STATUS_VAR)) {
+        HostFloat32 ua = { .s = a }, ub = { .s = b }, ur;
+
+        ur.h = ua.h + ub.h;
+        if (host_float_is_normal(ur.h) || ur.h == 0) {
+            return ur.s;
+        }
+    }
+#endif
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -2048,6 +2128,16 @@ float32 float32_add( float32 a, float32 b STATUS_PARAM )
 float32 float32_sub( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
+#ifdef USE_HOST_FPU
+    if (float32_host_usable(a, b STATUS_VAR)) {
+        HostFloat32 ua = { .s = a }, ub = { .s = b }, ur;
+
+        ur.h = ua.h - ub.h;
+        if (host_float_is_normal(ur.h) || ur.h == 0) {
+            return ur.s;
+        }
+    }
+#endif
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -2075,6 +2165,17 @@ float32 float32_mul( float32 a, float32 b STATUS_PARAM )
     uint32_t aSig, bSig;
     uint64_t zSig64;
     uint32_t zSig;
+#ifdef USE_HOST_FPU
+    if (float32_host_usable(a, b STATUS_VAR)) {
+        HostFloat32 ua = { .s = a }, ub = { .s = b }, ur;
+
+        ur.h = ua.h * ub.h;
+        if (host_float_is_normal(ur.h) ||
+            float32_is_zero(a) || float32_is_zero(b)) {
+            return ur.s;
+        }
+    }
+#endif
 
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
@@ -2136,6 +2237,16 @@ float32 float32_div( float32 a, float32 b STATUS_PARAM )
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
     uint32_t aSig, bSig, zSig;
+#ifdef USE_HOST_FPU
+    if (float32_host_usable(a, b STATUS_VAR) && !float32_is_zero(b)) {
+        HostFloat32 ua = { .s = a }, ub = { .s = b }, ur;
+
+        ur.h = ua.h / ub.h;
+        if (host_float_is_normal(ur.h) || float32_is_zero(a)) {
+            return ur.s;
+        }
+    }
+#endif
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -2527,6 +2638,15 @@ float32 float32_sqrt( float32 a STATUS_PARAM )
     int_fast16_t aExp, zExp;
     uint32_t aSig, zSig;
     uint64_t rem, term;
+#ifdef USE_HOST_FPU
+    if (host_fpu_usable(status) && float32_is_zero_or_normal(a) &&
+        !float32_is_neg(a)) {
+        HostFloat32 u = { .s = a };
+
+        u.h = sqrtf(u.h);
+        return u.s;
+    }
+#endif
     a = float32_squash_input_denormal(a STATUS_VAR);
 
     aSig = extractFloat32Frac( a );
@@ -3769,6 +3889,16 @@ static float64 subFloat64Sigs( float64 a, float64 b, flag zSign STATUS_PARAM )
 float64 float64_add( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
+#ifdef USE_HOST_FPU
+    if (float64_host_usable(a, b STATUS_VAR)) {
+        HostFloat64 ua = { .s = a }, ub = { .s = b }, ur;
+
+        ur.h = ua.h + ub.h;
+        if (host_double_is_normal(ur.h) || ur.h == 0) {
+            return ur.s;
+        }
+    }
+#endif
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3792,6 +3922,16 @@ float64 float64_add( float64 a, float64 b STATUS_PARAM )
 float64 float64_sub( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
+#ifdef USE_HOST_FPU
+    if (float64_host_usable(a, b STATUS_VAR)) {
+        HostFloat64 ua = { .s = a }, ub = { .s = b }, ur;
+
+        ur.h = ua.h - ub.h;
+        if (host_double_is_normal(ur.h) || ur.h == 0) {
+            return ur.s;
+        }
+    }
+#endif
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3817,6 +3957,17 @@ float64 float64_mul( float64 a, float64 b STATUS_PARAM )
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
     uint64_t aSig, bSig, zSig0, zSig1;
+#ifdef USE_HOST_FPU
+    if (float64_host_usable(a, b STATUS_VAR)) {
+        HostFloat64 ua = { .s = a }, ub = { .s = b }, ur;
+
+        ur.h = ua.h * ub.h;
+        if (host_double_is_normal(ur.h) ||
+            float64_is_zero(a) || float64_is_zero(b)) {
+            return ur.s;
+        }
+    }
+#endif
 
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
@@ -3880,6 +4031,16 @@ float64 float64_div( float64 a, float64 b STATUS_PARAM )
     uint64_t aSig, bSig, zSig;
     uint64_t rem0, rem1;
     uint64_t term0, term1;
+#ifdef USE_HOST_FPU
+    if (float64_host_usable(a, b STATUS_VAR) && !float64_is_zero(b)) {
+        HostFloat64 ua = { .s = a }, ub = { .s = b }, ur;
+
+        ur.h = ua.h / ub.h;
+        if (host_double_is_normal(ur.h) || float64_is_zero(a)) {
+            return ur.s;
+        }
+    }
+#endif
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -4283,6 +4444,15 @@ float64 float64_sqrt( float64 a STATUS_PARAM )
     int_fast16_t aExp, zExp;
     uint64_t aSig, zSig, doubleZSig;
     uint64_t rem0, rem1, term0, term1;
+#ifdef USE_HOST_FPU
+    if (host_fpu_usable(status) && float64_is_zero_or_normal(a) &&
+        !float64_is_neg(a)) {
+        HostFloat64 u = { .s = a };
+
+        u.h = sqrt(u.h);
+        return u.s;
+    }
+#endif
     a = float64_squash_input_denormal(a STATUS_VAR);
 
     aSig = extractFloat64Frac( a );
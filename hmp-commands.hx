@@ -72,6 +72,23 @@ Resize a block image while a guest is running.  Usually requires guest
 action to see the updated size.  Resize to a lower size is supported,
 but should be used with extreme caution.  Note that this command only
 resizes image files, it can not resize block devices like LVM volumes.
+ETEXI
+
+    {
+        .name       = "block_reset",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "revert a block image to its backing file, or zero it",
+        .mhandler.cmd = hmp_block_reset,
+    },
+
+STEXI
+@item block_reset
+@findex block_reset
+Throw away everything written to a block device while the VM is stopped.
+An image with a backing file, like a qcow2 overlay, goes back to the
+contents of the backing file; other images are zeroed, punching holes
+in the image file where the host supports it.
 ETEXI
 
     {
@@ -314,19 +331,23 @@ ETEXI
 
     {
         .name       = "savevm",
-        .args_type  = "name:s?",
-        .params     = "[tag|id]",
-        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created",
+        .args_type  = "background:-b,name:s?",
+        .params     = "[-b] [tag|id]",
+        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created"
+                      "\n\t\t\t -b to resume the VM while its RAM is still being saved",
         .mhandler.cmd = do_savevm,
     },
 
 STEXI
-@item savevm [@var{tag}|@var{id}]
+@item savevm [-b] [@var{tag}|@var{id}]
 @findex savevm
 Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+With @code{-b}, the virtual machine resumes as soon as its device state
+is saved and its RAM is written out in the background, on hosts and
+accelerators that allow it.
 ETEXI
 
     {
@@ -373,6 +394,22 @@ STEXI
 @findex singlestep
 Run the emulation in single step mode.
 If called with option off, the emulation returns to normal mode.
+ETEXI
+
+    {
+        .name       = "tb-profile",
+        .args_type  = "option:s?",
+        .params     = "[on|off|reset]",
+        .help       = "count translation block executions for 'info hot-tbs'",
+        .mhandler.cmd = do_tb_profile,
+    },
+
+STEXI
+@item tb-profile [off|reset]
+@findex tb-profile
+Make translated code count how often each translation block runs, as
+reported by @code{info hot-tbs}. Switching it on or off flushes the
+translation cache. With option reset, the counts start again from zero.
 ETEXI
 
     {
@@ -1112,8 +1149,9 @@ ETEXI
 
     {
         .name       = "drive_backup",
-        .args_type  = "reuse:-n,full:-f,device:B,target:s,format:s?",
-        .params     = "[-n] [-f] device target [format]",
+        .args_type  = "reuse:-n,full:-f,incremental:-i,device:B,target:s,"
+                      "format:s?",
+        .params     = "[-n] [-f] [-i] device target [format]",
         .help       = "initiates a point-in-time\n\t\t\t"
                       "copy for a device. The device's contents are\n\t\t\t"
                       "copied to the new image file, excluding data that\n\t\t\t"
@@ -1121,7 +1159,10 @@ ETEXI
                       "The -n flag requests QEMU to reuse the image found\n\t\t\t"
                       "in new-image-file, instead of recreating it from scratch.\n\t\t\t"
                       "The -f flag requests QEMU to copy the whole disk,\n\t\t\t"
-                      "so that the result does not need a backing file.\n\t\t\t",
+                      "so that the result does not need a backing file.\n\t\t\t"
+                      "The -i flag requests QEMU to only copy what changed\n\t\t\t"
+                      "since the last -i copy, into the result of that copy,\n\t\t\t"
+                      "for a drive with a dirty-map.\n\t\t\t",
         .mhandler.cmd = hmp_drive_backup,
     },
 STEXI
@@ -1732,6 +1773,8 @@ show virtual to physical memory mappings (i386, SH4, SPARC, PPC, and Xtensa only
 show the active virtual memory mappings (i386 only)
 @item info jit
 show dynamic compiler info
+@item info hot-tbs [@var{count}]
+show the @var{count} (default 20) most executed translation blocks
 @item info numa
 show NUMA information
 @item info kvm
@@ -219,8 +219,12 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss);
         monitor_printf(mon, "xbzrle cache miss rate: %0.2f\n",
                        info->xbzrle_cache->cache_miss_rate);
+        monitor_printf(mon, "xbzrle cache hit rate: %0.2f\n",
+                       1.0 - info->xbzrle_cache->cache_miss_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle encode time: %" PRIu64 " milliseconds\n",
+                       info->xbzrle_cache->encode_time);
     }
 
     qapi_free_MigrationInfo(info);
@@ -912,6 +916,15 @@ void hmp_block_resize(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &err);
 }
 
+void hmp_block_reset(Monitor *mon, const QDict *qdict)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    Error *err = NULL;
+
+    qmp_block_reset(device, &err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_drive_mirror(Monitor *mon, const QDict *qdict)
 {
     const char *device = qdict_get_str(qdict, "device");
@@ -949,7 +962,9 @@ void hmp_drive_backup(Monitor *mon, const QDict *qdict)
     const char *format = qdict_get_try_str(qdict, "format");
     int reuse = qdict_get_try_bool(qdict, "reuse", 0);
     int full = qdict_get_try_bool(qdict, "full", 0);
+    int incremental = qdict_get_try_bool(qdict, "incremental", 0);
     enum NewImageMode mode;
+    enum MirrorSyncMode sync;
     Error *err = NULL;
 
     if (!filename) {
@@ -958,14 +973,18 @@ void hmp_drive_backup(Monitor *mon, const QDict *qdict)
         return;
     }
 
-    if (reuse) {
+    if (reuse || incremental) {
         mode = NEW_IMAGE_MODE_EXISTING;
     } else {
         mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
     }
+    if (incremental) {
+        sync = MIRROR_SYNC_MODE_INCREMENTAL;
+    } else {
+        sync = full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP;
+    }
 
-    qmp_drive_backup(device, filename, !!format, format,
-                     full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
+    qmp_drive_backup(device, filename, !!format, format, sync,
                      true, mode, false, 0, false, 0, false, 0, &err);
     hmp_handle_error(mon, &err);
 }
@@ -0,0 +1,16 @@
+/*
+ * QEMU Hypervisor.framework accelerator (HVF) stub
+ *
+ * Copyright (c) 2017 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "sysemu/hvf.h"
+
+int hvf_enabled(void)
+{
+    return 0;
+}
@@ -28,13 +28,17 @@ void co_run_in_worker_bh(void *opaque)
 
 static void v9fs_qemu_process_req_done(void *arg)
 {
-    char byte;
+    char buf[64];
     ssize_t len;
     Coroutine *co;
 
+    /*
+     * Each completion writes a byte.  Take them all, the queue below is
+     * drained anyway, rather than coming back here once per byte.
+     */
     do {
-        len = read(v9fs_pool.rfd, &byte, sizeof(byte));
-    } while (len == -1 &&  errno == EINTR);
+        len = read(v9fs_pool.rfd, buf, sizeof(buf));
+    } while (len == sizeof(buf) || (len == -1 && errno == EINTR));
 
     while ((co = g_async_queue_try_pop(v9fs_pool.completed)) != NULL) {
         qemu_coroutine_enter(co, NULL);
@@ -42,6 +42,13 @@ static void virtio_9p_get_config(VirtIODevice *vdev, uint8_t *config)
     g_free(cfg);
 }
 
+static void virtio_9p_notify_bh(void *opaque)
+{
+    V9fsState *s = opaque;
+
+    virtio_notify(VIRTIO_DEVICE(s), s->vq);
+}
+
 static void virtio_9p_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -62,6 +69,7 @@ static void virtio_9p_device_realize(DeviceState *dev, Error **errp)
     }
 
     s->vq = virtio_add_queue(vdev, MAX_REQ, handle_9p_output);
+    s->notify_bh = qemu_bh_new(virtio_9p_notify_bh, s);
 
     v9fs_path_init(&path);
 
@@ -131,6 +139,7 @@ static void virtio_9p_device_realize(DeviceState *dev, Error **errp)
 
     return;
 out:
+    qemu_bh_delete(s->notify_bh);
     g_free(s->ctx.fs_root);
     g_free(s->tag);
     virtio_cleanup(vdev);
@@ -625,11 +625,13 @@ static void complete_pdu(V9fsState *s, V9fsPDU *pdu, ssize_t len)
     pdu->size = len;
     pdu->id = id;
 
-    /* push onto queue and notify */
+    /*
+     * Requests are handled in parallel by the worker threads, and the
+     * replies of those that finish together are pushed in the same main
+     * loop iteration, so the guest is notified once for all of them.
+     */
     virtqueue_push(s->vq, &pdu->elem, len);
-
-    /* FIXME: we should batch these completions */
-    virtio_notify(VIRTIO_DEVICE(s), s->vq);
+    qemu_bh_schedule(s->notify_bh);
 
     /* Now wakeup anybody waiting in flush for this request */
     qemu_co_queue_next(&pdu->complete);
@@ -911,6 +913,11 @@ static void v9fs_version(void *opaque)
     }
     trace_v9fs_version(pdu->tag, pdu->id, s->msize, version.data);
 
+    if (s->msize < P9_MIN_MSIZE) {
+        offset = -EMSGSIZE;
+        goto out;
+    }
+
     virtfs_reset(pdu);
 
     if (!strcmp(version.data, "9P2000.u")) {
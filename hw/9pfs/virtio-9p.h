@@ -123,6 +123,8 @@ static inline char *rpath(FsContext *ctx, const char *path)
  * size[4] Tread/Twrite tag[2] fid[4] offset[8] count[4]
  */
 #define P9_IOHDRSZ 24
+/* Smallest msize that leaves room for a useful Rread/Twrite payload */
+#define P9_MIN_MSIZE 4096
 
 typedef struct V9fsPDU V9fsPDU;
 struct V9fsState;
@@ -224,6 +226,7 @@ typedef struct V9fsState
     CoRwlock rename_lock;
     int32_t root_fid;
     Error *migration_blocker;
+    QEMUBH *notify_bh;
     V9fsConf fsconf;
 } V9fsState;
 
@@ -32,6 +32,8 @@
 #include "hw/acpi/acpi.h"
 #include "sysemu/kvm.h"
 #include "sysemu/hax.h"
+#include "sysemu/whpx.h"
+#include "sysemu/hvf.h"
 #include "exec/address-spaces.h"
 
 #include "hw/i386/ich9.h"
@@ -194,7 +196,8 @@ static void pm_reset(void *opaque)
     acpi_pm_tmr_reset(&pm->acpi_regs);
     acpi_gpe_reset(&pm->acpi_regs);
 
-    if (kvm_enabled() || hax_enabled()) {
+    if (kvm_enabled() || hax_enabled() || whpx_enabled() ||
+        hvf_enabled()) {
         /* Mark SMM as already inited to prevent SMM from running. KVM does not
          * support SMM mode. */
         pm->smi_en |= ICH9_PMIO_SMI_EN_APMC_EN;
@@ -481,6 +481,7 @@ void arm_load_kernel(ARMCPU *cpu, struct arm_boot_info *info)
     CPUState *cs;
     int kernel_size;
     int initrd_size;
+    GunzipJob *initrd_job = NULL;
     int is_linux = 0;
     uint64_t elf_entry, elf_low_addr, elf_high_addr;
     int elf_machine;
@@ -556,6 +557,15 @@ void arm_load_kernel(ARMCPU *cpu, struct arm_boot_info *info)
     info->initrd_start = info->loader_start +
         MIN(info->ram_size / 2, 128 * 1024 * 1024);
 
+    /* A compressed initrd is decompressed while the kernel loads, which
+     * also saves the guest from doing it at every boot.
+     */
+    if (info->initrd_filename) {
+        initrd_job = load_image_gzipped_start(info->initrd_filename,
+                                              info->ram_size -
+                                              info->initrd_start);
+    }
+
     /* Assume that raw images are linux kernels, and ELF images are not.  */
     kernel_size = load_elf(info->kernel_filename, NULL, NULL, &elf_entry,
                            &elf_low_addr, &elf_high_addr, big_endian,
@@ -609,6 +619,11 @@ void arm_load_kernel(ARMCPU *cpu, struct arm_boot_info *info)
                                        info->initrd_start,
                                        info->ram_size -
                                        info->initrd_start);
+            if (initrd_size < 0) {
+                initrd_size = load_image_gzipped_finish(initrd_job,
+                                                        info->initrd_start);
+                initrd_job = NULL;
+            }
             if (initrd_size < 0) {
                 initrd_size = load_image_targphys(info->initrd_filename,
                                                   info->initrd_start,
@@ -660,6 +675,9 @@ void arm_load_kernel(ARMCPU *cpu, struct arm_boot_info *info)
         }
     }
     info->is_linux = is_linux;
+    if (initrd_job) {
+        load_image_gzipped_cancel(initrd_job);
+    }
 
     for (cs = CPU(cpu); cs; cs = CPU_NEXT(cs)) {
         ARM_CPU(cs)->env.boot_info = info;
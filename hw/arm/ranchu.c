@@ -42,6 +42,7 @@
 
 #ifdef USE_ANDROID_EMU
 #include "android/android.h"
+#include "android/error-messages.h"
 #else
 #include "android-console.h"
 #endif
@@ -367,6 +368,7 @@ static void create_simple_device(const VirtBoardInfo *vbi, qemu_irq *pic,
     int irq = irqmap[devid];
     hwaddr base = memmap[devid].base;
     hwaddr size = memmap[devid].size;
+    DeviceState *dev;
     char *nodename;
     int i;
     int compat_sz = 0;
@@ -380,7 +382,16 @@ static void create_simple_device(const VirtBoardInfo *vbi, qemu_irq *pic,
         clocks_sz += strlen(clocks + clocks_sz) + 1;
     }
 
-    sysbus_create_simple(sysbus_name, base, pic[irq]);
+    dev = qdev_create(NULL, sysbus_name);
+    /* The SPI numbers are the KVM GSIs, for the devices that can raise
+     * their irq without going through QEMU's GIC code */
+    if (kvm_irqchip_in_kernel() &&
+        object_property_find(OBJECT(dev), "irqfd-gsi", NULL)) {
+        qdev_prop_set_int32(dev, "irqfd-gsi", irq);
+    }
+    qdev_init_nofail(dev);
+    sysbus_mmio_map(SYS_BUS_DEVICE(dev), 0, base);
+    sysbus_connect_irq(SYS_BUS_DEVICE(dev), 0, pic[irq]);
 
     nodename = g_strdup_printf("/%s@%" PRIx64, sysbus_name, base);
     qemu_fdt_add_subnode(vbi->fdt, nodename);
@@ -561,9 +572,14 @@ static void ranchu_init(MachineState *machine)
     }
     fdt_add_cpu_nodes(vbi);
 
-    memory_region_init_ram(ram, NULL, "ranchu.ram", machine->ram_size,
-                           &error_abort);
-    vmstate_register_ram_global(ram);
+    /* Takes the memdevs of -numa, to bind guest RAM to host nodes */
+    memory_region_allocate_system_memory(ram, NULL, "ranchu.ram",
+                                         machine->ram_size);
+#ifdef USE_ANDROID_EMU
+    if (android_init_error_occurred()) {
+        return;
+    }
+#endif  // USE_ANDROID_EMU
     memory_region_add_subregion(sysmem, memmap[RANCHU_MEM].base, ram);
 
     create_gic(vbi, pic);
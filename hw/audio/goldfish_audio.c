@@ -12,7 +12,9 @@
 #include "hw/hw.h"
 #include "audio/audio.h"
 #include "hw/sysbus.h"
+#include "exec/address-spaces.h"
 #include "qemu/error-report.h"
+#include "qemu/timer.h"
 #include "trace.h"
 
 #define TYPE_GOLDFISH_AUDIO "goldfish_audio"
@@ -46,14 +48,45 @@ enum {
 	AUDIO_SET_WRITE_BUFFER_2_HIGH = 0x30,
 	AUDIO_SET_READ_BUFFER_HIGH = 0x34,
 
+	/* AUDIO_FEATURE_xxx bits supported by the device */
+	AUDIO_FEATURES = 0x38,
+
+	/* descriptor rings, see struct goldfish_audio_ring */
+	AUDIO_OUT_RING_ADDR = 0x40,
+	AUDIO_OUT_RING_ADDR_HIGH = 0x44,
+	AUDIO_OUT_RING_SIZE = 0x48,
+	AUDIO_OUT_RING_TAIL = 0x4C,
+	AUDIO_OUT_RING_HEAD = 0x50,
+	AUDIO_IN_RING_ADDR = 0x54,
+	AUDIO_IN_RING_ADDR_HIGH = 0x58,
+	AUDIO_IN_RING_SIZE = 0x5C,
+	AUDIO_IN_RING_TAIL = 0x60,
+	AUDIO_IN_RING_HEAD = 0x64,
+
+	/* number of times playback ran out of data, and capture data
+	 * had no buffer to go to */
+	AUDIO_UNDERRUNS = 0x68,
+	AUDIO_OVERRUNS = 0x6C,
+
 	/* AUDIO_INT_STATUS bits */
 
 	/* this bit set when it is safe to write more bytes to the buffer */
 	AUDIO_INT_WRITE_BUFFER_1_EMPTY	= 1U << 0,
 	AUDIO_INT_WRITE_BUFFER_2_EMPTY	= 1U << 1,
 	AUDIO_INT_READ_BUFFER_FULL      = 1U << 2,
+	/* set when descriptors were completed, cleared by reading status */
+	AUDIO_INT_OUT_RING		= 1U << 3,
+	AUDIO_INT_IN_RING		= 1U << 4,
+
+	/* AUDIO_FEATURES bits */
+	AUDIO_FEATURE_RING		= 1U << 0,
 };
 
+/* Maximum number of descriptors in a ring, and of bytes moved between the
+ * guest and the audio backend at once. */
+#define AUDIO_RING_MAX_SIZE  256
+#define AUDIO_RING_CHUNK     4096
+
 struct goldfish_audio_buff {
     uint64_t  address;
     uint32_t  length;
@@ -63,11 +96,38 @@ struct goldfish_audio_buff {
 };
 
 
+/* With AUDIO_FEATURE_RING, instead of alternating between two buffers,
+ * the guest can queue up to AUDIO_RING_MAX_SIZE buffers for playback or
+ * capture. A ring is an array of |size| descriptors at |address|, size
+ * being a power of two, each made of a little-endian 64-bit buffer
+ * address, 32-bit buffer length and 32 reserved bits. The guest fills
+ * descriptors and moves the tail, the device processes them in order and
+ * moves the head. Both are free-running 32-bit counters, descriptor N
+ * being at index N % size. Writing a size enables the ring (0 disables
+ * it) and resets the counters.
+ */
+#define AUDIO_RING_DESC_SIZE 16
+
+struct goldfish_audio_ring {
+    uint64_t  address;
+    uint32_t  size;
+    uint32_t  head;
+    uint32_t  tail;
+    /* the descriptor at head, being processed */
+    uint64_t  cur_address;
+    uint32_t  cur_length;
+    uint32_t  cur_offset;
+};
+
 struct goldfish_audio_state {
     SysBusDevice parent;
 
     bool input;
     bool output;
+    // how long to keep the output voice open without data, and whether
+    // to feed it silence meanwhile
+    uint32_t idle_timeout_ms;
+    bool silence_fill;
 
     MemoryRegion iomem;
     qemu_irq irq;
@@ -87,6 +147,22 @@ struct goldfish_audio_state {
     struct goldfish_audio_buff  out_buffs[2];
     struct goldfish_audio_buff  in_buff;
 
+    // descriptor rings, and the bounce buffer between them and the voices
+    struct goldfish_audio_ring  out_ring;
+    struct goldfish_audio_ring  in_ring;
+    uint8_t  ring_data[AUDIO_RING_CHUNK];
+
+    // statistics, and whether the current playback or capture starved
+    uint32_t underruns;
+    uint32_t overruns;
+    bool out_playing;
+    bool in_starved;
+
+    // whether the output voice is active, and since when it has been
+    // out of data (QEMU_CLOCK_REALTIME, 0 if it isn't)
+    bool out_active;
+    int64_t out_idle_since;
+
     // for QEMU sound output
     QEMUSoundCard card;
     SWVoiceOut *voice;
@@ -185,8 +261,72 @@ goldfish_audio_buff_recv( struct goldfish_audio_buff*  b, int  avail, struct gol
     return read;
 }
 
+static void
+goldfish_audio_ring_set_size( struct goldfish_audio_ring*  r, uint32_t  size )
+{
+    if (size > AUDIO_RING_MAX_SIZE || (size & (size - 1))) {
+        error_report("goldfish_audio: bad ring size %u", size);
+        size = 0;
+    }
+    r->size = size;
+    r->head = 0;
+    r->tail = 0;
+    r->cur_length = 0;
+    r->cur_offset = 0;
+}
+
+static void
+goldfish_audio_ring_set_tail( struct goldfish_audio_ring*  r, uint32_t  tail )
+{
+    if (tail - r->head > r->size) {
+        error_report("goldfish_audio: bad ring tail %u (head %u, size %u)",
+                     tail, r->head, r->size);
+        return;
+    }
+    r->tail = tail;
+}
+
+/* Make the descriptor at head current if there is none, and return false
+ * if the ring is empty. Empty descriptors are completed at once. */
+static bool
+goldfish_audio_ring_load( struct goldfish_audio_ring*  r, uint32_t*  new_status,
+                          uint32_t  done_status )
+{
+    while (r->cur_offset == r->cur_length) {
+        hwaddr desc;
+
+        if (r->head == r->tail) {
+            return false;
+        }
+        desc = r->address + (r->head & (r->size - 1)) * AUDIO_RING_DESC_SIZE;
+        r->cur_address = ldq_le_phys(&address_space_memory, desc);
+        r->cur_length = ldl_le_phys(&address_space_memory, desc + 8);
+        r->cur_offset = 0;
+        if (!r->cur_length) {
+            r->head++;
+            *new_status |= done_status;
+        }
+    }
+    return true;
+}
+
+/* Account for |len| bytes of the current descriptor, completing it if
+ * it is done. */
+static void
+goldfish_audio_ring_advance( struct goldfish_audio_ring*  r, uint32_t  len,
+                             uint32_t*  new_status, uint32_t  done_status )
+{
+    r->cur_offset += len;
+    if (r->cur_offset == r->cur_length) {
+        r->cur_length = 0;
+        r->cur_offset = 0;
+        r->head++;
+        *new_status |= done_status;
+    }
+}
+
 /* update this whenever you change the goldfish_audio_state structure */
-#define  AUDIO_STATE_SAVE_VERSION  3
+#define  AUDIO_STATE_SAVE_VERSION  4
 
 static const VMStateDescription goldfish_audio_buff_vmsd = {
     .name = "goldfish_audio_buff",
@@ -203,6 +343,23 @@ static const VMStateDescription goldfish_audio_buff_vmsd = {
     }
 };
 
+static const VMStateDescription goldfish_audio_ring_vmsd = {
+    .name = "goldfish_audio_ring",
+    .version_id = AUDIO_STATE_SAVE_VERSION,
+    .minimum_version_id = AUDIO_STATE_SAVE_VERSION,
+    .minimum_version_id_old = AUDIO_STATE_SAVE_VERSION,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(address, struct goldfish_audio_ring),
+        VMSTATE_UINT32(size, struct goldfish_audio_ring),
+        VMSTATE_UINT32(head, struct goldfish_audio_ring),
+        VMSTATE_UINT32(tail, struct goldfish_audio_ring),
+        VMSTATE_UINT64(cur_address, struct goldfish_audio_ring),
+        VMSTATE_UINT32(cur_length, struct goldfish_audio_ring),
+        VMSTATE_UINT32(cur_offset, struct goldfish_audio_ring),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription goldfish_audio_vmsd = {
     .name = "goldfish_audio",
     .version_id = AUDIO_STATE_SAVE_VERSION,
@@ -217,6 +374,12 @@ static const VMStateDescription goldfish_audio_vmsd = {
                 goldfish_audio_buff_vmsd, struct goldfish_audio_buff),
         VMSTATE_STRUCT(in_buff, struct goldfish_audio_state, 0,
                 goldfish_audio_buff_vmsd, struct goldfish_audio_buff),
+        VMSTATE_STRUCT(out_ring, struct goldfish_audio_state, 0,
+                goldfish_audio_ring_vmsd, struct goldfish_audio_ring),
+        VMSTATE_STRUCT(in_ring, struct goldfish_audio_state, 0,
+                goldfish_audio_ring_vmsd, struct goldfish_audio_ring),
+        VMSTATE_UINT32(underruns, struct goldfish_audio_state),
+        VMSTATE_UINT32(overruns, struct goldfish_audio_state),
         VMSTATE_END_OF_LIST()
     }
 };
@@ -229,7 +392,8 @@ static void enable_audio(struct goldfish_audio_state *s, int enable)
     }
 
     if (s->voicein) {
-        AUD_set_active_in (s->voicein, (enable & AUDIO_INT_READ_BUFFER_FULL) != 0);
+        AUD_set_active_in (s->voicein,
+                (enable & (AUDIO_INT_READ_BUFFER_FULL | AUDIO_INT_IN_RING)) != 0);
         goldfish_audio_buff_reset( &s->in_buff );
     }
     s->current_buffer = -1;
@@ -253,8 +417,24 @@ static uint64_t goldfish_audio_read(void *opaque, hwaddr offset, unsigned size)
             if(ret) {
                 qemu_irq_lower(s->irq);
             }
+            s->int_status &= ~(AUDIO_INT_OUT_RING | AUDIO_INT_IN_RING);
             return ret;
 
+	case AUDIO_FEATURES:
+            return AUDIO_FEATURE_RING;
+
+	case AUDIO_OUT_RING_HEAD:
+            return s->out_ring.head;
+
+	case AUDIO_IN_RING_HEAD:
+            return s->in_ring.head;
+
+	case AUDIO_UNDERRUNS:
+            return s->underruns;
+
+	case AUDIO_OVERRUNS:
+            return s->overruns;
+
 	case AUDIO_READ_SUPPORTED:
             trace_goldfish_audio_memory_read("AUDIO_READ_SUPPORTED",
               (s->voicein != NULL));
@@ -273,6 +453,19 @@ static uint64_t goldfish_audio_read(void *opaque, hwaddr offset, unsigned size)
     }
 }
 
+/* Starting and stopping the host voice is expensive with some backends,
+ * so only do it when its state actually changes. */
+static void goldfish_audio_set_active_out(struct goldfish_audio_state *s,
+        bool active)
+{
+    s->out_idle_since = 0;
+    if (s->out_active != active) {
+        s->out_active = active;
+        trace_goldfish_audio_set_active_out(active);
+        AUD_set_active_out(s->voice, active);
+    }
+}
+
 static void goldfish_audio_write_buffer(struct goldfish_audio_state *s,
         unsigned int buf, uint32_t length)
 {
@@ -280,7 +473,7 @@ static void goldfish_audio_write_buffer(struct goldfish_audio_state *s,
         s->current_buffer = buf;
     goldfish_audio_buff_set_length(&s->out_buffs[buf], length);
     goldfish_audio_buff_read(&s->out_buffs[buf]);
-    AUD_set_active_out(s->voice, 1);
+    goldfish_audio_set_active_out(s, true);
 }
 
 static void goldfish_audio_write(void *opaque, hwaddr offset, uint64_t val,
@@ -341,6 +534,7 @@ static void goldfish_audio_write(void *opaque, hwaddr offset, uint64_t val,
         case AUDIO_START_READ:
             trace_goldfish_audio_memory_write("AUDIO_START_READ", val);
             start_read(s, val);
+            s->in_starved = false;
             s->int_status &= ~AUDIO_INT_READ_BUFFER_FULL;
             qemu_set_irq(s->irq, s->int_status & s->int_enable);
             break;
@@ -352,6 +546,40 @@ static void goldfish_audio_write(void *opaque, hwaddr offset, uint64_t val,
                                               val);
             break;
 
+        case AUDIO_OUT_RING_ADDR:
+            s->out_ring.address = deposit64(s->out_ring.address, 0, 32, val);
+            break;
+        case AUDIO_OUT_RING_ADDR_HIGH:
+            s->out_ring.address = deposit64(s->out_ring.address, 32, 32, val);
+            break;
+        case AUDIO_OUT_RING_SIZE:
+            trace_goldfish_audio_memory_write("AUDIO_OUT_RING_SIZE", val);
+            goldfish_audio_ring_set_size(&s->out_ring, val);
+            break;
+        case AUDIO_OUT_RING_TAIL:
+            /* new buffers to play */
+            goldfish_audio_ring_set_tail(&s->out_ring, val);
+            if (s->voice && s->out_ring.head != s->out_ring.tail) {
+                goldfish_audio_set_active_out(s, true);
+            }
+            break;
+
+        case AUDIO_IN_RING_ADDR:
+            s->in_ring.address = deposit64(s->in_ring.address, 0, 32, val);
+            break;
+        case AUDIO_IN_RING_ADDR_HIGH:
+            s->in_ring.address = deposit64(s->in_ring.address, 32, 32, val);
+            break;
+        case AUDIO_IN_RING_SIZE:
+            trace_goldfish_audio_memory_write("AUDIO_IN_RING_SIZE", val);
+            goldfish_audio_ring_set_size(&s->in_ring, val);
+            break;
+        case AUDIO_IN_RING_TAIL:
+            /* new buffers to fill */
+            goldfish_audio_ring_set_tail(&s->in_ring, val);
+            s->in_starved = false;
+            break;
+
         default:
             error_report ("goldfish_audio_write: Bad offset 0x" TARGET_FMT_plx,
                     offset);
@@ -374,6 +602,7 @@ static bool goldfish_audio_flush(struct goldfish_audio_state *s, int buf,
     b->offset += written;
     b->length -= written;
     *free -= written;
+    s->out_playing = true;
     trace_goldfish_audio_buff_send(written, buf + 1);
 
     /* If buffer is drained, set corresponding status bit. */
@@ -384,12 +613,66 @@ static bool goldfish_audio_flush(struct goldfish_audio_state *s, int buf,
     return true;
 }
 
+/* Play the buffers of the output ring. */
+static void goldfish_audio_ring_play(struct goldfish_audio_state *s,
+        int *free, uint32_t *new_status)
+{
+    struct goldfish_audio_ring *r = &s->out_ring;
+
+    while (*free > 0 &&
+           goldfish_audio_ring_load(r, new_status, AUDIO_INT_OUT_RING)) {
+        int chunk = audio_MIN(r->cur_length - r->cur_offset,
+                              audio_MIN(*free, AUDIO_RING_CHUNK));
+        int written;
+
+        cpu_physical_memory_read(r->cur_address + r->cur_offset,
+                                 s->ring_data, chunk);
+        written = AUD_write(s->voice, s->ring_data, chunk);
+        if (!written)
+            break;
+
+        *free -= written;
+        s->out_playing = true;
+        trace_goldfish_audio_buff_send(written, 0);
+        goldfish_audio_ring_advance(r, written, new_status, AUDIO_INT_OUT_RING);
+    }
+}
+
+/* Out of samples: pause playback, unless it has been idle for less than
+ * idle_timeout_ms, so that short gaps in bursty output don't restart the
+ * host voice. With silence_fill, the gap is filled with silence rather
+ * than left to the backend, which some of them don't handle smoothly. */
+static void goldfish_audio_idle(struct goldfish_audio_state *s, int free)
+{
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    if (!s->out_idle_since) {
+        s->out_idle_since = now;
+    }
+    if (now - s->out_idle_since >= s->idle_timeout_ms) {
+        goldfish_audio_set_active_out(s, false);
+        return;
+    }
+    if (s->silence_fill) {
+        memset(s->ring_data, 0, sizeof(s->ring_data));
+        while (free > 0) {
+            int written = AUD_write(s->voice, s->ring_data,
+                                    audio_MIN(free, AUDIO_RING_CHUNK));
+            if (!written)
+                break;
+            free -= written;
+        }
+    }
+}
+
 static void goldfish_audio_callback(void *opaque, int free)
 {
     struct goldfish_audio_state *s = opaque;
     uint32_t new_status = 0;
 
-    if (s->current_buffer != -1) {
+    if (s->out_ring.size) {
+        goldfish_audio_ring_play(s, &free, &new_status);
+    } else if (s->current_buffer != -1) {
         int8_t i = s->current_buffer;
         int8_t j = (i + 1) % 2;
 
@@ -405,8 +688,15 @@ static void goldfish_audio_callback(void *opaque, int free)
         }
     }
 
-    if (free) /* out of samples, pause playback */
-        AUD_set_active_out(s->voice, 0);
+    if (free) {
+        if (s->out_playing) {
+            s->underruns++;
+            s->out_playing = false;
+        }
+        goldfish_audio_idle(s, free);
+    } else {
+        s->out_idle_since = 0;
+    }
 
     if (new_status && new_status != s->int_status) {
         s->int_status |= new_status;
@@ -414,14 +704,60 @@ static void goldfish_audio_callback(void *opaque, int free)
     }
 }
 
+/* Fill the buffers of the input ring, return false if there was no room
+ * for all the available data. */
+static bool goldfish_audio_ring_record(struct goldfish_audio_state *s,
+        int avail, uint32_t *new_status)
+{
+    struct goldfish_audio_ring *r = &s->in_ring;
+
+    while (avail > 0) {
+        int chunk, read;
+
+        if (!goldfish_audio_ring_load(r, new_status, AUDIO_INT_IN_RING)) {
+            return false;
+        }
+        chunk = audio_MIN(r->cur_length - r->cur_offset,
+                          audio_MIN(avail, AUDIO_RING_CHUNK));
+        read = AUD_read(s->voicein, s->ring_data, chunk);
+        if (read == 0)
+            break;
+
+        trace_goldfish_audio_buff_recv(chunk, read);
+        cpu_physical_memory_write(r->cur_address + r->cur_offset,
+                                  s->ring_data, read);
+        avail -= read;
+        goldfish_audio_ring_advance(r, read, new_status, AUDIO_INT_IN_RING);
+    }
+    return true;
+}
+
 static void
 goldfish_audio_in_callback(void *opaque, int avail)
 {
     struct goldfish_audio_state *s = opaque;
-    int new_status = 0;
+    uint32_t new_status = 0;
+
+    if (s->in_ring.size) {
+        if (!goldfish_audio_ring_record(s, avail, &new_status) &&
+            !s->in_starved) {
+            s->overruns++;
+            s->in_starved = true;
+        }
+        if (new_status && new_status != s->int_status) {
+            s->int_status |= new_status;
+            qemu_set_irq(s->irq, s->int_status & s->int_enable);
+        }
+        return;
+    }
 
-    if (goldfish_audio_buff_available( &s->in_buff ) == 0 )
+    if (goldfish_audio_buff_available( &s->in_buff ) == 0 ) {
+        if (avail > 0 && !s->in_starved) {
+            s->overruns++;
+            s->in_starved = true;
+        }
         return;
+    }
 
     while (avail > 0) {
         int  read = goldfish_audio_buff_recv( &s->in_buff, avail, s );
@@ -519,6 +855,10 @@ static void goldfish_audio_realize(DeviceState *dev, Error **errp)
 static Property goldfish_audio_properties[] = {
     DEFINE_PROP_BOOL("input", struct goldfish_audio_state, input, true),
     DEFINE_PROP_BOOL("output", struct goldfish_audio_state, output, true),
+    DEFINE_PROP_UINT32("idle-timeout-ms", struct goldfish_audio_state,
+                       idle_timeout_ms, 500),
+    DEFINE_PROP_BOOL("silence-fill", struct goldfish_audio_state,
+                     silence_fill, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -87,13 +87,10 @@ static void complete_request_vring(VirtIOBlockReq *req, unsigned char status)
     qemu_bh_schedule(s->bh);
 }
 
-static void handle_notify(EventNotifier *e)
+static void process_vring(VirtIOBlockDataPlane *s)
 {
-    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           host_notifier);
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
 
-    event_notifier_test_and_clear(&s->host_notifier);
     blk_io_plug(s->conf->conf.blk);
     for (;;) {
         MultiReqBuffer mrb = {
@@ -136,6 +133,28 @@ static void handle_notify(EventNotifier *e)
     blk_io_unplug(s->conf->conf.blk);
 }
 
+static void handle_notify(EventNotifier *e)
+{
+    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
+                                           host_notifier);
+
+    event_notifier_test_and_clear(&s->host_notifier);
+    process_vring(s);
+}
+
+/* Called while the iothread spins, so it must be cheap when idle */
+static bool handle_notify_poll(void *opaque)
+{
+    VirtIOBlockDataPlane *s = container_of(opaque, VirtIOBlockDataPlane,
+                                           host_notifier);
+
+    if (s->vring.broken || !vring_more_avail(&s->vring)) {
+        return false;
+    }
+    process_vring(s);
+    return true;
+}
+
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   VirtIOBlockDataPlane **dataplane,
@@ -152,6 +171,14 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
         return;
     }
 
+    /* Data plane services a single vring from its IOThread */
+    if (conf->num_queues > 1) {
+        error_setg(errp,
+                   "device is incompatible with x-data-plane "
+                   "(num-queues > 1 is not supported)");
+        return;
+    }
+
     /* Don't try if transport does not support notifiers. */
     if (!k->set_guest_notifiers || !k->set_host_notifier) {
         error_setg(errp,
@@ -276,6 +303,7 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     /* Get this show started by hooking up our callbacks */
     aio_context_acquire(s->ctx);
     aio_set_event_notifier(s->ctx, &s->host_notifier, handle_notify);
+    aio_set_event_notifier_poll(s->ctx, &s->host_notifier, handle_notify_poll);
     aio_context_release(s->ctx);
     return;
 
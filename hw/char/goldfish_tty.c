@@ -15,9 +15,11 @@
 #include "hw/hw.h"
 #include "exec/address-spaces.h"
 #include "hw/sysbus.h"
+#include "qemu/main-loop.h"
 #include "sysemu/sysemu.h"
 
-#define TTY_DEVICE_VERSION 1
+/* Version 2 adds the asynchronous write registers and commands. */
+#define TTY_DEVICE_VERSION 2
 
 enum {
     TTY_PUT_CHAR       = 0x00,
@@ -30,12 +32,47 @@ enum {
 
     TTY_VERSION        = 0x20,
 
+    /* number of bytes taken by the last TTY_CMD_WRITE_BUFFER */
+    TTY_WRITTEN        = 0x24,
+    /* free space in the write queue, reading it acknowledges the
+     * interrupt requested by TTY_CMD_WRITE_WAIT */
+    TTY_WRITE_SPACE    = 0x28,
+
     TTY_CMD_INT_DISABLE    = 0,
     TTY_CMD_INT_ENABLE     = 1,
     TTY_CMD_WRITE_BUFFER   = 2,
     TTY_CMD_READ_BUFFER    = 3,
+    /* the driver checks TTY_WRITTEN, see below */
+    TTY_CMD_WRITE_PARTIAL  = 4,
+    /* raise the interrupt when the write queue is half empty */
+    TTY_CMD_WRITE_WAIT     = 5,
+};
+
+/* With the async-write property, TTY_CMD_WRITE_BUFFER copies the guest
+ * data into a queue drained by the main loop, instead of writing to the
+ * chardev from the vCPU, so that a slow backend doesn't stall the guest.
+ * When the queue is full, a driver that sent TTY_CMD_WRITE_PARTIAL only
+ * gets part of its data taken, as reported by TTY_WRITTEN, and can ask
+ * for an interrupt with TTY_CMD_WRITE_WAIT to retry. For other drivers,
+ * the queue and the data are written synchronously as before, so nothing
+ * is lost.
+ */
+
+/* A circular buffer of |size| bytes, holding |count| bytes from |head| */
+struct tty_fifo {
+    uint8_t *data;
+    uint32_t size;
+    uint32_t head;
+    uint32_t count;
 };
 
+/* Without async_write, TTY_PUT_CHAR bytes are still gathered so that the
+ * chardev gets a line at a time rather than one write per byte.  They go
+ * out at the end of a line, when the buffer is full, before any other
+ * output, or from the bottom half at the latest.
+ */
+#define GOLDFISH_TTY_PUTC_BUFFER 128
+
 struct tty_state {
     SysBusDevice parent;
 
@@ -46,11 +83,28 @@ struct tty_state {
     uint64_t ptr;
     uint32_t ptr_len;
     uint32_t ready;
-    uint8_t data[128];
-    uint32_t data_count;
+    /* Received bytes waiting for the guest */
+    struct tty_fifo rx;
+
+    /* Bytes waiting to be written to the chardev, with async_write */
+    bool async_write;
+    struct tty_fifo tx;
+    QEMUBH *tx_bh;
+    guint tx_watch;
+    uint32_t written;
+    bool write_partial;
+    bool write_wait;
+    bool write_irq;
+
+    /* TTY_PUT_CHAR bytes not written yet, without async_write */
+    uint8_t putc_buf[GOLDFISH_TTY_PUTC_BUFFER];
+    uint32_t putc_len;
 };
 
-#define  GOLDFISH_TTY_SAVE_VERSION  2
+#define  GOLDFISH_TTY_SAVE_VERSION  4
+
+/* Smallest receive buffer, the fixed size of older versions. */
+#define  GOLDFISH_TTY_MIN_BUFFER  128
 
 #define TYPE_GOLDFISH_TTY "goldfish_tty"
 #define GOLDFISH_TTY(obj) OBJECT_CHECK(struct tty_state, (obj), TYPE_GOLDFISH_TTY)
@@ -58,38 +112,247 @@ struct tty_state {
 /* Number of instantiated TTYs */
 static int  instance_id = 0;
 
+static void tty_fifo_init(struct tty_fifo *f, uint32_t min_size)
+{
+    f->size = MAX(f->size, min_size);
+    f->data = g_malloc(f->size);
+    f->head = 0;
+    f->count = 0;
+}
+
+/* Copy |len| bytes out of the fifo at |dst|, oldest first. */
+static void tty_fifo_pop(struct tty_fifo *f, uint8_t *dst, uint32_t len)
+{
+    uint32_t first = MIN(len, f->size - f->head);
+
+    memcpy(dst, f->data + f->head, first);
+    memcpy(dst + first, f->data, len - first);
+    f->head = (f->head + len) % f->size;
+    f->count -= len;
+}
+
+/* Append |len| bytes at |src| to the fifo, which must have room for
+ * them. */
+static void tty_fifo_push(struct tty_fifo *f, const uint8_t *src,
+                          uint32_t len)
+{
+    uint32_t tail = (f->head + f->count) % f->size;
+    uint32_t first = MIN(len, f->size - tail);
+
+    memcpy(f->data + tail, src, first);
+    memcpy(f->data, src + first, len - first);
+    f->count += len;
+}
+
+static void tty_fifo_save(QEMUFile *f, struct tty_fifo *fifo)
+{
+    uint32_t first = MIN(fifo->count, fifo->size - fifo->head);
+
+    qemu_put_be32(f, fifo->count);
+    qemu_put_buffer(f, fifo->data + fifo->head, first);
+    qemu_put_buffer(f, fifo->data, fifo->count - first);
+}
+
+static int tty_fifo_load(QEMUFile *f, struct tty_fifo *fifo, uint32_t count)
+{
+    /* The source may have had a larger buffer. */
+    if (count > fifo->size) {
+        fifo->data = g_realloc(fifo->data, count);
+        fifo->size = count;
+    }
+    fifo->head  = 0;
+    fifo->count = count;
+    if (qemu_get_buffer(f, fifo->data, count) != count)
+        return -1;
+    return 0;
+}
+
+static void goldfish_tty_update_irq(struct tty_state *s)
+{
+    qemu_set_irq(s->irq, (s->ready && s->rx.count > 0) || s->write_irq);
+}
+
+static gboolean goldfish_tty_tx_watch(GIOChannel *chan, GIOCondition cond,
+                                      void *opaque);
+
+/* Write as much of the queue as the chardev takes without blocking, and
+ * wait for it to be writable again if it didn't take everything. */
+static void goldfish_tty_tx_drain(struct tty_state *s)
+{
+    if (s->tx.count > 0) {
+        /* Both halves of a wrapped queue in one go */
+        uint32_t first = MIN(s->tx.count, s->tx.size - s->tx.head);
+        struct iovec iov[2] = {
+            { .iov_base = s->tx.data + s->tx.head, .iov_len = first },
+            { .iov_base = s->tx.data, .iov_len = s->tx.count - first },
+        };
+        int n = qemu_chr_fe_writev(s->cs, iov, iov[1].iov_len ? 2 : 1);
+
+        if (n > 0) {
+            s->tx.head = (s->tx.head + n) % s->tx.size;
+            s->tx.count -= n;
+        }
+    }
+
+    if (s->tx.count > 0 && !s->tx_watch) {
+        int tag = qemu_chr_fe_add_watch(s->cs, G_IO_OUT | G_IO_HUP,
+                                        goldfish_tty_tx_watch, s);
+        if (tag <= 0) {
+            /* The backend can't tell when it is writable. */
+            uint8_t buf[256];
+            while (s->tx.count > 0) {
+                uint32_t n = MIN(s->tx.count, sizeof(buf));
+                tty_fifo_pop(&s->tx, buf, n);
+                qemu_chr_fe_write_all(s->cs, buf, n);
+            }
+        } else {
+            s->tx_watch = tag;
+        }
+    }
+
+    if (s->write_wait && s->tx.count <= s->tx.size / 2) {
+        s->write_wait = false;
+        s->write_irq = true;
+        goldfish_tty_update_irq(s);
+    }
+}
+
+static gboolean goldfish_tty_tx_watch(GIOChannel *chan, GIOCondition cond,
+                                      void *opaque)
+{
+    struct tty_state *s = opaque;
+
+    s->tx_watch = 0;
+    goldfish_tty_tx_drain(s);
+    return FALSE;
+}
+
+static void goldfish_tty_putc_flush(struct tty_state *s)
+{
+    if (s->putc_len) {
+        qemu_chr_fe_write(s->cs, s->putc_buf, s->putc_len);
+        s->putc_len = 0;
+    }
+}
+
+static void goldfish_tty_tx_bh(void *opaque)
+{
+    struct tty_state *s = opaque;
+
+    goldfish_tty_putc_flush(s);
+    if (s->async_write && !s->tx_watch) {
+        goldfish_tty_tx_drain(s);
+    }
+}
+
+static void goldfish_tty_putc(struct tty_state *s, uint8_t ch)
+{
+    if (!s->putc_len) {
+        qemu_bh_schedule(s->tx_bh);
+    }
+    s->putc_buf[s->putc_len++] = ch;
+    if (ch == '\n' || s->putc_len == sizeof(s->putc_buf)) {
+        goldfish_tty_putc_flush(s);
+    }
+}
+
+/* Write |len| bytes for the guest, and return how many were taken. */
+static uint32_t goldfish_tty_send(struct tty_state *s, const uint8_t *buf,
+                                  uint32_t len)
+{
+    uint32_t n;
+
+    if (!s->async_write) {
+        if (s->putc_len) {
+            struct iovec iov[2] = {
+                { .iov_base = s->putc_buf, .iov_len = s->putc_len },
+                { .iov_base = (void *)buf, .iov_len = len },
+            };
+            qemu_chr_fe_writev(s->cs, iov, 2);
+            s->putc_len = 0;
+        } else {
+            qemu_chr_fe_write(s->cs, buf, len);
+        }
+        return len;
+    }
+
+    n = MIN(len, s->tx.size - s->tx.count);
+    tty_fifo_push(&s->tx, buf, n);
+    if (n < len && !s->write_partial) {
+        /* Keep the old blocking behaviour rather than losing data. */
+        uint8_t chunk[256];
+        while (s->tx.count > 0) {
+            uint32_t c = MIN(s->tx.count, sizeof(chunk));
+            tty_fifo_pop(&s->tx, chunk, c);
+            qemu_chr_fe_write_all(s->cs, chunk, c);
+        }
+        qemu_chr_fe_write_all(s->cs, buf + n, len - n);
+        n = len;
+    }
+    if (s->tx.count > 0) {
+        qemu_bh_schedule(s->tx_bh);
+    }
+    return n;
+}
+
 static void goldfish_tty_save(QEMUFile*  f, void*  opaque)
 {
     struct tty_state*  s = opaque;
 
+    if (s->cs) {
+        goldfish_tty_putc_flush(s);
+    }
     qemu_put_be64( f, s->ptr );
     qemu_put_be32( f, s->ptr_len );
     qemu_put_byte( f, s->ready );
-    qemu_put_byte( f, s->data_count );
-    qemu_put_buffer( f, s->data, s->data_count );
+    tty_fifo_save( f, &s->rx );
+    tty_fifo_save( f, &s->tx );
+    qemu_put_be32( f, s->written );
+    qemu_put_byte( f, s->write_partial );
+    qemu_put_byte( f, s->write_wait );
+    qemu_put_byte( f, s->write_irq );
 }
 
 static int goldfish_tty_load(QEMUFile*  f, void*  opaque, int  version_id)
 {
     struct tty_state*  s = opaque;
+    uint32_t count;
 
-    if ((version_id != GOLDFISH_TTY_SAVE_VERSION) &&
-        (version_id != (GOLDFISH_TTY_SAVE_VERSION - 1))) {
+    if (version_id < 1 || version_id > GOLDFISH_TTY_SAVE_VERSION) {
         return -1;
     }
-    if (version_id == (GOLDFISH_TTY_SAVE_VERSION - 1)) {
+    if (version_id == 1) {
         s->ptr    = (uint64_t)qemu_get_be32(f);
     } else {
         s->ptr    = qemu_get_be64(f);
     }
     s->ptr_len    = qemu_get_be32(f);
     s->ready      = qemu_get_byte(f);
-    s->data_count = qemu_get_byte(f);
-
-    if (qemu_get_buffer(f, s->data, s->data_count) < 0)
+    if (version_id < 3) {
+        count = qemu_get_byte(f);
+    } else {
+        count = qemu_get_be32(f);
+    }
+    if (tty_fifo_load(f, &s->rx, count) < 0)
         return -1;
 
-    qemu_set_irq(s->irq, s->ready && s->data_count > 0);
+    if (version_id >= 4) {
+        if (tty_fifo_load(f, &s->tx, qemu_get_be32(f)) < 0)
+            return -1;
+        s->written       = qemu_get_be32(f);
+        s->write_partial = qemu_get_byte(f);
+        s->write_wait    = qemu_get_byte(f);
+        s->write_irq     = qemu_get_byte(f);
+        if (s->tx.count > 0) {
+            if (s->cs) {
+                qemu_bh_schedule(s->tx_bh);
+            } else {
+                s->tx.count = 0;
+            }
+        }
+    }
+
+    goldfish_tty_update_irq(s);
     return 0;
 }
 
@@ -99,9 +362,17 @@ static uint64_t goldfish_tty_read(void *opaque, hwaddr offset, unsigned size)
 
     switch (offset) {
         case TTY_BYTES_READY:
-            return s->data_count;
+            return s->rx.count;
         case TTY_VERSION:
             return TTY_DEVICE_VERSION;
+        case TTY_WRITTEN:
+            return s->written;
+        case TTY_WRITE_SPACE:
+            if (s->write_irq) {
+                s->write_irq = false;
+                goldfish_tty_update_irq(s);
+            }
+            return s->async_write ? s->tx.size - s->tx.count : UINT32_MAX;
     default:
         cpu_abort(current_cpu,
                   "goldfish_tty_read: Bad offset %" HWADDR_PRIx "\n",
@@ -118,35 +389,36 @@ static void goldfish_tty_write(void *opaque, hwaddr offset,
     switch(offset) {
         case TTY_PUT_CHAR: {
             uint8_t ch = value;
-            if(s->cs)
-                qemu_chr_fe_write(s->cs, &ch, 1);
+            if(s->cs) {
+                if (s->async_write) {
+                    goldfish_tty_send(s, &ch, 1);
+                } else {
+                    goldfish_tty_putc(s, ch);
+                }
+            }
         } break;
 
         case TTY_CMD:
             switch(value) {
                 case TTY_CMD_INT_DISABLE:
-                    if(s->ready) {
-                        if(s->data_count > 0)
-                            qemu_set_irq(s->irq, 0);
-                        s->ready = 0;
-                    }
+                    s->ready = 0;
+                    goldfish_tty_update_irq(s);
                     break;
 
                 case TTY_CMD_INT_ENABLE:
-                    if(!s->ready) {
-                        if(s->data_count > 0)
-                            qemu_set_irq(s->irq, 1);
-                        s->ready = 1;
-                    }
+                    s->ready = 1;
+                    goldfish_tty_update_irq(s);
                     break;
 
                 case TTY_CMD_WRITE_BUFFER:
+                    s->written = 0;
                     if(s->cs) {
                         hwaddr l = s->ptr_len;
                         void *ptr;
 
                         ptr = cpu_physical_memory_map(s->ptr, &l, 0);
-                        qemu_chr_fe_write(s->cs, (const uint8_t*)ptr, l);
+                        s->written = goldfish_tty_send(s, (const uint8_t*)ptr,
+                                                       l);
                         cpu_physical_memory_unmap(ptr, l, 0, 0);
                     }
                     break;
@@ -156,21 +428,31 @@ static void goldfish_tty_write(void *opaque, hwaddr offset,
                         hwaddr l = s->ptr_len;
                         void *ptr;
 
-                        if(s->ptr_len > s->data_count)
+                        if(s->ptr_len > s->rx.count)
                             cpu_abort(current_cpu,
                                       "goldfish_tty_write: reading"
                                       " more data than available %d %d\n",
-                                      s->ptr_len, s->data_count);
+                                      s->ptr_len, s->rx.count);
 
                         ptr = cpu_physical_memory_map(s->ptr, &l, 1);
-                        memcpy(ptr, s->data, l);
+                        tty_fifo_pop(&s->rx, ptr, l);
                         cpu_physical_memory_unmap(ptr, l, 1, l);
 
-                        if(s->data_count > l)
-                            memmove(s->data, s->data + l, s->data_count - l);
-                        s->data_count -= l;
-                        if(s->data_count == 0 && s->ready)
-                            qemu_set_irq(s->irq, 0);
+                        if(s->rx.count == 0)
+                            goldfish_tty_update_irq(s);
+                    }
+                    break;
+
+                case TTY_CMD_WRITE_PARTIAL:
+                    s->write_partial = true;
+                    break;
+
+                case TTY_CMD_WRITE_WAIT:
+                    if (s->async_write && s->tx.count > s->tx.size / 2) {
+                        s->write_wait = true;
+                    } else {
+                        s->write_irq = true;
+                        goldfish_tty_update_irq(s);
                     }
                     break;
 
@@ -208,17 +490,15 @@ static int tty_can_receive(void *opaque)
 {
     struct tty_state *s = opaque;
 
-    return (sizeof(s->data) - s->data_count);
+    return (s->rx.size - s->rx.count);
 }
 
 static void tty_receive(void *opaque, const uint8_t *buf, int size)
 {
     struct tty_state *s = opaque;
 
-    memcpy(s->data + s->data_count, buf, size);
-    s->data_count += size;
-    if(s->data_count > 0 && s->ready)
-        qemu_set_irq(s->irq, 1);
+    tty_fifo_push(&s->rx, buf, size);
+    goldfish_tty_update_irq(s);
 }
 
 static const MemoryRegionOps mips_qemu_ops = {
@@ -239,8 +519,20 @@ static void goldfish_tty_realize(DeviceState *dev, Error **errp)
                   MAX_SERIAL_PORTS);
     }
 
+    tty_fifo_init(&s->rx, GOLDFISH_TTY_MIN_BUFFER);
+    if (s->async_write) {
+        tty_fifo_init(&s->tx, GOLDFISH_TTY_MIN_BUFFER);
+    } else {
+        s->tx.size = 0;
+    }
+    s->tx_bh = qemu_bh_new(goldfish_tty_tx_bh, s);
+
     memory_region_init_io(&s->iomem, OBJECT(s), &mips_qemu_ops, s,
             "goldfish_tty", 0x1000);
+    /* The buffer registers only latch values for the next TTY_CMD, so
+     * their writes needn't exit to us right away with KVM. */
+    memory_region_add_coalescing(&s->iomem, TTY_DATA_PTR,
+                                 TTY_VERSION - TTY_DATA_PTR);
     sysbus_init_mmio(sbdev, &s->iomem);
     sysbus_init_irq(sbdev, &s->irq);
 
@@ -262,12 +554,20 @@ static void goldfish_tty_realize(DeviceState *dev, Error **errp)
                     s);
 }
 
+static Property goldfish_tty_properties[] = {
+    DEFINE_PROP_UINT32("rx-buffer-size", struct tty_state, rx.size, 4096),
+    DEFINE_PROP_BOOL("async-write", struct tty_state, async_write, false),
+    DEFINE_PROP_UINT32("tx-queue-size", struct tty_state, tx.size, 65536),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void goldfish_tty_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->realize = goldfish_tty_realize;
     dc->desc = "goldfish tty";
+    dc->props = goldfish_tty_properties;
 }
 
 static const TypeInfo goldfish_tty_info = {
@@ -0,0 +1,56 @@
+/*
+ * Level-triggered interrupt lines raised through a KVM irqfd
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "hw/irqfd-line.h"
+#include "sysemu/kvm.h"
+
+static void irqfd_line_resample(EventNotifier *notifier)
+{
+    IrqfdLine *line = container_of(notifier, IrqfdLine, resample);
+
+    if (event_notifier_test_and_clear(notifier) &&
+        line->pending(line->opaque)) {
+        event_notifier_set(&line->set);
+    }
+}
+
+bool irqfd_line_init(IrqfdLine *line, int gsi, bool (*pending)(void *opaque),
+                     void *opaque)
+{
+    line->active = false;
+    if (gsi < 0 || !kvm_irqfds_enabled() || !kvm_gsi_direct_mapping()) {
+        return false;
+    }
+    if (event_notifier_init(&line->set, 0) < 0) {
+        return false;
+    }
+    if (event_notifier_init(&line->resample, 0) < 0) {
+        event_notifier_cleanup(&line->set);
+        return false;
+    }
+    /* Without resampling, a level-triggered line can't be kept raised */
+    if (kvm_irqchip_add_irqfd_notifier(kvm_state, &line->set,
+                                       &line->resample, gsi) < 0) {
+        event_notifier_cleanup(&line->resample);
+        event_notifier_cleanup(&line->set);
+        return false;
+    }
+    line->pending = pending;
+    line->opaque = opaque;
+    line->gsi = gsi;
+    line->active = true;
+    event_notifier_set_handler(&line->resample, irqfd_line_resample);
+    return true;
+}
+
+void irqfd_line_raise(IrqfdLine *line)
+{
+    event_notifier_set(&line->set);
+}
@@ -51,8 +51,12 @@
 #include "hw/nvram/fw_cfg.h"
 #include "exec/memory.h"
 #include "exec/address-spaces.h"
+#include "qemu/thread.h"
 
 #include <zlib.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 bool option_rom_has_mr = false;
 bool rom_file_has_mr = true;
@@ -620,16 +624,88 @@ int load_ramdisk(const char *filename, hwaddr addr, uint64_t max_sz)
  */
 #define LOAD_IMAGE_MAX_GUNZIP_BYTES (256 << 20)
 
-/* Load a gzip-compressed kernel. */
-int load_image_gzipped(const char *filename, hwaddr addr, uint64_t max_sz)
+static uint8_t *rom_map_fd(int fd, size_t size);
+static void rom_add_image(const char *name, uint8_t *data, size_t size,
+                          bool mapped, hwaddr addr);
+
+struct GunzipJob {
+    char *filename;
+    size_t max_sz;
+    QemuThread thread;
+    bool threaded;
+    /* Only take files that are exactly one gzip member */
+    bool whole_file;
+
+    /* The decompressed image, mapped from the cache if @mapped */
+    uint8_t *data;
+    ssize_t size;
+    bool mapped;
+};
+
+/* Decompressed images are kept in $ANDROID_IMAGE_CACHE if set, named after
+ * the hash of the compressed file.
+ */
+static char *gunzip_cache_path(const uint8_t *compressed_data, size_t len)
+{
+#if GLIB_CHECK_VERSION(2, 16, 0)
+    const char *cache_dir = getenv("ANDROID_IMAGE_CACHE");
+    char *sum, *path;
+
+    if (!cache_dir || !cache_dir[0]) {
+        return NULL;
+    }
+    sum = g_compute_checksum_for_data(G_CHECKSUM_SHA256, compressed_data, len);
+    path = g_strdup_printf("%s/%s.img", cache_dir, sum);
+    g_free(sum);
+    return path;
+#else
+    return NULL;
+#endif
+}
+
+/* Returns whether @job was found in the cache, at @path */
+static bool gunzip_cache_lookup(GunzipJob *job, const char *path)
+{
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size <= 0 || st.st_size > job->max_sz) {
+        close(fd);
+        return false;
+    }
+    job->data = rom_map_fd(fd, st.st_size);
+    if (job->data) {
+        job->mapped = true;
+    } else {
+        job->data = g_malloc(st.st_size);
+        if (read(fd, job->data, st.st_size) != st.st_size) {
+            g_free(job->data);
+            job->data = NULL;
+        }
+    }
+    close(fd);
+    if (!job->data) {
+        return false;
+    }
+    job->size = st.st_size;
+    return true;
+}
+
+static void *gunzip_job_run(void *opaque)
 {
+    GunzipJob *job = opaque;
     uint8_t *compressed_data = NULL;
-    uint8_t *data = NULL;
+    char *cache_path = NULL;
+    uint8_t *data;
     gsize len;
     ssize_t bytes;
-    int ret = -1;
 
-    if (!g_file_get_contents(filename, (char **) &compressed_data, &len,
+    job->size = -1;
+    if (!g_file_get_contents(job->filename, (char **) &compressed_data, &len,
                              NULL)) {
         goto out;
     }
@@ -641,27 +717,106 @@ int load_image_gzipped(const char *filename, hwaddr addr, uint64_t max_sz)
         goto out;
     }
 
-    if (max_sz > LOAD_IMAGE_MAX_GUNZIP_BYTES) {
-        max_sz = LOAD_IMAGE_MAX_GUNZIP_BYTES;
+    cache_path = gunzip_cache_path(compressed_data, len);
+    if (cache_path && gunzip_cache_lookup(job, cache_path)) {
+        goto out;
     }
 
-    data = g_malloc(max_sz);
-    bytes = gunzip(data, max_sz, compressed_data, len);
-    if (bytes < 0) {
-        fprintf(stderr, "%s: unable to decompress gzipped kernel file\n",
-                filename);
+    data = g_malloc(job->max_sz);
+    bytes = gunzip(data, job->max_sz, compressed_data, len);
+    if (bytes <= 0) {
+        fprintf(stderr, "%s: unable to decompress gzipped image file\n",
+                job->filename);
+        g_free(data);
         goto out;
     }
-
-    rom_add_blob_fixed(filename, data, bytes, addr);
-    ret = bytes;
+    /* The size ends the member, anything else is loaded as is */
+    if (job->whole_file && (len < 18 ||
+                            (uint32_t)ldl_le_p(compressed_data + len - 4) !=
+                            (uint32_t)bytes)) {
+        g_free(data);
+        goto out;
+    }
+    /* Give back the part of the buffer that was not used */
+    job->data = g_realloc(data, bytes);
+    job->size = bytes;
+
+    if (cache_path) {
+        /* Written to a temporary file and renamed, so another emulator
+         * never maps a partial image */
+        g_file_set_contents(cache_path, (char *)job->data, bytes, NULL);
+    }
 
  out:
     g_free(compressed_data);
-    g_free(data);
+    g_free(cache_path);
+    return NULL;
+}
+
+GunzipJob *load_image_gzipped_start(const char *filename, uint64_t max_sz)
+{
+    GunzipJob *job = g_new0(GunzipJob, 1);
+
+    job->filename = g_strdup(filename);
+    job->max_sz = MIN(max_sz, LOAD_IMAGE_MAX_GUNZIP_BYTES);
+    job->threaded = true;
+    job->whole_file = true;
+    qemu_thread_create(&job->thread, "gunzip", gunzip_job_run, job,
+                       QEMU_THREAD_JOINABLE);
+    return job;
+}
+
+static void gunzip_job_free(GunzipJob *job)
+{
+    if (job->data) {
+#ifndef _WIN32
+        if (job->mapped) {
+            munmap(job->data, job->size);
+        } else
+#endif
+        {
+            g_free(job->data);
+        }
+    }
+    g_free(job->filename);
+    g_free(job);
+}
+
+int load_image_gzipped_finish(GunzipJob *job, hwaddr addr)
+{
+    int ret;
+
+    if (job->threaded) {
+        qemu_thread_join(&job->thread);
+    }
+    ret = job->size;
+    if (job->data) {
+        rom_add_image(job->filename, job->data, job->size, job->mapped, addr);
+        job->data = NULL;
+    }
+    gunzip_job_free(job);
     return ret;
 }
 
+void load_image_gzipped_cancel(GunzipJob *job)
+{
+    if (job->threaded) {
+        qemu_thread_join(&job->thread);
+    }
+    gunzip_job_free(job);
+}
+
+/* Load a gzip-compressed kernel. */
+int load_image_gzipped(const char *filename, hwaddr addr, uint64_t max_sz)
+{
+    GunzipJob *job = g_new0(GunzipJob, 1);
+
+    job->filename = g_strdup(filename);
+    job->max_sz = MIN(max_sz, LOAD_IMAGE_MAX_GUNZIP_BYTES);
+    gunzip_job_run(job);
+    return load_image_gzipped_finish(job, addr);
+}
+
 /*
  * Functions for reboot-persistent memory regions.
  *  - used for vga bios and option roms.
@@ -682,6 +837,7 @@ struct Rom {
     size_t datasize;
 
     uint8_t *data;
+    bool mapped;    /* data is a private mapping of the image file */
     MemoryRegion *mr;
     int isrom;
     char *fw_dir;
@@ -712,6 +868,54 @@ static void rom_insert(Rom *rom)
     QTAILQ_INSERT_TAIL(&roms, rom, next);
 }
 
+/* Map @fd copy-on-write, as rom_ptr() users may patch the image, rather
+ * than reading it in.  Returns NULL if it can't be mapped.
+ */
+static uint8_t *rom_map_fd(int fd, size_t size)
+{
+#ifndef _WIN32
+    void *data;
+
+    if (size == 0) {
+        return NULL;
+    }
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    return data == MAP_FAILED ? NULL : data;
+#else
+    return NULL;
+#endif
+}
+
+static void rom_free_data(Rom *rom)
+{
+#ifndef _WIN32
+    if (rom->mapped) {
+        munmap(rom->data, rom->datasize);
+    } else
+#endif
+    {
+        g_free(rom->data);
+    }
+    rom->data = NULL;
+    rom->mapped = false;
+}
+
+/* Takes ownership of @data */
+static void rom_add_image(const char *name, uint8_t *data, size_t size,
+                          bool mapped, hwaddr addr)
+{
+    Rom *rom;
+
+    rom           = g_malloc0(sizeof(*rom));
+    rom->name     = g_strdup(name);
+    rom->addr     = addr;
+    rom->romsize  = size;
+    rom->datasize = size;
+    rom->data     = data;
+    rom->mapped   = mapped;
+    rom_insert(rom);
+}
+
 static void *rom_set_mr(Rom *rom, Object *owner, const char *name)
 {
     void *data;
@@ -762,13 +966,19 @@ int rom_add_file(const char *file, const char *fw_dir,
     }
 
     rom->datasize = rom->romsize;
-    rom->data     = g_malloc0(rom->datasize);
-    lseek(fd, 0, SEEK_SET);
-    rc = read(fd, rom->data, rom->datasize);
-    if (rc != rom->datasize) {
-        fprintf(stderr, "rom: file %-20s: read error: rc=%d (expected %zd)\n",
-                rom->name, rc, rom->datasize);
-        goto err;
+    rom->data     = rom_map_fd(fd, rom->datasize);
+    if (rom->data) {
+        rom->mapped = true;
+    } else {
+        rom->data = g_malloc0(rom->datasize);
+        lseek(fd, 0, SEEK_SET);
+        rc = read(fd, rom->data, rom->datasize);
+        if (rc != rom->datasize) {
+            fprintf(stderr,
+                    "rom: file %-20s: read error: rc=%d (expected %zd)\n",
+                    rom->name, rc, rom->datasize);
+            goto err;
+        }
     }
     close(fd);
     rom_insert(rom);
@@ -804,7 +1014,7 @@ int rom_add_file(const char *file, const char *fw_dir,
 err:
     if (fd != -1)
         close(fd);
-    g_free(rom->data);
+    rom_free_data(rom);
     g_free(rom->path);
     g_free(rom->name);
     g_free(rom);
@@ -896,8 +1106,7 @@ static void rom_reset(void *unused)
         }
         if (rom->isrom) {
             /* rom needs to be written only once */
-            g_free(rom->data);
-            rom->data = NULL;
+            rom_free_data(rom);
         }
         /*
          * The rom loader is really on the same level as firmware in the guest
@@ -116,3 +116,58 @@ void framebuffer_update_display(
 out:
     memory_region_unref(mem);
 }
+
+/* Render the rectangle of w x h pixels at (x, y) of a shared memory
+   framebuffer of cols x rows, whatever the dirty memory bitmap says, for
+   a device told by the guest what changed.  Returns false if the lines
+   can't be mapped.  */
+bool framebuffer_update_region(
+    DisplaySurface *ds,
+    hwaddr base,
+    int cols, /* Width in pixels.  */
+    int rows, /* Height in pixels.  */
+    int src_width, /* Length of source line, in bytes.  */
+    int src_bpp, /* Bytes per source pixel.  */
+    int dest_row_pitch, /* Bytes between adjacent horizontal output pixels.  */
+    int dest_col_pitch, /* Bytes between adjacent vertical output pixels.  */
+    int x, int y, int w, int h,
+    drawfn fn,
+    void *opaque)
+{
+    hwaddr src_len = (hwaddr)src_width * h;
+    hwaddr len = src_len;
+    uint8_t *dest;
+    uint8_t *src;
+    uint8_t *src_base;
+    int i;
+
+    assert(x >= 0 && y >= 0 && w > 0 && h > 0 &&
+           x + w <= cols && y + h <= rows);
+    src_base = cpu_physical_memory_map(base + (hwaddr)y * src_width, &len, 0);
+    if (!src_base) {
+        return false;
+    }
+    if (len != src_len) {
+        cpu_physical_memory_unmap(src_base, len, 0, 0);
+        return false;
+    }
+    src = src_base + x * src_bpp;
+    dest = surface_data(ds);
+
+    /* Same starting point as framebuffer_update_display() */
+    if (dest_col_pitch < 0) {
+        dest -= dest_col_pitch * (cols - 1);
+    }
+    if (dest_row_pitch < 0) {
+        dest -= dest_row_pitch * (rows - 1);
+    }
+    dest += y * dest_row_pitch + x * dest_col_pitch;
+
+    for (i = 0; i < h; i++) {
+        fn(opaque, dest, src, w, dest_col_pitch);
+        src += src_width;
+        dest += dest_row_pitch;
+    }
+    cpu_physical_memory_unmap(src_base, len, 0, 0);
+    return true;
+}
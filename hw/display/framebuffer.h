@@ -22,4 +22,17 @@ void framebuffer_update_display(
     int *first_row,
     int *last_row);
 
+bool framebuffer_update_region(
+    DisplaySurface *ds,
+    hwaddr base,
+    int cols,
+    int rows,
+    int src_width,
+    int src_bpp,
+    int dest_row_pitch,
+    int dest_col_pitch,
+    int x, int y, int w, int h,
+    drawfn fn,
+    void *opaque);
+
 #endif
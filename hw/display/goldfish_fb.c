@@ -10,8 +10,11 @@
 ** GNU General Public License for more details.
 */
 #include "framebuffer.h"
+#include "goldfish_fb_simd.h"
 #include "hw/hw.h"
 #include "hw/sysbus.h"
+#include "qemu/input-latency.h"
+#include "qemu/timer.h"
 #include "ui/console.h"
 #include "ui/pixel_ops.h"
 #include "trace.h"
@@ -55,6 +58,37 @@ static const int android_display_use_host_gpu = 0;
 #define SOURCE_BITS 32
 #include "goldfish_fb_template.h"
 
+/* Vectorized versions of the converters to contiguous 32-bit lines,
+ * selected once for the host CPU in goldfish_fb_init(). */
+static const GoldfishFbKernels *fb_kernels;
+
+static void draw_line_16_32_fast(void *opaque, uint8_t *d, const uint8_t *s,
+                                 int width, int deststep)
+{
+    if (deststep == 4) {
+        fb_kernels->rgb565_to_xrgb8888(d, s, width);
+    } else {
+        draw_line_16_32(opaque, d, s, width, deststep);
+    }
+}
+
+static void draw_line_32_32_fast(void *opaque, uint8_t *d, const uint8_t *s,
+                                 int width, int deststep)
+{
+    if (deststep == 4) {
+        fb_kernels->rgbx8888_to_xrgb8888(d, s, width);
+    } else {
+        draw_line_32_32(opaque, d, s, width, deststep);
+    }
+}
+
+/* Used when the console surface aliases the guest framebuffer: nothing
+ * to copy, framebuffer_update_display() only reports the dirty lines. */
+static void draw_line_none(void *opaque, uint8_t *d, const uint8_t *s,
+                           int width, int deststep)
+{
+}
+
 #define TYPE_GOLDFISH_FB "goldfish_fb"
 #define GOLDFISH_FB(obj) OBJECT_CHECK(struct goldfish_fb_state, (obj), TYPE_GOLDFISH_FB)
 /* These values *must* match the platform definitions found under
@@ -79,11 +113,22 @@ enum {
     FB_GET_PHYS_WIDTH   = 0x1c,
     FB_GET_PHYS_HEIGHT  = 0x20,
     FB_GET_FORMAT       = 0x24,
+    /* Optional damage reporting, see goldfish_fb_post_damage() */
+    FB_SET_DAMAGE_XY    = 0x28,
+    FB_SET_DAMAGE_WH    = 0x2c,
+    FB_GET_FEATURES     = 0x30,
 
     FB_INT_VSYNC             = 1U << 0,
-    FB_INT_BASE_UPDATE_DONE  = 1U << 1
+    FB_INT_BASE_UPDATE_DONE  = 1U << 1,
+
+    FB_FEATURE_DAMAGE        = 1U << 0,
 };
 
+/* A rectangle of the guest framebuffer, in unrotated pixels */
+typedef struct GoldfishFbRect {
+    int x, y, w, h;
+} GoldfishFbRect;
+
 struct goldfish_fb_state {
     SysBusDevice parent;
 
@@ -101,6 +146,30 @@ struct goldfish_fb_state {
     int      rotation;   /* 0, 1, 2 or 3 */
     int      dpi;
     int      format;
+    /* Unrotated copy of the framebuffer, used to rotate 32-bit
+     * surfaces by 90 or 270 degrees one tile at a time. */
+    DisplaySurface *rotate_surface;
+    /* Display the guest framebuffer in place when its format allows it,
+     * see goldfish_fb_check_direct(). */
+    bool     zero_copy;
+    bool     adaptive_refresh;
+    /* Damage written with FB_SET_DAMAGE_XY and FB_SET_DAMAGE_WH for the
+     * next FB_SET_BASE, and that of the flips not drawn yet. */
+    uint32_t damage_xy;
+    uint32_t damage_wh;
+    bool     damage_posted;
+    bool     damage_mode;
+    bool     need_damage;
+    int      damage_x0, damage_y0, damage_x1, damage_y1;
+    DisplaySurface *direct_surface;
+    MemoryRegion *direct_mr;
+    /* Update statistics, only collected while the goldfish_fb_update_stats
+     * trace event is enabled. */
+    int      stats_counter;
+    int      stats_full_updates;
+    int      stats_partial_updates;
+    long     stats_total;
+    long     stats_total_full_updates;
 };
 
 #define  GOLDFISH_FB_SAVE_VERSION  3
@@ -200,14 +269,188 @@ pixels_to_mm(int  pixels, int dpi)
 }
 
 
-#define  STATS  0
+/* Number of refreshes between two goldfish_fb_update_stats traces. */
+#define  STATS_PERIOD  120
+
+static void goldfish_fb_update_stats(struct goldfish_fb_state *s,
+                                     int full_updates, int partial_updates)
+{
+    s->stats_counter += 1;
+    s->stats_full_updates += full_updates;
+    s->stats_partial_updates += partial_updates;
+    if (s->stats_counter == STATS_PERIOD) {
+        s->stats_total += s->stats_counter;
+        s->stats_total_full_updates += s->stats_full_updates;
+
+        trace_goldfish_fb_update_stats(
+                s->stats_full_updates * 100.0 / s->stats_counter,
+                s->stats_partial_updates * 100.0 / s->stats_counter,
+                s->stats_total_full_updates * 100.0 / s->stats_total);
+
+        s->stats_counter = 0;
+        s->stats_full_updates = 0;
+        s->stats_partial_updates = 0;
+    }
+}
+
+static void goldfish_fb_drop_direct(struct goldfish_fb_state *s)
+{
+    if (s->direct_mr) {
+        memory_region_unref(s->direct_mr);
+        s->direct_mr = NULL;
+    }
+    s->direct_surface = NULL;
+}
+
+/* Return a host pointer to the |len| bytes of the guest framebuffer if
+ * they are a single block of RAM, taking a reference on it in |*mr|. */
+static uint8_t *goldfish_fb_map_direct(struct goldfish_fb_state *s,
+                                       hwaddr len, MemoryRegion **mr)
+{
+    MemoryRegion *address_space = sysbus_address_space(SYS_BUS_DEVICE(s));
+    MemoryRegionSection section;
+
+    section = memory_region_find(address_space, s->fb_base, len);
+    if (!section.mr) {
+        return NULL;
+    }
+    if (int128_get64(section.size) != len ||
+        !memory_region_is_ram(section.mr)) {
+        memory_region_unref(section.mr);
+        return NULL;
+    }
+    *mr = section.mr;
+    return (uint8_t *)memory_region_get_ram_ptr(section.mr) +
+           section.offset_within_region;
+}
+
+/* In zero-copy mode, when the guest framebuffer is RGBX8888 and isn't
+ * rotated, the console surface is created directly over guest RAM and
+ * an FB_SET_BASE flip only swaps that surface for one over the new buffer.
+ * This is only done when the console uses a surface allocated by QEMU: a
+ * display that installed its own backing store (e.g. the Android
+ * QFrameBuffer) expects the pixels to be copied there. Returns the surface
+ * to draw into, which is the direct one if direct mode is in use.
+ */
+static DisplaySurface *goldfish_fb_check_direct(struct goldfish_fb_state *s,
+                                                DisplaySurface *ds,
+                                                int *full_update)
+{
+    int width = surface_width(ds);
+    int height = surface_height(ds);
+    bool direct = false;
 
-#if STATS
-static int   stats_counter;
-static long  stats_total;
-static int   stats_full_updates;
-static long  stats_total_full_updates;
+    if (s->direct_surface && s->direct_surface != ds) {
+        /* The surface was replaced behind our back (e.g. resized). */
+        goldfish_fb_drop_direct(s);
+    }
+#ifndef HOST_WORDS_BIGENDIAN
+    direct = s->zero_copy && !s->blank && s->rotation == 0 &&
+             s->format == HAL_PIXEL_FORMAT_RGBX_8888 &&
+             (s->direct_surface || !is_buffer_shared(ds));
 #endif
+    if (direct && (*full_update || !s->direct_surface)) {
+        MemoryRegion *mr = NULL;
+        uint8_t *data = goldfish_fb_map_direct(s, (hwaddr)width * height * 4,
+                                               &mr);
+        if (!data) {
+            direct = false;
+        } else if (s->direct_surface && data == surface_data(ds)) {
+            memory_region_unref(mr);
+        } else {
+            /* Guest RGBX8888 pixels are x8b8g8r8 on a little-endian host. */
+            ds = qemu_create_displaysurface_from(width, height,
+                                                 PIXMAN_x8b8g8r8,
+                                                 width * 4, data);
+            dpy_gfx_replace_surface(s->con, ds);
+            goldfish_fb_drop_direct(s);
+            s->direct_surface = ds;
+            s->direct_mr = mr;
+            *full_update = 1;
+        }
+    }
+    if (!direct && s->direct_surface) {
+        /* Go back to a surface of our own before drawing into it. */
+        qemu_console_resize(s->con, width, height);
+        goldfish_fb_drop_direct(s);
+        ds = qemu_console_surface(s->con);
+        *full_update = 1;
+    }
+    return ds;
+}
+
+/* With each FB_SET_BASE, the display HAL of the guest may tell what changed
+ * since the previous frame, by writing the rectangle to FB_SET_DAMAGE_XY
+ * then FB_SET_DAMAGE_WH, each as x | y << 16 (resp. w | h << 16) in pixels
+ * of the unrotated framebuffer. Only that rectangle is converted then, and
+ * nothing at all between two flips while the guest keeps posting damage.
+ * This saves scanning the dirty memory bitmap, which HAX always reports
+ * fully dirty. A flip without damage is a whole new frame again.
+ */
+static void goldfish_fb_post_damage(struct goldfish_fb_state *s)
+{
+    int x0 = s->damage_xy & 0xffff, y0 = s->damage_xy >> 16;
+    int x1 = x0 + (s->damage_wh & 0xffff), y1 = y0 + (s->damage_wh >> 16);
+
+    if (s->need_damage) {
+        /* Several flips between two refreshes */
+        x0 = MIN(x0, s->damage_x0);
+        y0 = MIN(y0, s->damage_y0);
+        x1 = MAX(x1, s->damage_x1);
+        y1 = MAX(y1, s->damage_y1);
+    }
+    s->damage_x0 = x0;
+    s->damage_y0 = y0;
+    s->damage_x1 = x1;
+    s->damage_y1 = y1;
+    s->need_damage = 1;
+}
+
+/* Convert what changed of the guest framebuffer into @ds, and set @r to
+ * the source rectangle drawn, of zero height if nothing was. That is the
+ * damage the guest posted if it does, else the lines that the dirty memory
+ * bitmap reports. */
+static void goldfish_fb_draw(struct goldfish_fb_state *s, DisplaySurface *ds,
+                             MemoryRegion *address_space,
+                             int src_width, int src_height, int src_bpp,
+                             int dest_row_pitch, int dest_col_pitch,
+                             int full_update, drawfn fn, void *opaque,
+                             GoldfishFbRect *r)
+{
+    int ymin = 0, ymax;
+
+    r->h = 0;
+    if (s->damage_mode && !full_update) {
+        int x0 = s->damage_x0, y0 = s->damage_y0;
+        int x1 = MIN(s->damage_x1, src_width);
+        int y1 = MIN(s->damage_y1, src_height);
+
+        if (!s->need_damage || x1 <= x0 || y1 <= y0) {
+            return;
+        }
+        if (framebuffer_update_region(ds, s->fb_base, src_width, src_height,
+                                      src_width * src_bpp, src_bpp,
+                                      dest_row_pitch, dest_col_pitch,
+                                      x0, y0, x1 - x0, y1 - y0, fn, opaque)) {
+            r->x = x0;
+            r->y = y0;
+            r->w = x1 - x0;
+            r->h = y1 - y0;
+            return;
+        }
+        full_update = 1;
+    }
+    framebuffer_update_display(ds, address_space, s->fb_base,
+                               src_width, src_height, src_width * src_bpp,
+                               dest_row_pitch, dest_col_pitch, full_update,
+                               fn, opaque, &ymin, &ymax);
+    if (ymin >= 0) {
+        r->x = 0;
+        r->y = ymin;
+        r->w = src_width;
+        r->h = ymax - ymin + 1;
+    }
+}
 
 static void goldfish_fb_update_display(void *opaque)
 {
@@ -223,8 +466,8 @@ static void goldfish_fb_update_display(void *opaque)
         qemu_irq_raise(s->irq);
     }
 
-    if(s->need_update) {
-        full_update = 1;
+    if(s->need_update || s->need_damage) {
+        full_update = s->need_update;
         if(s->need_int) {
             s->int_status |= FB_INT_BASE_UPDATE_DONE;
             if(s->int_enable & FB_INT_BASE_UPDATE_DONE)
@@ -234,38 +477,29 @@ static void goldfish_fb_update_display(void *opaque)
         s->need_update = 0;
     }
 
+    ds = goldfish_fb_check_direct(s, ds, &full_update);
+
     int dest_width = surface_width(ds);
     int dest_height = surface_height(ds);
     int dest_pitch = surface_stride(ds);
-    int ymin, ymax;
-
-#if STATS
-    if (full_update)
-        stats_full_updates += 1;
-    if (++stats_counter == 120) {
-        stats_total               += stats_counter;
-        stats_total_full_updates  += stats_full_updates;
-
-        trace_goldfish_fb_update_stats(stats_full_updates*100.0/stats_counter,
-                stats_total_full_updates*100.0/stats_total );
-
-        stats_counter      = 0;
-        stats_full_updates = 0;
-    }
-#endif /* STATS */
+    /* Source lines map to destination columns in portrait modes. */
+    int src_width = (s->rotation % 2) ? dest_height : dest_width;
+    int src_height = (s->rotation % 2) ? dest_width : dest_height;
+    GoldfishFbRect r;
 
     if (s->blank)
     {
         void *dst_line = surface_data(ds);
         memset( dst_line, 0, dest_height*dest_pitch );
-        ymin = 0;
-        ymax = dest_height-1;
+        r.x = 0;
+        r.y = 0;
+        r.w = src_width;
+        r.h = src_height;
     }
     else
     {
         SysBusDevice *dev = SYS_BUS_DEVICE(opaque);
         MemoryRegion *address_space = sysbus_address_space(dev);
-        int src_width, src_height;
         int dest_row_pitch, dest_col_pitch;
         drawfn fn;
 
@@ -312,7 +546,7 @@ static void goldfish_fb_update_display(void *opaque)
             case 15: fn = draw_line_16_15; break;
             case 16: fn = draw_line_16_16; break;
             case 24: fn = draw_line_16_24; break;
-            case 32: fn = draw_line_16_32; break;
+            case 32: fn = draw_line_16_32_fast; break;
             default:
                 hw_error("goldfish_fb: bad dest color depth\n");
                 return;
@@ -325,7 +559,7 @@ static void goldfish_fb_update_display(void *opaque)
             case 15: fn = draw_line_32_15; break;
             case 16: fn = draw_line_32_16; break;
             case 24: fn = draw_line_32_24; break;
-            case 32: fn = draw_line_32_32; break;
+            case 32: fn = draw_line_32_32_fast; break;
             default:
                 hw_error("goldfish_fb: bad dest color depth\n");
                 return;
@@ -336,27 +570,88 @@ static void goldfish_fb_update_display(void *opaque)
             return;
         }
 
-        ymin = 0;
-        framebuffer_update_display(ds, address_space, s->fb_base,
-                                   src_width, src_height,
-                                   src_width * source_bytes_per_pixel,
-                                   dest_row_pitch, dest_col_pitch,
-                                   full_update,
-                                   fn, ds, &ymin, &ymax);
+        if (ds == s->direct_surface) {
+            fn = draw_line_none;
+        }
+
+        if ((s->rotation % 2) && surface_bits_per_pixel(ds) == 32) {
+            /* Writing a rotated line touches one cache line per pixel,
+             * so convert the dirty lines linearly into a scratch surface
+             * and rotate them by tiles afterwards. */
+            DisplaySurface *rs = s->rotate_surface;
+
+            if (!rs || surface_width(rs) != src_width ||
+                surface_height(rs) != src_height) {
+                qemu_free_displaysurface(rs);
+                rs = qemu_create_displaysurface(src_width, src_height);
+                s->rotate_surface = rs;
+                full_update = 1;
+            }
+            goldfish_fb_draw(s, rs, address_space, src_width, src_height,
+                             source_bytes_per_pixel, surface_stride(rs),
+                             surface_bytes_per_pixel(rs), full_update,
+                             fn, rs, &r);
+            if (r.h) {
+                /* Whole lines of the scratch surface, the rest of them
+                 * is still what was last drawn. */
+                goldfish_fb_rotate_32(surface_data(ds), dest_pitch,
+                                      (uint8_t *)surface_data(rs) +
+                                          r.y * surface_stride(rs),
+                                      surface_stride(rs),
+                                      src_width, src_height,
+                                      r.y, r.h, s->rotation);
+                r.x = 0;
+                r.w = src_width;
+            }
+        } else {
+            goldfish_fb_draw(s, ds, address_space, src_width, src_height,
+                             source_bytes_per_pixel, dest_row_pitch,
+                             dest_col_pitch, full_update, fn, ds, &r);
+        }
     }
+    s->need_damage = 0;
 
-    ymax += 1;
-    if (ymin >= 0) {
-        if (s->rotation % 2) {
-            /* In portrait mode we are drawing "sideways" so always
-             * need to update the whole screen */
-            trace_goldfish_fb_update_display(0, dest_height, 0, dest_width);
-            dpy_gfx_update(s->con, 0, 0, dest_width, dest_height);
+    if (r.h) {
+        int x, y, w, h;
+        int64_t now;
 
-        } else {
-            trace_goldfish_fb_update_display(ymin, ymax-ymin, 0, dest_width);
-            dpy_gfx_update(s->con, 0, ymin, dest_width, ymax-ymin);
+        /* r is in source pixels, find where it ended up. */
+        switch (s->rotation) {
+        case 0:
+            x = r.x;
+            y = r.y;
+            w = r.w;
+            h = r.h;
+            break;
+        case 1:
+            x = src_height - r.y - r.h;
+            y = r.x;
+            w = r.h;
+            h = r.w;
+            break;
+        case 2:
+            x = src_width - r.x - r.w;
+            y = src_height - r.y - r.h;
+            w = r.w;
+            h = r.h;
+            break;
+        default:
+            x = r.y;
+            y = src_width - r.x - r.w;
+            w = r.h;
+            h = r.w;
+            break;
+        }
+        trace_goldfish_fb_update_display(y, h, x, w);
+        dpy_gfx_update(s->con, x, y, w, h);
+        now = get_clock();
+        input_latency_frame(INPUT_LATENCY_FB, now, now);
+        if (trace_event_get_state(TRACE_GOLDFISH_FB_UPDATE_STATS)) {
+            bool full = (w == dest_width && h == dest_height);
+            goldfish_fb_update_stats(s, full, !full);
         }
+    } else if (trace_event_get_state(TRACE_GOLDFISH_FB_UPDATE_STATS)) {
+        goldfish_fb_update_stats(s, 0, 0);
     }
 }
 
@@ -402,6 +697,10 @@ static uint64_t goldfish_fb_read(void *opaque, hwaddr offset, unsigned size)
             ret = pixels_to_mm( surface_height(ds), s->dpi );
             break;
 
+        case FB_GET_FEATURES:
+            ret = FB_FEATURE_DAMAGE;
+            break;
+
         case FB_GET_FORMAT:
             /* A kernel making this query supports high color and true color */
             switch (android_display_bpp) {   /* hw.lcd.depth */
@@ -442,10 +741,23 @@ static void goldfish_fb_write(void *opaque, hwaddr offset, uint64_t val,
             s->int_enable = val;
             qemu_set_irq(s->irq, s->int_status & s->int_enable);
             break;
+        case FB_SET_DAMAGE_XY:
+            s->damage_xy = val;
+            break;
+        case FB_SET_DAMAGE_WH:
+            s->damage_wh = val;
+            s->damage_posted = 1;
+            break;
         case FB_SET_BASE:
             s->fb_base = val;
             s->int_status &= ~FB_INT_BASE_UPDATE_DONE;
-            s->need_update = 1;
+            s->damage_mode = s->damage_posted;
+            if (s->damage_posted) {
+                goldfish_fb_post_damage(s);
+            } else {
+                s->need_update = 1;
+            }
+            s->damage_posted = 0;
             s->need_int = 1;
             s->base_valid = 1;
             /* The guest is waiting for us to complete an update cycle
@@ -481,6 +793,16 @@ static const GraphicHwOps goldfish_fb_ops = {
     .gfx_update = goldfish_fb_update_display,
 };
 
+static void goldfish_fb_reset(DeviceState *dev)
+{
+    struct goldfish_fb_state *s = GOLDFISH_FB(dev);
+
+    /* Until the display HAL flips again, the kernel draws in place */
+    s->damage_posted = 0;
+    s->damage_mode = 0;
+    s->need_damage = 0;
+}
+
 static int goldfish_fb_init(SysBusDevice *sbdev)
 {
     DeviceState *dev = DEVICE(sbdev);
@@ -491,11 +813,16 @@ static int goldfish_fb_init(SysBusDevice *sbdev)
     sysbus_init_irq(sbdev, &s->irq);
 
     s->con = graphic_console_init(dev, 0, &goldfish_fb_ops, s);
+    /* Lower the refresh (and VSYNC) rate while the guest is not drawing,
+     * FB_SET_BASE or a dirty line brings it back immediately. */
+    qemu_console_set_adaptive_refresh(s->con, s->adaptive_refresh);
 
     s->dpi = 165;  /* TODO: Find better way to get actual value ! */
 
     s->format = HAL_PIXEL_FORMAT_RGB_565;
 
+    fb_kernels = goldfish_fb_get_kernels();
+
     memory_region_init_io(&s->iomem, OBJECT(s), &goldfish_fb_iomem_ops, s,
             "goldfish_fb", 0x100);
     sysbus_init_mmio(sbdev, &s->iomem);
@@ -506,12 +833,21 @@ static int goldfish_fb_init(SysBusDevice *sbdev)
     return 0;
 }
 
+static Property goldfish_fb_properties[] = {
+    DEFINE_PROP_BOOL("zero-copy", struct goldfish_fb_state, zero_copy, false),
+    DEFINE_PROP_BOOL("adaptive-refresh", struct goldfish_fb_state,
+                     adaptive_refresh, true),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void goldfish_fb_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
 
     k->init = goldfish_fb_init;
+    dc->reset = goldfish_fb_reset;
+    dc->props = goldfish_fb_properties;
     dc->desc = "goldfish framebuffer";
 }
 
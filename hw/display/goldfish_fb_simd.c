@@ -0,0 +1,313 @@
+/*
+ *  QEMU model of the Goldfish framebuffer: vectorized pixel conversion.
+ *
+ *  Copyright (c) 2016 The Android Open Source Project
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include "qemu-common.h"
+#include "qemu/bswap.h"
+#include "goldfish_fb_simd.h"
+
+#if defined(CONFIG_CPUID_H)
+#include <cpuid.h>
+#endif
+
+/* The vector kernels assume a little-endian host, like the scalar
+ * code in goldfish_fb_template.h does for 32-bit source pixels. */
+#if !defined(HOST_WORDS_BIGENDIAN)
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define GOLDFISH_FB_HAVE_SSE2 1
+/* AVX2 kernels are built with a function target attribute and only used
+ * if the CPU and the OS support them. */
+#if defined(CONFIG_CPUID_H) && defined(__x86_64__) && \
+    ((defined(__clang__) && defined(__has_attribute)) || \
+     (!defined(__clang__) && QEMU_GNUC_PREREQ(4, 9)))
+#include <immintrin.h>
+#define GOLDFISH_FB_HAVE_AVX2 1
+#endif
+#endif /* __SSE2__ */
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define GOLDFISH_FB_HAVE_NEON 1
+#endif
+#endif /* !HOST_WORDS_BIGENDIAN */
+
+/* Portable versions, these produce the same pixels as draw_line_16_32()
+ * and draw_line_32_32(). */
+static void rgb565_to_xrgb8888_c(uint8_t *dst, const uint8_t *src, int width)
+{
+    while (width--) {
+        uint16_t rgb565 = lduw_le_p(src);
+        uint32_t r = ((rgb565 >> 11) & 0x1f) << 3;
+        uint32_t g = ((rgb565 >>  5) & 0x3f) << 2;
+        uint32_t b = ((rgb565 >>  0) & 0x1f) << 3;
+        stl_he_p(dst, (r << 16) | (g << 8) | b);
+        dst += 4;
+        src += 2;
+    }
+}
+
+static void rgbx8888_to_xrgb8888_c(uint8_t *dst, const uint8_t *src, int width)
+{
+    while (width--) {
+        uint32_t rgbx8888 = ldl_le_p(src);
+        uint32_t b = (rgbx8888 >> 16) & 0xff;
+        uint32_t g = (rgbx8888 >>  8) & 0xff;
+        uint32_t r = (rgbx8888 >>  0) & 0xff;
+        stl_he_p(dst, (r << 16) | (g << 8) | b);
+        dst += 4;
+        src += 4;
+    }
+}
+
+static const GoldfishFbKernels kernels_c = {
+    .name = "c",
+    .rgb565_to_xrgb8888 = rgb565_to_xrgb8888_c,
+    .rgbx8888_to_xrgb8888 = rgbx8888_to_xrgb8888_c,
+};
+
+#ifdef GOLDFISH_FB_HAVE_SSE2
+static void rgb565_to_xrgb8888_sse2(uint8_t *dst, const uint8_t *src,
+                                    int width)
+{
+    const __m128i mask_b = _mm_set1_epi16(0x001f);
+    const __m128i mask_g = _mm_set1_epi16(0x00fc);
+    const __m128i mask_r = _mm_set1_epi16(0x00f8);
+
+    for (; width >= 8; width -= 8, src += 16, dst += 32) {
+        __m128i p = _mm_loadu_si128((const __m128i *)src);
+        __m128i b = _mm_slli_epi16(_mm_and_si128(p, mask_b), 3);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(p, 3), mask_g);
+        __m128i r = _mm_and_si128(_mm_srli_epi16(p, 8), mask_r);
+        /* low 16 bits of each output pixel are g:b, high ones are 0:r */
+        __m128i gb = _mm_or_si128(_mm_slli_epi16(g, 8), b);
+        _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(gb, r));
+        _mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(gb, r));
+    }
+    rgb565_to_xrgb8888_c(dst, src, width);
+}
+
+static void rgbx8888_to_xrgb8888_sse2(uint8_t *dst, const uint8_t *src,
+                                      int width)
+{
+    const __m128i mask_g = _mm_set1_epi32(0x0000ff00);
+    const __m128i mask_b = _mm_set1_epi32(0x000000ff);
+
+    for (; width >= 4; width -= 4, src += 16, dst += 16) {
+        __m128i p = _mm_loadu_si128((const __m128i *)src);
+        __m128i r = _mm_slli_epi32(_mm_and_si128(p, mask_b), 16);
+        __m128i g = _mm_and_si128(p, mask_g);
+        __m128i b = _mm_and_si128(_mm_srli_epi32(p, 16), mask_b);
+        _mm_storeu_si128((__m128i *)dst,
+                         _mm_or_si128(_mm_or_si128(r, g), b));
+    }
+    rgbx8888_to_xrgb8888_c(dst, src, width);
+}
+
+static const GoldfishFbKernels kernels_sse2 = {
+    .name = "sse2",
+    .rgb565_to_xrgb8888 = rgb565_to_xrgb8888_sse2,
+    .rgbx8888_to_xrgb8888 = rgbx8888_to_xrgb8888_sse2,
+};
+#endif /* GOLDFISH_FB_HAVE_SSE2 */
+
+#ifdef GOLDFISH_FB_HAVE_AVX2
+__attribute__((target("avx2")))
+static void rgb565_to_xrgb8888_avx2(uint8_t *dst, const uint8_t *src,
+                                    int width)
+{
+    const __m256i mask_b = _mm256_set1_epi16(0x001f);
+    const __m256i mask_g = _mm256_set1_epi16(0x00fc);
+    const __m256i mask_r = _mm256_set1_epi16(0x00f8);
+
+    for (; width >= 16; width -= 16, src += 32, dst += 64) {
+        __m256i p = _mm256_loadu_si256((const __m256i *)src);
+        __m256i b = _mm256_slli_epi16(_mm256_and_si256(p, mask_b), 3);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi16(p, 3), mask_g);
+        __m256i r = _mm256_and_si256(_mm256_srli_epi16(p, 8), mask_r);
+        __m256i gb = _mm256_or_si256(_mm256_slli_epi16(g, 8), b);
+        /* The unpacks work within each 128-bit lane, so they produce
+         * pixels 0-3/8-11 and 4-7/12-15, put them back in order. */
+        __m256i lo = _mm256_unpacklo_epi16(gb, r);
+        __m256i hi = _mm256_unpackhi_epi16(gb, r);
+        _mm256_storeu_si256((__m256i *)dst,
+                            _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + 32),
+                            _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    rgb565_to_xrgb8888_sse2(dst, src, width);
+}
+
+__attribute__((target("avx2")))
+static void rgbx8888_to_xrgb8888_avx2(uint8_t *dst, const uint8_t *src,
+                                      int width)
+{
+    const __m256i mask_g = _mm256_set1_epi32(0x0000ff00);
+    const __m256i mask_b = _mm256_set1_epi32(0x000000ff);
+
+    for (; width >= 8; width -= 8, src += 32, dst += 32) {
+        __m256i p = _mm256_loadu_si256((const __m256i *)src);
+        __m256i r = _mm256_slli_epi32(_mm256_and_si256(p, mask_b), 16);
+        __m256i g = _mm256_and_si256(p, mask_g);
+        __m256i b = _mm256_and_si256(_mm256_srli_epi32(p, 16), mask_b);
+        _mm256_storeu_si256((__m256i *)dst,
+                            _mm256_or_si256(_mm256_or_si256(r, g), b));
+    }
+    rgbx8888_to_xrgb8888_sse2(dst, src, width);
+}
+
+static const GoldfishFbKernels kernels_avx2 = {
+    .name = "avx2",
+    .rgb565_to_xrgb8888 = rgb565_to_xrgb8888_avx2,
+    .rgbx8888_to_xrgb8888 = rgbx8888_to_xrgb8888_avx2,
+};
+
+/* AVX2 needs both CPU support and the OS saving the YMM registers. */
+static bool cpu_has_avx2(void)
+{
+    unsigned a, b, c, d;
+    int max = __get_cpuid_max(0, 0);
+
+    if (max < 7) {
+        return false;
+    }
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return false;
+    }
+    /* xgetbv(0): XMM and YMM state must both be enabled. */
+    asm("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    if ((a & 6) != 6) {
+        return false;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b & (1 << 5)) != 0;     /* bit_AVX2 */
+}
+#endif /* GOLDFISH_FB_HAVE_AVX2 */
+
+#ifdef GOLDFISH_FB_HAVE_NEON
+static void rgb565_to_xrgb8888_neon(uint8_t *dst, const uint8_t *src,
+                                    int width)
+{
+    for (; width >= 8; width -= 8, src += 16, dst += 32) {
+        uint16x8_t p = vld1q_u16((const uint16_t *)src);
+        uint8x8x4_t out;
+        out.val[0] = vshl_n_u8(vmovn_u16(p), 3);                    /* b */
+        out.val[1] = vand_u8(vshrn_n_u16(p, 3), vdup_n_u8(0xfc));   /* g */
+        out.val[2] = vand_u8(vshrn_n_u16(p, 8), vdup_n_u8(0xf8));   /* r */
+        out.val[3] = vdup_n_u8(0);
+        vst4_u8(dst, out);
+    }
+    rgb565_to_xrgb8888_c(dst, src, width);
+}
+
+static void rgbx8888_to_xrgb8888_neon(uint8_t *dst, const uint8_t *src,
+                                      int width)
+{
+    for (; width >= 8; width -= 8, src += 32, dst += 32) {
+        uint8x8x4_t in = vld4_u8(src);
+        uint8x8x4_t out;
+        out.val[0] = in.val[2];
+        out.val[1] = in.val[1];
+        out.val[2] = in.val[0];
+        out.val[3] = vdup_n_u8(0);
+        vst4_u8(dst, out);
+    }
+    rgbx8888_to_xrgb8888_c(dst, src, width);
+}
+
+static const GoldfishFbKernels kernels_neon = {
+    .name = "neon",
+    .rgb565_to_xrgb8888 = rgb565_to_xrgb8888_neon,
+    .rgbx8888_to_xrgb8888 = rgbx8888_to_xrgb8888_neon,
+};
+#endif /* GOLDFISH_FB_HAVE_NEON */
+
+static const GoldfishFbKernels *all_kernels[4];
+static int num_kernels;
+
+static void goldfish_fb_init_kernels(void)
+{
+    if (num_kernels) {
+        return;
+    }
+    /* Slowest first, the last one is the one that gets used. */
+    all_kernels[num_kernels++] = &kernels_c;
+#ifdef GOLDFISH_FB_HAVE_SSE2
+    all_kernels[num_kernels++] = &kernels_sse2;
+#endif
+#ifdef GOLDFISH_FB_HAVE_AVX2
+    if (cpu_has_avx2()) {
+        all_kernels[num_kernels++] = &kernels_avx2;
+    }
+#endif
+#ifdef GOLDFISH_FB_HAVE_NEON
+    all_kernels[num_kernels++] = &kernels_neon;
+#endif
+}
+
+const GoldfishFbKernels *goldfish_fb_get_kernels(void)
+{
+    goldfish_fb_init_kernels();
+    return all_kernels[num_kernels - 1];
+}
+
+const GoldfishFbKernels *const *goldfish_fb_get_all_kernels(int *count)
+{
+    goldfish_fb_init_kernels();
+    *count = num_kernels;
+    return all_kernels;
+}
+
+/* Side of the square tiles used by goldfish_fb_rotate_32(), 16 pixels
+ * make a 64-byte cache line on each side. */
+#define ROTATE_TILE  16
+
+void goldfish_fb_rotate_32(uint8_t *dst, int dst_pitch,
+                           const uint8_t *src, int src_pitch,
+                           int cols, int src_height,
+                           int first_row, int rows, int rotation)
+{
+    int ty, tx, y, x;
+
+    for (ty = 0; ty < rows; ty += ROTATE_TILE) {
+        int tile_rows = MIN(ROTATE_TILE, rows - ty);
+        for (tx = 0; tx < cols; tx += ROTATE_TILE) {
+            int tile_cols = MIN(ROTATE_TILE, cols - tx);
+            for (y = ty; y < ty + tile_rows; y++) {
+                const uint32_t *s = (const uint32_t *)(src + y * src_pitch) + tx;
+                int sy = first_row + y;
+                uint8_t *d;
+                int step;
+
+                if (rotation == 1) {
+                    /* (x, y) -> (src_height - 1 - y, x) */
+                    d = dst + tx * dst_pitch + (src_height - 1 - sy) * 4;
+                    step = dst_pitch;
+                } else {
+                    /* (x, y) -> (y, cols - 1 - x) */
+                    d = dst + (cols - 1 - tx) * dst_pitch + sy * 4;
+                    step = -dst_pitch;
+                }
+                for (x = 0; x < tile_cols; x++) {
+                    *(uint32_t *)d = s[x];
+                    d += step;
+                }
+            }
+        }
+    }
+}
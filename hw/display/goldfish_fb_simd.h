@@ -0,0 +1,55 @@
+/*
+ *  QEMU model of the Goldfish framebuffer: vectorized pixel conversion.
+ *
+ *  Copyright (c) 2016 The Android Open Source Project
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef HW_DISPLAY_GOLDFISH_FB_SIMD_H
+#define HW_DISPLAY_GOLDFISH_FB_SIMD_H
+
+#include <stdint.h>
+
+/* Convert |width| contiguous source pixels at |src| into 32-bit
+ * x8r8g8b8 pixels at |dst|. Neither pointer needs to be aligned. */
+typedef void (*GoldfishFbRowFn)(uint8_t *dst, const uint8_t *src, int width);
+
+typedef struct GoldfishFbKernels {
+    const char *name;
+    GoldfishFbRowFn rgb565_to_xrgb8888;
+    GoldfishFbRowFn rgbx8888_to_xrgb8888;
+} GoldfishFbKernels;
+
+/* Return the fastest set of kernels supported by the host CPU. */
+const GoldfishFbKernels *goldfish_fb_get_kernels(void);
+
+/* Return all the sets of kernels supported by the host CPU, the first one
+ * being the portable C implementation. Used by the tests. */
+const GoldfishFbKernels *const *goldfish_fb_get_all_kernels(int *count);
+
+/* Copy |rows| lines of |cols| 32-bit pixels from |src| into the
+ * rotated destination surface |dst|, processing the image in square
+ * tiles to keep both the reads and the writes cache friendly. |first_row|
+ * is the index of the first copied line in the whole |cols|x|src_height|
+ * source image. |rotation| must be 1 (90 degrees, source pixel (x, y) goes
+ * to (src_height - 1 - y, x)) or 3 (270 degrees, source pixel (x, y) goes
+ * to (y, cols - 1 - x)).
+ */
+void goldfish_fb_rotate_32(uint8_t *dst, int dst_pitch,
+                           const uint8_t *src, int src_pitch,
+                           int cols, int src_height,
+                           int first_row, int rows, int rotation);
+
+#endif /* HW_DISPLAY_GOLDFISH_FB_SIMD_H */
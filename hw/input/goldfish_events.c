@@ -20,7 +20,13 @@
 #include "android/multitouch-screen.h"
 #endif
 
+#include "hw/irqfd-line.h"
 #include "hw/sysbus.h"
+#include "qemu/input-latency.h"
+#include "qemu/timer.h"
+#include "qemu/thread.h"
+#include "qemu/main-loop.h"
+#include "qmp-commands.h"
 #include "ui/input.h"
 #include "ui/console.h"
 #include "hw/input/android_keycodes.h"
@@ -31,7 +37,18 @@
 #include "android/utils/debug.h"
 
 #define  D(...)    VERBOSE_PRINT(adb,__VA_ARGS__)
-#define MAX_EVENTS (256 * 100)
+
+/* The event queue holds 32-bit words, three per event (type, code, value).
+ * It starts with room for MIN_EVENT_WORDS words and doubles each time it
+ * fills up, up to MAX_EVENT_WORDS. Both must be powers of two. */
+#define MIN_EVENT_WORDS (1 << 12)
+#define MAX_EVENT_WORDS (1 << 22)
+
+/* Number of queued events searched for a value to coalesce with. */
+#define COALESCE_WINDOW 64
+
+/* Maximum number of scripted events waiting for their time. */
+#define MAX_SCRIPT_EVENTS (1 << 20)
 
 typedef struct {
     const char *name;
@@ -531,6 +548,21 @@ enum {
     PAGE_NAME       = 0x00000,
     PAGE_EVBITS     = 0x10000,
     PAGE_ABSDATA    = 0x20000 | EV_ABS,
+
+    /* Bulk reads, only if REG_FEATURES reports EVENTS_FEATURE_BULK_READ.
+     * These sit well above the largest page, which is read from REG_DATA.
+     * The guest sets up a buffer of REG_BUF_SIZE events, each made of
+     * three 32-bit words (type, code, value), then each read of
+     * REG_READ_MANY copies as many queued events as fit into it and
+     * returns their count.
+     */
+    REG_FEATURES      = 0xf00,
+    REG_BUF_ADDR      = 0xf04,
+    REG_BUF_ADDR_HIGH = 0xf08,
+    REG_BUF_SIZE      = 0xf0c,
+    REG_READ_MANY     = 0xf10,
+
+    EVENTS_FEATURE_BULK_READ = 1U << 0,
 };
 
 /* These corresponds to the state of the driver.
@@ -559,6 +591,9 @@ typedef struct GoldfishEvDevState {
 
     MemoryRegion iomem;
     qemu_irq irq;
+    /* The KVM GSI of |irq|, set by boards that can wire it to an irqfd */
+    int32_t irqfd_gsi;
+    IrqfdLine irqfd;
 
     /* Device properties (TODO: actually make these props) */
     bool have_dpad;
@@ -569,15 +604,48 @@ typedef struct GoldfishEvDevState {
     bool have_touch;
     bool have_multitouch;
 
+    /* The registers are accessed without the iothread lock, see
+     * gf_evdev_init(). This protects the actual device state and the
+     * statistics below, and is taken after the iothread lock. Events are
+     * only enqueued, and the irq only changed, with both held, except that
+     * the irqfd doesn't need the iothread lock. */
+    QemuMutex lock;
+
     /* Actual device state */
+    bool irq_level;
     int32_t page;
-    uint32_t events[MAX_EVENTS];
+    uint32_t *events;
+    uint32_t events_size;   /* in words, a power of two */
     uint32_t first;
     uint32_t last;
     uint32_t state;
 
+    /* Number of queued words enqueued since the last EV_SYN, may be more
+     * than the actual count if the guest already read some of them. */
+    uint32_t packet_words;
+
+    /* Host time at which the oldest queued event came in, 0 if the queue
+     * is empty or the guest driver isn't live yet, for input_latency */
+    int64_t input_ns;
+
+    /* Statistics, reported by gf_get_event_stats() */
+    uint64_t coalesced;
+    uint64_t dropped;
+
+    /* Events of gf_event_script() waiting for their time, sorted by time.
+     * The ones before script_pos were already sent. This is host input,
+     * so it isn't migrated. */
+    QEMUTimer *script_timer;
+    GArray *script;
+    guint script_pos;
+    uint32_t script_seq;
+
     uint32_t modifier_state;
 
+    /* Guest buffer for REG_READ_MANY */
+    uint64_t buf_addr;
+    uint32_t buf_size;
+
     /* All data below here is set up at realize and not modified thereafter */
 
     const char *name;
@@ -591,6 +659,14 @@ typedef struct GoldfishEvDevState {
     size_t abs_info_count;
 } GoldfishEvDevState;
 
+typedef struct ScriptEvent {
+    int64_t time;       /* QEMU_CLOCK_VIRTUAL, in ns */
+    uint32_t seq;       /* keeps the order of events with the same time */
+    uint32_t type;
+    uint32_t code;
+    int32_t value;
+} ScriptEvent;
+
 /* Bitfield meanings for modifier_state. */
 #define MODSTATE_SHIFT (1 << 0)
 #define MODSTATE_CTRL (1 << 1)
@@ -608,66 +684,279 @@ typedef struct ABSEntry {
     uint32_t    flat;
 } ABSEntry;
 
-static const VMStateDescription vmstate_gf_evdev = {
-    .name = "goldfish-events",
-    .version_id = 1,
-    .minimum_version_id = 1,
-    .fields = (VMStateField[]) {
-        VMSTATE_INT32(page, GoldfishEvDevState),
-        VMSTATE_UINT32_ARRAY(events, GoldfishEvDevState, MAX_EVENTS),
-        VMSTATE_UINT32(first, GoldfishEvDevState),
-        VMSTATE_UINT32(last, GoldfishEvDevState),
-        VMSTATE_UINT32(state, GoldfishEvDevState),
-        VMSTATE_UINT32(modifier_state, GoldfishEvDevState),
-        VMSTATE_END_OF_LIST()
+/* Number of words in the event queue. */
+static uint32_t events_queued(GoldfishEvDevState *s)
+{
+    return (s->last - s->first) & (s->events_size - 1);
+}
+
+/* Make room for at least |words| words in a queue holding none of them,
+ * keeping the queued words. Return false if the queue can't grow. */
+static bool events_reserve(GoldfishEvDevState *s, uint32_t words)
+{
+    uint32_t queued = events_queued(s);
+    uint32_t size = s->events_size;
+    uint32_t *events;
+
+    /* Keep one word free, so that first == last means empty. */
+    if (queued + words < size) {
+        return true;
+    }
+    while (queued + words >= size) {
+        size *= 2;
+    }
+    if (size > MAX_EVENT_WORDS) {
+        return false;
     }
-};
 
-static void enqueue_event(GoldfishEvDevState *s,
-                          unsigned int type, unsigned int code, int value)
+    events = g_new(uint32_t, size);
+    if (s->first <= s->last) {
+        memcpy(events, s->events + s->first, queued * sizeof(*events));
+    } else {
+        uint32_t head = s->events_size - s->first;
+        memcpy(events, s->events + s->first, head * sizeof(*events));
+        memcpy(events + head, s->events, s->last * sizeof(*events));
+    }
+    g_free(s->events);
+    s->events = events;
+    s->events_size = size;
+    s->first = 0;
+    s->last = queued;
+    return true;
+}
+
+/* Try to fold an EV_ABS event into one queued since the last EV_SYN:
+ * the guest only acts on the state at EV_SYN time, so a second value for
+ * the same axis of the same multi-touch slot replaces the first one. The
+ * queued events are tagged with the slot they apply to, -1 standing for
+ * the slot selected before the searched window. Tracking ids are never
+ * coalesced, as a touch ending and a new one starting in the same packet
+ * must remain distinct. Return true if the event was absorbed.
+ */
+static bool coalesce_event(GoldfishEvDevState *s,
+                           unsigned int code, int value)
 {
-    int  enqueued = s->last - s->first;
+    uint32_t mask = s->events_size - 1;
+    uint32_t count, idx, match = 0;
+    int64_t slot = -1, match_slot = -1;
+    bool found = false;
+
+    if (code == ABS_MT_TRACKING_ID) {
+        return false;
+    }
+
+    /* Only consider whole events the guest didn't start reading. */
+    s->packet_words = MIN(s->packet_words, events_queued(s));
+    count = MIN(s->packet_words / 3, COALESCE_WINDOW);
+    if (count == 0) {
+        return false;
+    }
 
-    if (enqueued < 0) {
-        enqueued += MAX_EVENTS;
+    idx = (s->last - count * 3) & mask;
+    for (; count > 0; count--, idx = (idx + 3) & mask) {
+        if (s->events[idx] != EV_ABS) {
+            continue;
+        }
+        if (s->events[(idx + 1) & mask] == code) {
+            match = idx;
+            match_slot = slot;
+            found = true;
+        }
+        if (s->events[(idx + 1) & mask] == ABS_MT_SLOT) {
+            slot = s->events[(idx + 2) & mask];
+        }
     }
 
-    if (enqueued + 3 > MAX_EVENTS) {
-        fprintf(stderr, "##KBD: Full queue, lose event\n");
+    if (!found) {
+        return false;
+    }
+    if (code == ABS_MT_SLOT) {
+        /* Only a slot selection directly followed by another one is
+         * redundant. */
+        if (match != ((s->last - 3) & mask)) {
+            return false;
+        }
+    } else if (match_slot != slot) {
+        return false;
+    }
+    s->events[(match + 2) & mask] = value;
+    s->coalesced++;
+    return true;
+}
+
+/* Set the level of the irq, with the locks described above */
+static void gf_evdev_set_irq(GoldfishEvDevState *s, bool level)
+{
+    s->irq_level = level;
+    if (s->irqfd.active) {
+        /* KVM lowers it when the guest is done with the interrupt, and
+         * asks gf_evdev_irq_pending() whether to raise it again. */
+        if (level) {
+            irqfd_line_raise(&s->irqfd);
+        }
+    } else {
+        qemu_set_irq(s->irq, level);
+    }
+}
+
+static bool gf_evdev_irq_pending(void *opaque)
+{
+    GoldfishEvDevState *s = opaque;
+    bool level;
+
+    qemu_mutex_lock(&s->lock);
+    level = s->irq_level;
+    qemu_mutex_unlock(&s->lock);
+    return level;
+}
+
+static void enqueue_event_locked(GoldfishEvDevState *s, unsigned int type,
+                                 unsigned int code, int value)
+{
+    if (type == EV_ABS && coalesce_event(s, code, value)) {
+        return;
+    }
+
+    if (!events_reserve(s, 3)) {
+        if (!s->dropped++) {
+            fprintf(stderr, "##KBD: Full queue, lose event\n");
+        }
         return;
     }
 
     if (s->first == s->last) {
         if (s->state == STATE_LIVE) {
-            qemu_irq_raise(s->irq);
+            gf_evdev_set_irq(s, true);
         } else {
             s->state = STATE_BUFFERED;
         }
     }
+    if (!s->input_ns && s->state == STATE_LIVE) {
+        s->input_ns = get_clock();
+    }
 
     s->events[s->last] = type;
-    s->last = (s->last + 1) & (MAX_EVENTS-1);
+    s->last = (s->last + 1) & (s->events_size - 1);
     s->events[s->last] = code;
-    s->last = (s->last + 1) & (MAX_EVENTS-1);
+    s->last = (s->last + 1) & (s->events_size - 1);
     s->events[s->last] = value;
-    s->last = (s->last + 1) & (MAX_EVENTS-1);
+    s->last = (s->last + 1) & (s->events_size - 1);
 
+    if (type == EV_SYN) {
+        s->packet_words = 0;
+    } else {
+        s->packet_words += 3;
+    }
 }
 
-static unsigned dequeue_event(GoldfishEvDevState *s)
+/* Must be called with the iothread lock held */
+static void enqueue_event(GoldfishEvDevState *s,
+                          unsigned int type, unsigned int code, int value)
 {
-    unsigned n;
+    qemu_mutex_lock(&s->lock);
+    enqueue_event_locked(s, type, code, value);
+    qemu_mutex_unlock(&s->lock);
+}
 
-    if (s->first == s->last) {
-        return 0;
+/* The queue is migrated as its word count followed by the queued words. */
+static void put_event_queue(QEMUFile *f, void *pv, size_t size)
+{
+    GoldfishEvDevState *s = pv;
+    uint32_t queued;
+    uint32_t i;
+
+    qemu_mutex_lock(&s->lock);
+    queued = events_queued(s);
+    qemu_put_be32(f, queued);
+    for (i = 0; i < queued; i++) {
+        qemu_put_be32(f, s->events[(s->first + i) & (s->events_size - 1)]);
     }
+    qemu_put_be32(f, s->packet_words);
+    qemu_mutex_unlock(&s->lock);
+}
 
-    n = s->events[s->first];
+static int get_event_queue(QEMUFile *f, void *pv, size_t size)
+{
+    GoldfishEvDevState *s = pv;
+    uint32_t queued = qemu_get_be32(f);
+    uint32_t i;
+
+    qemu_mutex_lock(&s->lock);
+    s->first = s->last = 0;
+    s->input_ns = 0;
+    if (!events_reserve(s, queued)) {
+        qemu_mutex_unlock(&s->lock);
+        return -EINVAL;
+    }
+    for (i = 0; i < queued; i++) {
+        s->events[i] = qemu_get_be32(f);
+    }
+    s->last = queued;
+    s->packet_words = qemu_get_be32(f);
+    qemu_mutex_unlock(&s->lock);
+    return 0;
+}
 
-    s->first = (s->first + 1) & (MAX_EVENTS - 1);
+static const VMStateInfo vmstate_info_event_queue = {
+    .name = "goldfish event queue",
+    .get  = get_event_queue,
+    .put  = put_event_queue,
+};
 
+/* The irq level itself is restored with the interrupt controller */
+static int gf_evdev_post_load(void *opaque, int version_id)
+{
+    GoldfishEvDevState *s = opaque;
+
+    qemu_mutex_lock(&s->lock);
+    s->irq_level = s->first != s->last && s->state == STATE_LIVE;
+    if (s->irqfd.active && s->irq_level) {
+        irqfd_line_raise(&s->irqfd);
+    }
+    qemu_mutex_unlock(&s->lock);
+    return 0;
+}
+
+static const VMStateDescription vmstate_gf_evdev = {
+    .name = "goldfish-events",
+    .version_id = 3,
+    .minimum_version_id = 3,
+    .post_load = gf_evdev_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_INT32(page, GoldfishEvDevState),
+        {
+            .name         = "events",
+            .version_id   = 0,
+            .field_exists = NULL,
+            .size         = 0,
+            .info         = &vmstate_info_event_queue,
+            .flags        = VMS_SINGLE,
+            .offset       = 0,
+        },
+        VMSTATE_UINT32(state, GoldfishEvDevState),
+        VMSTATE_UINT32(modifier_state, GoldfishEvDevState),
+        VMSTATE_UINT64(buf_addr, GoldfishEvDevState),
+        VMSTATE_UINT32(buf_size, GoldfishEvDevState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/* Bring the irq in line with the queue after the guest read from it:
+ * lower it once the queue is empty and, on x86, pulse it again if a whole
+ * event is still waiting. Called without the device lock, as raising or
+ * lowering the irq needs the iothread lock, which must be taken first,
+ * unless the irq goes through the irqfd. */
+static void dequeue_update_irq(GoldfishEvDevState *s)
+{
+    bool locked = qemu_mutex_iothread_locked() || s->irqfd.active;
+
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+    qemu_mutex_lock(&s->lock);
+    /* An event enqueued meanwhile has raised the irq already */
     if (s->first == s->last) {
-        qemu_irq_lower(s->irq);
+        gf_evdev_set_irq(s, false);
     }
 #ifdef TARGET_I386
     /*
@@ -680,16 +969,123 @@ static unsigned dequeue_event(GoldfishEvDevState *s)
      * queue, the goldfish event device will re-assert the IRQ so that
      * the driver can be notified to fetch the event again.
      */
-    else if (((s->first + 2) & (MAX_EVENTS - 1)) < s->last ||
-               (s->first & (MAX_EVENTS - 1)) > s->last) {
+    else if (events_queued(s) >= 3) {
         /* if there still is an event */
-        qemu_irq_lower(s->irq);
-        qemu_irq_raise(s->irq);
+        gf_evdev_set_irq(s, false);
+        gf_evdev_set_irq(s, true);
     }
 #endif
+    qemu_mutex_unlock(&s->lock);
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+/* Once the guest has read the whole queue, with the device lock held,
+ * return the host time of the input it got, or 0. */
+static int64_t dequeue_input_time(GoldfishEvDevState *s)
+{
+    int64_t input_ns = s->input_ns;
+
+    s->input_ns = 0;
+    return input_ns;
+}
+
+static unsigned dequeue_event(GoldfishEvDevState *s)
+{
+    int64_t input_ns = 0;
+    bool update_irq;
+    unsigned n;
+
+    qemu_mutex_lock(&s->lock);
+    if (s->first == s->last) {
+        qemu_mutex_unlock(&s->lock);
+        return 0;
+    }
+
+    n = s->events[s->first];
+
+    s->first = (s->first + 1) & (s->events_size - 1);
+
+    /* Most words are read with more of the same event queued behind
+     * them, and leave the irq alone */
+    update_irq = s->first == s->last;
+    if (update_irq) {
+        input_ns = dequeue_input_time(s);
+    }
+#ifdef TARGET_I386
+    update_irq = update_irq || events_queued(s) >= 3;
+#endif
+    qemu_mutex_unlock(&s->lock);
+
+    if (input_ns) {
+        input_latency_consumed(input_ns, get_clock());
+    }
+    if (update_irq) {
+        dequeue_update_irq(s);
+    }
     return n;
 }
 
+/* Copy as many whole queued events as fit into the guest buffer set up
+ * through REG_BUF_ADDR and REG_BUF_SIZE, and return their count. */
+static unsigned dequeue_events(GoldfishEvDevState *s)
+{
+    uint32_t words[3 * 64];
+    hwaddr addr;
+    unsigned count = 0;
+    int64_t input_ns = 0;
+    bool empty;
+
+    qemu_mutex_lock(&s->lock);
+    addr = s->buf_addr;
+    do {
+        unsigned n = 0;
+
+        while (n + 3 <= ARRAY_SIZE(words) && count < s->buf_size &&
+               s->first != s->last) {
+            int i;
+            for (i = 0; i < 3; i++) {
+                words[n++] = tswap32(s->events[s->first]);
+                s->first = (s->first + 1) & (s->events_size - 1);
+            }
+            count++;
+        }
+        empty = s->first == s->last;
+        if (!n) {
+            break;
+        }
+
+        /* Guest memory may be MMIO, don't access it with the lock held */
+        qemu_mutex_unlock(&s->lock);
+        cpu_physical_memory_write(addr, words, n * sizeof(words[0]));
+        addr += n * sizeof(words[0]);
+        qemu_mutex_lock(&s->lock);
+    } while (count < s->buf_size && s->first != s->last);
+    empty = s->first == s->last;
+    if (empty) {
+        input_ns = dequeue_input_time(s);
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    if (input_ns) {
+        input_latency_consumed(input_ns, get_clock());
+    }
+
+    /* Unlike dequeue_event(), the whole queue is drained at once in the
+     * normal case, so only x86 needs a new edge if we stopped early. */
+#ifdef TARGET_I386
+    if (count || empty) {
+        dequeue_update_irq(s);
+    }
+#else
+    if (empty) {
+        dequeue_update_irq(s);
+    }
+#endif
+    return count;
+}
+
 static int get_page_len(GoldfishEvDevState *s)
 {
     int page = s->page;
@@ -726,6 +1122,128 @@ static int get_page_data(GoldfishEvDevState *s, int offset)
     return 0;
 }
 
+int gf_get_event_stats(GoldfishEventStats *stats)
+{
+    DeviceState *s = qdev_find_recursive(sysbus_get_default(),
+                                           TYPE_GOLDFISHEVDEV);
+    GoldfishEvDevState *dev = GOLDFISHEVDEV(s);
+
+    if (!dev) {
+        return -1;
+    }
+    qemu_mutex_lock(&dev->lock);
+    stats->queued = events_queued(dev) / 3;
+    stats->capacity = (dev->events_size - 1) / 3;
+    stats->coalesced = dev->coalesced;
+    stats->dropped = dev->dropped;
+    qemu_mutex_unlock(&dev->lock);
+    return 0;
+}
+
+static gint script_event_compare(gconstpointer a, gconstpointer b)
+{
+    const ScriptEvent *ea = a, *eb = b;
+
+    if (ea->time != eb->time) {
+        return ea->time < eb->time ? -1 : 1;
+    }
+    return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+static void gf_evdev_script_tick(void *opaque)
+{
+    GoldfishEvDevState *s = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    const ScriptEvent *ev;
+
+    while (s->script_pos < s->script->len) {
+        ev = &g_array_index(s->script, ScriptEvent, s->script_pos);
+        if (ev->time > now) {
+            timer_mod(s->script_timer, ev->time);
+            break;
+        }
+        enqueue_event(s, ev->type, ev->code, ev->value);
+        s->script_pos++;
+    }
+
+    /* Drop the sent events once they are the larger part of the array. */
+    if (s->script_pos == s->script->len) {
+        g_array_set_size(s->script, 0);
+        s->script_pos = 0;
+    } else if (s->script_pos > s->script->len / 2) {
+        g_array_remove_range(s->script, 0, s->script_pos);
+        s->script_pos = 0;
+    }
+}
+
+int gf_event_script(const GoldfishScriptedEvent *events, int count)
+{
+    DeviceState *s = qdev_find_recursive(sysbus_get_default(),
+                                           TYPE_GOLDFISHEVDEV);
+    GoldfishEvDevState *dev = GOLDFISHEVDEV(s);
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    guint old_len;
+    bool sorted;
+    int i;
+
+    if (!dev) {
+        return -1;
+    }
+    if (count > MAX_SCRIPT_EVENTS - (int)(dev->script->len - dev->script_pos)) {
+        return -1;
+    }
+
+    old_len = dev->script->len;
+    g_array_set_size(dev->script, old_len + count);
+    sorted = true;
+    for (i = 0; i < count; i++) {
+        ScriptEvent *ev = &g_array_index(dev->script, ScriptEvent,
+                                         old_len + i);
+        ev->time = start + MAX(events[i].time_us, 0) * SCALE_US;
+        ev->seq = dev->script_seq++;
+        ev->type = events[i].type;
+        ev->code = events[i].code;
+        ev->value = events[i].value;
+        if (old_len + i > dev->script_pos &&
+            script_event_compare(ev - 1, ev) > 0) {
+            sorted = false;
+        }
+    }
+
+    /* Scripts are normally in time order and don't overlap, so the array
+     * rarely needs sorting. */
+    if (!sorted) {
+        g_array_remove_range(dev->script, 0, dev->script_pos);
+        dev->script_pos = 0;
+        g_array_sort(dev->script, script_event_compare);
+    }
+
+    gf_evdev_script_tick(dev);
+    return 0;
+}
+
+void qmp_goldfish_event_script(GoldfishEventList *events, Error **errp)
+{
+    GoldfishScriptedEvent *script;
+    GoldfishEventList *e;
+    int count = 0;
+
+    for (e = events; e; e = e->next) {
+        count++;
+    }
+    script = g_new(GoldfishScriptedEvent, count);
+    for (count = 0, e = events; e; e = e->next, count++) {
+        script[count].time_us = e->value->time;
+        script[count].type = e->value->type;
+        script[count].code = e->value->code;
+        script[count].value = e->value->value;
+    }
+    if (gf_event_script(script, count) < 0) {
+        error_setg(errp, "No goldfish event device, or too many events");
+    }
+    g_free(script);
+}
+
 int gf_event_send(int type, int code, int value)
 {
     DeviceState *s = qdev_find_recursive(sysbus_get_default(),
@@ -739,31 +1257,60 @@ int gf_event_send(int type, int code, int value)
     return 0;
 }
 
-static uint64_t events_read(void *opaque, hwaddr offset, unsigned size)
+/* The driver reads REG_LEN of PAGE_ABSDATA while probing the device */
+static void events_set_live(GoldfishEvDevState *s)
 {
-    GoldfishEvDevState *s = (GoldfishEvDevState *)opaque;
+    bool locked = qemu_mutex_iothread_locked();
 
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+    qemu_mutex_lock(&s->lock);
     /* This gross hack below is used to ensure that we
      * only raise the IRQ when the kernel driver is
      * properly ready! If done before this, the driver
      * becomes confused and ignores all input events
      * as soon as one was buffered!
      */
-    if (offset == REG_LEN && s->page == PAGE_ABSDATA) {
+    if (s->page == PAGE_ABSDATA) {
         if (s->state == STATE_BUFFERED) {
-            qemu_irq_raise(s->irq);
+            gf_evdev_set_irq(s, true);
         }
         s->state = STATE_LIVE;
     }
+    qemu_mutex_unlock(&s->lock);
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+static uint64_t events_read(void *opaque, hwaddr offset, unsigned size)
+{
+    GoldfishEvDevState *s = (GoldfishEvDevState *)opaque;
+    uint64_t ret;
 
     switch (offset) {
     case REG_READ:
         return dequeue_event(s);
     case REG_LEN:
-        return get_page_len(s);
+        if (atomic_read(&s->state) != STATE_LIVE &&
+            atomic_read(&s->page) == PAGE_ABSDATA) {
+            events_set_live(s);
+        }
+        qemu_mutex_lock(&s->lock);
+        ret = get_page_len(s);
+        qemu_mutex_unlock(&s->lock);
+        return ret;
+    case REG_FEATURES:
+        return EVENTS_FEATURE_BULK_READ;
+    case REG_READ_MANY:
+        return dequeue_events(s);
     default:
         if (offset >= REG_DATA) {
-            return get_page_data(s, offset - REG_DATA);
+            qemu_mutex_lock(&s->lock);
+            ret = get_page_data(s, offset - REG_DATA);
+            qemu_mutex_unlock(&s->lock);
+            return ret;
         }
         qemu_log_mask(LOG_GUEST_ERROR,
                       "goldfish events device read: bad offset %x\n",
@@ -776,16 +1323,28 @@ static void events_write(void *opaque, hwaddr offset,
                          uint64_t val, unsigned size)
 {
     GoldfishEvDevState *s = (GoldfishEvDevState *)opaque;
+
+    qemu_mutex_lock(&s->lock);
     switch (offset) {
     case REG_SET_PAGE:
         s->page = val;
         break;
+    case REG_BUF_ADDR:
+        s->buf_addr = deposit64(s->buf_addr, 0, 32, val);
+        break;
+    case REG_BUF_ADDR_HIGH:
+        s->buf_addr = deposit64(s->buf_addr, 32, 32, val);
+        break;
+    case REG_BUF_SIZE:
+        s->buf_size = val;
+        break;
     default:
         qemu_log_mask(LOG_GUEST_ERROR,
                       "goldfish events device write: bad offset %x\n",
                       (int)offset);
         break;
     }
+    qemu_mutex_unlock(&s->lock);
 }
 
 static const MemoryRegionOps gf_evdev_ops = {
@@ -1133,8 +1692,19 @@ static void gf_evdev_init(Object *obj)
     DeviceState *dev = DEVICE(obj);
     SysBusDevice *sbd = SYS_BUS_DEVICE(obj);
 
+    s->events_size = MIN_EVENT_WORDS;
+    s->events = g_new(uint32_t, s->events_size);
+    s->script = g_array_new(FALSE, FALSE, sizeof(ScriptEvent));
+    s->script_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                   gf_evdev_script_tick, s);
+    qemu_mutex_init(&s->lock);
+    input_latency_init();
+
     memory_region_init_io(&s->iomem, obj, &gf_evdev_ops, s,
                           "goldfish-events", 0x1000);
+    /* The guest reads events one word at a time, only take the iothread
+     * lock when the irq has to change */
+    memory_region_set_lockless(&s->iomem, true);
     sysbus_init_mmio(sbd, &s->iomem);
     sysbus_init_irq(sbd, &s->irq);
 
@@ -1347,6 +1917,8 @@ static void gf_evdev_realize(DeviceState *dev, Error **errp)
         events_set_bit(s, EV_SW, 0);
     }
 
+    irqfd_line_init(&s->irqfd, s->irqfd_gsi, gf_evdev_irq_pending, s);
+
 #if defined(USE_ANDROID_EMU)
     // The android control agent might fire buffered events to the device, so
     // ensure that it is enabled after the initialization is complete.
@@ -1358,10 +1930,19 @@ static void gf_evdev_reset(DeviceState *dev)
 {
     GoldfishEvDevState *s = GOLDFISHEVDEV(dev);
 
+    qemu_mutex_lock(&s->lock);
     s->state = STATE_INIT;
     s->first = 0;
     s->last = 0;
+    s->packet_words = 0;
+    s->input_ns = 0;
     s->state = 0;
+    s->buf_addr = 0;
+    s->buf_size = 0;
+    qemu_mutex_unlock(&s->lock);
+    timer_del(s->script_timer);
+    g_array_set_size(s->script, 0);
+    s->script_pos = 0;
 }
 
 static Property gf_evdev_props[] = {
@@ -1376,6 +1957,7 @@ static Property gf_evdev_props[] = {
                      have_touch, false),
     DEFINE_PROP_BOOL("have-multitouch", GoldfishEvDevState,
                      have_multitouch, true),
+    DEFINE_PROP_INT32("irqfd-gsi", GoldfishEvDevState, irqfd_gsi, -1),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -25,6 +25,8 @@
 #include "sysemu/char.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
+#include "qemu/bswap.h"
+#include "qemu/queue.h"
 #include "trace.h"
 #include "hw/input/goldfish_sensors.h"
 #include "hw/misc/android_pipe.h"
@@ -40,13 +42,14 @@
 #endif
 
 enum {
-    ANDROID_SENSOR_ACCELERATION
+    ANDROID_SENSOR_ACCELERATION,
+    MAX_SENSORS
 } SensorID_t;
 
 /* The sensor configuration is global to whole driver */
 typedef struct SensorsConfig {
     /* Timer tick stuff */
-    int         delay_ms;
+    int64_t     delay_us;
 
     /* Sensor data */
     int         enabled_mask;
@@ -58,13 +61,28 @@ typedef struct SensorsConfig {
 } SensorsConfig;
 
 struct SensorsConfig sensor_config = {
-    800,
+    800 * 1000,
     0,
     {
         .acceleration = { 0.0, 0.0, 0.0 }
     }
 };
 
+/* Shortest delay between reports, and between samples when they are
+ * batched, which makes high rates affordable. */
+#define SENSORS_MIN_DELAY_US        20000
+#define SENSORS_MIN_BATCH_DELAY_US  1000
+
+/* Number of batched samples, like the FIFO of a hardware sensor hub. */
+#define SENSORS_FIFO_SIZE           1024
+
+/* The values of the enabled sensors at a given time */
+typedef struct SensorsSample {
+    int64_t     time_us;
+    uint32_t    mask;
+    float       values[MAX_SENSORS * 3];
+} SensorsSample;
+
 /* There will be one pipe connection per open connection with the
  * guest. Generally there will be a control path used to interrogate
  * the list of sensors and a data path which will trigger the periodic
@@ -75,19 +93,41 @@ typedef struct SensorsPipe {
     void      *hwpipe;
     /* Sensor Ticks */
     QEMUTimer *periodic_tick;
-    /* Arrays containing framed strings, outstanding is used for
-     * staging the frames as they come in/go out.
+    /* Framed messages waiting to be read by the guest */
+    QemudBuffer send;
+    /* Partially received frames from the HAL */
+    QemudBuffer recv;
+
+    /* Reporting mode, as negotiated by the HAL module */
+    bool       binary;
+    bool       on_change;
+    int64_t    last_report_us;
+    int64_t    next_tick_ns;
+
+    /* Batched samples, the oldest at fifo_head. Samples are delivered
+     * all at once when the oldest is batch_us old or the FIFO is full.
      */
-    GPtrArray *send_data;
-    GString   *send_outstanding;
-    GPtrArray *recv_data;
-    GString   *recv_outstanding;
+    int64_t    batch_us;
+    SensorsSample *fifo;
+    unsigned   fifo_head;
+    unsigned   fifo_count;
+    uint64_t   fifo_dropped;
+
+    QLIST_ENTRY(SensorsPipe) next;
 } SensorsPipe;
 
+static QLIST_HEAD(, SensorsPipe) sensors_pipes =
+    QLIST_HEAD_INITIALIZER(sensors_pipes);
+
+static void goldfish_sensors_changed(void);
+
 #define RADIANS_PER_DEGREE (M_PI / 180.0)
 
 void goldfish_sensors_set_rotation(int rotation)
 {
+    typeof(sensor_config.sensors.acceleration) old =
+        sensor_config.sensors.acceleration;
+
     /* The Android framework computes the orientation by looking at
      * the accelerometer sensor (*not* the orientation sensor !)
      *
@@ -134,18 +174,30 @@ void goldfish_sensors_set_rotation(int rotation)
         g_assert_not_reached();
         break;
     }
+
+    if (memcmp(&old, &sensor_config.sensors.acceleration, sizeof(old))) {
+        goldfish_sensors_changed();
+    }
+}
+
+static void sensor_queue_data(SensorsPipe *sp, const uint8_t *buf, int len)
+{
+    qemud_buffer_put_frame(&sp->send, buf, len);
 }
 
-/* I'll just append to a GString holding our data here, which we
- * truncate as we page back out....
- */
 static void sensor_send_data(SensorsPipe *sp, const uint8_t *buf, int len)
 {
-    gchar *msg = g_strndup((gchar *) buf, len);
-    g_ptr_array_add(sp->send_data, msg);
+    sensor_queue_data(sp, buf, len);
     android_pipe_wake(sp->hwpipe, PIPE_WAKE_READ);
 }
 
+static void sensor_put_float(float *dst, float value)
+{
+    uint32_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    stl_le_p(dst, bits);
+}
 
 /*
  * - when the qemu-specific sensors HAL module starts, it sends
@@ -187,8 +239,143 @@ static void sensor_send_data(SensorsPipe *sp, const uint8_t *buf, int len)
  *   was "taken" by this code. This is adjusted by the HAL module to
  *   emulated system time (using the first sync: to compute an adjustment
  *   offset).
+ *
+ * - the HAL module can send "set-format:binary", which this code
+ *   acknowledges with "format:binary". From then on, each report is sent
+ *   as a single GoldfishSensorsReport message instead of the text lines.
+ *   Older versions of this code ignore the command, so a module that
+ *   doesn't get the acknowledgement keeps parsing text.
+ *
+ * - the HAL module can send "set-mode:on-change", acknowledged with
+ *   "mode:on-change". Reports are then only sent when a sensor is enabled
+ *   and when the value of an enabled sensor changes, at most once per
+ *   delay, rather than periodically. "set-mode:periodic" restores the
+ *   default.
+ *
+ * - the HAL module can send "set-batch:<latency>", acknowledged with
+ *   "batch:<latency>", where <latency> is an integer in milli-seconds.
+ *   In periodic mode, sensors are then still sampled every delay, but the
+ *   samples are kept and sent all at once when the oldest one is
+ *   <latency> old, or when SENSORS_FIFO_SIZE samples are waiting (the
+ *   oldest is dropped if they can't be sent). Each sample keeps its own
+ *   sync:<time_us> or binary report time. A <latency> of 0 stops
+ *   batching.
+ *
+ * - the HAL module can send "set-delay-us:<delay>", which is the same as
+ *   "set-delay:" with a delay in micro-seconds. Delays shorter than
+ *   SENSORS_MIN_DELAY_US are only honoured while batching.
  */
 
+static void goldfish_sensor_sample(SensorsSample *sample, int64_t now_us)
+{
+    float *values = sample->values;
+
+    sample->time_us = now_us;
+    sample->mask = sensor_config.enabled_mask & ((1 << MAX_SENSORS) - 1);
+    if (sample->mask & (1<<ANDROID_SENSOR_ACCELERATION)) {
+        *values++ = sensor_config.sensors.acceleration.x;
+        *values++ = sensor_config.sensors.acceleration.y;
+        *values++ = sensor_config.sensors.acceleration.z;
+    }
+}
+
+/* Queue the messages of one sample for the guest, without waking it. */
+static void goldfish_sensor_queue_sample(SensorsPipe *sp,
+                                         const SensorsSample *sample)
+{
+    const float *src = sample->values;
+    char             buffer[128];
+
+    if (sp->binary) {
+        GoldfishSensorsReport *report = (GoldfishSensorsReport *)buffer;
+        float *values = report->values;
+        int i;
+
+        QEMU_BUILD_BUG_ON(sizeof(*report) + MAX_SENSORS * 3 * sizeof(float) >
+                          sizeof(buffer));
+        stl_le_p(&report->magic, GOLDFISH_SENSORS_REPORT_MAGIC);
+        stl_le_p(&report->mask, sample->mask);
+        stq_le_p(&report->time_us, sample->time_us);
+        for (i = 0; i < MAX_SENSORS; i++) {
+            if (sample->mask & (1 << i)) {
+                sensor_put_float(values++, *src++);
+                sensor_put_float(values++, *src++);
+                sensor_put_float(values++, *src++);
+            }
+        }
+        sensor_queue_data(sp, (uint8_t *)buffer,
+                          (uint8_t *)values - (uint8_t *)buffer);
+        return;
+    }
+
+    if (sample->mask & (1<<ANDROID_SENSOR_ACCELERATION)) {
+        snprintf(buffer, sizeof buffer, "acceleration:%g:%g:%g",
+                 src[0], src[1], src[2]);
+        sensor_queue_data(sp, (uint8_t *)buffer, strlen(buffer));
+    }
+
+    snprintf(buffer, sizeof buffer, "sync:%" PRId64, sample->time_us);
+    sensor_queue_data(sp, (uint8_t *)buffer, strlen(buffer));
+}
+
+/* Send all the batched samples to the guest at once. */
+static void goldfish_sensor_flush(SensorsPipe *sp)
+{
+    if (sp->fifo_count == 0) {
+        return;
+    }
+    trace_goldfish_sensors_flush(sp->hwpipe, sp->fifo_count);
+    while (sp->fifo_count > 0) {
+        goldfish_sensor_queue_sample(sp, &sp->fifo[sp->fifo_head]);
+        sp->fifo_head = (sp->fifo_head + 1) % SENSORS_FIFO_SIZE;
+        sp->fifo_count--;
+    }
+    android_pipe_wake(sp->hwpipe, PIPE_WAKE_READ);
+}
+
+/* Send a report of the enabled sensors, or batch it. */
+static void goldfish_sensor_report(SensorsPipe *sp, int64_t now_us)
+{
+    SensorsSample sample, *slot;
+
+    sp->last_report_us = now_us;
+    goldfish_sensor_sample(&sample, now_us);
+
+    if (sp->batch_us == 0 || sp->on_change || sample.mask == 0) {
+        goldfish_sensor_flush(sp);
+        goldfish_sensor_queue_sample(sp, &sample);
+        android_pipe_wake(sp->hwpipe, PIPE_WAKE_READ);
+        return;
+    }
+
+    if (!sp->fifo) {
+        sp->fifo = g_new(SensorsSample, SENSORS_FIFO_SIZE);
+    }
+    if (sp->fifo_count == SENSORS_FIFO_SIZE) {
+        /* The guest stopped reading, keep the most recent samples. */
+        sp->fifo_head = (sp->fifo_head + 1) % SENSORS_FIFO_SIZE;
+        sp->fifo_count--;
+        sp->fifo_dropped++;
+        DPRINTF("FIFO full, %" PRIu64 " samples dropped\n",
+                sp->fifo_dropped);
+    }
+    slot = &sp->fifo[(sp->fifo_head + sp->fifo_count) % SENSORS_FIFO_SIZE];
+    *slot = sample;
+    sp->fifo_count++;
+
+    if (sp->fifo_count == SENSORS_FIFO_SIZE ||
+        now_us - sp->fifo[sp->fifo_head].time_us >= sp->batch_us) {
+        goldfish_sensor_flush(sp);
+    }
+}
+
+static int64_t goldfish_sensor_delay_us(SensorsPipe *sp)
+{
+    return MAX(sensor_config.delay_us,
+               sp->batch_us ? SENSORS_MIN_BATCH_DELAY_US
+                            : SENSORS_MIN_DELAY_US);
+}
+
 /* this function is called periodically to send sensor reports
  * to the HAL module, and re-arm the timer if necessary
  */
@@ -196,36 +383,57 @@ static void
 goldfish_sensor_tick(void *opaque)
 {
     SensorsPipe *sp = opaque;
-    int64_t          delay = sensor_config.delay_ms;
-    int64_t          now_ms;
+    int64_t          delay = goldfish_sensor_delay_us(sp) * SCALE_US;
+    int64_t          now_ns;
+    int64_t          start_ns = get_clock();
     uint32_t         mask  = sensor_config.enabled_mask;
-    char             buffer[128];
 
-    if (sensor_config.enabled_mask & (1<<ANDROID_SENSOR_ACCELERATION)) {
-        snprintf(buffer, sizeof buffer, "acceleration:%g:%g:%g",
-                 sensor_config.sensors.acceleration.x,
-                 sensor_config.sensors.acceleration.y,
-                 sensor_config.sensors.acceleration.z);
-        sensor_send_data(sp, (uint8_t *)buffer, strlen(buffer));
-    }
-
-    now_ms = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
-
-    snprintf(buffer, sizeof buffer, "sync:%" PRId64, now_ms * 1000);
-    sensor_send_data(sp, (uint8_t *)buffer, strlen(buffer));
+    now_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    goldfish_sensor_report(sp, now_ns / SCALE_US);
+    trace_goldfish_sensors_tick(sp->hwpipe, mask, now_ns - sp->next_tick_ns,
+                                sp->fifo_count, get_clock() - start_ns);
 
     /* rearm timer, use a minimum delay of 20 ms, just to
-     * be safe.
+     * be safe (1 ms when batching). In on-change mode, the next
+     * report is triggered by goldfish_sensors_changed() instead.
      */
-    if (mask == 0) {
+    if (mask == 0 || sp->on_change) {
         return;
     }
 
-    if (delay < 20) {
-        delay = 20;
+    /* Keep the period exact when the timer fires on time, samples would
+     * drift at high rates otherwise. */
+    if (now_ns < sp->next_tick_ns || now_ns - sp->next_tick_ns >= delay) {
+        sp->next_tick_ns = now_ns;
+    }
+    sp->next_tick_ns += delay;
+    timer_mod_ns(sp->periodic_tick, sp->next_tick_ns);
+}
+
+/* Called when the value of a sensor changes, to report it to the pipes in
+ * on-change mode. Changes closer than the delay are folded into a single
+ * report, sent when the delay has elapsed. */
+static void goldfish_sensors_changed(void)
+{
+    int64_t now_us = qemu_clock_get_us(QEMU_CLOCK_VIRTUAL);
+    int64_t delay = MAX(sensor_config.delay_us, SENSORS_MIN_DELAY_US);
+    SensorsPipe *sp;
+
+    if (sensor_config.enabled_mask == 0) {
+        return;
     }
 
-    timer_mod(sp->periodic_tick, now_ms + delay);
+    QLIST_FOREACH(sp, &sensors_pipes, next) {
+        if (!sp->on_change || timer_pending(sp->periodic_tick)) {
+            continue;
+        }
+        if (now_us - sp->last_report_us >= delay) {
+            goldfish_sensor_report(sp, now_us);
+        } else {
+            timer_mod_ns(sp->periodic_tick,
+                         (sp->last_report_us + delay) * SCALE_US);
+        }
+    }
 }
 
 /* Incoming command from the guest */
@@ -253,13 +461,74 @@ static ssize_t goldfish_sensors_have_data(SensorsPipe *sp, const gchar *buf)
      * between sensor events
      */
     if (len > 10 && g_str_has_prefix(buf, "set-delay:")) {
-        sensor_config.delay_ms = atoi((const char *)buf+10);
+        sensor_config.delay_us = atoi((const char *)buf+10) * 1000LL;
         if (sensor_config.enabled_mask != 0) {
             goldfish_sensor_tick(sp);
         }
         return len;
     }
 
+    /* "set-delay-us:<delay>" is the same in micro-seconds */
+    if (len > 13 && g_str_has_prefix(buf, "set-delay-us:")) {
+        sensor_config.delay_us = atoi((const char *)buf+13);
+        if (sensor_config.enabled_mask != 0) {
+            goldfish_sensor_tick(sp);
+        }
+        return len;
+    }
+
+    /* "set-batch:<latency>" sets the longest time in milliseconds
+     * samples can wait before being sent, 0 to send them at once
+     */
+    if (len > 10 && g_str_has_prefix(buf, "set-batch:")) {
+        int latency_ms = MAX(atoi((const char *)buf+10), 0);
+        char reply[32];
+
+        sp->batch_us = latency_ms * 1000LL;
+        if (sp->batch_us == 0) {
+            goldfish_sensor_flush(sp);
+        }
+        snprintf(reply, sizeof(reply), "batch:%d", latency_ms);
+        sensor_send_data(sp, (const uint8_t *)reply, strlen(reply));
+        return len;
+    }
+
+    /* "set-format:<format>" selects text (the default) or binary
+     * reports.
+     */
+    if (len > 11 && g_str_has_prefix(buf, "set-format:")) {
+        if (!strcmp(buf + 11, "binary")) {
+            sp->binary = true;
+            sensor_send_data(sp, (const uint8_t *)"format:binary", 13);
+        } else if (!strcmp(buf + 11, "text")) {
+            sp->binary = false;
+            sensor_send_data(sp, (const uint8_t *)"format:text", 11);
+        } else {
+            DPRINTF("bad set-format: command (%s)", buf);
+        }
+        return len;
+    }
+
+    /* "set-mode:<mode>" selects periodic (the default) or on-change
+     * reports.
+     */
+    if (len > 9 && g_str_has_prefix(buf, "set-mode:")) {
+        if (!strcmp(buf + 9, "on-change")) {
+            sp->on_change = true;
+            timer_del(sp->periodic_tick);
+            sensor_send_data(sp, (const uint8_t *)"mode:on-change", 14);
+        } else if (!strcmp(buf + 9, "periodic")) {
+            sp->on_change = false;
+            sensor_send_data(sp, (const uint8_t *)"mode:periodic", 13);
+            if (sensor_config.enabled_mask != 0) {
+                goldfish_sensor_tick(sp);
+            }
+        } else {
+            DPRINTF("bad set-mode: command (%s)", buf);
+        }
+        return len;
+    }
+
     /* "set:<name>:<state>" is used to enable/disable a given
      * sensor. <state> must be 0 or 1
      */
@@ -296,12 +565,11 @@ static void *sensors_pipe_init(void *hwpipe, void *opaque, const char *args)
     DPRINTF("hwpipe=%p\n", hwpipe);
     pipe = g_malloc0(sizeof(SensorsPipe));
     pipe->hwpipe = hwpipe;
-    pipe->periodic_tick = timer_new_ms(QEMU_CLOCK_VIRTUAL,
+    pipe->periodic_tick = timer_new_ns(QEMU_CLOCK_VIRTUAL,
                                        goldfish_sensor_tick, pipe);
-    pipe->send_data = g_ptr_array_new_full(8, g_free);
-    pipe->recv_data = g_ptr_array_new_full(8, g_free);
-    pipe->send_outstanding = g_string_sized_new(128);
-    pipe->recv_outstanding = g_string_sized_new(128);
+    qemud_buffer_init(&pipe->send, 1024);
+    qemud_buffer_init(&pipe->recv, 128);
+    QLIST_INSERT_HEAD(&sensors_pipes, pipe, next);
     return pipe;
 }
 
@@ -309,13 +577,13 @@ static void sensors_pipe_close(void *opaque)
 {
     SensorsPipe *pipe = opaque;
     DPRINTF("pipe %p, hwpipe %p\n", pipe, pipe->hwpipe);
+    QLIST_REMOVE(pipe, next);
     timer_del(pipe->periodic_tick);
     timer_free(pipe->periodic_tick);
     pipe->periodic_tick = NULL;
-    g_ptr_array_free(pipe->send_data, TRUE);
-    g_ptr_array_free(pipe->recv_data, TRUE);
-    g_string_free(pipe->send_outstanding, TRUE);
-    g_string_free(pipe->recv_outstanding, TRUE);
+    g_free(pipe->fifo);
+    qemud_buffer_destroy(&pipe->send);
+    qemud_buffer_destroy(&pipe->recv);
     g_free(pipe);
 }
 
@@ -324,11 +592,9 @@ static void sensors_pipe_wake(void *opaque, int flags)
     SensorsPipe *pipe = opaque;
 
     /* we have data for the guest to read */
-    if (flags & PIPE_WAKE_READ
-        && (pipe->send_outstanding->len > 0 || pipe->send_data->len > 0)) {
-        DPRINTF("0x%x:PIPE_WAKE_READ we have %d bytes, %d msgs\n", flags,
-                (int) pipe->send_outstanding->len,
-                pipe->send_data->len);
+    if (flags & PIPE_WAKE_READ && qemud_buffer_len(&pipe->send) > 0) {
+        DPRINTF("0x%x:PIPE_WAKE_READ we have %d bytes\n", flags,
+                (int) qemud_buffer_len(&pipe->send));
         android_pipe_wake(pipe->hwpipe, PIPE_WAKE_READ);
     }
 
@@ -344,34 +610,30 @@ static int sensors_pipe_recv(void *opaque, AndroidPipeBuffer *buffers,
 {
     SensorsPipe *pipe = opaque;
 
-    DPRINTF("%d outstanding msgs\n", pipe->send_data->len);
-    if (pipe->send_outstanding->len > 0 || pipe->send_data->len > 0) {
-        return qemud_pipe_write_buffers(pipe->send_data, pipe->send_outstanding,
-                                        buffers, cnt);
-    } else {
+    DPRINTF("%d outstanding bytes\n", (int) qemud_buffer_len(&pipe->send));
+    if (qemud_buffer_len(&pipe->send) == 0) {
         return PIPE_ERROR_AGAIN;
     }
+
+    return qemud_buffer_drain(&pipe->send, buffers, cnt);
 }
 
 /*
- * We use the qemud helper functions to de-serialise the qemud framed
- * messages into a series of strings. We then just process each entry
- * in the array and free the strings when done.
+ * We use the qemud helper functions to split the incoming data into
+ * qemud frames, each of which is handled in place as a string.
  */
 static int sensors_pipe_send(void *opaque, const AndroidPipeBuffer* buffers,
                              int cnt)
 {
     SensorsPipe *pipe = opaque;
-    int consumed = qemud_pipe_read_buffers(buffers, cnt,
-                                           pipe->recv_data,
-                                           pipe->recv_outstanding);
+    int consumed = qemud_buffer_append(&pipe->recv, buffers, cnt);
+    char *msg;
+    uint32_t len;
 
-    DPRINTF("pipe %p, messages: %d\n", pipe, pipe->recv_data->len);
+    DPRINTF("pipe %p, consumed: %d\n", pipe, consumed);
 
-    while (pipe->recv_data->len > 0) {
-        gchar *msg = g_ptr_array_index(pipe->recv_data, 0);
+    while (qemud_buffer_next_frame(&pipe->recv, &msg, &len)) {
         goldfish_sensors_have_data(pipe, msg);
-        g_ptr_array_remove(pipe->recv_data, msg);
     }
 
     return consumed;
@@ -382,7 +644,7 @@ static unsigned sensors_pipe_poll(void *opaque)
     SensorsPipe *pipe = opaque;
     unsigned flags = 0;
 
-    if (pipe->send_outstanding->len > 0 || pipe->send_data->len > 0) {
+    if (qemud_buffer_len(&pipe->send) > 0) {
         flags |= PIPE_POLL_IN;
     }
     flags |= PIPE_POLL_OUT;
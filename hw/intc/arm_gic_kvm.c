@@ -553,6 +553,12 @@ static void kvm_arm_gic_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    /* Devices can raise SPIs through irqfds, SPI n being GSI n */
+    if (kvm_check_extension(kvm_state, KVM_CAP_IRQFD)) {
+        kvm_irqfds_allowed = true;
+        kvm_gsi_direct_mapping = true;
+    }
+
     /* Distributor */
     memory_region_init_reservation(&s->iomem, OBJECT(s),
                                    "kvm-gic_dist", 0x1000);
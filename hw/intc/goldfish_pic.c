@@ -20,6 +20,7 @@
 #include "hw/irq.h"
 #include "hw/hw.h"
 #include "hw/sysbus.h"
+#include "qmp-commands.h"
 
 static qemu_irq* goldfish_pic = NULL;
 static qemu_irq pic_parent_irq = NULL;
@@ -30,7 +31,10 @@ enum {
     INTERRUPT_NUMBER        = 0x04,
     INTERRUPT_DISABLE_ALL   = 0x08,
     INTERRUPT_DISABLE       = 0x0c,
-    INTERRUPT_ENABLE        = 0x10
+    INTERRUPT_ENABLE        = 0x10,
+    INTERRUPT_PENDING       = 0x14, // bitmap of the pending interrupts
+    INTERRUPT_DISABLE_MASK  = 0x18, // disable the interrupts of a bitmap
+    INTERRUPT_ENABLE_MASK   = 0x1c, // enable the interrupts of a bitmap
 };
 
 struct goldfish_int_state {
@@ -45,6 +49,9 @@ struct goldfish_int_state {
     uint32_t fiq_enabled;
     qemu_irq parent_irq;
     qemu_irq parent_fiq;
+
+    /* Times each line became pending, not migrated */
+    uint64_t delivered[32];
 };
 
 #define  GOLDFISH_INT_SAVE_VERSION  1
@@ -96,8 +103,10 @@ static void goldfish_int_set_irq(void *opaque, int irq, int level)
 
     if(level) {
         if(!(s->level & mask)) {
-            if(s->irq_enabled & mask)
+            if(s->irq_enabled & mask) {
                 s->pending_count++;
+                s->delivered[irq]++;
+            }
             s->level |= mask;
         }
     }
@@ -129,6 +138,9 @@ static uint64_t goldfish_int_read(void *opaque, hwaddr offset, unsigned size)
         }
         return 0;
     }
+    case INTERRUPT_PENDING:
+        /* Lets the guest handle all the pending lines in one exit */
+        return s->level & s->irq_enabled;
     default:
         cpu_abort(current_cpu,
                   "goldfish_int_read: Bad offset %" HWADDR_PRIx "\n",
@@ -159,11 +171,34 @@ static void goldfish_int_write(void *opaque, hwaddr offset, uint64_t value, unsi
         case INTERRUPT_ENABLE:
             if(!(s->irq_enabled & mask)) {
                 s->irq_enabled |= mask;
-                if(s->level & mask)
+                if(s->level & mask) {
                     s->pending_count++;
+                    s->delivered[value & 31]++;
+                }
             }
             break;
 
+        /* The lines are level triggered and lowered by their device once
+         * serviced, so the guest acknowledges a set of interrupts by
+         * masking them while it handles them. */
+        case INTERRUPT_DISABLE_MASK:
+            s->irq_enabled &= ~value;
+            s->pending_count = ctpop32(s->level & s->irq_enabled);
+            break;
+        case INTERRUPT_ENABLE_MASK: {
+            uint32_t raised = s->level & value & ~s->irq_enabled;
+            int i;
+
+            for (i = 0; i < 32; i++) {
+                if (raised & (1U << i)) {
+                    s->delivered[i]++;
+                }
+            }
+            s->irq_enabled |= value;
+            s->pending_count = ctpop32(s->level & s->irq_enabled);
+            break;
+        }
+
     default:
         cpu_abort(current_cpu,
                   "goldfish_int_write: Bad offset %" HWADDR_PRIx "\n",
@@ -173,6 +208,35 @@ static void goldfish_int_write(void *opaque, hwaddr offset, uint64_t value, unsi
     goldfish_int_update(s);
 }
 
+GoldfishInterruptInfoList *qmp_query_goldfish_interrupts(Error **errp)
+{
+    DeviceState *dev = qdev_find_recursive(sysbus_get_default(),
+                                           TYPE_GOLDFISH_PIC);
+    struct goldfish_int_state *s;
+    GoldfishInterruptInfoList *head = NULL, **tail = &head;
+    int i;
+
+    if (!dev) {
+        error_setg(errp, "No goldfish interrupt controller");
+        return NULL;
+    }
+    s = GOLDFISH_PIC(dev);
+
+    for (i = 0; i < GFD_MAX_IRQ; i++) {
+        GoldfishInterruptInfoList *entry = g_new0(GoldfishInterruptInfoList, 1);
+        GoldfishInterruptInfo *info = g_new0(GoldfishInterruptInfo, 1);
+
+        info->irq = i;
+        info->enabled = (s->irq_enabled >> i) & 1;
+        info->level = (s->level >> i) & 1;
+        info->delivered = s->delivered[i];
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
 static const MemoryRegionOps mips_qemu_int_ops = {
     .read = goldfish_int_read,
     .write = goldfish_int_write,
@@ -22,10 +22,20 @@
 
 #include "hw/hw.h"
 #include "hw/mips/cpudevs.h"
+#include "qemu/notify.h"
 #include "qemu/timer.h"
 #include "sysemu/kvm.h"
 
-#define TIMER_FREQ	100 * 1000 * 1000
+#define TIMER_FREQ	CPU_MIPS_COUNT_FREQ
+
+/* Told when the Count of a CPU is set, started or stopped */
+static NotifierList count_notifiers =
+    NOTIFIER_LIST_INITIALIZER(count_notifiers);
+
+void cpu_mips_add_count_notifier(Notifier *notifier)
+{
+    notifier_list_add(&count_notifiers, notifier);
+}
 
 /* XXX: do not use a global */
 uint32_t cpu_mips_get_random (CPUMIPSState *env)
@@ -84,6 +94,19 @@ uint32_t cpu_mips_get_count (CPUMIPSState *env)
     }
 }
 
+/* What Count reads at the virtual time @now, without side effects. Returns
+ * false if it doesn't follow the virtual clock: it is stopped, or run by
+ * KVM. */
+bool cpu_mips_count_at(CPUMIPSState *env, int64_t now, uint32_t *count)
+{
+    if (env->CP0_Cause & (1 << CP0Ca_DC) || !env->timer) {
+        return false;
+    }
+    *count = env->CP0_Count +
+        (uint32_t)muldiv64(now, TIMER_FREQ, get_ticks_per_sec());
+    return true;
+}
+
 void cpu_mips_store_count (CPUMIPSState *env, uint32_t count)
 {
     /*
@@ -101,6 +124,7 @@ void cpu_mips_store_count (CPUMIPSState *env, uint32_t count)
         /* Update timer timer */
         cpu_mips_timer_update(env);
     }
+    notifier_list_notify(&count_notifiers, env);
 }
 
 void cpu_mips_store_compare (CPUMIPSState *env, uint32_t value)
@@ -123,6 +147,7 @@ void cpu_mips_stop_count(CPUMIPSState *env)
     /* Store the current value */
     env->CP0_Count += (uint32_t)muldiv64(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL),
                                          TIMER_FREQ, get_ticks_per_sec());
+    notifier_list_notify(&count_notifiers, env);
 }
 
 static void mips_timer_cb (void *opaque)
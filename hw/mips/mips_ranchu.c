@@ -6,6 +6,7 @@
 #include "sysemu/device_tree.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/kvm.h"
+#include "sysemu/qtest.h"
 #include "hw/boards.h"
 #include "exec/address-spaces.h"
 #include "qemu/bitops.h"
@@ -450,6 +451,10 @@ static void ranchu_init(MachineState *machine)
 
     qemu_fdt_dumpdtb(fdt, fdt_size);
 
+    /* qtest drives the devices without running any guest code */
+    if (qtest_enabled()) {
+        return;
+    }
     android_load_kernel(env, MIN(ram_size, GOLDFISH_IO_SPACE),
                         machine->kernel_filename,
                         machine->kernel_cmdline,
@@ -30,8 +30,11 @@
 #include "qapi/error.h"
 #include "qemu/module.h"
 #include "qemu/sockets.h"
+#include "qemu/iov.h"
+#include "qemu/timer.h"
 
 #include "hw/misc/android_pipe.h"
+#include "trace.h"
 
 //#define DEBUG_ADB
 
@@ -45,9 +48,16 @@ do { fprintf(stderr, "adb: " fmt , ## __VA_ARGS__); } while (0)
 #define PIPE_QUEUE_LEN     16
 #define HANDSHAKE_MAXLEN   128
 #define ADB_BUFFER_LEN     4096
+#define ADB_MAX_IOV        64
 
 #define ADB_SERVER_PORT         5037
 
+/* Registration with the host adb server is retried with a jittered
+ * exponential backoff between these bounds.
+ */
+#define ADB_NOTIFY_MIN_MS       100
+#define ADB_NOTIFY_MAX_MS       30000
+
 /* 'accept' request from adbd */
 static const char _accept_req[] = "accept";
 /* 'start' request from adbd */
@@ -65,10 +75,12 @@ enum adb_connect_state {
     ADB_CONNECTION_STATE_CONNECTED,
 };
 
+typedef struct adb_conn adb_conn;
+
 typedef struct {
     void*     hwpipe;
     enum adb_connect_state state;
-    GIOChannel *chan;   /* I/O channel to adb server */
+    adb_conn *conn;     /* adb server connection paired with this pipe */
     unsigned flags;
 
     /* TODO: Make sure access to thes buffers is
@@ -82,21 +94,37 @@ typedef struct {
 } adb_pipe;
 
 /*
- * This structure keeps track of the adb-server connection state (that
- * is HOST adb-server <-> QEMU connections). We only expect to see one
- * active connection at a time as data is multiplexed over the pipe.
+ * One accepted HOST adb-server <-> QEMU connection. Each connection is
+ * paired with its own guest adb pipe, so several adb sessions can be
+ * proxied in parallel. A slot is free when |chan| is NULL.
  */
-
-typedef struct {
-    GIOChannel *listen_chan;    /* listener/connect socket */
+struct adb_conn {
     GIOChannel *chan;           /* actual comms socket */
+    int         fd;             /* raw fd of |chan|, used for data transfer */
     /* these cache the read/write state for when wakeon is called */
     gboolean    data_in;        /* have we seen data? */
     gboolean    data_out;       /* can we output data? */
+    adb_pipe   *pipe;           /* paired guest pipe, or NULL */
+    guint       in_watch;       /* pending readable watch or 0 */
+    guint       out_watch;      /* pending writable watch or 0 */
+    int64_t     connect_ns;     /* when |chan| was connected */
+};
+
+#define ADB_MAX_CONNECTIONS     PIPE_QUEUE_LEN
+
+/*
+ * This structure keeps track of the adb-server connections and of the
+ * guest pipes waiting to be paired with one.
+ */
+
+typedef struct {
+    GIOChannel *listen_chan;    /* listener/connect socket */
     adb_pipe *adb_pipes[PIPE_QUEUE_LEN];
-    adb_pipe *connected_pipe;
+    adb_conn conns[ADB_MAX_CONNECTIONS];
     guint       listen_chan_event; /* an event id if we're listening or 0 */
     QemuMutex*  mutex;
+    /* throughput counters, updated without locking so only approximate */
+    AndroidAdbStats stats;
 } adb_backend_state;
 
 struct adb_timer_data_struct {
@@ -113,6 +141,14 @@ QemuMutex adb_state_mutex;
 
 static struct adb_timer_data_struct adb_timer_data;
 
+/* State of the registration with the host adb server */
+static struct {
+    int         port;           /* our adb port to advertise */
+    QEMUTimer  *timer;          /* pending retry */
+    int64_t     backoff_ms;     /* delay before the next retry */
+    int64_t     init_ns;        /* when the backend was set up */
+} adb_notify;
+
 static void adb_reply(adb_pipe *apipe, const char *reply);
 
 
@@ -150,36 +186,80 @@ static QemuOpts* adb_server_config(void) {
     return socket_opts;
 }
 
-static void adb_server_notify(int adb_port) {
+/* Tell the host adb server about us, return true on success */
+static bool adb_server_notify(int adb_port) {
     Error *local_err = NULL;
     QemuOpts *socket_opts = adb_server_config();
     int sock = inet_connect_opts(socket_opts, &local_err, NULL, NULL);
     size_t len;
     gchar *message,*handshake;
+    bool ok;
 
-    if (sock >= 0) {
-        socket_set_nodelay(sock);
-    }
+    qemu_opts_del(socket_opts);
+    adb_state.stats.notify_attempts++;
 
     /* Failed to establish connection */
     if (sock < 0) {
-        fprintf(stderr,"%s: Failed to establish connection to ADB server\n",
-                __func__);
-        return;
+        /* only complain once per series of retries */
+        if (adb_notify.backoff_ms <= ADB_NOTIFY_MIN_MS) {
+            fprintf(stderr,"%s: Failed to establish connection to ADB server\n",
+                    __func__);
+        }
+        error_free(local_err);
+        adb_state.stats.notify_failures++;
+        return false;
     }
+    socket_set_nodelay(sock);
 
     message = g_strdup_printf("host:emulator:%d", adb_port);
     handshake = g_strdup_printf("%04x%s", (int) strlen(message), message);
     len = strlen(handshake);
 
-    if (send_all(sock, handshake, len) != len) {
+    ok = send_all(sock, handshake, len) == len;
+    if (!ok) {
         fprintf(stderr,"%s: error sending string:%s\n", __func__, handshake);
+        adb_state.stats.notify_failures++;
     }
 
     closesocket(sock);
 
     g_free(message);
     g_free(handshake);
+    return ok;
+}
+
+/* Arm the retry timer with the current backoff, randomised by +/-50% so
+ * that emulators sharing a host don't all retry in lockstep.
+ */
+static void adb_server_notify_schedule(void)
+{
+    int64_t delay = adb_notify.backoff_ms / 2 +
+                    g_random_int_range(0, adb_notify.backoff_ms + 1);
+
+    DPRINTF("%s: retrying in %" PRId64 "ms\n", __func__, delay);
+    timer_mod(adb_notify.timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + delay);
+    adb_notify.backoff_ms = MIN(adb_notify.backoff_ms * 2, ADB_NOTIFY_MAX_MS);
+}
+
+static void adb_server_notify_timer(void *opaque)
+{
+    if (adb_server_notify(adb_notify.port)) {
+        adb_notify.backoff_ms = ADB_NOTIFY_MIN_MS;
+    } else {
+        adb_server_notify_schedule();
+    }
+}
+
+/* Start a fresh series of registration attempts, e.g. after the host
+ * adb server dropped its connections because it was restarted.
+ */
+static void adb_server_notify_kick(void)
+{
+    if (!adb_notify.timer) {
+        return;
+    }
+    adb_notify.backoff_ms = ADB_NOTIFY_MIN_MS;
+    adb_server_notify_schedule();
 }
 
 /* TODO: Needs a common implementation with the likes of qemu-char.c */
@@ -204,6 +284,15 @@ static GIOChannel *io_channel_from_socket(int fd)
 }
 static gboolean tcp_adb_accept(GIOChannel *channel, GIOCondition cond,
                                void *opaque);
+static void adb_conn_watch(adb_conn *conn, GIOCondition cond);
+
+/* Pair |conn| with |apipe|. Called with the mutex held. */
+static void adb_conn_pair(adb_conn *conn, adb_pipe *apipe)
+{
+    g_assert(!conn->pipe && !apipe->conn);
+    conn->pipe = apipe;
+    apipe->conn = conn;
+}
 
 /* Close a connection to the server.
 **
@@ -212,157 +301,239 @@ static gboolean tcp_adb_accept(GIOChannel *channel, GIOCondition cond,
 ** Note: this function could be called from any thread - both host and
 **  guest may initiate a connection closing process
 */
-static void tcp_adb_server_close(adb_backend_state *bs)
+static void tcp_adb_conn_close(adb_backend_state *bs, adb_conn *conn)
 {
+    bool last;
+
     g_assert(bs->listen_chan);
     g_assert(bs->mutex);
 
     qemu_mutex_lock(bs->mutex);
 
-    /* clean-up connected pipes */
-    if (bs->connected_pipe) {
+    if (!conn->chan) {
+        /* already closed by the other side */
+        qemu_mutex_unlock(bs->mutex);
+        return;
+    }
+
+    /* clean-up the connected pipe */
+    if (conn->pipe) {
         DPRINTF("%s: closing connected pipe\n", __func__);
-        android_pipe_close(bs->connected_pipe->hwpipe);
-        bs->connected_pipe->chan = NULL;
-        bs->connected_pipe = NULL;
+        android_pipe_close(conn->pipe->hwpipe);
+        conn->pipe->conn = NULL;
+        conn->pipe = NULL;
     }
 
+    if (conn->in_watch) {
+        g_source_remove(conn->in_watch);
+    }
+    if (conn->out_watch) {
+        g_source_remove(conn->out_watch);
+    }
+
+    /* close down this socket */
+    g_io_channel_shutdown(conn->chan, FALSE, NULL);
+    g_io_channel_unref(conn->chan);
+    bs->stats.connected_ns += get_clock() - conn->connect_ns;
+    bs->stats.connections--;
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = -1;
+
     if (bs->listen_chan_event == 0) {
         /* wait for new connections */
         bs->listen_chan_event =
                 g_io_add_watch(bs->listen_chan, G_IO_IN, tcp_adb_accept, bs);
     }
-    if (bs->chan) {
-        /* close down this socket */
-        g_io_channel_shutdown(bs->chan, FALSE, NULL);
-        g_io_channel_unref(bs->chan);
-        bs->chan = NULL;
-    }
+    last = bs->stats.connections == 0;
 
     qemu_mutex_unlock(bs->mutex);
+
+    /* With no server connected left, the host adb server has likely gone
+     * away; register again as soon as a new one shows up.
+     */
+    if (last) {
+        adb_server_notify_kick();
+    }
 }
 
 /*
- * This handles state changes on the server socket. We don't directly
+ * This handles state changes on a server socket. We don't directly
  * start receiving or sending data here but we do need to ensure that
  * the pipe guest wakes up so it can start reading data.
  *
- * This is a one-shot wake up - the watch needs re-adding whenever
+ * Watches are one-shot wake ups - they need re-adding whenever
  * things go quite so we'll wake up again when needed.
  */
-static gboolean tcp_adb_server_data(GIOChannel *channel, GIOCondition cond,
-                                    void *opaque)
+static void tcp_adb_conn_event(adb_conn *conn, GIOCondition cond)
 {
+    adb_backend_state *bs = &adb_state;
+
     DPRINTF("%s: called with 0x%x\n", __func__, (int)cond);
 
-    adb_backend_state *bs = (adb_backend_state *) opaque;
+    qemu_mutex_lock(bs->mutex);
     if (cond & G_IO_IN) {
-        qemu_mutex_lock(bs->mutex);
-        bs->data_in = TRUE;
-        if (bs->connected_pipe && bs->connected_pipe->flags & PIPE_WAKE_READ) {
+        conn->data_in = TRUE;
+        if (conn->pipe && conn->pipe->flags & PIPE_WAKE_READ) {
             DPRINTF("%s: waking up pipe for incomming data\n", __func__);
-            android_pipe_wake(bs->connected_pipe->hwpipe, PIPE_WAKE_READ);
+            android_pipe_wake(conn->pipe->hwpipe, PIPE_WAKE_READ);
         }
-        qemu_mutex_unlock(bs->mutex);
     }
 
     if (cond & G_IO_OUT) {
-        qemu_mutex_lock(bs->mutex);
-        bs->data_out = TRUE;
-        if (bs->connected_pipe && bs->connected_pipe->flags & PIPE_WAKE_WRITE) {
+        conn->data_out = TRUE;
+        if (conn->pipe && conn->pipe->flags & PIPE_WAKE_WRITE) {
             DPRINTF("%s: waking up pipe for now able to write\n", __func__);
-            android_pipe_wake(bs->connected_pipe->hwpipe, PIPE_WAKE_WRITE);
+            android_pipe_wake(conn->pipe->hwpipe, PIPE_WAKE_WRITE);
         }
-        qemu_mutex_unlock(bs->mutex);
     }
+    qemu_mutex_unlock(bs->mutex);
 
     if ((cond & G_IO_ERR) ||
         (cond & G_IO_HUP)) {
         DPRINTF("%s: error %d - closing server connectio\n", __func__, cond);
-        tcp_adb_server_close(bs);
+        tcp_adb_conn_close(bs, conn);
     }
+}
+
+static gboolean tcp_adb_conn_readable(GIOChannel *channel, GIOCondition cond,
+                                      void *opaque)
+{
+    adb_conn *conn = opaque;
+
+    qemu_mutex_lock(adb_state.mutex);
+    conn->in_watch = 0;
+    qemu_mutex_unlock(adb_state.mutex);
+    tcp_adb_conn_event(conn, cond);
 
     /* Done, we must re-add watch next time we are waiting for data */
     return FALSE;
 }
 
+static gboolean tcp_adb_conn_writable(GIOChannel *channel, GIOCondition cond,
+                                      void *opaque)
+{
+    adb_conn *conn = opaque;
+
+    qemu_mutex_lock(adb_state.mutex);
+    conn->out_watch = 0;
+    qemu_mutex_unlock(adb_state.mutex);
+    tcp_adb_conn_event(conn, cond);
+
+    return FALSE;
+}
+
+/* Arm a one-shot watch for |cond| on |conn| unless one is pending */
+static void adb_conn_watch(adb_conn *conn, GIOCondition cond)
+{
+    qemu_mutex_lock(adb_state.mutex);
+    if (conn->chan) {
+        if ((cond & G_IO_IN) && !conn->in_watch) {
+            conn->in_watch = g_io_add_watch(conn->chan,
+                                            G_IO_IN|G_IO_ERR|G_IO_HUP,
+                                            tcp_adb_conn_readable, conn);
+        }
+        if ((cond & G_IO_OUT) && !conn->out_watch) {
+            conn->out_watch = g_io_add_watch(conn->chan,
+                                             G_IO_OUT|G_IO_ERR|G_IO_HUP,
+                                             tcp_adb_conn_writable, conn);
+        }
+    }
+    qemu_mutex_unlock(adb_state.mutex);
+}
+
 static gboolean tcp_adb_server_timer(void *opaque) {
     struct adb_timer_data_struct *timer_data = (struct adb_timer_data_struct*) opaque;
     adb_backend_state *bs = timer_data->bs;
-    if(g_main_context_find_source_by_user_data(NULL, bs)) {
-        // since the io watcher for adb server data is still there, do nothing;
-        // otherwise, we are adding too many fds to the main thread's select
-        // and will slow it down on linux/mac and quit the program on windows
-        // after a while
-        return TRUE;
-    }
+    int i;
 
+    // connections which still have a pending watch are left alone;
+    // otherwise, we are adding too many fds to the main thread's select
+    // and will slow it down on linux/mac and quit the program on windows
+    // after a while
     qemu_mutex_lock(bs->mutex);
-    if (bs->chan && bs->connected_pipe && bs->connected_pipe->state == ADB_CONNECTION_STATE_CONNECTED) {
-        DPRINTF("%s: setting up watch\n", __func__);
-        g_io_add_watch(bs->chan, G_IO_IN|G_IO_ERR|G_IO_HUP,
-                           tcp_adb_server_data, bs);
+    for (i = 0; i < ADB_MAX_CONNECTIONS; i++) {
+        adb_conn *conn = &bs->conns[i];
+        if (conn->chan && !conn->in_watch && conn->pipe &&
+            conn->pipe->state == ADB_CONNECTION_STATE_CONNECTED) {
+            DPRINTF("%s: setting up watch\n", __func__);
+            conn->in_watch = g_io_add_watch(conn->chan,
+                                            G_IO_IN|G_IO_ERR|G_IO_HUP,
+                                            tcp_adb_conn_readable, conn);
+        }
     }
     qemu_mutex_unlock(bs->mutex);
 
     return TRUE;
 }
 
+/* Return a free connection slot, or NULL. Called with the mutex held. */
+static adb_conn *tcp_adb_free_conn(adb_backend_state *bs)
+{
+    int i;
+
+    for (i = 0; i < ADB_MAX_CONNECTIONS; i++) {
+        if (!bs->conns[i].chan) {
+            return &bs->conns[i];
+        }
+    }
+    return NULL;
+}
+
 static gboolean tcp_adb_connect(adb_backend_state *bs, int fd)
 {
-    if (bs->chan) {
-        DPRINTF("%s: existing connection %p, fail connect!\n",
-                __func__, bs->chan);
+    adb_conn *conn = tcp_adb_free_conn(bs);
+    int i;
+
+    if (!conn) {
+        DPRINTF("%s: too many connections, fail connect!\n", __func__);
         return FALSE;
     }
 
     DPRINTF("%s: in-coming connection on %d\n", __func__, fd);
 
     qemu_set_nonblock(fd);
-    bs->chan = io_channel_from_socket(fd);
-    if (!bs->chan) {
-        close(fd);
+    conn->chan = io_channel_from_socket(fd);
+    if (!conn->chan) {
         return FALSE;
     }
-
-    /* If we don't have a pipe to use for the tcp backend, then find one in
-     * the accept state.  Note, this can happen, for example, if the previous
-     * connected pipe was closed for some reason.  Also note that this becomes
-     * sort of random which pipe we select, but there doesn't seem to be any
-     * clearly defined semantics about the ordering here.  A proper fifo may
-     * be a better data structure for this.
+    conn->fd = fd;
+    conn->connect_ns = get_clock();
+    bs->stats.connections++;
+
+    /* Find a pipe in the accept state that has no connection yet.  Note
+     * that this becomes sort of random which pipe we select, but there
+     * doesn't seem to be any clearly defined semantics about the ordering
+     * here.  A proper fifo may be a better data structure for this.
      */
-    if (!bs->connected_pipe) {
-        int i;
-        for (i = 0; i < PIPE_QUEUE_LEN; i++) {
-            if (bs->adb_pipes[i] &&
-                bs->adb_pipes[i]->state == ADB_CONNECTION_STATE_ACCEPT) {
-                bs->connected_pipe = bs->adb_pipes[i];
-            }
+    for (i = 0; i < PIPE_QUEUE_LEN; i++) {
+        adb_pipe *apipe = bs->adb_pipes[i];
+        if (apipe && apipe->state == ADB_CONNECTION_STATE_ACCEPT &&
+            !apipe->conn) {
+            adb_conn_pair(conn, apipe);
+            break;
         }
     }
 
     /* Tell the adbd that the adb server has conected and that we're ready to
      * receive the start package */
-    if (bs->connected_pipe) {
+    if (conn->pipe) {
         DPRINTF("Incoming TCP connection on already accepted pipe, connect\n");
-        adb_pipe *apipe = bs->connected_pipe;
-        apipe->chan = bs->chan;
+        adb_pipe *apipe = conn->pipe;
         if (apipe->out_next) {
             fprintf(stderr, "Pending reply on non-connected pipe, error\n");
             abort();
         }
         adb_reply(apipe, _ok_resp);
-        android_pipe_wake(bs->connected_pipe->hwpipe, PIPE_WAKE_READ);
+        android_pipe_wake(apipe->hwpipe, PIPE_WAKE_READ);
     }
 
     return TRUE;
 }
 
-/* Accept incoming connections. If the connect succeeds and we create
- * a connection we return FALSE to take the listen socket out of the
- * polling loop. We need to re-add the watch if/when the connection
- * dies so another connection can be created.
+/* Accept incoming connections. While there are free connection slots
+ * the listen socket stays in the polling loop; once they are all used
+ * we return FALSE to take it out, and the watch is re-added when a
+ * connection dies so another connection can be created.
  */
 static gboolean tcp_adb_accept(GIOChannel *channel, GIOCondition cond,
                                void *opaque)
@@ -372,6 +543,7 @@ static gboolean tcp_adb_accept(GIOChannel *channel, GIOCondition cond,
     struct sockaddr *addr;
     socklen_t len;
     int fd;
+    bool more;
 
     for(;;) {
         len = sizeof(saddr);
@@ -390,13 +562,16 @@ static gboolean tcp_adb_accept(GIOChannel *channel, GIOCondition cond,
     }
 
     qemu_mutex_lock(bs->mutex);
-    const bool connected = tcp_adb_connect(bs, fd);
-    if (connected) {
+    if (!tcp_adb_connect(bs, fd)) {
+        closesocket(fd);
+    }
+    more = tcp_adb_free_conn(bs) != NULL;
+    if (!more) {
         bs->listen_chan_event = 0; // the listener will be gone after return
     }
     qemu_mutex_unlock(bs->mutex);
 
-    return !connected;
+    return more;
 }
 
 static bool adb_server_listen_incoming(int port)
@@ -456,12 +631,20 @@ static void* adb_pipe_init(void *hwpipe,void *opaque, const char *args)
 static void adb_pipe_close(void *opaque )
 {
     adb_pipe *apipe = opaque;
+    adb_conn *conn;
     int i;
 
     DPRINTF("%s: hwpipe=%p\n", __FUNCTION__, apipe->hwpipe);
-    if (adb_state.connected_pipe == apipe) {
-        tcp_adb_server_close(&adb_state);
-        // tcp_adb_server_close() has cleaned |adb_state.connected_pipe| for us
+    qemu_mutex_lock(adb_state.mutex);
+    conn = apipe->conn;
+    if (conn) {
+        /* the pipe is going away, don't ask the guest to close it */
+        conn->pipe = NULL;
+        apipe->conn = NULL;
+    }
+    qemu_mutex_unlock(adb_state.mutex);
+    if (conn) {
+        tcp_adb_conn_close(&adb_state, conn);
     }
     for (i = 0; i < PIPE_QUEUE_LEN; i++) {
         if (adb_state.adb_pipes[i] == apipe) {
@@ -506,6 +689,7 @@ static bool match_request(const char *request, int len, const char *match)
 static const char *handle_request(adb_pipe *apipe, const char *request, int len)
 {
     adb_backend_state *bs = &adb_state;
+    int i;
 
     if (match_request(request, len, _accept_req)) {
         if (apipe->state != ADB_CONNECTION_STATE_UNCONNECTED) {
@@ -514,16 +698,14 @@ static const char *handle_request(adb_pipe *apipe, const char *request, int len)
 
         apipe->state = ADB_CONNECTION_STATE_ACCEPT;
 
-        /* If we don't have any connected adb_pipe to the tcp backend yet,
-         * elect ourselves.  If the tcp connection is ready as well, go ahead
-         * and thell adbd to carry on.
+        /* If a tcp connection is waiting for a pipe, take it and tell
+         * adbd to carry on. Otherwise the next connection picks us.
          */
         qemu_mutex_lock(bs->mutex);
-        if (!bs->connected_pipe) {
-            bs->connected_pipe = apipe;
-            if (bs->chan) {
-                g_assert(!bs->connected_pipe->chan);
-                bs->connected_pipe->chan = bs->chan;
+        for (i = 0; i < ADB_MAX_CONNECTIONS; i++) {
+            adb_conn *conn = &bs->conns[i];
+            if (conn->chan && !conn->pipe) {
+                adb_conn_pair(conn, apipe);
                 qemu_mutex_unlock(bs->mutex);
                 DPRINTF("Already have tcp connection, reply 'ok' to 'accept'\n");
                 return _ok_resp;
@@ -540,22 +722,22 @@ static const char *handle_request(adb_pipe *apipe, const char *request, int len)
             return NULL;
         }
 
-        if (!bs->chan) {
-            qemu_mutex_lock(bs->mutex);
+        if (!apipe->conn) {
             DPRINTF("adbd requested 'start' but tcp connection not yet connected, error\n");
-            bs->connected_pipe->chan = NULL;
             android_pipe_close(apipe->hwpipe);
-            qemu_mutex_unlock(bs->mutex);
             return NULL;
         }
 
         apipe->state = ADB_CONNECTION_STATE_CONNECTED;
-        if (adb_timer_data.adb_data_timer_id) {
-            g_source_remove(adb_timer_data.adb_data_timer_id);
+        if (!bs->stats.ready_ns) {
+            bs->stats.ready_ns = get_clock() - adb_notify.init_ns;
+        }
+        /* one fallback timer serves all connections */
+        if (!adb_timer_data.adb_data_timer_id) {
+            adb_timer_data.adb_data_timer_id =
+                    g_timeout_add(1000 /* ms */, tcp_adb_server_timer,
+                                  &adb_timer_data);
         }
-        adb_timer_data.adb_data_timer_id =
-                g_timeout_add(1000 /* ms */, tcp_adb_server_timer,
-                              &adb_timer_data);
         return NULL; /* start proxying data */
     } else {
         /* unrecognized command */
@@ -570,76 +752,69 @@ static void adb_reply(adb_pipe *apipe, const char *reply)
     apipe->out_next = &apipe->out_buffer[0];
 }
 
+/* Fill |iov| from the pipe buffers, return the number of entries used */
+static int adb_pipe_iov(struct iovec *iov, const AndroidPipeBuffer *buffers,
+                        int cnt, size_t *bytes)
+{
+    int i;
+
+    cnt = MIN(cnt, ADB_MAX_IOV);
+    *bytes = 0;
+    for (i = 0; i < cnt; i++) {
+        iov[i].iov_base = buffers[i].data;
+        iov[i].iov_len = buffers[i].size;
+        *bytes += buffers[i].size;
+    }
+    return cnt;
+}
+
+/*
+ * Data is moved with vectored socket calls straight on the connected
+ * fd; the GIOChannel is only used to accept and to watch for readiness.
+ */
 static int adb_pipe_proxy_send(adb_pipe *apipe, const AndroidPipeBuffer *buffers,
                                int cnt)
 {
-    gsize total_copied = 0;
     adb_backend_state *bs = &adb_state;
-
-    GIOChannel* chan = apipe->chan;
-    g_assert(chan);
-
-    g_io_channel_ref(chan);
-
-    DPRINTF("%s: %p[%d]/%d\n", __func__, buffers,
-            cnt ? (int)buffers->size : 0, cnt);
-    do {
-        GError *error = NULL;
-        gchar *bptr = (gchar *) buffers[0].data;
-        gsize bsize = buffers[0].size;
-        gsize copied = 0;
-
-        GIOStatus status = g_io_channel_write_chars(
-            chan, bptr, bsize, &copied, &error);
-
-        total_copied += copied;
-
-        /* If we have already copied some data lets signal that and
-         * let it come back to here.
-         */
-        if (total_copied > 0 &&
-            ((status == G_IO_STATUS_EOF || status == G_IO_STATUS_AGAIN))) {
-            bs->data_out = FALSE;
-            g_io_channel_unref(chan);
-            return total_copied;
-        }
-
-        /* Can't write and more data.... */
-        if (status == G_IO_STATUS_AGAIN) {
-            DPRINTF("%s: out of data, setting up watch\n", __func__);
-            g_io_add_watch(chan, G_IO_IN|G_IO_ERR|G_IO_HUP,
-                           tcp_adb_server_data, bs);
-            g_io_channel_unref(chan);
-            bs->data_out = FALSE;
+    adb_conn *conn = apipe->conn;
+    struct iovec iov[ADB_MAX_IOV];
+    size_t bytes;
+    ssize_t ret;
+    int64_t start_ns;
+
+    if (!conn) {
+        /* the server side went away, the pipe is being closed */
+        return PIPE_ERROR_IO;
+    }
+    g_assert(conn->chan && conn->fd >= 0);
+
+    cnt = adb_pipe_iov(iov, buffers, cnt, &bytes);
+    DPRINTF("%s: %d buffers, %zd bytes\n", __func__, cnt, bytes);
+
+    start_ns = get_clock();
+    ret = iov_send_recv(conn->fd, iov, cnt, 0, bytes, true);
+    trace_android_adb_proxy_send(apipe->hwpipe, cnt, bytes, ret,
+                                 get_clock() - start_ns);
+    bs->stats.writes++;
+
+    if (ret < 0) {
+        conn->data_out = FALSE;
+        if (errno == EAGAIN) {
+            DPRINTF("%s: socket full, setting up watch\n", __func__);
+            adb_conn_watch(conn, G_IO_OUT);
             return PIPE_ERROR_AGAIN;
         }
+        DPRINTF("%s: went wrong (%d)\n", __func__, errno);
+        tcp_adb_conn_close(bs, conn);
+        return PIPE_ERROR_IO;
+    }
 
-        if (status == G_IO_STATUS_EOF) {
-            g_io_channel_unref(chan);
-            bs->data_out = FALSE;
-            tcp_adb_server_close(bs);
-            return 0;
-        }
-
-        if (status != G_IO_STATUS_NORMAL) {
-            DPRINTF("%s: went wrong (%d)\n", __func__, status);
-            g_io_channel_unref(chan);
-            bs->data_out = FALSE;
-            tcp_adb_server_close(bs);
-            return PIPE_ERROR_IO;
-        }
-
-        if (copied < bsize) {
-            g_assert(total_copied > 0);
-            bs->data_out = FALSE;
-            break;
-        }
-
-        buffers++;
-    } while (--cnt);
-
-    g_io_channel_unref(chan);
-    return total_copied;
+    /* iov_send_recv() only stops short once the socket is full */
+    if (ret < bytes) {
+        conn->data_out = FALSE;
+    }
+    bs->stats.bytes_to_host += ret;
+    return ret;
 }
 
 static int adb_pipe_send(void *opaque, const AndroidPipeBuffer* buffers,
@@ -695,84 +870,62 @@ static int pipe_recv_data(adb_pipe *apipe, const char *data, unsigned len,
 static int adb_pipe_proxy_recv(adb_pipe *apipe, AndroidPipeBuffer *buffers,
                                int cnt)
 {
-    gsize total_copied = 0;
     adb_backend_state *bs = &adb_state;
+    adb_conn *conn = apipe->conn;
+    struct iovec iov[ADB_MAX_IOV];
+    size_t bytes;
+    ssize_t ret;
+    int64_t start_ns;
+
+    if (!conn) {
+        return PIPE_ERROR_IO;
+    }
+    g_assert(conn->chan && conn->pipe == apipe && conn->fd >= 0);
 
-    GIOChannel* chan = apipe->chan;
-    g_assert(chan);
-    g_assert(bs->chan == chan);
-    g_io_channel_ref(chan);
-
-    DPRINTF("%s: hwpipe=%p (buffers %p[%d]/%d)\n", __func__, apipe->hwpipe,
-            buffers, cnt ? (int)buffers->size : 0, cnt);
-    do {
-        GError *error = NULL;
-        gchar *bptr = (gchar *) buffers[0].data;
-        gsize bsize = buffers[0].size;
-        gsize copied = 0;
-        GIOStatus status = g_io_channel_read_chars(
-            chan, bptr, bsize, &copied, &error);
-
-        DPRINTF("%s: read %zd bytes into %p[%zd] -> %d\n", __func__,
-                copied, bptr, bsize, status);
-
-        total_copied += copied;
-
-        /* If we have already copied some data lets signal that and
-         * let it come back to here */
-        if (total_copied > 0 &&
-            ((status == G_IO_STATUS_EOF || status == G_IO_STATUS_AGAIN))) {
-            g_io_channel_unref(chan);
-            bs->data_in = FALSE;
-            return total_copied;
-        }
-
-        /* no data to read.... */
-        if (status == G_IO_STATUS_AGAIN) {
-            DPRINTF("%s: out of data, setting up watch\n", __func__);
-            g_io_add_watch(chan, G_IO_IN|G_IO_ERR|G_IO_HUP,
-                           tcp_adb_server_data, bs);
-            g_io_channel_unref(chan);
-            bs->data_in = FALSE;
-            return PIPE_ERROR_AGAIN;
-        }
+    cnt = adb_pipe_iov(iov, buffers, cnt, &bytes);
+    DPRINTF("%s: hwpipe=%p (%d buffers, %zd bytes)\n", __func__,
+            apipe->hwpipe, cnt, bytes);
 
-        if (status == G_IO_STATUS_EOF) {
-            g_io_channel_unref(chan);
-            bs->data_in = FALSE;
-            return 0;
-        }
+    start_ns = get_clock();
+    ret = iov_send_recv(conn->fd, iov, cnt, 0, bytes, false);
+    trace_android_adb_proxy_recv(apipe->hwpipe, cnt, bytes, ret,
+                                 get_clock() - start_ns);
+    bs->stats.reads++;
 
-        if (status != G_IO_STATUS_NORMAL) {
-            DPRINTF("%s: went wrong (%d)\n", __func__, status);
-            g_io_channel_unref(chan);
-            bs->data_in = FALSE;
-            tcp_adb_server_close(bs);
-            return PIPE_ERROR_IO;
+    if (ret < 0) {
+        conn->data_in = FALSE;
+        if (errno == EAGAIN) {
+            DPRINTF("%s: out of data, setting up watch\n", __func__);
+            adb_conn_watch(conn, G_IO_IN);
+            return PIPE_ERROR_AGAIN;
         }
+        DPRINTF("%s: went wrong (%d)\n", __func__, errno);
+        tcp_adb_conn_close(bs, conn);
+        return PIPE_ERROR_IO;
+    }
 
-        if (copied < bsize) {
-            g_assert(total_copied > 0);
-            bs->data_in = FALSE;
-            break;
+    /* A short read means the socket was drained (or hit EOF), so wait
+     * for it to become readable again rather than for the fallback timer.
+     */
+    if (ret < bytes) {
+        conn->data_in = FALSE;
+        if (ret > 0) {
+            adb_conn_watch(conn, G_IO_IN);
         }
-        buffers++;
-        cnt--;
-    } while (cnt);
-
-    g_io_channel_unref(chan);
-    return total_copied;
+    }
+    bs->stats.bytes_from_host += ret;
+    return ret;
 }
 
 static int adb_pipe_recv(void *opaque, AndroidPipeBuffer *buffers,
                              int cnt)
 {
     adb_pipe *apipe = opaque;
-    adb_backend_state *bs = &adb_state;
+    adb_conn *conn = apipe->conn;
     int ret = 0;
 
     if (apipe->state == ADB_CONNECTION_STATE_CONNECTED) {
-        if (bs->data_in) {
+        if (conn && conn->data_in) {
             ret = adb_pipe_proxy_recv(apipe, buffers, cnt);
             return ret;
         } else {
@@ -794,8 +947,10 @@ static int adb_pipe_recv(void *opaque, AndroidPipeBuffer *buffers,
     if (apipe->out_cnt == 0) {
         apipe->out_next = NULL;
         // ready for adbserver to connect now
-        DPRINTF("%s: waiting for data, setting up watch\n", __func__);
-        g_io_add_watch(bs->chan, G_IO_IN|G_IO_ERR|G_IO_HUP, tcp_adb_server_data, bs);
+        if (conn) {
+            DPRINTF("%s: waiting for data, setting up watch\n", __func__);
+            adb_conn_watch(conn, G_IO_IN);
+        }
     } else {
         apipe->out_next += ret;
     }
@@ -806,7 +961,7 @@ static int adb_pipe_recv(void *opaque, AndroidPipeBuffer *buffers,
 static unsigned adb_pipe_poll(void *opaque)
 {
     adb_pipe *apipe = opaque;
-    adb_backend_state *bs = &adb_state;
+    adb_conn *conn = apipe->conn;
     unsigned flags = 0;
 
     if (apipe->state != ADB_CONNECTION_STATE_CONNECTED) {
@@ -816,7 +971,7 @@ static unsigned adb_pipe_poll(void *opaque)
             flags |= PIPE_POLL_OUT;
         }
     } else {
-        if (bs->data_in) {
+        if (conn && conn->data_in) {
             flags |= PIPE_POLL_IN;
         }
         /* We can always forward data to the socket as far as we know */
@@ -829,14 +984,15 @@ static unsigned adb_pipe_poll(void *opaque)
 static void adb_pipe_wake_on(void *opaque, int flags)
 {
     adb_pipe *apipe = opaque;
+    adb_conn *conn = apipe->conn;
     DPRINTF("%s: setting flags 0x%x->0x%x\n", __func__, apipe->flags, flags);
     apipe->flags |= flags;
 
-    if (flags & PIPE_WAKE_READ && adb_state.data_in) {
+    if (flags & PIPE_WAKE_READ && conn && conn->data_in) {
         android_pipe_wake(apipe->hwpipe, PIPE_WAKE_READ);
     }
 
-    if (flags & PIPE_WAKE_WRITE && adb_state.data_out) {
+    if (flags & PIPE_WAKE_WRITE && conn && conn->data_out) {
         android_pipe_wake(apipe->hwpipe, PIPE_WAKE_WRITE);
     }
 }
@@ -858,11 +1014,14 @@ static const AndroidPipeFuncs adb_pipe_funcs = {
 bool qemu2_adb_server_init(int port)
 {
     if (!pipe_backend_initialized) {
-        adb_state.chan = NULL;
+        int i;
+
         adb_state.listen_chan = NULL;
         adb_state.listen_chan_event = 0;
-        adb_state.data_in = FALSE;
-        adb_state.connected_pipe = NULL;
+        for (i = 0; i < ADB_MAX_CONNECTIONS; i++) {
+            memset(&adb_state.conns[i], 0, sizeof(adb_conn));
+            adb_state.conns[i].fd = -1;
+        }
         qemu_mutex_init(&adb_state_mutex);
         adb_state.mutex = &adb_state_mutex;
 
@@ -876,6 +1035,44 @@ bool qemu2_adb_server_init(int port)
     if (!adb_server_listen_incoming(port)) {
         return false;
     }
-    adb_server_notify(port);
+
+    adb_notify.port = port;
+    adb_notify.init_ns = get_clock();
+    adb_notify.backoff_ms = ADB_NOTIFY_MIN_MS;
+    adb_notify.timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                    adb_server_notify_timer, NULL);
+    if (!adb_server_notify(port)) {
+        adb_server_notify_schedule();
+    }
     return true;
 }
+
+void android_adb_server_notify_now(void)
+{
+    if (!adb_notify.timer) {
+        return;
+    }
+    timer_del(adb_notify.timer);
+    adb_notify.backoff_ms = ADB_NOTIFY_MIN_MS;
+    adb_server_notify_timer(NULL);
+}
+
+void android_adb_get_stats(AndroidAdbStats* stats)
+{
+    adb_backend_state *bs = &adb_state;
+    int i;
+
+    if (!pipe_backend_initialized) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    qemu_mutex_lock(bs->mutex);
+    *stats = bs->stats;
+    for (i = 0; i < ADB_MAX_CONNECTIONS; i++) {
+        if (bs->conns[i].chan) {
+            stats->connected_ns += get_clock() - bs->conns[i].connect_ns;
+        }
+    }
+    qemu_mutex_unlock(bs->mutex);
+}
@@ -16,7 +16,8 @@
  * this program.  If not, see <http://www.gnu.org/licenses/>.
  *
  * Handles the 'boot-properties' service used to inject system properties
- * at boot time.
+ * at boot time. The guest also reports its boot milestones through it,
+ * with "boot:<name>" messages that go to the startup timeline.
  */
 
 #include <glib.h>
@@ -26,6 +27,7 @@
 #include "hw/misc/android_boot_properties.h"
 #include "hw/misc/android_pipe.h"
 #include "hw/misc/android_qemud.h"
+#include "sysemu/boot-timeline.h"
 
 //#define DEBUG_BOOT_PROPERTIES
 
@@ -36,21 +38,19 @@ do { fprintf(stderr, "%s: " fmt, __func__, ## __VA_ARGS__); } while (0)
 #define DPRINTF(fmt, ...) do {} while (0)
 #endif
 
+#define BOOT_PROP_MAX_MILESTONE 64
+
 static GPtrArray *all_boot_properties;
 
 typedef struct {
     void *hwpipe;
-    GPtrArray *send_data;
-    GString *send_outstanding;
-    GPtrArray *recv_data;
-    GString *recv_outstanding;
+    QemudBuffer send;
+    QemudBuffer recv;
 } BootPropPipe;
 
-static ssize_t boot_prop_pipe_have_data(BootPropPipe *props,
-                                        const gchar *buf)
+static void boot_prop_pipe_have_data(BootPropPipe *props,
+                                     const gchar *buf)
 {
-    int len = strlen(buf);
-
     if (!strcmp(buf, "list")) {
         GPtrArray *properties = all_boot_properties;
         if (properties) {
@@ -60,15 +60,21 @@ static ssize_t boot_prop_pipe_have_data(BootPropPipe *props,
                 const gchar *key = g_ptr_array_index(properties, n);
                 const gchar *value = g_ptr_array_index(properties, n + 1);
                 gchar *line = g_strdup_printf("%s=%s", key, value);
-                g_ptr_array_add(props->send_data, line);
+                qemud_buffer_put_frame(&props->send, line, strlen(line));
+                g_free(line);
             }
         }
-        g_ptr_array_add(props->send_data, g_strdup(""));
+        qemud_buffer_put_frame(&props->send, "", 0);
         android_pipe_wake(props->hwpipe, PIPE_WAKE_READ);
+    } else if (!strncmp(buf, "boot:", 5) && buf[5] &&
+               strlen(buf + 5) <= BOOT_PROP_MAX_MILESTONE) {
+        /* A boot milestone, e.g. "boot:sys.boot_completed" */
+        gchar *name = g_strdup_printf("guest:%s", buf + 5);
+        boot_timeline_mark_once(name);
+        g_free(name);
     } else {
         DPRINTF("bad command [%s] expected [%s]", buf, "list");
     }
-    return len;
 }
 
 static void *boot_prop_pipe_init(void *hwpipe,
@@ -79,10 +85,8 @@ static void *boot_prop_pipe_init(void *hwpipe,
 
     pipe = g_malloc0(sizeof(*pipe));
     pipe->hwpipe = hwpipe;
-    pipe->send_data = g_ptr_array_new_full(8, g_free);
-    pipe->recv_data = g_ptr_array_new_full(1, g_free);
-    pipe->send_outstanding = g_string_sized_new(128);
-    pipe->recv_outstanding = g_string_sized_new(8);
+    qemud_buffer_init(&pipe->send, 1024);
+    qemud_buffer_init(&pipe->recv, 64);
 
     return pipe;
 }
@@ -90,10 +94,8 @@ static void *boot_prop_pipe_init(void *hwpipe,
 static void boot_prop_pipe_close(void *opaque)
 {
     BootPropPipe *pipe = opaque;
-    g_ptr_array_free(pipe->send_data, TRUE);
-    g_ptr_array_free(pipe->recv_data, TRUE);
-    g_string_free(pipe->send_outstanding, TRUE);
-    g_string_free(pipe->recv_outstanding, TRUE);
+    qemud_buffer_destroy(&pipe->send);
+    qemud_buffer_destroy(&pipe->recv);
     g_free(pipe);
 }
 
@@ -101,8 +103,7 @@ static void boot_prop_pipe_wake(void *opaque, int flags)
 {
     BootPropPipe *pipe = opaque;
 
-    if (flags & PIPE_WAKE_READ
-        && (pipe->send_outstanding->len > 0 || pipe->send_data->len > 0)) {
+    if (flags & PIPE_WAKE_READ && qemud_buffer_len(&pipe->send) > 0) {
         android_pipe_wake(pipe->hwpipe, PIPE_WAKE_READ);
     }
 
@@ -117,10 +118,8 @@ static int boot_prop_pipe_recv(void *opaque,
 {
     BootPropPipe *pipe = opaque;
 
-    if (pipe->send_outstanding->len > 0 || pipe->send_data->len > 0) {
-        return qemud_pipe_write_buffers(pipe->send_data,
-                                        pipe->send_outstanding,
-                                        buffers, cnt);
+    if (qemud_buffer_len(&pipe->send) > 0) {
+        return qemud_buffer_drain(&pipe->send, buffers, cnt);
     } else {
         return PIPE_ERROR_AGAIN;
     }
@@ -131,14 +130,12 @@ static int boot_prop_pipe_send(void *opaque,
                                 int cnt)
 {
     BootPropPipe *pipe = opaque;
-    int consumed = qemud_pipe_read_buffers(buffers, cnt,
-                                           pipe->recv_data,
-                                           pipe->recv_outstanding);
+    int consumed = qemud_buffer_append(&pipe->recv, buffers, cnt);
+    char *msg;
+    uint32_t len;
 
-    while (pipe->recv_data->len > 0) {
-        gchar *msg = g_ptr_array_index(pipe->recv_data, 0);
+    while (qemud_buffer_next_frame(&pipe->recv, &msg, &len)) {
         boot_prop_pipe_have_data(pipe, msg);
-        g_ptr_array_remove(pipe->recv_data, msg);
     }
 
     return consumed;
@@ -149,7 +146,7 @@ static unsigned boot_prop_pipe_poll(void *opaque)
     BootPropPipe *pipe = opaque;
     unsigned flags = 0;
 
-    if (pipe->send_outstanding->len > 0 || pipe->send_data->len > 0) {
+    if (qemud_buffer_len(&pipe->send) > 0) {
         flags |= PIPE_POLL_IN;
     }
     flags |= PIPE_POLL_OUT;
@@ -30,13 +30,24 @@
 */
 
 #include "hw/hw.h"
+#include "hw/irqfd-line.h"
 #include "hw/sysbus.h"
+#include "exec/address-spaces.h"
+#include "exec/ram_addr.h"
 #include "hw/misc/android_pipe.h"
 #include "hw/misc/android_boot_properties.h"
 #include "qemu-common.h"
 #include "qemu/timer.h"
 #include "qemu/error-report.h"
 #include "qemu/thread.h"
+#include "qemu/queue.h"
+#include "qemu/main-loop.h"
+#include "qemu/metrics.h"
+#include "qmp-commands.h"
+#include "qapi/qmp/qerror.h"
+#include "sysemu/boot-timeline.h"
+#include "sysemu/kvm.h"
+#include "trace.h"
 
 /* Set to > 0 for debug output */
 #define PIPE_DEBUG 0
@@ -95,10 +106,15 @@ static inline void uint64_set_high(uint64_t *addr, uint32 value)
 
 typedef struct PipeDevice  PipeDevice;
 
+/* The one and only pipe device, used by the global query functions. */
+static PipeDevice* s_pipe_device;
+
 typedef struct {
     SysBusDevice parent;
     MemoryRegion iomem;
     qemu_irq irq;
+    /* The KVM GSI of |irq|, set by boards that can wire it to an irqfd */
+    int32_t irqfd_gsi;
 
     /* TODO: roll into shared state */
     PipeDevice *dev;
@@ -112,6 +128,65 @@ typedef struct {
  *****
  *****/
 
+/* Number of guest buffer translations remembered by each pipe. */
+#define PIPE_MAP_CACHE_SIZE  4
+
+/* A cached translation of a page-aligned range of guest RAM. Entries are
+ * only valid while |generation| matches PipeDevice::map_generation, which
+ * changes every time the guest memory layout is modified.
+ */
+typedef struct PipeMapCacheEntry {
+    hwaddr      phys;       /* page-aligned guest physical address */
+    hwaddr      len;        /* size of the range, 0 for an empty entry */
+    uint8_t*    host;       /* host address of |phys| */
+    ram_addr_t  ram_addr;   /* RAM address of |phys|, for dirty tracking */
+    unsigned    generation;
+} PipeMapCacheEntry;
+
+/* Objects released when a pipe is closed are kept on per-type free lists
+ * owned by the pipe device, so that opening and closing pipes at a high
+ * rate doesn't hit the heap at steady state. The first word of a free
+ * object links to the next one. These are only used with the iothread
+ * lock held.
+ */
+#define PIPE_FREE_LIST_MAX  256
+
+typedef struct PipeFreeList {
+    void*       head;
+    unsigned    count;
+} PipeFreeList;
+
+typedef struct PipeAllocator {
+    PipeFreeList    pipes;          /* HwPipe */
+    PipeFreeList    internals;      /* PipeInternal */
+    PipeFreeList    connectors;     /* PipeConnector */
+} PipeAllocator;
+
+static PipeAllocator* pipeDevice_allocator(PipeDevice* dev);
+
+static void* pipe_free_list_alloc(PipeFreeList* list, size_t size)
+{
+    void* obj = list->head;
+    if (obj == NULL) {
+        return g_malloc0(size);
+    }
+    list->head = *(void**)obj;
+    list->count--;
+    memset(obj, 0, size);
+    return obj;
+}
+
+static void pipe_free_list_release(PipeFreeList* list, void* obj)
+{
+    if (list->count >= PIPE_FREE_LIST_MAX) {
+        g_free(obj);
+        return;
+    }
+    *(void**)obj = list->head;
+    list->head = obj;
+    list->count++;
+}
+
 typedef struct HwPipe {
     struct HwPipe               *next;
     struct HwPipe               *next_waked;
@@ -121,6 +196,8 @@ typedef struct HwPipe {
     char                        closed;
     void                        *pipe;
     QemuMutex                   lock;
+    PipeMapCacheEntry           map_cache[PIPE_MAP_CACHE_SIZE];
+    unsigned                    map_cache_next;
 } HwPipe;
 
 static unsigned char get_and_clear_pipe_wanted(HwPipe* pipe) {
@@ -151,7 +228,8 @@ static HwPipe*
 pipe_new0(PipeDevice* dev)
 {
     HwPipe*  pipe;
-    pipe = g_malloc0(sizeof(HwPipe));
+    pipe = pipe_free_list_alloc(&pipeDevice_allocator(dev)->pipes,
+                                sizeof(HwPipe));
     pipe->device = dev;
     return pipe;
 }
@@ -166,6 +244,20 @@ pipe_new(uint64_t channel, PipeDevice* dev)
     return pipe;
 }
 
+/* Channels are kernel pointers, so the low bits carry little entropy;
+ * fold the high word in and drop the alignment bits before hashing.
+ */
+static guint pipe_channel_hash(gconstpointer key)
+{
+    uint64_t channel = *(const uint64_t *)key;
+    return (guint)((channel >> 3) ^ (channel >> 32));
+}
+
+static gboolean pipe_channel_equal(gconstpointer a, gconstpointer b)
+{
+    return *(const uint64_t *)a == *(const uint64_t *)b;
+}
+
 static HwPipe**
 pipe_list_findp_channel(HwPipe **list, uint64_t channel)
 {
@@ -189,7 +281,7 @@ static void pipe_free(HwPipe* pipe)
        mutex could also be called in "android_pipe_free"
        */
     qemu_mutex_destroy(&pipe->lock);
-    g_free(pipe);
+    pipe_free_list_release(&pipeDevice_allocator(pipe->device)->pipes, pipe);
 }
 
 #ifndef USE_ANDROID_EMU
@@ -199,18 +291,25 @@ static void pipe_free(HwPipe* pipe)
 typedef struct PipeService PipeService;
 typedef struct HwPipe HwPipe;
 
+/* Connection arguments up to this size are stored in the PipeInternal
+ * itself rather than in a separate heap allocation. */
+#define PIPE_ARGS_INLINE_SIZE  64
+
 typedef struct PipeInternal {
     void                        *opaque;
     const AndroidPipeFuncs      *funcs;
     const PipeService           *service;
-    char*                       args;
+    char*                       args;   /* NULL, args_buf or heap copy */
     HwPipe*                     hwPipe;
+    char                        args_buf[PIPE_ARGS_INLINE_SIZE];
 } PipeInternal;
 
 static void* pipeConnector_new(HwPipe* pipe);
 
 PipeInternal* android_pipe_new(HwPipe* pipe) {
-    PipeInternal* res = pipe->pipe = g_malloc0(sizeof(PipeInternal));
+    PipeInternal* res = pipe->pipe = pipe_free_list_alloc(
+            &pipeDevice_allocator(pipe->device)->internals,
+            sizeof(PipeInternal));
     res->opaque = pipeConnector_new(pipe);
     res->hwPipe = pipe;
     return res;
@@ -227,8 +326,11 @@ void android_pipe_free(void* pipe_) {
         pipe->funcs->close(pipe->opaque);
     }
     /* Free stuff */
-    free(pipe->args);
-    free(pipe);
+    if (pipe->args != pipe->args_buf) {
+        g_free(pipe->args);
+    }
+    pipe_free_list_release(&pipeDevice_allocator(pipe->hwPipe->device)->internals,
+                           pipe);
 }
 
 static unsigned android_pipe_poll(void* pipe_) {
@@ -236,14 +338,24 @@ static unsigned android_pipe_poll(void* pipe_) {
     return pipe->funcs->poll(pipe->opaque);
 }
 
+static void android_pipe_account_command(void* pipe_);
+static void android_pipe_account_transfer(void* pipe_, int64_t start_ns,
+                                          int ret, bool is_send);
+
 static int android_pipe_recv(void* pipe_, AndroidPipeBuffer* buffers, int numBuffers) {
     PipeInternal* pipe = pipe_;
-    return pipe->funcs->recvBuffers(pipe->opaque, buffers, numBuffers);
+    int64_t start_ns = get_clock();
+    int ret = pipe->funcs->recvBuffers(pipe->opaque, buffers, numBuffers);
+    android_pipe_account_transfer(pipe, start_ns, ret, false);
+    return ret;
 }
 
 static int android_pipe_send(void* pipe_, const AndroidPipeBuffer* buffers, int numBuffers) {
     PipeInternal* pipe = pipe_;
-    return pipe->funcs->sendBuffers(pipe->opaque, buffers, numBuffers);
+    int64_t start_ns = get_clock();
+    int ret = pipe->funcs->sendBuffers(pipe->opaque, buffers, numBuffers);
+    android_pipe_account_transfer(pipe, start_ns, ret, true);
+    return ret;
 }
 
 static void android_pipe_wake_on(void* pipe_, unsigned wakes) {
@@ -259,10 +371,32 @@ static void android_pipe_wake_on(void* pipe_, unsigned wakes) {
  *****/
 
 #define MAX_PIPE_SERVICES  8
+
+/* Number of buckets in PipeServiceStats::latency. Bucket N counts the
+ * calls that took less than 4^N microseconds, the last one counts all
+ * slower calls.
+ */
+#define PIPE_LATENCY_BUCKETS  8
+
+typedef struct PipeServiceStats {
+    uint64_t            opens;
+    uint64_t            commands;
+    uint64_t            bytes_sent;
+    uint64_t            bytes_received;
+    uint64_t            again;
+    uint64_t            latency[PIPE_LATENCY_BUCKETS];
+    int64_t             open_ns;        /* total time spent connecting */
+    int64_t             open_max_ns;
+} PipeServiceStats;
+
 typedef struct PipeService {
     const char          *name;
+    size_t              name_len;
+    guint               name_hash;      /* see pipe_service_hash() */
     void                *opaque;        /* pipe specific data */
     AndroidPipeFuncs    funcs;
+    bool                threaded;       /* I/O runs on the pipe I/O thread */
+    PipeServiceStats    stats;          /* only updated with the BQL held */
 } PipeService;
 
 typedef struct {
@@ -272,10 +406,24 @@ typedef struct {
 
 static PipeServices  _pipeServices[1];
 
-void
-android_pipe_add_type(const char *pipeName,
-                      void *pipeOpaque,
-                      const AndroidPipeFuncs *pipeFuncs)
+/* FNV-1a hash of a service name, computed once at registration time so
+ * that looking up a service only compares names with a matching hash. */
+static guint pipe_service_hash(const char* name, size_t len)
+{
+    guint hash = 2166136261u;
+    size_t nn;
+
+    for (nn = 0; nn < len; nn++) {
+        hash = (hash ^ (unsigned char)name[nn]) * 16777619u;
+    }
+    return hash;
+}
+
+static void
+android_pipe_add_service(const char *pipeName,
+                         void *pipeOpaque,
+                         const AndroidPipeFuncs *pipeFuncs,
+                         bool threaded)
 {
     PipeServices *list = _pipeServices;
     int          count = list->count;
@@ -288,27 +436,632 @@ android_pipe_add_type(const char *pipeName,
         APANIC("HwPipe service name too long: '%s'", pipeName);
     }
 
-    list->services[count].name   = pipeName;
-    list->services[count].opaque = pipeOpaque;
-    list->services[count].funcs  = pipeFuncs[0];
+    list->services[count].name     = pipeName;
+    list->services[count].name_len = strlen(pipeName);
+    list->services[count].name_hash =
+            pipe_service_hash(pipeName, list->services[count].name_len);
+    list->services[count].opaque   = pipeOpaque;
+    list->services[count].funcs    = pipeFuncs[0];
+    list->services[count].threaded = threaded;
+
+    /* The metrics read the services without the BQL */
+    smp_wmb();
+    atomic_set(&list->count, count + 1);
+}
 
-    list->count++;
+void
+android_pipe_add_type(const char *pipeName,
+                      void *pipeOpaque,
+                      const AndroidPipeFuncs *pipeFuncs)
+{
+    android_pipe_add_service(pipeName, pipeOpaque, pipeFuncs, false);
 }
 
-static const PipeService* android_pipe_find_type(const char *pipeName)
+void
+android_pipe_add_type_threaded(const char *pipeName,
+                               void *pipeOpaque,
+                               const AndroidPipeFuncs *pipeFuncs)
+{
+    android_pipe_add_service(pipeName, pipeOpaque, pipeFuncs, true);
+}
+
+/* Return the stats of the service |pipe_| is connected to, or NULL if it
+ * is still waiting for its connection string. */
+static PipeServiceStats* android_pipe_stats(void* pipe_)
+{
+    PipeInternal* pipe = pipe_;
+    if (!pipe || !pipe->service) {
+        return NULL;
+    }
+    /* The registry is the only owner of PipeService instances. */
+    return (PipeServiceStats*)&pipe->service->stats;
+}
+
+static void android_pipe_account_command(void* pipe_)
+{
+    PipeServiceStats* stats = android_pipe_stats(pipe_);
+    if (stats) {
+        stats->commands++;
+    }
+}
+
+static void android_pipe_account_transfer(void* pipe_, int64_t start_ns,
+                                          int ret, bool is_send)
+{
+    PipeServiceStats* stats = android_pipe_stats(pipe_);
+    int64_t us;
+    int bucket;
+
+    if (!stats) {
+        return;
+    }
+    if (ret > 0) {
+        if (is_send) {
+            stats->bytes_sent += ret;
+        } else {
+            stats->bytes_received += ret;
+        }
+    } else if (ret == PIPE_ERROR_AGAIN) {
+        stats->again++;
+    }
+
+    us = (get_clock() - start_ns) / 1000;
+    for (bucket = 0; bucket < PIPE_LATENCY_BUCKETS - 1; bucket++) {
+        if (us < (INT64_C(1) << (2 * bucket))) {
+            break;
+        }
+    }
+    stats->latency[bucket]++;
+}
+
+AndroidPipeServiceInfoList* qmp_query_android_pipes(Error** errp)
+{
+    AndroidPipeServiceInfoList* head = NULL;
+    AndroidPipeServiceInfoList** prev = &head;
+    PipeServices* list = _pipeServices;
+    int nn, mm;
+
+    if (!s_pipe_device) {
+        error_setg(errp, "No android pipe device");
+        return NULL;
+    }
+
+    for (nn = 0; nn < list->count; nn++) {
+        const PipeService* svc = &list->services[nn];
+        AndroidPipeServiceInfoList* entry = g_new0(AndroidPipeServiceInfoList, 1);
+        AndroidPipeServiceInfo* info = g_new0(AndroidPipeServiceInfo, 1);
+        intList** bucket = &info->latency_histogram;
+
+        info->name = g_strdup(svc->name);
+        info->opens = svc->stats.opens;
+        info->commands = svc->stats.commands;
+        info->bytes_sent = svc->stats.bytes_sent;
+        info->bytes_received = svc->stats.bytes_received;
+        info->again = svc->stats.again;
+        info->open_time_ns = svc->stats.open_ns;
+        info->open_time_max_ns = svc->stats.open_max_ns;
+        for (mm = 0; mm < PIPE_LATENCY_BUCKETS; mm++) {
+            *bucket = g_new0(intList, 1);
+            (*bucket)->value = svc->stats.latency[mm];
+            bucket = &(*bucket)->next;
+        }
+
+        entry->value = info;
+        *prev = entry;
+        prev = &entry->next;
+    }
+    return head;
+}
+
+/* The services are never unregistered and their stats are plain
+ * counters, so they can be read without the BQL. */
+static void android_pipe_metrics_collect(MetricsWriter* w, void* opaque)
+{
+    PipeServices* list = _pipeServices;
+    double bounds[PIPE_LATENCY_BUCKETS - 1];
+    int count = atomic_read(&list->count);
+    int nn;
+
+    for (nn = 0; nn < PIPE_LATENCY_BUCKETS - 1; nn++) {
+        bounds[nn] = (INT64_C(1) << (2 * nn)) / 1e6;
+    }
+
+    metrics_family(w, "qemu_android_pipe_opens", METRIC_COUNTER,
+                   "Pipes connected to the service");
+    metrics_family(w, "qemu_android_pipe_open_seconds", METRIC_COUNTER,
+                   "Time spent connecting pipes");
+    metrics_family(w, "qemu_android_pipe_commands", METRIC_COUNTER,
+                   "Commands sent by the guest");
+    metrics_family(w, "qemu_android_pipe_sent_bytes", METRIC_COUNTER,
+                   "Bytes sent by the guest");
+    metrics_family(w, "qemu_android_pipe_received_bytes", METRIC_COUNTER,
+                   "Bytes received by the guest");
+    metrics_family(w, "qemu_android_pipe_again", METRIC_COUNTER,
+                   "Transfers that had to be retried");
+    metrics_family(w, "qemu_android_pipe_transfer_seconds", METRIC_HISTOGRAM,
+                   "Time taken by transfers");
+    for (nn = 0; nn < count; nn++) {
+        const PipeService* svc = &list->services[nn];
+        char* labels = metrics_labels("service", svc->name, NULL);
+
+        metrics_sample_int(w, "qemu_android_pipe_opens", labels,
+                           svc->stats.opens);
+        metrics_sample(w, "qemu_android_pipe_open_seconds", labels,
+                       svc->stats.open_ns / 1e9);
+        metrics_sample_int(w, "qemu_android_pipe_commands", labels,
+                           svc->stats.commands);
+        metrics_sample_int(w, "qemu_android_pipe_sent_bytes", labels,
+                           svc->stats.bytes_sent);
+        metrics_sample_int(w, "qemu_android_pipe_received_bytes", labels,
+                           svc->stats.bytes_received);
+        metrics_sample_int(w, "qemu_android_pipe_again", labels,
+                           svc->stats.again);
+        /* Only the buckets are kept, not the total time */
+        metrics_histogram(w, "qemu_android_pipe_transfer_seconds", labels,
+                          bounds, svc->stats.latency,
+                          PIPE_LATENCY_BUCKETS - 1, -1);
+        g_free(labels);
+    }
+}
+
+static void android_pipe_metrics_init(void)
+{
+    metrics_collector_add(android_pipe_metrics_collect, NULL);
+}
+
+/* Find the service whose name is the |len| first characters of
+ * |pipeName|, which doesn't need to be zero-terminated. */
+static const PipeService* android_pipe_find_type_len(const char *pipeName,
+                                                     size_t len)
 {
     PipeServices* list = _pipeServices;
     int           count = list->count;
+    guint         hash = pipe_service_hash(pipeName, len);
     int           nn;
 
     for (nn = 0; nn < count; nn++) {
-        if (!strcmp(list->services[nn].name, pipeName)) {
-            return &list->services[nn];
+        const PipeService* svc = &list->services[nn];
+        if (svc->name_hash == hash && svc->name_len == len &&
+            !memcmp(svc->name, pipeName, len)) {
+            return svc;
         }
     }
     return NULL;
 }
 
+/***********************************************************************
+ ***********************************************************************
+ *****
+ *****    T H R E A D E D   P I P E S
+ *****
+ *****/
+
+/* Pipes of services registered with android_pipe_add_type_threaded() are
+ * wrapped by a ThreadedPipe. The vCPU thread only copies data between the
+ * guest buffers and two per-pipe staging buffers, and the service's
+ * sendBuffers/recvBuffers callbacks run on a dedicated pipe I/O thread
+ * that drains/fills them. When a staging buffer is full (resp. empty) the
+ * guest gets PIPE_ERROR_AGAIN, and is woken up once the I/O thread has
+ * made progress.
+ *
+ * The other service callbacks (init, close, poll, wakeOn) are still
+ * called with the iothread lock held, from the vCPU thread or from a
+ * main loop bottom-half, so only sendBuffers/recvBuffers need to be
+ * thread-safe.
+ *
+ * All ThreadedPipe fields below the 'peer' member are protected by
+ * PipeIoThread::lock.
+ */
+
+#define THREADED_PIPE_BUFFER_SIZE  (64 * 1024)
+
+typedef struct ThreadedPipe {
+    HwPipe*                     hwpipe;
+    const PipeService*          service;
+    void*                       peer;       /* service-specific pipe */
+
+    QSIMPLEQ_ENTRY(ThreadedPipe) io_link;   /* in PipeIoThread::io_queue */
+    QSIMPLEQ_ENTRY(ThreadedPipe) main_link; /* in PipeIoThread::main_queue */
+    bool        io_queued;
+    bool        main_queued;
+    bool        busy;           /* being serviced by the I/O thread */
+    bool        rx_wanted;      /* the guest has started reading */
+
+    uint8_t*    tx;             /* guest -> service */
+    size_t      tx_len;
+    uint8_t*    rx;             /* service -> guest */
+    size_t      rx_pos;
+    size_t      rx_len;
+
+    int         error;          /* sticky service error, 0 if none */
+    unsigned    guest_wakes;    /* PIPE_WAKE_XXX wanted by the guest */
+    unsigned    service_ready;  /* PIPE_WAKE_XXX the service can handle */
+    unsigned    main_wake_on;   /* flags to pass to service wakeOn() */
+    unsigned    main_signal;    /* flags to signal to the guest */
+} ThreadedPipe;
+
+typedef struct PipeIoThread {
+    QemuThread  thread;
+    QemuMutex   lock;
+    QemuCond    work_cond;      /* io_queue is not empty */
+    QemuCond    idle_cond;      /* a pipe is no longer busy */
+    QEMUBH*     main_bh;        /* runs main-thread work for main_queue */
+    QSIMPLEQ_HEAD(, ThreadedPipe) io_queue;
+    QSIMPLEQ_HEAD(, ThreadedPipe) main_queue;
+} PipeIoThread;
+
+static PipeIoThread* s_pipe_io_thread;
+
+static const AndroidPipeFuncs threadedPipe_funcs;  // forward
+static void hwpipe_signal_guest(HwPipe* pipe, unsigned flags);  // forward
+
+/* Queue |tp| for the I/O thread. Called with the I/O thread lock held. */
+static void threadedPipe_scheduleIo(PipeIoThread* io, ThreadedPipe* tp)
+{
+    if (!tp->io_queued) {
+        tp->io_queued = true;
+        QSIMPLEQ_INSERT_TAIL(&io->io_queue, tp, io_link);
+        qemu_cond_signal(&io->work_cond);
+    }
+}
+
+/* Queue |tp| for the main loop bottom-half, which will call the service's
+ * wakeOn() and/or signal the guest. Called with the I/O thread lock held.
+ */
+static void threadedPipe_scheduleMain(PipeIoThread* io, ThreadedPipe* tp,
+                                      unsigned wake_on, unsigned signal)
+{
+    if (!wake_on && !signal) {
+        return;
+    }
+    tp->main_wake_on |= wake_on;
+    tp->main_signal |= signal;
+    if (!tp->main_queued) {
+        tp->main_queued = true;
+        QSIMPLEQ_INSERT_TAIL(&io->main_queue, tp, main_link);
+        qemu_bh_schedule(io->main_bh);
+    }
+}
+
+/* Called on the I/O thread, without any lock held, to push staged guest
+ * data to the service and pull new data from it.
+ */
+static void threadedPipe_service(PipeIoThread* io, ThreadedPipe* tp)
+{
+    const AndroidPipeFuncs* funcs = &tp->service->funcs;
+    unsigned wake_on = 0, signal = 0;
+    AndroidPipeBuffer buf;
+    size_t tx_len, rx_space = 0;
+    bool can_read;
+    int ret;
+
+    qemu_mutex_lock(&io->lock);
+    tx_len = (tp->error || !(tp->service_ready & PIPE_WAKE_WRITE)) ?
+            0 : tp->tx_len;
+    can_read = !tp->error && tp->rx_wanted &&
+               (tp->service_ready & PIPE_WAKE_READ);
+    if (can_read) {
+        if (tp->rx_pos > 0) {
+            memmove(tp->rx, tp->rx + tp->rx_pos, tp->rx_len - tp->rx_pos);
+            tp->rx_len -= tp->rx_pos;
+            tp->rx_pos = 0;
+        }
+        rx_space = THREADED_PIPE_BUFFER_SIZE - tp->rx_len;
+    }
+    qemu_mutex_unlock(&io->lock);
+
+    /* The vCPU thread only appends to |tx| and only consumes |rx| below
+     * |rx_len|, so the ranges used here can be accessed without the lock.
+     */
+    if (tx_len > 0) {
+        buf.data = tp->tx;
+        buf.size = tx_len;
+        ret = funcs->sendBuffers(tp->peer, &buf, 1);
+
+        qemu_mutex_lock(&io->lock);
+        if (ret > 0) {
+            memmove(tp->tx, tp->tx + ret, tp->tx_len - ret);
+            tp->tx_len -= ret;
+            if (tp->guest_wakes & PIPE_WAKE_WRITE) {
+                tp->guest_wakes &= ~PIPE_WAKE_WRITE;
+                signal |= PIPE_WAKE_WRITE;
+            }
+            if (tp->tx_len > 0) {
+                threadedPipe_scheduleIo(io, tp);
+            }
+        } else if (ret == PIPE_ERROR_AGAIN) {
+            tp->service_ready &= ~PIPE_WAKE_WRITE;
+            wake_on |= PIPE_WAKE_WRITE;
+        } else {
+            tp->error = ret ? ret : PIPE_ERROR_IO;
+        }
+        qemu_mutex_unlock(&io->lock);
+    }
+
+    if (rx_space > 0) {
+        buf.data = tp->rx + tp->rx_len;
+        buf.size = rx_space;
+        ret = funcs->recvBuffers(tp->peer, &buf, 1);
+
+        qemu_mutex_lock(&io->lock);
+        if (ret > 0) {
+            tp->rx_len += ret;
+            if (tp->guest_wakes & PIPE_WAKE_READ) {
+                tp->guest_wakes &= ~PIPE_WAKE_READ;
+                signal |= PIPE_WAKE_READ;
+            }
+        } else if (ret == PIPE_ERROR_AGAIN) {
+            tp->service_ready &= ~PIPE_WAKE_READ;
+            wake_on |= PIPE_WAKE_READ;
+        } else {
+            tp->error = ret ? ret : PIPE_ERROR_IO;
+        }
+        qemu_mutex_unlock(&io->lock);
+    }
+
+    qemu_mutex_lock(&io->lock);
+    if (tp->error) {
+        /* Let blocked guest readers and writers see the error. */
+        signal |= tp->guest_wakes;
+        tp->guest_wakes = 0;
+    }
+    threadedPipe_scheduleMain(io, tp, wake_on, signal);
+    qemu_mutex_unlock(&io->lock);
+}
+
+static void* pipe_io_thread_run(void* opaque)
+{
+    PipeIoThread* io = opaque;
+
+    qemu_mutex_lock(&io->lock);
+    for (;;) {
+        ThreadedPipe* tp = QSIMPLEQ_FIRST(&io->io_queue);
+        if (!tp) {
+            qemu_cond_wait(&io->work_cond, &io->lock);
+            continue;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&io->io_queue, io_link);
+        tp->io_queued = false;
+        tp->busy = true;
+        qemu_mutex_unlock(&io->lock);
+
+        threadedPipe_service(io, tp);
+
+        qemu_mutex_lock(&io->lock);
+        tp->busy = false;
+        qemu_cond_broadcast(&io->idle_cond);
+    }
+    qemu_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+/* Main loop bottom-half, runs with the iothread lock held. */
+static void pipe_io_thread_main_bh(void* opaque)
+{
+    PipeIoThread* io = opaque;
+    ThreadedPipe* tp;
+
+    qemu_mutex_lock(&io->lock);
+    while ((tp = QSIMPLEQ_FIRST(&io->main_queue)) != NULL) {
+        unsigned wake_on = tp->main_wake_on;
+        unsigned signal = tp->main_signal;
+
+        QSIMPLEQ_REMOVE_HEAD(&io->main_queue, main_link);
+        tp->main_queued = false;
+        tp->main_wake_on = 0;
+        tp->main_signal = 0;
+        qemu_mutex_unlock(&io->lock);
+
+        /* |tp| can't be freed here: closing it also requires the iothread
+         * lock, which we hold. */
+        if (wake_on) {
+            tp->service->funcs.wakeOn(tp->peer, wake_on);
+        }
+        if (signal) {
+            hwpipe_signal_guest(tp->hwpipe, signal);
+        }
+        qemu_mutex_lock(&io->lock);
+    }
+    qemu_mutex_unlock(&io->lock);
+}
+
+static PipeIoThread* pipe_io_thread_get(void)
+{
+    if (!s_pipe_io_thread) {
+        PipeIoThread* io = g_new0(PipeIoThread, 1);
+        qemu_mutex_init(&io->lock);
+        qemu_cond_init(&io->work_cond);
+        qemu_cond_init(&io->idle_cond);
+        QSIMPLEQ_INIT(&io->io_queue);
+        QSIMPLEQ_INIT(&io->main_queue);
+        io->main_bh = qemu_bh_new(pipe_io_thread_main_bh, io);
+        qemu_thread_create(&io->thread, "android-pipe-io", pipe_io_thread_run,
+                           io, QEMU_THREAD_DETACHED);
+        s_pipe_io_thread = io;
+    }
+    return s_pipe_io_thread;
+}
+
+static ThreadedPipe* threadedPipe_new(HwPipe* hwpipe,
+                                      const PipeService* service,
+                                      void* peer)
+{
+    ThreadedPipe* tp = g_new0(ThreadedPipe, 1);
+    tp->hwpipe = hwpipe;
+    tp->service = service;
+    tp->peer = peer;
+    tp->tx = g_malloc(THREADED_PIPE_BUFFER_SIZE);
+    tp->rx = g_malloc(THREADED_PIPE_BUFFER_SIZE);
+    /* Optimistically assume the service is ready, it will return
+     * PIPE_ERROR_AGAIN otherwise. */
+    tp->service_ready = PIPE_WAKE_READ | PIPE_WAKE_WRITE;
+    pipe_io_thread_get();
+    return tp;
+}
+
+/* Called from qemu2_android_pipe_wake() when the service signals that it
+ * can make progress again. */
+static void threadedPipe_serviceWake(ThreadedPipe* tp, unsigned flags)
+{
+    PipeIoThread* io = s_pipe_io_thread;
+
+    qemu_mutex_lock(&io->lock);
+    tp->service_ready |= flags & (PIPE_WAKE_READ | PIPE_WAKE_WRITE);
+    threadedPipe_scheduleIo(io, tp);
+    qemu_mutex_unlock(&io->lock);
+}
+
+static void threadedPipe_close(void* opaque)
+{
+    ThreadedPipe* tp = opaque;
+    PipeIoThread* io = s_pipe_io_thread;
+
+    qemu_mutex_lock(&io->lock);
+    /* The I/O thread never takes the iothread lock, so it is safe to
+     * wait for it here. */
+    while (tp->busy) {
+        qemu_cond_wait(&io->idle_cond, &io->lock);
+    }
+    if (tp->io_queued) {
+        QSIMPLEQ_REMOVE(&io->io_queue, tp, ThreadedPipe, io_link);
+    }
+    if (tp->main_queued) {
+        QSIMPLEQ_REMOVE(&io->main_queue, tp, ThreadedPipe, main_link);
+    }
+    qemu_mutex_unlock(&io->lock);
+
+    if (tp->service->funcs.close) {
+        tp->service->funcs.close(tp->peer);
+    }
+    g_free(tp->tx);
+    g_free(tp->rx);
+    g_free(tp);
+}
+
+static int threadedPipe_sendBuffers(void* opaque,
+                                    const AndroidPipeBuffer* buffers,
+                                    int numBuffers)
+{
+    ThreadedPipe* tp = opaque;
+    PipeIoThread* io = s_pipe_io_thread;
+    int ret = 0;
+    int nn;
+
+    qemu_mutex_lock(&io->lock);
+    if (tp->error) {
+        ret = tp->error;
+        goto out;
+    }
+    for (nn = 0; nn < numBuffers; nn++) {
+        size_t avail = THREADED_PIPE_BUFFER_SIZE - tp->tx_len;
+        size_t len = MIN(avail, buffers[nn].size);
+        memcpy(tp->tx + tp->tx_len, buffers[nn].data, len);
+        tp->tx_len += len;
+        ret += len;
+        if (len < buffers[nn].size) {
+            break;
+        }
+    }
+    if (ret == 0) {
+        ret = PIPE_ERROR_AGAIN;
+    } else {
+        threadedPipe_scheduleIo(io, tp);
+    }
+out:
+    qemu_mutex_unlock(&io->lock);
+    return ret;
+}
+
+static int threadedPipe_recvBuffers(void* opaque,
+                                    AndroidPipeBuffer* buffers,
+                                    int numBuffers)
+{
+    ThreadedPipe* tp = opaque;
+    PipeIoThread* io = s_pipe_io_thread;
+    int ret = 0;
+    int nn;
+
+    qemu_mutex_lock(&io->lock);
+    tp->rx_wanted = true;
+    for (nn = 0; nn < numBuffers && tp->rx_pos < tp->rx_len; nn++) {
+        size_t len = MIN(tp->rx_len - tp->rx_pos, buffers[nn].size);
+        memcpy(buffers[nn].data, tp->rx + tp->rx_pos, len);
+        tp->rx_pos += len;
+        ret += len;
+    }
+    if (ret == 0) {
+        ret = tp->error ? tp->error : PIPE_ERROR_AGAIN;
+    }
+    if (!tp->error) {
+        /* Either fetch more data, or refill the space we just freed. */
+        threadedPipe_scheduleIo(io, tp);
+    }
+    qemu_mutex_unlock(&io->lock);
+    return ret;
+}
+
+static unsigned threadedPipe_poll(void* opaque)
+{
+    ThreadedPipe* tp = opaque;
+    PipeIoThread* io = s_pipe_io_thread;
+    unsigned ret = 0;
+
+    qemu_mutex_lock(&io->lock);
+    if (tp->rx_pos < tp->rx_len) {
+        ret |= PIPE_POLL_IN;
+    }
+    if (tp->tx_len < THREADED_PIPE_BUFFER_SIZE) {
+        ret |= PIPE_POLL_OUT;
+    }
+    if (tp->error) {
+        ret |= PIPE_POLL_HUP;
+    }
+    qemu_mutex_unlock(&io->lock);
+    return ret;
+}
+
+static void threadedPipe_wakeOn(void* opaque, int flags)
+{
+    ThreadedPipe* tp = opaque;
+    PipeIoThread* io = s_pipe_io_thread;
+    unsigned signal = 0;
+
+    qemu_mutex_lock(&io->lock);
+    if ((flags & PIPE_WAKE_READ) &&
+        (tp->rx_pos < tp->rx_len || tp->error)) {
+        signal |= PIPE_WAKE_READ;
+        flags &= ~PIPE_WAKE_READ;
+    }
+    if ((flags & PIPE_WAKE_WRITE) &&
+        (tp->tx_len < THREADED_PIPE_BUFFER_SIZE || tp->error)) {
+        signal |= PIPE_WAKE_WRITE;
+        flags &= ~PIPE_WAKE_WRITE;
+    }
+    tp->guest_wakes |= flags;
+    if (flags & PIPE_WAKE_READ) {
+        tp->rx_wanted = true;
+    }
+    if (flags) {
+        threadedPipe_scheduleIo(io, tp);
+    }
+    qemu_mutex_unlock(&io->lock);
+
+    if (signal) {
+        hwpipe_signal_guest(tp->hwpipe, signal);
+    }
+}
+
+static const AndroidPipeFuncs  threadedPipe_funcs = {
+    NULL,  /* init */
+    threadedPipe_close,
+    threadedPipe_sendBuffers,
+    threadedPipe_recvBuffers,
+    threadedPipe_poll,
+    threadedPipe_wakeOn,
+    NULL,  /* staged data can't be saved */
+    NULL,  /* so these can't be loaded */
+};
+
 /***********************************************************************
  ***********************************************************************
  *****
@@ -333,7 +1086,8 @@ pipeConnector_new(HwPipe* pipe)
 {
     PipeConnector*  pcon;
 
-    pcon = g_malloc0(sizeof(PipeConnector));
+    pcon = pipe_free_list_alloc(&pipeDevice_allocator(pipe->device)->connectors,
+                                sizeof(PipeConnector));
     pcon->pipe  = pipe;
     PipeInternal* pi = pipe->pipe;
     assert(pi);
@@ -341,11 +1095,119 @@ pipeConnector_new(HwPipe* pipe)
     return pcon;
 }
 
+static void
+pipeConnector_free( PipeConnector* pcon )
+{
+    pipe_free_list_release(&pipeDevice_allocator(pcon->pipe->device)->connectors,
+                           pcon);
+}
+
 static void
 pipeConnector_close( void* opaque )
 {
-    PipeConnector*  pcon = opaque;
-    g_free(pcon);
+    pipeConnector_free(opaque);
+}
+
+/* Parse the connection string |str| of |len| characters, which must be
+ * followed by a terminating zero, then connect the pipe to the requested
+ * service. Acceptable formats for the connection string are:
+ *
+ *   pipe:<name>
+ *   pipe:<name>:<arguments>
+ *
+ * Returns 0 on success, or PIPE_ERROR_INVAL. This doesn't modify |str|,
+ * which can directly point to guest memory.
+ */
+static int
+pipeConnector_connect( PipeConnector* pcon, const char* str, size_t len )
+{
+    const char* pipeName;
+    const char* pipeArgs;
+    size_t nameLen;
+    int64_t start_ns = get_clock();
+
+    D("%s: connector: '%s'", __FUNCTION__, str);
+
+    if (len < 5 || memcmp(str, "pipe:", 5) != 0) {
+        /* Nope, we don't handle these for now. */
+        qemu_log_mask(LOG_UNIMP, "%s: Unknown pipe connection: '%s'\n",
+                      __func__, str);
+        return PIPE_ERROR_INVAL;
+    }
+
+    pipeName = str + 5;
+    pipeArgs = memchr(pipeName, ':', len - 5);
+
+    /* Directly connect qemud:adb pipes to their adb backends without
+     * going through the qemud multiplexer.  All other uses of the ':'
+     * char than an initial "qemud:" will be parsed as arguments to the
+     * pipe name preceeding the colon.
+     */
+    if (pipeArgs && pipeArgs - pipeName == 5
+            && strncmp(pipeName, "qemud", 5) == 0) {
+        pipeArgs = memchr(pipeArgs + 1, ':', str + len - (pipeArgs + 1));
+    }
+
+    if (pipeArgs != NULL) {
+        nameLen = pipeArgs - pipeName;
+        pipeArgs++;
+        if (!*pipeArgs)
+            pipeArgs = NULL;
+    } else {
+        nameLen = str + len - pipeName;
+    }
+
+    HwPipe* pipe = pcon->pipe;
+    const PipeService* svc = android_pipe_find_type_len(pipeName, nameLen);
+    if (svc == NULL) {
+        qemu_log_mask(LOG_UNIMP, "%s: Couldn't find service: '%.*s'\n",
+                      __func__, (int)nameLen, pipeName);
+        return PIPE_ERROR_INVAL;
+    }
+
+    /* Copy the arguments before calling init(), |str| may be guest memory
+     * that can change under our feet. */
+    PipeInternal* pi = pipe->pipe;
+    char* args = NULL;
+    if (pipeArgs != NULL) {
+        size_t argsLen = strlen(pipeArgs);
+        if (argsLen < sizeof(pi->args_buf)) {
+            args = memcpy(pi->args_buf, pipeArgs, argsLen + 1);
+        } else {
+            args = g_strndup(pipeArgs, argsLen);
+        }
+    }
+    void*  peer = svc->funcs.init(pipe, svc->opaque, args);
+    if (peer == NULL) {
+        fprintf(stderr,"%s: error initialising pipe:'%s' with args '%s'\n",
+                __func__, svc->name, args);
+        if (args != pi->args_buf) {
+            g_free(args);
+        }
+        return PIPE_ERROR_INVAL;
+    }
+
+    /* Do the evil switch now */
+    pi->service = svc;
+    if (svc->threaded) {
+        pi->opaque = threadedPipe_new(pipe, svc, peer);
+        pi->funcs  = &threadedPipe_funcs;
+    } else {
+        pi->opaque = peer;
+        pi->funcs  = &svc->funcs;
+    }
+    pi->args   = args;
+    pipeConnector_free(pcon);
+
+    PipeServiceStats* stats = (PipeServiceStats*)&svc->stats;
+    int64_t open_ns = get_clock() - start_ns;
+    trace_android_pipe_connect(svc->name, open_ns);
+    stats->opens++;
+    stats->open_ns += open_ns;
+    if (open_ns > stats->open_max_ns) {
+        stats->open_max_ns = open_ns;
+    }
+    return 0;
 }
 
 static int
@@ -359,6 +1221,22 @@ pipeConnector_sendBuffers( void* opaque, const AndroidPipeBuffer* buffers, int n
        (unsigned long long)pcon->pipe->channel,
        numBuffers);
 
+    /* Fast path: the whole connection string is in the first buffer, parse
+     * it in place instead of copying it into the connector buffer. */
+    if (pcon->buffpos == 0 && numBuffers > 0 && buffers[0].size > 0) {
+        size_t limit = MIN(buffers[0].size, sizeof(pcon->buffer));
+        const char* str = (const char*)buffers[0].data;
+        const char* zero = memchr(str, '\0', limit);
+        if (zero != NULL) {
+            for (; buffers < buffers_limit; buffers++) {
+                int avail = sizeof(pcon->buffer) - ret;
+                ret += MIN(avail, buffers[0].size);
+            }
+            int err = pipeConnector_connect(pcon, str, zero - str);
+            return err ? err : ret;
+        }
+    }
+
     while (buffers < buffers_limit) {
         int  avail;
 
@@ -383,65 +1261,13 @@ pipeConnector_sendBuffers( void* opaque, const AndroidPipeBuffer* buffers, int n
     }
 
     /* Now check that our buffer contains a zero-terminated string */
-    if (memchr(pcon->buffer, '\0', pcon->buffpos) != NULL) {
-        /* Acceptable formats for the connection string are:
-         *
-         *   pipe:<name>
-         *   pipe:<name>:<arguments>
-         */
-        char* pipeName;
-        char* pipeArgs;
-
-        D("%s: connector: '%s'", __FUNCTION__, pcon->buffer);
-
-        if (memcmp(pcon->buffer, "pipe:", 5) != 0) {
-            /* Nope, we don't handle these for now. */
-            qemu_log_mask(LOG_UNIMP, "%s: Unknown pipe connection: '%s'\n",
-                          __func__, pcon->buffer);
-            return PIPE_ERROR_INVAL;
-        }
-
-        pipeName = pcon->buffer + 5;
-        pipeArgs = strchr(pipeName, ':');
-
-        /* Directly connect qemud:adb pipes to their adb backends without
-         * going through the qemud multiplexer.  All other uses of the ':'
-         * char than an initial "qemud:" will be parsed as arguments to the
-         * pipe name preceeding the colon.
-         */
-        if (pipeArgs && pipeArgs - pipeName == 5
-                && strncmp(pipeName, "qemud", 5) == 0) {
-            pipeArgs = strchr(pipeArgs + 1, ':');
-        }
-
-        if (pipeArgs != NULL) {
-            *pipeArgs++ = '\0';
-            if (!*pipeArgs)
-                pipeArgs = NULL;
-        }
-
-        HwPipe* pipe = pcon->pipe;
-        const PipeService* svc = android_pipe_find_type(pipeName);
-        if (svc == NULL) {
-            qemu_log_mask(LOG_UNIMP, "%s: Couldn't find service: '%s'\n",
-                          __func__, pipeName);
-            return PIPE_ERROR_INVAL;
-        }
-
-        void*  peer = svc->funcs.init(pipe, svc->opaque, pipeArgs);
-        if (peer == NULL) {
-            fprintf(stderr,"%s: error initialising pipe:'%s' with args '%s'\n",
-                    __func__, pipeName, pipeArgs);
-            return PIPE_ERROR_INVAL;
+    const char* zero = memchr(pcon->buffer, '\0', pcon->buffpos);
+    if (zero != NULL) {
+        int err = pipeConnector_connect(pcon, pcon->buffer,
+                                        zero - pcon->buffer);
+        if (err) {
+            return err;
         }
-
-        /* Do the evil switch now */
-        PipeInternal* pi = pipe->pipe;
-        pi->opaque = peer;
-        pi->service = svc;
-        pi->funcs  = &svc->funcs;
-        pi->args   = g_strdup(pipeArgs);
-        g_free(pcon);
     }
 
     return ret;
@@ -485,7 +1311,7 @@ pipeConnector_load( void* hwpipe, void* pipeOpaque, const char* args, QEMUFile*
     pcon = pipeConnector_new(hwpipe);
     pcon->buffpos = len;
     if (qemu_get_buffer(file, (uint8_t*)pcon->buffer, pcon->buffpos) != pcon->buffpos) {
-        g_free(pcon);
+        pipeConnector_free(pcon);
         return NULL;
     }
     return pcon;
@@ -502,6 +1328,18 @@ static const AndroidPipeFuncs  pipeConnector_funcs = {
     pipeConnector_load,
 };
 
+#else  // USE_ANDROID_EMU
+
+/* The pipe services are managed by AndroidEmu in this configuration. */
+static inline void android_pipe_account_command(void* pipe) {}
+static inline void android_pipe_metrics_init(void) {}
+
+AndroidPipeServiceInfoList* qmp_query_android_pipes(Error** errp)
+{
+    error_set(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
 #endif // USE_ANDROID_EMU
 
 
@@ -521,74 +1359,448 @@ struct PipeDevice {
     HwPipe*  cache_pipe;
     HwPipe*  cache_pipe_64bit;
 
-    QemuMutex lock;
+    /* channel -> HwPipe map, keyed by &HwPipe::channel. This mirrors
+     * |save_pipes| and is only used to resolve |channel| quickly, the
+     * list above keeps its ordering for the wake/save logic. */
+    GHashTable* pipes_by_channel;
+    AndroidPipeLookupStats lookup_stats;
+
+    /* Used to invalidate the per-pipe guest buffer mapping caches. */
+    MemoryListener memory_listener;
+    unsigned map_generation;
+
+    /* Free lists for the per-pipe objects, see PipeFreeList. */
+    PipeAllocator allocator;
+
+    QemuMutex lock;
+
+    /* Protects the i/o registers below, which the guest accesses without
+     * the iothread lock, see pipe_dev_lock(). Taken after the iothread
+     * lock. Everything else is still protected by the iothread lock. */
+    QemuMutex state_lock;
+
+    /* Scheduled when loading a snapshot to signal the pipes it closed. */
+    QEMUBH* load_bh;
+
+    /* The irq, raised through |irqfd| when it is active. |ring_done| is
+     * set when an asynchronous ring doorbell raised it, and cleared when
+     * it is lowered. Both are protected by the iothread lock. */
+    IrqfdLine irqfd;
+    bool irq_level;
+    bool ring_done;
+
+    /* PIPE_REG_RING_DOORBELL_ASYNC, as a KVM ioeventfd */
+    EventNotifier doorbell;
+
+    /* i/o registers */
+    uint64_t  address;
+    uint32_t  size;
+    uint32_t  status;
+    uint64_t  channel;
+    uint32_t  wakes;
+    uint64_t  params_addr;
+    uint64_t  ring_addr;
+    uint32_t  ring_entries;
+};
+
+/* Set the level of the irq, the iothread lock must be held */
+static void pipe_dev_set_irq(PipeDevice* dev, bool level)
+{
+    dev->irq_level = level;
+    if (!level) {
+        dev->ring_done = false;
+    }
+    if (dev->irqfd.active) {
+        /* KVM lowers it when the guest is done with the interrupt, and
+         * asks pipe_dev_irq_pending() whether to raise it again. */
+        if (level) {
+            irqfd_line_raise(&dev->irqfd);
+        }
+    } else {
+        qemu_set_irq(dev->ps->irq, level);
+    }
+}
+
+static bool pipe_dev_irq_pending(void* opaque)
+{
+    PipeDevice* dev = opaque;
+
+    return dev->irq_level;
+}
+
+static PipeAllocator* pipeDevice_allocator(PipeDevice* dev)
+{
+    return &dev->allocator;
+}
+
+static HwPipe* get_and_clear_cache_pipe(PipeDevice* dev) {
+    if (dev->cache_pipe_64bit) {
+        HwPipe* val = dev->cache_pipe_64bit;
+        dev->cache_pipe_64bit = NULL;
+        return val;
+    }
+    qemu_mutex_lock(&dev->lock);
+    HwPipe* val = dev->cache_pipe;
+    dev->cache_pipe = NULL;
+    qemu_mutex_unlock(&dev->lock);
+    return val;
+}
+
+static void set_cache_pipe(PipeDevice* dev, HwPipe* cache_pipe) {
+    qemu_mutex_lock(&dev->lock);
+    dev->cache_pipe = cache_pipe;
+    qemu_mutex_unlock(&dev->lock);
+}
+
+/* Update this version number if the device's interface changes. */
+#define PIPE_DEVICE_VERSION  1
+
+/* Optional extensions advertised through PIPE_REG_FEATURES. These don't
+ * change the version number, so existing guest drivers are unaffected. */
+#define PIPE_DEVICE_FEATURES  (PIPE_FEATURE_VECTORED_IO | \
+                               PIPE_FEATURE_COMMAND_RING | \
+                               PIPE_FEATURE_BATCH_POLL | \
+                               PIPE_FEATURE_ASYNC_RING)
+
+/* Map the guest buffer specified by the guest paddr 'phys'.
+ * Returns a host pointer which should be unmapped later via
+ * cpu_physical_memory_unmap(), or NULL if mapping failed (likely
+ * because the paddr doesn't actually point at RAM).
+ * Note that for RAM the "mapping" process doesn't actually involve a
+ * data copy.
+ */
+static void *map_guest_buffer(hwaddr phys, size_t size, int is_write)
+{
+    hwaddr l = size;
+    void *ptr;
+
+    ptr = cpu_physical_memory_map(phys, &l, is_write);
+    if (!ptr) {
+        /* Can't happen for RAM */
+        return NULL;
+    }
+    if (l != size) {
+        /* This will only happen if the address pointed at non-RAM,
+         * or if the size means the buffer end is beyond the end of
+         * the RAM block.
+         */
+        cpu_physical_memory_unmap(ptr, l, 0, 0);
+        return NULL;
+    }
+
+    return ptr;
+}
+
+static HwPipe* pipeDevice_findChannel(PipeDevice* dev, uint64_t channel)
+{
+    HwPipe* pipe = g_hash_table_lookup(dev->pipes_by_channel, &channel);
+    dev->lookup_stats.lookups++;
+    if (pipe == NULL) {
+        dev->lookup_stats.misses++;
+    }
+    return pipe;
+}
+
+static void pipeDevice_addPipe(PipeDevice* dev, HwPipe* pipe)
+{
+    unsigned count;
+
+    pipe->next = dev->save_pipes;
+    dev->save_pipes = pipe;
+    dev->pipes = dev->save_pipes;
+    g_hash_table_insert(dev->pipes_by_channel, &pipe->channel, pipe);
+
+    count = g_hash_table_size(dev->pipes_by_channel);
+    dev->lookup_stats.num_pipes = count;
+    if (count > dev->lookup_stats.max_pipes) {
+        dev->lookup_stats.max_pipes = count;
+    }
+}
+
+static void pipeDevice_removePipe(PipeDevice* dev, HwPipe* pipe)
+{
+    HwPipe** lookup = pipe_list_findp_channel(&dev->save_pipes, pipe->channel);
+    if (*lookup == pipe) {
+        *lookup = pipe->next;
+    }
+    pipe->next = NULL;
+    dev->pipes = dev->save_pipes;
+    if (dev->cache_pipe == pipe) {
+        dev->cache_pipe = NULL;
+    }
+    if (dev->cache_pipe_64bit == pipe) {
+        dev->cache_pipe_64bit = NULL;
+    }
+    g_hash_table_remove(dev->pipes_by_channel, &pipe->channel);
+    dev->lookup_stats.num_pipes = g_hash_table_size(dev->pipes_by_channel);
+}
+
+void android_pipe_get_lookup_stats(AndroidPipeLookupStats* stats)
+{
+    if (!s_pipe_device) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    *stats = s_pipe_device->lookup_stats;
+}
+
+/* A guest buffer mapped by pipe_map_buffer(). */
+typedef struct {
+    uint8_t*    data;
+    size_t      size;
+    ram_addr_t  ram_addr;   /* only valid if |cached| is true */
+    bool        cached;
+} PipeBufferMap;
+
+/* Map the guest buffer at |phys| for use by |pipe|. This first looks at
+ * the pipe's translation cache, and on a miss maps the whole set of
+ * guest pages covering the buffer so that later transfers to the same
+ * pages can skip cpu_physical_memory_map(). Returns false if the buffer
+ * isn't entirely contained in guest RAM.
+ */
+static bool pipe_map_buffer(HwPipe* pipe, hwaddr phys, size_t size,
+                            int is_write, PipeBufferMap* map)
+{
+    PipeDevice* dev = pipe->device;
+    PipeMapCacheEntry* entry;
+    hwaddr base, end, len;
+    MemoryRegion* mr;
+    uint8_t* host;
+    int nn;
+
+    for (nn = 0; nn < PIPE_MAP_CACHE_SIZE; nn++) {
+        entry = &pipe->map_cache[nn];
+        if (entry->len != 0 && entry->generation == dev->map_generation &&
+            phys >= entry->phys && phys + size <= entry->phys + entry->len) {
+            map->data = entry->host + (phys - entry->phys);
+            map->size = size;
+            map->ram_addr = entry->ram_addr + (phys - entry->phys);
+            map->cached = true;
+            dev->lookup_stats.map_cache_hits++;
+            return true;
+        }
+    }
+    dev->lookup_stats.map_cache_misses++;
+
+    base = phys & TARGET_PAGE_MASK;
+    end = TARGET_PAGE_ALIGN(phys + size);
+    len = end - base;
+    host = cpu_physical_memory_map(base, &len, is_write);
+    if (host && len == end - base) {
+        mr = qemu_ram_addr_from_host(host, &map->ram_addr);
+        if (mr) {
+            /* Plain guest RAM: the host pointer stays valid until the
+             * memory layout changes, so drop the reference taken by the
+             * map and remember the translation. */
+            cpu_physical_memory_unmap(host, len, 0, 0);
+            entry = &pipe->map_cache[pipe->map_cache_next];
+            pipe->map_cache_next =
+                    (pipe->map_cache_next + 1) % PIPE_MAP_CACHE_SIZE;
+            entry->phys = base;
+            entry->len = len;
+            entry->host = host;
+            entry->ram_addr = map->ram_addr;
+            entry->generation = dev->map_generation;
+
+            map->data = host + (phys - base);
+            map->size = size;
+            map->ram_addr += phys - base;
+            map->cached = true;
+            return true;
+        }
+    }
+    if (host) {
+        cpu_physical_memory_unmap(host, len, 0, 0);
+    }
+
+    /* Fall back to an uncached mapping of the exact range. */
+    map->data = map_guest_buffer(phys, size, is_write);
+    map->size = size;
+    map->cached = false;
+    return map->data != NULL;
+}
+
+/* Release a buffer mapped with pipe_map_buffer(). |access_len| is the
+ * number of bytes that may have been modified when |is_write| is set.
+ */
+static void pipe_unmap_buffer(PipeBufferMap* map, int is_write,
+                              size_t access_len)
+{
+    if (map->cached) {
+        if (is_write && access_len > 0) {
+            cpu_physical_memory_set_written(map->ram_addr, access_len);
+        }
+        return;
+    }
+    cpu_physical_memory_unmap(map->data, map->size, is_write, access_len);
+}
+
+static void pipe_device_memory_commit(MemoryListener* listener)
+{
+    PipeDevice* dev = container_of(listener, PipeDevice, memory_listener);
+
+    /* Any change to the guest memory layout can move or remove RAM,
+     * so invalidate all cached translations at once. */
+    dev->map_generation++;
+}
+
+/* Handle PIPE_CMD_WRITEV and PIPE_CMD_READV: read the descriptor array
+ * at dev->address, map all the guest buffers it describes and pass them
+ * to the pipe service with a single call.
+ */
+static void pipeDevice_doVectoredIo(PipeDevice* dev, HwPipe* pipe,
+                                    int is_read)
+{
+    struct android_pipe_iovec iov[PIPE_MAX_IOVECS];
+    AndroidPipeBuffer buffers[PIPE_MAX_IOVECS];
+    PipeBufferMap maps[PIPE_MAX_IOVECS];
+    uint32_t count = dev->size;
+    uint32_t nn, mapped = 0;
+    uint64_t total = 0;
+    int64_t start_ns;
+
+    if (count == 0 || count > PIPE_MAX_IOVECS) {
+        dev->status = PIPE_ERROR_INVAL;
+        return;
+    }
+
+    cpu_physical_memory_read(dev->address, iov, count * sizeof(iov[0]));
+
+    for (nn = 0; nn < count; nn++) {
+        uint64_t address = le64_to_cpu(iov[nn].address);
+        uint32_t size = le32_to_cpu(iov[nn].size);
+
+        if (!pipe_map_buffer(pipe, address, size, is_read, &maps[nn])) {
+            dev->status = PIPE_ERROR_INVAL;
+            goto out;
+        }
+        buffers[nn].data = maps[nn].data;
+        buffers[nn].size = size;
+        total += size;
+        mapped++;
+    }
+
+    start_ns = get_clock();
+    if (is_read) {
+        dev->status = android_pipe_recv(pipe->pipe, buffers, count);
+        trace_android_pipe_recv(dev->channel, count, total, dev->status,
+                                get_clock() - start_ns);
+    } else {
+        dev->status = android_pipe_send(pipe->pipe, buffers, count);
+        trace_android_pipe_send(dev->channel, count, total, dev->status,
+                                get_clock() - start_ns);
+    }
+    DD("%s: CMD_%s channel=0x%llx count=%u > status=%d", __FUNCTION__,
+       is_read ? "READV" : "WRITEV", (unsigned long long)dev->channel,
+       count, dev->status);
+
+out:
+    for (nn = 0; nn < mapped; nn++) {
+        pipe_unmap_buffer(&maps[nn], is_read, maps[nn].size);
+    }
+}
+
+/* Handle PIPE_CMD_POLL_MANY: poll every channel listed in the array at
+ * dev->address and store the results in place.
+ */
+static void pipeDevice_pollMany(PipeDevice* dev)
+{
+    struct android_pipe_poll_entry entries[PIPE_MAX_POLL_ENTRIES];
+    uint32_t count = dev->size;
+    uint32_t nn;
 
+    if (count == 0 || count > PIPE_MAX_POLL_ENTRIES) {
+        dev->status = PIPE_ERROR_INVAL;
+        return;
+    }
 
-    /* i/o registers */
-    uint64_t  address;
-    uint32_t  size;
-    uint32_t  status;
-    uint64_t  channel;
-    uint32_t  wakes;
-    uint64_t  params_addr;
-};
+    cpu_physical_memory_read(dev->address, entries, count * sizeof(entries[0]));
 
-static HwPipe* get_and_clear_cache_pipe(PipeDevice* dev) {
-    if (dev->cache_pipe_64bit) {
-        HwPipe* val = dev->cache_pipe_64bit;
-        dev->cache_pipe_64bit = NULL;
-        return val;
+    for (nn = 0; nn < count; nn++) {
+        HwPipe* pipe = pipeDevice_findChannel(dev,
+                                              le64_to_cpu(entries[nn].channel));
+        int flags;
+
+        if (pipe == NULL) {
+            flags = PIPE_ERROR_INVAL;
+        } else if (pipe->closed) {
+            flags = PIPE_ERROR_IO;
+        } else {
+            android_pipe_account_command(pipe->pipe);
+            flags = android_pipe_poll(pipe->pipe);
+        }
+        entries[nn].flags = cpu_to_le32(flags);
     }
-    qemu_mutex_lock(&dev->lock);
-    HwPipe* val = dev->cache_pipe;
-    dev->cache_pipe = NULL;
-    qemu_mutex_unlock(&dev->lock);
-    return val;
-}
 
-static void set_cache_pipe(PipeDevice* dev, HwPipe* cache_pipe) {
-    qemu_mutex_lock(&dev->lock);
-    dev->cache_pipe = cache_pipe;
-    qemu_mutex_unlock(&dev->lock);
+    cpu_physical_memory_write(dev->address, entries, count * sizeof(entries[0]));
+    DD("%s: polled %u channels", __FUNCTION__, count);
+    dev->status = count;
 }
 
-/* Update this version number if the device's interface changes. */
-#define PIPE_DEVICE_VERSION  1
-
-/* Map the guest buffer specified by the guest paddr 'phys'.
- * Returns a host pointer which should be unmapped later via
- * cpu_physical_memory_unmap(), or NULL if mapping failed (likely
- * because the paddr doesn't actually point at RAM).
- * Note that for RAM the "mapping" process doesn't actually involve a
- * data copy.
+/* Handle PIPE_CMD_GET_SIGNALLED: report and clear the wake flags of all
+ * signalled pipes that fit in the array at dev->address. This replaces
+ * the PIPE_REG_CHANNEL/PIPE_REG_WAKES iteration, so reset its state too.
  */
-static void *map_guest_buffer(hwaddr phys, size_t size, int is_write)
+static void pipeDevice_getSignalled(PipeDevice* dev)
 {
-    hwaddr l = size;
-    void *ptr;
+    struct android_pipe_poll_entry entries[PIPE_MAX_POLL_ENTRIES];
+    uint32_t max = dev->size;
+    uint32_t count = 0;
+    HwPipe* pipe;
 
-    ptr = cpu_physical_memory_map(phys, &l, is_write);
-    if (!ptr) {
-        /* Can't happen for RAM */
-        return NULL;
+    if (max == 0 || max > PIPE_MAX_POLL_ENTRIES) {
+        dev->status = PIPE_ERROR_INVAL;
+        return;
     }
-    if (l != size) {
-        /* This will only happen if the address pointed at non-RAM,
-         * or if the size means the buffer end is beyond the end of
-         * the RAM block.
-         */
-        cpu_physical_memory_unmap(ptr, l, 0, 0);
-        return NULL;
+
+    for (pipe = dev->save_pipes; pipe != NULL; pipe = pipe->next) {
+        if (pipe->wanted == 0) {
+            continue;
+        }
+        if (count == max) {
+            break;
+        }
+        entries[count].channel = cpu_to_le64(pipe->channel);
+        entries[count].flags = cpu_to_le32(get_and_clear_pipe_wanted(pipe));
+        entries[count].reserved = 0;
+        count++;
     }
 
-    return ptr;
+    if (count > 0) {
+        cpu_physical_memory_write(dev->address, entries,
+                                  count * sizeof(entries[0]));
+    }
+
+    if (pipe == NULL) {
+        /* Everything was reported. */
+        dev->pipes = dev->save_pipes;
+        get_and_clear_cache_pipe(dev);
+        dev->cache_pipe_64bit = NULL;
+        pipe_dev_set_irq(dev, false);
+        DD("%s: lowering IRQ", __FUNCTION__);
+    }
+
+    DD("%s: %u signalled channels", __FUNCTION__, count);
+    dev->status = count;
 }
 
 static void
 pipeDevice_doCommand( PipeDevice* dev, uint32_t command )
 {
-    HwPipe** lookup = pipe_list_findp_channel(&dev->pipes, dev->channel);
-    HwPipe*  pipe   = *lookup;
+    HwPipe*  pipe;
+
+    /* These commands don't refer to the CHANNEL register. */
+    switch (command) {
+    case PIPE_CMD_POLL_MANY:
+        pipeDevice_pollMany(dev);
+        return;
+
+    case PIPE_CMD_GET_SIGNALLED:
+        pipeDevice_getSignalled(dev);
+        return;
+    }
+
+    pipe = pipeDevice_findChannel(dev, dev->channel);
 
     /* Check that we're referring a known pipe channel */
     if (command != PIPE_CMD_OPEN && pipe == NULL) {
@@ -596,6 +1808,10 @@ pipeDevice_doCommand( PipeDevice* dev, uint32_t command )
         return;
     }
 
+    if (pipe != NULL) {
+        android_pipe_account_command(pipe->pipe);
+    }
+
     /* If the pipe is closed by the host, return an error */
     if (pipe != NULL && pipe->closed && command != PIPE_CMD_CLOSE) {
         dev->status = PIPE_ERROR_IO;
@@ -610,18 +1826,17 @@ pipeDevice_doCommand( PipeDevice* dev, uint32_t command )
             break;
         }
         pipe = pipe_new(dev->channel, dev);
-        pipe->next = dev->pipes;
-        dev->pipes = pipe;
-        dev->save_pipes = dev->pipes;
+        pipeDevice_addPipe(dev, pipe);
+        trace_android_pipe_open(dev->channel);
+        boot_timeline_mark_once("guest:first-pipe-open");
         dev->status = 0;
         break;
 
     case PIPE_CMD_CLOSE:
         DD("%s: CMD_CLOSE channel=0x%llx", __FUNCTION__, (unsigned long long)dev->channel);
+        trace_android_pipe_close(dev->channel, pipe->closed);
         /* Remove from device's lists */
-        *lookup = pipe->next;
-        pipe->next = NULL;
-        dev->save_pipes = dev->pipes;
+        pipeDevice_removePipe(dev, pipe);
         pipe_free(pipe);
         break;
 
@@ -633,41 +1848,60 @@ pipeDevice_doCommand( PipeDevice* dev, uint32_t command )
     case PIPE_CMD_READ_BUFFER: {
         /* Translate guest physical address into emulator memory. */
         AndroidPipeBuffer  buffer;
-        buffer.data = map_guest_buffer(dev->address, dev->size, 1);
-        if (!buffer.data) {
+        PipeBufferMap      map;
+        int64_t            start_ns;
+        if (!pipe_map_buffer(pipe, dev->address, dev->size, 1, &map)) {
             dev->status = PIPE_ERROR_INVAL;
             break;
         }
+        buffer.data = map.data;
         buffer.size = dev->size;
+        start_ns = get_clock();
         dev->status = android_pipe_recv(pipe->pipe, &buffer, 1);
+        trace_android_pipe_recv(dev->channel, 1, dev->size, dev->status,
+                                get_clock() - start_ns);
         DD("%s: CMD_READ_BUFFER channel=0x%llx address=0x%16llx size=%d > status=%d",
            __FUNCTION__, (unsigned long long)dev->channel, (unsigned long long)dev->address,
            dev->size, dev->status);
-        cpu_physical_memory_unmap(buffer.data, dev->size, 1, dev->size);
+        pipe_unmap_buffer(&map, 1, dev->size);
         break;
     }
 
     case PIPE_CMD_WRITE_BUFFER: {
         /* Translate guest physical address into emulator memory. */
         AndroidPipeBuffer  buffer;
-        buffer.data = map_guest_buffer(dev->address, dev->size, 0);
-        if (!buffer.data) {
+        PipeBufferMap      map;
+        int64_t            start_ns;
+        if (!pipe_map_buffer(pipe, dev->address, dev->size, 0, &map)) {
             dev->status = PIPE_ERROR_INVAL;
             break;
         }
+        buffer.data = map.data;
         buffer.size = dev->size;
+        start_ns = get_clock();
         dev->status = android_pipe_send(pipe->pipe, &buffer, 1);
+        trace_android_pipe_send(dev->channel, 1, dev->size, dev->status,
+                                get_clock() - start_ns);
         DD("%s: CMD_WRITE_BUFFER channel=0x%llx address=0x%16llx size=%d > status=%d",
            __FUNCTION__, (unsigned long long)dev->channel, (unsigned long long)dev->address,
            dev->size, dev->status);
-        cpu_physical_memory_unmap(buffer.data, dev->size, 0, dev->size);
+        pipe_unmap_buffer(&map, 0, dev->size);
         break;
     }
 
+    case PIPE_CMD_WRITEV:
+        pipeDevice_doVectoredIo(dev, pipe, 0);
+        break;
+
+    case PIPE_CMD_READV:
+        pipeDevice_doVectoredIo(dev, pipe, 1);
+        break;
+
     case PIPE_CMD_WAKE_ON_READ:
         DD("%s: CMD_WAKE_ON_READ channel=0x%llx", __FUNCTION__, (unsigned long long)dev->channel);
         if ((pipe->wanted & PIPE_WAKE_READ) == 0) {
             pipe->wanted |= PIPE_WAKE_READ;
+            trace_android_pipe_wake_on(dev->channel, pipe->wanted);
             android_pipe_wake_on(pipe->pipe, pipe->wanted);
         }
         dev->status = 0;
@@ -677,6 +1911,7 @@ pipeDevice_doCommand( PipeDevice* dev, uint32_t command )
         DD("%s: CMD_WAKE_ON_WRITE channel=0x%llx", __FUNCTION__, (unsigned long long)dev->channel);
         if ((pipe->wanted & PIPE_WAKE_WRITE) == 0) {
             pipe->wanted |= PIPE_WAKE_WRITE;
+            trace_android_pipe_wake_on(dev->channel, pipe->wanted);
             android_pipe_wake_on(pipe->pipe, pipe->wanted);
         }
         dev->status = 0;
@@ -687,13 +1922,137 @@ pipeDevice_doCommand( PipeDevice* dev, uint32_t command )
     }
 }
 
+/* Process all pending entries of the guest command ring, see the
+ * description of 'struct android_pipe_ring' in android_pipe.h. The
+ * register values set by the guest are preserved across the batch.
+ */
+static void pipeDevice_processRing(PipeDevice* dev)
+{
+    struct android_pipe_ring* ring;
+    uint32_t entries = dev->ring_entries;
+    uint32_t mask = entries - 1;
+    uint32_t head, tail;
+    size_t ring_size;
+    int processed = 0;
+
+    uint64_t saved_channel = dev->channel;
+    uint64_t saved_address = dev->address;
+    uint32_t saved_size = dev->size;
+
+    if (entries == 0 || (entries & mask) != 0 ||
+        entries > PIPE_RING_MAX_ENTRIES) {
+        dev->status = PIPE_ERROR_INVAL;
+        return;
+    }
+
+    ring_size = sizeof(*ring) + entries * sizeof(ring->entries[0]);
+    ring = map_guest_buffer(dev->ring_addr, ring_size, 1);
+    if (!ring) {
+        dev->status = PIPE_ERROR_INVAL;
+        return;
+    }
+
+    head = le32_to_cpu(atomic_read(&ring->head));
+    tail = le32_to_cpu(ring->tail);
+    smp_rmb();
+
+    if (head - tail > entries) {
+        cpu_physical_memory_unmap(ring, ring_size, 1, 0);
+        dev->status = PIPE_ERROR_INVAL;
+        return;
+    }
+
+    while (tail != head) {
+        struct android_pipe_ring_entry* entry = &ring->entries[tail & mask];
+
+        dev->channel = le64_to_cpu(entry->channel);
+        dev->address = le64_to_cpu(entry->address);
+        dev->size = le32_to_cpu(entry->size);
+        dev->status = PIPE_ERROR_INVAL;
+        pipeDevice_doCommand(dev, le32_to_cpu(entry->cmd));
+        entry->status = cpu_to_le32(dev->status);
+        tail++;
+        processed++;
+    }
+
+    smp_wmb();
+    atomic_set(&ring->tail, cpu_to_le32(tail));
+    cpu_physical_memory_unmap(ring, ring_size, 1, ring_size);
+
+    DD("%s: processed %d ring commands", __FUNCTION__, processed);
+
+    dev->channel = saved_channel;
+    dev->address = saved_address;
+    dev->size = saved_size;
+    dev->status = processed;
+}
+
+/* Handle PIPE_REG_RING_DOORBELL_ASYNC, with the locks taken by
+ * pipe_dev_lock(|dev|, true). */
+static void pipeDevice_processRingAsync(PipeDevice* dev)
+{
+    uint32_t saved_status = dev->status;
+
+    pipeDevice_processRing(dev);
+    dev->status = saved_status;
+    dev->ring_done = true;
+    pipe_dev_set_irq(dev, true);
+}
+
+/* Set while this thread holds a PipeDevice's state_lock. A command may
+ * access guest memory that turns out to be the device's own registers,
+ * which must then not try to take the lock again. */
+static __thread bool pipe_state_locked;
+
+#define PIPE_LOCKED_IOTHREAD  (1 << 0)
+#define PIPE_LOCKED_STATE     (1 << 1)
+
+/* Lock the i/o registers of |dev| for a guest access, and the iothread
+ * lock first if |iothread| is true and this thread doesn't hold it yet.
+ * The accesses that only read or set a register don't need the latter,
+ * everything that calls into the pipe services, touches the pipe lists
+ * or changes the irq does. Returns what to pass to pipe_dev_unlock().
+ */
+static unsigned pipe_dev_lock(PipeDevice* dev, bool iothread)
+{
+    unsigned locked = 0;
+
+    if (pipe_state_locked) {
+        /* Nested access from a command, which holds both locks */
+        return 0;
+    }
+    if (iothread && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        locked |= PIPE_LOCKED_IOTHREAD;
+    }
+    qemu_mutex_lock(&dev->state_lock);
+    pipe_state_locked = true;
+    return locked | PIPE_LOCKED_STATE;
+}
+
+static void pipe_dev_unlock(PipeDevice* dev, unsigned locked)
+{
+    if (locked & PIPE_LOCKED_STATE) {
+        pipe_state_locked = false;
+        qemu_mutex_unlock(&dev->state_lock);
+    }
+    if (locked & PIPE_LOCKED_IOTHREAD) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 static void pipe_dev_write(void *opaque, hwaddr offset, uint64_t value, unsigned size)
 {
     AndroidPipeState *state = (AndroidPipeState *) opaque;
     PipeDevice *s = state->dev;
+    unsigned locked;
 
     DR("%s: offset = 0x%" HWADDR_PRIx " value=%" PRIu64 "/0x%" PRIx64,
        __func__, offset, value, value);
+    locked = pipe_dev_lock(s, offset == PIPE_REG_COMMAND ||
+                              offset == PIPE_REG_RING_DOORBELL ||
+                              offset == PIPE_REG_RING_DOORBELL_ASYNC ||
+                              offset == PIPE_REG_ACCESS_PARAMS);
     switch (offset) {
     case PIPE_REG_COMMAND:
         pipeDevice_doCommand(s, value);
@@ -727,6 +2086,27 @@ static void pipe_dev_write(void *opaque, hwaddr offset, uint64_t value, unsigned
         uint64_set_low(&s->params_addr, value);
         break;
 
+    case PIPE_REG_RING_ADDR_LOW:
+        uint64_set_low(&s->ring_addr, value);
+        break;
+
+    case PIPE_REG_RING_ADDR_HIGH:
+        uint64_set_high(&s->ring_addr, value);
+        break;
+
+    case PIPE_REG_RING_ENTRIES:
+        s->ring_entries = value;
+        break;
+
+    case PIPE_REG_RING_DOORBELL:
+        pipeDevice_processRing(s);
+        break;
+
+    case PIPE_REG_RING_DOORBELL_ASYNC:
+        /* Only without KVM's ioeventfd, see pipe_dev_doorbell() */
+        pipeDevice_processRingAsync(s);
+        break;
+
     case PIPE_REG_ACCESS_PARAMS:
     {
         union access_params aps;
@@ -762,7 +2142,8 @@ static void pipe_dev_write(void *opaque, hwaddr offset, uint64_t value, unsigned
             cmd = aps.aps32.cmd;
         }
 
-        if ((cmd != PIPE_CMD_READ_BUFFER) && (cmd != PIPE_CMD_WRITE_BUFFER))
+        if ((cmd != PIPE_CMD_READ_BUFFER) && (cmd != PIPE_CMD_WRITE_BUFFER) &&
+            (cmd != PIPE_CMD_READV) && (cmd != PIPE_CMD_WRITEV))
             break;
 
         pipeDevice_doCommand(s, cmd);
@@ -783,6 +2164,7 @@ static void pipe_dev_write(void *opaque, hwaddr offset, uint64_t value, unsigned
                       __func__, offset, value, value);
         break;
     }
+    pipe_dev_unlock(s, locked);
 }
 
 static int is_valid_pipe(HwPipe* head, HwPipe* pipe) {
@@ -794,10 +2176,9 @@ static int is_valid_pipe(HwPipe* head, HwPipe* pipe) {
     return 0;
 }
 
-/* I/O read */
-static uint64_t pipe_dev_read(void *opaque, hwaddr offset, unsigned size)
+/* I/O read, must be called with the locks taken by pipe_dev_lock() */
+static uint64_t pipe_dev_read_locked(AndroidPipeState *s, hwaddr offset)
 {
-    AndroidPipeState *s = (AndroidPipeState *)opaque;
     PipeDevice *dev = s->dev;
     HwPipe* cache_pipe = NULL;
 
@@ -823,12 +2204,16 @@ static uint64_t pipe_dev_read(void *opaque, hwaddr offset, unsigned size)
             pipe->next_waked = NULL;
             if (dev->pipes == NULL) {
                 /* android_device_set_irq(&dev->dev, 0, 0); */
-                qemu_set_irq(s->irq, 0);
+                pipe_dev_set_irq(dev, false);
                 DD("%s: lowering IRQ", __FUNCTION__);
             }
             return (uint32_t)(pipe->channel & 0xFFFFFFFFUL);
         }
         dev->pipes = dev->save_pipes;
+        if (dev->ring_done) {
+            /* Only raised for the completion of a ring */
+            pipe_dev_set_irq(dev, false);
+        }
         DR("%s: no signaled channels", __FUNCTION__);
         return 0;
 
@@ -861,6 +2246,18 @@ static uint64_t pipe_dev_read(void *opaque, hwaddr offset, unsigned size)
     case PIPE_REG_VERSION:
         return PIPE_DEVICE_VERSION;
 
+    case PIPE_REG_FEATURES:
+        return PIPE_DEVICE_FEATURES;
+
+    case PIPE_REG_RING_ADDR_LOW:
+        return (uint32_t)(dev->ring_addr & 0xFFFFFFFFUL);
+
+    case PIPE_REG_RING_ADDR_HIGH:
+        return (uint32_t)(dev->ring_addr >> 32);
+
+    case PIPE_REG_RING_ENTRIES:
+        return dev->ring_entries;
+
     default:
         qemu_log_mask(LOG_GUEST_ERROR, "%s: unknown register %" HWADDR_PRId
                       " (0x%" HWADDR_PRIx ")\n", __FUNCTION__, offset, offset);
@@ -868,14 +2265,45 @@ static uint64_t pipe_dev_read(void *opaque, hwaddr offset, unsigned size)
     return 0;
 }
 
+static uint64_t pipe_dev_read(void *opaque, hwaddr offset, unsigned size)
+{
+    AndroidPipeState *s = (AndroidPipeState *)opaque;
+    unsigned locked;
+    uint64_t ret;
+
+    /* Reading the channel walks the signalled pipes and may lower the
+     * irq, the other registers are plain values. */
+    locked = pipe_dev_lock(s->dev, offset == PIPE_REG_CHANNEL ||
+                                   offset == PIPE_REG_CHANNEL_HIGH);
+    ret = pipe_dev_read_locked(s, offset);
+    pipe_dev_unlock(s->dev, locked);
+    return ret;
+}
+
 static const MemoryRegionOps android_pipe_iomem_ops = {
     .read = pipe_dev_read,
     .write = pipe_dev_write,
     .endianness = DEVICE_NATIVE_ENDIAN
 };
 
+/* The guest wrote to PIPE_REG_RING_DOORBELL_ASYNC, in the main loop */
+static void pipe_dev_doorbell(EventNotifier* notifier)
+{
+    PipeDevice* dev = container_of(notifier, PipeDevice, doorbell);
+    unsigned locked;
+
+    if (event_notifier_test_and_clear(notifier)) {
+        locked = pipe_dev_lock(dev, true);
+        pipeDevice_processRingAsync(dev);
+        pipe_dev_unlock(dev, locked);
+    }
+}
+
 static void qemu2_android_pipe_wake(void* hwpipe, unsigned flags);
 static void qemu2_android_pipe_close(void* hwpipe);
+#ifdef USE_ANDROID_EMU
+static void hwpipe_signal_guest(HwPipe* pipe, unsigned flags);
+#endif
 
 #if defined(USE_ANDROID_EMU)
 static const AndroidPipeHwFuncs qemu2_android_pipe_hw_funcs = {
@@ -892,6 +2320,312 @@ void android_pipe_wake(void* hwpipe, unsigned flags) {
 }
 #endif  // !USE_ANDROID_EMU
 
+/***********************************************************************
+ ***********************************************************************
+ *****
+ *****    S N A P S H O T S
+ *****
+ *****/
+
+/* The device registers are saved, then each pipe with its channel, wake
+ * state and, when its service can save it, the service state. Pipes whose
+ * service state can't be restored, e.g. threaded pipes or GLES pipes
+ * whose host side rendering state is lost, are recreated closed, so the
+ * guest gets PIPE_ERROR_IO on their next use and reconnects.
+ */
+#define ANDROID_PIPE_SAVE_VERSION  1
+
+enum {
+    PIPE_SAVE_NONE = 0,         /* no state, closed on load */
+    PIPE_SAVE_CONNECTOR = 1,    /* still waiting for its service name */
+    PIPE_SAVE_SERVICE = 2,      /* connected to a service */
+};
+
+#ifndef USE_ANDROID_EMU
+static void pipe_save_string(QEMUFile* file, const char* str)
+{
+    uint32_t len = str ? strlen(str) : 0;
+
+    qemu_put_be32(file, len);
+    qemu_put_buffer(file, (const uint8_t*)str, len);
+}
+
+/* Returns a heap copy of the string saved by pipe_save_string(), or NULL
+ * if it was empty. */
+static char* pipe_load_string(QEMUFile* file)
+{
+    uint32_t len = qemu_get_be32(file);
+    char* str;
+
+    if (len == 0 || len > 4096) {
+        return NULL;
+    }
+    str = g_malloc(len + 1);
+    qemu_get_buffer(file, (uint8_t*)str, len);
+    str[len] = '\0';
+    return str;
+}
+
+/* Save the service state of |pipe| length-prefixed, so that a service
+ * failing to load it can't desynchronize the rest of the stream. */
+static void pipe_save_service_state(HwPipe* pipe, QEMUFile* file)
+{
+    PipeInternal* pi = pipe->pipe;
+    const QEMUSizedBuffer* qsb;
+    QEMUFile* buf;
+    uint8_t* data;
+    size_t len;
+
+    if (pi->funcs == &pipeConnector_funcs) {
+        qemu_put_byte(file, PIPE_SAVE_CONNECTOR);
+    } else if (pi->service && pi->funcs->save) {
+        qemu_put_byte(file, PIPE_SAVE_SERVICE);
+        pipe_save_string(file, pi->service->name);
+        pipe_save_string(file, pi->args);
+    } else {
+        qemu_put_byte(file, PIPE_SAVE_NONE);
+        return;
+    }
+
+    buf = qemu_bufopen("w", NULL);
+    pi->funcs->save(pi->opaque, buf);
+    qsb = qemu_buf_get(buf);
+    len = qsb_get_length(qsb);
+    data = g_malloc(len);
+    qsb_get_buffer(qsb, 0, len, data);
+    qemu_fclose(buf);
+
+    qemu_put_be32(file, len);
+    qemu_put_buffer(file, data, len);
+    g_free(data);
+}
+
+/* Recreate the PipeInternal of |pipe| from its saved state, returns false
+ * if this isn't possible. */
+static bool pipe_load_service_state(HwPipe* pipe, QEMUFile* file)
+{
+    const PipeService* svc = NULL;
+    char* name = NULL;
+    char* args = NULL;
+    PipeInternal* pi;
+    QEMUFile* buf;
+    uint8_t* data;
+    uint32_t len;
+    void* opaque;
+    int kind;
+
+    kind = qemu_get_byte(file);
+    if (kind == PIPE_SAVE_NONE) {
+        return false;
+    }
+    if (kind == PIPE_SAVE_SERVICE) {
+        name = pipe_load_string(file);
+        args = pipe_load_string(file);
+        if (name) {
+            svc = android_pipe_find_type_len(name, strlen(name));
+        }
+    }
+
+    len = qemu_get_be32(file);
+    data = g_malloc(len);
+    qemu_get_buffer(file, data, len);
+    buf = qemu_bufopen("r", qsb_create(data, len));
+    g_free(data);
+
+    pi = pipe_free_list_alloc(&pipeDevice_allocator(pipe->device)->internals,
+                              sizeof(PipeInternal));
+    pi->hwPipe = pipe;
+    pipe->pipe = pi;
+    opaque = NULL;
+    if (kind == PIPE_SAVE_CONNECTOR) {
+        opaque = pipeConnector_load(pipe, NULL, NULL, buf);
+    } else if (svc && !svc->threaded && svc->funcs.load) {
+        opaque = svc->funcs.load(pipe, svc->opaque, args, buf);
+    }
+    qemu_fclose(buf);
+
+    if (opaque == NULL) {
+        D("%s: can't restore pipe '%s'", __FUNCTION__, name ? name : "");
+        pipe_free_list_release(
+                &pipeDevice_allocator(pipe->device)->internals, pi);
+        pipe->pipe = NULL;
+        g_free(name);
+        g_free(args);
+        return false;
+    }
+
+    pi->opaque = opaque;
+    if (kind == PIPE_SAVE_SERVICE) {
+        pi->service = svc;
+        pi->funcs = &svc->funcs;
+        if (args && strlen(args) < sizeof(pi->args_buf)) {
+            pi->args = strcpy(pi->args_buf, args);
+            g_free(args);
+        } else {
+            pi->args = args;
+        }
+    } else {
+        g_free(args);
+    }
+    g_free(name);
+    return true;
+}
+#else  // USE_ANDROID_EMU
+/* The pipe services live in AndroidEmu, which can't save them yet. */
+static void pipe_save_service_state(HwPipe* pipe, QEMUFile* file)
+{
+    qemu_put_byte(file, PIPE_SAVE_NONE);
+}
+
+static bool pipe_load_service_state(HwPipe* pipe, QEMUFile* file)
+{
+    if (qemu_get_byte(file) != PIPE_SAVE_NONE) {
+        qemu_file_set_error(file, -EINVAL);
+    }
+    return false;
+}
+#endif  // USE_ANDROID_EMU
+
+static void android_pipe_save(QEMUFile* file, void* opaque)
+{
+    PipeDevice* dev = opaque;
+    HwPipe* pipe;
+    uint32_t count = 0;
+
+    qemu_mutex_lock(&dev->state_lock);
+    qemu_put_be64(file, dev->address);
+    qemu_put_be32(file, dev->size);
+    qemu_put_be32(file, dev->status);
+    qemu_put_be64(file, dev->channel);
+    qemu_put_be32(file, dev->wakes);
+    qemu_put_be64(file, dev->params_addr);
+    qemu_put_be64(file, dev->ring_addr);
+    qemu_put_be32(file, dev->ring_entries);
+    qemu_mutex_unlock(&dev->state_lock);
+
+    for (pipe = dev->save_pipes; pipe; pipe = pipe->next) {
+        count++;
+    }
+    qemu_put_be32(file, count);
+
+    for (pipe = dev->save_pipes; pipe; pipe = pipe->next) {
+        qemu_put_be64(file, pipe->channel);
+        qemu_put_byte(file, pipe->wanted);
+        qemu_put_byte(file, pipe->closed);
+        pipe_save_service_state(pipe, file);
+    }
+}
+
+static void android_pipe_load_bh(void* opaque)
+{
+    PipeDevice* dev = opaque;
+    HwPipe* pipe;
+
+    /* The completion of an asynchronous ring may not have been delivered,
+     * have the guest look at the ring again. */
+    if (dev->ring_addr) {
+        dev->ring_done = true;
+        pipe_dev_set_irq(dev, true);
+    }
+    for (pipe = dev->save_pipes; pipe; pipe = pipe->next) {
+        if (pipe->wanted) {
+            pipe_dev_set_irq(dev, true);
+            break;
+        }
+    }
+}
+
+static int android_pipe_load(QEMUFile* file, void* opaque, int version_id)
+{
+    PipeDevice* dev = opaque;
+    HwPipe** pipes;
+    uint32_t count, nn;
+
+    if (version_id != ANDROID_PIPE_SAVE_VERSION) {
+        return -EINVAL;
+    }
+
+    /* Drop the current pipes, their guest side is gone. */
+    while (dev->save_pipes) {
+        HwPipe* pipe = dev->save_pipes;
+        pipeDevice_removePipe(dev, pipe);
+        pipe_free(pipe);
+    }
+
+    qemu_mutex_lock(&dev->state_lock);
+    dev->address = qemu_get_be64(file);
+    dev->size = qemu_get_be32(file);
+    dev->status = qemu_get_be32(file);
+    dev->channel = qemu_get_be64(file);
+    dev->wakes = qemu_get_be32(file);
+    dev->params_addr = qemu_get_be64(file);
+    dev->ring_addr = qemu_get_be64(file);
+    dev->ring_entries = qemu_get_be32(file);
+    qemu_mutex_unlock(&dev->state_lock);
+
+    count = qemu_get_be32(file);
+    if (count > 65536) {
+        return -EINVAL;
+    }
+    pipes = g_new0(HwPipe*, count);
+    for (nn = 0; nn < count; nn++) {
+        HwPipe* pipe = pipe_new0(dev);
+
+        pipe->channel = qemu_get_be64(file);
+        pipe->wanted = qemu_get_byte(file);
+        pipe->closed = qemu_get_byte(file);
+        qemu_mutex_init(&pipe->lock);
+        if (!pipe_load_service_state(pipe, file)) {
+            /* Give it a connector to free on close, and close it. */
+            pipe->pipe = android_pipe_new(pipe);
+            pipe->closed = 1;
+            pipe->wanted |= PIPE_WAKE_CLOSED;
+        }
+        pipes[nn] = pipe;
+    }
+    /* pipeDevice_addPipe() inserts at the head, keep the saved order */
+    while (nn-- > 0) {
+        pipeDevice_addPipe(dev, pipes[nn]);
+    }
+    g_free(pipes);
+
+    dev->cache_pipe = NULL;
+    dev->cache_pipe_64bit = NULL;
+    /* The interrupt controller may be loaded after us */
+    qemu_bh_schedule(dev->load_bh);
+    return qemu_file_get_error(file);
+}
+
+/* The guest side of every pipe is gone after a reset: close them all, and
+ * drop whatever the driver set up. */
+static void android_pipe_reset(DeviceState *d)
+{
+    AndroidPipeState *s = ANDROID_PIPE(d);
+    PipeDevice* dev = s->dev;
+
+    while (dev->save_pipes) {
+        HwPipe* pipe = dev->save_pipes;
+        pipeDevice_removePipe(dev, pipe);
+        pipe_free(pipe);
+    }
+    /* Closing a service may have signalled its pipe */
+    dev->cache_pipe = NULL;
+    dev->cache_pipe_64bit = NULL;
+
+    qemu_mutex_lock(&dev->state_lock);
+    dev->address = 0;
+    dev->size = 0;
+    dev->status = 0;
+    dev->channel = 0;
+    dev->wakes = 0;
+    dev->params_addr = 0;
+    dev->ring_addr = 0;
+    dev->ring_entries = 0;
+    qemu_mutex_unlock(&dev->state_lock);
+
+    pipe_dev_set_irq(dev, false);
+}
+
 static void android_pipe_realize(DeviceState *dev, Error **errp)
 {
     SysBusDevice *sbdev = SYS_BUS_DEVICE(dev);
@@ -901,13 +2635,46 @@ static void android_pipe_realize(DeviceState *dev, Error **errp)
     s->dev->ps = s; /* HACK: backlink */
     s->dev->cache_pipe = NULL;
     s->dev->cache_pipe_64bit = NULL;
+    s->dev->pipes_by_channel = g_hash_table_new(pipe_channel_hash,
+                                                pipe_channel_equal);
     qemu_mutex_init(&s->dev->lock);
+    qemu_mutex_init(&s->dev->state_lock);
+    s_pipe_device = s->dev;
+    android_pipe_metrics_init();
+
+    s->dev->memory_listener = (MemoryListener) {
+        .commit = pipe_device_memory_commit,
+    };
+    memory_listener_register(&s->dev->memory_listener, &address_space_memory);
+
+    s->dev->load_bh = qemu_bh_new(android_pipe_load_bh, s->dev);
+    register_savevm(dev, "android_pipe", 0, ANDROID_PIPE_SAVE_VERSION,
+                    android_pipe_save, android_pipe_load, s->dev);
 
     memory_region_init_io(&s->iomem, OBJECT(s), &android_pipe_iomem_ops, s,
                           "android_pipe", 0x2000 /*TODO: ?how big?*/);
+    /* Setting up a command doesn't need the iothread lock */
+    memory_region_set_lockless(&s->iomem, true);
+    /* Nor does it need to exit to us right away. The writes are replayed
+     * before the next access to any other register, with KVM. */
+    memory_region_add_coalescing(&s->iomem, PIPE_REG_CHANNEL,
+                                 PIPE_REG_WAKES - PIPE_REG_CHANNEL);
+    memory_region_add_coalescing(&s->iomem, PIPE_REG_CHANNEL_HIGH,
+                                 PIPE_REG_FEATURES - PIPE_REG_CHANNEL_HIGH);
     sysbus_init_mmio(sbdev, &s->iomem);
     sysbus_init_irq(sbdev, &s->irq);
 
+    /* With KVM, neither the asynchronous doorbell nor raising the irq go
+     * through a vcpu exit or the iothread. */
+    if (kvm_enabled() && kvm_eventfds_enabled() &&
+        event_notifier_init(&s->dev->doorbell, 0) == 0) {
+        event_notifier_set_handler(&s->dev->doorbell, pipe_dev_doorbell);
+        memory_region_add_eventfd(&s->iomem, PIPE_REG_RING_DOORBELL_ASYNC, 4,
+                                  false, 0, &s->dev->doorbell);
+    }
+    irqfd_line_init(&s->dev->irqfd, s->irqfd_gsi, pipe_dev_irq_pending,
+                    s->dev);
+
     android_zero_pipe_init();
     android_pingpong_init();
     android_throttle_init();
@@ -930,17 +2697,36 @@ static void android_pipe_realize(DeviceState *dev, Error **errp)
 static void qemu2_android_pipe_wake( void* hwpipe, unsigned flags )
 {
     HwPipe*  pipe = hwpipe;
+
+#ifndef USE_ANDROID_EMU
+    PipeInternal* pi = pipe->pipe;
+    if (pi && pi->funcs == &threadedPipe_funcs &&
+        !(flags & PIPE_WAKE_CLOSED)) {
+        /* The service is ready, let the I/O thread move the data, it will
+         * signal the guest once it is done. */
+        threadedPipe_serviceWake(pi->opaque, flags);
+        return;
+    }
+#endif
+    hwpipe_signal_guest(pipe, flags);
+}
+
+/* Signal |flags| to the guest for |pipe|, must be called with the iothread
+ * lock held. */
+static void hwpipe_signal_guest(HwPipe* pipe, unsigned flags)
+{
     PipeDevice*  dev = pipe->device;
 
     DD("%s: channel=0x%llx flags=%d", __FUNCTION__, (unsigned long long)pipe->channel, flags);
 
+    trace_android_pipe_wake(pipe->channel, flags);
     set_pipe_wanted_bits(pipe, (unsigned char)flags);
     if (!pipe->closed) {
         set_cache_pipe(dev, pipe);
     }
     /* Raise IRQ to indicate there are items on our list ! */
     /* android_device_set_irq(&dev->dev, 0, 1);*/
-    qemu_set_irq(dev->ps->irq, 1);
+    pipe_dev_set_irq(dev, true);
     DD("%s: raising IRQ", __FUNCTION__);
 }
 
@@ -956,10 +2742,17 @@ static void qemu2_android_pipe_close( void* hwpipe )
     }
 }
 
+static Property android_pipe_props[] = {
+    DEFINE_PROP_INT32("irqfd-gsi", AndroidPipeState, irqfd_gsi, -1),
+    DEFINE_PROP_END_OF_LIST()
+};
+
 static void android_pipe_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = android_pipe_realize;
+    dc->reset = android_pipe_reset;
+    dc->props = android_pipe_props;
     dc->desc = "android pipe";
 }
 
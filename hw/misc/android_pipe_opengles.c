@@ -19,11 +19,19 @@
  */
 
 #include "android/opengles.h"
+#include "android/opengles-guest-ram.h"
+#include "android/opengles-ring.h"
 #include "hw/misc/android_pipe.h"
 
 #include "qemu-common.h"
+#include "exec/address-spaces.h"
+#include "exec/memory.h"
+#include "qemu/atomic.h"
+#include "qemu/event_notifier.h"
+#include "qemu/iov.h"
 #include "qemu/main-loop.h"
 #include "qemu/sockets.h"
+#include "sysemu/sysemu.h"
 
 #include <errno.h>
 #include <stdio.h>
@@ -207,73 +215,63 @@ static int net_pipe_ready_send(NetPipe *pipe) {
         return PIPE_ERROR_IO;
 }
 
+/* Maximum number of buffers transferred with a single system call. */
+#define NET_PIPE_MAX_IOVECS  32
+
+/* Fill |iov| from |buffers|, returns the number of bytes they cover. */
+static size_t net_pipe_fill_iov(struct iovec* iov,
+                                const AndroidPipeBuffer* buffers,
+                                int numBuffers) {
+    size_t count = 0;
+    int nn;
+
+    for (nn = 0; nn < numBuffers; nn++) {
+        iov[nn].iov_base = buffers[nn].data;
+        iov[nn].iov_len = buffers[nn].size;
+        count += buffers[nn].size;
+    }
+    return count;
+}
+
 static int net_pipe_send_buffers(void* opaque,
                                  const AndroidPipeBuffer* buffers,
                                  int numBuffers) {
     NetPipe *pipe = opaque;
-    int count = 0;
+    struct iovec iov[NET_PIPE_MAX_IOVECS];
+    size_t count;
+    ssize_t len;
     int ret = 0;
-    size_t buffStart = 0;
-    const AndroidPipeBuffer* buff = buffers;
-    const AndroidPipeBuffer* buffEnd = buff + numBuffers;
 
     ret = net_pipe_ready_send(pipe);
     if (ret != 0) {
         DD("%s: fd=%d error=%d", __FUNCTION__, pipe->fd, errno);
         return ret;
     }
-    for (; buff < buffEnd; buff++) {
-        count += buff->size;
-    }
-    DD("%s: fd=%d count=%d num_buffers=%d", __FUNCTION__, pipe->fd,
+    /* Anything beyond NET_PIPE_MAX_IOVECS is left to the next call, the
+     * guest handles short writes. */
+    numBuffers = MIN(numBuffers, NET_PIPE_MAX_IOVECS);
+    count = net_pipe_fill_iov(iov, buffers, numBuffers);
+    DD("%s: fd=%d count=%zu num_buffers=%d", __FUNCTION__, pipe->fd,
        count, numBuffers);
-    buff = buffers;
-    while (count > 0) {
-        int  avail = buff->size - buffStart;
-#ifdef _WIN32
-        int  len = send_all(pipe->fd, buff->data + buffStart, avail);
-#else
-        int  len = opengl_send_all(pipe->fd, buff->data + buffStart, avail);
-#endif
-
-        /* the write succeeded */
-        if (len > 0) {
-            buffStart += len;
-            if (buffStart >= buff->size) {
-                buff++;
-                buffStart = 0;
-            }
-            count -= len;
-            ret += len;
-            continue;
-        }
-
-        /* we reached the end of stream? */
-        if (len == 0) {
-            if (ret == 0) {
-                DD("%s: fd=%d EOF", __FUNCTION__, pipe->fd);
-                ret = PIPE_ERROR_IO;
-            }
-            break;
-        }
-
-        /* if we already wrote some stuff, simply return */
-        if (ret > 0) {
-            break;
-        }
+    if (count == 0) {
+        return 0;
+    }
 
-        /* need to return an appropriate error code */
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            ret = PIPE_ERROR_AGAIN;
-        } else {
-            DD("%s: fd=%d I/O error [%s]", __FUNCTION__, pipe->fd,
-               strerror(errno));
-            ret = PIPE_ERROR_IO;
-        }
-        break;
+    len = iov_send(pipe->fd, iov, numBuffers, 0, count);
+    if (len > 0) {
+        ret = len;
+    } else if (len == 0) {
+        DD("%s: fd=%d EOF", __FUNCTION__, pipe->fd);
+        ret = PIPE_ERROR_IO;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        ret = PIPE_ERROR_AGAIN;
+    } else {
+        DD("%s: fd=%d I/O error [%s]", __FUNCTION__, pipe->fd,
+           strerror(errno));
+        ret = PIPE_ERROR_IO;
     }
 
-    if (count > 0) {
+    if (len < (ssize_t)count) {
         pipe->wakeActual &= ~PIPE_WAKE_WRITE;
     }
 
@@ -284,64 +282,35 @@ static int net_pipe_recv_buffers(void *opaque,
                                  AndroidPipeBuffer* buffers,
                                  int numBuffers) {
     NetPipe *pipe = opaque;
-    int count = 0;
-    int ret   = 0;
-    size_t buffStart = 0;
-    AndroidPipeBuffer* buff = buffers;
-    AndroidPipeBuffer* buffEnd = buff + numBuffers;
+    struct iovec iov[NET_PIPE_MAX_IOVECS];
+    size_t count;
+    ssize_t len;
+    int ret = 0;
 
-    for (; buff < buffEnd; buff++) {
-        count += buff->size;
-    }
-    DD("%s: fd=%d count=%d num_buffers=%d", __FUNCTION__, pipe->fd,
+    numBuffers = MIN(numBuffers, NET_PIPE_MAX_IOVECS);
+    count = net_pipe_fill_iov(iov, buffers, numBuffers);
+    DD("%s: fd=%d count=%zu num_buffers=%d", __FUNCTION__, pipe->fd,
        count, numBuffers);
-    buff = buffers;
-    while (count > 0) {
-        int avail = buff->size - buffStart;
-#ifdef _WIN32
-        int len = recv_all(pipe->fd, buff->data + buffStart, avail, true);
-#else
-        int len = opengl_recv_all(pipe->fd, buff->data + buffStart, avail, true);
-#endif
-
-        /* the read succeeded */
-        if (len > 0) {
-            buffStart += len;
-            if (buffStart >= buff->size) {
-                buff++;
-                buffStart = 0;
-            }
-            count -= len;
-            ret   += len;
-            continue;
-        }
-
-        /* we reached the end of stream? */
-        if (len == 0) {
-            if (ret == 0) {
-                DD("%s: fd=%d EOS", __FUNCTION__, pipe->fd);
-                ret = PIPE_ERROR_IO;
-            }
-            break;
-        }
-
-        /* if we already read some stuff, simply return */
-        if (ret > 0) {
-            break;
-        }
+    if (count == 0) {
+        return 0;
+    }
 
-        /* need to return an appropriate error code */
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            ret = PIPE_ERROR_AGAIN;
-        } else {
-            DD("%s: fd=%d I/O error [%s]", __FUNCTION__, pipe->fd,
-               strerror(errno));
-            ret = PIPE_ERROR_IO;
-        }
-        break;
+    /* The socket is non-blocking, so this returns what is available. */
+    len = iov_recv(pipe->fd, iov, numBuffers, 0, count);
+    if (len > 0) {
+        ret = len;
+    } else if (len == 0) {
+        DD("%s: fd=%d EOS", __FUNCTION__, pipe->fd);
+        ret = PIPE_ERROR_IO;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        ret = PIPE_ERROR_AGAIN;
+    } else {
+        DD("%s: fd=%d I/O error [%s]", __FUNCTION__, pipe->fd,
+           strerror(errno));
+        ret = PIPE_ERROR_IO;
     }
 
-    if (count > 0) {
+    if (len < (ssize_t)count) {
         pipe->wakeActual &= ~PIPE_WAKE_READ;
     }
 
@@ -432,8 +401,286 @@ static const AndroidPipeFuncs  netPipeUnix_funcs = {
 };
 #endif
 
+/**********************************************************************
+ **********************************************************************
+ *****
+ *****  R I N G   P I P E S
+ *****
+ *****/
+
+/* An 'opengles' pipe connected to the renderer through shared memory
+ * rings, see android/opengles-ring.h. The guest buffers are copied
+ * directly into and out of the rings, and the doorbells are only used
+ * when one side has to wait for the other.
+ */
+
+typedef struct {
+    void* hwpipe;
+    OpenglesRingStream stream;
+    EventNotifier renderer_doorbell;    /* rung by us */
+    EventNotifier emulator_doorbell;    /* rung by the renderer */
+    int wakeWanted;
+} RingPipe;
+
+static OpenglesRing* ring_pipe_ring_new(void) {
+    OpenglesRing* ring = qemu_memalign(64, sizeof(*ring) + OPENGLES_RING_SIZE);
+    memset(ring, 0, sizeof(*ring));
+    ring->size = OPENGLES_RING_SIZE;
+    return ring;
+}
+
+/* Copy as much of |buffers| as possible into |ring|, returns the number
+ * of bytes copied. */
+static uint32_t ring_pipe_write(OpenglesRing* ring,
+                                const AndroidPipeBuffer* buffers,
+                                int numBuffers) {
+    uint32_t mask = ring->size - 1;
+    uint32_t head = ring->head;
+    uint32_t avail = ring->size - (head - atomic_read(&ring->tail));
+    uint32_t total = 0;
+
+    /* Don't overwrite anything before the consumer is done reading it. */
+    smp_mb();
+    for (; numBuffers > 0 && total < avail; buffers++, numBuffers--) {
+        uint32_t len = MIN(buffers->size, avail - total);
+        uint32_t pos = (head + total) & mask;
+        uint32_t first = MIN(len, ring->size - pos);
+
+        memcpy(ring->data + pos, buffers->data, first);
+        memcpy(ring->data, buffers->data + first, len - first);
+        total += len;
+    }
+    smp_wmb();
+    atomic_set(&ring->head, head + total);
+    return total;
+}
+
+/* Copy as much data as possible from |ring| into |buffers|, returns the
+ * number of bytes copied. */
+static uint32_t ring_pipe_read(OpenglesRing* ring,
+                               AndroidPipeBuffer* buffers,
+                               int numBuffers) {
+    uint32_t mask = ring->size - 1;
+    uint32_t tail = ring->tail;
+    uint32_t avail = atomic_read(&ring->head) - tail;
+    uint32_t total = 0;
+
+    smp_rmb();
+    for (; numBuffers > 0 && total < avail; buffers++, numBuffers--) {
+        uint32_t len = MIN(buffers->size, avail - total);
+        uint32_t pos = (tail + total) & mask;
+        uint32_t first = MIN(len, ring->size - pos);
+
+        memcpy(buffers->data, ring->data + pos, first);
+        memcpy(buffers->data + first, ring->data, len - first);
+        total += len;
+    }
+    smp_mb();
+    atomic_set(&ring->tail, tail + total);
+    return total;
+}
+
+/* Ring the renderer's doorbell if it is waiting on |*waiting|. Must be
+ * called after the corresponding ring index has been updated. */
+static void ring_pipe_notify(RingPipe* pipe, uint32_t* waiting) {
+    smp_mb();
+    if (atomic_read(waiting) && atomic_xchg(waiting, 0)) {
+        event_notifier_set(&pipe->renderer_doorbell);
+    }
+}
+
+static unsigned ring_pipe_poll(void* opaque) {
+    RingPipe* pipe = opaque;
+    OpenglesRing* to = pipe->stream.to_renderer;
+    OpenglesRing* from = pipe->stream.from_renderer;
+    unsigned ret = 0;
+
+    if (atomic_read(&from->head) != from->tail)
+        ret |= PIPE_POLL_IN;
+    if (to->head - atomic_read(&to->tail) < to->size)
+        ret |= PIPE_POLL_OUT;
+
+    DD("%s: result=%d", __FUNCTION__, ret);
+    return ret;
+}
+
+/* Signal the guest for all the wanted conditions that are now true. */
+static void ring_pipe_check_wakes(RingPipe* pipe) {
+    unsigned ready = ring_pipe_poll(pipe);
+    int flags = 0;
+
+    if ((pipe->wakeWanted & PIPE_WAKE_READ) && (ready & PIPE_POLL_IN))
+        flags |= PIPE_WAKE_READ;
+    if ((pipe->wakeWanted & PIPE_WAKE_WRITE) && (ready & PIPE_POLL_OUT))
+        flags |= PIPE_WAKE_WRITE;
+
+    if (flags) {
+        pipe->wakeWanted &= ~flags;
+        android_pipe_wake(pipe->hwpipe, flags);
+    }
+}
+
+static void ring_pipe_handle_doorbell(EventNotifier* e) {
+    RingPipe* pipe = container_of(e, RingPipe, emulator_doorbell);
+
+    event_notifier_test_and_clear(e);
+    ring_pipe_check_wakes(pipe);
+}
+
+static void ring_pipe_free(RingPipe* pipe) {
+    event_notifier_set_handler(&pipe->emulator_doorbell, NULL);
+    event_notifier_cleanup(&pipe->emulator_doorbell);
+    event_notifier_cleanup(&pipe->renderer_doorbell);
+    qemu_vfree(pipe->stream.to_renderer);
+    qemu_vfree(pipe->stream.from_renderer);
+    g_free(pipe);
+}
+
+/* Returns NULL if the renderer doesn't support the ring transport. */
+static RingPipe* ring_pipe_init(void* hwpipe) {
+    RingPipe* pipe = g_new0(RingPipe, 1);
+
+    pipe->hwpipe = hwpipe;
+    if (event_notifier_init(&pipe->renderer_doorbell, 0) < 0) {
+        g_free(pipe);
+        return NULL;
+    }
+    if (event_notifier_init(&pipe->emulator_doorbell, 0) < 0) {
+        event_notifier_cleanup(&pipe->renderer_doorbell);
+        g_free(pipe);
+        return NULL;
+    }
+
+    pipe->stream.to_renderer = ring_pipe_ring_new();
+    pipe->stream.from_renderer = ring_pipe_ring_new();
+#ifdef _WIN32
+    pipe->stream.renderer_event =
+            event_notifier_get_handle(&pipe->renderer_doorbell);
+    pipe->stream.emulator_event =
+            event_notifier_get_handle(&pipe->emulator_doorbell);
+#else
+    pipe->stream.renderer_notify_fd = pipe->renderer_doorbell.wfd;
+    pipe->stream.renderer_wait_fd = pipe->renderer_doorbell.rfd;
+    pipe->stream.emulator_notify_fd = pipe->emulator_doorbell.wfd;
+#endif
+
+    if (android_gles_ring_open(&pipe->stream) < 0) {
+        event_notifier_cleanup(&pipe->emulator_doorbell);
+        event_notifier_cleanup(&pipe->renderer_doorbell);
+        qemu_vfree(pipe->stream.to_renderer);
+        qemu_vfree(pipe->stream.from_renderer);
+        g_free(pipe);
+        return NULL;
+    }
+
+    /* On Windows the main loop waits on at most MAXIMUM_WAIT_OBJECTS
+     * handles, past that the pipe goes through a socket. */
+    if (event_notifier_set_handler(&pipe->emulator_doorbell,
+                                   ring_pipe_handle_doorbell) < 0) {
+        D("%s: can't wait on the ring doorbell", __FUNCTION__);
+        android_gles_ring_close(&pipe->stream);
+        ring_pipe_free(pipe);
+        return NULL;
+    }
+    D("%s: using ring transport for GPU emulation", __FUNCTION__);
+    return pipe;
+}
+
+static void ring_pipe_close(void* opaque) {
+    RingPipe* pipe = opaque;
+
+    DD("%s", __FUNCTION__);
+    android_gles_ring_close(&pipe->stream);
+    ring_pipe_free(pipe);
+}
+
+static int ring_pipe_send_buffers(void* opaque,
+                                  const AndroidPipeBuffer* buffers,
+                                  int numBuffers) {
+    RingPipe* pipe = opaque;
+    OpenglesRing* ring = pipe->stream.to_renderer;
+    uint32_t len = ring_pipe_write(ring, buffers, numBuffers);
+
+    if (len == 0 && numBuffers > 0) {
+        /* Full: ask the renderer to ring us once it has made room, and
+         * check again in case it did so in the meantime. */
+        atomic_set(&ring->producer_waiting, 1);
+        smp_mb();
+        len = ring_pipe_write(ring, buffers, numBuffers);
+        if (len == 0) {
+            return PIPE_ERROR_AGAIN;
+        }
+    }
+    ring_pipe_notify(pipe, &ring->consumer_waiting);
+
+    DD("%s: len=%u num_buffers=%d", __FUNCTION__, len, numBuffers);
+    return len;
+}
+
+static int ring_pipe_recv_buffers(void* opaque,
+                                  AndroidPipeBuffer* buffers,
+                                  int numBuffers) {
+    RingPipe* pipe = opaque;
+    OpenglesRing* ring = pipe->stream.from_renderer;
+    uint32_t len = ring_pipe_read(ring, buffers, numBuffers);
+
+    if (len == 0 && numBuffers > 0) {
+        atomic_set(&ring->consumer_waiting, 1);
+        smp_mb();
+        len = ring_pipe_read(ring, buffers, numBuffers);
+        if (len == 0) {
+            return PIPE_ERROR_AGAIN;
+        }
+    }
+    ring_pipe_notify(pipe, &ring->producer_waiting);
+
+    DD("%s: len=%u num_buffers=%d", __FUNCTION__, len, numBuffers);
+    return len;
+}
+
+static void ring_pipe_wake_on(void* opaque, int flags) {
+    RingPipe* pipe = opaque;
+
+    DD("%s: flags=%d", __FUNCTION__, flags);
+
+    pipe->wakeWanted |= flags;
+    if (flags & PIPE_WAKE_READ) {
+        atomic_set(&pipe->stream.from_renderer->consumer_waiting, 1);
+    }
+    if (flags & PIPE_WAKE_WRITE) {
+        atomic_set(&pipe->stream.to_renderer->producer_waiting, 1);
+    }
+    smp_mb();
+    ring_pipe_check_wakes(pipe);
+}
+
+static const AndroidPipeFuncs  ringPipe_funcs = {
+    NULL,  /* created by openglesPipe_init() */
+    ring_pipe_close,
+    ring_pipe_send_buffers,
+    ring_pipe_recv_buffers,
+    ring_pipe_poll,
+    ring_pipe_wake_on,
+    NULL,  /* we can't save these */
+    NULL,  /* we can't load these */
+};
+
+/**********************************************************************
+ **********************************************************************
+ *****
+ *****  O P E N G L E S   P I P E S
+ *****
+ *****/
+
+/* The 'opengles' service uses the ring transport when the renderer
+ * supports it, and a socket otherwise. */
+typedef struct {
+    const AndroidPipeFuncs* funcs;
+    void* transport;
+} OpenglesPipe;
+
 static void*
-openglesPipe_init( void* hwpipe, void* _looper, const char* args )
+openglesPipe_initSocket( void* hwpipe, void* _looper )
 {
     NetPipe *pipe;
 
@@ -481,17 +728,177 @@ openglesPipe_init( void* hwpipe, void* _looper, const char* args )
     return pipe;
 }
 
+static void*
+openglesPipe_init( void* hwpipe, void* _looper, const char* args )
+{
+    const AndroidPipeFuncs* funcs;
+    void* transport = NULL;
+
+    transport = ring_pipe_init(hwpipe);
+    if (transport != NULL) {
+        funcs = &ringPipe_funcs;
+    } else {
+#ifndef _WIN32
+        funcs = &netPipeUnix_funcs;
+#else
+        funcs = &netPipeTcp_funcs;
+#endif
+    }
+    if (transport == NULL) {
+        transport = openglesPipe_initSocket(hwpipe, _looper);
+        if (transport == NULL) {
+            return NULL;
+        }
+    }
+
+    OpenglesPipe* pipe = g_new0(OpenglesPipe, 1);
+    pipe->funcs = funcs;
+    pipe->transport = transport;
+    return pipe;
+}
+
+static void
+openglesPipe_close( void* opaque )
+{
+    OpenglesPipe* pipe = opaque;
+    pipe->funcs->close(pipe->transport);
+    g_free(pipe);
+}
+
+static int
+openglesPipe_sendBuffers( void* opaque, const AndroidPipeBuffer* buffers,
+                          int numBuffers )
+{
+    OpenglesPipe* pipe = opaque;
+    return pipe->funcs->sendBuffers(pipe->transport, buffers, numBuffers);
+}
+
+static int
+openglesPipe_recvBuffers( void* opaque, AndroidPipeBuffer* buffers,
+                          int numBuffers )
+{
+    OpenglesPipe* pipe = opaque;
+    return pipe->funcs->recvBuffers(pipe->transport, buffers, numBuffers);
+}
+
+static unsigned
+openglesPipe_poll( void* opaque )
+{
+    OpenglesPipe* pipe = opaque;
+    return pipe->funcs->poll(pipe->transport);
+}
+
+static void
+openglesPipe_wakeOn( void* opaque, int flags )
+{
+    OpenglesPipe* pipe = opaque;
+    pipe->funcs->wakeOn(pipe->transport, flags);
+}
+
 static const AndroidPipeFuncs  openglesPipe_funcs = {
     openglesPipe_init,
-    net_pipe_close_from_guest,
-    net_pipe_send_buffers,
-    net_pipe_recv_buffers,
-    net_pipe_poll,
-    net_pipe_wake_on,
+    openglesPipe_close,
+    openglesPipe_sendBuffers,
+    openglesPipe_recvBuffers,
+    openglesPipe_poll,
+    openglesPipe_wakeOn,
     NULL,  /* we can't save these */
     NULL,  /* we can't load these */
 };
 
+/**********************************************************************
+ **********************************************************************
+ *****
+ *****  G U E S T   R A M
+ *****
+ *****/
+
+/* With -mem-shared, the renderer is told where guest RAM is so that it can
+ * read graphics buffers in place, see android/opengles-guest-ram.h. The
+ * table is kept up to date from the memory map of the guest. */
+typedef struct {
+    MemoryListener listener;
+    Notifier machine_done;
+    GArray* ranges;             /* of OpenglesGuestRamRange */
+    bool changed;
+} GlesGuestRam;
+
+static GlesGuestRam gles_guest_ram;
+
+static void gles_guest_ram_region_add(MemoryListener* listener,
+                                      MemoryRegionSection* section) {
+    GlesGuestRam* gr = container_of(listener, GlesGuestRam, listener);
+    OpenglesGuestRamRange range;
+
+    if (!memory_region_is_ram(section->mr)) {
+        return;
+    }
+    /* Each RAM block has a file of its own, starting at the block */
+    range.gpa = section->offset_within_address_space;
+    range.size = int128_get64(section->size);
+    range.host = (uint8_t*)memory_region_get_ram_ptr(section->mr) +
+                 section->offset_within_region;
+    range.fd = memory_region_get_fd(section->mr);
+    range.fd_offset = section->offset_within_region;
+    g_array_append_val(gr->ranges, range);
+    gr->changed = true;
+}
+
+static void gles_guest_ram_region_del(MemoryListener* listener,
+                                      MemoryRegionSection* section) {
+    GlesGuestRam* gr = container_of(listener, GlesGuestRam, listener);
+    guint i;
+
+    for (i = 0; i < gr->ranges->len; i++) {
+        OpenglesGuestRamRange* range =
+                &g_array_index(gr->ranges, OpenglesGuestRamRange, i);
+
+        if (range->gpa == section->offset_within_address_space) {
+            g_array_remove_index_fast(gr->ranges, i);
+            gr->changed = true;
+            return;
+        }
+    }
+}
+
+static void gles_guest_ram_commit(MemoryListener* listener) {
+    GlesGuestRam* gr = container_of(listener, GlesGuestRam, listener);
+
+    if (gr->changed) {
+        gr->changed = false;
+        android_gles_set_guest_ram((OpenglesGuestRamRange*)gr->ranges->data,
+                                   gr->ranges->len);
+    }
+}
+
+/* The renderer is started by then */
+static void gles_guest_ram_machine_done(Notifier* notifier, void* data) {
+    GlesGuestRam* gr = container_of(notifier, GlesGuestRam, machine_done);
+
+    if (android_gles_set_guest_ram(NULL, 0) < 0) {
+        D("%s: the renderer can't read guest RAM", __FUNCTION__);
+        return;
+    }
+    gr->ranges = g_array_new(false, false, sizeof(OpenglesGuestRamRange));
+    gr->listener.region_add = gles_guest_ram_region_add;
+    gr->listener.region_del = gles_guest_ram_region_del;
+    gr->listener.commit = gles_guest_ram_commit;
+    /* Registering only reports the current regions, without a commit */
+    memory_listener_register(&gr->listener, &address_space_memory);
+    gles_guest_ram_commit(&gr->listener);
+}
+
 void android_net_pipes_init(void) {
-    android_pipe_add_type("opengles", NULL, &openglesPipe_funcs);
+    if (mem_shared && !gles_guest_ram.machine_done.notify) {
+        gles_guest_ram.machine_done.notify = gles_guest_ram_machine_done;
+        qemu_add_machine_init_done_notifier(&gles_guest_ram.machine_done);
+    }
+
+    /* Setting ANDROID_PIPE_THREADED_GLES moves the GLES socket I/O to the
+     * pipe I/O thread, so a busy renderer doesn't stall the vCPUs. */
+    if (g_getenv("ANDROID_PIPE_THREADED_GLES")) {
+        android_pipe_add_type_threaded("opengles", NULL, &openglesPipe_funcs);
+    } else {
+        android_pipe_add_type("opengles", NULL, &openglesPipe_funcs);
+    }
 }
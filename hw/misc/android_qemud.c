@@ -27,6 +27,7 @@
 #include "qemu/timer.h"
 #include "hw/misc/android_pipe.h"
 #include "hw/misc/android_qemud.h"
+#include "trace.h"
 
 /* #define DEBUG_QEMUD */
 
@@ -37,70 +38,165 @@
 #define D(fmt, ...) do {} while (0)
 #endif
 
-int qemud_pipe_read_buffers(const AndroidPipeBuffer *buf, int cnt,
-                            GPtrArray *msgs, GString *remaining)
+void qemud_buffer_init(QemudBuffer *b, uint32_t size)
+{
+    memset(b, 0, sizeof(*b));
+    b->size = MAX(size, 16);
+    b->data = g_malloc(b->size);
+}
+
+void qemud_buffer_destroy(QemudBuffer *b)
+{
+    g_free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+/* Undo the termination of the previously returned frame view */
+static void qemud_buffer_release(QemudBuffer *b)
+{
+    if (b->held) {
+        *b->held = b->held_byte;
+        b->held = NULL;
+    }
+}
+
+/*
+ * Make room for 'len' more bytes at the end, plus one spare byte so a
+ * frame finishing at the end of the data can always be terminated.
+ */
+static uint8_t *qemud_buffer_reserve(QemudBuffer *b, uint32_t len)
+{
+    uint32_t used;
+
+    qemud_buffer_release(b);
+    used = b->end - b->start;
+    if (b->end + len < b->size) {
+        return b->data + b->end;
+    }
+
+    if (b->start > 0) {
+        memmove(b->data, b->data + b->start, used);
+        b->start = 0;
+        b->end = used;
+    }
+    if (used + len >= b->size) {
+        uint32_t size = b->size;
+        while (used + len >= size) {
+            size *= 2;
+        }
+        D("growing from %u to %u bytes\n", b->size, size);
+        b->data = g_realloc(b->data, size);
+        b->size = size;
+    }
+    return b->data + b->end;
+}
+
+int qemud_buffer_append(QemudBuffer *b, const AndroidPipeBuffer *buf, int cnt)
 {
     int i, consumed = 0;
-    gchar *p;
+
     for (i = 0; i < cnt; i++) {
-        g_string_append_len(remaining,
-                            (gchar *) buf[i].data,
-                            (gssize) buf[i].size);
         consumed += buf[i].size;
     }
-    D("consumed %d bytes (%s)\n", consumed, remaining->str);
-
-    /* Now walk through the string extracting frames */
-    p = remaining->str;
-    do {
-        int frame_length = 0;
-        if (sscanf(p, "%4x", &frame_length) == 1) {
-            p += 4;
-            if (frame_length+4 <= remaining->len) {
-                gchar *frame = g_strndup(p, frame_length);
-                g_ptr_array_add(msgs, frame);
-                g_string_erase(remaining, 0, frame_length+4);
-                p = remaining->str;
-            } else {
-                break;
-            }
-        } else {
-            /* we need more (unlikely) */
-            break;
-        }
-    } while (remaining->len > 0);
+    qemud_buffer_reserve(b, consumed);
+    for (i = 0; i < cnt; i++) {
+        memcpy(b->data + b->end, buf[i].data, buf[i].size);
+        b->end += buf[i].size;
+    }
+    D("consumed %d bytes, %u pending\n", consumed, qemud_buffer_len(b));
 
     return consumed;
 }
 
-int qemud_pipe_write_buffers(GPtrArray *msgs, GString *left,
-                             AndroidPipeBuffer *buf, int cnt)
+static int qemud_hex_digit(uint8_t c)
 {
-    int b = 0, total = 0;
-    D("have %d buffers, %d/%d msgs\n", cnt, (int) left->len, msgs->len);
-    do {
-        if (left->len > 0) {
-            /* Handle any remaining partially sent message */
-            int buf_space = buf[b].size;
-            void *buf_data = buf[b].data;
-            int to_copy = left->len <= buf_space ? left->len : buf_space;
-            memcpy(buf_data, left->str, to_copy);
-            g_string_erase(left, 0, to_copy);
-            total += to_copy;
-            b++;
-        } else {
-            /* Format next message to send if we have one */
-            if (msgs->len > 0) {
-                gchar *msg = g_ptr_array_index(msgs, 0);
-                g_string_printf(left, "%04x%s", (int) strlen(msg), msg);
-                g_ptr_array_remove(msgs, msg);
-            } else {
-                break;
-            }
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+bool qemud_buffer_next_frame(QemudBuffer *b, char **frame, uint32_t *len)
+{
+    uint8_t *p;
+    uint32_t frame_length = 0;
+    int i;
+
+    qemud_buffer_release(b);
+    if (qemud_buffer_len(b) < 4) {
+        return false;
+    }
+
+    p = b->data + b->start;
+    for (i = 0; i < 4; i++) {
+        int d = qemud_hex_digit(p[i]);
+        if (d < 0) {
+            D("bad frame header %.4s\n", (char *) p);
+            return false;
         }
-    } while ((left->len > 0) && (b < cnt));
+        frame_length = (frame_length << 4) | d;
+    }
+    if (frame_length + 4 > qemud_buffer_len(b)) {
+        /* we need more */
+        return false;
+    }
+
+    /* Terminate the frame in place, the spare byte at the end of the
+     * data guarantees this is always within the allocation.
+     */
+    b->held = p + 4 + frame_length;
+    b->held_byte = *b->held;
+    *b->held = '\0';
 
-    D("sent %d bytes, %d/%d msgs\n", total, (int) left->len, msgs->len);
+    b->start += frame_length + 4;
+    if (b->start == b->end) {
+        b->start = b->end = 0;
+    }
+
+    *frame = (char *) p + 4;
+    *len = frame_length;
+    trace_qemud_frame_recv(b, frame_length, qemud_buffer_len(b));
+    return true;
+}
+
+void qemud_buffer_put_frame(QemudBuffer *b, const void *data, uint32_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    uint8_t *p;
+
+    assert(len <= QEMUD_MAX_FRAME_LEN);
+    p = qemud_buffer_reserve(b, len + 4);
+    p[0] = hex[(len >> 12) & 0xf];
+    p[1] = hex[(len >> 8) & 0xf];
+    p[2] = hex[(len >> 4) & 0xf];
+    p[3] = hex[len & 0xf];
+    memcpy(p + 4, data, len);
+    b->end += len + 4;
+    trace_qemud_frame_send(b, len, qemud_buffer_len(b));
+}
+
+int qemud_buffer_drain(QemudBuffer *b, AndroidPipeBuffer *buf, int cnt)
+{
+    int i, total = 0;
+
+    qemud_buffer_release(b);
+    for (i = 0; i < cnt && b->start < b->end; i++) {
+        uint32_t n = MIN(buf[i].size, b->end - b->start);
+        memcpy(buf[i].data, b->data + b->start, n);
+        b->start += n;
+        total += n;
+    }
+    if (b->start == b->end) {
+        b->start = b->end = 0;
+    }
+    D("sent %d bytes, %u left\n", total, qemud_buffer_len(b));
+    trace_qemud_buffer_drain(b, total, qemud_buffer_len(b));
 
     return total;
 }
@@ -12,6 +12,8 @@
 #include "hw/hw.h"
 #include "hw/sysbus.h"
 #include "qemu/error-report.h"
+#include "qemu/thread.h"
+#include "qemu/main-loop.h"
 #include "monitor/monitor.h"
 #include "hw/misc/goldfish_battery.h"
 
@@ -43,6 +45,10 @@ struct goldfish_battery_state {
     MemoryRegion iomem;
     qemu_irq irq;
 
+    /* The registers are accessed without the iothread lock, see
+     * goldfish_battery_realize(). Taken after the iothread lock. */
+    QemuMutex lock;
+
     // IRQs
     uint32_t int_status;
     // irq enable mask for int_status
@@ -82,16 +88,26 @@ void goldfish_battery_display_cb(void* opaque, BatteryLineCallback callback)
     DeviceState *dev = qdev_find_recursive(sysbus_get_default(),
                                            TYPE_GOLDFISH_BATTERY);
     struct goldfish_battery_state *s = GOLDFISH_BATTERY(dev);
+    uint32_t ac_online, status, health, present, capacity;
     const char *value;
     int size;
     char buf[128] = {0};
 
+    /* Don't call back into the console with the lock held */
+    qemu_mutex_lock(&s->lock);
+    ac_online = s->ac_online;
+    status = s->status;
+    health = s->health;
+    present = s->present;
+    capacity = s->capacity;
+    qemu_mutex_unlock(&s->lock);
+
     size = snprintf(buf, sizeof(buf) - 1,
-                    "AC: %s\n", (s->ac_online) ? "online" : "offline");
+                    "AC: %s\n", (ac_online) ? "online" : "offline");
     assert(size > 0);
     callback(opaque, buf, size);
 
-    switch (s->status) {
+    switch (status) {
     case POWER_SUPPLY_STATUS_CHARGING:
         value = "Charging";
         break;
@@ -112,7 +128,7 @@ void goldfish_battery_display_cb(void* opaque, BatteryLineCallback callback)
     assert(size > 0);
     callback(opaque, buf, size);
 
-    switch (s->health) {
+    switch (health) {
     case POWER_SUPPLY_HEALTH_GOOD:
         value = "Good";
         break;
@@ -136,11 +152,11 @@ void goldfish_battery_display_cb(void* opaque, BatteryLineCallback callback)
     callback(opaque, buf, size);
 
     size = snprintf(buf, sizeof(buf) - 1,
-                    "present: %s\n", (s->present) ? "true" : "false");
+                    "present: %s\n", (present) ? "true" : "false");
     assert(size > 0);
     callback(opaque, buf, size);
 
-    size = snprintf(buf, sizeof(buf) - 1, "capacity: %d\n", s->capacity);
+    size = snprintf(buf, sizeof(buf) - 1, "capacity: %d\n", capacity);
     assert(size > 0);
     callback(opaque, buf, size);
 }
@@ -168,6 +184,7 @@ int goldfish_battery_read_prop(int property)
         return 0;
     }
 
+    qemu_mutex_lock(&battery_state->lock);
     switch (property) {
         case POWER_SUPPLY_PROP_ONLINE:
             retVal = battery_state->ac_online;
@@ -188,6 +205,7 @@ int goldfish_battery_read_prop(int property)
             retVal = 0;
             break;
     }
+    qemu_mutex_unlock(&battery_state->lock);
     return retVal;
 }
 
@@ -202,6 +220,7 @@ void goldfish_battery_set_prop(int ac, int property, int value)
         return;
     }
 
+    qemu_mutex_lock(&battery_state->lock);
     if (ac) {
         switch (property) {
         case POWER_SUPPLY_PROP_ONLINE:
@@ -231,35 +250,47 @@ void goldfish_battery_set_prop(int ac, int property, int value)
                      (battery_state->int_status &
                      battery_state->int_enable));
     }
+    qemu_mutex_unlock(&battery_state->lock);
 }
 
 static uint64_t goldfish_battery_read(void *opaque, hwaddr offset, unsigned size)
 {
     uint64_t ret;
     struct goldfish_battery_state *s = opaque;
+    bool locked;
 
     switch(offset) {
         case BATTERY_INT_STATUS:
+            /* Lowering the irq needs the iothread lock */
+            locked = qemu_mutex_iothread_locked();
+            if (!locked) {
+                qemu_mutex_lock_iothread();
+            }
+            qemu_mutex_lock(&s->lock);
             // return current buffer status flags
             ret = s->int_status & s->int_enable;
             if (ret) {
                 qemu_irq_lower(s->irq);
                 s->int_status = 0;
             }
+            qemu_mutex_unlock(&s->lock);
+            if (!locked) {
+                qemu_mutex_unlock_iothread();
+            }
             return ret;
 
 		case BATTERY_INT_ENABLE:
-		    return s->int_enable;
+		    return atomic_read(&s->int_enable);
 		case BATTERY_AC_ONLINE:
-		    return s->ac_online;
+		    return atomic_read(&s->ac_online);
 		case BATTERY_STATUS:
-		    return s->status;
+		    return atomic_read(&s->status);
 		case BATTERY_HEALTH:
-		    return s->health;
+		    return atomic_read(&s->health);
 		case BATTERY_PRESENT:
-		    return s->present;
+		    return atomic_read(&s->present);
 		case BATTERY_CAPACITY:
-		    return s->capacity;
+		    return atomic_read(&s->capacity);
 
         default:
             error_report ("goldfish_battery_read: Bad offset " TARGET_FMT_plx,
@@ -276,7 +307,9 @@ static void goldfish_battery_write(void *opaque, hwaddr offset, uint64_t val,
     switch(offset) {
         case BATTERY_INT_ENABLE:
             /* enable interrupts */
+            qemu_mutex_lock(&s->lock);
             s->int_enable = val;
+            qemu_mutex_unlock(&s->lock);
             break;
 
         default:
@@ -303,8 +336,11 @@ static void goldfish_battery_realize(DeviceState *dev, Error **errp)
      */
     dev->id = g_strdup("goldfish_battery");
 
+    qemu_mutex_init(&s->lock);
     memory_region_init_io(&s->iomem, OBJECT(s), &goldfish_battery_iomem_ops, s,
             "goldfish_battery", 0x1000);
+    /* Only reading the interrupt status needs the iothread lock */
+    memory_region_set_lockless(&s->iomem, true);
     sysbus_init_mmio(sbdev, &s->iomem);
     sysbus_init_irq(sbdev, &s->irq);
 
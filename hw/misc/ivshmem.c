@@ -26,6 +26,7 @@
 #include "qemu/event_notifier.h"
 #include "qemu/fifo8.h"
 #include "sysemu/char.h"
+#include "android/shm-channel.h"
 
 #include <sys/mman.h>
 #include <sys/types.h>
@@ -104,6 +105,7 @@ typedef struct IVShmemState {
     char * sizearg;
     char * role;
     int role_val;   /* scalar to avoid multiple string comparisons */
+    uint32_t channels;  /* android/shm-channel.h channels to lay out */
 } IVShmemState;
 
 /* registers for the Inter-VM shared memory device */
@@ -774,6 +776,10 @@ static int pci_ivshmem_init(PCIDevice *dev)
             error_report("WARNING: do not specify both 'chardev' "
                          "and 'shm' with ivshmem");
         }
+        if (s->channels) {
+            error_report("WARNING: 'channels' is ignored with 'chardev', "
+                         "the server lays out the memory");
+        }
 
         IVSHMEM_DPRINTF("using shared memory server (socket = %s)\n",
                         s->server_chr->filename);
@@ -798,6 +804,7 @@ static int pci_ivshmem_init(PCIDevice *dev)
     } else {
         /* just map the file immediately, we're not using a server */
         int fd;
+        bool created = false;
 
         if (s->shmobj == NULL) {
             error_report("Must specify 'chardev' or 'shm' to ivshmem");
@@ -814,6 +821,7 @@ static int pci_ivshmem_init(PCIDevice *dev)
             if (ftruncate(fd, s->ivshmem_size) != 0) {
                 error_report("could not truncate shared file");
             }
+            created = true;
 
         } else if ((fd = shm_open(s->shmobj, O_CREAT|O_RDWR,
                         S_IRWXU|S_IRWXG|S_IRWXO)) < 0) {
@@ -828,6 +836,14 @@ static int pci_ivshmem_init(PCIDevice *dev)
 
         create_shared_memory_BAR(s, fd);
 
+        /* an object that already existed was formatted by its creator */
+        if (s->channels && created &&
+            shm_channel_format(memory_region_get_ram_ptr(&s->ivshmem),
+                               s->ivshmem_size, s->channels) < 0) {
+            error_report("cannot lay out %u channels in shared memory",
+                         s->channels);
+            exit(1);
+        }
     }
 
     dev->config_write = ivshmem_write_config;
@@ -859,6 +875,7 @@ static Property ivshmem_properties[] = {
     DEFINE_PROP_STRING("shm", IVShmemState, shmobj),
     DEFINE_PROP_STRING("role", IVShmemState, role),
     DEFINE_PROP_UINT32("use64", IVShmemState, ivshmem_64bit, 1),
+    DEFINE_PROP_UINT32("channels", IVShmemState, channels, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
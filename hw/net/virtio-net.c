@@ -322,6 +322,7 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
+    int i;
 
     /* Reset back to compatibility mode */
     n->promisc = 1;
@@ -345,6 +346,11 @@ static void virtio_net_reset(VirtIODevice *vdev)
     memcpy(&n->mac[0], &n->nic->conf->macaddr, sizeof(n->mac));
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     memset(n->vlans, 0, MAX_VLAN >> 3);
+
+    for (i = 0; i < n->max_queues; i++) {
+        n->vqs[i].rx_notify_pending = false;
+        n->vqs[i].tx_burst = n->tx_burst;
+    }
 }
 
 static void peer_test_vnet_hdr(VirtIONet *n)
@@ -1092,11 +1098,27 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+
+    /* Signal all the packets delivered in this main loop iteration at once */
+    q->rx_notify_pending = true;
+    qemu_bh_schedule(q->rx_bh);
 
     return size;
 }
 
+static void virtio_net_rx_notify(VirtIONetQueue *q)
+{
+    if (q->rx_notify_pending) {
+        q->rx_notify_pending = false;
+        virtio_notify(VIRTIO_DEVICE(q->n), q->rx_vq);
+    }
+}
+
+static void virtio_net_rx_bh(void *opaque)
+{
+    virtio_net_rx_notify(opaque);
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
@@ -1175,18 +1197,29 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
             q->async_tx.len  = len;
+            /* The peer is backed up: take smaller bites until it copes */
+            q->tx_burst = MAX(q->tx_burst / 2, 1);
+            if (num_packets) {
+                virtqueue_flush(q->tx_vq, num_packets);
+                virtio_notify(vdev, q->tx_vq);
+            }
             return -EBUSY;
         }
 
         len += ret;
 
-        virtqueue_push(q->tx_vq, &elem, 0);
-        virtio_notify(vdev, q->tx_vq);
+        /* Hand the whole burst back to the guest at once, below */
+        virtqueue_fill(q->tx_vq, &elem, 0, num_packets);
 
-        if (++num_packets >= n->tx_burst) {
+        if (++num_packets >= q->tx_burst) {
+            q->tx_burst = MIN(q->tx_burst * 2, n->tx_burst);
             break;
         }
     }
+    if (num_packets) {
+        virtqueue_flush(q->tx_vq, num_packets);
+        virtio_notify(vdev, q->tx_vq);
+    }
     return num_packets;
 }
 
@@ -1259,6 +1292,7 @@ static void virtio_net_tx_bh(void *opaque)
     VirtIONetQueue *q = opaque;
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int32_t burst = q->tx_burst;
     int32_t ret;
 
     /* This happens when device was stopped but BH wasn't. */
@@ -1282,7 +1316,7 @@ static void virtio_net_tx_bh(void *opaque)
 
     /* If we flush a full burst of packets, assume there are
      * more coming and immediately reschedule */
-    if (ret >= n->tx_burst) {
+    if (ret >= burst) {
         qemu_bh_schedule(q->tx_bh);
         q->tx_waiting = 1;
         return;
@@ -1306,6 +1340,9 @@ static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue)
 
     n->multiqueue = multiqueue;
 
+    for (i = 0; i < n->max_queues; i++) {
+        virtio_net_rx_notify(&n->vqs[i]);
+    }
     for (i = 2; i <= n->max_queues * 2 + 1; i++) {
         virtio_del_queue(vdev, i);
     }
@@ -1342,9 +1379,14 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
     VirtIONet *n = opaque;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
+    int i;
+
     /* At this point, backend must be stopped, otherwise
      * it might keep writing to memory. */
     assert(!n->vhost_started);
+    for (i = 0; i < n->max_queues; i++) {
+        virtio_net_rx_notify(&n->vqs[i]);
+    }
     virtio_save(vdev, f);
 }
 
@@ -1649,6 +1691,10 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     n->vqs[0].tx_waiting = 0;
     n->tx_burst = n->net_conf.txburst;
+    for (i = 0; i < n->max_queues; i++) {
+        n->vqs[i].tx_burst = n->tx_burst;
+        n->vqs[i].rx_bh = qemu_bh_new(virtio_net_rx_bh, &n->vqs[i]);
+    }
     virtio_net_set_mrg_rx_bufs(n, 0);
     n->promisc = 1; /* for compatibility */
 
@@ -1695,6 +1741,7 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
         } else if (q->tx_bh) {
             qemu_bh_delete(q->tx_bh);
         }
+        qemu_bh_delete(q->rx_bh);
     }
 
     timer_del(n->announce_timer);
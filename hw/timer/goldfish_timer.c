@@ -11,9 +11,14 @@
 */
 #include "qemu-common.h"
 #include "qemu/timer.h"
+#include "qemu/thread.h"
+#include "qemu/main-loop.h"
 #include "cpu.h"
+#include "exec/address-spaces.h"
 #include "hw/hw.h"
 #include "hw/sysbus.h"
+#include "qemu/notify.h"
+#include "sysemu/kvm.h"
 
 enum {
     TIMER_TIME_LOW          = 0x00, // get low bits of current time and update TIMER_TIME_HIGH
@@ -21,23 +26,110 @@ enum {
     TIMER_ALARM_LOW         = 0x08, // set low bits of alarm and activate it
     TIMER_ALARM_HIGH        = 0x0c, // set high bits of next alarm
     TIMER_CLEAR_INTERRUPT   = 0x10,
-    TIMER_CLEAR_ALARM       = 0x14
+    TIMER_CLEAR_ALARM       = 0x14,
+    TIMER_FEATURES          = 0x18, // TIMER_FEATURE_* flags
+    TIMER_PVCLOCK_LOW       = 0x1c, // set low bits of the pvclock page and enable it, 0 disables
+    TIMER_PVCLOCK_HIGH      = 0x20, // set high bits of the next pvclock page
+    TIMER_ALARM_RING_LOW    = 0x24, // set low bits of the alarm ring and enable it, 0 disables
+    TIMER_ALARM_RING_HIGH   = 0x28, // set high bits of the next alarm ring
+    TIMER_ALARM_SLACK       = 0x2c, // ns an alarm of the ring may be late by
+    TIMER_ALARM_KICK        = 0x30, // the ring has an alarm before its armed_ns
 };
 
+enum {
+    TIMER_FEATURE_PVCLOCK   = 1 << 0,
+    TIMER_FEATURE_ALARM_RING = 1 << 1,
+};
+
+/*
+ * The pvclock page lets the guest read the virtual clock without an MMIO
+ * exit, from a counter that it reads without trapping and that follows the
+ * virtual clock. Fields are in guest byte order:
+ *
+ *   0x00  u32  version       odd while the host updates the page
+ *   0x04  u32  flags         PVCLOCK_VALID, else the guest uses TIMER_TIME_*
+ *   0x08  u64  system_time   virtual clock in ns when the counter ...
+ *   0x10  u64  counter       ... had this value
+ *   0x18  u32  mul           ns = system_time + (((now - counter) mod 2^width)
+ *   0x1c  u32  shift              * mul >> shift)
+ *
+ * A guest reads the version, the fields and the version again, and retries
+ * if the two versions differ or are odd. On MIPS the counter is the 32-bit
+ * CP0 Count register of the boot CPU, so the host moves the page forward
+ * well before the difference wraps.
+ */
+#define PVCLOCK_VERSION         0x00
+#define PVCLOCK_FLAGS           0x04
+#define PVCLOCK_SYSTEM_TIME     0x08
+#define PVCLOCK_COUNTER         0x10
+#define PVCLOCK_MUL             0x18
+#define PVCLOCK_SHIFT           0x1c
+
+#define PVCLOCK_VALID           (1 << 0)
+
+/* A quarter of the 43s wrap of a 100MHz 32-bit counter */
+#define PVCLOCK_REFRESH_NS      (10 * 1000 * 1000 * 1000LL)
+
+/*
+ * The alarm ring lets the guest queue its alarms without an exit for each,
+ * and the host raise a single interrupt for the alarms that are close
+ * enough. Fields are in guest byte order:
+ *
+ *   0x00  u32  entries       number of slots, up to ALARM_RING_MAX_ENTRIES
+ *   0x04  u32  reserved
+ *   0x08  u64  armed_ns      set by the host: when it raises the interrupt
+ *                            next, ALARM_RING_IDLE if it has no alarm
+ *   0x10  u64  deadlines[entries]   virtual clock in ns, 0 if free
+ *
+ * The guest owns the slots. To queue an alarm it fills a slot, then, after
+ * a memory barrier, reads armed_ns, and writes TIMER_ALARM_KICK if the
+ * alarm is earlier. The host raises the interrupt at the latest deadline
+ * that is at most TIMER_ALARM_SLACK ns after the earliest one, and from
+ * then on ignores the deadlines up to that time: the guest is expected to
+ * run the alarms that are due and free their slots. The host publishes
+ * armed_ns before it looks at the slots again, so that either it sees a
+ * new alarm or the guest sees the old armed_ns and kicks it.
+ */
+#define ALARM_RING_ENTRIES      0x00
+#define ALARM_RING_ARMED_NS     0x08
+#define ALARM_RING_DEADLINES    0x10
+
+#define ALARM_RING_MAX_ENTRIES  256
+#define ALARM_RING_IDLE         UINT64_MAX
+
 struct timer_state {
     SysBusDevice parent;
 
     MemoryRegion iomem;
     qemu_irq irq;
 
+    /* The registers are accessed without the iothread lock, see
+     * goldfish_timer_realize(). Taken after the iothread lock, which
+     * everything that touches the timer or the irq holds as well. */
+    QemuMutex lock;
     uint32_t alarm_low_ns;
     int32_t alarm_high_ns;
     int64_t now_ns;
     char armed;
     QEMUTimer *timer;
+
+    /* Guest physical address of the pvclock page, 0 if disabled */
+    uint64_t pvclock_addr;
+    uint32_t pvclock_high;
+    uint32_t pvclock_version;
+    QEMUTimer *pvclock_timer;
+    Notifier pvclock_notifier;
+
+    /* Guest physical address of the alarm ring, 0 if disabled */
+    uint64_t ring_addr;
+    uint32_t ring_high;
+    uint32_t ring_slack_ns;
+    /* The deadlines up to this time have been given to the guest */
+    int64_t ring_served_ns;
+    QEMUTimer *ring_timer;
 };
 
-#define  GOLDFISH_TIMER_SAVE_VERSION  1
+#define  GOLDFISH_TIMER_SAVE_VERSION  3
 
 #define TYPE_GOLDFISH_TIMER "goldfish_timer"
 #define GOLDFISH_TIMER(obj) OBJECT_CHECK(struct timer_state, (obj), TYPE_GOLDFISH_TIMER)
@@ -46,6 +138,7 @@ static void  goldfish_timer_save(QEMUFile*  f, void*  opaque)
 {
     struct timer_state* s = opaque;
 
+    qemu_mutex_lock(&s->lock);
     qemu_put_be64(f, s->now_ns);  /* in case the kernel is in the middle of a timer read */
     qemu_put_byte(f, s->armed);
     if (s->armed) {
@@ -53,15 +146,201 @@ static void  goldfish_timer_save(QEMUFile*  f, void*  opaque)
         int64_t  alarm_ns = (s->alarm_low_ns | (int64_t)s->alarm_high_ns << 32);
         qemu_put_be64(f, alarm_ns - now_ns);
     }
+    qemu_put_be64(f, s->pvclock_addr);
+    qemu_put_be32(f, s->pvclock_high);
+    qemu_put_be64(f, s->ring_addr);
+    qemu_put_be32(f, s->ring_high);
+    qemu_put_be32(f, s->ring_slack_ns);
+    qemu_put_be64(f, s->ring_served_ns);
+    qemu_mutex_unlock(&s->lock);
+}
+
+static bool goldfish_timer_has_pvclock(void)
+{
+#ifdef TARGET_MIPS
+    return !kvm_enabled();
+#else
+    return false;
+#endif
+}
+
+/* Reads the guest counter at the virtual time @now_ns */
+static bool goldfish_timer_counter(int64_t now_ns, uint64_t *counter,
+                                   uint64_t *freq)
+{
+#ifdef TARGET_MIPS
+    uint32_t count;
+
+    if (!first_cpu ||
+        !cpu_mips_count_at(&MIPS_CPU(first_cpu)->env, now_ns, &count)) {
+        return false;
+    }
+    *counter = count;
+    *freq = CPU_MIPS_COUNT_FREQ;
+    return true;
+#else
+    return false;
+#endif
+}
+
+/* Rewrites the pvclock page for the current virtual time, with s->lock */
+static void goldfish_timer_pvclock_update(struct timer_state *s)
+{
+    AddressSpace *as = &address_space_memory;
+    hwaddr addr = s->pvclock_addr;
+    int64_t now_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint64_t counter, freq, period_ns;
+    uint32_t flags = 0, mul = 0, shift = 0;
+
+    if (!addr) {
+        timer_del(s->pvclock_timer);
+        return;
+    }
+
+    /* The counter ticks on multiples of its period, and so does the time
+     * given to the guest, so that it doesn't depend on when this runs. */
+    if (goldfish_timer_counter(now_ns, &counter, &freq) &&
+        get_ticks_per_sec() % freq == 0) {
+        period_ns = get_ticks_per_sec() / freq;
+        now_ns -= now_ns % period_ns;
+        /* The largest scale that keeps a 32-bit delta * mul in 64 bits */
+        for (mul = period_ns; mul <= UINT32_MAX / 2 && shift < 31; shift++) {
+            mul <<= 1;
+        }
+        flags = PVCLOCK_VALID;
+    } else {
+        counter = 0;
+    }
+
+    stl_phys(as, addr + PVCLOCK_VERSION, ++s->pvclock_version);
+    smp_wmb();
+    stl_phys(as, addr + PVCLOCK_FLAGS, flags);
+    stq_phys(as, addr + PVCLOCK_SYSTEM_TIME, now_ns);
+    stq_phys(as, addr + PVCLOCK_COUNTER, counter);
+    stl_phys(as, addr + PVCLOCK_MUL, mul);
+    stl_phys(as, addr + PVCLOCK_SHIFT, shift);
+    smp_wmb();
+    stl_phys(as, addr + PVCLOCK_VERSION, ++s->pvclock_version);
+
+    if (flags & PVCLOCK_VALID) {
+        timer_mod(s->pvclock_timer, now_ns + PVCLOCK_REFRESH_NS);
+    } else {
+        timer_del(s->pvclock_timer);
+    }
+}
+
+static void goldfish_timer_pvclock_tick(void *opaque)
+{
+    struct timer_state *s = opaque;
+
+    qemu_mutex_lock(&s->lock);
+    goldfish_timer_pvclock_update(s);
+    qemu_mutex_unlock(&s->lock);
+}
+
+/* Returns the earliest deadline of the ring that hasn't been served, and
+ * sets @fire_ns to when to raise the interrupt for it. */
+static uint64_t goldfish_timer_ring_scan(struct timer_state *s,
+                                         int64_t *fire_ns)
+{
+    uint8_t buf[ALARM_RING_MAX_ENTRIES * 8];
+    uint64_t first = ALARM_RING_IDLE, last = ALARM_RING_IDLE;
+    uint32_t entries, i;
+
+    entries = ldl_phys(&address_space_memory,
+                       s->ring_addr + ALARM_RING_ENTRIES);
+    entries = MIN(entries, ALARM_RING_MAX_ENTRIES);
+    cpu_physical_memory_read(s->ring_addr + ALARM_RING_DEADLINES, buf,
+                             entries * 8);
+
+    for (i = 0; i < entries; i++) {
+        uint64_t deadline = ldq_p(buf + i * 8);
+
+        if (deadline > s->ring_served_ns && deadline < first) {
+            first = deadline;
+        }
+    }
+    if (first != ALARM_RING_IDLE) {
+        /* Serve along with it the alarms that follow it closely */
+        last = first;
+        for (i = 0; i < entries; i++) {
+            uint64_t deadline = ldq_p(buf + i * 8);
+
+            if (deadline > last && deadline - first <= s->ring_slack_ns) {
+                last = deadline;
+            }
+        }
+    }
+    *fire_ns = last;
+    return first;
+}
+
+/* Raises the interrupt if alarms of the ring are due, and arms the host
+ * timer for the next ones. Called with s->lock held. */
+static void goldfish_timer_ring_update(struct timer_state *s)
+{
+    int64_t now_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t fire_ns;
+    uint64_t first;
+
+    if (!s->ring_addr) {
+        timer_del(s->ring_timer);
+        return;
+    }
+
+    for (;;) {
+        first = goldfish_timer_ring_scan(s, &fire_ns);
+        if (first != ALARM_RING_IDLE && fire_ns <= now_ns) {
+            s->ring_served_ns = now_ns;
+            qemu_set_irq(s->irq, 1);
+            continue;
+        }
+        stq_phys(&address_space_memory, s->ring_addr + ALARM_RING_ARMED_NS,
+                 first == ALARM_RING_IDLE ? ALARM_RING_IDLE : fire_ns);
+        smp_mb();
+        /* Catch the alarms queued while armed_ns was being published */
+        if (goldfish_timer_ring_scan(s, &fire_ns) == first) {
+            break;
+        }
+    }
+
+    if (first == ALARM_RING_IDLE) {
+        timer_del(s->ring_timer);
+    } else {
+        timer_mod(s->ring_timer, fire_ns);
+    }
 }
 
+static void goldfish_timer_ring_tick(void *opaque)
+{
+    struct timer_state *s = opaque;
+
+    qemu_mutex_lock(&s->lock);
+    goldfish_timer_ring_update(s);
+    qemu_mutex_unlock(&s->lock);
+}
+
+#ifdef TARGET_MIPS
+/* The guest set, started or stopped the counter of a CPU */
+static void goldfish_timer_counter_changed(Notifier *notifier, void *data)
+{
+    struct timer_state *s = container_of(notifier, struct timer_state,
+                                         pvclock_notifier);
+
+    if (first_cpu && data == first_cpu->env_ptr) {
+        goldfish_timer_pvclock_tick(s);
+    }
+}
+#endif
+
 static int  goldfish_timer_load(QEMUFile*  f, void*  opaque, int  version_id)
 {
     struct timer_state*  s   = opaque;
 
-    if (version_id != GOLDFISH_TIMER_SAVE_VERSION)
+    if (version_id < 1 || version_id > GOLDFISH_TIMER_SAVE_VERSION)
         return -1;
 
+    qemu_mutex_lock(&s->lock);
     s->now_ns = qemu_get_be64(f);
     s->armed  = qemu_get_byte(f);
     if (s->armed) {
@@ -77,18 +356,60 @@ static int  goldfish_timer_load(QEMUFile*  f, void*  opaque, int  version_id)
             timer_mod(s->timer, alarm_tks);
         }
     }
+    if (version_id >= 2) {
+        s->pvclock_addr = qemu_get_be64(f);
+        s->pvclock_high = qemu_get_be32(f);
+    } else {
+        s->pvclock_addr = 0;
+        s->pvclock_high = 0;
+    }
+    if (version_id >= 3) {
+        s->ring_addr = qemu_get_be64(f);
+        s->ring_high = qemu_get_be32(f);
+        s->ring_slack_ns = qemu_get_be32(f);
+        s->ring_served_ns = qemu_get_be64(f);
+    } else {
+        s->ring_addr = 0;
+        s->ring_high = 0;
+        s->ring_slack_ns = 0;
+        s->ring_served_ns = 0;
+    }
+    /* Once the CPUs and the RAM are loaded as well */
+    if (s->pvclock_addr) {
+        timer_mod(s->pvclock_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    } else {
+        timer_del(s->pvclock_timer);
+    }
+    if (s->ring_addr) {
+        timer_mod(s->ring_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    } else {
+        timer_del(s->ring_timer);
+    }
+    qemu_mutex_unlock(&s->lock);
     return 0;
 }
 
 static uint64_t goldfish_timer_read(void *opaque, hwaddr offset, unsigned size)
 {
     struct timer_state *s = (struct timer_state *)opaque;
+    uint64_t ret;
+
+    /* The virtual clock can be read without the iothread lock */
     switch(offset) {
         case TIMER_TIME_LOW:
+            qemu_mutex_lock(&s->lock);
             s->now_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
-            return s->now_ns;
+            ret = (uint32_t)s->now_ns;
+            qemu_mutex_unlock(&s->lock);
+            return ret;
         case TIMER_TIME_HIGH:
-            return s->now_ns >> 32;
+            qemu_mutex_lock(&s->lock);
+            ret = (uint64_t)s->now_ns >> 32;
+            qemu_mutex_unlock(&s->lock);
+            return ret;
+        case TIMER_FEATURES:
+            return TIMER_FEATURE_ALARM_RING |
+                   (goldfish_timer_has_pvclock() ? TIMER_FEATURE_PVCLOCK : 0);
         default:
             cpu_abort(current_cpu,
                       "goldfish_timer_read: Bad offset %" HWADDR_PRIx "\n",
@@ -100,7 +421,14 @@ static uint64_t goldfish_timer_read(void *opaque, hwaddr offset, unsigned size)
 static void goldfish_timer_write(void *opaque, hwaddr offset, uint64_t value_ns, unsigned size)
 {
     struct timer_state *s = (struct timer_state *)opaque;
+    bool locked = qemu_mutex_iothread_locked();
     int64_t alarm_ns, now_ns;
+
+    /* Arming the timer and raising the irq need the iothread lock */
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+    qemu_mutex_lock(&s->lock);
     switch(offset) {
         case TIMER_ALARM_LOW:
             s->alarm_low_ns = value_ns;
@@ -123,18 +451,65 @@ static void goldfish_timer_write(void *opaque, hwaddr offset, uint64_t value_ns,
         case TIMER_CLEAR_INTERRUPT:
             qemu_set_irq(s->irq, 0);
             break;
+        case TIMER_PVCLOCK_LOW:
+            if (goldfish_timer_has_pvclock()) {
+                s->pvclock_addr = (uint32_t)value_ns |
+                                  (uint64_t)s->pvclock_high << 32;
+                goldfish_timer_pvclock_update(s);
+            }
+            break;
+        case TIMER_PVCLOCK_HIGH:
+            s->pvclock_high = value_ns;
+            break;
+        case TIMER_ALARM_RING_LOW:
+            s->ring_addr = (uint32_t)value_ns | (uint64_t)s->ring_high << 32;
+            s->ring_served_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+            goldfish_timer_ring_update(s);
+            break;
+        case TIMER_ALARM_RING_HIGH:
+            s->ring_high = value_ns;
+            break;
+        case TIMER_ALARM_SLACK:
+            s->ring_slack_ns = value_ns;
+            goldfish_timer_ring_update(s);
+            break;
+        case TIMER_ALARM_KICK:
+            goldfish_timer_ring_update(s);
+            break;
         default:
             cpu_abort(current_cpu,
                       "goldfish_timer_write: Bad offset %" HWADDR_PRIx "\n",
                       offset);
     }
+    qemu_mutex_unlock(&s->lock);
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 static void goldfish_timer_tick(void *opaque)
 {
     struct timer_state *s = (struct timer_state *)opaque;
+
+    qemu_mutex_lock(&s->lock);
     s->armed = 0;
     qemu_set_irq(s->irq, 1);
+    qemu_mutex_unlock(&s->lock);
+}
+
+static void goldfish_timer_reset(DeviceState *dev)
+{
+    struct timer_state *s = GOLDFISH_TIMER(dev);
+
+    qemu_mutex_lock(&s->lock);
+    s->pvclock_addr = 0;
+    s->pvclock_high = 0;
+    timer_del(s->pvclock_timer);
+    s->ring_addr = 0;
+    s->ring_high = 0;
+    s->ring_slack_ns = 0;
+    timer_del(s->ring_timer);
+    qemu_mutex_unlock(&s->lock);
 }
 
 static const MemoryRegionOps mips_qemu_timer_ops = {
@@ -148,10 +523,22 @@ static void goldfish_timer_realize(DeviceState *dev, Error **errp)
     SysBusDevice *sbdev = SYS_BUS_DEVICE(dev);
     struct timer_state *s = GOLDFISH_TIMER(dev);
 
+    qemu_mutex_init(&s->lock);
     s->timer = timer_new(QEMU_CLOCK_VIRTUAL, SCALE_NS, goldfish_timer_tick, s);
+    s->pvclock_timer = timer_new(QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                 goldfish_timer_pvclock_tick, s);
+    s->ring_timer = timer_new(QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                              goldfish_timer_ring_tick, s);
+#ifdef TARGET_MIPS
+    s->pvclock_notifier.notify = goldfish_timer_counter_changed;
+    cpu_mips_add_count_notifier(&s->pvclock_notifier);
+#endif
 
     memory_region_init_io(&s->iomem, OBJECT(s), &mips_qemu_timer_ops, s,
             "goldfish_timer", 0x1000);
+    /* The guest kernel reads the time a lot, let it do that without
+     * waiting for the iothread lock */
+    memory_region_set_lockless(&s->iomem, true);
     sysbus_init_mmio(sbdev, &s->iomem);
     sysbus_init_irq(sbdev, &s->irq);
     register_savevm(NULL,
@@ -168,6 +555,7 @@ static void goldfish_timer_class_init(ObjectClass *klass, void *data)
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->realize = goldfish_timer_realize;
+    dc->reset = goldfish_timer_reset;
     dc->desc = "goldfish timer";
 }
 
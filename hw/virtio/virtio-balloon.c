@@ -42,6 +42,32 @@ static void balloon_page(void *addr, int deflate)
 #endif
 }
 
+/* Give the host back the whole pages in a run of free guest RAM */
+static void balloon_discard(void *addr, size_t len)
+{
+#if defined(__linux__)
+    uintptr_t page_size = getpagesize();
+    uintptr_t start = ROUND_UP((uintptr_t)addr, page_size);
+    uintptr_t end = ((uintptr_t)addr + len) & ~(page_size - 1);
+    ram_addr_t ram_addr;
+
+    if (start >= end || (kvm_enabled() && !kvm_has_sync_mmu())) {
+        return;
+    }
+    /* Mapping a buffer may have bounced it; only ever drop guest RAM */
+    if (!qemu_ram_addr_from_host(addr, &ram_addr)) {
+        return;
+    }
+#ifdef MADV_FREE
+    /* Lazily: pages the host doesn't need back are kept until it does */
+    if (madvise((void *)start, end - start, MADV_FREE) == 0) {
+        return;
+    }
+#endif
+    qemu_madvise((void *)start, end - start, QEMU_MADV_DONTNEED);
+#endif
+}
+
 static const char *balloon_stat_names[] = {
    [VIRTIO_BALLOON_S_SWAP_IN] = "stat-swap-in",
    [VIRTIO_BALLOON_S_SWAP_OUT] = "stat-swap-out",
@@ -235,6 +261,47 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     }
 }
 
+/*
+ * The guest hands runs of free pages over as in buffers and gets them back
+ * once we have dropped them, after which they read as zeroes or as they
+ * were. Adjacent buffers are merged so that every batch the guest reports
+ * takes as few madvise() calls as possible.
+ */
+static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtQueueElement elem;
+    bool pushed = false;
+
+    while (virtqueue_pop(vq, &elem)) {
+        uint8_t *start = NULL;
+        size_t len = 0;
+        unsigned int i;
+
+        for (i = 0; i < elem.in_num; i++) {
+            uint8_t *base = elem.in_sg[i].iov_base;
+
+            if (start && start + len == base) {
+                len += elem.in_sg[i].iov_len;
+                continue;
+            }
+            if (start) {
+                balloon_discard(start, len);
+            }
+            start = base;
+            len = elem.in_sg[i].iov_len;
+        }
+        if (start) {
+            balloon_discard(start, len);
+        }
+
+        virtqueue_push(vq, &elem, 0);
+        pushed = true;
+    }
+    if (pushed) {
+        virtio_notify(vdev, vq);
+    }
+}
+
 static void virtio_balloon_receive_stats(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
@@ -305,6 +372,9 @@ static void virtio_balloon_set_config(VirtIODevice *vdev,
 
 static uint32_t virtio_balloon_get_features(VirtIODevice *vdev, uint32_t f)
 {
+    VirtIOBalloon *dev = VIRTIO_BALLOON(vdev);
+
+    f |= dev->host_features;
     f |= (1 << VIRTIO_BALLOON_F_STATS_VQ);
     return f;
 }
@@ -316,20 +386,94 @@ static void virtio_balloon_stat(void *opaque, BalloonInfo *info)
                                VIRTIO_BALLOON_PFN_SHIFT);
 }
 
+static void virtio_balloon_update_target(VirtIOBalloon *dev)
+{
+    uint64_t ram_pages = ram_size >> VIRTIO_BALLOON_PFN_SHIFT;
+
+    dev->num_pages = MIN((uint64_t)dev->target_pages + dev->auto_pages,
+                         ram_pages);
+    virtio_notify_config(VIRTIO_DEVICE(dev));
+}
+
 static void virtio_balloon_to_target(void *opaque, ram_addr_t target)
 {
     VirtIOBalloon *dev = VIRTIO_BALLOON(opaque);
-    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
 
     if (target > ram_size) {
         target = ram_size;
     }
     if (target) {
-        dev->num_pages = (ram_size - target) >> VIRTIO_BALLOON_PFN_SHIFT;
-        virtio_notify_config(vdev);
+        dev->target_pages = (ram_size - target) >> VIRTIO_BALLOON_PFN_SHIFT;
+        virtio_balloon_update_target(dev);
     }
 }
 
+/*
+ * Automatic policy: while the host has less than AUTO_LOW_PCT of its memory
+ * available, take another 1/2^AUTO_STEP_SHIFT of guest RAM every interval,
+ * up to half of it and never more than half of what the guest last said
+ * was free. Give it back a step at a time once the host is above
+ * AUTO_HIGH_PCT again.
+ */
+#define AUTO_LOW_PCT    10
+#define AUTO_HIGH_PCT   20
+#define AUTO_STEP_SHIFT 4
+
+/* Percentage of host memory available, or -1 if we can't know */
+static int balloon_host_mem_available(void)
+{
+#if defined(__linux__)
+    FILE *f = fopen("/proc/meminfo", "r");
+    char line[128];
+    uint64_t total = 0, avail = 0, val;
+    bool found = false;
+
+    if (!f) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "MemTotal: %" SCNu64, &val) == 1) {
+            total = val;
+        } else if (sscanf(line, "MemAvailable: %" SCNu64, &val) == 1) {
+            avail = val;
+            found = true;
+        }
+    }
+    fclose(f);
+    if (total && found) {
+        return avail * 100 / total;
+    }
+#endif
+    return -1;
+}
+
+static void balloon_auto_cb(void *opaque)
+{
+    VirtIOBalloon *s = opaque;
+    uint32_t ram_pages = ram_size >> VIRTIO_BALLOON_PFN_SHIFT;
+    uint32_t step = ram_pages >> AUTO_STEP_SHIFT;
+    uint32_t pages = s->auto_pages;
+    int avail = balloon_host_mem_available();
+
+    if (avail >= 0 && avail < AUTO_LOW_PCT) {
+        if (s->stats[VIRTIO_BALLOON_S_MEMFREE] != (uint64_t)-1) {
+            step = MIN(step, (s->stats[VIRTIO_BALLOON_S_MEMFREE] >>
+                              VIRTIO_BALLOON_PFN_SHIFT) / 2);
+        }
+        pages = MIN(pages + step, ram_pages / 2);
+    } else if (avail >= AUTO_HIGH_PCT) {
+        pages = pages > step ? pages - step : 0;
+    }
+
+    if (pages != s->auto_pages) {
+        s->auto_pages = pages;
+        virtio_balloon_update_target(s);
+    }
+    timer_mod(s->auto_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+              s->auto_interval * 1000LL);
+}
+
 static void virtio_balloon_save(QEMUFile *f, void *opaque)
 {
     virtio_save(VIRTIO_DEVICE(opaque), f);
@@ -358,6 +502,8 @@ static int virtio_balloon_load_device(VirtIODevice *vdev, QEMUFile *f,
 
     s->num_pages = qemu_get_be32(f);
     s->actual = qemu_get_be32(f);
+    s->target_pages = s->num_pages;
+    s->auto_pages = 0;
     return 0;
 }
 
@@ -382,9 +528,24 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     s->ivq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->dvq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(vdev, 128, virtio_balloon_receive_stats);
+    if (s->host_features & (1 << VIRTIO_BALLOON_F_REPORTING)) {
+        s->rvq = virtio_add_queue(vdev, 32, virtio_balloon_handle_report);
+    }
 
     reset_stats(s);
 
+    if (s->auto_interval) {
+        s->auto_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, balloon_auto_cb, s);
+        timer_mod(s->auto_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+                  s->auto_interval * 1000LL);
+        /* The policy wants to know how much the guest has free */
+        s->stats_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL,
+                                      balloon_stats_poll_cb, s);
+        s->stats_poll_interval = s->auto_interval;
+        balloon_stats_change_timer(s, s->auto_interval);
+    }
+
     register_savevm(dev, "virtio-balloon", -1, 1,
                     virtio_balloon_save, virtio_balloon_load, s);
 
@@ -403,12 +564,20 @@ static void virtio_balloon_device_unrealize(DeviceState *dev, Error **errp)
     VirtIOBalloon *s = VIRTIO_BALLOON(dev);
 
     balloon_stats_destroy_timer(s);
+    if (s->auto_timer) {
+        timer_del(s->auto_timer);
+        timer_free(s->auto_timer);
+    }
     qemu_remove_balloon_handler(s);
     unregister_savevm(dev, "virtio-balloon", s);
     virtio_cleanup(vdev);
 }
 
 static Property virtio_balloon_properties[] = {
+    DEFINE_PROP_BIT("free-page-reporting", VirtIOBalloon, host_features,
+                    VIRTIO_BALLOON_F_REPORTING, false),
+    DEFINE_PROP_UINT32("auto-balloon-interval", VirtIOBalloon, auto_interval,
+                       0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
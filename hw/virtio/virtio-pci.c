@@ -29,6 +29,7 @@
 #include "hw/pci/msix.h"
 #include "hw/loader.h"
 #include "sysemu/kvm.h"
+#include "sysemu/hax.h"
 #include "sysemu/block-backend.h"
 #include "virtio-pci.h"
 #include "qemu/range.h"
@@ -992,7 +993,7 @@ static void virtio_pci_device_plugged(DeviceState *d)
     pci_register_bar(&proxy->pci_dev, 0, PCI_BASE_ADDRESS_SPACE_IO,
                      &proxy->bar);
 
-    if (!kvm_has_many_ioeventfds()) {
+    if (!kvm_has_many_ioeventfds() && !hax_enabled()) {
         proxy->flags &= ~VIRTIO_PCI_FLAG_USE_IOEVENTFD;
     }
 
@@ -15,6 +15,7 @@
 
 #include "trace.h"
 #include "exec/address-spaces.h"
+#include "exec/ram_addr.h"
 #include "qemu/error-report.h"
 #include "hw/virtio/virtio.h"
 #include "qemu/atomic.h"
@@ -66,11 +67,39 @@ typedef struct VRing
     hwaddr used;
 } VRing;
 
+enum {
+    VRING_CACHE_STALE,      /* to be mapped on next access */
+    VRING_CACHE_MAPPED,
+    VRING_CACHE_UNMAPPED,   /* not all in RAM, use physical accesses */
+};
+
+/*
+ * Host mappings of the rings of a queue, so that ring accesses are plain
+ * loads and stores rather than a walk of the memory map each.  They are
+ * dropped whenever the guest moves the rings or the memory map changes.
+ */
+typedef struct VRingCache
+{
+    int state;
+    VRingDesc *desc;
+    VRingAvail *avail;
+    VRingUsed *used;
+    MemoryRegion *desc_mr;
+    MemoryRegion *avail_mr;
+    MemoryRegion *used_mr;
+    ram_addr_t used_ram_addr;
+} VRingCache;
+
 struct VirtQueue
 {
     VRing vring;
+    VRingCache cache;
     hwaddr pa;
     uint16_t last_avail_idx;
+    /* Last avail index read from the guest; heads up to it need no read */
+    uint16_t shadow_avail_idx;
+    /* Our copy of the used index, which only we write */
+    uint16_t used_idx;
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
 
@@ -91,66 +120,171 @@ struct VirtQueue
     EventNotifier host_notifier;
 };
 
-/* virt queue functions */
-static void virtqueue_init(VirtQueue *vq)
+static void *vring_cache_map(MemoryRegion **mr, hwaddr pa, hwaddr len,
+                             bool is_write)
 {
-    hwaddr pa = vq->pa;
+    MemoryRegionSection section;
 
-    vq->vring.desc = pa;
-    vq->vring.avail = pa + vq->vring.num * sizeof(VRingDesc);
-    vq->vring.used = vring_align(vq->vring.avail +
-                                 offsetof(VRingAvail, ring[vq->vring.num]),
-                                 vq->vring.align);
+    section = memory_region_find(get_system_memory(), pa, len);
+    if (!section.mr) {
+        return NULL;
+    }
+    if (int128_get64(section.size) < len ||
+        (is_write && section.readonly) ||
+        !memory_region_is_ram(section.mr) ||
+        memory_region_is_logging(section.mr)) {
+        memory_region_unref(section.mr);
+        return NULL;
+    }
+
+    *mr = section.mr;
+    return memory_region_get_ram_ptr(section.mr) +
+           section.offset_within_region;
 }
 
-static inline uint64_t vring_desc_addr(VirtIODevice *vdev, hwaddr desc_pa,
-                                       int i)
+static void vring_cache_invalidate(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return virtio_ldq_phys(vdev, pa);
+    VRingCache *cache = &vq->cache;
+
+    if (cache->state == VRING_CACHE_MAPPED) {
+        memory_region_unref(cache->desc_mr);
+        memory_region_unref(cache->avail_mr);
+        memory_region_unref(cache->used_mr);
+    }
+    memset(cache, 0, sizeof(*cache));
+    cache->state = VRING_CACHE_STALE;
 }
 
-static inline uint32_t vring_desc_len(VirtIODevice *vdev, hwaddr desc_pa, int i)
+static void vring_cache_update(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return virtio_ldl_phys(vdev, pa);
+    VRingCache *cache = &vq->cache;
+    VRing *vring = &vq->vring;
+    unsigned int num = vring->num;
+
+    cache->state = VRING_CACHE_UNMAPPED;
+    if (!vring->desc || !num) {
+        return;
+    }
+
+    /* Include the event index after each of the avail and used rings */
+    cache->desc = vring_cache_map(&cache->desc_mr, vring->desc,
+                                  num * sizeof(VRingDesc), false);
+    cache->avail = vring_cache_map(&cache->avail_mr, vring->avail,
+                                   offsetof(VRingAvail, ring[num + 1]), false);
+    cache->used = vring_cache_map(&cache->used_mr, vring->used,
+                                  offsetof(VRingUsed, ring[num]) +
+                                  sizeof(uint16_t), true);
+    if (!cache->desc || !cache->avail || !cache->used) {
+        MemoryRegion *desc_mr = cache->desc ? cache->desc_mr : NULL;
+        MemoryRegion *avail_mr = cache->avail ? cache->avail_mr : NULL;
+        MemoryRegion *used_mr = cache->used ? cache->used_mr : NULL;
+
+        memory_region_unref(desc_mr);
+        memory_region_unref(avail_mr);
+        memory_region_unref(used_mr);
+        memset(cache, 0, sizeof(*cache));
+        cache->state = VRING_CACHE_UNMAPPED;
+        return;
+    }
+
+    qemu_ram_addr_from_host(cache->used, &cache->used_ram_addr);
+    cache->state = VRING_CACHE_MAPPED;
 }
 
-static inline uint16_t vring_desc_flags(VirtIODevice *vdev, hwaddr desc_pa,
-                                        int i)
+static inline VRingCache *vring_get_cache(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return virtio_lduw_phys(vdev, pa);
+    if (unlikely(vq->cache.state == VRING_CACHE_STALE)) {
+        vring_cache_update(vq);
+    }
+    return vq->cache.state == VRING_CACHE_MAPPED ? &vq->cache : NULL;
 }
 
-static inline uint16_t vring_desc_next(VirtIODevice *vdev, hwaddr desc_pa,
-                                       int i)
+/* Stores to the used ring must be seen by migration and by TCG */
+static inline void vring_used_written(VRingCache *cache, hwaddr offset,
+                                      hwaddr len)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return virtio_lduw_phys(vdev, pa);
+    cpu_physical_memory_set_written(cache->used_ram_addr + offset, len);
+}
+
+static void virtio_memory_commit(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice,
+                                      memory_listener);
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        vring_cache_invalidate(&vdev->vq[i]);
+    }
+}
+
+/* virt queue functions */
+static void virtqueue_init(VirtQueue *vq)
+{
+    hwaddr pa = vq->pa;
+
+    vq->vring.desc = pa;
+    vq->vring.avail = pa + vq->vring.num * sizeof(VRingDesc);
+    vq->vring.used = vring_align(vq->vring.avail +
+                                 offsetof(VRingAvail, ring[vq->vring.num]),
+                                 vq->vring.align);
+    vring_cache_invalidate(vq);
+}
+
+/*
+ * Read descriptor @i of the table at @desc_pa, which is either the ring
+ * of @vq or an indirect table.
+ */
+static void vring_desc_read(VirtQueue *vq, VRingDesc *desc, hwaddr desc_pa,
+                            int i)
+{
+    VirtIODevice *vdev = vq->vdev;
+    VRingCache *cache = vring_get_cache(vq);
+
+    if (cache && desc_pa == vq->vring.desc) {
+        *desc = cache->desc[i];
+    } else {
+        address_space_read(&address_space_memory,
+                           desc_pa + sizeof(VRingDesc) * i,
+                           (uint8_t *)desc, sizeof(*desc));
+    }
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->flags);
+    virtio_tswap16s(vdev, &desc->next);
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
+    VRingCache *cache = vring_get_cache(vq);
     hwaddr pa;
+
+    if (cache) {
+        return virtio_tswap16(vq->vdev, atomic_read(&cache->avail->flags));
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, flags);
     return virtio_lduw_phys(vq->vdev, pa);
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
+    VRingCache *cache = vring_get_cache(vq);
     hwaddr pa;
+
+    if (cache) {
+        return virtio_tswap16(vq->vdev, atomic_read(&cache->avail->idx));
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, idx);
     return virtio_lduw_phys(vq->vdev, pa);
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
+    VRingCache *cache = vring_get_cache(vq);
     hwaddr pa;
+
+    if (cache) {
+        return virtio_tswap16(vq->vdev, atomic_read(&cache->avail->ring[i]));
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
     return virtio_lduw_phys(vq->vdev, pa);
 }
@@ -160,56 +294,91 @@ static inline uint16_t vring_used_event(VirtQueue *vq)
     return vring_avail_ring(vq, vq->vring.num);
 }
 
-static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
+static inline void vring_used_ring_elem(VirtQueue *vq, int i, uint32_t id,
+                                        uint32_t len)
 {
+    VRingCache *cache = vring_get_cache(vq);
     hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
-    virtio_stl_phys(vq->vdev, pa, val);
-}
 
-static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
-{
-    hwaddr pa;
+    if (cache) {
+        VRingUsedElem *elem = &cache->used->ring[i];
+
+        elem->id = virtio_tswap32(vq->vdev, id);
+        elem->len = virtio_tswap32(vq->vdev, len);
+        vring_used_written(cache, offsetof(VRingUsed, ring[i]),
+                           sizeof(*elem));
+        return;
+    }
+    pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
+    virtio_stl_phys(vq->vdev, pa, id);
     pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
-    virtio_stl_phys(vq->vdev, pa, val);
+    virtio_stl_phys(vq->vdev, pa, len);
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
+    VRingCache *cache = vring_get_cache(vq);
     hwaddr pa;
+
+    if (cache) {
+        return virtio_tswap16(vq->vdev, atomic_read(&cache->used->idx));
+    }
     pa = vq->vring.used + offsetof(VRingUsed, idx);
     return virtio_lduw_phys(vq->vdev, pa);
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
+    VRingCache *cache = vring_get_cache(vq);
     hwaddr pa;
+
+    if (cache) {
+        atomic_set(&cache->used->idx, virtio_tswap16(vq->vdev, val));
+        vring_used_written(cache, offsetof(VRingUsed, idx), sizeof(uint16_t));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, idx);
     virtio_stw_phys(vq->vdev, pa, val);
 }
 
-static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
+static inline void vring_used_flags_set(VirtQueue *vq, uint16_t set,
+                                        uint16_t clear)
 {
     VirtIODevice *vdev = vq->vdev;
+    VRingCache *cache = vring_get_cache(vq);
     hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) | mask);
-}
+    uint16_t flags;
 
-static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
-{
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
+    if (cache) {
+        flags = virtio_tswap16(vdev, atomic_read(&cache->used->flags));
+        flags = (flags | set) & ~clear;
+        atomic_set(&cache->used->flags, virtio_tswap16(vdev, flags));
+        vring_used_written(cache, offsetof(VRingUsed, flags),
+                           sizeof(uint16_t));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) & ~mask);
+    flags = virtio_lduw_phys(vdev, pa);
+    virtio_stw_phys(vdev, pa, (flags | set) & ~clear);
 }
 
 static inline void vring_avail_event(VirtQueue *vq, uint16_t val)
 {
+    VRingCache *cache;
     hwaddr pa;
+
     if (!vq->notification) {
         return;
     }
+    cache = vring_get_cache(vq);
+    if (cache) {
+        uint16_t *event = (uint16_t *)&cache->used->ring[vq->vring.num];
+
+        atomic_set(event, virtio_tswap16(vq->vdev, val));
+        vring_used_written(cache, offsetof(VRingUsed, ring[vq->vring.num]),
+                           sizeof(uint16_t));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
     virtio_stw_phys(vq->vdev, pa, val);
 }
@@ -220,9 +389,9 @@ void virtio_queue_set_notification(VirtQueue *vq, int enable)
     if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
         vring_avail_event(vq, vring_avail_idx(vq));
     } else if (enable) {
-        vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
+        vring_used_flags_set(vq, 0, VRING_USED_F_NO_NOTIFY);
     } else {
-        vring_used_flags_set_bit(vq, VRING_USED_F_NO_NOTIFY);
+        vring_used_flags_set(vq, VRING_USED_F_NO_NOTIFY, 0);
     }
     if (enable) {
         /* Expose avail event/used flags before caller checks the avail idx. */
@@ -237,7 +406,11 @@ int virtio_queue_ready(VirtQueue *vq)
 
 int virtio_queue_empty(VirtQueue *vq)
 {
-    return vring_avail_idx(vq) == vq->last_avail_idx;
+    if (vq->shadow_avail_idx != vq->last_avail_idx) {
+        return 0;
+    }
+    vq->shadow_avail_idx = vring_avail_idx(vq);
+    return vq->shadow_avail_idx == vq->last_avail_idx;
 }
 
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
@@ -264,11 +437,10 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                                   elem->out_sg[i].iov_len,
                                   0, elem->out_sg[i].iov_len);
 
-    idx = (idx + vring_used_idx(vq)) % vq->vring.num;
+    idx = (idx + vq->used_idx) % vq->vring.num;
 
     /* Get a pointer to the next entry in the used ring. */
-    vring_used_ring_id(vq, idx, elem->index);
-    vring_used_ring_len(vq, idx, len);
+    vring_used_ring_elem(vq, idx, elem->index, len);
 }
 
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
@@ -277,9 +449,10 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
     /* Make sure buffer is written before we update index. */
     smp_wmb();
     trace_virtqueue_flush(vq, count);
-    old = vring_used_idx(vq);
+    old = vq->used_idx;
     new = old + count;
     vring_used_idx_set(vq, new);
+    vq->used_idx = new;
     vq->inuse -= count;
     if (unlikely((int16_t)(new - vq->signalled_used) < (uint16_t)(new - old)))
         vq->signalled_used_valid = false;
@@ -294,12 +467,20 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
 
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
-    uint16_t num_heads = vring_avail_idx(vq) - idx;
+    uint16_t num_heads = vq->shadow_avail_idx - idx;
+
+    /* Heads we already know of were ordered by the read that found them */
+    if (num_heads && num_heads <= vq->vring.num) {
+        return num_heads;
+    }
+
+    vq->shadow_avail_idx = vring_avail_idx(vq);
+    num_heads = vq->shadow_avail_idx - idx;
 
     /* Check it isn't doing very strange things with descriptor numbers. */
     if (num_heads > vq->vring.num) {
         error_report("Guest moved used index from %u to %u",
-                     idx, vring_avail_idx(vq));
+                     idx, vq->shadow_avail_idx);
         exit(1);
     }
     /* On success, callers read a descriptor at vq->last_avail_idx.
@@ -328,21 +509,18 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(VirtIODevice *vdev, hwaddr desc_pa,
-                                    unsigned int i, unsigned int max)
+static unsigned virtqueue_next_desc(const VRingDesc *desc, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_NEXT)) {
+    if (!(desc->flags & VRING_DESC_F_NEXT)) {
         return max;
     }
 
-    /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(vdev, desc_pa, i);
-    /* Make sure compiler knows to grab that: we don't want it changing! */
-    smp_wmb();
-
+    /* Check they're not leading us off end of descriptors.  The descriptor
+     * is our own copy, so it cannot change under us. */
+    next = desc->next;
     if (next >= max) {
         error_report("Desc next is %u", next);
         exit(1);
@@ -362,8 +540,8 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
-        VirtIODevice *vdev = vq->vdev;
         unsigned int max, num_bufs, indirect = 0;
+        VRingDesc desc;
         hwaddr desc_pa;
         int i;
 
@@ -371,9 +549,10 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
+        vring_desc_read(vq, &desc, desc_pa, i);
 
-        if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(vdev, desc_pa, i) % sizeof(VRingDesc)) {
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -386,9 +565,10 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(vdev, desc_pa, i) / sizeof(VRingDesc);
-            desc_pa = vring_desc_addr(vdev, desc_pa, i);
+            max = desc.len / sizeof(VRingDesc);
+            desc_pa = desc.addr;
             num_bufs = i = 0;
+            vring_desc_read(vq, &desc, desc_pa, i);
         }
 
         do {
@@ -398,15 +578,20 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                 exit(1);
             }
 
-            if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_WRITE) {
-                in_total += vring_desc_len(vdev, desc_pa, i);
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
             } else {
-                out_total += vring_desc_len(vdev, desc_pa, i);
+                out_total += desc.len;
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_next_desc(vdev, desc_pa, i, max)) != max);
+
+            i = virtqueue_next_desc(&desc, max);
+            if (i != max) {
+                vring_desc_read(vq, &desc, desc_pa, i);
+            }
+        } while (i != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -458,6 +643,7 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     unsigned int i, head, max;
     hwaddr desc_pa = vq->vring.desc;
     VirtIODevice *vdev = vq->vdev;
+    VRingDesc desc;
 
     if (!virtqueue_num_heads(vq, vq->last_avail_idx))
         return 0;
@@ -472,46 +658,53 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
         vring_avail_event(vq, vq->last_avail_idx);
     }
 
-    if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(vdev, desc_pa, i) % sizeof(VRingDesc)) {
+    vring_desc_read(vq, &desc, desc_pa, i);
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(vdev, desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(vdev, desc_pa, i);
+        max = desc.len / sizeof(VRingDesc);
+        desc_pa = desc.addr;
         i = 0;
+        vring_desc_read(vq, &desc, desc_pa, i);
     }
 
     /* Collect all the descriptors */
     do {
         struct iovec *sg;
 
-        if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_WRITE) {
+        if (desc.flags & VRING_DESC_F_WRITE) {
             if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
                 error_report("Too many write descriptors in indirect table");
                 exit(1);
             }
-            elem->in_addr[elem->in_num] = vring_desc_addr(vdev, desc_pa, i);
+            elem->in_addr[elem->in_num] = desc.addr;
             sg = &elem->in_sg[elem->in_num++];
         } else {
             if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
                 error_report("Too many read descriptors in indirect table");
                 exit(1);
             }
-            elem->out_addr[elem->out_num] = vring_desc_addr(vdev, desc_pa, i);
+            elem->out_addr[elem->out_num] = desc.addr;
             sg = &elem->out_sg[elem->out_num++];
         }
 
-        sg->iov_len = vring_desc_len(vdev, desc_pa, i);
+        sg->iov_len = desc.len;
 
         /* If we've got too many, that implies a descriptor loop. */
         if ((elem->in_num + elem->out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(vdev, desc_pa, i, max)) != max);
+
+        i = virtqueue_next_desc(&desc, max);
+        if (i != max) {
+            vring_desc_read(vq, &desc, desc_pa, i);
+        }
+    } while (i != max);
 
     /* Now map what we have collected */
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
@@ -603,7 +796,10 @@ void virtio_reset(void *opaque)
         vdev->vq[i].vring.desc = 0;
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
+        vring_cache_invalidate(&vdev->vq[i]);
         vdev->vq[i].last_avail_idx = 0;
+        vdev->vq[i].shadow_avail_idx = 0;
+        vdev->vq[i].used_idx = 0;
         vdev->vq[i].pa = 0;
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].signalled_used = 0;
@@ -810,6 +1006,7 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
     }
 
     vdev->vq[n].vring.num = 0;
+    vring_cache_invalidate(&vdev->vq[n]);
 }
 
 void virtio_irq(VirtQueue *vq)
@@ -851,7 +1048,7 @@ static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
     v = vq->signalled_used_valid;
     vq->signalled_used_valid = true;
     old = vq->signalled_used;
-    new = vq->signalled_used = vring_used_idx(vq);
+    new = vq->signalled_used = vq->used_idx;
     return !v || vring_need_event(vring_used_event(vq), new, old);
 }
 
@@ -1077,8 +1274,10 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
     }
 
     for (i = 0; i < num; i++) {
+        vdev->vq[i].shadow_avail_idx = vdev->vq[i].last_avail_idx;
         if (vdev->vq[i].pa) {
             uint16_t nheads;
+            vdev->vq[i].used_idx = vring_used_idx(&vdev->vq[i]);
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
             /* Check it isn't doing strange things with descriptor numbers. */
             if (nheads > vdev->vq[i].vring.num) {
@@ -1097,6 +1296,11 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        vring_cache_invalidate(&vdev->vq[i]);
+    }
     qemu_del_vm_change_state_handler(vdev->vmstate);
     g_free(vdev->config);
     g_free(vdev->vq);
@@ -1214,6 +1418,11 @@ uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
 void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
 {
     vdev->vq[n].last_avail_idx = idx;
+    vdev->vq[n].shadow_avail_idx = idx;
+    /* Whoever ran the queue meanwhile (vhost, data plane) moved used idx */
+    if (vdev->vq[n].vring.desc) {
+        vdev->vq[n].used_idx = vring_used_idx(&vdev->vq[n]);
+    }
 }
 
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
@@ -1309,6 +1518,11 @@ static void virtio_device_realize(DeviceState *dev, Error **errp)
         }
     }
     virtio_bus_device_plugged(vdev);
+
+    vdev->memory_listener = (MemoryListener) {
+        .commit = virtio_memory_commit,
+    };
+    memory_listener_register(&vdev->memory_listener, &address_space_memory);
 }
 
 static void virtio_device_unrealize(DeviceState *dev, Error **errp)
@@ -1317,6 +1531,7 @@ static void virtio_device_unrealize(DeviceState *dev, Error **errp)
     VirtioDeviceClass *vdc = VIRTIO_DEVICE_GET_CLASS(dev);
     Error *err = NULL;
 
+    memory_listener_unregister(&vdev->memory_listener);
     virtio_bus_device_unplugged(vdev);
 
     if (vdc->unrealize != NULL) {
@@ -14,6 +14,9 @@
 
 #include "android/opengles.h"
 
+#include <stdbool.h>
+#include <stdint.h>
+
 // The Android GPU emulation (EmuGL) libraries provide a way to send GPU
 // frame data to its client, but will do so by calling a user-provided
 // callback in an EmuGL-created thread. The corresponding data cannot be
@@ -37,4 +40,83 @@ typedef void (GpuFrameBridgeCallback)(void* opaque,
 void android_gpu_frame_bridge_init(GpuFrameBridgeCallback* callback,
                                    void* callback_opaque);
 
+// A rectangle within a GPU frame, empty if |w| or |h| is 0.
+typedef struct {
+    int x;
+    int y;
+    int w;
+    int h;
+} GpuFrameRect;
+
+// Same as GpuFrameBridgeCallback, but also receives the area of the frame
+// that changed since the previous call. |damage| can be empty when the
+// frame is identical to the previous one.
+typedef void (GpuFrameBridgeDamageCallback)(void* opaque,
+                                            int width,
+                                            int height,
+                                            const void* pixels,
+                                            const GpuFrameRect* damage);
+
+// Tuning parameters for android_gpu_frame_bridge_init_with_options().
+//
+//   max_frames: number of frame slots, i.e. how many frames can be
+//      pending or being delivered at once. 0 selects the default.
+//
+//   width, height: expected frame size. If known, the slot buffers are
+//      allocated up front, otherwise they are allocated with the first
+//      frames, and grown on resolution changes.
+//
+//   drop_stale: if true, posting a frame while all slots are busy drops
+//      the oldest pending frame instead of blocking the EmuGL thread until
+//      the main loop catches up.
+//
+//   mailbox: if true, posting a frame replaces any pending one, so that
+//      the main loop only ever receives the most recent frame and the
+//      EmuGL thread never blocks. This uses 3 slots by default.
+//
+//   damage_callback: if not NULL, called instead of the regular callback
+//      with the damaged area of each frame. Damage is computed by comparing
+//      each posted frame with the previous one, and merged across dropped
+//      frames.
+//
+typedef struct {
+    int max_frames;
+    int width;
+    int height;
+    bool drop_stale;
+    bool mailbox;
+    GpuFrameBridgeDamageCallback* damage_callback;
+} GpuFrameBridgeOptions;
+
+// Same as android_gpu_frame_bridge_init(), with explicit |options|, which
+// can be NULL to use the defaults.
+void android_gpu_frame_bridge_init_with_options(
+        GpuFrameBridgeCallback* callback,
+        void* callback_opaque,
+        const GpuFrameBridgeOptions* options);
+
+// Frame counters, see android_gpu_frame_bridge_get_stats().
+//
+//   posted, consumed, dropped: number of frames posted by EmuGL, delivered
+//      to the callback, and discarded without being delivered.
+//
+//   queue_depth, max_queue_depth: current and highest number of pending
+//      frames.
+//
+//   latency_total_ns, latency_max_ns: total and highest delay between a
+//      frame being posted and being delivered, in nanoseconds.
+//
+typedef struct {
+    uint64_t posted;
+    uint64_t consumed;
+    uint64_t dropped;
+    int queue_depth;
+    int max_queue_depth;
+    int64_t latency_total_ns;
+    int64_t latency_max_ns;
+} GpuFrameBridgeStats;
+
+// Retrieve the bridge's counters, can be called from any thread.
+void android_gpu_frame_bridge_get_stats(GpuFrameBridgeStats* stats);
+
 #endif  // ANDROID_GPU_FRAME_BRIDGE_H
@@ -0,0 +1,44 @@
+/* Copyright (C) 2016 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#ifndef ANDROID_OPENGLES_GUEST_RAM_H
+#define ANDROID_OPENGLES_GUEST_RAM_H
+
+/* Guest physical memory map given to the GLES renderer.
+ *
+ * With -mem-shared, guest RAM is made of anonymous shared files, and the
+ * emulator tells the renderer where each range of guest physical addresses
+ * is, both in the emulator's address space and in those files. A guest
+ * that knows about it can then describe a graphics buffer update by its
+ * guest physical address, size and stride instead of streaming the pixels
+ * through the 'opengles' pipe, and the renderer reads them in place, or
+ * maps the file to import the pages into the host GPU driver.
+ *
+ * The emulator sends the whole table again, from its main loop, whenever
+ * the guest memory map changes. The renderer must copy what it needs: the
+ * table only lives for the duration of the call, and the ranges missing
+ * from a new table may be unmapped as soon as the call returns. The file
+ * descriptors remain owned by the emulator, the renderer must dup() those
+ * it wants to keep. The declarations below must be equivalent to those
+ * used by the renderer library.
+ */
+
+#include <stdint.h>
+
+typedef struct OpenglesGuestRamRange {
+    uint64_t gpa;           /* guest physical address of the range */
+    uint64_t size;          /* in bytes */
+    void* host;             /* where the emulator maps it */
+    int fd;                 /* file backing it, or -1 if there is none */
+    uint64_t fd_offset;     /* offset of |gpa| in |fd| */
+} OpenglesGuestRamRange;
+
+#endif /* ANDROID_OPENGLES_GUEST_RAM_H */
@@ -0,0 +1,87 @@
+/* Copyright (C) 2016 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#ifndef ANDROID_OPENGLES_RING_H
+#define ANDROID_OPENGLES_RING_H
+
+/* In-process transport for the GLES streams.
+ *
+ * The GLES renderer library is loaded in the emulator process, so instead
+ * of a socket each 'opengles' pipe can use a pair of memory rings that
+ * both sides access directly: guest command buffers are copied once into
+ * |to_renderer|, and replies are copied once from |from_renderer| into
+ * guest memory.
+ *
+ * Each ring has a single producer and a single consumer. The producer
+ * only writes |head|, the consumer only writes |tail|, both are
+ * free-running indices and the byte at index i is data[i & (size - 1)].
+ * A side publishes data or free space with a release barrier before
+ * updating its index, and reads the other index with an acquire barrier.
+ *
+ * The doorbells are only used on the slow path: a consumer finding the
+ * ring empty (or a producer finding it full) sets |consumer_waiting|
+ * (resp. |producer_waiting|), issues a full barrier, checks the ring
+ * again, then sleeps on its doorbell. The other side, after updating its
+ * index and issuing a full barrier, atomically clears the flag and, if it
+ * was set, rings that doorbell. When both sides keep up, no system call
+ * is made.
+ *
+ * On POSIX hosts a doorbell is an eventfd or a pipe. On Windows, where the
+ * GLES streams would otherwise go through loopback TCP, it is a
+ * manual-reset event: the ringing side calls SetEvent(), the waiting side
+ * calls ResetEvent() once it is awake, before checking the ring again.
+ *
+ * The emulator allocates everything and keeps ownership of it; the
+ * renderer must stop using a stream once its closeRingStream() entry point
+ * returns. The declarations below must be equivalent to those used by the
+ * renderer library.
+ */
+
+#include <stdint.h>
+
+/* Size of the data area of each ring, must be a power of 2. */
+#define OPENGLES_RING_SIZE  (1U << 20)
+
+typedef struct OpenglesRing {
+    uint32_t size;                  /* data area size, power of 2 */
+    uint32_t reserved[15];
+    /* Written by the producer, on its own cache line. */
+    uint32_t head;
+    uint32_t consumer_waiting;
+    uint32_t reserved_producer[14];
+    /* Written by the consumer, on its own cache line. */
+    uint32_t tail;
+    uint32_t producer_waiting;
+    uint32_t reserved_consumer[14];
+    uint8_t  data[];
+} OpenglesRing;
+
+typedef struct OpenglesRingStream {
+    OpenglesRing* to_renderer;      /* emulator -> renderer */
+    OpenglesRing* from_renderer;    /* renderer -> emulator */
+#ifdef _WIN32
+    /* Event HANDLEs: the renderer waits on |renderer_event|, which the
+     * emulator sets, and sets |emulator_event|. */
+    void* renderer_event;
+    void* emulator_event;
+#else
+    /* Doorbell of the renderer side: the emulator writes an 8-byte
+     * counter increment to |renderer_notify_fd|, the renderer polls
+     * |renderer_wait_fd|. These may be the same eventfd. */
+    int renderer_notify_fd;
+    int renderer_wait_fd;
+    /* Doorbell of the emulator side, written by the renderer. */
+    int emulator_notify_fd;
+#endif
+    void* renderer_opaque;          /* for use by the renderer */
+} OpenglesRingStream;
+
+#endif /* ANDROID_OPENGLES_RING_H */
@@ -68,6 +68,27 @@ void android_stopOpenglesRenderer(void);
  */
 void android_gles_server_path(char* buff, size_t buffsize);
 
+struct OpenglesRingStream;
+
+/* Connect |stream| to the renderer through its in-process transport, see
+ * android/opengles-ring.h. Returns 0 on success, or -1 if the renderer
+ * isn't started or doesn't support it, in which case clients should use
+ * the socket returned by android_gles_server_path() instead.
+ */
+int android_gles_ring_open(struct OpenglesRingStream* stream);
+
+/* Disconnect a stream opened with android_gles_ring_open(). */
+void android_gles_ring_close(struct OpenglesRingStream* stream);
+
+struct OpenglesGuestRamRange;
+
+/* Give the renderer the |count| ranges of guest RAM, see
+ * android/opengles-guest-ram.h. Returns -1 if the renderer isn't started
+ * or can't read guest memory directly.
+ */
+int android_gles_set_guest_ram(const struct OpenglesGuestRamRange* ranges,
+                               int count);
+
 #endif
 
 #endif /* ANDROID_OPENGLES_H */
@@ -0,0 +1,263 @@
+/* Copyright (C) 2016 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#ifndef ANDROID_SHM_CHANNEL_H
+#define ANDROID_SHM_CHANNEL_H
+
+/* Bulk data channels between host tools and guest services.
+ *
+ * An ivshmem device backed by a POSIX shared memory object, e.g.
+ *
+ *   -device ivshmem,shm=avd-test,size=64M,channels=4
+ *
+ * is seen by guest services as BAR 2 of the PCI device (through the UIO
+ * driver, or resource2 in sysfs), and by host tools as /dev/shm/avd-test.
+ * With 'channels', the emulator lays the region out as below when it
+ * creates the object; a tool that creates the object itself, before the
+ * emulator starts, calls shm_channel_format() instead. Either way, both
+ * sides then call shm_channel_attach() on their mapping.
+ *
+ * Each channel is a pair of rings, one in each direction. A ring has a
+ * single producer and a single consumer and carries records: the producer
+ * gets room for a record with shm_ring_reserve(), writes the payload in
+ * place and publishes it with shm_ring_commit(); the consumer gets the
+ * next record with shm_ring_peek(), uses it in place and gives the room
+ * back with shm_ring_release(). No copy is made besides the producer
+ * writing its data, so a screen buffer or a trace can be handed over at
+ * memory speed.
+ *
+ * The producer only writes |head|, the consumer only writes |tail|, both
+ * are free-running byte indices and the data at index i is at
+ * data_offset + (i & (size - 1)) in the region. A record starts on an
+ * 8-byte boundary with a 32-bit length and 32-bit flags; a record that
+ * would not fit before the end of the data area is preceded by a padding
+ * record up to it. Indices are published with release semantics and read
+ * with acquire semantics.
+ *
+ * The rings don't wake anybody: a side finding its ring empty or full
+ * polls, or sleeps on a doorbell of its own, such as ivshmem interrupts
+ * when the device is connected to an ivshmem server.
+ *
+ * This header does not depend on QEMU, and is meant to be copied as is
+ * into guest services and host tools.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SHM_CHANNEL_MAGIC       0x48434d53      /* "SMCH" */
+#define SHM_CHANNEL_VERSION     1
+#define SHM_CHANNEL_MAX         16
+
+/* Smallest ring data area */
+#define SHM_RING_MIN_SIZE       4096
+
+#define SHM_RING_RECORD_PAD     1U              /* flags of a padding record */
+
+typedef struct ShmRing {
+    uint32_t size;                  /* data area size, power of 2 */
+    uint32_t reserved;
+    uint64_t data_offset;           /* of the data area in the region */
+    uint32_t reserved_config[12];
+    /* Written by the producer, on its own cache line. */
+    uint32_t head;
+    uint32_t reserved_producer[15];
+    /* Written by the consumer, on its own cache line. */
+    uint32_t tail;
+    uint32_t reserved_consumer[15];
+} ShmRing;
+
+typedef struct ShmChannel {
+    ShmRing to_guest;               /* host tool -> guest service */
+    ShmRing to_host;                /* guest service -> host tool */
+} ShmChannel;
+
+typedef struct ShmChannelHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nchannels;
+    uint32_t reserved;
+    uint64_t region_size;
+    uint32_t reserved_header[10];
+    ShmChannel channels[SHM_CHANNEL_MAX];
+} ShmChannelHeader;
+
+typedef struct ShmRecord {
+    uint32_t len;                   /* of the payload that follows */
+    uint32_t flags;
+} ShmRecord;
+
+static inline uint32_t shm_ring_align(uint32_t len)
+{
+    return (len + 7) & ~7U;
+}
+
+static inline uint8_t* shm_ring_at(void* base, const ShmRing* ring,
+                                   uint32_t index)
+{
+    return (uint8_t*)base + ring->data_offset + (index & (ring->size - 1));
+}
+
+/* Lay out |nchannels| channels in the |size| bytes at |base|, sharing the
+ * room left by the header equally between the rings. The header is
+ * written last, so a side attaching concurrently sees nothing before the
+ * layout is complete. Returns 0, or -1 if the region is too small.
+ */
+static inline int shm_channel_format(void* base, uint64_t size,
+                                     uint32_t nchannels)
+{
+    ShmChannelHeader* h = (ShmChannelHeader*)base;
+    uint64_t offset = (sizeof(*h) + 4095) & ~(uint64_t)4095;
+    uint64_t per_ring;
+    uint32_t ring_size = SHM_RING_MIN_SIZE;
+    uint32_t i;
+
+    if (nchannels == 0 || nchannels > SHM_CHANNEL_MAX ||
+        size < offset + 2ULL * nchannels * SHM_RING_MIN_SIZE) {
+        return -1;
+    }
+    per_ring = (size - offset) / (2ULL * nchannels);
+    while (ring_size < (1U << 31) && 2ULL * ring_size <= per_ring) {
+        ring_size *= 2;
+    }
+
+    __atomic_store_n(&h->magic, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    memset(h, 0, sizeof(*h));
+    h->version = SHM_CHANNEL_VERSION;
+    h->nchannels = nchannels;
+    h->region_size = size;
+    for (i = 0; i < nchannels; i++) {
+        h->channels[i].to_guest.size = ring_size;
+        h->channels[i].to_guest.data_offset = offset;
+        offset += ring_size;
+        h->channels[i].to_host.size = ring_size;
+        h->channels[i].to_host.data_offset = offset;
+        offset += ring_size;
+    }
+    __atomic_store_n(&h->magic, SHM_CHANNEL_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Check the layout of the |size| bytes mapped at |base|. Returns the
+ * header, or NULL if the region is not formatted or is inconsistent.
+ */
+static inline ShmChannelHeader* shm_channel_attach(void* base, uint64_t size)
+{
+    ShmChannelHeader* h = (ShmChannelHeader*)base;
+    uint32_t i;
+
+    if (size < sizeof(*h) ||
+        __atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != SHM_CHANNEL_MAGIC ||
+        h->version != SHM_CHANNEL_VERSION ||
+        h->nchannels == 0 || h->nchannels > SHM_CHANNEL_MAX ||
+        h->region_size > size) {
+        return NULL;
+    }
+    for (i = 0; i < 2 * h->nchannels; i++) {
+        const ShmRing* ring = i & 1 ? &h->channels[i / 2].to_host
+                                    : &h->channels[i / 2].to_guest;
+
+        if (ring->size < SHM_RING_MIN_SIZE ||
+            (ring->size & (ring->size - 1)) ||
+            ring->size > h->region_size ||
+            ring->data_offset < sizeof(*h) ||
+            ring->data_offset > h->region_size - ring->size) {
+            return NULL;
+        }
+    }
+    return h;
+}
+
+/* Producer side: return room for a record of |len| bytes in the data
+ * area, or NULL if the ring is too full or the record is too large to
+ * ever fit: payloads can take up to half the ring, less a record header.
+ */
+static inline void* shm_ring_reserve(void* base, ShmRing* ring, uint32_t len)
+{
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t need = sizeof(ShmRecord) + shm_ring_align(len);
+    uint32_t to_end = ring->size - (head & (ring->size - 1));
+    uint32_t room = ring->size - (head - tail);
+
+    if (len > ring->size / 2 - sizeof(ShmRecord)) {
+        return NULL;
+    }
+    if (need > to_end) {
+        ShmRecord* pad;
+
+        if (to_end + need > room) {
+            return NULL;
+        }
+        pad = (ShmRecord*)shm_ring_at(base, ring, head);
+        pad->len = to_end - sizeof(ShmRecord);
+        pad->flags = SHM_RING_RECORD_PAD;
+        head += to_end;
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    } else if (need > room) {
+        return NULL;
+    }
+    return shm_ring_at(base, ring, head) + sizeof(ShmRecord);
+}
+
+/* Producer side: publish the record of |len| bytes, which must not exceed
+ * that given to the last shm_ring_reserve() call.
+ */
+static inline void shm_ring_commit(void* base, ShmRing* ring, uint32_t len)
+{
+    ShmRecord* rec = (ShmRecord*)shm_ring_at(base, ring, ring->head);
+
+    rec->len = len;
+    rec->flags = 0;
+    __atomic_store_n(&ring->head,
+                     ring->head + sizeof(ShmRecord) + shm_ring_align(len),
+                     __ATOMIC_RELEASE);
+}
+
+/* Consumer side: return the payload of the next record and set |*len| to
+ * its length, or return NULL if the ring is empty. The payload stays
+ * valid until shm_ring_release().
+ */
+static inline void* shm_ring_peek(void* base, ShmRing* ring, uint32_t* len)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = ring->tail;
+    ShmRecord* rec;
+
+    if (tail == head) {
+        return NULL;
+    }
+    rec = (ShmRecord*)shm_ring_at(base, ring, tail);
+    if (rec->flags & SHM_RING_RECORD_PAD) {
+        tail += sizeof(ShmRecord) + rec->len;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        if (tail == head) {
+            return NULL;
+        }
+        rec = (ShmRecord*)shm_ring_at(base, ring, tail);
+    }
+    *len = rec->len;
+    return rec + 1;
+}
+
+/* Consumer side: give back the room of the record last peeked at. */
+static inline void shm_ring_release(void* base, ShmRing* ring)
+{
+    ShmRecord* rec = (ShmRecord*)shm_ring_at(base, ring, ring->tail);
+
+    __atomic_store_n(&ring->tail,
+                     ring->tail + sizeof(ShmRecord) + shm_ring_align(rec->len),
+                     __ATOMIC_RELEASE);
+}
+
+#endif /* ANDROID_SHM_CHANNEL_H */
@@ -35,11 +35,34 @@ enum BlockAcctType {
     BLOCK_MAX_IOTYPE,
 };
 
+#define BLOCK_LATENCY_MAX_BINS  32
+
+/*
+ * Counts of requests by latency. Bin 0 counts requests completing in
+ * less than boundaries[0] ns, bin i those taking from boundaries[i - 1]
+ * up to boundaries[i], and the last bin all the slower ones. A histogram
+ * with no bins is disabled.
+ */
+typedef struct BlockLatencyHistogram {
+    unsigned int nbins;
+    uint64_t boundaries[BLOCK_LATENCY_MAX_BINS - 1];
+    uint64_t bins[BLOCK_LATENCY_MAX_BINS];
+} BlockLatencyHistogram;
+
 typedef struct BlockAcctStats {
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
     uint64_t nr_ops[BLOCK_MAX_IOTYPE];
     uint64_t total_time_ns[BLOCK_MAX_IOTYPE];
+    uint64_t merged[BLOCK_MAX_IOTYPE];
+    uint64_t flush_coalesced;
+    uint64_t throttled_ns;
     uint64_t wr_highest_sector;
+    BlockLatencyHistogram latency[BLOCK_MAX_IOTYPE];
+    /* Requests in flight, and their count integrated over time */
+    unsigned int queue_depth;
+    unsigned int max_queue_depth;
+    uint64_t queue_depth_ns;
+    int64_t queue_depth_time_ns;
 } BlockAcctStats;
 
 typedef struct BlockAcctCookie {
@@ -48,10 +71,20 @@ typedef struct BlockAcctCookie {
     enum BlockAcctType type;
 } BlockAcctCookie;
 
+void block_acct_init(BlockAcctStats *stats);
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type);
 void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie);
+void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
+                           int num_requests);
+void block_acct_throttled(BlockAcctStats *stats, int64_t ns);
 void block_acct_highest_sector(BlockAcctStats *stats, int64_t sector_num,
                                unsigned int nb_sectors);
+void block_acct_request_begin(BlockAcctStats *stats);
+void block_acct_request_end(BlockAcctStats *stats);
+uint64_t block_acct_queue_depth_ns(BlockAcctStats *stats);
+int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
+                                const uint64_t *boundaries,
+                                unsigned int nboundaries);
 
 #endif
@@ -47,6 +47,7 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
 
 struct AioContext {
     GSource source;
@@ -85,6 +86,28 @@ struct AioContext {
     /* GPollFDs for aio_poll() */
     GArray *pollfds;
 
+    /* Number of handlers that have not been deleted */
+    int n_handlers;
+
+    /* Once there are enough handlers, they are kept registered in this
+     * epoll set and only epollfd is polled, through epoll_pfd when the
+     * context is used as a GSource.  -1 while handlers are polled one
+     * by one.
+     */
+    int epollfd;
+    GPollFD epoll_pfd;
+    bool epoll_disabled;
+
+    /* Number of handlers with an io_poll callback */
+    int n_poll_handlers;
+
+    /* How long aio_poll() spins on the poll handlers before it blocks.
+     * poll_ns adapts between 0 and poll_max_ns to how long recent waits
+     * lasted; a poll_max_ns of 0 disables polling.
+     */
+    int64_t poll_max_ns;
+    int64_t poll_ns;
+
     /* Thread pool for performing work and receiving completion callbacks */
     struct ThreadPool *thread_pool;
 
@@ -266,6 +289,35 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             EventNotifierHandler *io_read);
 
+/* Give a registered file descriptor a poll handler.  When the context has
+ * a polling window, a blocking aio_poll() calls @io_poll repeatedly for up
+ * to that long before it goes to sleep; @io_poll checks for work without
+ * waiting for the descriptor, for example by looking at a ring in guest
+ * memory, does it, and returns true if there was any.
+ *
+ * Pass NULL to remove the poll handler.  Removing the fd handler removes
+ * it too.  Polling is only implemented on POSIX hosts.
+ */
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll);
+
+/* Same as aio_set_fd_poll() for a registered event notifier.  @io_poll is
+ * passed the notifier.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
+
+/**
+ * aio_context_set_poll_max_ns:
+ * @ctx: the aio context
+ * @max_ns: longest polling window in nanoseconds, 0 to disable polling
+ *
+ * Set how long a blocking aio_poll() may spin on the poll handlers before
+ * it sleeps.  The window actually used grows while waits end within
+ * @max_ns and is dropped when they last longer.
+ */
+void aio_context_set_poll_max_ns(AioContext *ctx, int64_t max_ns);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -200,6 +200,8 @@ struct BlockDriver {
                                   const char *name,
                                   Error **errp);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
+    /* A host file with the same contents as @bs at the same offsets */
+    int (*bdrv_get_host_fd)(BlockDriverState *bs);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, QEMUIOVector *qiov,
@@ -298,6 +300,7 @@ typedef struct BlockLimits {
 } BlockLimits;
 
 typedef struct BdrvOpBlocker BdrvOpBlocker;
+typedef struct HostThrottleMember HostThrottleMember;
 
 typedef struct BdrvAioNotifier {
     void (*attached_aio_context)(AioContext *new_context, void *opaque);
@@ -324,6 +327,9 @@ struct BlockDriverState {
     int sg;        /* if true, the device is a /dev/sg* */
     int copy_on_read; /* if true, copy read backing sectors into image
                          note this is a reference count */
+    HBitmap *read_map; /* if not NULL, sectors read by the guest are set */
+    /* if not NULL, sectors written since the last incremental backup */
+    BdrvDirtyBitmap *dirty_map;
 
     BlockDriver *drv; /* NULL means no media */
     void *opaque;
@@ -359,6 +365,8 @@ struct BlockDriverState {
     ThrottleState throttle_state;
     CoQueue      throttled_reqs[2];
     bool         io_limits_enabled;
+    /* if not NULL, the limits are shared with the other processes */
+    HostThrottleMember *host_throttle;
 
     /* I/O stats (display with "info blockstats"). */
     BlockAcctStats stats;
@@ -407,6 +415,13 @@ struct BlockDriverState {
     QDict *options;
     BlockdevDetectZeroesOptions detect_zeroes;
 
+    /* Flush coalescing (BDRV_O_COALESCE_FLUSH): count of writes, its value
+     * at the last flush that reached the disk, and when the next may */
+    uint64_t write_gen;
+    uint64_t flushed_gen;
+    int64_t flush_interval_ns;
+    int64_t next_flush_ns;
+
     /* The error object in use for blocking operations on backing_hd */
     Error *backing_blocker;
 };
@@ -565,6 +580,46 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp);
 
+/**
+ * host_throttle_join:
+ * @bs: Block device to operate on.
+ * @cfg: Limits of the host device that @bs is stored on.
+ * @errp: Error object.
+ *
+ * Enable I/O limits on @bs that give it a share of @cfg.  @cfg is split
+ * equally between the processes with recent requests for the same host
+ * device, with the same @cfg, and between the busy drives of each.
+ */
+void host_throttle_join(BlockDriverState *bs, ThrottleConfig *cfg,
+                        Error **errp);
+void host_throttle_leave(BlockDriverState *bs);
+void host_throttle_account(BlockDriverState *bs, int64_t throttled_ns);
+
+/**
+ * prefetch_start:
+ * @bs: Block device to operate on.
+ * @map: File holding the read map of @bs.
+ * @errp: Error object.
+ *
+ * If @map exists, start a prefetch job that reads the ranges of @bs it
+ * lists, copying them into @bs if it has a backing file.  Then record the
+ * ranges the guest reads until it reports that it booted, or @bs is
+ * closed, and write them to @map for the next start.
+ */
+void prefetch_start(BlockDriverState *bs, const char *map, Error **errp);
+
+/**
+ * dirty_map_start:
+ * @bs: Block device to operate on.
+ * @map: File holding the dirty map of @bs.
+ * @errp: Error object.
+ *
+ * Track the sectors of @bs written since its last incremental backup,
+ * starting from those listed in @map, or from all of them if @map is
+ * missing or stale, and write them to @map when @bs is closed.
+ */
+void dirty_map_start(BlockDriverState *bs, const char *map, Error **errp);
+
 /*
  * backup_start:
  * @bs: Block device to operate on.
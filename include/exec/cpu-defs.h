@@ -69,7 +69,13 @@ typedef uint64_t target_ulong;
 #define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
 #if !defined(CONFIG_USER_ONLY)
+/* The x86_64 and aarch64 backends can address a larger table from the
+   env pointer; guests with a big working set miss much less with it. */
+#if defined(__x86_64__) || defined(__aarch64__)
+#define CPU_TLB_BITS 10
+#else
 #define CPU_TLB_BITS 8
+#endif
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
 /* use a fully associative victim tlb of 8 entries */
 #define CPU_VTLB_SIZE 8
@@ -106,10 +112,13 @@ QEMU_BUILD_BUG_ON(sizeof(CPUTLBEntry) != (1 << CPU_TLB_ENTRY_BITS));
     /* The meaning of the MMU modes is defined in the target code. */   \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    /* bit N set: no entry of MMU mode N was filled since the last flush */ \
+    uint32_t tlb_clean_modes;                                           \
     hwaddr iotlb[NB_MMU_MODES][CPU_TLB_SIZE];                           \
     hwaddr iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                        \
-    target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;                                        \
+    /* area covered by the large pages of each mode */                  \
+    target_ulong tlb_flush_addr[NB_MMU_MODES];                          \
+    target_ulong tlb_flush_mask[NB_MMU_MODES];                          \
     target_ulong vtlb_index;                                            \
 
 #else
@@ -30,6 +30,21 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length);
 void tlb_set_dirty(CPUArchState *env, target_ulong vaddr);
 extern int tlb_flush_count;
 
+/* What a TLB flush was for; indexes the flush statistics */
+enum {
+    TLB_FLUSH_STAT_ALL,         /* tlb_flush() */
+    TLB_FLUSH_STAT_MMUIDX,      /* tlb_flush_by_mmuidx() */
+    TLB_FLUSH_STAT_PAGE,        /* tlb_flush_page() */
+    TLB_FLUSH_STAT_RANGE,       /* tlb_flush_range() */
+    TLB_FLUSH_STAT_LARGE_PAGE,  /* either of these two, which hit a large
+                                   page and so flushed whole modes */
+    TLB_FLUSH_STAT_MAX
+};
+
+/* number of flushes, and the time spent in them */
+extern int64_t tlb_flush_stat_count[TLB_FLUSH_STAT_MAX];
+extern int64_t tlb_flush_stat_time_ns[TLB_FLUSH_STAT_MAX];
+
 /* exec.c */
 void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr);
 
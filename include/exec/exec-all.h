@@ -100,6 +100,10 @@ void tcg_cpu_address_space_init(CPUState *cpu, AddressSpace *as);
 /* cputlb.c */
 void tlb_flush_page(CPUState *cpu, target_ulong addr);
 void tlb_flush(CPUState *cpu, int flush_global);
+/* Flush the MMU modes whose bit is set in @idxmap */
+void tlb_flush_by_mmuidx(CPUState *cpu, uint32_t idxmap);
+/* Flush the entries of the pages in [@addr, @addr + @len) in all modes */
+void tlb_flush_range(CPUState *cpu, target_ulong addr, target_ulong len);
 void tlb_set_page(CPUState *cpu, target_ulong vaddr,
                   hwaddr paddr, int prot,
                   int mmu_idx, target_ulong size);
@@ -112,12 +116,22 @@ static inline void tlb_flush_page(CPUState *cpu, target_ulong addr)
 static inline void tlb_flush(CPUState *cpu, int flush_global)
 {
 }
+
+static inline void tlb_flush_by_mmuidx(CPUState *cpu, uint32_t idxmap)
+{
+}
+
+static inline void tlb_flush_range(CPUState *cpu, target_ulong addr,
+                                   target_ulong len)
+{
+}
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+/* TBs the physical hash table is sized for at first, it grows as needed */
+#define CODE_GEN_HTABLE_BITS     15
+#define CODE_GEN_HTABLE_SIZE     (1 << CODE_GEN_HTABLE_BITS)
 
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
@@ -142,13 +156,12 @@ struct TranslationBlock {
     uint64_t flags; /* flags defining in which context the code was generated */
     uint16_t size;      /* size of target code for this block (1 <=
                            size <= TARGET_PAGE_SIZE) */
-    uint16_t cflags;    /* compile flags */
+    uint32_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+#define CF_INVALID     0x10000 /* Removed by tb_phys_invalidate() */
 
     void *tc_ptr;    /* pointer to the translated code */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
     /* first and second physical page containing code. The lower bit
        of the pointer tells the index in page_next[] */
     struct TranslationBlock *page_next[2];
@@ -169,16 +182,33 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* times the block was entered, counted while tb_profile is set */
+    uint64_t exec_count;
 };
 
 #include "exec/spinlock.h"
+#include "qemu/qht.h"
 
 typedef struct TBContext TBContext;
 
+/* Why generated code, or the loop around it, went back to cpu_exec()'s
+   main loop; indexes TBContext.tb_exit_count */
+enum {
+    TB_EXIT_STAT_LOOKUP,        /* exit_tb(0), the next TB is looked up */
+    TB_EXIT_STAT_CHAIN,         /* goto_tb not yet patched to its target */
+    TB_EXIT_STAT_REQUESTED,     /* tcg_exit_req was set */
+    TB_EXIT_STAT_ICOUNT,        /* the instruction budget ran out */
+    TB_EXIT_STAT_LOOP_EXIT,     /* cpu_loop_exit(), e.g. for exceptions */
+    TB_EXIT_STAT_MAX
+};
+
 struct TBContext {
 
+    /* a ring of nb_tbs blocks starting at tb_first, oldest first */
     TranslationBlock *tbs;
-    TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+    /* valid TBs by tb_hash_func() of their physical PC, PC and flags */
+    QHT htable;
+    int tb_first;
     int nb_tbs;
     /* any access to the tbs or the page table must use this lock */
     spinlock_t tb_lock;
@@ -186,6 +216,21 @@ struct TBContext {
     /* statistics */
     int tb_flush_count;
     int tb_phys_invalidate_count;
+    int tb_evict_count;
+    /* since startup, across flushes */
+    int64_t tb_evicted_count;
+    int64_t tb_evict_time_ns;
+    int64_t tb_evict_max_ns;
+    int64_t tb_flush_time_ns;
+    int64_t tb_flush_max_ns;
+    int64_t tb_gen_count;
+    int64_t tb_gen_time_ns;
+    int64_t tb_phys_lookup_count;
+    int64_t tb_phys_lookup_miss_count;
+    int64_t tb_ptr_lookup_count;
+    int64_t tb_ptr_lookup_miss_count;
+    int64_t tb_chain_count;
+    int64_t tb_exit_count[TB_EXIT_STAT_MAX];
 
     int tb_invalidated_flag;
 };
@@ -205,9 +250,15 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+static inline uint32_t tb_hash_func(tb_page_addr_t phys_pc, target_ulong pc,
+                                    uint64_t flags)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    uint64_t h = (uint64_t)phys_pc + (uint64_t)pc * 0x9e3779b97f4a7c15ULL +
+                 flags * 0xc2b2ae3d27d4eb4fULL;
+
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 32);
 }
 
 void tb_free(TranslationBlock *tb);
@@ -344,6 +395,11 @@ bool io_mem_write(struct MemoryRegion *mr, hwaddr addr,
 void tlb_fill(CPUState *cpu, target_ulong addr, int is_write, int mmu_idx,
               uintptr_t retaddr);
 
+/* cputlb.c, indexed by MMUAccessType: main TLB misses, and the misses
+   which also missed the victim TLB and went to tlb_fill() */
+extern int64_t tlb_miss_count[3];
+extern int64_t tlb_fill_count[3];
+
 #endif
 
 #if defined(CONFIG_USER_ONLY)
@@ -359,6 +415,12 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr);
 /* vl.c */
 extern int singlestep;
 
+/* translate-all.c */
+extern int tb_profile;
+void tb_profile_set(CPUArchState *env, int enable);
+void tb_profile_reset(void);
+void tcg_stats_init(void);
+
 /* cpu-exec.c */
 extern volatile sig_atomic_t exit_request;
 
@@ -157,6 +157,7 @@ struct MemoryRegion {
     bool rom_device;
     bool warning_printed; /* For reservations */
     bool flush_coalesced_mmio;
+    bool lockless;
     MemoryRegion *alias;
     hwaddr alias_offset;
     int32_t priority;
@@ -748,6 +749,22 @@ void memory_region_set_flush_coalesced(MemoryRegion *mr);
  */
 void memory_region_clear_flush_coalesced(MemoryRegion *mr);
 
+/**
+ * memory_region_set_lockless: Dispatch accesses without the iothread lock.
+ *
+ * By default, accesses to MMIO regions are dispatched with the iothread
+ * lock held. A device that protects its state with its own locks can ask
+ * for its callbacks to be called without it, from any vCPU thread at the
+ * same time. The callbacks must then take the iothread lock themselves,
+ * before their own locks, for anything that still needs it, such as
+ * raising or lowering an IRQ line; qemu_mutex_iothread_locked() tells
+ * whether they already hold it.
+ *
+ * @mr: the memory region to be updated.
+ * @lockless: whether accesses can be dispatched without the iothread lock.
+ */
+void memory_region_set_lockless(MemoryRegion *mr, bool lockless);
+
 /**
  * memory_region_add_eventfd: Request an eventfd to be triggered when a word
  *                            is written to a location.
@@ -1083,6 +1100,23 @@ MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
  */
 bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_write);
 
+/* address_space_access_lockless: check whether an access can be dispatched
+ * without the iothread lock
+ *
+ * Returns true if the range is handled by a single MMIO region that was
+ * marked with memory_region_set_lockless(). Accelerators use this to avoid
+ * taking the iothread lock on exits that only access such a region; if the
+ * memory map changes afterwards, address_space_rw() still takes the lock
+ * for regions that need it.
+ *
+ * @as: #AddressSpace to be accessed
+ * @addr: address within that address space
+ * @len: length of the access
+ * @is_write: indicates the transfer direction
+ */
+bool address_space_access_lockless(AddressSpace *as, hwaddr addr, int len,
+                                   bool is_write);
+
 /* address_space_map: map a physical memory region into a host virtual address
  *
  * May map a subset of the requested range, given by and returned in @plen.
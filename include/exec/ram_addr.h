@@ -34,19 +34,75 @@ void *qemu_get_ram_ptr(ram_addr_t addr);
 void qemu_ram_free(ram_addr_t addr);
 void qemu_ram_free_from_ptr(ram_addr_t addr);
 
+/* Note in the summary of @client that the dirty bits of pages @page to
+ * @end - 1 may be set.  Called after setting them, so that a clear summary
+ * bit always means a clean word, see cpu_physical_memory_dirty_summary_clear().
+ */
+static inline void cpu_physical_memory_dirty_summary_set(unsigned client,
+                                                         unsigned long page,
+                                                         unsigned long end)
+{
+    unsigned long word = BIT_WORD(page);
+
+    if (end <= page) {
+        return;
+    }
+    bitmap_set_atomic(ram_list.dirty_summary[client], word,
+                      BIT_WORD(end - 1) - word + 1);
+}
+
+/* Drop the summary bits of @client for the words wholly inside pages @page
+ * to @end - 1, which the caller is about to clear.  This must come first:
+ * a page dirtied in between then either gets its bit cleared too, or sets
+ * the summary bit again after its own.
+ */
+static inline void cpu_physical_memory_dirty_summary_clear(unsigned client,
+                                                           unsigned long page,
+                                                           unsigned long end)
+{
+    unsigned long first = BIT_WORD(page + BITS_PER_LONG - 1);
+    unsigned long last = BIT_WORD(end);
+
+    if (first < last) {
+        bitmap_test_and_clear_atomic(ram_list.dirty_summary[client],
+                                     first, last - first);
+    }
+}
+
 static inline bool cpu_physical_memory_get_dirty(ram_addr_t start,
                                                  ram_addr_t length,
                                                  unsigned client)
 {
-    unsigned long end, page, next;
+    unsigned long end, page, next, word, last;
 
     assert(client < DIRTY_MEMORY_NUM);
 
     end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
     page = start >> TARGET_PAGE_BITS;
-    next = find_next_bit(ram_list.dirty_memory[client], end, page);
+    if (end <= page) {
+        return false;
+    }
+    word = BIT_WORD(page);
+    last = BIT_WORD(end - 1);
+    if (word == last) {
+        next = find_next_bit(ram_list.dirty_memory[client], end, page);
+        return next < end;
+    }
 
-    return next < end;
+    /* Only look at the words the summary doesn't say are clean */
+    for (word = find_next_bit(ram_list.dirty_summary[client], last + 1, word);
+         word <= last;
+         word = find_next_bit(ram_list.dirty_summary[client], last + 1,
+                              word + 1)) {
+        unsigned long word_end = MIN(end, (word + 1) * BITS_PER_LONG);
+
+        next = find_next_bit(ram_list.dirty_memory[client], word_end,
+                             MAX(page, word * BITS_PER_LONG));
+        if (next < word_end) {
+            return true;
+        }
+    }
+    return false;
 }
 
 static inline bool cpu_physical_memory_get_clean(ram_addr_t start,
@@ -92,8 +148,11 @@ static inline bool cpu_physical_memory_range_includes_clean(ram_addr_t start,
 static inline void cpu_physical_memory_set_dirty_flag(ram_addr_t addr,
                                                       unsigned client)
 {
+    unsigned long page = addr >> TARGET_PAGE_BITS;
+
     assert(client < DIRTY_MEMORY_NUM);
-    set_bit(addr >> TARGET_PAGE_BITS, ram_list.dirty_memory[client]);
+    set_bit(page, ram_list.dirty_memory[client]);
+    cpu_physical_memory_dirty_summary_set(client, page, page + 1);
 }
 
 static inline void cpu_physical_memory_set_dirty_range_nocode(ram_addr_t start,
@@ -103,8 +162,10 @@ static inline void cpu_physical_memory_set_dirty_range_nocode(ram_addr_t start,
 
     end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
     page = start >> TARGET_PAGE_BITS;
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION], page, end - page);
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_VGA], page, end - page);
+    bitmap_set_atomic(ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION], page, end - page);
+    bitmap_set_atomic(ram_list.dirty_memory[DIRTY_MEMORY_VGA], page, end - page);
+    cpu_physical_memory_dirty_summary_set(DIRTY_MEMORY_MIGRATION, page, end);
+    cpu_physical_memory_dirty_summary_set(DIRTY_MEMORY_VGA, page, end);
 }
 
 static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
@@ -114,9 +175,12 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
 
     end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
     page = start >> TARGET_PAGE_BITS;
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION], page, end - page);
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_VGA], page, end - page);
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_CODE], page, end - page);
+    bitmap_set_atomic(ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION], page, end - page);
+    bitmap_set_atomic(ram_list.dirty_memory[DIRTY_MEMORY_VGA], page, end - page);
+    bitmap_set_atomic(ram_list.dirty_memory[DIRTY_MEMORY_CODE], page, end - page);
+    cpu_physical_memory_dirty_summary_set(DIRTY_MEMORY_MIGRATION, page, end);
+    cpu_physical_memory_dirty_summary_set(DIRTY_MEMORY_VGA, page, end);
+    cpu_physical_memory_dirty_summary_set(DIRTY_MEMORY_CODE, page, end);
     xen_modified_memory(start, length);
 }
 
@@ -138,14 +202,32 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
         (hpratio == 1)) {
         long k;
         long nr = BITS_TO_LONGS(pages);
+        unsigned long summary = 0;
 
         for (k = 0; k < nr; k++) {
             if (bitmap[k]) {
                 unsigned long temp = leul_to_cpu(bitmap[k]);
 
-                ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION][page + k] |= temp;
-                ram_list.dirty_memory[DIRTY_MEMORY_VGA][page + k] |= temp;
-                ram_list.dirty_memory[DIRTY_MEMORY_CODE][page + k] |= temp;
+                atomic_or(&ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION][page + k],
+                          temp);
+                atomic_or(&ram_list.dirty_memory[DIRTY_MEMORY_VGA][page + k],
+                          temp);
+                atomic_or(&ram_list.dirty_memory[DIRTY_MEMORY_CODE][page + k],
+                          temp);
+                summary |= BIT_MASK(page + k);
+            }
+            /* Update the summaries once per word of them */
+            if (summary && (k == nr - 1 ||
+                            BIT_WORD(page + k + 1) != BIT_WORD(page + k))) {
+                unsigned long word = BIT_WORD(page + k);
+
+                atomic_or(&ram_list.dirty_summary[DIRTY_MEMORY_MIGRATION][word],
+                          summary);
+                atomic_or(&ram_list.dirty_summary[DIRTY_MEMORY_VGA][word],
+                          summary);
+                atomic_or(&ram_list.dirty_summary[DIRTY_MEMORY_CODE][word],
+                          summary);
+                summary = 0;
             }
         }
         xen_modified_memory(start, pages);
@@ -181,11 +263,30 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
     assert(client < DIRTY_MEMORY_NUM);
     end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
     page = start >> TARGET_PAGE_BITS;
-    bitmap_clear(ram_list.dirty_memory[client], page, end - page);
+    cpu_physical_memory_dirty_summary_clear(client, page, end);
+    /* Devices may set bits of the same words from other threads */
+    bitmap_test_and_clear_atomic(ram_list.dirty_memory[client], page,
+                                 end - page);
 }
 
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t length,
                                      unsigned client);
 
+/* Clear the dirty bits of @client for a RAM range, and return whether any
+ * was set. Unlike a cpu_physical_memory_get_dirty() and
+ * cpu_physical_memory_reset_dirty() pair, this is safe against devices
+ * dirtying the range from other threads in between.
+ */
+bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
+                                              ram_addr_t length,
+                                              unsigned client);
+
+/* Mark a RAM range as written by a device that accessed it through a
+ * host pointer it kept around, i.e. without calling
+ * cpu_physical_memory_unmap(). This invalidates translated code and
+ * sets the dirty bits, just like the unmap would have done.
+ */
+void cpu_physical_memory_set_written(ram_addr_t start, ram_addr_t length);
+
 #endif
 #endif
@@ -12,6 +12,8 @@
 #ifndef _HW_GOLDFISH_EVENT_H
 #define _HW_GOLDFISH_EVENT_H
 
+#include <stdint.h>
+
 extern int gf_get_event_type_count(void);
 extern int gf_get_event_type_name(int type, char *buf);
 extern int gf_get_event_type_value(char *codename);
@@ -21,4 +23,29 @@ extern int gf_get_event_code_name(const char *typename, unsigned int code,
 extern int gf_get_event_code_value(int typeval, char *codename);
 extern int gf_event_send(int type, int code, int value);
 
+typedef struct GoldfishEventStats {
+    unsigned queued;            /* events waiting for the guest */
+    unsigned capacity;          /* events the queue can hold before growing */
+    unsigned long long coalesced;   /* EV_ABS updates folded into queued ones */
+    unsigned long long dropped;     /* events lost because the queue was full */
+} GoldfishEventStats;
+
+/* Fill |stats| for the event device, return -1 if there is none. */
+extern int gf_get_event_stats(GoldfishEventStats *stats);
+
+typedef struct GoldfishScriptedEvent {
+    int64_t time_us;    /* from the gf_event_script() call, guest time */
+    int type;
+    int code;
+    int value;
+} GoldfishScriptedEvent;
+
+/* Queue the |count| |events| for delivery at their time, measured on the
+ * guest (QEMU_CLOCK_VIRTUAL) clock, so that they keep their spacing even if
+ * the emulator is paused or slowed down. Events don't need to be sorted,
+ * those with the same time are sent in array order, after the events of
+ * earlier calls. Return -1 if there is no event device or too many events
+ * are already waiting. */
+extern int gf_event_script(const GoldfishScriptedEvent *events, int count);
+
 #endif
@@ -18,6 +18,24 @@
 #ifndef HW_INPUT_GOLDFISH_SENSORS_FB_H
 #define HW_INPUT_GOLDFISH_SENSORS_FB_H
 
+#include <stdint.h>
+#include "qemu/compiler.h"
+
 void goldfish_sensors_set_rotation(int rotation);
 
+/* Binary sensor report, sent instead of the text lines once the HAL module
+ * asked for it with "set-format:binary". All the fields are little-endian.
+ * |values| holds three floats for each sensor set in |mask|, in increasing
+ * sensor number order. Text replies to commands such as "wake" don't change,
+ * and can't be mistaken for a report as they never start with a 0 byte.
+ */
+#define GOLDFISH_SENSORS_REPORT_MAGIC  0x524e5300   /* "\0SNR" */
+
+typedef struct QEMU_PACKED GoldfishSensorsReport {
+    uint32_t magic;
+    uint32_t mask;          /* 1 << sensor number for each sensor present */
+    int64_t  time_us;       /* VM time of the report, as in sync:<time_us> */
+    float    values[];
+} GoldfishSensorsReport;
+
 #endif /* HW_INPUT_GOLDFISH_SENSORS_FB_H */
@@ -0,0 +1,47 @@
+/*
+ * Level-triggered interrupt lines raised through a KVM irqfd
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef HW_IRQFD_LINE_H
+#define HW_IRQFD_LINE_H
+
+#include "qemu/event_notifier.h"
+
+/*
+ * Raising a line through its irqfd takes no lock and doesn't go through
+ * the iothread, so it can be done from any thread. KVM lowers the line
+ * when the guest ends the interrupt and tells us through the resample
+ * notifier, which raises it again if @pending says the device still
+ * wants it. Lowering it is thus implicit: the device only has to stop
+ * reporting it as pending.
+ */
+typedef struct IrqfdLine {
+    EventNotifier set;
+    EventNotifier resample;
+    /* Called from the main loop, with the iothread lock held */
+    bool (*pending)(void *opaque);
+    void *opaque;
+    int gsi;
+    bool active;
+} IrqfdLine;
+
+/**
+ * irqfd_line_init: Route KVM interrupt @gsi through an irqfd
+ *
+ * Returns false if the in-kernel irqchip can't do it, in which case the
+ * device keeps raising and lowering its qemu_irq.
+ */
+bool irqfd_line_init(IrqfdLine *line, int gsi, bool (*pending)(void *opaque),
+                     void *opaque);
+
+/**
+ * irqfd_line_raise: Raise an active line, from any thread
+ */
+void irqfd_line_raise(IrqfdLine *line);
+
+#endif
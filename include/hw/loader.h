@@ -18,6 +18,33 @@ int load_image_targphys(const char *filename, hwaddr,
                         uint64_t max_sz);
 int load_image_gzipped(const char *filename, hwaddr addr, uint64_t max_sz);
 
+/**
+ * load_image_gzipped_start:
+ * @filename: Path to the image file
+ * @max_sz: Maximum allowed decompressed size
+ *
+ * Start decompressing a gzip-compressed image in a thread, to load it
+ * with load_image_gzipped_finish() once the caller is done with other
+ * images.  The job must be finished or cancelled.  Unlike with
+ * load_image_gzipped(), files of several gzip members, or with data
+ * after the member, are not decompressed.
+ */
+typedef struct GunzipJob GunzipJob;
+GunzipJob *load_image_gzipped_start(const char *filename, uint64_t max_sz);
+
+/**
+ * load_image_gzipped_finish:
+ * @job: what load_image_gzipped_start() returned
+ * @addr: Memory address to load the image to
+ *
+ * Wait for @job and load the decompressed image, freeing @job.
+ *
+ * Returns the size of the loaded image on success, -1 if the file is not
+ * gzip-compressed or can't be decompressed.
+ */
+int load_image_gzipped_finish(GunzipJob *job, hwaddr addr);
+void load_image_gzipped_cancel(GunzipJob *job);
+
 #define ELF_LOAD_FAILED       -1
 #define ELF_LOAD_NOT_ELF      -2
 #define ELF_LOAD_WRONG_ARCH   -3
@@ -18,6 +18,26 @@
 
 extern bool qemu2_adb_server_init(int port);
 
+/* Traffic proxied between adbd in the guest and the host adb server. */
+typedef struct AndroidAdbStats {
+    uint64_t bytes_to_host;    /* guest -> adb server */
+    uint64_t bytes_from_host;  /* adb server -> guest */
+    uint64_t writes;           /* vectored socket writes issued */
+    uint64_t reads;            /* vectored socket reads issued */
+    int64_t  connected_ns;     /* summed lifetime of all server connections */
+    uint32_t connections;      /* adb server connections currently open */
+    uint64_t notify_attempts;  /* registrations tried with the adb server */
+    uint64_t notify_failures;  /* ... of which failed */
+    int64_t  ready_ns;         /* setup to first adbd 'start', 0 if not yet */
+} AndroidAdbStats;
+
+/* Copy the adb proxy counters into |stats|, all zero if adb is unused. */
+extern void android_adb_get_stats(AndroidAdbStats* stats);
+
+/* Register with the host adb server right away instead of waiting for
+ * the next retry. */
+extern void android_adb_server_notify_now(void);
+
 #if defined(USE_ANDROID_EMU)
 
 #include "android/emulation/android_pipe.h"
@@ -133,6 +153,20 @@ extern void  android_pipe_add_type(const char*               pipeName,
                                      void*                     pipeOpaque,
                                      const AndroidPipeFuncs*  pipeFuncs );
 
+/* Same as android_pipe_add_type(), but the service's sendBuffers() and
+ * recvBuffers() callbacks are invoked from a dedicated pipe I/O thread
+ * instead of the vCPU thread. The guest transfers data to and from
+ * per-pipe staging buffers, so a slow service doesn't stall the vCPU
+ * that issued the command.
+ *
+ * The two callbacks above must be thread-safe with regards to the other
+ * ones, which are still called with the iothread lock held. Pipes of such
+ * services can't be saved to snapshots.
+ */
+extern void  android_pipe_add_type_threaded(const char*              pipeName,
+                                            void*                    pipeOpaque,
+                                            const AndroidPipeFuncs*  pipeFuncs);
+
 /* This tells the guest system that we want to close the pipe and that
  * further attempts to read or write to it will fail. This will not
  * necessarily call the 'close' callback immediately though.
@@ -174,6 +208,22 @@ extern void android_pipe_wake( void* hwpipe, unsigned flags );
 #define PIPE_REG_VERSION             0x24 /* read: device version */
 #define PIPE_REG_CHANNEL_HIGH        0x30 /* read/write: high 32 bit channel id */
 #define PIPE_REG_ADDRESS_HIGH        0x34 /* write: high 32 bit physical address */
+#define PIPE_REG_FEATURES            0x38 /* read: PIPE_FEATURE_XXX bit-flags */
+/* read/write: guest physical address of the command ring */
+#define PIPE_REG_RING_ADDR_LOW       0x3c
+#define PIPE_REG_RING_ADDR_HIGH      0x40
+#define PIPE_REG_RING_ENTRIES        0x44 /* read/write: ring size, power of 2 */
+#define PIPE_REG_RING_DOORBELL       0x48 /* write: process pending commands */
+#define PIPE_REG_RING_DOORBELL_ASYNC 0x4c /* write: same, signal completion */
+
+/* Bit-flags returned by PIPE_REG_FEATURES. Older devices return 0 for
+ * this register, so a guest must check it before using any of the
+ * extensions listed here.
+ */
+#define PIPE_FEATURE_VECTORED_IO   (1 << 0)  /* PIPE_CMD_WRITEV/READV */
+#define PIPE_FEATURE_COMMAND_RING  (1 << 1)  /* PIPE_REG_RING_XXX */
+#define PIPE_FEATURE_BATCH_POLL    (1 << 2)  /* PIPE_CMD_POLL_MANY/GET_SIGNALLED */
+#define PIPE_FEATURE_ASYNC_RING    (1 << 3)  /* PIPE_REG_RING_DOORBELL_ASYNC */
 
 /* list of commands for PIPE_REG_COMMAND */
 #define PIPE_CMD_OPEN               1  /* open new channel */
@@ -197,6 +247,95 @@ extern void android_pipe_wake( void* hwpipe, unsigned flags );
 #define PIPE_CMD_READ_BUFFER        6  /* receive a page-contained buffer from the emulator */
 #define PIPE_CMD_WAKE_ON_READ       7  /* tell the emulator to wake us when reading is possible */
 
+/* Scatter-gather variants of PIPE_CMD_WRITE_BUFFER/READ_BUFFER, only
+ * available when PIPE_FEATURE_VECTORED_IO is set. For these, the ADDRESS
+ * register holds the guest physical address of an array of
+ * 'struct android_pipe_iovec', and SIZE holds the number of entries in it
+ * (at most PIPE_MAX_IOVECS). All buffers are handed to the pipe service
+ * in a single call, and STATUS receives the total number of bytes
+ * transferred or a PIPE_ERROR_XXX value.
+ */
+#define PIPE_CMD_WRITEV             8  /* send several buffers at once */
+#define PIPE_CMD_READV              9  /* receive into several buffers at once */
+
+#define PIPE_MAX_IOVECS            32
+
+struct android_pipe_iovec {
+    uint64_t address;   /* 0x00: guest physical address of buffer */
+    uint32_t size;      /* 0x08: buffer size in bytes */
+    uint32_t reserved;  /* 0x0c: must be 0 */
+};
+
+/* Command ring, only available when PIPE_FEATURE_COMMAND_RING is set.
+ *
+ * Instead of programming the CHANNEL/ADDRESS/SIZE/COMMAND registers for
+ * each operation, the guest can describe a batch of commands in a ring
+ * located in guest RAM, then write any value to PIPE_REG_RING_DOORBELL.
+ * The device processes all entries between 'tail' and 'head', writes each
+ * command's result into its 'status' field, and advances 'tail' before the
+ * doorbell write returns. After the doorbell, PIPE_REG_STATUS contains the
+ * number of processed entries, or a PIPE_ERROR_XXX value if the ring is
+ * invalid.
+ *
+ * 'head' and 'tail' are free-running 32-bit indices, the slot used by an
+ * index is (index & (entries - 1)). Any PIPE_CMD_XXX command can be queued,
+ * including PIPE_CMD_WRITEV/READV. Wake events are still reported through
+ * the interrupt and PIPE_REG_CHANNEL/PIPE_REG_WAKES, as usual.
+ *
+ * When PIPE_FEATURE_ASYNC_RING is set, the guest can write to
+ * PIPE_REG_RING_DOORBELL_ASYNC instead, which may return before the
+ * entries are processed: with KVM, the write doesn't leave the kernel. The
+ * device raises the interrupt once it advanced 'tail', so the interrupt
+ * handler should check it in addition to reading PIPE_REG_CHANNEL, which
+ * lowers the interrupt as usual. PIPE_REG_STATUS isn't changed, and an
+ * invalid ring leaves 'tail' unchanged.
+ */
+struct android_pipe_ring_entry {
+    uint64_t channel;   /* 0x00 */
+    uint64_t address;   /* 0x08 */
+    uint32_t size;      /* 0x10 */
+    uint32_t cmd;       /* 0x14 */
+    int32_t  status;    /* 0x18: written by the device */
+    uint32_t reserved;  /* 0x1c */
+};
+
+struct android_pipe_ring {
+    uint32_t head;      /* 0x00: written by the guest */
+    uint32_t tail;      /* 0x04: written by the device */
+    uint32_t reserved[2];
+    struct android_pipe_ring_entry entries[];
+};
+
+#define PIPE_RING_MAX_ENTRIES     256
+
+/* Batched variants of PIPE_CMD_POLL and of the PIPE_REG_CHANNEL/WAKES
+ * interrupt handling loop, only available when PIPE_FEATURE_BATCH_POLL is
+ * set. These don't use the CHANNEL register. For both, ADDRESS holds the
+ * guest physical address of an array of 'struct android_pipe_poll_entry'
+ * and SIZE holds its number of entries (at most PIPE_MAX_POLL_ENTRIES).
+ *
+ * PIPE_CMD_POLL_MANY sets the 'flags' field of each entry to the
+ * PIPE_POLL_XXX flags of the pipe in its 'channel' field, or to
+ * PIPE_ERROR_XXX for unknown or closed channels. STATUS receives the
+ * number of entries processed.
+ *
+ * PIPE_CMD_GET_SIGNALLED fills the array with the channels that have
+ * pending wake events, along with their PIPE_WAKE_XXX flags, and clears
+ * them. STATUS receives the number of entries written. Once all signalled
+ * pipes have been reported the interrupt is lowered, if the array was too
+ * small it remains raised and the command should be issued again.
+ */
+#define PIPE_CMD_POLL_MANY         10  /* poll several channels at once */
+#define PIPE_CMD_GET_SIGNALLED     11  /* fetch all pending wake events */
+
+#define PIPE_MAX_POLL_ENTRIES      64
+
+struct android_pipe_poll_entry {
+    uint64_t channel;   /* 0x00: set by the guest (POLL_MANY) or device */
+    int32_t  flags;     /* 0x08: written by the device */
+    uint32_t reserved;  /* 0x0c */
+};
+
 /* Possible status values used to signal errors - see qemu_pipe_error_convert */
 #define PIPE_ERROR_INVAL       -1
 #define PIPE_ERROR_AGAIN       -2
@@ -234,6 +373,23 @@ union access_params {
 };
 
 
+/* Counters describing the cost of resolving a guest channel id to its
+ * host pipe. Lookups go through a hash table, so |lookups| should grow
+ * linearly with the number of commands regardless of |num_pipes|.
+ */
+typedef struct AndroidPipeLookupStats {
+    uint64_t lookups;    /* total channel lookups performed */
+    uint64_t misses;     /* lookups that did not find a pipe */
+    unsigned num_pipes;  /* currently open pipes */
+    unsigned max_pipes;  /* high watermark of |num_pipes| */
+    uint64_t map_cache_hits;    /* guest buffers found in a pipe's cache */
+    uint64_t map_cache_misses;  /* guest buffers that had to be mapped */
+} AndroidPipeLookupStats;
+
+/* Copy the current lookup counters of the pipe device into |stats|.
+ * All fields are zero if no pipe device was created. */
+extern void android_pipe_get_lookup_stats(AndroidPipeLookupStats* stats);
+
 extern void android_zero_pipe_init(void);
 extern void android_pingpong_init(void);
 extern void android_throttle_init(void);
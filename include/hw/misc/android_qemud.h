@@ -16,13 +16,54 @@
 #define ANDROID_QEMUD_H
 
 #include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
 
-/* Read Android buffers into an array of terminated strings */
-int qemud_pipe_read_buffers(const AndroidPipeBuffer *buf, int cnt,
-                            GPtrArray *msgs, GString *remaining);
+/*
+ * A QemudBuffer holds qemud framed data for one direction of a pipe.
+ *
+ * Incoming data is appended as-is and frames are handed out as views
+ * into the buffer, with the four digit hex length header parsed in
+ * place. Outgoing frames are written with their header directly into
+ * the buffer and then copied out to the guest's pipe buffers. Space is
+ * reclaimed by moving the unconsumed tail to the front only when more
+ * room is needed, so steady state traffic does not allocate.
+ */
+typedef struct QemudBuffer {
+    uint8_t  *data;
+    uint32_t  size;
+    uint32_t  start;
+    uint32_t  end;
+    /* byte overwritten to terminate the last frame view, if any */
+    uint8_t  *held;
+    uint8_t   held_byte;
+} QemudBuffer;
 
-/* Write an array of strings into a series on Android pipe buffers */
-int qemud_pipe_write_buffers(GPtrArray *msgs, GString *remaining,
-                             AndroidPipeBuffer *buf, int cnt);
+#define QEMUD_MAX_FRAME_LEN 0xffff
+
+void qemud_buffer_init(QemudBuffer *b, uint32_t size);
+void qemud_buffer_destroy(QemudBuffer *b);
+
+/* Number of bytes held in the buffer and not yet consumed */
+static inline uint32_t qemud_buffer_len(const QemudBuffer *b)
+{
+    return b->end - b->start;
+}
+
+/* Append the contents of the guest's buffers, return bytes consumed */
+int qemud_buffer_append(QemudBuffer *b, const AndroidPipeBuffer *buf, int cnt);
+
+/*
+ * Extract the next complete frame. On success *frame points at the
+ * NUL terminated payload inside the buffer and *len is its length; the
+ * view stays valid until the next call on this buffer.
+ */
+bool qemud_buffer_next_frame(QemudBuffer *b, char **frame, uint32_t *len);
+
+/* Queue one framed message of at most QEMUD_MAX_FRAME_LEN bytes */
+void qemud_buffer_put_frame(QemudBuffer *b, const void *data, uint32_t len);
+
+/* Copy queued bytes out to the guest's buffers, return bytes copied */
+int qemud_buffer_drain(QemudBuffer *b, AndroidPipeBuffer *buf, int cnt);
 
 #endif /* ANDROID_QEMUD_H */
@@ -40,6 +40,7 @@
 #define VIRTIO_BLK_F_WCE        9       /* write cache enabled */
 #define VIRTIO_BLK_F_TOPOLOGY   10      /* Topology information is available */
 #define VIRTIO_BLK_F_CONFIG_WCE 11      /* write cache configurable */
+#define VIRTIO_BLK_F_MQ         12      /* support more than one vq */
 
 #define VIRTIO_BLK_ID_BYTES     20      /* ID string length */
 
@@ -57,6 +58,8 @@ struct virtio_blk_config
     uint16_t min_io_size;
     uint32_t opt_io_size;
     uint8_t wce;
+    uint8_t unused;
+    uint16_t num_queues;    /* only present with VIRTIO_BLK_F_MQ */
 } QEMU_PACKED;
 
 /* These two define direction. */
@@ -113,6 +116,7 @@ struct VirtIOBlkConf
     uint32_t scsi;
     uint32_t config_wce;
     uint32_t data_plane;
+    uint16_t num_queues;
 };
 
 struct VirtIOBlockDataPlane;
@@ -121,11 +125,14 @@ struct VirtIOBlockReq;
 typedef struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockBackend *blk;
-    VirtQueue *vq;
+    VirtQueue *vqs[VIRTIO_PCI_QUEUE_MAX];
     void *rq;
     QEMUBH *bh;
+    QEMUBH *notify_bh;
+    uint64_t notify_pending;    /* queues with completions to signal */
     VirtIOBlkConf conf;
     unsigned short sector_mask;
+    size_t config_size;
     bool original_wce;
     VMChangeStateEntry *change;
     /* Function to push to vq and notify guest */
@@ -141,6 +148,7 @@ typedef struct MultiReqBuffer {
 
 typedef struct VirtIOBlockReq {
     VirtIOBlock *dev;
+    VirtQueue *vq;
     VirtQueueElement elem;
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr out;
@@ -149,6 +149,9 @@ typedef struct VirtIONetQueue {
     QEMUTimer *tx_timer;
     QEMUBH *tx_bh;
     int tx_waiting;
+    int32_t tx_burst;       /* current limit, between 1 and n->tx_burst */
+    QEMUBH *rx_bh;
+    bool rx_notify_pending; /* packets received but not yet signalled */
     struct {
         VirtQueueElement elem;
         ssize_t len;
@@ -128,6 +128,7 @@ struct VirtIODevice
     VMChangeStateEntry *vmstate;
     char *bus_name;
     uint8_t device_endian;
+    MemoryListener memory_listener;
 };
 
 typedef struct VirtioDeviceClass {
@@ -36,6 +36,26 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size);
  */
 void cache_fini(PageCache *cache);
 
+/**
+ * cache_lock: lock the cache entry a page maps to
+ *
+ * Threads sharing a cache must hold the lock of a page around looking
+ * it up, reading or updating its data and inserting it.  Pages mapping
+ * to different shards of the cache can be worked on in parallel.
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page addr
+ */
+void cache_lock(PageCache *cache, uint64_t addr);
+
+/**
+ * cache_unlock: unlock the cache entry a page maps to
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page addr
+ */
+void cache_unlock(PageCache *cache, uint64_t addr);
+
 /**
  * cache_is_cached: Checks to see if the page is cached
  *
@@ -94,8 +94,12 @@ typedef struct QEMUFileOps {
     QEMURamHookFunc *after_ram_iterate;
     QEMURamHookFunc *hook_ram_load;
     QEMURamSaveFunc *save_page;
+    /* Backed by a local file: buffer up to IO_BUF_SIZE_BULK per write */
+    bool bulk;
 } QEMUFileOps;
 
+#define IO_BUF_SIZE_BULK (1024 * 1024)
+
 struct QEMUSizedBuffer {
     struct iovec *iov;
     size_t n_iov;
@@ -107,6 +111,8 @@ QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops);
 QEMUFile *qemu_fopen(const char *filename, const char *mode);
 QEMUFile *qemu_fdopen(int fd, const char *mode);
 QEMUFile *qemu_fopen_socket(int fd, const char *mode);
+QEMUFile *qemu_fopen_ram_streams_out(int fd, const char *host_port);
+QEMUFile *qemu_fopen_ram_streams_in(int fd, int listen_fd);
 QEMUFile *qemu_popen_cmd(const char *command, const char *mode);
 QEMUFile *qemu_bufopen(const char *mode, QEMUSizedBuffer *input);
 int qemu_get_fd(QEMUFile *f);
@@ -119,6 +125,13 @@ void qemu_put_byte(QEMUFile *f, int v);
  * The buffer should be available till it is sent asynchronously.
  */
 void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size);
+/*
+ * Zero copy access to the buffer, for up to qemu_file_buffer_size() bytes:
+ * fill the space qemu_put_reserve() returns and qemu_put_commit() it.
+ */
+int qemu_file_buffer_size(QEMUFile *f);
+uint8_t *qemu_put_reserve(QEMUFile *f, int size);
+void qemu_put_commit(QEMUFile *f, int size);
 bool qemu_file_mode_is_not_valid(const char *mode);
 bool qemu_file_is_writable(QEMUFile *f);
 
@@ -150,6 +163,7 @@ void qemu_put_be32(QEMUFile *f, unsigned int v);
 void qemu_put_be64(QEMUFile *f, uint64_t v);
 int qemu_peek_buffer(QEMUFile *f, uint8_t *buf, int size, size_t offset);
 int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size);
+const uint8_t *qemu_peek_buffer_in_place(QEMUFile *f, int size);
 /*
  * Note that you can only peek continuous bytes from where the current pointer
  * is; you aren't guaranteed to be able to peak to +n bytes unless you've
@@ -159,6 +173,7 @@ int qemu_peek_byte(QEMUFile *f, int offset);
 int qemu_get_byte(QEMUFile *f);
 void qemu_file_skip(QEMUFile *f, int size);
 void qemu_update_position(QEMUFile *f, size_t size);
+void qemu_file_update_transfer(QEMUFile *f, int64_t len);
 
 static inline unsigned int qemu_get_ubyte(QEMUFile *f)
 {
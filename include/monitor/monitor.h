@@ -52,14 +52,23 @@ typedef struct mon_cmd_t {
 
 /* flags for monitor commands */
 #define MONITOR_CMD_ASYNC       0x0001
+/* QMP command without arguments that -qmp-thread may run without the BQL */
+#define MONITOR_CMD_NO_BQL      0x0002
 
 int monitor_cur_is_qmp(void);
 
 Monitor * monitor_init(CharDriverState *chr, int flags);
+int monitor_qmp_thread_init(const char *address, Error **errp);
+
+typedef void MonitorFakeFunc(void *opaque, const char *buf, int len);
+Monitor *monitor_fake_new(void *opaque, MonitorFakeFunc *func);
+int monitor_fake_get_bytes(Monitor *mon);
+void monitor_fake_free(Monitor *mon);
 void monitor_add_command(Monitor *mon, mon_cmd_t *cmd);
 void monitor_set_command_table(Monitor* mon, mon_cmd_t* cmds);
 #ifdef CONFIG_ANDROID
 mon_cmd_t* monitor_get_android_cmds();
+char *monitor_android_console_run(const char *cmdline);
 #endif
 
 int monitor_suspend(Monitor *mon);
@@ -34,10 +34,22 @@ typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
 
+typedef struct NetQueueStats {
+    uint32_t count;         /* packets in the queue */
+    uint32_t max_len;
+    uint32_t peak;
+    uint64_t queued;        /* packets that went through the queue */
+    uint64_t dropped;       /* because the queue was full */
+} NetQueueStats;
+
 NetQueue *qemu_new_net_queue(void *opaque);
 
 void qemu_del_net_queue(NetQueue *queue);
 
+/* Beyond @max_len packets, those sent without a callback are dropped */
+void qemu_net_queue_set_max_len(NetQueue *queue, uint32_t max_len);
+void qemu_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats);
+
 ssize_t qemu_net_queue_send(NetQueue *queue,
                             NetClientState *sender,
                             unsigned flags,
@@ -460,6 +460,12 @@ void qemu_hexdump(const char *buf, FILE *fp, const char *prefix, size_t size);
 #define VECTYPE        __m128i
 #define SPLAT(p)       _mm_set1_epi8(*(p))
 #define ALL_EQ(v1, v2) (_mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2)) == 0xFFFF)
+#elif defined __aarch64__
+#include <arm_neon.h>
+#define VECTYPE        uint64x2_t
+#define SPLAT(p)       vreinterpretq_u64_u8(vdupq_n_u8(*(p)))
+#define ALL_EQ(v1, v2) \
+    (vmaxvq_u32(vreinterpretq_u32_u64(veorq_u64(v1, v2))) == 0)
 #else
 #define VECTYPE        unsigned long
 #define SPLAT(p)       (*(p) * (~0UL / 255))
@@ -129,6 +129,26 @@
 #define atomic_set(ptr, i)     ((*(__typeof__(*ptr) *volatile) (ptr)) = (i))
 #endif
 
+/* Read a pointer published with atomic_rcu_set(), inside an RCU read-side
+ * critical section. Whatever it points to is seen as it was before the
+ * pointer was published.
+ */
+#ifndef atomic_rcu_read
+#define atomic_rcu_read(ptr)    ({                \
+    __typeof__(*ptr) _val = atomic_read(ptr);     \
+    smp_read_barrier_depends();                   \
+    _val;                                         \
+})
+#endif
+
+/* Publish a pointer to a fully initialized object for RCU readers */
+#ifndef atomic_rcu_set
+#define atomic_rcu_set(ptr, i)  do {              \
+    smp_wmb();                                    \
+    atomic_set(ptr, i);                           \
+} while (0)
+#endif
+
 /* These have the same semantics as Java volatile variables.
  * See http://gee.cs.oswego.edu/dl/jmm/cookbook.html:
  * "1. Issue a StoreStore barrier (wmb) before each volatile store."
@@ -117,6 +117,19 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count);
  */
 bool hbitmap_get(const HBitmap *hb, uint64_t item);
 
+/**
+ * hbitmap_merge:
+ * @a: HBitmap to merge into.
+ * @b: HBitmap whose bits are added to @a.
+ *
+ * Set in @a all the bits that are set in @b, for instance to combine the
+ * dirty bitmaps of two periods.  Both must have the same size and
+ * granularity.
+ *
+ * Return whether @b could be merged into @a.
+ */
+bool hbitmap_merge(HBitmap *a, const HBitmap *b);
+
 /**
  * hbitmap_free:
  * @hb: HBitmap to operate on.
@@ -0,0 +1,49 @@
+/*
+ * Input to display latency
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_INPUT_LATENCY_H
+#define QEMU_INPUT_LATENCY_H
+
+#include "qemu-common.h"
+
+/*
+ * The input device notes the host time (get_clock()) at which the oldest
+ * event of its queue came in, and reports it once the guest has read the
+ * whole queue.  The first frame produced after that is taken as the answer
+ * of the guest, and the time from the input to that frame being shown
+ * goes into the qemu_input_display_seconds histogram, labelled with the
+ * display path.  qemu_input_queue_seconds has the time from the input to
+ * the guest reading it.
+ *
+ * A guest that animates the screen anyway may show a frame that doesn't
+ * reflect the input yet, so the display latency is a lower bound of what
+ * the user sees; it is exact for a screen that only changes on input.
+ * Inputs read before the previous one reached the display are counted
+ * from the oldest of them.
+ */
+
+typedef enum InputLatencyDisplay {
+    INPUT_LATENCY_FB,           /* goldfish framebuffer */
+    INPUT_LATENCY_GPU,          /* GPU frames of the GLES renderer */
+    INPUT_LATENCY_DISPLAY_MAX,
+} InputLatencyDisplay;
+
+void input_latency_init(void);
+
+/* The guest read the input that came in at @input_ns, at @now_ns */
+void input_latency_consumed(int64_t input_ns, int64_t now_ns);
+
+/*
+ * A frame produced at @frame_ns was shown at @now_ns, from any thread.
+ * Does nothing before input_latency_init().
+ */
+void input_latency_frame(InputLatencyDisplay display, int64_t frame_ns,
+                         int64_t now_ns);
+
+#endif
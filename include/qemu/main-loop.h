@@ -299,6 +299,18 @@ void qemu_mutex_lock_iothread(void);
  */
 void qemu_mutex_unlock_iothread(void);
 
+/**
+ * qemu_mutex_iothread_locked: Return lock status of the main loop mutex.
+ *
+ * Returns %true if the calling thread holds the main loop mutex. Memory
+ * regions that do their own locking are dispatched without it, see
+ * memory_region_set_lockless(); their callbacks can use this to take it
+ * only when they need it.
+ *
+ * NOTE: tools are single-threaded and this always returns %true there.
+ */
+bool qemu_mutex_iothread_locked(void);
+
 /* internal interfaces */
 
 void qemu_fd_register(int fd);
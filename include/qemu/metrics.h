@@ -0,0 +1,103 @@
+/*
+ * Registry of performance metrics, exported in the OpenMetrics format
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_METRICS_H
+#define QEMU_METRICS_H
+
+#include "qemu-common.h"
+
+/*
+ * Subsystems publish their metrics in one of two ways:
+ *
+ * - with the counters and histograms of the registry, which are split in
+ *   per-thread shards so that updating one costs an atomic add on a cache
+ *   line the thread seldom shares;
+ *
+ * - with a collector, which the registry calls to report the statistics a
+ *   subsystem keeps anyway when the metrics are read.
+ *
+ * Metrics are read from any thread and without the BQL.  A collector must
+ * only look at data that stays valid until it is removed, and may see
+ * values while they are updated; removing it waits for a read in progress.
+ *
+ * Names follow the OpenMetrics conventions: qemu_<subsystem>_<what>, in
+ * base units such as seconds or bytes.  The metrics of one name form a
+ * family of one type, and differ by their labels, which are given in the
+ * text form key="value",... (see metrics_labels()).  Counter names don't
+ * end with _total, which is added on output.
+ */
+
+typedef enum MetricType {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM,
+} MetricType;
+
+typedef struct MetricCounter MetricCounter;
+typedef struct MetricHistogram MetricHistogram;
+typedef struct MetricsCollector MetricsCollector;
+typedef struct MetricsWriter MetricsWriter;
+
+typedef void MetricsCollectFunc(MetricsWriter *w, void *opaque);
+
+MetricsCollector *metrics_collector_add(MetricsCollectFunc *func,
+                                        void *opaque);
+void metrics_collector_remove(MetricsCollector *c);
+
+/*
+ * For collectors: declare the family @name before writing its samples.
+ * Families declared by several collectors are merged, the first @help
+ * is kept.
+ */
+void metrics_family(MetricsWriter *w, const char *name, MetricType type,
+                    const char *help);
+/* Write a counter or gauge sample; @labels may be NULL */
+void metrics_sample(MetricsWriter *w, const char *name, const char *labels,
+                    double value);
+void metrics_sample_int(MetricsWriter *w, const char *name,
+                        const char *labels, int64_t value);
+/*
+ * Write a histogram with @nbounds increasing upper bounds and the
+ * @nbounds + 1 counts of the values up to each bound and above the last.
+ * A negative @sum is for histograms whose sum isn't known.
+ */
+void metrics_histogram(MetricsWriter *w, const char *name, const char *labels,
+                       const double *bounds, const uint64_t *counts,
+                       unsigned int nbounds, double sum);
+
+/*
+ * Return the labels built from NULL-terminated pairs of keys and values,
+ * with the values escaped.  Free with g_free().
+ */
+char *metrics_labels(const char *key, const char *value, ...)
+    G_GNUC_NULL_TERMINATED;
+
+MetricCounter *metric_counter_new(const char *name, const char *help,
+                                  const char *labels);
+void metric_counter_free(MetricCounter *c);
+void metric_counter_add(MetricCounter *c, int64_t n);
+
+/*
+ * Values are observed as integers, such as nanoseconds, and multiplied by
+ * @scale on output, e.g. 1e-9 to report seconds.  @bounds is copied.
+ */
+MetricHistogram *metric_histogram_new(const char *name, const char *help,
+                                      const char *labels,
+                                      const int64_t *bounds,
+                                      unsigned int nbounds, double scale);
+void metric_histogram_free(MetricHistogram *h);
+void metric_histogram_observe(MetricHistogram *h, int64_t value);
+
+/* Return all the metrics in the OpenMetrics text format, free with g_free() */
+char *metrics_render(void);
+
+/* Serve the metrics over HTTP on @address, "host:port" or "unix:path" */
+int metrics_server_init(const char *address, Error **errp);
+
+#endif
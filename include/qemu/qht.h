@@ -0,0 +1,72 @@
+/*
+ * Resizable hash table with lock-free lookups
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_QHT_H
+#define QEMU_QHT_H
+
+#include "qemu-common.h"
+#include "qemu/thread.h"
+
+/*
+ * The table stores pointers under a 32-bit hash that the caller computes.
+ * Lookups take no lock and may run at the same time as changes to the
+ * table, from any thread registered with RCU; they see every object that
+ * was inserted before they started and not removed since.  Insertions and
+ * removals are serialized by a lock of the table.
+ *
+ * Objects are not copied, so an object must stay valid, and its lookup
+ * keys unchanged, until readers that could have found it are done, i.e.
+ * for an RCU grace period after it is removed.
+ */
+typedef struct QHT QHT;
+typedef struct QHTMap QHTMap;
+
+struct QHT {
+    QHTMap *map;
+    QemuMutex lock;
+    unsigned int mode;
+};
+
+/* Grow the table as it fills up */
+#define QHT_MODE_AUTO_RESIZE    0x1
+
+typedef struct QHTStats {
+    size_t head_buckets;
+    size_t entries;
+    /* buckets between a head bucket and the last of its chain */
+    size_t max_chain;
+    /* entries found in chained buckets */
+    size_t chained_entries;
+} QHTStats;
+
+/* Objects for which this is true join in the lookup */
+typedef bool (*QHTLookupFunc)(const void *obj, const void *userp);
+typedef void (*QHTIterFunc)(QHT *ht, void *obj, uint32_t hash, void *userp);
+
+/* @n_elems is how many objects to size the table for */
+void qht_init(QHT *ht, size_t n_elems, unsigned int mode);
+void qht_destroy(QHT *ht);
+
+/* Return false, and leave the table as it was, if @p is already in it */
+bool qht_insert(QHT *ht, void *p, uint32_t hash);
+/* Return false if @p is not in the table */
+bool qht_remove(QHT *ht, const void *p, uint32_t hash);
+void *qht_lookup(QHT *ht, QHTLookupFunc func, const void *userp,
+                 uint32_t hash);
+
+/* Remove everything, and size the table for @n_elems objects if not 0 */
+void qht_reset(QHT *ht);
+void qht_reset_size(QHT *ht, size_t n_elems);
+void qht_resize(QHT *ht, size_t n_elems);
+
+/* Call @func on each object; @func must not change the table */
+void qht_iter(QHT *ht, QHTIterFunc func, void *userp);
+void qht_statistics(QHT *ht, QHTStats *stats);
+
+#endif
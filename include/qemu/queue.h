@@ -195,6 +195,20 @@ struct {                                                                \
         (head)->slh_first = (elm);                                      \
 } while (/*CONSTCOND*/0)
 
+/* Safe against concurrent QSLIST_INSERT_HEAD_ATOMIC and QSLIST_MOVE_ATOMIC */
+#define QSLIST_INSERT_HEAD_ATOMIC(head, elm, field) do {                 \
+        typeof(elm) save_sle_next;                                      \
+        do {                                                            \
+            save_sle_next = (elm)->field.sle_next = (head)->slh_first;  \
+        } while (atomic_cmpxchg(&(head)->slh_first, save_sle_next,      \
+                                (elm)) != save_sle_next);               \
+} while (/*CONSTCOND*/0)
+
+/* Take the whole list out of @src, leaving it empty */
+#define QSLIST_MOVE_ATOMIC(dest, src) do {                               \
+        (dest)->slh_first = atomic_xchg(&(src)->slh_first, NULL);       \
+} while (/*CONSTCOND*/0)
+
 #define QSLIST_REMOVE_HEAD(head, field) do {                             \
         (head)->slh_first = (head)->slh_first->field.sle_next;          \
 } while (/*CONSTCOND*/0)
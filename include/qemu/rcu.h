@@ -0,0 +1,113 @@
+/*
+ * Read-copy-update
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_RCU_H
+#define QEMU_RCU_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "qemu/compiler.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "qemu/queue.h"
+
+/* Read-copy-update, after the "memory barrier" flavour of liburcu
+ *
+ * Readers bracket their accesses to an RCU-protected pointer with
+ * rcu_read_lock() and rcu_read_unlock(), which never block and may be
+ * nested, and read the pointer with atomic_rcu_read().
+ *
+ * Writers publish a new version with atomic_rcu_set(), and must not free
+ * the old one until every reader that may still see it is done: either
+ * wait for that with synchronize_rcu(), or have call_rcu() free it later
+ * from a separate thread. call_rcu() callbacks run under the iothread
+ * lock, so they can drop references to objects as if nothing had changed.
+ *
+ * Every thread that reads without holding the iothread lock must call
+ * rcu_register_thread() first and rcu_unregister_thread() before it
+ * exits; the main thread is registered automatically.
+ */
+
+/* Global grace period counter; bit 0 is always set */
+extern unsigned long rcu_gp_ctr;
+
+extern QemuEvent rcu_gp_event;
+
+struct rcu_reader_data {
+    /* Grace period this reader started in, 0 when not reading */
+    unsigned long ctr;
+    /* A writer is waiting for this reader to leave */
+    bool waiting;
+    /* Nesting depth, only ever used by the reader itself */
+    unsigned depth;
+    QLIST_ENTRY(rcu_reader_data) node;
+};
+
+extern __thread struct rcu_reader_data rcu_reader;
+
+static inline void rcu_read_lock(void)
+{
+    struct rcu_reader_data *p_rcu_reader = &rcu_reader;
+
+    if (p_rcu_reader->depth++ > 0) {
+        return;
+    }
+
+    /* Full barrier: accesses in the section can't move before this */
+    atomic_xchg(&p_rcu_reader->ctr, atomic_read(&rcu_gp_ctr));
+}
+
+static inline void rcu_read_unlock(void)
+{
+    struct rcu_reader_data *p_rcu_reader = &rcu_reader;
+
+    assert(p_rcu_reader->depth != 0);
+    if (--p_rcu_reader->depth > 0) {
+        return;
+    }
+
+    atomic_xchg(&p_rcu_reader->ctr, 0);
+    if (unlikely(atomic_read(&p_rcu_reader->waiting))) {
+        atomic_set(&p_rcu_reader->waiting, false);
+        qemu_event_set(&rcu_gp_event);
+    }
+}
+
+void synchronize_rcu(void);
+
+void rcu_register_thread(void);
+void rcu_unregister_thread(void);
+
+struct rcu_head;
+typedef void RCUCBFunc(struct rcu_head *head);
+
+struct rcu_head {
+    struct rcu_head *next;
+    RCUCBFunc *func;
+};
+
+void call_rcu1(struct rcu_head *head, RCUCBFunc *func);
+
+/* Call @func on @head once readers are done with it. @field is the
+ * struct rcu_head in @head, which must be its first member so that @func
+ * can take a pointer to the containing type.
+ */
+#define call_rcu(head, func, field)                                      \
+    call_rcu1(({                                                         \
+         char __attribute__((unused))                                    \
+            offset_must_be_zero[-offsetof(typeof(*(head)), field)],      \
+            func_type_invalid = (func) - (void (*)(typeof(head)))(func); \
+         &(head)->field;                                                 \
+      }),                                                                \
+      (RCUCBFunc *)(func))
+
+#endif
@@ -194,6 +194,12 @@ struct kvm_run;
 #ifdef CONFIG_HAX
 struct hax_vcpu_state;
 #endif
+#ifdef CONFIG_WHPX
+struct whpx_vcpu;
+#endif
+#ifdef CONFIG_HVF
+struct hvf_vcpu;
+#endif
 
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
@@ -285,6 +291,11 @@ struct CPUState {
     uintptr_t mem_io_pc;
     vaddr mem_io_vaddr;
 
+    /* Exit statistics under hardware accelerators, see vcpu-exits.c */
+    struct VcpuExitStats *exit_stats;
+    /* Current halt polling window of HAX and KVM vcpus, see cpus.c */
+    int64_t halt_poll_ns;
+
     int kvm_fd;
     bool kvm_vcpu_dirty;
     struct KVMState *kvm_state;
@@ -307,9 +318,14 @@ struct CPUState {
     volatile sig_atomic_t tcg_exit_req;
 
 #ifdef CONFIG_HAX
-    bool hax_vcpu_dirty;
     struct hax_vcpu_state *hax_vcpu;
 #endif
+#ifdef CONFIG_WHPX
+    struct whpx_vcpu *whpx_vcpu;
+#endif
+#ifdef CONFIG_HVF
+    struct hvf_vcpu *hvf_vcpu;
+#endif
 };
 
 QTAILQ_HEAD(CPUTailQ, CPUState);
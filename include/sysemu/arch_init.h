@@ -33,6 +33,13 @@ void select_soundhw(const char *optarg);
 void do_acpitable_option(const QemuOpts *opts);
 void do_smbios_option(QemuOpts *opts);
 void ram_mig_init(void);
+/* Keep RAM in @path, mapped on load, for the next savevm/loadvm; or not */
+void ram_set_snapshot_file(const char *path);
+void ram_set_snapshot_base(const char *path);
+void ram_set_snapshot_background(bool background);
+int ram_snapshot_background_start(void);
+void ram_snapshot_background_wait(void);
+void ram_snapshot_background_abort(void);
 void cpudef_init(void);
 bool audio_init(void);
 int kvm_available(void);
@@ -0,0 +1,36 @@
+/*
+ * Startup timeline
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef SYSEMU_BOOT_TIMELINE_H
+#define SYSEMU_BOOT_TIMELINE_H
+
+/*
+ * Marks are timestamped from the first one, normally when the process
+ * starts. Host phases are named after what just completed, such as
+ * "machine-init", and milestones reported by the guest start with
+ * "guest:". They can be recorded from any thread.
+ *
+ * If $ANDROID_BOOT_TIMELINE names a file, the timeline is written to it
+ * as JSON after each mark.
+ */
+void boot_timeline_mark(const char *name);
+
+/* Same as boot_timeline_mark(), but only the first time @name is seen */
+void boot_timeline_mark_once(const char *name);
+
+/* Whether @name was marked */
+bool boot_timeline_has(const char *name);
+
+/*
+ * Drop the guest milestones and "guest-start", so that they are recorded
+ * again when the guest boots anew after a reset
+ */
+void boot_timeline_forget_guest(void);
+
+#endif
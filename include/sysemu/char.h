@@ -57,6 +57,9 @@ struct CharDriverState {
     QemuMutex chr_write_lock;
     void (*init)(struct CharDriverState *s);
     int (*chr_write)(struct CharDriverState *s, const uint8_t *buf, int len);
+    /* Optional, chr_write() is called for each element otherwise */
+    int (*chr_writev)(struct CharDriverState *s, const struct iovec *iov,
+                      int iovcnt);
     int (*chr_sync_read)(struct CharDriverState *s,
                          const uint8_t *buf, int len);
     GSource *(*chr_add_watch)(struct CharDriverState *s, GIOCondition cond);
@@ -189,6 +192,22 @@ int qemu_chr_fe_add_watch(CharDriverState *s, GIOCondition cond,
  */
 int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len);
 
+/**
+ * @qemu_chr_fe_writev:
+ *
+ * Write data gathered from several buffers to a character backend from the
+ * front end, like @qemu_chr_fe_write.  Backends that can do so hand all
+ * of it to the host in a single system call.  This function is
+ * thread-safe.
+ *
+ * @iov the buffers
+ * @iovcnt the number of buffers
+ *
+ * Returns: the number of bytes consumed, which may stop anywhere in @iov
+ */
+int qemu_chr_fe_writev(CharDriverState *s, const struct iovec *iov,
+                       int iovcnt);
+
 /**
  * @qemu_chr_fe_write_all:
  *
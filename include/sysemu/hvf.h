@@ -0,0 +1,32 @@
+/*
+ * QEMU Hypervisor.framework accelerator (HVF) support
+ *
+ * Copyright (c) 2017 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/* header to be included in non-HVF-specific code */
+#ifndef QEMU_HVF_H
+#define QEMU_HVF_H
+
+#include "config-host.h"
+#include "qemu-common.h"
+
+int hvf_enabled(void);
+
+#ifdef CONFIG_HVF
+
+int hvf_init_vcpu(CPUState *cpu);
+int hvf_vcpu_exec(CPUState *cpu);
+void hvf_destroy_vcpu(CPUState *cpu);
+void hvf_vcpu_kick(CPUState *cpu);
+void hvf_cpu_synchronize_state(CPUState *cpu);
+void hvf_cpu_synchronize_post_reset(CPUState *cpu);
+void hvf_cpu_synchronize_post_init(CPUState *cpu);
+
+#endif
+
+#endif /* QEMU_HVF_H */
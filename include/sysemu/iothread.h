@@ -28,6 +28,9 @@ typedef struct {
     QemuCond init_done_cond;    /* is thread initialization done? */
     bool stopping;
     int thread_id;
+
+    /* Longest polling window of the AioContext, see aio_poll() */
+    int64_t poll_max_ns;
 } IOThread;
 
 #define IOTHREAD(obj) \
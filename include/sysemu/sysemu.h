@@ -75,6 +75,8 @@ void qemu_remove_exit_notifier(Notifier *notify);
 void qemu_add_machine_init_done_notifier(Notifier *notify);
 
 void do_savevm(Monitor *mon, const QDict *qdict);
+int save_vmstate(const char *name);
+int save_vmstate_background(const char *name);
 int load_vmstate(const char *name);
 void do_delvm(Monitor *mon, const QDict *qdict);
 void do_info_snapshots(Monitor *mon, const QDict *qdict);
@@ -90,6 +92,11 @@ void qemu_savevm_state_cancel(void);
 uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size);
 int qemu_loadvm_state(QEMUFile *f);
 
+/* Keep the state of the devices, but not RAM, in memory and go back to it.
+ * qemu_loadvm_initial_state() returns -ENOENT if there is none. */
+int qemu_savevm_initial_state(void);
+int qemu_loadvm_initial_state(void);
+
 /* SLIRP */
 void do_info_slirp(Monitor *mon);
 
@@ -139,6 +146,15 @@ extern QEMUClockType rtc_clock;
 extern const char *mem_path;
 extern int mem_prealloc;
 
+enum {
+    MEM_HUGEPAGES_TRANSPARENT,  /* let the host use transparent huge pages */
+    MEM_HUGEPAGES_OFF,
+    MEM_HUGEPAGES_EXPLICIT,     /* back guest RAM with reserved huge pages */
+};
+extern int mem_hugepages;
+extern uint64_t mem_hugepage_size;  /* 0 for the host default */
+extern int mem_shared;
+
 #define MAX_NODES 128
 
 /* The following shall be true for all CPUs:
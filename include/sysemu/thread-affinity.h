@@ -0,0 +1,30 @@
+/*
+ * Host CPU affinity of the emulator threads
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef SYSEMU_THREAD_AFFINITY_H
+#define SYSEMU_THREAD_AFFINITY_H
+
+#include "qapi/error.h"
+
+/*
+ * Host CPUs are given as lists like "0-3,8".  The vcpu set is applied by
+ * each vcpu thread when it starts, the I/O set by the main loop and the
+ * IOThreads.  Threads that don't use either, such as the renderer threads
+ * of the GPU emulation library, inherit the set of the thread that created
+ * them, usually the main loop.  On hosts other than Linux and Windows,
+ * setting a list fails.
+ */
+bool thread_affinity_set_vcpus(const char *host_cpus, Error **errp);
+bool thread_affinity_set_io(const char *host_cpus, Error **errp);
+
+/* Move the calling thread to the host CPUs chosen for its kind, if any */
+void thread_affinity_apply_vcpu(void);
+void thread_affinity_apply_io(void);
+
+#endif
@@ -0,0 +1,37 @@
+/*
+ * Exit statistics of virtual CPUs run by hardware accelerators
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef SYSEMU_VCPU_EXITS_H
+#define SYSEMU_VCPU_EXITS_H
+
+#include "qemu-common.h"
+#include "qom/cpu.h"
+#include "qapi-types.h"
+
+/*
+ * Accelerators call these from the vcpu thread, with @start_ns the
+ * get_clock() time at which the vcpu returned to QEMU, once the exit has
+ * been handled.
+ */
+void vcpu_exit_account(CPUState *cpu, VcpuExitReason reason,
+                       int64_t start_ns);
+
+/* Count an exit for a port (@io) or guest physical MMIO address */
+void vcpu_exit_account_address(CPUState *cpu, bool io, uint64_t address);
+
+/*
+ * Count a halt during which the vcpu polled for @poll_ns, and whether it
+ * was woken up before the end of its polling window
+ */
+void vcpu_exit_account_halt_poll(CPUState *cpu, bool success, int64_t poll_ns);
+
+/* Clear the statistics of all the vcpus */
+void vcpu_exit_reset(void);
+
+#endif
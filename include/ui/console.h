@@ -27,6 +27,10 @@
 /* in ms */
 #define GUI_REFRESH_INTERVAL_DEFAULT    30
 #define GUI_REFRESH_INTERVAL_IDLE     3000
+/* Longest interval used by the adaptive refresh policy, and the number
+ * of refreshes without activity after which it starts backing off. */
+#define GUI_REFRESH_INTERVAL_ADAPTIVE_MAX  250
+#define GUI_REFRESH_IDLE_THRESHOLD          30
 
 typedef void QEMUPutKBDEvent(void *opaque, int keycode);
 typedef void QEMUPutLEDEvent(void *opaque, int ledstate);
@@ -236,6 +240,12 @@ void unregister_displaychangelistener(DisplayChangeListener *dcl);
 int dpy_set_ui_info(QemuConsole *con, QemuUIInfo *info);
 
 void dpy_gfx_update(QemuConsole *con, int x, int y, int w, int h);
+/* Tell the refresh timer that |con| (or the active console if NULL) has
+ * something new to display, e.g. a frame posted by the GPU emulation.
+ * dpy_gfx_update() and dpy_gfx_replace_surface() already do this. */
+void dpy_gfx_activity(QemuConsole *con);
+/* Total number of refreshes skipped by the adaptive refresh policy. */
+uint64_t dpy_get_suppressed_refreshes(void);
 void dpy_gfx_replace_surface(QemuConsole *con,
                              DisplaySurface *surface);
 void dpy_gfx_copy(QemuConsole *con, int src_x, int src_y,
@@ -323,6 +333,8 @@ QemuConsole *qemu_console_lookup_by_device(DeviceState *dev, uint32_t head);
 bool qemu_console_is_visible(QemuConsole *con);
 bool qemu_console_is_graphic(QemuConsole *con);
 bool qemu_console_is_fixedsize(QemuConsole *con);
+/* Let the refresh rate back off while |con| has nothing new to display. */
+void qemu_console_set_adaptive_refresh(QemuConsole *con, bool enabled);
 int qemu_console_get_index(QemuConsole *con);
 uint32_t qemu_console_get_head(QemuConsole *con);
 QemuUIInfo *qemu_console_get_ui_info(QemuConsole *con);
@@ -0,0 +1,72 @@
+/*
+ * Frame capture into a shared memory ring
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_UI_FRAME_CAPTURE_H
+#define QEMU_UI_FRAME_CAPTURE_H
+
+#include <stdint.h>
+
+/*
+ * The frame-capture-start QMP command maps a file (normally on a tmpfs
+ * such as /dev/shm) and publishes display frames into it, so that other
+ * processes can read them at video rate without going through QMP or the
+ * disk. The file starts with a FrameCaptureRingHeader, followed by
+ * |slot_count| slots of |slot_size| bytes each, starting at |header_size|.
+ * Each slot starts with a FrameCaptureSlot.
+ *
+ * Frames are published in order, frame N of the publication order going
+ * into slot N % slot_count. To read the latest frame, a reader:
+ *   1. reads |published|, and stops if it is 0;
+ *   2. reads |seq| of slot (published - 1) % slot_count, retrying later
+ *      if it is odd (the slot is being written);
+ *   3. copies the slot header and data;
+ *   4. reads |seq| again, and drops the copy if it changed.
+ * A reader too slow to copy a frame before slot_count newer frames are
+ * published sees |seq| change and must retry.
+ *
+ * All the fields are in host byte order.
+ */
+
+#define FRAME_CAPTURE_MAGIC    0x52434651   /* "QFCR" */
+#define FRAME_CAPTURE_VERSION  1
+
+/* Values of FrameCaptureSlot.encoding, same as FrameCaptureEncoding. */
+#define FRAME_CAPTURE_RAW   0
+#define FRAME_CAPTURE_PNG   1
+#define FRAME_CAPTURE_JPEG  2
+
+typedef struct FrameCaptureRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t slot_count;
+    uint64_t slot_size;
+    uint64_t published;     /* number of frames published so far */
+    uint64_t reserved[4];
+} FrameCaptureRingHeader;
+
+typedef struct FrameCaptureSlot {
+    uint64_t seq;           /* odd while the slot is being written */
+    uint64_t frame;         /* capture id, as returned by frame-capture-grab */
+    int64_t  timestamp_ns;  /* host monotonic clock, at capture time */
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;        /* bytes per line of raw frames */
+    uint32_t format;        /* pixman format code of raw frames */
+    uint32_t encoding;      /* FRAME_CAPTURE_xxx */
+    uint32_t size;          /* bytes of data */
+    uint64_t reserved[2];
+    uint8_t  data[];
+} FrameCaptureSlot;
+
+/* Called by the GPU frame bridge for each frame it delivers, |pixels|
+ * holds |width|x|height| RGBA pixels, top line first. */
+void frame_capture_gpu_frame(int width, int height, const void *pixels);
+
+#endif /* QEMU_UI_FRAME_CAPTURE_H */
@@ -31,6 +31,9 @@
 #ifndef _WIN32
 #include <sys/wait.h>
 #endif
+#ifdef CONFIG_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
 
 typedef struct IOHandlerRecord {
     IOCanReadHandler *fd_read_poll;
@@ -41,11 +44,107 @@ typedef struct IOHandlerRecord {
     int fd;
     int pollfds_idx;
     bool deleted;
+#ifdef CONFIG_EPOLL_CREATE1
+    int epoll_events;       /* registered in iohandler_epoll_fd, or 0 */
+    bool epoll_failed;      /* epoll refused the fd, always use pollfds */
+    int revents;            /* as reported by epoll */
+#endif
 } IOHandlerRecord;
 
 static QLIST_HEAD(, IOHandlerRecord) io_handlers =
     QLIST_HEAD_INITIALIZER(io_handlers);
 
+#ifdef CONFIG_EPOLL_CREATE1
+/*
+ * Handlers are kept registered in an epoll set rather than being added to
+ * the main loop's pollfds one by one, so that the kernel only looks at the
+ * ones that are ready.  Registrations are only touched when the events a
+ * handler waits for change.  Descriptors epoll does not support, such as
+ * regular files, are still polled directly.
+ */
+#define IOHANDLER_EPOLL_MAX_EVENTS 128
+
+static int iohandler_epoll_fd = -1;
+static bool iohandler_epoll_tried;
+static int iohandler_epoll_count;
+static int iohandler_epoll_pollfds_idx = -1;
+
+static void iohandler_epoll_forget(IOHandlerRecord *ioh)
+{
+    if (ioh->epoll_events) {
+        epoll_ctl(iohandler_epoll_fd, EPOLL_CTL_DEL, ioh->fd, NULL);
+        ioh->epoll_events = 0;
+        iohandler_epoll_count--;
+    }
+    ioh->revents = 0;
+}
+
+/* Returns true if epoll takes care of @ioh waiting for @events */
+static bool iohandler_epoll_update(IOHandlerRecord *ioh, int events)
+{
+    struct epoll_event ev;
+
+    if (!iohandler_epoll_tried) {
+        iohandler_epoll_tried = true;
+        iohandler_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    }
+    if (iohandler_epoll_fd < 0 || ioh->epoll_failed) {
+        return false;
+    }
+    if (!events) {
+        iohandler_epoll_forget(ioh);
+        return true;
+    }
+    if (events == ioh->epoll_events) {
+        return true;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((events & G_IO_IN) ? EPOLLIN : 0) |
+                ((events & G_IO_OUT) ? EPOLLOUT : 0);
+    ev.data.ptr = ioh;
+    if (epoll_ctl(iohandler_epoll_fd,
+                  ioh->epoll_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                  ioh->fd, &ev) < 0) {
+        iohandler_epoll_forget(ioh);
+        ioh->epoll_failed = true;
+        return false;
+    }
+    if (!ioh->epoll_events) {
+        iohandler_epoll_count++;
+    }
+    ioh->epoll_events = events;
+    return true;
+}
+
+static void iohandler_epoll_poll(GArray *pollfds)
+{
+    struct epoll_event events[IOHANDLER_EPOLL_MAX_EVENTS];
+    int i, n;
+
+    if (iohandler_epoll_pollfds_idx == -1 ||
+        !(g_array_index(pollfds, GPollFD,
+                        iohandler_epoll_pollfds_idx).revents & G_IO_IN)) {
+        return;
+    }
+
+    /* Level triggered, whatever does not fit is reported next time.
+     * Deleted handlers are unregistered right away, so each record seen
+     * here is still on the list.
+     */
+    n = epoll_wait(iohandler_epoll_fd, events, IOHANDLER_EPOLL_MAX_EVENTS, 0);
+    for (i = 0; i < n; i++) {
+        IOHandlerRecord *ioh = events[i].data.ptr;
+        uint32_t ev = events[i].events;
+
+        ioh->revents = ((ev & EPOLLIN) ? G_IO_IN : 0) |
+                       ((ev & EPOLLOUT) ? G_IO_OUT : 0) |
+                       ((ev & EPOLLERR) ? G_IO_ERR : 0) |
+                       ((ev & EPOLLHUP) ? G_IO_HUP : 0);
+    }
+}
+#endif
+
 
 /* XXX: fd_read_poll should be suppressed, but an API change is
    necessary in the character devices to suppress fd_can_read(). */
@@ -63,6 +162,10 @@ int qemu_set_fd_handler2(int fd,
         QLIST_FOREACH(ioh, &io_handlers, next) {
             if (ioh->fd == fd) {
                 ioh->deleted = 1;
+#ifdef CONFIG_EPOLL_CREATE1
+                /* The fd may well be closed before the record is freed */
+                iohandler_epoll_forget(ioh);
+#endif
                 break;
             }
         }
@@ -111,6 +214,12 @@ void qemu_iohandler_fill(GArray *pollfds)
         if (ioh->fd_write) {
             events |= G_IO_OUT | G_IO_ERR;
         }
+#ifdef CONFIG_EPOLL_CREATE1
+        if (iohandler_epoll_update(ioh, events)) {
+            ioh->pollfds_idx = -1;
+            continue;
+        }
+#endif
         if (events) {
             GPollFD pfd = {
                 .fd = ioh->fd,
@@ -122,6 +231,18 @@ void qemu_iohandler_fill(GArray *pollfds)
             ioh->pollfds_idx = -1;
         }
     }
+
+#ifdef CONFIG_EPOLL_CREATE1
+    iohandler_epoll_pollfds_idx = -1;
+    if (iohandler_epoll_count) {
+        GPollFD pfd = {
+            .fd = iohandler_epoll_fd,
+            .events = G_IO_IN,
+        };
+        iohandler_epoll_pollfds_idx = pollfds->len;
+        g_array_append_val(pollfds, pfd);
+    }
+#endif
 }
 
 void qemu_iohandler_poll(GArray *pollfds, int ret)
@@ -129,6 +250,10 @@ void qemu_iohandler_poll(GArray *pollfds, int ret)
     if (ret > 0) {
         IOHandlerRecord *pioh, *ioh;
 
+#ifdef CONFIG_EPOLL_CREATE1
+        iohandler_epoll_poll(pollfds);
+#endif
+
         QLIST_FOREACH_SAFE(ioh, &io_handlers, next, pioh) {
             int revents = 0;
 
@@ -137,6 +262,12 @@ void qemu_iohandler_poll(GArray *pollfds, int ret)
                                               ioh->pollfds_idx);
                 revents = pfd->revents;
             }
+#ifdef CONFIG_EPOLL_CREATE1
+            if (!ioh->deleted && ioh->epoll_events) {
+                revents = ioh->revents;
+            }
+            ioh->revents = 0;
+#endif
 
             if (!ioh->deleted && ioh->fd_read &&
                 (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
@@ -18,9 +18,15 @@
 #include "sysemu/iothread.h"
 #include "qmp-commands.h"
 #include "qemu/error-report.h"
+#include "qemu/rcu.h"
+#include "sysemu/thread-affinity.h"
+#include "qapi/visitor.h"
 
 #define IOTHREADS_PATH "/objects"
 
+/* Long enough to catch a guest that kicks again right after a completion */
+#define IOTHREAD_POLL_MAX_NS_DEFAULT 32768
+
 typedef ObjectClass IOThreadClass;
 
 #define IOTHREAD_GET_CLASS(obj) \
@@ -33,6 +39,9 @@ static void *iothread_run(void *opaque)
     IOThread *iothread = opaque;
     bool blocking;
 
+    rcu_register_thread();
+    thread_affinity_apply_io();
+
     qemu_mutex_lock(&iothread->init_done_lock);
     iothread->thread_id = qemu_get_thread_id();
     qemu_cond_signal(&iothread->init_done_cond);
@@ -47,6 +56,8 @@ static void *iothread_run(void *opaque)
         }
         aio_context_release(iothread->ctx);
     }
+
+    rcu_unregister_thread();
     return NULL;
 }
 
@@ -78,6 +89,8 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
         return;
     }
 
+    aio_context_set_poll_max_ns(iothread->ctx, iothread->poll_max_ns);
+
     qemu_mutex_init(&iothread->init_done_lock);
     qemu_cond_init(&iothread->init_done_cond);
 
@@ -96,6 +109,49 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
     qemu_mutex_unlock(&iothread->init_done_lock);
 }
 
+static void iothread_get_poll_max_ns(Object *obj, Visitor *v, void *opaque,
+                                     const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    int64_t value = iothread->poll_max_ns;
+
+    visit_type_int64(v, &value, name, errp);
+}
+
+static void iothread_set_poll_max_ns(Object *obj, Visitor *v, void *opaque,
+                                     const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    Error *local_err = NULL;
+    int64_t value;
+
+    visit_type_int64(v, &value, name, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (value < 0) {
+        error_setg(&local_err, "Property '%s.%s' doesn't take value '%"
+                   PRId64 "'", object_get_typename(obj), name, value);
+        goto out;
+    }
+    iothread->poll_max_ns = value;
+    if (iothread->ctx) {
+        aio_context_set_poll_max_ns(iothread->ctx, value);
+    }
+out:
+    error_propagate(errp, local_err);
+}
+
+static void iothread_instance_init(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->poll_max_ns = IOTHREAD_POLL_MAX_NS_DEFAULT;
+    object_property_add(obj, "poll-max-ns", "int",
+                        iothread_get_poll_max_ns,
+                        iothread_set_poll_max_ns, NULL, NULL, NULL);
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
@@ -107,6 +163,7 @@ static const TypeInfo iothread_info = {
     .parent = TYPE_OBJECT,
     .class_init = iothread_class_init,
     .instance_size = sizeof(IOThread),
+    .instance_init = iothread_instance_init,
     .instance_finalize = iothread_instance_finalize,
     .interfaces = (InterfaceInfo[]) {
         {TYPE_USER_CREATABLE},
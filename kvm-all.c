@@ -31,6 +31,7 @@
 #include "hw/s390x/adapter.h"
 #include "exec/gdbstub.h"
 #include "sysemu/kvm.h"
+#include "sysemu/vcpu-exits.h"
 #include "qemu/bswap.h"
 #include "exec/memory.h"
 #include "exec/ram_addr.h"
@@ -1666,27 +1667,41 @@ static int kvm_handle_internal_error(CPUState *cpu, struct kvm_run *run)
 void kvm_flush_coalesced_mmio_buffer(void)
 {
     KVMState *s = kvm_state;
+    struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
+    bool locked;
 
-    if (s->coalesced_flush_in_progress) {
+    /* Lockless regions flush before each access, see
+     * memory_region_set_lockless(), and usually find the ring empty.
+     * Only take the iothread lock, which serializes flushing, if not. */
+    if (!ring || atomic_read(&ring->first) == atomic_read(&ring->last)) {
         return;
     }
+    locked = qemu_mutex_iothread_locked();
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+
+    if (s->coalesced_flush_in_progress) {
+        goto out;
+    }
 
     s->coalesced_flush_in_progress = true;
 
-    if (s->coalesced_mmio_ring) {
-        struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
-        while (ring->first != ring->last) {
-            struct kvm_coalesced_mmio *ent;
+    while (ring->first != ring->last) {
+        struct kvm_coalesced_mmio *ent;
 
-            ent = &ring->coalesced_mmio[ring->first];
+        ent = &ring->coalesced_mmio[ring->first];
 
-            cpu_physical_memory_write(ent->phys_addr, ent->data, ent->len);
-            smp_wmb();
-            ring->first = (ring->first + 1) % KVM_COALESCED_MMIO_MAX;
-        }
+        cpu_physical_memory_write(ent->phys_addr, ent->data, ent->len);
+        smp_wmb();
+        ring->first = (ring->first + 1) % KVM_COALESCED_MMIO_MAX;
     }
 
     s->coalesced_flush_in_progress = false;
+out:
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 static void do_kvm_cpu_synchronize_state(void *arg)
@@ -1737,9 +1752,58 @@ void kvm_cpu_clean_state(CPUState *cpu)
     cpu->kvm_vcpu_dirty = false;
 }
 
+static VcpuExitReason kvm_exit_reason(struct kvm_run *run)
+{
+    switch (run->exit_reason) {
+    case KVM_EXIT_IO:
+        return VCPU_EXIT_REASON_IO;
+    case KVM_EXIT_MMIO:
+        return VCPU_EXIT_REASON_MMIO;
+    case KVM_EXIT_HLT:
+        return VCPU_EXIT_REASON_HLT;
+    case KVM_EXIT_IRQ_WINDOW_OPEN:
+    case KVM_EXIT_INTR:
+        return VCPU_EXIT_REASON_INTERRUPT;
+    case KVM_EXIT_SHUTDOWN:
+    case KVM_EXIT_SYSTEM_EVENT:
+        return VCPU_EXIT_REASON_SHUTDOWN;
+    default:
+        return VCPU_EXIT_REASON_OTHER;
+    }
+}
+
+/* Complete an MMIO exit to a region that does its own locking, see
+ * memory_region_set_lockless(), without the iothread lock, so that the
+ * vCPU can go straight back into the guest. kvm_arch_pre_run() and
+ * kvm_arch_post_run() need the lock and are skipped until the next exit
+ * of another kind, which is fine since the access only completes the
+ * instruction and other threads kick the vCPU out of KVM_RUN when they
+ * need it.
+ */
+static bool kvm_handle_lockless_mmio(CPUState *cpu, struct kvm_run *run,
+                                     int64_t exit_ns)
+{
+    if (run->exit_reason != KVM_EXIT_MMIO ||
+        !address_space_access_lockless(&address_space_memory,
+                                       run->mmio.phys_addr, run->mmio.len,
+                                       run->mmio.is_write)) {
+        return false;
+    }
+
+    DPRINTF("handle_mmio without the iothread lock\n");
+    vcpu_exit_account_address(cpu, false, run->mmio.phys_addr);
+    cpu_physical_memory_rw(run->mmio.phys_addr,
+                           run->mmio.data,
+                           run->mmio.len,
+                           run->mmio.is_write);
+    vcpu_exit_account(cpu, VCPU_EXIT_REASON_MMIO, exit_ns);
+    return true;
+}
+
 int kvm_cpu_exec(CPUState *cpu)
 {
     struct kvm_run *run = cpu->kvm_run;
+    int64_t exit_ns;
     int ret, run_ret;
 
     DPRINTF("kvm_cpu_exec()\n");
@@ -1767,7 +1831,11 @@ int kvm_cpu_exec(CPUState *cpu)
         }
         qemu_mutex_unlock_iothread();
 
-        run_ret = kvm_vcpu_ioctl(cpu, KVM_RUN, 0);
+        do {
+            run_ret = kvm_vcpu_ioctl(cpu, KVM_RUN, 0);
+            exit_ns = get_clock();
+        } while (run_ret == 0 && !cpu->exit_request &&
+                 kvm_handle_lockless_mmio(cpu, run, exit_ns));
 
         qemu_mutex_lock_iothread();
         kvm_arch_post_run(cpu, run);
@@ -1775,6 +1843,7 @@ int kvm_cpu_exec(CPUState *cpu)
         if (run_ret < 0) {
             if (run_ret == -EINTR || run_ret == -EAGAIN) {
                 DPRINTF("io window exit\n");
+                vcpu_exit_account(cpu, VCPU_EXIT_REASON_INTERRUPT, exit_ns);
                 ret = EXCP_INTERRUPT;
                 break;
             }
@@ -1788,6 +1857,7 @@ int kvm_cpu_exec(CPUState *cpu)
         switch (run->exit_reason) {
         case KVM_EXIT_IO:
             DPRINTF("handle_io\n");
+            vcpu_exit_account_address(cpu, true, run->io.port);
             kvm_handle_io(run->io.port,
                           (uint8_t *)run + run->io.data_offset,
                           run->io.direction,
@@ -1797,6 +1867,7 @@ int kvm_cpu_exec(CPUState *cpu)
             break;
         case KVM_EXIT_MMIO:
             DPRINTF("handle_mmio\n");
+            vcpu_exit_account_address(cpu, false, run->mmio.phys_addr);
             cpu_physical_memory_rw(run->mmio.phys_addr,
                                    run->mmio.data,
                                    run->mmio.len,
@@ -1841,6 +1912,7 @@ int kvm_cpu_exec(CPUState *cpu)
             ret = kvm_arch_handle_exit(cpu, run);
             break;
         }
+        vcpu_exit_account(cpu, kvm_exit_reason(run), exit_ns);
     } while (ret == 0);
 
     if (ret < 0) {
@@ -0,0 +1,678 @@
+/*
+ * Parallel RAM streams for TCP migration
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "block/coroutine.h"
+#include "exec/cpu-common.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+
+/*
+ * With the multi-stream capability, RAM pages don't go in the main
+ * migration stream.  The page hook of the main QEMUFile gathers runs of
+ * consecutive dirty pages and hands each run to one of several threads,
+ * each with a TCP connection of its own to the destination, which sends
+ * it.  Everything else, zero pages included, stays in the main stream.
+ *
+ * The destination reads each connection in a thread of its own, straight
+ * into guest memory.  A page is sent at most once per round, between two
+ * dirty bitmap syncs, so the pages of a round can land in any order as
+ * long as all of them are in place before the next round.  At the end of
+ * each round the source waits for its threads, puts a sync marker with
+ * the round number in every connection, then a RAM hook with the same
+ * number in the main stream, where the destination waits for all its
+ * readers to get to that marker, and the readers wait for the main stream
+ * before going on with the next round.
+ *
+ * After RAM_SAVE_FLAG_HOOK, the main stream holds one of:
+ *   RAM_STREAMS_OPEN, be32 count, be32 blocks, be64 offset and length each
+ *   RAM_STREAMS_SYNC, be32 round
+ * and each connection, after be32 RAM_STREAMS_MAGIC and be32 index:
+ *   RAM_STREAMS_PAGES, be64 RAM address, be32 length, the pages
+ *   RAM_STREAMS_SYNC, be32 round
+ * Pages are named by their RAM address, so both sides must have the same
+ * RAM layout, which the block table sent on opening lets the destination
+ * check.  A destination that doesn't accept the extra connections gets
+ * everything in the main stream.
+ */
+#define RAM_STREAMS_MAGIC   0x514d5354      /* "QMST" */
+#define RAM_STREAMS_COUNT   4
+#define RAM_STREAMS_BATCH   64              /* pages per run at most */
+
+enum {
+    RAM_STREAMS_OPEN = 1,
+    RAM_STREAMS_SYNC = 2,
+    RAM_STREAMS_PAGES = 3,
+};
+
+typedef struct RamStreamBlock {
+    ram_addr_t offset;
+    ram_addr_t length;
+    uint8_t *host;
+} RamStreamBlock;
+
+typedef struct RamStreams RamStreams;
+
+typedef struct RamStream {
+    RamStreams *rs;
+    QemuThread thread;
+    QemuCond wake;
+    QEMUFile *file;
+    int fd;
+    bool quit;
+    bool done;              /* incoming: the reader exited */
+    /* Outgoing: the run to send, set while busy */
+    bool busy;
+    ram_addr_t addr;
+    uint8_t *host;
+    size_t len;
+    /* Incoming: the last sync marker read */
+    uint32_t synced;
+} RamStream;
+
+struct RamStreams {
+    QEMUFile *file;
+    int fd;                 /* of the main stream */
+    int listen_fd;          /* incoming: to accept the connections from */
+    char *host_port;        /* outgoing: where to connect them */
+    QemuMutex lock;
+    QemuCond idle;          /* outgoing: a thread is done with its run */
+    QemuCond synced;        /* incoming: either side got to a sync marker */
+    RamStream *streams;
+    int count;
+    int next;
+    RamStreamBlock *blocks;
+    int nblocks;
+    size_t page_size;
+    /* The run being gathered */
+    RamStreamBlock *run_block;
+    ram_addr_t run_addr;
+    size_t run_len;
+    uint32_t round;         /* the last sync marker sent or loaded */
+    int error;
+};
+
+static RamStreamBlock *ram_streams_find_block(RamStreams *rs, ram_addr_t addr,
+                                              size_t len)
+{
+    int i;
+
+    for (i = 0; i < rs->nblocks; i++) {
+        RamStreamBlock *b = &rs->blocks[i];
+
+        if (addr >= b->offset && len <= b->length &&
+            addr - b->offset <= b->length - len) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static void ram_streams_add_block(void *host_addr, ram_addr_t offset,
+                                  ram_addr_t length, void *opaque)
+{
+    RamStreams *rs = opaque;
+    RamStreamBlock *b;
+
+    rs->blocks = g_renew(RamStreamBlock, rs->blocks, rs->nblocks + 1);
+    b = &rs->blocks[rs->nblocks++];
+    b->offset = offset;
+    b->length = length;
+    b->host = host_addr;
+}
+
+static void ram_streams_set_error(RamStreams *rs, int error)
+{
+    if (!rs->error) {
+        rs->error = error;
+    }
+}
+
+/* Main stream I/O, as qemu_fopen_socket() does it */
+
+static ssize_t ram_streams_writev_buffer(void *opaque, struct iovec *iov,
+                                         int iovcnt, int64_t pos)
+{
+    RamStreams *rs = opaque;
+    ssize_t size = iov_size(iov, iovcnt);
+    ssize_t len;
+
+    len = iov_send(rs->fd, iov, iovcnt, 0, size);
+    if (len < size) {
+        len = -socket_error();
+    }
+    return len;
+}
+
+static int ram_streams_get_buffer(void *opaque, uint8_t *buf, int64_t pos,
+                                  int size)
+{
+    RamStreams *rs = opaque;
+    ssize_t len;
+
+    for (;;) {
+        len = qemu_recv(rs->fd, buf, size, 0);
+        if (len != -1) {
+            break;
+        }
+        if (socket_error() == EAGAIN) {
+            yield_until_fd_readable(rs->fd);
+        } else if (socket_error() != EINTR) {
+            break;
+        }
+    }
+    if (len == -1) {
+        len = -socket_error();
+    }
+    return len;
+}
+
+static int ram_streams_get_fd(void *opaque)
+{
+    RamStreams *rs = opaque;
+
+    return rs->fd;
+}
+
+/* Outgoing side */
+
+static void *ram_stream_send_thread(void *opaque)
+{
+    RamStream *s = opaque;
+    RamStreams *rs = s->rs;
+
+    qemu_mutex_lock(&rs->lock);
+    while (!s->quit) {
+        int ret;
+
+        if (!s->busy) {
+            qemu_cond_wait(&s->wake, &rs->lock);
+            continue;
+        }
+        qemu_mutex_unlock(&rs->lock);
+
+        qemu_put_byte(s->file, RAM_STREAMS_PAGES);
+        qemu_put_be64(s->file, s->addr);
+        qemu_put_be32(s->file, s->len);
+        qemu_put_buffer_async(s->file, s->host, s->len);
+        qemu_fflush(s->file);
+        ret = qemu_file_get_error(s->file);
+
+        qemu_mutex_lock(&rs->lock);
+        if (ret < 0) {
+            ram_streams_set_error(rs, ret);
+        }
+        s->busy = false;
+        qemu_cond_broadcast(&rs->idle);
+    }
+    qemu_mutex_unlock(&rs->lock);
+    return NULL;
+}
+
+/* Hand the run gathered so far to an idle thread */
+static void ram_streams_queue_run(RamStreams *rs)
+{
+    RamStream *s = NULL;
+    int i;
+
+    if (!rs->run_len) {
+        return;
+    }
+    qemu_mutex_lock(&rs->lock);
+    while (!s) {
+        for (i = 0; i < rs->count; i++) {
+            RamStream *t = &rs->streams[(rs->next + i) % rs->count];
+
+            if (!t->busy) {
+                s = t;
+                rs->next = (rs->next + i + 1) % rs->count;
+                break;
+            }
+        }
+        if (!s) {
+            qemu_cond_wait(&rs->idle, &rs->lock);
+        }
+    }
+    s->addr = rs->run_addr;
+    s->host = rs->run_block->host + (rs->run_addr - rs->run_block->offset);
+    s->len = rs->run_len;
+    s->busy = true;
+    qemu_cond_signal(&s->wake);
+    qemu_mutex_unlock(&rs->lock);
+
+    rs->run_len = 0;
+}
+
+static void ram_streams_wait_idle(RamStreams *rs)
+{
+    int i;
+
+    qemu_mutex_lock(&rs->lock);
+    for (i = 0; i < rs->count; i++) {
+        while (rs->streams[i].busy) {
+            qemu_cond_wait(&rs->idle, &rs->lock);
+        }
+    }
+    qemu_mutex_unlock(&rs->lock);
+}
+
+/* Connect as many streams as possible, returns how many */
+static int ram_streams_connect(RamStreams *rs)
+{
+    int i;
+
+    rs->streams = g_new0(RamStream, RAM_STREAMS_COUNT);
+    for (i = 0; i < RAM_STREAMS_COUNT; i++) {
+        RamStream *s = &rs->streams[i];
+        Error *err = NULL;
+
+        s->fd = inet_connect(rs->host_port, &err);
+        if (s->fd < 0) {
+            if (i == 0) {
+                error_report("warning: migration: no extra connection, "
+                             "sending RAM in the main stream: %s",
+                             error_get_pretty(err));
+            }
+            error_free(err);
+            break;
+        }
+        socket_set_nodelay(s->fd);
+        s->rs = rs;
+        s->file = qemu_fopen_socket(s->fd, "wb");
+        qemu_put_be32(s->file, RAM_STREAMS_MAGIC);
+        qemu_put_be32(s->file, i);
+        qemu_cond_init(&s->wake);
+        qemu_thread_create(&s->thread, "ram-stream-send",
+                           ram_stream_send_thread, s, QEMU_THREAD_JOINABLE);
+    }
+    return i;
+}
+
+static int ram_streams_before_iterate(QEMUFile *f, void *opaque,
+                                      uint64_t flags)
+{
+    RamStreams *rs = opaque;
+    int i;
+
+    if (flags != RAM_CONTROL_SETUP || rs->streams) {
+        return 0;
+    }
+
+    qemu_ram_foreach_block(ram_streams_add_block, rs);
+    rs->count = ram_streams_connect(rs);
+    if (!rs->count) {
+        return 0;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_HOOK);
+    qemu_put_be32(f, RAM_STREAMS_OPEN);
+    qemu_put_be32(f, rs->count);
+    qemu_put_be32(f, rs->nblocks);
+    for (i = 0; i < rs->nblocks; i++) {
+        qemu_put_be64(f, rs->blocks[i].offset);
+        qemu_put_be64(f, rs->blocks[i].length);
+    }
+    /* The destination must accept the streams before they fill up */
+    qemu_fflush(f);
+    return 0;
+}
+
+static int ram_streams_after_iterate(QEMUFile *f, void *opaque,
+                                     uint64_t flags)
+{
+    RamStreams *rs = opaque;
+    int i;
+
+    if (!rs->count || flags == RAM_CONTROL_SETUP) {
+        return 0;
+    }
+
+    ram_streams_queue_run(rs);
+    ram_streams_wait_idle(rs);
+
+    rs->round++;
+    for (i = 0; i < rs->count; i++) {
+        QEMUFile *sf = rs->streams[i].file;
+
+        qemu_put_byte(sf, RAM_STREAMS_SYNC);
+        qemu_put_be32(sf, rs->round);
+        qemu_fflush(sf);
+        if (qemu_file_get_error(sf) < 0) {
+            ram_streams_set_error(rs, qemu_file_get_error(sf));
+        }
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_HOOK);
+    qemu_put_be32(f, RAM_STREAMS_SYNC);
+    qemu_put_be32(f, rs->round);
+    /* And get to the marker before it blocks the readers */
+    qemu_fflush(f);
+    return rs->error;
+}
+
+static size_t ram_streams_save_page(QEMUFile *f, void *opaque,
+                                    ram_addr_t block_offset,
+                                    ram_addr_t offset, size_t size,
+                                    int *bytes_sent)
+{
+    RamStreams *rs = opaque;
+    ram_addr_t addr = block_offset + offset;
+    RamStreamBlock *b = rs->run_block;
+
+    if (!rs->count || rs->error) {
+        return RAM_SAVE_CONTROL_NOT_SUPP;
+    }
+    if (!b || b->offset != block_offset) {
+        b = ram_streams_find_block(rs, addr, size);
+        if (!b || b->offset != block_offset) {
+            /* Added after the setup */
+            return RAM_SAVE_CONTROL_NOT_SUPP;
+        }
+    }
+    /* Zero pages are cheaper in the main stream */
+    if (buffer_is_zero(b->host + offset, size)) {
+        return RAM_SAVE_CONTROL_NOT_SUPP;
+    }
+
+    rs->page_size = size;
+    if (rs->run_len && (b != rs->run_block ||
+                        addr != rs->run_addr + rs->run_len ||
+                        rs->run_len >= RAM_STREAMS_BATCH * size)) {
+        ram_streams_queue_run(rs);
+    }
+    if (!rs->run_len) {
+        rs->run_block = b;
+        rs->run_addr = addr;
+    }
+    rs->run_len += size;
+
+    /* Charge the page now, so that the bandwidth limit holds */
+    acct_update_position(f, size, false);
+    qemu_file_update_transfer(f, size);
+    *bytes_sent = 1;
+    return RAM_SAVE_CONTROL_DELAYED;
+}
+
+static int ram_streams_close_out(void *opaque)
+{
+    RamStreams *rs = opaque;
+    int i;
+
+    qemu_mutex_lock(&rs->lock);
+    for (i = 0; i < rs->count; i++) {
+        rs->streams[i].quit = true;
+        qemu_cond_signal(&rs->streams[i].wake);
+    }
+    qemu_mutex_unlock(&rs->lock);
+    for (i = 0; i < rs->count; i++) {
+        RamStream *s = &rs->streams[i];
+
+        qemu_thread_join(&s->thread);
+        qemu_cond_destroy(&s->wake);
+        qemu_fclose(s->file);
+    }
+    closesocket(rs->fd);
+    qemu_cond_destroy(&rs->idle);
+    qemu_cond_destroy(&rs->synced);
+    qemu_mutex_destroy(&rs->lock);
+    g_free(rs->streams);
+    g_free(rs->blocks);
+    g_free(rs->host_port);
+    g_free(rs);
+    return 0;
+}
+
+/* Incoming side */
+
+static int ram_stream_recv(RamStream *s)
+{
+    RamStreams *rs = s->rs;
+
+    if (qemu_get_be32(s->file) != RAM_STREAMS_MAGIC) {
+        return -EINVAL;
+    }
+    qemu_get_be32(s->file);
+
+    for (;;) {
+        int type = qemu_get_byte(s->file);
+        RamStreamBlock *b;
+        ram_addr_t addr;
+        uint32_t len;
+
+        if (qemu_file_get_error(s->file)) {
+            return qemu_file_get_error(s->file);
+        }
+        switch (type) {
+        case RAM_STREAMS_PAGES:
+            addr = qemu_get_be64(s->file);
+            len = qemu_get_be32(s->file);
+            b = ram_streams_find_block(rs, addr, len);
+            if (!b) {
+                error_report("migration: RAM stream page " RAM_ADDR_FMT
+                             " out of range", addr);
+                return -EINVAL;
+            }
+            /* The RAM file is no longer tracked when RAM is loaded */
+            if (qemu_get_buffer(s->file, b->host + (addr - b->offset),
+                                len) != len) {
+                return -EIO;
+            }
+            break;
+        case RAM_STREAMS_SYNC:
+            /*
+             * Don't read on before the main stream gets to the same point,
+             * the pages of the next round could be overwritten by the zero
+             * pages of this one.
+             */
+            qemu_mutex_lock(&rs->lock);
+            s->synced = qemu_get_be32(s->file);
+            qemu_cond_broadcast(&rs->synced);
+            while (rs->round != s->synced && !s->quit) {
+                qemu_cond_wait(&rs->synced, &rs->lock);
+            }
+            qemu_mutex_unlock(&rs->lock);
+            break;
+        default:
+            return -EINVAL;
+        }
+    }
+}
+
+static void *ram_stream_recv_thread(void *opaque)
+{
+    RamStream *s = opaque;
+    RamStreams *rs = s->rs;
+    int ret = ram_stream_recv(s);
+
+    qemu_mutex_lock(&rs->lock);
+    if (!s->quit) {
+        ram_streams_set_error(rs, ret);
+    }
+    s->done = true;
+    qemu_cond_broadcast(&rs->synced);
+    qemu_mutex_unlock(&rs->lock);
+    return NULL;
+}
+
+/* Check that the RAM layout of the source is ours */
+static int ram_streams_load_blocks(RamStreams *rs, QEMUFile *f)
+{
+    uint32_t i, nblocks = qemu_get_be32(f);
+
+    qemu_ram_foreach_block(ram_streams_add_block, rs);
+    for (i = 0; i < nblocks; i++) {
+        ram_addr_t offset = qemu_get_be64(f);
+        ram_addr_t length = qemu_get_be64(f);
+        RamStreamBlock *b = ram_streams_find_block(rs, offset, length);
+
+        if (!b || b->offset != offset || b->length != length) {
+            error_report("migration: RAM block " RAM_ADDR_FMT "+" RAM_ADDR_FMT
+                         " of the source doesn't match ours", offset, length);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static int ram_streams_open_in(RamStreams *rs, QEMUFile *f)
+{
+    uint32_t count = qemu_get_be32(f);
+    int ret;
+
+    if (rs->streams || count == 0 || count > RAM_STREAMS_COUNT) {
+        return -EINVAL;
+    }
+    ret = ram_streams_load_blocks(rs, f);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The source connected them all before telling us */
+    rs->streams = g_new0(RamStream, count);
+    qemu_set_block(rs->listen_fd);
+    for (rs->count = 0; rs->count < count; rs->count++) {
+        RamStream *s = &rs->streams[rs->count];
+
+        do {
+            s->fd = qemu_accept(rs->listen_fd, NULL, NULL);
+        } while (s->fd < 0 && socket_error() == EINTR);
+        if (s->fd < 0) {
+            error_report("migration: could not accept RAM stream (%s)",
+                         strerror(socket_error()));
+            return -EIO;
+        }
+        qemu_set_block(s->fd);
+        s->rs = rs;
+        s->file = qemu_fopen_socket(s->fd, "rb");
+        qemu_thread_create(&s->thread, "ram-stream-recv",
+                           ram_stream_recv_thread, s, QEMU_THREAD_JOINABLE);
+    }
+    return 0;
+}
+
+static int ram_streams_sync_in(RamStreams *rs, QEMUFile *f)
+{
+    uint32_t round = qemu_get_be32(f);
+    int i, ret;
+
+    qemu_mutex_lock(&rs->lock);
+    for (i = 0; i < rs->count && !rs->error; i++) {
+        RamStream *s = &rs->streams[i];
+
+        while (s->synced != round && !s->done) {
+            qemu_cond_wait(&rs->synced, &rs->lock);
+        }
+        if (s->synced != round) {
+            ram_streams_set_error(rs, -EIO);
+        }
+    }
+    rs->round = round;
+    qemu_cond_broadcast(&rs->synced);
+    ret = rs->error;
+    qemu_mutex_unlock(&rs->lock);
+
+    if (ret < 0) {
+        error_report("migration: RAM stream failed: %s", strerror(-ret));
+    }
+    return ret;
+}
+
+static int ram_streams_hook_load(QEMUFile *f, void *opaque, uint64_t flags)
+{
+    RamStreams *rs = opaque;
+
+    switch (qemu_get_be32(f)) {
+    case RAM_STREAMS_OPEN:
+        return ram_streams_open_in(rs, f);
+    case RAM_STREAMS_SYNC:
+        return ram_streams_sync_in(rs, f);
+    default:
+        error_report("migration: unknown RAM hook");
+        return -EINVAL;
+    }
+}
+
+static int ram_streams_close_in(void *opaque)
+{
+    RamStreams *rs = opaque;
+    int i;
+
+    /* Unblock the readers; after the last sync they only wait for EOF */
+    qemu_mutex_lock(&rs->lock);
+    for (i = 0; i < rs->count; i++) {
+        rs->streams[i].quit = true;
+        shutdown(rs->streams[i].fd, 2);
+    }
+    qemu_cond_broadcast(&rs->synced);
+    qemu_mutex_unlock(&rs->lock);
+    for (i = 0; i < rs->count; i++) {
+        qemu_thread_join(&rs->streams[i].thread);
+        qemu_fclose(rs->streams[i].file);
+    }
+    closesocket(rs->listen_fd);
+    closesocket(rs->fd);
+    qemu_cond_destroy(&rs->idle);
+    qemu_cond_destroy(&rs->synced);
+    qemu_mutex_destroy(&rs->lock);
+    g_free(rs->streams);
+    g_free(rs->blocks);
+    g_free(rs);
+    return 0;
+}
+
+static const QEMUFileOps ram_streams_write_ops = {
+    .get_fd = ram_streams_get_fd,
+    .writev_buffer = ram_streams_writev_buffer,
+    .close = ram_streams_close_out,
+    .before_ram_iterate = ram_streams_before_iterate,
+    .after_ram_iterate = ram_streams_after_iterate,
+    .save_page = ram_streams_save_page,
+};
+
+static const QEMUFileOps ram_streams_read_ops = {
+    .get_fd = ram_streams_get_fd,
+    .get_buffer = ram_streams_get_buffer,
+    .close = ram_streams_close_in,
+    .hook_ram_load = ram_streams_hook_load,
+};
+
+static RamStreams *ram_streams_new(int fd)
+{
+    RamStreams *rs = g_new0(RamStreams, 1);
+
+    rs->fd = fd;
+    rs->listen_fd = -1;
+    qemu_mutex_init(&rs->lock);
+    qemu_cond_init(&rs->idle);
+    qemu_cond_init(&rs->synced);
+    return rs;
+}
+
+QEMUFile *qemu_fopen_ram_streams_out(int fd, const char *host_port)
+{
+    RamStreams *rs = ram_streams_new(fd);
+
+    qemu_set_block(fd);
+    rs->host_port = g_strdup(host_port);
+    rs->file = qemu_fopen_ops(rs, &ram_streams_write_ops);
+    return rs->file;
+}
+
+QEMUFile *qemu_fopen_ram_streams_in(int fd, int listen_fd)
+{
+    RamStreams *rs = ram_streams_new(fd);
+
+    rs->listen_fd = listen_fd;
+    rs->file = qemu_fopen_ops(rs, &ram_streams_read_ops);
+    return rs->file;
+}
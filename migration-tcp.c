@@ -33,9 +33,15 @@
     do { } while (0)
 #endif
 
+typedef struct TcpOutgoing {
+    MigrationState *s;
+    char *host_port;
+} TcpOutgoing;
+
 static void tcp_wait_for_connect(int fd, Error *err, void *opaque)
 {
-    MigrationState *s = opaque;
+    TcpOutgoing *out = opaque;
+    MigrationState *s = out->s;
 
     if (fd < 0) {
         DPRINTF("migrate connect error: %s\n", error_get_pretty(err));
@@ -43,14 +49,28 @@ static void tcp_wait_for_connect(int fd, Error *err, void *opaque)
         migrate_fd_error(s);
     } else {
         DPRINTF("migrate connect success\n");
-        s->file = qemu_fopen_socket(fd, "wb");
+        if (migrate_use_multi_stream()) {
+            s->file = qemu_fopen_ram_streams_out(fd, out->host_port);
+        } else {
+            s->file = qemu_fopen_socket(fd, "wb");
+        }
         migrate_fd_connect(s);
     }
+    g_free(out->host_port);
+    g_free(out);
 }
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
-    inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
+    TcpOutgoing *out = g_new(TcpOutgoing, 1);
+
+    out->s = s;
+    out->host_port = g_strdup(host_port);
+    if (inet_nonblocking_connect(host_port, tcp_wait_for_connect, out,
+                                 errp) < 0) {
+        g_free(out->host_port);
+        g_free(out);
+    }
 }
 
 static void tcp_accept_incoming_migration(void *opaque)
@@ -66,27 +86,19 @@ static void tcp_accept_incoming_migration(void *opaque)
         err = socket_error();
     } while (c < 0 && err == EINTR);
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    closesocket(s);
 
     DPRINTF("accepted migration\n");
 
     if (c < 0) {
         error_report("could not accept migration connection (%s)",
                      strerror(err));
+        closesocket(s);
         return;
     }
 
-    f = qemu_fopen_socket(c, "rb");
-    if (f == NULL) {
-        error_report("could not qemu_fopen socket");
-        goto out;
-    }
-
+    /* Still listening, for the RAM streams of a multi-stream source */
+    f = qemu_fopen_ram_streams_in(c, s);
     process_incoming_migration(f);
-    return;
-
-out:
-    closesocket(c);
 }
 
 void tcp_start_incoming_migration(const char *host_port, Error **errp)
@@ -73,6 +73,7 @@
 #include "android-console.h"
 #endif
 #include "qemu/thread.h"
+#include "qemu/sockets.h"
 #include "block/qapi.h"
 #include "qapi/qmp-event.h"
 #include "qapi-event.h"
@@ -190,6 +191,11 @@ struct Monitor {
     QString *outbuf;
     guint out_watch;
 
+    /* Output of monitors created by monitor_fake_new() */
+    MonitorFakeFunc *fake_func;
+    void *fake_opaque;
+    int fake_bytes;
+
     /* Read under either BQL or out_lock, written with BQL+out_lock.  */
     int mux_out;
 
@@ -310,6 +316,16 @@ static void monitor_flush_locked(Monitor *mon)
     buf = qstring_get_str(mon->outbuf);
     len = qstring_get_length(mon->outbuf);
 
+    if (mon->fake_func) {
+        if (len) {
+            mon->fake_func(mon->fake_opaque, buf, len);
+            mon->fake_bytes += len;
+            QDECREF(mon->outbuf);
+            mon->outbuf = qstring_new();
+        }
+        return;
+    }
+
     if (len && !mon->mux_out) {
         rc = qemu_chr_fe_write(mon->chr, (const uint8_t *) buf, len);
         if ((rc < 0 && errno != EAGAIN) || (rc == len)) {
@@ -341,19 +357,19 @@ void monitor_flush(Monitor *mon)
 /* flush at every end of line */
 static void monitor_puts(Monitor *mon, const char *str)
 {
-    char c;
-
     qemu_mutex_lock(&mon->out_lock);
-    for(;;) {
-        c = *str++;
-        if (c == '\0')
-            break;
-        if (c == '\n') {
-            qstring_append_chr(mon->outbuf, '\r');
-        }
-        qstring_append_chr(mon->outbuf, c);
-        if (c == '\n') {
+    while (*str) {
+        size_t len = strcspn(str, "\n");
+
+        qstring_append_len(mon->outbuf, str, len);
+        str += len;
+        if (*str == '\n') {
+            if (!mon->fake_func) {
+                qstring_append_chr(mon->outbuf, '\r');
+            }
+            qstring_append_chr(mon->outbuf, '\n');
             monitor_flush_locked(mon);
+            str++;
         }
     }
     qemu_mutex_unlock(&mon->out_lock);
@@ -663,6 +679,33 @@ out:
     return output;
 }
 
+/* Create a monitor which isn't attached to a character device and passes
+ * everything printed to it to @func, one line at a time. This lets code
+ * outside of the monitor run commands that report through a Monitor. */
+Monitor *monitor_fake_new(void *opaque, MonitorFakeFunc *func)
+{
+    Monitor *mon = g_malloc(sizeof(*mon));
+
+    monitor_data_init(mon);
+    mon->fake_func = func;
+    mon->fake_opaque = opaque;
+    return mon;
+}
+
+/* Number of bytes printed to the fake monitor @mon so far */
+int monitor_fake_get_bytes(Monitor *mon)
+{
+    monitor_flush(mon);
+    return mon->fake_bytes;
+}
+
+void monitor_fake_free(Monitor *mon)
+{
+    monitor_flush(mon);
+    monitor_data_destroy(mon);
+    g_free(mon);
+}
+
 static int compare_cmd(const char *name, const char *list)
 {
     const char *p, *pstart;
@@ -1160,6 +1203,12 @@ static void do_info_jit(Monitor *mon, const QDict *qdict)
     dump_drift_info((FILE *)mon, monitor_fprintf);
 }
 
+static void do_info_hot_tbs(Monitor *mon, const QDict *qdict)
+{
+    dump_hot_tbs((FILE *)mon, monitor_fprintf,
+                 qdict_get_try_int(qdict, "count", 20));
+}
+
 static void do_info_history(Monitor *mon, const QDict *qdict)
 {
     int i;
@@ -1268,6 +1317,23 @@ static void do_singlestep(Monitor *mon, const QDict *qdict)
     }
 }
 
+static void do_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    const char *option = qdict_get_try_str(qdict, "option");
+
+    if (!tcg_enabled()) {
+        monitor_printf(mon, "TB profiling needs TCG\n");
+    } else if (!option || !strcmp(option, "on")) {
+        tb_profile_set(mon_get_cpu(), 1);
+    } else if (!strcmp(option, "off")) {
+        tb_profile_set(mon_get_cpu(), 0);
+    } else if (!strcmp(option, "reset")) {
+        tb_profile_reset();
+    } else {
+        monitor_printf(mon, "unexpected option %s\n", option);
+    }
+}
+
 static void do_gdbserver(Monitor *mon, const QDict *qdict)
 {
     const char *device = qdict_get_try_str(qdict, "device");
@@ -2856,6 +2922,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show dynamic compiler info",
         .mhandler.cmd = do_info_jit,
     },
+    {
+        .name       = "hot-tbs",
+        .args_type  = "count:i?",
+        .params     = "[count]",
+        .help       = "show the most executed translation blocks",
+        .mhandler.cmd = do_info_hot_tbs,
+    },
     {
         .name       = "kvm",
         .args_type  = "",
@@ -5174,18 +5247,16 @@ static void qmp_call_cmd(Monitor *mon, const mon_cmd_t *cmd,
     qobject_decref(data);
 }
 
-static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
+/* Run the request @obj, NULL if it couldn't be parsed, and take it over */
+static void handle_qmp_input(Monitor *mon, QObject *obj)
 {
     int err;
-    QObject *obj;
     QDict *input, *args;
     const mon_cmd_t *cmd;
     const char *cmd_name;
-    Monitor *mon = cur_mon;
 
     args = input = NULL;
 
-    obj = json_parser_parse(tokens, NULL);
     if (!obj) {
         // FIXME: should be triggered in json_parser_parse()
         qerror_report(QERR_JSON_PARSING);
@@ -5246,6 +5317,11 @@ out:
     QDECREF(args);
 }
 
+static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
+{
+    handle_qmp_input(cur_mon, json_parser_parse(tokens, NULL));
+}
+
 /**
  * monitor_control_read(): Read and handle QMP input
  */
@@ -5353,6 +5429,283 @@ static void monitor_control_event(void *opaque, int event)
     }
 }
 
+/*
+ * QMP served from a thread of its own, see -qmp-thread.  The thread reads
+ * and parses the requests, answers right away the commands flagged with
+ * MONITOR_CMD_NO_BQL, which only read statistics, and queues the others
+ * for the main loop.  The main loop runs them on a monitor without a
+ * chardev, which sends the replies and events back to the client.
+ *
+ * So the no-BQL queries are answered even while the main loop is stuck in
+ * a long command, and a flood of requests is parsed off the main loop.
+ * Their replies may overtake those of earlier commands, clients that mix
+ * the two should use "id".  Clients are served one at a time.
+ */
+typedef struct QmpThreadRequest {
+    QObject *input;             /* NULL if it couldn't be parsed */
+    bool connect;               /* a new client, to greet */
+    unsigned int conn;
+    QSIMPLEQ_ENTRY(QmpThreadRequest) entry;
+} QmpThreadRequest;
+
+typedef struct QmpThread {
+    QemuThread thread;
+    int listen_fd;
+    JSONMessageParser parser;   /* only used by the thread */
+    unsigned int read_conn;     /* only used by the thread */
+
+    /* The current client, and a count of the clients so far, so that
+     * replies to a client that left are dropped. */
+    QemuMutex write_lock;
+    int fd;
+    unsigned int conn;
+
+    QemuMutex lock;
+    QSIMPLEQ_HEAD(, QmpThreadRequest) requests;
+
+    /* Main loop side. */
+    QEMUBH *bh;
+    Monitor *mon;
+    unsigned int mon_conn;      /* client of the request being run */
+} QmpThread;
+
+static QmpThread *qmp_thread;
+
+static void qmp_thread_send(QmpThread *qt, unsigned int conn,
+                            const char *buf, size_t len)
+{
+    qemu_mutex_lock(&qt->write_lock);
+    while (qt->fd >= 0 && qt->conn == conn && len) {
+        ssize_t ret = send(qt->fd, buf, len, 0);
+
+        if (ret < 0) {
+            if (socket_error() == EINTR) {
+                continue;
+            }
+            break;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    qemu_mutex_unlock(&qt->write_lock);
+}
+
+static void qmp_thread_output(void *opaque, const char *buf, int len)
+{
+    QmpThread *qt = opaque;
+
+    qmp_thread_send(qt, qt->mon_conn, buf, len);
+}
+
+static void qmp_thread_bh(void *opaque)
+{
+    QmpThread *qt = opaque;
+    Monitor *old_mon = cur_mon;
+    QmpThreadRequest *req;
+    QObject *data;
+
+    cur_mon = qt->mon;
+    for (;;) {
+        qemu_mutex_lock(&qt->lock);
+        req = QSIMPLEQ_FIRST(&qt->requests);
+        if (req) {
+            QSIMPLEQ_REMOVE_HEAD(&qt->requests, entry);
+        }
+        qemu_mutex_unlock(&qt->lock);
+        if (!req) {
+            break;
+        }
+
+        qt->mon_conn = req->conn;
+        if (req->connect) {
+            qt->mon->mc->command_mode = 0;
+            data = get_qmp_greeting();
+            monitor_json_emitter(qt->mon, data);
+            qobject_decref(data);
+        } else {
+            handle_qmp_input(qt->mon, req->input);
+        }
+        g_free(req);
+    }
+    cur_mon = old_mon;
+}
+
+static void qmp_thread_queue(QmpThread *qt, QObject *input, bool connect)
+{
+    QmpThreadRequest *req = g_new0(QmpThreadRequest, 1);
+
+    req->input = input;
+    req->connect = connect;
+    req->conn = qt->read_conn;
+    qemu_mutex_lock(&qt->lock);
+    QSIMPLEQ_INSERT_TAIL(&qt->requests, req, entry);
+    qemu_mutex_unlock(&qt->lock);
+    qemu_bh_schedule(qt->bh);
+}
+
+/* Answer @obj from the thread if it is a MONITOR_CMD_NO_BQL command
+ * without arguments, which can't fail.  Anything else, including
+ * malformed requests, is left for the main loop to run or report. */
+static bool qmp_thread_answer(QmpThread *qt, QObject *obj)
+{
+    QDict *input, *args, *rsp;
+    const QDictEntry *ent;
+    const mon_cmd_t *cmd;
+    const char *cmd_name;
+    QObject *data = NULL, *id;
+    QString *json;
+
+    if (qobject_type(obj) != QTYPE_QDICT ||
+        !atomic_read(&qt->mon->mc->command_mode)) {
+        return false;
+    }
+    input = qobject_to_qdict(obj);
+    for (ent = qdict_first(input); ent; ent = qdict_next(input, ent)) {
+        const char *key = qdict_entry_key(ent);
+        QObject *value = qdict_entry_value(ent);
+
+        if (!strcmp(key, "execute")) {
+            if (qobject_type(value) != QTYPE_QSTRING) {
+                return false;
+            }
+        } else if (!strcmp(key, "arguments")) {
+            if (qobject_type(value) != QTYPE_QDICT ||
+                qdict_size(qobject_to_qdict(value))) {
+                return false;
+            }
+        } else if (strcmp(key, "id")) {
+            return false;
+        }
+    }
+    cmd_name = qdict_get_try_str(input, "execute");
+    cmd = cmd_name ? qmp_find_cmd(cmd_name) : NULL;
+    if (!cmd || !(cmd->flags & MONITOR_CMD_NO_BQL)) {
+        return false;
+    }
+
+    args = qdict_new();
+    cmd->mhandler.cmd_new(NULL, args, &data);
+    QDECREF(args);
+
+    rsp = qdict_new();
+    if (data) {
+        qdict_put_obj(rsp, "return", data);
+    } else {
+        qdict_put(rsp, "return", qdict_new());
+    }
+    id = qdict_get(input, "id");
+    if (id) {
+        qobject_incref(id);
+        qdict_put_obj(rsp, "id", id);
+    }
+    json = qobject_to_json(QOBJECT(rsp));
+    qstring_append_chr(json, '\n');
+    qmp_thread_send(qt, qt->read_conn, qstring_get_str(json),
+                    qstring_get_length(json));
+    QDECREF(json);
+    QDECREF(rsp);
+    qobject_decref(obj);
+    return true;
+}
+
+static void qmp_thread_handle(JSONMessageParser *parser, GQueue *tokens)
+{
+    QmpThread *qt = container_of(parser, QmpThread, parser);
+    QObject *obj = json_parser_parse(tokens, NULL);
+
+    if (!obj || !qmp_thread_answer(qt, obj)) {
+        qmp_thread_queue(qt, obj, false);
+    }
+}
+
+static void *qmp_thread_run(void *opaque)
+{
+    QmpThread *qt = opaque;
+    char buf[4096];
+    ssize_t len;
+    int fd;
+
+    for (;;) {
+        fd = qemu_accept(qt->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (socket_error() == EINTR || socket_error() == ECONNABORTED) {
+                continue;
+            }
+            error_report("qmp-thread: accept failed: %s",
+                         strerror(socket_error()));
+            break;
+        }
+
+        qemu_mutex_lock(&qt->write_lock);
+        qt->fd = fd;
+        qt->read_conn = ++qt->conn;
+        qemu_mutex_unlock(&qt->write_lock);
+
+        qmp_thread_queue(qt, NULL, true);
+        json_message_parser_init(&qt->parser, qmp_thread_handle);
+        for (;;) {
+            len = qemu_recv(fd, buf, sizeof(buf), 0);
+            if (len < 0 && socket_error() == EINTR) {
+                continue;
+            }
+            if (len <= 0) {
+                break;
+            }
+            json_message_parser_feed(&qt->parser, buf, len);
+        }
+        json_message_parser_destroy(&qt->parser);
+
+        qemu_mutex_lock(&qt->write_lock);
+        qt->fd = -1;
+        qemu_mutex_unlock(&qt->write_lock);
+        closesocket(fd);
+    }
+    return NULL;
+}
+
+/* Serve QMP on @address, "host:port" or "unix:path", from a new thread */
+int monitor_qmp_thread_init(const char *address, Error **errp)
+{
+    SocketAddress *addr;
+    QmpThread *qt;
+    int fd;
+
+    if (qmp_thread) {
+        error_setg(errp, "QMP is already served from a thread");
+        return -1;
+    }
+    addr = socket_parse(address, errp);
+    if (!addr) {
+        return -1;
+    }
+    fd = socket_listen_addr(addr, errp);
+    qapi_free_SocketAddress(addr);
+    if (fd < 0) {
+        return -1;
+    }
+    qemu_set_block(fd);
+
+    qt = g_new0(QmpThread, 1);
+    qt->listen_fd = fd;
+    qt->fd = -1;
+    qemu_mutex_init(&qt->write_lock);
+    qemu_mutex_init(&qt->lock);
+    QSIMPLEQ_INIT(&qt->requests);
+    qt->bh = qemu_bh_new(qmp_thread_bh, qt);
+
+    qt->mon = monitor_fake_new(qt, qmp_thread_output);
+    qt->mon->flags = MONITOR_USE_CONTROL;
+    qt->mon->mc = g_malloc0(sizeof(MonitorControl));
+    qemu_mutex_lock(&monitor_lock);
+    QLIST_INSERT_HEAD(&mon_list, qt->mon, entry);
+    qemu_mutex_unlock(&monitor_lock);
+
+    qmp_thread = qt;
+    qemu_thread_create(&qt->thread, "qmp", qmp_thread_run, qt,
+                       QEMU_THREAD_DETACHED);
+    return 0;
+}
+
 static void monitor_event(void *opaque, int event)
 {
     Monitor *mon = opaque;
@@ -5632,6 +5985,34 @@ mon_cmd_t* monitor_get_android_cmds() {
     return android_cmds;
 }
 
+#ifdef CONFIG_ANDROID
+/* Run the android console command @cmdline on a monitor of its own, and
+ * return what it printed. Lets a single request run several commands. */
+char *monitor_android_console_run(const char *cmdline)
+{
+    Monitor *old_mon, mon;
+    char *output;
+
+    monitor_data_init(&mon);
+    mon.skip_flush = true;
+    mon.flags = MONITOR_ANDROID_CONSOLE;
+    mon.cmds.static_table = android_cmds;
+    mon.print_error = android_monitor_print_error;
+
+    old_mon = cur_mon;
+    cur_mon = &mon;
+    handle_user_command(&mon, cmdline);
+    cur_mon = old_mon;
+
+    qemu_mutex_lock(&mon.out_lock);
+    output = g_strdup(qstring_get_str(mon.outbuf));
+    qemu_mutex_unlock(&mon.out_lock);
+
+    monitor_data_destroy(&mon);
+    return output;
+}
+#endif
+
 static void bdrv_password_cb(void *opaque, const char *password,
                              void *readline_opaque)
 {
@@ -41,6 +41,10 @@
 #include "qemu/queue.h"
 #include "qemu/main-loop.h"
 
+#ifdef CONFIG_LINUX
+#include <sys/sendfile.h>
+#endif
+
 //#define DEBUG_NBD
 
 #ifdef DEBUG_NBD
@@ -95,8 +99,21 @@ struct NBDRequest {
     QSIMPLEQ_ENTRY(NBDRequest) entry;
     NBDClient *client;
     uint8_t *data;
+    bool pooled;
+
+    /* When data is NULL, a read is sent from there instead */
+    int host_fd;
+    off_t host_offset;
 };
 
+/* Requests up to this size get their buffer from the export's pool, which
+ * covers what the Linux and QEMU clients send.  The buffers for
+ * MAX_NBD_REQUESTS requests are allocated with the export, and up to
+ * NBD_POOL_MAX are kept for the clients of an export.
+ */
+#define NBD_POOL_BUFFER_SIZE    (1024 * 1024)
+#define NBD_POOL_MAX            64
+
 struct NBDExport {
     int refcount;
     void (*close)(NBDExport *exp);
@@ -110,6 +127,9 @@ struct NBDExport {
     QTAILQ_ENTRY(NBDExport) next;
 
     AioContext *ctx;
+
+    uint8_t *buffers[NBD_POOL_MAX];
+    int nb_buffers;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -912,14 +932,33 @@ static NBDRequest *nbd_request_get(NBDClient *client)
     req = g_slice_new0(NBDRequest);
     nbd_client_get(client);
     req->client = client;
+    req->host_fd = -1;
     return req;
 }
 
+static void nbd_request_alloc_data(NBDRequest *req, uint32_t len)
+{
+    NBDExport *exp = req->client->exp;
+
+    if (len > NBD_POOL_BUFFER_SIZE) {
+        req->data = qemu_blockalign(exp->bs, len);
+    } else if (exp->nb_buffers) {
+        req->data = exp->buffers[--exp->nb_buffers];
+        req->pooled = true;
+    } else {
+        req->data = qemu_blockalign(exp->bs, NBD_POOL_BUFFER_SIZE);
+        req->pooled = true;
+    }
+}
+
 static void nbd_request_put(NBDRequest *req)
 {
     NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
 
-    if (req->data) {
+    if (req->pooled && exp->nb_buffers < NBD_POOL_MAX) {
+        exp->buffers[exp->nb_buffers++] = req->data;
+    } else if (req->data) {
         qemu_vfree(req->data);
     }
     g_slice_free(NBDRequest, req);
@@ -970,6 +1009,10 @@ NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
     exp->size = size == -1 ? bdrv_getlength(bs) : size;
     exp->close = close;
     exp->ctx = bdrv_get_aio_context(bs);
+    while (exp->nb_buffers < MAX_NBD_REQUESTS) {
+        exp->buffers[exp->nb_buffers++] = qemu_blockalign(bs,
+                                                          NBD_POOL_BUFFER_SIZE);
+    }
     bdrv_ref(bs);
     bdrv_add_aio_context_notifier(bs, bs_aio_attached, bs_aio_detach, exp);
     /*
@@ -1052,6 +1095,9 @@ void nbd_export_put(NBDExport *exp)
             exp->close(exp);
         }
 
+        while (exp->nb_buffers) {
+            qemu_vfree(exp->buffers[--exp->nb_buffers]);
+        }
         g_free(exp);
     }
 }
@@ -1070,6 +1116,42 @@ void nbd_export_close_all(void)
     }
 }
 
+#ifdef CONFIG_LINUX
+static ssize_t coroutine_fn nbd_co_sendfile(int csock, int fd, off_t offset,
+                                            size_t len)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < len) {
+        ret = sendfile(csock, fd, &offset, len - done);
+        if (ret > 0) {
+            done += ret;
+        } else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            qemu_coroutine_yield();
+        } else if (ret < 0 && errno == EINTR) {
+            continue;
+        } else {
+            /* Past the end of the file, or a read error */
+            break;
+        }
+    }
+    return done;
+}
+#endif
+
+static ssize_t nbd_co_send_data(NBDRequest *req, int len)
+{
+    int csock = req->client->sock;
+
+#ifdef CONFIG_LINUX
+    if (!req->data) {
+        return nbd_co_sendfile(csock, req->host_fd, req->host_offset, len);
+    }
+#endif
+    return qemu_co_send(csock, req->data, len);
+}
+
 static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
                                  int len)
 {
@@ -1087,7 +1169,7 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
         socket_set_cork(csock, 1);
         rc = nbd_send_reply(csock, reply);
         if (rc >= 0) {
-            ret = qemu_co_send(csock, req->data, len);
+            ret = nbd_co_send_data(req, len);
             if (ret != len) {
                 rc = -EIO;
             }
@@ -1136,10 +1218,8 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
     TRACE("Decoding type");
 
     command = request->type & NBD_CMD_MASK_COMMAND;
-    if (command == NBD_CMD_READ || command == NBD_CMD_WRITE) {
-        req->data = qemu_blockalign(client->exp->bs, request->len);
-    }
     if (command == NBD_CMD_WRITE) {
+        nbd_request_alloc_data(req, request->len);
         TRACE("Reading %u byte(s)", request->len);
 
         if (qemu_co_recv(csock, req->data, request->len) != request->len) {
@@ -1157,6 +1237,21 @@ out:
     return rc;
 }
 
+/*
+ * Reads from read-only exports of raw files skip the buffer and go from the
+ * page cache to the socket.  Writable exports keep using a buffer, since
+ * a failed read could then only be reported by closing the connection.
+ */
+static bool nbd_can_send_host_fd(NBDExport *exp, struct nbd_request *request)
+{
+#ifdef CONFIG_LINUX
+    return (exp->nbdflags & NBD_FLAG_READ_ONLY) && request->len &&
+           bdrv_get_host_fd(exp->bs) >= 0;
+#else
+    return false;
+#endif
+}
+
 static void nbd_trip(void *opaque)
 {
     NBDClient *client = opaque;
@@ -1211,6 +1306,21 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (nbd_can_send_host_fd(exp, &request)) {
+            /* The data is copied to the socket by the kernel.  A read error
+             * past this point has to close the connection, since the reply
+             * header is already sent.
+             */
+            req->host_fd = bdrv_get_host_fd(exp->bs);
+            req->host_offset = request.from + exp->dev_offset;
+            TRACE("Sending %u byte(s) from the image file", request.len);
+            if (nbd_co_send_reply(req, &reply, request.len) < 0) {
+                goto out;
+            }
+            break;
+        }
+
+        nbd_request_alloc_data(req, request.len);
         ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
                         req->data, request.len / 512);
         if (ret < 0) {
@@ -21,18 +21,97 @@
 #define PROTO_TCP  6
 #define PROTO_UDP 17
 
-uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+/*
+ * One's complement sum of the 16-bit words of buf in host byte order, not
+ * folded.  The sum does not depend on the byte order except for swapping
+ * the two bytes of the result (RFC 1071), so the words are added as they
+ * are in memory, several at a time.
+ */
+static uint64_t net_checksum_add_native(const uint8_t *buf, size_t len)
 {
-    uint32_t sum = 0;
-    int i;
+    uint64_t sum = 0;
+
+#if defined(__SSE2__) || defined(__aarch64__)
+    while (len >= 16) {
+        /* Each round adds at most 2 * 0xffff to a 32-bit lane */
+        size_t n = MIN(len / 16, 0x8000);
+        uint32_t lanes[4];
+        size_t i;
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        __m128i acc = zero;
+
+        for (i = 0; i < n; i++, buf += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)buf);
+
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+        }
+        _mm_storeu_si128((__m128i *)lanes, acc);
+#else
+        uint32x4_t acc = vdupq_n_u32(0);
 
-    for (i = seq; i < seq + len; i++) {
-        if (i & 1) {
-            sum += (uint32_t)buf[i - seq];
-        } else {
-            sum += (uint32_t)buf[i - seq] << 8;
+        for (i = 0; i < n; i++, buf += 16) {
+            acc = vpadalq_u16(acc, vreinterpretq_u16_u8(vld1q_u8(buf)));
         }
+        vst1q_u32(lanes, acc);
+#endif
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        len -= n * 16;
+    }
+#endif
+
+    /* 2^32 is 1 modulo 0xffff, so 32-bit words can be added as well */
+    for (; len >= 4; len -= 4, buf += 4) {
+        uint32_t v;
+
+        memcpy(&v, buf, 4);
+        sum += v;
+    }
+    if (len >= 2) {
+        uint16_t v;
+
+        memcpy(&v, buf, 2);
+        sum += v;
+        len -= 2;
+        buf += 2;
+    }
+    if (len) {
+        /* Padded with a zero byte */
+#ifdef HOST_WORDS_BIGENDIAN
+        sum += (uint32_t)buf[0] << 8;
+#else
+        sum += buf[0];
+#endif
+    }
+    return sum;
+}
+
+uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+{
+    uint64_t sum;
+
+    if (len <= 0) {
+        return 0;
+    }
+
+    /* Folding keeps the sum modulo 0xffff, and only gives zero for zero */
+    sum = net_checksum_add_native(buf, len);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+
+    /* Bytes at even offsets of the packet are the most significant ones */
+#ifdef HOST_WORDS_BIGENDIAN
+    if (seq & 1) {
+        sum = bswap16(sum);
+    }
+#else
+    if (!(seq & 1)) {
+        sum = bswap16(sum);
     }
+#endif
     return sum;
 }
 
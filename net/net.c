@@ -202,6 +202,37 @@ static void qemu_net_client_destructor(NetClientState *nc)
     g_free(nc);
 }
 
+/* The queue stays until the collector is removed, its counters are only
+ * read, so the BQL isn't needed. */
+static void qemu_net_client_metrics(MetricsWriter *w, void *opaque)
+{
+    NetClientState *nc = opaque;
+    NetQueueStats stats;
+    char queue_index[16];
+    char *labels;
+
+    qemu_net_queue_get_stats(nc->incoming_queue, &stats);
+    snprintf(queue_index, sizeof(queue_index), "%u", nc->queue_index);
+    labels = metrics_labels("name", nc->name, "queue", queue_index, NULL);
+
+    metrics_family(w, "qemu_net_queue_depth", METRIC_GAUGE,
+                   "Packets waiting in the incoming queue");
+    metrics_sample_int(w, "qemu_net_queue_depth", labels, stats.count);
+    metrics_family(w, "qemu_net_queue_limit", METRIC_GAUGE,
+                   "Packets the incoming queue holds before dropping");
+    metrics_sample_int(w, "qemu_net_queue_limit", labels, stats.max_len);
+    metrics_family(w, "qemu_net_queue_depth_max", METRIC_GAUGE,
+                   "Highest number of packets in the incoming queue");
+    metrics_sample_int(w, "qemu_net_queue_depth_max", labels, stats.peak);
+    metrics_family(w, "qemu_net_queue_packets", METRIC_COUNTER,
+                   "Packets that went through the incoming queue");
+    metrics_sample_int(w, "qemu_net_queue_packets", labels, stats.queued);
+    metrics_family(w, "qemu_net_queue_dropped", METRIC_COUNTER,
+                   "Packets dropped because the incoming queue was full");
+    metrics_sample_int(w, "qemu_net_queue_dropped", labels, stats.dropped);
+    g_free(labels);
+}
+
 static void qemu_net_client_setup(NetClientState *nc,
                                   NetClientInfo *info,
                                   NetClientState *peer,
@@ -226,6 +257,7 @@ static void qemu_net_client_setup(NetClientState *nc,
 
     nc->incoming_queue = qemu_new_net_queue(nc);
     nc->destructor = destructor;
+    nc->metrics = metrics_collector_add(qemu_net_client_metrics, nc);
 }
 
 NetClientState *qemu_new_net_client(NetClientInfo *info,
@@ -306,6 +338,10 @@ static void qemu_cleanup_net_client(NetClientState *nc)
 
 static void qemu_free_net_client(NetClientState *nc)
 {
+    if (nc->metrics) {
+        metrics_collector_remove(nc->metrics);
+        nc->metrics = NULL;
+    }
     if (nc->incoming_queue) {
         qemu_del_net_queue(nc->incoming_queue);
     }
@@ -1115,6 +1151,64 @@ RxFilterInfoList *qmp_query_rx_filter(bool has_name, const char *name,
     return filter_list;
 }
 
+NetQueueInfoList *qmp_query_net_queues(bool has_name, const char *name,
+                                       Error **errp)
+{
+    NetQueueInfoList *head = NULL, **tail = &head;
+    NetClientState *nc;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        NetQueueInfoList *entry;
+        NetQueueInfo *info;
+        NetQueueStats stats;
+
+        if (has_name && strcmp(nc->name, name) != 0) {
+            continue;
+        }
+        qemu_net_queue_get_stats(nc->incoming_queue, &stats);
+
+        info = g_new0(NetQueueInfo, 1);
+        info->name = g_strdup(nc->name);
+        info->queue_index = nc->queue_index;
+        info->depth = stats.count;
+        info->limit = stats.max_len;
+        info->peak = stats.peak;
+        info->queued = stats.queued;
+        info->dropped = stats.dropped;
+
+        entry = g_new0(NetQueueInfoList, 1);
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    if (!head && has_name) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, name);
+    }
+    return head;
+}
+
+void qmp_set_net_queue_limit(const char *name, int64_t limit, Error **errp)
+{
+    NetClientState *nc;
+    bool found = false;
+
+    if (limit < 1 || limit > 1000000) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "limit",
+                  "a number of packets between 1 and 1000000");
+        return;
+    }
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        if (!strcmp(nc->name, name)) {
+            qemu_net_queue_set_max_len(nc->incoming_queue, limit);
+            found = true;
+        }
+    }
+    if (!found) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, name);
+    }
+}
+
 void do_info_network(Monitor *mon, const QDict *qdict)
 {
     NetClientState *nc, *peer;
@@ -44,16 +44,37 @@ struct NetPacket {
     NetClientState *sender;
     unsigned flags;
     int size;
+    int size_class;
     NetPacketSent *sent_cb;
     uint8_t data[0];
 };
 
+/* Delivered packets are kept for reuse, by size class, so that a queue
+ * under backpressure doesn't allocate for each packet.  Bigger packets,
+ * and packets beyond max_free, are freed.
+ */
+static const struct {
+    size_t size;
+    unsigned max_free;
+} net_packet_classes[] = {
+    { 256, 256 },           /* ACKs and other small packets */
+    { 2048, 256 },          /* up to the Ethernet MTU */
+    { NET_BUFSIZE, 8 },     /* GSO and jumbo frames */
+};
+
+#define NET_PACKET_CLASSES ARRAY_SIZE(net_packet_classes)
+
 struct NetQueue {
     void *opaque;
     uint32_t nq_maxlen;
     uint32_t nq_count;
+    uint32_t nq_peak;
+    uint64_t nq_queued;
+    uint64_t nq_dropped;
 
     QTAILQ_HEAD(packets, NetPacket) packets;
+    QTAILQ_HEAD(, NetPacket) free_packets[NET_PACKET_CLASSES];
+    unsigned nb_free_packets[NET_PACKET_CLASSES];
 
     unsigned delivering : 1;
 };
@@ -61,6 +82,7 @@ struct NetQueue {
 NetQueue *qemu_new_net_queue(void *opaque)
 {
     NetQueue *queue;
+    int i;
 
     queue = g_malloc0(sizeof(NetQueue));
 
@@ -69,6 +91,9 @@ NetQueue *qemu_new_net_queue(void *opaque)
     queue->nq_count = 0;
 
     QTAILQ_INIT(&queue->packets);
+    for (i = 0; i < NET_PACKET_CLASSES; i++) {
+        QTAILQ_INIT(&queue->free_packets[i]);
+    }
 
     queue->delivering = 0;
 
@@ -78,15 +103,81 @@ NetQueue *qemu_new_net_queue(void *opaque)
 void qemu_del_net_queue(NetQueue *queue)
 {
     NetPacket *packet, *next;
+    int i;
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         g_free(packet);
     }
+    for (i = 0; i < NET_PACKET_CLASSES; i++) {
+        QTAILQ_FOREACH_SAFE(packet, &queue->free_packets[i], entry, next) {
+            QTAILQ_REMOVE(&queue->free_packets[i], packet, entry);
+            g_free(packet);
+        }
+    }
 
     g_free(queue);
 }
 
+void qemu_net_queue_set_max_len(NetQueue *queue, uint32_t max_len)
+{
+    queue->nq_maxlen = max_len;
+}
+
+void qemu_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats)
+{
+    stats->count = queue->nq_count;
+    stats->max_len = queue->nq_maxlen;
+    stats->peak = queue->nq_peak;
+    stats->queued = queue->nq_queued;
+    stats->dropped = queue->nq_dropped;
+}
+
+static NetPacket *net_packet_alloc(NetQueue *queue, size_t size)
+{
+    NetPacket *packet;
+    int c;
+
+    for (c = 0; c < NET_PACKET_CLASSES; c++) {
+        if (size <= net_packet_classes[c].size) {
+            break;
+        }
+    }
+    if (c == NET_PACKET_CLASSES) {
+        packet = g_malloc(sizeof(NetPacket) + size);
+    } else if (QTAILQ_EMPTY(&queue->free_packets[c])) {
+        packet = g_malloc(sizeof(NetPacket) + net_packet_classes[c].size);
+    } else {
+        packet = QTAILQ_FIRST(&queue->free_packets[c]);
+        QTAILQ_REMOVE(&queue->free_packets[c], packet, entry);
+        queue->nb_free_packets[c]--;
+    }
+    packet->size_class = c;
+    return packet;
+}
+
+static void net_packet_free(NetQueue *queue, NetPacket *packet)
+{
+    int c = packet->size_class;
+
+    if (c == NET_PACKET_CLASSES ||
+        queue->nb_free_packets[c] >= net_packet_classes[c].max_free) {
+        g_free(packet);
+        return;
+    }
+    /* The most recently used packet is still in the cache */
+    QTAILQ_INSERT_HEAD(&queue->free_packets[c], packet, entry);
+    queue->nb_free_packets[c]++;
+}
+
+static void qemu_net_queue_insert(NetQueue *queue, NetPacket *packet)
+{
+    queue->nq_count++;
+    queue->nq_queued++;
+    queue->nq_peak = MAX(queue->nq_peak, queue->nq_count);
+    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+}
+
 static void qemu_net_queue_append(NetQueue *queue,
                                   NetClientState *sender,
                                   unsigned flags,
@@ -97,17 +188,17 @@ static void qemu_net_queue_append(NetQueue *queue,
     NetPacket *packet;
 
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+        queue->nq_dropped++;
         return; /* drop if queue full and no callback */
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
+    packet = net_packet_alloc(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
     memcpy(packet->data, buf, size);
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_insert(queue, packet);
 }
 
 static void qemu_net_queue_append_iov(NetQueue *queue,
@@ -122,13 +213,14 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
     int i;
 
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+        queue->nq_dropped++;
         return; /* drop if queue full and no callback */
     }
     for (i = 0; i < iovcnt; i++) {
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = net_packet_alloc(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -141,8 +233,7 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
         packet->size += len;
     }
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_insert(queue, packet);
 }
 
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
@@ -236,7 +327,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
-            g_free(packet);
+            net_packet_free(queue, packet);
         }
     }
 }
@@ -266,7 +357,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        net_packet_free(queue, packet);
     }
     return true;
 }
@@ -107,7 +107,7 @@ static inline void slirp_smb_cleanup(SlirpState *s) { }
 void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len)
 {
 #if defined(CONFIG_ANDROID) && defined(USE_ANDROID_EMU)
-    netshaper_send(slirp_shaper_out, (void*)pkt, pkt_len);
+    slirp_shaper_send_out(pkt, pkt_len);
 #else
     SlirpState *s = opaque;
 
@@ -118,7 +118,7 @@ void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len)
 static ssize_t net_slirp_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
 #if defined(CONFIG_ANDROID) && defined(USE_ANDROID_EMU)
-    netshaper_send(slirp_shaper_in, (char*)buf, size);
+    slirp_shaper_send_in(buf, size);
 #else
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
 
@@ -150,7 +150,9 @@ static int net_slirp_init(NetClientState *peer, const char *model,
                           const char *vhostname, const char *tftp_export,
                           const char *bootfile, const char *vdhcp_start,
                           const char *vnameserver, const char *smb_export,
-                          const char *vsmbserver, const char **dnssearch)
+                          const char *vsmbserver, const char **dnssearch,
+                          bool large_window, bool dns_cache,
+                          bool dns_cache_shared)
 {
     /* default settings according to historic slirp */
     struct in_addr net  = { .s_addr = htonl(0x0a000200) }; /* 10.0.2.0 */
@@ -257,6 +259,8 @@ static int net_slirp_init(NetClientState *peer, const char *model,
 
     s->slirp = slirp_init(restricted, net, mask, host, vhostname,
                           tftp_export, bootfile, dhcp, dns, dnssearch, s);
+    slirp_set_large_window(s->slirp, large_window);
+    slirp_set_dns_cache(s->slirp, dns_cache, dns_cache_shared);
     QTAILQ_INSERT_TAIL(&slirp_stacks, s, entry);
 
     for (config = slirp_configs; config; config = config->next) {
@@ -787,7 +791,9 @@ int net_init_slirp(const NetClientOptions *opts, const char *name,
     ret = net_slirp_init(peer, "user", name, user->q_restrict, vnet,
                          user->host, user->hostname, user->tftp,
                          user->bootfile, user->dhcpstart, user->dns, user->smb,
-                         user->smbserver, dnssearch);
+                         user->smbserver, dnssearch,
+                         user->tcp_large_window, user->dns_cache,
+                         user->dns_cache_shared);
 
     while (slirp_configs) {
         config = slirp_configs;
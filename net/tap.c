@@ -44,6 +44,13 @@
 
 #include "net/vhost_net.h"
 
+/*
+ * Packets read in one go before returning to the main loop.  With GSO each
+ * of them can be up to 64k, and the peer's bottom halves, such as the RX
+ * notification of virtio-net, only run once tap_send() gives the loop back.
+ */
+#define TAP_SEND_BURST  64
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
@@ -188,9 +195,10 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
+    int packets = 0;
     int size;
 
-    while (qemu_can_send_packet(&s->nc)) {
+    while (packets++ < TAP_SEND_BURST && qemu_can_send_packet(&s->nc)) {
         uint8_t *buf = s->buf;
 
         size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
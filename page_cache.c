@@ -23,6 +23,8 @@
 #include <glib.h>
 
 #include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
 #include "migration/page_cache.h"
 
 #ifdef DEBUG_CACHE
@@ -41,12 +43,19 @@ struct CacheItem {
     uint8_t *it_data;
 };
 
+/*
+ * Entries are spread over shards by position, each with a lock of its
+ * own, so threads working on different pages rarely wait for each other.
+ */
+#define CACHE_SHARDS 64
+
 struct PageCache {
     CacheItem *page_cache;
     unsigned int page_size;
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
+    QemuMutex shard_lock[CACHE_SHARDS];
 };
 
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
@@ -92,10 +101,22 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         cache->page_cache[i].it_age = 0;
         cache->page_cache[i].it_addr = -1;
     }
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        qemu_mutex_init(&cache->shard_lock[i]);
+    }
 
     return cache;
 }
 
+static void cache_destroy_locks(PageCache *cache)
+{
+    int i;
+
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        qemu_mutex_destroy(&cache->shard_lock[i]);
+    }
+}
+
 void cache_fini(PageCache *cache)
 {
     int64_t i;
@@ -109,6 +130,7 @@ void cache_fini(PageCache *cache)
 
     g_free(cache->page_cache);
     cache->page_cache = NULL;
+    cache_destroy_locks(cache);
     g_free(cache);
 }
 
@@ -122,6 +144,22 @@ static size_t cache_get_cache_pos(const PageCache *cache,
     return pos;
 }
 
+static QemuMutex *cache_shard_lock(PageCache *cache, uint64_t addr)
+{
+    return &cache->shard_lock[cache_get_cache_pos(cache, addr) &
+                              (CACHE_SHARDS - 1)];
+}
+
+void cache_lock(PageCache *cache, uint64_t addr)
+{
+    qemu_mutex_lock(cache_shard_lock(cache, addr));
+}
+
+void cache_unlock(PageCache *cache, uint64_t addr)
+{
+    qemu_mutex_unlock(cache_shard_lock(cache, addr));
+}
+
 bool cache_is_cached(const PageCache *cache, uint64_t addr)
 {
     size_t pos;
@@ -169,12 +207,12 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
             DPRINTF("Error allocating page\n");
             return -1;
         }
-        cache->num_items++;
+        atomic_inc(&cache->num_items);
     }
 
     memcpy(it->it_data, pdata, cache->page_size);
 
-    it->it_age = ++cache->max_item_age;
+    it->it_age = atomic_fetch_add(&cache->max_item_age, 1) + 1;
     it->it_addr = addr;
 
     return 0;
@@ -231,6 +269,7 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     cache->max_num_items = new_cache->max_num_items;
     cache->num_items = new_cache->num_items;
 
+    cache_destroy_locks(new_cache);
     g_free(new_cache);
 
     return cache->max_num_items;
@@ -31,6 +31,7 @@
 #include "qapi/qmp-input-visitor.h"
 #include "qapi/qmp-output-visitor.h"
 #include "qapi-visit.h"
+#include "qemu/iov.h"
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -222,6 +223,40 @@ int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len)
     return ret;
 }
 
+/* Called with chr_write_lock held.  */
+static int qemu_chr_writev_each(CharDriverState *s, const struct iovec *iov,
+                                int iovcnt)
+{
+    int i, res, done = 0;
+
+    for (i = 0; i < iovcnt; i++) {
+        res = s->chr_write(s, iov[i].iov_base, iov[i].iov_len);
+        if (res < 0) {
+            return done ? done : res;
+        }
+        done += res;
+        if (res < iov[i].iov_len) {
+            break;
+        }
+    }
+    return done;
+}
+
+int qemu_chr_fe_writev(CharDriverState *s, const struct iovec *iov,
+                       int iovcnt)
+{
+    int ret;
+
+    qemu_mutex_lock(&s->chr_write_lock);
+    if (s->chr_writev) {
+        ret = s->chr_writev(s, iov, iovcnt);
+    } else {
+        ret = qemu_chr_writev_each(s, iov, iovcnt);
+    }
+    qemu_mutex_unlock(&s->chr_write_lock);
+    return ret;
+}
+
 int qemu_chr_fe_write_all(CharDriverState *s, const uint8_t *buf, int len)
 {
     int offset = 0;
@@ -1043,6 +1078,23 @@ static int io_channel_send(GIOChannel *fd, const void *buf, size_t len)
 
 #ifndef _WIN32
 
+/* Same as io_channel_send() for several buffers, in one writev() */
+static int io_channel_sendv(GIOChannel *chan, const struct iovec *iov,
+                            int iovcnt)
+{
+    int fd = g_io_channel_unix_get_fd(chan);
+    ssize_t ret;
+
+    do {
+        ret = writev(fd, iov, MIN(iovcnt, IOV_MAX));
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0 && errno != EAGAIN) {
+        errno = EINVAL;
+    }
+    return ret;
+}
+
 typedef struct FDCharDriver {
     CharDriverState *chr;
     GIOChannel *fd_in, *fd_out;
@@ -1058,6 +1110,15 @@ static int fd_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     return io_channel_send(s->fd_out, buf, len);
 }
 
+/* Called with chr_write_lock held.  */
+static int fd_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                         int iovcnt)
+{
+    FDCharDriver *s = chr->opaque;
+
+    return io_channel_sendv(s->fd_out, iov, iovcnt);
+}
+
 static gboolean fd_chr_read(GIOChannel *chan, GIOCondition cond, void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -1146,6 +1207,7 @@ static CharDriverState *qemu_chr_open_fd(int fd_in, int fd_out)
     chr->opaque = s;
     chr->chr_add_watch = fd_chr_add_watch;
     chr->chr_write = fd_chr_write;
+    chr->chr_writev = fd_chr_writev;
     chr->chr_update_read_handler = fd_chr_update_read_handler;
     chr->chr_close = fd_chr_close;
 
@@ -1342,6 +1404,21 @@ static int pty_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     return io_channel_send(s->fd, buf, len);
 }
 
+/* Called with chr_write_lock held.  */
+static int pty_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                          int iovcnt)
+{
+    PtyCharDriver *s = chr->opaque;
+
+    if (!s->connected) {
+        pty_chr_update_read_handler_locked(chr);
+        if (!s->connected) {
+            return 0;
+        }
+    }
+    return io_channel_sendv(s->fd, iov, iovcnt);
+}
+
 static GSource *pty_chr_add_watch(CharDriverState *chr, GIOCondition cond)
 {
     PtyCharDriver *s = chr->opaque;
@@ -1474,6 +1551,7 @@ static CharDriverState *qemu_chr_open_pty(const char *id,
     s = g_malloc0(sizeof(PtyCharDriver));
     chr->opaque = s;
     chr->chr_write = pty_chr_write;
+    chr->chr_writev = pty_chr_writev;
     chr->chr_update_read_handler = pty_chr_update_read_handler;
     chr->chr_close = pty_chr_close;
     chr->chr_add_watch = pty_chr_add_watch;
@@ -2696,6 +2774,24 @@ static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     }
 }
 
+#ifndef _WIN32
+/* Called with chr_write_lock held.  */
+static int tcp_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                          int iovcnt)
+{
+    TCPCharDriver *s = chr->opaque;
+
+    if (!s->connected) {
+        return iov_size(iov, iovcnt);
+    }
+    if (s->is_unix && s->write_msgfds_num) {
+        /* The descriptors go out with the first write */
+        return qemu_chr_writev_each(chr, iov, iovcnt);
+    }
+    return io_channel_sendv(s->chan, iov, iovcnt);
+}
+#endif
+
 static int tcp_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -4232,6 +4328,9 @@ static CharDriverState *qmp_chardev_open_socket(ChardevSocket *sock,
 
     chr->opaque = s;
     chr->chr_write = tcp_chr_write;
+#ifndef _WIN32
+    chr->chr_writev = tcp_chr_writev;
+#endif
     chr->chr_sync_read = tcp_chr_sync_read;
     chr->chr_close = tcp_chr_close;
     chr->get_msgfds = tcp_get_msgfds;
@@ -20,26 +20,81 @@
 
 enum {
     POOL_DEFAULT_SIZE = 64,
+    POOL_BATCH_SIZE = 16,
 };
 
-/** Free list to speed up creation */
-static QemuMutex pool_lock;
-static QSLIST_HEAD(, Coroutine) pool = QSLIST_HEAD_INITIALIZER(pool);
-static unsigned int pool_size;
+/** Free lists to speed up creation
+ *
+ * Each thread recycles up to POOL_BATCH_SIZE coroutines in its own
+ * alloc_pool, without any locking.  What does not fit goes to the global
+ * release_pool, up to pool_max_size.  A thread that runs out takes the
+ * whole release_pool over with a single atomic exchange, so the only
+ * shared state is touched once per batch rather than once per coroutine.
+ *
+ * release_pool_size can be briefly off from the length of the list; it
+ * is only a heuristic.
+ */
+static QSLIST_HEAD(CoroutinePool, Coroutine) release_pool =
+    QSLIST_HEAD_INITIALIZER(release_pool);
+static unsigned int release_pool_size;
 static unsigned int pool_max_size = POOL_DEFAULT_SIZE;
+static __thread struct CoroutinePool alloc_pool =
+    QSLIST_HEAD_INITIALIZER(alloc_pool);
+static __thread unsigned int alloc_pool_size;
+
+static void coroutine_pool_free(struct CoroutinePool *list)
+{
+    Coroutine *co;
+    Coroutine *tmp;
+
+    QSLIST_FOREACH_SAFE(co, list, pool_next, tmp) {
+        QSLIST_REMOVE_HEAD(list, pool_next);
+        qemu_coroutine_delete(co);
+    }
+}
+
+#ifndef _WIN32
+/* Frees a thread's alloc_pool when it exits */
+static pthread_key_t alloc_pool_key;
+
+static void alloc_pool_cleanup(void *value)
+{
+    coroutine_pool_free(&alloc_pool);
+    alloc_pool_size = 0;
+}
+#endif
+
+static Coroutine *alloc_pool_refill(void)
+{
+    if (!atomic_read(&release_pool_size)) {
+        return NULL;
+    }
+#ifndef _WIN32
+    /* Slow path, a good place to make sure the batch is freed on exit */
+    if (!pthread_getspecific(alloc_pool_key)) {
+        pthread_setspecific(alloc_pool_key, &alloc_pool);
+    }
+#endif
+    alloc_pool_size = atomic_xchg(&release_pool_size, 0);
+    QSLIST_MOVE_ATOMIC(&alloc_pool, &release_pool);
+    return QSLIST_FIRST(&alloc_pool);
+}
 
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
 {
     Coroutine *co = NULL;
 
     if (CONFIG_COROUTINE_POOL) {
-        qemu_mutex_lock(&pool_lock);
-        co = QSLIST_FIRST(&pool);
+        co = QSLIST_FIRST(&alloc_pool);
+        if (!co) {
+            co = alloc_pool_refill();
+        }
         if (co) {
-            QSLIST_REMOVE_HEAD(&pool, pool_next);
-            pool_size--;
+            QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
+            if (alloc_pool_size) {
+                alloc_pool_size--;
+            }
         }
-        qemu_mutex_unlock(&pool_lock);
     }
 
     if (!co) {
@@ -53,16 +108,19 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
 
 static void coroutine_delete(Coroutine *co)
 {
+    co->caller = NULL;
+
     if (CONFIG_COROUTINE_POOL) {
-        qemu_mutex_lock(&pool_lock);
-        if (pool_size < pool_max_size) {
-            QSLIST_INSERT_HEAD(&pool, co, pool_next);
-            co->caller = NULL;
-            pool_size++;
-            qemu_mutex_unlock(&pool_lock);
+        if (alloc_pool_size < POOL_BATCH_SIZE) {
+            QSLIST_INSERT_HEAD(&alloc_pool, co, pool_next);
+            alloc_pool_size++;
+            return;
+        }
+        if (atomic_read(&release_pool_size) < atomic_read(&pool_max_size)) {
+            QSLIST_INSERT_HEAD_ATOMIC(&release_pool, co, pool_next);
+            atomic_inc(&release_pool_size);
             return;
         }
-        qemu_mutex_unlock(&pool_lock);
     }
 
     qemu_coroutine_delete(co);
@@ -70,20 +128,15 @@ static void coroutine_delete(Coroutine *co)
 
 static void __attribute__((constructor)) coroutine_pool_init(void)
 {
-    qemu_mutex_init(&pool_lock);
+#ifndef _WIN32
+    pthread_key_create(&alloc_pool_key, alloc_pool_cleanup);
+#endif
 }
 
 static void __attribute__((destructor)) coroutine_pool_cleanup(void)
 {
-    Coroutine *co;
-    Coroutine *tmp;
-
-    QSLIST_FOREACH_SAFE(co, &pool, pool_next, tmp) {
-        QSLIST_REMOVE_HEAD(&pool, pool_next);
-        qemu_coroutine_delete(co);
-    }
-
-    qemu_mutex_destroy(&pool_lock);
+    coroutine_pool_free(&release_pool);
+    coroutine_pool_free(&alloc_pool);
 }
 
 static void coroutine_swap(Coroutine *from, Coroutine *to)
@@ -140,20 +193,17 @@ void coroutine_fn qemu_coroutine_yield(void)
 
 void qemu_coroutine_adjust_pool_size(int n)
 {
-    qemu_mutex_lock(&pool_lock);
-
-    pool_max_size += n;
+    unsigned int max_size = atomic_fetch_add(&pool_max_size, n) + n;
 
     /* Callers should never take away more than they added */
-    assert(pool_max_size >= POOL_DEFAULT_SIZE);
+    assert(max_size >= POOL_DEFAULT_SIZE);
 
-    /* Trim oversized pool down to new max */
-    while (pool_size > pool_max_size) {
-        Coroutine *co = QSLIST_FIRST(&pool);
-        QSLIST_REMOVE_HEAD(&pool, pool_next);
-        pool_size--;
-        qemu_coroutine_delete(co);
-    }
+    /* Trim an oversized pool by dropping it, it refills on demand */
+    if (n < 0 && atomic_read(&release_pool_size) > max_size) {
+        struct CoroutinePool list;
 
-    qemu_mutex_unlock(&pool_lock);
+        atomic_xchg(&release_pool_size, 0);
+        QSLIST_MOVE_ATOMIC(&list, &release_pool);
+        coroutine_pool_free(&list);
+    }
 }
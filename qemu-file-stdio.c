@@ -24,6 +24,7 @@
 #include "qemu-common.h"
 #include "block/coroutine.h"
 #include "migration/qemu-file.h"
+#include "qemu/iov.h"
 
 #ifdef USE_ANDROID_EMU
 #include "android/utils/file_io.h"
@@ -55,6 +56,34 @@ static int stdio_put_buffer(void *opaque, const uint8_t *buf, int64_t pos,
     return res;
 }
 
+/* Guest RAM pages go straight from the iovec to the file */
+static ssize_t stdio_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                                   int64_t pos)
+{
+    QEMUFileStdio *s = opaque;
+    int fd = fileno(s->stdio_file);
+    unsigned int cnt = iovcnt;
+    ssize_t size = iov_size(iov, iovcnt);
+    ssize_t done = 0;
+
+    if (fflush(s->stdio_file) == EOF) {
+        return -errno;
+    }
+    while (done < size) {
+        ssize_t len = writev(fd, iov, cnt);
+
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        iov_discard_front(&iov, &cnt, len);
+        done += len;
+    }
+    return done;
+}
+
 static int stdio_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
 {
     QEMUFileStdio *s = opaque;
@@ -166,13 +195,16 @@ QEMUFile *qemu_popen_cmd(const char *command, const char *mode)
 static const QEMUFileOps stdio_file_read_ops = {
     .get_fd =     stdio_get_fd,
     .get_buffer = stdio_get_buffer,
-    .close =      stdio_fclose
+    .close =      stdio_fclose,
+    .bulk =       true
 };
 
 static const QEMUFileOps stdio_file_write_ops = {
-    .get_fd =     stdio_get_fd,
-    .put_buffer = stdio_put_buffer,
-    .close =      stdio_fclose
+    .get_fd =        stdio_get_fd,
+    .put_buffer =    stdio_put_buffer,
+    .writev_buffer = stdio_writev_buffer,
+    .close =         stdio_fclose,
+    .bulk =          true
 };
 
 QEMUFile *qemu_fopen(const char *filename, const char *mode)
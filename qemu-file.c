@@ -43,10 +43,12 @@ struct QEMUFile {
                     when reading */
     int buf_index;
     int buf_size; /* 0 when writing */
-    uint8_t buf[IO_BUF_SIZE];
+    int buf_max;
+    uint8_t *buf;
 
-    struct iovec iov[MAX_IOV_SIZE];
+    struct iovec *iov;
     unsigned int iovcnt;
+    unsigned int iov_max;
 
     int last_error;
 };
@@ -71,6 +73,17 @@ QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 
     f->opaque = opaque;
     f->ops = ops;
+
+    /* Files on local storage flush in fewer, larger writes */
+    if (ops->bulk) {
+        f->buf_max = IO_BUF_SIZE_BULK;
+        f->iov_max = IOV_MAX;
+    } else {
+        f->buf_max = IO_BUF_SIZE;
+        f->iov_max = MAX_IOV_SIZE;
+    }
+    f->buf = g_malloc(f->buf_max);
+    f->iov = g_new(struct iovec, f->iov_max);
     return f;
 }
 
@@ -176,7 +189,8 @@ size_t ram_control_save_page(QEMUFile *f, ram_addr_t block_offset,
         int ret = f->ops->save_page(f, f->opaque, block_offset,
                                     offset, size, bytes_sent);
 
-        if (ret != RAM_SAVE_CONTROL_DELAYED) {
+        if (ret != RAM_SAVE_CONTROL_DELAYED &&
+            ret != RAM_SAVE_CONTROL_NOT_SUPP) {
             if (bytes_sent && *bytes_sent > 0) {
                 qemu_update_position(f, *bytes_sent);
             } else if (ret < 0) {
@@ -213,7 +227,7 @@ static ssize_t qemu_fill_buffer(QEMUFile *f)
     f->buf_size = pending;
 
     len = f->ops->get_buffer(f->opaque, f->buf + pending, f->pos,
-                        IO_BUF_SIZE - pending);
+                        f->buf_max - pending);
     if (len > 0) {
         f->buf_size += len;
         f->pos += len;
@@ -239,6 +253,12 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/* Charge data sent on the side against the rate limit of @f */
+void qemu_file_update_transfer(QEMUFile *f, int64_t len)
+{
+    f->bytes_xfer += len;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -265,6 +285,8 @@ int qemu_fclose(QEMUFile *f)
     if (f->last_error) {
         ret = f->last_error;
     }
+    g_free(f->buf);
+    g_free(f->iov);
     g_free(f);
     trace_qemu_file_fclose();
     return ret;
@@ -281,7 +303,7 @@ static void add_to_iovec(QEMUFile *f, const uint8_t *buf, int size)
         f->iov[f->iovcnt++].iov_len = size;
     }
 
-    if (f->iovcnt >= MAX_IOV_SIZE) {
+    if (f->iovcnt >= f->iov_max) {
         qemu_fflush(f);
     }
 }
@@ -310,7 +332,7 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
     }
 
     while (size > 0) {
-        l = IO_BUF_SIZE - f->buf_index;
+        l = f->buf_max - f->buf_index;
         if (l > size) {
             l = size;
         }
@@ -320,7 +342,7 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
             add_to_iovec(f, f->buf + f->buf_index, l);
         }
         f->buf_index += l;
-        if (f->buf_index == IO_BUF_SIZE) {
+        if (f->buf_index == f->buf_max) {
             qemu_fflush(f);
         }
         if (qemu_file_get_error(f)) {
@@ -331,6 +353,44 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
     }
 }
 
+int qemu_file_buffer_size(QEMUFile *f)
+{
+    return f->buf_max;
+}
+
+/*
+ * Returns room for @size contiguous bytes in the buffer, to be filled in
+ * place and added to the stream with qemu_put_commit(), or NULL if @size
+ * is larger than the buffer or the file is in error.
+ */
+uint8_t *qemu_put_reserve(QEMUFile *f, int size)
+{
+    if (f->last_error || size > f->buf_max) {
+        return NULL;
+    }
+    if (size > f->buf_max - f->buf_index) {
+        qemu_fflush(f);
+        if (f->last_error) {
+            return NULL;
+        }
+    }
+    return f->buf + f->buf_index;
+}
+
+void qemu_put_commit(QEMUFile *f, int size)
+{
+    assert(size <= f->buf_max - f->buf_index);
+
+    f->bytes_xfer += size;
+    if (f->ops->writev_buffer) {
+        add_to_iovec(f, f->buf + f->buf_index, size);
+    }
+    f->buf_index += size;
+    if (f->buf_index == f->buf_max) {
+        qemu_fflush(f);
+    }
+}
+
 void qemu_put_byte(QEMUFile *f, int v)
 {
     if (f->last_error) {
@@ -343,7 +403,7 @@ void qemu_put_byte(QEMUFile *f, int v)
         add_to_iovec(f, f->buf + f->buf_index, 1);
     }
     f->buf_index++;
-    if (f->buf_index == IO_BUF_SIZE) {
+    if (f->buf_index == f->buf_max) {
         qemu_fflush(f);
     }
 }
@@ -369,8 +429,8 @@ int qemu_peek_buffer(QEMUFile *f, uint8_t *buf, int size, size_t offset)
     int index;
 
     assert(!qemu_file_is_writable(f));
-    assert(offset < IO_BUF_SIZE);
-    assert(size <= IO_BUF_SIZE - offset);
+    assert(offset < f->buf_max);
+    assert(size <= f->buf_max - offset);
 
     /* The 1st byte to read from */
     index = f->buf_index + offset;
@@ -403,6 +463,26 @@ int qemu_peek_buffer(QEMUFile *f, uint8_t *buf, int size, size_t offset)
     return size;
 }
 
+/*
+ * Returns a pointer to the next 'size' bytes in the buffer without moving
+ * the pointer, valid until the next operation on the file; NULL if 'size'
+ * is larger than the buffer or the data ends first.
+ */
+const uint8_t *qemu_peek_buffer_in_place(QEMUFile *f, int size)
+{
+    assert(!qemu_file_is_writable(f));
+
+    if (size > f->buf_max) {
+        return NULL;
+    }
+    while (f->buf_size - f->buf_index < size) {
+        if (qemu_fill_buffer(f) <= 0) {
+            return NULL;
+        }
+    }
+    return f->buf + f->buf_index;
+}
+
 /*
  * Read 'size' bytes of data from the file into buf.
  * 'size' can be larger than the internal buffer.
@@ -419,7 +499,7 @@ int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size)
     while (pending > 0) {
         int res;
 
-        res = qemu_peek_buffer(f, buf, MIN(pending, IO_BUF_SIZE), 0);
+        res = qemu_peek_buffer(f, buf, MIN(pending, f->buf_max), 0);
         if (res == 0) {
             return done;
         }
@@ -440,7 +520,7 @@ int qemu_peek_byte(QEMUFile *f, int offset)
     int index = f->buf_index + offset;
 
     assert(!qemu_file_is_writable(f));
-    assert(offset < IO_BUF_SIZE);
+    assert(offset < f->buf_max);
 
     if (index >= f->buf_size) {
         qemu_fill_buffer(f);
@@ -68,7 +68,8 @@ static void usage(const char *name)
 "  -b, --bind=IFACE          interface to bind to (default `0.0.0.0')\n"
 "  -k, --socket=PATH         path to the unix socket\n"
 "                            (default '"SOCKET_PATH"')\n"
-"  -e, --shared=NUM          device can be shared by NUM clients (default '1')\n"
+"  -e, --shared=NUM          device can be shared by NUM clients (default '1'),\n"
+"                            or a client can open NUM connections to it\n"
 "  -t, --persistent          don't exit on the last connection\n"
 "  -v, --verbose             display extra debugging information\n"
 "\n"
@@ -730,6 +731,12 @@ int main(int argc, char **argv)
         }
     }
 
+    /* All connections go through the same BlockDriverState, so a flush on
+     * one of them also covers the writes made on the others.
+     */
+    if (shared > 1) {
+        nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
     exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags, nbd_export_closed);
 
     if (sockpath) {
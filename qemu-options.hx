@@ -254,12 +254,70 @@ Allocate guest RAM from a temporarily created file in @var{path}.
 ETEXI
 
 DEF("mem-prealloc", 0, QEMU_OPTION_mem_prealloc,
-    "-mem-prealloc   preallocate guest memory (use with -mem-path)\n",
+    "-mem-prealloc   preallocate guest memory at startup\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -mem-prealloc
 @findex -mem-prealloc
-Preallocate memory when using -mem-path.
+Fault in all of guest RAM at startup, with one thread per host CPU, instead
+of on first access by the guest. With -mem-path, exit if the huge pages
+cannot all be allocated.
+ETEXI
+
+DEF("mem-hugepages", HAS_ARG, QEMU_OPTION_mem_hugepages,
+    "-mem-hugepages transparent|off|on|size\n"
+    "                back guest RAM with huge pages\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -mem-hugepages @var{mode}
+@findex -mem-hugepages
+Select the host pages backing guest RAM. @option{transparent}, the default,
+lets a Linux host use transparent huge pages and @option{off} disables them.
+@option{on} backs guest RAM with huge pages of the default size reserved on
+Linux hosts, or with large pages on Windows hosts, which requires the
+"Lock pages in memory" user right. A @var{size} such as @option{2M} or
+@option{1G} selects the size of the huge pages on Linux. QEMU falls back to
+normal pages, with a warning, when not enough huge pages are available.
+ETEXI
+
+DEF("mem-shared", 0, QEMU_OPTION_mem_shared,
+    "-mem-shared     let the GPU renderer map guest RAM directly\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -mem-shared
+@findex -mem-shared
+Back guest RAM with anonymous shared files (memfd) on Linux hosts, and hand
+the guest physical memory map, with the file descriptors, to a GPU renderer
+that supports it. The renderer can then read guest graphics buffers in
+place instead of getting them copied through the opengles pipe. This takes
+precedence over @option{-mem-hugepages on}; on other hosts, or if the files
+cannot be created, guest RAM is allocated as usual, with a warning.
+ETEXI
+
+DEF("vcpu-affinity", HAS_ARG, QEMU_OPTION_vcpu_affinity,
+    "-vcpu-affinity cpus\n"
+    "                run the virtual CPUs on these host CPUs only\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -vcpu-affinity @var{cpus}
+@findex -vcpu-affinity
+Restrict the threads running the virtual CPUs to the host CPUs in
+@var{cpus}, a list such as @option{0-3,8}. Only Linux and Windows hosts
+support this, the latter for the first 64 host CPUs.
+ETEXI
+
+DEF("io-affinity", HAS_ARG, QEMU_OPTION_io_affinity,
+    "-io-affinity cpus\n"
+    "                run the main loop and IOThreads on these host CPUs only\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -io-affinity @var{cpus}
+@findex -io-affinity
+Restrict the main loop and the IOThreads to the host CPUs in @var{cpus}, a
+list such as @option{4-7}. Other threads created by the main loop, such as
+those of the renderer, start with the same host CPUs. Use it with
+@option{-numa node,memdev=} and a @option{memory-backend-ram} object bound
+to a host node to keep the emulator on one NUMA node.
 ETEXI
 
 DEF("k", HAS_ARG, QEMU_OPTION_k,
@@ -432,7 +490,8 @@ ETEXI
 DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "-drive [file=file][,if=type][,bus=n][,unit=m][,media=d][,index=i]\n"
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
-    "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
+    "       [,cache=writethrough|writeback|none|directsync|unsafe|ephemeral]\n"
+    "       [,cache.flush-interval=ms][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
     "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
@@ -442,6 +501,8 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
     "       [[,iops_max=im]|[[,iops_rd_max=irm][,iops_wr_max=iwm]]]\n"
     "       [[,iops_size=is]]\n"
+    "       [,throttling.host-bps-total=b][,throttling.host-iops-total=i]\n"
+    "       [,throttling.host-bps-total-max=bm][,throttling.host-iops-total-max=im]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -474,7 +535,10 @@ These options have the same definition as they have in @option{-hdachs}.
 @var{snapshot} is "on" or "off" and controls snapshot mode for the given drive
 (see @option{-snapshot}).
 @item cache=@var{cache}
-@var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
+@var{cache} is "none", "writeback", "unsafe", "ephemeral", "directsync" or "writethrough" and controls how the host cache is used to access block data.
+@item cache.flush-interval=@var{ms}
+With @option{cache=ephemeral}, the shortest time between two flushes that
+reach the disk, in milliseconds. The default is 1000.
 @item aio=@var{aio}
 @var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
 @item discard=@var{discard}
@@ -503,6 +567,16 @@ file sectors into the image file.
 conversion of plain zero writes by the OS to driver specific optimized
 zero write commands. You may even choose "unmap" if @var{discard} is set
 to "unmap" to allow a zero write to be converted to an UNMAP operation.
+@item throttling.host-bps-total=@var{b},throttling.host-iops-total=@var{i}
+Limit the drive to a share of @var{b} bytes and @var{i} operations per
+second, the limits of the host device that the image is stored on.  On
+Linux hosts, the processes with such limits coordinate through a file in
+@file{/dev/shm} named after the host device: each gets an equal share of
+the limits among those that had requests in the last second, split again
+between its own busy drives.  All the processes using the device should
+give the same limits.  @option{throttling.host-bps-total-max} and
+@option{throttling.host-iops-total-max} are the bursts, shared the same
+way.  These can't be combined with the per-drive limits.
 @end table
 
 By default, the @option{cache=writeback} mode is used. It will report data
@@ -534,6 +608,16 @@ like your host losing power, the disk storage getting disconnected accidentally,
 etc. your image will most probably be rendered unusable.   When using
 the @option{-snapshot} option, unsafe caching is always used.
 
+@option{cache=ephemeral} is meant for disposable images, such as those of
+test instances, whose guests flush often. Like @option{cache=writeback}, it
+writes data back to the host page cache and completes each flush only once
+QEMU's own caches have been written back to the host. A flush reaches the
+disk only if something was written since the last one that did, and at most
+once per @option{cache.flush-interval}; the others complete without waiting
+for the disk. Data written since the last flush that reached the disk is lost
+if the host crashes. Adjacent writes submitted together
+are merged into larger requests in all modes.
+
 Copy-on-read avoids accessing the same backing file sectors repeatedly and is
 useful when the backing file is over a slow network.  By default copy-on-read
 is off.
@@ -1278,6 +1362,12 @@ This can be really helpful to save bandwidth when playing videos. Disabling
 adaptive encodings restores the original static behavior of encodings
 like Tight.
 
+@item workers=@var{n}
+
+Encode the updates of different clients on up to @var{n} threads (1 by
+default, at most 16). The updates of each client are still encoded one
+at a time, in order.
+
 @item share=[allow-exclusive|force-shared|ignore]
 
 Set display sharing policy.  'allow-exclusive' allows clients to ask
@@ -1406,7 +1496,8 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
 #ifdef CONFIG_SLIRP
     "-net user[,vlan=n][,name=str][,net=addr[/mask]][,host=addr][,restrict=on|off]\n"
     "         [,hostname=host][,dhcpstart=addr][,dns=addr][,dnssearch=domain][,tftp=dir]\n"
-    "         [,bootfile=f][,hostfwd=rule][,guestfwd=rule]"
+    "         [,bootfile=f][,hostfwd=rule][,guestfwd=rule][,tcp-large-window=on|off]\n"
+    "         [,dns-cache=on|off][,dns-cache-shared=on|off]"
 #ifndef _WIN32
                                              "[,smb=dir[,smbserver=addr]]\n"
 #endif
@@ -1555,6 +1646,24 @@ to the outside. This option does not affect any explicitly set forwarding rules.
 @item hostname=@var{name}
 Specifies the client hostname reported by the built-in DHCP server.
 
+@item tcp-large-window=on|off
+Use large socket buffers and TCP window scaling for connections through the
+user mode network stack, and send the queued segments to the guest in
+batches. This raises bulk TCP throughput at the cost of more memory per
+connection. Off by default. Connections forwarded with @option{hostfwd} or
+the Android console @code{redir} command always get the large buffers and
+window scaling.
+
+@item dns-cache=on|off
+Answer repeated queries to the built-in DNS servers from a cache of the
+responses of the host's name servers. Entries are kept no longer than their
+TTLs allow, and the TTLs the guest sees count down while cached. Hits and
+misses are shown by @code{info usernet}. Off by default.
+
+@item dns-cache-shared=on|off
+With @option{dns-cache}, use a cache shared by all the user mode networks of
+this process that ask for a shared one, instead of a private one.
+
 @item dhcpstart=@var{addr}
 Specify the first of the 16 IPs the built-in DHCP server can assign. Default
 is the 15th to 31st IP in the guest network, i.e. x.x.x.15 to x.x.x.31.
@@ -2361,6 +2470,23 @@ This value may optionally have the suffix 'T', 'G', 'M', 'K', 'k' or 'b'. If it
 does not have a suffix, it will be assumed to be in bytes. The value must be a
 multiple of 512 bytes. It defaults to 256k.
 
+@item readahead-max
+The readahead doubles, up to this amount, while each read that misses starts
+within the data of the previous range request, and drops back to
+@option{readahead} on the first read that doesn't.  The value must be a
+multiple of 512 bytes. It defaults to 4M.
+
+@item connections
+The maximum number of range requests to the remote server in flight at once,
+between 1 and 64. It defaults to 16.
+
+@item cache-dir
+Keep the data read from the remote server in this directory, and read it from
+there the next time the image is opened.  The cache of an image is named after
+its URL, size and ETag or Last-Modified header, so that an image changed on the
+server gets a new one; images without either header are not cached.  Files in
+the directory can be removed at any time the image is not open.
+
 @item sslverify
 Whether to verify the remote server's certificate when connecting over SSL. It
 can have the value 'on' or 'off'. It defaults to 'on'.
@@ -2791,6 +2917,44 @@ STEXI
 Like -monitor but opens in 'control' mode.
 ETEXI
 
+DEF("qmp-thread", HAS_ARG, QEMU_OPTION_qmp_thread, \
+    "-qmp-thread addr\n"
+    "                serve QMP on addr (host:port or unix:path) from a thread\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -qmp-thread @var{addr}
+@findex -qmp-thread
+Listen for QMP clients on @var{addr}, @code{host:port} or @code{unix:path},
+from a thread of its own instead of the main loop. The thread answers the
+queries that only read statistics, such as @code{query-status} or
+@code{query-vcpu-exits}, without waiting for the main loop, so they stay
+responsive while a long command runs. Other commands are run by the main
+loop in order, which means their replies may come after those of later
+queries: use the @code{id} member to match them. One client is served at
+a time.
+ETEXI
+
+DEF("metrics", HAS_ARG, QEMU_OPTION_metrics, \
+    "-metrics addr\n"
+    "                serve the performance metrics over HTTP on addr\n"
+    "                (host:port or unix:path)\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -metrics @var{addr}
+@findex -metrics
+Serve the performance counters of the emulator in the OpenMetrics text
+format on @var{addr}, @code{host:port} or @code{unix:path}, at
+@code{http://@var{addr}/metrics}. The metrics cover the TCG translator,
+the vcpu exits, the block devices, the network queues, the Android pipes
+and the GPU frame bridge. A thread of its own answers the requests, one
+at a time, without taking the global mutex, so scraping the metrics
+doesn't slow down the guest. For instance:
+@example
+qemu-system-x86_64 -metrics 127.0.0.1:9100 ...
+curl http://127.0.0.1:9100/metrics
+@end example
+ETEXI
+
 DEF("mon", HAS_ARG, QEMU_OPTION_mon, \
     "-mon [chardev=]name[,mode=readline|control][,default]\n", QEMU_ARCH_ALL)
 STEXI
@@ -3040,17 +3204,25 @@ re-inject them.
 ETEXI
 
 DEF("icount", HAS_ARG, QEMU_OPTION_icount, \
-    "-icount [shift=N|auto][,align=on|off]\n" \
+    "-icount [shift=N|auto][,align=on|off][,sleep=on|off]\n" \
     "                enable virtual instruction counter with 2^N clock ticks per\n" \
-    "                instruction and enable aligning the host and virtual clocks\n", QEMU_ARCH_ALL)
+    "                instruction, enable aligning the host and virtual clocks\n" \
+    "                or skip idle periods\n", QEMU_ARCH_ALL)
 STEXI
-@item -icount [shift=@var{N}|auto]
+@item -icount [shift=@var{N}|auto][,align=on|off][,sleep=on|off]
 @findex -icount
 Enable virtual instruction counter.  The virtual cpu will execute one
 instruction every 2^@var{N} ns of virtual time.  If @code{auto} is specified
 then the virtual cpu speed will be automatically adjusted to keep virtual
 time within a few seconds of real time.
 
+When the virtual cpu is idle, it normally sleeps until the next timer is
+due in real time. With @option{sleep=off}, virtual time instead jumps to
+the next timer right away, so that guests mostly waiting on timers run
+faster than real time. Guest time then only depends on the instructions
+executed. @option{sleep=off} requires a fixed @option{shift} and can't be
+used with @option{align=on}.
+
 Note that while this option can give deterministic behavior, it does not
 provide cycle accurate emulation.  Modern CPUs contain superscalar out of
 order cores with complex cache hierarchies.  The number of instructions
@@ -3406,6 +3578,20 @@ STEXI
 Set the network delay, either based on a network type or in milliseconds
 ETEXI
 
+DEF("netprofile", HAS_ARG, QEMU_OPTION_netprofile,
+    "-netprofile <addr>[/<bits>][:<port>[-<port>]][,speed=<speed>][,delay=<delay>][,loss=<percent>]\n"
+    "                per-destination network speed, delay and loss emulation\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -netprofile @var{addr}[/@var{bits}][:@var{port}[-@var{port}]][,speed=@var{speed}][,delay=@var{delay}][,loss=@var{percent}]
+@findex -netprofile
+Apply separate network conditions to the traffic exchanged with the given
+remote address range and TCP/UDP ports. @var{speed} and @var{delay} take
+the same values as @option{-netspeed} and @option{-netdelay}, and
+@var{percent} is the chance of dropping each packet. The option can be
+given several times, the first matching profile is used.
+ETEXI
+
 DEF("netfast", 0, QEMU_OPTION_netfast,
     "-netfast disable network shaping\n", QEMU_ARCH_ALL)
 STEXI
@@ -3464,6 +3650,33 @@ STEXI
 Specify the hw config ini file location
 ETEXI
 
+DEF("savevm-on-exit", HAS_ARG, QEMU_OPTION_savevm_on_exit,
+    "-savevm-on-exit tag\n"
+    "                save the VM state as snapshot 'tag' when exiting\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -savevm-on-exit @var{tag}
+@findex -savevm-on-exit
+Save the VM state as snapshot @var{tag} when QEMU exits, so that the next
+run can start from it with @option{-loadvm}. With this option or
+@option{-loadvm}, writable raw drives are opened through a qcow2 overlay
+next to their image, which holds the disk side of the snapshots.
+ETEXI
+
+DEF("snapshot-ram-base", HAS_ARG, QEMU_OPTION_snapshot_ram_base,
+    "-snapshot-ram-base file\n"
+    "                share a read-only snapshot RAM file between VMs\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -snapshot-ram-base @var{file}
+@findex -snapshot-ram-base
+Load snapshot RAM from @var{file}, the RAM file of a snapshot saved by
+another VM, when a snapshot being loaded has no RAM file of its own.
+The file is mapped copy-on-write and never written, so any number of VMs
+started from the same snapshot share the memory of the pages they don't
+change. Later snapshots only store the pages that differ from it.
+ETEXI
+
 #endif
 
 HXCOMM This is the last statement. Insert new options before this line!
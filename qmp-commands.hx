@@ -164,6 +164,126 @@ Example:
 -> { "execute": "screendump", "arguments": { "filename": "/tmp/image" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "frame-capture-start",
+        .args_type  = "path:F?,slots:i?,encoding:s?,quality:i?,"
+                      "continuous:b?,interval:i?,stream:s?",
+        .mhandler.cmd_new = qmp_marshal_input_frame_capture_start,
+    },
+
+SQMP
+frame-capture-start
+-------------------
+
+Start publishing display frames into a shared memory ring, see
+include/ui/frame-capture.h for its layout, or streaming them over HTTP.
+
+Arguments:
+
+- "path": file to map the ring from, normally on a tmpfs
+  (json-string, optional)
+- "slots": number of frames in the ring, default 4 (json-int, optional)
+- "encoding": "raw", "png" or "jpeg", default "raw", or "jpeg" with
+  "stream" (json-string, optional)
+- "quality": JPEG quality, default 85 (json-int, optional)
+- "continuous": capture every display update, default true
+  (json-bool, optional)
+- "interval": minimum milliseconds between continuous captures, default 0,
+  or 33 with "stream" (json-int, optional)
+- "stream": host:port to serve an MJPEG stream of the frames on, over HTTP;
+  requires the "jpeg" encoding (json-string, optional)
+
+At least one of "path" and "stream" must be given.
+
+Examples:
+
+-> { "execute": "frame-capture-start",
+     "arguments": { "path": "/dev/shm/emulator-5554-frames",
+                    "encoding": "png", "interval": 33 } }
+<- { "return": {} }
+
+-> { "execute": "frame-capture-start",
+     "arguments": { "stream": "127.0.0.1:5580", "quality": 70 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "frame-capture-stop",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_frame_capture_stop,
+    },
+
+SQMP
+frame-capture-stop
+------------------
+
+Stop the frame capture.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "frame-capture-stop" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "frame-capture-grab",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_frame_capture_grab,
+    },
+
+SQMP
+frame-capture-grab
+------------------
+
+Capture the current display contents into the frame capture ring, and
+return the capture id of the frame (json-int).
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "frame-capture-grab" }
+<- { "return": 1204 }
+
+EQMP
+
+    {
+        .name       = "query-frame-capture",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_frame_capture,
+    },
+
+SQMP
+query-frame-capture
+-------------------
+
+Return the status of the frame capture, as a json-object containing:
+
+- "active": whether a capture is running (json-bool)
+- "path": file the ring is mapped from (json-string, only if active with a
+  ring)
+- "stream": address the frames are streamed on (json-string, only if active
+  with a stream)
+- "encoding": "raw", "png" or "jpeg" (json-string, only if active)
+- "captured": number of frames captured (json-int)
+- "published": number of frames published into the ring (json-int)
+- "dropped": number of frames replaced before being encoded (json-int)
+- "too-large": number of frames that didn't fit in a slot (json-int)
+- "streamed": number of frames sent to stream viewers (json-int)
+
+Example:
+
+-> { "execute": "query-frame-capture" }
+<- { "return": { "active": true, "path": "/dev/shm/emulator-5554-frames",
+                 "encoding": "png", "captured": 1820, "published": 1790,
+                 "dropped": 30, "too-large": 0, "streamed": 0 } }
+
 EQMP
 
     {
@@ -974,6 +1094,62 @@ Example:
 -> { "execute": "block_resize", "arguments": { "device": "scratch", "size": 1073741824 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-reset",
+        .args_type  = "device:B",
+        .mhandler.cmd_new = qmp_marshal_input_block_reset,
+    },
+
+SQMP
+block-reset
+-----------
+
+Throw away everything written to a block device. An image with a backing
+file is reverted to it, any other image is zeroed. The VM must be stopped.
+
+Arguments:
+
+- "device": the device's ID, must be unique (json-string)
+
+Example:
+
+-> { "execute": "block-reset", "arguments": { "device": "userdata" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,boundaries:q?,boundaries-read:q?,"
+                      "boundaries-write:q?,boundaries-flush:q?",
+        .mhandler.cmd_new = qmp_marshal_input_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Set the bin boundaries of a device's latency histograms and clear them.
+A histogram given no boundaries is disabled.
+
+Arguments:
+
+- "device": the device's ID, must be unique (json-string)
+- "boundaries": boundaries in ns for all histograms
+                (json-array of json-int, optional)
+- "boundaries-read": boundaries for reads (json-array of json-int, optional)
+- "boundaries-write": boundaries for writes (json-array of json-int, optional)
+- "boundaries-flush": boundaries for flushes (json-array of json-int, optional)
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "userdata",
+                    "boundaries": [ 100000, 1000000, 10000000 ] } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1075,8 +1251,9 @@ Arguments:
             (json-string, optional)
 - "sync": what parts of the disk image should be copied to the destination;
   possibilities include "full" for all the disk, "top" for only the sectors
-  allocated in the topmost image, or "none" to only replicate new I/O
-  (MirrorSyncMode).
+  allocated in the topmost image, "none" to only replicate new I/O, or
+  "incremental" for what changed since the last incremental backup into
+  the same "existing" target, on a drive with a dirty-map (MirrorSyncMode).
 - "mode": whether and how QEMU should create a new image
           (NewImageMode, optional, default 'absolute-paths')
 - "speed": the maximum speed, in bytes per second (json-int, optional)
@@ -1894,6 +2071,7 @@ EQMP
     {
         .name       = "query-version",
         .args_type  = "",
+        .flags      = MONITOR_CMD_NO_BQL,
         .mhandler.cmd_new = qmp_marshal_input_query_version,
     },
 
@@ -2261,6 +2439,21 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "rd_latency_histogram": read latencies, omitted if disabled
+                              (json-object, optional), containing:
+        - "boundaries": bin boundaries in ns (json-array of json-int)
+        - "bins": request count per bin (json-array of json-int)
+    - "wr_latency_histogram": write latencies (json-object, optional)
+    - "flush_latency_histogram": flush latencies (json-object, optional)
+    - "queue_depth": read and write requests in flight (json-int)
+    - "max_queue_depth": most requests ever in flight at once (json-int)
+    - "queue_depth_total_ns": requests in flight summed over time, in
+                              nano-seconds (json-int)
+    - "wr_merged": write requests merged into others (json-int)
+    - "flush_coalesced": flushes that did not reach the disk because of
+                         cache=ephemeral (json-int)
+    - "throttled_total_time_ns": time requests waited for the I/O limits,
+                                 in nano-seconds (json-int)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -2399,6 +2592,314 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_cpus,
     },
 
+SQMP
+query-vcpu-exits
+----------------
+
+Show why and how often each virtual CPU run by KVM or HAX returns to QEMU.
+
+Arguments:
+
+- "reset": clear the statistics after reading them (json-bool, optional)
+
+Return a json-array. Each CPU is represented by a json-object, which contains:
+
+- "CPU": CPU index (json-int)
+- "reasons": json-array of json-objects, one per exit reason seen, with:
+  - "reason": one of "io", "mmio", "fast-mmio", "hlt", "interrupt",
+    "real-mode", "shutdown", "other" (json-string)
+  - "count": number of exits (json-int)
+  - "time-ns": total time spent handling them, in nanoseconds (json-int)
+  - "latency-histogram": number of exits per handling time, entry N counts
+    the exits handled in less than 4^N microseconds (json-array of json-int)
+- "top-addresses": json-array of the most accessed ports and MMIO
+  addresses, most frequent first, each a json-object with:
+  - "io": true for a port, false for a guest physical address (json-bool)
+  - "address": the port or address (json-int)
+  - "count": approximate number of exits (json-int)
+- "halt-poll": json-object with the halt polling statistics:
+  - "window-ns": current polling window, in nanoseconds (json-int)
+  - "polls": number of halts with a non empty window (json-int)
+  - "successes": number of these halts which ended while polling (json-int)
+  - "time-ns": total time spent polling, in nanoseconds (json-int)
+
+Example:
+
+-> { "execute": "query-vcpu-exits" }
+<- {
+      "return":[
+         {
+            "CPU":0,
+            "reasons":[
+               {
+                  "reason":"fast-mmio",
+                  "count":182211,
+                  "time-ns":401902113,
+                  "latency-histogram":[ 1021, 160544, 19870, 702, 74, 0, 0, 0 ]
+               },
+               {
+                  "reason":"hlt",
+                  "count":9120,
+                  "time-ns":3311902,
+                  "latency-histogram":[ 8803, 301, 16, 0, 0, 0, 0, 0 ]
+               }
+            ],
+            "top-addresses":[
+               { "io":false, "address":4278190080, "count":120034 },
+               { "io":true, "address":112, "count":4410 }
+            ],
+            "halt-poll":{
+               "window-ns":40000,
+               "polls":9120,
+               "successes":6011,
+               "time-ns":143810270
+            }
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-vcpu-exits",
+        .args_type  = "reset:b?",
+        .flags      = MONITOR_CMD_NO_BQL,
+        .mhandler.cmd_new = qmp_marshal_input_query_vcpu_exits,
+    },
+
+SQMP
+vcpu-profile-start
+------------------
+
+Start sampling what the virtual CPUs are doing. Each sample records, for
+every CPU, whether it is stopped, halted, running QEMU code, or running
+guest code and at which guest PC. Under KVM and HAX, sampling briefly
+interrupts the running CPUs to read their registers.
+
+Arguments:
+
+- "file": file the profile is written to by vcpu-profile-stop, as folded
+  stacks for flame graph tools (json-string)
+- "rate": samples per second and CPU, 1 to 1000, default 99 (json-int,
+  optional)
+
+Example:
+
+-> { "execute": "vcpu-profile-start",
+     "arguments": { "file": "/tmp/vcpu.folded", "rate": 199 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "vcpu-profile-start",
+        .args_type  = "file:s,rate:i?",
+        .mhandler.cmd_new = qmp_marshal_input_vcpu_profile_start,
+    },
+
+SQMP
+vcpu-profile-stop
+-----------------
+
+Stop the profiler and write its file, one "<stack> <count>" line per
+distinct stack, e.g. "vcpu0;guest;0xffffffc0000855a0 42" or
+"vcpu1;halted 1890".
+
+Return a json-object with:
+
+- "file": the file written (json-string)
+- "samples": number of samples, all CPUs included (json-int)
+- "stacks": number of lines in the file (json-int)
+- "duration-ns": time the profiler ran for, in nanoseconds (json-int)
+
+Example:
+
+-> { "execute": "vcpu-profile-stop" }
+<- { "return": { "file": "/tmp/vcpu.folded", "samples": 23880,
+                 "stacks": 4127, "duration-ns": 60012311845 } }
+
+EQMP
+
+    {
+        .name       = "vcpu-profile-stop",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_vcpu_profile_stop,
+    },
+
+SQMP
+set-vcpu-affinity
+-----------------
+
+Restrict the threads running virtual CPUs to a set of host CPUs. Under
+TCG, all CPUs are run by the same thread.
+
+Arguments:
+
+- "cpu-index": the CPU whose thread is moved, all of them if omitted
+  (json-int, optional)
+- "host-cpus": the host CPUs the threads may run on (json-array of
+  json-int)
+
+Example:
+
+-> { "execute": "set-vcpu-affinity",
+     "arguments": { "cpu-index": 1, "host-cpus": [ 2, 3 ] } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "set-vcpu-affinity",
+        .args_type  = "cpu-index:i?,host-cpus:q",
+        .mhandler.cmd_new = qmp_marshal_input_set_vcpu_affinity,
+    },
+
+SQMP
+set-thread-affinity
+-------------------
+
+Restrict any thread of the emulator, such as an IOThread or a renderer
+thread, to a set of host CPUs.
+
+Arguments:
+
+- "thread-id": the host ID of the thread, as reported by query-cpus or
+  query-iothreads (json-int)
+- "host-cpus": the host CPUs the thread may run on (json-array of
+  json-int)
+
+Example:
+
+-> { "execute": "set-thread-affinity",
+     "arguments": { "thread-id": 3134, "host-cpus": [ 0, 1, 2, 3 ] } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "set-thread-affinity",
+        .args_type  = "thread-id:i,host-cpus:q",
+        .mhandler.cmd_new = qmp_marshal_input_set_thread_affinity,
+    },
+
+SQMP
+query-boot-timeline
+-------------------
+
+Show when each startup phase completed, from the launch of the process to
+the milestones reported by the guest while it boots.
+
+Return a json-array of json-objects, oldest first, each with:
+
+- "name": the phase, guest milestones start with "guest:" (json-string)
+- "time-ns": nanoseconds since the first mark (json-int)
+
+Example:
+
+-> { "execute": "query-boot-timeline" }
+<- { "return": [ { "name": "launch", "time-ns": 0 },
+                 { "name": "options-parsed", "time-ns": 41203311 },
+                 { "name": "machine-init", "time-ns": 388104221 },
+                 { "name": "guest-start", "time-ns": 612990541 },
+                 { "name": "guest:sys.boot_completed",
+                   "time-ns": 31877624012 } ] }
+
+EQMP
+
+    {
+        .name       = "query-boot-timeline",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_boot_timeline,
+    },
+
+SQMP
+query-tcg-stats
+---------------
+
+Show statistics of the TCG translator and of the code it generated.
+
+Return a json-object with:
+
+- "translations": number of blocks translated (json-int)
+- "translation-time-ns": total time spent translating, in nanoseconds
+  (json-int)
+- "translation-rate": blocks translated per second over the last second
+  (json-int)
+- "tb-count": number of blocks in the translation buffer (json-int)
+- "flushes": number of translation buffer flushes (json-int)
+- "evictions": number of blocks evicted for new ones (json-int)
+- "invalidations": number of blocks invalidated by code writes (json-int)
+- "chain-patches": number of direct jumps chained (json-int)
+- "jump-lookups": number of jump cache lookups by indirect branches
+  (json-int)
+- "jump-lookup-misses": number of these which found no block (json-int)
+- "phys-lookups": number of block lookups by physical address (json-int)
+- "phys-lookup-misses": number of these which had to translate (json-int)
+- "tlb-flushes": number of softmmu TLB flushes (json-int)
+- "tlb-misses": json-array of json-objects, one per kind of access, with:
+  - "access": one of "read", "write", "code" (json-string)
+  - "misses": number of main TLB misses (json-int)
+  - "fills": number of these which also missed the victim TLB (json-int)
+- "tlb-flush-reasons": json-array of json-objects, one per flush reason,
+  with:
+  - "reason": one of "all", "mmu-modes", "page", "range", "large-page"
+    (json-string)
+  - "count": number of flushes (json-int)
+  - "time-ns": time spent in them, in nanoseconds (json-int)
+- "exits": json-array of json-objects, one per exit reason, with:
+  - "reason": one of "lookup", "chain", "requested", "icount",
+    "cpu-loop-exit" (json-string)
+  - "count": number of exits to the main loop (json-int)
+
+Example:
+
+-> { "execute": "query-tcg-stats" }
+<- {
+      "return":{
+         "translations":48211,
+         "translation-time-ns":1203419822,
+         "translation-rate":312,
+         "tb-count":20113,
+         "flushes":0,
+         "evictions":1288,
+         "invalidations":3410,
+         "chain-patches":60338,
+         "jump-lookups":90213388,
+         "jump-lookup-misses":409211,
+         "phys-lookups":412008,
+         "phys-lookup-misses":48211,
+         "tlb-flushes":1120,
+         "tlb-misses":[
+            { "access":"read", "misses":8820931, "fills":401223 },
+            { "access":"write", "misses":2730112, "fills":120993 },
+            { "access":"code", "misses":51201, "fills":30112 }
+         ],
+         "tlb-flush-reasons":[
+            { "reason":"all", "count":1120, "time-ns":10329841 },
+            { "reason":"mmu-modes", "count":0, "time-ns":0 },
+            { "reason":"page", "count":88213, "time-ns":9120332 },
+            { "reason":"range", "count":0, "time-ns":0 },
+            { "reason":"large-page", "count":312, "time-ns":2210093 }
+         ],
+         "exits":[
+            { "reason":"lookup", "count":1022345 },
+            { "reason":"chain", "count":60338 },
+            { "reason":"requested", "count":40112 },
+            { "reason":"icount", "count":0 },
+            { "reason":"cpu-loop-exit", "count":220931 }
+         ]
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-tcg-stats",
+        .args_type  = "",
+        .flags      = MONITOR_CMD_NO_BQL,
+        .mhandler.cmd_new = qmp_marshal_input_query_tcg_stats,
+    },
+
 SQMP
 query-iothreads
 ---------------
@@ -2438,6 +2939,266 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_iothreads,
     },
 
+SQMP
+query-android-pipes
+-------------------
+
+Returns usage statistics for each registered android pipe service.
+
+Return a json-array. Each service is represented by a json-object, which
+contains:
+
+- "name": name of the pipe service (json-str)
+- "opens": number of pipes connected to the service (json-int)
+- "commands": number of guest commands handled by its pipes (json-int)
+- "bytes-sent": bytes sent by the guest to the service (json-int)
+- "bytes-received": bytes received by the guest from the service (json-int)
+- "again": number of transfers that returned PIPE_ERROR_AGAIN (json-int)
+- "open-time-ns": total time spent connecting pipes, in ns (json-int)
+- "open-time-max-ns": longest time spent connecting a pipe, in ns (json-int)
+- "latency-histogram": number of send/receive callback calls per duration,
+  entry N counts the calls shorter than 4^N microseconds (json-array of
+  json-int)
+
+Example:
+
+-> { "execute": "query-android-pipes" }
+<- {
+      "return":[
+         {
+            "name":"opengles",
+            "opens":12,
+            "commands":48211,
+            "bytes-sent":90133842,
+            "bytes-received":1843201,
+            "again":733,
+            "open-time-ns":1402113,
+            "open-time-max-ns":412034,
+            "latency-histogram":[ 40211, 6012, 1102, 120, 33, 0, 0, 0 ]
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-android-pipes",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_android_pipes,
+    },
+
+SQMP
+goldfish-event-script
+---------------------
+
+Schedule input events for the goldfish event device at given guest times.
+
+Arguments:
+
+- "events": json-array of events, each a json-object with:
+  - "time": guest time of the event, in microseconds from the command
+    (json-int)
+  - "type": Linux input event type (json-int)
+  - "code": Linux input event code (json-int)
+  - "value": event value (json-int)
+
+Events don't need to be sorted, those with the same time are sent in order.
+
+Example:
+
+-> { "execute": "goldfish-event-script",
+     "arguments": { "events": [
+        { "time": 0, "type": 3, "code": 57, "value": 1 },
+        { "time": 0, "type": 3, "code": 53, "value": 200 },
+        { "time": 0, "type": 3, "code": 54, "value": 400 },
+        { "time": 0, "type": 0, "code": 0, "value": 0 },
+        { "time": 1000, "type": 3, "code": 54, "value": 410 },
+        { "time": 1000, "type": 0, "code": 0, "value": 0 },
+        { "time": 2000, "type": 3, "code": 57, "value": -1 },
+        { "time": 2000, "type": 0, "code": 0, "value": 0 } ] } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "goldfish-event-script",
+        .args_type  = "events:q",
+        .mhandler.cmd_new = qmp_marshal_input_goldfish_event_script,
+    },
+
+SQMP
+query-goldfish-interrupts
+-------------------------
+
+Returns the state and statistics of the goldfish interrupt lines.
+
+Return a json-array with, for each line, a json-object containing:
+
+- "irq": line number (json-int)
+- "enabled": whether the guest enabled the line (json-bool)
+- "level": whether the device raises the line (json-bool)
+- "delivered": times the line became pending (json-int)
+
+Example:
+
+-> { "execute": "query-goldfish-interrupts" }
+<- { "return": [
+        { "irq": 0, "enabled": true, "level": false, "delivered": 1024 },
+        { "irq": 1, "enabled": true, "level": true, "delivered": 87311 },
+        { "irq": 2, "enabled": false, "level": false, "delivered": 0 } ] }
+
+EQMP
+
+    {
+        .name       = "query-goldfish-interrupts",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_goldfish_interrupts,
+    },
+
+SQMP
+android-console-batch
+---------------------
+
+Run android console commands in order, and return the result of each.
+
+Arguments:
+
+- "commands": json-array of console command lines (json-string)
+
+Return a json-array with, for each command, a json-object containing:
+
+- "command": the command line (json-string)
+- "ok": false if the command printed a "KO" line (json-bool)
+- "output": what the command printed (json-string)
+
+Example:
+
+-> { "execute": "android-console-batch",
+     "arguments": { "commands": [ "geo fix -122.08 37.42",
+                                  "power capacity 42",
+                                  "sensor set nosuch 1" ] } }
+<- { "return": [
+        { "command": "geo fix -122.08 37.42", "ok": true, "output": "OK\n" },
+        { "command": "power capacity 42", "ok": true, "output": "OK\n" },
+        { "command": "sensor set nosuch 1", "ok": false,
+          "output": "KO: unknown command, try 'help'\n" } ] }
+
+EQMP
+
+    {
+        .name       = "android-console-batch",
+        .args_type  = "commands:q",
+        .mhandler.cmd_new = qmp_marshal_input_android_console_batch,
+    },
+
+SQMP
+android-fast-reset
+------------------
+
+Reboot the virtual device in place, with the devices and emulated services
+back in their startup state, or load a snapshot.  Chardevs, network
+backends, the renderer and console connections are kept.
+
+Arguments:
+
+- "snapshot": snapshot to load instead of rebooting (json-string, optional)
+- "wipe": json-array of block devices to revert before rebooting
+  (json-string, optional)
+
+Example:
+
+-> { "execute": "android-fast-reset",
+     "arguments": { "wipe": [ "userdata", "cache" ] } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "android-fast-reset",
+        .args_type  = "snapshot:s?,wipe:q?",
+        .mhandler.cmd_new = qmp_marshal_input_android_fast_reset,
+    },
+
+SQMP
+geo-route-start
+---------------
+
+Play a GPX track back as GPS fixes, sent on the guest clock and
+interpolated along the track.
+
+Arguments:
+
+- "file": GPX file to play (json-string)
+- "speed": playback speed multiplier, default 1 (json-number, optional)
+- "interval": milliseconds of guest time between fixes, default 1000
+  (json-int, optional)
+- "loop": start over at the end of the track, default false
+  (json-bool, optional)
+
+Example:
+
+-> { "execute": "geo-route-start",
+     "arguments": { "file": "/tmp/commute.gpx", "speed": 4 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "geo-route-start",
+        .args_type  = "file:s,speed:T?,interval:i?,loop:b?",
+        .mhandler.cmd_new = qmp_marshal_input_geo_route_start,
+    },
+
+SQMP
+geo-route-stop
+--------------
+
+Stop the route playback.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "geo-route-stop" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "geo-route-stop",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_geo_route_stop,
+    },
+
+SQMP
+query-geo-route
+---------------
+
+Return the progress of the route playback, as a json-object containing:
+
+- "active": whether the route is playing (json-bool)
+- "file": the GPX file, if a route was started (json-string, optional)
+- "points": number of points of the route (json-int)
+- "position": index of the last point passed (json-int)
+- "fixes": number of fixes sent (json-int)
+- "elapsed-ms": route time of the last fix (json-int)
+- "duration-ms": route time of the last point (json-int)
+
+Example:
+
+-> { "execute": "query-geo-route" }
+<- { "return": { "active": true, "file": "/tmp/commute.gpx", "points": 1840,
+                 "position": 311, "fixes": 80, "elapsed-ms": 316000,
+                 "duration-ms": 1857000 } }
+
+EQMP
+
+    {
+        .name       = "query-geo-route",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_geo_route,
+    },
+
 SQMP
 query-pci
 ---------
@@ -2716,6 +3477,7 @@ EQMP
     {
         .name       = "query-status",
         .args_type  = "",
+        .flags      = MONITOR_CMD_NO_BQL,
         .mhandler.cmd_new = qmp_marshal_input_query_status,
     },
 
@@ -2924,6 +3686,7 @@ EQMP
     {
         .name       = "query-name",
         .args_type  = "",
+        .flags      = MONITOR_CMD_NO_BQL,
         .mhandler.cmd_new = qmp_marshal_input_query_name,
     },
 
@@ -2947,6 +3710,7 @@ EQMP
     {
         .name       = "query-uuid",
         .args_type  = "",
+        .flags      = MONITOR_CMD_NO_BQL,
         .mhandler.cmd_new = qmp_marshal_input_query_uuid,
     },
 
@@ -3059,6 +3823,8 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+         - "encode-time": milliseconds the encoder threads spent on
+           pages, summed over all of them
 
 Examples:
 
@@ -3164,7 +3930,8 @@ Examples:
             "pages":2444343,
             "cache-miss":2244,
             "cache-miss-rate":0.123,
-            "overflow":34434
+            "overflow":34434,
+            "encode-time":2103
          }
       }
    }
@@ -3527,6 +4294,67 @@ Example:
       ]
    }
 
+EQMP
+
+    {
+        .name       = "query-net-queues",
+        .args_type  = "name:s?",
+        .mhandler.cmd_new = qmp_marshal_input_query_net_queues,
+    },
+
+SQMP
+query-net-queues
+----------------
+
+Show the queues of packets waiting to be delivered to net clients.
+
+Arguments:
+
+- "name": net client name (json-string, optional)
+
+Each array entry contains the following:
+
+- "name": net client name (json-string)
+- "queue-index": queue of the net client (json-int)
+- "depth": packets in the queue (json-int)
+- "limit": packets beyond which those without a completion callback are
+  dropped (json-int)
+- "peak": most packets the queue has held (json-int)
+- "queued": packets that went through the queue (json-int)
+- "dropped": packets dropped because the queue was full (json-int)
+
+Example:
+
+-> { "execute": "query-net-queues", "arguments": { "name": "net0" } }
+<- { "return": [
+        { "name": "net0", "queue-index": 0, "depth": 0, "limit": 10000,
+          "peak": 37, "queued": 1284, "dropped": 0 } ] }
+
+EQMP
+
+    {
+        .name       = "set-net-queue-limit",
+        .args_type  = "name:s,limit:i",
+        .mhandler.cmd_new = qmp_marshal_input_set_net_queue_limit,
+    },
+
+SQMP
+set-net-queue-limit
+-------------------
+
+Set the length of the incoming packet queue of a net client.
+
+Arguments:
+
+- "name": net client name (json-string)
+- "limit": number of packets, 1 to 1000000 (json-int)
+
+Example:
+
+-> { "execute": "set-net-queue-limit",
+     "arguments": { "name": "net0", "limit": 256 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -629,10 +629,36 @@ typedef struct OCFData
 {
     void (*fn)(ObjectClass *klass, void *opaque);
     const char *implements_type;
+    TypeImpl *target;
     bool include_abstract;
     void *opaque;
 } OCFData;
 
+/*
+ * Decide from the type names alone, without initializing any class, whether
+ * @type could cast to @target: either @target is one of its ancestors, or
+ * it or an ancestor declares an interface derived from @target.  This may
+ * say yes too often, never too rarely.
+ */
+static bool type_may_implement(TypeImpl *type, TypeImpl *target)
+{
+    int i;
+
+    for (; type; type = type_get_parent(type)) {
+        if (type == target) {
+            return true;
+        }
+        for (i = 0; i < type->num_interfaces; i++) {
+            TypeImpl *iface = type_get_by_name(type->interfaces[i].typename);
+
+            if (iface && type_is_ancestor(iface, target)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
 static void object_class_foreach_tramp(gpointer key, gpointer value,
                                        gpointer opaque)
 {
@@ -640,14 +666,19 @@ static void object_class_foreach_tramp(gpointer key, gpointer value,
     TypeImpl *type = value;
     ObjectClass *k;
 
-    type_initialize(type);
-    k = type->class;
-
     if (!data->include_abstract && type->abstract) {
         return;
     }
 
-    if (data->implements_type && 
+    /* Leave the classes that cannot match uninitialized */
+    if (data->implements_type && !type_may_implement(type, data->target)) {
+        return;
+    }
+
+    type_initialize(type);
+    k = type->class;
+
+    if (data->implements_type &&
         !object_class_dynamic_cast(k, data->implements_type)) {
         return;
     }
@@ -659,7 +690,19 @@ void object_class_foreach(void (*fn)(ObjectClass *klass, void *opaque),
                           const char *implements_type, bool include_abstract,
                           void *opaque)
 {
-    OCFData data = { fn, implements_type, include_abstract, opaque };
+    OCFData data = {
+        .fn = fn,
+        .implements_type = implements_type,
+        .include_abstract = include_abstract,
+        .opaque = opaque,
+    };
+
+    if (implements_type) {
+        data.target = type_get_by_name(implements_type);
+        if (!data.target) {
+            return;
+        }
+    }
 
     enumerating_types = true;
     g_hash_table_foreach(type_table_get(), object_class_foreach_tramp, &data);
@@ -42,6 +42,8 @@
 #include "qemu/iov.h"
 #include "block/snapshot.h"
 #include "block/qapi.h"
+#include "block/block_int.h"
+#include "sysemu/arch_init.h"
 
 
 #ifndef ETH_P_RARP
@@ -149,13 +151,15 @@ static int bdrv_fclose(void *opaque)
 
 static const QEMUFileOps bdrv_read_ops = {
     .get_buffer = block_get_buffer,
-    .close =      bdrv_fclose
+    .close =      bdrv_fclose,
+    .bulk =       true
 };
 
 static const QEMUFileOps bdrv_write_ops = {
     .put_buffer     = block_put_buffer,
     .writev_buffer  = block_writev_buffer,
-    .close          = bdrv_fclose
+    .close          = bdrv_fclose,
+    .bulk           = true
 };
 
 static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
@@ -1013,7 +1017,7 @@ static BlockDriverState *find_vmstate_bs(void)
 /*
  * Deletes snapshots of a given name in all opened images.
  */
-static int del_existing_snapshots(Monitor *mon, const char *name)
+static int del_existing_snapshots(const char *name)
 {
     BlockDriverState *bs;
     QEMUSnapshotInfo sn1, *snapshot = &sn1;
@@ -1025,11 +1029,10 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
             bdrv_snapshot_find(bs, snapshot, name) >= 0) {
             bdrv_snapshot_delete_by_id_or_name(bs, name, &err);
             if (err) {
-                monitor_printf(mon,
-                               "Error while deleting snapshot on device '%s':"
-                               " %s\n",
-                               bdrv_get_device_name(bs),
-                               error_get_pretty(err));
+                error_report("Error while deleting snapshot on device '%s':"
+                             " %s",
+                             bdrv_get_device_name(bs),
+                             error_get_pretty(err));
                 error_free(err);
                 return -1;
             }
@@ -1039,7 +1042,38 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
     return 0;
 }
 
-void do_savevm(Monitor *mon, const QDict *qdict)
+/*
+ * Saves the VM state as snapshot @name, or as a new snapshot named after
+ * the current date if @name is NULL. Errors are reported with
+ * error_report(), so they go to the current monitor if there is one.
+ */
+/*
+ * RAM of a snapshot is kept next to the image holding its VM state, in a
+ * file that is mapped rather than read back on load.  Hosts without mmap
+ * keep it in the VM state as before.
+ */
+#ifndef _WIN32
+static char *ram_snapshot_path(BlockDriverState *bs, const char *name)
+{
+    return g_strdup_printf("%s.%s.ram", bs->filename, name);
+}
+#endif
+
+static void set_ram_snapshot_file(BlockDriverState *bs, const char *name)
+{
+#ifndef _WIN32
+    char *path = ram_snapshot_path(bs, name);
+
+    ram_set_snapshot_file(path);
+    g_free(path);
+#endif
+}
+
+/*
+ * In the background, guest RAM is written out after the VM has resumed,
+ * where the host allows; see ram_snapshot_background_start().
+ */
+static int do_save_vmstate(const char *name, bool background)
 {
     BlockDriverState *bs, *bs1;
     QEMUSnapshotInfo sn1, *sn = &sn1, old_sn1, *old_sn = &old_sn1;
@@ -1049,7 +1083,6 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     uint64_t vm_state_size;
     qemu_timeval tv;
     struct tm tm;
-    const char *name = qdict_get_try_str(qdict, "name");
 
     /* Verify if there is a device that doesn't support snapshots and is writable */
     bs = NULL;
@@ -1060,18 +1093,21 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         }
 
         if (!bdrv_can_snapshot(bs)) {
-            monitor_printf(mon, "Device '%s' is writable but does not support snapshots.\n",
-                               bdrv_get_device_name(bs));
-            return;
+            error_report("Device '%s' is writable but does not support snapshots.",
+                         bdrv_get_device_name(bs));
+            return -ENOTSUP;
         }
     }
 
     bs = find_vmstate_bs();
     if (!bs) {
-        monitor_printf(mon, "No block device can accept snapshots\n");
-        return;
+        error_report("No block device can accept snapshots");
+        return -ENOTSUP;
     }
 
+    /* The RAM file being written may be the one to replace */
+    ram_snapshot_background_wait();
+
     saved_vm_running = runstate_is_running();
     vm_stop(RUN_STATE_SAVE_VM);
 
@@ -1098,21 +1134,26 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     }
 
     /* Delete old snapshots of the same name */
-    if (name && del_existing_snapshots(mon, name) < 0) {
+    ret = -1;
+    if (name && del_existing_snapshots(name) < 0) {
         goto the_end;
     }
 
     /* save the VM state */
     f = qemu_fopen_bdrv(bs, 1);
     if (!f) {
-        monitor_printf(mon, "Could not open VM state file\n");
+        error_report("Could not open VM state file");
         goto the_end;
     }
+    set_ram_snapshot_file(bs, sn->name);
+    ram_set_snapshot_background(background);
     ret = qemu_savevm_state(f);
+    ram_set_snapshot_background(false);
+    ram_set_snapshot_file(NULL);
     vm_state_size = qemu_ftell(f);
     qemu_fclose(f);
     if (ret < 0) {
-        monitor_printf(mon, "Error %d while writing VM\n", ret);
+        error_report("Error %d while writing VM", ret);
         goto the_end;
     }
 
@@ -1123,18 +1164,43 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         if (bdrv_can_snapshot(bs1)) {
             /* Write VM state size only to the image that contains the state */
             sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
-            ret = bdrv_snapshot_create(bs1, sn);
-            if (ret < 0) {
-                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
-                               bdrv_get_device_name(bs1));
+            if (bdrv_snapshot_create(bs1, sn) < 0) {
+                error_report("Error while creating snapshot on '%s'",
+                             bdrv_get_device_name(bs1));
+                ret = -EIO;
             }
         }
     }
 
+    /* RAM must be forked off before the guest runs again */
+    if (ret >= 0) {
+        ret = ram_snapshot_background_start();
+    }
+
  the_end:
+    if (ret < 0) {
+        ram_snapshot_background_abort();
+    }
     if (saved_vm_running) {
         vm_start();
     }
+    return ret < 0 ? ret : 0;
+}
+
+int save_vmstate(const char *name)
+{
+    return do_save_vmstate(name, false);
+}
+
+int save_vmstate_background(const char *name)
+{
+    return do_save_vmstate(name, true);
+}
+
+void do_savevm(Monitor *mon, const QDict *qdict)
+{
+    do_save_vmstate(qdict_get_try_str(qdict, "name"),
+                    qdict_get_try_bool(qdict, "background", 0));
 }
 
 void qmp_xen_save_devices_state(const char *filename, Error **errp)
@@ -1163,6 +1229,56 @@ void qmp_xen_save_devices_state(const char *filename, Error **errp)
     }
 }
 
+/* The state of the devices once the machine is created and reset */
+static QEMUSizedBuffer *initial_device_state;
+
+int qemu_savevm_initial_state(void)
+{
+    QEMUFile *f;
+    int ret;
+
+    qsb_free(initial_device_state);
+    initial_device_state = NULL;
+
+    f = qemu_bufopen("w", NULL);
+    if (!f) {
+        return -ENOMEM;
+    }
+    ret = qemu_save_device_state(f);
+    if (ret == 0) {
+        initial_device_state = qsb_clone(qemu_buf_get(f));
+        if (!initial_device_state) {
+            ret = -ENOMEM;
+        }
+    }
+    qemu_fclose(f);
+    return ret;
+}
+
+int qemu_loadvm_initial_state(void)
+{
+    QEMUSizedBuffer *qsb;
+    QEMUFile *f;
+    int ret;
+
+    if (!initial_device_state) {
+        return -ENOENT;
+    }
+    /* Closing the file frees the buffer it reads, keep ours for next time */
+    qsb = qsb_clone(initial_device_state);
+    if (!qsb) {
+        return -ENOMEM;
+    }
+    f = qemu_bufopen("r", qsb);
+    if (!f) {
+        qsb_free(qsb);
+        return -ENOMEM;
+    }
+    ret = qemu_loadvm_state(f);
+    qemu_fclose(f);
+    return ret;
+}
+
 int load_vmstate(const char *name)
 {
     BlockDriverState *bs, *bs_vm_state;
@@ -1209,6 +1325,9 @@ int load_vmstate(const char *name)
         }
     }
 
+    /* The snapshot's RAM file may still be being written */
+    ram_snapshot_background_wait();
+
     /* Flush all IO requests so they don't interfere with the new state.  */
     bdrv_drain_all();
 
@@ -1232,7 +1351,10 @@ int load_vmstate(const char *name)
     }
 
     qemu_system_reset(VMRESET_SILENT);
+    set_ram_snapshot_file(bs_vm_state, sn.name);
     ret = qemu_loadvm_state(f);
+    ram_set_snapshot_file(NULL);
+    ram_decompress_cleanup();
 
     qemu_fclose(f);
     if (ret < 0) {
@@ -1245,15 +1367,30 @@ int load_vmstate(const char *name)
 
 void do_delvm(Monitor *mon, const QDict *qdict)
 {
-    BlockDriverState *bs;
+    BlockDriverState *bs, *bs_vm_state;
     Error *err;
     const char *name = qdict_get_str(qdict, "name");
 
-    if (!find_vmstate_bs()) {
+    bs_vm_state = find_vmstate_bs();
+    if (!bs_vm_state) {
         monitor_printf(mon, "No block device supports snapshots\n");
         return;
     }
 
+#ifndef _WIN32
+    ram_snapshot_background_wait();
+    {
+        QEMUSnapshotInfo sn;
+
+        if (bdrv_snapshot_find(bs_vm_state, &sn, name) >= 0) {
+            char *path = ram_snapshot_path(bs_vm_state, sn.name);
+
+            unlink(path);
+            g_free(path);
+        }
+    }
+#endif
+
     bs = NULL;
     while ((bs = bdrv_next(bs))) {
         if (bdrv_can_snapshot(bs)) {
@@ -0,0 +1,386 @@
+#!/usr/bin/env python
+#
+# End-to-end performance benchmark of the emulator on a reference AVD
+#
+# Copyright 2016 The Android Open Source Project
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+# Boots an AVD with the given emulator and writes the results as JSON, so
+# that builds can be compared before a release. Run it with "make bench":
+#
+#   make bench BENCH_AVD=<avd> [BENCH_EMULATOR=<path>] [BENCH_OUTPUT=<file>]
+#
+# It measures, in this order:
+#
+#   cold_boot:     seconds from the launch to sys.boot_completed, without
+#                  loading a snapshot
+#   idle_cpu:      host CPU used by the emulator once booted and idle, in
+#                  percent of one host CPU (Linux hosts only)
+#   ui:            frames delivered by the GPU frame bridge per second while
+#                  scrolling the settings, and the bytes per second through
+#                  each Android pipe service meanwhile
+#   adb_push:      throughput of "adb push" of a file of random data
+#   disk:          sequential write (fsync'ed) and read throughput of /data
+#   network:       TCP throughput and latency, see net-tcp-bench.py
+#   snapshot_boot: seconds from the launch to sys.boot_completed, loading
+#                  the snapshot saved at the end of the first boot
+#
+# The emulator publishes its counters with -metrics and is driven through
+# a QMP socket, both passed after -qemu. A phase that fails records an
+# "error" instead of its results, the others still run.
+
+import imp
+import json
+import optparse
+import os
+import platform
+import re
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+import urllib2
+
+sys.path.append(os.path.join(os.path.dirname(__file__), 'qmp'))
+import qmp
+
+net_bench = imp.load_source('net_bench', os.path.join(
+    os.path.dirname(os.path.abspath(__file__)), 'net-tcp-bench.py'))
+
+SNAPSHOT = 'avd-bench'
+REMOTE_DIR = '/data/local/tmp'
+SAMPLE_RE = re.compile(r'^([a-zA-Z_:][a-zA-Z0-9_:]*)(\{(.*)\})? (\S+)$')
+LABEL_RE = re.compile(r'([a-zA-Z_][a-zA-Z0-9_]*)="((?:[^"\\]|\\.)*)"')
+
+
+class BenchError(Exception):
+    pass
+
+
+def scrape(port):
+    """Return the metrics as a dict of (name, labels) to values, with the
+    labels a sorted tuple of (key, value)."""
+    text = urllib2.urlopen('http://127.0.0.1:%d/metrics' % port,
+                           timeout=10).read()
+    samples = {}
+    for line in text.splitlines():
+        match = SAMPLE_RE.match(line)
+        if not match or line.startswith('#'):
+            continue
+        labels = tuple(sorted(LABEL_RE.findall(match.group(3) or '')))
+        samples[(match.group(1), labels)] = float(match.group(4))
+    return samples
+
+
+def metric_sum(samples, name, **match):
+    """Sum the samples of @name whose labels include @match."""
+    total = 0.0
+    for (key, labels), value in samples.items():
+        if key == name and set(match.items()) <= set(labels):
+            total += value
+    return total
+
+
+def process_tree(pid):
+    """Return @pid and its descendants, the launcher may spawn the
+    emulator binary."""
+    parents = {}
+    for entry in os.listdir('/proc'):
+        if not entry.isdigit():
+            continue
+        try:
+            with open('/proc/%s/stat' % entry) as f:
+                stat = f.read()
+        except IOError:
+            continue
+        ppid = int(stat[stat.rindex(')') + 2:].split()[1])
+        parents.setdefault(ppid, []).append(int(entry))
+    tree, todo = [], [pid]
+    while todo:
+        p = todo.pop()
+        tree.append(p)
+        todo.extend(parents.get(p, []))
+    return tree
+
+
+def cpu_seconds(pid):
+    """Return the user and system CPU time of @pid and its descendants."""
+    ticks = 0
+    for p in process_tree(pid):
+        try:
+            with open('/proc/%d/stat' % p) as f:
+                stat = f.read()
+        except IOError:
+            continue
+        fields = stat[stat.rindex(')') + 2:].split()
+        ticks += int(fields[11]) + int(fields[12])
+    return float(ticks) / os.sysconf('SC_CLK_TCK')
+
+
+def free_port():
+    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+class Emulator(object):
+    def __init__(self, opts, workdir, qemu_args):
+        self.opts = opts
+        self.serial = 'emulator-%d' % opts.port
+        self.adb_cmd = [opts.adb, '-s', self.serial]
+        self.metrics_port = free_port()
+        self.qmp_path = os.path.join(workdir, 'qmp.sock')
+        if os.path.exists(self.qmp_path):
+            os.unlink(self.qmp_path)
+        cmd = [opts.emulator, '-avd', opts.avd, '-port', str(opts.port),
+               '-no-snapshot', '-no-audio', '-no-boot-anim']
+        cmd += opts.emulator_args
+        cmd += ['-qemu', '-metrics', '127.0.0.1:%d' % self.metrics_port,
+                '-qmp', 'unix:%s,server,nowait' % self.qmp_path]
+        cmd += qemu_args
+        self.log = open(os.path.join(workdir, 'emulator.log'), 'a')
+        self.start = time.time()
+        self.proc = subprocess.Popen(cmd, stdout=self.log,
+                                     stderr=subprocess.STDOUT)
+        self.monitor = None
+
+    def adb(self, *args):
+        return subprocess.check_output(self.adb_cmd + list(args))
+
+    def shell(self, cmd):
+        return self.adb('shell', cmd)
+
+    def wait_boot(self):
+        """Return the seconds from the launch to sys.boot_completed."""
+        deadline = self.start + self.opts.boot_timeout
+        while time.time() < deadline:
+            if self.proc.poll() is not None:
+                raise BenchError('the emulator exited with status %d' %
+                                 self.proc.returncode)
+            try:
+                if self.shell('getprop sys.boot_completed').strip() == '1':
+                    return time.time() - self.start
+            except subprocess.CalledProcessError:
+                pass
+            time.sleep(0.5)
+        raise BenchError('no boot after %d seconds' % self.opts.boot_timeout)
+
+    def hmp(self, command):
+        if not self.monitor:
+            self.monitor = qmp.QEMUMonitorProtocol(self.qmp_path)
+            self.monitor.connect()
+        return self.monitor.command('human-monitor-command',
+                                    **{'command-line': command})
+
+    def metrics(self):
+        return scrape(self.metrics_port)
+
+    def quit(self):
+        try:
+            if self.monitor or os.path.exists(self.qmp_path):
+                self.hmp('quit')
+        except Exception:
+            pass
+        deadline = time.time() + 60
+        while self.proc.poll() is None and time.time() < deadline:
+            time.sleep(0.5)
+        if self.proc.poll() is None:
+            self.proc.kill()
+            self.proc.wait()
+        self.log.close()
+
+
+def bench_idle_cpu(emu, opts):
+    time.sleep(opts.settle)
+    start, cpu = time.time(), cpu_seconds(emu.proc.pid)
+    time.sleep(opts.idle_seconds)
+    elapsed = time.time() - start
+    return {'seconds': elapsed,
+            'percent': (cpu_seconds(emu.proc.pid) - cpu) * 100 / elapsed}
+
+
+def bench_ui(emu, opts):
+    """Scroll the settings for a while, measuring the frame rate and the
+    traffic of the pipes meanwhile."""
+    emu.shell('am start -W -a android.settings.SETTINGS')
+    before = emu.metrics()
+    start = time.time()
+    while time.time() - start < opts.ui_seconds:
+        emu.shell('input swipe 200 800 200 200 300; '
+                  'input swipe 200 200 200 800 300')
+    elapsed = time.time() - start
+    after = emu.metrics()
+    emu.shell('input keyevent KEYCODE_HOME')
+
+    def rate(name, **labels):
+        return (metric_sum(after, name, **labels) -
+                metric_sum(before, name, **labels)) / elapsed
+
+    pipes = {}
+    for (name, labels), value in after.items():
+        if name != 'qemu_android_pipe_sent_bytes_total':
+            continue
+        service = dict(labels)['service']
+        pipes[service] = {
+            'sent_bytes_per_second': rate(name, service=service),
+            'received_bytes_per_second':
+                rate('qemu_android_pipe_received_bytes_total',
+                     service=service),
+        }
+    return {'seconds': elapsed,
+            'frames_per_second': rate('qemu_gpu_frames_consumed_total'),
+            'dropped_frames_per_second': rate('qemu_gpu_frames_dropped_total'),
+            'pipes': pipes}
+
+
+def bench_adb_push(emu, opts, workdir):
+    path = os.path.join(workdir, 'push.bin')
+    with open(path, 'wb') as f:
+        for _ in range(opts.megabytes):
+            f.write(os.urandom(1024 * 1024))
+    remote = REMOTE_DIR + '/avd-bench-push.bin'
+    start = time.time()
+    emu.adb('push', path, remote)
+    elapsed = time.time() - start
+    emu.shell('rm -f %s' % remote)
+    os.unlink(path)
+    return {'megabytes': opts.megabytes,
+            'megabytes_per_second': opts.megabytes / elapsed}
+
+
+def bench_disk(emu, opts):
+    remote = REMOTE_DIR + '/avd-bench-disk.bin'
+    start = time.time()
+    emu.shell('dd if=/dev/zero of=%s bs=1048576 count=%d conv=fsync '
+              '2>/dev/null' % (remote, opts.megabytes))
+    write = time.time() - start
+    # Reading back from the page cache would say nothing of the disk
+    emu.shell('sync; echo 3 > /proc/sys/vm/drop_caches 2>/dev/null')
+    start = time.time()
+    emu.shell('dd if=%s of=/dev/null bs=1048576 2>/dev/null' % remote)
+    read = time.time() - start
+    emu.shell('rm -f %s' % remote)
+    return {'megabytes': opts.megabytes,
+            'write_megabytes_per_second': opts.megabytes / write,
+            'read_megabytes_per_second': opts.megabytes / read}
+
+
+def bench_network(emu, opts):
+    net_opts = optparse.Values({'listen': '127.0.0.1', 'addr': '10.0.2.2',
+                                'port': free_port(),
+                                'megabytes': opts.megabytes,
+                                'pings': 200})
+    result = {}
+    for name, upload in (('guest_to_host', True), ('host_to_guest', False)):
+        total, elapsed = net_bench.run(emu.adb_cmd, net_opts, upload)
+        result[name + '_mbit_per_second'] = total * 8 / elapsed / 1e6
+    times = net_bench.run_ping(emu.adb_cmd, net_opts)
+    if times:
+        result['round_trip_median_us'] = times[len(times) // 2] * 1e6
+    return result
+
+
+def save_snapshot(emu):
+    # savevm only prints something when it fails
+    out = emu.hmp('savevm ' + SNAPSHOT).strip()
+    if out:
+        raise BenchError('savevm: ' + out)
+    return True
+
+
+def run_phase(results, name, func, *args):
+    sys.stderr.write('avd-bench: %s\n' % name)
+    try:
+        results[name] = func(*args)
+    except Exception as e:
+        results[name] = {'error': str(e)}
+    return results[name]
+
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options] [-- emulator args]')
+    parser.add_option('-e', '--emulator', default='emulator',
+                      help='emulator launcher (default: %default)')
+    parser.add_option('-a', '--avd', help='reference AVD to boot')
+    parser.add_option('-o', '--output', help='JSON output, default stdout')
+    parser.add_option('--adb', default='adb',
+                      help='adb binary (default: %default)')
+    parser.add_option('-p', '--port', type='int', default=5580,
+                      help='console port of the emulator (default: %default)')
+    parser.add_option('-m', '--megabytes', type='int', default=64,
+                      help='data for the adb, disk and network phases '
+                           '(default: %default)')
+    parser.add_option('--boot-timeout', type='int', default=600,
+                      help='seconds to wait for a boot (default: %default)')
+    parser.add_option('--settle', type='int', default=30,
+                      help='seconds to wait after the boot before measuring '
+                           'the idle CPU (default: %default)')
+    parser.add_option('--idle-seconds', type='int', default=30,
+                      help='seconds of idle CPU measurement '
+                           '(default: %default)')
+    parser.add_option('--ui-seconds', type='int', default=20,
+                      help='seconds of scrolling (default: %default)')
+    opts, args = parser.parse_args()
+    if not opts.avd:
+        parser.error('an AVD is needed, see --avd')
+    opts.emulator_args = args
+
+    workdir = tempfile.mkdtemp(prefix='avd-bench-')
+    results = {}
+    saved = False
+    report = {
+        'version': 1,
+        'date': time.strftime('%Y-%m-%dT%H:%M:%SZ', time.gmtime()),
+        'avd': opts.avd,
+        'emulator': opts.emulator,
+        'emulator_args': args,
+        'host': {'system': platform.system(), 'release': platform.release(),
+                 'machine': platform.machine(),
+                 'cpus': os.sysconf('SC_NPROCESSORS_ONLN')},
+        'results': results,
+    }
+
+    try:
+        emu = Emulator(opts, workdir, [])
+        try:
+            boot = run_phase(results, 'cold_boot',
+                             lambda: {'seconds': emu.wait_boot()})
+            if 'error' not in boot:
+                run_phase(results, 'idle_cpu', bench_idle_cpu, emu, opts)
+                run_phase(results, 'ui', bench_ui, emu, opts)
+                run_phase(results, 'adb_push', bench_adb_push, emu, opts,
+                          workdir)
+                run_phase(results, 'disk', bench_disk, emu, opts)
+                run_phase(results, 'network', bench_network, emu, opts)
+                saved = run_phase(results, 'snapshot_boot', save_snapshot,
+                                  emu) is True
+        finally:
+            emu.quit()
+
+        if saved:
+            emu = Emulator(opts, workdir, ['-loadvm', SNAPSHOT])
+            try:
+                run_phase(results, 'snapshot_boot',
+                          lambda: {'seconds': emu.wait_boot()})
+                emu.hmp('delvm ' + SNAPSHOT)
+            finally:
+                emu.quit()
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    out = open(opts.output, 'w') if opts.output else sys.stdout
+    json.dump(report, out, indent=2, sort_keys=True)
+    out.write('\n')
+    if opts.output:
+        out.close()
+    return 1 if [r for r in results.values() if 'error' in r] else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,163 @@
+#!/usr/bin/env python
+#
+# Measure TCP throughput and latency of the guest network
+#
+# Copyright 2016 The Android Open Source Project
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+# Needs a booted emulator reachable through adb, whose image has a
+# netcat (toybox nc). The guest connects to a server run here:
+#
+#   guest->host: the guest writes zeroes to the host, which discards them
+#   host->guest: the host writes zeroes to the guest, which discards them
+#   round trip:  the guest echoes back single bytes the host sends it
+#
+# With the default user mode network the guest reaches the host at
+# 10.0.2.2, so all the traffic goes through slirp. Compare runs with and
+# without -net user,tcp-large-window=on.
+#
+# For a tap backend (ANDROID_NET_TAP=<ifname>), pass the host's address
+# on the bridge with -a, and listen on it with -l. Compare runs with
+# vhost-net and without, and with different numbers of vCPUs, which
+# gives as many queue pairs.
+
+import optparse
+import socket
+import subprocess
+import sys
+import threading
+import time
+
+CHUNK = 64 * 1024
+FIFO = '/data/local/tmp/net-bench.fifo'
+
+
+def serve_once(listener, send_bytes, result):
+    conn, _ = listener.accept()
+    start = time.time()
+    total = 0
+    if send_bytes:
+        buf = b'\0' * CHUNK
+        while total < send_bytes:
+            conn.sendall(buf)
+            total += len(buf)
+        conn.shutdown(socket.SHUT_WR)
+        # Wait for the guest to drain and close its end.
+        while conn.recv(CHUNK):
+            pass
+    else:
+        while True:
+            data = conn.recv(CHUNK)
+            if not data:
+                break
+            total += len(data)
+    result.append((total, time.time() - start))
+    conn.close()
+
+
+def ping_once(listener, count, result):
+    conn, _ = listener.accept()
+    conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    times = []
+    for _ in range(count):
+        start = time.time()
+        conn.sendall(b'x')
+        if not conn.recv(1):
+            break
+        times.append(time.time() - start)
+    result.append(times)
+    conn.close()
+
+
+def listen(addr, port):
+    listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind((addr, port))
+    listener.listen(1)
+    return listener
+
+
+def run(adb, opts, upload):
+    listener = listen(opts.listen, opts.port)
+    result = []
+    server = threading.Thread(target=serve_once,
+                              args=(listener, 0 if upload else
+                                    opts.megabytes * 1024 * 1024, result))
+    server.start()
+
+    if upload:
+        cmd = 'dd if=/dev/zero bs=%d count=%d 2>/dev/null | nc %s %d' % (
+            CHUNK, opts.megabytes * 1024 * 1024 // CHUNK, opts.addr,
+            opts.port)
+    else:
+        cmd = 'nc %s %d > /dev/null' % (opts.addr, opts.port)
+    subprocess.check_call(adb + ['shell', cmd])
+
+    server.join()
+    listener.close()
+    total, elapsed = result[0]
+    return total, elapsed
+
+
+def run_ping(adb, opts):
+    listener = listen(opts.listen, opts.port)
+    result = []
+    server = threading.Thread(target=ping_once,
+                              args=(listener, opts.pings, result))
+    server.start()
+
+    # Whatever nc reads from the socket goes back out through the fifo.
+    cmd = ('rm -f %s; mkfifo %s && cat %s | nc %s %d > %s; rm -f %s' %
+           (FIFO, FIFO, FIFO, opts.addr, opts.port, FIFO, FIFO))
+    guest = subprocess.Popen(adb + ['shell', cmd])
+
+    server.join()
+    listener.close()
+    guest.wait()
+    return sorted(result[0])
+
+
+def main():
+    parser = optparse.OptionParser()
+    parser.add_option('-s', '--serial', help='adb serial of the emulator')
+    parser.add_option('-a', '--addr', default='10.0.2.2',
+                      help='host address as seen from the guest '
+                           '(default: %default)')
+    parser.add_option('-l', '--listen', default='127.0.0.1',
+                      help='local address to listen on (default: %default)')
+    parser.add_option('-p', '--port', type='int', default=5999,
+                      help='host port to listen on (default: %default)')
+    parser.add_option('-m', '--megabytes', type='int', default=256,
+                      help='amount of data per direction (default: %default)')
+    parser.add_option('-n', '--runs', type='int', default=3,
+                      help='runs per direction (default: %default)')
+    parser.add_option('-c', '--pings', type='int', default=1000,
+                      help='round trips to time (default: %default)')
+    opts, _ = parser.parse_args()
+
+    adb = ['adb']
+    if opts.serial:
+        adb += ['-s', opts.serial]
+
+    for name, upload in (('guest->host', True), ('host->guest', False)):
+        rates = []
+        for _ in range(opts.runs):
+            total, elapsed = run(adb, opts, upload)
+            rates.append(total * 8 / elapsed / 1e6)
+        sys.stdout.write('%-12s %8.1f Mbit/s (best of %d, %s)\n' % (
+            name, max(rates), opts.runs,
+            ' '.join('%.1f' % r for r in rates)))
+
+    times = run_ping(adb, opts)
+    if times:
+        sys.stdout.write('%-12s %8.1f us median, %.1f us 99th percentile '
+                         '(%d round trips)\n' % (
+                             'round trip', times[len(times) // 2] * 1e6,
+                             times[len(times) * 99 // 100] * 1e6,
+                             len(times)))
+
+
+if __name__ == '__main__':
+    main()
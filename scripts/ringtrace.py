@@ -0,0 +1,140 @@
+#!/usr/bin/env python
+#
+# Pretty-printer for ring trace backend files
+#
+# Copyright 2016 The Android Open Source Project
+#
+# This work is licensed under the terms of the GNU GPL, version 2.  See
+# the COPYING file in the top-level directory.
+#
+# For help see docs/tracing.txt
+#
+# The file is the live mapping QEMU writes its rings to, so it can be read
+# while QEMU runs, or copied away after a failure and read later.  Records
+# of all threads are merged in timestamp order.
+
+import mmap
+import struct
+import sys
+from tracetool import _read_events
+from tracetool.backend.simple import is_string
+
+ring_magic = 0x676e6972756d6571
+ring_version = 1
+truncated_flag = 1 << 31
+
+file_header_fmt = '=QIIIIIIqq'
+ring_header_fmt = '=iIQQqq'
+rec_header_fmt = '=QII'
+
+
+class RingFile(object):
+    """The rings of a trace file, read through a shared mapping"""
+
+    def __init__(self, fobj):
+        self.map = mmap.mmap(fobj.fileno(), 0, access=mmap.ACCESS_READ)
+        (magic, version, self.header_size, self.ring_count,
+         self.ring_records, self.record_size, self.pid,
+         self.start_ns, self.start_ticks) = struct.unpack_from(
+             file_header_fmt, self.map, 0)
+        if magic != ring_magic:
+            raise ValueError('Not a valid ring trace file!')
+        if version != ring_version:
+            raise ValueError('Ring trace format %d not supported!' % version)
+        self.ring_size = (self.ring_records + 1) * self.record_size
+
+    def ring_header(self, idx):
+        return struct.unpack_from(ring_header_fmt, self.map,
+                                  self.header_size + idx * self.ring_size)
+
+    def rings(self):
+        """Yield (tid, sync_ns, sync_ticks, records) for each used ring,
+        where records is a list of (ticks, event, args) tuples."""
+        for idx in range(self.ring_count):
+            offset = self.header_size + idx * self.ring_size
+            tid, _, head, _, sync_ns, sync_ticks = self.ring_header(idx)
+            if head == 0:
+                continue
+            data = self.map[offset:offset + self.ring_size]
+            # Records older than this may have been overwritten meanwhile
+            head_after = self.ring_header(idx)[2]
+            first = max(0, head_after - self.ring_records + 1)
+            records = []
+            for seq in range(first, head):
+                pos = (1 + seq % self.ring_records) * self.record_size
+                ticks, event, length = struct.unpack_from(rec_header_fmt,
+                                                          data, pos)
+                hlen = struct.calcsize(rec_header_fmt)
+                args = data[pos + hlen:pos + hlen + length]
+                records.append((ticks, event, args))
+            yield tid, sync_ns, sync_ticks, records
+
+
+def decode_args(event, args):
+    """Return the formatted arguments of a record, as far as they go"""
+    fields = []
+    pos = 0
+    for type, name in event.args:
+        if is_string(type):
+            if pos + 4 > len(args):
+                break
+            (slen,) = struct.unpack_from('=L', args, pos)
+            fields.append('%s=%s' % (name, args[pos + 4:pos + 4 + slen]))
+            pos += 4 + slen
+        else:
+            if pos + 8 > len(args):
+                break
+            (value,) = struct.unpack_from('=Q', args, pos)
+            fields.append('%s=0x%x' % (name, value))
+            pos += 8
+    return fields
+
+
+def process(events, fobj, out):
+    edict = dict(enumerate(events))
+    rf = RingFile(fobj)
+
+    merged = []
+    sync_ns, sync_ticks = rf.start_ns, rf.start_ticks
+    for tid, ns, ticks, records in rf.rings():
+        if ticks > sync_ticks:
+            sync_ns, sync_ticks = ns, ticks
+        merged.extend((rec[0], tid, rec[1], rec[2]) for rec in records)
+    merged.sort()
+
+    if sync_ticks > rf.start_ticks:
+        ns_per_tick = float(sync_ns - rf.start_ns) / (sync_ticks -
+                                                      rf.start_ticks)
+    else:
+        ns_per_tick = None
+
+    last_ticks = None
+    for ticks, tid, event_id, args in merged:
+        if last_ticks is None:
+            last_ticks = ticks
+        delta = ticks - last_ticks
+        last_ticks = ticks
+        if ns_per_tick is None:
+            delta = '%d' % delta
+        else:
+            delta = '%0.3f' % (delta * ns_per_tick / 1000.0)
+
+        event = edict.get(event_id & ~truncated_flag)
+        if event is None:
+            out.write('unknown_event_%d %s tid=%d\n' % (event_id, delta, tid))
+            continue
+        fields = [event.name, delta, 'tid=%d' % tid] + \
+            decode_args(event, args)
+        if event_id & truncated_flag:
+            fields.append('...')
+        out.write(' '.join(fields) + '\n')
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        sys.stderr.write('usage: %s <trace-events> <trace-file.ring>\n' %
+                         sys.argv[0])
+        sys.exit(1)
+
+    events = _read_events(open(sys.argv[1], 'r'))
+    process(events, open(sys.argv[2], 'rb'), sys.stdout)
@@ -0,0 +1,74 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+"""
+Per-thread ring buffer built-in backend.
+"""
+
+__copyright__  = "Copyright 2016 The Android Open Source Project"
+__license__    = "GPL version 2 or (at your option) any later version"
+
+
+from tracetool import out
+from tracetool.backend.simple import is_string
+
+
+PUBLIC = True
+
+
+def generate_h_begin(events):
+    for event in events:
+        out('void _ring_%(api)s(%(args)s);',
+            api=event.api(),
+            args=event.args)
+    out('')
+
+
+def generate_h(event):
+    out('    _ring_%(api)s(%(args)s);',
+        api=event.api(),
+        args=", ".join(event.args.names()))
+
+
+def generate_c_begin(events):
+    out('#include "trace.h"',
+        '#include "trace/control.h"',
+        '#include "trace/ring.h"',
+        '')
+
+
+def generate_c(event):
+    out('void _ring_%(api)s(%(args)s)',
+        '{',
+        '    TraceRingRecord *rec;',
+        '',
+        '    if (!trace_event_get_state(%(event_id)s)) {',
+        '        return;',
+        '    }',
+        '',
+        '    rec = trace_ring_record_start(%(event_id)s);',
+        '    if (!rec) {',
+        '        return;',
+        '    }',
+        api=event.api(),
+        args=event.args,
+        event_id='TRACE_' + event.name.upper())
+
+    for type_, name in event.args:
+        # string
+        if is_string(type_):
+            out('    trace_ring_record_write_str(rec, %(name)s ? %(name)s : "",',
+                '                                %(name)s ? strlen(%(name)s) : 0);',
+                name=name)
+        # pointer var (not string)
+        elif type_.endswith('*'):
+            out('    trace_ring_record_write_u64(rec, (uintptr_t)(uint64_t *)%(name)s);',
+                name=name)
+        # primitive data type
+        else:
+            out('    trace_ring_record_write_u64(rec, (uint64_t)%(name)s);',
+                name=name)
+
+    out('    trace_ring_record_finish(rec);',
+        '}',
+        '')
@@ -0,0 +1,354 @@
+/*
+ * Caching DNS responder for the slirp virtual name servers
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Queries the guest sends to a virtual name server are looked up by
+ * question (name, type and class) before being forwarded to the host
+ * resolver. Responses coming back from the host are remembered for as
+ * long as their records' TTLs allow, and later queries for the same
+ * question are answered directly, with the ID of the new query and the
+ * TTLs reduced by the time spent in the cache.
+ *
+ * Only plain, untruncated NOERROR and NXDOMAIN responses to single
+ * question queries are cached. Everything else goes to the host as
+ * before.
+ */
+
+#include <glib.h>
+#include "slirp.h"
+#include "monitor/monitor.h"
+#include "qemu/timer.h"
+
+#define DNS_HDR_LEN         12
+#define DNS_MAX_NAME        255
+#define DNS_TYPE_OPT        41
+
+#define DNS_FLAG_QR         0x8000
+#define DNS_FLAG_TC         0x0200
+#define DNS_OPCODE_MASK     0x7800
+#define DNS_RCODE_MASK      0x000f
+#define DNS_RCODE_NXDOMAIN  3
+
+#define DNS_CACHE_MAX_ENTRIES   1024
+#define DNS_CACHE_MAX_LEN       4096    /* largest response cached */
+#define DNS_CACHE_MAX_RRS       64      /* records whose TTL we rewrite */
+#define DNS_CACHE_MAX_TTL       86400   /* seconds */
+#define DNS_CACHE_MAX_NEG_TTL   300     /* seconds, for NXDOMAIN/NODATA */
+
+typedef struct DnsCacheEntry {
+    char *key;
+    uint8_t *data;
+    int len;
+    int64_t stored_ms;
+    int64_t expires_ms;
+    int n_ttl;
+    uint16_t ttl_offset[DNS_CACHE_MAX_RRS];
+    uint32_t ttl[DNS_CACHE_MAX_RRS];
+    QTAILQ_ENTRY(DnsCacheEntry) lru;
+} DnsCacheEntry;
+
+struct DnsCache {
+    int refcount;
+    bool shared;
+    GHashTable *entries;                         /* key -> DnsCacheEntry */
+    QTAILQ_HEAD(DnsCacheLru, DnsCacheEntry) lru; /* most recently used first */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t expired;
+    uint64_t evicted;
+};
+
+static DnsCache *shared_dns_cache;
+
+static void dns_cache_entry_free(gpointer opaque)
+{
+    DnsCacheEntry *e = opaque;
+
+    g_free(e->key);
+    g_free(e->data);
+    g_free(e);
+}
+
+DnsCache *dns_cache_get(bool shared)
+{
+    DnsCache *cache;
+
+    if (shared && shared_dns_cache) {
+        shared_dns_cache->refcount++;
+        return shared_dns_cache;
+    }
+
+    cache = g_malloc0(sizeof(*cache));
+    cache->refcount = 1;
+    cache->shared = shared;
+    cache->entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                           dns_cache_entry_free);
+    QTAILQ_INIT(&cache->lru);
+    if (shared) {
+        shared_dns_cache = cache;
+    }
+    return cache;
+}
+
+void dns_cache_put(DnsCache *cache)
+{
+    if (--cache->refcount > 0) {
+        return;
+    }
+    if (cache == shared_dns_cache) {
+        shared_dns_cache = NULL;
+    }
+    g_hash_table_destroy(cache->entries);
+    g_free(cache);
+}
+
+static void dns_cache_remove(DnsCache *cache, DnsCacheEntry *e)
+{
+    QTAILQ_REMOVE(&cache->lru, e, lru);
+    g_hash_table_remove(cache->entries, e->key);
+}
+
+/*
+ * Parse the single question of the message @data, returning its cache key
+ * and setting *@end to the offset following it, or NULL if the message
+ * is not one we cache.
+ */
+static char *dns_question_key(const uint8_t *data, int len, int *end)
+{
+    char name[DNS_MAX_NAME + 1];
+    int name_len = 0;
+    int off = DNS_HDR_LEN;
+
+    if (len < DNS_HDR_LEN ||
+        ((data[4] << 8) | data[5]) != 1) {     /* qdcount */
+        return NULL;
+    }
+
+    for (;;) {
+        int label;
+
+        if (off >= len) {
+            return NULL;
+        }
+        label = data[off++];
+        if (label == 0) {
+            break;
+        }
+        /* No compression in questions, nor odd characters in names */
+        if (label > 63 || off + label > len ||
+            name_len + label + 1 > DNS_MAX_NAME) {
+            return NULL;
+        }
+        while (label--) {
+            uint8_t c = data[off++];
+            if (c == 0 || c == '.') {
+                return NULL;
+            }
+            name[name_len++] = g_ascii_tolower(c);
+        }
+        name[name_len++] = '.';
+    }
+    name[name_len] = '\0';
+
+    if (off + 4 > len) {
+        return NULL;
+    }
+    *end = off + 4;
+    return g_strdup_printf("%s/%u/%u", name,
+                           (data[off] << 8) | data[off + 1],
+                           (data[off + 2] << 8) | data[off + 3]);
+}
+
+/* Skip a possibly compressed name, returning the offset after it or -1 */
+static int dns_skip_name(const uint8_t *data, int len, int off)
+{
+    while (off < len) {
+        int label = data[off];
+
+        if (label == 0) {
+            return off + 1;
+        }
+        if ((label & 0xc0) == 0xc0) {
+            return off + 2 <= len ? off + 2 : -1;
+        }
+        if (label > 63) {
+            return -1;
+        }
+        off += label + 1;
+    }
+    return -1;
+}
+
+void dns_cache_store(DnsCache *cache, const uint8_t *data, int len)
+{
+    DnsCacheEntry *e, *old;
+    uint16_t flags;
+    int nrr, i, off;
+    uint32_t min_ttl = DNS_CACHE_MAX_TTL;
+    bool negative;
+    char *key;
+
+    if (len < DNS_HDR_LEN || len > DNS_CACHE_MAX_LEN) {
+        return;
+    }
+    flags = (data[2] << 8) | data[3];
+    if (!(flags & DNS_FLAG_QR) || (flags & (DNS_FLAG_TC | DNS_OPCODE_MASK))) {
+        return;
+    }
+    if ((flags & DNS_RCODE_MASK) != 0 &&
+        (flags & DNS_RCODE_MASK) != DNS_RCODE_NXDOMAIN) {
+        return;
+    }
+    key = dns_question_key(data, len, &off);
+    if (!key) {
+        return;
+    }
+
+    e = g_malloc0(sizeof(*e));
+    e->key = key;
+    negative = (flags & DNS_RCODE_MASK) == DNS_RCODE_NXDOMAIN ||
+               ((data[6] << 8) | data[7]) == 0;   /* ancount */
+    nrr = ((data[6] << 8) | data[7]) + ((data[8] << 8) | data[9]) +
+          ((data[10] << 8) | data[11]);
+    for (i = 0; i < nrr; i++) {
+        uint32_t ttl;
+        int type;
+
+        off = dns_skip_name(data, len, off);
+        if (off < 0 || off + 10 > len) {
+            goto drop;
+        }
+        type = (data[off] << 8) | data[off + 1];
+        ttl = ((uint32_t)data[off + 4] << 24) | (data[off + 5] << 16) |
+              (data[off + 6] << 8) | data[off + 7];
+        /* The TTL field of an EDNS OPT record holds flags */
+        if (type != DNS_TYPE_OPT) {
+            if (e->n_ttl == DNS_CACHE_MAX_RRS) {
+                goto drop;
+            }
+            e->ttl_offset[e->n_ttl] = off + 4;
+            e->ttl[e->n_ttl] = ttl;
+            e->n_ttl++;
+            min_ttl = MIN(min_ttl, ttl);
+        }
+        off += 10 + ((data[off + 8] << 8) | data[off + 9]);
+        if (off > len) {
+            goto drop;
+        }
+    }
+    if (negative) {
+        min_ttl = MIN(min_ttl, DNS_CACHE_MAX_NEG_TTL);
+    }
+    /* Nothing to take a TTL from, or not meant to be cached */
+    if (e->n_ttl == 0 || min_ttl == 0) {
+        goto drop;
+    }
+
+    e->data = g_memdup(data, len);
+    e->len = len;
+    e->stored_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    e->expires_ms = e->stored_ms + (int64_t)min_ttl * 1000;
+
+    old = g_hash_table_lookup(cache->entries, e->key);
+    if (old) {
+        dns_cache_remove(cache, old);
+    } else if (g_hash_table_size(cache->entries) >= DNS_CACHE_MAX_ENTRIES) {
+        dns_cache_remove(cache, QTAILQ_LAST(&cache->lru, DnsCacheLru));
+        cache->evicted++;
+    }
+    g_hash_table_insert(cache->entries, e->key, e);
+    QTAILQ_INSERT_HEAD(&cache->lru, e, lru);
+    return;
+
+drop:
+    dns_cache_entry_free(e);
+}
+
+bool dns_cache_answer(Slirp *slirp, struct ip *ip, struct udphdr *uh)
+{
+    DnsCache *cache = slirp->dns_cache;
+    const uint8_t *query = (const uint8_t *)(uh + 1);
+    int len = ntohs(uh->uh_ulen) - sizeof(struct udphdr);
+    struct sockaddr_in saddr, daddr;
+    DnsCacheEntry *e;
+    struct mbuf *m;
+    int64_t now, elapsed;
+    uint16_t flags;
+    char *key;
+    int end, i;
+
+    if (len < DNS_HDR_LEN) {
+        return false;
+    }
+    flags = (query[2] << 8) | query[3];
+    if ((flags & (DNS_FLAG_QR | DNS_OPCODE_MASK)) ||
+        !(key = dns_question_key(query, len, &end))) {
+        return false;
+    }
+    e = g_hash_table_lookup(cache->entries, key);
+    g_free(key);
+
+    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    if (e && e->expires_ms <= now) {
+        dns_cache_remove(cache, e);
+        cache->expired++;
+        e = NULL;
+    }
+    if (!e) {
+        cache->misses++;
+        return false;
+    }
+
+    m = m_get(slirp);
+    if (!m) {
+        return false;
+    }
+    m_inc(m, IF_MAXLINKHDR + sizeof(struct udpiphdr) + e->len + 1);
+    m->m_data += IF_MAXLINKHDR + sizeof(struct udpiphdr);
+    memcpy(m->m_data, e->data, e->len);
+    m->m_len = e->len;
+
+    /* Answer with the new query's ID and what is left of the TTLs */
+    memcpy(m->m_data, query, 2);
+    elapsed = (now - e->stored_ms) / 1000;
+    for (i = 0; i < e->n_ttl; i++) {
+        uint32_t ttl = e->ttl[i] > elapsed ? e->ttl[i] - elapsed : 0;
+        uint8_t *p = (uint8_t *)m->m_data + e->ttl_offset[i];
+
+        p[0] = ttl >> 24;
+        p[1] = ttl >> 16;
+        p[2] = ttl >> 8;
+        p[3] = ttl;
+    }
+
+    QTAILQ_REMOVE(&cache->lru, e, lru);
+    QTAILQ_INSERT_HEAD(&cache->lru, e, lru);
+    cache->hits++;
+
+    saddr.sin_addr = ip->ip_dst;
+    saddr.sin_port = uh->uh_dport;
+    daddr.sin_addr = ip->ip_src;
+    daddr.sin_port = uh->uh_sport;
+    udp_output2(NULL, m, &saddr, &daddr, IPTOS_LOWDELAY);
+    return true;
+}
+
+void dns_cache_info(DnsCache *cache, Monitor *mon)
+{
+    uint64_t lookups = cache->hits + cache->misses;
+
+    monitor_printf(mon, "  DNS cache%s: %u entries, %" PRIu64 " hits, %"
+                   PRIu64 " misses (%.1f%% hit rate), %" PRIu64 " expired, %"
+                   PRIu64 " evicted\n",
+                   cache->shared ? " (shared)" : "",
+                   g_hash_table_size(cache->entries), cache->hits,
+                   cache->misses,
+                   lookups ? 100.0 * cache->hits / lookups : 0.0,
+                   cache->expired, cache->evicted);
+}
@@ -0,0 +1,29 @@
+/*
+ * Caching DNS responder for the slirp virtual name servers
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef SLIRP_DNSCACHE_H
+#define SLIRP_DNSCACHE_H
+
+typedef struct DnsCache DnsCache;
+
+/* Get a cache private to one instance, or the one shared by all the
+ * instances asking for a shared cache. */
+DnsCache *dns_cache_get(bool shared);
+void dns_cache_put(DnsCache *cache);
+
+/* Answer the query in the UDP datagram @ip/@uh from @slirp's cache.
+ * Returns true if a response was sent to the guest. */
+bool dns_cache_answer(Slirp *slirp, struct ip *ip, struct udphdr *uh);
+
+/* Remember the response @data (the UDP payload) of a name server. */
+void dns_cache_store(DnsCache *cache, const uint8_t *data, int len);
+
+void dns_cache_info(DnsCache *cache, Monitor *mon);
+
+#endif
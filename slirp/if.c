@@ -134,9 +134,14 @@ diddit:
 
 #ifndef FULL_BOLT
 	/*
-	 * This prevents us from malloc()ing too many mbufs
+	 * This prevents us from malloc()ing too many mbufs.
+	 * In large window mode, let a batch build up: whoever produced
+	 * it calls if_start() when done.
 	 */
-	if_start(ifm->slirp);
+	if (!slirp->large_window ||
+	    ++slirp->if_pending >= IF_MAX_PENDING) {
+		if_start(ifm->slirp);
+	}
 #endif
 }
 
@@ -164,6 +169,7 @@ void if_start(Slirp *slirp)
         return;
     }
     slirp->if_start_busy = true;
+    slirp->if_pending = 0;
 
     if (slirp->if_fastq.ifq_next != &slirp->if_fastq) {
         ifm_next = slirp->if_fastq.ifq_next;
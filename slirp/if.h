@@ -17,6 +17,9 @@
 #define IF_MRU 1500
 #define	IF_COMP IF_AUTOCOMP	/* Flags for compression */
 
+/* Packets if_output() lets queue up in large window mode before flushing */
+#define IF_MAX_PENDING 256
+
 /* 2 for alignment, 14 for ethernet, 40 for TCP/IP */
 #define IF_MAXLINKHDR (2 + 14 + 40)
 
@@ -21,6 +21,16 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
                   void *opaque);
 void slirp_cleanup(Slirp *slirp);
 
+/* Use large socket buffers and window scaling for new TCP connections,
+ * and send the segments queued for the guest in one batch per main loop
+ * iteration or guest packet instead of one at a time. */
+void slirp_set_large_window(Slirp *slirp, bool on);
+
+/* Answer repeated queries to the virtual name servers from a cache of the
+ * host's responses, private to this instance or shared with the other
+ * instances asking for a shared one. */
+void slirp_set_dns_cache(Slirp *slirp, bool on, bool shared);
+
 void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout);
 
 void slirp_pollfds_poll(GArray *pollfds, int select_error);
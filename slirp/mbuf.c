@@ -17,73 +17,80 @@
 
 #include <slirp.h>
 
-#define MBUF_THRESH 30
-
 /*
  * Find a nice value for msize
  * XXX if_maxlinkhdr already in mtu
  */
 #define SLIRP_MSIZE (IF_MTU + IF_MAXLINKHDR + offsetof(struct mbuf, m_dat) + 6)
 
+static const int mbuf_ext_sizes[MBUF_EXT_CLASSES] = {
+    4 * 1024, 16 * 1024, 64 * 1024,
+};
+
 void
 m_init(Slirp *slirp)
 {
-    slirp->m_freelist.m_next = slirp->m_freelist.m_prev = &slirp->m_freelist;
+    int i;
+
     slirp->m_usedlist.m_next = slirp->m_usedlist.m_prev = &slirp->m_usedlist;
+    slirp_pool_init(&slirp->mbuf_pool, "mbuf", SLIRP_MSIZE);
+    for (i = 0; i < MBUF_EXT_CLASSES; i++) {
+        slirp_pool_init(&slirp->mbuf_ext_pool[i], "mbuf ext",
+                        mbuf_ext_sizes[i]);
+    }
 }
 
-void m_cleanup(Slirp *slirp)
+/* Release the m_ext buffer of @m to the pool it came from */
+static void
+m_ext_free(struct mbuf *m)
 {
-    struct mbuf *m, *next;
+    int i;
 
-    m = slirp->m_usedlist.m_next;
-    while (m != &slirp->m_usedlist) {
-        next = m->m_next;
-        if (m->m_flags & M_EXT) {
+    for (i = 0; i < MBUF_EXT_CLASSES; i++) {
+        if (m->m_size == mbuf_ext_sizes[i]) {
+            slirp_pool_put(&m->slirp->mbuf_ext_pool[i], m->m_ext);
+            return;
+        }
+    }
+    free(m->m_ext);
+}
+
+void m_cleanup(Slirp *slirp)
+{
+    struct mbuf *m;
+    int i;
+
+    /* Pooled buffers go away with their pools */
+    for (m = slirp->m_usedlist.m_next; m != &slirp->m_usedlist;
+         m = m->m_next) {
+        if ((m->m_flags & M_EXT) && m->m_size > mbuf_ext_sizes[
+                MBUF_EXT_CLASSES - 1]) {
             free(m->m_ext);
         }
-        free(m);
-        m = next;
     }
-    m = slirp->m_freelist.m_next;
-    while (m != &slirp->m_freelist) {
-        next = m->m_next;
-        free(m);
-        m = next;
+    slirp_pool_cleanup(&slirp->mbuf_pool);
+    for (i = 0; i < MBUF_EXT_CLASSES; i++) {
+        slirp_pool_cleanup(&slirp->mbuf_ext_pool[i]);
     }
 }
 
 /*
- * Get an mbuf from the free list, if there are none
- * malloc one
- *
- * Because fragmentation can occur if we alloc new mbufs and
- * free old mbufs, we mark all mbufs above mbuf_thresh as M_DOFREE,
- * which tells m_free to actually free() it
+ * Get an mbuf from the pool
  */
 struct mbuf *
 m_get(Slirp *slirp)
 {
 	register struct mbuf *m;
-	int flags = 0;
 
 	DEBUG_CALL("m_get");
 
-	if (slirp->m_freelist.m_next == &slirp->m_freelist) {
-		m = (struct mbuf *)malloc(SLIRP_MSIZE);
-		if (m == NULL) goto end_error;
-		slirp->mbuf_alloced++;
-		if (slirp->mbuf_alloced > MBUF_THRESH)
-			flags = M_DOFREE;
-		m->slirp = slirp;
-	} else {
-		m = slirp->m_freelist.m_next;
-		remque(m);
-	}
+	m = slirp_pool_get(&slirp->mbuf_pool);
+	if (m == NULL) goto end_error;
+	m->slirp = slirp;
 
 	/* Insert it in the used list */
 	insque(m,&slirp->m_usedlist);
-	m->m_flags = (flags | M_USEDLIST);
+	m->m_flags = M_USEDLIST;
 
 	/* Initialise it */
 	m->m_size = SLIRP_MSIZE - offsetof(struct mbuf, m_dat);
@@ -110,19 +117,16 @@ m_free(struct mbuf *m)
 	if (m->m_flags & M_USEDLIST)
 	   remque(m);
 
-	/* If it's M_EXT, free() it */
+	/* If it's M_EXT, release its data */
 	if (m->m_flags & M_EXT)
-	   free(m->m_ext);
+	   m_ext_free(m);
 
 	/*
-	 * Either free() it or put it on the free list
+	 * Put it back in the pool, unless it already is
 	 */
-	if (m->m_flags & M_DOFREE) {
-		m->slirp->mbuf_alloced--;
-		free(m);
-	} else if ((m->m_flags & M_FREELIST) == 0) {
-		insque(m,&m->slirp->m_freelist);
+	if ((m->m_flags & M_FREELIST) == 0) {
 		m->m_flags = M_FREELIST; /* Clobber other flags */
+		slirp_pool_put(&m->slirp->mbuf_pool, m);
 	}
   } /* if(m) */
 }
@@ -153,25 +157,37 @@ void
 m_inc(struct mbuf *m, int size)
 {
 	int datasize;
+	int i;
+	char *dat;
 
 	/* some compiles throw up on gotos.  This one we can fake. */
         if(m->m_size>size) return;
 
+        /* Round up to a pooled size class when there is one */
+        for (i = 0; i < MBUF_EXT_CLASSES; i++) {
+            if (size <= mbuf_ext_sizes[i]) {
+                size = mbuf_ext_sizes[i];
+                break;
+            }
+        }
+        if (i < MBUF_EXT_CLASSES) {
+            dat = slirp_pool_get(&m->slirp->mbuf_ext_pool[i]);
+        } else {
+            dat = (char *)malloc(size);
+        }
+
         if (m->m_flags & M_EXT) {
 	  datasize = m->m_data - m->m_ext;
-	  m->m_ext = (char *)realloc(m->m_ext,size);
-	  m->m_data = m->m_ext + datasize;
+	  memcpy(dat, m->m_ext, m->m_size);
+	  m_ext_free(m);
         } else {
-	  char *dat;
 	  datasize = m->m_data - m->m_dat;
-	  dat = (char *)malloc(size);
 	  memcpy(dat, m->m_dat, m->m_size);
-
-	  m->m_ext = dat;
-	  m->m_data = m->m_ext + datasize;
-	  m->m_flags |= M_EXT;
         }
 
+        m->m_ext = dat;
+        m->m_data = m->m_ext + datasize;
+        m->m_flags |= M_EXT;
         m->m_size = size;
 
 }
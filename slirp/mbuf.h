@@ -94,11 +94,13 @@ struct mbuf {
 #define ifs_next m_nextpkt
 #define ifq_so m_so
 
+/* Size classes of the pooled m_ext buffers, larger ones are malloced */
+#define MBUF_EXT_CLASSES	3
+
 #define M_EXT			0x01	/* m_ext points to more (malloced) data */
 #define M_FREELIST		0x02	/* mbuf is on free list */
 #define M_USEDLIST		0x04	/* XXX mbuf is on used list (for dtom()) */
-#define M_DOFREE		0x08	/* when m_free is called on the mbuf, free()
-					 * it rather than putting it on the free list */
+#define M_DOFREE		0x08	/* unused since mbufs are pooled */
 
 void m_init(Slirp *);
 void m_cleanup(Slirp *slirp);
@@ -228,6 +228,12 @@ fork_exec(struct socket *so, const char *ex, int do_pty)
 }
 #endif
 
+static void slirp_pool_info(Monitor *mon, const SlirpPool *pool)
+{
+    monitor_printf(mon, "  %-14s %5zu %5d %9d %9d\n", pool->name, pool->size,
+                   pool->in_use, pool->high_water, pool->allocated);
+}
+
 void slirp_connection_info(Slirp *slirp, Monitor *mon)
 {
     const char * const tcpstates[] = {
@@ -250,6 +256,7 @@ void slirp_connection_info(Slirp *slirp, Monitor *mon)
     struct socket *so;
     const char *state;
     char buf[20];
+    int i;
 
     monitor_printf(mon, "  Protocol[State]    FD  Source Address  Port   "
                         "Dest. Address  Port RecvQ SendQ\n");
@@ -315,4 +322,78 @@ void slirp_connection_info(Slirp *slirp, Monitor *mon)
         monitor_printf(mon, "%15s  -    %5d %5d\n", inet_ntoa(dst_addr),
                        so->so_rcv.sb_cc, so->so_snd.sb_cc);
     }
+
+    monitor_printf(mon, "  Pool            Size InUse HighWater Allocated\n");
+    slirp_pool_info(mon, &slirp->mbuf_pool);
+    for (i = 0; i < MBUF_EXT_CLASSES; i++) {
+        slirp_pool_info(mon, &slirp->mbuf_ext_pool[i]);
+    }
+    slirp_pool_info(mon, &slirp->so_pool);
+    slirp_pool_info(mon, &slirp->tcpcb_pool);
+
+    if (slirp->dns_cache) {
+        dns_cache_info(slirp->dns_cache, mon);
+    }
+}
+
+/* Bytes per slab; objects larger than this get a slab of their own */
+#define SLIRP_POOL_SLAB_BYTES (64 * 1024)
+#define SLIRP_POOL_ALIGN 16
+
+void slirp_pool_init(SlirpPool *pool, const char *name, size_t size)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->name = name;
+    pool->size = (MAX(size, sizeof(void *)) + SLIRP_POOL_ALIGN - 1) &
+                 ~(size_t)(SLIRP_POOL_ALIGN - 1);
+    pool->per_slab = MAX(1, SLIRP_POOL_SLAB_BYTES / pool->size);
+}
+
+void slirp_pool_cleanup(SlirpPool *pool)
+{
+    char *slab, *next;
+
+    for (slab = pool->slabs; slab; slab = next) {
+        next = *(char **)(slab + pool->per_slab * pool->size);
+        free(slab);
+    }
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+}
+
+void *slirp_pool_get(SlirpPool *pool)
+{
+    void *obj;
+
+    if (!pool->free_list) {
+        /* The slab link goes after the objects */
+        char *slab = malloc(pool->per_slab * pool->size + sizeof(void *));
+        int i;
+
+        if (!slab) {
+            return NULL;
+        }
+        *(void **)(slab + pool->per_slab * pool->size) = pool->slabs;
+        pool->slabs = slab;
+        for (i = pool->per_slab - 1; i >= 0; i--) {
+            obj = slab + i * pool->size;
+            *(void **)obj = pool->free_list;
+            pool->free_list = obj;
+        }
+        pool->allocated += pool->per_slab;
+    }
+
+    obj = pool->free_list;
+    pool->free_list = *(void **)obj;
+    if (++pool->in_use > pool->high_water) {
+        pool->high_water = pool->in_use;
+    }
+    return obj;
+}
+
+void slirp_pool_put(SlirpPool *pool, void *obj)
+{
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+    pool->in_use--;
 }
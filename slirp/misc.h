@@ -50,4 +50,26 @@ void slirp_remque(void *);
 int add_exec(struct ex_list **, int, char *, struct in_addr, int);
 int fork_exec(struct socket *so, const char *ex, int do_pty);
 
+/*
+ * Fixed size object pool. Objects are carved out of slabs and go back on
+ * the pool's free list when released, so once a pool has grown to its
+ * high water mark, getting and putting objects never calls the allocator.
+ * Slabs are only freed by slirp_pool_cleanup().
+ */
+typedef struct SlirpPool {
+    const char *name;
+    size_t size;            /* object size, rounded for alignment */
+    int per_slab;
+    void *free_list;        /* linked through the first word of objects */
+    void *slabs;            /* linked through the word after their objects */
+    int in_use;
+    int high_water;         /* largest in_use seen */
+    int allocated;          /* objects carved out so far */
+} SlirpPool;
+
+void slirp_pool_init(SlirpPool *pool, const char *name, size_t size);
+void slirp_pool_cleanup(SlirpPool *pool);
+void *slirp_pool_get(SlirpPool *pool);
+void slirp_pool_put(SlirpPool *pool, void *obj);
+
 #endif
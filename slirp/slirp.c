@@ -291,6 +291,8 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
 
     /* Initialise mbufs *after* setting the MTU */
     m_init(slirp);
+    slirp_pool_init(&slirp->so_pool, "socket", sizeof(struct socket));
+    slirp_pool_init(&slirp->tcpcb_pool, "tcpcb", sizeof(struct tcpcb));
 
     slirp->vnetwork_addr = vnetwork;
     slirp->vnetwork_mask = vnetmask;
@@ -310,6 +312,12 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
 
     slirp->opaque = opaque;
 
+#ifdef CONFIG_EPOLL
+    /* Falls back to polling every socket if this fails */
+    slirp->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    slirp->epoll_pollfds_idx = -1;
+#endif
+
 #ifdef USE_ANDROID_EMU
     inet_strtoip(SPECIAL_ADDRESS_IP, &special_addr_ip.s_addr);
 #endif
@@ -330,6 +338,19 @@ void slirp_cleanup(Slirp *slirp)
 
     ip_cleanup(slirp);
     m_cleanup(slirp);
+    slirp_pool_cleanup(&slirp->so_pool);
+    slirp_pool_cleanup(&slirp->tcpcb_pool);
+
+#ifdef CONFIG_EPOLL
+    if (slirp->epoll_fd >= 0) {
+        close(slirp->epoll_fd);
+    }
+    g_free(slirp->epoll_owner);
+#endif
+
+    if (slirp->dns_cache) {
+        dns_cache_put(slirp->dns_cache);
+    }
 
     g_free(slirp->vdnssearch);
     g_free(slirp->tftp_prefix);
@@ -366,6 +387,131 @@ static void slirp_update_timeout(uint32_t *timeout)
     *timeout = t;
 }
 
+#ifdef CONFIG_EPOLL
+/*
+ * epoll readiness mode.
+ *
+ * Instead of adding every host socket to the main loop's pollfds on each
+ * iteration, sockets are kept registered in a per-instance epoll set and
+ * only the epoll descriptor itself is polled. Registrations are only
+ * touched when the events a socket is interested in change, and only
+ * the sockets epoll reports ready are dispatched.
+ *
+ * Registrations are keyed by host fd. epoll_owner[] maps each registered
+ * fd back to its socket, so that a socket freed, or an fd closed and
+ * reused, in the middle of a dispatch batch is never dereferenced.
+ */
+#define SLIRP_EPOLL_MAX_EVENTS 256
+
+static uint32_t slirp_epoll_events(int events)
+{
+    return ((events & G_IO_IN) ? EPOLLIN : 0) |
+           ((events & G_IO_PRI) ? EPOLLPRI : 0) |
+           ((events & G_IO_OUT) ? EPOLLOUT : 0);
+}
+
+static int slirp_epoll_revents(uint32_t events)
+{
+    return ((events & EPOLLIN) ? G_IO_IN : 0) |
+           ((events & EPOLLPRI) ? G_IO_PRI : 0) |
+           ((events & EPOLLOUT) ? G_IO_OUT : 0) |
+           ((events & EPOLLERR) ? G_IO_ERR : 0) |
+           ((events & EPOLLHUP) ? G_IO_HUP : 0);
+}
+
+static struct socket *slirp_epoll_owner(Slirp *slirp, int fd)
+{
+    if (fd < 0 || fd >= slirp->epoll_owner_len) {
+        return NULL;
+    }
+    return slirp->epoll_owner[fd];
+}
+
+void slirp_epoll_forget(struct socket *so)
+{
+    Slirp *slirp = so->slirp;
+
+    if (so->epoll_s < 0) {
+        return;
+    }
+    if (slirp_epoll_owner(slirp, so->epoll_s) == so) {
+        /* Usually the fd is already closed, which did this for us */
+        epoll_ctl(slirp->epoll_fd, EPOLL_CTL_DEL, so->epoll_s, NULL);
+        slirp->epoll_owner[so->epoll_s] = NULL;
+    }
+    so->epoll_s = -1;
+    so->epoll_events = 0;
+}
+
+static void slirp_epoll_update(Slirp *slirp, struct socket *so, int events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (so->s == so->epoll_s && events == so->epoll_events &&
+        slirp_epoll_owner(slirp, so->s) == so) {
+        return;
+    }
+    if (so->s != so->epoll_s || !events) {
+        slirp_epoll_forget(so);
+    }
+    if (!events || so->s < 0) {
+        return;
+    }
+
+    if (so->s >= slirp->epoll_owner_len) {
+        int len = MAX(so->s + 1, slirp->epoll_owner_len * 2);
+        slirp->epoll_owner = g_renew(struct socket *, slirp->epoll_owner, len);
+        memset(slirp->epoll_owner + slirp->epoll_owner_len, 0,
+               (len - slirp->epoll_owner_len) * sizeof(struct socket *));
+        slirp->epoll_owner_len = len;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = slirp_epoll_events(events);
+    ev.data.fd = so->s;
+    op = slirp_epoll_owner(slirp, so->s) == so ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(slirp->epoll_fd, op, so->s, &ev) < 0) {
+        /* The fd was closed and reopened behind our back, or its old
+         * owner never got to see it close */
+        op = (errno == ENOENT) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+        if (epoll_ctl(slirp->epoll_fd, op, so->s, &ev) < 0) {
+            so->epoll_s = -1;
+            so->epoll_events = 0;
+            return;
+        }
+    }
+    slirp->epoll_owner[so->s] = so;
+    so->epoll_s = so->s;
+    so->epoll_events = events;
+}
+#endif /* CONFIG_EPOLL */
+
+/*
+ * Record the events @so needs to be polled for, 0 meaning none.
+ */
+static void slirp_pollfd_add(Slirp *slirp, GArray *pollfds,
+                             struct socket *so, int events)
+{
+    so->pollfds_idx = -1;
+
+#ifdef CONFIG_EPOLL
+    if (slirp->epoll_fd >= 0) {
+        slirp_epoll_update(slirp, so, events);
+        return;
+    }
+#endif
+
+    if (events) {
+        GPollFD pfd = {
+            .fd = so->s,
+            .events = events,
+        };
+        so->pollfds_idx = pollfds->len;
+        g_array_append_val(pollfds, pfd);
+    }
+}
+
 void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
 {
     Slirp *slirp;
@@ -380,6 +526,14 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
      */
 
     QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
+        /*
+         * Output batched from outside the poll and input paths, e.g.
+         * from timers or proxy callbacks
+         */
+        if (slirp->if_pending) {
+            if_start(slirp);
+        }
+
         /*
          * *_slowtimo needs calling if there are IP fragments
          * in the fragment queue, or there are TCP connections active
@@ -393,8 +547,6 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
 
             so_next = so->so_next;
 
-            so->pollfds_idx = -1;
-
             /*
              * See if we need a tcp_fasttimo
              */
@@ -403,65 +555,41 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
                 slirp->time_fasttimo = curtime; /* Flag when want a fasttimo */
             }
 
-            /*
-             * NOFDREF can include still connecting to local-host,
-             * newly socreated() sockets etc. Don't want to select these.
-             */
             if (so->so_state & SS_NOFDREF || so->s == -1) {
-                continue;
-            }
-
-            /*
-             * Set for reading sockets which are accepting
-             */
-            if (so->so_state & SS_FACCEPTCONN) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
-                continue;
-            }
-
-            /*
-             * Set for writing sockets which are connecting
-             */
-            if (so->so_state & SS_ISFCONNECTING) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_OUT | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
-                continue;
-            }
-
-            /*
-             * Set for writing if we are connected, can send more, and
-             * we have something to send
-             */
-            if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
-                events |= G_IO_OUT | G_IO_ERR;
-            }
+                /*
+                 * NOFDREF can include still connecting to local-host,
+                 * newly socreated() sockets etc. Don't want to select these.
+                 */
+            } else if (so->so_state & SS_FACCEPTCONN) {
+                /*
+                 * Set for reading sockets which are accepting
+                 */
+                events = G_IO_IN | G_IO_HUP | G_IO_ERR;
+            } else if (so->so_state & SS_ISFCONNECTING) {
+                /*
+                 * Set for writing sockets which are connecting
+                 */
+                events = G_IO_OUT | G_IO_ERR;
+            } else {
+                /*
+                 * Set for writing if we are connected, can send more, and
+                 * we have something to send
+                 */
+                if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
+                    events |= G_IO_OUT | G_IO_ERR;
+                }
 
-            /*
-             * Set for reading (and urgent data) if we are connected, can
-             * receive more, and we have room for it XXX /2 ?
-             */
-            if (CONN_CANFRCV(so) &&
-                (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2))) {
-                events |= G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_PRI;
+                /*
+                 * Set for reading (and urgent data) if we are connected, can
+                 * receive more, and we have room for it XXX /2 ?
+                 */
+                if (CONN_CANFRCV(so) &&
+                    (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2))) {
+                    events |= G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_PRI;
+                }
             }
 
-            if (events) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = events,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
-            }
+            slirp_pollfd_add(slirp, pollfds, so, events);
         }
 
         /*
@@ -469,9 +597,9 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
          */
         for (so = slirp->udb.so_next; so != &slirp->udb;
                 so = so_next) {
-            so_next = so->so_next;
+            int events = 0;
 
-            so->pollfds_idx = -1;
+            so_next = so->so_next;
 
             /*
              * See if it's timed out
@@ -496,13 +624,10 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
              * (XXX <= 4 ?)
              */
             if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
+                events = G_IO_IN | G_IO_HUP | G_IO_ERR;
             }
+
+            slirp_pollfd_add(slirp, pollfds, so, events);
         }
 
         /*
@@ -510,9 +635,9 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
          */
         for (so = slirp->icmp.so_next; so != &slirp->icmp;
                 so = so_next) {
-            so_next = so->so_next;
+            int events = 0;
 
-            so->pollfds_idx = -1;
+            so_next = so->so_next;
 
             /*
              * See if it's timed out
@@ -527,23 +652,227 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
             }
 
             if (so->so_state & SS_ISFCONNECTED) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
+                events = G_IO_IN | G_IO_HUP | G_IO_ERR;
             }
+
+            slirp_pollfd_add(slirp, pollfds, so, events);
         }
+
+#ifdef CONFIG_EPOLL
+        slirp->epoll_pollfds_idx = -1;
+        if (slirp->epoll_fd >= 0) {
+            GPollFD pfd = {
+                .fd = slirp->epoll_fd,
+                .events = G_IO_IN,
+            };
+            slirp->epoll_pollfds_idx = pollfds->len;
+            g_array_append_val(pollfds, pfd);
+        }
+#endif
     }
     slirp_update_timeout(timeout);
 }
 
+void slirp_set_large_window(Slirp *slirp, bool on)
+{
+    slirp->large_window = on;
+}
+
+void slirp_set_dns_cache(Slirp *slirp, bool on, bool shared)
+{
+    if (slirp->dns_cache) {
+        dns_cache_put(slirp->dns_cache);
+        slirp->dns_cache = NULL;
+    }
+    if (on) {
+        slirp->dns_cache = dns_cache_get(shared);
+    }
+}
+
+static void slirp_tcp_poll(struct socket *so, int revents)
+{
+    int ret;
+
+    if (so->so_state & SS_NOFDREF || so->s == -1) {
+        return;
+    }
+
+    /*
+     * Check for URG data
+     * This will soread as well, so no need to
+     * test for G_IO_IN below if this succeeds
+     */
+    if (revents & G_IO_PRI) {
+        sorecvoob(so);
+    }
+    /*
+     * Check sockets for reading
+     */
+    else if (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) {
+        /*
+         * Check for incoming connections
+         */
+        if (so->so_state & SS_FACCEPTCONN) {
+            tcp_connect(so);
+            return;
+        } /* else */
+        ret = soread(so);
+
+        /* Output it if we read something */
+        if (ret > 0) {
+            tcp_output(sototcpcb(so));
+        }
+    }
+
+    /*
+     * Check sockets for writing
+     */
+    if (!(so->so_state & SS_NOFDREF) &&
+            (revents & (G_IO_OUT | G_IO_ERR))) {
+        /*
+         * Check for non-blocking, still-connecting sockets
+         */
+        if (so->so_state & SS_ISFCONNECTING) {
+            /* Connected */
+            so->so_state &= ~SS_ISFCONNECTING;
+
+            ret = send(so->s, (const void *) &ret, 0, 0);
+            if (ret < 0) {
+                /* XXXXX Must fix, zero bytes is a NOP */
+                if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINPROGRESS || errno == ENOTCONN) {
+                    return;
+                }
+
+                /* else failed */
+                so->so_state &= SS_PERSISTENT_MASK;
+                so->so_state |= SS_NOFDREF;
+            }
+            /* else so->so_state &= ~SS_ISFCONNECTING; */
+
+            /*
+             * Continue tcp_input
+             */
+            tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
+            /* continue; */
+        } else {
+            ret = sowrite(so);
+        }
+        /*
+         * XXXXX If we wrote something (a lot), there
+         * could be a need for a window update.
+         * In the worst case, the remote will send
+         * a window probe to get things going again
+         */
+    }
+
+    /*
+     * Probe a still-connecting, non-blocking socket
+     * to check if it's still alive
+     */
+#ifdef PROBE_CONN
+    if (so->so_state & SS_ISFCONNECTING) {
+        ret = qemu_recv(so->s, &ret, 0, 0);
+
+        if (ret < 0) {
+            /* XXX */
+            if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                errno == EINPROGRESS || errno == ENOTCONN) {
+                return; /* Still connecting, continue */
+            }
+
+            /* else failed */
+            so->so_state &= SS_PERSISTENT_MASK;
+            so->so_state |= SS_NOFDREF;
+
+            /* tcp_input will take care of it */
+        } else {
+            ret = send(so->s, &ret, 0, 0);
+            if (ret < 0) {
+                /* XXX */
+                if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINPROGRESS || errno == ENOTCONN) {
+                    return;
+                }
+                /* else failed */
+                so->so_state &= SS_PERSISTENT_MASK;
+                so->so_state |= SS_NOFDREF;
+            } else {
+                so->so_state &= ~SS_ISFCONNECTING;
+            }
+
+        }
+        tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
+    } /* SS_ISFCONNECTING */
+#endif
+}
+
+/*
+ * Incoming packets are sent straight away, they're not buffered.
+ * Incoming UDP data isn't buffered either.
+ */
+static void slirp_udp_poll(struct socket *so, int revents)
+{
+    if (so->s != -1 &&
+        (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
+        sorecvfrom(so);
+    }
+}
+
+static void slirp_icmp_poll(struct socket *so, int revents)
+{
+    if (so->s != -1 &&
+        (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
+        icmp_receive(so);
+    }
+}
+
+static int slirp_pollfd_revents(GArray *pollfds, struct socket *so)
+{
+    if (so->pollfds_idx == -1) {
+        return 0;
+    }
+    return g_array_index(pollfds, GPollFD, so->pollfds_idx).revents;
+}
+
+#ifdef CONFIG_EPOLL
+static void slirp_epoll_poll(Slirp *slirp, GArray *pollfds)
+{
+    struct epoll_event events[SLIRP_EPOLL_MAX_EVENTS];
+    int i, n;
+
+    if (slirp->epoll_pollfds_idx == -1 ||
+        !(g_array_index(pollfds, GPollFD,
+                        slirp->epoll_pollfds_idx).revents & G_IO_IN)) {
+        return;
+    }
+
+    /* Level triggered, whatever does not fit is reported next time */
+    n = epoll_wait(slirp->epoll_fd, events, SLIRP_EPOLL_MAX_EVENTS, 0);
+    for (i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        struct socket *so = slirp_epoll_owner(slirp, fd);
+        int revents = slirp_epoll_revents(events[i].events);
+
+        /* Freed or moved to another fd by an earlier event */
+        if (!so || so->s != fd) {
+            continue;
+        }
+        if (so->so_type == IPPROTO_ICMP) {
+            slirp_icmp_poll(so, revents);
+        } else if (so->so_tcpcb) {
+            slirp_tcp_poll(so, revents);
+        } else {
+            slirp_udp_poll(so, revents);
+        }
+    }
+}
+#endif
+
 void slirp_pollfds_poll(GArray *pollfds, int select_error)
 {
     Slirp *slirp;
     struct socket *so, *so_next;
-    int ret;
 
     if (QTAILQ_EMPTY(&slirp_instances)) {
         return;
@@ -570,157 +899,29 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
         /*
          * Check sockets
          */
-        if (!select_error) {
+        if (select_error) {
+            /* nothing */
+#ifdef CONFIG_EPOLL
+        } else if (slirp->epoll_fd >= 0) {
+            slirp_epoll_poll(slirp, pollfds);
+#endif
+        } else {
             /*
              * Check TCP sockets
              */
             for (so = slirp->tcb.so_next; so != &slirp->tcb;
                     so = so_next) {
-                int revents;
-
                 so_next = so->so_next;
-
-                revents = 0;
-                if (so->pollfds_idx != -1) {
-                    revents = g_array_index(pollfds, GPollFD,
-                                            so->pollfds_idx).revents;
-                }
-
-                if (so->so_state & SS_NOFDREF || so->s == -1) {
-                    continue;
-                }
-
-                /*
-                 * Check for URG data
-                 * This will soread as well, so no need to
-                 * test for G_IO_IN below if this succeeds
-                 */
-                if (revents & G_IO_PRI) {
-                    sorecvoob(so);
-                }
-                /*
-                 * Check sockets for reading
-                 */
-                else if (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) {
-                    /*
-                     * Check for incoming connections
-                     */
-                    if (so->so_state & SS_FACCEPTCONN) {
-                        tcp_connect(so);
-                        continue;
-                    } /* else */
-                    ret = soread(so);
-
-                    /* Output it if we read something */
-                    if (ret > 0) {
-                        tcp_output(sototcpcb(so));
-                    }
-                }
-
-                /*
-                 * Check sockets for writing
-                 */
-                if (!(so->so_state & SS_NOFDREF) &&
-                        (revents & (G_IO_OUT | G_IO_ERR))) {
-                    /*
-                     * Check for non-blocking, still-connecting sockets
-                     */
-                    if (so->so_state & SS_ISFCONNECTING) {
-                        /* Connected */
-                        so->so_state &= ~SS_ISFCONNECTING;
-
-                        ret = send(so->s, (const void *) &ret, 0, 0);
-                        if (ret < 0) {
-                            /* XXXXX Must fix, zero bytes is a NOP */
-                            if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                                errno == EINPROGRESS || errno == ENOTCONN) {
-                                continue;
-                            }
-
-                            /* else failed */
-                            so->so_state &= SS_PERSISTENT_MASK;
-                            so->so_state |= SS_NOFDREF;
-                        }
-                        /* else so->so_state &= ~SS_ISFCONNECTING; */
-
-                        /*
-                         * Continue tcp_input
-                         */
-                        tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
-                        /* continue; */
-                    } else {
-                        ret = sowrite(so);
-                    }
-                    /*
-                     * XXXXX If we wrote something (a lot), there
-                     * could be a need for a window update.
-                     * In the worst case, the remote will send
-                     * a window probe to get things going again
-                     */
-                }
-
-                /*
-                 * Probe a still-connecting, non-blocking socket
-                 * to check if it's still alive
-                 */
-#ifdef PROBE_CONN
-                if (so->so_state & SS_ISFCONNECTING) {
-                    ret = qemu_recv(so->s, &ret, 0, 0);
-
-                    if (ret < 0) {
-                        /* XXX */
-                        if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                            errno == EINPROGRESS || errno == ENOTCONN) {
-                            continue; /* Still connecting, continue */
-                        }
-
-                        /* else failed */
-                        so->so_state &= SS_PERSISTENT_MASK;
-                        so->so_state |= SS_NOFDREF;
-
-                        /* tcp_input will take care of it */
-                    } else {
-                        ret = send(so->s, &ret, 0, 0);
-                        if (ret < 0) {
-                            /* XXX */
-                            if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                                errno == EINPROGRESS || errno == ENOTCONN) {
-                                continue;
-                            }
-                            /* else failed */
-                            so->so_state &= SS_PERSISTENT_MASK;
-                            so->so_state |= SS_NOFDREF;
-                        } else {
-                            so->so_state &= ~SS_ISFCONNECTING;
-                        }
-
-                    }
-                    tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
-                } /* SS_ISFCONNECTING */
-#endif
+                slirp_tcp_poll(so, slirp_pollfd_revents(pollfds, so));
             }
 
             /*
              * Now UDP sockets.
-             * Incoming packets are sent straight away, they're not buffered.
-             * Incoming UDP data isn't buffered either.
              */
             for (so = slirp->udb.so_next; so != &slirp->udb;
                     so = so_next) {
-                int revents;
-
                 so_next = so->so_next;
-
-                revents = 0;
-                if (so->pollfds_idx != -1) {
-                    revents = g_array_index(pollfds, GPollFD,
-                            so->pollfds_idx).revents;
-                }
-
-                if (so->s != -1 &&
-                    (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
-                    sorecvfrom(so);
-                }
+                slirp_udp_poll(so, slirp_pollfd_revents(pollfds, so));
             }
 
             /*
@@ -728,20 +929,8 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
              */
             for (so = slirp->icmp.so_next; so != &slirp->icmp;
                     so = so_next) {
-                    int revents;
-
-                    so_next = so->so_next;
-
-                    revents = 0;
-                    if (so->pollfds_idx != -1) {
-                        revents = g_array_index(pollfds, GPollFD,
-                                                so->pollfds_idx).revents;
-                    }
-
-                    if (so->s != -1 &&
-                        (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
-                    icmp_receive(so);
-                }
+                so_next = so->so_next;
+                slirp_icmp_poll(so, slirp_pollfd_revents(pollfds, so));
             }
         }
 
@@ -840,6 +1029,11 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
     default:
         break;
     }
+
+    /* Flush whatever the packet made us queue in one go */
+    if (slirp->if_pending) {
+        if_start(slirp);
+    }
 }
 
 /* Output the IP packet to the ethernet device. Returns 0 if the packet must be
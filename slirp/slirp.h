@@ -122,6 +122,10 @@ void free(void *ptr);
 
 #include <sys/stat.h>
 
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
+
 /* Avoid conflicting with the libc insque() and remque(), which
    have different prototypes. */
 #define insque slirp_insque
@@ -157,6 +161,7 @@ void free(void *ptr);
 
 #include "bootp.h"
 #include "tftp.h"
+#include "dnscache.h"
 
 #define ETH_ALEN 6
 #define ETH_HLEN 14
@@ -221,14 +226,26 @@ struct Slirp {
     struct ex_list *exec_list;
 
     /* mbuf states */
-    struct mbuf m_freelist, m_usedlist;
-    int mbuf_alloced;
+    struct mbuf m_usedlist;
+    SlirpPool mbuf_pool;
+    SlirpPool mbuf_ext_pool[MBUF_EXT_CLASSES];  /* m_ext data, see m_inc() */
+
+    /* socket and tcpcb pools */
+    SlirpPool so_pool;
+    SlirpPool tcpcb_pool;
 
     /* if states */
     struct mbuf if_fastq;   /* fast queue (for interactive data) */
     struct mbuf if_batchq;  /* queue for non-interactive data */
     struct mbuf *next_m;    /* pointer to next mbuf to output */
     bool if_start_busy;     /* avoid if_start recursion */
+    int if_pending;         /* packets queued since the last if_start */
+
+    /* Large TCP windows and batched output, see slirp_set_large_window() */
+    bool large_window;
+
+    /* Answers for the virtual name servers, see slirp_set_dns_cache() */
+    DnsCache *dns_cache;
 
     /* ip states */
     struct ipq ipq;         /* ip reass. queue */
@@ -260,6 +277,14 @@ struct Slirp {
 
     ArpTable arp_table;
 
+#ifdef CONFIG_EPOLL
+    /* epoll readiness mode, epoll_fd is -1 when polling every socket */
+    int epoll_fd;
+    int epoll_pollfds_idx;
+    struct socket **epoll_owner;    /* socket registered for each fd */
+    int epoll_owner_len;
+#endif
+
     void *opaque;
 };
 
@@ -296,6 +321,11 @@ void if_start(struct ttys *);
 #define SO_OPTIONS DO_KEEPALIVE
 #define TCP_MAXIDLE (TCPTV_KEEPCNT * TCPTV_KEEPINTVL)
 
+/* slirp.c */
+#ifdef CONFIG_EPOLL
+void slirp_epoll_forget(struct socket *so);
+#endif
+
 /* dnssearch.c */
 int translate_dnssearch(Slirp *s, const char ** names);
 
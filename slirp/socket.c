@@ -48,13 +48,15 @@ socreate(Slirp *slirp)
 {
   struct socket *so;
 
-  so = (struct socket *)malloc(sizeof(struct socket));
+  so = slirp_pool_get(&slirp->so_pool);
   if(so) {
     memset(so, 0, sizeof(struct socket));
     so->so_state = SS_NOFDREF;
     so->s = -1;
     so->slirp = slirp;
     so->pollfds_idx = -1;
+    so->epoll_s = -1;
+    so->so_large_window = slirp->large_window;
   }
   return(so);
 }
@@ -85,10 +87,14 @@ sofree(struct socket *so)
   }
   m_free(so->so_m);
 
+#ifdef CONFIG_EPOLL
+  slirp_epoll_forget(so);
+#endif
+
   if(so->so_next && so->so_prev)
     remque(so);  /* crashes if so is not in a queue */
 
-  free(so);
+  slirp_pool_put(&slirp->so_pool, so);
 }
 
 size_t sopreprbuf(struct socket *so, struct iovec *iov, int *np)
@@ -531,6 +537,12 @@ sorecvfrom(struct socket *so)
 		so->so_expire = curtime + SO_EXPIRE;
 	    }
 
+	    if (so->slirp->dns_cache && so->so_fport == htons(53) &&
+	        is_dns_addr(so->slirp, &so->so_faddr)) {
+	      dns_cache_store(so->slirp->dns_cache,
+	                      (const uint8_t *)m->m_data, m->m_len);
+	    }
+
 	    /*
 	     * If this packet was destined for CTL_ADDR,
 	     * make it look like that's where it came from, done by udp_output
@@ -614,7 +626,7 @@ tcp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 
 	/* Don't tcp_attach... we don't need so_snd nor so_rcv */
 	if ((so->so_tcpcb = tcp_newtcpcb(so)) == NULL) {
-		free(so);
+		slirp_pool_put(&slirp->so_pool, so);
 		return NULL;
 	}
 	insque(so, &slirp->tcb);
@@ -21,6 +21,8 @@ struct socket {
   int s;                           /* The actual socket */
 
   int pollfds_idx;                 /* GPollFD GArray index */
+  int epoll_s;                     /* fd registered with slirp->epoll_fd */
+  int epoll_events;                /* GPollFD events it is registered for */
 
   Slirp *slirp;			   /* managing slirp instance */
 
@@ -40,6 +42,7 @@ struct socket {
   uint8_t	so_emu;		/* Is the socket emulated? */
 
   u_char	so_type;		/* Type of socket, UDP or TCP */
+  bool	so_large_window;	/* Large TCP buffers and window scaling */
   int	so_state;		/* internal state flags SS_*, below */
 
   struct 	tcpcb *so_tcpcb;	/* pointer to TCP protocol control block */
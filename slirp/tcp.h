@@ -41,6 +41,10 @@ typedef	uint32_t tcp_seq;
 #define TCP_SNDSPACE 8192
 #define TCP_RCVSPACE 8192
 
+/* Socket buffer sizes when the large window mode is on */
+#define TCP_LARGE_SNDSPACE (256 * 1024)
+#define TCP_LARGE_RCVSPACE (256 * 1024)
+
 /*
  * TCP header.
  * Per RFC 793, September, 1981.
@@ -367,12 +367,18 @@ findso:
 	  if ((so = socreate(slirp)) == NULL)
 	    goto dropwithreset;
 	  if (tcp_attach(so) < 0) {
-	    free(so); /* Not sofree (if it failed, it's not insqued) */
+	    /* Not sofree (if it failed, it's not insqued) */
+	    slirp_pool_put(&slirp->so_pool, so);
 	    goto dropwithreset;
 	  }
 
-	  sbreserve(&so->so_snd, TCP_SNDSPACE);
-	  sbreserve(&so->so_rcv, TCP_RCVSPACE);
+	  if (so->so_large_window) {
+	    sbreserve(&so->so_snd, TCP_LARGE_SNDSPACE);
+	    sbreserve(&so->so_rcv, TCP_LARGE_RCVSPACE);
+	  } else {
+	    sbreserve(&so->so_snd, TCP_SNDSPACE);
+	    sbreserve(&so->so_rcv, TCP_RCVSPACE);
+	  }
 
 	  so->so_laddr = ti->ti_src;
 	  so->so_lport = ti->ti_sport;
@@ -403,6 +409,8 @@ findso:
 		goto drop;
 
 	tiwin = ti->ti_win;
+	if ((tiflags & TH_SYN) == 0)
+		tiwin <<= tp->snd_scale;
 
 	/*
 	 * Segment received on connection.
@@ -695,6 +703,13 @@ findso:
 			soisfconnected(so);
 			tp->t_state = TCPS_ESTABLISHED;
 
+			/* Do window scaling on this connection? */
+			if ((tp->t_flags & (TF_RCVD_SCALE|TF_REQ_SCALE)) ==
+			    (TF_RCVD_SCALE|TF_REQ_SCALE)) {
+				tp->snd_scale = tp->requested_s_scale;
+				tp->rcv_scale = tp->request_r_scale;
+			}
+
 			(void) tcp_reass(tp, (struct tcpiphdr *)0,
 				(struct mbuf *)0);
 			/*
@@ -874,6 +889,12 @@ trimthenstep6:
 		    SEQ_GT(ti->ti_ack, tp->snd_max))
 			goto dropwithreset;
 		tp->t_state = TCPS_ESTABLISHED;
+		/* Do window scaling? */
+		if ((tp->t_flags & (TF_RCVD_SCALE|TF_REQ_SCALE)) ==
+		    (TF_RCVD_SCALE|TF_REQ_SCALE)) {
+			tp->snd_scale = tp->requested_s_scale;
+			tp->rcv_scale = tp->request_r_scale;
+		}
 		/*
 		 * The sent SYN is ack'ed with our sequence number +1
 		 * The first data byte already in the buffer will get
@@ -1329,6 +1350,15 @@ tcp_dooptions(struct tcpcb *tp, u_char *cp, int cnt, struct tcpiphdr *ti)
 			NTOHS(mss);
 			(void) tcp_mss(tp, mss);	/* sets t_maxseg */
 			break;
+
+		case TCPOPT_WINDOW:
+			if (optlen != TCPOLEN_WINDOW)
+				continue;
+			if (!(ti->ti_flags & TH_SYN))
+				continue;
+			tp->t_flags |= TF_RCVD_SCALE;
+			tp->requested_s_scale = min(cp[2], TCP_MAX_WINSHIFT);
+			break;
 		}
 	}
 }
@@ -1469,6 +1499,7 @@ tcp_mss(struct tcpcb *tp, u_int offer)
 {
 	struct socket *so = tp->t_socket;
 	int mss;
+	int sndspace, rcvspace;
 
 	DEBUG_CALL("tcp_mss");
 	DEBUG_ARG("tp = %lx", (long)tp);
@@ -1483,12 +1514,14 @@ tcp_mss(struct tcpcb *tp, u_int offer)
 
 	tp->snd_cwnd = mss;
 
-	sbreserve(&so->so_snd, TCP_SNDSPACE + ((TCP_SNDSPACE % mss) ?
-                                               (mss - (TCP_SNDSPACE % mss)) :
-                                               0));
-	sbreserve(&so->so_rcv, TCP_RCVSPACE + ((TCP_RCVSPACE % mss) ?
-                                               (mss - (TCP_RCVSPACE % mss)) :
-                                               0));
+	sndspace = so->so_large_window ? TCP_LARGE_SNDSPACE : TCP_SNDSPACE;
+	rcvspace = so->so_large_window ? TCP_LARGE_RCVSPACE : TCP_RCVSPACE;
+	sbreserve(&so->so_snd, sndspace + ((sndspace % mss) ?
+                                           (mss - (sndspace % mss)) :
+                                           0));
+	sbreserve(&so->so_rcv, rcvspace + ((rcvspace % mss) ?
+                                           (mss - (rcvspace % mss)) :
+                                           0));
 
 	DEBUG_MISC((dfd, " returning mss = %d\n", mss));
 
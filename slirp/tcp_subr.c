@@ -187,7 +187,7 @@ tcp_newtcpcb(struct socket *so)
 {
 	register struct tcpcb *tp;
 
-	tp = (struct tcpcb *)malloc(sizeof(*tp));
+	tp = slirp_pool_get(&so->slirp->tcpcb_pool);
 	if (tp == NULL)
 		return ((struct tcpcb *)0);
 
@@ -198,6 +198,17 @@ tcp_newtcpcb(struct socket *so)
 	tp->t_flags = TCP_DO_RFC1323 ? (TF_REQ_SCALE|TF_REQ_TSTMP) : 0;
 	tp->t_socket = so;
 
+	/*
+	 * In large window mode, ask for the smallest window scale that
+	 * lets us advertise the whole receive buffer.
+	 */
+	if (so->so_large_window) {
+		tp->t_flags |= TF_REQ_SCALE;
+		while (tp->request_r_scale < TCP_MAX_WINSHIFT &&
+		       (TCP_MAXWIN << tp->request_r_scale) < TCP_LARGE_RCVSPACE)
+			tp->request_r_scale++;
+	}
+
 	/*
 	 * Init srtt to TCPTV_SRTTBASE (0), so we can tell that we have no
 	 * rtt estimate.  Set rttvar so that srtt + 2 * rttvar gives
@@ -263,7 +274,7 @@ tcp_close(struct tcpcb *tp)
 		remque(tcpiphdr2qlink(tcpiphdr_prev(t)));
 		m_free(m);
 	}
-	free(tp);
+	slirp_pool_put(&slirp->tcpcb_pool, tp);
         so->so_tcpcb = NULL;
 	/* clobber input socket cache if we're closing the cached connection */
 	if (so == slirp->tcp_last_so)
@@ -450,8 +461,14 @@ void tcp_connect(struct socket *inso)
             closesocket(accept(inso->s, (struct sockaddr *)&addr, &addrlen));
             return;
         }
+        /*
+         * Forwarded connections come from the host itself, where small
+         * buffers and an unscaled window are the only limit on what goes
+         * through, whatever the option says.
+         */
+        so->so_large_window = true;
         if (tcp_attach(so) < 0) {
-            free(so); /* NOT sofree */
+            slirp_pool_put(&slirp->so_pool, so); /* NOT sofree */
             return;
         }
         so->so_laddr = inso->so_laddr;
@@ -148,6 +148,15 @@ udp_input(register struct mbuf *m, int iphlen)
             goto bad;
         }
 
+        /*
+         *  handle cached DNS answers
+         */
+        if (slirp->dns_cache && ntohs(uh->uh_dport) == 53 &&
+            is_dns_addr(slirp, &ip->ip_dst) &&
+            dns_cache_answer(slirp, ip, uh)) {
+            goto bad;
+        }
+
 	/*
 	 * Locate pcb for datagram.
 	 */
@@ -186,7 +186,9 @@ WORD_TYPE helper_le_ld_name(CPUArchState *env, target_ulong addr, int mmu_idx,
                                  mmu_idx, retaddr, DATA_SIZE);
         }
 #endif
+        tlb_miss_count[READ_ACCESS_TYPE]++;
         if (!VICTIM_TLB_HIT(ADDR_READ)) {
+            tlb_fill_count[READ_ACCESS_TYPE]++;
             tlb_fill(ENV_GET_CPU(env), addr, READ_ACCESS_TYPE,
                      mmu_idx, retaddr);
         }
@@ -274,7 +276,9 @@ WORD_TYPE helper_be_ld_name(CPUArchState *env, target_ulong addr, int mmu_idx,
                                  mmu_idx, retaddr, DATA_SIZE);
         }
 #endif
+        tlb_miss_count[READ_ACCESS_TYPE]++;
         if (!VICTIM_TLB_HIT(ADDR_READ)) {
+            tlb_fill_count[READ_ACCESS_TYPE]++;
             tlb_fill(ENV_GET_CPU(env), addr, READ_ACCESS_TYPE,
                      mmu_idx, retaddr);
         }
@@ -400,7 +404,9 @@ void helper_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
                                  mmu_idx, retaddr, DATA_SIZE);
         }
 #endif
+        tlb_miss_count[MMU_DATA_STORE]++;
         if (!VICTIM_TLB_HIT(addr_write)) {
+            tlb_fill_count[MMU_DATA_STORE]++;
             tlb_fill(ENV_GET_CPU(env), addr, MMU_DATA_STORE, mmu_idx, retaddr);
         }
         tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
@@ -481,7 +487,9 @@ void helper_be_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
                                  mmu_idx, retaddr, DATA_SIZE);
         }
 #endif
+        tlb_miss_count[MMU_DATA_STORE]++;
         if (!VICTIM_TLB_HIT(addr_write)) {
+            tlb_fill_count[MMU_DATA_STORE]++;
             tlb_fill(ENV_GET_CPU(env), addr, MMU_DATA_STORE, mmu_idx, retaddr);
         }
         tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
@@ -0,0 +1,34 @@
+#include "qemu-common.h"
+#include "qapi/qmp/qerror.h"
+#include "qmp-commands.h"
+
+AndroidConsoleResultList *qmp_android_console_batch(strList *commands,
+                                                    Error **errp)
+{
+    error_set(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+void qmp_android_fast_reset(bool has_snapshot, const char *snapshot,
+                            bool has_wipe, strList *wipe, Error **errp)
+{
+    error_set(errp, QERR_UNSUPPORTED);
+}
+
+void qmp_geo_route_start(const char *file, bool has_speed, double speed,
+                         bool has_interval, int64_t interval,
+                         bool has_loop, bool loop, Error **errp)
+{
+    error_set(errp, QERR_UNSUPPORTED);
+}
+
+void qmp_geo_route_stop(Error **errp)
+{
+    error_set(errp, QERR_UNSUPPORTED);
+}
+
+GeoRouteInfo *qmp_query_geo_route(Error **errp)
+{
+    error_set(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
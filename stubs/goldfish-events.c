@@ -0,0 +1,8 @@
+#include "qemu-common.h"
+#include "qapi/qmp/qerror.h"
+#include "qmp-commands.h"
+
+void qmp_goldfish_event_script(GoldfishEventList *events, Error **errp)
+{
+    error_set(errp, QERR_UNSUPPORTED);
+}
@@ -0,0 +1,9 @@
+#include "qemu-common.h"
+#include "qapi/qmp/qerror.h"
+#include "qmp-commands.h"
+
+GoldfishInterruptInfoList *qmp_query_goldfish_interrupts(Error **errp)
+{
+    error_set(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
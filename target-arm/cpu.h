@@ -1238,6 +1238,8 @@ bool write_cpustate_to_list(ARMCPU *cpu);
  * disable them?
  */
 #define TARGET_PAGE_BITS 10
+/* Linux maps 4k pages though, which TLB flushes by MVA then cover whole */
+#define TARGET_TLB_FLUSH_BITS 12
 #endif
 #endif
 
@@ -22,6 +22,248 @@ union CRYPTO_STATE {
     uint64_t   l[2];
 };
 
+/*
+ * The same operations done by the crypto instructions of the host, if it
+ * has them.  Only these functions are built for the extensions, and they
+ * are used when the host has them.  The state vectors are in the byte
+ * order of the guest registers, which is that of a little-endian host.
+ *
+ * AES-NI has no MixColumns on its own: AESENC after AESDECLAST with zero
+ * round keys cancels everything but it.  SHA-NI adds the round constant
+ * that the ARM instructions expect their input to include, and keeps the
+ * SHA-256 state as ABEF and CDGH rather than ABCD and EFGH.
+ */
+#if defined(CONFIG_AESNI_OPT) && defined(CONFIG_CPUID_H)
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define CRYPTO_AES_HW
+
+static void __attribute__((target("aes")))
+crypto_aese_hw(union CRYPTO_STATE *st, const union CRYPTO_STATE *rk,
+               uint32_t decrypt)
+{
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)st->bytes),
+                              _mm_loadu_si128((const __m128i *)rk->bytes));
+
+    if (decrypt) {
+        x = _mm_aesdeclast_si128(x, _mm_setzero_si128());
+    } else {
+        x = _mm_aesenclast_si128(x, _mm_setzero_si128());
+    }
+    _mm_storeu_si128((__m128i *)st->bytes, x);
+}
+
+static void __attribute__((target("aes")))
+crypto_aesmc_hw(union CRYPTO_STATE *st, uint32_t decrypt)
+{
+    __m128i x = _mm_loadu_si128((const __m128i *)st->bytes);
+
+    if (decrypt) {
+        x = _mm_aesimc_si128(x);
+    } else {
+        x = _mm_aesenc_si128(_mm_aesdeclast_si128(x, _mm_setzero_si128()),
+                             _mm_setzero_si128());
+    }
+    _mm_storeu_si128((__m128i *)st->bytes, x);
+}
+
+static bool crypto_aes_hw_usable(void)
+{
+    unsigned a, b, c, d;
+
+    return __get_cpuid(1, &a, &b, &c, &d) && (c & bit_AES);
+}
+#elif defined(CONFIG_ARM_CRYPTO_OPT) && defined(CONFIG_LINUX) && \
+      defined(__aarch64__) && !defined(HOST_WORDS_BIGENDIAN)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+
+#define CRYPTO_AES_HW
+#define CRYPTO_SHA_HW
+
+static void __attribute__((target("+crypto")))
+crypto_aese_hw(union CRYPTO_STATE *st, const union CRYPTO_STATE *rk,
+               uint32_t decrypt)
+{
+    uint8x16_t x = vld1q_u8(st->bytes);
+
+    if (decrypt) {
+        x = vaesdq_u8(x, vld1q_u8(rk->bytes));
+    } else {
+        x = vaeseq_u8(x, vld1q_u8(rk->bytes));
+    }
+    vst1q_u8(st->bytes, x);
+}
+
+static void __attribute__((target("+crypto")))
+crypto_aesmc_hw(union CRYPTO_STATE *st, uint32_t decrypt)
+{
+    uint8x16_t x = vld1q_u8(st->bytes);
+
+    vst1q_u8(st->bytes, decrypt ? vaesimcq_u8(x) : vaesmcq_u8(x));
+}
+
+static bool crypto_aes_hw_usable(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+}
+
+static void __attribute__((target("+crypto")))
+crypto_sha1_hw(union CRYPTO_STATE *d, uint32_t e,
+               const union CRYPTO_STATE *m, uint32_t op)
+{
+    uint32x4_t abcd = vld1q_u32(d->words);
+    uint32x4_t w = vld1q_u32(m->words);
+
+    switch (op) {
+    case 0: /* sha1c */
+        abcd = vsha1cq_u32(abcd, e, w);
+        break;
+    case 1: /* sha1p */
+        abcd = vsha1pq_u32(abcd, e, w);
+        break;
+    default: /* sha1m */
+        abcd = vsha1mq_u32(abcd, e, w);
+        break;
+    }
+    vst1q_u32(d->words, abcd);
+}
+
+/* sha256h if @h2 is 0, with @d holding ABCD and @n EFGH, else sha256h2 */
+static void __attribute__((target("+crypto")))
+crypto_sha256_hw(union CRYPTO_STATE *d, const union CRYPTO_STATE *n,
+                 const union CRYPTO_STATE *m, bool h2)
+{
+    uint32x4_t x = vld1q_u32(d->words);
+    uint32x4_t y = vld1q_u32(n->words);
+    uint32x4_t wk = vld1q_u32(m->words);
+
+    vst1q_u32(d->words, h2 ? vsha256h2q_u32(x, y, wk) :
+                             vsha256hq_u32(x, y, wk));
+}
+
+static bool crypto_sha_hw_usable(void)
+{
+    unsigned long hwcap = getauxval(AT_HWCAP);
+
+    return (hwcap & HWCAP_SHA1) && (hwcap & HWCAP_SHA2);
+}
+#endif
+
+#if defined(CONFIG_SHANI_OPT) && defined(CONFIG_CPUID_H)
+#include <cpuid.h>
+#include <immintrin.h>
+
+#ifndef bit_SHA
+#define bit_SHA (1 << 29)
+#endif
+
+#define CRYPTO_SHA_HW
+
+static void __attribute__((target("sha")))
+crypto_sha1_hw(union CRYPTO_STATE *d, uint32_t e,
+               const union CRYPTO_STATE *m, uint32_t op)
+{
+    static const uint32_t k[3] = { 0x5a827999, 0x6ed9eba1, 0x8f1bbcdc };
+    union CRYPTO_STATE w;
+    __m128i abcd;
+    int i;
+
+    /* Both vectors go from the highest word down */
+    for (i = 0; i < 4; i++) {
+        w.words[3 - i] = m->words[i] - k[op];
+    }
+    w.words[3] += e;
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)d->words),
+                             0x1b);
+    switch (op) {
+    case 0: /* sha1c */
+        abcd = _mm_sha1rnds4_epu32(abcd,
+                   _mm_loadu_si128((const __m128i *)w.words), 0);
+        break;
+    case 1: /* sha1p */
+        abcd = _mm_sha1rnds4_epu32(abcd,
+                   _mm_loadu_si128((const __m128i *)w.words), 1);
+        break;
+    default: /* sha1m */
+        abcd = _mm_sha1rnds4_epu32(abcd,
+                   _mm_loadu_si128((const __m128i *)w.words), 2);
+        break;
+    }
+    _mm_storeu_si128((__m128i *)d->words, _mm_shuffle_epi32(abcd, 0x1b));
+}
+
+/* sha256h if @h2 is 0, with @d holding ABCD and @n EFGH, else sha256h2 */
+static void __attribute__((target("sha")))
+crypto_sha256_hw(union CRYPTO_STATE *d, const union CRYPTO_STATE *n,
+                 const union CRYPTO_STATE *m, bool h2)
+{
+    __m128i abcd = _mm_loadu_si128((const __m128i *)(h2 ? n : d)->words);
+    __m128i efgh = _mm_loadu_si128((const __m128i *)(h2 ? d : n)->words);
+    __m128i wk = _mm_loadu_si128((const __m128i *)m->words);
+    __m128i abef, cdgh;
+
+    abef = _mm_shuffle_epi32(_mm_unpacklo_epi64(efgh, abcd), 0xb1);
+    cdgh = _mm_shuffle_epi32(_mm_unpackhi_epi64(efgh, abcd), 0xb1);
+    /* Two rounds each, the second with the upper two words of @wk */
+    cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk);
+    abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(wk, 0x0e));
+
+    if (h2) {
+        efgh = _mm_shuffle_epi32(_mm_unpacklo_epi64(cdgh, abef), 0x1b);
+        _mm_storeu_si128((__m128i *)d->words, efgh);
+    } else {
+        abcd = _mm_shuffle_epi32(_mm_unpackhi_epi64(cdgh, abef), 0x1b);
+        _mm_storeu_si128((__m128i *)d->words, abcd);
+    }
+}
+
+static bool crypto_sha_hw_usable(void)
+{
+    unsigned a, b, c, d;
+
+    if (__get_cpuid_max(0, 0) < 7) {
+        return false;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b & bit_SHA) != 0;
+}
+#endif
+
+#ifdef CRYPTO_AES_HW
+static bool crypto_aes_hw;
+#else
+#define crypto_aes_hw false
+#endif
+#ifdef CRYPTO_SHA_HW
+static bool crypto_sha_hw;
+#else
+#define crypto_sha_hw false
+#endif
+
+#if defined(CRYPTO_AES_HW) || defined(CRYPTO_SHA_HW)
+static void __attribute__((constructor)) init_crypto_hw(void)
+{
+#ifdef CRYPTO_AES_HW
+    crypto_aes_hw = crypto_aes_hw_usable();
+#endif
+#ifdef CRYPTO_SHA_HW
+    crypto_sha_hw = crypto_sha_hw_usable();
+#endif
+}
+#endif
+
 void HELPER(crypto_aese)(CPUARMState *env, uint32_t rd, uint32_t rm,
                          uint32_t decrypt)
 {
@@ -40,6 +282,15 @@ void HELPER(crypto_aese)(CPUARMState *env, uint32_t rd, uint32_t rm,
 
     assert(decrypt < 2);
 
+#ifdef CRYPTO_AES_HW
+    if (crypto_aes_hw) {
+        crypto_aese_hw(&st, &rk, decrypt);
+        env->vfp.regs[rd] = make_float64(st.l[0]);
+        env->vfp.regs[rd + 1] = make_float64(st.l[1]);
+        return;
+    }
+#endif
+
     /* xor state vector with round key */
     rk.l[0] ^= st.l[0];
     rk.l[1] ^= st.l[1];
@@ -197,6 +448,15 @@ void HELPER(crypto_aesmc)(CPUARMState *env, uint32_t rd, uint32_t rm,
 
     assert(decrypt < 2);
 
+#ifdef CRYPTO_AES_HW
+    if (crypto_aes_hw) {
+        crypto_aesmc_hw(&st, decrypt);
+        env->vfp.regs[rd] = make_float64(st.l[0]);
+        env->vfp.regs[rd + 1] = make_float64(st.l[1]);
+        return;
+    }
+#endif
+
     for (i = 0; i < 16; i += 4) {
         st.words[i >> 2] = cpu_to_le32(
             mc[decrypt][st.bytes[i]] ^
@@ -247,6 +507,10 @@ void HELPER(crypto_sha1_3reg)(CPUARMState *env, uint32_t rd, uint32_t rn,
     if (op == 3) { /* sha1su0 */
         d.l[0] ^= d.l[1] ^ m.l[0];
         d.l[1] ^= n.l[0] ^ m.l[1];
+    } else if (crypto_sha_hw) {
+#ifdef CRYPTO_SHA_HW
+        crypto_sha1_hw(&d, n.words[0], &m, op);
+#endif
     } else {
         int i;
 
@@ -355,6 +619,15 @@ void HELPER(crypto_sha256h)(CPUARMState *env, uint32_t rd, uint32_t rn,
     } };
     int i;
 
+#ifdef CRYPTO_SHA_HW
+    if (crypto_sha_hw) {
+        crypto_sha256_hw(&d, &n, &m, false);
+        env->vfp.regs[rd] = make_float64(d.l[0]);
+        env->vfp.regs[rd + 1] = make_float64(d.l[1]);
+        return;
+    }
+#endif
+
     for (i = 0; i < 4; i++) {
         uint32_t t = cho(n.words[0], n.words[1], n.words[2]) + n.words[3]
                      + S1(n.words[0]) + m.words[i];
@@ -393,6 +666,15 @@ void HELPER(crypto_sha256h2)(CPUARMState *env, uint32_t rd, uint32_t rn,
     } };
     int i;
 
+#ifdef CRYPTO_SHA_HW
+    if (crypto_sha_hw) {
+        crypto_sha256_hw(&d, &n, &m, true);
+        env->vfp.regs[rd] = make_float64(d.l[0]);
+        env->vfp.regs[rd + 1] = make_float64(d.l[1]);
+        return;
+    }
+#endif
+
     for (i = 0; i < 4; i++) {
         uint32_t t = cho(d.words[0], d.words[1], d.words[2]) + d.words[3]
                      + S1(d.words[0]) + m.words[i];
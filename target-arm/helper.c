@@ -330,11 +330,13 @@ static void contextidr_write(CPUARMState *env, const ARMCPRegInfo *ri,
 {
     ARMCPU *cpu = arm_env_get_cpu(env);
 
-    if (raw_read(env, ri) != value && !arm_feature(env, ARM_FEATURE_MPU)
+    if (((raw_read(env, ri) ^ value) & 0xff)
+        && !arm_feature(env, ARM_FEATURE_MPU)
         && !extended_addresses_enabled(env)) {
         /* For VMSA (when not using the LPAE long descriptor page table
-         * format) this register includes the ASID, so do a TLB flush.
-         * For PMSA it is purely a process ID and no action is needed.
+         * format) the low byte of this register is the ASID, so do a TLB
+         * flush when it changes.  The rest, and all of it for PMSA, is
+         * purely a process ID and no action is needed.
          */
         tlb_flush(CPU(cpu), 1);
     }
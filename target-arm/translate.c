@@ -812,7 +812,9 @@ static inline void gen_bx_im(DisasContext *s, uint32_t addr)
 {
     TCGv_i32 tmp;
 
-    s->is_jmp = DISAS_UPDATE;
+    /* The Thumb bit is part of the TB flags, so only the PC changed as
+       far as the next TB lookup is concerned.  */
+    s->is_jmp = DISAS_JUMP;
     if (s->thumb != (addr & 1)) {
         tmp = tcg_temp_new_i32();
         tcg_gen_movi_i32(tmp, addr & 1);
@@ -825,7 +827,7 @@ static inline void gen_bx_im(DisasContext *s, uint32_t addr)
 /* Set PC and Thumb state from var.  var is marked as dead.  */
 static inline void gen_bx(DisasContext *s, TCGv_i32 var)
 {
-    s->is_jmp = DISAS_UPDATE;
+    s->is_jmp = DISAS_JUMP;
     tcg_gen_andi_i32(cpu_R[15], var, ~1);
     tcg_gen_andi_i32(var, var, 1);
     store_cpu_field(var, thumb);
@@ -5053,6 +5055,115 @@ static const uint8_t neon_2rm_sizes[] = {
    We process data in a mixture of 32-bit and 64-bit chunks.
    Mostly we use 32-bit chunks so we can use normal scalar instructions.  */
 
+/* Emit the integer three-reg-same-size operation @op, which A32/T32
+ * NEON and A64 AdvSIMD encode the same way, as a single call to a
+ * whole-vector helper on the @oprsz bytes at env offsets @dofs, @nofs
+ * and @mofs.  Returns false, and emits nothing, for the operations
+ * that still need to be done a lane group at a time.
+ */
+bool gen_neon_3same_vec(int op, int size, int u, int oprsz,
+                        int dofs, int nofs, int mofs)
+{
+    static NeonGenThreeVecFn * const cgt_fns[3][2] = {
+        { gen_helper_vec_cgt_s8, gen_helper_vec_cgt_u8 },
+        { gen_helper_vec_cgt_s16, gen_helper_vec_cgt_u16 },
+        { gen_helper_vec_cgt_s32, gen_helper_vec_cgt_u32 },
+    };
+    static NeonGenThreeVecFn * const cge_fns[3][2] = {
+        { gen_helper_vec_cge_s8, gen_helper_vec_cge_u8 },
+        { gen_helper_vec_cge_s16, gen_helper_vec_cge_u16 },
+        { gen_helper_vec_cge_s32, gen_helper_vec_cge_u32 },
+    };
+    static NeonGenThreeVecFn * const max_fns[3][2] = {
+        { gen_helper_vec_max_s8, gen_helper_vec_max_u8 },
+        { gen_helper_vec_max_s16, gen_helper_vec_max_u16 },
+        { gen_helper_vec_max_s32, gen_helper_vec_max_u32 },
+    };
+    static NeonGenThreeVecFn * const min_fns[3][2] = {
+        { gen_helper_vec_min_s8, gen_helper_vec_min_u8 },
+        { gen_helper_vec_min_s16, gen_helper_vec_min_u16 },
+        { gen_helper_vec_min_s32, gen_helper_vec_min_u32 },
+    };
+    static NeonGenThreeVecFn * const add_sub_fns[4][2] = {
+        { gen_helper_vec_add8, gen_helper_vec_sub8 },
+        { gen_helper_vec_add16, gen_helper_vec_sub16 },
+        { gen_helper_vec_add32, gen_helper_vec_sub32 },
+        { gen_helper_vec_add64, gen_helper_vec_sub64 },
+    };
+    static NeonGenThreeVecFn * const tst_ceq_fns[3][2] = {
+        { gen_helper_vec_tst8, gen_helper_vec_ceq8 },
+        { gen_helper_vec_tst16, gen_helper_vec_ceq16 },
+        { gen_helper_vec_tst32, gen_helper_vec_ceq32 },
+    };
+    static NeonGenThreeVecFn * const mla_mls_fns[3][2] = {
+        { gen_helper_vec_mla8, gen_helper_vec_mls8 },
+        { gen_helper_vec_mla16, gen_helper_vec_mls16 },
+        { gen_helper_vec_mla32, gen_helper_vec_mls32 },
+    };
+    static NeonGenThreeVecFn * const mul_fns[3] = {
+        gen_helper_vec_mul8, gen_helper_vec_mul16, gen_helper_vec_mul32,
+    };
+    NeonGenThreeVecFn *fn = NULL;
+    TCGv_ptr tcg_d, tcg_n, tcg_m;
+    TCGv_i32 tcg_oprsz;
+
+    if (size == 3) {
+        if (op != NEON_3R_VADD_VSUB) {
+            return false;
+        }
+        fn = add_sub_fns[size][u];
+    } else {
+        switch (op) {
+        case NEON_3R_VCGT:
+            fn = cgt_fns[size][u];
+            break;
+        case NEON_3R_VCGE:
+            fn = cge_fns[size][u];
+            break;
+        case NEON_3R_VMAX:
+            fn = max_fns[size][u];
+            break;
+        case NEON_3R_VMIN:
+            fn = min_fns[size][u];
+            break;
+        case NEON_3R_VADD_VSUB:
+            fn = add_sub_fns[size][u];
+            break;
+        case NEON_3R_VTST_VCEQ:
+            fn = tst_ceq_fns[size][u];
+            break;
+        case NEON_3R_VML:
+            fn = mla_mls_fns[size][u];
+            break;
+        case NEON_3R_VMUL:
+            if (!u) {
+                /* not the polynomial VMUL.P8 / PMUL */
+                fn = mul_fns[size];
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    if (!fn) {
+        return false;
+    }
+
+    tcg_d = tcg_temp_new_ptr();
+    tcg_n = tcg_temp_new_ptr();
+    tcg_m = tcg_temp_new_ptr();
+    tcg_gen_addi_ptr(tcg_d, cpu_env, dofs);
+    tcg_gen_addi_ptr(tcg_n, cpu_env, nofs);
+    tcg_gen_addi_ptr(tcg_m, cpu_env, mofs);
+    tcg_oprsz = tcg_const_i32(oprsz);
+    fn(tcg_d, tcg_n, tcg_m, tcg_oprsz);
+    tcg_temp_free_i32(tcg_oprsz);
+    tcg_temp_free_ptr(tcg_m);
+    tcg_temp_free_ptr(tcg_n);
+    tcg_temp_free_ptr(tcg_d);
+    return true;
+}
+
 static int disas_neon_data_insn(DisasContext *s, uint32_t insn)
 {
     int op;
@@ -5278,6 +5389,13 @@ static int disas_neon_data_insn(DisasContext *s, uint32_t insn)
             return 1;
         }
 
+        if (!pairwise &&
+            gen_neon_3same_vec(op, size, u, q ? 16 : 8,
+                               vfp_reg_offset(1, rd), vfp_reg_offset(1, rn),
+                               vfp_reg_offset(1, rm))) {
+            return 0;
+        }
+
         for (pass = 0; pass < (q ? 4 : 2); pass++) {
 
         if (pairwise) {
@@ -11075,7 +11193,7 @@ static inline void gen_intermediate_code_internal(ARMCPU *cpu,
     if (max_insns == 0)
         max_insns = CF_COUNT_MASK;
 
-    gen_tb_start();
+    gen_tb_start(tb);
 
     tcg_clear_temp_count();
 
@@ -11290,8 +11408,11 @@ static inline void gen_intermediate_code_internal(ARMCPU *cpu,
         case DISAS_NEXT:
             gen_goto_tb(dc, 1, dc->pc);
             break;
-        default:
         case DISAS_JUMP:
+            /* only the PC changed, try to chain to the next TB directly */
+            tcg_gen_lookup_and_goto_ptr(cpu_env);
+            break;
+        default:
         case DISAS_UPDATE:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
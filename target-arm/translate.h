@@ -61,6 +61,11 @@ typedef struct DisasContext {
 
 extern TCGv_ptr cpu_env;
 
+typedef void NeonGenThreeVecFn(TCGv_ptr, TCGv_ptr, TCGv_ptr, TCGv_i32);
+
+bool gen_neon_3same_vec(int op, int size, int u, int oprsz,
+                        int dofs, int nofs, int mofs);
+
 static inline int arm_dc_feature(DisasContext *dc, int feature)
 {
     return (dc->features & (1ULL << feature)) != 0;
@@ -86,6 +91,10 @@ static inline int get_mem_index(DisasContext *s)
 #define DISAS_WFE 7
 #define DISAS_HVC 8
 #define DISAS_SMC 9
+/* The PC was set dynamically along with other CPU state (A64 ERET), so
+ * the TB must go back to the main loop rather than chain to the next one.
+ */
+#define DISAS_EXIT 10
 
 #ifdef TARGET_AARCH64
 void a64_translate_init(void);
@@ -0,0 +1,80 @@
+/*
+ * ARM AdvSIMD / NEON whole-register integer operations
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+/*
+ * Each helper does a lane-wise operation on the @oprsz (8 or 16) bytes
+ * of vector register state at @vn and @vm, writing the result to @vd.
+ * They are written with GCC vector extensions, so a single helper call
+ * runs as a few SSE or NEON instructions on the host instead of one
+ * TCG op sequence or per-32-bit helper call per lane group.
+ *
+ * Lanes are never split across the two 64-bit halves of a register, so
+ * this works whatever the order of the halves in memory.
+ */
+
+#include <string.h>
+
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "exec/helper-proto.h"
+
+typedef uint8_t vec_u8 __attribute__((vector_size(16)));
+typedef int8_t vec_s8 __attribute__((vector_size(16)));
+typedef uint16_t vec_u16 __attribute__((vector_size(16)));
+typedef int16_t vec_s16 __attribute__((vector_size(16)));
+typedef uint32_t vec_u32 __attribute__((vector_size(16)));
+typedef int32_t vec_s32 __attribute__((vector_size(16)));
+typedef uint64_t vec_u64 __attribute__((vector_size(16)));
+
+/* Register state is only 8 byte aligned, hence the memcpy */
+#define DO_3OP(NAME, TYPE, EXPR)                                        \
+void HELPER(NAME)(void *vd, void *vn, void *vm, uint32_t oprsz)         \
+{                                                                       \
+    TYPE d, n, m, mask;                                                 \
+                                                                        \
+    memcpy(&d, vd, 16);                                                 \
+    memcpy(&n, vn, 16);                                                 \
+    memcpy(&m, vm, 16);                                                 \
+    (void)mask;                                                         \
+    d = (EXPR);                                                         \
+    memcpy(vd, &d, oprsz);                                              \
+}
+
+#define DO_3OP_ALL(NAME, EXPR)                                          \
+    DO_3OP(vec_##NAME##8, vec_u8, EXPR)                                 \
+    DO_3OP(vec_##NAME##16, vec_u16, EXPR)                               \
+    DO_3OP(vec_##NAME##32, vec_u32, EXPR)
+
+#define DO_3OP_SU(NAME, EXPR)                                           \
+    DO_3OP(vec_##NAME##_s8, vec_s8, EXPR)                               \
+    DO_3OP(vec_##NAME##_u8, vec_u8, EXPR)                               \
+    DO_3OP(vec_##NAME##_s16, vec_s16, EXPR)                             \
+    DO_3OP(vec_##NAME##_u16, vec_u16, EXPR)                             \
+    DO_3OP(vec_##NAME##_s32, vec_s32, EXPR)                             \
+    DO_3OP(vec_##NAME##_u32, vec_u32, EXPR)
+
+DO_3OP_ALL(add, n + m)
+DO_3OP(vec_add64, vec_u64, n + m)
+DO_3OP_ALL(sub, n - m)
+DO_3OP(vec_sub64, vec_u64, n - m)
+DO_3OP_ALL(mul, n * m)
+DO_3OP_ALL(mla, d + n * m)
+DO_3OP_ALL(mls, d - n * m)
+
+/* Comparisons give all ones or all zeros in each lane */
+#define CMP(X) ((typeof(d))(X))
+
+DO_3OP_ALL(tst, CMP((n & m) != 0))
+DO_3OP_ALL(ceq, CMP(n == m))
+DO_3OP_SU(cgt, CMP(n > m))
+DO_3OP_SU(cge, CMP(n >= m))
+DO_3OP_SU(max, (mask = CMP(n > m), (n & mask) | (m & ~mask)))
+DO_3OP_SU(min, (mask = CMP(n < m), (n & mask) | (m & ~mask)))
@@ -30,6 +30,7 @@
 #include "exec/address-spaces.h"
 #include "qemu/main-loop.h"
 #include "hax-slot.h"
+#include "sysemu/vcpu-exits.h"
 
 #ifdef USE_ANDROID_EMU
 #include "android/error-messages.h"
@@ -72,10 +73,13 @@ const uint32_t hax_min_version = 0x3;
 bool hax_allowed;
 
 static void hax_vcpu_sync_state(CPUArchState * env, int modified);
-static int hax_arch_get_registers(CPUArchState * env);
+static int hax_arch_get_registers(CPUArchState * env, unsigned int regs);
+static int hax_arch_set_registers(CPUArchState * env, unsigned int regs);
 static int hax_handle_io(CPUArchState * env, uint32_t df, uint16_t port,
                          int direction, int size, int count, void *buffer);
 static int hax_handle_fastmmio(CPUArchState * env, struct hax_fastmmio *hft);
+static void hax_dirty_log_start(MemoryRegionSection *section);
+static void hax_dirty_log_stop(MemoryRegionSection *section);
 
 struct hax_state hax_global;
 int ret_hax_init = 0;
@@ -327,7 +331,8 @@ int hax_init_vcpu(CPUState * cpu)
 
     cpu->hax_vcpu = hax_global.vm->vcpus[cpu->cpu_index];
     cpu->hax_vcpu->emulation_state = HAX_EMULATE_STATE_INITIAL;
-    cpu->hax_vcpu_dirty = true;
+    cpu->hax_vcpu->regs_valid = HAX_REGS_ALL;
+    cpu->hax_vcpu->regs_dirty = HAX_REGS_ALL;
     qemu_register_reset(hax_reset_vcpu_state, (CPUArchState *) (cpu->env_ptr));
 
     return ret;
@@ -361,7 +366,7 @@ struct hax_vm *hax_vm_create(struct hax_state *hax)
     }
 
     hax->vm = vm;
-    hax_slot_init_registry();
+    hax_slot_init_registry(hax_set_ram);
     return vm;
 
   error:
@@ -425,45 +430,129 @@ static void hax_region_add(MemoryListener * listener,
                            MemoryRegionSection * section)
 {
     hax_set_phys_mem(section);
+    if (memory_region_is_logging(section->mr)) {
+        hax_dirty_log_start(section);
+    }
 }
 
 static void hax_region_del(MemoryListener * listener,
                            MemoryRegionSection * section)
 {
     // Memory mappings will be removed at VM close.
+    hax_dirty_log_stop(section);
+}
+
+/*
+ * The HAX kernel module has no dirty page log: guest writes go straight
+ * to the host pages behind its back. For the sections a device asked to
+ * log (a framebuffer, typically), keep a shadow copy of the section and
+ * find the modified pages by comparing against it on each sync. Sections
+ * without a shadow (all of RAM during migration) are reported entirely
+ * dirty, which is always safe.
+ */
+typedef struct HaxDirtyLog {
+    MemoryRegion *mr;
+    hwaddr offset;          /* within mr */
+    hwaddr size;
+    uint8_t *shadow;
+    QLIST_ENTRY(HaxDirtyLog) link;
+} HaxDirtyLog;
+
+static QLIST_HEAD(, HaxDirtyLog) hax_dirty_logs =
+    QLIST_HEAD_INITIALIZER(hax_dirty_logs);
+
+static HaxDirtyLog *hax_dirty_log_find(MemoryRegionSection *section)
+{
+    HaxDirtyLog *log;
+
+    QLIST_FOREACH(log, &hax_dirty_logs, link) {
+        if (log->mr == section->mr &&
+            log->offset == section->offset_within_region &&
+            log->size == int128_get64(section->size)) {
+            return log;
+        }
+    }
+    return NULL;
+}
+
+static void hax_dirty_log_start(MemoryRegionSection *section)
+{
+    MemoryRegion *mr = section->mr;
+    HaxDirtyLog *log;
+
+    if (!memory_region_is_ram(mr) || hax_dirty_log_find(section)) {
+        return;
+    }
+
+    log = g_new0(HaxDirtyLog, 1);
+    log->mr = mr;
+    log->offset = section->offset_within_region;
+    log->size = int128_get64(section->size);
+    log->shadow = g_malloc(log->size);
+    memcpy(log->shadow, memory_region_get_ram_ptr(mr) + log->offset,
+           log->size);
+    QLIST_INSERT_HEAD(&hax_dirty_logs, log, link);
+
+    /* What was written before the copy was taken is not known */
+    memory_region_set_dirty(mr, log->offset, log->size);
+}
+
+static void hax_dirty_log_stop(MemoryRegionSection *section)
+{
+    HaxDirtyLog *log = hax_dirty_log_find(section);
+
+    if (log) {
+        QLIST_REMOVE(log, link);
+        g_free(log->shadow);
+        g_free(log);
+    }
+}
+
+static void hax_dirty_log_sync(HaxDirtyLog *log)
+{
+    const uint8_t *ram = memory_region_get_ram_ptr(log->mr) + log->offset;
+    hwaddr addr, len, dirty_start = 0, dirty_len = 0;
+
+    for (addr = 0; addr < log->size; addr += len) {
+        len = MIN(TARGET_PAGE_SIZE, log->size - addr);
+        if (memcmp(log->shadow + addr, ram + addr, len)) {
+            memcpy(log->shadow + addr, ram + addr, len);
+            /* Report runs of modified pages with one call */
+            if (dirty_len && dirty_start + dirty_len == addr) {
+                dirty_len += len;
+                continue;
+            }
+            if (dirty_len) {
+                memory_region_set_dirty(log->mr, log->offset + dirty_start,
+                                        dirty_len);
+            }
+            dirty_start = addr;
+            dirty_len = len;
+        }
+    }
+    if (dirty_len) {
+        memory_region_set_dirty(log->mr, log->offset + dirty_start,
+                                dirty_len);
+    }
 }
 
-/* currently we fake the dirty bitmap sync, always dirty */
-/* avoid implicit declaration warning on Windows */
-int ffsl(long value);
 static void hax_log_sync(MemoryListener * listener,
                          MemoryRegionSection * section)
 {
     MemoryRegion *mr = section->mr;
+    HaxDirtyLog *log;
 
     if (!memory_region_is_ram(mr)) {
         /* Skip MMIO regions */
         return;
     }
 
-    unsigned long c;
-    unsigned int len =
-        ((int128_get64(section->size) / TARGET_PAGE_SIZE) + HOST_LONG_BITS -
-         1) / HOST_LONG_BITS;
-    unsigned long bitmap[len];
-    unsigned int i, j;
-
-    for (i = 0; i < len; i++) {
-        bitmap[i] = 1;
-        c = leul_to_cpu(bitmap[i]);
-        do {
-            j = ffsl(c) - 1;
-            c &= ~(1ul << j);
-
-            memory_region_set_dirty(mr, ((uint64_t)i * HOST_LONG_BITS + j) *
-                                    TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
-        }
-        while (c != 0);
+    log = hax_dirty_log_find(section);
+    if (log) {
+        hax_dirty_log_sync(log);
+    } else {
+        memory_region_set_dirty(mr, section->offset_within_region,
+                                int128_get64(section->size));
     }
 }
 
@@ -478,19 +567,23 @@ static void hax_log_global_stop(struct MemoryListener *listener)
 static void hax_log_start(MemoryListener * listener,
                           MemoryRegionSection * section)
 {
+    hax_dirty_log_start(section);
 }
 
 static void hax_log_stop(MemoryListener * listener,
                          MemoryRegionSection * section)
 {
+    hax_dirty_log_stop(section);
 }
 
 static void hax_begin(MemoryListener * listener)
 {
+    hax_slot_begin();
 }
 
 static void hax_commit(MemoryListener * listener)
 {
+    hax_slot_commit();
 }
 
 static void hax_region_nop(MemoryListener * listener,
@@ -498,6 +591,194 @@ static void hax_region_nop(MemoryListener * listener,
 {
 }
 
+/*
+ * The HAX kernel module cannot signal an eventfd itself, so ioeventfds
+ * (virtio queue notifications, typically) are matched here as soon as
+ * hax_vcpu_run() returns. The vcpu thread then signals the notifier and
+ * re-enters the guest without taking the iothread lock or dispatching the
+ * access, and the device handles the notification in the main loop.
+ * Anything not caught here, e.g. writes emulated by TCG, is matched again
+ * by memory_region_dispatch_write().
+ */
+typedef struct HaxIoeventfd {
+    bool pio;
+    uint64_t addr;
+    unsigned size;
+    bool match_data;
+    uint64_t data;
+    EventNotifier *e;
+} HaxIoeventfd;
+
+static QemuMutex hax_ioeventfd_lock;
+static GArray *hax_ioeventfds;
+
+static void hax_ioeventfd_update(MemoryRegionSection *section, bool pio,
+                                 bool match_data, uint64_t data,
+                                 EventNotifier *e, bool add)
+{
+    HaxIoeventfd fd = {
+        .pio = pio,
+        .addr = section->offset_within_address_space,
+        .size = int128_get64(section->size),
+        .match_data = match_data,
+        .data = data,
+        .e = e,
+    };
+    unsigned i;
+
+    qemu_mutex_lock(&hax_ioeventfd_lock);
+    if (add) {
+        g_array_append_val(hax_ioeventfds, fd);
+    } else {
+        for (i = 0; i < hax_ioeventfds->len; i++) {
+            HaxIoeventfd *old = &g_array_index(hax_ioeventfds, HaxIoeventfd, i);
+            if (old->pio == fd.pio && old->addr == fd.addr &&
+                old->size == fd.size && old->match_data == fd.match_data &&
+                old->data == fd.data && old->e == fd.e) {
+                g_array_remove_index_fast(hax_ioeventfds, i);
+                break;
+            }
+        }
+    }
+    qemu_mutex_unlock(&hax_ioeventfd_lock);
+}
+
+static bool hax_ioeventfd_notify(bool pio, uint64_t addr, unsigned size,
+                                 uint64_t value)
+{
+    EventNotifier *e = NULL;
+    unsigned i;
+
+    qemu_mutex_lock(&hax_ioeventfd_lock);
+    for (i = 0; i < hax_ioeventfds->len; i++) {
+        HaxIoeventfd *fd = &g_array_index(hax_ioeventfds, HaxIoeventfd, i);
+        if (fd->pio == pio && fd->addr == addr && fd->size == size &&
+            (!fd->match_data || fd->data == value)) {
+            e = fd->e;
+            break;
+        }
+    }
+    qemu_mutex_unlock(&hax_ioeventfd_lock);
+
+    if (e) {
+        event_notifier_set(e);
+    }
+    return e != NULL;
+}
+
+/* Returns true if the last exit of @cpu, at @exit_ns, was a write to an
+ * ioeventfd */
+static bool hax_handle_ioeventfd(CPUState *cpu, int64_t exit_ns)
+{
+    struct hax_vcpu_state *vcpu = cpu->hax_vcpu;
+    struct hax_tunnel *ht = vcpu->tunnel;
+    struct hax_fastmmio *hft;
+    uint64_t value;
+
+    if (!hax_ioeventfds->len) {
+        return false;
+    }
+
+    switch (ht->_exit_status) {
+    case HAX_EXIT_IO:
+        if (ht->pio._direction != HAX_EXIT_IO_OUT || ht->pio._count != 1) {
+            return false;
+        }
+        switch (ht->pio._size) {
+        case 1:
+            value = ldub_p(vcpu->iobuf);
+            break;
+        case 2:
+            value = lduw_p(vcpu->iobuf);
+            break;
+        case 4:
+            value = ldl_p(vcpu->iobuf);
+            break;
+        default:
+            return false;
+        }
+        if (!hax_ioeventfd_notify(true, ht->pio._port, ht->pio._size,
+                                  value)) {
+            return false;
+        }
+        vcpu_exit_account_address(cpu, true, ht->pio._port);
+        vcpu_exit_account(cpu, VCPU_EXIT_REASON_IO, exit_ns);
+        return true;
+    case HAX_EXIT_FAST_MMIO:
+        hft = (struct hax_fastmmio *) vcpu->iobuf;
+        if (hft->direction != 1 ||
+            !hax_ioeventfd_notify(false, hft->gpa, hft->size, hft->value)) {
+            return false;
+        }
+        vcpu_exit_account_address(cpu, false, hft->gpa);
+        vcpu_exit_account(cpu, VCPU_EXIT_REASON_FAST_MMIO, exit_ns);
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Complete a fast MMIO exit to a region that does its own locking, see
+ * memory_region_set_lockless(), without the iothread lock. Only used on
+ * UG platforms, where the vCPU runs without the lock.
+ */
+static bool hax_handle_lockless_mmio(CPUState *cpu, int64_t exit_ns)
+{
+    struct hax_vcpu_state *vcpu = cpu->hax_vcpu;
+    struct hax_fastmmio *hft;
+
+    if (vcpu->tunnel->_exit_status != HAX_EXIT_FAST_MMIO) {
+        return false;
+    }
+    hft = (struct hax_fastmmio *) vcpu->iobuf;
+    if (!address_space_access_lockless(&address_space_memory, hft->gpa,
+                                       hft->size, hft->direction)) {
+        return false;
+    }
+
+    vcpu_exit_account_address(cpu, false, hft->gpa);
+    hax_handle_fastmmio(cpu->env_ptr, hft);
+    vcpu_exit_account(cpu, VCPU_EXIT_REASON_FAST_MMIO, exit_ns);
+    return true;
+}
+
+static void hax_eventfd_add(MemoryListener *listener,
+                            MemoryRegionSection *section,
+                            bool match_data, uint64_t data,
+                            EventNotifier *e)
+{
+    hax_ioeventfd_update(section, false, match_data, data, e, true);
+}
+
+static void hax_eventfd_del(MemoryListener *listener,
+                            MemoryRegionSection *section,
+                            bool match_data, uint64_t data,
+                            EventNotifier *e)
+{
+    hax_ioeventfd_update(section, false, match_data, data, e, false);
+}
+
+static void hax_io_eventfd_add(MemoryListener *listener,
+                               MemoryRegionSection *section,
+                               bool match_data, uint64_t data,
+                               EventNotifier *e)
+{
+    hax_ioeventfd_update(section, true, match_data, data, e, true);
+}
+
+static void hax_io_eventfd_del(MemoryListener *listener,
+                               MemoryRegionSection *section,
+                               bool match_data, uint64_t data,
+                               EventNotifier *e)
+{
+    hax_ioeventfd_update(section, true, match_data, data, e, false);
+}
+
+static MemoryListener hax_io_listener = {
+    .eventfd_add = hax_io_eventfd_add,
+    .eventfd_del = hax_io_eventfd_del,
+};
+
 static MemoryListener hax_memory_listener = {
     .begin = hax_begin,
     .commit = hax_commit,
@@ -509,6 +790,8 @@ static MemoryListener hax_memory_listener = {
     .log_sync = hax_log_sync,
     .log_global_start = hax_log_global_start,
     .log_global_stop = hax_log_global_stop,
+    .eventfd_add = hax_eventfd_add,
+    .eventfd_del = hax_eventfd_del,
 };
 
 static void hax_handle_interrupt(CPUState * cpu, int mask)
@@ -576,7 +859,10 @@ static int hax_init(void)
         goto error;
     }
 
+    qemu_mutex_init(&hax_ioeventfd_lock);
+    hax_ioeventfds = g_array_new(false, false, sizeof(HaxIoeventfd));
     memory_listener_register(&hax_memory_listener, &address_space_memory);
+    memory_listener_register(&hax_io_listener, &address_space_io);
 
     qversion.cur_version = hax_cur_version;
     qversion.min_version = hax_min_version;
@@ -784,6 +1070,9 @@ static int hax_vcpu_hax_exec(CPUArchState * env, int ug_platform)
     }
 
     do {
+        struct hax_fastmmio *hft;
+        VcpuExitReason reason;
+        int64_t exit_ns;
         int hax_ret;
 
         if (cpu->exit_request) {
@@ -792,19 +1081,33 @@ static int hax_vcpu_hax_exec(CPUArchState * env, int ug_platform)
         }
 
         hax_vcpu_interrupt(env);
+        if (vcpu->regs_dirty) {
+            hax_arch_set_registers(env, vcpu->regs_dirty);
+        }
         if (!ug_platform) {
-            hax_ret = hax_vcpu_run(vcpu);
+            do {
+                hax_ret = hax_vcpu_run(vcpu);
+                exit_ns = get_clock();
+            } while (hax_ret == 0 && hax_handle_ioeventfd(cpu, exit_ns));
         } else {                /* UG platform */
 
             qemu_mutex_unlock_iothread();
-            hax_ret = hax_vcpu_run(vcpu);
+            do {
+                hax_ret = hax_vcpu_run(vcpu);
+                exit_ns = get_clock();
+            } while (hax_ret == 0 && !cpu->exit_request &&
+                     (hax_handle_ioeventfd(cpu, exit_ns) ||
+                      hax_handle_lockless_mmio(cpu, exit_ns)));
             qemu_mutex_lock_iothread();
             current_cpu = cpu;
         }
+        /* The guest may have run: the kernel module has the state now */
+        vcpu->regs_valid = 0;
 
         /* Simply continue the vcpu_run if system call interrupted */
         if (hax_ret == -EINTR || hax_ret == -EAGAIN) {
             DPRINTF("io window interrupted\n");
+            vcpu_exit_account(cpu, VCPU_EXIT_REASON_INTERRUPT, exit_ns);
             continue;
         }
 
@@ -814,21 +1117,29 @@ static int hax_vcpu_hax_exec(CPUArchState * env, int ug_platform)
         }
         switch (ht->_exit_status) {
         case HAX_EXIT_IO:
+            reason = VCPU_EXIT_REASON_IO;
+            vcpu_exit_account_address(cpu, true, ht->pio._port);
             ret = hax_handle_io(env, ht->pio._df, ht->pio._port,
                             ht->pio._direction,
                             ht->pio._size, ht->pio._count, vcpu->iobuf);
             break;
         case HAX_EXIT_MMIO:
+            reason = VCPU_EXIT_REASON_MMIO;
             ret = HAX_EMUL_ONE;
             break;
         case HAX_EXIT_FAST_MMIO:
-            ret = hax_handle_fastmmio(env, (struct hax_fastmmio *) vcpu->iobuf);
+            reason = VCPU_EXIT_REASON_FAST_MMIO;
+            hft = (struct hax_fastmmio *) vcpu->iobuf;
+            vcpu_exit_account_address(cpu, false, hft->gpa);
+            ret = hax_handle_fastmmio(env, hft);
             break;
         case HAX_EXIT_REAL:
+            reason = VCPU_EXIT_REASON_REAL_MODE;
             ret = HAX_EMUL_REAL;
             break;
         /* Guest state changed, currently only for shutdown */
         case HAX_EXIT_STATECHANGE:
+            reason = VCPU_EXIT_REASON_SHUTDOWN;
             fprintf(stdout, "VCPU shutdown request\n");
             qemu_system_reset_request();
             hax_prepare_emulation(env);
@@ -836,6 +1147,7 @@ static int hax_vcpu_hax_exec(CPUArchState * env, int ug_platform)
             ret = HAX_EMUL_EXITLOOP;
             break;
         case HAX_EXIT_UNKNOWN_VMEXIT:
+            reason = VCPU_EXIT_REASON_OTHER;
             fprintf(stderr, "Unknown VMX exit %x from guest\n",
                     ht->_exit_reason);
             qemu_system_reset_request();
@@ -844,6 +1156,7 @@ static int hax_vcpu_hax_exec(CPUArchState * env, int ug_platform)
             ret = HAX_EMUL_EXITLOOP;
             break;
         case HAX_EXIT_HLT:
+            reason = VCPU_EXIT_REASON_HLT;
             if (!(cpu->interrupt_request & CPU_INTERRUPT_HARD) &&
                 !(cpu->interrupt_request & CPU_INTERRUPT_NMI)) {
                 /* hlt instruction with interrupt disabled is shutdown */
@@ -856,8 +1169,10 @@ static int hax_vcpu_hax_exec(CPUArchState * env, int ug_platform)
         /* these situation will continue to hax module */
         case HAX_EXIT_INTERRUPT:
         case HAX_EXIT_PAUSED:
+            reason = VCPU_EXIT_REASON_INTERRUPT;
             break;
         default:
+            reason = VCPU_EXIT_REASON_OTHER;
             fprintf(stderr, "Unknow exit %x from hax\n", ht->_exit_status);
             qemu_system_reset_request();
             hax_prepare_emulation(env);
@@ -865,6 +1180,7 @@ static int hax_vcpu_hax_exec(CPUArchState * env, int ug_platform)
             ret = HAX_EMUL_EXITLOOP;
             break;
         }
+        vcpu_exit_account(cpu, reason, exit_ns);
     } while (!ret);
 
     if (cpu->exit_request) {
@@ -879,19 +1195,18 @@ static void do_hax_cpu_synchronize_state(void *arg)
     CPUState *cpu = arg;
     CPUArchState *env = cpu->env_ptr;
 
-    hax_arch_get_registers(env);
-    cpu->hax_vcpu_dirty = true;
+    /* The caller may change anything: write it all back before running */
+    hax_vcpu_sync_state(env, 0);
+    cpu->hax_vcpu->regs_dirty = HAX_REGS_ALL;
 }
 
 void hax_cpu_synchronize_state(CPUState *cpu)
 {
-    /* TODO: Do not sync if cpu->hax_vcpu_dirty is true. (Cf
-     * kvm_cpu_synchronize_state() in kvm-all.c)
-     * This would require that this flag be updated properly and consistently
-     * wherever a vCPU state sync between QEMU and HAX takes place. For now,
-     * just perform the sync regardless of hax_vcpu_dirty.
-     */
-    run_on_cpu(cpu, do_hax_cpu_synchronize_state, cpu);
+    /* Same as kvm_cpu_synchronize_state(): once dirty, env stays the
+     * authoritative copy until the vcpu runs again */
+    if (cpu->hax_vcpu->regs_dirty != HAX_REGS_ALL) {
+        run_on_cpu(cpu, do_hax_cpu_synchronize_state, cpu);
+    }
 }
 
 static void do_hax_cpu_synchronize_post_reset(void *arg)
@@ -899,8 +1214,7 @@ static void do_hax_cpu_synchronize_post_reset(void *arg)
     CPUState *cpu = arg;
     CPUArchState *env = cpu->env_ptr;
 
-    hax_vcpu_sync_state(env, 1);
-    cpu->hax_vcpu_dirty = false;
+    hax_arch_set_registers(env, HAX_REGS_ALL);
 }
 
 void hax_cpu_synchronize_post_reset(CPUState * cpu)
@@ -913,8 +1227,7 @@ static void do_hax_cpu_synchronize_post_init(void *arg)
     CPUState *cpu = arg;
     CPUArchState *env = cpu->env_ptr;
 
-    hax_vcpu_sync_state(env, 1);
-    cpu->hax_vcpu_dirty = false;
+    hax_arch_set_registers(env, HAX_REGS_ALL);
 }
 
 void hax_cpu_synchronize_post_init(CPUState * cpu)
@@ -1340,55 +1653,91 @@ static int hax_set_fpu(CPUArchState * env)
     return hax_sync_fpu(env, &fpu, 1);
 }
 
-static int hax_arch_get_registers(CPUArchState * env)
+/*
+ * Read the register classes @regs from the kernel module, skipping those
+ * already up to date in env since the vcpu last ran.
+ */
+static int hax_arch_get_registers(CPUArchState * env, unsigned int regs)
 {
+    struct hax_vcpu_state *vcpu = ENV_GET_CPU(env)->hax_vcpu;
     int ret;
 
-    ret = hax_sync_vcpu_register(env, 0);
-    if (ret < 0)
-        return ret;
+    regs &= ~vcpu->regs_valid;
 
-    ret = hax_get_fpu(env);
-    if (ret < 0)
-        return ret;
+    if (regs & HAX_REGS_STATE) {
+        ret = hax_sync_vcpu_register(env, 0);
+        if (ret < 0)
+            return ret;
+        vcpu->regs_valid |= HAX_REGS_STATE;
+    }
 
-    ret = hax_get_msrs(env);
-    if (ret < 0)
-        return ret;
+    if (regs & HAX_REGS_FPU) {
+        ret = hax_get_fpu(env);
+        if (ret < 0)
+            return ret;
+        vcpu->regs_valid |= HAX_REGS_FPU;
+    }
+
+    if (regs & HAX_REGS_MSRS) {
+        ret = hax_get_msrs(env);
+        if (ret < 0)
+            return ret;
+        vcpu->regs_valid |= HAX_REGS_MSRS;
+    }
 
     return 0;
 }
 
-static int hax_arch_set_registers(CPUArchState * env)
+/* Write the register classes @regs of env to the kernel module */
+static int hax_arch_set_registers(CPUArchState * env, unsigned int regs)
 {
+    struct hax_vcpu_state *vcpu = ENV_GET_CPU(env)->hax_vcpu;
     int ret;
-    ret = hax_sync_vcpu_register(env, 1);
 
-    if (ret < 0) {
-        fprintf(stderr, "Failed to sync vcpu reg\n");
-        return ret;
+    if (regs & HAX_REGS_STATE) {
+        ret = hax_sync_vcpu_register(env, 1);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to sync vcpu reg\n");
+            return ret;
+        }
+        vcpu->regs_dirty &= ~HAX_REGS_STATE;
     }
-    ret = hax_set_fpu(env);
-    if (ret < 0) {
-        fprintf(stderr, "FPU failed\n");
-        return ret;
+    if (regs & HAX_REGS_FPU) {
+        ret = hax_set_fpu(env);
+        if (ret < 0) {
+            fprintf(stderr, "FPU failed\n");
+            return ret;
+        }
+        vcpu->regs_dirty &= ~HAX_REGS_FPU;
     }
-    ret = hax_set_msrs(env);
-    if (ret < 0) {
-        fprintf(stderr, "MSR failed\n");
-        return ret;
+    if (regs & HAX_REGS_MSRS) {
+        ret = hax_set_msrs(env);
+        if (ret < 0) {
+            fprintf(stderr, "MSR failed\n");
+            return ret;
+        }
+        vcpu->regs_dirty &= ~HAX_REGS_MSRS;
     }
+    vcpu->regs_valid |= regs;
 
     return 0;
 }
 
+/*
+ * Make env current (!@modified), or note that all of env was modified and
+ * must be written back before the vcpu runs again (@modified).
+ */
 static void hax_vcpu_sync_state(CPUArchState * env, int modified)
 {
     if (hax_enabled()) {
-        if (modified)
-            hax_arch_set_registers(env);
-        else
-            hax_arch_get_registers(env);
+        struct hax_vcpu_state *vcpu = ENV_GET_CPU(env)->hax_vcpu;
+
+        if (modified) {
+            vcpu->regs_valid = HAX_REGS_ALL;
+            vcpu->regs_dirty = HAX_REGS_ALL;
+        } else {
+            hax_arch_get_registers(env, HAX_REGS_ALL);
+        }
     }
 }
 
@@ -1409,7 +1758,7 @@ int hax_sync_vcpus(void)
         for (; cpu != NULL; cpu = CPU_NEXT(cpu)) {
             int ret;
 
-            ret = hax_arch_set_registers(cpu->env_ptr);
+            ret = hax_arch_set_registers(cpu->env_ptr, HAX_REGS_ALL);
             if (ret < 0) {
                 derror(kHaxVcpuSyncFailed);
                 return ret;
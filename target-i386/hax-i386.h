@@ -31,8 +31,19 @@ struct hax_vcpu_state {
     int emulation_state;
     struct hax_tunnel *tunnel;
     unsigned char *iobuf;
+    /* Register classes (HAX_REGS_*) whose copy in CPUArchState is up to
+     * date, and those modified there that must be written back to the
+     * kernel module before the vcpu runs again */
+    unsigned int regs_valid;
+    unsigned int regs_dirty;
 };
 
+/* Register classes, each read and written with one ioctl */
+#define HAX_REGS_STATE  0x1   /* general, RIP, RFLAGS, CRs, segments */
+#define HAX_REGS_FPU    0x2
+#define HAX_REGS_MSRS   0x4
+#define HAX_REGS_ALL    (HAX_REGS_STATE | HAX_REGS_FPU | HAX_REGS_MSRS)
+
 struct hax_state {
     hax_fd fd; /* the global hax device interface */
     uint32_t version;
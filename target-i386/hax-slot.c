@@ -15,7 +15,6 @@
 
 #include "target-i386/hax-slot.h"
 #include "target-i386/hax-i386.h"
-#include "qemu/queue.h"
 
 //#define DEBUG_HAX_SLOT
 
@@ -39,28 +38,67 @@
  *                the region (start_pa <= pa < end_pa), the corresponding host
  *                virtual address is calculated by host_va = pa + hva_pa_delta
  * @flags: parameters for the mapping; must be non-negative
- * @entry: additional fields for linking #HAXSlot instances together
  */
 typedef struct HAXSlot {
     uint64_t start_pa;
     uint64_t end_pa;
     uint64_t hva_pa_delta;
     int flags;
-    QTAILQ_ENTRY(HAXSlot) entry;
 } HAXSlot;
 
-/* A doubly-linked list (actually a tail queue) of all registered slots */
-static QTAILQ_HEAD(HAXSlotListHead, HAXSlot) slot_list =
-    QTAILQ_HEAD_INITIALIZER(slot_list);
+/**
+ * HAXSlotArray: an array of slots sorted by address
+ *
+ * The slots cover all valid guest physical addresses without overlapping, so
+ * the slot containing an address can be found with a binary search.
+ *
+ * @slots: the slots, in ascending order of start_pa
+ * @len: the number of slots in use
+ * @alloc: the number of slots allocated
+ */
+typedef struct HAXSlotArray {
+    HAXSlot *slots;
+    int len;
+    int alloc;
+} HAXSlotArray;
+
+/* All registered slots */
+static HAXSlotArray slot_array;
+
+/* Between hax_slot_begin() and hax_slot_commit(), a copy of @slot_array as it
+ * was at hax_slot_begin(), i.e. the mappings known to the accelerator */
+static HAXSlotArray committed_array;
+static bool in_transaction;
+
+/* Applies the mappings */
+static HAXSlotSetRam *slot_set_ram;
+
+static void hax_slot_array_reserve(HAXSlotArray *array, int len)
+{
+    if (len > array->alloc) {
+        array->alloc = MAX(len, MAX(16, array->alloc * 2));
+        array->slots = g_renew(HAXSlot, array->slots, array->alloc);
+    }
+}
+
+static void hax_slot_array_free(HAXSlotArray *array)
+{
+    g_free(array->slots);
+    array->slots = NULL;
+    array->len = array->alloc = 0;
+}
 
-void hax_slot_init_registry(void)
+void hax_slot_init_registry(HAXSlotSetRam *set_ram)
 {
     HAXSlot *initial_slot;
 
-    g_assert(QTAILQ_EMPTY(&slot_list));
+    g_assert(slot_array.len == 0);
 
-    initial_slot = (HAXSlot *) g_malloc0(sizeof(*initial_slot));
-    /* Implied: initial_slot->start_pa = 0; */
+    slot_set_ram = set_ram;
+
+    hax_slot_array_reserve(&slot_array, 1);
+    initial_slot = &slot_array.slots[0];
+    initial_slot->start_pa = 0;
     /* Ideally we want to set end_pa to 2^64, but that is too large for
      * uint64_t. We don't need to support such a large guest physical address
      * space anyway; (2^64 - TARGET_PAGE_SIZE) should be (more than) enough.
@@ -69,17 +107,15 @@ void hax_slot_init_registry(void)
     /* hva_pa_delta and flags are initialized with invalid values */
     initial_slot->hva_pa_delta = ~TARGET_PAGE_MASK;
     initial_slot->flags = -1;
-    QTAILQ_INSERT_TAIL(&slot_list, initial_slot, entry);
+    slot_array.len = 1;
 }
 
 void hax_slot_free_registry(void)
 {
     DPRINTF("%s: Deleting all registered slots\n", __func__);
-    while (!QTAILQ_EMPTY(&slot_list)) {
-        HAXSlot *slot = QTAILQ_FIRST(&slot_list);
-        QTAILQ_REMOVE(&slot_list, slot, entry);
-        g_free(slot);
-    }
+    hax_slot_array_free(&slot_array);
+    hax_slot_array_free(&committed_array);
+    in_transaction = false;
 }
 
 /**
@@ -87,7 +123,7 @@ void hax_slot_free_registry(void)
  *
  * @slot: the slot to dump
  */
-static void hax_slot_dump(HAXSlot *slot)
+static void hax_slot_dump(const HAXSlot *slot)
 {
     DPRINTF("[ start_pa=0x%016" PRIx64 ", end_pa=0x%016" PRIx64
             ", hva_pa_delta=0x%016" PRIx64 ", flags=%d ]\n", slot->start_pa,
@@ -95,18 +131,17 @@ static void hax_slot_dump(HAXSlot *slot)
 }
 
 /**
- * hax_slot_dump_list: dumps @slot_list to stdout (for debugging)
+ * hax_slot_dump_list: dumps @slot_array to stdout (for debugging)
  */
 static void hax_slot_dump_list(void)
 {
 #ifdef DEBUG_HAX_SLOT
-    HAXSlot *slot;
-    int i = 0;
+    int i;
 
     DPRINTF("**** BEGIN HAX SLOT LIST DUMP ****\n");
-    QTAILQ_FOREACH(slot, &slot_list, entry) {
-        DPRINTF("Slot %d:\n\t", i++);
-        hax_slot_dump(slot);
+    for (i = 0; i < slot_array.len; i++) {
+        DPRINTF("Slot %d:\n\t", i);
+        hax_slot_dump(&slot_array.slots[i]);
     }
     DPRINTF("**** END HAX SLOT LIST DUMP ****\n");
 #endif
@@ -115,64 +150,36 @@ static void hax_slot_dump_list(void)
 /**
  * hax_slot_find: locates the slot containing a guest physical address
  *
- * Traverses @slot_list, starting from @start_slot, and returns the slot which
- * contains @pa. There should be one and only one such slot, because:
+ * Returns the index in @slot_array of the slot which contains @pa, searching
+ * from index @first on. There should be one and only one such slot, because:
  *
- * 1) @slot_list is initialized with a slot which covers all valid @pa values.
- *    This coverage stays unchanged as new slots are inserted into @slot_list.
- * 2) @slot_list does not contain overlapping slots.
+ * 1) @slot_array is initialized with a slot which covers all valid @pa values.
+ *    This coverage stays unchanged as new slots are inserted into @slot_array.
+ * 2) @slot_array does not contain overlapping slots.
  *
- * @start_slot: the first slot from which @slot_list is traversed and searched;
- *              must not be %NULL
- * @pa: the guest physical address to locate; must not be less than the lower
- *      bound of @start_slot
+ * @first: the index of the first slot to search; the slot must not start
+ *         after @pa
+ * @pa: the guest physical address to locate
  */
-static HAXSlot * hax_slot_find(HAXSlot *start_slot, uint64_t pa)
+static int hax_slot_find(int first, uint64_t pa)
 {
-    HAXSlot *slot;
+    int lo = first, hi = slot_array.len - 1;
 
-    g_assert(start_slot);
-    g_assert(start_slot->start_pa <= pa);
+    g_assert(first < slot_array.len);
+    g_assert(slot_array.slots[first].start_pa <= pa);
+    g_assert(slot_array.slots[hi].end_pa > pa);
 
-    slot = start_slot;
-    do {
-        if (slot->end_pa > pa) {
-            return slot;
-        }
-        slot = QTAILQ_NEXT(slot, entry);
-    } while (slot);
+    /* Find the first slot ending after pa */
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
 
-    /* Should never reach here */
-    g_assert_not_reached();
-    return NULL;
-}
-
-/**
- * hax_slot_split: splits a slot into two
- *
- * Shrinks @slot and creates a new slot from the vacated region. Returns the
- * new slot.
- *
- * @slot: the slot to be split/shrinked
- * @pa: the splitting point; must be page-aligned and within @slot
- */
-static HAXSlot * hax_slot_split(HAXSlot *slot, uint64_t pa)
-{
-    HAXSlot *new_slot;
-
-    g_assert(slot);
-    g_assert(pa > slot->start_pa && pa < slot->end_pa);
-    g_assert(!(pa & ~TARGET_PAGE_MASK));
-
-    new_slot = (HAXSlot *) g_malloc0(sizeof(*new_slot));
-    new_slot->start_pa = pa;
-    new_slot->end_pa = slot->end_pa;
-    new_slot->hva_pa_delta = slot->hva_pa_delta;
-    new_slot->flags = slot->flags;
-
-    slot->end_pa = pa;
-    QTAILQ_INSERT_AFTER(&slot_list, slot, new_slot, entry);
-    return new_slot;
+        if (slot_array.slots[mid].end_pa > pa) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
 }
 
 /**
@@ -186,7 +193,7 @@ static HAXSlot * hax_slot_split(HAXSlot *slot, uint64_t pa)
  * @slot1: one of the slots to be tested; must not be %NULL
  * @slot2: the other slot to be tested; must not be %NULL
  */
-static bool hax_slot_can_merge(HAXSlot *slot1, HAXSlot *slot2)
+static bool hax_slot_can_merge(const HAXSlot *slot1, const HAXSlot *slot2)
 {
     g_assert(slot1 && slot2);
 
@@ -195,107 +202,126 @@ static bool hax_slot_can_merge(HAXSlot *slot1, HAXSlot *slot2)
 }
 
 /**
- * hax_slot_insert: inserts a slot into @slot_list, with the potential side
+ * hax_slot_set_ram: asks the accelerator to map a guest physical memory range
+ *
+ * Maps [@start_pa, @end_pa) to the host virtual addresses given by
+ * @hva_pa_delta, with @flags. Ranges of 4GB or more are split, since
+ * HAXSlotSetRam takes 32-bit sizes.
+ *
+ * Aborts QEMU on error.
+ */
+static void hax_slot_set_ram(uint64_t start_pa, uint64_t end_pa,
+                             uint64_t hva_pa_delta, int flags)
+{
+    const uint64_t max_size = UINT32_MAX & TARGET_PAGE_MASK;
+
+    while (start_pa < end_pa) {
+        uint32_t size = MIN(end_pa - start_pa, max_size);
+        int err;
+
+        DPRINTF("%s: Doing ioctl (pa=0x%016" PRIx64 ", size=0x%08" PRIx32
+                ")\n", __func__, start_pa, size);
+        err = slot_set_ram(start_pa, size, start_pa + hva_pa_delta, flags);
+        if (err) {
+            fprintf(stderr, "%s: Failed to set memory mapping (err=%d)\n",
+                    __func__, err);
+            abort();
+        }
+        start_pa += size;
+    }
+}
+
+/**
+ * hax_slot_insert: inserts a slot into @slot_array, with the potential side
  *                  effect of creating/updating memory mappings
  *
- * Causes memory mapping attributes of @slot to override those of overlapping
- * slots (including partial slots) in @slot_list. For any slot whose mapping
- * attributes have changed, performs an ioctl to enforce the new mapping.
+ * Causes memory mapping attributes of @new_slot to override those of
+ * overlapping slots (including partial slots) in @slot_array. Outside a
+ * transaction, performs an ioctl for each contiguous range whose mapping
+ * attributes have changed.
  *
  * Aborts QEMU on error.
  *
- * @slot: the slot to be inserted
+ * @new_slot: the slot to be inserted
  */
-static void hax_slot_insert(HAXSlot *slot)
+static void hax_slot_insert(const HAXSlot *new_slot)
 {
-    HAXSlot *low_slot, *high_slot;
-    HAXSlot *low_slot_prev, *high_slot_next;
-    HAXSlot *old_slot, *old_slot_next;
-
-    g_assert(!QTAILQ_EMPTY(&slot_list));
-
-    low_slot = hax_slot_find(QTAILQ_FIRST(&slot_list), slot->start_pa);
-    g_assert(low_slot);
-    low_slot_prev = QTAILQ_PREV(low_slot, HAXSlotListHead, entry);
+    HAXSlot slot = *new_slot;
+    HAXSlot head, tail;
+    bool has_head = false, has_tail = false;
+    int low, high, i, n_old, n_new;
+
+    low = hax_slot_find(0, slot.start_pa);
+
+    /* Extend slot downwards over a compatible neighbour, or keep the part of
+     * slots[low] below slot as a separate head slot */
+    if (hax_slot_can_merge(&slot_array.slots[low], &slot)) {
+        slot.start_pa = slot_array.slots[low].start_pa;
+    } else if (slot.start_pa == slot_array.slots[low].start_pa && low > 0
+               && hax_slot_can_merge(&slot_array.slots[low - 1], &slot)) {
+        low--;
+        slot.start_pa = slot_array.slots[low].start_pa;
+    } else if (slot.start_pa != slot_array.slots[low].start_pa) {
+        head = slot_array.slots[low];
+        head.end_pa = slot.start_pa;
+        has_head = true;
+    }
 
-    /* Adjust slot and/or low_slot such that their lower bounds (start_pa)
-     * align.
-     */
-    if (hax_slot_can_merge(low_slot, slot)) {
-        slot->start_pa = low_slot->start_pa;
-    } else if (slot->start_pa == low_slot->start_pa && low_slot_prev
-               && hax_slot_can_merge(low_slot_prev, slot)) {
-        low_slot = low_slot_prev;
-        slot->start_pa = low_slot->start_pa;
-    } else if (slot->start_pa != low_slot->start_pa) {
-        /* low_slot->start_pa < slot->start_pa < low_slot->end_pa */
-        low_slot = hax_slot_split(low_slot, slot->start_pa);
-        g_assert(low_slot);
+    high = hax_slot_find(low, slot.end_pa - 1);
+
+    /* Likewise upwards */
+    if (hax_slot_can_merge(&slot, &slot_array.slots[high])) {
+        slot.end_pa = slot_array.slots[high].end_pa;
+    } else if (slot.end_pa == slot_array.slots[high].end_pa
+               && high + 1 < slot_array.len
+               && hax_slot_can_merge(&slot, &slot_array.slots[high + 1])) {
+        high++;
+        slot.end_pa = slot_array.slots[high].end_pa;
+    } else if (slot.end_pa != slot_array.slots[high].end_pa) {
+        tail = slot_array.slots[high];
+        tail.start_pa = slot.end_pa;
+        has_tail = true;
     }
-    /* Now we have slot->start_pa == low_slot->start_pa */
 
-    high_slot = hax_slot_find(low_slot, slot->end_pa - 1);
-    g_assert(high_slot);
-    high_slot_next = QTAILQ_NEXT(high_slot, entry);
+    if (!in_transaction) {
+        /* Map the parts of slots[low..high] that change, all with the new
+         * attributes, combining adjacent ones. Inside a transaction,
+         * hax_slot_commit() takes care of it. */
+        uint64_t run_start = 0, run_end = 0;
 
-    /* Adjust slot and/or high_slot such that their upper bounds (end_pa)
-     * align.
-     */
-    if (hax_slot_can_merge(slot, high_slot)) {
-        slot->end_pa = high_slot->end_pa;
-    } else if (slot->end_pa == high_slot->end_pa && high_slot_next
-               && hax_slot_can_merge(slot, high_slot_next)) {
-        high_slot = high_slot_next;
-        slot->end_pa = high_slot->end_pa;
-    } else if (slot->end_pa != high_slot->end_pa) {
-        /* high_slot->start_pa < slot->end_pa < high_slot->end_pa */
-        high_slot_next = hax_slot_split(high_slot, slot->end_pa);
-        g_assert(high_slot_next);
-    }
-    /* Now we have slot->end_pa == high_slot->end_pa */
-
-    /* We are ready for substitution: replace all slots between low_slot and
-     * high_slot (inclusive) with slot. */
-
-    /* Step 1: insert slot into the list, before low_slot */
-    QTAILQ_INSERT_BEFORE(low_slot, slot, entry);
-
-    /* Step 2: remove low_slot..high_slot, one by one */
-    for (old_slot = low_slot;
-         /* This condition always evaluates to 1. See:
-          * https://en.wikipedia.org/wiki/Comma_operator
-          */
-         old_slot_next = QTAILQ_NEXT(old_slot, entry), 1;
-         old_slot = old_slot_next) {
-        g_assert(old_slot);
-
-        QTAILQ_REMOVE(&slot_list, old_slot, entry);
-        if (!hax_slot_can_merge(slot, old_slot)) {
-            /* Mapping for guest memory region [old_slot->start_pa,
-             * old_slot->end_pa) has changed - must do ioctl. */
-            /* TODO: Further reduce the number of ioctl calls by preprocessing
-             * the low_slot..high_slot sublist and combining any two adjacent
-             * slots that are both incompatible with slot.
-             */
-            uint32_t size = old_slot->end_pa - old_slot->start_pa;
-            uint64_t host_va = old_slot->start_pa + slot->hva_pa_delta;
-            int err;
-
-            DPRINTF("%s: Doing ioctl (size=0x%08" PRIx32 ")\n", __func__, size);
-            /* Use the new host_va and flags */
-            err = hax_set_ram(old_slot->start_pa, size, host_va, slot->flags);
-            if (err) {
-                fprintf(stderr, "%s: Failed to set memory mapping (err=%d)\n",
-                        __func__, err);
-                abort();
+        for (i = low; i <= high; i++) {
+            const HAXSlot *old_slot = &slot_array.slots[i];
+            uint64_t start = MAX(old_slot->start_pa, slot.start_pa);
+            uint64_t end = MIN(old_slot->end_pa, slot.end_pa);
+
+            if (hax_slot_can_merge(&slot, old_slot)) {
+                continue;
             }
+            if (run_end != start) {
+                hax_slot_set_ram(run_start, run_end, slot.hva_pa_delta,
+                                 slot.flags);
+                run_start = start;
+            }
+            run_end = end;
         }
-        g_free(old_slot);
+        hax_slot_set_ram(run_start, run_end, slot.hva_pa_delta, slot.flags);
+    }
 
-        /* Exit the infinite loop following the removal of high_slot */
-        if (old_slot == high_slot) {
-            break;
-        }
+    /* Replace slots[low..high] with head, slot and tail */
+    n_old = high - low + 1;
+    n_new = 1 + has_head + has_tail;
+    hax_slot_array_reserve(&slot_array, slot_array.len - n_old + n_new);
+    memmove(&slot_array.slots[low + n_new], &slot_array.slots[high + 1],
+            (slot_array.len - high - 1) * sizeof(HAXSlot));
+    slot_array.len += n_new - n_old;
+
+    i = low;
+    if (has_head) {
+        slot_array.slots[i++] = head;
+    }
+    slot_array.slots[i++] = slot;
+    if (has_tail) {
+        slot_array.slots[i] = tail;
     }
 }
 
@@ -303,7 +329,7 @@ void hax_slot_register(uint64_t start_pa, uint32_t size, uint64_t host_va,
                        int flags)
 {
     uint64_t end_pa = start_pa + size;
-    HAXSlot *slot;
+    HAXSlot slot;
 
     g_assert(!(start_pa & ~TARGET_PAGE_MASK));
     g_assert(!(end_pa & ~TARGET_PAGE_MASK));
@@ -311,18 +337,87 @@ void hax_slot_register(uint64_t start_pa, uint32_t size, uint64_t host_va,
     g_assert(host_va);
     g_assert(flags >= 0);
 
-    slot = g_malloc0(sizeof(*slot));
-    slot->start_pa = start_pa;
-    slot->end_pa = end_pa;
-    slot->hva_pa_delta = host_va - start_pa;
-    slot->flags = flags;
+    slot.start_pa = start_pa;
+    slot.end_pa = end_pa;
+    slot.hva_pa_delta = host_va - start_pa;
+    slot.flags = flags;
 
     DPRINTF("%s: Inserting slot:\n\t", __func__);
-    hax_slot_dump(slot);
+    hax_slot_dump(&slot);
     hax_slot_dump_list();
 
-    hax_slot_insert(slot);
+    hax_slot_insert(&slot);
 
     DPRINTF("%s: Done\n", __func__);
     hax_slot_dump_list();
 }
+
+void hax_slot_begin(void)
+{
+    if (in_transaction) {
+        return;
+    }
+
+    hax_slot_array_reserve(&committed_array, slot_array.len);
+    memcpy(committed_array.slots, slot_array.slots,
+           slot_array.len * sizeof(HAXSlot));
+    committed_array.len = slot_array.len;
+    in_transaction = true;
+}
+
+void hax_slot_commit(void)
+{
+    /* The range waiting to be mapped, extended while consecutive changed
+     * ranges belong to the same new slot */
+    int run_slot = -1;
+    uint64_t run_start = 0, run_end = 0;
+    int i = 0, j = 0, ioctls = 0;
+
+    if (!in_transaction) {
+        return;
+    }
+    in_transaction = false;
+
+    /* Both arrays cover the same address space without overlaps: walk them
+     * side by side and map the ranges whose attributes differ */
+    while (i < slot_array.len && j < committed_array.len) {
+        const HAXSlot *slot = &slot_array.slots[i];
+        const HAXSlot *old_slot = &committed_array.slots[j];
+        uint64_t start = MAX(slot->start_pa, old_slot->start_pa);
+        uint64_t end = MIN(slot->end_pa, old_slot->end_pa);
+
+        /* flags < 0 is the initial, never mapped slot */
+        if (start < end && slot->flags >= 0
+            && !hax_slot_can_merge(slot, old_slot)) {
+            if (run_slot != i || run_end != start) {
+                if (run_slot >= 0) {
+                    hax_slot_set_ram(run_start, run_end,
+                                     slot_array.slots[run_slot].hva_pa_delta,
+                                     slot_array.slots[run_slot].flags);
+                    ioctls++;
+                }
+                run_slot = i;
+                run_start = start;
+            }
+            run_end = end;
+        }
+
+        if (slot->end_pa == end) {
+            i++;
+        }
+        if (old_slot->end_pa == end) {
+            j++;
+        }
+    }
+    if (run_slot >= 0) {
+        hax_slot_set_ram(run_start, run_end,
+                         slot_array.slots[run_slot].hva_pa_delta,
+                         slot_array.slots[run_slot].flags);
+        ioctls++;
+    }
+
+    committed_array.len = 0;
+
+    DPRINTF("%s: Done (%d ranges mapped)\n", __func__, ioctls);
+    hax_slot_dump_list();
+}
@@ -18,13 +18,28 @@
 
 #include <inttypes.h>
 
+/**
+ * HAXSlotSetRam: maps a guest physical memory range in the accelerator
+ *
+ * Called by the registry whenever the mapping of [@start_pa, @start_pa +
+ * @size) changes, with the @host_va and @flags last registered for it.
+ * hax_set_ram() for HAXM; other accelerators using the registry provide
+ * their own.
+ *
+ * Returns 0, or a negative error code.
+ */
+typedef int HAXSlotSetRam(uint64_t start_pa, uint32_t size, uint64_t host_va,
+                          int flags);
+
 /**
  * hax_slot_init_registry: initializes the registry of memory slots.
  *
  * Should be called during HAX initialization, before any call to
  * hax_slot_register().
+ *
+ * @set_ram: the function applying the mappings
  */
-void hax_slot_init_registry(void);
+void hax_slot_init_registry(HAXSlotSetRam *set_ram);
 
 /**
  * hax_slot_free_registry: destroys the registry of memory slots.
@@ -40,7 +55,7 @@ void hax_slot_free_registry(void);
  *
  * Must be called after hax_slot_init_registry(). Can be called multiple times
  * to create new memory mappings or update existing ones. This function is smart
- * enough to avoid asking the HAXM driver to do the same mapping twice for any
+ * enough to avoid asking the accelerator to do the same mapping twice for any
  * guest physical page.
  *
  * Aborts QEMU on error.
@@ -49,10 +64,31 @@ void hax_slot_free_registry(void);
  *            register; must be page-aligned
  * @size: size of the slot to register; must be page-aligned and positive
  * @host_va: a host virtual address to which @start_pa should be mapped
- * @flags: parameters for the mapping, passed verbatim to the HAXM driver if
+ * @flags: parameters for the mapping, passed verbatim to the accelerator if
  *         necessary; must be non-negative
  */
 void hax_slot_register(uint64_t start_pa, uint32_t size, uint64_t host_va,
                        int flags);
 
+/**
+ * hax_slot_begin: starts a transaction of memory slot updates.
+ *
+ * Until the matching hax_slot_commit(), hax_slot_register() only updates the
+ * registry and defers all the requests to the accelerator. Does nothing if a
+ * transaction is already open.
+ */
+void hax_slot_begin(void);
+
+/**
+ * hax_slot_commit: ends a transaction of memory slot updates.
+ *
+ * Compares the registry with its state at hax_slot_begin() and asks the
+ * accelerator to map only the guest physical ranges whose mapping has changed,
+ * with one request per contiguous range. Ranges remapped several times during
+ * the transaction are mapped once, and not at all if they end up as before.
+ *
+ * Aborts QEMU on error.
+ */
+void hax_slot_commit(void);
+
 #endif
@@ -0,0 +1,1468 @@
+/*
+ * QEMU Hypervisor.framework accelerator (HVF)
+ *
+ * Copyright (c) 2017 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * Runs the vcpus through Apple's Hypervisor.framework, on the macOS hosts
+ * where HAXM isn't installed.
+ *
+ * The structure is that of hax-all.c: guest RAM is mapped by a
+ * MemoryListener, through the same slot registry as HAX, each vcpu has its
+ * own thread looping in hvf_vcpu_exec(), and the register file is only
+ * copied to env when QEMU asks for it. Unlike HAXM, the framework hands
+ * the VMX exits over as they are: port and MMIO accesses are decoded here,
+ * the latter by hvf-decode.c, and CPUID, MSR and control register accesses
+ * are answered from env. The APIC, PIC and timers stay emulated by QEMU.
+ *
+ * The framework is weak-linked, so the emulator still starts on macOS
+ * before 10.10 and falls back to the next accelerator given to
+ * -machine accel=.
+ */
+
+#include <Hypervisor/hv.h>
+#include <Hypervisor/hv_vmx.h>
+
+#include "qemu-common.h"
+#include "cpu.h"
+#include "exec/address-spaces.h"
+#include "exec/helper-proto.h"
+#include "exec/ioport.h"
+#include "hw/boards.h"
+#include "hw/i386/apic.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "sysemu/accel.h"
+#include "sysemu/cpus.h"
+#include "sysemu/hvf.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/vcpu-exits.h"
+#include "hax-slot.h"
+#include "hvf-decode.h"
+
+#define TYPE_HVF_ACCEL ACCEL_CLASS_NAME("hvf")
+
+/* Slot flags, as for HAXM */
+#define HVF_RAM_ROM 0x1
+
+/* CR0 and CR4 bits the guest doesn't own, see hvf_set_registers() */
+#define HVF_CR0_MASK (CR0_PE_MASK | CR0_NE_MASK | CR0_PG_MASK)
+#define HVF_CR4_MASK CR4_VMXE_MASK
+
+/* VMX segment access rights: the descriptor bits 40-55, and unusable */
+#define HVF_AR_MASK     0xf0ff
+#define HVF_AR_UNUSABLE (1 << 16)
+
+/* VMCS_GUEST_INTERRUPTIBILITY */
+#define HVF_INTR_STI     (1 << 0)
+#define HVF_INTR_MOV_SS  (1 << 1)
+#define HVF_INTR_NMI     (1 << 3)
+
+/* Exit qualification of I/O instructions */
+#define HVF_IO_SIZE(q)   (((q) & 7) + 1)
+#define HVF_IO_IN        (1 << 3)
+#define HVF_IO_STRING    (1 << 4)
+#define HVF_IO_REP       (1 << 5)
+#define HVF_IO_PORT(q)   (((q) >> 16) & 0xffff)
+
+/* Exit qualification of control register accesses */
+#define HVF_CR_NUM(q)    ((q) & 0xf)
+#define HVF_CR_TYPE(q)   (((q) >> 4) & 3)
+#define HVF_CR_GPR(q)    (((q) >> 8) & 0xf)
+#define HVF_CR_LMSW(q)   (((q) >> 16) & 0xffff)
+
+/* Exit qualification of EPT violations */
+#define HVF_EPT_FETCH    (1 << 2)
+
+struct hvf_state {
+    bool vm_created;
+    /* VMX capabilities: allowed 0-settings low, allowed 1-settings high */
+    uint64_t cap_pinbased;
+    uint64_t cap_procbased;
+    uint64_t cap_procbased2;
+    uint64_t cap_entry;
+};
+
+struct hvf_vcpu {
+    hv_vcpuid_t id;
+    /* env holds the registers, they must be written before running */
+    bool regs_dirty;
+};
+
+static struct hvf_state hvf_global;
+static bool hvf_allowed;
+
+int hvf_enabled(void)
+{
+    return hvf_allowed && hvf_global.vm_created;
+}
+
+/*
+ * VMCS and register accessors. The framework only fails them for fields
+ * and registers that don't exist, and these are all constants.
+ */
+
+static uint64_t hvf_rvmcs(hv_vcpuid_t id, uint32_t field)
+{
+    uint64_t value = 0;
+
+    hv_vmx_vcpu_read_vmcs(id, field, &value);
+    return value;
+}
+
+static void hvf_wvmcs(hv_vcpuid_t id, uint32_t field, uint64_t value)
+{
+    hv_vmx_vcpu_write_vmcs(id, field, value);
+}
+
+static uint64_t hvf_rreg(hv_vcpuid_t id, hv_x86_reg_t reg)
+{
+    uint64_t value = 0;
+
+    hv_vcpu_read_register(id, reg, &value);
+    return value;
+}
+
+static void hvf_wreg(hv_vcpuid_t id, hv_x86_reg_t reg, uint64_t value)
+{
+    hv_vcpu_write_register(id, reg, value);
+}
+
+/* Controls with the bits the CPU requires set, and those it lacks clear */
+static uint64_t hvf_cap2ctrl(uint64_t cap, uint64_t ctrl)
+{
+    return (ctrl | (cap & 0xffffffff)) & (cap >> 32);
+}
+
+/*
+ * Register sync
+ */
+
+/* In the order of env->regs */
+static const hv_x86_reg_t hvf_gprs[] = {
+    HV_X86_RAX, HV_X86_RCX, HV_X86_RDX, HV_X86_RBX,
+    HV_X86_RSP, HV_X86_RBP, HV_X86_RSI, HV_X86_RDI,
+    HV_X86_R8, HV_X86_R9, HV_X86_R10, HV_X86_R11,
+    HV_X86_R12, HV_X86_R13, HV_X86_R14, HV_X86_R15,
+};
+
+typedef struct HvfSegmentFields {
+    uint32_t selector;
+    uint32_t limit;
+    uint32_t ar;
+    uint32_t base;
+} HvfSegmentFields;
+
+/* In the order of env->segs */
+static const HvfSegmentFields hvf_segment_fields[] = {
+    { VMCS_GUEST_ES, VMCS_GUEST_ES_LIMIT, VMCS_GUEST_ES_AR,
+      VMCS_GUEST_ES_BASE },
+    { VMCS_GUEST_CS, VMCS_GUEST_CS_LIMIT, VMCS_GUEST_CS_AR,
+      VMCS_GUEST_CS_BASE },
+    { VMCS_GUEST_SS, VMCS_GUEST_SS_LIMIT, VMCS_GUEST_SS_AR,
+      VMCS_GUEST_SS_BASE },
+    { VMCS_GUEST_DS, VMCS_GUEST_DS_LIMIT, VMCS_GUEST_DS_AR,
+      VMCS_GUEST_DS_BASE },
+    { VMCS_GUEST_FS, VMCS_GUEST_FS_LIMIT, VMCS_GUEST_FS_AR,
+      VMCS_GUEST_FS_BASE },
+    { VMCS_GUEST_GS, VMCS_GUEST_GS_LIMIT, VMCS_GUEST_GS_AR,
+      VMCS_GUEST_GS_BASE },
+};
+
+static const HvfSegmentFields hvf_ldtr_fields = {
+    VMCS_GUEST_LDTR, VMCS_GUEST_LDTR_LIMIT, VMCS_GUEST_LDTR_AR,
+    VMCS_GUEST_LDTR_BASE
+};
+
+static const HvfSegmentFields hvf_tr_fields = {
+    VMCS_GUEST_TR, VMCS_GUEST_TR_LIMIT, VMCS_GUEST_TR_AR,
+    VMCS_GUEST_TR_BASE
+};
+
+/* MSRs the guest accesses without exiting */
+static const uint32_t hvf_native_msrs[] = {
+    MSR_STAR, MSR_LSTAR, MSR_CSTAR, MSR_FMASK, MSR_FSBASE, MSR_GSBASE,
+    MSR_KERNELGSBASE, MSR_TSC_AUX, MSR_IA32_TSC, MSR_IA32_SYSENTER_CS,
+    MSR_IA32_SYSENTER_ESP, MSR_IA32_SYSENTER_EIP,
+};
+
+/* Offsets in the legacy area of the FXSAVE/XSAVE image */
+#define HVF_FX_FCW      0
+#define HVF_FX_FSW      2
+#define HVF_FX_FTW      4
+#define HVF_FX_FOP      6
+#define HVF_FX_FIP      8
+#define HVF_FX_FDP      16
+#define HVF_FX_MXCSR    24
+#define HVF_FX_ST       32
+#define HVF_FX_XMM      160
+
+/* Big enough for the XSAVE image of any host CPU */
+#define HVF_FPSTATE_SIZE 4096
+
+static uint64_t hvf_seg_ar(const SegmentCache *qs)
+{
+    uint64_t ar = (qs->flags >> DESC_TYPE_SHIFT) & HVF_AR_MASK;
+
+    if (!(qs->flags & DESC_P_MASK)) {
+        ar |= HVF_AR_UNUSABLE;
+    }
+    return ar;
+}
+
+static void hvf_set_segment(hv_vcpuid_t id, const HvfSegmentFields *f,
+                            const SegmentCache *qs, uint64_t ar)
+{
+    hvf_wvmcs(id, f->selector, qs->selector);
+    hvf_wvmcs(id, f->limit, qs->limit);
+    hvf_wvmcs(id, f->ar, ar);
+    hvf_wvmcs(id, f->base, qs->base);
+}
+
+static void hvf_get_segment(hv_vcpuid_t id, const HvfSegmentFields *f,
+                            SegmentCache *qs)
+{
+    uint64_t ar = hvf_rvmcs(id, f->ar);
+
+    qs->selector = hvf_rvmcs(id, f->selector);
+    qs->limit = hvf_rvmcs(id, f->limit);
+    qs->base = hvf_rvmcs(id, f->base);
+    qs->flags = (ar & HVF_AR_MASK) << DESC_TYPE_SHIFT;
+    if (ar & HVF_AR_UNUSABLE) {
+        qs->flags &= ~DESC_P_MASK;
+    }
+}
+
+/* The guest's view of CR0 and CR4: the bits it doesn't own are shadowed */
+static uint64_t hvf_get_cr0(hv_vcpuid_t id)
+{
+    return (hvf_rvmcs(id, VMCS_GUEST_CR0) & ~HVF_CR0_MASK) |
+           (hvf_rvmcs(id, VMCS_CTRL_CR0_SHADOW) & HVF_CR0_MASK);
+}
+
+static uint64_t hvf_get_cr4(hv_vcpuid_t id)
+{
+    return (hvf_rvmcs(id, VMCS_GUEST_CR4) & ~HVF_CR4_MASK) |
+           (hvf_rvmcs(id, VMCS_CTRL_CR4_SHADOW) & HVF_CR4_MASK);
+}
+
+/* Recompute the hflags that depend on the registers read back */
+static void hvf_update_hflags(CPUX86State *env)
+{
+#define HFLAG_COPY_MASK ~( \
+  HF_CPL_MASK | HF_PE_MASK | HF_MP_MASK | HF_EM_MASK | \
+  HF_TS_MASK | HF_TF_MASK | HF_VM_MASK | HF_IOPL_MASK | \
+  HF_OSFXSR_MASK | HF_LMA_MASK | HF_CS32_MASK | \
+  HF_SS32_MASK | HF_CS64_MASK | HF_ADDSEG_MASK)
+
+    uint32_t hflags;
+
+    hflags = (env->segs[R_CS].flags >> DESC_DPL_SHIFT) & HF_CPL_MASK;
+    hflags |= (env->cr[0] & CR0_PE_MASK) << (HF_PE_SHIFT - CR0_PE_SHIFT);
+    hflags |= (env->cr[0] << (HF_MP_SHIFT - CR0_MP_SHIFT)) &
+        (HF_MP_MASK | HF_EM_MASK | HF_TS_MASK);
+    hflags |= (env->eflags & (HF_TF_MASK | HF_VM_MASK | HF_IOPL_MASK));
+    hflags |= (env->cr[4] & CR4_OSFXSR_MASK) <<
+        (HF_OSFXSR_SHIFT - CR4_OSFXSR_SHIFT);
+
+    if (env->efer & MSR_EFER_LMA) {
+        hflags |= HF_LMA_MASK;
+    }
+
+    if ((hflags & HF_LMA_MASK) && (env->segs[R_CS].flags & DESC_L_MASK)) {
+        hflags |= HF_CS32_MASK | HF_SS32_MASK | HF_CS64_MASK;
+    } else {
+        hflags |= (env->segs[R_CS].flags & DESC_B_MASK) >>
+            (DESC_B_SHIFT - HF_CS32_SHIFT);
+        hflags |= (env->segs[R_SS].flags & DESC_B_MASK) >>
+            (DESC_B_SHIFT - HF_SS32_SHIFT);
+        if (!(env->cr[0] & CR0_PE_MASK) ||
+            (env->eflags & VM_MASK) || !(hflags & HF_CS32_MASK)) {
+            hflags |= HF_ADDSEG_MASK;
+        } else {
+            hflags |= ((env->segs[R_DS].base |
+                        env->segs[R_ES].base |
+                        env->segs[R_SS].base) != 0) << HF_ADDSEG_SHIFT;
+        }
+    }
+    env->hflags = (env->hflags & HFLAG_COPY_MASK) | hflags;
+#undef HFLAG_COPY_MASK
+}
+
+static void hvf_set_fpu(hv_vcpuid_t id, CPUX86State *env)
+{
+    uint8_t buf[HVF_FPSTATE_SIZE] __attribute__((aligned(64)));
+    uint16_t fsw;
+    uint8_t ftw = 0;
+    int i;
+
+    /* Keep the XSAVE header and the state beyond SSE as they are */
+    if (hv_vcpu_read_fpstate(id, buf, sizeof(buf)) != HV_SUCCESS) {
+        memset(buf, 0, sizeof(buf));
+    }
+
+    fsw = (env->fpus & ~0x3800) | (env->fpstt & 0x7) << 11;
+    for (i = 0; i < 8; i++) {
+        ftw |= (!env->fptags[i]) << i;
+    }
+    stw_p(buf + HVF_FX_FCW, env->fpuc);
+    stw_p(buf + HVF_FX_FSW, fsw);
+    buf[HVF_FX_FTW] = ftw;
+    stw_p(buf + HVF_FX_FOP, env->fpop);
+    stq_p(buf + HVF_FX_FIP, env->fpip);
+    stq_p(buf + HVF_FX_FDP, env->fpdp);
+    stl_p(buf + HVF_FX_MXCSR, env->mxcsr);
+    for (i = 0; i < 8; i++) {
+        memcpy(buf + HVF_FX_ST + i * 16, &env->fpregs[i], 16);
+    }
+    for (i = 0; i < CPU_NB_REGS; i++) {
+        stq_p(buf + HVF_FX_XMM + i * 16, env->xmm_regs[i].XMM_Q(0));
+        stq_p(buf + HVF_FX_XMM + i * 16 + 8, env->xmm_regs[i].XMM_Q(1));
+    }
+
+    if (hv_vcpu_write_fpstate(id, buf, sizeof(buf)) != HV_SUCCESS) {
+        error_report("HVF: Failed to set the FPU state");
+    }
+}
+
+static void hvf_get_fpu(hv_vcpuid_t id, CPUX86State *env)
+{
+    uint8_t buf[HVF_FPSTATE_SIZE] __attribute__((aligned(64)));
+    uint16_t fsw;
+    int i;
+
+    if (hv_vcpu_read_fpstate(id, buf, sizeof(buf)) != HV_SUCCESS) {
+        error_report("HVF: Failed to get the FPU state");
+        return;
+    }
+
+    env->fpuc = lduw_p(buf + HVF_FX_FCW);
+    fsw = lduw_p(buf + HVF_FX_FSW);
+    env->fpstt = (fsw >> 11) & 0x7;
+    env->fpus = fsw & ~0x3800;
+    for (i = 0; i < 8; i++) {
+        env->fptags[i] = !((buf[HVF_FX_FTW] >> i) & 1);
+    }
+    env->fpop = lduw_p(buf + HVF_FX_FOP);
+    env->fpip = ldq_p(buf + HVF_FX_FIP);
+    env->fpdp = ldq_p(buf + HVF_FX_FDP);
+    env->mxcsr = ldl_p(buf + HVF_FX_MXCSR);
+    for (i = 0; i < 8; i++) {
+        memcpy(&env->fpregs[i], buf + HVF_FX_ST + i * 16, 16);
+    }
+    for (i = 0; i < CPU_NB_REGS; i++) {
+        env->xmm_regs[i].XMM_Q(0) = ldq_p(buf + HVF_FX_XMM + i * 16);
+        env->xmm_regs[i].XMM_Q(1) = ldq_p(buf + HVF_FX_XMM + i * 16 + 8);
+    }
+}
+
+/*
+ * VM entry checks the IA-32e mode control against EFER.LMA, and with
+ * PAE paging outside of long mode, loads the PDPTEs from the VMCS rather
+ * than from the guest's CR3.
+ */
+static void hvf_set_paging_mode(CPUState *cpu, hv_vcpuid_t id)
+{
+    CPUX86State *env = &X86_CPU(cpu)->env;
+    uint64_t entry = hvf_rvmcs(id, VMCS_CTRL_VMENTRY_CONTROLS);
+    int i;
+
+    if (env->efer & MSR_EFER_LMA) {
+        entry |= VMENTRY_GUEST_IA32E;
+    } else {
+        entry &= ~VMENTRY_GUEST_IA32E;
+    }
+    hvf_wvmcs(id, VMCS_CTRL_VMENTRY_CONTROLS, entry);
+
+    if ((env->cr[0] & CR0_PG_MASK) && (env->cr[4] & CR4_PAE_MASK) &&
+        !(env->efer & MSR_EFER_LMA)) {
+        for (i = 0; i < 4; i++) {
+            uint64_t pdpte = ldq_phys(CPU(cpu)->as,
+                                      (env->cr[3] & ~0x1fULL) + i * 8);
+
+            hvf_wvmcs(id, VMCS_GUEST_PDPTE0 + i * 2, pdpte);
+        }
+    }
+}
+
+/* Write env to the vcpu; the TSC only when @full, on reset and at init */
+static void hvf_set_registers(CPUState *cpu, bool full)
+{
+    hv_vcpuid_t id = cpu->hvf_vcpu->id;
+    CPUX86State *env = &X86_CPU(cpu)->env;
+    int v86 = (env->eflags & VM_MASK) != 0;
+    uint64_t tr_ar;
+    int i;
+
+    for (i = 0; i < CPU_NB_REGS; i++) {
+        hvf_wreg(id, hvf_gprs[i], env->regs[i]);
+    }
+    hvf_wreg(id, HV_X86_RIP, env->eip);
+    hvf_wreg(id, HV_X86_RFLAGS, env->eflags);
+
+    for (i = 0; i < 6; i++) {
+        /* Virtual-8086 segments are read/write data, DPL 3 */
+        hvf_set_segment(id, &hvf_segment_fields[i], &env->segs[i],
+                        v86 ? 0xf3 : hvf_seg_ar(&env->segs[i]));
+    }
+    hvf_set_segment(id, &hvf_ldtr_fields, &env->ldt, hvf_seg_ar(&env->ldt));
+    /* VM entry only takes a busy TSS, and a 64-bit one in long mode */
+    tr_ar = hvf_seg_ar(&env->tr) & ~HVF_AR_UNUSABLE;
+    if (env->efer & MSR_EFER_LMA) {
+        tr_ar = (tr_ar & ~0xf) | 11;
+    } else {
+        tr_ar |= 2;
+    }
+    hvf_set_segment(id, &hvf_tr_fields, &env->tr, tr_ar);
+
+    hvf_wvmcs(id, VMCS_GUEST_GDTR_BASE, env->gdt.base);
+    hvf_wvmcs(id, VMCS_GUEST_GDTR_LIMIT, env->gdt.limit);
+    hvf_wvmcs(id, VMCS_GUEST_IDTR_BASE, env->idt.base);
+    hvf_wvmcs(id, VMCS_GUEST_IDTR_LIMIT, env->idt.limit);
+
+    /*
+     * VMX operation needs CR0.NE and CR4.VMXE set, the guest reads its own
+     * values from the shadows. Changes to PE and PG exit, for QEMU to
+     * switch EFER.LMA, see hvf_handle_cr().
+     */
+    hvf_wvmcs(id, VMCS_GUEST_CR0, env->cr[0] | CR0_NE_MASK | CR0_ET_MASK);
+    hvf_wvmcs(id, VMCS_CTRL_CR0_SHADOW, env->cr[0]);
+    hvf_wreg(id, HV_X86_CR2, env->cr[2]);
+    hvf_wvmcs(id, VMCS_GUEST_CR3, env->cr[3]);
+    hvf_wvmcs(id, VMCS_GUEST_CR4, env->cr[4] | CR4_VMXE_MASK);
+    hvf_wvmcs(id, VMCS_CTRL_CR4_SHADOW, env->cr[4]);
+    hvf_wvmcs(id, VMCS_GUEST_IA32_EFER, env->efer);
+    hvf_set_paging_mode(cpu, id);
+
+    hvf_set_fpu(id, env);
+
+    hvf_wvmcs(id, VMCS_GUEST_IA32_SYSENTER_CS, env->sysenter_cs);
+    hvf_wvmcs(id, VMCS_GUEST_IA32_SYSENTER_ESP, env->sysenter_esp);
+    hvf_wvmcs(id, VMCS_GUEST_IA32_SYSENTER_EIP, env->sysenter_eip);
+    hv_vcpu_write_msr(id, MSR_STAR, env->star);
+#ifdef TARGET_X86_64
+    hv_vcpu_write_msr(id, MSR_LSTAR, env->lstar);
+    hv_vcpu_write_msr(id, MSR_CSTAR, env->cstar);
+    hv_vcpu_write_msr(id, MSR_FMASK, env->fmask);
+    hv_vcpu_write_msr(id, MSR_KERNELGSBASE, env->kernelgsbase);
+#endif
+    hv_vcpu_write_msr(id, MSR_TSC_AUX, env->tsc_aux);
+    if (full) {
+        /* Writing the TSC back while the guest runs would make it jump */
+        hv_vcpu_write_msr(id, MSR_IA32_TSC, env->tsc);
+        hvf_wvmcs(id, VMCS_GUEST_INTERRUPTIBILITY, 0);
+    }
+}
+
+static void hvf_get_registers(CPUState *cpu)
+{
+    hv_vcpuid_t id = cpu->hvf_vcpu->id;
+    CPUX86State *env = &X86_CPU(cpu)->env;
+    int i;
+
+    for (i = 0; i < CPU_NB_REGS; i++) {
+        env->regs[i] = hvf_rreg(id, hvf_gprs[i]);
+    }
+    env->eip = hvf_rreg(id, HV_X86_RIP);
+    env->eflags = hvf_rreg(id, HV_X86_RFLAGS);
+
+    for (i = 0; i < 6; i++) {
+        hvf_get_segment(id, &hvf_segment_fields[i], &env->segs[i]);
+    }
+    hvf_get_segment(id, &hvf_ldtr_fields, &env->ldt);
+    hvf_get_segment(id, &hvf_tr_fields, &env->tr);
+
+    env->gdt.base = hvf_rvmcs(id, VMCS_GUEST_GDTR_BASE);
+    env->gdt.limit = hvf_rvmcs(id, VMCS_GUEST_GDTR_LIMIT);
+    env->idt.base = hvf_rvmcs(id, VMCS_GUEST_IDTR_BASE);
+    env->idt.limit = hvf_rvmcs(id, VMCS_GUEST_IDTR_LIMIT);
+
+    env->cr[0] = hvf_get_cr0(id);
+    env->cr[2] = hvf_rreg(id, HV_X86_CR2);
+    env->cr[3] = hvf_rvmcs(id, VMCS_GUEST_CR3);
+    env->cr[4] = hvf_get_cr4(id);
+    env->efer = hvf_rvmcs(id, VMCS_GUEST_IA32_EFER);
+
+    hvf_get_fpu(id, env);
+
+    env->sysenter_cs = hvf_rvmcs(id, VMCS_GUEST_IA32_SYSENTER_CS);
+    env->sysenter_esp = hvf_rvmcs(id, VMCS_GUEST_IA32_SYSENTER_ESP);
+    env->sysenter_eip = hvf_rvmcs(id, VMCS_GUEST_IA32_SYSENTER_EIP);
+    hv_vcpu_read_msr(id, MSR_STAR, &env->star);
+#ifdef TARGET_X86_64
+    hv_vcpu_read_msr(id, MSR_LSTAR, (uint64_t *)&env->lstar);
+    hv_vcpu_read_msr(id, MSR_CSTAR, (uint64_t *)&env->cstar);
+    hv_vcpu_read_msr(id, MSR_FMASK, (uint64_t *)&env->fmask);
+    hv_vcpu_read_msr(id, MSR_KERNELGSBASE, (uint64_t *)&env->kernelgsbase);
+#endif
+    hv_vcpu_read_msr(id, MSR_TSC_AUX, &env->tsc_aux);
+    hv_vcpu_read_msr(id, MSR_IA32_TSC, &env->tsc);
+
+    hvf_update_hflags(env);
+}
+
+static void do_hvf_cpu_synchronize_state(void *arg)
+{
+    CPUState *cpu = arg;
+
+    /* The caller may change anything: write it all back before running */
+    hvf_get_registers(cpu);
+    cpu->hvf_vcpu->regs_dirty = true;
+}
+
+void hvf_cpu_synchronize_state(CPUState *cpu)
+{
+    /* Once dirty, env stays the authoritative copy until the vcpu runs */
+    if (!cpu->hvf_vcpu->regs_dirty) {
+        run_on_cpu(cpu, do_hvf_cpu_synchronize_state, cpu);
+    }
+}
+
+static void do_hvf_cpu_synchronize_post_reset(void *arg)
+{
+    CPUState *cpu = arg;
+
+    hvf_set_registers(cpu, true);
+    cpu->hvf_vcpu->regs_dirty = false;
+}
+
+void hvf_cpu_synchronize_post_reset(CPUState *cpu)
+{
+    run_on_cpu(cpu, do_hvf_cpu_synchronize_post_reset, cpu);
+}
+
+void hvf_cpu_synchronize_post_init(CPUState *cpu)
+{
+    run_on_cpu(cpu, do_hvf_cpu_synchronize_post_reset, cpu);
+}
+
+/*
+ * Enough of env for cpu_memory_rw_debug() to walk the guest page tables,
+ * without the cost of a full sync on every MMIO exit
+ */
+static void hvf_get_mmu_state(CPUState *cpu)
+{
+    hv_vcpuid_t id = cpu->hvf_vcpu->id;
+    CPUX86State *env = &X86_CPU(cpu)->env;
+
+    if (cpu->hvf_vcpu->regs_dirty) {
+        return;
+    }
+    env->cr[0] = hvf_get_cr0(id);
+    env->cr[3] = hvf_rvmcs(id, VMCS_GUEST_CR3);
+    env->cr[4] = hvf_get_cr4(id);
+    env->efer = hvf_rvmcs(id, VMCS_GUEST_IA32_EFER);
+    if (env->efer & MSR_EFER_LMA) {
+        env->hflags |= HF_LMA_MASK;
+    } else {
+        env->hflags &= ~HF_LMA_MASK;
+    }
+}
+
+/*
+ * vcpu run loop
+ */
+
+/* Step over the instruction that exited, which QEMU emulated */
+static void hvf_skip_insn(CPUState *cpu, uint64_t len)
+{
+    hv_vcpuid_t id = cpu->hvf_vcpu->id;
+    uint64_t intr;
+
+    if (cpu->hvf_vcpu->regs_dirty) {
+        X86_CPU(cpu)->env.eip += len;
+    } else {
+        hvf_wreg(id, HV_X86_RIP, hvf_rreg(id, HV_X86_RIP) + len);
+    }
+
+    /* Like any instruction, it ends the shadow of a preceding STI */
+    intr = hvf_rvmcs(id, VMCS_GUEST_INTERRUPTIBILITY);
+    if (intr & (HVF_INTR_STI | HVF_INTR_MOV_SS)) {
+        hvf_wvmcs(id, VMCS_GUEST_INTERRUPTIBILITY,
+                  intr & ~(HVF_INTR_STI | HVF_INTR_MOV_SS));
+    }
+}
+
+static uint32_t hvf_cpu_in(uint16_t port, int size)
+{
+    switch (size) {
+    case 1:
+        return cpu_inb(port);
+    case 2:
+        return cpu_inw(port);
+    default:
+        return cpu_inl(port);
+    }
+}
+
+static void hvf_cpu_out(uint16_t port, int size, uint32_t value)
+{
+    switch (size) {
+    case 1:
+        cpu_outb(port, value);
+        break;
+    case 2:
+        cpu_outw(port, value);
+        break;
+    default:
+        cpu_outl(port, value);
+        break;
+    }
+}
+
+/* INS and OUTS, with or without REP: rare enough to do on env */
+static int hvf_handle_string_io(CPUState *cpu, uint64_t qual, uint64_t len)
+{
+    CPUX86State *env = &X86_CPU(cpu)->env;
+    uint16_t port = HVF_IO_PORT(qual);
+    int size = HVF_IO_SIZE(qual);
+    bool in = qual & HVF_IO_IN;
+    int reg = in ? R_EDI : R_ESI;
+    SegmentCache *seg = &env->segs[in ? R_ES : R_DS];
+    target_ulong mask, base, count = 1;
+    target_long step;
+    uint8_t data[4];
+
+    hvf_cpu_synchronize_state(cpu);
+
+    if (env->hflags & HF_CS64_MASK) {
+        mask = (target_ulong)-1;
+        base = 0;
+    } else {
+        mask = (env->hflags & HF_CS32_MASK) ? 0xffffffff : 0xffff;
+        base = seg->base;
+    }
+    step = (env->eflags & DF_MASK) ? -size : size;
+    if (qual & HVF_IO_REP) {
+        count = env->regs[R_ECX] & mask;
+    }
+
+    while (count--) {
+        target_ulong addr = base + (env->regs[reg] & mask);
+
+        if (in) {
+            stl_p(data, hvf_cpu_in(port, size));
+            if (cpu_memory_rw_debug(cpu, addr, data, size, 1) < 0) {
+                break;
+            }
+        } else {
+            if (cpu_memory_rw_debug(cpu, addr, data, size, 0) < 0) {
+                break;
+            }
+            hvf_cpu_out(port, size, ldl_p(data));
+        }
+        env->regs[reg] = (env->regs[reg] & ~mask) |
+                         ((env->regs[reg] + step) & mask);
+        if (qual & HVF_IO_REP) {
+            env->regs[R_ECX] = (env->regs[R_ECX] & ~mask) |
+                               ((env->regs[R_ECX] - 1) & mask);
+        }
+    }
+    if (count != (target_ulong)-1) {
+        error_report("HVF: Failed to access guest memory at 0x" TARGET_FMT_lx
+                     " for port 0x%x", base + (env->regs[reg] & mask), port);
+        return -1;
+    }
+
+    hvf_skip_insn(cpu, len);
+    return 0;
+}
+
+static int hvf_handle_io(CPUState *cpu, uint64_t qual, uint64_t len)
+{
+    hv_vcpuid_t id = cpu->hvf_vcpu->id;
+    uint16_t port = HVF_IO_PORT(qual);
+    int size = HVF_IO_SIZE(qual);
+    uint64_t rax;
+
+    vcpu_exit_account_address(cpu, true, port);
+    if (qual & HVF_IO_STRING) {
+        return hvf_handle_string_io(cpu, qual, len);
+    }
+
+    rax = hvf_rreg(id, HV_X86_RAX);
+    if (qual & HVF_IO_IN) {
+        uint32_t value = hvf_cpu_in(port, size);
+
+        switch (size) {
+        case 1:
+            rax = (rax & ~0xffULL) | (value & 0xff);
+            break;
+        case 2:
+            rax = (rax & ~0xffffULL) | (value & 0xffff);
+            break;
+        default:
+            rax = value;
+            break;
+        }
+        hvf_wreg(id, HV_X86_RAX, rax);
+    } else {
+        hvf_cpu_out(port, size, rax);
+    }
+    hvf_skip_insn(cpu, len);
+    return 0;
+}
+
+/*
+ * An access to guest physical memory that isn't mapped, or a write to
+ * ROM: decode the move that made it and perform it on the memory map.
+ */
+static int hvf_handle_mmio(CPUState *cpu, uint64_t qual)
+{
+    hv_vcpuid_t id = cpu->hvf_vcpu->id;
+    X86CPU *x86_cpu = X86_CPU(cpu);
+    CPUX86State *env = &x86_cpu->env;
+    uint64_t gpa = hvf_rvmcs(id, VMCS_GUEST_PHYSICAL_ADDRESS);
+    uint8_t code[HVF_INSN_MAX_LEN];
+    uint8_t data[8];
+    SegmentCache cs;
+    target_ulong pc;
+    HvfMmioInsn insn;
+    int mode, len;
+
+    vcpu_exit_account_address(cpu, false, gpa);
+    if (qual & HVF_EPT_FETCH) {
+        error_report("HVF: Guest executes from unmapped memory at 0x%" PRIx64,
+                     gpa);
+        return -1;
+    }
+
+    hvf_get_mmu_state(cpu);
+    hvf_get_segment(id, &hvf_segment_fields[R_CS], &cs);
+    if ((env->efer & MSR_EFER_LMA) && (cs.flags & DESC_L_MASK)) {
+        mode = 64;
+    } else {
+        mode = (cs.flags & DESC_B_MASK) ? 32 : 16;
+    }
+    pc = cs.base + hvf_rreg(id, HV_X86_RIP);
+    if (mode != 64) {
+        pc = (uint32_t)pc;
+    }
+
+    /* The instruction may end on the next page, or not: try both */
+    len = MIN(HVF_INSN_MAX_LEN, TARGET_PAGE_SIZE - (pc & ~TARGET_PAGE_MASK));
+    if (cpu_memory_rw_debug(cpu, pc, code, len, 0) < 0) {
+        error_report("HVF: Failed to read the instruction at 0x"
+                     TARGET_FMT_lx, pc);
+        return -1;
+    }
+    if (len < HVF_INSN_MAX_LEN &&
+        cpu_memory_rw_debug(cpu, pc + len, code + len,
+                            HVF_INSN_MAX_LEN - len, 0) == 0) {
+        len = HVF_INSN_MAX_LEN;
+    }
+
+    if (hvf_decode_mmio(code, len, mode, &insn) < 0 ||
+        insn.reg >= CPU_NB_REGS) {
+        error_report("HVF: Failed to decode the MMIO access at 0x%" PRIx64
+                     ", instruction %02x %02x %02x %02x", gpa,
+                     code[0], code[1], code[2], code[3]);
+        return -1;
+    }
+
+    memset(data, 0, sizeof(data));
+    if (insn.write) {
+        uint64_t value = insn.reg < 0 ? 0 : hvf_rreg(id, hvf_gprs[insn.reg]);
+
+        stq_p(data, hvf_mmio_store_value(&insn, value));
+        cpu_physical_memory_rw(gpa, data, insn.size, 1);
+    } else {
+        uint64_t old = hvf_rreg(id, hvf_gprs[insn.reg]);
+
+        cpu_physical_memory_rw(gpa, data, insn.size, 0);
+        hvf_wreg(id, hvf_gprs[insn.reg],
+                 hvf_mmio_load_value(&insn, old, ldq_p(data)));
+    }
+    hvf_skip_insn(cpu, insn.len);
+    return 0;
+}
+
+/*
+ * Control register accesses that exit: PE and PG, which switch the paging
+ * mode, VMXE, and CR8, which is QEMU's APIC TPR.
+ */
+static int hvf_handle_cr(CPUState *cpu, uint64_t qual, uint64_t len)
+{
+    X86CPU *x86_cpu = X86_CPU(cpu);
+    CPUX86State *env = &x86_cpu->env;
+    int cr = HVF_CR_NUM(qual);
+    int gpr = HVF_CR_GPR(qual);
+    target_ulong value;
+
+    hvf_cpu_synchronize_state(cpu);
+
+    switch (HVF_CR_TYPE(qual)) {
+    case 0:     /* mov to cr */
+        value = env->regs[gpr];
+        switch (cr) {
+        case 0:
+            cpu_x86_update_cr0(env, value);
+            break;
+        case 4:
+            cpu_x86_update_cr4(env, value);
+            break;
+        case 8:
+            cpu_set_apic_tpr(x86_cpu->apic_state, value & 0xf);
+            break;
+        default:
+            goto unexpected;
+        }
+        break;
+    case 1:     /* mov from cr */
+        if (cr == 8) {
+            env->regs[gpr] = cpu_get_apic_tpr(x86_cpu->apic_state);
+        } else if (cr == 0 || cr == 3 || cr == 4) {
+            env->regs[gpr] = env->cr[cr];
+        } else {
+            goto unexpected;
+        }
+        break;
+    case 3:     /* lmsw, which can set PE but not clear it */
+        value = (env->cr[0] & ~0xeULL) | (HVF_CR_LMSW(qual) & 0xf);
+        cpu_x86_update_cr0(env, value | (env->cr[0] & CR0_PE_MASK));
+        break;
+    default:
+        goto unexpected;
+    }
+    hvf_skip_insn(cpu, len);
+    return 0;
+
+unexpected:
+    error_report("HVF: Unexpected access to CR%d, qualification 0x%" PRIx64,
+                 cr, qual);
+    return -1;
+}
+
+static int hvf_handle_msr(CPUState *cpu, bool write, uint64_t len)
+{
+    CPUX86State *env = &X86_CPU(cpu)->env;
+
+    /* EFER, the APIC base and the like change more than a register */
+    hvf_cpu_synchronize_state(cpu);
+    if (write) {
+        helper_wrmsr(env);
+    } else {
+        helper_rdmsr(env);
+    }
+    hvf_skip_insn(cpu, len);
+    return 0;
+}
+
+/*
+ * Answer CPUID from the CPU model, so that the guest sees the features
+ * QEMU emulates and its own APIC ID.
+ */
+static int hvf_handle_cpuid(CPUState *cpu, uint64_t len)
+{
+    hv_vcpuid_t id = cpu->hvf_vcpu->id;
+    CPUX86State *env = &X86_CPU(cpu)->env;
+    uint32_t index = hvf_rreg(id, HV_X86_RAX);
+    uint32_t count = hvf_rreg(id, HV_X86_RCX);
+    uint32_t eax, ebx, ecx, edx;
+
+    cpu_x86_cpuid(env, index, count, &eax, &ebx, &ecx, &edx);
+    if (index == 1) {
+        /* No nested VMX, and MONITOR/MWAIT are trapped as NOPs */
+        ecx &= ~(CPUID_EXT_VMX | CPUID_EXT_MONITOR);
+    }
+
+    hvf_wreg(id, HV_X86_RAX, eax);
+    hvf_wreg(id, HV_X86_RBX, ebx);
+    hvf_wreg(id, HV_X86_RCX, ecx);
+    hvf_wreg(id, HV_X86_RDX, edx);
+    hvf_skip_insn(cpu, len);
+    return 0;
+}
+
+static int hvf_handle_xsetbv(CPUState *cpu, uint64_t len)
+{
+    hv_vcpuid_t id = cpu->hvf_vcpu->id;
+    uint64_t xcr0;
+
+    if (hvf_rreg(id, HV_X86_RCX) != 0) {
+        error_report("HVF: XSETBV of an unknown XCR");
+        return -1;
+    }
+    xcr0 = (uint32_t)hvf_rreg(id, HV_X86_RAX) |
+           hvf_rreg(id, HV_X86_RDX) << 32;
+    hvf_wreg(id, HV_X86_XCR0, xcr0);
+    X86_CPU(cpu)->env.xcr0 = xcr0;
+    hvf_skip_insn(cpu, len);
+    return 0;
+}
+
+static int hvf_handle_halt(CPUState *cpu, uint64_t len)
+{
+    CPUX86State *env = &X86_CPU(cpu)->env;
+
+    /* Unlike on HAXM, the vcpu stops on the HLT, not after it */
+    hvf_skip_insn(cpu, len);
+    if (!((cpu->interrupt_request & CPU_INTERRUPT_HARD) &&
+          (env->eflags & IF_MASK)) &&
+        !(cpu->interrupt_request & CPU_INTERRUPT_NMI)) {
+        cpu->exception_index = EXCP_HLT;
+        cpu->halted = 1;
+        return 1;
+    }
+    return 0;
+}
+
+/* Handle what QEMU requested of the vcpu while it was out of the guest */
+static void hvf_vcpu_process_async_events(CPUState *cpu)
+{
+    X86CPU *x86_cpu = X86_CPU(cpu);
+    CPUX86State *env = &x86_cpu->env;
+
+    if ((cpu->interrupt_request & CPU_INTERRUPT_INIT) &&
+        !(env->hflags & HF_SMM_MASK)) {
+        hvf_cpu_synchronize_state(cpu);
+        do_cpu_init(x86_cpu);
+    }
+
+    if (cpu->interrupt_request & CPU_INTERRUPT_POLL) {
+        cpu->interrupt_request &= ~CPU_INTERRUPT_POLL;
+        apic_poll_irq(x86_cpu->apic_state);
+    }
+
+    if (((cpu->interrupt_request & CPU_INTERRUPT_HARD) &&
+         (env->eflags & IF_MASK)) ||
+        (cpu->interrupt_request & CPU_INTERRUPT_NMI)) {
+        cpu->halted = 0;
+    }
+
+    if (cpu->interrupt_request & CPU_INTERRUPT_SIPI) {
+        hvf_cpu_synchronize_state(cpu);
+        do_cpu_sipi(x86_cpu);
+    }
+
+    if (cpu->interrupt_request & CPU_INTERRUPT_TPR) {
+        cpu->interrupt_request &= ~CPU_INTERRUPT_TPR;
+        hvf_cpu_synchronize_state(cpu);
+        apic_handle_tpr_access_report(x86_cpu->apic_state, env->eip,
+                                      env->tpr_access_type);
+    }
+}
+
+/*
+ * Inject a pending NMI or interrupt if the guest can take it, or ask for
+ * an exit as soon as it can.
+ */
+static void hvf_vcpu_pre_run(CPUState *cpu)
+{
+    hv_vcpuid_t id = cpu->hvf_vcpu->id;
+    CPUX86State *env = &X86_CPU(cpu)->env;
+    uint64_t intr = hvf_rvmcs(id, VMCS_GUEST_INTERRUPTIBILITY);
+    uint64_t ctls = hvf_rvmcs(id, VMCS_CTRL_CPU_BASED);
+    uint64_t info = 0;
+
+    /* An event whose delivery the exit interrupted goes first */
+    if (hvf_rvmcs(id, VMCS_CTRL_VMENTRY_IRQ_INFO) & IRQ_INFO_VALID) {
+        return;
+    }
+
+    if (cpu->interrupt_request & CPU_INTERRUPT_NMI) {
+        if (!(intr & (HVF_INTR_NMI | HVF_INTR_MOV_SS))) {
+            cpu->interrupt_request &= ~CPU_INTERRUPT_NMI;
+            info = IRQ_INFO_VALID | IRQ_INFO_NMI | 2;
+        } else {
+            ctls |= CPU_BASED_VIRTUAL_NMI_WND;
+        }
+    }
+
+    if (!info && (cpu->interrupt_request & CPU_INTERRUPT_HARD)) {
+        if ((env->eflags & IF_MASK) &&
+            !(intr & (HVF_INTR_STI | HVF_INTR_MOV_SS))) {
+            int irq;
+
+            cpu->interrupt_request &= ~CPU_INTERRUPT_HARD;
+            irq = cpu_get_pic_interrupt(env);
+            if (irq >= 0) {
+                info = IRQ_INFO_VALID | IRQ_INFO_EXT_IRQ | irq;
+            }
+        } else {
+            ctls |= CPU_BASED_IRQ_WND;
+        }
+    }
+
+    if (info) {
+        hvf_wvmcs(id, VMCS_CTRL_VMENTRY_IRQ_INFO, info);
+    }
+    hvf_wvmcs(id, VMCS_CTRL_CPU_BASED, ctls);
+}
+
+static void hvf_vcpu_post_run(CPUState *cpu)
+{
+    hv_vcpuid_t id = cpu->hvf_vcpu->id;
+    CPUX86State *env = &X86_CPU(cpu)->env;
+    uint64_t idt_info = hvf_rvmcs(id, VMCS_RO_IDT_VECTOR_INFO);
+
+    /* Enough of the state for cpu_has_work() and interrupt injection */
+    env->eflags = hvf_rreg(id, HV_X86_RFLAGS);
+
+    /* The framework leaves the reinjection of an interrupted event to us */
+    if (idt_info & IRQ_INFO_VALID) {
+        hvf_wvmcs(id, VMCS_CTRL_VMENTRY_IRQ_INFO, idt_info & 0x80000fff);
+        if (idt_info & IRQ_INFO_ERROR_VALID) {
+            hvf_wvmcs(id, VMCS_CTRL_VMENTRY_EXC_ERROR,
+                      hvf_rvmcs(id, VMCS_RO_IDT_VECTOR_ERROR));
+        }
+        hvf_wvmcs(id, VMCS_CTRL_VMENTRY_INSTR_LEN,
+                  hvf_rvmcs(id, VMCS_RO_VMEXIT_INSTR_LEN));
+    }
+}
+
+/* Stop asking for the window exit that just happened */
+static void hvf_clear_window(CPUState *cpu, uint64_t ctl)
+{
+    hv_vcpuid_t id = cpu->hvf_vcpu->id;
+
+    hvf_wvmcs(id, VMCS_CTRL_CPU_BASED,
+              hvf_rvmcs(id, VMCS_CTRL_CPU_BASED) & ~ctl);
+}
+
+/*
+ * Run the vcpu until QEMU has something to do outside of it: a halt, a
+ * kick, or a fatal exit. Port and MMIO exits are handled in the loop.
+ */
+static int hvf_vcpu_run(CPUState *cpu)
+{
+    struct hvf_vcpu *vcpu = cpu->hvf_vcpu;
+    int ret = 0;
+
+    hvf_vcpu_process_async_events(cpu);
+    if (cpu->halted) {
+        cpu->exception_index = EXCP_HLT;
+        cpu->exit_request = 0;
+        return 0;
+    }
+
+    do {
+        VcpuExitReason reason;
+        uint64_t exit_reason, qual, len;
+        int64_t exit_ns;
+        hv_return_t r;
+
+        if (cpu->exit_request) {
+            break;
+        }
+
+        if (vcpu->regs_dirty) {
+            hvf_set_registers(cpu, false);
+            vcpu->regs_dirty = false;
+        }
+        hvf_vcpu_pre_run(cpu);
+
+        qemu_mutex_unlock_iothread();
+        r = hv_vcpu_run(vcpu->id);
+        exit_ns = get_clock();
+        qemu_mutex_lock_iothread();
+        current_cpu = cpu;
+
+        if (r != HV_SUCCESS) {
+            error_report("HVF: Failed to run vcpu %d (%x)", cpu->cpu_index,
+                         r);
+            return -1;
+        }
+        hvf_vcpu_post_run(cpu);
+
+        exit_reason = hvf_rvmcs(vcpu->id, VMCS_RO_EXIT_REASON) & 0xffff;
+        qual = hvf_rvmcs(vcpu->id, VMCS_RO_EXIT_QUALIFIC);
+        len = hvf_rvmcs(vcpu->id, VMCS_RO_VMEXIT_INSTR_LEN);
+
+        switch (exit_reason) {
+        case VMX_REASON_EPT_VIOLATION:
+            reason = VCPU_EXIT_REASON_MMIO;
+            ret = hvf_handle_mmio(cpu, qual);
+            break;
+        case VMX_REASON_IO:
+            reason = VCPU_EXIT_REASON_IO;
+            ret = hvf_handle_io(cpu, qual, len);
+            break;
+        case VMX_REASON_IRQ:
+        case VMX_REASON_EXC_NMI:
+            /* A host interrupt, or hv_vcpu_interrupt() */
+            reason = VCPU_EXIT_REASON_INTERRUPT;
+            break;
+        case VMX_REASON_IRQ_WND:
+            reason = VCPU_EXIT_REASON_INTERRUPT;
+            hvf_clear_window(cpu, CPU_BASED_IRQ_WND);
+            break;
+        case VMX_REASON_VIRTUAL_NMI_WND:
+            reason = VCPU_EXIT_REASON_INTERRUPT;
+            hvf_clear_window(cpu, CPU_BASED_VIRTUAL_NMI_WND);
+            break;
+        case VMX_REASON_HLT:
+            reason = VCPU_EXIT_REASON_HLT;
+            ret = hvf_handle_halt(cpu, len);
+            break;
+        case VMX_REASON_MOV_CR:
+            reason = VCPU_EXIT_REASON_OTHER;
+            ret = hvf_handle_cr(cpu, qual, len);
+            break;
+        case VMX_REASON_RDMSR:
+        case VMX_REASON_WRMSR:
+            reason = VCPU_EXIT_REASON_OTHER;
+            ret = hvf_handle_msr(cpu, exit_reason == VMX_REASON_WRMSR, len);
+            break;
+        case VMX_REASON_CPUID:
+            reason = VCPU_EXIT_REASON_OTHER;
+            ret = hvf_handle_cpuid(cpu, len);
+            break;
+        case VMX_REASON_XSETBV:
+            reason = VCPU_EXIT_REASON_OTHER;
+            ret = hvf_handle_xsetbv(cpu, len);
+            break;
+        case VMX_REASON_MWAIT:
+        case VMX_REASON_MONITOR:
+            reason = VCPU_EXIT_REASON_OTHER;
+            hvf_skip_insn(cpu, len);
+            break;
+        case VMX_REASON_VMCALL:
+            /* No hypercalls: #UD, as on hardware without VMX */
+            reason = VCPU_EXIT_REASON_OTHER;
+            hvf_wvmcs(vcpu->id, VMCS_CTRL_VMENTRY_IRQ_INFO,
+                      IRQ_INFO_VALID | IRQ_INFO_HARD_EXC | EXCP06_ILLOP);
+            break;
+        case VMX_REASON_TRIPLE_FAULT:
+            /* Reset, as the hardware would */
+            reason = VCPU_EXIT_REASON_SHUTDOWN;
+            fprintf(stderr, "HVF: triple fault, resetting\n");
+            hvf_cpu_synchronize_state(cpu);
+            cpu_dump_state(cpu, stderr, fprintf, 0);
+            qemu_system_reset_request();
+            ret = 1;
+            break;
+        default:
+            reason = VCPU_EXIT_REASON_OTHER;
+            error_report("HVF: Unexpected exit %" PRIu64 " from vcpu %d, "
+                         "qualification 0x%" PRIx64, exit_reason,
+                         cpu->cpu_index, qual);
+            hvf_cpu_synchronize_state(cpu);
+            cpu_dump_state(cpu, stderr, fprintf, 0);
+            qemu_system_reset_request();
+            ret = 1;
+            break;
+        }
+        vcpu_exit_account(cpu, reason, exit_ns);
+    } while (!ret);
+
+    if (cpu->exit_request) {
+        cpu->exit_request = 0;
+        cpu->exception_index = EXCP_INTERRUPT;
+    }
+    return ret < 0 ? ret : 0;
+}
+
+int hvf_vcpu_exec(CPUState *cpu)
+{
+    int ret;
+
+    while (1) {
+        if (cpu->exception_index >= EXCP_INTERRUPT) {
+            ret = cpu->exception_index;
+            cpu->exception_index = -1;
+            break;
+        }
+
+        if (hvf_vcpu_run(cpu) < 0) {
+            hvf_cpu_synchronize_state(cpu);
+            cpu_dump_state(cpu, stderr, fprintf, 0);
+            abort();
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * A kick landing between the exit_request check and the entry into the
+ * guest is only seen at the next exit, at the latest on the next host
+ * timer interrupt.
+ */
+void hvf_vcpu_kick(CPUState *cpu)
+{
+    struct hvf_vcpu *vcpu = cpu->hvf_vcpu;
+
+    cpu->exit_request = 1;
+    if (vcpu) {
+        hv_vcpu_interrupt(&vcpu->id, 1);
+    }
+}
+
+int hvf_init_vcpu(CPUState *cpu)
+{
+    struct hvf_state *hvf = &hvf_global;
+    struct hvf_vcpu *vcpu;
+    hv_return_t r;
+    int i;
+
+    vcpu = g_new0(struct hvf_vcpu, 1);
+    r = hv_vcpu_create(&vcpu->id, HV_VCPU_DEFAULT);
+    if (r != HV_SUCCESS) {
+        error_report("HVF: Failed to create vcpu %d (%x)", cpu->cpu_index,
+                     r);
+        g_free(vcpu);
+        return -EINVAL;
+    }
+
+    hvf_wvmcs(vcpu->id, VMCS_CTRL_PIN_BASED,
+              hvf_cap2ctrl(hvf->cap_pinbased,
+                           PIN_BASED_INTR | PIN_BASED_NMI |
+                           PIN_BASED_VIRTUAL_NMI));
+    hvf_wvmcs(vcpu->id, VMCS_CTRL_CPU_BASED,
+              hvf_cap2ctrl(hvf->cap_procbased,
+                           CPU_BASED_HLT | CPU_BASED_MWAIT |
+                           CPU_BASED_MONITOR | CPU_BASED_UNCOND_IO |
+                           CPU_BASED_CR8_LOAD | CPU_BASED_CR8_STORE |
+                           CPU_BASED_SECONDARY_CTLS));
+    hvf_wvmcs(vcpu->id, VMCS_CTRL_CPU_BASED2,
+              hvf_cap2ctrl(hvf->cap_procbased2,
+                           CPU_BASED2_UNRESTRICTED | CPU_BASED2_RDTSCP));
+    hvf_wvmcs(vcpu->id, VMCS_CTRL_VMENTRY_CONTROLS,
+              hvf_cap2ctrl(hvf->cap_entry, VMENTRY_LOAD_EFER));
+    hvf_wvmcs(vcpu->id, VMCS_CTRL_EXC_BITMAP, 0);
+    hvf_wvmcs(vcpu->id, VMCS_CTRL_CR0_MASK, HVF_CR0_MASK);
+    hvf_wvmcs(vcpu->id, VMCS_CTRL_CR4_MASK, HVF_CR4_MASK);
+
+    for (i = 0; i < ARRAY_SIZE(hvf_native_msrs); i++) {
+        hv_vcpu_enable_native_msr(vcpu->id, hvf_native_msrs[i], true);
+    }
+
+    vcpu->regs_dirty = true;
+    cpu->hvf_vcpu = vcpu;
+    return 0;
+}
+
+void hvf_destroy_vcpu(CPUState *cpu)
+{
+    struct hvf_vcpu *vcpu = cpu->hvf_vcpu;
+
+    if (!vcpu) {
+        return;
+    }
+    hv_vcpu_destroy(vcpu->id);
+    g_free(vcpu);
+    cpu->hvf_vcpu = NULL;
+}
+
+/*
+ * Memory slots
+ */
+
+/* HAXSlotSetRam for the slot registry */
+static int hvf_set_ram(uint64_t start_pa, uint32_t size, uint64_t host_va,
+                       int flags)
+{
+    hv_memory_flags_t prot = HV_MEMORY_READ | HV_MEMORY_EXEC;
+    hv_return_t r;
+
+    /* Mapping over a mapped range fails: drop whatever is there first */
+    hv_vm_unmap(start_pa, size);
+
+    /* Writes to ROM exit as MMIO, and QEMU drops them */
+    if (!(flags & HVF_RAM_ROM)) {
+        prot |= HV_MEMORY_WRITE;
+    }
+    r = hv_vm_map((hv_uvaddr_t)(uintptr_t)host_va, start_pa, size, prot);
+    return r == HV_SUCCESS ? 0 : -EINVAL;
+}
+
+static void hvf_set_phys_mem(MemoryRegionSection *section)
+{
+    MemoryRegion *mr = section->mr;
+    hwaddr start_pa = section->offset_within_address_space;
+    ram_addr_t size = int128_get64(section->size);
+    unsigned int delta;
+    void *host_ptr;
+    int flags;
+
+    /* We only care about RAM and ROM */
+    if (!memory_region_is_ram(mr)) {
+        return;
+    }
+
+    /* Adjust start_pa and size so that they are page-aligned. (Cf
+     * kvm_set_phys_mem() in kvm-all.c).
+     */
+    delta = TARGET_PAGE_SIZE - (start_pa & ~TARGET_PAGE_MASK);
+    delta &= ~TARGET_PAGE_MASK;
+    if (delta > size) {
+        return;
+    }
+    start_pa += delta;
+    size -= delta;
+    size &= TARGET_PAGE_MASK;
+    if (!size || start_pa & ~TARGET_PAGE_MASK) {
+        return;
+    }
+
+    host_ptr = memory_region_get_ram_ptr(mr) + section->offset_within_region
+               + delta;
+    flags = memory_region_is_rom(mr) ? HVF_RAM_ROM : 0;
+    hax_slot_register(start_pa, size, (uintptr_t) host_ptr, flags);
+}
+
+static void hvf_region_add(MemoryListener *listener,
+                           MemoryRegionSection *section)
+{
+    hvf_set_phys_mem(section);
+}
+
+/* As with HAX, a range stays mapped until a region replaces it */
+static void hvf_region_del(MemoryListener *listener,
+                           MemoryRegionSection *section)
+{
+}
+
+static void hvf_region_nop(MemoryListener *listener,
+                           MemoryRegionSection *section)
+{
+}
+
+/*
+ * The framework doesn't track the pages the guest writes: report all of
+ * guest RAM as dirty, which is correct for migration, snapshots and the
+ * display, only slower.
+ */
+static void hvf_log_sync(MemoryListener *listener,
+                         MemoryRegionSection *section)
+{
+    MemoryRegion *mr = section->mr;
+
+    if (!memory_region_is_ram(mr)) {
+        return;
+    }
+    memory_region_set_dirty(mr, section->offset_within_region,
+                            int128_get64(section->size));
+}
+
+static void hvf_begin(MemoryListener *listener)
+{
+    hax_slot_begin();
+}
+
+static void hvf_commit(MemoryListener *listener)
+{
+    hax_slot_commit();
+}
+
+static void hvf_log_start(MemoryListener *listener,
+                          MemoryRegionSection *section)
+{
+}
+
+static void hvf_log_stop(MemoryListener *listener,
+                         MemoryRegionSection *section)
+{
+}
+
+static void hvf_log_global_start(struct MemoryListener *listener)
+{
+}
+
+static void hvf_log_global_stop(struct MemoryListener *listener)
+{
+}
+
+static MemoryListener hvf_memory_listener = {
+    .begin = hvf_begin,
+    .commit = hvf_commit,
+    .region_add = hvf_region_add,
+    .region_del = hvf_region_del,
+    .region_nop = hvf_region_nop,
+    .log_start = hvf_log_start,
+    .log_stop = hvf_log_stop,
+    .log_sync = hvf_log_sync,
+    .log_global_start = hvf_log_global_start,
+    .log_global_stop = hvf_log_global_stop,
+    .priority = 10,
+};
+
+/*
+ * VM setup
+ */
+
+static void hvf_handle_interrupt(CPUState *cpu, int mask)
+{
+    cpu->interrupt_request |= mask;
+
+    if (!qemu_cpu_is_self(cpu)) {
+        qemu_cpu_kick(cpu);
+    }
+}
+
+static int hvf_read_caps(struct hvf_state *hvf)
+{
+    if (hv_vmx_read_capability(HV_VMX_CAP_PINBASED,
+                               &hvf->cap_pinbased) != HV_SUCCESS ||
+        hv_vmx_read_capability(HV_VMX_CAP_PROCBASED,
+                               &hvf->cap_procbased) != HV_SUCCESS ||
+        hv_vmx_read_capability(HV_VMX_CAP_PROCBASED2,
+                               &hvf->cap_procbased2) != HV_SUCCESS ||
+        hv_vmx_read_capability(HV_VMX_CAP_ENTRY,
+                               &hvf->cap_entry) != HV_SUCCESS) {
+        error_report("HVF: Failed to read the VMX capabilities");
+        return -1;
+    }
+    return 0;
+}
+
+static int hvf_accel_init(MachineState *ms)
+{
+    struct hvf_state *hvf = &hvf_global;
+    hv_return_t r;
+
+    /* Weak-linked: NULL before macOS 10.10 */
+    if (hv_vm_create == NULL) {
+        fprintf(stderr, "HVF: Hypervisor.framework needs macOS 10.10 or "
+                "later\n");
+        return -ENOSYS;
+    }
+
+    r = hv_vm_create(HV_VM_DEFAULT);
+    if (r != HV_SUCCESS) {
+        fprintf(stderr, "HVF: Failed to create the VM (%x), does the CPU "
+                "support VMX with EPT and unrestricted guests?\n", r);
+        return -ENODEV;
+    }
+
+    if (hvf_read_caps(hvf) < 0) {
+        hv_vm_destroy();
+        return -EINVAL;
+    }
+
+    hvf->vm_created = true;
+    hax_slot_init_registry(hvf_set_ram);
+    memory_listener_register(&hvf_memory_listener, &address_space_memory);
+    cpu_interrupt_handler = hvf_handle_interrupt;
+
+    fprintf(stdout, "HVF is working and emulator runs in fast virt mode.\n");
+    return 0;
+}
+
+static void hvf_accel_class_init(ObjectClass *oc, void *data)
+{
+    AccelClass *ac = ACCEL_CLASS(oc);
+    ac->name = "HVF";
+    ac->init_machine = hvf_accel_init;
+    ac->allowed = &hvf_allowed;
+}
+
+static const TypeInfo hvf_accel_type = {
+    .name = TYPE_HVF_ACCEL,
+    .parent = TYPE_ACCEL,
+    .class_init = hvf_accel_class_init,
+};
+
+static void hvf_type_init(void)
+{
+    type_register_static(&hvf_accel_type);
+}
+
+type_init(hvf_type_init);
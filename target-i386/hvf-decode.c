@@ -0,0 +1,264 @@
+/*
+ * Decoding of the x86 instructions that access MMIO, for HVF
+ *
+ * Copyright (c) 2017 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * Hypervisor.framework exits to QEMU on an access to unmapped guest
+ * physical memory without decoding the instruction, as the HAXM kernel
+ * module does. Guests access device registers with plain moves, the
+ * readl()/writel() family, so those are the only instructions decoded
+ * here; anything else is reported to the caller.
+ */
+
+#include <string.h>
+
+#include "hvf-decode.h"
+
+typedef struct HvfDecoder {
+    const uint8_t *code;
+    int len;
+    int pos;
+} HvfDecoder;
+
+static int hvf_decode_byte(HvfDecoder *d)
+{
+    if (d->pos >= d->len) {
+        return -1;
+    }
+    return d->code[d->pos++];
+}
+
+/* Skip the SIB byte and displacement of a memory operand */
+static int hvf_decode_skip_modrm(HvfDecoder *d, int modrm, int addr_size)
+{
+    int mod = modrm >> 6;
+    int rm = modrm & 7;
+    int disp = 0;
+
+    if (mod == 3) {
+        /* A register operand can't be what accessed memory */
+        return -1;
+    }
+    if (addr_size == 2) {
+        if ((mod == 0 && rm == 6) || mod == 2) {
+            disp = 2;
+        } else if (mod == 1) {
+            disp = 1;
+        }
+    } else {
+        if (rm == 4) {
+            int sib = hvf_decode_byte(d);
+
+            if (sib < 0) {
+                return -1;
+            }
+            if (mod == 0 && (sib & 7) == 5) {
+                disp = 4;
+            }
+        }
+        if ((mod == 0 && rm == 5) || mod == 2) {
+            disp = 4;
+        } else if (mod == 1) {
+            disp = 1;
+        }
+    }
+    d->pos += disp;
+    return d->pos <= d->len ? 0 : -1;
+}
+
+static int hvf_decode_imm(HvfDecoder *d, int size, uint64_t *imm)
+{
+    int i;
+
+    if (d->pos + size > d->len) {
+        return -1;
+    }
+    *imm = 0;
+    for (i = 0; i < size; i++) {
+        *imm |= (uint64_t)d->code[d->pos++] << (i * 8);
+    }
+    return 0;
+}
+
+int hvf_decode_mmio(const uint8_t *code, int code_len, int mode,
+                    HvfMmioInsn *insn)
+{
+    HvfDecoder d = { code, code_len, 0 };
+    bool opsize_prefix = false, addrsize_prefix = false;
+    int rex = 0;
+    int op, modrm, op_size, addr_size;
+    bool byte_reg = false;
+
+    memset(insn, 0, sizeof(*insn));
+    if (d.len > HVF_INSN_MAX_LEN) {
+        d.len = HVF_INSN_MAX_LEN;
+    }
+
+    for (;;) {
+        op = hvf_decode_byte(&d);
+        switch (op) {
+        case 0x66:
+            opsize_prefix = true;
+            rex = 0;
+            continue;
+        case 0x67:
+            addrsize_prefix = true;
+            rex = 0;
+            continue;
+        case 0x26: case 0x2e: case 0x36: case 0x3e: case 0x64: case 0x65:
+        case 0xf0: case 0xf2: case 0xf3:
+            /* Segments and locking don't change what is moved */
+            rex = 0;
+            continue;
+        }
+        if (mode == 64 && (op & 0xf0) == 0x40) {
+            /* Only counts right before the opcode */
+            rex = op;
+            continue;
+        }
+        break;
+    }
+    if (op < 0) {
+        return -1;
+    }
+
+    switch (mode) {
+    case 64:
+        op_size = (rex & 8) ? 8 : opsize_prefix ? 2 : 4;
+        addr_size = addrsize_prefix ? 4 : 8;
+        break;
+    case 32:
+        op_size = opsize_prefix ? 2 : 4;
+        addr_size = addrsize_prefix ? 2 : 4;
+        break;
+    case 16:
+        op_size = opsize_prefix ? 4 : 2;
+        addr_size = addrsize_prefix ? 4 : 2;
+        break;
+    default:
+        return -1;
+    }
+
+    switch (op) {
+    case 0x88:      /* mov r/m8, r8 */
+    case 0x89:      /* mov r/m, r */
+    case 0x8a:      /* mov r8, r/m8 */
+    case 0x8b:      /* mov r, r/m */
+        modrm = hvf_decode_byte(&d);
+        if (modrm < 0 || hvf_decode_skip_modrm(&d, modrm, addr_size) < 0) {
+            return -1;
+        }
+        insn->reg = ((modrm >> 3) & 7) | ((rex & 4) << 1);
+        insn->size = (op & 1) ? op_size : 1;
+        insn->write = !(op & 2);
+        insn->dst_size = insn->size;
+        byte_reg = !(op & 1);
+        break;
+    case 0xc6:      /* mov r/m8, imm8 */
+    case 0xc7:      /* mov r/m, imm */
+        modrm = hvf_decode_byte(&d);
+        if (modrm < 0 || ((modrm >> 3) & 7) != 0 ||
+            hvf_decode_skip_modrm(&d, modrm, addr_size) < 0) {
+            return -1;
+        }
+        insn->size = (op & 1) ? op_size : 1;
+        if (hvf_decode_imm(&d, insn->size == 8 ? 4 : insn->size,
+                           &insn->imm) < 0) {
+            return -1;
+        }
+        if (insn->size == 8) {
+            insn->imm = (uint64_t)(int64_t)(int32_t)insn->imm;
+        }
+        insn->reg = -1;
+        insn->write = true;
+        break;
+    case 0xa0:      /* mov al, moffs8 */
+    case 0xa1:      /* mov ax, moffs */
+    case 0xa2:      /* mov moffs8, al */
+    case 0xa3:      /* mov moffs, ax */
+        d.pos += addr_size;
+        if (d.pos > d.len) {
+            return -1;
+        }
+        insn->reg = 0;
+        insn->size = (op & 1) ? op_size : 1;
+        insn->write = (op & 2) != 0;
+        insn->dst_size = insn->size;
+        break;
+    case 0x0f:
+        op = hvf_decode_byte(&d);
+        if (op != 0xb6 && op != 0xb7 && op != 0xbe && op != 0xbf) {
+            return -1;
+        }
+        /* movzx and movsx, from 8 or 16 bits */
+        modrm = hvf_decode_byte(&d);
+        if (modrm < 0 || hvf_decode_skip_modrm(&d, modrm, addr_size) < 0) {
+            return -1;
+        }
+        insn->reg = ((modrm >> 3) & 7) | ((rex & 4) << 1);
+        insn->size = (op & 1) ? 2 : 1;
+        insn->dst_size = op_size;
+        insn->sign_extend = op >= 0xbe;
+        break;
+    default:
+        return -1;
+    }
+
+    if (byte_reg && !rex && insn->reg >= 4) {
+        /* Without REX, byte registers 4 to 7 are AH, CH, DH and BH */
+        insn->reg -= 4;
+        insn->high_byte = true;
+    }
+    insn->len = d.pos;
+    return 0;
+}
+
+static uint64_t hvf_mmio_mask(int size)
+{
+    return size >= 8 ? ~0ULL : (1ULL << (size * 8)) - 1;
+}
+
+uint64_t hvf_mmio_load_value(const HvfMmioInsn *insn, uint64_t old,
+                             uint64_t data)
+{
+    data &= hvf_mmio_mask(insn->size);
+    if (insn->sign_extend) {
+        int shift = 64 - insn->size * 8;
+
+        data = (uint64_t)((int64_t)(data << shift) >> shift);
+    }
+
+    switch (insn->dst_size) {
+    case 1:
+        if (insn->high_byte) {
+            return (old & ~0xff00ULL) | ((data & 0xff) << 8);
+        }
+        return (old & ~0xffULL) | (data & 0xff);
+    case 2:
+        return (old & ~0xffffULL) | (data & 0xffff);
+    case 4:
+        return data & 0xffffffffULL;
+    default:
+        return data;
+    }
+}
+
+uint64_t hvf_mmio_store_value(const HvfMmioInsn *insn, uint64_t reg_value)
+{
+    uint64_t value;
+
+    if (insn->reg < 0) {
+        value = insn->imm;
+    } else if (insn->high_byte) {
+        value = reg_value >> 8;
+    } else {
+        value = reg_value;
+    }
+    return value & hvf_mmio_mask(insn->size);
+}
@@ -0,0 +1,65 @@
+/*
+ * Decoding of the x86 instructions that access MMIO, for HVF
+ *
+ * Copyright (c) 2017 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HVF_DECODE_H
+#define HVF_DECODE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Longest x86 instruction */
+#define HVF_INSN_MAX_LEN 15
+
+/*
+ * An instruction moving data between a register, or an immediate, and
+ * memory. The EPT violation gives the guest physical address accessed,
+ * so only what is moved, and where to, is decoded; the addressing mode
+ * only matters for the length of the instruction.
+ *
+ * @len: length of the instruction in bytes
+ * @size: bytes accessed in memory
+ * @write: whether the instruction stores to memory
+ * @reg: the register operand, in the order of env->regs, or -1 for an
+ *       immediate stored to memory
+ * @high_byte: @reg is AH, CH, DH or BH; @reg is then 0 to 3
+ * @dst_size: for loads, bytes written to @reg (it is zero-extended to 64
+ *            bits when 4, as x86-64 does)
+ * @sign_extend: for loads, whether the value is sign-extended from @size
+ *               to @dst_size bytes, rather than zero-extended
+ * @imm: the value stored, when @reg is -1
+ */
+typedef struct HvfMmioInsn {
+    int len;
+    int size;
+    bool write;
+    int reg;
+    bool high_byte;
+    int dst_size;
+    bool sign_extend;
+    uint64_t imm;
+} HvfMmioInsn;
+
+/*
+ * Decode the instruction in the @code_len bytes at @code, for a vcpu in
+ * 16-, 32- or 64-bit @mode (the default operand and address size of the
+ * code segment). Returns 0, or -1 if the instruction is not a move this
+ * knows about or is truncated.
+ */
+int hvf_decode_mmio(const uint8_t *code, int code_len, int mode,
+                    HvfMmioInsn *insn);
+
+/* The value of the register loaded with @data, from its @old value */
+uint64_t hvf_mmio_load_value(const HvfMmioInsn *insn, uint64_t old,
+                             uint64_t data);
+
+/* The value stored to memory, given that of the register operand */
+uint64_t hvf_mmio_store_value(const HvfMmioInsn *insn, uint64_t reg_value);
+
+#endif /* HVF_DECODE_H */
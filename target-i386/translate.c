@@ -904,13 +904,34 @@ static CCPrepare gen_prepare_eflags_s(DisasContext *s, TCGv reg)
 /* compute eflags.O to reg */
 static CCPrepare gen_prepare_eflags_o(DisasContext *s, TCGv reg)
 {
+    TCGMemOp size;
+    TCGv t0;
+
     switch (s->cc_op) {
     case CC_OP_ADOX:
     case CC_OP_ADCOX:
         return (CCPrepare) { .cond = TCG_COND_NE, .reg = cpu_cc_src2,
                              .mask = -1, .no_setcond = true };
+    case CC_OP_LOGICB ... CC_OP_LOGICQ:
     case CC_OP_CLR:
         return (CCPrepare) { .cond = TCG_COND_NEVER, .mask = -1 };
+    case CC_OP_MULB ... CC_OP_MULQ:
+        /* Same as C */
+        return (CCPrepare) { .cond = TCG_COND_NE,
+                             .reg = cpu_cc_src, .mask = -1 };
+    case CC_OP_INCB ... CC_OP_INCQ:
+        /* (DATA_TYPE)CC_DST == SIGN_MASK */
+        size = s->cc_op - CC_OP_INCB;
+        t0 = gen_ext_tl(reg, cpu_cc_dst, size, false);
+        return (CCPrepare) { .cond = TCG_COND_EQ, .reg = t0, .mask = -1,
+                             .imm = (target_ulong)1 << ((8 << size) - 1) };
+    case CC_OP_DECB ... CC_OP_DECQ:
+        /* (DATA_TYPE)CC_DST == SIGN_MASK - 1 */
+        size = s->cc_op - CC_OP_DECB;
+        t0 = gen_ext_tl(reg, cpu_cc_dst, size, false);
+        return (CCPrepare) { .cond = TCG_COND_EQ, .reg = t0, .mask = -1,
+                             .imm = ((target_ulong)1 << ((8 << size) - 1))
+                                    - 1 };
     default:
         gen_compute_eflags(s);
         return (CCPrepare) { .cond = TCG_COND_NE, .reg = cpu_cc_src,
@@ -946,7 +967,7 @@ static CCPrepare gen_prepare_eflags_z(DisasContext *s, TCGv reg)
    value 'b'. In the fast case, T0 is guaranted not to be used. */
 static CCPrepare gen_prepare_cc(DisasContext *s, int b, TCGv reg)
 {
-    int inv, jcc_op, cond;
+    int inv, jcc_op, cond, imm;
     TCGMemOp size;
     CCPrepare cc;
     TCGv t0;
@@ -985,6 +1006,56 @@ static CCPrepare gen_prepare_cc(DisasContext *s, int b, TCGv reg)
         }
         break;
 
+    case CC_OP_LOGICB ... CC_OP_LOGICQ:
+        /* C and O are clear, which leaves Z, S and S | Z */
+        size = s->cc_op - CC_OP_LOGICB;
+        switch (jcc_op) {
+        case JCC_BE:
+            cc = gen_prepare_eflags_z(s, reg);
+            break;
+        case JCC_L:
+            cc = gen_prepare_eflags_s(s, reg);
+            break;
+        case JCC_LE:
+            t0 = gen_ext_tl(cpu_tmp4, cpu_cc_dst, size, true);
+            cc = (CCPrepare) { .cond = TCG_COND_LE, .reg = t0, .mask = -1 };
+            break;
+        default:
+            goto slow_jcc;
+        }
+        break;
+
+    case CC_OP_INCB ... CC_OP_INCQ:
+    case CC_OP_DECB ... CC_OP_DECQ:
+        /*
+         * The signed conditions are those of a compare of the operand
+         * with 1 for DEC, and with -1 for INC, as for the dec/jg loops.
+         */
+        switch (jcc_op) {
+        case JCC_L:
+            cond = TCG_COND_LT;
+            goto fast_jcc_incdec;
+        case JCC_LE:
+            cond = TCG_COND_LE;
+        fast_jcc_incdec:
+            if (s->cc_op >= CC_OP_DECB) {
+                size = s->cc_op - CC_OP_DECB;
+                tcg_gen_addi_tl(cpu_tmp4, cpu_cc_dst, 1);
+                imm = 1;
+            } else {
+                size = s->cc_op - CC_OP_INCB;
+                tcg_gen_subi_tl(cpu_tmp4, cpu_cc_dst, 1);
+                imm = -1;
+            }
+            gen_exts(size, cpu_tmp4);
+            cc = (CCPrepare) { .cond = cond, .reg = cpu_tmp4,
+                               .imm = imm, .mask = -1 };
+            break;
+        default:
+            goto slow_jcc;
+        }
+        break;
+
     default:
     slow_jcc:
         /* This actually generates good code for JC, JZ and JS.  */
@@ -2970,6 +3041,124 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0xdf] = AESNI_OP(aeskeygenassist),
 };
 
+/* Lane-wise add and subtract of the 8/16/32 bit lanes of 64 bit words,
+   with @m holding the top bit of each lane: the carry out of a lane is
+   kept from reaching the next one by doing the top bits separately. */
+static void gen_addv_mask_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, uint64_t m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_andi_i64(t1, a, ~m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static void gen_subv_mask_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, uint64_t m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_ori_i64(t1, a, m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+/* Translate the most common MMX/SSE2 integer ops of sse_op_table1 to
+   TCG ops on 64 bit words instead of a helper call.  Returns false if
+   the op must go through its helper. */
+static bool gen_sse_inline(int b, int is_xmm, int op1_offset, int op2_offset)
+{
+    TCGv_i64 t0, t1;
+    int i;
+
+    switch (b) {
+    case 0xd4: /* paddq */
+    case 0xdb: /* pand */
+    case 0xdf: /* pandn */
+    case 0xeb: /* por */
+    case 0xef: /* pxor */
+    case 0xf8: /* psubb */
+    case 0xf9: /* psubw */
+    case 0xfa: /* psubl */
+    case 0xfb: /* psubq */
+    case 0xfc: /* paddb */
+    case 0xfd: /* paddw */
+    case 0xfe: /* paddl */
+        break;
+    default:
+        return false;
+    }
+
+    t0 = tcg_temp_new_i64();
+    t1 = tcg_temp_new_i64();
+    for (i = 0; i < (is_xmm ? 2 : 1); i++) {
+        int ofs = is_xmm ? offsetof(XMMReg, XMM_Q(i))
+                         : offsetof(MMXReg, MMX_Q(0));
+
+        tcg_gen_ld_i64(t0, cpu_env, op1_offset + ofs);
+        tcg_gen_ld_i64(t1, cpu_env, op2_offset + ofs);
+        switch (b) {
+        case 0xd4:
+            tcg_gen_add_i64(t0, t0, t1);
+            break;
+        case 0xdb:
+            tcg_gen_and_i64(t0, t0, t1);
+            break;
+        case 0xdf:
+            tcg_gen_andc_i64(t0, t1, t0);
+            break;
+        case 0xeb:
+            tcg_gen_or_i64(t0, t0, t1);
+            break;
+        case 0xef:
+            tcg_gen_xor_i64(t0, t0, t1);
+            break;
+        case 0xf8:
+            gen_subv_mask_i64(t0, t0, t1, 0x8080808080808080ull);
+            break;
+        case 0xf9:
+            gen_subv_mask_i64(t0, t0, t1, 0x8000800080008000ull);
+            break;
+        case 0xfa:
+            gen_subv_mask_i64(t0, t0, t1, 0x8000000080000000ull);
+            break;
+        case 0xfb:
+            tcg_gen_sub_i64(t0, t0, t1);
+            break;
+        case 0xfc:
+            gen_addv_mask_i64(t0, t0, t1, 0x8080808080808080ull);
+            break;
+        case 0xfd:
+            gen_addv_mask_i64(t0, t0, t1, 0x8000800080008000ull);
+            break;
+        case 0xfe:
+            gen_addv_mask_i64(t0, t0, t1, 0x8000000080000000ull);
+            break;
+        }
+        tcg_gen_st_i64(t0, cpu_env, op1_offset + ofs);
+    }
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+    return true;
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -4385,6 +4574,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (gen_sse_inline(b, is_xmm, op1_offset, op2_offset)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -7980,7 +8172,7 @@ static inline void gen_intermediate_code_internal(X86CPU *cpu,
     if (max_insns == 0)
         max_insns = CF_COUNT_MASK;
 
-    gen_tb_start();
+    gen_tb_start(tb);
     for(;;) {
         if (unlikely(!QTAILQ_EMPTY(&cs->breakpoints))) {
             QTAILQ_FOREACH(bp, &cs->breakpoints, entry) {
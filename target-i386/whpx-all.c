@@ -0,0 +1,1288 @@
+/*
+ * QEMU Windows Hypervisor Platform accelerator (WHPX)
+ *
+ * Copyright (c) 2017 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * Runs the vcpus on Hyper-V through the Windows Hypervisor Platform API,
+ * for the hosts where Hyper-V is enabled, which HAXM can't coexist with.
+ *
+ * The structure is that of hax-all.c: guest RAM is mapped into the
+ * partition by a MemoryListener, each vcpu has its own thread looping in
+ * whpx_vcpu_exec(), and the register file is only copied to env when
+ * QEMU asks for it. Port and MMIO accesses are decoded by the instruction
+ * emulator of WinHvEmulation.dll, which calls back into QEMU to perform
+ * them. The APIC, PIC and timers stay emulated by QEMU, as with HAX.
+ *
+ * The two DLLs are loaded at run time, so the emulator still starts on
+ * Windows versions without the Hypervisor Platform and falls back to the
+ * next accelerator given to -machine accel=.
+ */
+
+#include <windows.h>
+#include <WinHvPlatform.h>
+#include <WinHvEmulation.h>
+
+#include "qemu-common.h"
+#include "cpu.h"
+#include "exec/address-spaces.h"
+#include "exec/ioport.h"
+#include "hw/boards.h"
+#include "hw/i386/apic.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "sysemu/accel.h"
+#include "sysemu/cpus.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/vcpu-exits.h"
+#include "sysemu/whpx.h"
+
+#define TYPE_WHPX_ACCEL ACCEL_CLASS_NAME("whpx")
+
+/* Entry points resolved from WinHvPlatform.dll and WinHvEmulation.dll */
+#define WHPX_PLATFORM_FUNCTIONS(X) \
+    X(WHvGetCapability, (WHV_CAPABILITY_CODE, VOID *, UINT32, UINT32 *)) \
+    X(WHvCreatePartition, (WHV_PARTITION_HANDLE *)) \
+    X(WHvSetupPartition, (WHV_PARTITION_HANDLE)) \
+    X(WHvDeletePartition, (WHV_PARTITION_HANDLE)) \
+    X(WHvSetPartitionProperty, (WHV_PARTITION_HANDLE, \
+                                WHV_PARTITION_PROPERTY_CODE, \
+                                const VOID *, UINT32)) \
+    X(WHvMapGpaRange, (WHV_PARTITION_HANDLE, VOID *, \
+                       WHV_GUEST_PHYSICAL_ADDRESS, UINT64, \
+                       WHV_MAP_GPA_RANGE_FLAGS)) \
+    X(WHvUnmapGpaRange, (WHV_PARTITION_HANDLE, WHV_GUEST_PHYSICAL_ADDRESS, \
+                         UINT64)) \
+    X(WHvTranslateGva, (WHV_PARTITION_HANDLE, UINT32, \
+                        WHV_GUEST_VIRTUAL_ADDRESS, WHV_TRANSLATE_GVA_FLAGS, \
+                        WHV_TRANSLATE_GVA_RESULT *, \
+                        WHV_GUEST_PHYSICAL_ADDRESS *)) \
+    X(WHvCreateVirtualProcessor, (WHV_PARTITION_HANDLE, UINT32, UINT32)) \
+    X(WHvDeleteVirtualProcessor, (WHV_PARTITION_HANDLE, UINT32)) \
+    X(WHvRunVirtualProcessor, (WHV_PARTITION_HANDLE, UINT32, VOID *, \
+                               UINT32)) \
+    X(WHvCancelRunVirtualProcessor, (WHV_PARTITION_HANDLE, UINT32, UINT32)) \
+    X(WHvGetVirtualProcessorRegisters, (WHV_PARTITION_HANDLE, UINT32, \
+                                        const WHV_REGISTER_NAME *, UINT32, \
+                                        WHV_REGISTER_VALUE *)) \
+    X(WHvSetVirtualProcessorRegisters, (WHV_PARTITION_HANDLE, UINT32, \
+                                        const WHV_REGISTER_NAME *, UINT32, \
+                                        const WHV_REGISTER_VALUE *))
+
+#define WHPX_EMULATION_FUNCTIONS(X) \
+    X(WHvEmulatorCreateEmulator, (const WHV_EMULATOR_CALLBACKS *, \
+                                  WHV_EMULATOR_HANDLE *)) \
+    X(WHvEmulatorDestroyEmulator, (WHV_EMULATOR_HANDLE)) \
+    X(WHvEmulatorTryIoEmulation, (WHV_EMULATOR_HANDLE, VOID *, \
+                                  const WHV_VP_EXIT_CONTEXT *, \
+                                  const WHV_X64_IO_PORT_ACCESS_CONTEXT *, \
+                                  WHV_EMULATOR_STATUS *)) \
+    X(WHvEmulatorTryMmioEmulation, (WHV_EMULATOR_HANDLE, VOID *, \
+                                    const WHV_VP_EXIT_CONTEXT *, \
+                                    const WHV_MEMORY_ACCESS_CONTEXT *, \
+                                    WHV_EMULATOR_STATUS *))
+
+#define WHPX_DECLARE(name, args) static HRESULT (WINAPI *p##name) args;
+WHPX_PLATFORM_FUNCTIONS(WHPX_DECLARE)
+WHPX_EMULATION_FUNCTIONS(WHPX_DECLARE)
+#undef WHPX_DECLARE
+
+struct whpx_state {
+    WHV_PARTITION_HANDLE partition;
+    bool partition_ready;
+};
+
+struct whpx_vcpu {
+    WHV_EMULATOR_HANDLE emulator;
+    WHV_RUN_VP_EXIT_CONTEXT exit_ctx;
+    /* env holds the registers, they must be written before running */
+    bool regs_dirty;
+    bool window_registered;
+    bool interruptable;
+    bool interruption_pending;
+    uint64_t tpr;
+};
+
+static struct whpx_state whpx_global;
+static bool whpx_allowed;
+
+int whpx_enabled(void)
+{
+    return whpx_allowed && whpx_global.partition_ready;
+}
+
+static bool whpx_load_functions(void)
+{
+    HMODULE platform = LoadLibraryA("WinHvPlatform.dll");
+    HMODULE emulation = LoadLibraryA("WinHvEmulation.dll");
+
+    if (!platform || !emulation) {
+        goto fail;
+    }
+
+#define WHPX_RESOLVE(module, name) \
+    p##name = (void *)GetProcAddress(module, #name); \
+    if (!p##name) { \
+        error_report("WHPX: %s not found", #name); \
+        goto fail; \
+    }
+#define WHPX_RESOLVE_PLATFORM(name, args) WHPX_RESOLVE(platform, name)
+#define WHPX_RESOLVE_EMULATION(name, args) WHPX_RESOLVE(emulation, name)
+    WHPX_PLATFORM_FUNCTIONS(WHPX_RESOLVE_PLATFORM)
+    WHPX_EMULATION_FUNCTIONS(WHPX_RESOLVE_EMULATION)
+#undef WHPX_RESOLVE_EMULATION
+#undef WHPX_RESOLVE_PLATFORM
+#undef WHPX_RESOLVE
+
+    return true;
+
+fail:
+    if (platform) {
+        FreeLibrary(platform);
+    }
+    if (emulation) {
+        FreeLibrary(emulation);
+    }
+    return false;
+}
+
+/*
+ * Register sync
+ */
+
+/* The order matters: whpx_get_registers() and whpx_set_registers() walk it */
+static const WHV_REGISTER_NAME whpx_register_names[] = {
+    /* X64 General purpose registers, in the order of env->regs */
+    WHvX64RegisterRax,
+    WHvX64RegisterRcx,
+    WHvX64RegisterRdx,
+    WHvX64RegisterRbx,
+    WHvX64RegisterRsp,
+    WHvX64RegisterRbp,
+    WHvX64RegisterRsi,
+    WHvX64RegisterRdi,
+    WHvX64RegisterR8,
+    WHvX64RegisterR9,
+    WHvX64RegisterR10,
+    WHvX64RegisterR11,
+    WHvX64RegisterR12,
+    WHvX64RegisterR13,
+    WHvX64RegisterR14,
+    WHvX64RegisterR15,
+    WHvX64RegisterRip,
+    WHvX64RegisterRflags,
+
+    /* X64 Segment registers, in the order of env->segs */
+    WHvX64RegisterEs,
+    WHvX64RegisterCs,
+    WHvX64RegisterSs,
+    WHvX64RegisterDs,
+    WHvX64RegisterFs,
+    WHvX64RegisterGs,
+    WHvX64RegisterLdtr,
+    WHvX64RegisterTr,
+
+    /* X64 Table registers */
+    WHvX64RegisterIdtr,
+    WHvX64RegisterGdtr,
+
+    /* X64 Control Registers */
+    WHvX64RegisterCr0,
+    WHvX64RegisterCr2,
+    WHvX64RegisterCr3,
+    WHvX64RegisterCr4,
+    WHvX64RegisterCr8,
+
+    /* X64 Floating Point and Vector Registers */
+    WHvX64RegisterXmm0,
+    WHvX64RegisterXmm1,
+    WHvX64RegisterXmm2,
+    WHvX64RegisterXmm3,
+    WHvX64RegisterXmm4,
+    WHvX64RegisterXmm5,
+    WHvX64RegisterXmm6,
+    WHvX64RegisterXmm7,
+    WHvX64RegisterXmm8,
+    WHvX64RegisterXmm9,
+    WHvX64RegisterXmm10,
+    WHvX64RegisterXmm11,
+    WHvX64RegisterXmm12,
+    WHvX64RegisterXmm13,
+    WHvX64RegisterXmm14,
+    WHvX64RegisterXmm15,
+    WHvX64RegisterFpMmx0,
+    WHvX64RegisterFpMmx1,
+    WHvX64RegisterFpMmx2,
+    WHvX64RegisterFpMmx3,
+    WHvX64RegisterFpMmx4,
+    WHvX64RegisterFpMmx5,
+    WHvX64RegisterFpMmx6,
+    WHvX64RegisterFpMmx7,
+    WHvX64RegisterFpControlStatus,
+    WHvX64RegisterXmmControlStatus,
+
+    /* X64 MSRs */
+    WHvX64RegisterEfer,
+#ifdef TARGET_X86_64
+    WHvX64RegisterKernelGsBase,
+#endif
+    WHvX64RegisterApicBase,
+    WHvX64RegisterSysenterCs,
+    WHvX64RegisterSysenterEip,
+    WHvX64RegisterSysenterEsp,
+    WHvX64RegisterStar,
+#ifdef TARGET_X86_64
+    WHvX64RegisterLstar,
+    WHvX64RegisterCstar,
+    WHvX64RegisterSfmask,
+#endif
+
+    /* Only written on reset and at init, see whpx_set_registers() */
+    WHvX64RegisterTsc,
+};
+
+#define WHPX_NB_REGISTERS ARRAY_SIZE(whpx_register_names)
+
+static WHV_X64_SEGMENT_REGISTER whpx_seg_q2h(const SegmentCache *qs, int v86)
+{
+    WHV_X64_SEGMENT_REGISTER hs;
+
+    hs.Base = qs->base;
+    hs.Limit = qs->limit;
+    hs.Selector = qs->selector;
+    if (v86) {
+        hs.Attributes = 0;
+        hs.SegmentType = 3;
+        hs.Present = 1;
+        hs.DescriptorPrivilegeLevel = 3;
+        hs.NonSystemSegment = 1;
+    } else {
+        hs.Attributes = qs->flags >> DESC_TYPE_SHIFT;
+    }
+    return hs;
+}
+
+static SegmentCache whpx_seg_h2q(const WHV_X64_SEGMENT_REGISTER *hs)
+{
+    SegmentCache qs;
+
+    qs.base = hs->Base;
+    qs.limit = hs->Limit;
+    qs.selector = hs->Selector;
+    qs.flags = ((uint32_t)hs->Attributes) << DESC_TYPE_SHIFT;
+    return qs;
+}
+
+/* Recompute the hflags that depend on the registers read back */
+static void whpx_update_hflags(CPUX86State *env)
+{
+#define HFLAG_COPY_MASK ~( \
+  HF_CPL_MASK | HF_PE_MASK | HF_MP_MASK | HF_EM_MASK | \
+  HF_TS_MASK | HF_TF_MASK | HF_VM_MASK | HF_IOPL_MASK | \
+  HF_OSFXSR_MASK | HF_LMA_MASK | HF_CS32_MASK | \
+  HF_SS32_MASK | HF_CS64_MASK | HF_ADDSEG_MASK)
+
+    uint32_t hflags;
+
+    hflags = (env->segs[R_CS].flags >> DESC_DPL_SHIFT) & HF_CPL_MASK;
+    hflags |= (env->cr[0] & CR0_PE_MASK) << (HF_PE_SHIFT - CR0_PE_SHIFT);
+    hflags |= (env->cr[0] << (HF_MP_SHIFT - CR0_MP_SHIFT)) &
+        (HF_MP_MASK | HF_EM_MASK | HF_TS_MASK);
+    hflags |= (env->eflags & (HF_TF_MASK | HF_VM_MASK | HF_IOPL_MASK));
+    hflags |= (env->cr[4] & CR4_OSFXSR_MASK) <<
+        (HF_OSFXSR_SHIFT - CR4_OSFXSR_SHIFT);
+
+    if (env->efer & MSR_EFER_LMA) {
+        hflags |= HF_LMA_MASK;
+    }
+
+    if ((hflags & HF_LMA_MASK) && (env->segs[R_CS].flags & DESC_L_MASK)) {
+        hflags |= HF_CS32_MASK | HF_SS32_MASK | HF_CS64_MASK;
+    } else {
+        hflags |= (env->segs[R_CS].flags & DESC_B_MASK) >>
+            (DESC_B_SHIFT - HF_CS32_SHIFT);
+        hflags |= (env->segs[R_SS].flags & DESC_B_MASK) >>
+            (DESC_B_SHIFT - HF_SS32_SHIFT);
+        if (!(env->cr[0] & CR0_PE_MASK) ||
+            (env->eflags & VM_MASK) || !(hflags & HF_CS32_MASK)) {
+            hflags |= HF_ADDSEG_MASK;
+        } else {
+            hflags |= ((env->segs[R_DS].base |
+                        env->segs[R_ES].base |
+                        env->segs[R_SS].base) != 0) << HF_ADDSEG_SHIFT;
+        }
+    }
+    env->hflags = (env->hflags & HFLAG_COPY_MASK) | hflags;
+#undef HFLAG_COPY_MASK
+}
+
+/* Write env to the vcpu; the TSC only when @full, on reset and at init */
+static void whpx_set_registers(CPUState *cpu, bool full)
+{
+    struct whpx_vcpu *vcpu = cpu->whpx_vcpu;
+    X86CPU *x86_cpu = X86_CPU(cpu);
+    CPUX86State *env = &x86_cpu->env;
+    WHV_REGISTER_VALUE values[WHPX_NB_REGISTERS];
+    int v86 = (env->eflags & VM_MASK) != 0;
+    int idx = 0;
+    int i;
+    HRESULT hr;
+
+    memset(values, 0, sizeof(values));
+
+    for (i = 0; i < CPU_NB_REGS; i++) {
+        values[i].Reg64 = env->regs[i];
+    }
+    idx = 16;
+    values[idx++].Reg64 = env->eip;
+    values[idx++].Reg64 = env->eflags;
+
+    for (i = 0; i < 6; i++) {
+        values[idx++].Segment = whpx_seg_q2h(&env->segs[i], v86);
+    }
+    values[idx++].Segment = whpx_seg_q2h(&env->ldt, 0);
+    values[idx++].Segment = whpx_seg_q2h(&env->tr, 0);
+
+    values[idx].Table.Base = env->idt.base;
+    values[idx++].Table.Limit = env->idt.limit;
+    values[idx].Table.Base = env->gdt.base;
+    values[idx++].Table.Limit = env->gdt.limit;
+
+    values[idx++].Reg64 = env->cr[0];
+    values[idx++].Reg64 = env->cr[2];
+    values[idx++].Reg64 = env->cr[3];
+    values[idx++].Reg64 = env->cr[4];
+    vcpu->tpr = cpu_get_apic_tpr(x86_cpu->apic_state);
+    values[idx++].Reg64 = vcpu->tpr;
+
+    for (i = 0; i < CPU_NB_REGS; i++) {
+        values[idx + i].Reg128.Low64 = env->xmm_regs[i].XMM_Q(0);
+        values[idx + i].Reg128.High64 = env->xmm_regs[i].XMM_Q(1);
+    }
+    idx += 16;
+    for (i = 0; i < 8; i++) {
+        values[idx].Fp.AsUINT128.Low64 = env->fpregs[i].d.low;
+        values[idx++].Fp.AsUINT128.High64 = env->fpregs[i].d.high;
+    }
+    values[idx].FpControlStatus.FpControl = env->fpuc;
+    values[idx].FpControlStatus.FpStatus =
+        (env->fpus & ~0x3800) | (env->fpstt & 0x7) << 11;
+    values[idx].FpControlStatus.FpTag = 0;
+    for (i = 0; i < 8; i++) {
+        values[idx].FpControlStatus.FpTag |= (!env->fptags[i]) << i;
+    }
+    values[idx].FpControlStatus.LastFpOp = env->fpop;
+    values[idx++].FpControlStatus.LastFpRip = env->fpip;
+    values[idx].XmmControlStatus.XmmStatusControl = env->mxcsr;
+    values[idx++].XmmControlStatus.XmmStatusControlMask = 0x0000ffff;
+
+    values[idx++].Reg64 = env->efer;
+#ifdef TARGET_X86_64
+    values[idx++].Reg64 = env->kernelgsbase;
+#endif
+    values[idx++].Reg64 = cpu_get_apic_base(x86_cpu->apic_state);
+    values[idx++].Reg64 = env->sysenter_cs;
+    values[idx++].Reg64 = env->sysenter_eip;
+    values[idx++].Reg64 = env->sysenter_esp;
+    values[idx++].Reg64 = env->star;
+#ifdef TARGET_X86_64
+    values[idx++].Reg64 = env->lstar;
+    values[idx++].Reg64 = env->cstar;
+    values[idx++].Reg64 = env->fmask;
+#endif
+    /* Writing the TSC back while the guest runs would make it jump */
+    values[idx++].Reg64 = env->tsc;
+    assert(idx == WHPX_NB_REGISTERS);
+
+    hr = pWHvSetVirtualProcessorRegisters(whpx_global.partition,
+                                          cpu->cpu_index,
+                                          whpx_register_names,
+                                          full ? idx : idx - 1, values);
+    if (FAILED(hr)) {
+        error_report("WHPX: Failed to set vcpu %d registers, hr=%08lx",
+                     cpu->cpu_index, hr);
+    }
+}
+
+static void whpx_get_registers(CPUState *cpu)
+{
+    struct whpx_vcpu *vcpu = cpu->whpx_vcpu;
+    X86CPU *x86_cpu = X86_CPU(cpu);
+    CPUX86State *env = &x86_cpu->env;
+    WHV_REGISTER_VALUE values[WHPX_NB_REGISTERS];
+    uint64_t tpr, apic_base;
+    int idx = 0;
+    int i;
+    HRESULT hr;
+
+    hr = pWHvGetVirtualProcessorRegisters(whpx_global.partition,
+                                          cpu->cpu_index,
+                                          whpx_register_names,
+                                          WHPX_NB_REGISTERS, values);
+    if (FAILED(hr)) {
+        error_report("WHPX: Failed to get vcpu %d registers, hr=%08lx",
+                     cpu->cpu_index, hr);
+        return;
+    }
+
+    for (i = 0; i < CPU_NB_REGS; i++) {
+        env->regs[i] = values[i].Reg64;
+    }
+    idx = 16;
+    env->eip = values[idx++].Reg64;
+    env->eflags = values[idx++].Reg64;
+
+    for (i = 0; i < 6; i++) {
+        env->segs[i] = whpx_seg_h2q(&values[idx++].Segment);
+    }
+    env->ldt = whpx_seg_h2q(&values[idx++].Segment);
+    env->tr = whpx_seg_h2q(&values[idx++].Segment);
+
+    env->idt.base = values[idx].Table.Base;
+    env->idt.limit = values[idx++].Table.Limit;
+    env->gdt.base = values[idx].Table.Base;
+    env->gdt.limit = values[idx++].Table.Limit;
+
+    env->cr[0] = values[idx++].Reg64;
+    env->cr[2] = values[idx++].Reg64;
+    env->cr[3] = values[idx++].Reg64;
+    env->cr[4] = values[idx++].Reg64;
+    tpr = values[idx++].Reg64;
+    if (tpr != vcpu->tpr) {
+        vcpu->tpr = tpr;
+        cpu_set_apic_tpr(x86_cpu->apic_state, tpr);
+    }
+
+    for (i = 0; i < CPU_NB_REGS; i++) {
+        env->xmm_regs[i].XMM_Q(0) = values[idx + i].Reg128.Low64;
+        env->xmm_regs[i].XMM_Q(1) = values[idx + i].Reg128.High64;
+    }
+    idx += 16;
+    for (i = 0; i < 8; i++) {
+        env->fpregs[i].d.low = values[idx].Fp.AsUINT128.Low64;
+        env->fpregs[i].d.high = values[idx++].Fp.AsUINT128.High64;
+    }
+    env->fpuc = values[idx].FpControlStatus.FpControl;
+    env->fpstt = (values[idx].FpControlStatus.FpStatus >> 11) & 0x7;
+    env->fpus = values[idx].FpControlStatus.FpStatus & ~0x3800;
+    for (i = 0; i < 8; i++) {
+        env->fptags[i] = !((values[idx].FpControlStatus.FpTag >> i) & 1);
+    }
+    env->fpop = values[idx].FpControlStatus.LastFpOp;
+    env->fpip = values[idx++].FpControlStatus.LastFpRip;
+    env->mxcsr = values[idx++].XmmControlStatus.XmmStatusControl;
+
+    env->efer = values[idx++].Reg64;
+#ifdef TARGET_X86_64
+    env->kernelgsbase = values[idx++].Reg64;
+#endif
+    apic_base = values[idx++].Reg64;
+    if (apic_base != cpu_get_apic_base(x86_cpu->apic_state)) {
+        cpu_set_apic_base(x86_cpu->apic_state, apic_base);
+    }
+    env->sysenter_cs = values[idx++].Reg64;
+    env->sysenter_eip = values[idx++].Reg64;
+    env->sysenter_esp = values[idx++].Reg64;
+    env->star = values[idx++].Reg64;
+#ifdef TARGET_X86_64
+    env->lstar = values[idx++].Reg64;
+    env->cstar = values[idx++].Reg64;
+    env->fmask = values[idx++].Reg64;
+#endif
+    env->tsc = values[idx++].Reg64;
+    assert(idx == WHPX_NB_REGISTERS);
+
+    whpx_update_hflags(env);
+}
+
+static void do_whpx_cpu_synchronize_state(void *arg)
+{
+    CPUState *cpu = arg;
+
+    /* The caller may change anything: write it all back before running */
+    whpx_get_registers(cpu);
+    cpu->whpx_vcpu->regs_dirty = true;
+}
+
+void whpx_cpu_synchronize_state(CPUState *cpu)
+{
+    /* Once dirty, env stays the authoritative copy until the vcpu runs */
+    if (!cpu->whpx_vcpu->regs_dirty) {
+        run_on_cpu(cpu, do_whpx_cpu_synchronize_state, cpu);
+    }
+}
+
+static void do_whpx_cpu_synchronize_post_reset(void *arg)
+{
+    CPUState *cpu = arg;
+
+    whpx_set_registers(cpu, true);
+    cpu->whpx_vcpu->regs_dirty = false;
+}
+
+void whpx_cpu_synchronize_post_reset(CPUState *cpu)
+{
+    run_on_cpu(cpu, do_whpx_cpu_synchronize_post_reset, cpu);
+}
+
+void whpx_cpu_synchronize_post_init(CPUState *cpu)
+{
+    run_on_cpu(cpu, do_whpx_cpu_synchronize_post_reset, cpu);
+}
+
+/*
+ * Instruction emulator callbacks, called with the iothread lock held
+ */
+
+static HRESULT CALLBACK whpx_emu_ioport_callback(
+    void *ctx, WHV_EMULATOR_IO_ACCESS_INFO *io)
+{
+    uint8_t *data = (uint8_t *)&io->Data;
+
+    if (io->Direction == 0) {
+        switch (io->AccessSize) {
+        case 1:
+            io->Data = cpu_inb(io->Port);
+            break;
+        case 2:
+            io->Data = cpu_inw(io->Port);
+            break;
+        case 4:
+            io->Data = cpu_inl(io->Port);
+            break;
+        }
+    } else {
+        switch (io->AccessSize) {
+        case 1:
+            cpu_outb(io->Port, ldub_p(data));
+            break;
+        case 2:
+            cpu_outw(io->Port, lduw_p(data));
+            break;
+        case 4:
+            cpu_outl(io->Port, ldl_p(data));
+            break;
+        }
+    }
+    return S_OK;
+}
+
+static HRESULT CALLBACK whpx_emu_mmio_callback(
+    void *ctx, WHV_EMULATOR_MEMORY_ACCESS_INFO *ma)
+{
+    cpu_physical_memory_rw(ma->GpaAddress, ma->Data, ma->AccessSize,
+                           ma->Direction);
+    return S_OK;
+}
+
+static HRESULT CALLBACK whpx_emu_getreg_callback(
+    void *ctx, const WHV_REGISTER_NAME *names, UINT32 count,
+    WHV_REGISTER_VALUE *values)
+{
+    CPUState *cpu = ctx;
+    HRESULT hr;
+
+    hr = pWHvGetVirtualProcessorRegisters(whpx_global.partition,
+                                          cpu->cpu_index, names, count,
+                                          values);
+    if (FAILED(hr)) {
+        error_report("WHPX: Failed to get vcpu %d registers, hr=%08lx",
+                     cpu->cpu_index, hr);
+    }
+    return hr;
+}
+
+static HRESULT CALLBACK whpx_emu_setreg_callback(
+    void *ctx, const WHV_REGISTER_NAME *names, UINT32 count,
+    const WHV_REGISTER_VALUE *values)
+{
+    CPUState *cpu = ctx;
+    HRESULT hr;
+
+    hr = pWHvSetVirtualProcessorRegisters(whpx_global.partition,
+                                          cpu->cpu_index, names, count,
+                                          values);
+    if (FAILED(hr)) {
+        error_report("WHPX: Failed to set vcpu %d registers, hr=%08lx",
+                     cpu->cpu_index, hr);
+    }
+    return hr;
+}
+
+static HRESULT CALLBACK whpx_emu_translate_callback(
+    void *ctx, WHV_GUEST_VIRTUAL_ADDRESS gva, WHV_TRANSLATE_GVA_FLAGS flags,
+    WHV_TRANSLATE_GVA_RESULT_CODE *result, WHV_GUEST_PHYSICAL_ADDRESS *gpa)
+{
+    CPUState *cpu = ctx;
+    WHV_TRANSLATE_GVA_RESULT res;
+    HRESULT hr;
+
+    hr = pWHvTranslateGva(whpx_global.partition, cpu->cpu_index, gva, flags,
+                          &res, gpa);
+    if (FAILED(hr)) {
+        error_report("WHPX: Failed to translate GVA, hr=%08lx", hr);
+    } else {
+        *result = res.ResultCode;
+    }
+    return hr;
+}
+
+static const WHV_EMULATOR_CALLBACKS whpx_emu_callbacks = {
+    .Size = sizeof(WHV_EMULATOR_CALLBACKS),
+    .WHvEmulatorIoPortCallback = whpx_emu_ioport_callback,
+    .WHvEmulatorMemoryCallback = whpx_emu_mmio_callback,
+    .WHvEmulatorGetVirtualProcessorRegisters = whpx_emu_getreg_callback,
+    .WHvEmulatorSetVirtualProcessorRegisters = whpx_emu_setreg_callback,
+    .WHvEmulatorTranslateGvaPage = whpx_emu_translate_callback,
+};
+
+/*
+ * vcpu run loop
+ */
+
+static int whpx_handle_mmio(CPUState *cpu, WHV_MEMORY_ACCESS_CONTEXT *ctx)
+{
+    struct whpx_vcpu *vcpu = cpu->whpx_vcpu;
+    WHV_EMULATOR_STATUS status;
+    HRESULT hr;
+
+    vcpu_exit_account_address(cpu, false, ctx->Gpa);
+    hr = pWHvEmulatorTryMmioEmulation(vcpu->emulator, cpu,
+                                      &vcpu->exit_ctx.VpContext, ctx,
+                                      &status);
+    if (FAILED(hr) || !status.EmulationSuccessful) {
+        error_report("WHPX: Failed to emulate MMIO access at 0x%" PRIx64
+                     ", hr=%08lx", (uint64_t)ctx->Gpa, hr);
+        return -1;
+    }
+    return 0;
+}
+
+static int whpx_handle_portio(CPUState *cpu,
+                              WHV_X64_IO_PORT_ACCESS_CONTEXT *ctx)
+{
+    struct whpx_vcpu *vcpu = cpu->whpx_vcpu;
+    WHV_EMULATOR_STATUS status;
+    HRESULT hr;
+
+    vcpu_exit_account_address(cpu, true, ctx->PortNumber);
+    hr = pWHvEmulatorTryIoEmulation(vcpu->emulator, cpu,
+                                    &vcpu->exit_ctx.VpContext, ctx,
+                                    &status);
+    if (FAILED(hr) || !status.EmulationSuccessful) {
+        error_report("WHPX: Failed to emulate port access to 0x%x, hr=%08lx",
+                     ctx->PortNumber, hr);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Answer the CPUID leaves of the exit list from the CPU model, so that the
+ * guest sees the features QEMU emulates and its own APIC ID.
+ */
+static int whpx_handle_cpuid(CPUState *cpu)
+{
+    struct whpx_vcpu *vcpu = cpu->whpx_vcpu;
+    CPUX86State *env = &X86_CPU(cpu)->env;
+    WHV_X64_CPUID_ACCESS_CONTEXT *ctx = &vcpu->exit_ctx.CpuidAccess;
+    static const WHV_REGISTER_NAME names[] = {
+        WHvX64RegisterRip, WHvX64RegisterRax, WHvX64RegisterRbx,
+        WHvX64RegisterRcx, WHvX64RegisterRdx,
+    };
+    WHV_REGISTER_VALUE values[ARRAY_SIZE(names)];
+    uint32_t eax, ebx, ecx, edx;
+    HRESULT hr;
+
+    cpu_x86_cpuid(env, ctx->Rax, ctx->Rcx, &eax, &ebx, &ecx, &edx);
+    if (ctx->Rax == 0x80000001) {
+        /* The hypervisor doesn't implement OS visible workarounds */
+        ecx &= ~CPUID_EXT3_OSVW;
+    }
+
+    memset(values, 0, sizeof(values));
+    values[0].Reg64 = vcpu->exit_ctx.VpContext.Rip +
+                      vcpu->exit_ctx.VpContext.InstructionLength;
+    values[1].Reg64 = eax;
+    values[2].Reg64 = ebx;
+    values[3].Reg64 = ecx;
+    values[4].Reg64 = edx;
+    hr = pWHvSetVirtualProcessorRegisters(whpx_global.partition,
+                                          cpu->cpu_index, names,
+                                          ARRAY_SIZE(names), values);
+    if (FAILED(hr)) {
+        error_report("WHPX: Failed to set CPUID results, hr=%08lx", hr);
+        return -1;
+    }
+    return 0;
+}
+
+static int whpx_handle_halt(CPUState *cpu)
+{
+    CPUX86State *env = &X86_CPU(cpu)->env;
+
+    if (!((cpu->interrupt_request & CPU_INTERRUPT_HARD) &&
+          (env->eflags & IF_MASK)) &&
+        !(cpu->interrupt_request & CPU_INTERRUPT_NMI)) {
+        cpu->exception_index = EXCP_HLT;
+        cpu->halted = 1;
+        return 1;
+    }
+    return 0;
+}
+
+/* Handle what QEMU requested of the vcpu while it was out of the guest */
+static void whpx_vcpu_process_async_events(CPUState *cpu)
+{
+    X86CPU *x86_cpu = X86_CPU(cpu);
+    CPUX86State *env = &x86_cpu->env;
+    struct whpx_vcpu *vcpu = cpu->whpx_vcpu;
+
+    if ((cpu->interrupt_request & CPU_INTERRUPT_INIT) &&
+        !(env->hflags & HF_SMM_MASK)) {
+        whpx_cpu_synchronize_state(cpu);
+        do_cpu_init(x86_cpu);
+        vcpu->interruptable = true;
+    }
+
+    if (cpu->interrupt_request & CPU_INTERRUPT_POLL) {
+        cpu->interrupt_request &= ~CPU_INTERRUPT_POLL;
+        apic_poll_irq(x86_cpu->apic_state);
+    }
+
+    if (((cpu->interrupt_request & CPU_INTERRUPT_HARD) &&
+         (env->eflags & IF_MASK)) ||
+        (cpu->interrupt_request & CPU_INTERRUPT_NMI)) {
+        cpu->halted = 0;
+    }
+
+    if (cpu->interrupt_request & CPU_INTERRUPT_SIPI) {
+        whpx_cpu_synchronize_state(cpu);
+        do_cpu_sipi(x86_cpu);
+    }
+
+    if (cpu->interrupt_request & CPU_INTERRUPT_TPR) {
+        cpu->interrupt_request &= ~CPU_INTERRUPT_TPR;
+        whpx_cpu_synchronize_state(cpu);
+        apic_handle_tpr_access_report(x86_cpu->apic_state, env->eip,
+                                      env->tpr_access_type);
+    }
+}
+
+/*
+ * Inject a pending NMI or interrupt if the guest can take it, or ask for
+ * an exit as soon as it can, and pass a TPR changed by QEMU on to CR8.
+ */
+static int whpx_vcpu_pre_run(CPUState *cpu)
+{
+    struct whpx_vcpu *vcpu = cpu->whpx_vcpu;
+    X86CPU *x86_cpu = X86_CPU(cpu);
+    CPUX86State *env = &x86_cpu->env;
+    WHV_X64_PENDING_INTERRUPTION_REGISTER new_int;
+    WHV_REGISTER_NAME names[3];
+    WHV_REGISTER_VALUE values[3];
+    UINT32 count = 0;
+    uint64_t tpr;
+    HRESULT hr;
+
+    memset(&new_int, 0, sizeof(new_int));
+    memset(values, 0, sizeof(values));
+
+    if (!vcpu->interruption_pending &&
+        (cpu->interrupt_request & CPU_INTERRUPT_NMI)) {
+        cpu->interrupt_request &= ~CPU_INTERRUPT_NMI;
+        vcpu->interruptable = false;
+        new_int.InterruptionType = WHvX64PendingNmi;
+        new_int.InterruptionPending = 1;
+        new_int.InterruptionVector = 2;
+    }
+
+    if (!new_int.InterruptionPending && !vcpu->interruption_pending &&
+        vcpu->interruptable && (env->eflags & IF_MASK) &&
+        (cpu->interrupt_request & CPU_INTERRUPT_HARD)) {
+        int irq;
+
+        cpu->interrupt_request &= ~CPU_INTERRUPT_HARD;
+        irq = cpu_get_pic_interrupt(env);
+        if (irq >= 0) {
+            new_int.InterruptionType = WHvX64PendingInterrupt;
+            new_int.InterruptionPending = 1;
+            new_int.InterruptionVector = irq;
+        }
+    }
+
+    if (new_int.InterruptionPending) {
+        names[count] = WHvRegisterPendingInterruption;
+        values[count++].PendingInterruption = new_int;
+    }
+
+    tpr = cpu_get_apic_tpr(x86_cpu->apic_state);
+    if (tpr != vcpu->tpr) {
+        vcpu->tpr = tpr;
+        names[count] = WHvX64RegisterCr8;
+        values[count++].Reg64 = tpr;
+    }
+
+    if (!vcpu->window_registered &&
+        (cpu->interrupt_request & CPU_INTERRUPT_HARD)) {
+        vcpu->window_registered = true;
+        names[count] = WHvX64RegisterDeliverabilityNotifications;
+        values[count++].DeliverabilityNotifications.InterruptNotification = 1;
+    }
+
+    if (count) {
+        hr = pWHvSetVirtualProcessorRegisters(whpx_global.partition,
+                                              cpu->cpu_index, names, count,
+                                              values);
+        if (FAILED(hr)) {
+            error_report("WHPX: Failed to inject interrupt, hr=%08lx", hr);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void whpx_vcpu_post_run(CPUState *cpu)
+{
+    struct whpx_vcpu *vcpu = cpu->whpx_vcpu;
+    X86CPU *x86_cpu = X86_CPU(cpu);
+    WHV_VP_EXIT_CONTEXT *ctx = &vcpu->exit_ctx.VpContext;
+
+    /* Enough of the state for cpu_has_work() and interrupt injection */
+    x86_cpu->env.eflags = ctx->Rflags;
+    if (ctx->Cr8 != vcpu->tpr) {
+        vcpu->tpr = ctx->Cr8;
+        cpu_set_apic_tpr(x86_cpu->apic_state, vcpu->tpr);
+    }
+    vcpu->interruption_pending = ctx->ExecutionState.InterruptionPending;
+    vcpu->interruptable = !ctx->ExecutionState.InterruptShadow;
+}
+
+/*
+ * Run the vcpu until QEMU has something to do outside of it: a halt, a
+ * kick, or a fatal exit. Port and MMIO exits are handled in the loop.
+ */
+static int whpx_vcpu_run(CPUState *cpu)
+{
+    struct whpx_vcpu *vcpu = cpu->whpx_vcpu;
+    int ret = 0;
+
+    whpx_vcpu_process_async_events(cpu);
+    if (cpu->halted) {
+        cpu->exception_index = EXCP_HLT;
+        cpu->exit_request = 0;
+        return 0;
+    }
+
+    do {
+        VcpuExitReason reason;
+        int64_t exit_ns;
+        HRESULT hr;
+
+        if (cpu->exit_request) {
+            break;
+        }
+
+        if (vcpu->regs_dirty) {
+            whpx_set_registers(cpu, false);
+            vcpu->regs_dirty = false;
+        }
+        if (whpx_vcpu_pre_run(cpu) < 0) {
+            return -1;
+        }
+
+        /* A cancel issued from here on stops the run as soon as it starts */
+        qemu_mutex_unlock_iothread();
+        hr = pWHvRunVirtualProcessor(whpx_global.partition, cpu->cpu_index,
+                                     &vcpu->exit_ctx,
+                                     sizeof(vcpu->exit_ctx));
+        exit_ns = get_clock();
+        qemu_mutex_lock_iothread();
+        current_cpu = cpu;
+
+        if (FAILED(hr)) {
+            error_report("WHPX: Failed to run vcpu %d, hr=%08lx",
+                         cpu->cpu_index, hr);
+            return -1;
+        }
+        whpx_vcpu_post_run(cpu);
+
+        switch (vcpu->exit_ctx.ExitReason) {
+        case WHvRunVpExitReasonMemoryAccess:
+            reason = VCPU_EXIT_REASON_MMIO;
+            ret = whpx_handle_mmio(cpu, &vcpu->exit_ctx.MemoryAccess);
+            break;
+        case WHvRunVpExitReasonX64IoPortAccess:
+            reason = VCPU_EXIT_REASON_IO;
+            ret = whpx_handle_portio(cpu, &vcpu->exit_ctx.IoPortAccess);
+            break;
+        case WHvRunVpExitReasonX64InterruptWindow:
+            reason = VCPU_EXIT_REASON_INTERRUPT;
+            vcpu->window_registered = false;
+            break;
+        case WHvRunVpExitReasonX64Halt:
+            reason = VCPU_EXIT_REASON_HLT;
+            ret = whpx_handle_halt(cpu);
+            break;
+        case WHvRunVpExitReasonCanceled:
+            reason = VCPU_EXIT_REASON_INTERRUPT;
+            cpu->exception_index = EXCP_INTERRUPT;
+            ret = 1;
+            break;
+        case WHvRunVpExitReasonX64Cpuid:
+            reason = VCPU_EXIT_REASON_OTHER;
+            ret = whpx_handle_cpuid(cpu);
+            break;
+        case WHvRunVpExitReasonUnrecoverableException:
+            /* Triple fault: reset, as the hardware would */
+            reason = VCPU_EXIT_REASON_SHUTDOWN;
+            fprintf(stderr, "WHPX: unrecoverable exception, resetting\n");
+            whpx_cpu_synchronize_state(cpu);
+            cpu_dump_state(cpu, stderr, fprintf, 0);
+            qemu_system_reset_request();
+            ret = 1;
+            break;
+        default:
+            reason = VCPU_EXIT_REASON_OTHER;
+            error_report("WHPX: Unexpected exit %x from vcpu %d",
+                         vcpu->exit_ctx.ExitReason, cpu->cpu_index);
+            whpx_cpu_synchronize_state(cpu);
+            cpu_dump_state(cpu, stderr, fprintf, 0);
+            qemu_system_reset_request();
+            ret = 1;
+            break;
+        }
+        vcpu_exit_account(cpu, reason, exit_ns);
+    } while (!ret);
+
+    if (cpu->exit_request) {
+        cpu->exit_request = 0;
+        cpu->exception_index = EXCP_INTERRUPT;
+    }
+    return ret < 0 ? ret : 0;
+}
+
+int whpx_vcpu_exec(CPUState *cpu)
+{
+    int ret;
+
+    while (1) {
+        if (cpu->exception_index >= EXCP_INTERRUPT) {
+            ret = cpu->exception_index;
+            cpu->exception_index = -1;
+            break;
+        }
+
+        if (whpx_vcpu_run(cpu) < 0) {
+            whpx_cpu_synchronize_state(cpu);
+            cpu_dump_state(cpu, stderr, fprintf, 0);
+            abort();
+        }
+    }
+
+    return ret;
+}
+
+void whpx_vcpu_kick(CPUState *cpu)
+{
+    HRESULT hr;
+
+    cpu->exit_request = 1;
+    hr = pWHvCancelRunVirtualProcessor(whpx_global.partition,
+                                       cpu->cpu_index, 0);
+    if (FAILED(hr)) {
+        error_report("WHPX: Failed to cancel vcpu %d, hr=%08lx",
+                     cpu->cpu_index, hr);
+    }
+}
+
+int whpx_init_vcpu(CPUState *cpu)
+{
+    struct whpx_vcpu *vcpu;
+    HRESULT hr;
+
+    vcpu = g_new0(struct whpx_vcpu, 1);
+    hr = pWHvEmulatorCreateEmulator(&whpx_emu_callbacks, &vcpu->emulator);
+    if (FAILED(hr)) {
+        error_report("WHPX: Failed to create the instruction emulator, "
+                     "hr=%08lx", hr);
+        g_free(vcpu);
+        return -EINVAL;
+    }
+
+    hr = pWHvCreateVirtualProcessor(whpx_global.partition, cpu->cpu_index, 0);
+    if (FAILED(hr)) {
+        error_report("WHPX: Failed to create vcpu %d, hr=%08lx",
+                     cpu->cpu_index, hr);
+        pWHvEmulatorDestroyEmulator(vcpu->emulator);
+        g_free(vcpu);
+        return -EINVAL;
+    }
+
+    vcpu->interruptable = true;
+    vcpu->regs_dirty = true;
+    cpu->whpx_vcpu = vcpu;
+    return 0;
+}
+
+void whpx_destroy_vcpu(CPUState *cpu)
+{
+    struct whpx_vcpu *vcpu = cpu->whpx_vcpu;
+
+    if (!vcpu) {
+        return;
+    }
+    pWHvDeleteVirtualProcessor(whpx_global.partition, cpu->cpu_index);
+    pWHvEmulatorDestroyEmulator(vcpu->emulator);
+    g_free(vcpu);
+    cpu->whpx_vcpu = NULL;
+}
+
+/*
+ * Memory slots
+ */
+
+static void whpx_set_phys_mem(MemoryRegionSection *section, bool add)
+{
+    MemoryRegion *mr = section->mr;
+    hwaddr start_pa = section->offset_within_address_space;
+    ram_addr_t size = int128_get64(section->size);
+    unsigned int delta;
+    void *host_ptr;
+    HRESULT hr;
+
+    /* We only care about RAM and ROM */
+    if (!memory_region_is_ram(mr)) {
+        return;
+    }
+
+    /* Adjust start_pa and size so that they are page-aligned. (Cf
+     * kvm_set_phys_mem() in kvm-all.c).
+     */
+    delta = TARGET_PAGE_SIZE - (start_pa & ~TARGET_PAGE_MASK);
+    delta &= ~TARGET_PAGE_MASK;
+    if (delta > size) {
+        return;
+    }
+    start_pa += delta;
+    size -= delta;
+    size &= TARGET_PAGE_MASK;
+    if (!size || start_pa & ~TARGET_PAGE_MASK) {
+        return;
+    }
+
+    if (add) {
+        WHV_MAP_GPA_RANGE_FLAGS flags = WHvMapGpaRangeFlagRead |
+                                        WHvMapGpaRangeFlagExecute;
+
+        /* Writes to ROM exit to QEMU as MMIO, which drops them */
+        if (!memory_region_is_rom(mr)) {
+            flags |= WHvMapGpaRangeFlagWrite;
+        }
+        host_ptr = memory_region_get_ram_ptr(mr) +
+                   section->offset_within_region + delta;
+        hr = pWHvMapGpaRange(whpx_global.partition, host_ptr, start_pa, size,
+                             flags);
+    } else {
+        hr = pWHvUnmapGpaRange(whpx_global.partition, start_pa, size);
+    }
+    if (FAILED(hr)) {
+        error_report("WHPX: Failed to %s GPA range 0x%" PRIx64 "+0x%" PRIx64
+                     ", hr=%08lx", add ? "map" : "unmap",
+                     (uint64_t)start_pa, (uint64_t)size, hr);
+    }
+}
+
+static void whpx_region_add(MemoryListener *listener,
+                            MemoryRegionSection *section)
+{
+    memory_region_ref(section->mr);
+    whpx_set_phys_mem(section, true);
+}
+
+static void whpx_region_del(MemoryListener *listener,
+                            MemoryRegionSection *section)
+{
+    whpx_set_phys_mem(section, false);
+    memory_region_unref(section->mr);
+}
+
+static void whpx_region_nop(MemoryListener *listener,
+                            MemoryRegionSection *section)
+{
+}
+
+/*
+ * The partition doesn't track the pages the guest writes: report all of
+ * guest RAM as dirty, which is correct for migration, snapshots and the
+ * display, only slower.
+ */
+static void whpx_log_sync(MemoryListener *listener,
+                          MemoryRegionSection *section)
+{
+    MemoryRegion *mr = section->mr;
+
+    if (!memory_region_is_ram(mr)) {
+        return;
+    }
+    memory_region_set_dirty(mr, section->offset_within_region,
+                            int128_get64(section->size));
+}
+
+static void whpx_begin(MemoryListener *listener)
+{
+}
+
+static void whpx_commit(MemoryListener *listener)
+{
+}
+
+static void whpx_log_start(MemoryListener *listener,
+                           MemoryRegionSection *section)
+{
+}
+
+static void whpx_log_stop(MemoryListener *listener,
+                          MemoryRegionSection *section)
+{
+}
+
+static void whpx_log_global_start(struct MemoryListener *listener)
+{
+}
+
+static void whpx_log_global_stop(struct MemoryListener *listener)
+{
+}
+
+static MemoryListener whpx_memory_listener = {
+    .begin = whpx_begin,
+    .commit = whpx_commit,
+    .region_add = whpx_region_add,
+    .region_del = whpx_region_del,
+    .region_nop = whpx_region_nop,
+    .log_start = whpx_log_start,
+    .log_stop = whpx_log_stop,
+    .log_sync = whpx_log_sync,
+    .log_global_start = whpx_log_global_start,
+    .log_global_stop = whpx_log_global_stop,
+    .priority = 10,
+};
+
+/*
+ * Partition setup
+ */
+
+static void whpx_handle_interrupt(CPUState *cpu, int mask)
+{
+    cpu->interrupt_request |= mask;
+
+    if (!qemu_cpu_is_self(cpu)) {
+        qemu_cpu_kick(cpu);
+    }
+}
+
+static int whpx_accel_init(MachineState *ms)
+{
+    struct whpx_state *whpx = &whpx_global;
+    WHV_CAPABILITY capability;
+    WHV_PARTITION_PROPERTY prop;
+    UINT32 cpuid_exits[] = { 1, 0x80000001 };
+    UINT32 size;
+    HRESULT hr;
+
+    if (!whpx_load_functions()) {
+        fprintf(stderr, "WHPX: the Windows Hypervisor Platform is not "
+                "installed\n");
+        return -ENOSYS;
+    }
+
+    memset(&capability, 0, sizeof(capability));
+    hr = pWHvGetCapability(WHvCapabilityCodeHypervisorPresent, &capability,
+                           sizeof(capability), &size);
+    if (FAILED(hr) || !capability.HypervisorPresent) {
+        fprintf(stderr, "WHPX: no hypervisor present, is Hyper-V "
+                "enabled?\n");
+        return -ENODEV;
+    }
+
+    hr = pWHvCreatePartition(&whpx->partition);
+    if (FAILED(hr)) {
+        error_report("WHPX: Failed to create partition, hr=%08lx", hr);
+        return -EINVAL;
+    }
+
+    memset(&prop, 0, sizeof(prop));
+    prop.ProcessorCount = smp_cpus;
+    hr = pWHvSetPartitionProperty(whpx->partition,
+                                  WHvPartitionPropertyCodeProcessorCount,
+                                  &prop, sizeof(prop));
+    if (FAILED(hr)) {
+        error_report("WHPX: Failed to set the processor count to %d, "
+                     "hr=%08lx", smp_cpus, hr);
+        goto error;
+    }
+
+    memset(&prop, 0, sizeof(prop));
+    prop.ExtendedVmExits.X64CpuidExit = 1;
+    hr = pWHvSetPartitionProperty(whpx->partition,
+                                  WHvPartitionPropertyCodeExtendedVmExits,
+                                  &prop, sizeof(prop));
+    if (FAILED(hr)) {
+        error_report("WHPX: Failed to enable CPUID exits, hr=%08lx", hr);
+        goto error;
+    }
+
+    hr = pWHvSetPartitionProperty(whpx->partition,
+                                  WHvPartitionPropertyCodeCpuidExitList,
+                                  cpuid_exits, sizeof(cpuid_exits));
+    if (FAILED(hr)) {
+        error_report("WHPX: Failed to set the CPUID exit list, hr=%08lx", hr);
+        goto error;
+    }
+
+    hr = pWHvSetupPartition(whpx->partition);
+    if (FAILED(hr)) {
+        error_report("WHPX: Failed to set up partition, hr=%08lx", hr);
+        goto error;
+    }
+
+    whpx->partition_ready = true;
+    memory_listener_register(&whpx_memory_listener, &address_space_memory);
+    cpu_interrupt_handler = whpx_handle_interrupt;
+
+    fprintf(stdout, "WHPX is working and emulator runs in fast virt mode.\n");
+    return 0;
+
+error:
+    pWHvDeletePartition(whpx->partition);
+    whpx->partition = NULL;
+    return -EINVAL;
+}
+
+static void whpx_accel_class_init(ObjectClass *oc, void *data)
+{
+    AccelClass *ac = ACCEL_CLASS(oc);
+    ac->name = "WHPX";
+    ac->init_machine = whpx_accel_init;
+    ac->allowed = &whpx_allowed;
+}
+
+static const TypeInfo whpx_accel_type = {
+    .name = TYPE_WHPX_ACCEL,
+    .parent = TYPE_ACCEL,
+    .class_init = whpx_accel_class_init,
+};
+
+static void whpx_type_init(void)
+{
+    type_register_static(&whpx_accel_type);
+}
+
+type_init(whpx_type_init);
@@ -793,6 +793,10 @@ void cpu_mips_store_count (CPUMIPSState *env, uint32_t value);
 void cpu_mips_store_compare (CPUMIPSState *env, uint32_t value);
 void cpu_mips_start_count(CPUMIPSState *env);
 void cpu_mips_stop_count(CPUMIPSState *env);
+/* Count ticks at CPU_MIPS_COUNT_FREQ Hz of the virtual clock */
+#define CPU_MIPS_COUNT_FREQ (100 * 1000 * 1000)
+bool cpu_mips_count_at(CPUMIPSState *env, int64_t now, uint32_t *count);
+void cpu_mips_add_count_notifier(Notifier *notifier);
 
 /* mips_int.c */
 void cpu_mips_soft_irq(CPUMIPSState *env, int irq, int level);
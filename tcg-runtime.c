@@ -29,6 +29,8 @@
 
 #include "exec/helper-head.h"
 
+/* lookup_tb_ptr needs the target's CPU state and lives in cpu-exec.c */
+#define DEF_HELPER_FLAGS_1(name, flags, ret, t1)
 #define DEF_HELPER_FLAGS_2(name, flags, ret, t1, t2) \
   dh_ctype(ret) HELPER(name) (dh_ctype(t1), dh_ctype(t2));
 
@@ -0,0 +1,359 @@
+/*
+ * QTest testcase and microbenchmark for the Android pipe device
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The benchmark only runs in perf mode (-m perf). It drives the device
+ * registers the same way the goldfish pipe kernel driver does, against
+ * the debug services of hw/misc/android_pipe_test.c:
+ *
+ *   sink    PIPE_CMD_WRITE_BUFFER to a 'zero' pipe
+ *   source  PIPE_CMD_READ_BUFFER from a 'zero' pipe
+ *   echo    PIPE_CMD_WRITE_BUFFER then PIPE_CMD_READ_BUFFER on a
+ *           'pingpong' pipe
+ *
+ * and reports ops/sec, MB/s and p50/p99 latencies for each combination of
+ * buffer size and number of pipes. The following environment variables,
+ * all comma-separated lists, select what is measured:
+ *
+ *   ANDROID_PIPE_BENCH_SERVICES  default "sink,source,echo"
+ *   ANDROID_PIPE_BENCH_PIPES     default "1,8,64"
+ *   ANDROID_PIPE_BENCH_SIZES     default "64,4096,65536"
+ *
+ * and ANDROID_PIPE_BENCH_OPS sets the number of operations per run
+ * (default 2000). Every register access goes through the qtest socket,
+ * so the absolute figures are much lower than in a real guest; they are
+ * meant to be compared between builds.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libqtest.h"
+#include "qemu/osdep.h"
+#include "hw/acpi/goldfish_defs.h"
+#include "hw/misc/android_pipe.h"
+
+#define PIPE_BASE           GF_PIPE_IOMEM_BASE
+
+/* Guest RAM used for the transfer buffers, one slot per pipe. */
+#define GUEST_BUF_BASE      0x100000
+#define GUEST_BUF_SLOT      0x10000
+#define MAX_PIPES           256
+
+#define FIRST_CHANNEL       0x1000ULL
+
+static void pipe_write_reg(uint32_t reg, uint32_t value)
+{
+    writel(PIPE_BASE + reg, value);
+}
+
+static uint32_t pipe_read_reg(uint32_t reg)
+{
+    return readl(PIPE_BASE + reg);
+}
+
+static int32_t pipe_command(uint64_t channel, uint32_t cmd,
+                            uint64_t address, uint32_t size)
+{
+    pipe_write_reg(PIPE_REG_CHANNEL, (uint32_t)channel);
+    pipe_write_reg(PIPE_REG_CHANNEL_HIGH, (uint32_t)(channel >> 32));
+    pipe_write_reg(PIPE_REG_SIZE, size);
+    pipe_write_reg(PIPE_REG_ADDRESS, (uint32_t)address);
+    pipe_write_reg(PIPE_REG_ADDRESS_HIGH, (uint32_t)(address >> 32));
+    pipe_write_reg(PIPE_REG_COMMAND, cmd);
+    return (int32_t)pipe_read_reg(PIPE_REG_STATUS);
+}
+
+static uint64_t buffer_addr(int index)
+{
+    return GUEST_BUF_BASE + (uint64_t)index * GUEST_BUF_SLOT;
+}
+
+static void pipe_open(uint64_t channel, uint64_t addr, const char *service)
+{
+    char *name = g_strdup_printf("pipe:%s", service);
+    size_t len = strlen(name) + 1;
+
+    g_assert_cmpint(pipe_command(channel, PIPE_CMD_OPEN, 0, 0), ==, 0);
+    memwrite(addr, name, len);
+    g_assert_cmpint(pipe_command(channel, PIPE_CMD_WRITE_BUFFER, addr, len),
+                    ==, len);
+    g_free(name);
+}
+
+static void pipe_close(uint64_t channel)
+{
+    pipe_command(channel, PIPE_CMD_CLOSE, 0, 0);
+}
+
+static void test_features(void)
+{
+    uint32_t features = pipe_read_reg(PIPE_REG_FEATURES);
+
+    g_assert_cmpuint(pipe_read_reg(PIPE_REG_VERSION), ==, 1);
+    g_assert(features & PIPE_FEATURE_VECTORED_IO);
+    g_assert(features & PIPE_FEATURE_COMMAND_RING);
+    g_assert(features & PIPE_FEATURE_BATCH_POLL);
+}
+
+static void test_unknown_service(void)
+{
+    static const char name[] = "pipe:no-such-service";
+    uint64_t addr = buffer_addr(0);
+
+    g_assert_cmpint(pipe_command(FIRST_CHANNEL, PIPE_CMD_OPEN, 0, 0), ==, 0);
+    memwrite(addr, name, sizeof(name));
+    g_assert_cmpint(pipe_command(FIRST_CHANNEL, PIPE_CMD_WRITE_BUFFER,
+                                 addr, sizeof(name)), ==, PIPE_ERROR_INVAL);
+    pipe_close(FIRST_CHANNEL);
+
+    /* Commands on a channel that isn't open must fail. */
+    g_assert_cmpint(pipe_command(FIRST_CHANNEL, PIPE_CMD_POLL, 0, 0),
+                    ==, PIPE_ERROR_INVAL);
+}
+
+static void test_zero(void)
+{
+    uint8_t buf[4096];
+    uint64_t addr = buffer_addr(0);
+    size_t nn;
+
+    pipe_open(FIRST_CHANNEL, addr, "zero");
+
+    g_assert_cmpint(pipe_command(FIRST_CHANNEL, PIPE_CMD_WRITE_BUFFER,
+                                 addr, sizeof(buf)), ==, sizeof(buf));
+
+    memset(buf, 0xff, sizeof(buf));
+    memwrite(addr, buf, sizeof(buf));
+    g_assert_cmpint(pipe_command(FIRST_CHANNEL, PIPE_CMD_READ_BUFFER,
+                                 addr, sizeof(buf)), ==, sizeof(buf));
+    memread(addr, buf, sizeof(buf));
+    for (nn = 0; nn < sizeof(buf); nn++) {
+        g_assert_cmpuint(buf[nn], ==, 0);
+    }
+
+    g_assert_cmpint(pipe_command(FIRST_CHANNEL, PIPE_CMD_POLL, 0, 0),
+                    ==, PIPE_POLL_IN | PIPE_POLL_OUT);
+    pipe_close(FIRST_CHANNEL);
+}
+
+static void test_pingpong(void)
+{
+    uint8_t out[1000], in[1000];
+    uint64_t addr = buffer_addr(0);
+    size_t nn;
+
+    pipe_open(FIRST_CHANNEL, addr, "pingpong");
+
+    for (nn = 0; nn < sizeof(out); nn++) {
+        out[nn] = nn * 7;
+    }
+    memwrite(addr, out, sizeof(out));
+    g_assert_cmpint(pipe_command(FIRST_CHANNEL, PIPE_CMD_WRITE_BUFFER,
+                                 addr, sizeof(out)), ==, sizeof(out));
+
+    memset(in, 0, sizeof(in));
+    memwrite(addr, in, sizeof(in));
+    g_assert_cmpint(pipe_command(FIRST_CHANNEL, PIPE_CMD_READ_BUFFER,
+                                 addr, sizeof(in)), ==, sizeof(in));
+    memread(addr, in, sizeof(in));
+    g_assert(memcmp(in, out, sizeof(in)) == 0);
+
+    /* Nothing left to read. */
+    g_assert_cmpint(pipe_command(FIRST_CHANNEL, PIPE_CMD_READ_BUFFER,
+                                 addr, sizeof(in)), ==, PIPE_ERROR_AGAIN);
+    pipe_close(FIRST_CHANNEL);
+}
+
+static void test_poll_many(void)
+{
+    struct android_pipe_poll_entry entries[3];
+    uint64_t addr = buffer_addr(2);
+
+    pipe_open(FIRST_CHANNEL, buffer_addr(0), "zero");
+    pipe_open(FIRST_CHANNEL + 1, buffer_addr(1), "pingpong");
+
+    memset(entries, 0, sizeof(entries));
+    entries[0].channel = cpu_to_le64(FIRST_CHANNEL);
+    entries[1].channel = cpu_to_le64(FIRST_CHANNEL + 1);
+    entries[2].channel = cpu_to_le64(FIRST_CHANNEL + 2);
+    memwrite(addr, entries, sizeof(entries));
+
+    g_assert_cmpint(pipe_command(0, PIPE_CMD_POLL_MANY, addr, 3), ==, 3);
+    memread(addr, entries, sizeof(entries));
+    g_assert_cmpint(le32_to_cpu(entries[0].flags), ==,
+                    PIPE_POLL_IN | PIPE_POLL_OUT);
+    g_assert_cmpint(le32_to_cpu(entries[1].flags), ==, PIPE_POLL_OUT);
+    g_assert_cmpint(le32_to_cpu(entries[2].flags), ==, PIPE_ERROR_INVAL);
+
+    pipe_close(FIRST_CHANNEL);
+    pipe_close(FIRST_CHANNEL + 1);
+}
+
+/***********************************************************************
+ * Benchmark
+ */
+
+typedef enum {
+    BENCH_SINK,
+    BENCH_SOURCE,
+    BENCH_ECHO,
+} BenchKind;
+
+static const struct {
+    const char *name;
+    const char *service;
+} bench_services[] = {
+    [BENCH_SINK]   = { "sink",   "zero" },
+    [BENCH_SOURCE] = { "source", "zero" },
+    [BENCH_ECHO]   = { "echo",   "pingpong" },
+};
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static char **bench_param(const char *env, const char *def)
+{
+    const char *value = getenv(env);
+
+    return g_strsplit(value && *value ? value : def, ",", -1);
+}
+
+static void bench_run(BenchKind kind, int num_pipes, uint32_t size, int ops)
+{
+    int64_t *latency = g_new(int64_t, ops);
+    int64_t start, total;
+    double seconds;
+    int nn;
+
+    for (nn = 0; nn < num_pipes; nn++) {
+        pipe_open(FIRST_CHANNEL + nn, buffer_addr(nn),
+                  bench_services[kind].service);
+    }
+
+    start = now_ns();
+    for (nn = 0; nn < ops; nn++) {
+        int index = nn % num_pipes;
+        uint64_t channel = FIRST_CHANNEL + index;
+        uint64_t addr = buffer_addr(index);
+        int64_t op_start = now_ns();
+
+        switch (kind) {
+        case BENCH_SINK:
+            g_assert_cmpint(pipe_command(channel, PIPE_CMD_WRITE_BUFFER,
+                                         addr, size), ==, size);
+            break;
+        case BENCH_SOURCE:
+            g_assert_cmpint(pipe_command(channel, PIPE_CMD_READ_BUFFER,
+                                         addr, size), ==, size);
+            break;
+        case BENCH_ECHO:
+            g_assert_cmpint(pipe_command(channel, PIPE_CMD_WRITE_BUFFER,
+                                         addr, size), ==, size);
+            g_assert_cmpint(pipe_command(channel, PIPE_CMD_READ_BUFFER,
+                                         addr, size), ==, size);
+            break;
+        }
+        latency[nn] = now_ns() - op_start;
+    }
+    total = now_ns() - start;
+
+    for (nn = 0; nn < num_pipes; nn++) {
+        pipe_close(FIRST_CHANNEL + nn);
+    }
+
+    qsort(latency, ops, sizeof(latency[0]), compare_int64);
+    seconds = total / 1e9;
+    printf("%-8s %6d %8u %12.0f %10.2f %10.1f %10.1f\n",
+           bench_services[kind].name, num_pipes, size, ops / seconds,
+           (double)ops * size / seconds / (1024 * 1024),
+           latency[ops / 2] / 1e3, latency[(int64_t)ops * 99 / 100] / 1e3);
+    g_free(latency);
+}
+
+static void test_bench(void)
+{
+    char **services = bench_param("ANDROID_PIPE_BENCH_SERVICES",
+                                  "sink,source,echo");
+    char **pipes = bench_param("ANDROID_PIPE_BENCH_PIPES", "1,8,64");
+    char **sizes = bench_param("ANDROID_PIPE_BENCH_SIZES", "64,4096,65536");
+    const char *ops_env = getenv("ANDROID_PIPE_BENCH_OPS");
+    int ops = ops_env ? atoi(ops_env) : 2000;
+    char **svc, **p, **sz;
+
+    g_assert_cmpint(ops, >, 0);
+
+    printf("\n%-8s %6s %8s %12s %10s %10s %10s\n", "service", "pipes",
+           "size", "ops/s", "MB/s", "p50(us)", "p99(us)");
+
+    for (svc = services; *svc; svc++) {
+        int kind;
+
+        for (kind = 0; kind < ARRAY_SIZE(bench_services); kind++) {
+            if (!strcmp(*svc, bench_services[kind].name)) {
+                break;
+            }
+        }
+        g_assert_cmpint(kind, <, ARRAY_SIZE(bench_services));
+
+        for (p = pipes; *p; p++) {
+            int num_pipes = atoi(*p);
+
+            g_assert_cmpint(num_pipes, >, 0);
+            g_assert_cmpint(num_pipes, <=, MAX_PIPES);
+
+            for (sz = sizes; *sz; sz++) {
+                uint32_t size = atoi(*sz);
+
+                g_assert_cmpuint(size, >, 0);
+                g_assert_cmpuint(size, <=, GUEST_BUF_SLOT);
+                bench_run(kind, num_pipes, size, ops);
+            }
+        }
+    }
+
+    g_strfreev(services);
+    g_strfreev(pipes);
+    g_strfreev(sizes);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/android_pipe/features", test_features);
+    qtest_add_func("/android_pipe/unknown_service", test_unknown_service);
+    qtest_add_func("/android_pipe/zero", test_zero);
+    qtest_add_func("/android_pipe/pingpong", test_pingpong);
+    qtest_add_func("/android_pipe/poll_many", test_poll_many);
+    if (g_test_perf()) {
+        qtest_add_func("/android_pipe/bench", test_bench);
+    }
+
+    qtest_start("-machine pc");
+    ret = g_test_run();
+
+    qtest_end();
+
+    return ret;
+}
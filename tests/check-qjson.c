@@ -19,6 +19,8 @@
 #include "qapi/qmp/qfloat.h"
 #include "qapi/qmp/qbool.h"
 #include "qapi/qmp/qjson.h"
+#include "qapi/qmp/json-parser.h"
+#include "qapi/qmp/json-streamer.h"
 
 #include "qemu-common.h"
 
@@ -1472,6 +1474,175 @@ static void unterminated_literal(void)
     g_assert(obj == NULL);
 }
 
+/* Messages, as a QMP monitor receives them */
+
+typedef struct StreamState {
+    JSONMessageParser parser;
+    int messages;
+    int errors;
+    int64_t id_sum;
+    bool respond;
+    size_t response_bytes;
+} StreamState;
+
+static void stream_respond(StreamState *s, QDict *cmd)
+{
+    QDict *rsp = qdict_new();
+    QDict *ret = qdict_new();
+    QString *json;
+
+    qdict_put(ret, "status", qstring_from_str("running"));
+    qdict_put(ret, "singlestep", qbool_from_int(false));
+    qdict_put(ret, "running", qbool_from_int(true));
+    qdict_put(rsp, "return", ret);
+    if (qdict_haskey(cmd, "id")) {
+        qdict_put_obj(rsp, "id", qdict_get(cmd, "id"));
+        qobject_incref(qdict_get(cmd, "id"));
+    }
+    json = qobject_to_json(QOBJECT(rsp));
+    s->response_bytes += qstring_get_length(json);
+    QDECREF(json);
+    QDECREF(rsp);
+}
+
+static void stream_message(JSONMessageParser *parser, GQueue *tokens)
+{
+    StreamState *s = container_of(parser, StreamState, parser);
+    QObject *obj = json_parser_parse(tokens, NULL);
+    QDict *cmd;
+
+    if (!obj) {
+        s->errors++;
+        return;
+    }
+    cmd = qobject_to_qdict(obj);
+    g_assert(cmd);
+    g_assert_cmpstr(qdict_get_str(cmd, "execute"), !=, "");
+    s->id_sum += qdict_get_int(cmd, "id");
+    s->messages++;
+    if (s->respond) {
+        stream_respond(s, cmd);
+    }
+    qobject_decref(obj);
+}
+
+static const char stream_commands[] =
+    "{\"execute\": \"query-status\", \"id\": 1}\n"
+    "{ 'execute': 'goldfish-event-script', 'arguments': { 'events': ["
+    "{ 'time': 0, 'type': 1, 'code': 30, 'value': 1 }, "
+    "{ 'time': 0, 'type': 0, 'code': 0, 'value': 0 } ] }, 'id': 2 }\r\n"
+    "{\"execute\": \"query-tcg-stats\", \"id\": 3}";
+
+static void stream_feed(StreamState *s, const char *buf, size_t len,
+                        size_t chunk)
+{
+    size_t pos;
+
+    for (pos = 0; pos < len; pos += chunk) {
+        json_message_parser_feed(&s->parser, buf + pos, MIN(chunk, len - pos));
+    }
+}
+
+static void stream_messages(void)
+{
+    static const size_t chunks[] = { 1, 2, 7, 64, 4096 };
+    StreamState s;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(chunks); i++) {
+        memset(&s, 0, sizeof(s));
+        json_message_parser_init(&s.parser, stream_message);
+        stream_feed(&s, stream_commands, strlen(stream_commands), chunks[i]);
+        g_assert_cmpint(s.messages, ==, 3);
+        g_assert_cmpint(s.id_sum, ==, 6);
+        g_assert_cmpint(s.errors, ==, 0);
+        json_message_parser_destroy(&s.parser);
+    }
+}
+
+/* After a lexical error the next message must still get through */
+static void stream_error_recovery(void)
+{
+    static const char input[] =
+        "{'execute': 'a', 'id': 1}\xff{'execute': 'b', 'id': 2}";
+    StreamState s = {};
+
+    json_message_parser_init(&s.parser, stream_message);
+    stream_feed(&s, input, strlen(input), 1);
+    g_assert_cmpint(s.messages, ==, 2);
+    g_assert_cmpint(s.id_sum, ==, 3);
+    g_assert_cmpint(s.errors, ==, 1);
+    json_message_parser_destroy(&s.parser);
+}
+
+/* Full commands-per-second round of a QMP server: parse each command as
+ * it arrives in 4 KiB reads, then build and serialize the response. */
+static void perf_qmp_commands(void)
+{
+    GString *input = g_string_new("");
+    const int rounds = 100000;
+    StreamState s = {};
+    double elapsed;
+    int i;
+
+    for (i = 0; i < rounds; i++) {
+        g_string_append_printf(input, i % 2 ?
+            "{\"execute\": \"query-status\", \"id\": %d}\r\n" :
+            "{\"execute\": \"goldfish-event-script\", \"arguments\": "
+            "{\"events\": [{\"time\": 0, \"type\": 1, \"code\": 30, "
+            "\"value\": 1}, {\"time\": 0, \"type\": 0, \"code\": 0, "
+            "\"value\": 0}]}, \"id\": %d}\r\n", i);
+    }
+
+    s.respond = true;
+    json_message_parser_init(&s.parser, stream_message);
+    g_test_timer_start();
+    stream_feed(&s, input->str, input->len, 4096);
+    elapsed = g_test_timer_elapsed();
+    g_assert_cmpint(s.messages, ==, rounds);
+    g_test_maximized_result(rounds / elapsed,
+                            "QMP: %.0f commands/s, %.1f MiB/s in, %.1f out",
+                            rounds / elapsed,
+                            input->len / elapsed / (1 << 20),
+                            s.response_bytes / elapsed / (1 << 20));
+    json_message_parser_destroy(&s.parser);
+    g_string_free(input, true);
+}
+
+/* Serialization alone, with a reply the size of query-tcg-stats */
+static void perf_to_json(void)
+{
+    QDict *reply = qdict_new();
+    QList *list = qlist_new();
+    const int rounds = 20000;
+    size_t bytes = 0;
+    double elapsed;
+    int i;
+
+    for (i = 0; i < 64; i++) {
+        QDict *entry = qdict_new();
+
+        qdict_put(entry, "name", qstring_from_str("exit-reason-name"));
+        qdict_put(entry, "count", qint_from_int(i * 123457));
+        qdict_put(entry, "fraction", qfloat_from_double(i / 64.0));
+        qlist_append(list, entry);
+    }
+    qdict_put(reply, "return", list);
+
+    g_test_timer_start();
+    for (i = 0; i < rounds; i++) {
+        QString *json = qobject_to_json(QOBJECT(reply));
+
+        bytes += qstring_get_length(json);
+        QDECREF(json);
+    }
+    elapsed = g_test_timer_elapsed();
+    g_test_maximized_result(bytes / elapsed / (1 << 20),
+                            "qobject_to_json: %.0f replies/s, %.1f MiB/s",
+                            rounds / elapsed, bytes / elapsed / (1 << 20));
+    QDECREF(reply);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1508,5 +1679,13 @@ int main(int argc, char **argv)
     g_test_add_func("/errors/invalid_dict_comma", invalid_dict_comma);
     g_test_add_func("/errors/unterminated/literal", unterminated_literal);
 
+    g_test_add_func("/stream/messages", stream_messages);
+    g_test_add_func("/stream/error_recovery", stream_error_recovery);
+
+    if (g_test_perf()) {
+        g_test_add_func("/perf/qmp_commands", perf_qmp_commands);
+        g_test_add_func("/perf/to_json", perf_to_json);
+    }
+
     return g_test_run();
 }
@@ -88,6 +88,55 @@ static void interface_intermediate_test(void)
     test_interface_impl(TYPE_INTERMEDIATE_IMPL);
 }
 
+#define TYPE_UNRELATED "unrelated"
+
+static int unrelated_class_inits;
+
+static void unrelated_class_init(ObjectClass *oc, void *data)
+{
+    unrelated_class_inits++;
+}
+
+static const TypeInfo unrelated_info = {
+    .name = TYPE_UNRELATED,
+    .parent = TYPE_OBJECT,
+    .class_init = unrelated_class_init,
+};
+
+static bool class_list_has(GSList *list, const char *name)
+{
+    for (; list; list = list->next) {
+        if (!g_strcmp0(object_class_get_name(list->data), name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void test_lazy_list(const char *implements)
+{
+    GSList *list = object_class_get_list(implements, false);
+
+    g_assert(class_list_has(list, TYPE_DIRECT_IMPL));
+    g_assert(class_list_has(list, TYPE_INTERMEDIATE_IMPL));
+    g_assert(!class_list_has(list, TYPE_UNRELATED));
+    g_slist_free(list);
+
+    /* Listing other types must not have initialized this class */
+    g_assert_cmpint(unrelated_class_inits, ==, 0);
+}
+
+static void interface_lazy_list_test(void)
+{
+    test_lazy_list(TYPE_TEST_IF);
+    test_lazy_list(TYPE_DIRECT_IMPL);
+    g_assert(!object_class_get_list("no-such-type", true));
+    g_assert_cmpint(unrelated_class_inits, ==, 0);
+
+    g_assert(object_class_by_name(TYPE_UNRELATED));
+    g_assert_cmpint(unrelated_class_inits, ==, 1);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -96,10 +145,12 @@ int main(int argc, char **argv)
     type_register_static(&test_if_info);
     type_register_static(&direct_impl_info);
     type_register_static(&intermediate_impl_info);
+    type_register_static(&unrelated_info);
 
     g_test_add_func("/qom/interface/direct_impl", interface_direct_test);
     g_test_add_func("/qom/interface/intermediate_impl",
                     interface_intermediate_test);
+    g_test_add_func("/qom/interface/lazy_list", interface_lazy_list_test);
 
     return g_test_run();
 }
@@ -0,0 +1,670 @@
+/*
+ * QTest testcase and microbenchmarks for the goldfish devices
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The benchmarks only run in perf mode (-m perf). Each one drives the hot
+ * path of a device through its registers, the way the kernel driver does:
+ *
+ *   events  enqueue    events sent with goldfish-event-script, per event
+ *           dequeue    events read one word at a time from REG_READ
+ *           bulk       events read 64 at a time with REG_READ_MANY
+ *   fb      rgb565     FB_SET_BASE flips, each converting a whole frame
+ *           rgbx8888   the same for a 32-bit guest framebuffer
+ *           damage     32-bit flips posting a 64x64 damage rectangle
+ *   audio   write      AUDIO_WRITE_BUFFER_x of a buffer
+ *           flush      a buffer written and played by the audio timer
+ *   tty     write      TTY_CMD_WRITE_BUFFER to the chardev
+ *           read       TTY_CMD_READ_BUFFER of data sent from the host
+ *   timer   read       TIMER_TIME_LOW then TIMER_TIME_HIGH
+ *
+ * and reports ops/sec and p50/p99 latencies per benchmark and size. The
+ * tty and timer only exist on the MIPS ranchu board. The following
+ * environment variables, comma-separated lists, select what is measured:
+ *
+ *   GOLDFISH_BENCH_DEVICES  default "events,fb,audio,tty,timer"
+ *   GOLDFISH_BENCH_SIZES    default "64,4096", in bytes for the audio and
+ *                           tty benchmarks
+ *
+ * and GOLDFISH_BENCH_OPS sets the number of operations per run (default
+ * 2000). As with tests/android-pipe-test.c, every register access goes
+ * through the qtest socket, so the figures are meant to be compared
+ * between builds rather than with a real guest.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "libqtest.h"
+#include "qemu/osdep.h"
+#include "hw/acpi/goldfish_defs.h"
+
+/* hw/input/goldfish_events.c */
+#define EVENTS_REG_READ         0x00
+#define EVENTS_REG_FEATURES     0xf00
+#define EVENTS_REG_BUF_ADDR     0xf04
+#define EVENTS_REG_BUF_ADDR_HIGH 0xf08
+#define EVENTS_REG_BUF_SIZE     0xf0c
+#define EVENTS_REG_READ_MANY    0xf10
+#define EVENTS_FEATURE_BULK_READ 1
+#define EV_SYN                  0x00
+#define EV_KEY                  0x01
+#define KEY_A                   30
+
+/* hw/display/goldfish_fb.c */
+#define FB_GET_WIDTH            0x00
+#define FB_GET_HEIGHT           0x04
+#define FB_SET_BASE             0x10
+#define FB_GET_FORMAT           0x24
+#define FB_SET_DAMAGE_XY        0x28
+#define FB_SET_DAMAGE_WH        0x2c
+#define FB_GET_FEATURES         0x30
+#define FB_FEATURE_DAMAGE       1
+#define HAL_PIXEL_FORMAT_RGBX_8888  2
+
+/* hw/audio/goldfish_audio.c */
+#define AUDIO_INT_STATUS        0x00
+#define AUDIO_INT_ENABLE        0x04
+#define AUDIO_SET_WRITE_BUFFER_1 0x08
+#define AUDIO_SET_WRITE_BUFFER_2 0x0c
+#define AUDIO_WRITE_BUFFER_1    0x10
+#define AUDIO_WRITE_BUFFER_2    0x14
+#define AUDIO_FEATURES          0x38
+#define AUDIO_INT_WRITE_BUFFER_1_EMPTY  (1U << 0)
+#define AUDIO_INT_WRITE_BUFFER_2_EMPTY  (1U << 1)
+#define AUDIO_FEATURE_RING      1
+/* The period of the audio timer, which plays the buffers */
+#define AUDIO_TIMER_NS          10000000
+
+/* hw/char/goldfish_tty.c */
+#define TTY_BYTES_READY         0x04
+#define TTY_CMD                 0x08
+#define TTY_DATA_PTR            0x10
+#define TTY_DATA_LEN            0x14
+#define TTY_VERSION             0x20
+#define TTY_CMD_WRITE_BUFFER    2
+#define TTY_CMD_READ_BUFFER     3
+#define TTY_RX_BUFFER           4096
+#define TTYS                    3
+
+/* hw/timer/goldfish_timer.c */
+#define TIMER_TIME_LOW          0x00
+#define TIMER_TIME_HIGH         0x04
+
+/* Guest RAM for the device buffers */
+#define GUEST_BUF_BASE          0x100000
+#define GUEST_BUF_SIZE          0x10000
+#define GUEST_FB_BASE           0x1000000
+
+#define BULK_EVENTS             64
+#define ENQUEUE_BATCH           64
+
+typedef struct GoldfishBoard {
+    const char *arch;
+    const char *machine;
+    uint64_t events;
+    uint64_t fb;
+    uint64_t audio;
+    uint64_t tty;               /* first of TTYS, 0 when absent */
+    uint64_t timer;
+} GoldfishBoard;
+
+#define RANCHU_IO(offset)       (0x1f000000 + (offset))
+
+static const GoldfishBoard boards[] = {
+    { "i386", "-machine pc", GF_EVENTS_IOMEM_BASE, GF_FB_IOMEM_BASE,
+      GF_AUDIO_IOMEM_BASE, 0, 0 },
+    { "x86_64", "-machine pc", GF_EVENTS_IOMEM_BASE, GF_FB_IOMEM_BASE,
+      GF_AUDIO_IOMEM_BASE, 0, 0 },
+    { "mips64el", "-machine ranchu", RANCHU_IO(0x09000), RANCHU_IO(0x08000),
+      RANCHU_IO(0x0c000), RANCHU_IO(0x02000), RANCHU_IO(0x05000) },
+};
+
+static const GoldfishBoard *board;
+static char *tty_socket_path;
+static int tty_socket = -1;
+
+/***********************************************************************
+ * Device helpers
+ */
+
+static void events_send(int count)
+{
+    GString *cmd = g_string_new("{ 'execute': 'goldfish-event-script', "
+                                "'arguments': { 'events': [");
+    QDict *response;
+    int nn;
+
+    /* Key events are never coalesced by the device, unlike EV_ABS ones */
+    for (nn = 0; nn < count; nn++) {
+        bool syn = nn % 2;
+
+        g_string_append_printf(cmd, "%s{ 'time': 0, 'type': %d, "
+                               "'code': %d, 'value': %d }",
+                               nn ? ", " : "", syn ? EV_SYN : EV_KEY,
+                               syn ? 0 : KEY_A, syn ? 0 : (nn / 2) & 1);
+    }
+    g_string_append(cmd, "] } }");
+
+    response = qmp(cmd->str);
+    g_assert(response);
+    g_assert(!qdict_haskey(response, "error"));
+    QDECREF(response);
+    g_string_free(cmd, true);
+}
+
+static void events_check_one(int nn)
+{
+    bool syn = nn % 2;
+
+    g_assert_cmpuint(readl(board->events + EVENTS_REG_READ), ==,
+                     syn ? EV_SYN : EV_KEY);
+    g_assert_cmpuint(readl(board->events + EVENTS_REG_READ), ==,
+                     syn ? 0 : KEY_A);
+    g_assert_cmpuint(readl(board->events + EVENTS_REG_READ), ==,
+                     syn ? 0 : (nn / 2) & 1);
+}
+
+static int events_read_many(void)
+{
+    writel(board->events + EVENTS_REG_BUF_ADDR, GUEST_BUF_BASE);
+    writel(board->events + EVENTS_REG_BUF_ADDR_HIGH, 0);
+    writel(board->events + EVENTS_REG_BUF_SIZE, BULK_EVENTS);
+    return readl(board->events + EVENTS_REG_READ_MANY);
+}
+
+static void fb_flip(int frame)
+{
+    uint32_t width = readl(board->fb + FB_GET_WIDTH);
+    uint32_t height = readl(board->fb + FB_GET_HEIGHT);
+
+    /* Two frames, each large enough for 32 bits per pixel */
+    writel(board->fb + FB_SET_BASE,
+           GUEST_FB_BASE + (frame & 1) * width * height * 4);
+}
+
+/* Flip to @frame, telling the device only a @w x @h rectangle changed */
+static void fb_flip_damage(int frame, int x, int y, int w, int h)
+{
+    writel(board->fb + FB_SET_DAMAGE_XY, x | y << 16);
+    writel(board->fb + FB_SET_DAMAGE_WH, w | h << 16);
+    fb_flip(frame);
+}
+
+static void audio_write(int buffer, uint64_t addr, uint32_t size)
+{
+    writel(board->audio + (buffer ? AUDIO_SET_WRITE_BUFFER_2
+                                  : AUDIO_SET_WRITE_BUFFER_1), addr);
+    writel(board->audio + (buffer ? AUDIO_WRITE_BUFFER_2
+                                  : AUDIO_WRITE_BUFFER_1), size);
+}
+
+/* Run the audio timer until @buffer has been played */
+static void audio_wait_empty(int buffer)
+{
+    uint32_t empty = buffer ? AUDIO_INT_WRITE_BUFFER_2_EMPTY
+                            : AUDIO_INT_WRITE_BUFFER_1_EMPTY;
+    int tries;
+
+    for (tries = 0; tries < 1000; tries++) {
+        if (readl(board->audio + AUDIO_INT_STATUS) & empty) {
+            return;
+        }
+        clock_step(AUDIO_TIMER_NS);
+    }
+    g_assert_not_reached();
+}
+
+static void tty_command(uint64_t base, uint32_t cmd, uint64_t addr,
+                        uint32_t size)
+{
+    writel(base + TTY_DATA_PTR, addr);
+    writel(base + TTY_DATA_LEN, size);
+    writel(base + TTY_CMD, cmd);
+}
+
+/* Discard what the ttys wrote to the socket */
+static void tty_drain(void)
+{
+    char buf[4096];
+
+    while (recv(tty_socket, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+        /* nothing */
+    }
+}
+
+/* Send @size bytes from the host, and return the base of the tty that
+ * receives them once they have all arrived; all the ttys share the
+ * chardev, only one of them gets its input. */
+static uint64_t tty_feed(const uint8_t *buf, size_t size)
+{
+    int tries, nn;
+
+    g_assert_cmpint(send(tty_socket, buf, size, 0), ==, size);
+    for (tries = 0; tries < 100000; tries++) {
+        for (nn = 0; nn < TTYS; nn++) {
+            uint64_t base = board->tty + nn * 0x1000;
+
+            if (readl(base + TTY_BYTES_READY) == size) {
+                return base;
+            }
+        }
+    }
+    g_assert_not_reached();
+    return 0;
+}
+
+static uint64_t timer_read(void)
+{
+    uint64_t low = readl(board->timer + TIMER_TIME_LOW);
+
+    return low | (uint64_t)readl(board->timer + TIMER_TIME_HIGH) << 32;
+}
+
+/***********************************************************************
+ * Tests
+ */
+
+static void test_events(void)
+{
+    int nn;
+
+    g_assert(readl(board->events + EVENTS_REG_FEATURES) &
+             EVENTS_FEATURE_BULK_READ);
+
+    events_send(4);
+    for (nn = 0; nn < 4; nn++) {
+        events_check_one(nn);
+    }
+    g_assert_cmpuint(readl(board->events + EVENTS_REG_READ), ==, 0);
+
+    events_send(BULK_EVENTS + 2);
+    g_assert_cmpint(events_read_many(), ==, BULK_EVENTS);
+    g_assert_cmpint(events_read_many(), ==, 2);
+    g_assert_cmpint(events_read_many(), ==, 0);
+}
+
+static void test_fb(void)
+{
+    uint32_t width = readl(board->fb + FB_GET_WIDTH);
+    uint32_t height = readl(board->fb + FB_GET_HEIGHT);
+
+    g_assert_cmpuint(width, >, 0);
+    g_assert_cmpuint(height, >, 0);
+    qmemset(GUEST_FB_BASE, 0x5a, width * height * 4 * 2);
+    fb_flip(0);
+    fb_flip(1);
+
+    g_assert(readl(board->fb + FB_GET_FEATURES) & FB_FEATURE_DAMAGE);
+    fb_flip_damage(0, 10, 20, 30, 40);
+    /* Clipped to the framebuffer, or empty */
+    fb_flip_damage(1, width - 8, height - 8, 64, 64);
+    fb_flip_damage(0, 0, 0, 0, 0);
+    fb_flip(1);
+}
+
+static void test_audio(void)
+{
+    g_assert(readl(board->audio + AUDIO_FEATURES) & AUDIO_FEATURE_RING);
+
+    writel(board->audio + AUDIO_INT_ENABLE,
+           AUDIO_INT_WRITE_BUFFER_1_EMPTY | AUDIO_INT_WRITE_BUFFER_2_EMPTY);
+    qmemset(GUEST_BUF_BASE, 0, 4096);
+    audio_write(0, GUEST_BUF_BASE, 4096);
+    g_assert(!(readl(board->audio + AUDIO_INT_STATUS) &
+               AUDIO_INT_WRITE_BUFFER_1_EMPTY));
+    audio_wait_empty(0);
+}
+
+static void test_tty(void)
+{
+    uint8_t out[100], in[100];
+    uint64_t base;
+    int nn;
+
+    g_assert_cmpuint(readl(board->tty + TTY_VERSION), ==, 2);
+
+    for (nn = 0; nn < sizeof(out); nn++) {
+        out[nn] = nn * 7;
+    }
+    base = tty_feed(out, sizeof(out));
+    tty_command(base, TTY_CMD_READ_BUFFER, GUEST_BUF_BASE, sizeof(in));
+    memread(GUEST_BUF_BASE, in, sizeof(in));
+    g_assert(memcmp(in, out, sizeof(in)) == 0);
+    g_assert_cmpuint(readl(base + TTY_BYTES_READY), ==, 0);
+
+    memwrite(GUEST_BUF_BASE, out, sizeof(out));
+    tty_command(board->tty, TTY_CMD_WRITE_BUFFER, GUEST_BUF_BASE,
+                sizeof(out));
+    tty_drain();
+}
+
+static void test_timer(void)
+{
+    uint64_t before = timer_read();
+
+    clock_step(1000000);
+    g_assert_cmpuint(timer_read(), >=, before + 1000000);
+}
+
+/***********************************************************************
+ * Benchmarks
+ */
+
+typedef enum {
+    BENCH_EVENTS_ENQUEUE,
+    BENCH_EVENTS_DEQUEUE,
+    BENCH_EVENTS_BULK,
+    BENCH_FB_RGB565,
+    BENCH_FB_RGBX8888,
+    BENCH_FB_DAMAGE,
+    BENCH_AUDIO_WRITE,
+    BENCH_AUDIO_FLUSH,
+    BENCH_TTY_WRITE,
+    BENCH_TTY_READ,
+    BENCH_TIMER_READ,
+} BenchKind;
+
+static const struct {
+    const char *device;
+    const char *name;
+    bool sized;
+} bench_kinds[] = {
+    [BENCH_EVENTS_ENQUEUE] = { "events", "enqueue",  false },
+    [BENCH_EVENTS_DEQUEUE] = { "events", "dequeue",  false },
+    [BENCH_EVENTS_BULK]    = { "events", "bulk",     false },
+    [BENCH_FB_RGB565]      = { "fb",     "rgb565",   false },
+    [BENCH_FB_RGBX8888]    = { "fb",     "rgbx8888", false },
+    [BENCH_FB_DAMAGE]      = { "fb",     "damage",   false },
+    [BENCH_AUDIO_WRITE]    = { "audio",  "write",    true },
+    [BENCH_AUDIO_FLUSH]    = { "audio",  "flush",    true },
+    [BENCH_TTY_WRITE]      = { "tty",    "write",    true },
+    [BENCH_TTY_READ]       = { "tty",    "read",     true },
+    [BENCH_TIMER_READ]     = { "timer",  "read",     false },
+};
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static char **bench_param(const char *env, const char *def)
+{
+    const char *value = getenv(env);
+
+    return g_strsplit(value && *value ? value : def, ",", -1);
+}
+
+/* Run one operation of @kind and return its cost in ns. Work the
+ * operation needs but that isn't part of the measured path, such as
+ * queueing the events to dequeue, isn't counted. */
+static int64_t bench_op(BenchKind kind, int nn, uint32_t size)
+{
+    uint8_t buf[TTY_RX_BUFFER];
+    int64_t start, cost;
+    uint64_t base;
+
+    switch (kind) {
+    case BENCH_EVENTS_ENQUEUE:
+        start = now_ns();
+        events_send(ENQUEUE_BATCH);
+        cost = (now_ns() - start) / ENQUEUE_BATCH;
+        while (events_read_many() > 0) {
+            /* drain */
+        }
+        return cost;
+    case BENCH_EVENTS_DEQUEUE:
+        if (nn % ENQUEUE_BATCH == 0) {
+            events_send(ENQUEUE_BATCH);
+        }
+        start = now_ns();
+        events_check_one(nn % ENQUEUE_BATCH);
+        return now_ns() - start;
+    case BENCH_EVENTS_BULK:
+        events_send(BULK_EVENTS);
+        start = now_ns();
+        g_assert_cmpint(events_read_many(), ==, BULK_EVENTS);
+        return (now_ns() - start) / BULK_EVENTS;
+    case BENCH_FB_RGB565:
+    case BENCH_FB_RGBX8888:
+        start = now_ns();
+        fb_flip(nn);
+        return now_ns() - start;
+    case BENCH_FB_DAMAGE:
+        start = now_ns();
+        fb_flip_damage(nn, (nn * 64) % 256, 64, 64, 64);
+        return now_ns() - start;
+    case BENCH_AUDIO_WRITE:
+        start = now_ns();
+        audio_write(nn & 1, GUEST_BUF_BASE + (nn & 1) * GUEST_BUF_SIZE, size);
+        return now_ns() - start;
+    case BENCH_AUDIO_FLUSH:
+        start = now_ns();
+        audio_write(0, GUEST_BUF_BASE, size);
+        audio_wait_empty(0);
+        return now_ns() - start;
+    case BENCH_TTY_WRITE:
+        start = now_ns();
+        tty_command(board->tty, TTY_CMD_WRITE_BUFFER, GUEST_BUF_BASE, size);
+        cost = now_ns() - start;
+        tty_drain();
+        return cost;
+    case BENCH_TTY_READ:
+        memset(buf, nn, size);
+        base = tty_feed(buf, size);
+        start = now_ns();
+        tty_command(base, TTY_CMD_READ_BUFFER, GUEST_BUF_BASE, size);
+        return now_ns() - start;
+    case BENCH_TIMER_READ:
+        start = now_ns();
+        timer_read();
+        return now_ns() - start;
+    }
+    g_assert_not_reached();
+    return 0;
+}
+
+static void bench_prepare(BenchKind kind)
+{
+    uint32_t width, height;
+
+    switch (kind) {
+    case BENCH_FB_RGB565:
+    case BENCH_FB_RGBX8888:
+    case BENCH_FB_DAMAGE:
+        width = readl(board->fb + FB_GET_WIDTH);
+        height = readl(board->fb + FB_GET_HEIGHT);
+        qmemset(GUEST_FB_BASE, 0x5a, width * height * 4 * 2);
+        /* Reading the format switches the device to 32-bit frames */
+        if (kind != BENCH_FB_RGB565) {
+            g_assert_cmpuint(readl(board->fb + FB_GET_FORMAT), ==,
+                             HAL_PIXEL_FORMAT_RGBX_8888);
+        }
+        break;
+    case BENCH_AUDIO_WRITE:
+    case BENCH_AUDIO_FLUSH:
+        writel(board->audio + AUDIO_INT_ENABLE,
+               AUDIO_INT_WRITE_BUFFER_1_EMPTY |
+               AUDIO_INT_WRITE_BUFFER_2_EMPTY);
+        qmemset(GUEST_BUF_BASE, 0, GUEST_BUF_SIZE * 2);
+        break;
+    case BENCH_TTY_WRITE:
+        qmemset(GUEST_BUF_BASE, 'x', GUEST_BUF_SIZE);
+        break;
+    default:
+        break;
+    }
+}
+
+static void bench_run(BenchKind kind, uint32_t size, int ops)
+{
+    int64_t *latency = g_new(int64_t, ops);
+    int64_t total = 0;
+    int nn;
+
+    bench_prepare(kind);
+    for (nn = 0; nn < ops; nn++) {
+        latency[nn] = bench_op(kind, nn, size);
+        total += latency[nn];
+    }
+    if (kind == BENCH_AUDIO_WRITE) {
+        writel(board->audio + AUDIO_INT_ENABLE, 0);
+    }
+
+    qsort(latency, ops, sizeof(latency[0]), compare_int64);
+    printf("%-8s %-10s %8u %12.0f %10.2f %10.2f\n",
+           bench_kinds[kind].device, bench_kinds[kind].name, size,
+           ops / (total / 1e9), latency[ops / 2] / 1e3,
+           latency[(int64_t)ops * 99 / 100] / 1e3);
+    g_free(latency);
+}
+
+static bool bench_has_device(const char *device)
+{
+    if (!strcmp(device, "tty")) {
+        return board->tty != 0;
+    }
+    if (!strcmp(device, "timer")) {
+        return board->timer != 0;
+    }
+    return true;
+}
+
+static void test_bench(void)
+{
+    char **devices = bench_param("GOLDFISH_BENCH_DEVICES",
+                                 "events,fb,audio,tty,timer");
+    char **sizes = bench_param("GOLDFISH_BENCH_SIZES", "64,4096");
+    const char *ops_env = getenv("GOLDFISH_BENCH_OPS");
+    int ops = ops_env ? atoi(ops_env) : 2000;
+    char **dev, **sz;
+    int kind;
+
+    g_assert_cmpint(ops, >, 0);
+
+    printf("\n%-8s %-10s %8s %12s %10s %10s\n", "device", "op", "size",
+           "ops/s", "p50(us)", "p99(us)");
+
+    for (dev = devices; *dev; dev++) {
+        bool found = false;
+
+        if (!bench_has_device(*dev)) {
+            continue;
+        }
+        for (kind = 0; kind < ARRAY_SIZE(bench_kinds); kind++) {
+            if (strcmp(*dev, bench_kinds[kind].device)) {
+                continue;
+            }
+            found = true;
+            if (!bench_kinds[kind].sized) {
+                bench_run(kind, 0, ops);
+                continue;
+            }
+            for (sz = sizes; *sz; sz++) {
+                uint32_t size = atoi(*sz);
+
+                g_assert_cmpuint(size, >, 0);
+                g_assert_cmpuint(size, <=, TTY_RX_BUFFER);
+                bench_run(kind, size, ops);
+            }
+        }
+        g_assert(found);
+    }
+
+    g_strfreev(devices);
+    g_strfreev(sizes);
+}
+
+static void tty_connect(void)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int tries;
+
+    tty_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    g_assert_cmpint(tty_socket, >=, 0);
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", tty_socket_path);
+    for (tries = 0; tries < 100; tries++) {
+        if (!connect(tty_socket, (struct sockaddr *)&addr, sizeof(addr))) {
+            return;
+        }
+        g_usleep(10000);
+    }
+    g_assert_not_reached();
+}
+
+int main(int argc, char **argv)
+{
+    const char *arch = qtest_get_arch();
+    char *args;
+    int ret, nn;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (nn = 0; nn < ARRAY_SIZE(boards); nn++) {
+        if (!strcmp(arch, boards[nn].arch)) {
+            board = &boards[nn];
+        }
+    }
+    if (!board) {
+        g_test_message("No goldfish board for %s", arch);
+        return 0;
+    }
+
+    qtest_add_func("/goldfish/events", test_events);
+    qtest_add_func("/goldfish/fb", test_fb);
+    qtest_add_func("/goldfish/audio", test_audio);
+    if (board->tty) {
+        qtest_add_func("/goldfish/tty", test_tty);
+    }
+    if (board->timer) {
+        qtest_add_func("/goldfish/timer", test_timer);
+    }
+    if (g_test_perf()) {
+        qtest_add_func("/goldfish/bench", test_bench);
+    }
+
+    /* The audio timer plays the buffers on the virtual clock */
+    setenv("QEMU_AUDIO_DRV", "none", 1);
+    if (board->tty) {
+        tty_socket_path = g_strdup_printf("/tmp/goldfish-test-%d.sock",
+                                          getpid());
+        args = g_strdup_printf("%s -serial unix:%s,server,nowait",
+                               board->machine, tty_socket_path);
+    } else {
+        args = g_strdup(board->machine);
+    }
+    qtest_start(args);
+    if (board->tty) {
+        tty_connect();
+    }
+    ret = g_test_run();
+
+    qtest_end();
+    if (tty_socket >= 0) {
+        close(tty_socket);
+        unlink(tty_socket_path);
+    }
+    g_free(tty_socket_path);
+    g_free(args);
+
+    return ret;
+}
@@ -0,0 +1,113 @@
+/*
+ * Condition code micro benchmark
+ *
+ * Runs loops where flags set by one instruction are used by the next, in
+ * the patterns compilers emit for integer code, and prints a checksum for
+ * each, plus the time taken on stderr.  The checksums must match between a
+ * native run and a run under qemu; compare the times to see how expensive
+ * each group is to emulate.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define ITERATIONS  20000000
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* cmp then jl/jle/jbe/setg: signed and unsigned compares */
+static uint32_t run_cmp(void)
+{
+    uint32_t acc = 0, x = 1;
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        x = x * 1103515245 + 12345;
+        asm("cmp %2, %1\n\t"
+            "jl 1f\n\t"
+            "add $3, %0\n"
+            "1:\tcmp $0x40000000, %1\n\t"
+            "jbe 2f\n\t"
+            "xor %1, %0\n"
+            "2:\tcmp %0, %1\n\t"
+            "setg %%cl\n\t"
+            "movzbl %%cl, %%ecx\n\t"
+            "add %%ecx, %0"
+            : "+r" (acc) : "r" (x), "r" (i) : "ecx", "cc");
+    }
+    return acc;
+}
+
+/* test/and/or then jle/jbe/jo/setl, where C and O are known clear */
+static uint32_t run_logic(void)
+{
+    uint32_t acc = 0, x = 1;
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        x = x * 1103515245 + 12345;
+        asm("test %1, %1\n\t"
+            "jle 1f\n\t"
+            "inc %0\n"
+            "1:\tand $0xff00, %1\n\t"
+            "jbe 2f\n\t"
+            "add $5, %0\n"
+            "2:\tor %0, %1\n\t"
+            "jo 3f\n\t"
+            "setl %%cl\n\t"
+            "movzbl %%cl, %%ecx\n\t"
+            "add %%ecx, %0\n"
+            "3:"
+            : "+r" (acc), "+r" (x) : : "ecx", "cc");
+    }
+    return acc;
+}
+
+/* dec/jg and inc/jl counted loops, plus jo after inc */
+static uint32_t run_incdec(void)
+{
+    uint32_t acc = 0;
+    int i;
+
+    for (i = 0; i < ITERATIONS / 4; i++) {
+        asm("mov $4, %%ecx\n"
+            "1:\tadd %%ecx, %0\n\t"
+            "dec %%ecx\n\t"
+            "jg 1b\n\t"
+            "mov $-3, %%ecx\n"
+            "2:\txor %%ecx, %0\n\t"
+            "inc %%ecx\n\t"
+            "jle 2b\n\t"
+            "mov %0, %%ecx\n\t"
+            "or $0x7fffffff, %%ecx\n\t"
+            "inc %%ecx\n\t"
+            "jno 3f\n\t"
+            "add $7, %0\n"
+            "3:"
+            : "+r" (acc) : : "ecx", "cc");
+    }
+    return acc;
+}
+
+static void run(const char *name, uint32_t (*fn)(void))
+{
+    double start = now();
+    uint32_t v = fn();
+
+    printf("%-10s %08x\n", name, v);
+    fprintf(stderr, "%-10s %.3f s\n", name, now() - start);
+}
+
+int main(void)
+{
+    run("cmp", run_cmp);
+    run("logic", run_logic);
+    run("incdec", run_incdec);
+    return 0;
+}
@@ -0,0 +1,169 @@
+/*
+ * CRC32C and Internet checksum unit-tests.
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "qemu/crc32c.h"
+#include "net/checksum.h"
+
+#define BUF_SIZE    (64 * 1024 + 64)
+
+static uint8_t *test_buf(void)
+{
+    uint8_t *buf = g_malloc(BUF_SIZE);
+    int i;
+
+    for (i = 0; i < BUF_SIZE; i++) {
+        buf[i] = g_test_rand_int();
+    }
+    return buf;
+}
+
+/* Bit at a time, straight from the definition */
+static uint32_t crc32c_ref(uint32_t crc, const uint8_t *data, size_t len)
+{
+    int i;
+
+    while (len--) {
+        crc ^= *data++;
+        for (i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+        }
+    }
+    return crc ^ 0xffffffff;
+}
+
+/* The byte-wise sum that net_checksum_add_cont used to compute */
+static uint32_t net_checksum_ref(int len, const uint8_t *buf, int seq)
+{
+    uint32_t sum = 0;
+    int i;
+
+    for (i = seq; i < seq + len; i++) {
+        sum += (i & 1) ? buf[i - seq] : (uint32_t)buf[i - seq] << 8;
+    }
+    return sum;
+}
+
+static void test_crc32c_vectors(void)
+{
+    static const uint8_t zeroes[32];
+    uint8_t ones[32];
+
+    memset(ones, 0xff, sizeof(ones));
+    /* RFC 3720, B.4 */
+    g_assert_cmphex(crc32c(0xffffffff, zeroes, 32), ==, 0x8a9136aa);
+    g_assert_cmphex(crc32c(0xffffffff, ones, 32), ==, 0x62a8ab43);
+    g_assert_cmphex(crc32c(0xffffffff, (const uint8_t *)"123456789", 9),
+                    ==, 0xe3069283);
+    g_assert_cmphex(crc32c(0xffffffff, zeroes, 0), ==, 0);
+}
+
+static void test_crc32c_random(void)
+{
+    uint8_t *buf = test_buf();
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        int off = g_test_rand_int_range(0, 64);
+        int len = g_test_rand_int_range(0, i < 900 ? 256 : BUF_SIZE - 64);
+
+        g_assert_cmphex(crc32c(0xffffffff, buf + off, len), ==,
+                        crc32c_ref(0xffffffff, buf + off, len));
+    }
+    g_free(buf);
+}
+
+static void test_net_checksum_random(void)
+{
+    uint8_t *buf = test_buf();
+    int i;
+
+    for (i = 0; i < 2000; i++) {
+        int off = g_test_rand_int_range(0, 64);
+        int len = g_test_rand_int_range(0, i < 1800 ? 256 : BUF_SIZE - 64);
+        int seq = g_test_rand_int_range(0, 4);
+        uint32_t sum = net_checksum_add_cont(len, buf + off, seq);
+        uint32_t ref = net_checksum_ref(len, buf + off, seq);
+
+        /* Only the folded value is defined, and whether it is zero */
+        g_assert_cmphex(net_checksum_finish(sum), ==, net_checksum_finish(ref));
+        g_assert_cmpint(sum == 0, ==, ref == 0);
+    }
+    g_free(buf);
+}
+
+static void test_net_checksum_packet(void)
+{
+    /* IPv4 UDP packet with an Ethernet header, from 10.0.2.15 to 10.0.2.3 */
+    uint8_t pkt[] = {
+        0x52, 0x55, 0x0a, 0x00, 0x02, 0x03, 0x52, 0x54, 0x00, 0x12, 0x34, 0x56,
+        0x08, 0x00,
+        0x45, 0x00, 0x00, 0x21, 0x00, 0x00, 0x40, 0x00, 0x40, 0x11, 0x22, 0xbb,
+        0x0a, 0x00, 0x02, 0x0f, 0x0a, 0x00, 0x02, 0x03,
+        0xc0, 0x01, 0x00, 0x35, 0x00, 0x0d, 0x00, 0x00,
+        'h', 'e', 'l', 'l', 'o',
+    };
+
+    net_checksum_calculate(pkt, sizeof(pkt));
+    g_assert_cmphex(pkt[40] << 8 | pkt[41], ==, 0xe3b9);
+    /* The checksum of an IPv4 header that has its checksum is zero */
+    g_assert_cmphex(net_raw_checksum(pkt + 14, 20), ==, 0);
+}
+
+static void test_crc32c_perf(void)
+{
+    uint8_t *buf = test_buf();
+    uint32_t crc = 0xffffffff;
+    double elapsed;
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < 4096; i++) {
+        crc = crc32c(crc, buf, 64 * 1024);
+    }
+    elapsed = g_test_timer_elapsed();
+    g_test_maximized_result(256 / elapsed, "crc32c: %.0f MiB/s (%08x)",
+                            256 / elapsed, crc);
+    g_free(buf);
+}
+
+static void test_net_checksum_perf(void)
+{
+    uint8_t *buf = test_buf();
+    uint32_t sum = 0;
+    double elapsed;
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < 4096 * 44; i++) {
+        sum += net_checksum_add(1500, buf + (i & 63));
+    }
+    elapsed = g_test_timer_elapsed();
+    g_test_maximized_result(4096 * 44 * 1500 / elapsed / (1 << 20),
+                            "net_checksum_add: %.0f MiB/s (%04x)",
+                            4096 * 44 * 1500 / elapsed / (1 << 20),
+                            net_checksum_finish(sum));
+    g_free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/checksum/crc32c/vectors", test_crc32c_vectors);
+    g_test_add_func("/checksum/crc32c/random", test_crc32c_random);
+    g_test_add_func("/checksum/net/random", test_net_checksum_random);
+    g_test_add_func("/checksum/net/packet", test_net_checksum_packet);
+    if (g_test_perf()) {
+        g_test_add_func("/checksum/perf/crc32c", test_crc32c_perf);
+        g_test_add_func("/checksum/perf/net", test_net_checksum_perf);
+    }
+    return g_test_run();
+}
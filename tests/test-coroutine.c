@@ -12,6 +12,7 @@
  */
 
 #include <glib.h>
+#include "qemu/thread.h"
 #include "block/coroutine.h"
 
 /*
@@ -230,6 +231,57 @@ static void perf_lifecycle(void)
     g_test_message("Lifecycle %u iterations: %f s\n", max, duration);
 }
 
+/* The same in several threads at once, which all share the release pool */
+#define LIFECYCLE_THREADS 4
+
+static void *lifecycle_thread(void *opaque)
+{
+    unsigned int i, max = *(unsigned int *)opaque;
+
+    for (i = 0; i < max; i++) {
+        Coroutine *coroutine = qemu_coroutine_create(empty_coroutine);
+        qemu_coroutine_enter(coroutine, NULL);
+    }
+    return NULL;
+}
+
+static void run_lifecycle_threads(unsigned int max)
+{
+    QemuThread threads[LIFECYCLE_THREADS];
+    unsigned int i;
+
+    for (i = 0; i < LIFECYCLE_THREADS; i++) {
+        qemu_thread_create(&threads[i], "lifecycle", lifecycle_thread, &max,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < LIFECYCLE_THREADS; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+}
+
+/* Coroutines recycled through the pools must come back usable */
+static void test_lifecycle_threads(void)
+{
+    run_lifecycle_threads(10000);
+    test_lifecycle();
+}
+
+static void perf_lifecycle_threads(void)
+{
+    unsigned int max;
+    double duration;
+
+    max = 1000000;
+
+    g_test_timer_start();
+    run_lifecycle_threads(max);
+    duration = g_test_timer_elapsed();
+
+    g_test_message("Lifecycle %u iterations in %d threads: %f s, "
+                   "%f M coroutines/s\n", max, LIFECYCLE_THREADS, duration,
+                   max * LIFECYCLE_THREADS / duration / 1e6);
+}
+
 static void perf_nesting(void)
 {
     unsigned int i, maxcycles, maxnesting;
@@ -344,6 +396,7 @@ int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/basic/lifecycle", test_lifecycle);
+    g_test_add_func("/basic/lifecycle-threads", test_lifecycle_threads);
     g_test_add_func("/basic/yield", test_yield);
     g_test_add_func("/basic/nesting", test_nesting);
     g_test_add_func("/basic/self", test_self);
@@ -351,6 +404,7 @@ int main(int argc, char **argv)
     g_test_add_func("/basic/order", test_order);
     if (g_test_perf()) {
         g_test_add_func("/perf/lifecycle", perf_lifecycle);
+        g_test_add_func("/perf/lifecycle-threads", perf_lifecycle_threads);
         g_test_add_func("/perf/nesting", perf_nesting);
         g_test_add_func("/perf/yield", perf_yield);
         g_test_add_func("/perf/function-call", perf_baseline);
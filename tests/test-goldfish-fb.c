@@ -0,0 +1,118 @@
+/*
+ * Test the goldfish framebuffer pixel conversion and rotation kernels
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "hw/display/goldfish_fb_simd.h"
+
+/* Odd sizes and offsets exercise the scalar tails and unaligned accesses. */
+#define MAX_WIDTH  259
+
+static void fill_random(uint8_t *buf, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = g_test_rand_int_range(0, 256);
+    }
+}
+
+static void test_convert(gconstpointer opaque)
+{
+    bool rgb565 = opaque != NULL;
+    int src_bpp = rgb565 ? 2 : 4;
+    uint8_t src[MAX_WIDTH * 4 + 1];
+    uint8_t expected[MAX_WIDTH * 4 + 1];
+    uint8_t actual[MAX_WIDTH * 4 + 1];
+    const GoldfishFbKernels *const *kernels;
+    int count, i, width, offset;
+
+    kernels = goldfish_fb_get_all_kernels(&count);
+    g_assert_cmpint(count, >=, 1);
+    g_assert_cmpstr(kernels[0]->name, ==, "c");
+
+    for (width = 0; width <= MAX_WIDTH; width += 7) {
+        for (offset = 0; offset <= 1; offset++) {
+            fill_random(src, sizeof(src));
+            memset(expected, 0xaa, sizeof(expected));
+            if (rgb565) {
+                kernels[0]->rgb565_to_xrgb8888(expected + offset,
+                                               src + offset, width);
+            } else {
+                kernels[0]->rgbx8888_to_xrgb8888(expected + offset,
+                                                 src + offset, width);
+            }
+            for (i = 1; i < count; i++) {
+                memset(actual, 0xaa, sizeof(actual));
+                if (rgb565) {
+                    kernels[i]->rgb565_to_xrgb8888(actual + offset,
+                                                   src + offset, width);
+                } else {
+                    kernels[i]->rgbx8888_to_xrgb8888(actual + offset,
+                                                     src + offset, width);
+                }
+                if (memcmp(expected, actual, sizeof(actual))) {
+                    g_test_message("kernel %s, width %d, source bpp %d",
+                                   kernels[i]->name, width, src_bpp);
+                }
+                g_assert(memcmp(expected, actual, sizeof(actual)) == 0);
+            }
+        }
+    }
+}
+
+static void test_rotate(gconstpointer opaque)
+{
+    int rotation = GPOINTER_TO_INT(opaque);
+    const int cols = 37, height = 21;
+    uint32_t src[21][37];
+    uint32_t dst[37][21];
+    int x, y, first, rows;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < cols; x++) {
+            src[y][x] = (y << 16) | x;
+        }
+    }
+
+    /* Rotate the whole image in two bands, like two dirty updates. */
+    memset(dst, 0, sizeof(dst));
+    for (first = 0; first < height; first += rows) {
+        rows = MIN(17, height - first);
+        goldfish_fb_rotate_32((uint8_t *)dst, sizeof(dst[0]),
+                              (uint8_t *)src[first], sizeof(src[0]),
+                              cols, height, first, rows, rotation);
+    }
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < cols; x++) {
+            if (rotation == 1) {
+                g_assert_cmphex(dst[x][height - 1 - y], ==, src[y][x]);
+            } else {
+                g_assert_cmphex(dst[cols - 1 - x][y], ==, src[y][x]);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_data_func("/goldfish_fb/convert/rgb565", (void *)1,
+                         test_convert);
+    g_test_add_data_func("/goldfish_fb/convert/rgbx8888", NULL,
+                         test_convert);
+    g_test_add_data_func("/goldfish_fb/rotate/90", GINT_TO_POINTER(1),
+                         test_rotate);
+    g_test_add_data_func("/goldfish_fb/rotate/270", GINT_TO_POINTER(3),
+                         test_rotate);
+    return g_test_run();
+}
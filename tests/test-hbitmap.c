@@ -11,6 +11,7 @@
 
 #include <glib.h>
 #include <stdarg.h>
+#include <inttypes.h>
 #include "qemu/hbitmap.h"
 
 #define LOG_BITS_PER_LONG          (BITS_PER_LONG == 32 ? 5 : 6)
@@ -369,6 +370,112 @@ static void test_hbitmap_iter_granularity(TestHBitmapData *data,
     g_assert_cmpint(hbitmap_iter_next(&hbi), <, 0);
 }
 
+static void test_hbitmap_merge(TestHBitmapData *data,
+                               const void *unused)
+{
+    HBitmap *b;
+    uint64_t i;
+
+    hbitmap_test_init(data, L3 * 2, 0);
+    b = hbitmap_alloc(L3 * 2, 0);
+
+    hbitmap_test_set(data, 10, 20);
+    hbitmap_test_set(data, L2 - 1, L1 * 3);
+    hbitmap_set(b, 25, L1);
+    hbitmap_set(b, L3 - L1, L2 + 7);
+    hbitmap_set(b, L3 * 2 - 1, 1);
+
+    g_assert(hbitmap_merge(data->hb, b));
+    for (i = 0; i < L3 * 2; i++) {
+        if (hbitmap_get(b, i)) {
+            data->bits[i >> LOG_BITS_PER_LONG] |= 1UL << (i & (BITS_PER_LONG - 1));
+        }
+    }
+    hbitmap_test_check(data, 0);
+    hbitmap_test_check(data, L3);
+
+    /* Merging an empty bitmap changes nothing */
+    hbitmap_free(b);
+    b = hbitmap_alloc(L3 * 2, 0);
+    g_assert(hbitmap_merge(data->hb, b));
+    hbitmap_test_check(data, 0);
+    hbitmap_free(b);
+}
+
+static void test_hbitmap_merge_mismatch(TestHBitmapData *data,
+                                        const void *unused)
+{
+    HBitmap *b;
+
+    hbitmap_test_init(data, L3, 1);
+    b = hbitmap_alloc(L3, 2);
+    hbitmap_set(b, 0, L1);
+    g_assert(!hbitmap_merge(data->hb, b));
+    hbitmap_free(b);
+
+    b = hbitmap_alloc(L3 * 2, 1);
+    hbitmap_set(b, 0, L1);
+    g_assert(!hbitmap_merge(data->hb, b));
+    hbitmap_free(b);
+    hbitmap_test_check(data, 0);
+}
+
+/* Benchmarks, only run in -m perf mode.  The bitmap is the dirty bitmap of a
+ * 1 TiB disk with 64 KiB clusters.
+ */
+#define PERF_SIZE           ((1ULL << 40) >> 9)
+#define PERF_GRANULARITY    7
+
+static void test_hbitmap_perf_set_reset(TestHBitmapData *data,
+                                        const void *unused)
+{
+    HBitmap *hb = hbitmap_alloc(PERF_SIZE, PERF_GRANULARITY);
+    uint64_t step = PERF_SIZE / 64;
+    double elapsed;
+    int i, j;
+
+    g_test_timer_start();
+    for (i = 0; i < 16; i++) {
+        for (j = 0; j < 64; j++) {
+            hbitmap_set(hb, j * step, step / 2);
+            hbitmap_set(hb, j * step + step / 4, step / 2);
+        }
+        for (j = 0; j < 64; j++) {
+            hbitmap_reset(hb, j * step + step / 8, step / 2);
+        }
+    }
+    elapsed = g_test_timer_elapsed();
+    g_test_minimized_result(elapsed, "set and reset %d ranges of %" PRIu64
+                            " sectors: %.3f s", 16 * 64 * 3, step / 2,
+                            elapsed);
+    hbitmap_free(hb);
+}
+
+static void test_hbitmap_perf_merge(TestHBitmapData *data,
+                                    const void *unused)
+{
+    HBitmap *a = hbitmap_alloc(PERF_SIZE, PERF_GRANULARITY);
+    HBitmap *b = hbitmap_alloc(PERF_SIZE, PERF_GRANULARITY);
+    uint64_t i;
+    double elapsed;
+    int n;
+
+    /* One cluster in three */
+    for (i = 0; i < PERF_SIZE; i += 3 << PERF_GRANULARITY) {
+        hbitmap_set(b, i, 1);
+    }
+
+    g_test_timer_start();
+    for (n = 0; n < 16; n++) {
+        hbitmap_merge(a, b);
+    }
+    elapsed = g_test_timer_elapsed();
+    g_test_minimized_result(elapsed, "16 merges of %" PRIu64 " bits: %.3f s",
+                            hbitmap_count(b) >> PERF_GRANULARITY, elapsed);
+    hbitmap_free(a);
+    hbitmap_free(b);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -395,6 +502,12 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/empty", test_hbitmap_reset_empty);
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
+    hbitmap_test_add("/hbitmap/merge/general", test_hbitmap_merge);
+    hbitmap_test_add("/hbitmap/merge/mismatch", test_hbitmap_merge_mismatch);
+    if (g_test_perf()) {
+        hbitmap_test_add("/hbitmap/perf/set-reset", test_hbitmap_perf_set_reset);
+        hbitmap_test_add("/hbitmap/perf/merge", test_hbitmap_perf_merge);
+    }
     g_test_run();
 
     return 0;
@@ -0,0 +1,194 @@
+/*
+ * Test code for the decoding of MMIO instructions by HVF
+ *
+ * Copyright (c) 2017 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+
+#include "hvf-decode.h"
+
+static HvfMmioInsn decode_ok(const uint8_t *code, int len, int mode)
+{
+    HvfMmioInsn insn;
+
+    g_assert_cmpint(hvf_decode_mmio(code, len, mode, &insn), ==, 0);
+    return insn;
+}
+
+static void test_mov_reg(void)
+{
+    /* mov %eax,(%rdx) */
+    static const uint8_t st32[] = { 0x89, 0x02 };
+    /* mov 0x10(%rdi),%r9 */
+    static const uint8_t ld64[] = { 0x4c, 0x8b, 0x4f, 0x10 };
+    /* mov %ax,0x12345678(%rbx,%rcx,4) */
+    static const uint8_t st16[] = { 0x66, 0x89, 0x84, 0x8b,
+                                    0x78, 0x56, 0x34, 0x12 };
+    HvfMmioInsn insn;
+
+    insn = decode_ok(st32, sizeof(st32), 64);
+    g_assert_cmpint(insn.len, ==, 2);
+    g_assert_cmpint(insn.size, ==, 4);
+    g_assert(insn.write);
+    g_assert_cmpint(insn.reg, ==, 0);
+
+    insn = decode_ok(ld64, sizeof(ld64), 64);
+    g_assert_cmpint(insn.len, ==, 4);
+    g_assert_cmpint(insn.size, ==, 8);
+    g_assert(!insn.write);
+    g_assert_cmpint(insn.reg, ==, 9);
+
+    insn = decode_ok(st16, sizeof(st16), 64);
+    g_assert_cmpint(insn.len, ==, 8);
+    g_assert_cmpint(insn.size, ==, 2);
+    g_assert(insn.write);
+    g_assert_cmpint(insn.reg, ==, 0);
+}
+
+static void test_mov_byte(void)
+{
+    /* mov %ah,(%rsi) */
+    static const uint8_t st_ah[] = { 0x88, 0x26 };
+    /* mov %spl,(%rsi) */
+    static const uint8_t st_spl[] = { 0x40, 0x88, 0x26 };
+    HvfMmioInsn insn;
+
+    insn = decode_ok(st_ah, sizeof(st_ah), 64);
+    g_assert_cmpint(insn.size, ==, 1);
+    g_assert_cmpint(insn.reg, ==, 0);
+    g_assert(insn.high_byte);
+    g_assert_cmphex(hvf_mmio_store_value(&insn, 0x1234), ==, 0x12);
+
+    insn = decode_ok(st_spl, sizeof(st_spl), 64);
+    g_assert_cmpint(insn.len, ==, 3);
+    g_assert_cmpint(insn.reg, ==, 4);
+    g_assert(!insn.high_byte);
+}
+
+static void test_mov_imm(void)
+{
+    /* movl $0x80000001,0x8(%rax) */
+    static const uint8_t st32[] = { 0xc7, 0x40, 0x08,
+                                    0x01, 0x00, 0x00, 0x80 };
+    /* movq $-1,(%rax) */
+    static const uint8_t st64[] = { 0x48, 0xc7, 0x00,
+                                    0xff, 0xff, 0xff, 0xff };
+    /* movb $0x5a,(%bx,%si) in 16-bit mode */
+    static const uint8_t st8[] = { 0xc6, 0x00, 0x5a };
+    HvfMmioInsn insn;
+
+    insn = decode_ok(st32, sizeof(st32), 64);
+    g_assert_cmpint(insn.len, ==, 7);
+    g_assert_cmpint(insn.reg, ==, -1);
+    g_assert_cmphex(hvf_mmio_store_value(&insn, 0), ==, 0x80000001);
+
+    insn = decode_ok(st64, sizeof(st64), 64);
+    g_assert_cmpint(insn.size, ==, 8);
+    g_assert_cmphex(hvf_mmio_store_value(&insn, 0), ==, ~0ULL);
+
+    insn = decode_ok(st8, sizeof(st8), 16);
+    g_assert_cmpint(insn.len, ==, 3);
+    g_assert_cmphex(hvf_mmio_store_value(&insn, 0), ==, 0x5a);
+}
+
+static void test_movzx_movsx(void)
+{
+    /* movzwl (%rcx),%edx */
+    static const uint8_t zx[] = { 0x0f, 0xb7, 0x11 };
+    /* movsbq (%rcx),%rdx */
+    static const uint8_t sx[] = { 0x48, 0x0f, 0xbe, 0x11 };
+    HvfMmioInsn insn;
+
+    insn = decode_ok(zx, sizeof(zx), 64);
+    g_assert_cmpint(insn.size, ==, 2);
+    g_assert_cmpint(insn.dst_size, ==, 4);
+    g_assert_cmpint(insn.reg, ==, 2);
+    g_assert_cmphex(hvf_mmio_load_value(&insn, ~0ULL, 0xabcd8001), ==,
+                    0x8001);
+
+    insn = decode_ok(sx, sizeof(sx), 64);
+    g_assert_cmpint(insn.size, ==, 1);
+    g_assert_cmpint(insn.dst_size, ==, 8);
+    g_assert_cmphex(hvf_mmio_load_value(&insn, 0, 0x80), ==,
+                    0xffffffffffffff80ULL);
+}
+
+static void test_moffs(void)
+{
+    /* mov 0xfee000b0,%eax in 32-bit mode */
+    static const uint8_t ld32[] = { 0xa1, 0xb0, 0x00, 0xe0, 0xfe };
+    /* mov %al,0x1234 in 16-bit mode */
+    static const uint8_t st16[] = { 0xa2, 0x34, 0x12 };
+    HvfMmioInsn insn;
+
+    insn = decode_ok(ld32, sizeof(ld32), 32);
+    g_assert_cmpint(insn.len, ==, 5);
+    g_assert_cmpint(insn.size, ==, 4);
+    g_assert(!insn.write);
+    g_assert_cmpint(insn.reg, ==, 0);
+
+    insn = decode_ok(st16, sizeof(st16), 16);
+    g_assert_cmpint(insn.len, ==, 3);
+    g_assert_cmpint(insn.size, ==, 1);
+    g_assert(insn.write);
+}
+
+static void test_load_value(void)
+{
+    /* mov (%rax),%ax, mov (%rax),%eax and mov (%rax),%bh */
+    static const uint8_t ld16[] = { 0x66, 0x8b, 0x00 };
+    static const uint8_t ld32[] = { 0x8b, 0x00 };
+    static const uint8_t ld_bh[] = { 0x8a, 0x38 };
+    HvfMmioInsn insn;
+
+    insn = decode_ok(ld16, sizeof(ld16), 64);
+    g_assert_cmphex(hvf_mmio_load_value(&insn, 0x1122334455667788ULL,
+                                        0xaabb), ==, 0x112233445566aabbULL);
+
+    insn = decode_ok(ld32, sizeof(ld32), 64);
+    g_assert_cmphex(hvf_mmio_load_value(&insn, 0x1122334455667788ULL,
+                                        0xaabbccdd), ==, 0xaabbccddULL);
+
+    insn = decode_ok(ld_bh, sizeof(ld_bh), 64);
+    g_assert_cmpint(insn.reg, ==, 3);
+    g_assert(insn.high_byte);
+    g_assert_cmphex(hvf_mmio_load_value(&insn, 0x1234, 0x5a), ==, 0x5a34);
+}
+
+static void test_reject(void)
+{
+    /* mov %eax,%edx, add %eax,(%rdx), and a truncated mov */
+    static const uint8_t reg[] = { 0x89, 0xc2 };
+    static const uint8_t add[] = { 0x01, 0x02 };
+    static const uint8_t trunc[] = { 0x89, 0x82, 0x00, 0x01 };
+    /* 0x48 is dec %eax outside 64-bit mode, not a REX prefix */
+    static const uint8_t dec[] = { 0x48, 0x89, 0x02 };
+    HvfMmioInsn insn;
+
+    g_assert_cmpint(hvf_decode_mmio(reg, sizeof(reg), 64, &insn), ==, -1);
+    g_assert_cmpint(hvf_decode_mmio(add, sizeof(add), 64, &insn), ==, -1);
+    g_assert_cmpint(hvf_decode_mmio(trunc, sizeof(trunc), 64, &insn), ==, -1);
+    g_assert_cmpint(hvf_decode_mmio(dec, sizeof(dec), 32, &insn), ==, -1);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/hvf-decode/mov-reg", test_mov_reg);
+    g_test_add_func("/hvf-decode/mov-byte", test_mov_byte);
+    g_test_add_func("/hvf-decode/mov-imm", test_mov_imm);
+    g_test_add_func("/hvf-decode/movzx-movsx", test_movzx_movsx);
+    g_test_add_func("/hvf-decode/moffs", test_moffs);
+    g_test_add_func("/hvf-decode/load-value", test_load_value);
+    g_test_add_func("/hvf-decode/reject", test_reject);
+
+    g_test_run();
+
+    return 0;
+}
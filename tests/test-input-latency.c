@@ -0,0 +1,76 @@
+/*
+ * Input to display latency unit-tests.
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/input-latency.h"
+#include "qemu/metrics.h"
+
+#define MS 1000000
+
+static void assert_contains(const char *text, const char *line)
+{
+    if (!strstr(text, line)) {
+        g_printerr("'%s' not found in:\n%s", line, text);
+        g_assert_not_reached();
+    }
+}
+
+static void test_latency(void)
+{
+    char *text;
+
+    /* Nothing is measured before the input device sets things up */
+    input_latency_consumed(10 * MS, 20 * MS);
+    input_latency_frame(INPUT_LATENCY_FB, 30 * MS, 30 * MS);
+    text = metrics_render();
+    g_assert(!strstr(text, "qemu_input_"));
+    g_free(text);
+
+    input_latency_init();
+    input_latency_init();
+    input_latency_frame(INPUT_LATENCY_FB, 40 * MS, 40 * MS);
+
+    /* A frame produced before the guest read the input doesn't count */
+    input_latency_consumed(100 * MS, 110 * MS);
+    input_latency_frame(INPUT_LATENCY_FB, 105 * MS, 112 * MS);
+    input_latency_frame(INPUT_LATENCY_GPU, 115 * MS, 130 * MS);
+    input_latency_frame(INPUT_LATENCY_GPU, 140 * MS, 140 * MS);
+
+    /* Inputs read before a frame comes are counted from the oldest */
+    input_latency_consumed(200 * MS, 205 * MS);
+    input_latency_consumed(210 * MS, 215 * MS);
+    input_latency_frame(INPUT_LATENCY_FB, 212 * MS, 220 * MS);
+
+    text = metrics_render();
+    assert_contains(text, "# TYPE qemu_input_queue_seconds histogram\n");
+    assert_contains(text, "qemu_input_queue_seconds_bucket{le=\"0.005\"} 2\n"
+                          "qemu_input_queue_seconds_bucket{le=\"0.01\"} 3\n");
+    assert_contains(text, "qemu_input_queue_seconds_count 3\n");
+    assert_contains(text, "qemu_input_display_seconds_bucket"
+                          "{display=\"fb\",le=\"0.016\"} 0\n"
+                          "qemu_input_display_seconds_bucket"
+                          "{display=\"fb\",le=\"0.025\"} 1\n");
+    assert_contains(text, "qemu_input_display_seconds_count"
+                          "{display=\"fb\"} 1\n");
+    assert_contains(text, "qemu_input_display_seconds_bucket"
+                          "{display=\"gpu\",le=\"0.025\"} 0\n"
+                          "qemu_input_display_seconds_bucket"
+                          "{display=\"gpu\",le=\"0.033\"} 1\n");
+    assert_contains(text, "qemu_input_display_seconds_count"
+                          "{display=\"gpu\"} 1\n");
+    g_free(text);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/input-latency/latency", test_latency);
+    return g_test_run();
+}
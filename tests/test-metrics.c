@@ -0,0 +1,163 @@
+/*
+ * Metrics registry unit-tests.
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/metrics.h"
+#include "qemu/thread.h"
+
+#define N_THREADS   4
+#define N_ADDS      100000
+
+static void assert_contains(const char *text, const char *line)
+{
+    if (!strstr(text, line)) {
+        g_printerr("'%s' not found in:\n%s", line, text);
+        g_assert_not_reached();
+    }
+}
+
+static int count_of(const char *text, const char *str)
+{
+    int n = 0;
+
+    while ((text = strstr(text, str))) {
+        text++;
+        n++;
+    }
+    return n;
+}
+
+static void test_labels(void)
+{
+    char *labels;
+
+    labels = metrics_labels("drive", "ide0", "type", "a\"b\\c\nd", NULL);
+    g_assert_cmpstr(labels, ==, "drive=\"ide0\",type=\"a\\\"b\\\\c\\nd\"");
+    g_free(labels);
+}
+
+static void *add_thread(void *opaque)
+{
+    MetricCounter *c = opaque;
+    int i;
+
+    for (i = 0; i < N_ADDS; i++) {
+        metric_counter_add(c, 1);
+    }
+    return NULL;
+}
+
+static void test_counter(void)
+{
+    QemuThread threads[N_THREADS];
+    MetricCounter *c;
+    char *text;
+    int i;
+
+    c = metric_counter_new("qemu_test_adds", "Additions", "kind=\"a\"");
+    for (i = 0; i < N_THREADS; i++) {
+        qemu_thread_create(&threads[i], "add", add_thread, c,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < N_THREADS; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+
+    text = metrics_render();
+    assert_contains(text, "# TYPE qemu_test_adds counter\n"
+                          "# HELP qemu_test_adds Additions\n"
+                          "qemu_test_adds_total{kind=\"a\"} 400000\n");
+    g_assert(g_str_has_suffix(text, "# EOF\n"));
+    g_free(text);
+
+    metric_counter_free(c);
+    text = metrics_render();
+    g_assert(!strstr(text, "qemu_test_adds"));
+    g_assert_cmpstr(text, ==, "# EOF\n");
+    g_free(text);
+}
+
+static void test_histogram(void)
+{
+    static const int64_t bounds[] = { 10, 100, 1000 };
+    MetricHistogram *h;
+    char *text;
+
+    h = metric_histogram_new("qemu_test_seconds", NULL, NULL, bounds,
+                             ARRAY_SIZE(bounds), 0.001);
+    metric_histogram_observe(h, 5);
+    metric_histogram_observe(h, 10);
+    metric_histogram_observe(h, 500);
+    metric_histogram_observe(h, 5000);
+
+    text = metrics_render();
+    assert_contains(text, "# TYPE qemu_test_seconds histogram\n"
+                          "qemu_test_seconds_bucket{le=\"0.01\"} 2\n"
+                          "qemu_test_seconds_bucket{le=\"0.1\"} 2\n"
+                          "qemu_test_seconds_bucket{le=\"1\"} 3\n"
+                          "qemu_test_seconds_bucket{le=\"+Inf\"} 4\n"
+                          "qemu_test_seconds_count 4\n"
+                          "qemu_test_seconds_sum 5.515\n");
+    g_free(text);
+    metric_histogram_free(h);
+}
+
+/* Each collector reports one queue, the families must stay together */
+static void collect_queue(MetricsWriter *w, void *opaque)
+{
+    const char *name = opaque;
+    char *labels = metrics_labels("queue", name, NULL);
+
+    metrics_family(w, "qemu_test_queue_depth", METRIC_GAUGE, "Depth");
+    metrics_sample_int(w, "qemu_test_queue_depth", labels, strlen(name));
+    metrics_family(w, "qemu_test_queue_drops", METRIC_COUNTER, "Drops");
+    metrics_sample(w, "qemu_test_queue_drops", labels, 0.5);
+    g_free(labels);
+}
+
+static void test_collectors(void)
+{
+    MetricsCollector *a, *b;
+    char *text;
+
+    a = metrics_collector_add(collect_queue, (void *)"rx");
+    b = metrics_collector_add(collect_queue, (void *)"txq");
+
+    text = metrics_render();
+    g_assert_cmpstr(text, ==,
+                    "# TYPE qemu_test_queue_depth gauge\n"
+                    "# HELP qemu_test_queue_depth Depth\n"
+                    "qemu_test_queue_depth{queue=\"rx\"} 2\n"
+                    "qemu_test_queue_depth{queue=\"txq\"} 3\n"
+                    "# TYPE qemu_test_queue_drops counter\n"
+                    "# HELP qemu_test_queue_drops Drops\n"
+                    "qemu_test_queue_drops_total{queue=\"rx\"} 0.5\n"
+                    "qemu_test_queue_drops_total{queue=\"txq\"} 0.5\n"
+                    "# EOF\n");
+    g_assert_cmpint(count_of(text, "# TYPE"), ==, 2);
+    g_free(text);
+
+    metrics_collector_remove(a);
+    text = metrics_render();
+    g_assert(!strstr(text, "\"rx\""));
+    assert_contains(text, "qemu_test_queue_depth{queue=\"txq\"} 3\n");
+    g_free(text);
+    metrics_collector_remove(b);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/metrics/labels", test_labels);
+    g_test_add_func("/metrics/counter", test_counter);
+    g_test_add_func("/metrics/histogram", test_histogram);
+    g_test_add_func("/metrics/collectors", test_collectors);
+    return g_test_run();
+}
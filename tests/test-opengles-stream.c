@@ -0,0 +1,477 @@
+/*
+ * Test and microbenchmark of the GLES stream transports
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Both ends of an 'opengles' stream run in this process, one thread
+ * standing for the pipe and one for the renderer, over either transport
+ * hw/misc/android_pipe_opengles.c can use:
+ *
+ *   ring    the shared memory rings and doorbells of android/opengles-ring.h
+ *   tcp     a loopback TCP connection with Nagle disabled, which is what
+ *           Windows hosts used to be limited to
+ *
+ * The benchmark only runs in perf mode (-m perf). Each frame is a command
+ * stream sent in 4 KiB writes, as the guest driver does one page at a
+ * time, followed by a 4-byte reply from the renderer, like the round trip
+ * of eglSwapBuffers(). It reports frames/s, MB/s and p50/p99 frame times
+ * for each transport and frame size. The following environment variables,
+ * comma-separated lists, select what is measured:
+ *
+ *   OPENGLES_BENCH_TRANSPORTS   default "ring,tcp"
+ *   OPENGLES_BENCH_SIZES        default "4096,65536,1048576"
+ *
+ * and OPENGLES_BENCH_FRAMES sets the number of frames per run (default
+ * 2000). No rendering takes place, so the figures are the transport's
+ * overhead only.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/event_notifier.h"
+#include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "android/opengles-ring.h"
+
+#ifndef _WIN32
+#include <poll.h>
+#endif
+
+#define WRITE_CHUNK     4096
+#define REPLY_SIZE      4
+
+typedef struct StreamEnd StreamEnd;
+
+struct StreamEnd {
+    void (*write)(StreamEnd *end, const uint8_t *buf, size_t len);
+    void (*read)(StreamEnd *end, uint8_t *buf, size_t len);
+    /* ring transport */
+    OpenglesRing *tx;
+    OpenglesRing *rx;
+    EventNotifier *bell;            /* rung by the other end */
+    EventNotifier *peer_bell;
+    /* tcp transport */
+    int fd;
+};
+
+typedef struct {
+    StreamEnd ends[2];
+    OpenglesRing *rings[2];
+    EventNotifier bells[2];
+    bool is_ring;
+} Stream;
+
+/* Same copies as ring_pipe_write() and ring_pipe_read(), on flat buffers */
+static uint32_t ring_put(OpenglesRing *ring, const uint8_t *buf, size_t len)
+{
+    uint32_t mask = ring->size - 1;
+    uint32_t head = ring->head;
+    uint32_t avail = ring->size - (head - atomic_read(&ring->tail));
+    uint32_t pos = head & mask;
+    uint32_t first;
+
+    smp_mb();
+    len = MIN(len, avail);
+    first = MIN(len, ring->size - pos);
+    memcpy(ring->data + pos, buf, first);
+    memcpy(ring->data, buf + first, len - first);
+    smp_wmb();
+    atomic_set(&ring->head, head + len);
+    return len;
+}
+
+static uint32_t ring_get(OpenglesRing *ring, uint8_t *buf, size_t len)
+{
+    uint32_t mask = ring->size - 1;
+    uint32_t tail = ring->tail;
+    uint32_t avail = atomic_read(&ring->head) - tail;
+    uint32_t pos = tail & mask;
+    uint32_t first;
+
+    smp_rmb();
+    len = MIN(len, avail);
+    first = MIN(len, ring->size - pos);
+    memcpy(buf, ring->data + pos, first);
+    memcpy(buf + first, ring->data, len - first);
+    smp_mb();
+    atomic_set(&ring->tail, tail + len);
+    return len;
+}
+
+static void ring_notify(uint32_t *waiting, EventNotifier *bell)
+{
+    smp_mb();
+    if (atomic_read(waiting) && atomic_xchg(waiting, 0)) {
+        event_notifier_set(bell);
+    }
+}
+
+static void doorbell_wait(EventNotifier *bell)
+{
+#ifdef _WIN32
+    WaitForSingleObject(event_notifier_get_handle(bell), INFINITE);
+#else
+    struct pollfd pfd = {
+        .fd = event_notifier_get_fd(bell),
+        .events = POLLIN,
+    };
+
+    poll(&pfd, 1, -1);
+#endif
+    event_notifier_test_and_clear(bell);
+}
+
+static void ring_write(StreamEnd *end, const uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        uint32_t n = ring_put(end->tx, buf, len);
+
+        if (n == 0) {
+            atomic_set(&end->tx->producer_waiting, 1);
+            smp_mb();
+            n = ring_put(end->tx, buf, len);
+            if (n == 0) {
+                doorbell_wait(end->bell);
+                continue;
+            }
+        }
+        ring_notify(&end->tx->consumer_waiting, end->peer_bell);
+        buf += n;
+        len -= n;
+    }
+}
+
+static void ring_read(StreamEnd *end, uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        uint32_t n = ring_get(end->rx, buf, len);
+
+        if (n == 0) {
+            atomic_set(&end->rx->consumer_waiting, 1);
+            smp_mb();
+            n = ring_get(end->rx, buf, len);
+            if (n == 0) {
+                doorbell_wait(end->bell);
+                continue;
+            }
+        }
+        ring_notify(&end->rx->producer_waiting, end->peer_bell);
+        buf += n;
+        len -= n;
+    }
+}
+
+static void tcp_write(StreamEnd *end, const uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(end->fd, (const void *)buf, len, 0);
+
+        if (n < 0 && socket_error() == EINTR) {
+            continue;
+        }
+        g_assert_cmpint(n, >, 0);
+        buf += n;
+        len -= n;
+    }
+}
+
+static void tcp_read(StreamEnd *end, uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = recv(end->fd, (void *)buf, len, 0);
+
+        if (n < 0 && socket_error() == EINTR) {
+            continue;
+        }
+        g_assert_cmpint(n, >, 0);
+        buf += n;
+        len -= n;
+    }
+}
+
+static OpenglesRing *ring_new(void)
+{
+    OpenglesRing *ring = qemu_memalign(64, sizeof(*ring) + OPENGLES_RING_SIZE);
+
+    memset(ring, 0, sizeof(*ring));
+    ring->size = OPENGLES_RING_SIZE;
+    return ring;
+}
+
+static void stream_init_ring(Stream *s)
+{
+    int i;
+
+    memset(s, 0, sizeof(*s));
+    s->is_ring = true;
+    for (i = 0; i < 2; i++) {
+        s->rings[i] = ring_new();
+        g_assert_cmpint(event_notifier_init(&s->bells[i], 0), ==, 0);
+    }
+    for (i = 0; i < 2; i++) {
+        s->ends[i].write = ring_write;
+        s->ends[i].read = ring_read;
+        s->ends[i].tx = s->rings[i];
+        s->ends[i].rx = s->rings[!i];
+        s->ends[i].bell = &s->bells[i];
+        s->ends[i].peer_bell = &s->bells[!i];
+    }
+}
+
+static void stream_init_tcp(Stream *s)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int lfd, i;
+
+    memset(s, 0, sizeof(*s));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    lfd = qemu_socket(AF_INET, SOCK_STREAM, 0);
+    g_assert_cmpint(lfd, >=, 0);
+    g_assert_cmpint(bind(lfd, (struct sockaddr *)&addr, len), ==, 0);
+    g_assert_cmpint(listen(lfd, 1), ==, 0);
+    g_assert_cmpint(getsockname(lfd, (struct sockaddr *)&addr, &len), ==, 0);
+
+    s->ends[0].fd = qemu_socket(AF_INET, SOCK_STREAM, 0);
+    g_assert_cmpint(s->ends[0].fd, >=, 0);
+    g_assert_cmpint(connect(s->ends[0].fd, (struct sockaddr *)&addr, len),
+                    ==, 0);
+    s->ends[1].fd = qemu_accept(lfd, NULL, NULL);
+    g_assert_cmpint(s->ends[1].fd, >=, 0);
+    closesocket(lfd);
+
+    for (i = 0; i < 2; i++) {
+        socket_set_nodelay(s->ends[i].fd);
+        s->ends[i].write = tcp_write;
+        s->ends[i].read = tcp_read;
+    }
+}
+
+static void stream_cleanup(Stream *s)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (s->is_ring) {
+            event_notifier_cleanup(&s->bells[i]);
+            qemu_vfree(s->rings[i]);
+        } else {
+            closesocket(s->ends[i].fd);
+        }
+    }
+}
+
+/* The renderer end, ends[1] */
+typedef struct {
+    Stream *stream;
+    QemuThread thread;
+    size_t frame_size;
+    int frames;
+    uint64_t total;
+} Renderer;
+
+static uint8_t pattern(uint64_t offset)
+{
+    return (offset ^ (offset >> 11)) * 131;
+}
+
+/* Expects 'frames' frames of 'frame_size' bytes and answers each one */
+static void *renderer_thread(void *opaque)
+{
+    Renderer *r = opaque;
+    StreamEnd *end = &r->stream->ends[1];
+    uint8_t *buf = g_malloc(WRITE_CHUNK);
+    uint8_t reply[REPLY_SIZE] = { 0 };
+    int frame;
+
+    for (frame = 0; frame < r->frames; frame++) {
+        size_t left = r->frame_size;
+
+        while (left > 0) {
+            size_t len = MIN(left, WRITE_CHUNK);
+
+            end->read(end, buf, len);
+            left -= len;
+        }
+        end->write(end, reply, sizeof(reply));
+    }
+    g_free(buf);
+    return NULL;
+}
+
+/* Checks a byte stream across many wrap-arounds of the ring, with reads
+ * and writes of every size up to one and a half rings */
+static void *checker_thread(void *opaque)
+{
+    Renderer *r = opaque;
+    StreamEnd *end = &r->stream->ends[1];
+    size_t max = OPENGLES_RING_SIZE + OPENGLES_RING_SIZE / 2;
+    uint8_t *buf = g_malloc(max);
+    uint64_t offset = 0;
+
+    while (offset < r->total) {
+        size_t len = MIN(r->total - offset, g_random_int_range(1, max));
+        size_t i;
+
+        end->read(end, buf, len);
+        for (i = 0; i < len; i++) {
+            if (buf[i] != pattern(offset + i)) {
+                g_error("bad byte at offset %" PRIu64, offset + i);
+            }
+        }
+        offset += len;
+    }
+    g_free(buf);
+    return NULL;
+}
+
+static void test_ring_stream(void)
+{
+    size_t max = OPENGLES_RING_SIZE + OPENGLES_RING_SIZE / 2;
+    uint8_t *buf = g_malloc(max);
+    uint64_t offset = 0;
+    Stream stream;
+    Renderer r = {
+        .stream = &stream,
+        .total = 16 * (uint64_t)OPENGLES_RING_SIZE,
+    };
+
+    stream_init_ring(&stream);
+    qemu_thread_create(&r.thread, "checker", checker_thread, &r,
+                       QEMU_THREAD_JOINABLE);
+    while (offset < r.total) {
+        size_t len = MIN(r.total - offset, g_test_rand_int_range(1, max));
+        size_t i;
+
+        for (i = 0; i < len; i++) {
+            buf[i] = pattern(offset + i);
+        }
+        stream.ends[0].write(&stream.ends[0], buf, len);
+        offset += len;
+    }
+    qemu_thread_join(&r.thread);
+
+    g_assert_cmpuint(stream.rings[0]->head, ==, (uint32_t)r.total);
+    g_assert_cmpuint(stream.rings[0]->tail, ==, (uint32_t)r.total);
+    stream_cleanup(&stream);
+    g_free(buf);
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static char **bench_param(const char *env, const char *def)
+{
+    const char *value = getenv(env);
+
+    return g_strsplit(value && *value ? value : def, ",", -1);
+}
+
+static void bench_run(const char *transport, size_t frame_size, int frames)
+{
+    int64_t *latency = g_new(int64_t, frames);
+    uint8_t *buf = g_malloc0(WRITE_CHUNK);
+    uint8_t reply[REPLY_SIZE];
+    int64_t start, total;
+    double seconds;
+    Stream stream;
+    Renderer r = {
+        .stream = &stream,
+        .frame_size = frame_size,
+        .frames = frames,
+    };
+    StreamEnd *end = &stream.ends[0];
+    int frame;
+
+    if (!strcmp(transport, "ring")) {
+        stream_init_ring(&stream);
+    } else if (!strcmp(transport, "tcp")) {
+        stream_init_tcp(&stream);
+    } else {
+        g_error("unknown transport '%s'", transport);
+    }
+    qemu_thread_create(&r.thread, "renderer", renderer_thread, &r,
+                       QEMU_THREAD_JOINABLE);
+
+    start = get_clock();
+    for (frame = 0; frame < frames; frame++) {
+        int64_t frame_start = get_clock();
+        size_t left = frame_size;
+
+        while (left > 0) {
+            size_t len = MIN(left, WRITE_CHUNK);
+
+            end->write(end, buf, len);
+            left -= len;
+        }
+        end->read(end, reply, sizeof(reply));
+        latency[frame] = get_clock() - frame_start;
+    }
+    total = get_clock() - start;
+
+    qemu_thread_join(&r.thread);
+    stream_cleanup(&stream);
+
+    qsort(latency, frames, sizeof(latency[0]), compare_int64);
+    seconds = total / 1e9;
+    printf("%-9s %8zu %10.0f %10.2f %10.1f %10.1f\n", transport, frame_size,
+           frames / seconds,
+           (double)frames * frame_size / seconds / (1024 * 1024),
+           latency[frames / 2] / 1e3,
+           latency[(int64_t)frames * 99 / 100] / 1e3);
+    g_free(latency);
+    g_free(buf);
+}
+
+static void test_bench(void)
+{
+    char **transports = bench_param("OPENGLES_BENCH_TRANSPORTS", "ring,tcp");
+    char **sizes = bench_param("OPENGLES_BENCH_SIZES", "4096,65536,1048576");
+    const char *frames_env = getenv("OPENGLES_BENCH_FRAMES");
+    int frames = frames_env ? atoi(frames_env) : 2000;
+    char **t, **sz;
+
+    g_assert_cmpint(frames, >, 0);
+
+    printf("\n%-9s %8s %10s %10s %10s %10s\n", "transport", "size",
+           "frames/s", "MB/s", "p50(us)", "p99(us)");
+
+    for (sz = sizes; *sz; sz++) {
+        size_t size = atoi(*sz);
+
+        g_assert_cmpuint(size, >, 0);
+        for (t = transports; *t; t++) {
+            bench_run(*t, size, frames);
+        }
+    }
+
+    g_strfreev(transports);
+    g_strfreev(sizes);
+}
+
+int main(int argc, char **argv)
+{
+    socket_init();
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/opengles_stream/ring", test_ring_stream);
+    if (g_test_perf()) {
+        g_test_add_func("/opengles_stream/bench", test_bench);
+    }
+    return g_test_run();
+}
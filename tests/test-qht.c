@@ -0,0 +1,213 @@
+/*
+ * QHT unit-tests.
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/qht.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+
+#define N_OBJS  4096
+
+static int32_t objs[N_OBJS];
+
+static bool is_equal(const void *obj, const void *userp)
+{
+    return *(const int32_t *)obj == *(const int32_t *)userp;
+}
+
+/* Few distinct hashes, so that chains fill up */
+static uint32_t hash_of(int32_t v, bool collide)
+{
+    return collide ? v % 7 : v * 2654435761u;
+}
+
+static void *lookup(QHT *ht, int32_t v, bool collide)
+{
+    return qht_lookup(ht, is_equal, &v, hash_of(v, collide));
+}
+
+static void check_range(QHT *ht, int first, int last, bool present,
+                        bool collide)
+{
+    int i;
+
+    for (i = first; i < last; i++) {
+        if (present) {
+            g_assert(lookup(ht, i, collide) == &objs[i]);
+        } else {
+            g_assert(lookup(ht, i, collide) == NULL);
+        }
+    }
+}
+
+static void insert_range(QHT *ht, int first, int last, bool collide)
+{
+    int i;
+
+    for (i = first; i < last; i++) {
+        g_assert(qht_insert(ht, &objs[i], hash_of(i, collide)));
+    }
+}
+
+static void remove_range(QHT *ht, int first, int last, bool collide)
+{
+    int i;
+
+    for (i = first; i < last; i++) {
+        g_assert(qht_remove(ht, &objs[i], hash_of(i, collide)));
+    }
+}
+
+static void count_obj(QHT *ht, void *obj, uint32_t hash, void *userp)
+{
+    (*(int *)userp)++;
+}
+
+static int count(QHT *ht)
+{
+    int n = 0;
+
+    qht_iter(ht, count_obj, &n);
+    return n;
+}
+
+static void do_test(unsigned int mode, bool collide)
+{
+    QHT ht;
+    QHTStats stats;
+    int i;
+
+    for (i = 0; i < N_OBJS; i++) {
+        objs[i] = i;
+    }
+    qht_init(&ht, 16, mode);
+
+    insert_range(&ht, 0, N_OBJS / 2, collide);
+    check_range(&ht, 0, N_OBJS / 2, true, collide);
+    check_range(&ht, N_OBJS / 2, N_OBJS, false, collide);
+    g_assert(!qht_insert(&ht, &objs[0], hash_of(0, collide)));
+    g_assert_cmpint(count(&ht), ==, N_OBJS / 2);
+
+    /* Holes in the middle of the chains */
+    for (i = 0; i < N_OBJS / 2; i += 3) {
+        g_assert(qht_remove(&ht, &objs[i], hash_of(i, collide)));
+        g_assert(!qht_remove(&ht, &objs[i], hash_of(i, collide)));
+    }
+    for (i = 0; i < N_OBJS / 2; i++) {
+        g_assert(lookup(&ht, i, collide) == (i % 3 ? &objs[i] : NULL));
+    }
+    for (i = 0; i < N_OBJS / 2; i += 3) {
+        g_assert(qht_insert(&ht, &objs[i], hash_of(i, collide)));
+    }
+
+    insert_range(&ht, N_OBJS / 2, N_OBJS, collide);
+    check_range(&ht, 0, N_OBJS, true, collide);
+    qht_statistics(&ht, &stats);
+    g_assert_cmpint(stats.entries, ==, N_OBJS);
+    if ((mode & QHT_MODE_AUTO_RESIZE) && !collide) {
+        g_assert_cmpint(stats.head_buckets, >, 16);
+    }
+
+    qht_resize(&ht, N_OBJS * 2);
+    check_range(&ht, 0, N_OBJS, true, collide);
+    qht_resize(&ht, 1);
+    check_range(&ht, 0, N_OBJS, true, collide);
+
+    remove_range(&ht, 0, N_OBJS / 2, collide);
+    check_range(&ht, 0, N_OBJS / 2, false, collide);
+    check_range(&ht, N_OBJS / 2, N_OBJS, true, collide);
+
+    qht_reset_size(&ht, 64);
+    check_range(&ht, 0, N_OBJS, false, collide);
+    g_assert_cmpint(count(&ht), ==, 0);
+    insert_range(&ht, 0, 100, collide);
+    qht_reset(&ht);
+    g_assert_cmpint(count(&ht), ==, 0);
+
+    synchronize_rcu();
+    qht_destroy(&ht);
+}
+
+static void test_basic(void)
+{
+    do_test(0, false);
+}
+
+static void test_resize(void)
+{
+    do_test(QHT_MODE_AUTO_RESIZE, false);
+}
+
+static void test_collide(void)
+{
+    do_test(QHT_MODE_AUTO_RESIZE, true);
+}
+
+/* Lookups of a stable set of objects, while others come and go */
+typedef struct ReaderData {
+    QHT *ht;
+    bool stop;
+    int lookups;
+} ReaderData;
+
+static void *reader_thread(void *opaque)
+{
+    ReaderData *data = opaque;
+    int i = 0;
+
+    rcu_register_thread();
+    while (!atomic_read(&data->stop)) {
+        g_assert(lookup(data->ht, i, false) == &objs[i]);
+        i = (i + 1) % (N_OBJS / 2);
+        data->lookups++;
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void test_concurrent(void)
+{
+    ReaderData data = { 0 };
+    QemuThread thread;
+    QHT ht;
+    int i;
+
+    for (i = 0; i < N_OBJS; i++) {
+        objs[i] = i;
+    }
+    qht_init(&ht, 16, QHT_MODE_AUTO_RESIZE);
+    insert_range(&ht, 0, N_OBJS / 2, false);
+    data.ht = &ht;
+    qemu_thread_create(&thread, "reader", reader_thread, &data,
+                       QEMU_THREAD_JOINABLE);
+
+    for (i = 0; i < 50; i++) {
+        insert_range(&ht, N_OBJS / 2, N_OBJS, false);
+        remove_range(&ht, N_OBJS / 2, N_OBJS, false);
+        qht_resize(&ht, i & 1 ? 16 : N_OBJS);
+    }
+
+    atomic_set(&data.stop, true);
+    qemu_thread_join(&thread);
+    g_assert_cmpint(data.lookups, >, 0);
+    synchronize_rcu();
+    qht_destroy(&ht);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qht/basic", test_basic);
+    g_test_add_func("/qht/resize", test_resize);
+    g_test_add_func("/qht/collide", test_collide);
+    g_test_add_func("/qht/concurrent", test_concurrent);
+    return g_test_run();
+}
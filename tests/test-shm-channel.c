@@ -0,0 +1,155 @@
+/*
+ * Shared memory channel unit-tests.
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/thread.h"
+#include "android/shm-channel.h"
+
+#define REGION_SIZE (1 << 20)
+#define N_RECORDS   20000
+
+static void test_format(void)
+{
+    void *region = g_malloc0(REGION_SIZE);
+    ShmChannelHeader *h;
+    uint32_t i;
+
+    g_assert(!shm_channel_attach(region, REGION_SIZE));
+    g_assert_cmpint(shm_channel_format(region, REGION_SIZE, 0), <, 0);
+    g_assert_cmpint(shm_channel_format(region, REGION_SIZE,
+                                       SHM_CHANNEL_MAX + 1), <, 0);
+    g_assert_cmpint(shm_channel_format(region, 8192, 1), <, 0);
+
+    g_assert_cmpint(shm_channel_format(region, REGION_SIZE, 3), ==, 0);
+    h = shm_channel_attach(region, REGION_SIZE);
+    g_assert(h == region);
+    g_assert_cmpint(h->nchannels, ==, 3);
+    for (i = 0; i < 3; i++) {
+        ShmRing *a = &h->channels[i].to_guest;
+        ShmRing *b = &h->channels[i].to_host;
+
+        g_assert_cmpint(a->size, ==, 128 * 1024);
+        g_assert_cmpint(b->size, ==, a->size);
+        g_assert_cmpint(b->data_offset, ==, a->data_offset + a->size);
+        g_assert_cmpint(a->data_offset % 4096, ==, 0);
+        g_assert_cmpint(b->data_offset + b->size, <=, REGION_SIZE);
+    }
+    /* A smaller mapping than the layout is refused */
+    g_assert(!shm_channel_attach(region, REGION_SIZE / 2));
+    h->channels[1].to_host.size = 3000;
+    g_assert(!shm_channel_attach(region, REGION_SIZE));
+    g_free(region);
+}
+
+static void test_wrap(void)
+{
+    void *region = g_malloc0(2 * REGION_SIZE);
+    ShmChannelHeader *h;
+    ShmRing *ring;
+    uint32_t len, size;
+    uint8_t *p;
+    int i;
+
+    g_assert_cmpint(shm_channel_format(region, 2 * REGION_SIZE, 1), ==, 0);
+    h = shm_channel_attach(region, 2 * REGION_SIZE);
+    ring = &h->channels[0].to_host;
+    size = ring->size;
+
+    g_assert(!shm_ring_reserve(region, ring, size / 2));
+    g_assert(!shm_ring_peek(region, ring, &len));
+
+    for (i = 0; i < 8; i++) {
+        /* Three records of 3/8 of the ring each can't all be queued */
+        p = shm_ring_reserve(region, ring, size * 3 / 8);
+        g_assert(p);
+        memset(p, i, size * 3 / 8);
+        shm_ring_commit(region, ring, size * 3 / 8);
+        p = shm_ring_reserve(region, ring, size * 3 / 8);
+        g_assert(p);
+        memset(p, i + 100, size * 3 / 8);
+        shm_ring_commit(region, ring, size * 3 / 8);
+        g_assert(!shm_ring_reserve(region, ring, size * 3 / 8));
+
+        p = shm_ring_peek(region, ring, &len);
+        g_assert(p);
+        g_assert_cmpint(len, ==, size * 3 / 8);
+        g_assert_cmpint(p[0], ==, i);
+        g_assert_cmpint(p[len - 1], ==, i);
+        shm_ring_release(region, ring);
+        p = shm_ring_peek(region, ring, &len);
+        g_assert(p);
+        g_assert_cmpint(p[0], ==, i + 100);
+        g_assert_cmpint(p[len - 1], ==, i + 100);
+        shm_ring_release(region, ring);
+        g_assert(!shm_ring_peek(region, ring, &len));
+    }
+    g_free(region);
+}
+
+static void *producer(void *opaque)
+{
+    void *region = opaque;
+    ShmRing *ring = &((ShmChannelHeader *)region)->channels[1].to_guest;
+    uint32_t i, j;
+
+    for (i = 0; i < N_RECORDS; i++) {
+        uint32_t len = 4 + (i * 7919) % 5000;
+        uint8_t *p;
+
+        while (!(p = shm_ring_reserve(region, ring, len))) {
+            sched_yield();
+        }
+        memcpy(p, &i, 4);
+        for (j = 4; j < len; j++) {
+            p[j] = i + j;
+        }
+        shm_ring_commit(region, ring, len);
+    }
+    return NULL;
+}
+
+static void test_threads(void)
+{
+    void *region = g_malloc0(REGION_SIZE);
+    ShmChannelHeader *h;
+    QemuThread thread;
+    uint32_t i, j, n, len;
+    uint8_t *p;
+
+    g_assert_cmpint(shm_channel_format(region, REGION_SIZE, 4), ==, 0);
+    h = shm_channel_attach(region, REGION_SIZE);
+    qemu_thread_create(&thread, "producer", producer, region,
+                       QEMU_THREAD_JOINABLE);
+
+    for (i = 0; i < N_RECORDS; i++) {
+        while (!(p = shm_ring_peek(region, &h->channels[1].to_guest, &len))) {
+            sched_yield();
+        }
+        memcpy(&n, p, 4);
+        g_assert_cmpint(n, ==, i);
+        g_assert_cmpint(len, ==, 4 + (i * 7919) % 5000);
+        for (j = 4; j < len; j++) {
+            g_assert_cmpint(p[j], ==, (uint8_t)(i + j));
+        }
+        shm_ring_release(region, &h->channels[1].to_guest);
+    }
+    qemu_thread_join(&thread);
+    g_assert(!shm_ring_peek(region, &h->channels[1].to_guest, &len));
+    g_free(region);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/shm-channel/format", test_format);
+    g_test_add_func("/shm-channel/wrap", test_wrap);
+    g_test_add_func("/shm-channel/threads", test_threads);
+    return g_test_run();
+}
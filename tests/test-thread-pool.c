@@ -220,6 +220,51 @@ static void test_cancel_async(void)
     do_test_cancel(false);
 }
 
+static int nop_cb(void *opaque)
+{
+    return 0;
+}
+
+static void perf_done_cb(void *opaque, int ret)
+{
+    active--;
+}
+
+static void do_perf_submit(int depth)
+{
+    const unsigned long maxcycles = 1000000;
+    unsigned long i;
+    double duration;
+
+    active = 0;
+    g_test_timer_start();
+    for (i = 0; i < maxcycles; i++) {
+        while (active >= depth) {
+            aio_poll(ctx, true);
+        }
+        active++;
+        thread_pool_submit_aio(pool, nop_cb, NULL, perf_done_cb, NULL);
+    }
+    while (active > 0) {
+        aio_poll(ctx, true);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("Queue depth %d: %lu requests %f s, %luK requests/s",
+                   depth, maxcycles, duration,
+                   (unsigned long)(maxcycles / (duration * 1000)));
+}
+
+static void perf_submit_serial(void)
+{
+    do_perf_submit(1);
+}
+
+static void perf_submit_parallel(void)
+{
+    do_perf_submit(256);
+}
+
 int main(int argc, char **argv)
 {
     int ret;
@@ -243,6 +288,10 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
     g_test_add_func("/thread-pool/cancel", test_cancel);
     g_test_add_func("/thread-pool/cancel-async", test_cancel_async);
+    if (g_test_perf()) {
+        g_test_add_func("/thread-pool/perf/serial", perf_submit_serial);
+        g_test_add_func("/thread-pool/perf/parallel", perf_submit_parallel);
+    }
 
     ret = g_test_run();
 
@@ -377,6 +377,272 @@ static void test_load_v2(void)
     qemu_fclose(loading);
 }
 
+/* Arrays and runs of fields, which are saved and loaded in bulk */
+
+typedef struct TestArrays {
+    uint8_t  u8[3];
+    uint8_t  buf[5];
+    uint16_t u16[3];
+    uint32_t u32_1, u32_2;
+    uint32_t u32[2];
+    uint64_t u64[2];
+    bool     b;
+} TestArrays;
+
+static const VMStateDescription vmstate_arrays = {
+    .name = "test/arrays",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8_ARRAY(u8, TestArrays, 3),
+        VMSTATE_BUFFER(buf, TestArrays),
+        VMSTATE_UINT16_ARRAY(u16, TestArrays, 3),
+        VMSTATE_UINT32(u32_1, TestArrays),
+        VMSTATE_UINT32(u32_2, TestArrays),
+        VMSTATE_UINT32_ARRAY(u32, TestArrays, 2),
+        VMSTATE_UINT64_ARRAY(u64, TestArrays, 2),
+        VMSTATE_BOOL(b, TestArrays),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static TestArrays obj_arrays = {
+    .u8 = { 1, 2, 3 },
+    .buf = "abcd",
+    .u16 = { 0x102, 0x304, 0x506 },
+    .u32_1 = 0x708090a,
+    .u32_2 = 0xb0c0d0e,
+    .u32 = { 0x10203040, 0x50607080 },
+    .u64 = { 0x1122334455667788ULL, 0x99aabbccddeeff00ULL },
+    .b = true,
+};
+
+static uint8_t wire_arrays[] = {
+    /* u8 */    0x01, 0x02, 0x03,
+    /* buf */   'a', 'b', 'c', 'd', 0x00,
+    /* u16 */   0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+    /* u32_1 */ 0x07, 0x08, 0x09, 0x0a,
+    /* u32_2 */ 0x0b, 0x0c, 0x0d, 0x0e,
+    /* u32 */   0x10, 0x20, 0x30, 0x40, 0x50, 0x60, 0x70, 0x80,
+    /* u64 */   0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88,
+                0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff, 0x00,
+    /* b */     0x01,
+    QEMU_VM_EOF, /* just to ensure we won't get EOF reported prematurely */
+};
+
+static void obj_arrays_copy(void *target, void *source)
+{
+    memcpy(target, source, sizeof(TestArrays));
+}
+
+static void test_arrays(void)
+{
+    TestArrays obj, obj_clone;
+
+    save_vmstate(&vmstate_arrays, &obj_arrays);
+    compare_vmstate(wire_arrays, sizeof(wire_arrays));
+
+    memset(&obj, 0, sizeof(obj));
+    SUCCESS(load_vmstate(&vmstate_arrays, &obj, &obj_clone,
+                         obj_arrays_copy, 1, wire_arrays,
+                         sizeof(wire_arrays)));
+    SUCCESS(memcmp(&obj, &obj_arrays, sizeof(obj)));
+}
+
+/* A run of fields must not swallow a neighbour from a later version */
+static const VMStateDescription vmstate_versioned_run = {
+    .name = "test/versioned_run",
+    .version_id = 2,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(u32_1, TestArrays),
+        VMSTATE_UINT32_V(u32_2, TestArrays, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void test_load_v1_run(void)
+{
+    QEMUFile *fsave = open_test_file(true);
+    uint8_t buf[] = {
+        0, 0, 0, 10,             /* u32_1 */
+        QEMU_VM_EOF, /* just to ensure we won't get EOF reported prematurely */
+    };
+    TestArrays obj = { .u32_2 = 20 };
+
+    qemu_put_buffer(fsave, buf, sizeof(buf));
+    qemu_fclose(fsave);
+
+    QEMUFile *loading = open_test_file(false);
+    SUCCESS(vmstate_load_state(loading, &vmstate_versioned_run, &obj, 1));
+    g_assert_cmpint(obj.u32_1, ==, 10);
+    g_assert_cmpint(obj.u32_2, ==, 20);
+    g_assert_cmpint(qemu_get_byte(loading), ==, QEMU_VM_EOF);
+    qemu_fclose(loading);
+}
+
+/* Benchmarks, with the register file of some device. The same state is
+ * also described with a test on every field, which keeps it out of the
+ * bulk operations and shows what interpreting each field costs.
+ */
+
+typedef struct TestDevice {
+    uint32_t regs[64];
+    uint32_t status, control, irq_mask, irq_level;
+    uint16_t fifo_head, fifo_tail;
+    uint64_t counters[16];
+    uint8_t  fifo[4096];
+} TestDevice;
+
+static bool test_always(void *opaque, int version_id)
+{
+    return true;
+}
+
+static const VMStateDescription vmstate_device = {
+    .name = "test/device",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(regs, TestDevice, 64),
+        VMSTATE_UINT32(status, TestDevice),
+        VMSTATE_UINT32(control, TestDevice),
+        VMSTATE_UINT32(irq_mask, TestDevice),
+        VMSTATE_UINT32(irq_level, TestDevice),
+        VMSTATE_UINT16(fifo_head, TestDevice),
+        VMSTATE_UINT16(fifo_tail, TestDevice),
+        VMSTATE_UINT64_ARRAY(counters, TestDevice, 16),
+        VMSTATE_BUFFER(fifo, TestDevice),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_device_fields = {
+    .name = "test/device",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_ARRAY_TEST(regs, TestDevice, 64, test_always,
+                           vmstate_info_uint32, uint32_t),
+        VMSTATE_UINT32_TEST(status, TestDevice, test_always),
+        VMSTATE_UINT32_TEST(control, TestDevice, test_always),
+        VMSTATE_UINT32_TEST(irq_mask, TestDevice, test_always),
+        VMSTATE_UINT32_TEST(irq_level, TestDevice, test_always),
+        VMSTATE_SINGLE_TEST(fifo_head, TestDevice, test_always, 0,
+                            vmstate_info_uint16, uint16_t),
+        VMSTATE_SINGLE_TEST(fifo_tail, TestDevice, test_always, 0,
+                            vmstate_info_uint16, uint16_t),
+        VMSTATE_ARRAY_TEST(counters, TestDevice, 16, test_always,
+                           vmstate_info_uint64, uint64_t),
+        VMSTATE_ARRAY_TEST(fifo, TestDevice, 4096, test_always,
+                           vmstate_info_uint8, uint8_t),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+#define DEVICE_WIRE_SIZE    (64 * 4 + 4 * 4 + 2 * 2 + 16 * 8 + 4096)
+#define DEVICE_SAVES        256
+
+static TestDevice *test_device_new(void)
+{
+    TestDevice *dev = g_new0(TestDevice, 1);
+    int i;
+
+    for (i = 0; i < sizeof(*dev); i++) {
+        ((uint8_t *)dev)[i] = i * 7;
+    }
+    return dev;
+}
+
+static QEMUSizedBuffer *save_device(const VMStateDescription *desc,
+                                    TestDevice *dev, int count)
+{
+    QEMUFile *f = qemu_bufopen("w", NULL);
+    QEMUSizedBuffer *qsb;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        vmstate_save_state(f, desc, dev);
+    }
+    g_assert(!qemu_file_get_error(f));
+    qsb = qsb_clone(qemu_buf_get(f));
+    qemu_fclose(f);
+    return qsb;
+}
+
+static void test_device_wire(void)
+{
+    TestDevice *dev = test_device_new();
+    QEMUSizedBuffer *bulk = save_device(&vmstate_device, dev, 1);
+    QEMUSizedBuffer *fields = save_device(&vmstate_device_fields, dev, 1);
+    uint8_t *a = g_malloc(DEVICE_WIRE_SIZE);
+    uint8_t *b = g_malloc(DEVICE_WIRE_SIZE);
+
+    g_assert_cmpint(qsb_get_length(bulk), ==, DEVICE_WIRE_SIZE);
+    g_assert_cmpint(qsb_get_length(fields), ==, DEVICE_WIRE_SIZE);
+    qsb_get_buffer(bulk, 0, DEVICE_WIRE_SIZE, a);
+    qsb_get_buffer(fields, 0, DEVICE_WIRE_SIZE, b);
+    SUCCESS(memcmp(a, b, DEVICE_WIRE_SIZE));
+
+    qsb_free(bulk);
+    qsb_free(fields);
+    g_free(a);
+    g_free(b);
+    g_free(dev);
+}
+
+static void test_device_perf(const VMStateDescription *desc, const char *what)
+{
+    TestDevice *dev = test_device_new();
+    TestDevice *copy = g_new0(TestDevice, 1);
+    QEMUSizedBuffer *qsb;
+    QEMUFile *f;
+    double elapsed, mib;
+    int i, rounds = 100;
+
+    mib = (double)rounds * DEVICE_SAVES * DEVICE_WIRE_SIZE / (1 << 20);
+
+    g_test_timer_start();
+    for (i = 0; i < rounds; i++) {
+        qsb_free(save_device(desc, dev, DEVICE_SAVES));
+    }
+    elapsed = g_test_timer_elapsed();
+    g_test_maximized_result(mib / elapsed, "save %s: %.0f MiB/s, %.0f ns",
+                            what, mib / elapsed,
+                            elapsed * 1e9 / rounds / DEVICE_SAVES);
+
+    qsb = save_device(desc, dev, DEVICE_SAVES);
+    g_test_timer_start();
+    for (i = 0; i < rounds; i++) {
+        int j;
+
+        f = qemu_bufopen("r", qsb_clone(qsb));
+        for (j = 0; j < DEVICE_SAVES; j++) {
+            SUCCESS(vmstate_load_state(f, desc, copy, 1));
+        }
+        qemu_fclose(f);
+    }
+    elapsed = g_test_timer_elapsed();
+    g_test_maximized_result(mib / elapsed, "load %s: %.0f MiB/s, %.0f ns",
+                            what, mib / elapsed,
+                            elapsed * 1e9 / rounds / DEVICE_SAVES);
+    SUCCESS(memcmp(dev, copy, sizeof(*dev)));
+
+    qsb_free(qsb);
+    g_free(copy);
+    g_free(dev);
+}
+
+static void test_perf_bulk(void)
+{
+    test_device_perf(&vmstate_device, "bulk");
+}
+
+static void test_perf_fields(void)
+{
+    test_device_perf(&vmstate_device_fields, "per field");
+}
+
 static bool test_skip(void *opaque, int version_id)
 {
     TestStruct *t = (TestStruct *)opaque;
@@ -498,6 +764,13 @@ int main(int argc, char **argv)
     g_test_add_func("/vmstate/field_exists/load/skip", test_load_skip);
     g_test_add_func("/vmstate/field_exists/save/noskip", test_save_noskip);
     g_test_add_func("/vmstate/field_exists/save/skip", test_save_skip);
+    g_test_add_func("/vmstate/arrays", test_arrays);
+    g_test_add_func("/vmstate/versioned/load/v1_run", test_load_v1_run);
+    g_test_add_func("/vmstate/device/wire", test_device_wire);
+    if (g_test_perf()) {
+        g_test_add_func("/vmstate/perf/bulk", test_perf_bulk);
+        g_test_add_func("/vmstate/perf/fields", test_perf_fields);
+    }
     g_test_run();
 
     close(temp_fd);
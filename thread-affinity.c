@@ -0,0 +1,255 @@
+/*
+ * Host CPU affinity of the emulator threads
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/bitmap.h"
+#include "qemu/error-report.h"
+#include "qom/cpu.h"
+#include "qapi/qmp/qerror.h"
+#include "qmp-commands.h"
+#include "sysemu/thread-affinity.h"
+
+#ifdef CONFIG_LINUX
+#include <sched.h>
+#endif
+
+/* Same as CPU_SETSIZE, Windows only goes up to 64 */
+#define HOST_CPUS_MAX   1024
+
+typedef struct HostCpus {
+    DECLARE_BITMAP(cpus, HOST_CPUS_MAX);
+    bool set;
+} HostCpus;
+
+static HostCpus vcpu_host_cpus;
+static HostCpus io_host_cpus;
+
+static bool host_cpus_parse(const char *str, unsigned long *cpus,
+                            Error **errp)
+{
+    const char *p = str;
+
+    bitmap_zero(cpus, HOST_CPUS_MAX);
+    do {
+        unsigned long first, last;
+        char *end;
+
+        if (!qemu_isdigit(*p)) {
+            break;
+        }
+        first = last = strtoul(p, &end, 10);
+        if (*end == '-') {
+            p = end + 1;
+            if (!qemu_isdigit(*p)) {
+                break;
+            }
+            last = strtoul(p, &end, 10);
+        }
+        if (first > last || last >= HOST_CPUS_MAX) {
+            break;
+        }
+        bitmap_set(cpus, first, last - first + 1);
+        p = *end == ',' ? end + 1 : end;
+        if (!*end) {
+            return true;
+        }
+    } while (*p);
+
+    error_setg(errp, "invalid list of host CPUs '%s', expected something "
+               "like 0-3,8 with CPUs below %d", str, HOST_CPUS_MAX);
+    return false;
+}
+
+/* @tid is a thread of this process, 0 for the calling one */
+static int host_cpus_apply(int tid, const unsigned long *cpus)
+{
+#if defined(CONFIG_LINUX)
+    cpu_set_t set;
+    long i;
+
+    CPU_ZERO(&set);
+    for (i = find_first_bit(cpus, HOST_CPUS_MAX); i < HOST_CPUS_MAX;
+         i = find_next_bit(cpus, HOST_CPUS_MAX, i + 1)) {
+        CPU_SET(i, &set);
+    }
+    return sched_setaffinity(tid, sizeof(set), &set) ? -errno : 0;
+#elif defined(_WIN32)
+    DWORD_PTR mask = 0;
+    HANDLE thread;
+    int ret = 0;
+    long i;
+
+    for (i = find_first_bit(cpus, HOST_CPUS_MAX); i < HOST_CPUS_MAX;
+         i = find_next_bit(cpus, HOST_CPUS_MAX, i + 1)) {
+        if (i >= sizeof(mask) * 8) {
+            return -EINVAL;
+        }
+        mask |= (DWORD_PTR)1 << i;
+    }
+    if (!tid) {
+        return SetThreadAffinityMask(GetCurrentThread(), mask) ? 0 : -EINVAL;
+    }
+    thread = OpenThread(THREAD_SET_INFORMATION | THREAD_QUERY_INFORMATION,
+                        FALSE, tid);
+    if (!thread) {
+        return -ESRCH;
+    }
+    if (GetProcessIdOfThread(thread) != GetCurrentProcessId()) {
+        ret = -ESRCH;
+    } else if (!SetThreadAffinityMask(thread, mask)) {
+        ret = -EINVAL;
+    }
+    CloseHandle(thread);
+    return ret;
+#else
+    return -ENOSYS;
+#endif
+}
+
+static bool host_cpus_set(HostCpus *hc, const char *str, Error **errp)
+{
+    if (!host_cpus_parse(str, hc->cpus, errp)) {
+        return false;
+    }
+#if defined(CONFIG_LINUX) || defined(_WIN32)
+    hc->set = true;
+    return true;
+#else
+    error_setg(errp, "CPU affinity is not supported on this host");
+    return false;
+#endif
+}
+
+static void host_cpus_apply_self(HostCpus *hc, const char *what)
+{
+    int ret;
+
+    if (!hc->set) {
+        return;
+    }
+    ret = host_cpus_apply(0, hc->cpus);
+    if (ret < 0) {
+        error_report("warning: could not set the host CPUs of the %s "
+                     "thread: %s", what, strerror(-ret));
+    }
+}
+
+bool thread_affinity_set_vcpus(const char *host_cpus, Error **errp)
+{
+    return host_cpus_set(&vcpu_host_cpus, host_cpus, errp);
+}
+
+bool thread_affinity_set_io(const char *host_cpus, Error **errp)
+{
+    return host_cpus_set(&io_host_cpus, host_cpus, errp);
+}
+
+void thread_affinity_apply_vcpu(void)
+{
+    host_cpus_apply_self(&vcpu_host_cpus, "vcpu");
+}
+
+void thread_affinity_apply_io(void)
+{
+    host_cpus_apply_self(&io_host_cpus, "I/O");
+}
+
+static bool host_cpus_from_list(uint16List *list, unsigned long *cpus,
+                                Error **errp)
+{
+    bitmap_zero(cpus, HOST_CPUS_MAX);
+    if (!list) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "host-cpus",
+                  "a non-empty list");
+        return false;
+    }
+    for (; list; list = list->next) {
+        if (list->value >= HOST_CPUS_MAX) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "host-cpus",
+                      "a list of host CPUs below 1024");
+            return false;
+        }
+        set_bit(list->value, cpus);
+    }
+    return true;
+}
+
+static void host_cpus_apply_thread(int tid, const unsigned long *cpus,
+                                   Error **errp)
+{
+    int ret = host_cpus_apply(tid, cpus);
+
+    if (ret == -ENOSYS) {
+        error_set(errp, QERR_UNSUPPORTED);
+    } else if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not set the host CPUs of "
+                         "thread %d", tid);
+    }
+}
+
+void qmp_set_vcpu_affinity(bool has_cpu_index, int64_t cpu_index,
+                           uint16List *host_cpus, Error **errp)
+{
+    DECLARE_BITMAP(mask, HOST_CPUS_MAX);
+    Error *local_err = NULL;
+    CPUState *cpu;
+
+    if (!host_cpus_from_list(host_cpus, mask, errp)) {
+        return;
+    }
+    if (has_cpu_index) {
+        cpu = qemu_get_cpu(cpu_index);
+        if (!cpu) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cpu-index",
+                      "a CPU number");
+            return;
+        }
+        host_cpus_apply_thread(cpu->thread_id, mask, errp);
+        return;
+    }
+
+    /* TCG runs them all in the same thread */
+    CPU_FOREACH(cpu) {
+        host_cpus_apply_thread(cpu->thread_id, mask, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
+    }
+}
+
+void qmp_set_thread_affinity(int64_t thread_id, uint16List *host_cpus,
+                             Error **errp)
+{
+    DECLARE_BITMAP(mask, HOST_CPUS_MAX);
+
+    if (!host_cpus_from_list(host_cpus, mask, errp)) {
+        return;
+    }
+    if (thread_id <= 0 || thread_id > INT_MAX) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "thread-id",
+                  "a thread ID");
+        return;
+    }
+#ifdef CONFIG_LINUX
+    {
+        /* sched_setaffinity() takes any thread of the host */
+        char *path = g_strdup_printf("/proc/self/task/%d", (int)thread_id);
+        bool ours = access(path, F_OK) == 0;
+
+        g_free(path);
+        if (!ours) {
+            error_setg(errp, "Thread %d is not one of this process",
+                       (int)thread_id);
+            return;
+        }
+    }
+#endif
+    host_cpus_apply_thread(thread_id, mask, errp);
+}
@@ -30,6 +30,7 @@ typedef struct ThreadPoolElement ThreadPoolElement;
 enum ThreadState {
     THREAD_QUEUED,
     THREAD_ACTIVE,
+    THREAD_CANCELED,
     THREAD_DONE,
 };
 
@@ -39,9 +40,10 @@ struct ThreadPoolElement {
     ThreadPoolFunc *func;
     void *arg;
 
-    /* Moving state out of THREAD_QUEUED is protected by lock.  After
-     * that, only the worker thread can write to it.  Reads and writes
-     * of state and ret are ordered with memory barriers.
+    /* Moving state out of THREAD_QUEUED is done with atomic_cmpxchg, by
+     * the worker that dequeues the request or by thread_pool_cancel.
+     * After that, only the worker thread can write to it.  Reads and
+     * writes of state and ret are ordered with memory barriers.
      */
     enum ThreadState state;
     int ret;
@@ -49,10 +51,29 @@ struct ThreadPoolElement {
     /* Access to this list is protected by lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
-    /* Access to this list is protected by the global mutex.  */
+    /* Pushed to by worker threads, emptied by the completion bottom half.  */
+    QSLIST_ENTRY(ThreadPoolElement) done;
+
+    /* Access to these lists is protected by the global mutex.  */
+    QSIMPLEQ_ENTRY(ThreadPoolElement) completed;
     QLIST_ENTRY(ThreadPoolElement) all;
 };
 
+/*
+ * Requests are handed to the workers through a bounded ring, the MPMC
+ * queue by Dmitry Vyukov: each slot's sequence number tells whether it
+ * is free for the enqueue position or filled for the dequeue position,
+ * so neither side takes a lock.  There is a single producer, the thread
+ * of the pool's AioContext.  If the ring is full, requests go to
+ * request_list under the lock.
+ */
+#define THREAD_POOL_RING_SIZE 256   /* must be a power of two */
+
+typedef struct ThreadPoolSlot {
+    unsigned long seq;
+    ThreadPoolElement *elem;
+} ThreadPoolSlot;
+
 struct ThreadPool {
     AioContext *ctx;
     QEMUBH *completion_bh;
@@ -62,18 +83,95 @@ struct ThreadPool {
     int max_threads;
     QEMUBH *new_thread_bh;
 
+    ThreadPoolSlot ring[THREAD_POOL_RING_SIZE];
+    unsigned long enqueue_pos;      /* written by the producer only */
+    unsigned long dequeue_pos;
+    QSLIST_HEAD(, ThreadPoolElement) done_list;
+
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    QSIMPLEQ_HEAD(, ThreadPoolElement) completed;
+
+    /* Updated atomically.  */
+    int idle_threads;
 
     /* The following variables are protected by lock.  */
     QTAILQ_HEAD(, ThreadPoolElement) request_list;
     int cur_threads;
-    int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
     bool stopping;
 };
 
+static bool thread_pool_ring_push(ThreadPool *pool, ThreadPoolElement *req)
+{
+    unsigned long pos = pool->enqueue_pos;
+    ThreadPoolSlot *slot = &pool->ring[pos & (THREAD_POOL_RING_SIZE - 1)];
+
+    if (atomic_read(&slot->seq) != pos) {
+        return false;   /* full */
+    }
+    /* Read seq before overwriting elem.  */
+    smp_mb();
+    slot->elem = req;
+    /* Write elem before publishing the slot.  */
+    smp_wmb();
+    atomic_set(&slot->seq, pos + 1);
+    atomic_set(&pool->enqueue_pos, pos + 1);
+    return true;
+}
+
+static ThreadPoolElement *thread_pool_ring_pop(ThreadPool *pool)
+{
+    for (;;) {
+        unsigned long pos = atomic_read(&pool->dequeue_pos);
+        ThreadPoolSlot *slot = &pool->ring[pos & (THREAD_POOL_RING_SIZE - 1)];
+        long diff = (long)(atomic_read(&slot->seq) - (pos + 1));
+
+        if (diff < 0) {
+            return NULL;    /* empty */
+        }
+        if (diff == 0 && atomic_cmpxchg(&pool->dequeue_pos, pos, pos + 1) == pos) {
+            ThreadPoolElement *req = slot->elem;
+
+            /* Read elem before handing the slot back to the producer.  */
+            smp_mb();
+            atomic_set(&slot->seq, pos + THREAD_POOL_RING_SIZE);
+            return req;
+        }
+        /* Another worker took this slot, try the next one */
+    }
+}
+
+static bool thread_pool_queue_empty(ThreadPool *pool)
+{
+    /* Runs with lock taken.  */
+    return atomic_read(&pool->dequeue_pos) == atomic_read(&pool->enqueue_pos) &&
+           QTAILQ_EMPTY(&pool->request_list);
+}
+
+/* Take a request that the semaphore says is there */
+static ThreadPoolElement *thread_pool_dequeue(ThreadPool *pool)
+{
+    ThreadPoolElement *req;
+
+    for (;;) {
+        req = thread_pool_ring_pop(pool);
+        if (req) {
+            return req;
+        }
+        qemu_mutex_lock(&pool->lock);
+        req = QTAILQ_FIRST(&pool->request_list);
+        if (req) {
+            QTAILQ_REMOVE(&pool->request_list, req, reqs);
+        }
+        qemu_mutex_unlock(&pool->lock);
+        if (req) {
+            return req;
+        }
+    }
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
@@ -81,36 +179,44 @@ static void *worker_thread(void *opaque)
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
     do_spawn_thread(pool);
+    qemu_mutex_unlock(&pool->lock);
 
-    while (!pool->stopping) {
+    for (;;) {
         ThreadPoolElement *req;
         int ret;
 
-        do {
-            pool->idle_threads++;
+        atomic_inc(&pool->idle_threads);
+        ret = qemu_sem_timedwait(&pool->sem, 10000);
+        /* Also orders the decrement before the emptiness check below,
+         * pairing with the smp_mb() in thread_pool_submit_aio().
+         */
+        atomic_dec(&pool->idle_threads);
+
+        if (ret == -1) {
+            qemu_mutex_lock(&pool->lock);
+            if (pool->stopping || thread_pool_queue_empty(pool)) {
+                break;
+            }
             qemu_mutex_unlock(&pool->lock);
-            ret = qemu_sem_timedwait(&pool->sem, 10000);
+            continue;
+        }
+        if (atomic_read(&pool->stopping)) {
             qemu_mutex_lock(&pool->lock);
-            pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
-        if (ret == -1 || pool->stopping) {
             break;
         }
 
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
-        qemu_mutex_unlock(&pool->lock);
-
-        ret = req->func(req->arg);
-
-        req->ret = ret;
+        req = thread_pool_dequeue(pool);
+        if (atomic_cmpxchg(&req->state, THREAD_QUEUED, THREAD_ACTIVE) ==
+            THREAD_QUEUED) {
+            req->ret = req->func(req->arg);
+        } else {
+            req->ret = -ECANCELED;
+        }
         /* Write ret before state.  */
         smp_wmb();
         req->state = THREAD_DONE;
 
-        qemu_mutex_lock(&pool->lock);
-
+        QSLIST_INSERT_HEAD_ATOMIC(&pool->done_list, req, done);
         qemu_bh_schedule(pool->completion_bh);
     }
 
@@ -163,61 +269,49 @@ static void spawn_thread(ThreadPool *pool)
 static void thread_pool_completion_bh(void *opaque)
 {
     ThreadPool *pool = opaque;
-    ThreadPoolElement *elem, *next;
-
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_DONE) {
-            continue;
-        }
-        if (elem->state == THREAD_DONE) {
-            trace_thread_pool_complete(pool, elem, elem->common.opaque,
-                                       elem->ret);
-        }
-        if (elem->state == THREAD_DONE && elem->common.cb) {
-            QLIST_REMOVE(elem, all);
-            /* Read state before ret.  */
-            smp_rmb();
-
+    QSLIST_HEAD(, ThreadPoolElement) done;
+    QSIMPLEQ_HEAD(, ThreadPoolElement) batch = QSIMPLEQ_HEAD_INITIALIZER(batch);
+    ThreadPoolElement *elem;
+
+    /* Workers push completed requests in LIFO order, turn that around */
+    QSLIST_MOVE_ATOMIC(&done, &pool->done_list);
+    while ((elem = QSLIST_FIRST(&done))) {
+        QSLIST_REMOVE_HEAD(&done, done);
+        QSIMPLEQ_INSERT_HEAD(&batch, elem, completed);
+    }
+    QSIMPLEQ_CONCAT(&pool->completed, &batch);
+
+    while ((elem = QSIMPLEQ_FIRST(&pool->completed))) {
+        QSIMPLEQ_REMOVE_HEAD(&pool->completed, completed);
+        QLIST_REMOVE(elem, all);
+        /* Read state before ret.  */
+        smp_rmb();
+        assert(elem->state == THREAD_DONE);
+        trace_thread_pool_complete(pool, elem, elem->common.opaque,
+                                   elem->ret);
+
+        if (elem->common.cb) {
             /* Schedule ourselves in case elem->common.cb() calls aio_poll() to
              * wait for another request that completed at the same time.
              */
             qemu_bh_schedule(pool->completion_bh);
 
             elem->common.cb(elem->common.opaque, elem->ret);
-            qemu_aio_unref(elem);
-            goto restart;
-        } else {
-            /* remove the request */
-            QLIST_REMOVE(elem, all);
-            qemu_aio_unref(elem);
         }
+        qemu_aio_unref(elem);
     }
 }
 
 static void thread_pool_cancel(BlockAIOCB *acb)
 {
     ThreadPoolElement *elem = (ThreadPoolElement *)acb;
-    ThreadPool *pool = elem->pool;
 
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
-    qemu_mutex_lock(&pool->lock);
-    if (elem->state == THREAD_QUEUED &&
-        /* No thread has yet started working on elem. we can try to "steal"
-         * the item from the worker if we can get a signal from the
-         * semaphore.  Because this is non-blocking, we can do it with
-         * the lock taken and ensure that elem will remain THREAD_QUEUED.
-         */
-        qemu_sem_timedwait(&pool->sem, 0) == 0) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        qemu_bh_schedule(pool->completion_bh);
-
-        elem->state = THREAD_DONE;
-        elem->ret = -ECANCELED;
-    }
-
-    qemu_mutex_unlock(&pool->lock);
+    /* If no thread has started working on elem yet, the worker that
+     * dequeues it completes it with -ECANCELED instead of running it.
+     */
+    atomic_cmpxchg(&elem->state, THREAD_QUEUED, THREAD_CANCELED);
 }
 
 static AioContext *thread_pool_get_aio_context(BlockAIOCB *acb)
@@ -249,12 +343,23 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
 
     trace_thread_pool_submit(pool, req, arg);
 
-    qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
-        spawn_thread(pool);
+    if (!thread_pool_ring_push(pool, req)) {
+        qemu_mutex_lock(&pool->lock);
+        QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
+        qemu_mutex_unlock(&pool->lock);
+    }
+
+    /* Queue the request before looking for idle threads, so that a worker
+     * timing out either sees the request or is not counted as idle.
+     */
+    smp_mb();
+    if (atomic_read(&pool->idle_threads) == 0) {
+        qemu_mutex_lock(&pool->lock);
+        if (pool->cur_threads < pool->max_threads) {
+            spawn_thread(pool);
+        }
+        qemu_mutex_unlock(&pool->lock);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    qemu_mutex_unlock(&pool->lock);
     qemu_sem_post(&pool->sem);
     return &req->common;
 }
@@ -289,6 +394,8 @@ void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg)
 
 static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
 {
+    int i;
+
     if (!ctx) {
         ctx = qemu_get_aio_context();
     }
@@ -302,7 +409,12 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     pool->max_threads = 64;
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
+    for (i = 0; i < THREAD_POOL_RING_SIZE; i++) {
+        pool->ring[i].seq = i;
+    }
+    QSLIST_INIT(&pool->done_list);
     QLIST_INIT(&pool->head);
+    QSIMPLEQ_INIT(&pool->completed);
     QTAILQ_INIT(&pool->request_list);
 }
 
@@ -11,6 +11,9 @@
 #ifdef CONFIG_TRACE_SIMPLE
 #include "trace/simple.h"
 #endif
+#ifdef CONFIG_TRACE_RING
+#include "trace/ring.h"
+#endif
 #ifdef CONFIG_TRACE_FTRACE
 #include "trace/ftrace.h"
 #endif
@@ -149,7 +152,20 @@ bool trace_init_backends(const char *events, const char *file)
         fprintf(stderr, "failed to initialize simple tracing backend.\n");
         return false;
     }
-#else
+#endif
+
+#ifdef CONFIG_TRACE_RING
+#ifdef CONFIG_TRACE_SIMPLE
+    /* file=... names the simple backend's output, use the default */
+    file = NULL;
+#endif
+    if (!trace_ring_init(file)) {
+        fprintf(stderr, "failed to initialize ring tracing backend.\n");
+        return false;
+    }
+#endif
+
+#if !defined(CONFIG_TRACE_SIMPLE) && !defined(CONFIG_TRACE_RING)
     if (file) {
         fprintf(stderr, "error: -trace file=...: "
                 "option not supported by the selected tracing backends\n");
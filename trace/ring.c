@@ -0,0 +1,249 @@
+/*
+ * Ring buffer trace backend
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/timer.h"
+#include "trace.h"
+#include "trace/control.h"
+#include "trace/ring.h"
+
+/* A ring is its header slot followed by its records */
+#define TRACE_RING_SIZE \
+    ((size_t)(TRACE_RING_RECORDS + 1) * TRACE_RING_RECORD_SIZE)
+
+/* Records between two updates of a ring's sync pair, a power of 2 */
+#define TRACE_RING_SYNC_RECORDS 65536
+
+/*
+ * Each ring has a single writer, the thread that claimed it, so recording
+ * an event takes no lock and no atomic operation: the thread fills the
+ * slot after the last record, then moves the ring's head past it.  A
+ * reader copies the ring and only trusts the records that the head says
+ * were complete and can't have been overwritten while it was copying.
+ *
+ * Threads claim a free ring on their first event and release it when they
+ * exit, leaving their records in place until another thread claims it.
+ * Nothing here may allocate memory or take a lock, since g_malloc() itself
+ * is traced.
+ */
+static uint8_t *trace_ring_base;
+static pthread_key_t trace_ring_key;
+
+static __thread TraceRingHeader *trace_ring;
+static __thread bool trace_ring_exhausted;
+
+QEMU_BUILD_BUG_ON(sizeof(TraceRingRecord) != TRACE_RING_RECORD_SIZE);
+QEMU_BUILD_BUG_ON(sizeof(TraceRingHeader) > TRACE_RING_RECORD_SIZE);
+QEMU_BUILD_BUG_ON(sizeof(TraceRingFileHeader) > TRACE_RING_FILE_HEADER_SIZE);
+QEMU_BUILD_BUG_ON(TRACE_RING_RECORDS & (TRACE_RING_RECORDS - 1));
+
+static TraceRingHeader *ring_header(uint8_t *base, unsigned int idx)
+{
+    return (TraceRingHeader *)(base + TRACE_RING_FILE_HEADER_SIZE +
+                               idx * TRACE_RING_SIZE);
+}
+
+static TraceRingRecord *ring_record(TraceRingHeader *ring, uint64_t seq)
+{
+    size_t slot = 1 + (seq & (TRACE_RING_RECORDS - 1));
+
+    return (TraceRingRecord *)((uint8_t *)ring +
+                               slot * TRACE_RING_RECORD_SIZE);
+}
+
+static void ring_sync(TraceRingHeader *ring)
+{
+    ring->sync_ns = get_clock_realtime();
+    ring->sync_ticks = cpu_get_real_ticks();
+}
+
+static void trace_ring_release(void *opaque)
+{
+    TraceRingHeader *ring = opaque;
+
+    ring_sync(ring);
+    atomic_mb_set(&ring->tid, 0);
+}
+
+static TraceRingHeader *trace_ring_claim(void)
+{
+    uint8_t *base = atomic_mb_read(&trace_ring_base);
+    int tid;
+    unsigned int i;
+
+    if (!base || trace_ring_exhausted) {
+        return NULL;
+    }
+
+    tid = qemu_get_thread_id();
+    for (i = 0; i < TRACE_RING_COUNT; i++) {
+        TraceRingHeader *ring = ring_header(base, i);
+
+        if (atomic_read(&ring->tid) == 0 &&
+            atomic_cmpxchg(&ring->tid, 0, tid) == 0) {
+            ring->dropped = 0;
+            ring_sync(ring);
+            atomic_set(&ring->head, 0);
+            smp_mb();
+            pthread_setspecific(trace_ring_key, ring);
+            trace_ring = ring;
+            return ring;
+        }
+    }
+
+    /* Too many threads, this one goes untraced */
+    trace_ring_exhausted = true;
+    return NULL;
+}
+
+TraceRingRecord *trace_ring_record_start(TraceEventID id)
+{
+    TraceRingHeader *ring = trace_ring;
+    TraceRingRecord *rec;
+
+    if (unlikely(!ring)) {
+        ring = trace_ring_claim();
+        if (!ring) {
+            return NULL;
+        }
+    }
+
+    rec = ring_record(ring, ring->head);
+    rec->ticks = cpu_get_real_ticks();
+    rec->event = id;
+    rec->length = 0;
+    return rec;
+}
+
+void trace_ring_record_write_u64(TraceRingRecord *rec, uint64_t val)
+{
+    if (rec->length + sizeof(val) > sizeof(rec->args)) {
+        rec->event |= TRACE_RING_TRUNCATED;
+        return;
+    }
+    memcpy(rec->args + rec->length, &val, sizeof(val));
+    rec->length += sizeof(val);
+}
+
+void trace_ring_record_write_str(TraceRingRecord *rec, const char *s,
+                                 uint32_t slen)
+{
+    size_t room;
+
+    if (rec->length + sizeof(slen) > sizeof(rec->args)) {
+        rec->event |= TRACE_RING_TRUNCATED;
+        return;
+    }
+    room = sizeof(rec->args) - rec->length - sizeof(slen);
+    if (slen > room) {
+        slen = room;
+        rec->event |= TRACE_RING_TRUNCATED;
+    }
+    memcpy(rec->args + rec->length, &slen, sizeof(slen));
+    memcpy(rec->args + rec->length + sizeof(slen), s, slen);
+    rec->length += sizeof(slen) + slen;
+}
+
+void trace_ring_record_finish(TraceRingRecord *rec)
+{
+    TraceRingHeader *ring = trace_ring;
+    uint64_t head = ring->head + 1;
+
+    if (rec->event & TRACE_RING_TRUNCATED) {
+        ring->dropped++;
+    }
+    smp_wmb(); /* the record before the head that covers it */
+    atomic_set(&ring->head, head);
+
+    if (!(head & (TRACE_RING_SYNC_RECORDS - 1))) {
+        ring_sync(ring);
+    }
+}
+
+static void trace_ring_exit(void)
+{
+    if (trace_ring) {
+        ring_sync(trace_ring);
+    }
+}
+
+/**
+ * Map the ring file
+ *
+ * @file        The file name or NULL for the default name-<pid>.ring set at
+ *              config time
+ */
+bool trace_ring_init(const char *file)
+{
+    size_t size = TRACE_RING_FILE_HEADER_SIZE +
+                  (size_t)TRACE_RING_COUNT * TRACE_RING_SIZE;
+    TraceRingFileHeader *header;
+    char *name;
+    void *base;
+    int fd;
+
+    if (file) {
+        name = g_strdup(file);
+    } else {
+        name = g_strdup_printf(CONFIG_TRACE_FILE ".ring", getpid());
+    }
+
+    fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "warning: could not create trace ring file %s: %s\n",
+                name, strerror(errno));
+        g_free(name);
+        return false;
+    }
+    if (ftruncate(fd, size) < 0) {
+        fprintf(stderr, "warning: could not size trace ring file %s: %s\n",
+                name, strerror(errno));
+        close(fd);
+        g_free(name);
+        return false;
+    }
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "warning: could not map trace ring file %s: %s\n",
+                name, strerror(errno));
+        g_free(name);
+        return false;
+    }
+    g_free(name);
+
+    header = base;
+    header->magic = TRACE_RING_MAGIC;
+    header->version = TRACE_RING_VERSION;
+    header->header_size = TRACE_RING_FILE_HEADER_SIZE;
+    header->ring_count = TRACE_RING_COUNT;
+    header->ring_records = TRACE_RING_RECORDS;
+    header->record_size = TRACE_RING_RECORD_SIZE;
+    header->pid = getpid();
+    header->start_ns = get_clock_realtime();
+    header->start_ticks = cpu_get_real_ticks();
+
+    if (pthread_key_create(&trace_ring_key, trace_ring_release)) {
+        munmap(base, size);
+        return false;
+    }
+    atexit(trace_ring_exit);
+
+    atomic_mb_set(&trace_ring_base, base);
+    return true;
+}
@@ -0,0 +1,93 @@
+/*
+ * Ring buffer trace backend
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef TRACE_RING_H
+#define TRACE_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "trace/generated-events.h"
+
+
+/* Each thread gets a ring of fixed-size records in a shared file mapping,
+ * which it overwrites oldest first.  Nothing is ever written out, so the
+ * file always holds the last TRACE_RING_RECORDS events of every thread;
+ * scripts/ringtrace.py formats it, even while QEMU is running.
+ */
+
+#define TRACE_RING_MAGIC        0x676e6972756d6571ULL   /* "qemuring" */
+#define TRACE_RING_VERSION      1
+
+enum {
+    TRACE_RING_RECORD_SIZE = 128,
+    TRACE_RING_RECORDS = 2048,      /* per ring, a power of 2 */
+    TRACE_RING_COUNT = 64,          /* threads traced at the same time */
+    TRACE_RING_FILE_HEADER_SIZE = 4096,
+};
+
+/* Arguments didn't all fit in the record */
+#define TRACE_RING_TRUNCATED    (1U << 31)
+
+typedef struct {
+    uint64_t magic;             /* TRACE_RING_MAGIC */
+    uint32_t version;           /* TRACE_RING_VERSION */
+    uint32_t header_size;       /* TRACE_RING_FILE_HEADER_SIZE */
+    uint32_t ring_count;
+    uint32_t ring_records;
+    uint32_t record_size;
+    uint32_t pid;
+    int64_t start_ns;           /* host realtime clock ... */
+    int64_t start_ticks;        /* ... and cpu_get_real_ticks() at startup */
+} TraceRingFileHeader;
+
+/* Occupies the first record slot of each ring, the records follow */
+typedef struct {
+    int32_t tid;                /* owner thread, 0 if free */
+    uint32_t unused;
+    uint64_t head;              /* records written since it was claimed */
+    uint64_t dropped;           /* arguments truncated */
+    int64_t sync_ns;            /* a later realtime/ticks pair, for the */
+    int64_t sync_ticks;         /* reader to convert timestamps */
+} TraceRingHeader;
+
+typedef struct {
+    uint64_t ticks;             /* cpu_get_real_ticks() */
+    uint32_t event;             /* TraceEventID, maybe TRACE_RING_TRUNCATED */
+    uint32_t length;            /* bytes used in args[] */
+    uint8_t args[TRACE_RING_RECORD_SIZE - 16];
+} TraceRingRecord;
+
+bool trace_ring_init(const char *file);
+
+/**
+ * Claim the next record of the calling thread's ring
+ *
+ * Returns NULL if the thread has no ring, in which case the event is lost.
+ */
+TraceRingRecord *trace_ring_record_start(TraceEventID id);
+
+/**
+ * Append a 64-bit argument to a trace record
+ */
+void trace_ring_record_write_u64(TraceRingRecord *rec, uint64_t val);
+
+/**
+ * Append a string argument to a trace record, truncated to what fits
+ */
+void trace_ring_record_write_str(TraceRingRecord *rec, const char *s,
+                                 uint32_t slen);
+
+/**
+ * Publish a trace record to readers
+ */
+void trace_ring_record_finish(TraceRingRecord *rec);
+
+#endif /* TRACE_RING_H */
@@ -60,6 +60,10 @@
 #include "exec/cputlb.h"
 #include "translate-all.h"
 #include "qemu/timer.h"
+#if !defined(CONFIG_USER_ONLY)
+#include "qmp-commands.h"
+#include "qemu/metrics.h"
+#endif
 
 //#define DEBUG_TB_INVALIDATE
 //#define DEBUG_FLUSH
@@ -79,7 +83,13 @@ typedef struct PageDesc {
     /* in order to optimize self modifying code, we count the number
        of lookups we do to a given page to use a bitmap */
     unsigned int code_write_count;
+    /* one bit per byte of the page covered by a TB.  TBs are added to it
+       as they are translated; invalidated ones leave their bits set until
+       the next write to the page rebuilds it, which is safe as the only
+       cost of a stale bit is a useless slow path. */
     uint8_t *code_bitmap;
+    /* number of TBs invalidated by writes to the page, for "info jit" */
+    unsigned int invalidate_count;
 #if defined(CONFIG_USER_ONLY)
     unsigned long flags;
 #endif
@@ -126,6 +136,9 @@ static void *l1_map[V_L1_SIZE];
 /* code generation context */
 TCGContext tcg_ctx;
 
+/* translated code counts its executions in tb->exec_count while set */
+int tb_profile;
+
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2);
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
@@ -485,6 +498,25 @@ static inline PageDesc *page_find(tb_page_addr_t index)
   (DEFAULT_CODE_GEN_BUFFER_SIZE_1 < MAX_CODE_GEN_BUFFER_SIZE \
    ? DEFAULT_CODE_GEN_BUFFER_SIZE_1 : MAX_CODE_GEN_BUFFER_SIZE)
 
+#ifndef USE_STATIC_CODE_GEN_BUFFER
+/* Physical memory of the host, or 0 if unknown */
+static uint64_t host_ram_size(void)
+{
+#ifdef _WIN32
+    MEMORYSTATUSEX status;
+
+    status.dwLength = sizeof(status);
+    return GlobalMemoryStatusEx(&status) ? status.ullTotalPhys : 0;
+#elif defined(_SC_PHYS_PAGES)
+    long pages = sysconf(_SC_PHYS_PAGES);
+
+    return pages > 0 ? (uint64_t)pages * getpagesize() : 0;
+#else
+    return 0;
+#endif
+}
+#endif
+
 static inline size_t size_code_gen_buffer(size_t tb_size)
 {
     /* Size the buffer.  */
@@ -492,11 +524,18 @@ static inline size_t size_code_gen_buffer(size_t tb_size)
 #ifdef USE_STATIC_CODE_GEN_BUFFER
         tb_size = DEFAULT_CODE_GEN_BUFFER_SIZE;
 #else
+        uint64_t host_size = host_ram_size();
+
         /* ??? Needs adjustments.  */
         /* ??? If we relax the requirement that CONFIG_USER_ONLY use the
            static buffer, we could size this on RESERVED_VA, on the text
            segment size of the executable, or continue to use the default.  */
         tb_size = (unsigned long)(ram_size / 4);
+        /* Old translations are recycled when the buffer is full, so do not
+           take more than a small part of the host's memory for it.  */
+        if (host_size && tb_size > host_size / 16) {
+            tb_size = host_size / 16;
+        }
 #endif
     }
     if (tb_size < MIN_CODE_GEN_BUFFER_SIZE) {
@@ -688,6 +727,8 @@ void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
     code_gen_alloc(tb_size);
+    qht_init(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE,
+             QHT_MODE_AUTO_RESIZE);
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     tcg_register_jit(tcg_ctx.code_gen_buffer, tcg_ctx.code_gen_buffer_size);
     page_init();
@@ -703,20 +744,101 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/*
+ * The TBs and their generated code are both allocated as rings, in the
+ * same order. When either is full, the oldest TBs are invalidated, about
+ * an eighth of the code buffer at a time, instead of flushing everything:
+ * the hot code that gets dropped is translated again on its next use,
+ * and the rest of the working set stays.
+ */
+#define TB_EVICT_FRACTION   8
+
+/* Upper bound of the host code generated for one TB */
+#define TB_MAX_CODE_SIZE    (TCG_MAX_OP_SIZE * OPC_BUF_SIZE)
+
+/* The @n-th oldest TB */
+static inline TranslationBlock *tb_nth(int n)
+{
+    return &tcg_ctx.tb_ctx.tbs[(tcg_ctx.tb_ctx.tb_first + n) %
+                               tcg_ctx.code_gen_max_blocks];
+}
+
+/* Offset of @ptr from the code of the oldest TB, following the ring */
+static size_t tb_code_offset(uintptr_t ptr)
+{
+    uintptr_t oldest = (uintptr_t)tb_nth(0)->tc_ptr;
+
+    return ptr >= oldest ? ptr - oldest
+                         : ptr + tcg_ctx.code_gen_buffer_size - oldest;
+}
+
+/* Whether there is room for one more TB's code at code_gen_ptr, moving
+   code_gen_ptr back to the start of the buffer when reaching its end. */
+static bool tb_code_has_room(void)
+{
+    uint8_t *oldest;
+
+    if (tcg_ctx.tb_ctx.nb_tbs == 0) {
+        tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
+        return true;
+    }
+    oldest = tb_nth(0)->tc_ptr;
+    if (oldest < tcg_ctx.code_gen_ptr) {
+        /* The live code is [oldest, code_gen_ptr) */
+        if (tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer <
+            tcg_ctx.code_gen_buffer_max_size) {
+            return true;
+        }
+        tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
+    }
+    /* The live code runs from oldest to the end, then up to code_gen_ptr */
+    return tcg_ctx.code_gen_ptr + TB_MAX_CODE_SIZE < oldest;
+}
+
+/* Invalidate the oldest TBs, covering at least one TB_EVICT_FRACTION-th
+   of the code buffer. */
+static void tb_evict(void)
+{
+    TBContext *s = &tcg_ctx.tb_ctx;
+    size_t target = tcg_ctx.code_gen_buffer_size / TB_EVICT_FRACTION;
+    int64_t start = get_clock(), ns;
+    int n = 0;
+
+    while (s->nb_tbs > 0) {
+        TranslationBlock *tb = tb_nth(0);
+
+        if (n > 0 && tb_code_offset((uintptr_t)tb->tc_ptr) >= target) {
+            break;
+        }
+        if (!(tb->cflags & CF_INVALID)) {
+            tb_phys_invalidate(tb, -1);
+        }
+        s->tb_first = (s->tb_first + 1) % tcg_ctx.code_gen_max_blocks;
+        s->nb_tbs--;
+        n++;
+    }
+
+    ns = get_clock() - start;
+    s->tb_evict_count++;
+    s->tb_evicted_count += n;
+    s->tb_evict_time_ns += ns;
+    s->tb_evict_max_ns = MAX(s->tb_evict_max_ns, ns);
+}
+
+/* Allocate a new translation block, evicting the oldest ones if there
+   are too many translation blocks or too much generated code. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks ||
-        (tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer) >=
-         tcg_ctx.code_gen_buffer_max_size) {
-        return NULL;
+    while (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks ||
+           !tb_code_has_room()) {
+        tb_evict();
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = tb_nth(tcg_ctx.tb_ctx.nb_tbs++);
     tb->pc = pc;
     tb->cflags = 0;
+    tb->exec_count = 0;
     return tb;
 }
 
@@ -726,7 +848,7 @@ void tb_free(TranslationBlock *tb)
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
     if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+            tb == tb_nth(tcg_ctx.tb_ctx.nb_tbs - 1)) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
         tcg_ctx.tb_ctx.nb_tbs--;
     }
@@ -779,6 +901,7 @@ static void page_flush_tb(void)
 void tb_flush(CPUArchState *env1)
 {
     CPUState *cpu = ENV_GET_CPU(env1);
+    int64_t start = get_clock(), ns;
 
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
@@ -791,76 +914,68 @@ void tb_flush(CPUArchState *env1)
         > tcg_ctx.code_gen_buffer_size) {
         cpu_abort(cpu, "Internal error: code buffer overflow\n");
     }
+    tcg_ctx.tb_ctx.tb_first = 0;
     tcg_ctx.tb_ctx.nb_tbs = 0;
 
     CPU_FOREACH(cpu) {
         memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
     }
 
-    memset(tcg_ctx.tb_ctx.tb_phys_hash, 0, sizeof(tcg_ctx.tb_ctx.tb_phys_hash));
+    qht_reset_size(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     page_flush_tb();
 
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tcg_ctx.tb_ctx.tb_flush_count++;
+    ns = get_clock() - start;
+    tcg_ctx.tb_ctx.tb_flush_time_ns += ns;
+    tcg_ctx.tb_ctx.tb_flush_max_ns = MAX(tcg_ctx.tb_ctx.tb_flush_max_ns, ns);
 }
 
 #ifdef DEBUG_TB_CHECK
 
-static void tb_invalidate_check(target_ulong address)
+static void do_tb_invalidate_check(QHT *ht, void *p, uint32_t hash,
+                                   void *userp)
 {
-    TranslationBlock *tb;
-    int i;
+    TranslationBlock *tb = p;
+    target_ulong address = *(target_ulong *)userp;
 
-    address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_ctx.tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
-                  address >= tb->pc + tb->size)) {
-                printf("ERROR invalidate: address=" TARGET_FMT_lx
-                       " PC=%08lx size=%04x\n",
-                       address, (long)tb->pc, tb->size);
-            }
-        }
+    if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
+          address >= tb->pc + tb->size)) {
+        printf("ERROR invalidate: address=" TARGET_FMT_lx
+               " PC=%08lx size=%04x\n",
+               address, (long)tb->pc, tb->size);
     }
 }
 
-/* verify that all the pages have correct rights for code */
-static void tb_page_check(void)
+static void tb_invalidate_check(target_ulong address)
 {
-    TranslationBlock *tb;
-    int i, flags1, flags2;
-
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
-                tb = tb->phys_hash_next) {
-            flags1 = page_get_flags(tb->pc);
-            flags2 = page_get_flags(tb->pc + tb->size - 1);
-            if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
-                printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
-                       (long)tb->pc, tb->size, flags1, flags2);
-            }
-        }
-    }
+    address &= TARGET_PAGE_MASK;
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_invalidate_check, &address);
 }
 
-#endif
-
-static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb)
+static void do_tb_page_check(QHT *ht, void *p, uint32_t hash, void *userp)
 {
-    TranslationBlock *tb1;
+    TranslationBlock *tb = p;
+    int flags1, flags2;
 
-    for (;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = tb1->phys_hash_next;
-            break;
-        }
-        ptb = &tb1->phys_hash_next;
+    flags1 = page_get_flags(tb->pc);
+    flags2 = page_get_flags(tb->pc + tb->size - 1);
+    if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
+        printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
+               (long)tb->pc, tb->size, flags1, flags2);
     }
 }
 
+/* verify that all the pages have correct rights for code */
+static void tb_page_check(void)
+{
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_page_check, NULL);
+}
+
+#endif
+
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
     TranslationBlock *tb1;
@@ -923,21 +1038,24 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
+    /* TBs stay in the ring, and may be found again, until evicted */
+    if (tb->cflags & CF_INVALID) {
+        return;
+    }
+
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_hash_remove(&tcg_ctx.tb_ctx.tb_phys_hash[h], tb);
+    h = tb_hash_func(phys_pc, tb->pc, tb->flags);
+    qht_remove(&tcg_ctx.tb_ctx.htable, tb, h);
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
         p = page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
     }
     if (tb->page_addr[1] != -1 && tb->page_addr[1] != page_addr) {
         p = page_find(tb->page_addr[1] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
     }
 
     tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
@@ -968,6 +1086,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
         tb1 = tb2;
     }
     tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
+    tb->cflags |= CF_INVALID;
 
     tcg_ctx.tb_ctx.tb_phys_invalidate_count++;
 }
@@ -999,31 +1118,45 @@ static inline void set_bits(uint8_t *tab, int start, int len)
     }
 }
 
+/* Mark the bytes of page @p covered by its part @n of @tb as code */
+static void page_bitmap_add_tb(PageDesc *p, TranslationBlock *tb, int n)
+{
+    int tb_start, tb_end;
+
+    /* NOTE: this is subtle as a TB may span two physical pages */
+    if (n == 0) {
+        /* NOTE: tb_end may be after the end of the page, but
+           it is not a problem */
+        tb_start = tb->pc & ~TARGET_PAGE_MASK;
+        tb_end = tb_start + tb->size;
+        if (tb_end > TARGET_PAGE_SIZE) {
+            tb_end = TARGET_PAGE_SIZE;
+        }
+    } else {
+        tb_start = 0;
+        tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
+    }
+    set_bits(p->code_bitmap, tb_start, tb_end - tb_start);
+}
+
+/* Build the code bitmap of @p, or rebuild it to drop the bits of
+   invalidated TBs */
 static void build_page_bitmap(PageDesc *p)
 {
-    int n, tb_start, tb_end;
+    int n;
     TranslationBlock *tb;
 
-    p->code_bitmap = g_malloc0(TARGET_PAGE_SIZE / 8);
+    if (p->code_bitmap) {
+        memset(p->code_bitmap, 0, TARGET_PAGE_SIZE / 8);
+    } else {
+        p->code_bitmap = g_malloc0(TARGET_PAGE_SIZE / 8);
+    }
 
     tb = p->first_tb;
     while (tb != NULL) {
         n = (uintptr_t)tb & 3;
         tb = (TranslationBlock *)((uintptr_t)tb & ~3);
-        /* NOTE: this is subtle as a TB may span two physical pages */
-        if (n == 0) {
-            /* NOTE: tb_end may be after the end of the page, but
-               it is not a problem */
-            tb_start = tb->pc & ~TARGET_PAGE_MASK;
-            tb_end = tb_start + tb->size;
-            if (tb_end > TARGET_PAGE_SIZE) {
-                tb_end = TARGET_PAGE_SIZE;
-            }
-        } else {
-            tb_start = 0;
-            tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
-        }
-        set_bits(p->code_bitmap, tb_start, tb_end - tb_start);
+        page_bitmap_add_tb(p, tb, n);
         tb = tb->page_next[n];
     }
 }
@@ -1037,17 +1170,11 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
     int code_gen_size;
+    int64_t start = get_clock();
 
     phys_pc = get_page_addr_code(env, pc);
+    /* Evicting old TBs sets tb_invalidated_flag */
     tb = tb_alloc(pc);
-    if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
-        /* cannot fail at this point */
-        tb = tb_alloc(pc);
-        /* Don't forget to invalidate previous TB info.  */
-        tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
-    }
     tb->tc_ptr = tcg_ctx.code_gen_ptr;
     tb->cs_base = cs_base;
     tb->flags = flags;
@@ -1063,6 +1190,9 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
     tb_link_page(tb, phys_pc, phys_page2);
+
+    tcg_ctx.tb_ctx.tb_gen_count++;
+    tcg_ctx.tb_ctx.tb_gen_time_ns += get_clock() - start;
     return tb;
 }
 
@@ -1100,7 +1230,8 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
 #endif
     tb_page_addr_t tb_start, tb_end;
     PageDesc *p;
-    int n;
+    int n, removed = 0;
+    bool want_bitmap;
 #ifdef TARGET_HAS_PRECISE_SMC
     int current_tb_not_found = is_cpu_write_access;
     TranslationBlock *current_tb = NULL;
@@ -1114,12 +1245,10 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
     if (!p) {
         return;
     }
-    if (!p->code_bitmap &&
-        ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD &&
-        is_cpu_write_access) {
-        /* build code bitmap */
-        build_page_bitmap(p);
-    }
+    /* build the code bitmap once the TBs in the range are gone */
+    want_bitmap = !p->code_bitmap &&
+                  ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD &&
+                  is_cpu_write_access;
 #if defined(TARGET_HAS_PRECISE_SMC)
     if (cpu != NULL) {
         env = cpu->env_ptr;
@@ -1176,6 +1305,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
                 cpu->current_tb = NULL;
             }
             tb_phys_invalidate(tb, -1);
+            removed++;
             if (cpu != NULL) {
                 cpu->current_tb = saved_tb;
                 if (cpu->interrupt_request && cpu->current_tb) {
@@ -1185,6 +1315,12 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
         }
         tb = tb_next;
     }
+    p->invalidate_count += removed;
+    if (p->first_tb && (want_bitmap || (removed && p->code_bitmap))) {
+        /* drop the bits of the TBs just removed in one go, so that
+           writes to the data they covered take the fast path again */
+        build_page_bitmap(p);
+    }
 #if !defined(CONFIG_USER_ONLY)
     /* if no code remaining, no need to continue to use slow writes */
     if (!p->first_tb) {
@@ -1323,7 +1459,9 @@ static inline void tb_alloc_page(TranslationBlock *tb,
     page_already_protected = p->first_tb != NULL;
 #endif
     p->first_tb = (TranslationBlock *)((uintptr_t)tb | n);
-    invalidate_page_bitmap(p);
+    if (p->code_bitmap) {
+        page_bitmap_add_tb(p, tb, n);
+    }
 
 #if defined(TARGET_HAS_SMC) || 1
 
@@ -1371,17 +1509,11 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
+    uint32_t h;
 
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1395,6 +1527,10 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
     tb->jmp_next[0] = NULL;
     tb->jmp_next[1] = NULL;
 
+    /* add in the physical hash table, once it can be found complete */
+    h = tb_hash_func(phys_pc, tb->pc, tb->flags);
+    qht_insert(&tcg_ctx.tb_ctx.htable, tb, h);
+
     /* init original jump addresses */
     if (tb->tb_next_offset[0] != 0xffff) {
         tb_reset_jump(tb, 0);
@@ -1414,14 +1550,21 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
     int m_min, m_max, m;
-    uintptr_t v;
+    size_t v, offset;
     TranslationBlock *tb;
 
     if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
         return NULL;
     }
     if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_buffer +
+                  tcg_ctx.code_gen_buffer_size) {
+        return NULL;
+    }
+    /* The code of the TBs is in ring order, compare offsets from the
+       oldest one */
+    offset = tb_code_offset(tc_ptr);
+    if (offset >= tb_code_offset((uintptr_t)tcg_ctx.code_gen_ptr)) {
         return NULL;
     }
     /* binary search (cf Knuth) */
@@ -1429,17 +1572,17 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
     m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
-        v = (uintptr_t)tb->tc_ptr;
-        if (v == tc_ptr) {
+        tb = tb_nth(m);
+        v = tb_code_offset((uintptr_t)tb->tc_ptr);
+        if (v == offset) {
             return tb;
-        } else if (tc_ptr < v) {
+        } else if (offset < v) {
             m_max = m - 1;
         } else {
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return tb_nth(m_max);
 }
 
 #if defined(TARGET_HAS_ICE) && !defined(CONFIG_USER_ONLY)
@@ -1582,11 +1725,70 @@ void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr)
            TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
 }
 
+#define SMC_HOT_PAGES 8
+
+typedef struct SMCHotPage {
+    tb_page_addr_t index;
+    unsigned int count;
+} SMCHotPage;
+
+/* Keep in @hot the SMC_HOT_PAGES pages with the most invalidated TBs */
+static void smc_hot_pages_1(SMCHotPage *hot, int level, void **lp,
+                            tb_page_addr_t base)
+{
+    int i, j;
+
+    if (*lp == NULL) {
+        return;
+    }
+    if (level == 0) {
+        PageDesc *pd = *lp;
+
+        for (i = 0; i < V_L2_SIZE; ++i) {
+            if (pd[i].invalidate_count <= hot[SMC_HOT_PAGES - 1].count) {
+                continue;
+            }
+            for (j = SMC_HOT_PAGES - 1;
+                 j > 0 && hot[j - 1].count < pd[i].invalidate_count; j--) {
+                hot[j] = hot[j - 1];
+            }
+            hot[j].index = base | i;
+            hot[j].count = pd[i].invalidate_count;
+        }
+    } else {
+        void **pp = *lp;
+
+        for (i = 0; i < V_L2_SIZE; ++i) {
+            smc_hot_pages_1(hot, level - 1, pp + i,
+                            base | ((tb_page_addr_t)i << (level * V_L2_BITS)));
+        }
+    }
+}
+
+static void dump_smc_hot_pages(FILE *f, fprintf_function cpu_fprintf)
+{
+    SMCHotPage hot[SMC_HOT_PAGES] = { { 0 } };
+    int i;
+
+    for (i = 0; i < V_L1_SIZE; i++) {
+        smc_hot_pages_1(hot, V_L1_SHIFT / V_L2_BITS - 1, l1_map + i,
+                        (tb_page_addr_t)i << V_L1_SHIFT);
+    }
+    for (i = 0; i < SMC_HOT_PAGES && hot[i].count; i++) {
+        cpu_fprintf(f, "%s0x%" PRIx64 " %u TBs\n",
+                    i ? "                    " : "SMC hot pages       ",
+                    (uint64_t)hot[i].index << TARGET_PAGE_BITS,
+                    hot[i].count);
+    }
+}
+
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
     int i, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    size_t code_size;
     TranslationBlock *tb;
+    QHTStats hst;
 
     target_code_size = 0;
     max_target_code_size = 0;
@@ -1594,7 +1796,7 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
     for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
+        tb = tb_nth(i);
         target_code_size += tb->size;
         if (tb->size > max_target_code_size) {
             max_target_code_size = tb->size;
@@ -1611,22 +1813,19 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_buffer_max_size);
+    code_size = tcg_ctx.tb_ctx.nb_tbs ?
+                tb_code_offset((uintptr_t)tcg_ctx.code_gen_ptr) : 0;
+    cpu_fprintf(f, "gen code size       %zd/%zd\n",
+                code_size, tcg_ctx.code_gen_buffer_max_size);
     cpu_fprintf(f, "TB count            %d/%d\n",
             tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
             tcg_ctx.tb_ctx.nb_tbs ? target_code_size /
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %zd bytes (expansion ratio: %0.1f)\n",
+            tcg_ctx.tb_ctx.nb_tbs ? code_size / tcg_ctx.tb_ctx.nb_tbs : 0,
+                target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
@@ -1637,14 +1836,320 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 direct_jmp2_count,
                 tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp2_count * 100) /
                         tcg_ctx.tb_ctx.nb_tbs : 0);
+    qht_statistics(&tcg_ctx.tb_ctx.htable, &hst);
+    cpu_fprintf(f, "TB hash buckets     %zu (%zu%% chained entries, "
+                "longest chain %zu)\n", hst.head_buckets,
+                hst.entries ? hst.chained_entries * 100 / hst.entries : 0,
+                hst.max_chain);
     cpu_fprintf(f, "\nStatistics:\n");
-    cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "TB flush count      %d (%" PRId64 " ms, max %" PRId64
+                " us)\n", tcg_ctx.tb_ctx.tb_flush_count,
+                tcg_ctx.tb_ctx.tb_flush_time_ns / 1000000,
+                tcg_ctx.tb_ctx.tb_flush_max_ns / 1000);
+    cpu_fprintf(f, "TB evict count      %d (%" PRId64 " TBs, %" PRId64
+                " ms, max %" PRId64 " us)\n", tcg_ctx.tb_ctx.tb_evict_count,
+                tcg_ctx.tb_ctx.tb_evicted_count,
+                tcg_ctx.tb_ctx.tb_evict_time_ns / 1000000,
+                tcg_ctx.tb_ctx.tb_evict_max_ns / 1000);
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    for (i = 0; i < TLB_FLUSH_STAT_MAX; i++) {
+        static const char * const names[TLB_FLUSH_STAT_MAX] = {
+            [TLB_FLUSH_STAT_ALL] = "all",
+            [TLB_FLUSH_STAT_MMUIDX] = "mmu modes",
+            [TLB_FLUSH_STAT_PAGE] = "page",
+            [TLB_FLUSH_STAT_RANGE] = "range",
+            [TLB_FLUSH_STAT_LARGE_PAGE] = "large page",
+        };
+
+        cpu_fprintf(f, "  %-17s %" PRId64 " (%" PRId64 " us)\n", names[i],
+                    tlb_flush_stat_count[i], tlb_flush_stat_time_ns[i] / 1000);
+    }
+    cpu_fprintf(f, "TB translations     %" PRId64 " (%" PRId64 " ms, "
+                "avg %" PRId64 " us)\n",
+                tcg_ctx.tb_ctx.tb_gen_count,
+                tcg_ctx.tb_ctx.tb_gen_time_ns / 1000000,
+                tcg_ctx.tb_ctx.tb_gen_count ?
+                    tcg_ctx.tb_ctx.tb_gen_time_ns / 1000 /
+                    tcg_ctx.tb_ctx.tb_gen_count : 0);
+    cpu_fprintf(f, "TB phys lookups     %" PRId64 " (%" PRId64 "%% hit)\n",
+                tcg_ctx.tb_ctx.tb_phys_lookup_count,
+                tcg_ctx.tb_ctx.tb_phys_lookup_count ?
+                    100 - tcg_ctx.tb_ctx.tb_phys_lookup_miss_count * 100 /
+                          tcg_ctx.tb_ctx.tb_phys_lookup_count : 0);
+    cpu_fprintf(f, "TB jump lookups     %" PRId64 " (%" PRId64 "%% hit)\n",
+                tcg_ctx.tb_ctx.tb_ptr_lookup_count,
+                tcg_ctx.tb_ctx.tb_ptr_lookup_count ?
+                    100 - tcg_ctx.tb_ctx.tb_ptr_lookup_miss_count * 100 /
+                          tcg_ctx.tb_ctx.tb_ptr_lookup_count : 0);
+    cpu_fprintf(f, "TB chain patches    %" PRId64 "\n",
+                tcg_ctx.tb_ctx.tb_chain_count);
+    cpu_fprintf(f, "TB exits            lookup %" PRId64 " chain %" PRId64
+                " req %" PRId64 " icount %" PRId64 " loop %" PRId64 "\n",
+                tcg_ctx.tb_ctx.tb_exit_count[TB_EXIT_STAT_LOOKUP],
+                tcg_ctx.tb_ctx.tb_exit_count[TB_EXIT_STAT_CHAIN],
+                tcg_ctx.tb_ctx.tb_exit_count[TB_EXIT_STAT_REQUESTED],
+                tcg_ctx.tb_ctx.tb_exit_count[TB_EXIT_STAT_ICOUNT],
+                tcg_ctx.tb_ctx.tb_exit_count[TB_EXIT_STAT_LOOP_EXIT]);
+    cpu_fprintf(f, "TLB misses          read %" PRId64 "/%" PRId64
+                " write %" PRId64 "/%" PRId64 " code %" PRId64 "/%" PRId64
+                " (victim miss/total)\n",
+                tlb_fill_count[MMU_DATA_LOAD], tlb_miss_count[MMU_DATA_LOAD],
+                tlb_fill_count[MMU_DATA_STORE], tlb_miss_count[MMU_DATA_STORE],
+                tlb_fill_count[MMU_INST_FETCH], tlb_miss_count[MMU_INST_FETCH]);
+    dump_smc_hot_pages(f, cpu_fprintf);
     tcg_dump_info(f, cpu_fprintf);
 }
 
+/* Translations per second over the last tcg_stats_timer period */
+static QEMUTimer *tcg_stats_timer;
+static int64_t tcg_stats_last_gen_count;
+static int64_t tcg_stats_rate;
+
+static void tcg_stats_tick(void *opaque)
+{
+    TBContext *s = &tcg_ctx.tb_ctx;
+
+    tcg_stats_rate = s->tb_gen_count - tcg_stats_last_gen_count;
+    tcg_stats_last_gen_count = s->tb_gen_count;
+    trace_tcg_stats(s->tb_gen_count, tcg_stats_rate, s->nb_tbs,
+                    s->tb_chain_count, s->tb_ptr_lookup_count,
+                    tlb_fill_count[MMU_DATA_LOAD] +
+                    tlb_fill_count[MMU_DATA_STORE] +
+                    tlb_fill_count[MMU_INST_FETCH],
+                    s->tb_exit_count[TB_EXIT_STAT_LOOP_EXIT]);
+    timer_mod(tcg_stats_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + 1000);
+}
+
+static const TcgExitReason tcg_exit_reasons[TB_EXIT_STAT_MAX] = {
+    [TB_EXIT_STAT_LOOKUP] = TCG_EXIT_REASON_LOOKUP,
+    [TB_EXIT_STAT_CHAIN] = TCG_EXIT_REASON_CHAIN,
+    [TB_EXIT_STAT_REQUESTED] = TCG_EXIT_REASON_REQUESTED,
+    [TB_EXIT_STAT_ICOUNT] = TCG_EXIT_REASON_ICOUNT,
+    [TB_EXIT_STAT_LOOP_EXIT] = TCG_EXIT_REASON_CPU_LOOP_EXIT,
+};
+
+static void tcg_metrics_counter(MetricsWriter *w, const char *name,
+                                const char *help, int64_t value)
+{
+    metrics_family(w, name, METRIC_COUNTER, help);
+    metrics_sample_int(w, name, NULL, value);
+}
+
+/*
+ * The statistics are plain counters updated by the TCG thread; reading
+ * them unlocked may give a slightly stale value, never a torn one on the
+ * 64-bit hosts that run TCG guests.
+ */
+static void tcg_metrics_collect(MetricsWriter *w, void *opaque)
+{
+    TBContext *s = &tcg_ctx.tb_ctx;
+    char *labels;
+    int i;
+
+    tcg_metrics_counter(w, "qemu_tcg_translations",
+                        "Translation blocks generated", s->tb_gen_count);
+    metrics_family(w, "qemu_tcg_translation_seconds", METRIC_COUNTER,
+                   "Time spent translating");
+    metrics_sample(w, "qemu_tcg_translation_seconds", NULL,
+                   s->tb_gen_time_ns / 1e9);
+    metrics_family(w, "qemu_tcg_blocks", METRIC_GAUGE,
+                   "Translation blocks in the code buffer");
+    metrics_sample_int(w, "qemu_tcg_blocks", NULL, s->nb_tbs);
+    tcg_metrics_counter(w, "qemu_tcg_flushes", "Code buffer flushes",
+                        s->tb_flush_count);
+    tcg_metrics_counter(w, "qemu_tcg_evictions",
+                        "Translation blocks evicted", s->tb_evicted_count);
+    tcg_metrics_counter(w, "qemu_tcg_invalidations",
+                        "Translation blocks invalidated",
+                        s->tb_phys_invalidate_count);
+    tcg_metrics_counter(w, "qemu_tcg_chain_patches",
+                        "Direct jumps patched", s->tb_chain_count);
+    tcg_metrics_counter(w, "qemu_tcg_jump_lookups",
+                        "Lookups of the next block by virtual address",
+                        s->tb_ptr_lookup_count);
+    tcg_metrics_counter(w, "qemu_tcg_jump_lookup_misses",
+                        "Lookups missing the jump cache",
+                        s->tb_ptr_lookup_miss_count);
+    tcg_metrics_counter(w, "qemu_tcg_phys_lookups",
+                        "Lookups of the next block by physical address",
+                        s->tb_phys_lookup_count);
+    tcg_metrics_counter(w, "qemu_tcg_phys_lookup_misses",
+                        "Physical lookups finding no block",
+                        s->tb_phys_lookup_miss_count);
+
+    metrics_family(w, "qemu_tcg_tlb_misses", METRIC_COUNTER,
+                   "Soft TLB misses");
+    metrics_family(w, "qemu_tcg_tlb_fills", METRIC_COUNTER,
+                   "Soft TLB misses also missing the victim TLB");
+    for (i = 0; i < TCG_TLB_ACCESS_MAX; i++) {
+        labels = metrics_labels("access", TcgTlbAccess_lookup[i], NULL);
+        metrics_sample_int(w, "qemu_tcg_tlb_misses", labels,
+                           tlb_miss_count[i]);
+        metrics_sample_int(w, "qemu_tcg_tlb_fills", labels,
+                           tlb_fill_count[i]);
+        g_free(labels);
+    }
+
+    metrics_family(w, "qemu_tcg_tlb_flushes", METRIC_COUNTER,
+                   "Soft TLB flushes");
+    metrics_family(w, "qemu_tcg_tlb_flush_seconds", METRIC_COUNTER,
+                   "Time spent flushing the soft TLB");
+    for (i = 0; i < TLB_FLUSH_STAT_MAX; i++) {
+        labels = metrics_labels("reason", TcgTlbFlushReason_lookup[i], NULL);
+        metrics_sample_int(w, "qemu_tcg_tlb_flushes", labels,
+                           tlb_flush_stat_count[i]);
+        metrics_sample(w, "qemu_tcg_tlb_flush_seconds", labels,
+                       tlb_flush_stat_time_ns[i] / 1e9);
+        g_free(labels);
+    }
+
+    metrics_family(w, "qemu_tcg_exits", METRIC_COUNTER,
+                   "Returns from generated code to the CPU loop");
+    for (i = 0; i < TB_EXIT_STAT_MAX; i++) {
+        labels = metrics_labels("reason",
+                                TcgExitReason_lookup[tcg_exit_reasons[i]],
+                                NULL);
+        metrics_sample_int(w, "qemu_tcg_exits", labels, s->tb_exit_count[i]);
+        g_free(labels);
+    }
+}
+
+/* Called once the TCG thread starts; the timer both keeps
+   translation-rate current and emits the tcg_stats trace event */
+void tcg_stats_init(void)
+{
+    if (tcg_stats_timer) {
+        return;
+    }
+    metrics_collector_add(tcg_metrics_collect, NULL);
+    tcg_stats_timer = timer_new_ms(QEMU_CLOCK_REALTIME, tcg_stats_tick, NULL);
+    timer_mod(tcg_stats_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + 1000);
+}
+
+TcgStats *qmp_query_tcg_stats(Error **errp)
+{
+    TBContext *s = &tcg_ctx.tb_ctx;
+    TcgStats *stats = g_malloc0(sizeof(*stats));
+    TcgTlbMissInfoList **tlb_tail = &stats->tlb_misses;
+    TcgExitInfoList **exit_tail = &stats->exits;
+    TcgTlbFlushInfoList **flush_tail = &stats->tlb_flush_reasons;
+    int i;
+
+    stats->translations = s->tb_gen_count;
+    stats->translation_time_ns = s->tb_gen_time_ns;
+    stats->translation_rate = tcg_stats_rate;
+    stats->tb_count = s->nb_tbs;
+    stats->flushes = s->tb_flush_count;
+    stats->evictions = s->tb_evicted_count;
+    stats->invalidations = s->tb_phys_invalidate_count;
+    stats->chain_patches = s->tb_chain_count;
+    stats->jump_lookups = s->tb_ptr_lookup_count;
+    stats->jump_lookup_misses = s->tb_ptr_lookup_miss_count;
+    stats->phys_lookups = s->tb_phys_lookup_count;
+    stats->phys_lookup_misses = s->tb_phys_lookup_miss_count;
+    stats->tlb_flushes = tlb_flush_count;
+
+    /* MMUAccessType and TcgTlbAccess are in the same order */
+    for (i = 0; i < TCG_TLB_ACCESS_MAX; i++) {
+        TcgTlbMissInfoList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->access = i;
+        entry->value->misses = tlb_miss_count[i];
+        entry->value->fills = tlb_fill_count[i];
+        *tlb_tail = entry;
+        tlb_tail = &entry->next;
+    }
+
+    /* The TLB flush statistics and TcgTlbFlushReason are in the same order */
+    for (i = 0; i < TLB_FLUSH_STAT_MAX; i++) {
+        TcgTlbFlushInfoList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->reason = i;
+        entry->value->count = tlb_flush_stat_count[i];
+        entry->value->time_ns = tlb_flush_stat_time_ns[i];
+        *flush_tail = entry;
+        flush_tail = &entry->next;
+    }
+
+    for (i = 0; i < TB_EXIT_STAT_MAX; i++) {
+        TcgExitInfoList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->reason = tcg_exit_reasons[i];
+        entry->value->count = s->tb_exit_count[i];
+        *exit_tail = entry;
+        exit_tail = &entry->next;
+    }
+    return stats;
+}
+
+void tb_profile_set(CPUArchState *env, int enable)
+{
+    if (tb_profile == !!enable) {
+        return;
+    }
+    tb_profile = !!enable;
+    /* Retranslate everything with or without the counters */
+    tb_flush(env);
+}
+
+void tb_profile_reset(void)
+{
+    int i;
+
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
+        tb_nth(i)->exec_count = 0;
+    }
+}
+
+static int tb_exec_count_cmp(const void *a, const void *b)
+{
+    const TranslationBlock *ta = *(TranslationBlock * const *)a;
+    const TranslationBlock *tb = *(TranslationBlock * const *)b;
+
+    if (ta->exec_count != tb->exec_count) {
+        return ta->exec_count < tb->exec_count ? 1 : -1;
+    }
+    return 0;
+}
+
+void dump_hot_tbs(FILE *f, fprintf_function cpu_fprintf, int count)
+{
+    TranslationBlock **tbs;
+    uint64_t total = 0;
+    int i, n = 0;
+
+    if (!tb_profile) {
+        cpu_fprintf(f, "TB profiling is off, enable it with 'tb-profile on'\n");
+        return;
+    }
+    tbs = g_new(TranslationBlock *, tcg_ctx.tb_ctx.nb_tbs + 1);
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
+        TranslationBlock *tb = tb_nth(i);
+
+        if (!(tb->cflags & CF_INVALID) && tb->exec_count) {
+            tbs[n++] = tb;
+            total += tb->exec_count;
+        }
+    }
+    qsort(tbs, n, sizeof(*tbs), tb_exec_count_cmp);
+
+    cpu_fprintf(f, "%d executed TBs, %" PRIu64 " executions\n", n, total);
+    cpu_fprintf(f, "pc                 flags                size          execs      %%\n");
+    for (i = 0; i < n && i < count; i++) {
+        TranslationBlock *tb = tbs[i];
+
+        cpu_fprintf(f, "0x" TARGET_FMT_lx " 0x%016" PRIx64 " %6u %14" PRIu64
+                    " %5.1f%%\n", tb->pc, tb->flags, tb->size, tb->exec_count,
+                    100.0 * tb->exec_count / total);
+    }
+    g_free(tbs);
+}
+
 #else /* CONFIG_USER_ONLY */
 
 void cpu_interrupt(CPUState *cpu, int mask)
@@ -13,8 +13,14 @@
 #include "android/gpu-frame-bridge.h"
 
 #include "qemu/main-loop.h"
+#include "qemu/metrics.h"
 #include "qemu/thread.h"
 #include "qemu/event_notifier.h"
+#include "qemu/input-latency.h"
+#include "qemu/timer.h"
+#include "ui/console.h"
+#include "ui/frame-capture.h"
+#include "trace.h"
 
 #include <glib.h>
 
@@ -29,49 +35,178 @@
 #define D(...)  ((void)0)
 #endif
 
-// A small structure used to hold a GPU Frame in memory.
+// A frame slot. Slots are allocated once and their pixel buffers are
+// reused by later frames, they only grow when the resolution increases.
 typedef struct {
     int width;
     int height;
     void* pixels;
+    size_t capacity;
+    int64_t posted_ns;
+    // Area that changed since the frame delivered before this one.
+    GpuFrameRect damage;
 } GpuFrame;
 
-static GpuFrame* gpu_frame_new(int w, int h, const void* pixels) {
-    GpuFrame* frame = g_new0(GpuFrame, 1);
-    frame->width = w;
-    frame->height = h;
-    frame->pixels = g_memdup(pixels, w * h * 4);
-    return frame;
+static void gpu_rect_union(GpuFrameRect* rect, const GpuFrameRect* other) {
+    if (other->w <= 0 || other->h <= 0) {
+        return;
+    }
+    if (rect->w <= 0 || rect->h <= 0) {
+        *rect = *other;
+        return;
+    }
+    int x1 = MAX(rect->x + rect->w, other->x + other->w);
+    int y1 = MAX(rect->y + rect->h, other->y + other->h);
+    rect->x = MIN(rect->x, other->x);
+    rect->y = MIN(rect->y, other->y);
+    rect->w = x1 - rect->x;
+    rect->h = y1 - rect->y;
+}
+
+// Width of the column tiles used to narrow down the damaged area of a row.
+#define DAMAGE_TILE_WIDTH 32
+
+// Compute the bounding rectangle of the pixels that differ between |prev|
+// and the new |w|x|h| frame at |pixels|. Rows are compared first, then the
+// first and last differing tiles of each changed row are looked for.
+static void gpu_frame_compute_damage(const GpuFrame* prev, int w, int h,
+                                     const uint8_t* pixels,
+                                     GpuFrameRect* damage) {
+    damage->x = damage->y = 0;
+    damage->w = w;
+    damage->h = h;
+    if (!prev || prev->width != w || prev->height != h) {
+        return;
+    }
+
+    const uint8_t* old = prev->pixels;
+    size_t pitch = (size_t)w * 4;
+    int xmin = w, xmax = 0, ymin = h, ymax = 0;
+    int y;
+
+    for (y = 0; y < h; y++) {
+        const uint8_t* row = pixels + y * pitch;
+        const uint8_t* old_row = old + y * pitch;
+        int x0, x1;
+
+        if (!memcmp(row, old_row, pitch)) {
+            continue;
+        }
+        ymin = MIN(ymin, y);
+        ymax = y + 1;
+
+        // Only look at the tiles outside of the known damaged columns.
+        for (x0 = 0; x0 < xmin; x0 += DAMAGE_TILE_WIDTH) {
+            int len = MIN(DAMAGE_TILE_WIDTH, w - x0);
+            if (memcmp(row + x0 * 4, old_row + x0 * 4, len * 4)) {
+                break;
+            }
+        }
+        xmin = MIN(xmin, x0);
+
+        for (x1 = w; x1 > xmax; ) {
+            int start = ((x1 - 1) / DAMAGE_TILE_WIDTH) * DAMAGE_TILE_WIDTH;
+            if (memcmp(row + start * 4, old_row + start * 4,
+                       (x1 - start) * 4)) {
+                break;
+            }
+            x1 = start;
+        }
+        xmax = MAX(xmax, x1);
+    }
+
+    if (ymin >= ymax || xmin >= xmax) {
+        damage->w = damage->h = 0;
+        return;
+    }
+    damage->x = xmin;
+    damage->y = ymin;
+    damage->w = xmax - xmin;
+    damage->h = ymax - ymin;
 }
 
-static void gpu_frame_free(GpuFrame* frame) {
-    if (frame) {
+static void gpu_frame_reserve(GpuFrame* frame, int w, int h) {
+    size_t size = (size_t)w * h * 4;
+    if (size > frame->capacity) {
         g_free(frame->pixels);
-        g_free(frame);
+        frame->pixels = g_malloc(size);
+        frame->capacity = size;
     }
 }
 
 // Maximum number of frames in the bridge. Trying to post more frames
-// than that will block.
+// than that will block, unless stale frames are dropped.
 #define MAX_GPU_FRAMES 16
 
+// Default number of slots in mailbox mode: one being displayed, one
+// pending and one being written.
+#define MAILBOX_GPU_FRAMES 3
+
 typedef struct {
     bool init;
+    bool drop_stale;
+    bool mailbox;
     QemuMutex lock;
     QemuCond can_write;
     EventNotifier can_read;
+    int max_frames;
+    GpuFrame* slots;
+    // Indices of the slots that aren't pending nor being read or written.
+    int* free_slots;
+    int num_free;
+    // Ring of the indices of the pending slots, oldest first.
+    int* pending;
+    int pending_pos;
     int num_frames;
-    GpuFrame* frames[MAX_GPU_FRAMES];
+    // Slot of the last posted frame, only used by the EmuGL thread.
+    int last_slot;
+    // Damage of dropped frames, to be added to the next posted one.
+    GpuFrameRect carry_damage;
+    GpuFrameBridgeStats stats;
     GpuFrameBridgeCallback* callback;
+    GpuFrameBridgeDamageCallback* damage_callback;
     void* callback_opaque;
 } GpuBridge;
 
 static GpuBridge s_bridge = {
     .init = false,
     .num_frames = 0,
-    .frames = { NULL, },
+    .last_slot = -1,
 };
 
+// Remove the oldest pending frame without delivering it, called with
+// the lock held. Its damage is passed on to the next frame so that the
+// consumer still sees every change.
+static int gpu_bridge_drop_oldest(GpuBridge* bridge) {
+    int slot = bridge->pending[bridge->pending_pos];
+    bridge->pending_pos = (bridge->pending_pos + 1) % bridge->max_frames;
+    bridge->num_frames -= 1;
+    bridge->stats.dropped += 1;
+    if (bridge->num_frames > 0) {
+        int next = bridge->pending[bridge->pending_pos];
+        gpu_rect_union(&bridge->slots[next].damage,
+                       &bridge->slots[slot].damage);
+    } else {
+        gpu_rect_union(&bridge->carry_damage, &bridge->slots[slot].damage);
+    }
+    return slot;
+}
+
+// Take a slot for writing, called with the lock held. If none is free,
+// either drop the oldest pending frame or wait for the main loop.
+static int gpu_bridge_get_free_slot(GpuBridge* bridge) {
+    while (bridge->num_free == 0) {
+        if ((bridge->drop_stale || bridge->mailbox) &&
+            bridge->num_frames > 0) {
+            D("%s: dropping stale frame\n", __FUNCTION__);
+            return gpu_bridge_drop_oldest(bridge);
+        }
+        D("%s: frame array full\n", __FUNCTION__);
+        qemu_cond_wait(&bridge->can_write, &bridge->lock);
+    }
+    return bridge->free_slots[--bridge->num_free];
+}
+
 // This function is called from an EmuGL thread to post a new GPU frame.
 static void emugl_frame_post(void* context,
                              int width,
@@ -81,15 +216,47 @@ static void emugl_frame_post(void* context,
                              int type,
                              unsigned char* pixels) {
     GpuBridge *bridge = &s_bridge;
+    int64_t start_ns = get_clock();
     qemu_mutex_lock(&bridge->lock);
-    while (bridge->num_frames >= MAX_GPU_FRAMES) {
-        D("%s: frame array full\n", __FUNCTION__);
-        qemu_cond_wait(&bridge->can_write, &bridge->lock);
+    int slot = gpu_bridge_get_free_slot(bridge);
+    qemu_mutex_unlock(&bridge->lock);
+
+    // The slot belongs to this thread now, fill it without the lock. The
+    // last posted slot isn't written by anyone else, so it can be
+    // compared against even if it is being delivered meanwhile.
+    GpuFrame* frame = &bridge->slots[slot];
+    const GpuFrame* prev = bridge->last_slot >= 0 ?
+            &bridge->slots[bridge->last_slot] : NULL;
+    gpu_frame_compute_damage(prev, width, height, pixels, &frame->damage);
+    gpu_frame_reserve(frame, width, height);
+    frame->width = width;
+    frame->height = height;
+    memcpy(frame->pixels, pixels, (size_t)width * height * 4);
+    frame->posted_ns = get_clock();
+
+    qemu_mutex_lock(&bridge->lock);
+    bridge->last_slot = slot;
+    if (bridge->mailbox) {
+        // Only the newest frame matters, recycle the pending ones.
+        while (bridge->num_frames > 0) {
+            bridge->free_slots[bridge->num_free++] =
+                    gpu_bridge_drop_oldest(bridge);
+        }
     }
-    bridge->frames[bridge->num_frames] = gpu_frame_new(width, height, pixels);
+    gpu_rect_union(&frame->damage, &bridge->carry_damage);
+    bridge->carry_damage.w = bridge->carry_damage.h = 0;
+    bridge->pending[(bridge->pending_pos + bridge->num_frames) %
+                    bridge->max_frames] = slot;
     bridge->num_frames += 1;
+    bridge->stats.posted += 1;
+    if (bridge->num_frames > bridge->stats.max_queue_depth) {
+        bridge->stats.max_queue_depth = bridge->num_frames;
+    }
+    int queued = bridge->num_frames;
     qemu_mutex_unlock(&bridge->lock);
     event_notifier_set(&bridge->can_read);
+    trace_gpu_frame_post(width, height, slot, queued,
+                         frame->posted_ns - start_ns);
 }
 
 // Called from the main loop whenever a new frame was notified from
@@ -97,42 +264,123 @@ static void emugl_frame_post(void* context,
 static void read_frame(EventNotifier* e) {
     GpuBridge* bridge = &s_bridge;
 
-    if (event_notifier_test_and_clear(&bridge->can_read)) {
-        qemu_mutex_lock(&bridge->lock);
-        // Beware of spurious wakeups.
-        if (bridge->num_frames > 0) {
-            GpuFrame* frame = bridge->frames[0];
-            memmove(bridge->frames, bridge->frames + 1,
-                    (bridge->num_frames - 1) * sizeof(bridge->frames[0]));
-
-            if (bridge->num_frames == MAX_GPU_FRAMES) {
-                D("%s: frame array no longer full\n", __FUNCTION__);
-                qemu_cond_signal(&bridge->can_write);
-            }
+    if (!event_notifier_test_and_clear(&bridge->can_read)) {
+        return;
+    }
 
-            D("%s: new frame %dx%d\n", __FUNCTION__, frame->width,
-              frame->height);
-            bridge->callback(bridge->callback_opaque,
-                            frame->width,
-                            frame->height,
-                            frame->pixels);
-            gpu_frame_free(frame);
-
-            bridge->num_frames -= 1;
-            if (bridge->num_frames > 0) {
-                event_notifier_set(&bridge->can_read);
-            }
-        } else {
-            D("%s: spurious wakeup\n", __FUNCTION__);
-        }
+    qemu_mutex_lock(&bridge->lock);
+    // Beware of spurious wakeups.
+    if (bridge->num_frames == 0) {
+        D("%s: spurious wakeup\n", __FUNCTION__);
         qemu_mutex_unlock(&bridge->lock);
+        return;
+    }
+    int slot = bridge->pending[bridge->pending_pos];
+    bridge->pending_pos = (bridge->pending_pos + 1) % bridge->max_frames;
+    bridge->num_frames -= 1;
+    bool more = bridge->num_frames > 0;
+
+    GpuFrame* frame = &bridge->slots[slot];
+    int64_t latency = get_clock() - frame->posted_ns;
+    bridge->stats.consumed += 1;
+    bridge->stats.latency_total_ns += latency;
+    if (latency > bridge->stats.latency_max_ns) {
+        bridge->stats.latency_max_ns = latency;
+    }
+    qemu_mutex_unlock(&bridge->lock);
+
+    // GPU frames don't go through dpy_gfx_update(), keep the display
+    // refreshing at full rate while they come in.
+    dpy_gfx_activity(NULL);
+    frame_capture_gpu_frame(frame->width, frame->height, frame->pixels);
+
+    // The callback runs without the lock, so the EmuGL thread can keep
+    // posting frames into the other slots meanwhile.
+    int64_t start_ns = get_clock();
+    D("%s: new frame %dx%d damage %dx%d+%d+%d\n", __FUNCTION__,
+      frame->width, frame->height, frame->damage.w, frame->damage.h,
+      frame->damage.x, frame->damage.y);
+    if (bridge->damage_callback) {
+        bridge->damage_callback(bridge->callback_opaque,
+                                frame->width,
+                                frame->height,
+                                frame->pixels,
+                                &frame->damage);
+    } else {
+        bridge->callback(bridge->callback_opaque,
+                         frame->width,
+                         frame->height,
+                         frame->pixels);
+    }
+    int64_t end_ns = get_clock();
+    trace_gpu_frame_consume(frame->width, frame->height, slot, latency,
+                            end_ns - start_ns);
+    input_latency_frame(INPUT_LATENCY_GPU, frame->posted_ns, end_ns);
+
+    qemu_mutex_lock(&bridge->lock);
+    if (bridge->num_free == 0) {
+        D("%s: frame array no longer full\n", __FUNCTION__);
+        qemu_cond_signal(&bridge->can_write);
+    }
+    bridge->free_slots[bridge->num_free++] = slot;
+    qemu_mutex_unlock(&bridge->lock);
+
+    if (more) {
+        event_notifier_set(&bridge->can_read);
     }
 }
 
+static void gpu_bridge_metrics_counter(MetricsWriter* w, const char* name,
+                                       const char* help, uint64_t value) {
+    metrics_family(w, name, METRIC_COUNTER, help);
+    metrics_sample_int(w, name, NULL, value);
+}
+
+// Only takes the bridge lock, which is never held for long.
+static void gpu_bridge_metrics_collect(MetricsWriter* w, void* opaque) {
+    GpuFrameBridgeStats stats;
+
+    android_gpu_frame_bridge_get_stats(&stats);
+    gpu_bridge_metrics_counter(w, "qemu_gpu_frames_posted",
+                               "Frames posted by EmuGL", stats.posted);
+    gpu_bridge_metrics_counter(w, "qemu_gpu_frames_consumed",
+                               "Frames delivered to the display",
+                               stats.consumed);
+    gpu_bridge_metrics_counter(w, "qemu_gpu_frames_dropped",
+                               "Frames discarded without being delivered",
+                               stats.dropped);
+    metrics_family(w, "qemu_gpu_frame_queue_depth", METRIC_GAUGE,
+                   "Pending frames");
+    metrics_sample_int(w, "qemu_gpu_frame_queue_depth", NULL,
+                       stats.queue_depth);
+    metrics_family(w, "qemu_gpu_frame_queue_depth_max", METRIC_GAUGE,
+                   "Highest number of pending frames");
+    metrics_sample_int(w, "qemu_gpu_frame_queue_depth_max", NULL,
+                       stats.max_queue_depth);
+    metrics_family(w, "qemu_gpu_frame_latency_seconds", METRIC_COUNTER,
+                   "Total delay between posting and delivering frames");
+    metrics_sample(w, "qemu_gpu_frame_latency_seconds", NULL,
+                   stats.latency_total_ns / 1e9);
+    metrics_family(w, "qemu_gpu_frame_latency_max_seconds", METRIC_GAUGE,
+                   "Highest delay between posting and delivering a frame");
+    metrics_sample(w, "qemu_gpu_frame_latency_max_seconds", NULL,
+                   stats.latency_max_ns / 1e9);
+}
+
 void android_gpu_frame_bridge_init(GpuFrameBridgeCallback *callback,
                                    void *callback_opaque)
+{
+    android_gpu_frame_bridge_init_with_options(callback, callback_opaque,
+                                               NULL);
+}
+
+void android_gpu_frame_bridge_init_with_options(
+        GpuFrameBridgeCallback *callback,
+        void *callback_opaque,
+        const GpuFrameBridgeOptions *options)
 {
     GpuBridge *bridge = &s_bridge;
+    int n;
 
     if (bridge->init) {
         return;
@@ -141,11 +389,50 @@ void android_gpu_frame_bridge_init(GpuFrameBridgeCallback *callback,
     bridge->init = true;
     bridge->callback = callback;
     bridge->callback_opaque = callback_opaque;
+    bridge->max_frames = MAX_GPU_FRAMES;
+    if (options) {
+        bridge->drop_stale = options->drop_stale;
+        bridge->mailbox = options->mailbox;
+        bridge->damage_callback = options->damage_callback;
+        if (options->max_frames > 0) {
+            bridge->max_frames = options->max_frames;
+        } else if (bridge->mailbox) {
+            bridge->max_frames = MAILBOX_GPU_FRAMES;
+        }
+    }
+
+    bridge->slots = g_new0(GpuFrame, bridge->max_frames);
+    bridge->free_slots = g_new(int, bridge->max_frames);
+    bridge->pending = g_new(int, bridge->max_frames);
+    for (n = 0; n < bridge->max_frames; n++) {
+        if (options && options->width > 0 && options->height > 0) {
+            gpu_frame_reserve(&bridge->slots[n], options->width,
+                              options->height);
+        }
+        bridge->free_slots[n] = n;
+    }
+    bridge->num_free = bridge->max_frames;
+
     qemu_mutex_init(&bridge->lock);
     qemu_cond_init(&bridge->can_write);
     event_notifier_init(&bridge->can_read, 0);
     event_notifier_set_handler(&bridge->can_read, read_frame);
+    metrics_collector_add(gpu_bridge_metrics_collect, NULL);
 
     // Ensure EmuGL will call
     android_setPostCallback(&emugl_frame_post, bridge);
 }
+
+void android_gpu_frame_bridge_get_stats(GpuFrameBridgeStats* stats)
+{
+    GpuBridge *bridge = &s_bridge;
+
+    if (!bridge->init) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    qemu_mutex_lock(&bridge->lock);
+    *stats = bridge->stats;
+    stats->queue_depth = bridge->num_frames;
+    qemu_mutex_unlock(&bridge->lock);
+}
@@ -11,12 +11,15 @@
 */
 
 #include "android/opengles.h"
+#include "android/opengles-guest-ram.h"
+#include "android/opengles-ring.h"
 
 #if !defined(CONFIG_ANDROID) || !defined(USE_ANDROID_EMU)
 
 #include "config-host.h"
 #include "qemu-common.h"
 #include "qemu/shared-library.h"
+#include "qemu/sockets.h"
 
 #include <assert.h>
 #include <limits.h>
@@ -67,6 +70,13 @@ typedef void* FBNativeWindowType;
   X(void, repaintOpenGLDisplay, (void), ()) \
   X(int, stopOpenGLRenderer, (void), ()) \
 
+/* Functions that are only exported by recent renderer libraries, the
+ * emulator falls back to older mechanisms when they're missing. */
+#define RENDERER_OPTIONAL_FUNCTIONS_LIST(X) \
+  X(bool, openRingStream, (OpenglesRingStream* stream), (stream)) \
+  X(void, closeRingStream, (OpenglesRingStream* stream), (stream)) \
+  X(bool, setGuestRam, (const OpenglesGuestRamRange* ranges, int count), (ranges, count)) \
+
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -87,6 +97,7 @@ typedef void* FBNativeWindowType;
 #define DEFINE_FUNCTION_POINTER(ret, name, sig, params) \
         static ret (*name) sig = NULL;
 RENDERER_FUNCTIONS_LIST(DEFINE_FUNCTION_POINTER)
+RENDERER_OPTIONAL_FUNCTIONS_LIST(DEFINE_FUNCTION_POINTER)
 
 // Define a function that initializes the function pointers by looking up
 // the symbols from the shared library.
@@ -104,6 +115,10 @@ static int initOpenglesEmulationFuncs(SharedLibrary* rendererLib)
     }
     RENDERER_FUNCTIONS_LIST(LOAD_FUNCTION_POINTER)
 
+#define LOAD_OPTIONAL_FUNCTION_POINTER(ret, name, sig, params) \
+    name = shared_library_find(rendererLib, #name);
+    RENDERER_OPTIONAL_FUNCTIONS_LIST(LOAD_OPTIONAL_FUNCTION_POINTER)
+
     return 0;
 }
 
@@ -113,16 +128,71 @@ extern int android_init_opengles_pipes(void);
 
 static SharedLibrary *rendererLib;
 static bool rendererUsesSubWindow;
+static bool rendererUsesRings;
 static int rendererStarted;
 static char rendererAddress[256];
 
+/* ANDROID_GLES_SHARED_RENDERER=<address> connects the GLES streams to a
+ * renderer service shared by the emulators of the host, instead of
+ * loading the renderer library in this process: a Unix socket path, or a
+ * TCP port on Windows, as android_gles_server_path() returns them. The
+ * service owns the GL contexts, so shader caches and identical uploads
+ * can be shared between instances. The library's in-process interfaces,
+ * the display subwindow and the post callback, aren't available then, so
+ * this is meant for headless instances. */
+static bool rendererShared;
+
+static int initSharedRenderer(const char* address)
+{
+    if (strlen(address) >= sizeof(rendererAddress)) {
+        E("ANDROID_GLES_SHARED_RENDERER address is too long\n");
+        return -1;
+    }
+    pstrcpy(rendererAddress, sizeof(rendererAddress), address);
+    rendererShared = true;
+    rendererUsesRings = false;
+    rendererUsesSubWindow = false;
+    return 0;
+}
+
+/* Fail at startup rather than on the first guest connection, so that the
+ * caller can fall back to another GPU mode. */
+static bool sharedRendererIsUp(void)
+{
+    Error* err = NULL;
+    int fd;
+
+#ifndef _WIN32
+    fd = unix_connect(rendererAddress, &err);
+#else
+    char hostPort[sizeof(rendererAddress) + 16];
+
+    snprintf(hostPort, sizeof(hostPort), "127.0.0.1:%s", rendererAddress);
+    fd = inet_connect(hostPort, &err);
+#endif
+    if (fd < 0) {
+        E("Could not connect to the shared GLES renderer at %s: %s\n",
+          rendererAddress, error_get_pretty(err));
+        error_free(err);
+        return false;
+    }
+    closesocket(fd);
+    return true;
+}
+
 int android_initOpenglesEmulation(void)
 {
     Error *error = NULL;
+    const char* shared;
 
-    if (rendererLib != NULL) {
+    if (rendererLib != NULL || rendererShared) {
         return 0;
     }
+
+    shared = getenv("ANDROID_GLES_SHARED_RENDERER");
+    if (shared && shared[0] != '\0') {
+        return initSharedRenderer(shared);
+    }
     D("Initializing hardware OpenGLES emulation support");
 
     rendererLib = shared_library_open(RENDERER_LIB_NAME, &error);
@@ -152,8 +222,17 @@ int android_initOpenglesEmulation(void)
         rendererUsesSubWindow = false;
     }
 
+    /* ANDROID_GLES_RING=0 forces the GLES streams to go through sockets
+     * even if the renderer supports the in-process transport. */
+    rendererUsesRings = openRingStream != NULL && closeRingStream != NULL;
+    env = getenv("ANDROID_GLES_RING");
+    if (env && env[0] == '0') {
+        rendererUsesRings = false;
+    }
+
 #ifdef _WIN32
-    /* XXX: NEED Win32 pipe implementation */
+    /* Only used by the pipes that can't go through the rings, see
+     * android_pipe_opengles.c */
     setStreamMode(STREAM_MODE_TCP);
 #else
     setStreamMode(STREAM_MODE_UNIX);
@@ -171,6 +250,13 @@ ERROR_EXIT:
 
 int android_startOpenglesRenderer(int width, int height)
 {
+    if (rendererShared) {
+        if (!rendererStarted && !sharedRendererIsUp()) {
+            return -1;
+        }
+        rendererStarted = 1;
+        return 0;
+    }
     if (!rendererLib) {
         D("Can't start OpenGLES renderer without support libraries");
         return -1;
@@ -195,7 +281,7 @@ int android_startOpenglesRenderer(int width, int height)
 
 void android_setPostCallback(OnPostFunc onPost, void* onPostContext)
 {
-    if (rendererLib) {
+    if (rendererLib && !rendererShared) {
         setPostCallback(onPost, onPostContext);
     }
 }
@@ -232,7 +318,7 @@ void android_getOpenglesHardwareStrings(char *vendor, size_t vendorBufSize,
     assert(vendorBufSize > 0 && rendererBufSize > 0 && versionBufSize > 0);
     assert(vendor != NULL && renderer != NULL && version != NULL);
 
-    if (!rendererStarted) {
+    if (!rendererStarted || rendererShared) {
         D("Can't get OpenGL ES hardware strings when renderer not started");
         vendor[0] = renderer[0] = version[0] = '\0';
         return;
@@ -263,7 +349,9 @@ void android_getOpenglesHardwareStrings(char *vendor, size_t vendorBufSize,
 
 void android_stopOpenglesRenderer(void)
 {
-    if (rendererStarted) {
+    if (rendererStarted && rendererShared) {
+        rendererStarted = 0;
+    } else if (rendererStarted) {
         stopOpenGLRenderer();
         rendererStarted = 0;
     }
@@ -279,7 +367,7 @@ int android_showOpenglesWindow(void* window,
                                float dpr,
                                float rotation)
 {
-    if (!rendererStarted) {
+    if (!rendererStarted || rendererShared) {
         return -1;
     }
     FBNativeWindowType win = (FBNativeWindowType)(uintptr_t)window;
@@ -290,7 +378,7 @@ int android_showOpenglesWindow(void* window,
 
 int android_hideOpenglesWindow(void)
 {
-    if (!rendererStarted) {
+    if (!rendererStarted || rendererShared) {
         return -1;
     }
     bool success = destroyOpenGLSubwindow();
@@ -299,7 +387,7 @@ int android_hideOpenglesWindow(void)
 
 void android_redrawOpenglesWindow(void)
 {
-    if (rendererStarted) {
+    if (rendererStarted && !rendererShared) {
         repaintOpenGLDisplay();
     }
 }
@@ -309,4 +397,29 @@ void android_gles_server_path(char* buff, size_t buffsize)
     pstrcpy(buff, buffsize, rendererAddress);
 }
 
+int android_gles_ring_open(OpenglesRingStream* stream)
+{
+    if (!rendererStarted || !rendererUsesRings) {
+        return -1;
+    }
+    return openRingStream(stream) ? 0 : -1;
+}
+
+void android_gles_ring_close(OpenglesRingStream* stream)
+{
+    if (rendererUsesRings) {
+        closeRingStream(stream);
+    }
+}
+
+/* The shared renderer service would need the file descriptors passed over
+ * its socket, it reads the buffers from the stream instead. */
+int android_gles_set_guest_ram(const OpenglesGuestRamRange* ranges, int count)
+{
+    if (!rendererStarted || rendererShared || !setGuestRam) {
+        return -1;
+    }
+    return setGuestRam(ranges, count) ? 0 : -1;
+}
+
 #endif // !CONFIG_ANDROID || !USE_ANDROID_EMU
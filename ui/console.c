@@ -157,6 +157,11 @@ struct QemuConsole {
     int esc_params[MAX_ESC_PARAMS];
     int nb_esc_params;
 
+    /* Adaptive refresh: the refresh rate backs off while none of the
+     * adaptive graphic consoles has anything new to display. */
+    bool adaptive_refresh;
+    bool gfx_activity;
+
     CharDriverState *chr;
     /* fifo for key pressed */
     QEMUFIFO out_fifo;
@@ -168,6 +173,9 @@ struct DisplayState {
     QEMUTimer *gui_timer;
     uint64_t last_update;
     uint64_t update_interval;
+    uint64_t base_interval;         /* without the adaptive backoff */
+    uint64_t idle_refreshes;
+    uint64_t suppressed_refreshes;
     bool refreshing;
     bool have_gfx;
     bool have_text;
@@ -189,6 +197,43 @@ static DisplayState *get_alloc_displaystate(void);
 static void text_console_update_cursor_timer(void);
 static void text_console_update_cursor(void *opaque);
 
+/* Return the refresh interval to use after a refresh, given the one
+ * requested by the listeners. If every graphic console uses the adaptive
+ * policy and none had any activity for GUI_REFRESH_IDLE_THRESHOLD refreshes,
+ * the interval doubles on each idle refresh, up to
+ * GUI_REFRESH_INTERVAL_ADAPTIVE_MAX. Any activity restores the requested
+ * interval.
+ */
+static uint64_t gui_adaptive_interval(DisplayState *ds, uint64_t interval)
+{
+    bool have_graphic = false;
+    bool idle = true;
+    uint64_t backoff;
+    int i;
+
+    for (i = 0; i < nb_consoles; i++) {
+        QemuConsole *con = consoles[i];
+
+        if (con->console_type != GRAPHIC_CONSOLE) {
+            continue;
+        }
+        have_graphic = true;
+        if (!con->adaptive_refresh || con->gfx_activity) {
+            idle = false;
+        }
+        con->gfx_activity = false;
+    }
+    if (!have_graphic || !idle) {
+        ds->idle_refreshes = 0;
+        return interval;
+    }
+    if (++ds->idle_refreshes <= GUI_REFRESH_IDLE_THRESHOLD) {
+        return interval;
+    }
+    backoff = MIN(ds->update_interval * 2, GUI_REFRESH_INTERVAL_ADAPTIVE_MAX);
+    return MAX(interval, backoff);
+}
+
 static void gui_update(void *opaque)
 {
     uint64_t interval = GUI_REFRESH_INTERVAL_IDLE;
@@ -208,6 +253,11 @@ static void gui_update(void *opaque)
             interval = dcl_interval;
         }
     }
+    ds->base_interval = interval;
+    interval = gui_adaptive_interval(ds, interval);
+    if (interval > ds->base_interval) {
+        ds->suppressed_refreshes += interval / ds->base_interval - 1;
+    }
     if (ds->update_interval != interval) {
         ds->update_interval = interval;
         for (i = 0; i < nb_consoles; i++) {
@@ -1413,6 +1463,37 @@ int dpy_set_ui_info(QemuConsole *con, QemuUIInfo *info)
     return -1;
 }
 
+void dpy_gfx_activity(QemuConsole *con)
+{
+    DisplayState *s;
+
+    if (con == NULL) {
+        con = active_console;
+    }
+    if (con == NULL) {
+        return;
+    }
+    s = con->ds;
+    con->gfx_activity = true;
+    /* Outside of a refresh, don't wait for the end of a backed off
+     * interval to go back to the normal rate. */
+    if (!s->refreshing && s->gui_timer &&
+        s->update_interval > s->base_interval) {
+        timer_mod(s->gui_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME));
+    }
+}
+
+uint64_t dpy_get_suppressed_refreshes(void)
+{
+    return display_state ? display_state->suppressed_refreshes : 0;
+}
+
+void qemu_console_set_adaptive_refresh(QemuConsole *con, bool enabled)
+{
+    con->adaptive_refresh = enabled;
+    con->gfx_activity = true;
+}
+
 void dpy_gfx_update(QemuConsole *con, int x, int y, int w, int h)
 {
     DisplayState *s = con->ds;
@@ -1420,6 +1501,8 @@ void dpy_gfx_update(QemuConsole *con, int x, int y, int w, int h)
     int width = surface_width(con->surface);
     int height = surface_height(con->surface);
 
+    dpy_gfx_activity(con);
+
     x = MAX(x, 0);
     y = MAX(y, 0);
     x = MIN(x, width);
@@ -1454,6 +1537,7 @@ void dpy_gfx_replace_surface(QemuConsole *con,
     DisplaySurface *old_surface = con->surface;
     DisplayChangeListener *dcl;
 
+    dpy_gfx_activity(con);
     con->surface = surface;
     QLIST_FOREACH(dcl, &s->listeners, next) {
         if (con != (dcl->con ? dcl->con : active_console)) {
@@ -0,0 +1,982 @@
+/*
+ * Frame capture into a shared memory ring or an MJPEG stream
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/main-loop.h"
+#include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+#include "qmp-commands.h"
+#include "ui/console.h"
+#include "ui/frame-capture.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#ifdef CONFIG_VNC_PNG
+#include <png.h>
+#endif
+#ifdef CONFIG_VNC_JPEG
+#include <jpeglib.h>
+#endif
+
+QEMU_BUILD_BUG_ON(FRAME_CAPTURE_RAW != FRAME_CAPTURE_ENCODING_RAW);
+QEMU_BUILD_BUG_ON(FRAME_CAPTURE_PNG != FRAME_CAPTURE_ENCODING_PNG);
+QEMU_BUILD_BUG_ON(FRAME_CAPTURE_JPEG != FRAME_CAPTURE_ENCODING_JPEG);
+
+#define FRAME_CAPTURE_HEADER_SIZE     4096
+#define FRAME_CAPTURE_DEFAULT_SLOTS   4
+#define FRAME_CAPTURE_MAX_SLOTS       64
+#define FRAME_CAPTURE_DEFAULT_QUALITY 85
+#define FRAME_CAPTURE_STREAM_INTERVAL 33    /* ms, about 30 fps */
+#define FRAME_CAPTURE_MAX_CLIENTS     8
+#define FRAME_CAPTURE_BOUNDARY        "qemuframe"
+
+/* GPU frames are RGBA bytes. */
+#ifdef HOST_WORDS_BIGENDIAN
+#define FRAME_CAPTURE_GPU_FORMAT  PIXMAN_r8g8b8x8
+#else
+#define FRAME_CAPTURE_GPU_FORMAT  PIXMAN_x8b8g8r8
+#endif
+
+typedef struct CaptureBuffer {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} CaptureBuffer;
+
+typedef struct CaptureJob {
+    uint64_t frame;
+    int64_t timestamp_ns;
+    int width;
+    int height;
+    int stride;
+    pixman_format_code_t format;
+    bool keep;                  /* requested by frame-capture-grab */
+    CaptureBuffer pixels;
+} CaptureJob;
+
+/* A viewer of the MJPEG stream. Only used by the main thread. */
+typedef struct StreamClient {
+    struct FrameCapture *fc;
+    int fd;
+    CaptureBuffer out;          /* left to send, from |offset| */
+    size_t offset;
+    uint64_t seq;               /* stream frame queued last */
+} StreamClient;
+
+typedef struct FrameCapture {
+    DisplayChangeListener dcl;
+    char *path;
+    int fd;
+    uint8_t *ring;
+    size_t ring_size;
+    FrameCaptureRingHeader *header;
+    uint32_t slot_count;
+    uint64_t slot_size;
+
+    FrameCaptureEncoding encoding;
+    int quality;
+    bool continuous;
+    int64_t interval_ms;
+    int64_t last_capture_ms;
+    uint64_t next_frame;
+
+    /* Main thread state. */
+    bool dirty;
+    int64_t surface_update_ms;
+    CaptureJob gpu_frame;       /* last GPU frame, for frame-capture-grab */
+    int64_t gpu_frame_ms;
+    char *stream;
+    int listen_fd;
+    QEMUBH *stream_bh;
+    StreamClient *clients[FRAME_CAPTURE_MAX_CLIENTS];
+
+    /* Encoded frames are handed to the worker thread through |pending|,
+     * a frame that is still pending when the next one is captured gets
+     * replaced. Everything below is protected by |lock|. */
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    bool quit;
+    bool job_pending;
+    CaptureJob pending;
+    CaptureJob work;            /* only used by the worker thread */
+    CaptureBuffer encoded;      /* only used by the worker thread */
+    CaptureBuffer stream_frame; /* last encoded frame, for the stream */
+    uint64_t stream_seq;
+
+    uint64_t captured;
+    uint64_t published;
+    uint64_t dropped;
+    uint64_t too_large;
+    uint64_t streamed;
+} FrameCapture;
+
+static FrameCapture *frame_capture;
+
+static void capture_buffer_reserve(CaptureBuffer *buf, size_t capacity)
+{
+    if (buf->capacity < capacity) {
+        buf->data = g_realloc(buf->data, capacity);
+        buf->capacity = capacity;
+    }
+}
+
+static void capture_buffer_append(CaptureBuffer *buf, const void *data,
+                                  size_t len)
+{
+    if (buf->size + len > buf->capacity) {
+        capture_buffer_reserve(buf, MAX(buf->capacity * 2, buf->size + len));
+    }
+    memcpy(buf->data + buf->size, data, len);
+    buf->size += len;
+}
+
+static void capture_buffer_free(CaptureBuffer *buf)
+{
+    g_free(buf->data);
+    buf->data = NULL;
+    buf->size = buf->capacity = 0;
+}
+
+/* Copy |job|'s pixels from |data|, padding lines to a multiple of 4 bytes
+ * as pixman requires. */
+static void capture_job_fill(CaptureJob *job, const uint8_t *data,
+                             int src_stride)
+{
+    int line_size = job->width * PIXMAN_FORMAT_BPP(job->format) / 8;
+    int y;
+
+    job->stride = ROUND_UP(line_size, 4);
+    job->pixels.size = (size_t)job->stride * job->height;
+    capture_buffer_reserve(&job->pixels, job->pixels.size);
+    for (y = 0; y < job->height; y++) {
+        memcpy(job->pixels.data + (size_t)y * job->stride,
+               data + (size_t)y * src_stride, line_size);
+    }
+}
+
+/* Publish |lines| lines of |line_size| bytes from |data|, |src_stride|
+ * bytes apart, as the next frame of the ring. Only one thread publishes
+ * frames: the main thread for raw captures, the worker otherwise. */
+static bool capture_publish(FrameCapture *fc, const CaptureJob *job,
+                            uint32_t encoding, const uint8_t *data,
+                            size_t line_size, size_t src_stride, int lines)
+{
+    FrameCaptureRingHeader *header = fc->header;
+    uint64_t index;
+    FrameCaptureSlot *slot;
+    int y;
+
+    if (header == NULL) {
+        return false;
+    }
+    index = header->published;
+    if (line_size * lines > fc->slot_size - sizeof(FrameCaptureSlot)) {
+        return false;
+    }
+    slot = (FrameCaptureSlot *)(fc->ring + FRAME_CAPTURE_HEADER_SIZE +
+                                (index % fc->slot_count) * fc->slot_size);
+
+    atomic_set(&slot->seq, slot->seq + 1);
+    smp_wmb();
+    slot->frame = job->frame;
+    slot->timestamp_ns = job->timestamp_ns;
+    slot->width = job->width;
+    slot->height = job->height;
+    slot->stride = encoding == FRAME_CAPTURE_RAW ? line_size : 0;
+    slot->format = job->format;
+    slot->encoding = encoding;
+    slot->size = line_size * lines;
+    for (y = 0; y < lines; y++) {
+        memcpy(slot->data + y * line_size, data + y * src_stride, line_size);
+    }
+    smp_wmb();
+    atomic_set(&slot->seq, slot->seq + 1);
+    smp_wmb();
+    atomic_set(&header->published, index + 1);
+    return true;
+}
+
+#ifdef CONFIG_VNC_PNG
+static void capture_png_write(png_structp png_ptr, png_bytep data,
+                              png_size_t length)
+{
+    capture_buffer_append(png_get_io_ptr(png_ptr), data, length);
+}
+
+static void capture_png_flush(png_structp png_ptr)
+{
+}
+
+static bool capture_encode_png(pixman_image_t *image, int width, int height,
+                               CaptureBuffer *out)
+{
+    png_structp png_ptr;
+    png_infop info_ptr;
+    pixman_image_t *linebuf;
+    int y;
+
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (png_ptr == NULL) {
+        return false;
+    }
+    info_ptr = png_create_info_struct(png_ptr);
+    if (info_ptr == NULL) {
+        png_destroy_write_struct(&png_ptr, NULL);
+        return false;
+    }
+    linebuf = qemu_pixman_linebuf_create(PIXMAN_BE_r8g8b8, width);
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        qemu_pixman_image_unref(linebuf);
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        return false;
+    }
+
+    png_set_write_fn(png_ptr, out, capture_png_write, capture_png_flush);
+    /* Favour speed, these are meant to be taken at video rate. */
+    png_set_compression_level(png_ptr, 1);
+    png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png_ptr, info_ptr);
+    for (y = 0; y < height; y++) {
+        qemu_pixman_linebuf_fill(linebuf, image, width, 0, y);
+        png_write_row(png_ptr, (png_bytep)pixman_image_get_data(linebuf));
+    }
+    png_write_end(png_ptr, NULL);
+
+    qemu_pixman_image_unref(linebuf);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return true;
+}
+#endif /* CONFIG_VNC_PNG */
+
+#ifdef CONFIG_VNC_JPEG
+typedef struct CaptureJpegDest {
+    struct jpeg_destination_mgr manager;
+    CaptureBuffer *out;
+} CaptureJpegDest;
+
+static void capture_jpeg_init_destination(j_compress_ptr cinfo)
+{
+    CaptureJpegDest *dest = (CaptureJpegDest *)cinfo->dest;
+    CaptureBuffer *out = dest->out;
+
+    capture_buffer_reserve(out, out->size + 65536);
+    cinfo->dest->next_output_byte = (JOCTET *)out->data + out->size;
+    cinfo->dest->free_in_buffer = out->capacity - out->size;
+}
+
+static boolean capture_jpeg_empty_output_buffer(j_compress_ptr cinfo)
+{
+    CaptureJpegDest *dest = (CaptureJpegDest *)cinfo->dest;
+
+    dest->out->size = dest->out->capacity;
+    capture_buffer_reserve(dest->out, dest->out->capacity * 2);
+    cinfo->dest->next_output_byte = (JOCTET *)dest->out->data +
+                                    dest->out->size;
+    cinfo->dest->free_in_buffer = dest->out->capacity - dest->out->size;
+    return TRUE;
+}
+
+static void capture_jpeg_term_destination(j_compress_ptr cinfo)
+{
+    CaptureJpegDest *dest = (CaptureJpegDest *)cinfo->dest;
+
+    dest->out->size = dest->out->capacity - cinfo->dest->free_in_buffer;
+}
+
+static bool capture_encode_jpeg(pixman_image_t *image, int width, int height,
+                                int quality, CaptureBuffer *out)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    CaptureJpegDest dest;
+    pixman_image_t *linebuf;
+    JSAMPROW row[1];
+    int y;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, true);
+
+    dest.manager.init_destination = capture_jpeg_init_destination;
+    dest.manager.empty_output_buffer = capture_jpeg_empty_output_buffer;
+    dest.manager.term_destination = capture_jpeg_term_destination;
+    dest.out = out;
+    cinfo.dest = &dest.manager;
+
+    jpeg_start_compress(&cinfo, true);
+    linebuf = qemu_pixman_linebuf_create(PIXMAN_BE_r8g8b8, width);
+    row[0] = (JSAMPROW)pixman_image_get_data(linebuf);
+    for (y = 0; y < height; y++) {
+        qemu_pixman_linebuf_fill(linebuf, image, width, 0, y);
+        jpeg_write_scanlines(&cinfo, row, 1);
+    }
+    qemu_pixman_image_unref(linebuf);
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return true;
+}
+#endif /* CONFIG_VNC_JPEG */
+
+static bool capture_encode(FrameCapture *fc, CaptureJob *job,
+                           CaptureBuffer *out)
+{
+    pixman_image_t *image;
+    bool ok = false;
+
+    image = pixman_image_create_bits(job->format, job->width, job->height,
+                                     (uint32_t *)job->pixels.data,
+                                     job->stride);
+    if (image == NULL) {
+        return false;
+    }
+    out->size = 0;
+    switch (fc->encoding) {
+#ifdef CONFIG_VNC_PNG
+    case FRAME_CAPTURE_ENCODING_PNG:
+        ok = capture_encode_png(image, job->width, job->height, out);
+        break;
+#endif
+#ifdef CONFIG_VNC_JPEG
+    case FRAME_CAPTURE_ENCODING_JPEG:
+        ok = capture_encode_jpeg(image, job->width, job->height,
+                                 fc->quality, out);
+        break;
+#endif
+    default:
+        break;
+    }
+    pixman_image_unref(image);
+    return ok;
+}
+
+static void *capture_worker(void *opaque)
+{
+    FrameCapture *fc = opaque;
+    CaptureJob tmp;
+    bool encoded, published = false;
+
+    qemu_mutex_lock(&fc->lock);
+    for (;;) {
+        while (!fc->job_pending && !fc->quit) {
+            qemu_cond_wait(&fc->cond, &fc->lock);
+        }
+        if (fc->quit) {
+            break;
+        }
+        /* Swap the buffers, the main thread refills |pending| meanwhile. */
+        tmp = fc->work;
+        fc->work = fc->pending;
+        fc->pending = tmp;
+        fc->job_pending = false;
+        qemu_mutex_unlock(&fc->lock);
+
+        encoded = capture_encode(fc, &fc->work, &fc->encoded);
+        if (encoded && fc->header) {
+            published = capture_publish(fc, &fc->work, fc->encoding,
+                                        fc->encoded.data, fc->encoded.size,
+                                        fc->encoded.size, 1);
+        }
+
+        qemu_mutex_lock(&fc->lock);
+        if (!encoded) {
+            fc->dropped++;
+            continue;
+        }
+        if (fc->stream) {
+            fc->stream_frame.size = 0;
+            capture_buffer_append(&fc->stream_frame, fc->encoded.data,
+                                  fc->encoded.size);
+            fc->stream_seq++;
+            qemu_bh_schedule(fc->stream_bh);
+        }
+        if (fc->header) {
+            if (published) {
+                fc->published++;
+            } else {
+                fc->too_large++;
+            }
+        }
+    }
+    qemu_mutex_unlock(&fc->lock);
+    return NULL;
+}
+
+/* Capture |width|x|height| pixels of |format| from |data|, |stride| bytes
+ * per line. Returns the capture id of the frame, or -1 if it was dropped.
+ */
+static int64_t capture_frame(FrameCapture *fc, int width, int height,
+                             int stride, pixman_format_code_t format,
+                             const uint8_t *data, bool keep)
+{
+    CaptureJob job = {
+        .frame = fc->next_frame,
+        .timestamp_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME),
+        .width = width,
+        .height = height,
+        .format = format,
+        .keep = keep,
+    };
+
+    fc->last_capture_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    if (fc->encoding == FRAME_CAPTURE_ENCODING_RAW) {
+        int line_size = width * PIXMAN_FORMAT_BPP(format) / 8;
+        bool published = capture_publish(fc, &job, FRAME_CAPTURE_RAW, data,
+                                         line_size, stride, height);
+
+        qemu_mutex_lock(&fc->lock);
+        fc->captured++;
+        if (published) {
+            fc->published++;
+        } else {
+            fc->too_large++;
+        }
+        qemu_mutex_unlock(&fc->lock);
+        if (!published) {
+            return -1;
+        }
+        return fc->next_frame++;
+    }
+
+    qemu_mutex_lock(&fc->lock);
+    if (fc->job_pending) {
+        if (fc->pending.keep) {
+            /* Never replace a frame requested by frame-capture-grab. */
+            fc->dropped++;
+            qemu_mutex_unlock(&fc->lock);
+            return -1;
+        }
+        fc->dropped++;
+    }
+    job.pixels = fc->pending.pixels;
+    fc->pending = job;
+    capture_job_fill(&fc->pending, data, stride);
+    fc->job_pending = true;
+    fc->captured++;
+    qemu_cond_signal(&fc->cond);
+    qemu_mutex_unlock(&fc->lock);
+    return fc->next_frame++;
+}
+
+static int64_t capture_surface(FrameCapture *fc, bool keep)
+{
+    DisplaySurface *surface = qemu_console_surface(fc->dcl.con);
+
+    if (surface == NULL) {
+        return -1;
+    }
+    return capture_frame(fc, surface_width(surface), surface_height(surface),
+                         surface_stride(surface), surface->format,
+                         surface_data(surface), keep);
+}
+
+static bool capture_interval_elapsed(FrameCapture *fc)
+{
+    return fc->interval_ms <= 0 ||
+           qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - fc->last_capture_ms >=
+               fc->interval_ms;
+}
+
+void frame_capture_gpu_frame(int width, int height, const void *pixels)
+{
+    FrameCapture *fc = frame_capture;
+
+    if (fc == NULL) {
+        return;
+    }
+    if (fc->continuous && capture_interval_elapsed(fc)) {
+        capture_frame(fc, width, height, width * 4, FRAME_CAPTURE_GPU_FORMAT,
+                      pixels, false);
+    }
+    /* These bypass the console surface, keep the last one around for
+     * frame-capture-grab. */
+    fc->gpu_frame.width = width;
+    fc->gpu_frame.height = height;
+    fc->gpu_frame.format = FRAME_CAPTURE_GPU_FORMAT;
+    capture_job_fill(&fc->gpu_frame, pixels, width * 4);
+    fc->gpu_frame_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+}
+
+static void capture_dpy_gfx_update(DisplayChangeListener *dcl,
+                                   int x, int y, int w, int h)
+{
+    FrameCapture *fc = container_of(dcl, FrameCapture, dcl);
+
+    fc->dirty = true;
+    fc->surface_update_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+}
+
+static void capture_dpy_gfx_switch(DisplayChangeListener *dcl,
+                                   DisplaySurface *new_surface)
+{
+    FrameCapture *fc = container_of(dcl, FrameCapture, dcl);
+
+    fc->dirty = true;
+    fc->surface_update_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+}
+
+static void capture_dpy_refresh(DisplayChangeListener *dcl)
+{
+    FrameCapture *fc = container_of(dcl, FrameCapture, dcl);
+
+    if (fc->continuous && fc->dirty && capture_interval_elapsed(fc)) {
+        fc->dirty = false;
+        capture_surface(fc, false);
+    }
+}
+
+static const DisplayChangeListenerOps capture_dcl_ops = {
+    .dpy_name          = "frame-capture",
+    .dpy_refresh       = capture_dpy_refresh,
+    .dpy_gfx_update    = capture_dpy_gfx_update,
+    .dpy_gfx_switch    = capture_dpy_gfx_switch,
+};
+
+/*
+ * The stream is served as an endless HTTP response of JPEG images
+ * (multipart/x-mixed-replace, "MJPEG"), which browsers and most video
+ * tools can show. Frames are only encoded when the display changes, so
+ * a still screen costs nothing, and a viewer that is still sending a
+ * frame when newer ones are encoded skips them and gets the latest one.
+ */
+static const char stream_response[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Connection: close\r\n"
+    "Content-Type: multipart/x-mixed-replace; boundary="
+    FRAME_CAPTURE_BOUNDARY "\r\n"
+    "\r\n";
+
+static void capture_stream_write(void *opaque);
+static void capture_stream_read(void *opaque);
+
+static void capture_stream_close(StreamClient *client)
+{
+    FrameCapture *fc = client->fc;
+    int i;
+
+    for (i = 0; i < FRAME_CAPTURE_MAX_CLIENTS; i++) {
+        if (fc->clients[i] == client) {
+            fc->clients[i] = NULL;
+        }
+    }
+    qemu_set_fd_handler(client->fd, NULL, NULL, NULL);
+    closesocket(client->fd);
+    capture_buffer_free(&client->out);
+    g_free(client);
+}
+
+/* Queue the last encoded frame after what |client| has left to send, if
+ * it didn't get it yet. */
+static void capture_stream_queue(StreamClient *client)
+{
+    FrameCapture *fc = client->fc;
+    char part[128];
+
+    qemu_mutex_lock(&fc->lock);
+    if (client->seq != fc->stream_seq && fc->stream_frame.size) {
+        snprintf(part, sizeof(part),
+                 "--" FRAME_CAPTURE_BOUNDARY "\r\n"
+                 "Content-Type: image/jpeg\r\n"
+                 "Content-Length: %zu\r\n"
+                 "\r\n", fc->stream_frame.size);
+        capture_buffer_append(&client->out, part, strlen(part));
+        capture_buffer_append(&client->out, fc->stream_frame.data,
+                              fc->stream_frame.size);
+        capture_buffer_append(&client->out, "\r\n", 2);
+        client->seq = fc->stream_seq;
+        fc->streamed++;
+    }
+    qemu_mutex_unlock(&fc->lock);
+
+    qemu_set_fd_handler(client->fd, capture_stream_read,
+                        client->offset < client->out.size ?
+                        capture_stream_write : NULL, client);
+}
+
+static void capture_stream_write(void *opaque)
+{
+    StreamClient *client = opaque;
+    ssize_t ret;
+
+    ret = send(client->fd, (const void *)(client->out.data + client->offset),
+               client->out.size - client->offset, 0);
+    if (ret < 0) {
+        if (socket_error() != EINTR && socket_error() != EAGAIN) {
+            capture_stream_close(client);
+        }
+        return;
+    }
+    client->offset += ret;
+    if (client->offset == client->out.size) {
+        client->out.size = client->offset = 0;
+        capture_stream_queue(client);
+    }
+}
+
+/* The request itself doesn't matter, read until the viewer goes away. */
+static void capture_stream_read(void *opaque)
+{
+    StreamClient *client = opaque;
+    char buf[512];
+    ssize_t ret;
+
+    ret = qemu_recv(client->fd, buf, sizeof(buf), 0);
+    if (ret == 0 ||
+        (ret < 0 && socket_error() != EINTR && socket_error() != EAGAIN)) {
+        capture_stream_close(client);
+    }
+}
+
+static void capture_stream_accept(void *opaque)
+{
+    FrameCapture *fc = opaque;
+    StreamClient *client;
+    int fd, i;
+
+    fd = qemu_accept(fc->listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    for (i = 0; i < FRAME_CAPTURE_MAX_CLIENTS; i++) {
+        if (fc->clients[i] == NULL) {
+            break;
+        }
+    }
+    if (i == FRAME_CAPTURE_MAX_CLIENTS) {
+        closesocket(fd);
+        return;
+    }
+    qemu_set_nonblock(fd);
+    socket_set_nodelay(fd);
+
+    client = g_new0(StreamClient, 1);
+    client->fc = fc;
+    client->fd = fd;
+    fc->clients[i] = client;
+    capture_buffer_append(&client->out, stream_response,
+                          sizeof(stream_response) - 1);
+    capture_stream_queue(client);
+    /* Still screens aren't captured again, make sure there is a fresh
+     * frame to start with. */
+    fc->dirty = true;
+}
+
+/* Runs in the main thread once the worker encoded a new frame. */
+static void capture_stream_bh(void *opaque)
+{
+    FrameCapture *fc = opaque;
+    int i;
+
+    for (i = 0; i < FRAME_CAPTURE_MAX_CLIENTS; i++) {
+        StreamClient *client = fc->clients[i];
+
+        if (client && client->offset == client->out.size) {
+            client->out.size = client->offset = 0;
+            capture_stream_queue(client);
+        }
+    }
+}
+
+static bool capture_stream_listen(FrameCapture *fc, Error **errp)
+{
+    fc->listen_fd = inet_listen(fc->stream, NULL, 0, SOCK_STREAM, 0, errp);
+    if (fc->listen_fd < 0) {
+        return false;
+    }
+    fc->stream_bh = qemu_bh_new(capture_stream_bh, fc);
+    qemu_set_fd_handler(fc->listen_fd, capture_stream_accept, NULL, fc);
+    return true;
+}
+
+static void capture_stream_shutdown(FrameCapture *fc)
+{
+    int i;
+
+    for (i = 0; i < FRAME_CAPTURE_MAX_CLIENTS; i++) {
+        if (fc->clients[i]) {
+            capture_stream_close(fc->clients[i]);
+        }
+    }
+    qemu_set_fd_handler(fc->listen_fd, NULL, NULL, NULL);
+    closesocket(fc->listen_fd);
+    qemu_bh_delete(fc->stream_bh);
+}
+
+#ifndef _WIN32
+static bool capture_map_ring(FrameCapture *fc, Error **errp)
+{
+    void *ring;
+
+    fc->fd = qemu_open(fc->path, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0600);
+    if (fc->fd < 0) {
+        error_setg_errno(errp, errno, "failed to open file '%s'", fc->path);
+        return false;
+    }
+    if (ftruncate(fc->fd, fc->ring_size) < 0) {
+        error_setg_errno(errp, errno, "failed to resize file '%s'", fc->path);
+        goto fail;
+    }
+    ring = mmap(NULL, fc->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fc->fd, 0);
+    if (ring == MAP_FAILED) {
+        error_setg_errno(errp, errno, "failed to map file '%s'", fc->path);
+        goto fail;
+    }
+    fc->ring = ring;
+    return true;
+
+fail:
+    qemu_close(fc->fd);
+    unlink(fc->path);
+    return false;
+}
+
+static void capture_unmap_ring(FrameCapture *fc)
+{
+    munmap(fc->ring, fc->ring_size);
+    qemu_close(fc->fd);
+}
+#else
+static bool capture_map_ring(FrameCapture *fc, Error **errp)
+{
+    error_setg(errp, "Frame capture is not supported on this host");
+    return false;
+}
+
+static void capture_unmap_ring(FrameCapture *fc)
+{
+}
+#endif
+
+static void frame_capture_free(FrameCapture *fc)
+{
+    if (fc->encoding != FRAME_CAPTURE_ENCODING_RAW) {
+        qemu_mutex_lock(&fc->lock);
+        fc->quit = true;
+        qemu_cond_signal(&fc->cond);
+        qemu_mutex_unlock(&fc->lock);
+        qemu_thread_join(&fc->thread);
+    }
+    if (fc->stream) {
+        capture_stream_shutdown(fc);
+    }
+    if (fc->header) {
+        capture_unmap_ring(fc);
+    }
+    qemu_cond_destroy(&fc->cond);
+    qemu_mutex_destroy(&fc->lock);
+    capture_buffer_free(&fc->pending.pixels);
+    capture_buffer_free(&fc->work.pixels);
+    capture_buffer_free(&fc->gpu_frame.pixels);
+    capture_buffer_free(&fc->encoded);
+    capture_buffer_free(&fc->stream_frame);
+    g_free(fc->stream);
+    g_free(fc->path);
+    g_free(fc);
+}
+
+void qmp_frame_capture_start(bool has_path, const char *path,
+                             bool has_slots, int64_t slots,
+                             bool has_encoding, FrameCaptureEncoding encoding,
+                             bool has_quality, int64_t quality,
+                             bool has_continuous, bool continuous,
+                             bool has_interval, int64_t interval,
+                             bool has_stream, const char *stream,
+                             Error **errp)
+{
+    QemuConsole *con = qemu_console_lookup_by_index(0);
+    DisplaySurface *surface;
+    FrameCapture *fc;
+
+    if (frame_capture) {
+        error_setg(errp, "A frame capture is already running");
+        return;
+    }
+    if (con == NULL || !qemu_console_is_graphic(con)) {
+        error_setg(errp, "There is no graphic console to capture from");
+        return;
+    }
+    if (!has_path && !has_stream) {
+        error_setg(errp, "Parameter 'path' or 'stream' is required");
+        return;
+    }
+    if (!has_encoding) {
+        encoding = has_stream ? FRAME_CAPTURE_ENCODING_JPEG
+                              : FRAME_CAPTURE_ENCODING_RAW;
+    }
+    if (has_stream && encoding != FRAME_CAPTURE_ENCODING_JPEG) {
+        error_setg(errp, "Streaming requires the jpeg encoding");
+        return;
+    }
+#ifndef CONFIG_VNC_PNG
+    if (encoding == FRAME_CAPTURE_ENCODING_PNG) {
+        error_setg(errp, "PNG encoding is not supported by this build");
+        return;
+    }
+#endif
+#ifndef CONFIG_VNC_JPEG
+    if (encoding == FRAME_CAPTURE_ENCODING_JPEG) {
+        error_setg(errp, "JPEG encoding is not supported by this build");
+        return;
+    }
+#endif
+    if (!has_slots) {
+        slots = FRAME_CAPTURE_DEFAULT_SLOTS;
+    }
+    if (slots < 1 || slots > FRAME_CAPTURE_MAX_SLOTS) {
+        error_setg(errp, "Parameter 'slots' expects a value between 1 and %d",
+                   FRAME_CAPTURE_MAX_SLOTS);
+        return;
+    }
+    if (!has_quality) {
+        quality = FRAME_CAPTURE_DEFAULT_QUALITY;
+    }
+    if (quality < 1 || quality > 100) {
+        error_setg(errp, "Parameter 'quality' expects a value between 1 "
+                   "and 100");
+        return;
+    }
+
+    fc = g_new0(FrameCapture, 1);
+    fc->path = g_strdup(path);
+    fc->stream = g_strdup(stream);
+    fc->encoding = encoding;
+    fc->quality = quality;
+    fc->continuous = has_continuous ? continuous : true;
+    if (has_interval) {
+        fc->interval_ms = interval;
+    } else if (has_stream) {
+        fc->interval_ms = FRAME_CAPTURE_STREAM_INTERVAL;
+    }
+
+    if (has_stream && !capture_stream_listen(fc, errp)) {
+        g_free(fc->stream);
+        g_free(fc->path);
+        g_free(fc);
+        return;
+    }
+
+    if (has_path) {
+        /* Size the slots for 32-bit frames of the current surface, raw
+         * frames may take that much space and encoded ones normally take
+         * less. */
+        surface = qemu_console_surface(con);
+        fc->slot_count = slots;
+        fc->slot_size = ROUND_UP(sizeof(FrameCaptureSlot) +
+                                 (uint64_t)surface_width(surface) *
+                                 surface_height(surface) * 4, 4096);
+        fc->ring_size = FRAME_CAPTURE_HEADER_SIZE + fc->slot_size * slots;
+        if (!capture_map_ring(fc, errp)) {
+            if (has_stream) {
+                capture_stream_shutdown(fc);
+            }
+            g_free(fc->stream);
+            g_free(fc->path);
+            g_free(fc);
+            return;
+        }
+
+        fc->header = (FrameCaptureRingHeader *)fc->ring;
+        fc->header->version = FRAME_CAPTURE_VERSION;
+        fc->header->header_size = FRAME_CAPTURE_HEADER_SIZE;
+        fc->header->slot_count = fc->slot_count;
+        fc->header->slot_size = fc->slot_size;
+        smp_wmb();
+        atomic_set(&fc->header->magic, FRAME_CAPTURE_MAGIC);
+    }
+
+    qemu_mutex_init(&fc->lock);
+    qemu_cond_init(&fc->cond);
+    if (encoding != FRAME_CAPTURE_ENCODING_RAW) {
+        qemu_thread_create(&fc->thread, "frame_capture", capture_worker, fc,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    frame_capture = fc;
+    fc->dcl.ops = &capture_dcl_ops;
+    fc->dcl.con = con;
+    register_displaychangelistener(&fc->dcl);
+}
+
+void qmp_frame_capture_stop(Error **errp)
+{
+    FrameCapture *fc = frame_capture;
+
+    if (fc == NULL) {
+        error_setg(errp, "No frame capture is running");
+        return;
+    }
+    unregister_displaychangelistener(&fc->dcl);
+    frame_capture = NULL;
+    frame_capture_free(fc);
+}
+
+int64_t qmp_frame_capture_grab(Error **errp)
+{
+    FrameCapture *fc = frame_capture;
+    int64_t frame;
+
+    if (fc == NULL) {
+        error_setg(errp, "No frame capture is running");
+        return -1;
+    }
+    if (fc->gpu_frame.pixels.size &&
+        fc->gpu_frame_ms >= fc->surface_update_ms) {
+        frame = capture_frame(fc, fc->gpu_frame.width, fc->gpu_frame.height,
+                              fc->gpu_frame.stride, fc->gpu_frame.format,
+                              fc->gpu_frame.pixels.data, true);
+    } else {
+        graphic_hw_update(fc->dcl.con);
+        frame = capture_surface(fc, true);
+    }
+    if (frame < 0) {
+        error_setg(errp, "The frame could not be captured, the previous one "
+                   "is still being encoded or the display is larger than "
+                   "the ring slots");
+    }
+    return frame;
+}
+
+FrameCaptureInfo *qmp_query_frame_capture(Error **errp)
+{
+    FrameCapture *fc = frame_capture;
+    FrameCaptureInfo *info = g_new0(FrameCaptureInfo, 1);
+
+    if (fc == NULL) {
+        return info;
+    }
+    info->active = true;
+    info->has_path = fc->path != NULL;
+    info->path = g_strdup(fc->path);
+    info->has_stream = fc->stream != NULL;
+    info->stream = g_strdup(fc->stream);
+    info->has_encoding = true;
+    info->encoding = fc->encoding;
+    qemu_mutex_lock(&fc->lock);
+    info->captured = fc->captured;
+    info->published = fc->published;
+    info->dropped = fc->dropped;
+    info->too_large = fc->too_large;
+    info->streamed = fc->streamed;
+    qemu_mutex_unlock(&fc->lock);
+    return info;
+}
@@ -68,6 +68,9 @@ static struct sdl2_state {
     int last_vm_running; /* per console for caption reasons */
     int x, y;
     int hidden;
+    bool dirty;                 /* texture changed since the last present */
+    int64_t last_present_ns;
+    int64_t present_interval_ns; /* refresh period of the display, or 0 */
 } *sdl2_console;
 
 static SDL_Surface *guest_sprite_surface;
@@ -93,6 +96,7 @@ static int scaling_active;
 static Notifier mouse_mode_notifier;
 
 static void sdl_update_caption(struct sdl2_state *scon);
+static void sdl_present(struct sdl2_state *scon, bool force);
 
 #ifdef CONFIG_ANDROID
 
@@ -145,6 +149,7 @@ static void android_on_gpu_frame(void *context,
     if (state->texture) {
         if (state->real_renderer) {
             SDL_UpdateTexture(state->texture, NULL, pixels, width * 4);
+            state->dirty = true;
         } else {
             D("GPU Texture update without renderer!\n");
         }
@@ -153,6 +158,30 @@ static void android_on_gpu_frame(void *context,
     }
 }
 
+// Same as android_on_gpu_frame(), but only uploads the damaged area of
+// the frame to the texture.
+static void android_on_gpu_frame_damage(void *context,
+                                        int width,
+                                        int height,
+                                        const void *pixels,
+                                        const GpuFrameRect *damage)
+{
+    struct sdl2_state *state = context;
+
+    if (damage->w <= 0 || damage->h <= 0) {
+        return;
+    }
+    if (state->texture && state->real_renderer) {
+        SDL_Rect rect = { damage->x, damage->y, damage->w, damage->h };
+        const uint8_t *src = (const uint8_t *)pixels +
+                             ((size_t)damage->y * width + damage->x) * 4;
+        SDL_UpdateTexture(state->texture, &rect, src, width * 4);
+        state->dirty = true;
+    } else {
+        D("GPU Frame update without texture or renderer!\n");
+    }
+}
+
 // Called from android_has_gpu_emulation() below.
 static int android_scan_kernel_for_gpu(const char* name, const char* value,
                                        void* opaque)
@@ -175,16 +204,14 @@ static bool android_has_gpu_emulation(void) {
 }
 
 // Called from graphics_hw_update() when software-based GPU emulation is
-// enabled. This blits the content of the GPU frame to the window.
+// enabled. This blits the content of the GPU frame to the window, if a
+// new one arrived since the last time.
 static void android_gpu_update(void* opaque) {
     struct sdl2_state *scon = opaque;
 
     D("%s: GPU update scon=%p texture=%p\n", __FUNCTION__, scon, scon->texture);
 
-    if (scon->texture) {
-        SDL_RenderCopy(scon->real_renderer, scon->texture, NULL, NULL);
-        SDL_RenderPresent(scon->real_renderer);
-    }
+    sdl_present(scon, false);
 }
 
 #endif  // CONFIG_ANDROID
@@ -200,12 +227,38 @@ static struct sdl2_state *get_scon_from_window(uint32_t window_id)
     return NULL;
 }
 
+/*
+ * Show the texture in the window if it changed, at most once per refresh
+ * period of the display unless |force| is set. A present that is held
+ * back happens on a later sdl_refresh().
+ */
+static void sdl_present(struct sdl2_state *scon, bool force)
+{
+    int64_t now;
+
+    if (!scon->texture || !scon->real_renderer || !scon->dirty) {
+        return;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (!force && now - scon->last_present_ns < scon->present_interval_ns) {
+        return;
+    }
+
+    /* The back buffer is undefined after a present, so copy it all */
+    SDL_RenderCopy(scon->real_renderer, scon->texture, NULL, NULL);
+    SDL_RenderPresent(scon->real_renderer);
+    scon->dirty = false;
+    scon->last_present_ns = now;
+}
+
 static void sdl_update(DisplayChangeListener *dcl,
                        int x, int y, int w, int h)
 {
     struct sdl2_state *scon = container_of(dcl, struct sdl2_state, dcl);
     SDL_Rect rect;
     DisplaySurface *surf = qemu_console_surface(dcl->con);
+    uint8_t *pixels;
 
     D("%s: scon=%p surface=%p texture=%p\n", __FUNCTION__, scon, surf, scon->texture);
 
@@ -216,15 +269,30 @@ static void sdl_update(DisplayChangeListener *dcl,
         return;
     }
 
-    rect.x = x;
-    rect.y = y;
-    rect.w = w;
-    rect.h = h;
+    rect.x = MAX(x, 0);
+    rect.y = MAX(y, 0);
+    rect.w = MIN(x + w, surface_width(surf)) - rect.x;
+    rect.h = MIN(y + h, surface_height(surf)) - rect.y;
+    if (rect.w <= 0 || rect.h <= 0) {
+        return;
+    }
 
-    SDL_UpdateTexture(scon->texture, NULL, surface_data(surf),
-                      surface_stride(surf));
-    SDL_RenderCopy(scon->real_renderer, scon->texture, &rect, &rect);
-    SDL_RenderPresent(scon->real_renderer);
+    /* Only upload the damaged rectangle, the texture keeps the rest */
+    pixels = (uint8_t *)surface_data(surf) + rect.y * surface_stride(surf) +
+             rect.x * surface_bytes_per_pixel(surf);
+    SDL_UpdateTexture(scon->texture, &rect, pixels, surface_stride(surf));
+    scon->dirty = true;
+}
+
+static void sdl_update_present_interval(struct sdl2_state *scon)
+{
+    SDL_DisplayMode mode;
+
+    scon->present_interval_ns = 0;
+    if (SDL_GetWindowDisplayMode(scon->real_window, &mode) == 0 &&
+        mode.refresh_rate > 0) {
+        scon->present_interval_ns = get_ticks_per_sec() / mode.refresh_rate;
+    }
 }
 
 static void do_sdl_resize(struct sdl2_state *scon, int width, int height,
@@ -276,6 +344,7 @@ static void do_sdl_resize(struct sdl2_state *scon, int width, int height,
                                              SDL_WINDOWPOS_UNDEFINED,
                                              width, height, flags);
         scon->real_renderer = SDL_CreateRenderer(scon->real_window, -1, 0);
+        sdl_update_present_interval(scon);
 
 #ifdef CONFIG_ANDROID
         if (android_gpu_started) {
@@ -297,7 +366,21 @@ static void do_sdl_resize(struct sdl2_state *scon, int width, int height,
                     graphic_console_set_hwops(scon->dcl.con, &null_ops, scon);
                 } else {
                     D("Initializing GPU frame bridge %dx%d scond=%p\n", width, height, scon);
-                    android_gpu_frame_bridge_init(android_on_gpu_frame, scon);
+                    // Set ANDROID_GPU_DROP_STALE_FRAMES to keep the renderer
+                    // from blocking when the UI can't keep up, or
+                    // ANDROID_GPU_LATEST_FRAME_ONLY to only display the
+                    // newest frame.
+                    const char* drop = getenv("ANDROID_GPU_DROP_STALE_FRAMES");
+                    const char* latest = getenv("ANDROID_GPU_LATEST_FRAME_ONLY");
+                    GpuFrameBridgeOptions options = {
+                        .width = width,
+                        .height = height,
+                        .drop_stale = drop && drop[0] && drop[0] != '0',
+                        .mailbox = latest && latest[0] && latest[0] != '0',
+                        .damage_callback = android_on_gpu_frame_damage,
+                    };
+                    android_gpu_frame_bridge_init_with_options(
+                            android_on_gpu_frame, scon, &options);
 
                     // Change console's hw_ops to avoid receiving framebuffer
                     // updates entirely. Instead the GPU frames coming from
@@ -357,30 +440,47 @@ static void sdl_switch(DisplayChangeListener *dcl,
                       surface_height(scon->surface), 0);
     }
 
+    if (new_surface) {
+        if (surface_bits_per_pixel(scon->surface) == 16) {
+            format = SDL_PIXELFORMAT_RGB565;
+        } else if (is_surface_bgr(scon->surface)) {
+            /* e.g. goldfish_fb displaying guest RGBX8888 memory. */
+            format = SDL_PIXELFORMAT_ABGR8888;
+        } else if (surface_bits_per_pixel(scon->surface) == 32) {
+            format = SDL_PIXELFORMAT_ARGB8888;
+#ifdef CONFIG_ANDROID
+            if (android_gpu_started && !android_gpu_use_subwindow) {
+                // Mesa uses a different pixel format.
+                format = SDL_PIXELFORMAT_ABGR8888;
+            }
+#endif  // CONFIG_ANDROID
+        }
+    }
+
+    /* Keep streaming into the same texture while the surface's size and
+     * format don't change */
     if (old_surface && scon->texture) {
-        SDL_DestroyTexture(scon->texture);
-        scon->texture = NULL;
+        Uint32 tex_format;
+        int tex_w, tex_h;
+
+        if (!new_surface ||
+            SDL_QueryTexture(scon->texture, &tex_format, NULL,
+                             &tex_w, &tex_h) != 0 ||
+            tex_format != format || tex_w != surface_width(new_surface) ||
+            tex_h != surface_height(new_surface)) {
+            SDL_DestroyTexture(scon->texture);
+            scon->texture = NULL;
+        }
     }
 
     if (new_surface) {
         if (!scon->texture) {
-            if (surface_bits_per_pixel(scon->surface) == 16) {
-                format = SDL_PIXELFORMAT_RGB565;
-            } else if (surface_bits_per_pixel(scon->surface) == 32) {
-                format = SDL_PIXELFORMAT_ARGB8888;
-#ifdef CONFIG_ANDROID
-                if (android_gpu_started && !android_gpu_use_subwindow) {
-                    // Mesa uses a different pixel format.
-                    format = SDL_PIXELFORMAT_ABGR8888;
-                }
-#endif  // CONFIG_ANDROID
-            }
-
             scon->texture = SDL_CreateTexture(scon->real_renderer, format,
                                               SDL_TEXTUREACCESS_STREAMING,
                                               surface_width(new_surface),
                                               surface_height(new_surface));
         }
+        scon->dirty = true;
     }
 }
 
@@ -876,7 +976,6 @@ static void handle_mousewheel(SDL_Event *ev)
 
 static void handle_windowevent(DisplayChangeListener *dcl, SDL_Event *ev)
 {
-    int w, h;
     struct sdl2_state *scon = get_scon_from_window(ev->key.windowID);
 
     if (!scon) {
@@ -897,8 +996,9 @@ static void handle_windowevent(DisplayChangeListener *dcl, SDL_Event *ev)
         graphic_hw_update(scon->dcl.con);
         break;
     case SDL_WINDOWEVENT_EXPOSED:
-        SDL_GetWindowSize(SDL_GetWindowFromID(ev->window.windowID), &w, &h);
-        sdl_update(dcl, 0, 0, w, h);
+        /* The texture is up to date, it only needs to be shown again */
+        scon->dirty = true;
+        sdl_present(scon, true);
         break;
     case SDL_WINDOWEVENT_FOCUS_GAINED:
     case SDL_WINDOWEVENT_ENTER:
@@ -947,6 +1047,7 @@ static void sdl_refresh(DisplayChangeListener *dcl)
     }
 
     graphic_hw_update(dcl->con);
+    sdl_present(scon, false);
 
     while (SDL_PollEvent(ev)) {
         switch (ev->type) {
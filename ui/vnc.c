@@ -44,6 +44,9 @@ static const struct timeval VNC_REFRESH_STATS = { 0, 500000 };
 static const struct timeval VNC_REFRESH_LOSSY = { 2, 0 };
 
 #include "vnc_keysym.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "d3des.h"
 
 static VncDisplay *vnc_display; /* needed for info vnc */
@@ -2683,6 +2686,32 @@ static void vnc_rect_updated(VncDisplay *vd, int x, int y, struct timeval * tv)
     rect->updated = true;
 }
 
+/* Whether a dirty chunk of the guest surface differs from the server's */
+static inline bool vnc_chunk_changed(const uint8_t *server,
+                                     const uint8_t *guest, int len)
+{
+#ifdef __SSE2__
+    /* Whole chunks are 64 bytes, one cache line: compare them at once */
+    if (len == 64) {
+        const __m128i *s = (const __m128i *)server;
+        const __m128i *g = (const __m128i *)guest;
+        __m128i diff;
+
+        diff = _mm_or_si128(
+            _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(s), _mm_loadu_si128(g)),
+                         _mm_xor_si128(_mm_loadu_si128(s + 1),
+                                       _mm_loadu_si128(g + 1))),
+            _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(s + 2),
+                                       _mm_loadu_si128(g + 2)),
+                         _mm_xor_si128(_mm_loadu_si128(s + 3),
+                                       _mm_loadu_si128(g + 3))));
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(diff,
+                                                _mm_setzero_si128())) != 0xffff;
+    }
+#endif
+    return memcmp(server, guest, len) != 0;
+}
+
 static int vnc_refresh_server_surface(VncDisplay *vd)
 {
     int width = MIN(pixman_image_get_width(vd->guest.fb),
@@ -2752,7 +2781,7 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
             if ((x + 1) * cmp_bytes > min_stride) {
                 _cmp_bytes = min_stride - x * cmp_bytes;
             }
-            if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
+            if (!vnc_chunk_changed(server_ptr, guest_ptr, _cmp_bytes)) {
                 continue;
             }
             memcpy(server_ptr, guest_ptr, _cmp_bytes);
@@ -3168,6 +3197,17 @@ void vnc_display_open(DisplayState *ds, const char *display, Error **errp)
 #endif
         } else if (strncmp(options, "non-adaptive", 12) == 0) {
             vs->non_adaptive = true;
+        } else if (strncmp(options, "workers=", 8) == 0) {
+            char *end;
+            long workers = strtol(options + 8, &end, 10);
+
+            if (end == options + 8 || (*end && *end != ',') ||
+                workers < 1 || workers > VNC_MAX_WORKERS) {
+                error_setg(errp, "vnc workers= must be between 1 and %d",
+                           VNC_MAX_WORKERS);
+                goto fail;
+            }
+            vnc_set_worker_threads(workers);
         } else if (strncmp(options, "share=", 6) == 0) {
             if (strncmp(options+6, "ignore", 6) == 0) {
                 vs->share_policy = VNC_SHARE_POLICY_IGNORE;
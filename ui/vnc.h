@@ -163,6 +163,7 @@ struct VncDisplay
     kbd_layout_t *kbd_layout;
     int lock_key_sync;
     QemuMutex mutex;
+    int encoders;           /* workers sharing the lock, under mutex */
 
     QEMUCursor *cursor;
     int cursor_msize;
@@ -247,6 +248,7 @@ struct VncRectEntry
 struct VncJob
 {
     VncState *vs;
+    bool running;           /* a worker is encoding it */
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
@@ -105,11 +105,112 @@ static const uint32_t crc32c_table[256] = {
 };
 
 
-uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+static uint32_t crc32c_generic(uint32_t crc, const uint8_t *data,
+                               unsigned int length)
 {
     while (length--) {
         crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
     }
-    return crc^0xffffffff;
+    return crc;
+}
+
+/*
+ * The CRC32 instructions of SSE 4.2 and of ARMv8 use the Castagnoli
+ * polynomial, so they do the same as a table lookup for 1, 4 or 8 bytes.
+ * Only these functions are built for the extension, and they are used when
+ * the host has it.
+ */
+#if defined(CONFIG_SSE42_OPT) && defined(CONFIG_CPUID_H)
+#include <cpuid.h>
+#include <nmmintrin.h>
+
+static uint32_t __attribute__((target("sse4.2")))
+crc32c_sse42(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+
+    for (; length >= 8; length -= 8, data += 8) {
+        uint64_t v;
+
+        memcpy(&v, data, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+    }
+    crc = crc64;
+#endif
+    for (; length >= 4; length -= 4, data += 4) {
+        uint32_t v;
+
+        memcpy(&v, data, 4);
+        crc = _mm_crc32_u32(crc, v);
+    }
+    while (length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+
+static bool crc32c_hw_usable(void)
+{
+    unsigned a, b, c, d;
+
+    return __get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSE4_2);
+}
+
+#define crc32c_hw crc32c_sse42
+#elif defined(CONFIG_ARM_CRC_OPT) && defined(CONFIG_LINUX)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+
+static uint32_t __attribute__((target("+crc")))
+crc32c_armv8(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    for (; length >= 8; length -= 8, data += 8) {
+        uint64_t v;
+
+        memcpy(&v, data, 8);
+        crc = __crc32cd(crc, v);
+    }
+    for (; length >= 4; length -= 4, data += 4) {
+        uint32_t v;
+
+        memcpy(&v, data, 4);
+        crc = __crc32cw(crc, v);
+    }
+    while (length--) {
+        crc = __crc32cb(crc, *data++);
+    }
+    return crc;
+}
+
+static bool crc32c_hw_usable(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+#define crc32c_hw crc32c_armv8
+#endif
+
+#ifdef crc32c_hw
+static uint32_t (*crc32c_fn)(uint32_t, const uint8_t *, unsigned int) =
+    crc32c_generic;
+
+static void __attribute__((constructor)) init_crc32c(void)
+{
+    if (crc32c_hw_usable()) {
+        crc32c_fn = crc32c_hw;
+    }
+}
+#else
+#define crc32c_fn crc32c_generic
+#endif
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    return crc32c_fn(crc, data, length) ^ 0xffffffff;
 }
 
@@ -178,33 +178,87 @@ uint64_t hbitmap_count(const HBitmap *hb)
     return hb->count << hb->granularity;
 }
 
+static uint64_t hb_count_words_generic(const unsigned long *words, size_t n)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        count += ctpopl(words[i]);
+    }
+    return count;
+}
+
+#if defined(CONFIG_CPUID_H) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+
+/*
+ * The same, built to use the POPCNT instruction instead of the bit tricks
+ * of the baseline ISA.  Four independent sums let the instructions of
+ * consecutive words run in parallel.
+ */
+static uint64_t __attribute__((target("popcnt")))
+hb_count_words_popcnt(const unsigned long *words, size_t n)
+{
+    uint64_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        c0 += __builtin_popcountl(words[i]);
+        c1 += __builtin_popcountl(words[i + 1]);
+        c2 += __builtin_popcountl(words[i + 2]);
+        c3 += __builtin_popcountl(words[i + 3]);
+    }
+    for (; i < n; i++) {
+        c0 += __builtin_popcountl(words[i]);
+    }
+    return c0 + c1 + c2 + c3;
+}
+
+static uint64_t (*hb_count_words)(const unsigned long *, size_t) =
+    hb_count_words_generic;
+
+static void __attribute__((constructor)) init_hb_count_words(void)
+{
+    unsigned a, b, c, d;
+
+    if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_POPCNT)) {
+        hb_count_words = hb_count_words_popcnt;
+    }
+}
+#else
+#define hb_count_words hb_count_words_generic
+#endif
+
 /* Count the number of set bits between start and end, not accounting for
- * the granularity.  Also an example of how to use hbitmap_iter_next_word.
+ * the granularity.  Words of the last level are counted in bulk; groups
+ * of BITS_PER_LONG words that are all zero are skipped by looking at the
+ * level above.
  */
 static uint64_t hb_count_between(HBitmap *hb, uint64_t start, uint64_t last)
 {
-    HBitmapIter hbi;
-    uint64_t count = 0;
-    uint64_t end = last + 1;
-    unsigned long cur;
-    size_t pos;
+    const unsigned long *words = hb->levels[HBITMAP_LEVELS - 1];
+    const unsigned long *upper = hb->levels[HBITMAP_LEVELS - 2];
+    size_t pos = start >> BITS_PER_LEVEL;
+    size_t lastpos = last >> BITS_PER_LEVEL;
+    unsigned long first_mask = ~0UL << (start & (BITS_PER_LONG - 1));
+    unsigned long last_mask = ~0UL >> (BITS_PER_LONG - 1 -
+                                       (last & (BITS_PER_LONG - 1)));
+    uint64_t count;
 
-    hbitmap_iter_init(&hbi, hb, start << hb->granularity);
-    for (;;) {
-        pos = hbitmap_iter_next_word(&hbi, &cur);
-        if (pos >= (end >> BITS_PER_LEVEL)) {
-            break;
-        }
-        count += ctpopl(cur);
+    if (pos == lastpos) {
+        return ctpopl(words[pos] & first_mask & last_mask);
     }
 
-    if (pos == (end >> BITS_PER_LEVEL)) {
-        /* Drop bits representing the END-th and subsequent items.  */
-        int bit = end & (BITS_PER_LONG - 1);
-        cur &= (1UL << bit) - 1;
-        count += ctpopl(cur);
-    }
+    count = ctpopl(words[pos] & first_mask) + ctpopl(words[lastpos] & last_mask);
+    for (pos++; pos < lastpos; ) {
+        size_t next = MIN((pos | (BITS_PER_LONG - 1)) + 1, lastpos);
 
+        if (upper[pos >> BITS_PER_LEVEL]) {
+            count += hb_count_words(words + pos, next - pos);
+        }
+        pos = next;
+    }
     return count;
 }
 
@@ -238,15 +292,18 @@ static void hb_set_between(HBitmap *hb, int level, uint64_t start, uint64_t last
     if (i < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
         changed |= hb_set_elem(&hb->levels[level][i], start, next - 1);
-        for (;;) {
-            start = next;
-            next += BITS_PER_LONG;
-            if (++i == lastpos) {
-                break;
-            }
-            changed |= (hb->levels[level][i] == 0);
-            hb->levels[level][i] = ~0UL;
+
+        /* The words in between are filled in bulk.  Rather than checking
+         * which of them were zero, always update the level above; it is
+         * BITS_PER_LONG times smaller.
+         */
+        if (++i < lastpos) {
+            memset(&hb->levels[level][i], 0xff,
+                   (lastpos - i) * sizeof(unsigned long));
+            changed = true;
+            i = lastpos;
         }
+        start = (uint64_t)lastpos << BITS_PER_LEVEL;
     }
     changed |= hb_set_elem(&hb->levels[level][i], start, last);
 
@@ -315,15 +372,16 @@ static void hb_reset_between(HBitmap *hb, int level, uint64_t start, uint64_t la
             pos++;
         }
 
-        for (;;) {
-            start = next;
-            next += BITS_PER_LONG;
-            if (++i == lastpos) {
-                break;
-            }
-            changed |= (hb->levels[level][i] != 0);
-            hb->levels[level][i] = 0UL;
+        /* Same as when setting, the words in between are cleared in bulk
+         * and the level above always updated.
+         */
+        if (++i < lastpos) {
+            memset(&hb->levels[level][i], 0,
+                   (lastpos - i) * sizeof(unsigned long));
+            changed = true;
+            i = lastpos;
         }
+        start = (uint64_t)lastpos << BITS_PER_LEVEL;
     }
 
     /* Same as above, this time for lastpos.  */
@@ -362,6 +420,39 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
 }
 
+bool hbitmap_merge(HBitmap *a, const HBitmap *b)
+{
+    size_t size = a->size;
+    unsigned long *dst;
+    const unsigned long *src;
+    size_t i, n;
+    int level;
+
+    if (a->size != b->size || a->granularity != b->granularity) {
+        return false;
+    }
+    if (hbitmap_empty(b)) {
+        return true;
+    }
+
+    /* A word of a level is nonzero in the result iff it is in either
+     * bitmap, so every level is simply or-ed.  This includes the sentinel
+     * in level 0, which both bitmaps have.
+     */
+    for (level = HBITMAP_LEVELS; level-- > 0; ) {
+        n = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+        dst = a->levels[level];
+        src = b->levels[level];
+        for (i = 0; i < n; i++) {
+            dst[i] |= src[i];
+        }
+        size = n;
+    }
+
+    a->count = hb_count_between(a, 0, a->size - 1);
+    return true;
+}
+
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
@@ -0,0 +1,109 @@
+/*
+ * Input to display latency
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/input-latency.h"
+#include "qemu/atomic.h"
+#include "qemu/metrics.h"
+#include "qemu/thread.h"
+
+static const int64_t input_latency_bounds[] = {
+    1000000, 2500000, 5000000, 10000000, 16000000, 25000000, 33000000,
+    50000000, 75000000, 100000000, 150000000, 250000000, 500000000,
+    1000000000,
+};
+
+static const char *const input_latency_display_names[] = {
+    [INPUT_LATENCY_FB] = "fb",
+    [INPUT_LATENCY_GPU] = "gpu",
+};
+
+static struct {
+    QemuMutex lock;
+    bool ready;
+    /* Oldest input read by the guest and not shown yet, 0 if none */
+    int64_t input_ns;
+    int64_t consumed_ns;
+    MetricHistogram *queue;
+    MetricHistogram *display[INPUT_LATENCY_DISPLAY_MAX];
+} input_latency;
+
+static void __attribute__((__constructor__)) input_latency_lock_init(void)
+{
+    qemu_mutex_init(&input_latency.lock);
+}
+
+void input_latency_init(void)
+{
+    int i;
+
+    qemu_mutex_lock(&input_latency.lock);
+    if (input_latency.ready) {
+        qemu_mutex_unlock(&input_latency.lock);
+        return;
+    }
+    input_latency.queue =
+        metric_histogram_new("qemu_input_queue_seconds",
+                             "Time from host input to the guest reading it",
+                             NULL, input_latency_bounds,
+                             ARRAY_SIZE(input_latency_bounds), 1e-9);
+    for (i = 0; i < INPUT_LATENCY_DISPLAY_MAX; i++) {
+        char *labels = metrics_labels("display",
+                                      input_latency_display_names[i], NULL);
+
+        input_latency.display[i] =
+            metric_histogram_new("qemu_input_display_seconds",
+                                 "Time from host input to the next frame "
+                                 "shown after the guest read it",
+                                 labels, input_latency_bounds,
+                                 ARRAY_SIZE(input_latency_bounds), 1e-9);
+        g_free(labels);
+    }
+    qemu_mutex_unlock(&input_latency.lock);
+    atomic_mb_set(&input_latency.ready, true);
+}
+
+void input_latency_consumed(int64_t input_ns, int64_t now_ns)
+{
+    if (!atomic_mb_read(&input_latency.ready)) {
+        return;
+    }
+    metric_histogram_observe(input_latency.queue, now_ns - input_ns);
+
+    qemu_mutex_lock(&input_latency.lock);
+    if (!input_latency.input_ns) {
+        input_latency.input_ns = input_ns;
+        input_latency.consumed_ns = now_ns;
+    }
+    qemu_mutex_unlock(&input_latency.lock);
+}
+
+void input_latency_frame(InputLatencyDisplay display, int64_t frame_ns,
+                         int64_t now_ns)
+{
+    int64_t input_ns;
+
+    /* Called for every frame, skip the lock while there's nothing to do */
+    if (!atomic_mb_read(&input_latency.ready) ||
+        !atomic_read(&input_latency.input_ns)) {
+        return;
+    }
+
+    qemu_mutex_lock(&input_latency.lock);
+    input_ns = input_latency.input_ns;
+    /* A frame produced before the guest read the input can't show it */
+    if (!input_ns || frame_ns < input_latency.consumed_ns) {
+        qemu_mutex_unlock(&input_latency.lock);
+        return;
+    }
+    input_latency.input_ns = 0;
+    qemu_mutex_unlock(&input_latency.lock);
+
+    metric_histogram_observe(input_latency.display[display],
+                             now_ns - input_ns);
+}
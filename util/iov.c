@@ -105,31 +105,37 @@ do_send_recv(int sockfd, struct iovec *iov, unsigned iov_cnt, bool do_send)
     } while (ret < 0 && errno == EINTR);
     return ret;
 #else
-    /* else send piece-by-piece */
-    /*XXX Note: windows has WSASend() and WSARecv() */
-    unsigned i = 0;
-    ssize_t ret = 0;
-    while (i < iov_cnt) {
-        ssize_t r = do_send
-            ? send(sockfd, iov[i].iov_base, iov[i].iov_len, 0)
-            : recv(sockfd, iov[i].iov_base, iov[i].iov_len, 0);
-        if (r > 0) {
-            ret += r;
-        } else if (!r) {
-            break;
-        } else if (errno == EINTR) {
-            continue;
-        } else {
-            /* else it is some "other" error,
-             * only return if there was no data processed. */
-            if (ret == 0) {
-                ret = -1;
-            }
-            break;
+    /* struct iovec and WSABUF don't have the same layout */
+    WSABUF stack_bufs[16];
+    WSABUF *bufs = stack_bufs;
+    DWORD bytes = 0, flags = 0;
+    unsigned i;
+    int err;
+
+    if (iov_cnt > ARRAY_SIZE(stack_bufs)) {
+        bufs = g_new(WSABUF, iov_cnt);
+    }
+    for (i = 0; i < iov_cnt; i++) {
+        bufs[i].buf = iov[i].iov_base;
+        bufs[i].len = iov[i].iov_len;
+    }
+    do {
+        err = do_send
+            ? WSASend(sockfd, bufs, iov_cnt, &bytes, 0, NULL, NULL)
+            : WSARecv(sockfd, bufs, iov_cnt, &bytes, &flags, NULL, NULL);
+        if (err != 0) {
+            err = WSAGetLastError();
         }
-        i++;
+    } while (err == WSAEINTR);
+    if (bufs != stack_bufs) {
+        g_free(bufs);
     }
-    return ret;
+    if (err != 0) {
+        /* iov_send_recv() expects errno to be set the POSIX way */
+        errno = err == WSAEWOULDBLOCK ? EAGAIN : err;
+        return -1;
+    }
+    return bytes;
 #endif
 }
 
@@ -0,0 +1,180 @@
+/*
+ * OpenMetrics endpoint over HTTP
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/metrics.h"
+#include "qemu/error-report.h"
+#include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+
+/*
+ * A thread of its own answers GET /metrics requests, one connection at a
+ * time, so that scrapers neither wait for nor slow down the main loop.
+ * Every reply closes the connection.
+ */
+#define METRICS_REQUEST_MAX     8192
+
+#define METRICS_CONTENT_TYPE \
+    "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+typedef struct MetricsServer {
+    QemuThread thread;
+    int listen_fd;
+    MetricCounter *requests;
+    MetricHistogram *render_time;
+} MetricsServer;
+
+static MetricsServer *metrics_server;
+
+/* From 100us to 1s, in nanoseconds */
+static const int64_t metrics_render_bounds[] = {
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 25000000,
+    50000000, 100000000, 250000000, 500000000, 1000000000,
+};
+
+static void metrics_server_send(int fd, const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t ret = send(fd, buf, len, 0);
+
+        if (ret < 0) {
+            if (socket_error() == EINTR) {
+                continue;
+            }
+            return;
+        }
+        buf += ret;
+        len -= ret;
+    }
+}
+
+static void metrics_server_reply(int fd, const char *status, const char *type,
+                                 const char *body, bool head)
+{
+    size_t len = strlen(body);
+    char *header;
+
+    header = g_strdup_printf("HTTP/1.0 %s\r\n"
+                             "Content-Type: %s\r\n"
+                             "Content-Length: %zu\r\n"
+                             "Connection: close\r\n"
+                             "\r\n", status, type, len);
+    metrics_server_send(fd, header, strlen(header));
+    if (!head) {
+        metrics_server_send(fd, body, len);
+    }
+    g_free(header);
+}
+
+static void metrics_server_handle(MetricsServer *ms, int fd)
+{
+    char buf[METRICS_REQUEST_MAX + 1];
+    char *path, *end, *body;
+    size_t len = 0;
+    int64_t start;
+    bool head;
+
+    /* Read up to the end of the headers; requests have no body */
+    while (len < METRICS_REQUEST_MAX) {
+        ssize_t ret = qemu_recv(fd, buf + len, METRICS_REQUEST_MAX - len, 0);
+
+        if (ret < 0 && socket_error() == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return;
+        }
+        len += ret;
+        buf[len] = '\0';
+        if (strstr(buf, "\r\n\r\n") || strstr(buf, "\n\n")) {
+            break;
+        }
+    }
+    buf[len] = '\0';
+
+    head = !strncmp(buf, "HEAD ", 5);
+    if (!head && strncmp(buf, "GET ", 4)) {
+        metrics_server_reply(fd, "405 Method Not Allowed", "text/plain",
+                             "Only GET is supported\n", false);
+        return;
+    }
+    path = buf + (head ? 5 : 4);
+    end = path + strcspn(path, " ?\r\n");
+    *end = '\0';
+    if (strcmp(path, "/metrics") && strcmp(path, "/")) {
+        metrics_server_reply(fd, "404 Not Found", "text/plain",
+                             "The metrics are at /metrics\n", head);
+        return;
+    }
+
+    start = get_clock();
+    body = metrics_render();
+    metric_histogram_observe(ms->render_time, get_clock() - start);
+    metric_counter_add(ms->requests, 1);
+    metrics_server_reply(fd, "200 OK", METRICS_CONTENT_TYPE, body, head);
+    g_free(body);
+}
+
+static void *metrics_server_run(void *opaque)
+{
+    MetricsServer *ms = opaque;
+    int fd;
+
+    for (;;) {
+        fd = qemu_accept(ms->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (socket_error() == EINTR || socket_error() == ECONNABORTED) {
+                continue;
+            }
+            error_report("metrics: accept failed: %s",
+                         strerror(socket_error()));
+            break;
+        }
+        metrics_server_handle(ms, fd);
+        closesocket(fd);
+    }
+    return NULL;
+}
+
+int metrics_server_init(const char *address, Error **errp)
+{
+    SocketAddress *addr;
+    MetricsServer *ms;
+    int fd;
+
+    if (metrics_server) {
+        error_setg(errp, "The metrics are already served");
+        return -1;
+    }
+    addr = socket_parse(address, errp);
+    if (!addr) {
+        return -1;
+    }
+    fd = socket_listen_addr(addr, errp);
+    qapi_free_SocketAddress(addr);
+    if (fd < 0) {
+        return -1;
+    }
+    qemu_set_block(fd);
+
+    ms = g_new0(MetricsServer, 1);
+    ms->listen_fd = fd;
+    ms->requests = metric_counter_new("qemu_metrics_requests",
+                                      "Requests for the metrics", NULL);
+    ms->render_time = metric_histogram_new("qemu_metrics_render_seconds",
+                                           "Time taken to gather the metrics",
+                                           NULL, metrics_render_bounds,
+                                           ARRAY_SIZE(metrics_render_bounds),
+                                           1e-9);
+    metrics_server = ms;
+    qemu_thread_create(&ms->thread, "metrics", metrics_server_run, ms,
+                       QEMU_THREAD_DETACHED);
+    return 0;
+}
@@ -0,0 +1,433 @@
+/*
+ * Registry of performance metrics, exported in the OpenMetrics format
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <math.h>
+#include "qemu/metrics.h"
+#include "qemu/atomic.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+
+/*
+ * Counters and histograms have one shard per thread, for up to
+ * METRIC_SHARDS threads; later threads share the shards round-robin.
+ */
+#define METRIC_SHARDS       8
+#define METRIC_SHARD_ALIGN  64
+
+struct MetricsCollector {
+    MetricsCollectFunc *func;
+    void *opaque;
+    QTAILQ_ENTRY(MetricsCollector) next;
+};
+
+typedef struct MetricsFamily {
+    char *name;
+    MetricType type;
+    const char *help;
+    GString *samples;
+} MetricsFamily;
+
+/* The families written by the collectors, to output them in one piece */
+struct MetricsWriter {
+    GHashTable *families;
+    GPtrArray *order;
+};
+
+typedef struct MetricShard {
+    int64_t value;
+} __attribute__((aligned(METRIC_SHARD_ALIGN))) MetricShard;
+
+struct MetricCounter {
+    MetricShard shards[METRIC_SHARDS];
+    char *name;
+    char *help;
+    char *labels;
+    MetricsCollector *collector;
+};
+
+struct MetricHistogram {
+    char *name;
+    char *help;
+    char *labels;
+    int64_t *bounds;
+    unsigned int nbounds;
+    double scale;
+    /* each shard has the nbounds + 1 counts and then the sum */
+    size_t stride;
+    int64_t *shards;
+    MetricsCollector *collector;
+};
+
+static QemuMutex metrics_lock;
+static QTAILQ_HEAD(, MetricsCollector) metrics_collectors =
+    QTAILQ_HEAD_INITIALIZER(metrics_collectors);
+
+static unsigned int metrics_next_shard;
+static __thread unsigned int metrics_shard;     /* 1 + shard, 0 if unset */
+
+static void __attribute__((__constructor__)) metrics_init(void)
+{
+    qemu_mutex_init(&metrics_lock);
+}
+
+static inline unsigned int metrics_thread_shard(void)
+{
+    if (unlikely(!metrics_shard)) {
+        metrics_shard = atomic_fetch_inc(&metrics_next_shard) %
+                        METRIC_SHARDS + 1;
+    }
+    return metrics_shard - 1;
+}
+
+/* Not atomic_read(), which may tear 64-bit values on 32-bit hosts */
+static inline int64_t metrics_read(int64_t *p)
+{
+    return atomic_fetch_add(p, 0);
+}
+
+MetricsCollector *metrics_collector_add(MetricsCollectFunc *func,
+                                        void *opaque)
+{
+    MetricsCollector *c = g_new0(MetricsCollector, 1);
+
+    c->func = func;
+    c->opaque = opaque;
+    qemu_mutex_lock(&metrics_lock);
+    QTAILQ_INSERT_TAIL(&metrics_collectors, c, next);
+    qemu_mutex_unlock(&metrics_lock);
+    return c;
+}
+
+void metrics_collector_remove(MetricsCollector *c)
+{
+    if (!c) {
+        return;
+    }
+    qemu_mutex_lock(&metrics_lock);
+    QTAILQ_REMOVE(&metrics_collectors, c, next);
+    qemu_mutex_unlock(&metrics_lock);
+    g_free(c);
+}
+
+/* Append @str with backslashes, newlines and double quotes escaped */
+static void metrics_escape(GString *s, const char *str)
+{
+    for (; *str; str++) {
+        switch (*str) {
+        case '\\':
+            g_string_append(s, "\\\\");
+            break;
+        case '\n':
+            g_string_append(s, "\\n");
+            break;
+        case '"':
+            g_string_append(s, "\\\"");
+            break;
+        default:
+            g_string_append_c(s, *str);
+        }
+    }
+}
+
+char *metrics_labels(const char *key, const char *value, ...)
+{
+    GString *s = g_string_new(NULL);
+    va_list ap;
+
+    va_start(ap, value);
+    while (key) {
+        g_string_append_printf(s, "%s%s=\"", s->len ? "," : "", key);
+        metrics_escape(s, value);
+        g_string_append_c(s, '"');
+        key = va_arg(ap, const char *);
+        if (key) {
+            value = va_arg(ap, const char *);
+        }
+    }
+    va_end(ap);
+    return g_string_free(s, false);
+}
+
+void metrics_family(MetricsWriter *w, const char *name, MetricType type,
+                    const char *help)
+{
+    MetricsFamily *f = g_hash_table_lookup(w->families, name);
+
+    if (f) {
+        assert(f->type == type);
+        return;
+    }
+    f = g_new0(MetricsFamily, 1);
+    f->name = g_strdup(name);
+    f->type = type;
+    f->help = help;
+    f->samples = g_string_new(NULL);
+    g_hash_table_insert(w->families, f->name, f);
+    g_ptr_array_add(w->order, f);
+}
+
+static MetricsFamily *metrics_find_family(MetricsWriter *w, const char *name)
+{
+    MetricsFamily *f = g_hash_table_lookup(w->families, name);
+
+    /* metrics_family() must be called first */
+    assert(f);
+    return f;
+}
+
+static void metrics_format(char *buf, size_t size, double value)
+{
+    if (isinf(value)) {
+        snprintf(buf, size, "%sInf", value < 0 ? "-" : "+");
+    } else {
+        g_ascii_formatd(buf, size, "%.15g", value);
+    }
+}
+
+static void metrics_append(MetricsFamily *f, const char *suffix,
+                           const char *labels, const char *le,
+                           const char *value)
+{
+    GString *s = f->samples;
+    bool has_labels = labels && *labels;
+
+    g_string_append(s, f->name);
+    g_string_append(s, suffix);
+    if (has_labels || le) {
+        g_string_append_c(s, '{');
+        if (has_labels) {
+            g_string_append(s, labels);
+        }
+        if (le) {
+            g_string_append_printf(s, "%sle=\"%s\"", has_labels ? "," : "",
+                                   le);
+        }
+        g_string_append_c(s, '}');
+    }
+    g_string_append_printf(s, " %s\n", value);
+}
+
+void metrics_sample(MetricsWriter *w, const char *name, const char *labels,
+                    double value)
+{
+    MetricsFamily *f = metrics_find_family(w, name);
+    char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+    assert(f->type != METRIC_HISTOGRAM);
+    metrics_format(buf, sizeof(buf), value);
+    metrics_append(f, f->type == METRIC_COUNTER ? "_total" : "", labels,
+                   NULL, buf);
+}
+
+void metrics_sample_int(MetricsWriter *w, const char *name,
+                        const char *labels, int64_t value)
+{
+    MetricsFamily *f = metrics_find_family(w, name);
+    char buf[32];
+
+    assert(f->type != METRIC_HISTOGRAM);
+    snprintf(buf, sizeof(buf), "%" PRId64, value);
+    metrics_append(f, f->type == METRIC_COUNTER ? "_total" : "", labels,
+                   NULL, buf);
+}
+
+void metrics_histogram(MetricsWriter *w, const char *name, const char *labels,
+                       const double *bounds, const uint64_t *counts,
+                       unsigned int nbounds, double sum)
+{
+    MetricsFamily *f = metrics_find_family(w, name);
+    char le[G_ASCII_DTOSTR_BUF_SIZE], buf[G_ASCII_DTOSTR_BUF_SIZE];
+    uint64_t total = 0;
+    unsigned int i;
+
+    assert(f->type == METRIC_HISTOGRAM);
+    for (i = 0; i <= nbounds; i++) {
+        total += counts[i];
+        metrics_format(le, sizeof(le), i < nbounds ? bounds[i] : INFINITY);
+        snprintf(buf, sizeof(buf), "%" PRIu64, total);
+        metrics_append(f, "_bucket", labels, le, buf);
+    }
+    snprintf(buf, sizeof(buf), "%" PRIu64, total);
+    metrics_append(f, "_count", labels, NULL, buf);
+    if (sum >= 0) {
+        metrics_format(buf, sizeof(buf), sum);
+        metrics_append(f, "_sum", labels, NULL, buf);
+    }
+}
+
+char *metrics_render(void)
+{
+    static const char * const type_names[] = {
+        [METRIC_COUNTER] = "counter",
+        [METRIC_GAUGE] = "gauge",
+        [METRIC_HISTOGRAM] = "histogram",
+    };
+    MetricsWriter w;
+    MetricsCollector *c;
+    GString *out = g_string_new(NULL);
+    guint i;
+
+    w.families = g_hash_table_new(g_str_hash, g_str_equal);
+    w.order = g_ptr_array_new();
+    qemu_mutex_lock(&metrics_lock);
+    QTAILQ_FOREACH(c, &metrics_collectors, next) {
+        c->func(&w, c->opaque);
+    }
+
+    /* The help strings belong to the collectors, output them now */
+    for (i = 0; i < w.order->len; i++) {
+        MetricsFamily *f = g_ptr_array_index(w.order, i);
+
+        g_string_append_printf(out, "# TYPE %s %s\n", f->name,
+                               type_names[f->type]);
+        if (f->help) {
+            g_string_append_printf(out, "# HELP %s ", f->name);
+            metrics_escape(out, f->help);
+            g_string_append_c(out, '\n');
+        }
+        g_string_append_len(out, f->samples->str, f->samples->len);
+        g_string_free(f->samples, true);
+        g_free(f->name);
+        g_free(f);
+    }
+    qemu_mutex_unlock(&metrics_lock);
+
+    g_ptr_array_free(w.order, true);
+    g_hash_table_destroy(w.families);
+    g_string_append(out, "# EOF\n");
+    return g_string_free(out, false);
+}
+
+static void metric_counter_collect(MetricsWriter *w, void *opaque)
+{
+    MetricCounter *c = opaque;
+    int64_t value = 0;
+    int i;
+
+    for (i = 0; i < METRIC_SHARDS; i++) {
+        value += metrics_read(&c->shards[i].value);
+    }
+    metrics_family(w, c->name, METRIC_COUNTER, c->help);
+    metrics_sample_int(w, c->name, c->labels, value);
+}
+
+MetricCounter *metric_counter_new(const char *name, const char *help,
+                                  const char *labels)
+{
+    MetricCounter *c = qemu_memalign(METRIC_SHARD_ALIGN, sizeof(*c));
+
+    memset(c, 0, sizeof(*c));
+    c->name = g_strdup(name);
+    c->help = g_strdup(help);
+    c->labels = g_strdup(labels);
+    c->collector = metrics_collector_add(metric_counter_collect, c);
+    return c;
+}
+
+void metric_counter_free(MetricCounter *c)
+{
+    if (!c) {
+        return;
+    }
+    metrics_collector_remove(c->collector);
+    g_free(c->name);
+    g_free(c->help);
+    g_free(c->labels);
+    qemu_vfree(c);
+}
+
+void metric_counter_add(MetricCounter *c, int64_t n)
+{
+    atomic_add(&c->shards[metrics_thread_shard()].value, n);
+}
+
+static void metric_histogram_collect(MetricsWriter *w, void *opaque)
+{
+    MetricHistogram *h = opaque;
+    uint64_t counts[h->nbounds + 1];
+    double bounds[h->nbounds];
+    int64_t sum = 0;
+    unsigned int i, j;
+
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < METRIC_SHARDS; i++) {
+        int64_t *shard = h->shards + i * h->stride;
+
+        for (j = 0; j <= h->nbounds; j++) {
+            counts[j] += metrics_read(&shard[j]);
+        }
+        sum += metrics_read(&shard[h->nbounds + 1]);
+    }
+    for (j = 0; j < h->nbounds; j++) {
+        bounds[j] = h->bounds[j] * h->scale;
+    }
+    metrics_family(w, h->name, METRIC_HISTOGRAM, h->help);
+    metrics_histogram(w, h->name, h->labels, bounds, counts, h->nbounds,
+                      sum * h->scale);
+}
+
+MetricHistogram *metric_histogram_new(const char *name, const char *help,
+                                      const char *labels,
+                                      const int64_t *bounds,
+                                      unsigned int nbounds, double scale)
+{
+    MetricHistogram *h = g_new0(MetricHistogram, 1);
+    size_t size;
+    unsigned int i;
+
+    for (i = 1; i < nbounds; i++) {
+        assert(bounds[i] > bounds[i - 1]);
+    }
+    h->name = g_strdup(name);
+    h->help = g_strdup(help);
+    h->labels = g_strdup(labels);
+    h->bounds = g_memdup(bounds, nbounds * sizeof(*bounds));
+    h->nbounds = nbounds;
+    h->scale = scale;
+    h->stride = QEMU_ALIGN_UP((nbounds + 2) * sizeof(int64_t),
+                              METRIC_SHARD_ALIGN) / sizeof(int64_t);
+    size = METRIC_SHARDS * h->stride * sizeof(int64_t);
+    h->shards = qemu_memalign(METRIC_SHARD_ALIGN, size);
+    memset(h->shards, 0, size);
+    h->collector = metrics_collector_add(metric_histogram_collect, h);
+    return h;
+}
+
+void metric_histogram_free(MetricHistogram *h)
+{
+    if (!h) {
+        return;
+    }
+    metrics_collector_remove(h->collector);
+    g_free(h->name);
+    g_free(h->help);
+    g_free(h->labels);
+    g_free(h->bounds);
+    qemu_vfree(h->shards);
+    g_free(h);
+}
+
+void metric_histogram_observe(MetricHistogram *h, int64_t value)
+{
+    int64_t *shard = h->shards + metrics_thread_shard() * h->stride;
+    unsigned int lo = 0, hi = h->nbounds;
+
+    /* Find the first bound the value is not above */
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+
+        if (value <= h->bounds[mid]) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    atomic_inc(&shard[lo]);
+    atomic_add(&shard[h->nbounds + 1], value);
+}
@@ -95,9 +95,16 @@ static void module_load(module_init_type type);
 
 void module_call_init(module_init_type type)
 {
+    static bool done[MODULE_INIT_MAX];
     ModuleTypeList *l;
     ModuleEntry *e;
 
+    /* Only once, a launcher may have done it before main() */
+    if (done[type]) {
+        return;
+    }
+    done[type] = true;
+
     module_load(type);
     l = find_type(type);
 
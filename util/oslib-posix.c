@@ -57,6 +57,8 @@ extern int daemon(int, int);
 #include "sysemu/sysemu.h"
 #include "trace.h"
 #include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "qemu/host-utils.h"
 #include <sys/mman.h>
 #include <libgen.h>
 #include <setjmp.h>
@@ -153,6 +155,122 @@ void *qemu_anon_ram_alloc(size_t size, uint64_t *alignment)
     return ptr;
 }
 
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#if defined(__linux__) && defined(MAP_HUGETLB)
+/* The size of the huge pages used by MAP_HUGETLB without a size flag */
+static uint64_t default_hugepagesize(void)
+{
+    uint64_t size = 0;
+    char line[64];
+    FILE *f;
+
+    f = fopen("/proc/meminfo", "r");
+    if (!f) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "Hugepagesize: %" SCNu64 " kB", &size) == 1) {
+            size <<= 10;
+            break;
+        }
+    }
+    fclose(f);
+    return size;
+}
+#endif
+
+void *qemu_anon_ram_alloc_huge(size_t size, uint64_t pagesize,
+                               uint64_t *align)
+{
+#if defined(__linux__) && defined(MAP_HUGETLB)
+    int flags = MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB;
+    void *ptr;
+
+    if (pagesize) {
+        flags |= ctz64(pagesize) << MAP_HUGE_SHIFT;
+    } else {
+        pagesize = default_hugepagesize();
+    }
+    /* munmap() wants whole huge pages */
+    if (!pagesize || size % pagesize) {
+        return NULL;
+    }
+    /* Private hugetlb mappings reserve their pages here, so running out
+     * of them makes the mmap fail instead of the guest later on. */
+    ptr = mmap(0, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+    if (align) {
+        *align = pagesize;
+    }
+    trace_qemu_anon_ram_alloc(size, ptr);
+    return ptr;
+#else
+    return NULL;
+#endif
+}
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+void *qemu_shared_ram_alloc(const char *name, size_t size, uint64_t *align,
+                            int *fd)
+{
+#if defined(__linux__) && defined(__NR_memfd_create)
+    size_t alignment = QEMU_VMALLOC_ALIGN;
+    size_t total = size + alignment - getpagesize();
+    void *area, *ptr;
+    size_t offset;
+    int memfd;
+
+    memfd = syscall(__NR_memfd_create, name, MFD_CLOEXEC);
+    if (memfd < 0) {
+        return NULL;
+    }
+    if (ftruncate(memfd, size) < 0) {
+        close(memfd);
+        return NULL;
+    }
+
+    /* Reserve enough address space to map the file at an aligned address,
+     * as qemu_anon_ram_alloc() does, so that KVM can still use huge pages
+     * for it. */
+    area = mmap(0, total, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (area == MAP_FAILED) {
+        close(memfd);
+        return NULL;
+    }
+    offset = QEMU_ALIGN_UP((uintptr_t)area, alignment) - (uintptr_t)area;
+    ptr = mmap(area + offset, size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_FIXED, memfd, 0);
+    if (ptr == MAP_FAILED) {
+        munmap(area, total);
+        close(memfd);
+        return NULL;
+    }
+    if (offset > 0) {
+        munmap(area, offset);
+    }
+    if (total > offset + size) {
+        munmap(ptr + size, total - offset - size);
+    }
+
+    if (align) {
+        *align = alignment;
+    }
+    *fd = memfd;
+    trace_qemu_anon_ram_alloc(size, ptr);
+    return ptr;
+#else
+    return NULL;
+#endif
+}
+
 void qemu_vfree(void *ptr)
 {
     trace_qemu_vfree(ptr);
@@ -344,13 +462,47 @@ char *qemu_get_exec_dir(void)
     return g_strdup(exec_dir);
 }
 
-static sigjmp_buf sigjump;
+/* Each thread touching pages jumps back to its own buffer on SIGBUS */
+static __thread sigjmp_buf sigjump;
 
 static void sigbus_handler(int signal)
 {
     siglongjmp(sigjump, 1);
 }
 
+#define MEM_PREALLOC_MAX_THREADS    16
+#define MEM_PREALLOC_MIN_CHUNK      (64 << 20)
+
+typedef struct MemPreallocThread {
+    QemuThread thread;
+    char *area;
+    size_t pages;
+    size_t hpagesize;
+    bool failed;
+} MemPreallocThread;
+
+static void *mem_prealloc_thread(void *opaque)
+{
+    MemPreallocThread *t = opaque;
+    sigset_t set;
+    size_t i;
+
+    /* qemu_thread_create() starts threads with all signals blocked */
+    sigemptyset(&set);
+    sigaddset(&set, SIGBUS);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    if (sigsetjmp(sigjump, 1)) {
+        t->failed = true;
+        return NULL;
+    }
+    /* MAP_POPULATE silently ignores failures */
+    for (i = 0; i < t->pages; i++) {
+        memset(t->area + t->hpagesize * i, 0, 1);
+    }
+    return NULL;
+}
+
 static size_t fd_getpagesize(int fd)
 {
 #ifdef CONFIG_LINUX
@@ -371,11 +523,19 @@ static size_t fd_getpagesize(int fd)
     return getpagesize();
 }
 
+/*
+ * Touch every page of @area, splitting the work between up to one thread
+ * per host CPU so that faulting in a large guest does not take seconds.
+ */
 void os_mem_prealloc(int fd, char *area, size_t memory)
 {
-    int ret;
+    int ret, i, nthreads;
     struct sigaction act, oldact;
-    sigset_t set, oldset;
+    MemPreallocThread threads[MEM_PREALLOC_MAX_THREADS];
+    size_t hpagesize = fd_getpagesize(fd);
+    size_t pages, per_thread;
+    bool failed = false;
+    long ncpus;
 
     memset(&act, 0, sizeof(act));
     act.sa_handler = &sigbus_handler;
@@ -387,31 +547,37 @@ void os_mem_prealloc(int fd, char *area, size_t memory)
         exit(1);
     }
 
-    /* unblock SIGBUS */
-    sigemptyset(&set);
-    sigaddset(&set, SIGBUS);
-    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
+    memory = (memory + hpagesize - 1) & -hpagesize;
+    pages = memory / hpagesize;
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = MIN(MAX(ncpus, 1), MEM_PREALLOC_MAX_THREADS);
+    nthreads = MIN(nthreads, MAX(memory / MEM_PREALLOC_MIN_CHUNK, 1));
+    per_thread = DIV_ROUND_UP(pages, nthreads);
+    nthreads = per_thread ? DIV_ROUND_UP(pages, per_thread) : 0;
+
+    for (i = 0; i < nthreads; i++) {
+        threads[i].area = area + hpagesize * per_thread * i;
+        threads[i].pages = MIN(per_thread, pages - per_thread * i);
+        threads[i].hpagesize = hpagesize;
+        threads[i].failed = false;
+        qemu_thread_create(&threads[i].thread, "mem_prealloc",
+                           mem_prealloc_thread, &threads[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < nthreads; i++) {
+        qemu_thread_join(&threads[i].thread);
+        failed |= threads[i].failed;
+    }
 
-    if (sigsetjmp(sigjump, 1)) {
+    if (failed) {
         fprintf(stderr, "os_mem_prealloc: Insufficient free host memory "
                         "pages available to allocate guest RAM\n");
         exit(1);
-    } else {
-        int i;
-        size_t hpagesize = fd_getpagesize(fd);
-
-        /* MAP_POPULATE silently ignores failures */
-        memory = (memory + hpagesize - 1) & -hpagesize;
-        for (i = 0; i < (memory / hpagesize); i++) {
-            memset(area + (hpagesize * i), 0, 1);
-        }
-
-        ret = sigaction(SIGBUS, &oldact, NULL);
-        if (ret) {
-            perror("os_mem_prealloc: failed to reinstall signal handler");
-            exit(1);
-        }
+    }
 
-        pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    ret = sigaction(SIGBUS, &oldact, NULL);
+    if (ret) {
+        perror("os_mem_prealloc: failed to reinstall signal handler");
+        exit(1);
     }
 }
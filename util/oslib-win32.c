@@ -37,6 +37,7 @@
 #include "qemu/main-loop.h"
 #include "trace.h"
 #include "qemu/sockets.h"
+#include "qemu/thread.h"
 
 #ifdef USE_ANDROID_EMU
 #include "android/utils/win32_unicode.h"
@@ -83,6 +84,59 @@ void *qemu_anon_ram_alloc(size_t size, uint64_t *align)
     return ptr;
 }
 
+/* Large pages need the "Lock pages in memory" right to be enabled */
+static bool enable_lock_memory_privilege(void)
+{
+    TOKEN_PRIVILEGES tp;
+    HANDLE token;
+    bool ok;
+
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES, &token)) {
+        return false;
+    }
+    tp.PrivilegeCount = 1;
+    tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    ok = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME,
+                              &tp.Privileges[0].Luid) &&
+         AdjustTokenPrivileges(token, FALSE, &tp, 0, NULL, NULL) &&
+         GetLastError() == ERROR_SUCCESS;
+    CloseHandle(token);
+    return ok;
+}
+
+void *qemu_anon_ram_alloc_huge(size_t size, uint64_t pagesize,
+                               uint64_t *align)
+{
+    static int privilege = -1;
+    size_t large = GetLargePageMinimum();
+    void *ptr;
+
+    if (!large || (pagesize && pagesize != large) || size % large) {
+        return NULL;
+    }
+    if (privilege < 0) {
+        privilege = enable_lock_memory_privilege();
+    }
+    if (!privilege) {
+        return NULL;
+    }
+    ptr = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                       PAGE_READWRITE);
+    if (ptr) {
+        if (align) {
+            *align = large;
+        }
+        trace_qemu_anon_ram_alloc(size, ptr);
+    }
+    return ptr;
+}
+
+void *qemu_shared_ram_alloc(const char *name, size_t size, uint64_t *align,
+                            int *fd)
+{
+    return NULL;
+}
+
 void qemu_vfree(void *ptr)
 {
     trace_qemu_vfree(ptr);
@@ -477,14 +531,55 @@ size_t getpagesize(void)
     return system_info.dwPageSize;
 }
 
+#define MEM_PREALLOC_MAX_THREADS    16
+#define MEM_PREALLOC_MIN_CHUNK      (64 << 20)
+
+typedef struct MemPreallocThread {
+    QemuThread thread;
+    char *area;
+    size_t pages;
+    size_t pagesize;
+} MemPreallocThread;
+
+static void *mem_prealloc_thread(void *opaque)
+{
+    MemPreallocThread *t = opaque;
+    size_t i;
+
+    for (i = 0; i < t->pages; i++) {
+        memset(t->area + t->pagesize * i, 0, 1);
+    }
+    return NULL;
+}
+
+/* Touch every page of @area, with up to one thread per host CPU */
 void os_mem_prealloc(int fd, char *area, size_t memory)
 {
-    int i;
+    MemPreallocThread threads[MEM_PREALLOC_MAX_THREADS];
     size_t pagesize = getpagesize();
+    size_t pages, per_thread;
+    SYSTEM_INFO system_info;
+    int i, nthreads;
 
+    GetSystemInfo(&system_info);
     memory = (memory + pagesize - 1) & -pagesize;
-    for (i = 0; i < memory / pagesize; i++) {
-        memset(area + pagesize * i, 0, 1);
+    pages = memory / pagesize;
+    nthreads = MIN(MAX(system_info.dwNumberOfProcessors, 1),
+                   MEM_PREALLOC_MAX_THREADS);
+    nthreads = MIN(nthreads, MAX(memory / MEM_PREALLOC_MIN_CHUNK, 1));
+    per_thread = DIV_ROUND_UP(pages, nthreads);
+    nthreads = per_thread ? DIV_ROUND_UP(pages, per_thread) : 0;
+
+    for (i = 0; i < nthreads; i++) {
+        threads[i].area = area + pagesize * per_thread * i;
+        threads[i].pages = MIN(per_thread, pages - per_thread * i);
+        threads[i].pagesize = pagesize;
+        qemu_thread_create(&threads[i].thread, "mem_prealloc",
+                           mem_prealloc_thread, &threads[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < nthreads; i++) {
+        qemu_thread_join(&threads[i].thread);
     }
 }
 
@@ -0,0 +1,361 @@
+/*
+ * Resizable hash table with lock-free lookups
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The table is an array of head buckets, each the size of a cache line,
+ * with a chain of extra buckets for when more entries than fit in one
+ * land on it.  The entries of a chain are kept packed at its start.
+ *
+ * Writers change a chain between two increments of the sequence count of
+ * its head bucket, and readers retry a chain whose count changed or was
+ * odd while they walked it, as with QemuSeqLock.  Resizing builds a new
+ * array with everything in it, publishes it, and frees the old one after
+ * a grace period; a reader that didn't find what it looked for in an
+ * array that has been replaced looks again in the new one.
+ */
+
+#include "qemu/qht.h"
+#include "qemu/atomic.h"
+#include "qemu/rcu.h"
+
+#define QHT_BUCKET_ALIGN    64
+
+#define QHT_BUCKET_ENTRIES \
+    ((QHT_BUCKET_ALIGN - sizeof(unsigned) - sizeof(void *)) / \
+     (sizeof(uint32_t) + sizeof(void *)))
+
+/* Grow by doubling once this fraction of the head buckets have chains */
+#define QHT_CHAINED_BUCKETS_DIV 8
+
+typedef struct QHTBucket QHTBucket;
+
+struct QHTBucket {
+    /* only that of the head bucket is used */
+    unsigned sequence;
+    uint32_t hashes[QHT_BUCKET_ENTRIES];
+    void *pointers[QHT_BUCKET_ENTRIES];
+    QHTBucket *next;
+} __attribute__((aligned(QHT_BUCKET_ALIGN)));
+
+struct QHTMap {
+    struct rcu_head rcu;
+    QHTBucket *buckets;
+    size_t n_buckets;
+    size_t n_added_buckets;
+};
+
+static inline size_t qht_elems_to_buckets(size_t n_elems)
+{
+    size_t n = 1;
+
+    while (n * QHT_BUCKET_ENTRIES < n_elems) {
+        n <<= 1;
+    }
+    return n;
+}
+
+static QHTMap *qht_map_create(size_t n_buckets)
+{
+    QHTMap *map = g_new0(QHTMap, 1);
+
+    map->n_buckets = n_buckets;
+    map->buckets = qemu_memalign(QHT_BUCKET_ALIGN,
+                                 n_buckets * sizeof(QHTBucket));
+    memset(map->buckets, 0, n_buckets * sizeof(QHTBucket));
+    return map;
+}
+
+static void qht_map_destroy(QHTMap *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        QHTBucket *b = map->buckets[i].next;
+
+        while (b) {
+            QHTBucket *next = b->next;
+
+            qemu_vfree(b);
+            b = next;
+        }
+    }
+    qemu_vfree(map->buckets);
+    g_free(map);
+}
+
+static inline QHTBucket *qht_map_to_bucket(QHTMap *map, uint32_t hash)
+{
+    return &map->buckets[hash & (map->n_buckets - 1)];
+}
+
+static inline void qht_bucket_write_begin(QHTBucket *head)
+{
+    atomic_set(&head->sequence, head->sequence + 1);
+    smp_wmb();
+}
+
+static inline void qht_bucket_write_end(QHTBucket *head)
+{
+    smp_wmb();
+    atomic_set(&head->sequence, head->sequence + 1);
+}
+
+void qht_init(QHT *ht, size_t n_elems, unsigned int mode)
+{
+    qemu_mutex_init(&ht->lock);
+    ht->mode = mode;
+    ht->map = qht_map_create(qht_elems_to_buckets(n_elems));
+}
+
+void qht_destroy(QHT *ht)
+{
+    qht_map_destroy(ht->map);
+    qemu_mutex_destroy(&ht->lock);
+    memset(ht, 0, sizeof(*ht));
+}
+
+static void *qht_lookup_chain(QHTBucket *head, QHTLookupFunc func,
+                              const void *userp, uint32_t hash)
+{
+    QHTBucket *b = head;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (atomic_read(&b->hashes[i]) == hash) {
+                void *p = atomic_read(&b->pointers[i]);
+
+                if (likely(p) && likely(func(p, userp))) {
+                    return p;
+                }
+            }
+        }
+        b = atomic_rcu_read(&b->next);
+    } while (b);
+    return NULL;
+}
+
+void *qht_lookup(QHT *ht, QHTLookupFunc func, const void *userp,
+                 uint32_t hash)
+{
+    QHTBucket *head;
+    QHTMap *map;
+    unsigned seq;
+    void *p;
+
+    rcu_read_lock();
+    for (;;) {
+        map = atomic_rcu_read(&ht->map);
+        head = qht_map_to_bucket(map, hash);
+        do {
+            seq = atomic_read(&head->sequence) & ~1;
+            smp_rmb();
+            p = qht_lookup_chain(head, func, userp, hash);
+            smp_rmb();
+        } while (unlikely(atomic_read(&head->sequence) != seq));
+        if (likely(p) || likely(map == atomic_read(&ht->map))) {
+            break;
+        }
+    }
+    rcu_read_unlock();
+    return p;
+}
+
+/* Return false if @p is there already, and whether @map needs to grow */
+static bool qht_insert_locked(QHTMap *map, void *p, uint32_t hash,
+                              bool *needs_resize)
+{
+    QHTBucket *head = qht_map_to_bucket(map, hash);
+    QHTBucket *b = head, *prev = NULL;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (!b->pointers[i]) {
+                goto found;
+            }
+            if (b->pointers[i] == p) {
+                return false;
+            }
+        }
+        prev = b;
+        b = b->next;
+    } while (b);
+
+    b = qemu_memalign(QHT_BUCKET_ALIGN, sizeof(*b));
+    memset(b, 0, sizeof(*b));
+    b->hashes[0] = hash;
+    b->pointers[0] = p;
+    qht_bucket_write_begin(head);
+    atomic_rcu_set(&prev->next, b);
+    qht_bucket_write_end(head);
+
+    map->n_added_buckets++;
+    if (map->n_added_buckets > map->n_buckets / QHT_CHAINED_BUCKETS_DIV) {
+        *needs_resize = true;
+    }
+    return true;
+
+found:
+    qht_bucket_write_begin(head);
+    atomic_set(&b->hashes[i], hash);
+    atomic_set(&b->pointers[i], p);
+    qht_bucket_write_end(head);
+    return true;
+}
+
+static void qht_replace_map(QHT *ht, QHTMap *new)
+{
+    QHTMap *old = ht->map;
+
+    atomic_rcu_set(&ht->map, new);
+    call_rcu(old, qht_map_destroy, rcu);
+}
+
+static void qht_do_resize(QHT *ht, size_t n_buckets)
+{
+    QHTMap *old = ht->map;
+    QHTMap *new;
+    bool needs_resize;
+    size_t i;
+    int j;
+
+    if (n_buckets == old->n_buckets) {
+        return;
+    }
+    new = qht_map_create(n_buckets);
+    for (i = 0; i < old->n_buckets; i++) {
+        QHTBucket *b;
+
+        for (b = &old->buckets[i]; b; b = b->next) {
+            for (j = 0; j < QHT_BUCKET_ENTRIES && b->pointers[j]; j++) {
+                qht_insert_locked(new, b->pointers[j], b->hashes[j],
+                                  &needs_resize);
+            }
+        }
+    }
+    qht_replace_map(ht, new);
+}
+
+bool qht_insert(QHT *ht, void *p, uint32_t hash)
+{
+    bool needs_resize = false;
+    bool ret;
+
+    assert(p);
+    qemu_mutex_lock(&ht->lock);
+    ret = qht_insert_locked(ht->map, p, hash, &needs_resize);
+    if (needs_resize && (ht->mode & QHT_MODE_AUTO_RESIZE)) {
+        qht_do_resize(ht, ht->map->n_buckets * 2);
+    }
+    qemu_mutex_unlock(&ht->lock);
+    return ret;
+}
+
+bool qht_remove(QHT *ht, const void *p, uint32_t hash)
+{
+    QHTBucket *head, *b, *found_b = NULL, *last_b = NULL;
+    int i, found_i = 0, last_i = 0;
+
+    qemu_mutex_lock(&ht->lock);
+    head = qht_map_to_bucket(ht->map, hash);
+    for (b = head; b; b = b->next) {
+        for (i = 0; i < QHT_BUCKET_ENTRIES && b->pointers[i]; i++) {
+            if (b->pointers[i] == p) {
+                assert(b->hashes[i] == hash);
+                found_b = b;
+                found_i = i;
+            }
+            last_b = b;
+            last_i = i;
+        }
+    }
+    if (!found_b) {
+        qemu_mutex_unlock(&ht->lock);
+        return false;
+    }
+
+    /* Keep the chain packed by moving its last entry into the hole */
+    qht_bucket_write_begin(head);
+    atomic_set(&found_b->hashes[found_i], last_b->hashes[last_i]);
+    atomic_set(&found_b->pointers[found_i], last_b->pointers[last_i]);
+    atomic_set(&last_b->hashes[last_i], 0);
+    atomic_set(&last_b->pointers[last_i], NULL);
+    qht_bucket_write_end(head);
+    qemu_mutex_unlock(&ht->lock);
+    return true;
+}
+
+void qht_reset(QHT *ht)
+{
+    qht_reset_size(ht, 0);
+}
+
+void qht_reset_size(QHT *ht, size_t n_elems)
+{
+    qemu_mutex_lock(&ht->lock);
+    qht_replace_map(ht, qht_map_create(n_elems ?
+                                       qht_elems_to_buckets(n_elems) :
+                                       ht->map->n_buckets));
+    qemu_mutex_unlock(&ht->lock);
+}
+
+void qht_resize(QHT *ht, size_t n_elems)
+{
+    qemu_mutex_lock(&ht->lock);
+    qht_do_resize(ht, qht_elems_to_buckets(n_elems));
+    qemu_mutex_unlock(&ht->lock);
+}
+
+void qht_iter(QHT *ht, QHTIterFunc func, void *userp)
+{
+    QHTMap *map;
+    size_t i;
+    int j;
+
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    for (i = 0; i < map->n_buckets; i++) {
+        QHTBucket *b;
+
+        for (b = &map->buckets[i]; b; b = b->next) {
+            for (j = 0; j < QHT_BUCKET_ENTRIES && b->pointers[j]; j++) {
+                func(ht, b->pointers[j], b->hashes[j], userp);
+            }
+        }
+    }
+    qemu_mutex_unlock(&ht->lock);
+}
+
+void qht_statistics(QHT *ht, QHTStats *stats)
+{
+    QHTMap *map;
+    size_t i;
+    int j;
+
+    memset(stats, 0, sizeof(*stats));
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    stats->head_buckets = map->n_buckets;
+    for (i = 0; i < map->n_buckets; i++) {
+        QHTBucket *b;
+        size_t chain = 0;
+
+        for (b = &map->buckets[i]; b; b = b->next, chain++) {
+            for (j = 0; j < QHT_BUCKET_ENTRIES && b->pointers[j]; j++) {
+                stats->entries++;
+                if (chain) {
+                    stats->chained_entries++;
+                }
+            }
+        }
+        stats->max_chain = MAX(stats->max_chain, chain - 1);
+    }
+    qemu_mutex_unlock(&ht->lock);
+}
@@ -0,0 +1,215 @@
+/*
+ * Read-copy-update
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+/*
+ * Grace periods are tracked with a global counter. A reader stores the
+ * counter's value in its rcu_reader_data when it enters its outermost
+ * critical section and zero when it leaves. synchronize_rcu() moves the
+ * counter on, then waits until every registered reader either is not
+ * reading or has started reading since, after which nobody can still hold
+ * a pointer that was unpublished before the call.
+ *
+ * With 32-bit longs the counter could wrap around while a reader sleeps
+ * in a critical section, so there it only flips one bit, twice per grace
+ * period, as liburcu does.
+ */
+
+#include <glib.h>
+
+#include "qemu-common.h"
+#include "qemu/rcu.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "qemu/main-loop.h"
+
+#define RCU_GP_LOCKED           (1UL << 0)
+#define RCU_GP_CTR              (1UL << 1)
+
+/* Callbacks queued with fewer than this wait a little for company */
+#define RCU_CALL_MIN_BATCH      16
+
+unsigned long rcu_gp_ctr = RCU_GP_LOCKED;
+
+QemuEvent rcu_gp_event;
+static QemuMutex rcu_gp_lock;
+
+__thread struct rcu_reader_data rcu_reader;
+
+/* Registered readers, protected by rcu_gp_lock */
+typedef QLIST_HEAD(, rcu_reader_data) ThreadList;
+static ThreadList registry = QLIST_HEAD_INITIALIZER(registry);
+
+/* Is this reader still in a critical section begun before the counter
+ * last moved on?
+ */
+static inline bool rcu_gp_ongoing(unsigned long *ctr)
+{
+    unsigned long v = atomic_read(ctr);
+
+    return v && (v != rcu_gp_ctr);
+}
+
+static void wait_for_readers(void)
+{
+    ThreadList qsreaders = QLIST_HEAD_INITIALIZER(qsreaders);
+    struct rcu_reader_data *index, *tmp;
+
+    for (;;) {
+        /* Be woken by any reader leaving while we look at the list */
+        qemu_event_reset(&rcu_gp_event);
+
+        QLIST_FOREACH(index, &registry, node) {
+            atomic_set(&index->waiting, true);
+        }
+
+        /* Order the stores to ->waiting before the loads of ->ctr */
+        smp_mb();
+
+        QLIST_FOREACH_SAFE(index, &registry, node, tmp) {
+            if (!rcu_gp_ongoing(&index->ctr)) {
+                QLIST_REMOVE(index, node);
+                QLIST_INSERT_HEAD(&qsreaders, index, node);
+                atomic_set(&index->waiting, false);
+            }
+        }
+
+        /* Order the loads of ->ctr before whatever the caller frees */
+        smp_mb();
+
+        if (QLIST_EMPTY(&registry)) {
+            break;
+        }
+
+        qemu_event_wait(&rcu_gp_event);
+    }
+
+    /* Everybody has been seen quiescent, put them back */
+    QLIST_FOREACH_SAFE(index, &qsreaders, node, tmp) {
+        QLIST_REMOVE(index, node);
+        QLIST_INSERT_HEAD(&registry, index, node);
+    }
+}
+
+void synchronize_rcu(void)
+{
+    qemu_mutex_lock(&rcu_gp_lock);
+
+    if (!QLIST_EMPTY(&registry)) {
+        /* The full barriers in atomic_mb_set() keep the caller's earlier
+         * stores, which unpublished what it is going to free, before the
+         * counter moves on.
+         */
+        if (sizeof(rcu_gp_ctr) < 8) {
+            atomic_mb_set(&rcu_gp_ctr, rcu_gp_ctr ^ RCU_GP_CTR);
+            wait_for_readers();
+            atomic_mb_set(&rcu_gp_ctr, rcu_gp_ctr ^ RCU_GP_CTR);
+        } else {
+            atomic_mb_set(&rcu_gp_ctr, rcu_gp_ctr + RCU_GP_CTR);
+        }
+
+        wait_for_readers();
+    }
+
+    qemu_mutex_unlock(&rcu_gp_lock);
+}
+
+/* Callbacks queued by call_rcu1(), protected by rcu_call_lock */
+static QemuMutex rcu_call_lock;
+static struct rcu_head *rcu_call_head;
+static struct rcu_head **rcu_call_tail = &rcu_call_head;
+static int rcu_call_count;
+static bool rcu_call_started;
+static QemuEvent rcu_call_ready_event;
+
+static void *call_rcu_thread(void *opaque)
+{
+    rcu_register_thread();
+
+    for (;;) {
+        struct rcu_head *node, *next;
+
+        qemu_event_reset(&rcu_call_ready_event);
+        qemu_mutex_lock(&rcu_call_lock);
+        if (!rcu_call_head) {
+            qemu_mutex_unlock(&rcu_call_lock);
+            qemu_event_wait(&rcu_call_ready_event);
+            continue;
+        }
+        if (rcu_call_count < RCU_CALL_MIN_BATCH) {
+            /* A grace period is expensive, let a few more come in */
+            qemu_mutex_unlock(&rcu_call_lock);
+            g_usleep(10000);
+            qemu_mutex_lock(&rcu_call_lock);
+        }
+        node = rcu_call_head;
+        rcu_call_head = NULL;
+        rcu_call_tail = &rcu_call_head;
+        rcu_call_count = 0;
+        qemu_mutex_unlock(&rcu_call_lock);
+
+        synchronize_rcu();
+
+        qemu_mutex_lock_iothread();
+        for (; node; node = next) {
+            next = node->next;
+            node->func(node);
+        }
+        qemu_mutex_unlock_iothread();
+    }
+    return NULL;
+}
+
+void call_rcu1(struct rcu_head *node, RCUCBFunc *func)
+{
+    node->func = func;
+    node->next = NULL;
+
+    qemu_mutex_lock(&rcu_call_lock);
+    *rcu_call_tail = node;
+    rcu_call_tail = &node->next;
+    rcu_call_count++;
+    /* Started on first use, so that it survives os_daemonize()'s fork */
+    if (!rcu_call_started) {
+        QemuThread thread;
+
+        rcu_call_started = true;
+        qemu_thread_create(&thread, "call_rcu", call_rcu_thread, NULL,
+                           QEMU_THREAD_DETACHED);
+    }
+    qemu_mutex_unlock(&rcu_call_lock);
+
+    qemu_event_set(&rcu_call_ready_event);
+}
+
+void rcu_register_thread(void)
+{
+    assert(rcu_reader.ctr == 0);
+    qemu_mutex_lock(&rcu_gp_lock);
+    QLIST_INSERT_HEAD(&registry, &rcu_reader, node);
+    qemu_mutex_unlock(&rcu_gp_lock);
+}
+
+void rcu_unregister_thread(void)
+{
+    qemu_mutex_lock(&rcu_gp_lock);
+    QLIST_REMOVE(&rcu_reader, node);
+    qemu_mutex_unlock(&rcu_gp_lock);
+}
+
+static void __attribute__((__constructor__)) rcu_init(void)
+{
+    qemu_mutex_init(&rcu_gp_lock);
+    qemu_event_init(&rcu_gp_event, true);
+
+    qemu_mutex_init(&rcu_call_lock);
+    qemu_event_init(&rcu_call_ready_event, false);
+
+    rcu_register_thread();
+}
@@ -0,0 +1,277 @@
+/*
+ * Exit statistics of virtual CPUs run by hardware accelerators
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qom/cpu.h"
+#include "qemu/atomic.h"
+#include "qemu/metrics.h"
+#include "qemu/timer.h"
+#include "qmp-commands.h"
+#include "sysemu/vcpu-exits.h"
+
+/* Bucket N counts the exits handled in less than 4^N microseconds, the
+ * last one counts all slower exits. */
+#define VCPU_EXIT_LATENCY_BUCKETS   8
+
+/*
+ * The frequent addresses are counted in a small open addressing table.
+ * When all the slots probed for a new address are taken, it replaces the
+ * least counted of them and inherits its count ("space saving"), so that
+ * frequent addresses get in whatever the order of accesses, at the price
+ * of overestimating the counts of late comers.
+ */
+#define VCPU_EXIT_ADDRESS_SLOTS     64      /* a power of 2 */
+#define VCPU_EXIT_ADDRESS_PROBES    8
+#define VCPU_EXIT_TOP_ADDRESSES     10
+
+typedef struct VcpuExitAddress {
+    uint64_t address;
+    uint64_t count;
+    bool io;
+} VcpuExitAddress;
+
+typedef struct VcpuExitStats VcpuExitStats;
+
+/* Only written by the vcpu thread; readers may see slightly stale values */
+struct VcpuExitStats {
+    uint64_t count[VCPU_EXIT_REASON_MAX];
+    uint64_t time_ns[VCPU_EXIT_REASON_MAX];
+    uint64_t latency[VCPU_EXIT_REASON_MAX][VCPU_EXIT_LATENCY_BUCKETS];
+    VcpuExitAddress addresses[VCPU_EXIT_ADDRESS_SLOTS];
+    uint64_t halt_polls;
+    uint64_t halt_poll_successes;
+    uint64_t halt_poll_ns;
+};
+
+static int vcpu_exit_metrics_added;
+
+static void vcpu_exit_metrics_collect(MetricsWriter *w, void *opaque);
+
+static VcpuExitStats *vcpu_exit_stats(CPUState *cpu)
+{
+    if (!cpu->exit_stats) {
+        cpu->exit_stats = g_new0(VcpuExitStats, 1);
+        if (!atomic_xchg(&vcpu_exit_metrics_added, 1)) {
+            metrics_collector_add(vcpu_exit_metrics_collect, NULL);
+        }
+    }
+    return cpu->exit_stats;
+}
+
+void vcpu_exit_account(CPUState *cpu, VcpuExitReason reason,
+                       int64_t start_ns)
+{
+    VcpuExitStats *stats = vcpu_exit_stats(cpu);
+    int64_t ns = get_clock() - start_ns;
+    int64_t us = ns / 1000;
+    int bucket = 0;
+
+    while (bucket < VCPU_EXIT_LATENCY_BUCKETS - 1 &&
+           us >= (INT64_C(1) << (2 * bucket))) {
+        bucket++;
+    }
+
+    stats->count[reason]++;
+    stats->time_ns[reason] += ns;
+    stats->latency[reason][bucket]++;
+}
+
+void vcpu_exit_account_address(CPUState *cpu, bool io, uint64_t address)
+{
+    VcpuExitStats *stats = vcpu_exit_stats(cpu);
+    VcpuExitAddress *slot, *victim = NULL;
+    unsigned hash, i;
+
+    hash = ((address ^ io) * 0x9e3779b97f4a7c15ULL) >> 32;
+    for (i = 0; i < VCPU_EXIT_ADDRESS_PROBES; i++) {
+        slot = &stats->addresses[(hash + i) & (VCPU_EXIT_ADDRESS_SLOTS - 1)];
+        if (!slot->count) {
+            slot->address = address;
+            slot->io = io;
+            slot->count = 1;
+            return;
+        }
+        if (slot->address == address && slot->io == io) {
+            slot->count++;
+            return;
+        }
+        if (!victim || slot->count < victim->count) {
+            victim = slot;
+        }
+    }
+
+    victim->address = address;
+    victim->io = io;
+    victim->count++;
+}
+
+void vcpu_exit_account_halt_poll(CPUState *cpu, bool success, int64_t poll_ns)
+{
+    VcpuExitStats *stats = vcpu_exit_stats(cpu);
+
+    stats->halt_polls++;
+    stats->halt_poll_successes += success;
+    stats->halt_poll_ns += poll_ns;
+}
+
+void vcpu_exit_reset(void)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if (cpu->exit_stats) {
+            memset(cpu->exit_stats, 0, sizeof(*cpu->exit_stats));
+        }
+    }
+}
+
+/*
+ * The vcpus are never unplugged and their statistics, once allocated, are
+ * never freed, so they can be read without the BQL.
+ */
+static void vcpu_exit_metrics_collect(MetricsWriter *w, void *opaque)
+{
+    double bounds[VCPU_EXIT_LATENCY_BUCKETS - 1];
+    char cpu_index[16];
+    CPUState *cpu;
+    int reason, i;
+
+    for (i = 0; i < VCPU_EXIT_LATENCY_BUCKETS - 1; i++) {
+        bounds[i] = (INT64_C(1) << (2 * i)) / 1e6;
+    }
+
+    metrics_family(w, "qemu_vcpu_exit_seconds", METRIC_HISTOGRAM,
+                   "Time taken to handle the exits of the vcpus");
+    metrics_family(w, "qemu_vcpu_halt_polls", METRIC_COUNTER,
+                   "Halts during which the vcpu polled");
+    metrics_family(w, "qemu_vcpu_halt_poll_successes", METRIC_COUNTER,
+                   "Halts ended by a wake-up while polling");
+    metrics_family(w, "qemu_vcpu_halt_poll_seconds", METRIC_COUNTER,
+                   "Time spent polling in halts");
+    CPU_FOREACH(cpu) {
+        VcpuExitStats *stats = atomic_read(&cpu->exit_stats);
+        char *labels;
+
+        if (!stats) {
+            continue;
+        }
+        snprintf(cpu_index, sizeof(cpu_index), "%d", cpu->cpu_index);
+        for (reason = 0; reason < VCPU_EXIT_REASON_MAX; reason++) {
+            if (!stats->count[reason]) {
+                continue;
+            }
+            labels = metrics_labels("cpu", cpu_index,
+                                    "reason", VcpuExitReason_lookup[reason],
+                                    NULL);
+            metrics_histogram(w, "qemu_vcpu_exit_seconds", labels, bounds,
+                              stats->latency[reason],
+                              VCPU_EXIT_LATENCY_BUCKETS - 1,
+                              stats->time_ns[reason] / 1e9);
+            g_free(labels);
+        }
+
+        labels = metrics_labels("cpu", cpu_index, NULL);
+        metrics_sample_int(w, "qemu_vcpu_halt_polls", labels,
+                           stats->halt_polls);
+        metrics_sample_int(w, "qemu_vcpu_halt_poll_successes", labels,
+                           stats->halt_poll_successes);
+        metrics_sample(w, "qemu_vcpu_halt_poll_seconds", labels,
+                       stats->halt_poll_ns / 1e9);
+        g_free(labels);
+    }
+}
+
+static int vcpu_exit_address_compare(const void *a, const void *b)
+{
+    const VcpuExitAddress *x = a, *y = b;
+
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+static VcpuExitInfo *vcpu_exit_info(CPUState *cpu)
+{
+    VcpuExitStats *stats = cpu->exit_stats;
+    VcpuExitInfo *info = g_new0(VcpuExitInfo, 1);
+    VcpuExitReasonInfoList **reason_tail = &info->reasons;
+    VcpuExitAddressInfoList **address_tail = &info->top_addresses;
+    VcpuExitAddress top[VCPU_EXIT_ADDRESS_SLOTS];
+    int reason, i, n;
+
+    info->CPU = cpu->cpu_index;
+    info->halt_poll = g_new0(VcpuHaltPollInfo, 1);
+    info->halt_poll->window_ns = cpu->halt_poll_ns;
+    if (!stats) {
+        return info;
+    }
+    info->halt_poll->polls = stats->halt_polls;
+    info->halt_poll->successes = stats->halt_poll_successes;
+    info->halt_poll->time_ns = stats->halt_poll_ns;
+
+    for (reason = 0; reason < VCPU_EXIT_REASON_MAX; reason++) {
+        VcpuExitReasonInfoList *entry;
+        intList **bucket_tail;
+
+        if (!stats->count[reason]) {
+            continue;
+        }
+        entry = g_new0(VcpuExitReasonInfoList, 1);
+        entry->value = g_new0(VcpuExitReasonInfo, 1);
+        entry->value->reason = reason;
+        entry->value->count = stats->count[reason];
+        entry->value->time_ns = stats->time_ns[reason];
+        bucket_tail = &entry->value->latency_histogram;
+        for (i = 0; i < VCPU_EXIT_LATENCY_BUCKETS; i++) {
+            intList *bucket = g_new0(intList, 1);
+            bucket->value = stats->latency[reason][i];
+            *bucket_tail = bucket;
+            bucket_tail = &bucket->next;
+        }
+        *reason_tail = entry;
+        reason_tail = &entry->next;
+    }
+
+    for (i = n = 0; i < VCPU_EXIT_ADDRESS_SLOTS; i++) {
+        if (stats->addresses[i].count) {
+            top[n++] = stats->addresses[i];
+        }
+    }
+    qsort(top, n, sizeof(top[0]), vcpu_exit_address_compare);
+    for (i = 0; i < n && i < VCPU_EXIT_TOP_ADDRESSES; i++) {
+        VcpuExitAddressInfoList *entry = g_new0(VcpuExitAddressInfoList, 1);
+
+        entry->value = g_new0(VcpuExitAddressInfo, 1);
+        entry->value->io = top[i].io;
+        entry->value->address = top[i].address;
+        entry->value->count = top[i].count;
+        *address_tail = entry;
+        address_tail = &entry->next;
+    }
+
+    return info;
+}
+
+VcpuExitInfoList *qmp_query_vcpu_exits(bool has_reset, bool reset,
+                                       Error **errp)
+{
+    VcpuExitInfoList *head = NULL, **tail = &head;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        VcpuExitInfoList *entry = g_new0(VcpuExitInfoList, 1);
+
+        entry->value = vcpu_exit_info(cpu);
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    if (has_reset && reset) {
+        vcpu_exit_reset();
+    }
+    return head;
+}
@@ -0,0 +1,250 @@
+/*
+ * Sampling profiler of the virtual CPUs
+ *
+ * Copyright (c) 2016 The Android Open Source Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "qom/cpu.h"
+#include "qemu/atomic.h"
+#include "qemu/main-loop.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qapi/qmp/qerror.h"
+#include "qmp-commands.h"
+#include "sysemu/hax.h"
+#include "sysemu/hvf.h"
+#include "sysemu/kvm.h"
+#include "sysemu/sysemu.h"
+
+#define VCPU_PROFILE_DEFAULT_RATE   99      /* Hz, out of step with timers */
+#define VCPU_PROFILE_MAX_RATE       1000
+
+/*
+ * A thread looks at every vcpu at a fixed rate and counts the samples by
+ * "stack": the vcpu, what its thread is doing and, when it runs guest
+ * code, the guest PC.  They are written out when the profiler is stopped,
+ * one "vcpu0;guest;0xffffffc0000855a0 <count>" line per stack, which is
+ * the folded format that flame graph tools take.
+ *
+ * TCG vcpus are sampled without stopping them.  The PC is the start of the
+ * translation block being run; when there is none the thread is in QEMU
+ * itself, translating, in a helper, emulating a device or waiting for the
+ * BQL.  KVM and HAX only hand out the registers of a running vcpu when
+ * asked to, so they are synchronized with the BQL held, which briefly
+ * kicks the vcpu out of the guest.
+ */
+typedef struct VcpuProfile {
+    QemuThread thread;
+    QemuSemaphore stop_sem;
+    int64_t period_ns;
+    int64_t start_ns;
+    char *file;
+    FILE *out;
+    /* Only used by the sampling thread until it is joined */
+    GHashTable *stacks;
+    uint64_t samples;
+} VcpuProfile;
+
+static VcpuProfile *vcpu_profile;
+
+static bool vcpu_profile_hw_accel(void)
+{
+#ifdef CONFIG_HAX
+    if (hax_enabled() && hax_ug_platform()) {
+        return true;
+    }
+#endif
+    return kvm_enabled() || hvf_enabled();
+}
+
+static uint64_t vcpu_profile_guest_pc(CPUState *cpu)
+{
+    CPUArchState *env = cpu->env_ptr;
+    target_ulong pc, cs_base;
+    int flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    return pc;
+}
+
+/* Returns what @cpu is doing and, for "guest", sets @pc */
+static const char *vcpu_profile_state(CPUState *cpu, bool hw, uint64_t *pc)
+{
+    const char *state;
+    TranslationBlock *tb;
+
+    if (cpu->stopped || !runstate_is_running()) {
+        return "stopped";
+    }
+    if (cpu->halted) {
+        return "halted";
+    }
+
+    if (!hw) {
+        tb = atomic_read(&cpu->current_tb);
+        if (!tb) {
+            return "qemu";
+        }
+        *pc = tb->pc;
+        return "guest";
+    }
+
+    qemu_mutex_lock_iothread();
+    if (cpu->stopped || cpu->halted) {
+        state = cpu->stopped ? "stopped" : "halted";
+    } else {
+        cpu_synchronize_state(cpu);
+#ifdef CONFIG_HAX
+        if (hax_enabled() && hax_ug_platform()) {
+            hax_cpu_synchronize_state(cpu);
+        }
+#endif
+#ifdef CONFIG_HVF
+        if (hvf_enabled()) {
+            hvf_cpu_synchronize_state(cpu);
+        }
+#endif
+        *pc = vcpu_profile_guest_pc(cpu);
+        state = "guest";
+    }
+    qemu_mutex_unlock_iothread();
+    return state;
+}
+
+static void vcpu_profile_sample(VcpuProfile *prof, CPUState *cpu, bool hw)
+{
+    uint64_t pc = 0;
+    const char *state = vcpu_profile_state(cpu, hw, &pc);
+    char *stack;
+    gpointer count;
+
+    if (!strcmp(state, "guest")) {
+        stack = g_strdup_printf("vcpu%d;%s;0x%" PRIx64, cpu->cpu_index, state,
+                                pc);
+    } else {
+        stack = g_strdup_printf("vcpu%d;%s", cpu->cpu_index, state);
+    }
+
+    /* The table frees @stack if it is already there */
+    count = g_hash_table_lookup(prof->stacks, stack);
+    g_hash_table_insert(prof->stacks, stack,
+                        GSIZE_TO_POINTER(GPOINTER_TO_SIZE(count) + 1));
+    prof->samples++;
+}
+
+static void *vcpu_profile_thread(void *opaque)
+{
+    VcpuProfile *prof = opaque;
+    bool hw = vcpu_profile_hw_accel();
+    int64_t next_ns = get_clock();
+    CPUState *cpu;
+
+    for (;;) {
+        int64_t wait_ns;
+
+        CPU_FOREACH(cpu) {
+            vcpu_profile_sample(prof, cpu, hw);
+        }
+
+        /* Keep the rate when sampling takes a while, without bursts */
+        next_ns += prof->period_ns;
+        wait_ns = next_ns - get_clock();
+        if (wait_ns < 0) {
+            next_ns -= wait_ns;
+            wait_ns = 0;
+        }
+        if (qemu_sem_timedwait(&prof->stop_sem, wait_ns / SCALE_MS) == 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+void qmp_vcpu_profile_start(const char *file, bool has_rate, int64_t rate,
+                            Error **errp)
+{
+    VcpuProfile *prof;
+    FILE *out;
+
+    if (vcpu_profile) {
+        error_setg(errp, "The vcpu profiler is already running");
+        return;
+    }
+    if (!has_rate) {
+        rate = VCPU_PROFILE_DEFAULT_RATE;
+    }
+    if (rate < 1 || rate > VCPU_PROFILE_MAX_RATE) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "rate",
+                  "a number of samples per second between 1 and 1000");
+        return;
+    }
+
+    /* Fail now rather than after the whole run */
+    out = fopen(file, "w");
+    if (!out) {
+        error_setg_file_open(errp, errno, file);
+        return;
+    }
+
+    prof = g_new0(VcpuProfile, 1);
+    prof->period_ns = get_ticks_per_sec() / rate;
+    prof->start_ns = get_clock();
+    prof->file = g_strdup(file);
+    prof->out = out;
+    prof->stacks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                         NULL);
+    qemu_sem_init(&prof->stop_sem, 0);
+    qemu_thread_create(&prof->thread, "vcpu_profile", vcpu_profile_thread,
+                       prof, QEMU_THREAD_JOINABLE);
+    vcpu_profile = prof;
+}
+
+VcpuProfileInfo *qmp_vcpu_profile_stop(Error **errp)
+{
+    VcpuProfile *prof = vcpu_profile;
+    VcpuProfileInfo *info;
+    GHashTableIter iter;
+    gpointer stack, count;
+    int ret = 0;
+
+    if (!prof) {
+        error_setg(errp, "The vcpu profiler is not running");
+        return NULL;
+    }
+    vcpu_profile = NULL;
+
+    /* The thread may be waiting for the BQL to synchronize a vcpu */
+    qemu_sem_post(&prof->stop_sem);
+    qemu_mutex_unlock_iothread();
+    qemu_thread_join(&prof->thread);
+    qemu_mutex_lock_iothread();
+
+    g_hash_table_iter_init(&iter, prof->stacks);
+    while (ret >= 0 && g_hash_table_iter_next(&iter, &stack, &count)) {
+        ret = fprintf(prof->out, "%s %zu\n", (char *)stack,
+                      (size_t)GPOINTER_TO_SIZE(count));
+    }
+    if (fclose(prof->out) || ret < 0) {
+        error_setg_errno(errp, errno, "Could not write the profile to '%s'",
+                         prof->file);
+        info = NULL;
+    } else {
+        info = g_new0(VcpuProfileInfo, 1);
+        info->file = g_strdup(prof->file);
+        info->samples = prof->samples;
+        info->stacks = g_hash_table_size(prof->stacks);
+        info->duration_ns = get_clock() - prof->start_ns;
+    }
+
+    qemu_sem_destroy(&prof->stop_sem);
+    g_hash_table_destroy(prof->stacks);
+    g_free(prof->file);
+    g_free(prof);
+    return info;
+}
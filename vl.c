@@ -65,6 +65,7 @@
 #include "sysemu/char.h"
 #include "qemu/bitmap.h"
 #include "sysemu/blockdev.h"
+#include "block/block_int.h"
 #include "hw/block/block.h"
 #include "migration/block.h"
 #include "sysemu/tpm.h"
@@ -73,12 +74,15 @@
 #include "migration/migration.h"
 #include "sysemu/kvm.h"
 #include "sysemu/hax.h"
+#include "sysemu/whpx.h"
+#include "sysemu/hvf.h"
 #include "qapi/qmp/qjson.h"
 #include "qemu/option.h"
 #include "qemu/config-file.h"
 #include "qemu-options.h"
 #include "qmp-commands.h"
 #include "qemu/main-loop.h"
+#include "qemu/metrics.h"
 #ifdef CONFIG_VIRTFS
 #include "fsdev/qemu-fsdev.h"
 #endif
@@ -94,6 +98,8 @@
 #include "qemu/queue.h"
 #include "sysemu/cpus.h"
 #include "sysemu/arch_init.h"
+#include "sysemu/boot-timeline.h"
+#include "sysemu/thread-affinity.h"
 #include "qemu/osdep.h"
 
 #include "ui/qemu-spice.h"
@@ -131,6 +137,7 @@
 #include "android/globals.h"
 #include "android/help.h"
 #include "android-qemu2-glue/looper-qemu.h"
+#include "android-qemu2-glue/net-android.h"
 #include "android/gps.h"
 #include "android/telephony/modem_driver.h"
 #include "android/hw-control.h"
@@ -189,6 +196,9 @@ const char* keyboard_layout = NULL;
 ram_addr_t ram_size;
 const char *mem_path = NULL;
 int mem_prealloc = 0; /* force preallocation of physical target memory */
+int mem_hugepages = MEM_HUGEPAGES_TRANSPARENT;
+uint64_t mem_hugepage_size;
+int mem_shared; /* back guest RAM with files the renderer can map */
 bool enable_mlock = false;
 int nb_nics;
 NICInfo nd_table[MAX_NICS];
@@ -617,6 +627,9 @@ static QemuOptsList qemu_icount_opts = {
         }, {
             .name = "align",
             .type = QEMU_OPT_BOOL,
+        }, {
+            .name = "sleep",
+            .type = QEMU_OPT_BOOL,
         },
         { /* end of list */ }
     },
@@ -862,6 +875,7 @@ void vm_start(void)
     if (runstate_is_running()) {
         qapi_event_send_stop(&error_abort);
     } else {
+        boot_timeline_mark_once("guest-start");
         cpu_enable_ticks();
         runstate_set(RUN_STATE_RUNNING);
         vm_state_notify(1, RUN_STATE_RUNNING);
@@ -1268,6 +1282,208 @@ static int drive_enable_snapshot(QemuOpts *opts, void *opaque)
     return 0;
 }
 
+#ifdef CONFIG_ANDROID
+/* VM snapshots need every writable drive to support snapshots, so open
+ * writable raw images through a qcow2 overlay named after them. The
+ * overlay is recreated when the image changed behind its back, e.g. on
+ * -wipe-data, together with the snapshots it holds. */
+static int drive_add_snapshot_overlay(QemuOpts *opts, void *opaque)
+{
+    const char *file = qemu_opt_get(opts, "file");
+    const char *format = qemu_opt_get(opts, "format");
+    struct stat base_st, overlay_st;
+    Error *local_err = NULL;
+    char *overlay;
+
+    if (!file || qemu_opt_get_bool(opts, "read-only", false) ||
+        (format && strcmp(format, "raw") != 0) ||
+        stat(file, &base_st) < 0) {
+        return 0;
+    }
+
+    overlay = g_strdup_printf("%s.qcow2", file);
+    if (stat(overlay, &overlay_st) < 0 ||
+        overlay_st.st_mtime < base_st.st_mtime) {
+        unlink(overlay);
+        bdrv_img_create(overlay, "qcow2", file, "raw", NULL, -1, 0,
+                        &local_err, true);
+        if (local_err) {
+            error_report("Could not create snapshot overlay for '%s': %s",
+                         file, error_get_pretty(local_err));
+            error_free(local_err);
+            g_free(overlay);
+            return 0;
+        }
+    }
+    qemu_opt_set(opts, "file", overlay);
+    qemu_opt_set(opts, "format", "qcow2");
+    g_free(overlay);
+    return 0;
+}
+
+/* A drive given an overlay-base is a qcow2 overlay on top of that raw
+ * image, created here if missing. Partitions started from a pristine
+ * image thus need no copy of it, and the image is shared read-only
+ * between instances. */
+static int drive_create_overlay(QemuOpts *opts, void *opaque)
+{
+    const char *file = qemu_opt_get(opts, "file");
+    char *base = g_strdup(qemu_opt_get(opts, "overlay-base"));
+    Error *local_err = NULL;
+    int ret = 0;
+
+    if (!base) {
+        return 0;
+    }
+    qemu_opt_unset(opts, "overlay-base");
+
+    if (file && access(file, F_OK) < 0) {
+        bdrv_img_create(file, "qcow2", base, "raw", NULL, -1, 0,
+                        &local_err, true);
+        if (local_err) {
+            error_report("Could not create overlay '%s' of '%s': %s",
+                         file, base, error_get_pretty(local_err));
+            error_free(local_err);
+            ret = -1;
+        }
+    }
+    g_free(base);
+    return ret;
+}
+
+/* A drive given a min-size smaller than that is grown to it: a raw image
+ * is extended sparsely, a qcow2 one only gets the metadata for the new
+ * size. Growing the file system on it is left to the guest. When resuming
+ * from a snapshot, the guest expects the drive it had, so it is left alone.
+ */
+static int drive_grow(QemuOpts *opts, void *opaque)
+{
+    const char *file = qemu_opt_get(opts, "file");
+    const char *format = qemu_opt_get(opts, "format");
+    const char *min_size = qemu_opt_get(opts, "min-size");
+    bool *enabled = opaque;
+    BlockDriverState *bs = NULL;
+    BlockDriver *drv = NULL;
+    Error *local_err = NULL;
+    int64_t size, len;
+    char *end;
+    int ret;
+
+    if (!min_size) {
+        return 0;
+    }
+    size = strtosz_suffix(min_size, &end, STRTOSZ_DEFSUFFIX_B);
+    if (size < 0 || *end) {
+        error_report("invalid min-size '%s'", min_size);
+        return -1;
+    }
+    if (!*enabled || !file) {
+        goto out;
+    }
+    if (format) {
+        drv = bdrv_find_format(format);
+    }
+
+    ret = bdrv_open(&bs, file, NULL, NULL, BDRV_O_RDWR, drv, &local_err);
+    if (ret < 0) {
+        error_report("warning: could not grow '%s': %s", file,
+                     error_get_pretty(local_err));
+        error_free(local_err);
+        goto out;
+    }
+    len = bdrv_getlength(bs);
+    if (len >= 0 && len < size) {
+        ret = bdrv_truncate(bs, size);
+        if (ret < 0) {
+            error_report("warning: could not grow '%s': %s", file,
+                         strerror(-ret));
+        }
+    }
+    bdrv_unref(bs);
+out:
+    qemu_opt_unset(opts, "min-size");
+    return 0;
+}
+
+/* Drive options naming a file that keeps data of the drive across runs,
+ * taken out of the options and acted upon once the drive is created. */
+typedef struct DriveMap {
+    char *id;
+    char *map;
+} DriveMap;
+
+static int drive_take_map(QemuOpts *opts, const char *name, bool enabled,
+                          GSList **maps)
+{
+    const char *map = qemu_opt_get(opts, name);
+    DriveMap *dm;
+
+    if (!map) {
+        return 0;
+    }
+    if (!qemu_opts_id(opts)) {
+        error_report("%s needs a drive id", name);
+        return -1;
+    }
+    if (enabled) {
+        dm = g_new(DriveMap, 1);
+        dm->id = g_strdup(qemu_opts_id(opts));
+        dm->map = g_strdup(map);
+        *maps = g_slist_append(*maps, dm);
+    }
+    qemu_opt_unset(opts, name);
+    return 0;
+}
+
+static void drive_start_maps(GSList **maps, const char *what,
+                             void (*start)(BlockDriverState *bs,
+                                           const char *map, Error **errp))
+{
+    while (*maps) {
+        DriveMap *dm = (*maps)->data;
+        BlockDriverState *bs = bdrv_find(dm->id);
+        Error *local_err = NULL;
+
+        if (bs) {
+            start(bs, dm->map, &local_err);
+        }
+        if (local_err) {
+            error_report("warning: no %s for drive '%s': %s", what, dm->id,
+                         error_get_pretty(local_err));
+            error_free(local_err);
+        }
+        *maps = g_slist_remove(*maps, dm);
+        g_free(dm->id);
+        g_free(dm->map);
+        g_free(dm);
+    }
+}
+
+/* A drive given a prefetch-map gets what the guest read while booting last
+ * time read ahead of it, and has the map written anew once it booted. When
+ * resuming from a snapshot the guest doesn't boot, so the map is left alone.
+ */
+static GSList *drive_prefetches;
+
+static int drive_take_prefetch_map(QemuOpts *opts, void *opaque)
+{
+    bool *enabled = opaque;
+
+    return drive_take_map(opts, "prefetch-map", *enabled, &drive_prefetches);
+}
+
+/* A drive given a dirty-map keeps track of what was written to it since
+ * its last incremental backup across runs, for drive-backup sync=incremental.
+ * Resuming from a snapshot counts as writing the whole drive.
+ */
+static GSList *drive_dirty_maps;
+
+static int drive_take_dirty_map(QemuOpts *opts, void *opaque)
+{
+    return drive_take_map(opts, "dirty-map", true, &drive_dirty_maps);
+}
+#endif
+
 static bool default_drive(int enable, int snapshot, BlockInterfaceType type,
                           int index, const char *optstr)
 {
@@ -1995,7 +2211,8 @@ static void main_loop(void)
     }
 
     do {
-        nonblocking = !kvm_enabled() && !xen_enabled() && !hax_enabled() && last_io > 0;
+        nonblocking = !kvm_enabled() && !xen_enabled() && !hax_enabled() &&
+                      !whpx_enabled() && !hvf_enabled() && last_io > 0;
 #ifdef CONFIG_PROFILER
         ti = profile_getclock();
 #endif
@@ -2869,6 +3086,49 @@ out:
 
 static int is_opengl_alive = 1;
 
+/* Loading the GLES renderer library, its translators and starting the
+ * renderer take a while but don't depend on the virtual machine, so this
+ * runs on its own thread while the machine is being created.
+ */
+static QemuThread renderer_start_thread;
+static bool renderer_starting;
+static int renderer_start_ret;
+
+static void *renderer_start_fn(void *opaque)
+{
+    renderer_start_ret = android_initOpenglesEmulation() != 0 ||
+                         android_startOpenglesRenderer(
+                                 android_hw->hw_lcd_width,
+                                 android_hw->hw_lcd_height) != 0;
+    if (!renderer_start_ret) {
+        boot_timeline_mark("renderer-start");
+    }
+    return NULL;
+}
+
+static void renderer_start_async(void)
+{
+    renderer_starting = true;
+    qemu_thread_create(&renderer_start_thread, "renderer_start",
+                       renderer_start_fn, NULL, QEMU_THREAD_JOINABLE);
+}
+
+static void renderer_start_wait(void)
+{
+    char tmp[64];
+
+    renderer_starting = false;
+    qemu_thread_join(&renderer_start_thread);
+    if (renderer_start_ret) {
+        is_opengl_alive = 0;
+        return;
+    }
+
+    android_display_use_host_gpu = 1;
+    snprintf(tmp, sizeof(tmp), "%d", 0x20000);
+    boot_property_add("ro.opengles.version", tmp);
+}
+
 static void android_check_for_updates()
 {
     char configPath[MAX_PATH];
@@ -2983,6 +3243,7 @@ int run_qemu_main(int argc, const char **argv)
     int optind;
     const char *optarg;
     const char *loadvm = NULL;
+    const char *savevm_on_exit = NULL;
     MachineClass *machine_class;
     const char *cpu_model;
     const char *vga_model = NULL;
@@ -2990,6 +3251,8 @@ int run_qemu_main(int argc, const char **argv)
     const char *qtest_log = NULL;
     const char *pid_file = NULL;
     const char *incoming = NULL;
+    const char *qmp_thread_address = NULL;
+    const char *metrics_address = NULL;
 #ifdef CONFIG_VNC
     int show_vnc_port = 0;
 #endif
@@ -3011,6 +3274,7 @@ int run_qemu_main(int argc, const char **argv)
     FILE *vmstate_dump_file = NULL;
     Error *main_loop_err = NULL;
 
+    boot_timeline_mark("qemu-main");
     atexit(qemu_run_exit_notifiers);
     error_set_progname(argv[0]);
     qemu_init_exec_dir(argv[0]);
@@ -3458,6 +3722,46 @@ int run_qemu_main(int argc, const char **argv)
             case QEMU_OPTION_mem_prealloc:
                 mem_prealloc = 1;
                 break;
+            case QEMU_OPTION_mem_shared:
+                mem_shared = 1;
+                break;
+            case QEMU_OPTION_mem_hugepages:
+                if (!strcmp(optarg, "transparent")) {
+                    mem_hugepages = MEM_HUGEPAGES_TRANSPARENT;
+                } else if (!strcmp(optarg, "off")) {
+                    mem_hugepages = MEM_HUGEPAGES_OFF;
+                } else if (!strcmp(optarg, "on")) {
+                    mem_hugepages = MEM_HUGEPAGES_EXPLICIT;
+                    mem_hugepage_size = 0;
+                } else {
+                    char *end;
+                    int64_t sz = strtosz(optarg, &end);
+
+                    if (sz <= 0 || *end || !is_power_of_2(sz)) {
+                        error_report("invalid -mem-hugepages value: %s",
+                                     optarg);
+                        exit(1);
+                    }
+                    mem_hugepages = MEM_HUGEPAGES_EXPLICIT;
+                    mem_hugepage_size = sz;
+                }
+                break;
+            case QEMU_OPTION_vcpu_affinity:
+            case QEMU_OPTION_io_affinity:
+                {
+                    Error *err = NULL;
+
+                    if (popt->index == QEMU_OPTION_vcpu_affinity) {
+                        thread_affinity_set_vcpus(optarg, &err);
+                    } else {
+                        thread_affinity_set_io(optarg, &err);
+                    }
+                    if (err) {
+                        error_report("%s", error_get_pretty(err));
+                        exit(1);
+                    }
+                }
+                break;
             case QEMU_OPTION_d:
                 log_mask = optarg;
                 break;
@@ -3550,6 +3854,12 @@ int run_qemu_main(int argc, const char **argv)
                 }
                 default_monitor = 0;
                 break;
+            case QEMU_OPTION_qmp_thread:
+                qmp_thread_address = optarg;
+                break;
+            case QEMU_OPTION_metrics:
+                metrics_address = optarg;
+                break;
             case QEMU_OPTION_mon:
                 opts = qemu_opts_parse(qemu_find_opts("mon"), optarg, 1);
                 if (!opts) {
@@ -4107,6 +4417,12 @@ int run_qemu_main(int argc, const char **argv)
             case QEMU_OPTION_list_webcam:
               android_list_web_cameras();
               return 0;
+            case QEMU_OPTION_savevm_on_exit:
+                savevm_on_exit = optarg;
+                break;
+            case QEMU_OPTION_snapshot_ram_base:
+                ram_set_snapshot_base(optarg);
+                break;
 
 #ifdef USE_ANDROID_EMU
             case QEMU_OPTION_http_proxy:
@@ -4115,6 +4431,13 @@ int run_qemu_main(int argc, const char **argv)
             case QEMU_OPTION_android_hw:
                 android_hw_file = optarg;
                 break;
+            case QEMU_OPTION_netprofile:
+                if (android_parse_network_profile(optarg) < 0) {
+                    fprintf(stderr, "invalid -netprofile parameter '%s'\n",
+                            optarg);
+                    return 1;
+                }
+                break;
 #endif  // USE_ANDROID_EMU
 #endif  // CONFIG_ANDROID
             default:
@@ -4127,6 +4450,9 @@ int run_qemu_main(int argc, const char **argv)
 
     os_daemonize();
 
+    /* Before the threads that should inherit it are created */
+    thread_affinity_apply_io();
+
     if (qemu_init_main_loop(&main_loop_err)) {
         error_report("%s", error_get_pretty(main_loop_err));
         return 1;
@@ -4205,19 +4531,15 @@ int run_qemu_main(int argc, const char **argv)
      *
      * The GL ES renderer cannot start properly if GPU emulation is disabled
      * because this requires changing the LD_LIBRARY_PATH before launching
-     * the emulation engine. */
+     * the emulation engine.
+     *
+     * When using emugl, the property is only set once the renderer has
+     * started, see renderer_start_wait(). */
     int qemu_gles = 0;
     is_opengl_alive = 1;
     if (android_hw->hw_gpu_enabled) {
         if (strcmp(android_hw->hw_gpu_mode, "guest") != 0) {
-            if (android_initOpenglesEmulation() != 0 ||
-                android_startOpenglesRenderer(android_hw->hw_lcd_width,
-                                              android_hw->hw_lcd_height) != 0) {
-                is_opengl_alive = 0;
-            } else {
-                android_display_use_host_gpu = 1;
-                qemu_gles = 1;   // Using emugl
-            }
+            renderer_start_async();
         } else {
             qemu_gles = 2;   // Using guest
         }
@@ -4283,6 +4605,7 @@ int run_qemu_main(int argc, const char **argv)
         qemu_net_upload_speed = 0;
         qemu_net_min_latency = 0;
         qemu_net_max_latency = 0;
+        android_clear_network_profiles();
     }
 
     int dns_count = 0;
@@ -4699,8 +5022,10 @@ int run_qemu_main(int argc, const char **argv)
 
     cpu_ticks_init();
     if (icount_opts) {
-        if (kvm_enabled() || xen_enabled() || hax_enabled()) {
-            fprintf(stderr, "-icount is not allowed with kvm or xen or hax\n");
+        if (kvm_enabled() || xen_enabled() || hax_enabled() ||
+            whpx_enabled() || hvf_enabled()) {
+            fprintf(stderr, "-icount is not allowed with kvm or xen or hax "
+                    "or whpx or hvf\n");
             return 1;
         }
         configure_icount(icount_opts, &error_abort);
@@ -4743,12 +5068,43 @@ int run_qemu_main(int argc, const char **argv)
     }
 
     /* open the virtual block devices */
+#ifdef CONFIG_ANDROID
+    if (qemu_opts_foreach(qemu_find_opts("drive"), drive_create_overlay,
+                          NULL, 1) != 0) {
+        return 1;
+    }
+    {
+        bool booting = !loadvm;
+
+        if (qemu_opts_foreach(qemu_find_opts("drive"), drive_grow,
+                              &booting, 1) != 0) {
+            return 1;
+        }
+        if (qemu_opts_foreach(qemu_find_opts("drive"),
+                              drive_take_prefetch_map, &booting, 1) != 0) {
+            return 1;
+        }
+        if (qemu_opts_foreach(qemu_find_opts("drive"),
+                              drive_take_dirty_map, NULL, 1) != 0) {
+            return 1;
+        }
+    }
+#endif
     if (snapshot)
         qemu_opts_foreach(qemu_find_opts("drive"), drive_enable_snapshot, NULL, 0);
+#ifdef CONFIG_ANDROID
+    else if (loadvm || savevm_on_exit)
+        qemu_opts_foreach(qemu_find_opts("drive"), drive_add_snapshot_overlay,
+                          NULL, 0);
+#endif
     if (qemu_opts_foreach(qemu_find_opts("drive"), drive_init_func,
                           &machine_class->block_default_type, 1) != 0) {
         return 1;
     }
+#ifdef CONFIG_ANDROID
+    drive_start_maps(&drive_prefetches, "prefetch", prefetch_start);
+    drive_start_maps(&drive_dirty_maps, "dirty map", dirty_map_start);
+#endif
 
     if (!default_drive(default_cdrom, snapshot,
                        machine_class->block_default_type, 2, CDROM_OPTS)) {
@@ -4814,7 +5170,12 @@ int run_qemu_main(int argc, const char **argv)
     current_machine->cpu_model = cpu_model;
 
     machine_class->init(current_machine);
+    boot_timeline_mark("machine-init");
 #ifdef USE_ANDROID_EMU
+    /* The guest can't use the renderer before it runs */
+    if (renderer_starting) {
+        renderer_start_wait();
+    }
     if (android_init_error_occurred()) {
         // Something went wrong when initializing the virtual machine
         return 1;
@@ -4936,6 +5297,24 @@ int run_qemu_main(int argc, const char **argv)
     if (qemu_opts_foreach(qemu_find_opts("mon"), mon_init_func, NULL, 1) != 0) {
         return 1;
     }
+    if (qmp_thread_address) {
+        Error *err = NULL;
+
+        if (monitor_qmp_thread_init(qmp_thread_address, &err) < 0) {
+            error_report("%s", error_get_pretty(err));
+            error_free(err);
+            return 1;
+        }
+    }
+    if (metrics_address) {
+        Error *err = NULL;
+
+        if (metrics_server_init(metrics_address, &err) < 0) {
+            error_report("%s", error_get_pretty(err));
+            error_free(err);
+            return 1;
+        }
+    }
 
 #ifdef CONFIG_ANDROID
     // Parse the System boot parameters from the command line last,
@@ -4952,9 +5331,25 @@ int run_qemu_main(int argc, const char **argv)
     rom_load_done();
 
     qemu_system_reset(VMRESET_SILENT);
+#ifdef CONFIG_ANDROID
+    /* What android-fast-reset goes back to, before any snapshot is loaded */
+    if (qemu_savevm_initial_state() < 0) {
+        error_report("warning: could not keep the initial device state, "
+                     "fast resets won't reset the emulated services");
+    }
+#endif  // CONFIG_ANDROID
     if (loadvm) {
-        if (load_vmstate(loadvm) < 0) {
+        int64_t start_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        int ret = load_vmstate(loadvm);
+
+        if (ret == -ENOENT) {
+            /* Nothing was loaded, e.g. the first run with -savevm-on-exit */
+            error_report("No snapshot '%s', booting normally", loadvm);
+        } else if (ret < 0) {
             autostart = 0;
+        } else {
+            fprintf(stderr, "Loaded snapshot '%s' in %" PRId64 " ms\n",
+                    loadvm, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_ms);
         }
     }
 
@@ -4993,10 +5388,26 @@ int run_qemu_main(int argc, const char **argv)
         return 1;
     }
 
+    boot_timeline_mark("main-loop");
     main_loop();
 #ifdef USE_ANDROID_EMU
     crashhandler_exitmode("after main_loop");
 #endif
+    if (savevm_on_exit) {
+        int64_t start_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+        /* Stop first so that save_vmstate() doesn't restart the VM */
+        vm_stop(RUN_STATE_SHUTDOWN);
+        if (save_vmstate(savevm_on_exit) == 0) {
+#ifdef USE_ANDROID_EMU
+            /* checked by snaphost_match_configs() on the next -loadvm */
+            snaphost_save_config(savevm_on_exit);
+#endif
+            fprintf(stderr, "Saved snapshot '%s' in %" PRId64 " ms\n",
+                    savevm_on_exit,
+                    qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_ms);
+        }
+    }
     bdrv_close_all();
     pause_all_vcpus();
     res_free();
@@ -3,6 +3,8 @@
 #include "migration/qemu-file.h"
 #include "migration/vmstate.h"
 #include "qemu/bitops.h"
+#include "qemu/bswap.h"
+#include "qemu/thread.h"
 #include "trace.h"
 
 static void vmstate_subsection_save(QEMUFile *f, const VMStateDescription *vmsd,
@@ -68,11 +70,276 @@ static void *vmstate_base_addr(void *opaque, VMStateField *field, bool alloc)
     return base_addr;
 }
 
+/*
+ * Fields are saved and loaded according to a plan, built the first time a
+ * VMStateDescription is used, rather than by interpreting the field list
+ * each time. Runs of fields that are laid out contiguously in memory and
+ * on the wire, such as consecutive uint32_t members or uint8_t buffers,
+ * become a single operation moving all their bytes at once; integers
+ * wider than a byte are byte-swapped in bulk on little endian hosts.
+ *
+ * Only plain fields are merged: single values, static arrays and static
+ * buffers of the integer types. Every other field keeps an operation of
+ * its own, which goes through info->get/put as before. Either way the
+ * wire format is unchanged. Plans are kept for the lifetime of the
+ * process, like the static descriptions they are built from.
+ */
+typedef enum VMStateOpKind {
+    VMSTATE_OP_FIELD,           /* anything else, through info->get/put */
+    VMSTATE_OP_COPY,            /* bytes, copied as they are */
+    VMSTATE_OP_BE16,            /* big endian on the wire */
+    VMSTATE_OP_BE32,
+    VMSTATE_OP_BE64,
+} VMStateOpKind;
+
+typedef struct VMStateOp {
+    VMStateOpKind kind;
+    int version_id;
+    size_t offset;
+    size_t len;                 /* in bytes, for the runs */
+    VMStateField *field;        /* the field, or the first one of the run */
+} VMStateOp;
+
+typedef struct VMStatePlan {
+    int n_ops;
+    VMStateOp ops[];
+} VMStatePlan;
+
+static QemuMutex vmstate_plans_lock;
+static GHashTable *vmstate_plans;
+
+static void __attribute__((__constructor__)) vmstate_plans_init(void)
+{
+    qemu_mutex_init(&vmstate_plans_lock);
+    vmstate_plans = g_hash_table_new(NULL, NULL);
+}
+
+static VMStateOpKind vmstate_field_kind(VMStateField *field)
+{
+    const VMStateInfo *info = field->info;
+    VMStateOpKind kind;
+    size_t width;
+
+    if (field->field_exists ||
+        (field->flags & ~(VMS_SINGLE | VMS_ARRAY | VMS_BUFFER))) {
+        return VMSTATE_OP_FIELD;
+    }
+    if (info == &vmstate_info_buffer) {
+        return VMSTATE_OP_COPY;
+    } else if (info == &vmstate_info_uint8 || info == &vmstate_info_int8) {
+        kind = VMSTATE_OP_COPY;
+        width = 1;
+    } else if (info == &vmstate_info_uint16 || info == &vmstate_info_int16) {
+        kind = VMSTATE_OP_BE16;
+        width = 2;
+    } else if (info == &vmstate_info_uint32 || info == &vmstate_info_int32) {
+        kind = VMSTATE_OP_BE32;
+        width = 4;
+    } else if (info == &vmstate_info_uint64 || info == &vmstate_info_int64) {
+        kind = VMSTATE_OP_BE64;
+        width = 8;
+    } else {
+        return VMSTATE_OP_FIELD;
+    }
+    if (field->size != width) {
+        return VMSTATE_OP_FIELD;
+    }
+#ifdef HOST_WORDS_BIGENDIAN
+    kind = VMSTATE_OP_COPY;
+#endif
+    return kind;
+}
+
+static VMStatePlan *vmstate_plan_build(const VMStateDescription *vmsd)
+{
+    VMStateField *field;
+    VMStatePlan *plan;
+    int n_fields = 0;
+
+    for (field = vmsd->fields; field->name; field++) {
+        n_fields++;
+    }
+    plan = g_malloc0(sizeof(*plan) + n_fields * sizeof(plan->ops[0]));
+
+    for (field = vmsd->fields; field->name; field++) {
+        VMStateOp *prev = plan->n_ops ? &plan->ops[plan->n_ops - 1] : NULL;
+        VMStateOpKind kind = vmstate_field_kind(field);
+        size_t len = 0;
+
+        if (kind != VMSTATE_OP_FIELD) {
+            len = field->size * vmstate_n_elems(NULL, field);
+            if (prev && prev->kind == kind &&
+                prev->version_id == field->version_id &&
+                prev->offset + prev->len == field->offset) {
+                prev->len += len;
+                continue;
+            }
+        }
+        plan->ops[plan->n_ops++] = (VMStateOp) {
+            .kind = kind,
+            .version_id = field->version_id,
+            .offset = field->offset,
+            .len = len,
+            .field = field,
+        };
+    }
+    return plan;
+}
+
+static const VMStatePlan *vmstate_plan(const VMStateDescription *vmsd)
+{
+    VMStatePlan *plan;
+
+    qemu_mutex_lock(&vmstate_plans_lock);
+    plan = g_hash_table_lookup(vmstate_plans, vmsd);
+    if (!plan) {
+        plan = vmstate_plan_build(vmsd);
+        g_hash_table_insert(vmstate_plans, (gpointer)vmsd, plan);
+    }
+    qemu_mutex_unlock(&vmstate_plans_lock);
+    return plan;
+}
+
+static void vmstate_put_be(QEMUFile *f, const VMStateOp *op, void *opaque)
+{
+    const uint8_t *src = opaque + op->offset;
+    uint8_t buf[1024];
+    size_t len = op->len;
+
+    while (len) {
+        size_t chunk = MIN(len, sizeof(buf));
+        size_t i;
+
+        switch (op->kind) {
+        case VMSTATE_OP_BE16:
+            for (i = 0; i < chunk; i += 2) {
+                stw_be_p(buf + i, lduw_he_p(src + i));
+            }
+            break;
+        case VMSTATE_OP_BE32:
+            for (i = 0; i < chunk; i += 4) {
+                stl_be_p(buf + i, ldl_he_p(src + i));
+            }
+            break;
+        case VMSTATE_OP_BE64:
+            for (i = 0; i < chunk; i += 8) {
+                stq_be_p(buf + i, ldq_he_p(src + i));
+            }
+            break;
+        default:
+            abort();
+        }
+        qemu_put_buffer(f, buf, chunk);
+        src += chunk;
+        len -= chunk;
+    }
+}
+
+static void vmstate_get_be(const VMStateOp *op, void *opaque)
+{
+    uint8_t *dst = opaque + op->offset;
+    size_t i;
+
+    switch (op->kind) {
+    case VMSTATE_OP_BE16:
+        for (i = 0; i < op->len; i += 2) {
+            be16_to_cpus((uint16_t *)(dst + i));
+        }
+        break;
+    case VMSTATE_OP_BE32:
+        for (i = 0; i < op->len; i += 4) {
+            be32_to_cpus((uint32_t *)(dst + i));
+        }
+        break;
+    case VMSTATE_OP_BE64:
+        for (i = 0; i < op->len; i += 8) {
+            be64_to_cpus((uint64_t *)(dst + i));
+        }
+        break;
+    default:
+        abort();
+    }
+}
+
+static int vmstate_load_field(QEMUFile *f, const VMStateDescription *vmsd,
+                              VMStateField *field, void *opaque,
+                              int version_id)
+{
+    int ret;
+
+    if ((field->field_exists &&
+         field->field_exists(opaque, version_id)) ||
+        (!field->field_exists &&
+         field->version_id <= version_id)) {
+        void *base_addr = vmstate_base_addr(opaque, field, true);
+        int i, n_elems = vmstate_n_elems(opaque, field);
+        int size = vmstate_size(opaque, field);
+
+        for (i = 0; i < n_elems; i++) {
+            void *addr = base_addr + size * i;
+
+            if (field->flags & VMS_ARRAY_OF_POINTER) {
+                addr = *(void **)addr;
+            }
+            if (field->flags & VMS_STRUCT) {
+                ret = vmstate_load_state(f, field->vmsd, addr,
+                                         field->vmsd->version_id);
+            } else {
+                ret = field->info->get(f, addr, size);
+
+            }
+            if (ret >= 0) {
+                ret = qemu_file_get_error(f);
+            }
+            if (ret < 0) {
+                qemu_file_set_error(f, ret);
+                trace_vmstate_load_field_error(field->name, ret);
+                return ret;
+            }
+        }
+    } else if (field->flags & VMS_MUST_EXIST) {
+        fprintf(stderr, "Input validation failed: %s/%s\n",
+                vmsd->name, field->name);
+        return -1;
+    }
+    return 0;
+}
+
+static void vmstate_save_field(QEMUFile *f, const VMStateDescription *vmsd,
+                               VMStateField *field, void *opaque)
+{
+    if (!field->field_exists ||
+        field->field_exists(opaque, vmsd->version_id)) {
+        void *base_addr = vmstate_base_addr(opaque, field, false);
+        int i, n_elems = vmstate_n_elems(opaque, field);
+        int size = vmstate_size(opaque, field);
+
+        for (i = 0; i < n_elems; i++) {
+            void *addr = base_addr + size * i;
+
+            if (field->flags & VMS_ARRAY_OF_POINTER) {
+                addr = *(void **)addr;
+            }
+            if (field->flags & VMS_STRUCT) {
+                vmstate_save_state(f, field->vmsd, addr);
+            } else {
+                field->info->put(f, addr, size);
+            }
+        }
+    } else {
+        if (field->flags & VMS_MUST_EXIST) {
+            fprintf(stderr, "Output state validation failed: %s/%s\n",
+                    vmsd->name, field->name);
+            assert(!(field->flags & VMS_MUST_EXIST));
+        }
+    }
+}
+
 int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id)
 {
-    VMStateField *field = vmsd->fields;
-    int ret;
+    const VMStatePlan *plan;
+    int i, ret;
 
     if (version_id > vmsd->version_id) {
         return -EINVAL;
@@ -90,43 +357,29 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
             return ret;
         }
     }
-    while (field->name) {
-        if ((field->field_exists &&
-             field->field_exists(opaque, version_id)) ||
-            (!field->field_exists &&
-             field->version_id <= version_id)) {
-            void *base_addr = vmstate_base_addr(opaque, field, true);
-            int i, n_elems = vmstate_n_elems(opaque, field);
-            int size = vmstate_size(opaque, field);
-
-            for (i = 0; i < n_elems; i++) {
-                void *addr = base_addr + size * i;
-
-                if (field->flags & VMS_ARRAY_OF_POINTER) {
-                    addr = *(void **)addr;
-                }
-                if (field->flags & VMS_STRUCT) {
-                    ret = vmstate_load_state(f, field->vmsd, addr,
-                                             field->vmsd->version_id);
-                } else {
-                    ret = field->info->get(f, addr, size);
-
-                }
-                if (ret >= 0) {
-                    ret = qemu_file_get_error(f);
-                }
-                if (ret < 0) {
-                    qemu_file_set_error(f, ret);
-                    trace_vmstate_load_field_error(field->name, ret);
-                    return ret;
-                }
+    plan = vmstate_plan(vmsd);
+    for (i = 0; i < plan->n_ops; i++) {
+        const VMStateOp *op = &plan->ops[i];
+
+        if (op->kind == VMSTATE_OP_FIELD) {
+            ret = vmstate_load_field(f, vmsd, op->field, opaque, version_id);
+            if (ret) {
+                return ret;
             }
-        } else if (field->flags & VMS_MUST_EXIST) {
-            fprintf(stderr, "Input validation failed: %s/%s\n",
-                    vmsd->name, field->name);
-            return -1;
+            continue;
+        }
+        if (op->version_id > version_id) {
+            continue;
+        }
+        qemu_get_buffer(f, opaque + op->offset, op->len);
+        ret = qemu_file_get_error(f);
+        if (ret < 0) {
+            trace_vmstate_load_field_error(op->field->name, ret);
+            return ret;
+        }
+        if (op->kind != VMSTATE_OP_COPY) {
+            vmstate_get_be(op, opaque);
         }
-        field++;
     }
     ret = vmstate_subsection_load(f, vmsd, opaque);
     if (ret != 0) {
@@ -141,38 +394,26 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
 void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                         void *opaque)
 {
-    VMStateField *field = vmsd->fields;
+    const VMStatePlan *plan = vmstate_plan(vmsd);
+    int i;
 
     if (vmsd->pre_save) {
         vmsd->pre_save(opaque);
     }
-    while (field->name) {
-        if (!field->field_exists ||
-            field->field_exists(opaque, vmsd->version_id)) {
-            void *base_addr = vmstate_base_addr(opaque, field, false);
-            int i, n_elems = vmstate_n_elems(opaque, field);
-            int size = vmstate_size(opaque, field);
-
-            for (i = 0; i < n_elems; i++) {
-                void *addr = base_addr + size * i;
-
-                if (field->flags & VMS_ARRAY_OF_POINTER) {
-                    addr = *(void **)addr;
-                }
-                if (field->flags & VMS_STRUCT) {
-                    vmstate_save_state(f, field->vmsd, addr);
-                } else {
-                    field->info->put(f, addr, size);
-                }
-            }
-        } else {
-            if (field->flags & VMS_MUST_EXIST) {
-                fprintf(stderr, "Output state validation failed: %s/%s\n",
-                        vmsd->name, field->name);
-                assert(!(field->flags & VMS_MUST_EXIST));
-            }
+    for (i = 0; i < plan->n_ops; i++) {
+        const VMStateOp *op = &plan->ops[i];
+
+        switch (op->kind) {
+        case VMSTATE_OP_FIELD:
+            vmstate_save_field(f, vmsd, op->field, opaque);
+            break;
+        case VMSTATE_OP_COPY:
+            qemu_put_buffer(f, opaque + op->offset, op->len);
+            break;
+        default:
+            vmstate_put_be(f, op, opaque);
+            break;
         }
-        field++;
     }
     vmstate_subsection_save(f, vmsd, opaque);
 }